@@ -28,6 +28,8 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "config.h"
 #ifdef BUILD_PROXY
@@ -38,7 +40,7 @@
 
 #define DEVICE_INFO_MAX_LENGTH 2048
 #define NUM_OF_DEVICE_ID 32
-#define NUM_OPTIONS 6
+#define NUM_OPTIONS 11
 
 #define ERRNO_EXIT(filename) do { \
     printf("IO error on file %s: %s\n", filename, strerror(errno)); \
@@ -52,6 +54,27 @@ unsigned opencl_device_id = 0;
 int list_devices = 0;
 int list_devices_only = 0;
 char *build_options = NULL;
+char *manifest_file = NULL;
+unsigned num_jobs = 0;
+int all_devices = 0;
+
+/* One program of a manifest (-m). */
+typedef struct _poclcc_job {
+  char *source_file;
+  char *output_file;
+  char *build_options;
+  char *specializations;
+} poclcc_job;
+
+typedef struct _poclcc_batch {
+  cl_context context;
+  cl_uint num_devices;
+  cl_device_id *devices;
+  poclcc_job *jobs;
+  unsigned num_jobs;
+  volatile unsigned next_job;
+  volatile unsigned failed;
+} poclcc_batch;
 
 /**********************************************************/
 
@@ -184,6 +207,56 @@ process_list_devices(int arg, char **argv, int argc)
   return 0;
 }
 
+static int
+process_manifest(int arg, char **argv, int argc)
+{
+  if (arg >= argc)
+    return poclcc_error("Incomplete argument for manifest!\n");
+
+  manifest_file = argv[arg];
+  return 0;
+}
+
+static int
+process_jobs(int arg, char **argv, int argc)
+{
+  if (arg >= argc)
+    return poclcc_error("Incomplete argument for jobs!\n");
+
+  num_jobs = atoi(argv[arg]);
+  return 0;
+}
+
+static int
+process_all_devices(int arg, char **argv, int argc)
+{
+  all_devices = 1;
+  return 0;
+}
+
+/* The environment is read when the platform is first initialized, so
+ * these must be set before the first OpenCL call. */
+static int
+process_cache_dir(int arg, char **argv, int argc)
+{
+  if (arg >= argc)
+    return poclcc_error("Incomplete argument for cache directory!\n");
+
+  setenv("POCL_CACHE_DIR", argv[arg], 1);
+  setenv("POCL_KERNEL_CACHE", "1", 1);
+  return 0;
+}
+
+static int
+process_cpu(int arg, char **argv, int argc)
+{
+  if (arg >= argc)
+    return poclcc_error("Incomplete argument for cpu!\n");
+
+  setenv("POCL_LLVM_CPU_NAME", argv[arg], 1);
+  return 0;
+}
+
 /**********************************************************/
 
 static poclcc_option options[NUM_OPTIONS] =
@@ -213,6 +286,35 @@ static poclcc_option options[NUM_OPTIONS] =
   {process_output, "-o",
    "\t-o <file>\n"
    "\t\tWrite output to <file>\n",
+   2},
+  {process_manifest, "-m",
+   "\t-m <manifest>\n"
+   "\t\tBuild all the programs listed in <manifest> instead of one\n"
+   "\t\tkernel program file. Each entry of the manifest is a block of\n"
+   "\t\tkey=value lines ended by an empty line; the keys are\n"
+   "\t\tsource=<file> (required), output=<file> (default <file>.pocl),\n"
+   "\t\toptions=<build options> and specialize=<list> (see\n"
+   "\t\tPOCL_BINARY_SPECIALIZE_WG). Lines starting with # are ignored.\n",
+   2},
+  {process_jobs, "-j",
+   "\t-j <n>\n"
+   "\t\tBuild <n> programs of the manifest in parallel\n"
+   "\t\tDefault: the number of online CPUs\n",
+   2},
+  {process_all_devices, "-a",
+   "\t-a\n"
+   "\t\tBuild for all the devices of <device_type> instead of one; the\n"
+   "\t\tindex of the device is appended to the names of the outputs\n",
+   1},
+  {process_cache_dir, "-c",
+   "\t-c <dir>\n"
+   "\t\tUse <dir> as the kernel cache, e.g. to populate it for\n"
+   "\t\tdeployment\n",
+   2},
+  {process_cpu, "-C",
+   "\t-C <cpu>\n"
+   "\t\tCompile for the LLVM CPU name <cpu> instead of the host CPU on\n"
+   "\t\tthe CPU devices\n",
    2}
 };
 
@@ -247,6 +349,262 @@ process_arg(int *arg, char **argv, int argc)
     }
 }
 
+/**********************************************************
+ * BUILDING */
+
+/* Builds the source for the devices of the context and writes their
+ * poclbinaries to output, or to output.<device index> if there are
+ * several devices. */
+static int
+build_program(cl_context context, cl_uint num_devices,
+              const cl_device_id *devices, const char *source,
+              const char *options, const char *output)
+{
+  cl_program program;
+  cl_int err;
+  cl_uint i;
+  int res = 0;
+
+  program = clCreateProgramWithSource(context, 1, &source, NULL, &err);
+  CHECK_OPENCL_ERROR_IN("clCreateProgramWithSource");
+
+  err = clBuildProgram (program, num_devices, devices, options, NULL, NULL);
+  if (err != CL_SUCCESS)
+    {
+      printf ("Compilation of %s failed\n", output);
+      for (i = 0; i < num_devices; i++)
+        {
+          char build_log[4096];
+          size_t actual_size = 0;
+          err = clGetProgramBuildInfo (program, devices[i],
+                                       CL_PROGRAM_BUILD_LOG, 4095,
+                                       build_log, &actual_size);
+          if (err == CL_SUCCESS)
+            {
+              build_log[actual_size] = 0;
+              printf ("Error log: \n\n%s\n", build_log);
+            }
+        }
+      CHECK_CL_ERROR(clReleaseProgram(program));
+      return 1;
+    }
+
+  size_t *binary_sizes = malloc(sizeof(size_t) * num_devices);
+  char **binaries = calloc(num_devices, sizeof(char *));
+  if (!binary_sizes || !binaries)
+    {
+      printf("malloc(binary) failed\n");
+      exit(1);
+    }
+
+  CHECK_CL_ERROR(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                                  sizeof(size_t) * num_devices, binary_sizes,
+                                  NULL));
+
+  for (i = 0; i < num_devices; i++)
+    {
+      binaries[i] = malloc(sizeof(char) * binary_sizes[i]);
+      if (!binaries[i])
+        {
+          printf("malloc(binary) failed\n");
+          exit(1);
+        }
+    }
+
+  CHECK_CL_ERROR(clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                                  sizeof(unsigned char*) * num_devices,
+                                  binaries, NULL));
+
+  CHECK_CL_ERROR(clReleaseProgram(program));
+
+  for (i = 0; i < num_devices; i++)
+    {
+      char *path = (char *)output;
+      if (num_devices > 1)
+        {
+          path = malloc(strlen(output) + 16);
+          sprintf(path, "%s.%u", output, i);
+        }
+      if (poclu_write_file(path, binaries[i], binary_sizes[i]))
+        {
+          printf("IO error on file %s: %s\n", path, strerror(errno));
+          res = 2;
+        }
+      if (path != output)
+        free(path);
+      free(binaries[i]);
+    }
+
+  free(binaries);
+  free(binary_sizes);
+  return res;
+}
+
+/* Returns the value of the key=value line, or NULL if it has another key. */
+static char *
+manifest_value(char *line, const char *key)
+{
+  size_t len = strlen(key);
+  if (strncmp(line, key, len) != 0 || line[len] != '=')
+    return NULL;
+  return line + len + 1;
+}
+
+static int
+parse_manifest(const char *path, poclcc_job **jobs_ret, unsigned *num_ret)
+{
+  char *content = poclu_read_file(path);
+  if (!content)
+    ERRNO_EXIT(path);
+
+  poclcc_job *jobs = NULL;
+  unsigned num = 0, line_num = 0;
+  int in_entry = 0;
+  char *rest = content;
+  char *line;
+
+  /* a final empty line closes the last entry */
+  while ((line = strsep(&rest, "\n")) != NULL || in_entry)
+    {
+      ++line_num;
+      if (line == NULL || line[0] == 0)
+        {
+          if (in_entry && jobs[num - 1].source_file == NULL)
+            {
+              printf("ERROR: %s:%u: entry without source=\n", path,
+                     line_num);
+              return 1;
+            }
+          in_entry = 0;
+          if (line == NULL)
+            break;
+          continue;
+        }
+      if (line[0] == '#')
+        continue;
+
+      if (!in_entry)
+        {
+          jobs = realloc(jobs, sizeof(poclcc_job) * (num + 1));
+          memset(&jobs[num], 0, sizeof(poclcc_job));
+          ++num;
+          in_entry = 1;
+        }
+      poclcc_job *job = &jobs[num - 1];
+      char *value;
+      if ((value = manifest_value(line, "source")))
+        job->source_file = value;
+      else if ((value = manifest_value(line, "output")))
+        job->output_file = value;
+      else if ((value = manifest_value(line, "options")))
+        job->build_options = value;
+      else if ((value = manifest_value(line, "specialize")))
+        job->specializations = value;
+      else
+        {
+          printf("ERROR: %s:%u: unknown line '%s'\n", path, line_num, line);
+          return 1;
+        }
+    }
+
+  *jobs_ret = jobs;
+  *num_ret = num;
+  return 0;
+}
+
+static int
+build_job(poclcc_batch *batch, poclcc_job *job)
+{
+  char *source = poclu_read_file(job->source_file);
+  if (!source)
+    {
+      printf("IO error on file %s: %s\n", job->source_file, strerror(errno));
+      return 2;
+    }
+
+  char *output = job->output_file;
+  if (output == NULL)
+    {
+      output = malloc(strlen(job->source_file) + 6);
+      strcpy(output, job->source_file);
+      strcat(output, ".pocl");
+    }
+
+  const char *opts = job->build_options ? job->build_options : "";
+  char *options = malloc(strlen(opts) + 32
+                         + (job->specializations
+                            ? strlen(job->specializations) : 0));
+  strcpy(options, opts);
+  if (job->specializations)
+    {
+      strcat(options, " -cl-pocl-specialize=");
+      strcat(options, job->specializations);
+    }
+
+  int res = build_program(batch->context, batch->num_devices, batch->devices,
+                          source, options, output);
+  if (res == 0)
+    printf("Built %s\n", output);
+
+  free(options);
+  if (output != job->output_file)
+    free(output);
+  free(source);
+  return res;
+}
+
+static void *
+build_jobs_worker(void *arg)
+{
+  poclcc_batch *batch = (poclcc_batch *)arg;
+  unsigned i;
+  while ((i = __sync_fetch_and_add(&batch->next_job, 1)) < batch->num_jobs)
+    if (build_job(batch, &batch->jobs[i]))
+      __sync_fetch_and_add(&batch->failed, 1);
+  return NULL;
+}
+
+/* Builds the programs of the manifest with num_jobs threads. The
+ * kernels of each program are compiled in parallel by pocl itself. */
+static int
+build_manifest(cl_context context, cl_uint num_devices, cl_device_id *devices)
+{
+  poclcc_batch batch;
+  unsigned i;
+
+  memset(&batch, 0, sizeof(batch));
+  batch.context = context;
+  batch.num_devices = num_devices;
+  batch.devices = devices;
+  if (parse_manifest(manifest_file, &batch.jobs, &batch.num_jobs))
+    return 1;
+
+  if (num_jobs == 0)
+    num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_jobs > batch.num_jobs)
+    num_jobs = batch.num_jobs;
+  if (num_jobs == 0)
+    num_jobs = 1;
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_jobs);
+  for (i = 1; i < num_jobs; i++)
+    if (pthread_create(&threads[i], NULL, build_jobs_worker, &batch))
+      {
+        printf("pthread_create failed\n");
+        exit(1);
+      }
+  build_jobs_worker(&batch);
+  for (i = 1; i < num_jobs; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (batch.failed)
+    printf("%u of %u programs failed to build\n", batch.failed,
+           batch.num_jobs);
+  free(batch.jobs);
+  return batch.failed ? 1 : 0;
+}
+
 /**********************************************************/
 
 int
@@ -262,10 +620,16 @@ main(int argc, char **argv)
     if (process_arg(&arg_num, argv, argc))
       return -1;
 
-  if (arg_num >= argc && list_devices)
-    list_devices_only = 1;
-  else if (arg_num >= argc)
-    poclcc_error("Invalid arguments!\n");
+  if (arg_num >= argc)
+    {
+      /* with a manifest there is no kernel file argument */
+      if (manifest_file != NULL)
+        ;
+      else if (list_devices)
+        list_devices_only = 1;
+      else
+        poclcc_error("Invalid arguments!\n");
+    }
   else
     {
       int current_process = search_process(argv[arg_num]);
@@ -274,7 +638,7 @@ main(int argc, char **argv)
       else if (current_process != -1)
         {
           process_arg(&arg_num, argv, argc);
-          list_devices_only = 1;
+          list_devices_only = (manifest_file == NULL);
         }
     }
 
@@ -282,7 +646,6 @@ main(int argc, char **argv)
   cl_platform_id cpPlatform;
   cl_device_id device_ids[NUM_OF_DEVICE_ID];
   cl_context context;
-  cl_program program;
   cl_int err;
   cl_uint num_devices, i;
 
@@ -323,51 +686,26 @@ main(int argc, char **argv)
   if (list_devices_only)
     return 0;
 
-  context = clCreateContext(0, 1, &device_ids[opencl_device_id], NULL, NULL, &err);
-  CHECK_OPENCL_ERROR_IN("clCreateContext");
-
-  program = clCreateProgramWithSource(context, 1, (const char **)&kernel_source, NULL, &err);
-  CHECK_OPENCL_ERROR_IN("clCreateProgramWithSource");
-
-  err = clBuildProgram (program, 0, NULL, build_options, NULL, NULL);
-  if (err != CL_SUCCESS)
+  cl_device_id *build_devices = &device_ids[opencl_device_id];
+  cl_uint num_build_devices = 1;
+  if (all_devices)
     {
-      printf ("Compilation failed\n");
-      char build_log[4096];
-      size_t actual_size = 0;
-      err = clGetProgramBuildInfo (program, device_ids[opencl_device_id],
-                                   CL_PROGRAM_BUILD_LOG, 4095, build_log,
-                                   &actual_size);
-      if (err == CL_SUCCESS)
-        {
-          build_log[actual_size] = 0;
-          printf ("Error log: \n\n%s\n", build_log);
-        }
+      build_devices = device_ids;
+      num_build_devices = num_devices;
     }
 
-  size_t binary_sizes;
-  char *binary;
-
-  CHECK_CL_ERROR(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
-                                  sizeof(size_t), &binary_sizes, NULL));
-
-  binary = malloc(sizeof(char)*binary_sizes);
-  if (!binary)
-    {
-      printf("malloc(binary) failed\n");
-      exit(1);
-    }
+  context = clCreateContext(0, num_build_devices, build_devices, NULL, NULL,
+                            &err);
+  CHECK_OPENCL_ERROR_IN("clCreateContext");
 
-  CHECK_CL_ERROR(clGetProgramInfo(program, CL_PROGRAM_BINARIES,
-                                  sizeof(unsigned char*), &binary, NULL));
+  int res;
+  if (manifest_file)
+    res = build_manifest(context, num_build_devices, build_devices);
+  else
+    res = build_program(context, num_build_devices, build_devices,
+                        kernel_source, build_options, output_file);
 
-  CHECK_CL_ERROR(clReleaseProgram(program));
   CHECK_CL_ERROR(clReleaseContext(context));
 
-  if (poclu_write_file(output_file, binary, binary_sizes))
-    ERRNO_EXIT(output_file);
-
-  free(binary);
-
-  return 0;
+  return res;
 }
@@ -332,6 +332,16 @@ if(NOT DEFINED LLVM_SPIRV)
   endif()
 endif()
 
+# the translator library, for translating SPIR-V without running llvm-spirv
+if(NOT DEFINED LLVM_SPIRV_LIB)
+  find_library(LLVM_SPIRV_LIB NAMES "LLVMSPIRVLib" HINTS "${LLVM_LIBDIR}")
+  find_path(LLVM_SPIRV_INCLUDEDIR NAMES "LLVMSPIRVLib.h"
+            HINTS "${LLVM_INCLUDEDIR}" PATH_SUFFIXES "LLVMSPIRVLib")
+  if(LLVM_SPIRV_LIB AND LLVM_SPIRV_INCLUDEDIR)
+    message(STATUS "Found LLVMSPIRVLib: ${LLVM_SPIRV_LIB}")
+  endif()
+endif()
+
 ####################################################################
 
 # try compile with any compiler (supplied as argument)
@@ -38,6 +38,8 @@ function(compile_c_to_bc FILENAME SUBDIR BC_FILE_LIST)
     add_custom_command( OUTPUT "${BC_FILE}"
         DEPENDS "${FULL_F_PATH}"
         "${CMAKE_SOURCE_DIR}/include/pocl_types.h"
+        "${CMAKE_SOURCE_DIR}/include/pocl_pipe.h"
+        "${CMAKE_SOURCE_DIR}/include/pocl_device_enqueue.h"
         "${CMAKE_SOURCE_DIR}/include/_kernel_c.h"
         COMMAND "${CLANG}" ${CLANG_FLAGS} ${DEVICE_CL_FLAGS} "-O1"
         ${KERNEL_C_FLAGS} "-o" "${BC_FILE}" "-c" "${FULL_F_PATH}"
@@ -8,6 +8,8 @@
 
 #cmakedefine BUILD_PROXY
 
+#cmakedefine BUILD_REMOTE_CLIENT
+
 #define BUILDDIR "@BUILDDIR@"
 
 /* "Build with ICD" */
@@ -28,6 +30,8 @@
 
 #cmakedefine ENABLE_CONFORMANCE
 
+#cmakedefine ENABLE_DEVICE_ENQUEUE
+
 #cmakedefine ENABLE_HWLOC
 
 #cmakedefine ENABLE_HOST_CPU_DEVICES
@@ -51,6 +55,8 @@
 
 #cmakedefine ENABLE_SPIRV
 
+#cmakedefine HAVE_LLVM_SPIRV_LIB
+
 #cmakedefine HAVE_DLFCN_H
 
 #cmakedefine HAVE_FORK
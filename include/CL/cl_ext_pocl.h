@@ -51,6 +51,481 @@ typedef CL_API_ENTRY cl_int
     cl_mem    buffer,
     cl_mem    content_size_buffer) CL_API_SUFFIX__VERSION_1_2;
 
+/***********************************
+* runtime statistics               *
+************************************/
+
+/* Returns the current values of PoCL's internal statistics (cache hits,
+ * compilations, migrations, scheduler activity) in values, and their
+ * names in names, for at most num_entries of them; either can be NULL.
+ * The number of statistics is returned in num_entries_ret. */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clGetStatisticsPoCL(
+    cl_platform_id platform,
+    cl_uint        num_entries,
+    cl_ulong *     values,
+    const char **  names,
+    cl_uint *      num_entries_ret) CL_API_SUFFIX__VERSION_1_2;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clGetStatisticsPoCL_fn)(
+    cl_platform_id platform,
+    cl_uint        num_entries,
+    cl_ulong *     values,
+    const char **  names,
+    cl_uint *      num_entries_ret) CL_API_SUFFIX__VERSION_1_2;
+
+/***********************************
+* split NDRange                    *
+************************************/
+
+/* Enqueues the NDRange split along its slowest dimension, at work-group
+ * boundaries, between the queues of one context, in proportion to the
+ * throughputs the devices have shown for the kernel in the earlier split
+ * enqueues. The buffers the kernel writes must be laid out with
+ * the slowest dimension outermost: a part with the share [a, b) of that
+ * dimension may only write the bytes [a, b) * size of every buffer it
+ * writes, and must write all of them it depends on. event, if not NULL,
+ * completes when all the parts have. */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueNDRangeKernelSplitPoCL(
+    cl_uint                 num_queues,
+    const cl_command_queue *queues,
+    cl_kernel               kernel,
+    cl_uint                 work_dim,
+    const size_t *          global_work_offset,
+    const size_t *          global_work_size,
+    const size_t *          local_work_size,
+    cl_uint                 num_events_in_wait_list,
+    const cl_event *        event_wait_list,
+    cl_event *              event) CL_API_SUFFIX__VERSION_1_2;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clEnqueueNDRangeKernelSplitPoCL_fn)(
+    cl_uint                 num_queues,
+    const cl_command_queue *queues,
+    cl_kernel               kernel,
+    cl_uint                 work_dim,
+    const size_t *          global_work_offset,
+    const size_t *          global_work_size,
+    const size_t *          local_work_size,
+    cl_uint                 num_events_in_wait_list,
+    const cl_event *        event_wait_list,
+    cl_event *              event) CL_API_SUFFIX__VERSION_1_2;
+
+/* Enqueues the whole NDRange on the one of the queues, of one context,
+ * whose device is predicted to complete it first: after the NDRanges this
+ * function has already enqueued on the device, at the throughput the device
+ * has shown for the kernel in the earlier balanced and split enqueues.
+ * The buffers are migrated to the chosen device as with
+ * clEnqueueNDRangeKernel. event, if not NULL, is the event of the NDRange
+ * on the chosen queue. */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueNDRangeKernelBalancePoCL(
+    cl_uint                 num_queues,
+    const cl_command_queue *queues,
+    cl_kernel               kernel,
+    cl_uint                 work_dim,
+    const size_t *          global_work_offset,
+    const size_t *          global_work_size,
+    const size_t *          local_work_size,
+    cl_uint                 num_events_in_wait_list,
+    const cl_event *        event_wait_list,
+    cl_event *              event) CL_API_SUFFIX__VERSION_1_2;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clEnqueueNDRangeKernelBalancePoCL_fn)(
+    cl_uint                 num_queues,
+    const cl_command_queue *queues,
+    cl_kernel               kernel,
+    cl_uint                 work_dim,
+    const size_t *          global_work_offset,
+    const size_t *          global_work_size,
+    const size_t *          local_work_size,
+    cl_uint                 num_events_in_wait_list,
+    const cl_event *        event_wait_list,
+    cl_event *              event) CL_API_SUFFIX__VERSION_1_2;
+
+/* One launch of clEnqueueNDRangeKernelBatchPoCL. The sizes are as in
+ * clEnqueueNDRangeKernel, with the elements past work_dim ignored, and a
+ * local_work_size of all zeros lets the device choose it. If arg_sizes is
+ * not NULL, the first num_args arguments of the kernel are set from
+ * arg_sizes and arg_values, as with clSetKernelArg, before the launch. */
+typedef struct _cl_ndrange_launch_pocl
+{
+  cl_kernel kernel;
+  cl_uint work_dim;
+  size_t global_work_offset[3];
+  size_t global_work_size[3];
+  size_t local_work_size[3];
+  cl_uint num_args;
+  const size_t *arg_sizes;
+  const void *const *arg_values;
+} cl_ndrange_launch_pocl;
+
+/* Enqueues the launches as one command, whose event, if not NULL,
+ * completes when all of them have. The launches must be independent of
+ * each other: the device may run their work-groups in any order, and
+ * concurrently. */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueNDRangeKernelBatchPoCL(
+    cl_command_queue              command_queue,
+    cl_uint                       num_launches,
+    const cl_ndrange_launch_pocl *launches,
+    cl_uint                       num_events_in_wait_list,
+    const cl_event *              event_wait_list,
+    cl_event *                    event) CL_API_SUFFIX__VERSION_1_2;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clEnqueueNDRangeKernelBatchPoCL_fn)(
+    cl_command_queue              command_queue,
+    cl_uint                       num_launches,
+    const cl_ndrange_launch_pocl *launches,
+    cl_uint                       num_events_in_wait_list,
+    const cl_event *              event_wait_list,
+    cl_event *                    event) CL_API_SUFFIX__VERSION_1_2;
+
+/***********************************
+* statically linked WG functions   *
+************************************/
+
+/* A work-group function of a CPU device kernel that is linked into the
+ * application (or a library of it) instead of being loaded from the
+ * kernel cache. build_hash is the build hash of the program, as in the
+ * kernel cache directory of the program (and in its pocl binary), and the
+ * functions are the _pocl_kernel_<name>_workgroup function and its
+ * optional launchers in the <kernel_name>.so of the cache. A local_size
+ * of all zeros is the generic WG function, otherwise the one specialized
+ * for the local size, and for the flags below, as its cache directory
+ * name tells. */
+typedef struct _cl_static_wg_function_pocl
+{
+  const char *build_hash;
+  const char *kernel_name;
+  size_t local_size[3];
+  cl_bitfield flags;
+  void *wg;
+  void *wg_range;
+  void *wg_noalias;
+  void *wg_range_noalias;
+} cl_static_wg_function_pocl;
+
+/* char[], for clGetProgramBuildInfo: the build hash of the program for the
+ * device, which names its kernel cache directory */
+#define CL_PROGRAM_BUILD_HASH_POCL 0x4F04
+
+/* the "-goffs0" WG functions, for the launches without a global offset */
+#define CL_STATIC_WG_GOFFS_ZERO_POCL (1 << 0)
+/* the "-smallgrid" WG functions */
+#define CL_STATIC_WG_SMALL_GRID_POCL (1 << 1)
+
+/* Registers the WG functions, which the CPU devices then use for the
+ * kernels of the programs with those build hashes before looking at the
+ * kernel cache, and the kernels of such pocl binaries are not unpacked
+ * there. The array must stay valid for the lifetime of the platform. */
+extern CL_API_ENTRY cl_int CL_API_CALL
+clRegisterStaticWGFunctionsPoCL(
+    cl_platform_id                    platform,
+    cl_uint                           num_functions,
+    const cl_static_wg_function_pocl *functions) CL_API_SUFFIX__VERSION_1_2;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clRegisterStaticWGFunctionsPoCL_fn)(
+    cl_platform_id                    platform,
+    cl_uint                           num_functions,
+    const cl_static_wg_function_pocl *functions) CL_API_SUFFIX__VERSION_1_2;
+
+/***********************************
+* cl_mem_info query for zero-copy  *
+************************************/
+
+/* cl_bool: CL_TRUE if the devices of the context that have allocated the
+ * buffer use its host memory directly, so that mapping the buffer and
+ * migrating it to and from the host need no copies. */
+#define CL_MEM_ZERO_COPY_POCL 0x4F00
+
+/***********************************
+* queue property for host waits    *
+************************************/
+
+/* cl_uint, for clCreateCommandQueueWithProperties: the time in microseconds
+ * that clFinish and clWaitForEvents on the queue's commands may busy-wait
+ * before sleeping. Overrides POCL_WAIT_SPIN_USEC for the queue. */
+#define CL_QUEUE_WAIT_SPIN_USEC_POCL 0x4F01
+
+/***********************************
+* context scheduling weight        *
+************************************/
+
+/* cl_uint, for clCreateContext: the share of the CPU device threads that
+ * the kernels of the context get, relative to the other contexts, when
+ * POCL_PTHREAD_FAIR_SHARE is set. Must be at least 1, which is the
+ * default. */
+#define CL_CONTEXT_SCHEDULING_WEIGHT_POCL 0x4F03
+
+/***********************************
+* event hardware counters          *
+************************************/
+
+/* cl_ulong[], for clGetEventProfilingInfo: the totals of the hardware
+ * performance counters selected with POCL_PERF_COUNTERS, in that order,
+ * over all the threads that ran the command. Only the pthread device
+ * collects them; the other devices return zeros. */
+#define CL_PROFILING_COMMAND_PERF_COUNTERS_POCL 0x4F02
+
+/***********************************
+* device performance calibration   *
+************************************/
+
+/* The throughputs of a device, measured with short built-in kernels when
+ * first queried, and kept in the kernel cache for the later processes:
+ * the bandwidth of a copy between two global buffers, counting both the
+ * reads and the writes, the rate of the float multiply-adds, counted as
+ * two operations, and the time from enqueueing an empty kernel to the
+ * return of clFinish. */
+typedef struct _cl_device_performance_pocl
+{
+  cl_ulong global_mem_bandwidth; /* bytes per second */
+  cl_ulong flops;                /* float operations per second */
+  cl_ulong launch_latency_ns;
+} cl_device_performance_pocl;
+
+/* cl_device_performance_pocl, for clGetDeviceInfo. Fails with
+ * CL_INVALID_OPERATION on the devices without an online compiler. */
+#define CL_DEVICE_PERFORMANCE_POCL 0x4F05
+
+/***********************************
+* core kind affinity domain        *
+************************************/
+
+/* For CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN: splits the CPU device of a
+ * host with a hybrid CPU into one sub-device per kind of cores (e.g. the
+ * performance and the efficiency cores), in the order of the CPUs. Included
+ * in CL_DEVICE_PARTITION_AFFINITY_DOMAIN if the host has several kinds. */
+#define CL_DEVICE_AFFINITY_DOMAIN_CORE_KIND_POCL (1 << 16)
+
+/***********************************
+* cl_khr_command_buffer            *
+************************************/
+
+/* The types, tokens and entry points of the provisional
+ * cl_khr_command_buffer extension that PoCL implements, for Khronos
+ * headers that do not define them yet. PoCL supports recording
+ * barriers, buffer copies, buffer fills and NDRange kernels on a
+ * single queue, and does not advertise the extension yet. */
+#ifndef cl_khr_command_buffer
+#define cl_khr_command_buffer 1
+
+typedef cl_bitfield cl_device_command_buffer_capabilities_khr;
+typedef struct _cl_command_buffer_khr *cl_command_buffer_khr;
+typedef cl_uint cl_sync_point_khr;
+typedef cl_uint cl_command_buffer_info_khr;
+typedef cl_uint cl_command_buffer_state_khr;
+typedef cl_properties cl_command_buffer_properties_khr;
+typedef cl_bitfield cl_command_buffer_flags_khr;
+typedef cl_properties cl_ndrange_kernel_command_properties_khr;
+typedef struct _cl_mutable_command_khr *cl_mutable_command_khr;
+
+#define CL_DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR 0x12A9
+#define CL_DEVICE_COMMAND_BUFFER_REQUIRED_QUEUE_PROPERTIES_KHR 0x12AA
+
+#define CL_COMMAND_BUFFER_FLAGS_KHR 0x1293
+#define CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR (1 << 0)
+
+#define CL_INVALID_COMMAND_BUFFER_KHR -1138
+#define CL_INVALID_SYNC_POINT_WAIT_LIST_KHR -1139
+#define CL_INCOMPATIBLE_COMMAND_QUEUE_KHR -1140
+
+#define CL_COMMAND_BUFFER_QUEUES_KHR 0x1294
+#define CL_COMMAND_BUFFER_NUM_QUEUES_KHR 0x1295
+#define CL_COMMAND_BUFFER_REFERENCE_COUNT_KHR 0x1296
+#define CL_COMMAND_BUFFER_STATE_KHR 0x1297
+#define CL_COMMAND_BUFFER_PROPERTIES_ARRAY_KHR 0x1298
+
+#define CL_COMMAND_BUFFER_STATE_RECORDING_KHR 0
+#define CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR 1
+#define CL_COMMAND_BUFFER_STATE_PENDING_KHR 2
+#define CL_COMMAND_BUFFER_STATE_INVALID_KHR 3
+
+#define CL_COMMAND_COMMAND_BUFFER_KHR 0x12A8
+
+extern CL_API_ENTRY cl_command_buffer_khr CL_API_CALL
+clCreateCommandBufferKHR(
+    cl_uint                                 num_queues,
+    const cl_command_queue *                queues,
+    const cl_command_buffer_properties_khr *properties,
+    cl_int *                                errcode_ret);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clFinalizeCommandBufferKHR(
+    cl_command_buffer_khr command_buffer);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clRetainCommandBufferKHR(
+    cl_command_buffer_khr command_buffer);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clReleaseCommandBufferKHR(
+    cl_command_buffer_khr command_buffer);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueCommandBufferKHR(
+    cl_uint               num_queues,
+    cl_command_queue *    queues,
+    cl_command_buffer_khr command_buffer,
+    cl_uint               num_events_in_wait_list,
+    const cl_event *      event_wait_list,
+    cl_event *            event);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clCommandBarrierWithWaitListKHR(
+    cl_command_buffer_khr    command_buffer,
+    cl_command_queue         command_queue,
+    cl_uint                  num_sync_points_in_wait_list,
+    const cl_sync_point_khr *sync_point_wait_list,
+    cl_sync_point_khr *      sync_point,
+    cl_mutable_command_khr * mutable_handle);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clCommandCopyBufferKHR(
+    cl_command_buffer_khr    command_buffer,
+    cl_command_queue         command_queue,
+    cl_mem                   src_buffer,
+    cl_mem                   dst_buffer,
+    size_t                   src_offset,
+    size_t                   dst_offset,
+    size_t                   size,
+    cl_uint                  num_sync_points_in_wait_list,
+    const cl_sync_point_khr *sync_point_wait_list,
+    cl_sync_point_khr *      sync_point,
+    cl_mutable_command_khr * mutable_handle);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clCommandFillBufferKHR(
+    cl_command_buffer_khr    command_buffer,
+    cl_command_queue         command_queue,
+    cl_mem                   buffer,
+    const void *             pattern,
+    size_t                   pattern_size,
+    size_t                   offset,
+    size_t                   size,
+    cl_uint                  num_sync_points_in_wait_list,
+    const cl_sync_point_khr *sync_point_wait_list,
+    cl_sync_point_khr *      sync_point,
+    cl_mutable_command_khr * mutable_handle);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clCommandNDRangeKernelKHR(
+    cl_command_buffer_khr                          command_buffer,
+    cl_command_queue                               command_queue,
+    const cl_ndrange_kernel_command_properties_khr *properties,
+    cl_kernel                                      kernel,
+    cl_uint                                        work_dim,
+    const size_t *                                 global_work_offset,
+    const size_t *                                 global_work_size,
+    const size_t *                                 local_work_size,
+    cl_uint                                        num_sync_points_in_wait_list,
+    const cl_sync_point_khr *                      sync_point_wait_list,
+    cl_sync_point_khr *                            sync_point,
+    cl_mutable_command_khr *                       mutable_handle);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clGetCommandBufferInfoKHR(
+    cl_command_buffer_khr      command_buffer,
+    cl_command_buffer_info_khr param_name,
+    size_t                     param_value_size,
+    void *                     param_value,
+    size_t *                   param_value_size_ret);
+
+typedef CL_API_ENTRY cl_command_buffer_khr
+(CL_API_CALL *clCreateCommandBufferKHR_fn)(
+    cl_uint,
+    const cl_command_queue *,
+    const cl_command_buffer_properties_khr *,
+    cl_int *);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clFinalizeCommandBufferKHR_fn)(
+    cl_command_buffer_khr);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clRetainCommandBufferKHR_fn)(
+    cl_command_buffer_khr);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clReleaseCommandBufferKHR_fn)(
+    cl_command_buffer_khr);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clEnqueueCommandBufferKHR_fn)(
+    cl_uint,
+    cl_command_queue *,
+    cl_command_buffer_khr,
+    cl_uint,
+    const cl_event *,
+    cl_event *);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clCommandBarrierWithWaitListKHR_fn)(
+    cl_command_buffer_khr,
+    cl_command_queue,
+    cl_uint,
+    const cl_sync_point_khr *,
+    cl_sync_point_khr *,
+    cl_mutable_command_khr *);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clCommandCopyBufferKHR_fn)(
+    cl_command_buffer_khr,
+    cl_command_queue,
+    cl_mem,
+    cl_mem,
+    size_t,
+    size_t,
+    size_t,
+    cl_uint,
+    const cl_sync_point_khr *,
+    cl_sync_point_khr *,
+    cl_mutable_command_khr *);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clCommandFillBufferKHR_fn)(
+    cl_command_buffer_khr,
+    cl_command_queue,
+    cl_mem,
+    const void *,
+    size_t,
+    size_t,
+    size_t,
+    cl_uint,
+    const cl_sync_point_khr *,
+    cl_sync_point_khr *,
+    cl_mutable_command_khr *);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clCommandNDRangeKernelKHR_fn)(
+    cl_command_buffer_khr,
+    cl_command_queue,
+    const cl_ndrange_kernel_command_properties_khr *,
+    cl_kernel,
+    cl_uint,
+    const size_t *,
+    const size_t *,
+    const size_t *,
+    cl_uint,
+    const cl_sync_point_khr *,
+    cl_sync_point_khr *,
+    cl_mutable_command_khr *);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clGetCommandBufferInfoKHR_fn)(
+    cl_command_buffer_khr,
+    cl_command_buffer_info_khr,
+    size_t,
+    void *,
+    size_t *);
+
+#endif /* cl_khr_command_buffer */
 
 #ifdef __cplusplus
 }
@@ -109,7 +109,9 @@ typedef struct pocl_mem_identifier
 
   /* Extra integer for drivers to use for anything
    *
-   * Currently Vulkan uses it to track vulkan memory requirements
+   * Currently Vulkan uses it to track vulkan memory requirements,
+   * the CPU devices store the tile shift of tiled images in it,
+   * and the remote driver the id of the buffer in its server
    */
   uint64_t extra;
 
@@ -136,21 +138,55 @@ struct _build_program_callback
 #define POCL_KERNEL_DIGEST_SIZE 16
 typedef uint8_t pocl_kernel_hash_t[POCL_KERNEL_DIGEST_SIZE];
 
+/* The maximum number of scalar arguments a WG function is specialized on. */
+#define POCL_MAX_SPEC_ARGS 8
+
 // clEnqueueNDRangeKernel
 typedef struct
 {
   void *hash;
   void *wg; /* The work group function ptr. Device specific. */
+  /* The work-group range launcher of wg, NULL if not available. */
+  void *wg_range;
+  /* The versions of wg and wg_range that assume the buffer arguments do
+     not overlap, NULL if not available. */
+  void *wg_noalias;
+  void *wg_range_noalias;
   cl_kernel kernel;
   /* The launch data that can be passed to the kernel execution environment. */
   struct pocl_context pc;
+  /* The local size of the last work-group in each dimension where it
+     differs from pc.local_size, i.e. the global size isn't a multiple
+     of it, 0 elsewhere. Only set for devices with edge_work_groups. */
+  size_t edge_size[3];
+  /* The kernel arguments of the launch, arguments of args_snapshot. */
   struct pocl_argument *arguments;
+  struct pocl_kernel_args *args_snapshot;
   /* Can be used to store/cache arbitrary device-specific data. */
   void *device_data;
+  /* The dlhandle cache entry of wg, for the CPU drivers. */
+  void *dlhandle_item;
   /* If set to 1, disallow any work-group function specialization. */
   int force_generic_wg_func;
   /* If set to 1, disallow "small grid" WG function specialization. */
   int force_large_grid_wg_func;
+  /* If set to 1, build the WG function with the faster to compile pipeline
+     of the first tier of POCL_TIERED_COMPILATION. */
+  int fast_wg_func;
+  /* The scalar arguments whose values are folded into the specialized WG
+     function: bit i is set for argument i. spec_arg_values holds the raw
+     bytes of the values, zero-padded, in the order of the arguments. */
+  uint64_t spec_args;
+  uint64_t spec_arg_values[POCL_MAX_SPEC_ARGS];
+  /* Kernel fusion of the pthread driver: the first command of a chain
+     lists the commands to run after it, work-group by work-group, from
+     fused_next; the others point to it with fused_head. fusion_open is set
+     in the first command while commands can still be appended. */
+  struct _cl_command_node *fused_next;
+  struct _cl_command_node *fused_head;
+  struct _cl_command_node *fused_tail;
+  unsigned fused_count;
+  int fusion_open;
 } _cl_command_run;
 
 // clEnqueueNativeKernel
@@ -320,6 +356,13 @@ typedef struct
   int has_wait_list;
 } _cl_command_marker;
 
+/* clEnqueueCommandBufferKHR, on a device that runs the whole command
+   buffer as one command */
+typedef struct
+{
+  cl_command_buffer_khr command_buffer;
+} _cl_command_command_buffer;
+
 /* clEnqueueBarrierWithWaitlist */
 typedef _cl_command_marker _cl_command_barrier;
 
@@ -338,6 +381,13 @@ typedef struct
   pocl_mem_identifier *src_id;
   pocl_mem_identifier *dst_id;
   pocl_mem_identifier *mem_id;
+  /* the byte range of a buffer to copy with D2H and H2D migrations;
+   * the rest of the destination already has the right content */
+  size_t offset;
+  size_t size;
+  /* cl_pocl_content_size: if set, only the bytes of the range below the
+   * content size in the host copy of this buffer are copied */
+  cl_mem content_size;
 } _cl_command_migrate;
 
 typedef struct
@@ -379,6 +429,15 @@ typedef struct
   size_t pattern_size;
 } _cl_command_svm_fill;
 
+typedef struct
+{
+  unsigned num_svm_pointers;
+  const void **svm_pointers;
+  /* 0 for the whole allocation */
+  size_t *sizes;
+  cl_mem_migration_flags flags;
+} _cl_command_svm_migrate;
+
 typedef union
 {
   _cl_command_run run;
@@ -401,6 +460,7 @@ typedef union
   _cl_command_unmap unmap;
 
   _cl_command_marker marker;
+  _cl_command_command_buffer command_buffer;
   _cl_command_barrier barrier;
   _cl_command_migrate migrate;
 
@@ -409,22 +469,25 @@ typedef union
   _cl_command_svm_unmap svm_unmap;
   _cl_command_svm_cpy svm_memcpy;
   _cl_command_svm_fill svm_fill;
+  _cl_command_svm_migrate svm_migrate;
 } _cl_command_t;
 
 // one item in the command queue
 typedef struct _cl_command_node _cl_command_node;
 struct _cl_command_node
 {
-  _cl_command_t command;
-  cl_command_type type;
+  /* The fields the queues and the schedulers look at come first, before
+     the large command union, so that they share the first cache line. */
   _cl_command_node *next; // for linked-list storage
   _cl_command_node *prev;
   cl_event event;
-  const cl_event *event_wait_list;
   cl_device_id device;
+  cl_command_type type;
+  cl_int ready;
   /* The index of the targeted device in the **program** device list. */
   unsigned program_device_i;
-  cl_int ready;
+  const cl_event *event_wait_list;
+  _cl_command_t command;
 };
 
 #define CLANG_MAJOR LLVM_MAJOR
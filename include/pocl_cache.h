@@ -30,6 +30,10 @@
    the kernel's temp dir. */
 #define POCL_PARALLEL_BC_FILENAME   "/parallel.bc"
 
+/* The kernel compile report written next to the parallel.bc with
+   POCL_KERNEL_COMPILE_REPORT. */
+#define POCL_COMPILE_REPORT_FILENAME "/compile_report.json"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,6 +42,10 @@ extern "C" {
 
 int pocl_cache_init_topdir ();
 
+/* Returns nonzero if the compilation results are kept across runs
+   (POCL_KERNEL_CACHE). */
+int pocl_cache_enabled ();
+
 POCL_EXPORT
 int
 pocl_cache_create_program_cachedir(cl_program program, unsigned device_i,
@@ -125,6 +133,69 @@ void pocl_cache_final_binary_path (char *final_binary_path, cl_program program,
                                    unsigned device_i, cl_kernel kernel,
                                    _cl_command_node *command, int specialize);
 
+/* Writes program->binaries[device_i] to the program.bc of the program's
+ * build if it is not there yet and the device compiles with LLVM. Without the kernel cache, program.bc is
+ * kept only in memory until something needs the file. */
+int pocl_cache_write_program_bc (cl_program program, unsigned device_i);
+
+/* Copies the program.bc of the program's build from the remote cache tier
+ * (POCL_CACHE_REMOTE) to the local cache. Returns 0 if it was found. */
+int pocl_cache_fetch_remote_program_bc (cl_program program,
+                                        unsigned device_i);
+
+/* Uploads the program.bc of the program's build to the remote cache tier. */
+void pocl_cache_store_remote_program_bc (cl_program program,
+                                         unsigned device_i);
+
+/* Computes the key of the work-group function llvm_module in the
+ * content-addressed kernel object store into key (a SHA1_digest_t). */
+void pocl_cache_object_key (char *key, cl_kernel kernel, unsigned device_i,
+                            _cl_command_node *command, int specialize,
+                            void *llvm_module);
+
+/* Hard links the object with the given key to path. Returns 0 on success,
+ * nonzero if the object is not in the store. */
+int pocl_cache_fetch_object (const char *key, const char *path);
+
+/* Adds the final binary at path to the object store under key. */
+void pocl_cache_store_object (const char *key, const char *path);
+
+/* Writes the path of the precompiled builtin headers (POCL_KERNEL_PCH) for
+ * the given front-end options into path. Returns nonzero if the kernel
+ * cache is disabled. */
+int pocl_cache_builtin_pch_path (char *path, const char *options);
+
+#define POCL_CACHE_LOCK_PROGRAM 0
+#define POCL_CACHE_LOCK_OBJECT 1
+#define POCL_CACHE_LOCK_KERNEL 2
+
+/* Locks the cache entry of the given kind (POCL_CACHE_LOCK_*) and name,
+ * e.g. a program build hash, an object store key or the path of a final
+ * kernel binary in the kernel's cache directory, against the other
+ * processes and threads using the cache directory. A compile that misses
+ * the cache takes the lock and checks the cache again, so that concurrent
+ * misses on the same entry compile it only once. The names are hashed to
+ * a fixed set of lock files per kind. Returns the lock to pass to
+ * pocl_cache_unlock(), or -1 if the cache is disabled. */
+int pocl_cache_lock (int kind, const char *name);
+
+void pocl_cache_unlock (int lock);
+
+/* Writes the path of the LLVM bitcode translated from the given SPIR-V
+ * module into path. Returns nonzero if the kernel cache is disabled. */
+int pocl_cache_spirv_bitcode_path (char *path, const char *spirv,
+                                   size_t size);
+
+/* Writes the path of a file named name that a driver keeps its own cache
+ * in, e.g. a serialized pipeline cache, into path. Returns nonzero if the
+ * kernel cache is disabled. */
+POCL_EXPORT
+int pocl_cache_device_cache_path (char *path, const char *name);
+
+/* Evicts the least recently used programs and objects of the cache if its
+ * size exceeds POCL_CACHE_MAX_SIZE. */
+void pocl_cache_enforce_size_limit ();
+
 
 #ifdef __cplusplus
 }
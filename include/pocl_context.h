@@ -38,6 +38,8 @@ struct pocl_context32 {
   uint printf_buffer_position;
   uint printf_buffer_capacity;
   uint work_dim;
+  uint preempt;
+  uint device_enqueue;
 };
 
 /* The default pocl_context is 64b. It should be copied to a 32b one
@@ -50,6 +52,10 @@ struct pocl_context {
   uint *printf_buffer_position;
   uint printf_buffer_capacity;
   uint work_dim;
+  /* struct pocl_preempt_point *, for the devices with preemption_points */
+  uchar *preempt;
+  /* struct pocl_device_enqueue *, for the devices with device queues */
+  uchar *device_enqueue;
 };
 
 /* Copy a 64b context struct to a 32b one. */
@@ -70,8 +76,26 @@ struct pocl_context {
     __dst->printf_buffer = __src->printf_buffer;			\
     __dst->printf_buffer_position = __src->printf_buffer_position;	\
     __dst->printf_buffer_capacity = __src->printf_buffer_capacity;	\
+    __dst->preempt = __src->preempt;					\
+    __dst->device_enqueue = __src->device_enqueue;			\
   } while (0)
 
+/* The preemption point of a CPU device thread. The work-group functions
+   compiled for a device with preemption_points poll requested at the
+   back-edges of their loops, and call yield with the address of the struct
+   when it is nonzero. The compiler relies on yield being the pointer-sized
+   field right after requested. */
+struct pocl_preempt_point {
+  volatile uint requested;
+  void (*yield) (struct pocl_preempt_point *);
+};
+
+/* The records of the binary printf (__pocl_printf_binary() in
+   lib/kernel/printf.c) start with a header of the uint size of the record
+   in bytes, a uint of flags (zero) and the ulong address of the format
+   string. The arguments follow in 8 byte aligned slots. */
+#define POCL_PRINTF_RECORD_HEADER_SIZE 16
+
 #define POCL_CONTEXT_SIZE(__BITNESS)					\
   (__BITNESS == 64 ?							\
    sizeof (struct pocl_context) :					\
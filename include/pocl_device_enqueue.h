@@ -0,0 +1,90 @@
+/* pocl_device_enqueue.h - The interface between the OpenCL 2.0 device-side
+   enqueue functions of the kernel library and the CPU device drivers.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* This header can be included both from device and host sources. */
+
+#ifndef POCL_DEVICE_ENQUEUE_H
+#define POCL_DEVICE_ENQUEUE_H
+
+#include "pocl_types.h"
+
+/* The kernel_enqueue_flags_t of enqueue_kernel(). */
+#define POCL_ENQUEUE_FLAGS_NO_WAIT 0
+#define POCL_ENQUEUE_FLAGS_WAIT_KERNEL 1
+#define POCL_ENQUEUE_FLAGS_WAIT_WORK_GROUP 2
+
+/* The return values of enqueue_kernel() and enqueue_marker(). */
+#define POCL_CLK_SUCCESS 0
+#define POCL_CLK_EVENT_ALLOCATION_FAILURE -100
+#define POCL_CLK_ENQUEUE_FAILURE -101
+#define POCL_CLK_INVALID_QUEUE -102
+#define POCL_CLK_INVALID_EVENT_WAIT_LIST -57
+#define POCL_CLK_INVALID_NDRANGE -160
+#define POCL_CLK_DEVICE_QUEUE_FULL -161
+
+/* The layout of the ndrange_t of the OpenCL C headers of Clang. A local
+   size of zero lets the device choose it. */
+typedef struct
+{
+  uint work_dim;
+  ulong global_offset[3];
+  ulong global_size[3];
+  ulong local_size[3];
+} pocl_ndrange;
+
+/* The device queue of the thread running a work-group, which the kernel
+   library functions reach through the device_enqueue field of the
+   pocl_context. The queues and the events are the opaque queue_t and
+   clk_event_t of the kernels: the cl_command_queue of a device queue, and
+   whatever the driver uses for its device events.
+
+   A child kernel is the kernel the compiler made of the block given to
+   enqueue_kernel(), named by kernel_name (see pocl_llvm_build.cc). Its
+   first argument is the block literal, which starts with its uint size in
+   bytes and is copied at the enqueue, and the rest are the num_locals
+   local buffers of local_sizes bytes. */
+struct pocl_device_enqueue
+{
+  int (*enqueue_kernel) (struct pocl_device_enqueue *de, void *queue,
+                         int flags, const pocl_ndrange *range,
+                         uint num_events, void *const *wait_list,
+                         void **event_ret, const char *kernel_name,
+                         void *block, uint num_locals,
+                         const ulong *local_sizes);
+  int (*enqueue_marker) (struct pocl_device_enqueue *de, void *queue,
+                         uint num_events, void *const *wait_list,
+                         void **event_ret);
+  void *(*create_user_event) (struct pocl_device_enqueue *de);
+  void (*set_user_event_status) (struct pocl_device_enqueue *de, void *event,
+                                 int status);
+  void (*retain_event) (struct pocl_device_enqueue *de, void *event);
+  void (*release_event) (struct pocl_device_enqueue *de, void *event);
+  void *(*get_default_queue) (struct pocl_device_enqueue *de);
+  /* the get_kernel_work_group_size() and the
+     get_kernel_preferred_work_group_size_multiple() of the child kernels */
+  ulong max_work_group_size;
+  ulong preferred_work_group_size_multiple;
+};
+
+#endif
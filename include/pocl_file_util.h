@@ -60,6 +60,10 @@ int pocl_write_tempfile (char *output_path, const char *prefix,
                          const char *suffix, const char *content,
                          unsigned long count, int *ret_fd);
 
+/* Sets whether the two functions above flush the written data to the
+ * disk before returning (the default). */
+void pocl_set_file_sync (int sync);
+
 /* Allocates memory and places file contents in it.
  * Returns negative errno on error, zero otherwise. */
 POCL_EXPORT
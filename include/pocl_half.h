@@ -0,0 +1,181 @@
+/* pocl_half.h - conversions between float and half, of one value or of
+   arrays, shared by the runtime and poclu
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef POCL_HALF_H
+#define POCL_HALF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* The array conversions use F16C on x86, picked at run time, and the
+ * conversion instructions of AArch64, which are always there. The values
+ * the vector code leaves over, and the other targets, use the scalar
+ * conversions, which give the same results. */
+#if (defined(__x86_64__) || defined(__i386__))                               \
+    && (defined(__GNUC__) || defined(__clang__))
+#define POCL_HALF_F16C
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define POCL_HALF_NEON
+#include <arm_neon.h>
+#endif
+
+/* Converts the float to the nearest half, ties to even, as the conversion
+ * instructions do. NaNs stay NaNs, quieted. */
+static inline uint16_t
+pocl_float_to_half (float value)
+{
+  const uint32_t f16_overflow = (127 + 16) << 23;
+  const uint32_t f16_min_normal = (127 - 14) << 23;
+  const uint32_t denorm_magic = ((127 - 15) + (23 - 10) + 1) << 23;
+  uint32_t u, o;
+  memcpy (&u, &value, sizeof (u));
+  uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+
+  if (u >= f16_overflow)
+    /* infinity, or a NaN with the top bits of its payload */
+    o = (u > 0x7f800000u) ? 0x7e00 | ((u >> 13) & 0x3ff) : 0x7c00;
+  else if (u < f16_min_normal)
+    {
+      /* a subnormal or zero: the addition rounds the value to the
+       * subnormal steps and moves it to the low bits */
+      float f, magic;
+      memcpy (&f, &u, sizeof (f));
+      memcpy (&magic, &denorm_magic, sizeof (magic));
+      f += magic;
+      memcpy (&o, &f, sizeof (o));
+      o -= denorm_magic;
+    }
+  else
+    {
+      /* rebias the exponent and round the mantissa; a carry out of it
+       * bumps the exponent, up to infinity */
+      uint32_t mant_odd = (u >> 13) & 1;
+      u += ((uint32_t)(15 - 127) << 23) + 0xfff + mant_odd;
+      o = u >> 13;
+    }
+  return (uint16_t)(o | (sign >> 16));
+}
+
+/* Converts the half to float, which holds every half exactly. */
+static inline float
+pocl_half_to_float (uint16_t value)
+{
+  uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  uint32_t em = value & 0x7fff;
+  uint32_t u;
+  float f;
+
+  if (em >= 0x7c00)
+    /* infinity or NaN, quieted */
+    u = 0x7f800000u | ((em & 0x3ff) << 13) | (em > 0x7c00 ? 0x400000u : 0);
+  else if (em >= 0x400)
+    u = (em << 13) + ((uint32_t)(127 - 15) << 23);
+  else
+    {
+      /* subnormal or zero: the mantissa in units of 2^-24 */
+      f = (float)em * 5.9604644775390625e-8f;
+      memcpy (&u, &f, sizeof (u));
+    }
+  u |= sign;
+  memcpy (&f, &u, sizeof (f));
+  return f;
+}
+
+#ifdef POCL_HALF_F16C
+
+__attribute__ ((target ("avx,f16c"))) static inline size_t
+pocl_float_to_half_f16c (uint16_t *dst, const float *src, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128 (
+        (__m128i *)(dst + i),
+        _mm256_cvtps_ph (_mm256_loadu_ps (src + i), _MM_FROUND_TO_NEAREST_INT));
+  if (i + 4 <= n)
+    {
+      _mm_storel_epi64 (
+          (__m128i *)(dst + i),
+          _mm_cvtps_ph (_mm_loadu_ps (src + i), _MM_FROUND_TO_NEAREST_INT));
+      i += 4;
+    }
+  return i;
+}
+
+__attribute__ ((target ("avx,f16c"))) static inline size_t
+pocl_half_to_float_f16c (float *dst, const uint16_t *src, size_t n)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps (dst + i, _mm256_cvtph_ps (_mm_loadu_si128 (
+                                   (const __m128i *)(src + i))));
+  if (i + 4 <= n)
+    {
+      _mm_storeu_ps (dst + i, _mm_cvtph_ps (_mm_loadl_epi64 (
+                                  (const __m128i *)(src + i))));
+      i += 4;
+    }
+  return i;
+}
+
+#endif
+
+/* Converts the n floats of src to the halves of dst, as pocl_float_to_half
+ * does. */
+static inline void
+pocl_float_to_half_array (uint16_t *dst, const float *src, size_t n)
+{
+  size_t i = 0;
+#if defined(POCL_HALF_F16C)
+  if (__builtin_cpu_supports ("f16c"))
+    i = pocl_float_to_half_f16c (dst, src, n);
+#elif defined(POCL_HALF_NEON)
+  for (; i + 4 <= n; i += 4)
+    vst1_u16 (dst + i,
+              vreinterpret_u16_f16 (vcvt_f16_f32 (vld1q_f32 (src + i))));
+#endif
+  for (; i < n; ++i)
+    dst[i] = pocl_float_to_half (src[i]);
+}
+
+/* Converts the n halves of src to the floats of dst. */
+static inline void
+pocl_half_to_float_array (float *dst, const uint16_t *src, size_t n)
+{
+  size_t i = 0;
+#if defined(POCL_HALF_F16C)
+  if (__builtin_cpu_supports ("f16c"))
+    i = pocl_half_to_float_f16c (dst, src, n);
+#elif defined(POCL_HALF_NEON)
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32 (dst + i,
+               vcvt_f32_f16 (vreinterpret_f16_u16 (vld1_u16 (src + i))));
+#endif
+  for (; i < n; ++i)
+    dst[i] = pocl_half_to_float (src[i]);
+}
+
+#endif
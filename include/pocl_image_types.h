@@ -27,8 +27,10 @@
 
 #ifdef __CBUILD__
 #define INTTYPE cl_int
+#define ULONGTYPE cl_ulong
 #else
 #define INTTYPE int
+#define ULONGTYPE ulong
 #endif
 
 typedef uintptr_t dev_sampler_t;
@@ -47,6 +49,24 @@ typedef struct dev_image_t {
   INTTYPE _data_type;
   INTTYPE _num_channels;
   INTTYPE _elem_size;
+  /* log2 of the side of the square tiles the image is stored in, 0 for the
+   * linear layout; see POCL_IMAGE_X_OFFSET in pocl_image_rw_utils.h */
+  INTTYPE _tile_shift;
 } dev_image_t;
 
+/* The CUDA devices keep an image in a CUDA array, and pass the kernels this
+ * descriptor of it instead: the texture objects of the reads with a
+ * sampler, one for each sampler state, at POCL_CUDA_TEXTURE_INDEX of the
+ * dev_sampler_t, and the surface object of the other reads and the
+ * writes. */
+#define POCL_CUDA_NUM_TEXTURES 20
+#define POCL_CUDA_TEXTURE_INDEX(sampler)                                      \
+  (((sampler) & 0xf) + (((sampler) & CLK_FILTER_LINEAR) ? 10 : 0))
+
+typedef struct cuda_image_t {
+  dev_image_t _base;
+  ULONGTYPE _textures[POCL_CUDA_NUM_TEXTURES];
+  ULONGTYPE _surface;
+} cuda_image_t;
+
 #endif
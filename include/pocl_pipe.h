@@ -0,0 +1,65 @@
+/* pocl_pipe.h - The layout of the OpenCL 2.0 pipes of the CPU devices.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* This header can be included both from device and host sources. */
+
+#ifndef POCL_PIPE_H
+#define POCL_PIPE_H
+
+#include "pocl_types.h"
+
+/* The counters the reading and the writing kernels update are on cache
+   lines of their own, so that the producers and the consumers do not
+   invalidate each other's lines more than the data they exchange needs. */
+#define POCL_PIPE_CACHE_LINE_SIZE 64
+
+#define POCL_PIPE_COUNTER(name)                                               \
+  uint name;                                                                  \
+  uchar name##_pad[POCL_PIPE_CACHE_LINE_SIZE - sizeof (uint)]
+
+/* A pipe is a ring buffer of max_packets packets of packet_size bytes,
+   which follow this header in the pipe's buffer. The counters grow
+   monotonically and wrap around; packet i is in the slot i % max_packets.
+
+   The writers reserve the slots between write_reserved and read_committed
+   + max_packets with an atomic compare-and-swap of write_reserved, and
+   publish them to the readers by advancing write_committed in the order
+   of the reservations. The readers reserve the packets between
+   read_reserved and write_committed, and free them to the writers by
+   advancing read_committed. A reservation does one atomic update of the
+   pipe whatever the number of packets, so the work-group reservations of
+   a whole work-group's packets cost the same as one work-item's. */
+typedef struct
+{
+  POCL_PIPE_COUNTER (write_reserved);
+  POCL_PIPE_COUNTER (write_committed);
+  POCL_PIPE_COUNTER (read_reserved);
+  POCL_PIPE_COUNTER (read_committed);
+  uint packet_size;
+  uint max_packets;
+  uchar params_pad[POCL_PIPE_CACHE_LINE_SIZE - 2 * sizeof (uint)];
+} pocl_pipe_header;
+
+#undef POCL_PIPE_COUNTER
+
+#endif
@@ -42,4 +42,13 @@ typedef void (*pocl_workgroup_func32) (uchar * /* args */,
 				       uint /* group_y */,
 				       uint /* group_z */);
 
+/* The launcher of a row of work-groups, from group_x_start up to, but not
+   including, group_x_end, generated next to the default one. */
+typedef void (*pocl_workgroup_range_func) (uchar * /* args */,
+					   uchar * /* pocl_context */,
+					   ulong /* group_x_start */,
+					   ulong /* group_x_end */,
+					   ulong /* group_y */,
+					   ulong /* group_z */);
+
 #endif
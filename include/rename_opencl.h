@@ -43,6 +43,7 @@
 #define clReleaseCommandQueue POclReleaseCommandQueue
 #define clGetCommandQueueInfo POclGetCommandQueueInfo
 #define clCreateBuffer POclCreateBuffer
+#define clCreateBufferWithProperties POclCreateBufferWithProperties
 #define clCreateSubBuffer POclCreateSubBuffer
 #define clCreateImage POclCreateImage
 #define clCreatePipe POclCreatePipe
@@ -117,6 +118,7 @@
 #define clEnqueueSVMMemFill POclEnqueueSVMMemFill
 #define clEnqueueSVMMap POclEnqueueSVMMap
 #define clEnqueueSVMUnmap POclEnqueueSVMUnmap
+#define clEnqueueSVMMigrateMem POclEnqueueSVMMigrateMem
 #define clGetExtensionFunctionAddressForPlatform POclGetExtensionFunctionAddressForPlatform
 #define clCreateImage2D POclCreateImage2D
 #define clCreateImage3D POclCreateImage3D
@@ -135,5 +137,7 @@
 #define clEnqueueAcquireGLObjects POclEnqueueAcquireGLObjects
 #define clEnqueueReleaseGLObjects POclEnqueueReleaseGLObjects
 #define clGetGLContextInfoKHR POclGetGLContextInfoKHR
+#define clEnqueueAcquireExternalMemObjectsKHR POclEnqueueAcquireExternalMemObjectsKHR
+#define clEnqueueReleaseExternalMemObjectsKHR POclEnqueueReleaseExternalMemObjectsKHR
 
 #endif
@@ -209,7 +209,7 @@ ERROR:
     }
 
     if (((flags & CL_MEM_USE_HOST_PTR) == 0) && mem->mem_host_ptr)
-      POCL_MEM_FREE (mem->mem_host_ptr);
+      pocl_free_mem_host_ptr (mem);
 
     POCL_MEM_FREE (mem);
   }
@@ -0,0 +1,159 @@
+/* OpenCL runtime library: clCreateBufferWithProperties()
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "pocl_cl.h"
+#include "pocl_shared.h"
+#include "pocl_util.h"
+
+extern unsigned long buffer_c;
+
+/* Imports the dma-buf fd as a buffer that is a shared mapping of it. The
+   CPU devices use the mapping as a CL_MEM_USE_HOST_PTR buffer, so the
+   kernels access the exporter's memory without copies. */
+static cl_int
+pocl_import_dma_buf (cl_context context, cl_mem_flags flags, size_t size,
+                     int fd, cl_mem *mem_ret)
+{
+  cl_mem mem = NULL;
+  int errcode = CL_SUCCESS;
+  unsigned i;
+  int mapped_fd = -1;
+  void *ptr;
+
+  for (i = 0; i < context->num_devices; ++i)
+    POCL_RETURN_ERROR_ON (
+        (strstr (context->devices[i]->extensions,
+                 "cl_khr_external_memory_dma_buf")
+         == NULL),
+        CL_INVALID_OPERATION,
+        "device %s of the context cannot import dma-bufs\n",
+        context->devices[i]->long_name);
+
+  POCL_RETURN_ERROR_ON (
+      (flags
+       & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR
+          | CL_MEM_COPY_HOST_PTR)),
+      CL_INVALID_VALUE,
+      "the host_ptr flags cannot be used with an imported dma-buf\n");
+
+  POCL_RETURN_ERROR_ON ((fd < 0), CL_INVALID_VALUE,
+                        "the dma-buf fd (%i) is invalid\n", fd);
+
+#ifndef _WIN32
+  /* the dma-bufs report their size with lseek, the other fds might not */
+  off_t fd_pos = lseek (fd, 0, SEEK_CUR);
+  off_t fd_size = lseek (fd, 0, SEEK_END);
+  if (fd_pos >= 0)
+    lseek (fd, fd_pos, SEEK_SET);
+  POCL_RETURN_ERROR_ON ((fd_size > 0 && (size_t)fd_size < size),
+                        CL_INVALID_BUFFER_SIZE,
+                        "the buffer (%zu bytes) is bigger than the dma-buf "
+                        "(%zu bytes)\n",
+                        size, (size_t)fd_size);
+#endif
+
+  ptr = pocl_map_dma_buf (fd, size, !(flags & CL_MEM_READ_ONLY), &mapped_fd);
+  POCL_RETURN_ERROR_ON ((ptr == NULL), CL_INVALID_VALUE,
+                        "cannot map the dma-buf fd %i: %s\n", fd,
+                        strerror (errno));
+
+  mem = pocl_create_memobject (context, flags | CL_MEM_USE_HOST_PTR, size,
+                               CL_MEM_OBJECT_BUFFER, NULL, ptr, &errcode);
+  if (mem == NULL)
+    {
+      pocl_unmap_dma_buf (ptr, size, mapped_fd);
+      return errcode;
+    }
+  mem->is_external = CL_TRUE;
+  mem->external_fd = mapped_fd;
+  *mem_ret = mem;
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_mem CL_API_CALL POname (clCreateBufferWithProperties) (
+    cl_context context, const cl_mem_properties *properties,
+    cl_mem_flags flags, size_t size, void *host_ptr,
+    cl_int *errcode_ret) CL_API_SUFFIX__VERSION_3_0
+{
+  cl_mem mem = NULL;
+  int errcode = CL_SUCCESS;
+  int dma_buf_fd = -1;
+
+  POCL_GOTO_ERROR_COND ((!IS_CL_OBJECT_VALID (context)), CL_INVALID_CONTEXT);
+
+  if (properties != NULL)
+    {
+      const cl_mem_properties *p = properties;
+      for (; *p != 0; p += 2)
+        {
+          switch (*p)
+            {
+            case CL_EXTERNAL_MEMORY_HANDLE_DMA_BUF_KHR:
+              POCL_GOTO_ERROR_ON ((dma_buf_fd >= 0), CL_INVALID_PROPERTY,
+                                  "the dma-buf fd is given twice\n");
+              dma_buf_fd = (int)p[1];
+              break;
+            default:
+              POCL_GOTO_ERROR_ON (1, CL_INVALID_PROPERTY,
+                                  "unknown buffer property 0x%" PRIx64 "\n",
+                                  (uint64_t)*p);
+            }
+        }
+    }
+
+  if (dma_buf_fd < 0)
+    return POname (clCreateBuffer) (context, flags, size, host_ptr,
+                                    errcode_ret);
+
+  POCL_GOTO_ERROR_ON ((host_ptr != NULL), CL_INVALID_HOST_PTR,
+                      "host_ptr must be NULL for an imported dma-buf\n");
+
+  errcode = pocl_import_dma_buf (context, flags, size, dma_buf_fd, &mem);
+  if (errcode != CL_SUCCESS)
+    goto ERROR;
+
+  TP_CREATE_BUFFER (context->id, mem->id);
+
+  POname (clRetainContext) (context);
+
+  POCL_MSG_PRINT_MEMORY ("Imported dma-buf fd %i as Buffer ID %" PRIu64
+                         " / %p, MEM_HOST_PTR: %p, SIZE %zu, FLAGS %" PRIu64
+                         " \n",
+                         dma_buf_fd, mem->id, mem, mem->mem_host_ptr, size,
+                         flags);
+
+  POCL_ATOMIC_INC (buffer_c);
+
+ERROR:
+  if (errcode_ret)
+    *errcode_ret = errcode;
+
+  return mem;
+}
+POsym (clCreateBufferWithProperties)
@@ -0,0 +1,102 @@
+/* OpenCL runtime library: clCreateCommandBufferKHR
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_util.h"
+
+#include <string.h>
+
+CL_API_ENTRY cl_command_buffer_khr CL_API_CALL
+POname (clCreateCommandBufferKHR) (
+    cl_uint num_queues, const cl_command_queue *queues,
+    const cl_command_buffer_properties_khr *properties,
+    cl_int *errcode_ret) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_command_buffer_khr command_buffer = NULL;
+  cl_command_buffer_flags_khr flags = 0;
+  cl_uint num_properties = 0;
+  int errcode = CL_SUCCESS;
+
+  POCL_GOTO_ERROR_COND ((num_queues == 0 || queues == NULL),
+                        CL_INVALID_VALUE);
+
+  POCL_GOTO_ERROR_ON ((num_queues > 1), CL_INVALID_VALUE,
+                      "Command buffers of several queues are not "
+                      "supported\n");
+
+  POCL_GOTO_ERROR_COND ((!IS_CL_OBJECT_VALID (queues[0])),
+                        CL_INVALID_COMMAND_QUEUE);
+
+  if (properties != NULL)
+    {
+      const cl_command_buffer_properties_khr *p = properties;
+      while (*p != 0)
+        {
+          switch (*p)
+            {
+            case CL_COMMAND_BUFFER_FLAGS_KHR:
+              flags = (cl_command_buffer_flags_khr)p[1];
+              POCL_GOTO_ERROR_ON (
+                  (flags & ~(cl_command_buffer_flags_khr)
+                               CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR),
+                  CL_INVALID_VALUE, "Unknown command buffer flags\n");
+              break;
+            default:
+              POCL_GOTO_ERROR_ON (1, CL_INVALID_VALUE,
+                                  "Unknown command buffer property %lu\n",
+                                  (unsigned long)*p);
+            }
+          p += 2;
+        }
+      num_properties = (cl_uint)(p - properties) + 1;
+    }
+
+  command_buffer = (cl_command_buffer_khr)calloc (
+      1, sizeof (struct _cl_command_buffer_khr));
+  POCL_GOTO_ERROR_COND ((command_buffer == NULL), CL_OUT_OF_HOST_MEMORY);
+
+  POCL_INIT_OBJECT_NO_ICD (command_buffer);
+  command_buffer->context = queues[0]->context;
+  command_buffer->queue = queues[0];
+  command_buffer->flags = flags;
+  command_buffer->last_barrier = -1;
+  if (num_properties > 0)
+    {
+      command_buffer->properties
+          = (cl_command_buffer_properties_khr *)malloc (
+              num_properties * sizeof (cl_command_buffer_properties_khr));
+      memcpy (command_buffer->properties, properties,
+              num_properties * sizeof (cl_command_buffer_properties_khr));
+      command_buffer->num_properties = num_properties;
+    }
+  POname (clRetainCommandQueue) (queues[0]);
+
+  POCL_MSG_PRINT_GENERAL ("Created Command Buffer %" PRIu64
+                          " (%p) for CQ %" PRIu64 "\n",
+                          command_buffer->id, command_buffer, queues[0]->id);
+
+ERROR:
+  if (errcode_ret)
+    *errcode_ret = errcode;
+  return command_buffer;
+}
+POsym (clCreateCommandBufferKHR)
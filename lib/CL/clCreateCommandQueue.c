@@ -22,7 +22,7 @@
 */
 
 #include "pocl_cl.h"
-#include "pocl_cq_profiling.h"
+#include "pocl_tracing.h"
 #include "pocl_util.h"
 
 extern unsigned long queue_c;
@@ -54,7 +54,8 @@ POname(clCreateCommandQueue)(cl_context context,
   POCL_GOTO_ERROR_ON ((properties & (~all_properties)), CL_INVALID_VALUE,
                       "Unknown properties requested\n");
 
-  if (POCL_DEBUGGING_ON || pocl_cq_profiling_enabled)
+  /* the tracers need the time stamps */
+  if (POCL_DEBUGGING_ON || pocl_is_tracing_enabled ())
     properties |= CL_QUEUE_PROFILING_ENABLE;
 
   for (i=0; i<context->num_devices; i++)
@@ -84,6 +85,20 @@ POname(clCreateCommandQueue)(cl_context context,
   if ((properties & CL_QUEUE_HIDDEN) == 0)
     POname (clRetainContext) (context);
 
+  /* the hidden queues only carry migrations, which other commands wait
+     for, so they always submit at once */
+  if (device->ops->submit_batch && (properties & CL_QUEUE_HIDDEN) == 0)
+    {
+      int limit = pocl_get_int_option ("POCL_SUBMIT_BATCH_SIZE", 64);
+      command_queue->batch_limit = (limit > 0) ? (unsigned)limit : 0;
+      if (command_queue->batch_limit)
+        POCL_INIT_LOCK (command_queue->batch_lock);
+    }
+
+  command_queue->wait_spin_ns
+      = (cl_ulong)pocl_get_int_option ("POCL_WAIT_SPIN_USEC", 0) * 1000;
+  command_queue->wait_spin_window_ns = command_queue->wait_spin_ns;
+
   TP_CREATE_QUEUE (context->id, command_queue->id);
 
   errcode = CL_SUCCESS;
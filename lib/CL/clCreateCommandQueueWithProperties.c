@@ -29,12 +29,17 @@ POname(clCreateCommandQueueWithProperties)(cl_context context,
                                            const cl_queue_properties *properties,
                                            cl_int *errcode_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  unsigned i = 0;
+  unsigned i = 0, dev_i = 0;
   int errcode;
   cl_bool found = CL_FALSE;
   cl_command_queue_properties queue_props = 0;
   int queue_props_set = 0;
   cl_uint queue_size = 0;
+  cl_uint wait_spin_usec = 0;
+  int wait_spin_set = 0;
+  cl_queue_priority_khr priority = 0;
+  cl_queue_throttle_khr throttle = 0;
+  cl_command_queue queue;
   const cl_command_queue_properties valid_prop_flags =
       (CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
        | CL_QUEUE_PROFILING_ENABLE
@@ -48,7 +53,10 @@ POname(clCreateCommandQueueWithProperties)(cl_context context,
   for (i=0; i<context->num_devices; i++)
     {
       if (context->devices[i] == pocl_real_dev (device))
-        found = CL_TRUE;
+        {
+          found = CL_TRUE;
+          dev_i = i;
+        }
     }
 
   POCL_GOTO_ERROR_ON((found == CL_FALSE), CL_INVALID_DEVICE,
@@ -68,6 +76,37 @@ POname(clCreateCommandQueueWithProperties)(cl_context context,
           queue_size = (cl_uint)properties[i+1];
           i+=2;
           break;
+        case CL_QUEUE_WAIT_SPIN_USEC_POCL:
+          wait_spin_usec = (cl_uint)properties[i + 1];
+          wait_spin_set = 1;
+          i += 2;
+          break;
+        case CL_QUEUE_PRIORITY_KHR:
+          priority = (cl_queue_priority_khr)properties[i + 1];
+          POCL_GOTO_ERROR_ON (
+              (strstr (device->extensions, "cl_khr_priority_hints") == NULL),
+              CL_INVALID_QUEUE_PROPERTIES,
+              "The device does not support cl_khr_priority_hints\n");
+          POCL_GOTO_ERROR_ON ((priority != CL_QUEUE_PRIORITY_HIGH_KHR
+                               && priority != CL_QUEUE_PRIORITY_MED_KHR
+                               && priority != CL_QUEUE_PRIORITY_LOW_KHR),
+                              CL_INVALID_VALUE,
+                              "Invalid CL_QUEUE_PRIORITY_KHR value\n");
+          i += 2;
+          break;
+        case CL_QUEUE_THROTTLE_KHR:
+          throttle = (cl_queue_throttle_khr)properties[i + 1];
+          POCL_GOTO_ERROR_ON (
+              (strstr (device->extensions, "cl_khr_throttle_hints") == NULL),
+              CL_INVALID_QUEUE_PROPERTIES,
+              "The device does not support cl_khr_throttle_hints\n");
+          POCL_GOTO_ERROR_ON ((throttle != CL_QUEUE_THROTTLE_HIGH_KHR
+                               && throttle != CL_QUEUE_THROTTLE_MED_KHR
+                               && throttle != CL_QUEUE_THROTTLE_LOW_KHR),
+                              CL_INVALID_VALUE,
+                              "Invalid CL_QUEUE_THROTTLE_KHR value\n");
+          i += 2;
+          break;
         default:
           POCL_GOTO_ERROR_ON(1, CL_INVALID_VALUE, "Invalid values it properties\n");
         }
@@ -82,20 +121,70 @@ POname(clCreateCommandQueueWithProperties)(cl_context context,
           POCL_GOTO_ERROR_COND((queue_size > device->dev_queue_max_size),
                                CL_INVALID_QUEUE_PROPERTIES);
 
-         // create a device side queue
-         POCL_ABORT_UNIMPLEMENTED("Device side queue");
+          POCL_GOTO_ERROR_ON ((device->on_dev_queue_props == 0),
+                              CL_INVALID_QUEUE_PROPERTIES,
+                              "The device does not support device queues\n");
+
+          POCL_GOTO_ERROR_ON (
+              ((queue_props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0),
+              CL_INVALID_VALUE, "Device queues must be out-of-order\n");
         }
       else
-        POCL_GOTO_ERROR_ON((queue_size > 0), CL_INVALID_VALUE,
-                           "To specify queue size, you must use CL_QUEUE_ON_DEVICE in flags\n");
+        {
+          POCL_GOTO_ERROR_ON((queue_size > 0), CL_INVALID_VALUE,
+                             "To specify queue size, you must use CL_QUEUE_ON_DEVICE in flags\n");
+
+          POCL_GOTO_ERROR_ON ((queue_props & CL_QUEUE_ON_DEVICE_DEFAULT),
+                              CL_INVALID_VALUE,
+                              "CL_QUEUE_ON_DEVICE_DEFAULT requires "
+                              "CL_QUEUE_ON_DEVICE\n");
+        }
 
       /* validate flags */
       POCL_GOTO_ERROR_ON((queue_props & (!valid_prop_flags)), CL_INVALID_VALUE,
                          "CL_QUEUE_PROPERTIES contain invalid entries");
     }
 
-  // currently thhere's only support for host side queues.
-  return POname(clCreateCommandQueue)(context, device, queue_props, errcode_ret);
+  /* there is only one default device queue per device */
+  if (queue_props & CL_QUEUE_ON_DEVICE_DEFAULT)
+    {
+      POCL_LOCK_OBJ (context);
+      queue = context->default_device_queues[dev_i];
+      if (queue)
+        POname (clRetainCommandQueue) (queue);
+      POCL_UNLOCK_OBJ (context);
+      if (queue)
+        {
+          if (errcode_ret)
+            *errcode_ret = CL_SUCCESS;
+          return queue;
+        }
+    }
+
+  queue = POname (clCreateCommandQueue) (context, device, queue_props,
+                                         errcode_ret);
+  if (queue && wait_spin_set)
+    {
+      queue->wait_spin_ns = (cl_ulong)wait_spin_usec * 1000;
+      queue->wait_spin_window_ns = queue->wait_spin_ns;
+    }
+  if (queue)
+    {
+      queue->priority = priority;
+      queue->throttle = throttle;
+    }
+  if (queue && (queue_props & CL_QUEUE_ON_DEVICE))
+    {
+      queue->size = queue_size;
+      if (queue_props & CL_QUEUE_ON_DEVICE_DEFAULT)
+        {
+          POCL_LOCK_OBJ (context);
+          if (context->default_device_queues[dev_i] == NULL)
+            context->default_device_queues[dev_i] = queue;
+          POCL_UNLOCK_OBJ (context);
+        }
+    }
+  return queue;
 
 ERROR:
   if(errcode_ret)
@@ -41,6 +41,7 @@ context_set_properties (cl_context context,
   
   context->properties = NULL;
   context->gl_interop = CL_FALSE;
+  context->scheduling_weight = 1;
 
   /* verify if data in properties is valid
    * and set them */
@@ -94,6 +95,17 @@ context_set_properties (cl_context context,
               p += 2;
               break;
 
+            case CL_CONTEXT_SCHEDULING_WEIGHT_POCL:
+              if (p[1] <= 0 || p[1] > CL_UINT_MAX)
+                {
+                  POCL_MSG_ERR ("Invalid context scheduling weight: %ld\n",
+                                (long)p[1]);
+                  return CL_INVALID_PROPERTY;
+                }
+              context->scheduling_weight = (cl_uint)p[1];
+              p += 2;
+              break;
+
             default: 
               POCL_MSG_ERR("Unknown context property: %lu\n", (unsigned long)p[0]);
               return CL_INVALID_PROPERTY;
@@ -192,6 +204,11 @@ POname(clCreateContext)(const cl_context_properties * properties,
   POCL_GOTO_ERROR_COND ((context->default_queues == NULL),
                         CL_OUT_OF_HOST_MEMORY);
 
+  context->default_device_queues
+      = (cl_command_queue *)calloc (num_devices, sizeof (cl_command_queue));
+  POCL_GOTO_ERROR_COND ((context->default_device_queues == NULL),
+                        CL_OUT_OF_HOST_MEMORY);
+
   for (i = 0; i < context->num_devices; ++i)
     {
       cl_device_id dev = context->devices[i];
@@ -203,6 +220,15 @@ POname(clCreateContext)(const cl_context_properties * properties,
           dev->long_name);
     }
 
+  /* the expensive setup of the devices happens at their first use */
+  if (!pocl_offline_compile)
+    {
+      errcode = pocl_init_deferred_devices (context->num_devices,
+                                            context->devices);
+      POCL_GOTO_ERROR_ON ((errcode != CL_SUCCESS), CL_DEVICE_NOT_AVAILABLE,
+                          "Could not initialize the devices\n");
+    }
+
   pocl_init_mem_manager ();
 
   /* only required for online context */
@@ -243,6 +269,7 @@ ERROR:
       for (i = 0; i < NUM_OPENCL_IMAGE_TYPES; ++i)
         POCL_MEM_FREE (context->image_formats[i]);
       POCL_MEM_FREE (context->default_queues);
+      POCL_MEM_FREE (context->default_device_queues);
       POCL_MEM_FREE (context->devices);
       POCL_MEM_FREE (context->properties);
     }
@@ -34,7 +34,9 @@
 #include "pocl_file_util.h"
 #include "pocl_cache.h"
 #include "pocl_binary.h"
+#include "pocl_static_wg.h"
 #include "pocl_util.h"
+#include "pocl_shared.h"
 
 extern unsigned long kernel_c;
 
@@ -51,6 +53,8 @@ POname(clCreateKernel)(cl_program program,
 
   POCL_GOTO_ERROR_COND ((!IS_CL_OBJECT_VALID (program)), CL_INVALID_PROGRAM);
 
+  pocl_wait_program_build (program);
+
   POCL_GOTO_ERROR_ON((program->build_status == CL_BUILD_NONE),
     CL_INVALID_PROGRAM_EXECUTABLE, "You must call clBuildProgram first!"
       " (even for programs created with binaries)\n");
@@ -74,6 +78,16 @@ POname(clCreateKernel)(cl_program program,
                       "Can't find a kernel with name %s in this program\n",
                       kernel_name);
 
+  /* the metadata of the kernels of pocl binaries is read on their first
+     clCreateKernel */
+  POCL_LOCK_OBJ (program);
+  errcode = pocl_binary_load_kernel_metadata (program,
+                                              &program->kernel_meta[i]);
+  POCL_UNLOCK_OBJ (program);
+  POCL_GOTO_ERROR_ON ((errcode != CL_SUCCESS), errcode,
+                      "Could not load the metadata of kernel %s\n",
+                      kernel_name);
+
   kernel->meta = &program->kernel_meta[i];
   kernel->data = (void **)calloc (program->num_devices, sizeof (void *));
   kernel->name = kernel->meta->name;
@@ -104,6 +118,21 @@ POname(clCreateKernel)(cl_program program,
       assert (offset == kernel->meta->total_argument_storage_size);
     }
 
+  /* Kernels of pocl binaries are unpacked into the cache lazily, unless
+     their WG functions are linked into the application. */
+  for (i = 0; i < program->num_devices; ++i)
+    {
+      if (program->build_hash != NULL
+          && pocl_static_wg_has_kernel ((const char *)program->build_hash[i],
+                                        kernel_name))
+        continue;
+      errcode = pocl_binary_unpack_kernel (program, i, kernel_name);
+      POCL_GOTO_ERROR_ON ((errcode != CL_SUCCESS), errcode,
+                          "Could not unpack kernel %s from the pocl "
+                          "binary\n",
+                          kernel_name);
+    }
+
   TP_CREATE_KERNEL (kernel->context->id, kernel->id, kernel->name);
 
   for (i = 0; i < program->num_devices; ++i)
@@ -7,6 +7,7 @@
 #include "pocl_cl.h"
 #include "pocl_llvm.h"
 #include "pocl_intfn.h"
+#include "pocl_shared.h"
 
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -19,6 +20,8 @@ POname(clCreateKernelsInProgram)(cl_program      program ,
 
   POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (program)), CL_INVALID_PROGRAM);
 
+  pocl_wait_program_build (program);
+
   POCL_RETURN_ERROR_ON((program->build_status == CL_BUILD_NONE),
     CL_INVALID_PROGRAM_EXECUTABLE, "You must call clBuildProgram first!"
       " (even for programs created with binaries)\n");
@@ -21,16 +21,24 @@
    IN THE SOFTWARE.
 */
 
+#include "pocl_cl.h"
+#include "pocl_pipe.h"
+#include "pocl_shared.h"
 #include "pocl_util.h"
 
-/*  Minimal OpenCL 3.0 conformant implemenation of clCreatePipe where only
-    error handling has been implemented.
-*/
+extern unsigned long buffer_c;
+
+/* The pipes are buffers of a pocl_pipe_header followed by the packets,
+   which the kernels of the devices with pipe support access with the
+   builtins of lib/kernel/pipes.c. */
 CL_API_ENTRY cl_mem CL_API_CALL POname (clCreatePipe) (
     cl_context context, cl_mem_flags flags, cl_uint pipe_packet_size,
     cl_uint pipe_max_packets, const cl_pipe_properties *properties,
     cl_int *errcode_ret) CL_API_SUFFIX__VERSION_2_0
 {
+  cl_mem mem = NULL;
+  pocl_pipe_header *header;
+
   if (!IS_CL_OBJECT_VALID (context))
     {
       POCL_ERROR (CL_INVALID_CONTEXT);
@@ -39,12 +47,14 @@ CL_API_ENTRY cl_mem CL_API_CALL POname (clCreatePipe) (
   // Check if any device within the context supports pipes.
   unsigned i;
   cl_bool context_pipe_support = CL_FALSE;
+  cl_uint max_packet_size = 0;
   for (i = 0; i < context->num_devices; i++)
     {
       if (context->devices[i]->pipe_support == CL_TRUE)
         {
           context_pipe_support = CL_TRUE;
-          break;
+          if (context->devices[i]->max_pipe_packet_size > max_packet_size)
+            max_packet_size = context->devices[i]->max_pipe_packet_size;
         }
     }
 
@@ -72,14 +82,69 @@ CL_API_ENTRY cl_mem CL_API_CALL POname (clCreatePipe) (
       POCL_ERROR (CL_INVALID_VALUE);
     }
 
-  // This should not happend, but in case it does..
-  POCL_ABORT_UNIMPLEMENTED ("clCreatePipe has not been implemented");
+  POCL_GOTO_ERROR_ON ((pipe_packet_size == 0
+                       || pipe_packet_size > max_packet_size),
+                      CL_INVALID_PIPE_SIZE,
+                      "pipe_packet_size (%u) must be between 1 and "
+                      "CL_DEVICE_PIPE_MAX_PACKET_SIZE (%u)\n",
+                      pipe_packet_size, max_packet_size);
+
+  /* the counters of the ring buffer must be able to tell a full pipe from
+     an empty one */
+  POCL_GOTO_ERROR_ON ((pipe_max_packets == 0
+                       || pipe_max_packets > (cl_uint)INT32_MAX),
+                      CL_INVALID_PIPE_SIZE,
+                      "pipe_max_packets (%u) must be between 1 and %i\n",
+                      pipe_max_packets, INT32_MAX);
+
+  POCL_GOTO_ERROR_ON (((SIZE_MAX - sizeof (pocl_pipe_header))
+                           / pipe_packet_size
+                       < pipe_max_packets),
+                      CL_INVALID_PIPE_SIZE, "The pipe is too big\n");
+
+  mem = pocl_create_memobject (
+      context, flags,
+      sizeof (pocl_pipe_header) + (size_t)pipe_packet_size * pipe_max_packets,
+      CL_MEM_OBJECT_PIPE, NULL, NULL, &errcode);
+  if (mem == NULL)
+    goto ERROR;
+
+  /* the header is set up in the host copy, which the devices that share
+     the host memory use directly, and the others get migrated */
+  if (pocl_alloc_or_retain_mem_host_ptr (mem) != 0)
+    {
+      POCL_MEM_FREE (mem->device_ptrs);
+      POCL_MEM_FREE (mem);
+      POCL_GOTO_ERROR_ON (1, CL_OUT_OF_HOST_MEMORY,
+                          "Cannot allocate backing memory!\n");
+    }
+  header = (pocl_pipe_header *)mem->mem_host_ptr;
+  memset (header, 0, sizeof (pocl_pipe_header));
+  header->packet_size = pipe_packet_size;
+  header->max_packets = pipe_max_packets;
+  mem->mem_host_ptr_version = 1;
+  mem->latest_version = 1;
+
+  mem->is_pipe = CL_TRUE;
+  mem->pipe_packet_size = pipe_packet_size;
+  mem->pipe_max_packets = pipe_max_packets;
+
+  TP_CREATE_BUFFER (context->id, mem->id);
+
+  POname (clRetainContext) (context);
+
+  POCL_MSG_PRINT_MEMORY ("Created Pipe ID %" PRIu64 " / %p, MEM_HOST_PTR: %p, "
+                         "PACKET SIZE %u, MAX PACKETS %u\n",
+                         mem->id, mem, mem->mem_host_ptr, pipe_packet_size,
+                         pipe_max_packets);
+
+  POCL_ATOMIC_INC (buffer_c);
 
 ERROR:
   if (errcode_ret)
     {
       *errcode_ret = errcode;
     }
-  return NULL;
+  return mem;
 }
-POsym (clCreatePipe)
\ No newline at end of file
+POsym (clCreatePipe)
@@ -27,6 +27,7 @@
 #include "pocl_file_util.h"
 #include "pocl_llvm.h"
 #include "pocl_shared.h"
+#include "pocl_static_wg.h"
 #include "pocl_util.h"
 #include <string.h>
 
@@ -153,21 +154,28 @@ create_program_skeleton (cl_context context, cl_uint num_devices,
           memcpy (program->pocl_binaries[i], binaries[i], lengths[i]);
 
           pocl_binary_set_program_buildhash (program, i, binaries[i]);
-          int error = pocl_cache_create_program_cachedir
-            (program, i, NULL, 0, program_bc_path);
-          POCL_GOTO_ERROR_ON((error != 0), CL_BUILD_PROGRAM_FAILURE,
-                             "Could not create program cachedir");
-          POCL_GOTO_ERROR_ON(pocl_binary_deserialize (program, i),
-                             CL_INVALID_BINARY,
-                             "Could not unpack a pocl binary\n");
-
-          /* read program.bc if present; can be useful later */
-          if (pocl_exists (program_bc_path))
+          /* The programs whose WG functions are linked into the
+             application are not unpacked to the cache, and run without
+             their program.bc; their other kernels are still unpacked
+             when they are created. */
+          if (!pocl_static_wg_has_build ((const char *)program->build_hash[i]))
             {
-              uint64_t size = 0;
-              pocl_read_file (program_bc_path,
-                              (char **)(&program->binaries[i]), &size);
-              program->binary_sizes[i] = (size_t)size;
+              int error = pocl_cache_create_program_cachedir (
+                  program, i, NULL, 0, program_bc_path);
+              POCL_GOTO_ERROR_ON ((error != 0), CL_BUILD_PROGRAM_FAILURE,
+                                  "Could not create program cachedir");
+              POCL_GOTO_ERROR_ON (pocl_binary_deserialize (program, i),
+                                  CL_INVALID_BINARY,
+                                  "Could not unpack a pocl binary\n");
+
+              /* read program.bc if present; can be useful later */
+              if (pocl_exists (program_bc_path))
+                {
+                  uint64_t size = 0;
+                  pocl_read_file (program_bc_path,
+                                  (char **)(&program->binaries[i]), &size);
+                  program->binary_sizes[i] = (size_t)size;
+                }
             }
 
           if (binary_status != NULL)
@@ -62,27 +62,54 @@ CL_API_SUFFIX__VERSION_2_1
       "is not recognized as SPIR-V!\n");
 
 #ifdef ENABLE_SPIRV
-  /* convert and the SPIR-V to LLVM IR with spir triple */
-  POCL_MSG_PRINT_LLVM ("SPIR-V binary detected, converting to LLVM SPIR\n");
-
-  char program_bc_spirv[POCL_FILENAME_LENGTH];
-  char program_bc_temp[POCL_FILENAME_LENGTH];
-  pocl_cache_write_spirv (program_bc_spirv, (const char *)il,
-                          (uint64_t)length);
-  pocl_cache_tempname (program_bc_temp, ".bc", NULL);
-
-  char *args[]
-      = { LLVM_SPIRV, "-r", "-o", program_bc_temp, program_bc_spirv, NULL };
-
-  errcode = pocl_run_command (args);
-  POCL_GOTO_ERROR_ON ((errcode != 0), CL_INVALID_VALUE,
-                      "External command (llvm-spirv translator) failed!\n");
-
-  /* load LLVM SPIR binary. */
-  pocl_read_file (program_bc_temp, &content, &fsize);
-  POCL_GOTO_ERROR_ON ((content == NULL), CL_INVALID_VALUE,
-                      "Can't read converted bitcode file\n");
-  pocl_remove (program_bc_temp);
+  /* convert and the SPIR-V to LLVM IR with spir triple, unless the same
+   * module has been converted before */
+  char cached_bc[POCL_FILENAME_LENGTH];
+  int cacheable = (pocl_cache_spirv_bitcode_path (cached_bc, (const char *)il,
+                                                  length)
+                   == 0);
+  if (cacheable && pocl_exists (cached_bc))
+    {
+      pocl_read_file (cached_bc, &content, &fsize);
+      if (content != NULL)
+        POCL_MSG_PRINT_LLVM ("SPIR-V binary found in the cache: %s\n",
+                             cached_bc);
+    }
+
+  if (content == NULL)
+    {
+      POCL_MSG_PRINT_LLVM (
+          "SPIR-V binary detected, converting to LLVM SPIR\n");
+#ifdef HAVE_LLVM_SPIRV_LIB
+      errcode = pocl_llvm_spirv_to_bitcode (context, (const char *)il, length,
+                                            &content, &fsize);
+      POCL_GOTO_ERROR_ON ((errcode != 0), CL_INVALID_VALUE,
+                          "SPIR-V translation failed!\n");
+#else
+      char program_bc_spirv[POCL_FILENAME_LENGTH];
+      char program_bc_temp[POCL_FILENAME_LENGTH];
+      pocl_cache_write_spirv (program_bc_spirv, (const char *)il,
+                              (uint64_t)length);
+      pocl_cache_tempname (program_bc_temp, ".bc", NULL);
+
+      char *args[] = { LLVM_SPIRV,      "-r", "-o", program_bc_temp,
+                       program_bc_spirv, NULL };
+
+      errcode = pocl_run_command (args);
+      pocl_remove (program_bc_spirv);
+      POCL_GOTO_ERROR_ON ((errcode != 0), CL_INVALID_VALUE,
+                          "External command (llvm-spirv translator) "
+                          "failed!\n");
+
+      /* load LLVM SPIR binary. */
+      pocl_read_file (program_bc_temp, &content, &fsize);
+      POCL_GOTO_ERROR_ON ((content == NULL), CL_INVALID_VALUE,
+                          "Can't read converted bitcode file\n");
+      pocl_remove (program_bc_temp);
+#endif
+      if (cacheable)
+        pocl_write_file (cached_bc, content, fsize, 0, 1);
+    }
 #endif
 
   /* TODO should we create a program for all devices ?
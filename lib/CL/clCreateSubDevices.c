@@ -27,11 +27,55 @@
 #include "pocl_cl.h"
 
 
+/* Returns the per-CPU domain ids of the given affinity domain, or NULL
+   if the device doesn't know them. */
+static const unsigned *
+get_affinity_domain_map (cl_device_id dev, cl_device_affinity_domain domain)
+{
+  switch (domain)
+    {
+    case CL_DEVICE_AFFINITY_DOMAIN_NUMA:
+      return dev->cpu_numa_node;
+    case CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE:
+      return dev->cpu_l3_cache;
+    case CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE:
+      return dev->cpu_l2_cache;
+    case CL_DEVICE_AFFINITY_DOMAIN_CORE_KIND_POCL:
+      return dev->cpu_kind;
+    default:
+      return NULL;
+    }
+}
+
+/* Splits the CUs of dev into groups of consecutive CUs that belong to
+   the same domain, according to map. Stores the number of CUs of each
+   group into cu_counts (which must have room for max_compute_units entries)
+   and returns the number of groups. */
+static cl_uint
+split_by_affinity_domain (cl_device_id dev, const unsigned *map,
+                          cl_uint *cu_counts)
+{
+  unsigned first = dev->parent_device ? dev->core_start : 0;
+  unsigned prev = 0;
+  cl_uint num_groups = 0;
+  cl_uint i;
+
+  for (i = 0; i < dev->max_compute_units; ++i)
+    {
+      unsigned domain = map[(first + i) % dev->num_cpus];
+      if (i == 0 || domain != prev)
+        cu_counts[num_groups++] = 0;
+      ++cu_counts[num_groups - 1];
+      prev = domain;
+    }
+  return num_groups;
+}
+
 /* Creates an array of sub-devices that each reference a non-intersecting
    set of compute units within in_device, according to a partition scheme
    given by properties.
-   TODO we should actually pin the subdevices to specific cores,
-   and possibly correct the cache information accordingly.
+   The device drivers are responsible for pinning the compute units of
+   sub-devices created BY_AFFINITY_DOMAIN to their domain.
    */
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -47,6 +91,8 @@ POname(clCreateSubDevices)(cl_device_id in_device,
    // number of elements in (copies of) properties, including terminating null
    cl_uint num_props = 0;
    cl_uint i;
+   /* number of CUs of each sub-device, for BY_AFFINITY_DOMAIN */
+   cl_uint *domain_cus = NULL;
 
    POCL_GOTO_ERROR_COND ((!IS_CL_OBJECT_VALID (in_device)), CL_INVALID_DEVICE);
    POCL_GOTO_ERROR_COND((properties == NULL), CL_INVALID_VALUE);
@@ -74,9 +120,9 @@ POname(clCreateSubDevices)(cl_device_id in_device,
        "Device %s does not support the requested partition property\n",
        in_device->short_name);
 
-   /* Ok, it's a supported partition property, count the number of devices; currently,
-    * we only support EQUALLY and BY_COUNTS, which enumerate the number of devices
-    * differently */
+   /* Ok, it's a supported partition property, count the number of devices;
+    * currently, we support EQUALLY, BY_COUNTS and BY_AFFINITY_DOMAIN, which
+    * enumerate the number of devices differently */
    if (properties[0] == CL_DEVICE_PARTITION_EQUALLY)
      {
        /* error out if the number of CUs per device is 0 or bigger than the
@@ -112,6 +158,53 @@ POname(clCreateSubDevices)(cl_device_id in_device,
        num_props = count_devices
                    + 2; /* partition type, one spec per device, terminating 0 */
      }
+   else if (properties[0] == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN)
+     {
+       cl_device_affinity_domain domain
+           = (cl_device_affinity_domain)properties[1];
+       POCL_GOTO_ERROR_COND (properties[2] != 0, CL_INVALID_VALUE);
+
+       domain_cus = (cl_uint *)calloc (in_device->max_compute_units,
+                                       sizeof (cl_uint));
+       POCL_GOTO_ERROR_COND ((domain_cus == NULL), CL_OUT_OF_HOST_MEMORY);
+
+       if (domain == CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE)
+         {
+           /* the first domain, from the outermost, that actually splits
+            * the device into more than one sub-device */
+           const cl_device_affinity_domain order[]
+               = { CL_DEVICE_AFFINITY_DOMAIN_NUMA,
+                   CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE,
+                   CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE };
+           for (i = 0; i < sizeof (order) / sizeof (order[0]); ++i)
+             {
+               const unsigned *map
+                   = get_affinity_domain_map (in_device, order[i]);
+               if (map == NULL)
+                 continue;
+               count_devices
+                   = split_by_affinity_domain (in_device, map, domain_cus);
+               if (count_devices > 1)
+                 break;
+             }
+           POCL_GOTO_ERROR_ON ((count_devices < 2), CL_DEVICE_PARTITION_FAILED,
+                               "Device %s has no partitionable affinity "
+                               "domain left\n",
+                               in_device->short_name);
+         }
+       else
+         {
+           const unsigned *map = get_affinity_domain_map (in_device, domain);
+           POCL_GOTO_ERROR_ON (
+               ((in_device->affinity_domains & domain) == 0 || map == NULL),
+               CL_INVALID_VALUE,
+               "Device %s does not support affinity domain 0x%x\n",
+               in_device->short_name, (unsigned)domain);
+           count_devices
+               = split_by_affinity_domain (in_device, map, domain_cus);
+         }
+       num_props = 3; // partition type, affinity domain, terminating 0
+     }
    else
      {
        /* we end here if some of our devices claim to support a different
@@ -142,11 +235,16 @@ POname(clCreateSubDevices)(cl_device_id in_device,
        POCL_INIT_OBJECT (new_devs[i]);
 
        new_devs[i]->parent_device = in_device;
+       new_devs[i]->performance_state = 0;
 
-       new_devs[i]->max_sub_devices = new_devs[i]->max_compute_units
-           = (properties[0] == CL_DEVICE_PARTITION_EQUALLY
-                  ? properties[1]
-                  : properties[i + 1]);
+       if (domain_cus)
+         new_devs[i]->max_sub_devices = new_devs[i]->max_compute_units
+             = domain_cus[i];
+       else
+         new_devs[i]->max_sub_devices = new_devs[i]->max_compute_units
+             = (properties[0] == CL_DEVICE_PARTITION_EQUALLY
+                    ? properties[1]
+                    : properties[i + 1]);
 
        /* for devices with 1 CU, report zero subdevices and
         * no partitioning support. */
@@ -179,9 +277,11 @@ POname(clCreateSubDevices)(cl_device_id in_device,
    if (num_devices_ret)
      *num_devices_ret = count_devices;
 
+   POCL_MEM_FREE (domain_cus);
    return errcode;
 
 ERROR:
+  POCL_MEM_FREE (domain_cus);
   if (new_devs) {
     // release all objects
     for (i = 0; i < count_devices; ++i) {
@@ -0,0 +1,114 @@
+/* OpenCL runtime library: clEnqueueAcquireExternalMemObjectsKHR()
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_util.h"
+
+CL_API_ENTRY cl_int CL_API_CALL POname (clEnqueueAcquireExternalMemObjectsKHR) (
+    cl_command_queue command_queue, cl_uint num_mem_objects,
+    const cl_mem *mem_objects, cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event)
+    CL_API_SUFFIX__VERSION_3_0
+{
+  unsigned i, acquired = 0;
+  int errcode;
+  _cl_command_node *cmd = NULL;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_queue)),
+                          CL_INVALID_COMMAND_QUEUE);
+
+  POCL_RETURN_ERROR_COND ((num_mem_objects == 0), CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_COND ((mem_objects == NULL), CL_INVALID_VALUE);
+
+  errcode = pocl_check_event_wait_list (command_queue, num_events_in_wait_list,
+                                        event_wait_list);
+  if (errcode != CL_SUCCESS)
+    return errcode;
+
+  char *rdonly = (char *)alloca (num_mem_objects * sizeof (char));
+  cl_mem *copy = (cl_mem *)alloca (num_mem_objects * sizeof (cl_mem));
+
+  for (i = 0; i < num_mem_objects; ++i)
+    {
+      cl_mem mem = mem_objects[i];
+      POCL_GOTO_ERROR_COND ((!IS_CL_OBJECT_VALID (mem)),
+                            CL_INVALID_MEM_OBJECT);
+
+      POCL_GOTO_ERROR_COND ((mem->context != command_queue->context),
+                            CL_INVALID_CONTEXT);
+
+      POCL_GOTO_ERROR_ON ((!mem->is_external), CL_INVALID_MEM_OBJECT,
+                          "mem_obj is not an imported external memory\n");
+
+      POCL_LOCK_OBJ (mem);
+      if (mem->is_external_acquired)
+        {
+          POCL_UNLOCK_OBJ (mem);
+          POCL_GOTO_ERROR_ON (1, CL_INVALID_MEM_OBJECT,
+                              "mem_obj has ALREADY been acquired\n");
+        }
+      mem->is_external_acquired = 1;
+      ++acquired;
+      POCL_UNLOCK_OBJ (mem);
+
+      rdonly[i] = (mem->flags & CL_MEM_READ_ONLY) ? 1 : 0;
+      copy[i] = mem;
+    }
+
+  /* The exporter might have written the memory since the last release, so
+     the mapping becomes the latest content which the migration moves to
+     the device; the CPU devices use the mapping itself and copy nothing. */
+  for (i = 0; i < num_mem_objects; ++i)
+    {
+      POCL_LOCK_OBJ (copy[i]);
+      pocl_dma_buf_sync (copy[i], 1);
+      copy[i]->latest_version++;
+      copy[i]->mem_host_ptr_version = copy[i]->latest_version;
+      POCL_UNLOCK_OBJ (copy[i]);
+    }
+
+  errcode = pocl_create_command_migrate (
+      &cmd, command_queue, 0, event, num_events_in_wait_list,
+      event_wait_list, num_mem_objects, copy, rdonly);
+  if (errcode != CL_SUCCESS)
+    {
+      for (i = 0; i < num_mem_objects; ++i)
+        pocl_dma_buf_sync (copy[i], 0);
+      goto ERROR;
+    }
+
+  cmd->event->command_type = CL_COMMAND_ACQUIRE_EXTERNAL_MEM_OBJECTS_KHR;
+
+  pocl_command_enqueue (command_queue, cmd);
+
+  return CL_SUCCESS;
+
+ERROR:
+  for (i = 0; i < acquired; ++i)
+    {
+      POCL_LOCK_OBJ (mem_objects[i]);
+      mem_objects[i]->is_external_acquired = 0;
+      POCL_UNLOCK_OBJ (mem_objects[i]);
+    }
+  return errcode;
+}
+POsym (clEnqueueAcquireExternalMemObjectsKHR)
@@ -0,0 +1,272 @@
+/* OpenCL runtime library: clEnqueueCommandBufferKHR
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_util.h"
+
+#include <string.h>
+
+/* Fills a node created for a recorded command with the recorded command,
+   and copies what the node owns. */
+static void
+pocl_copy_recorded_command (_cl_command_node *node,
+                            const pocl_recorded_command *rec)
+{
+  node->command = rec->node.command;
+  node->program_device_i = rec->node.program_device_i;
+
+  switch (rec->node.type)
+    {
+    case CL_COMMAND_NDRANGE_KERNEL:
+      {
+        cl_kernel kernel = rec->node.command.run.kernel;
+        pocl_kernel_args_retain (node->command.run.args_snapshot);
+        POname (clRetainKernel) (kernel);
+        break;
+      }
+
+    case CL_COMMAND_FILL_BUFFER:
+      {
+        size_t pattern_size = rec->node.command.memfill.pattern_size;
+        void *p = pocl_aligned_malloc (pattern_size, pattern_size);
+        memcpy (p, rec->node.command.memfill.pattern, pattern_size);
+        node->command.memfill.pattern = p;
+        break;
+      }
+
+    case CL_COMMAND_BARRIER:
+      /* the recorded barriers only wait for commands of the command
+         buffer, these are in their wait lists already */
+      node->command.barrier.has_wait_list = 1;
+      break;
+    }
+}
+
+/* Enqueues the command buffer as one command, for a device that runs the
+   recorded commands itself. The command uses the buffers of all of them,
+   so they are migrated to the device before it. */
+static cl_int
+pocl_enqueue_command_buffer_node (cl_command_queue command_queue,
+                                  cl_command_buffer_khr command_buffer,
+                                  cl_uint num_events_in_wait_list,
+                                  const cl_event *event_wait_list,
+                                  cl_event *final_event)
+{
+  _cl_command_node *cmd = NULL;
+  cl_mem *buffers = NULL;
+  char *readonly_flags = NULL;
+  pocl_mem_range *write_ranges = NULL;
+  size_t num_buffers = 0, n = 0;
+  cl_uint i;
+  int errcode;
+
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    num_buffers += command_buffer->commands[i]->num_buffers;
+
+  if (num_buffers > 0)
+    {
+      buffers = (cl_mem *)malloc (num_buffers * sizeof (cl_mem));
+      readonly_flags = (char *)malloc (num_buffers);
+      write_ranges
+          = (pocl_mem_range *)malloc (num_buffers * sizeof (pocl_mem_range));
+      POCL_GOTO_ERROR_COND (
+          (buffers == NULL || readonly_flags == NULL || write_ranges == NULL),
+          CL_OUT_OF_HOST_MEMORY);
+    }
+
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    {
+      pocl_recorded_command *rec = command_buffer->commands[i];
+      memcpy (buffers + n, rec->buffers, rec->num_buffers * sizeof (cl_mem));
+      memcpy (readonly_flags + n, rec->readonly_flags, rec->num_buffers);
+      memcpy (write_ranges + n, rec->write_ranges,
+              rec->num_buffers * sizeof (pocl_mem_range));
+      n += rec->num_buffers;
+    }
+
+  errcode = pocl_create_command_ranges (
+      &cmd, command_queue, CL_COMMAND_COMMAND_BUFFER_KHR, final_event,
+      num_events_in_wait_list, event_wait_list, num_buffers, buffers,
+      readonly_flags, write_ranges);
+  if (errcode != CL_SUCCESS)
+    goto ERROR;
+
+  POCL_RETAIN_OBJECT (command_buffer);
+  cmd->command.command_buffer.command_buffer = command_buffer;
+  pocl_command_enqueue (command_queue, cmd);
+
+ERROR:
+  POCL_MEM_FREE (buffers);
+  POCL_MEM_FREE (readonly_flags);
+  POCL_MEM_FREE (write_ranges);
+  return errcode;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clEnqueueCommandBufferKHR) (cl_uint num_queues,
+                                    cl_command_queue *queues,
+                                    cl_command_buffer_khr command_buffer,
+                                    cl_uint num_events_in_wait_list,
+                                    const cl_event *event_wait_list,
+                                    cl_event *event) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_command_queue command_queue;
+  cl_event *events = NULL;
+  cl_event final_event = NULL;
+  _cl_command_node *cmd = NULL;
+  cl_device_id dev;
+  cl_uint i, j, num_created = 0;
+  int errcode;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_buffer)),
+                          CL_INVALID_COMMAND_BUFFER_KHR);
+
+  POCL_RETURN_ERROR_ON ((!command_buffer->finalized), CL_INVALID_OPERATION,
+                        "The command buffer is not finalized\n");
+
+  POCL_RETURN_ERROR_COND (((num_queues > 0 && queues == NULL)
+                           || (num_queues == 0 && queues != NULL)
+                           || num_queues > 1),
+                          CL_INVALID_VALUE);
+
+  command_queue = command_buffer->queue;
+  if (num_queues == 1)
+    {
+      POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (queues[0])),
+                              CL_INVALID_COMMAND_QUEUE);
+      /* the recorded commands refer to the memory of the device */
+      POCL_RETURN_ERROR_ON (
+          (queues[0]->device != command_queue->device
+           || queues[0]->properties != command_queue->properties),
+          CL_INCOMPATIBLE_COMMAND_QUEUE_KHR,
+          "The queue differs from the one the commands were recorded for\n");
+      command_queue = queues[0];
+    }
+
+  errcode = pocl_check_event_wait_list (command_queue, num_events_in_wait_list,
+                                        event_wait_list);
+  if (errcode != CL_SUCCESS)
+    return errcode;
+
+  POCL_LOCK_OBJ (command_buffer);
+  POCL_GOTO_ERROR_ON (
+      ((command_buffer->flags & CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR) == 0
+       && command_buffer->last_enqueue != NULL
+       && command_buffer->last_enqueue->status > CL_COMPLETE),
+      CL_INVALID_OPERATION,
+      "The command buffer is pending and not simultaneous use\n");
+
+  dev = command_queue->device;
+  if (command_buffer->num_commands > 0 && dev->ops->can_run_command_buffer
+      && dev->ops->can_run_command_buffer (dev, command_buffer))
+    {
+      errcode = pocl_enqueue_command_buffer_node (
+          command_queue, command_buffer, num_events_in_wait_list,
+          event_wait_list, &final_event);
+      if (errcode != CL_SUCCESS)
+        goto ERROR;
+      goto ENQUEUED;
+    }
+
+  if (command_buffer->num_commands > 0)
+    {
+      events = (cl_event *)malloc (command_buffer->num_commands
+                                   * sizeof (cl_event));
+      POCL_GOTO_ERROR_COND ((events == NULL), CL_OUT_OF_HOST_MEMORY);
+    }
+
+  /* the commands that wait for no other command of the buffer wait for
+     the event wait list */
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    {
+      pocl_recorded_command *rec = command_buffer->commands[i];
+      cl_uint num_wait = rec->num_sync_points;
+      const cl_event *wait = event_wait_list;
+      cl_event sync_wait[num_wait + 1];
+      cl_mem buffers[rec->num_buffers + 1];
+      char readonly_flags[rec->num_buffers + 1];
+      pocl_mem_range write_ranges[rec->num_buffers + 1];
+
+      if (num_wait > 0)
+        {
+          for (j = 0; j < num_wait; ++j)
+            sync_wait[j] = events[rec->sync_points[j]];
+          wait = sync_wait;
+        }
+      else
+        num_wait = num_events_in_wait_list;
+
+      /* pocl_create_command_ranges sorts the buffers in place */
+      memcpy (buffers, rec->buffers, rec->num_buffers * sizeof (cl_mem));
+      memcpy (readonly_flags, rec->readonly_flags, rec->num_buffers);
+      memcpy (write_ranges, rec->write_ranges,
+              rec->num_buffers * sizeof (pocl_mem_range));
+
+      errcode = pocl_create_command_ranges (
+          &cmd, command_queue,
+          (rec->node.type == CL_COMMAND_BARRIER ? CL_COMMAND_MARKER
+                                                : rec->node.type),
+          &events[i], num_wait, wait, rec->num_buffers, buffers,
+          readonly_flags, write_ranges);
+      if (errcode != CL_SUCCESS)
+        goto ERROR;
+      ++num_created;
+
+      pocl_copy_recorded_command (cmd, rec);
+      pocl_command_enqueue (command_queue, cmd);
+    }
+
+  /* the event of the whole command buffer */
+  if (command_buffer->num_commands > 0)
+    errcode = pocl_create_command (&cmd, command_queue, CL_COMMAND_MARKER,
+                                   &final_event, command_buffer->num_commands,
+                                   events, 0, NULL, NULL);
+  else
+    errcode = pocl_create_command (&cmd, command_queue, CL_COMMAND_MARKER,
+                                   &final_event, num_events_in_wait_list,
+                                   event_wait_list, 0, NULL, NULL);
+  if (errcode != CL_SUCCESS)
+    goto ERROR;
+
+  final_event->command_type = CL_COMMAND_COMMAND_BUFFER_KHR;
+  cmd->command.marker.data = command_queue->device->data;
+  cmd->command.marker.has_wait_list = 1;
+  pocl_command_enqueue (command_queue, cmd);
+
+ENQUEUED:
+  if (command_buffer->last_enqueue)
+    POname (clReleaseEvent) (command_buffer->last_enqueue);
+  command_buffer->last_enqueue = final_event;
+  if (event)
+    {
+      POname (clRetainEvent) (final_event);
+      *event = final_event;
+    }
+
+ERROR:
+  POCL_UNLOCK_OBJ (command_buffer);
+  for (i = 0; i < num_created; ++i)
+    POname (clReleaseEvent) (events[i]);
+  POCL_MEM_FREE (events);
+  return errcode;
+}
+POsym (clEnqueueCommandBufferKHR)
@@ -27,17 +27,15 @@
 #include <assert.h>
 #include "pocl_util.h"
 
-CL_API_ENTRY cl_int CL_API_CALL
-POname(clEnqueueCopyBuffer)(cl_command_queue command_queue,
-                            cl_mem src_buffer,
-                            cl_mem dst_buffer,
-                            size_t src_offset,
-                            size_t dst_offset,
-                            size_t size,
-                            cl_uint num_events_in_wait_list,
-                            const cl_event *event_wait_list,
-                            cl_event *event) 
-CL_API_SUFFIX__VERSION_1_0
+cl_int
+pocl_copy_buffer_common (cl_command_buffer_khr command_buffer,
+                         cl_command_queue command_queue, cl_mem src_buffer,
+                         cl_mem dst_buffer, size_t src_offset,
+                         size_t dst_offset, size_t size,
+                         cl_uint num_items_in_wait_list,
+                         const cl_event *event_wait_list, cl_event *event,
+                         const cl_sync_point_khr *sync_point_wait_list,
+                         cl_sync_point_khr *sync_point)
 {
   cl_device_id device;
   unsigned i;
@@ -80,10 +78,13 @@ CL_API_SUFFIX__VERSION_1_0
 
   POCL_RETURN_ERROR_COND((size == 0), CL_INVALID_VALUE);
 
-  errcode = pocl_check_event_wait_list (command_queue, num_events_in_wait_list,
-                                        event_wait_list);
-  if (errcode != CL_SUCCESS)
-    return errcode;
+  if (command_buffer == NULL)
+    {
+      errcode = pocl_check_event_wait_list (
+          command_queue, num_items_in_wait_list, event_wait_list);
+      if (errcode != CL_SUCCESS)
+        return errcode;
+    }
 
   if (pocl_buffers_boundcheck(src_buffer, dst_buffer, src_offset,
         dst_offset, size) != CL_SUCCESS) return CL_INVALID_VALUE;
@@ -95,13 +96,20 @@ CL_API_SUFFIX__VERSION_1_0
 
   cl_mem buffers[3] = { src_buffer, dst_buffer, NULL };
   char rdonly[] = { 1, 0, 1 };
+  pocl_mem_range ranges[3] = { { 0, 0 }, { dst_offset, size }, { 0, 0 } };
   if (src_buffer->size_buffer != NULL)
     buffers[2] = src_buffer->size_buffer;
 
-  errcode
-      = pocl_create_command (&cmd, command_queue, CL_COMMAND_COPY_BUFFER,
-                             event, num_events_in_wait_list, event_wait_list,
-                             (buffers[2] == NULL ? 2 : 3), buffers, rdonly);
+  if (command_buffer == NULL)
+    errcode = pocl_create_command_ranges (
+        &cmd, command_queue, CL_COMMAND_COPY_BUFFER, event,
+        num_items_in_wait_list, event_wait_list,
+        (buffers[2] == NULL ? 2 : 3), buffers, rdonly, ranges);
+  else
+    errcode = pocl_create_recorded_command (
+        &cmd, command_buffer, command_queue, CL_COMMAND_COPY_BUFFER,
+        num_items_in_wait_list, sync_point_wait_list,
+        (buffers[2] == NULL ? 2 : 3), buffers, rdonly, ranges);
 
   if (errcode != CL_SUCCESS)
     return errcode;
@@ -119,11 +127,32 @@ CL_API_SUFFIX__VERSION_1_0
     {
       cmd->command.copy.src_content_size = src_buffer->size_buffer;
       cmd->command.copy.src_content_size_mem_id
-          = &src_buffer->size_buffer->device_ptrs[device->dev_id];
+          = &src_buffer->size_buffer->device_ptrs[device->global_mem_id];
     }
 
-  pocl_command_enqueue(command_queue, cmd);
+  if (command_buffer == NULL)
+    pocl_command_enqueue (command_queue, cmd);
+  else
+    pocl_command_record (command_buffer, cmd, sync_point);
 
   return CL_SUCCESS;
 }
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname(clEnqueueCopyBuffer)(cl_command_queue command_queue,
+                            cl_mem src_buffer,
+                            cl_mem dst_buffer,
+                            size_t src_offset,
+                            size_t dst_offset,
+                            size_t size,
+                            cl_uint num_events_in_wait_list,
+                            const cl_event *event_wait_list,
+                            cl_event *event) 
+CL_API_SUFFIX__VERSION_1_0
+{
+  return pocl_copy_buffer_common (NULL, command_queue, src_buffer, dst_buffer,
+                                  src_offset, dst_offset, size,
+                                  num_events_in_wait_list, event_wait_list,
+                                  event, NULL, NULL);
+}
 POsym(clEnqueueCopyBuffer)
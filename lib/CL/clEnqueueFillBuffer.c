@@ -24,17 +24,15 @@
 #include "pocl_util.h"
 #include <string.h>
 
-extern CL_API_ENTRY cl_int CL_API_CALL
-POname(clEnqueueFillBuffer)(cl_command_queue  command_queue,
-                           cl_mem            buffer,
-                           const void *      pattern,
-                           size_t            pattern_size,
-                           size_t            offset,
-                           size_t            size,
-                           cl_uint           num_events_in_wait_list,
-                           const cl_event*   event_wait_list,
-                           cl_event*         event)
-CL_API_SUFFIX__VERSION_1_2
+cl_int
+pocl_fill_buffer_common (cl_command_buffer_khr command_buffer,
+                         cl_command_queue command_queue, cl_mem buffer,
+                         const void *pattern, size_t pattern_size,
+                         size_t offset, size_t size,
+                         cl_uint num_items_in_wait_list,
+                         const cl_event *event_wait_list, cl_event *event,
+                         const cl_sync_point_khr *sync_point_wait_list,
+                         cl_sync_point_khr *sync_point)
 {
   int errcode = CL_SUCCESS;
   _cl_command_node *cmd = NULL;
@@ -51,10 +49,13 @@ CL_API_SUFFIX__VERSION_1_2
   POCL_RETURN_ERROR_ON((command_queue->context != buffer->context), CL_INVALID_CONTEXT,
                        "buffer and command_queue are not from the same context\n");
 
-  errcode = pocl_check_event_wait_list (command_queue, num_events_in_wait_list,
-                                        event_wait_list);
-  if (errcode != CL_SUCCESS)
-    return errcode;
+  if (command_buffer == NULL)
+    {
+      errcode = pocl_check_event_wait_list (
+          command_queue, num_items_in_wait_list, event_wait_list);
+      if (errcode != CL_SUCCESS)
+        return errcode;
+    }
 
   errcode = pocl_buffer_boundcheck(buffer, offset, size);
   if (errcode != CL_SUCCESS)
@@ -86,10 +87,17 @@ CL_API_SUFFIX__VERSION_1_2
                         "buffer is larger than device's MAX_MEM_ALLOC_SIZE\n");
 
   char rdonly = 0;
-
-  errcode = pocl_create_command (&cmd, command_queue, CL_COMMAND_FILL_BUFFER,
-                                 event, num_events_in_wait_list,
-                                 event_wait_list, 1, &buffer, &rdonly);
+  pocl_mem_range range = { offset, size };
+
+  if (command_buffer == NULL)
+    errcode = pocl_create_command_ranges (
+        &cmd, command_queue, CL_COMMAND_FILL_BUFFER, event,
+        num_items_in_wait_list, event_wait_list, 1, &buffer, &rdonly, &range);
+  else
+    errcode = pocl_create_recorded_command (
+        &cmd, command_buffer, command_queue, CL_COMMAND_FILL_BUFFER,
+        num_items_in_wait_list, sync_point_wait_list, 1, &buffer, &rdonly,
+        &range);
   if (errcode != CL_SUCCESS)
     return errcode;
 
@@ -102,9 +110,30 @@ CL_API_SUFFIX__VERSION_1_2
   cmd->command.memfill.pattern = p;
   cmd->command.memfill.pattern_size = pattern_size;
 
-  pocl_command_enqueue(command_queue, cmd);
+  if (command_buffer == NULL)
+    pocl_command_enqueue (command_queue, cmd);
+  else
+    pocl_command_record (command_buffer, cmd, sync_point);
 
   return CL_SUCCESS;
 
 }
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+POname(clEnqueueFillBuffer)(cl_command_queue  command_queue,
+                           cl_mem            buffer,
+                           const void *      pattern,
+                           size_t            pattern_size,
+                           size_t            offset,
+                           size_t            size,
+                           cl_uint           num_events_in_wait_list,
+                           const cl_event*   event_wait_list,
+                           cl_event*         event)
+CL_API_SUFFIX__VERSION_1_2
+{
+  return pocl_fill_buffer_common (NULL, command_queue, buffer, pattern,
+                                  pattern_size, offset, size,
+                                  num_events_in_wait_list, event_wait_list,
+                                  event, NULL, NULL);
+}
 POsym(clEnqueueFillBuffer)
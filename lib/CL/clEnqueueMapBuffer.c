@@ -124,10 +124,11 @@ POname(clEnqueueMapBuffer)(cl_command_queue command_queue,
     goto ERROR;
 
   char rdonly = (map_flags & CL_MAP_READ);
+  pocl_mem_range range = { offset, size };
 
-  errcode = pocl_create_command (&cmd, command_queue, CL_COMMAND_MAP_BUFFER,
-                                 event, num_events_in_wait_list,
-                                 event_wait_list, 1, &buffer, &rdonly);
+  errcode = pocl_create_command_ranges (
+      &cmd, command_queue, CL_COMMAND_MAP_BUFFER, event,
+      num_events_in_wait_list, event_wait_list, 1, &buffer, &rdonly, &range);
 
   if (errcode != CL_SUCCESS)
       goto ERROR;
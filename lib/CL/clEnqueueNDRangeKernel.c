@@ -23,11 +23,11 @@
 */
 
 #include "config.h"
+#include "pocl_autotune.h"
 #include "pocl_binary.h"
 #include "pocl_cache.h"
 #include "pocl_cl.h"
 #include "pocl_context.h"
-#include "pocl_cq_profiling.h"
 #include "pocl_llvm.h"
 #include "pocl_local_size.h"
 #include "pocl_util.h"
@@ -45,16 +45,73 @@
 
 //#define DEBUG_NDRANGE
 
-CL_API_ENTRY cl_int CL_API_CALL
-POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
-                       cl_kernel kernel,
-                       cl_uint work_dim,
-                       const size_t *global_work_offset,
-                       const size_t *global_work_size,
-                       const size_t *local_work_size,
-                       cl_uint num_events_in_wait_list,
-                       const cl_event *event_wait_list,
-                       cl_event *event) CL_API_SUFFIX__VERSION_1_0
+/* For the devices that run edge work-groups: when a global size isn't a
+ * multiple of the preferred WG size multiple, the local size optimizer can
+ * only pick its (possibly tiny) divisors. If the kernel can't tell the edge
+ * WGs apart, optimizes for the global size rounded up to the multiple
+ * instead, and keeps that if it gives larger work-groups. */
+static int
+nonuniform_local_size (cl_device_id dev, cl_kernel kernel,
+                       const size_t *global, size_t *local)
+{
+  size_t multiple = dev->preferred_wg_size_multiple;
+  size_t padded[3], padded_local[3];
+  int pad = 0;
+  unsigned d;
+
+  if (!dev->edge_work_groups || !kernel->meta->nonuniform_safe
+      || multiple < 2)
+    return 0;
+  if (kernel->program->compiler_options != NULL
+      && strstr (kernel->program->compiler_options,
+                 "-cl-uniform-work-group-size"))
+    return 0;
+
+  for (d = 0; d < 3; ++d)
+    {
+      padded[d] = global[d];
+      if (global[d] > multiple && global[d] % multiple != 0)
+        {
+          padded[d] = (global[d] + multiple - 1) / multiple * multiple;
+          pad = 1;
+        }
+    }
+  if (!pad)
+    return 0;
+
+  if (dev->ops->compute_local_size)
+    dev->ops->compute_local_size (dev, kernel, padded[0], padded[1],
+                                  padded[2], &padded_local[0],
+                                  &padded_local[1], &padded_local[2]);
+  else
+    pocl_default_local_size_optimizer (dev, kernel, padded[0], padded[1],
+                                       padded[2], &padded_local[0],
+                                       &padded_local[1], &padded_local[2]);
+
+  for (d = 0; d < 3; ++d)
+    padded_local[d] = min (padded_local[d], global[d]);
+  if (padded_local[0] * padded_local[1] * padded_local[2]
+      <= local[0] * local[1] * local[2])
+    return 0;
+
+  for (d = 0; d < 3; ++d)
+    local[d] = padded_local[d];
+  POCL_MSG_PRINT_INFO ("Kernel %s runs with edge work-groups\n",
+                       kernel->name);
+  return 1;
+}
+
+/* With split_part, the command is a part of a split NDRange and the
+ * buffers it writes get no new version, see pocl_gather_mem_slices. */
+static cl_int
+ndrange_kernel (cl_command_buffer_khr command_buffer,
+                cl_command_queue command_queue, cl_kernel kernel,
+                cl_uint work_dim, const size_t *global_work_offset,
+                const size_t *global_work_size, const size_t *local_work_size,
+                cl_uint num_items_in_wait_list,
+                const cl_event *event_wait_list, cl_event *event,
+                const cl_sync_point_khr *sync_point_wait_list,
+                cl_sync_point_khr *sync_point, int split_part)
 {
   size_t offset_x, offset_y, offset_z;
   size_t global_x, global_y, global_z;
@@ -69,10 +126,14 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
    * since we are going to access them repeatedly */
   size_t max_group_size;
 
-  unsigned i, j;
+  unsigned i;
   int errcode = 0;
   cl_device_id realdev = NULL;
   _cl_command_node *command_node;
+  pocl_autotune_entry *autotune_entry = NULL;
+  int autotune_candidate = -1;
+  /* set if the last WGs of a dimension are smaller, see edge_size */
+  int nonuniform = 0;
 
   /* no need for malloc, pocl_create_event will memcpy anyway.
    * num_args is the absolute max needed */
@@ -81,26 +142,26 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   size_t memobj_count = 0;
   char *readonly_flag_list
       = (char *)alloca (kernel->meta->num_args * sizeof (char));
+  /* a kernel can only write the subbuffer it gets of a buffer */
+  pocl_mem_range *write_range_list = (pocl_mem_range *)alloca (
+      kernel->meta->num_args * sizeof (pocl_mem_range));
 
   POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_queue)),
                           CL_INVALID_COMMAND_QUEUE);
 
   POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (kernel)), CL_INVALID_KERNEL);
 
-  /* alloc from stack to avoid malloc. num_args is the absolute max needed */
-  cl_mem mem_list[kernel->meta->num_args + 1];
-  /* reserve space for potential buffer migrate events */
-  cl_event new_event_wait_list[num_events_in_wait_list + kernel->meta->num_args
-                               + 1];
-
   POCL_RETURN_ERROR_ON((command_queue->context != kernel->context),
     CL_INVALID_CONTEXT,
     "kernel and command_queue are not from the same context\n");
 
-  errcode = pocl_check_event_wait_list (command_queue, num_events_in_wait_list,
-                                        event_wait_list);
-  if (errcode != CL_SUCCESS)
-    return errcode;
+  if (command_buffer == NULL)
+    {
+      errcode = pocl_check_event_wait_list (
+          command_queue, num_items_in_wait_list, event_wait_list);
+      if (errcode != CL_SUCCESS)
+        return errcode;
+    }
 
   POCL_RETURN_ERROR_COND((work_dim < 1), CL_INVALID_WORK_DIMENSION);
   POCL_RETURN_ERROR_ON(
@@ -200,22 +261,45 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   else if (local_work_size == NULL)
     {
       if (realdev->ops->compute_local_size)
-        realdev->ops->compute_local_size (realdev, global_x, global_y,
-                                          global_z, &local_x, &local_y,
-                                          &local_z);
+        realdev->ops->compute_local_size (realdev, kernel, global_x,
+                                          global_y, global_z, &local_x,
+                                          &local_y, &local_z);
       else
-        pocl_default_local_size_optimizer (realdev, global_x, global_y,
-                                           global_z, &local_x, &local_y,
-                                           &local_z);
+        pocl_default_local_size_optimizer (realdev, kernel, global_x,
+                                           global_y, global_z, &local_x,
+                                           &local_y, &local_z);
+
+      if (command_buffer == NULL && !split_part)
+        {
+          size_t global[3] = { global_x, global_y, global_z };
+          size_t local[3] = { local_x, local_y, local_z };
+          nonuniform = nonuniform_local_size (realdev, kernel, global, local);
+          local_x = local[0];
+          local_y = local[1];
+          local_z = local[2];
+        }
+
+      if (pocl_autotune_enabled && command_buffer == NULL && !split_part
+          && !nonuniform)
+        {
+          size_t global[3] = { global_x, global_y, global_z };
+          size_t local[3] = { local_x, local_y, local_z };
+          autotune_candidate
+              = pocl_autotune_local_size (kernel, command_queue, work_dim,
+                                          global, local, &autotune_entry);
+          local_x = local[0];
+          local_y = local[1];
+          local_z = local[2];
+        }
     }
 
   POCL_MSG_PRINT_INFO("Queueing kernel %s with local size %u x %u x %u group "
                       "sizes %u x %u x %u...\n",
                       kernel->name,
                       (unsigned)local_x, (unsigned)local_y, (unsigned)local_z,
-                      (unsigned)(global_x / local_x),
-                      (unsigned)(global_y / local_y),
-                      (unsigned)(global_z / local_z));
+                      (unsigned)((global_x + local_x - 1) / local_x),
+                      (unsigned)((global_y + local_y - 1) / local_y),
+                      (unsigned)((global_z + local_z - 1) / local_z));
 
   assert (local_x * local_y * local_z <= max_group_size);
   assert (local_x <= max_local_x);
@@ -223,9 +307,9 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   assert (local_z <= max_local_z);
 
   /* See TODO above for 'local must divide global' */
-  assert (global_x % local_x == 0);
-  assert (global_y % local_y == 0);
-  assert (global_z % local_z == 0);
+  assert (nonuniform || global_x % local_x == 0);
+  assert (nonuniform || global_y % local_y == 0);
+  assert (nonuniform || global_z % local_z == 0);
 
   for (i = 0; i < kernel->meta->num_args; ++i)
     {
@@ -264,7 +348,9 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
                   i);
             }
 
-          if (al->is_readonly || (buf->flags & CL_MEM_READ_ONLY))
+          if (split_part)
+            readonly_flag_list[memobj_count] = 1;
+          else if (al->is_readonly || (buf->flags & CL_MEM_READ_ONLY))
             {
               if (al->is_readonly == 0)
                 POCL_MSG_WARN ("readonly buffer used as kernel arg, but arg "
@@ -274,18 +360,34 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
           else
             readonly_flag_list[memobj_count] = 0;
 
+          write_range_list[memobj_count].offset = al->offset;
+          write_range_list[memobj_count].size
+              = (a->type == POCL_ARG_TYPE_IMAGE ? 0 : al->sub_buffer_size);
           memobj_list[memobj_count++] = buf;
         }
     }
 
-  errcode = pocl_create_command (
-      &command_node, command_queue, CL_COMMAND_NDRANGE_KERNEL, event,
-      num_events_in_wait_list, event_wait_list, memobj_count, memobj_list,
-      readonly_flag_list);
+  /* Snapshot the currently set kernel arguments because the same kernel
+     object can be reused for new launches with different arguments. */
+  pocl_kernel_args *args = pocl_kernel_args_snapshot (kernel);
+  POCL_RETURN_ERROR_COND ((args == NULL), CL_OUT_OF_HOST_MEMORY);
+
+  if (command_buffer == NULL)
+    errcode = pocl_create_command_ranges (
+        &command_node, command_queue, CL_COMMAND_NDRANGE_KERNEL, event,
+        num_items_in_wait_list, event_wait_list, memobj_count, memobj_list,
+        readonly_flag_list, write_range_list);
+  else
+    errcode = pocl_create_recorded_command (
+        &command_node, command_buffer, command_queue,
+        CL_COMMAND_NDRANGE_KERNEL, num_items_in_wait_list,
+        sync_point_wait_list, memobj_count, memobj_list, readonly_flag_list,
+        write_range_list);
 
   if (errcode != CL_SUCCESS)
     {
       POCL_MSG_ERR ("Failed to create command: %i\n", errcode);
+      pocl_kernel_args_release (args);
       return errcode;
     }
 
@@ -295,9 +397,15 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   command_node->command.run.pc.local_size[1] = local_y;
   command_node->command.run.pc.local_size[2] = local_z;
   command_node->command.run.pc.work_dim = work_dim;
-  command_node->command.run.pc.num_groups[0] = global_x / local_x;
-  command_node->command.run.pc.num_groups[1] = global_y / local_y;
-  command_node->command.run.pc.num_groups[2] = global_z / local_z;
+  command_node->command.run.pc.num_groups[0]
+      = (global_x + local_x - 1) / local_x;
+  command_node->command.run.pc.num_groups[1]
+      = (global_y + local_y - 1) / local_y;
+  command_node->command.run.pc.num_groups[2]
+      = (global_z + local_z - 1) / local_z;
+  command_node->command.run.edge_size[0] = global_x % local_x;
+  command_node->command.run.edge_size[1] = global_y % local_y;
+  command_node->command.run.edge_size[2] = global_z % local_z;
   command_node->command.run.pc.global_offset[0] = offset_x;
   command_node->command.run.pc.global_offset[1] = offset_y;
   command_node->command.run.pc.global_offset[2] = offset_z;
@@ -312,47 +420,76 @@ POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
   command_node->program_device_i = program_dev_i;
   command_node->command.run.hash = kernel->meta->build_hash[program_dev_i];
 
-  /* Copy the currently set kernel arguments because the same kernel
-     object can be reused for new launches with different arguments. */
-  command_node->command.run.arguments =
-    (struct pocl_argument *) malloc ((kernel->meta->num_args) *
-                                     sizeof (struct pocl_argument));
-
-  for (i = 0; i < kernel->meta->num_args; ++i)
-    {
-      struct pocl_argument *arg = &command_node->command.run.arguments[i];
-      memcpy (arg, &kernel->dyn_arguments[i], sizeof (pocl_argument));
-
-      if (arg->value != NULL)
-        {
-          size_t arg_alloc_size = arg->size;
-          assert (arg_alloc_size > 0);
-          /* FIXME: this is a cludge to determine an acceptable alignment,
-           * we should probably extract the argument alignment from the
-           * LLVM bytecode during kernel header generation. */
-          size_t arg_alignment = pocl_size_ceil2 (arg_alloc_size);
-          if (arg_alignment >= MAX_EXTENDED_ALIGNMENT)
-            arg_alignment = MAX_EXTENDED_ALIGNMENT;
-          if (arg_alloc_size < arg_alignment)
-            arg_alloc_size = arg_alignment;
-
-          arg->value = pocl_aligned_malloc (arg_alignment, arg_alloc_size);
-          memcpy (arg->value, kernel->dyn_arguments[i].value, arg->size);
-        }
-    }
+  command_node->command.run.args_snapshot = args;
+  command_node->command.run.arguments = args->arguments;
 
   command_node->next = NULL;
 
   POname(clRetainKernel) (kernel);
 
-  if (pocl_cq_profiling_enabled)
+  if (command_buffer != NULL)
     {
-      pocl_cq_profiling_register_event (command_node->event);
-      POname(clRetainKernel) (kernel);
-      command_node->event->meta_data->kernel = kernel;
+      pocl_command_record (command_buffer, command_node, sync_point);
+      return CL_SUCCESS;
     }
 
+  if (autotune_candidate >= 0)
+    pocl_autotune_measure (kernel, autotune_entry, autotune_candidate,
+                           command_node->event);
+
   pocl_command_enqueue (command_queue, command_node);
   return CL_SUCCESS;
 }
+
+cl_int
+pocl_ndrange_kernel_common (cl_command_buffer_khr command_buffer,
+                            cl_command_queue command_queue, cl_kernel kernel,
+                            cl_uint work_dim,
+                            const size_t *global_work_offset,
+                            const size_t *global_work_size,
+                            const size_t *local_work_size,
+                            cl_uint num_items_in_wait_list,
+                            const cl_event *event_wait_list, cl_event *event,
+                            const cl_sync_point_khr *sync_point_wait_list,
+                            cl_sync_point_khr *sync_point)
+{
+  return ndrange_kernel (command_buffer, command_queue, kernel, work_dim,
+                         global_work_offset, global_work_size,
+                         local_work_size, num_items_in_wait_list,
+                         event_wait_list, event, sync_point_wait_list,
+                         sync_point, 0);
+}
+
+cl_int
+pocl_ndrange_kernel_split_part (cl_command_queue command_queue,
+                                cl_kernel kernel, cl_uint work_dim,
+                                const size_t *global_work_offset,
+                                const size_t *global_work_size,
+                                const size_t *local_work_size,
+                                cl_uint num_items_in_wait_list,
+                                const cl_event *event_wait_list,
+                                cl_event *event)
+{
+  return ndrange_kernel (NULL, command_queue, kernel, work_dim,
+                         global_work_offset, global_work_size,
+                         local_work_size, num_items_in_wait_list,
+                         event_wait_list, event, NULL, NULL, 1);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname(clEnqueueNDRangeKernel)(cl_command_queue command_queue,
+                       cl_kernel kernel,
+                       cl_uint work_dim,
+                       const size_t *global_work_offset,
+                       const size_t *global_work_size,
+                       const size_t *local_work_size,
+                       cl_uint num_events_in_wait_list,
+                       const cl_event *event_wait_list,
+                       cl_event *event) CL_API_SUFFIX__VERSION_1_0
+{
+  return pocl_ndrange_kernel_common (
+      NULL, command_queue, kernel, work_dim, global_work_offset,
+      global_work_size, local_work_size, num_events_in_wait_list,
+      event_wait_list, event, NULL, NULL);
+}
 POsym(clEnqueueNDRangeKernel)
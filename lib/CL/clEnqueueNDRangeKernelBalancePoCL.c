@@ -0,0 +1,208 @@
+/* OpenCL runtime library: clEnqueueNDRangeKernelBalancePoCL
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "pocl_calibrate.h"
+#include "pocl_cl.h"
+#include "pocl_timing.h"
+#include "pocl_util.h"
+
+typedef struct
+{
+  cl_kernel kernel;
+  cl_device_id device;
+  unsigned device_i;
+  size_t work_items;
+  uint64_t enqueue_time;
+  uint64_t predicted_ns;
+} balance_info;
+
+/* Updates the throughput of the device from the time the NDRange took,
+ * and removes its prediction from the device's pending time. */
+static void CL_CALLBACK
+balance_finished (cl_event event, cl_int status, void *data)
+{
+  balance_info *info = (balance_info *)data;
+  cl_device_id dev = info->device;
+
+  pocl_ndrange_update_rate (event, status, info->kernel, info->device_i,
+                            info->work_items, info->enqueue_time);
+
+  POCL_LOCK_OBJ (dev);
+  assert (dev->balance_pending > 0);
+  assert (dev->balance_pending_ns >= info->predicted_ns);
+  dev->balance_pending_ns -= info->predicted_ns;
+  --dev->balance_pending;
+  POCL_UNLOCK_OBJ (dev);
+
+  POname (clReleaseDevice) (dev);
+  POname (clReleaseKernel) (info->kernel);
+  POCL_MEM_FREE (info);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clEnqueueNDRangeKernelBalancePoCL) (
+    cl_uint num_queues, const cl_command_queue *queues, cl_kernel kernel,
+    cl_uint work_dim, const size_t *global_work_offset,
+    const size_t *global_work_size, const size_t *local_work_size,
+    cl_uint num_events_in_wait_list, const cl_event *event_wait_list,
+    cl_event *event) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_int errcode = CL_SUCCESS;
+  cl_uint i;
+
+  POCL_RETURN_ERROR_COND ((num_queues == 0), CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_COND ((queues == NULL), CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (kernel)), CL_INVALID_KERNEL);
+  POCL_RETURN_ERROR_COND ((work_dim < 1 || work_dim > 3),
+                          CL_INVALID_WORK_DIMENSION);
+  POCL_RETURN_ERROR_COND ((global_work_size == NULL),
+                          CL_INVALID_GLOBAL_WORK_SIZE);
+
+  for (i = 0; i < num_queues; ++i)
+    {
+      POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (queues[i])),
+                              CL_INVALID_COMMAND_QUEUE);
+      POCL_RETURN_ERROR_ON ((queues[i]->context != kernel->context),
+                            CL_INVALID_CONTEXT,
+                            "kernel and the queues are not from the same "
+                            "context\n");
+    }
+
+  size_t work_items = 1;
+  for (i = 0; i < work_dim; ++i)
+    work_items *= global_work_size[i];
+
+  double *rates = (double *)alloca (num_queues * sizeof (double));
+  double *priors = (double *)alloca (num_queues * sizeof (double));
+  POCL_LOCK_OBJ (kernel);
+  errcode = pocl_kernel_alloc_split_rates (kernel);
+  if (errcode != CL_SUCCESS)
+    {
+      POCL_UNLOCK_OBJ (kernel);
+      return errcode;
+    }
+  for (i = 0; i < num_queues; ++i)
+    rates[i] = kernel->split_rates[pocl_context_device_index (
+        kernel->context, queues[i])];
+  POCL_UNLOCK_OBJ (kernel);
+
+  double measured_sum = 0.0;
+  cl_uint num_measured = 0;
+  int have_priors = 1;
+  for (i = 0; i < num_queues; ++i)
+    {
+      if (rates[i] > 0.0)
+        {
+          measured_sum += rates[i];
+          ++num_measured;
+        }
+      priors[i] = pocl_device_calibrated_flops (
+          pocl_real_dev (queues[i]->device));
+      if (priors[i] <= 0.0)
+        have_priors = 0;
+    }
+
+  /* The predicted completion time on a device is the pending time of the
+   * NDRanges already balanced to it plus the predicted run time of this
+   * one. The devices without a measurement yet are predicted with the
+   * average throughput of the others; until any device has been measured,
+   * the one with the fewest pending NDRanges is chosen, weighted by the
+   * calibrated FLOP rates of the devices if all of them have one. */
+  cl_uint best = 0;
+  double best_cost = 0.0;
+  uint64_t best_predicted = 0;
+  for (i = 0; i < num_queues; ++i)
+    {
+      cl_device_id dev = pocl_real_dev (queues[i]->device);
+      uint64_t predicted = 0;
+      double cost;
+
+      POCL_LOCK_OBJ (dev);
+      if (num_measured == 0 && have_priors)
+        cost = (double)(dev->balance_pending + 1) / priors[i];
+      else if (num_measured == 0)
+        cost = (double)dev->balance_pending;
+      else
+        {
+          double rate = rates[i] > 0.0 ? rates[i] : measured_sum / num_measured;
+          predicted = (uint64_t)((double)work_items / rate);
+          cost = (double)dev->balance_pending_ns + (double)predicted;
+        }
+      POCL_UNLOCK_OBJ (dev);
+
+      if (i == 0 || cost < best_cost)
+        {
+          best = i;
+          best_cost = cost;
+          best_predicted = predicted;
+        }
+    }
+
+  cl_command_queue queue = queues[best];
+  cl_device_id dev = pocl_real_dev (queue->device);
+  POCL_MSG_PRINT_INFO ("Balancing kernel %s to device %s, predicted %" PRIu64
+                       " ns\n",
+                       kernel->name, dev->short_name, best_predicted);
+
+  balance_info *info = (balance_info *)calloc (1, sizeof (balance_info));
+  POCL_RETURN_ERROR_COND ((info == NULL), CL_OUT_OF_HOST_MEMORY);
+  info->kernel = kernel;
+  info->device = dev;
+  info->device_i = pocl_context_device_index (kernel->context, queue);
+  info->work_items = work_items;
+  info->predicted_ns = best_predicted;
+
+  POCL_LOCK_OBJ (dev);
+  dev->balance_pending_ns += best_predicted;
+  ++dev->balance_pending;
+  POCL_UNLOCK_OBJ (dev);
+
+  cl_event ndrange_event = NULL;
+  info->enqueue_time = pocl_gettimemono_ns ();
+  errcode = pocl_ndrange_kernel_common (
+      NULL, queue, kernel, work_dim, global_work_offset, global_work_size,
+      local_work_size, num_events_in_wait_list, event_wait_list,
+      &ndrange_event, NULL, NULL);
+  if (errcode != CL_SUCCESS)
+    {
+      POCL_LOCK_OBJ (dev);
+      dev->balance_pending_ns -= best_predicted;
+      --dev->balance_pending;
+      POCL_UNLOCK_OBJ (dev);
+      POCL_MEM_FREE (info);
+      return errcode;
+    }
+
+  POname (clRetainKernel) (kernel);
+  POname (clRetainDevice) (dev);
+  POname (clSetEventCallback) (ndrange_event, CL_COMPLETE, balance_finished,
+                               info);
+
+  if (event)
+    *event = ndrange_event;
+  else
+    POname (clReleaseEvent) (ndrange_event);
+
+  return CL_SUCCESS;
+}
+POsym (clEnqueueNDRangeKernelBalancePoCL)
@@ -0,0 +1,98 @@
+/* OpenCL runtime library: clEnqueueNDRangeKernelBatchPoCL
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "pocl_cl.h"
+#include "pocl_cl.h"
+#include "pocl_util.h"
+
+/* The launches are recorded to a command buffer that is marked
+ * independent, so that a driver can run all of them as one command, e.g.
+ * the pthread driver lets its threads pick the work-groups of any of them.
+ * The other drivers get the recorded NDRanges as separate commands, which
+ * only wait for the event wait list. */
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clEnqueueNDRangeKernelBatchPoCL) (
+    cl_command_queue command_queue, cl_uint num_launches,
+    const cl_ndrange_launch_pocl *launches, cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_command_buffer_khr command_buffer;
+  cl_int errcode = CL_SUCCESS;
+  cl_uint i, a;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_queue)),
+                          CL_INVALID_COMMAND_QUEUE);
+  POCL_RETURN_ERROR_COND ((num_launches == 0 || launches == NULL),
+                          CL_INVALID_VALUE);
+
+  command_buffer = POname (clCreateCommandBufferKHR) (1, &command_queue, NULL,
+                                                      &errcode);
+  if (errcode != CL_SUCCESS)
+    return errcode;
+  command_buffer->independent = 1;
+
+  for (i = 0; i < num_launches; ++i)
+    {
+      const cl_ndrange_launch_pocl *l = &launches[i];
+      const size_t *local = NULL;
+
+      POCL_GOTO_ERROR_COND ((!IS_CL_OBJECT_VALID (l->kernel)),
+                            CL_INVALID_KERNEL);
+      if (l->arg_sizes != NULL)
+        {
+          POCL_GOTO_ERROR_COND ((l->arg_values == NULL), CL_INVALID_VALUE);
+          for (a = 0; a < l->num_args; ++a)
+            {
+              errcode = POname (clSetKernelArg) (l->kernel, a, l->arg_sizes[a],
+                                                 l->arg_values[a]);
+              if (errcode != CL_SUCCESS)
+                goto ERROR;
+            }
+        }
+
+      if (l->local_work_size[0] != 0 || l->local_work_size[1] != 0
+          || l->local_work_size[2] != 0)
+        local = l->local_work_size;
+
+      errcode = pocl_ndrange_kernel_common (
+          command_buffer, command_queue, l->kernel, l->work_dim,
+          l->global_work_offset, l->global_work_size, local, 0, NULL, NULL,
+          NULL, NULL);
+      if (errcode != CL_SUCCESS)
+        goto ERROR;
+    }
+
+  errcode = POname (clFinalizeCommandBufferKHR) (command_buffer);
+  if (errcode != CL_SUCCESS)
+    goto ERROR;
+
+  errcode = POname (clEnqueueCommandBufferKHR) (
+      0, NULL, command_buffer, num_events_in_wait_list, event_wait_list,
+      event);
+
+ERROR:
+  /* the enqueued commands keep the command buffer alive */
+  POname (clReleaseCommandBufferKHR) (command_buffer);
+  return errcode;
+}
+POsym (clEnqueueNDRangeKernelBatchPoCL)
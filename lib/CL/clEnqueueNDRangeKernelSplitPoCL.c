@@ -0,0 +1,402 @@
+/* OpenCL runtime library: clEnqueueNDRangeKernelSplitPoCL
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "pocl_calibrate.h"
+#include "pocl_cl.h"
+#include "pocl_timing.h"
+#include "pocl_util.h"
+
+#include <string.h>
+
+/* The most queues an NDRange can be split to. */
+#define POCL_SPLIT_MAX_QUEUES 16
+
+/* The weight of a new measurement in the throughput of a device. */
+#define POCL_SPLIT_RATE_WEIGHT 0.5
+
+typedef struct
+{
+  cl_kernel kernel;
+  unsigned device_i;
+  size_t work_items;
+  uint64_t enqueue_time;
+} split_part_info;
+
+uint64_t
+pocl_ndrange_update_rate (cl_event event, cl_int status, cl_kernel kernel,
+                          unsigned device_i, size_t work_items,
+                          uint64_t enqueue_time)
+{
+  uint64_t elapsed;
+
+  const pocl_event_profile *prof = pocl_event_profile_of (event);
+  if ((event->queue->properties & CL_QUEUE_PROFILING_ENABLE)
+      && prof->time_end > prof->time_start)
+    elapsed = prof->time_end - prof->time_start;
+  else
+    elapsed = pocl_gettimemono_ns () - enqueue_time;
+
+  if (status == CL_COMPLETE && elapsed > 0)
+    {
+      double rate = (double)work_items / (double)elapsed;
+      POCL_LOCK_OBJ (kernel);
+      double *old = &kernel->split_rates[device_i];
+      if (*old == 0.0)
+        *old = rate;
+      else
+        *old += POCL_SPLIT_RATE_WEIGHT * (rate - *old);
+      POCL_UNLOCK_OBJ (kernel);
+    }
+  return elapsed;
+}
+
+static void CL_CALLBACK
+split_part_finished (cl_event event, cl_int status, void *data)
+{
+  split_part_info *info = (split_part_info *)data;
+  cl_kernel kernel = info->kernel;
+
+  pocl_ndrange_update_rate (event, status, kernel, info->device_i,
+                            info->work_items, info->enqueue_time);
+
+  POname (clReleaseKernel) (kernel);
+  POCL_MEM_FREE (info);
+}
+
+unsigned
+pocl_context_device_index (cl_context context, cl_command_queue queue)
+{
+  cl_device_id dev = pocl_real_dev (queue->device);
+  unsigned i;
+  for (i = 0; i < context->num_devices; ++i)
+    if (context->devices[i] == dev)
+      return i;
+  assert (0 && "queue's device is not in the context");
+  return 0;
+}
+
+/* Splits num_units units of work between the queues proportionally to
+ * the measured throughputs of their devices. The devices without a
+ * measurement yet get the average of the others. Until any device has
+ * been measured, the shares follow the calibrated FLOP rates of the
+ * devices if all of them have one, else all get an equal share. */
+static void
+split_units (const double *rates, const double *priors, cl_uint num_queues,
+             size_t num_units, size_t *units)
+{
+  double weights[POCL_SPLIT_MAX_QUEUES];
+  double sum = 0.0, measured_sum = 0.0;
+  cl_uint i, num_measured = 0;
+
+  int have_priors = 1;
+
+  for (i = 0; i < num_queues; ++i)
+    {
+      if (rates[i] > 0.0)
+        {
+          measured_sum += rates[i];
+          ++num_measured;
+        }
+      if (priors[i] <= 0.0)
+        have_priors = 0;
+    }
+  for (i = 0; i < num_queues; ++i)
+    {
+      if (num_measured == 0)
+        weights[i] = have_priors ? priors[i] : 1.0;
+      else if (rates[i] > 0.0)
+        weights[i] = rates[i];
+      else
+        weights[i] = measured_sum / num_measured;
+      sum += weights[i];
+    }
+
+  size_t assigned = 0;
+  double cumulative = 0.0;
+  for (i = 0; i < num_queues; ++i)
+    {
+      cumulative += weights[i];
+      size_t end = (i == num_queues - 1)
+                       ? num_units
+                       : (size_t)(num_units * (cumulative / sum) + 0.5);
+      if (end < assigned)
+        end = assigned;
+      if (end > num_units)
+        end = num_units;
+      units[i] = end - assigned;
+      assigned = end;
+    }
+}
+
+cl_int
+pocl_kernel_alloc_split_rates (cl_kernel kernel)
+{
+  if (kernel->split_rates == NULL)
+    kernel->split_rates
+        = (double *)calloc (kernel->context->num_devices, sizeof (double));
+  return kernel->split_rates ? CL_SUCCESS : CL_OUT_OF_HOST_MEMORY;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clEnqueueNDRangeKernelSplitPoCL) (
+    cl_uint num_queues, const cl_command_queue *queues, cl_kernel kernel,
+    cl_uint work_dim, const size_t *global_work_offset,
+    const size_t *global_work_size, const size_t *local_work_size,
+    cl_uint num_events_in_wait_list, const cl_event *event_wait_list,
+    cl_event *event) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_int errcode = CL_SUCCESS;
+  cl_uint i, j;
+  unsigned device_i[POCL_SPLIT_MAX_QUEUES];
+  double rates[POCL_SPLIT_MAX_QUEUES];
+  double priors[POCL_SPLIT_MAX_QUEUES];
+  size_t units[POCL_SPLIT_MAX_QUEUES];
+  cl_event part_events[POCL_SPLIT_MAX_QUEUES];
+  cl_command_queue part_queues[POCL_SPLIT_MAX_QUEUES];
+  cl_uint num_parts = 0;
+
+  POCL_RETURN_ERROR_COND ((num_queues == 0), CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_ON ((num_queues > POCL_SPLIT_MAX_QUEUES),
+                        CL_INVALID_VALUE,
+                        "At most %u queues are supported\n",
+                        POCL_SPLIT_MAX_QUEUES);
+  POCL_RETURN_ERROR_COND ((queues == NULL), CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (kernel)), CL_INVALID_KERNEL);
+  POCL_RETURN_ERROR_COND ((work_dim < 1 || work_dim > 3),
+                          CL_INVALID_WORK_DIMENSION);
+  POCL_RETURN_ERROR_COND ((global_work_size == NULL),
+                          CL_INVALID_GLOBAL_WORK_SIZE);
+
+  for (i = 0; i < num_queues; ++i)
+    {
+      POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (queues[i])),
+                              CL_INVALID_COMMAND_QUEUE);
+      POCL_RETURN_ERROR_ON ((queues[i]->context != kernel->context),
+                            CL_INVALID_CONTEXT,
+                            "kernel and the queues are not from the same "
+                            "context\n");
+      errcode = pocl_check_event_wait_list (
+          queues[i], num_events_in_wait_list, event_wait_list);
+      if (errcode != CL_SUCCESS)
+        return errcode;
+      device_i[i] = pocl_context_device_index (kernel->context, queues[i]);
+    }
+
+  /* The slowest dimension is split at work-group boundaries. */
+  cl_uint dim = work_dim - 1;
+  size_t unit = local_work_size ? local_work_size[dim] : 1;
+  POCL_RETURN_ERROR_COND ((unit == 0 || global_work_size[dim] % unit != 0),
+                          CL_INVALID_WORK_GROUP_SIZE);
+  size_t num_units = global_work_size[dim] / unit;
+  size_t items_per_unit = unit;
+  for (i = 0; i < work_dim; ++i)
+    if (i != dim)
+      items_per_unit *= global_work_size[i];
+
+  POCL_LOCK_OBJ (kernel);
+  errcode = pocl_kernel_alloc_split_rates (kernel);
+  if (errcode != CL_SUCCESS)
+    {
+      POCL_UNLOCK_OBJ (kernel);
+      return errcode;
+    }
+  for (i = 0; i < num_queues; ++i)
+    rates[i] = kernel->split_rates[device_i[i]];
+  POCL_UNLOCK_OBJ (kernel);
+
+  for (i = 0; i < num_queues; ++i)
+    priors[i]
+        = pocl_device_calibrated_flops (pocl_real_dev (queues[i]->device));
+
+  split_units (rates, priors, num_queues, num_units, units);
+
+  /* The buffers the kernel writes, and the rest it uses. */
+  cl_uint num_args = kernel->meta->num_args;
+  cl_mem *buffers = (cl_mem *)alloca (num_args * sizeof (cl_mem));
+  char *readonly = (char *)alloca (num_args * sizeof (char));
+  cl_mem *written = (cl_mem *)alloca (num_args * sizeof (cl_mem));
+  size_t num_buffers = 0, num_written = 0;
+  for (i = 0; i < num_args; ++i)
+    {
+      struct pocl_argument_info *a = &kernel->meta->arg_info[i];
+      struct pocl_argument *al = &kernel->dyn_arguments[i];
+      POCL_RETURN_ERROR_ON ((!al->is_set), CL_INVALID_KERNEL_ARGS,
+                            "The %i-th kernel argument is not set!\n", i);
+      if (a->type == POCL_ARG_TYPE_IMAGE
+          || (!ARGP_IS_LOCAL (a) && a->type == POCL_ARG_TYPE_POINTER
+              && al->value != NULL && al->is_svm == 0))
+        {
+          cl_mem buf = *(cl_mem *)(al->value);
+          POCL_RETURN_ERROR_ON ((a->type == POCL_ARG_TYPE_IMAGE
+                                 && !al->is_readonly),
+                                CL_INVALID_KERNEL_ARGS,
+                                "Written images can't be split\n");
+          buffers[num_buffers] = buf;
+          readonly[num_buffers++] = 1;
+          if (!al->is_readonly && (buf->flags & CL_MEM_READ_ONLY) == 0)
+            {
+              for (j = 0; j < num_written; ++j)
+                if (written[j] == buf)
+                  break;
+              if (j == num_written)
+                written[num_written++] = buf;
+            }
+        }
+    }
+
+  size_t offset[3] = { 0, 0, 0 };
+  size_t part_size[3];
+  for (i = 0; i < work_dim; ++i)
+    {
+      if (global_work_offset)
+        offset[i] = global_work_offset[i];
+      part_size[i] = global_work_size[i];
+    }
+
+  /* Scatter: all the buffers are migrated to the devices first, as
+   * reads, so that the parts don't wait for each other. */
+  cl_event scatter_events[POCL_SPLIT_MAX_QUEUES];
+  memset (scatter_events, 0, sizeof (scatter_events));
+  for (i = 0; i < num_queues && num_buffers > 0; ++i)
+    {
+      if (units[i] == 0)
+        continue;
+      _cl_command_node *cmd = NULL;
+      errcode = pocl_create_command_migrate (
+          &cmd, queues[i], 0, &scatter_events[i], num_events_in_wait_list,
+          event_wait_list, num_buffers, buffers, readonly);
+      if (errcode != CL_SUCCESS)
+        goto ERROR;
+      cmd->command.migrate.type = ENQUEUE_MIGRATE_TYPE_NOP;
+      pocl_command_enqueue (queues[i], cmd);
+    }
+
+  cl_event *part_wait = (cl_event *)alloca ((num_events_in_wait_list + 1)
+                                            * sizeof (cl_event));
+  if (num_events_in_wait_list)
+    memcpy (part_wait, event_wait_list,
+            num_events_in_wait_list * sizeof (cl_event));
+  size_t start_unit = 0;
+  for (i = 0; i < num_queues; ++i)
+    {
+      if (units[i] == 0)
+        continue;
+
+      cl_uint num_part_wait = num_events_in_wait_list;
+      if (scatter_events[i])
+        part_wait[num_part_wait++] = scatter_events[i];
+      offset[dim] = (global_work_offset ? global_work_offset[dim] : 0)
+                    + start_unit * unit;
+      part_size[dim] = units[i] * unit;
+      errcode = pocl_ndrange_kernel_split_part (
+          queues[i], kernel, work_dim, offset, part_size, local_work_size,
+          num_part_wait, part_wait, &part_events[num_parts]);
+      if (errcode != CL_SUCCESS)
+        goto ERROR;
+
+      split_part_info *info
+          = (split_part_info *)calloc (1, sizeof (split_part_info));
+      if (info)
+        {
+          info->kernel = kernel;
+          info->device_i = device_i[i];
+          info->work_items = units[i] * items_per_unit;
+          info->enqueue_time = pocl_gettimemono_ns ();
+          POname (clRetainKernel) (kernel);
+          POname (clSetEventCallback) (part_events[num_parts], CL_COMPLETE,
+                                       split_part_finished, info);
+        }
+
+      part_queues[num_parts] = queues[i];
+      units[num_parts] = units[i];
+      ++num_parts;
+      start_unit += units[i];
+    }
+  for (i = 0; i < num_queues; ++i)
+    if (scatter_events[i])
+      POname (clReleaseEvent) (scatter_events[i]);
+
+  /* Gather: each written buffer's slices are exported to its host copy
+   * from the devices that wrote them. The slice of a part is the share of
+   * the buffer that its range has of the slowest dimension. */
+  cl_event *final_wait = (cl_event *)alloca (
+      (num_parts + num_written * num_parts) * sizeof (cl_event));
+  cl_uint num_final_wait = 0;
+  for (i = 0; i < num_parts; ++i)
+    final_wait[num_final_wait++] = part_events[i];
+  for (j = 0; j < num_written; ++j)
+    {
+      cl_mem mem = written[j];
+      pocl_mem_range slices[POCL_SPLIT_MAX_QUEUES];
+      size_t begin = 0;
+      start_unit = 0;
+      for (i = 0; i < num_parts; ++i)
+        {
+          size_t end_unit = start_unit + units[i];
+          size_t end = (i == num_parts - 1)
+                           ? mem->size
+                           : (size_t)((double)mem->size * end_unit
+                                      / num_units);
+          slices[i].offset = begin;
+          slices[i].size = end - begin;
+          begin = end;
+          start_unit = end_unit;
+        }
+      pocl_gather_mem_slices (mem, num_parts, part_queues, part_events,
+                              slices, final_wait + num_final_wait);
+      num_final_wait += num_parts;
+    }
+
+  cl_event final_event = NULL;
+  _cl_command_node *marker = NULL;
+  errcode = pocl_create_command (&marker, queues[0], CL_COMMAND_MARKER,
+                                 &final_event, num_final_wait, final_wait, 0,
+                                 NULL, NULL);
+  if (errcode == CL_SUCCESS)
+    {
+      marker->command.marker.data = queues[0]->device->data;
+      pocl_command_enqueue (queues[0], marker);
+      for (j = 0; j < num_written; ++j)
+        pocl_set_mem_last_event (written[j], final_event);
+      if (event)
+        *event = final_event;
+      else
+        POname (clReleaseEvent) (final_event);
+    }
+
+  for (i = num_parts; i < num_final_wait; ++i)
+    POname (clReleaseEvent) (final_wait[i]);
+  for (i = 0; i < num_parts; ++i)
+    POname (clReleaseEvent) (part_events[i]);
+
+  return errcode;
+
+ERROR:
+  for (i = 0; i < num_queues; ++i)
+    if (scatter_events[i])
+      POname (clReleaseEvent) (scatter_events[i]);
+  for (i = 0; i < num_parts; ++i)
+    POname (clReleaseEvent) (part_events[i]);
+  return errcode;
+}
+POsym (clEnqueueNDRangeKernelSplitPoCL)
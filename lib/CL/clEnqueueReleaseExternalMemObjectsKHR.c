@@ -0,0 +1,127 @@
+/* OpenCL runtime library: clEnqueueReleaseExternalMemObjectsKHR()
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_util.h"
+
+typedef struct
+{
+  unsigned num_mem_objects;
+  cl_mem mem_objects[1];
+} external_release;
+
+/* the exporter may access the memory again once the release command has
+   moved the latest content of the devices to the mapping */
+static void CL_CALLBACK
+external_release_finished (cl_event event, cl_int status, void *data)
+{
+  external_release *r = (external_release *)data;
+  unsigned i;
+
+  for (i = 0; i < r->num_mem_objects; ++i)
+    {
+      pocl_dma_buf_sync (r->mem_objects[i], 0);
+      POname (clReleaseMemObject) (r->mem_objects[i]);
+    }
+  POCL_MEM_FREE (r);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL POname (clEnqueueReleaseExternalMemObjectsKHR) (
+    cl_command_queue command_queue, cl_uint num_mem_objects,
+    const cl_mem *mem_objects, cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event)
+    CL_API_SUFFIX__VERSION_3_0
+{
+  unsigned i;
+  int errcode;
+  _cl_command_node *cmd = NULL;
+  external_release *r;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_queue)),
+                          CL_INVALID_COMMAND_QUEUE);
+
+  POCL_RETURN_ERROR_COND ((num_mem_objects == 0), CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_COND ((mem_objects == NULL), CL_INVALID_VALUE);
+
+  errcode = pocl_check_event_wait_list (command_queue, num_events_in_wait_list,
+                                        event_wait_list);
+  if (errcode != CL_SUCCESS)
+    return errcode;
+
+  char *rdonly = (char *)alloca (num_mem_objects * sizeof (char));
+
+  for (i = 0; i < num_mem_objects; ++i)
+    {
+      cl_mem mem = mem_objects[i];
+      POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (mem)),
+                              CL_INVALID_MEM_OBJECT);
+
+      POCL_RETURN_ERROR_COND ((mem->context != command_queue->context),
+                              CL_INVALID_CONTEXT);
+
+      POCL_RETURN_ERROR_ON ((!mem->is_external), CL_INVALID_MEM_OBJECT,
+                            "mem_obj is not an imported external memory\n");
+
+      POCL_RETURN_ERROR_ON ((!mem->is_external_acquired),
+                            CL_INVALID_MEM_OBJECT,
+                            "mem_obj has not been acquired\n");
+
+      rdonly[i] = 1;
+    }
+
+  r = (external_release *)malloc (sizeof (external_release)
+                                  + (num_mem_objects - 1) * sizeof (cl_mem));
+  POCL_RETURN_ERROR_COND ((r == NULL), CL_OUT_OF_HOST_MEMORY);
+  r->num_mem_objects = num_mem_objects;
+  memcpy (r->mem_objects, mem_objects, num_mem_objects * sizeof (cl_mem));
+
+  /* a migration to the host, which is a no-op for the buffers that the
+     devices use in the mapping directly */
+  errcode = pocl_create_command_migrate (
+      &cmd, command_queue, CL_MIGRATE_MEM_OBJECT_HOST, event,
+      num_events_in_wait_list, event_wait_list, num_mem_objects,
+      r->mem_objects, rdonly);
+  if (errcode != CL_SUCCESS)
+    {
+      POCL_MEM_FREE (r);
+      return errcode;
+    }
+
+  cmd->event->command_type = CL_COMMAND_RELEASE_EXTERNAL_MEM_OBJECTS_KHR;
+
+  for (i = 0; i < num_mem_objects; ++i)
+    {
+      POname (clRetainMemObject) (mem_objects[i]);
+      POCL_LOCK_OBJ (mem_objects[i]);
+      mem_objects[i]->is_external_acquired = 0;
+      POCL_UNLOCK_OBJ (mem_objects[i]);
+    }
+
+  /* the command is not enqueued yet, nothing else looks at the event */
+  POname (clSetEventCallback) (cmd->event, CL_COMPLETE,
+                               external_release_finished, r);
+
+  pocl_command_enqueue (command_queue, cmd);
+
+  return CL_SUCCESS;
+}
+POsym (clEnqueueReleaseExternalMemObjectsKHR)
@@ -82,10 +82,12 @@ POname(clEnqueueUnmapMemObject)(cl_command_queue command_queue,
       "Could not find mapping of this memobj\n");
 
   char rdonly = (mapping->map_flags & CL_MAP_READ);
+  /* images don't track ranges, so the size is ignored for them */
+  pocl_mem_range range = { mapping->offset, mapping->size };
 
-  errcode = pocl_create_command (
+  errcode = pocl_create_command_ranges (
       &cmd, command_queue, CL_COMMAND_UNMAP_MEM_OBJECT, event,
-      num_events_in_wait_list, event_wait_list, 1, &memobj, &rdonly);
+      num_events_in_wait_list, event_wait_list, 1, &memobj, &rdonly, &range);
 
   if (errcode != CL_SUCCESS)
     goto ERROR;
@@ -78,10 +78,11 @@ POname(clEnqueueWriteBuffer)(cl_command_queue command_queue,
   POCL_CHECK_DEV_IN_CMDQ;
 
   char rdonly = 0;
+  pocl_mem_range range = { offset, size };
 
-  errcode = pocl_create_command (&cmd, command_queue, CL_COMMAND_WRITE_BUFFER,
-                                 event, num_events_in_wait_list,
-                                 event_wait_list, 1, &buffer, &rdonly);
+  errcode = pocl_create_command_ranges (
+      &cmd, command_queue, CL_COMMAND_WRITE_BUFFER, event,
+      num_events_in_wait_list, event_wait_list, 1, &buffer, &rdonly, &range);
   if (errcode != CL_SUCCESS)
     {
       POCL_MSG_ERR ("create command failed \n");
@@ -93,10 +93,18 @@ POname(clEnqueueWriteBufferRect)(cl_command_queue command_queue,
                         "buffer is larger than device's MAX_MEM_ALLOC_SIZE\n");
 
   char rdonly = 0;
-
-  pocl_create_command (&cmd, command_queue, CL_COMMAND_WRITE_BUFFER_RECT,
-                       event, num_events_in_wait_list, event_wait_list, 1,
-                       &buffer, &rdonly);
+  /* the bytes between the first and the last byte of the rectangle */
+  pocl_mem_range range;
+  range.offset = dst_offset + buffer_origin[0]
+                 + buffer_origin[1] * buffer_row_pitch
+                 + buffer_origin[2] * buffer_slice_pitch;
+  range.size = (region[2] - 1) * buffer_slice_pitch
+               + (region[1] - 1) * buffer_row_pitch + region[0];
+
+  pocl_create_command_ranges (&cmd, command_queue,
+                              CL_COMMAND_WRITE_BUFFER_RECT, event,
+                              num_events_in_wait_list, event_wait_list, 1,
+                              &buffer, &rdonly, &range);
 
   cmd->command.write_rect.dst_mem_id = &buffer->device_ptrs[device->global_mem_id];
   cmd->command.write_rect.src_host_ptr = ptr;
@@ -22,6 +22,7 @@
 */
 
 #include "pocl_cl.h"
+#include "pocl_util.h"
 #include "utlist.h"
 #include "assert.h"
 
@@ -31,6 +32,8 @@ POname(clFlush)(cl_command_queue command_queue) CL_API_SUFFIX__VERSION_1_0
   POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_queue)),
                           CL_INVALID_COMMAND_QUEUE);
 
+  pocl_submit_batch (command_queue);
+
   if(command_queue->device->ops->flush)
     command_queue->device->ops->flush (command_queue->device, command_queue);
   
@@ -0,0 +1,66 @@
+/* OpenCL runtime library: clGetCommandBufferInfoKHR
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_util.h"
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clGetCommandBufferInfoKHR) (cl_command_buffer_khr command_buffer,
+                                    cl_command_buffer_info_khr param_name,
+                                    size_t param_value_size,
+                                    void *param_value,
+                                    size_t *param_value_size_ret)
+    CL_API_SUFFIX__VERSION_1_2
+{
+  cl_command_buffer_state_khr state;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_buffer)),
+                          CL_INVALID_COMMAND_BUFFER_KHR);
+
+  switch (param_name)
+    {
+    case CL_COMMAND_BUFFER_QUEUES_KHR:
+      POCL_RETURN_GETINFO (cl_command_queue, command_buffer->queue);
+    case CL_COMMAND_BUFFER_NUM_QUEUES_KHR:
+      POCL_RETURN_GETINFO (cl_uint, 1);
+    case CL_COMMAND_BUFFER_REFERENCE_COUNT_KHR:
+      POCL_RETURN_GETINFO (cl_uint, (cl_uint)command_buffer->pocl_refcount);
+    case CL_COMMAND_BUFFER_STATE_KHR:
+      POCL_LOCK_OBJ (command_buffer);
+      if (!command_buffer->finalized)
+        state = CL_COMMAND_BUFFER_STATE_RECORDING_KHR;
+      else if (command_buffer->last_enqueue
+               && command_buffer->last_enqueue->status > CL_COMPLETE)
+        state = CL_COMMAND_BUFFER_STATE_PENDING_KHR;
+      else
+        state = CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR;
+      POCL_UNLOCK_OBJ (command_buffer);
+      POCL_RETURN_GETINFO (cl_command_buffer_state_khr, state);
+    case CL_COMMAND_BUFFER_PROPERTIES_ARRAY_KHR:
+      POCL_RETURN_GETINFO_SIZE (command_buffer->num_properties
+                                    * sizeof (cl_command_buffer_properties_khr),
+                                command_buffer->properties);
+    }
+
+  return CL_INVALID_VALUE;
+}
+POsym (clGetCommandBufferInfoKHR)
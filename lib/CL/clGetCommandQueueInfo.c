@@ -53,9 +53,23 @@ POname(clGetCommandQueueInfo)(cl_command_queue      command_queue ,
       break;
     /* Device-side enqueue specific queries */
     case CL_QUEUE_SIZE:
-      return CL_INVALID_COMMAND_QUEUE;
+      POCL_RETURN_ERROR_COND (
+          ((command_queue->properties & CL_QUEUE_ON_DEVICE) == 0),
+          CL_INVALID_COMMAND_QUEUE);
+      POCL_RETURN_GETINFO (cl_uint, command_queue->size);
+      break;
     case CL_QUEUE_DEVICE_DEFAULT:
-      POCL_RETURN_GETINFO (cl_command_queue, NULL);
+      {
+        cl_context context = command_queue->context;
+        cl_command_queue queue = NULL;
+        unsigned i;
+        POCL_LOCK_OBJ (context);
+        for (i = 0; i < context->num_devices; ++i)
+          if (context->devices[i] == pocl_real_dev (command_queue->device))
+            queue = context->default_device_queues[i];
+        POCL_UNLOCK_OBJ (context);
+        POCL_RETURN_GETINFO (cl_command_queue, queue);
+      }
       break;
   }
   return CL_INVALID_VALUE;
@@ -21,6 +21,7 @@
    THE SOFTWARE.
 */
 
+#include "pocl_calibrate.h"
 #include "pocl_util.h"
 
 /* A version for querying the info and in case the device returns 
@@ -273,7 +274,16 @@ POname(clGetDeviceInfo)(cl_device_id   device,
       POCL_RETURN_GETINFO (cl_device_partition_property, 0);
 
   case CL_DEVICE_PARTITION_AFFINITY_DOMAIN         :
-    POCL_RETURN_GETINFO(cl_device_affinity_domain, 0);
+    {
+      cl_device_affinity_domain domains = 0;
+      size_t i;
+      for (i = 0; i < device->num_partition_properties; ++i)
+        if (device->partition_properties[i]
+            == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN)
+          domains = device->affinity_domains
+                    | CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE;
+      POCL_RETURN_GETINFO (cl_device_affinity_domain, domains);
+    }
 
   case CL_DEVICE_PREFERRED_INTEROP_USER_SYNC       :
     POCL_RETURN_GETINFO(cl_bool, CL_TRUE);
@@ -313,6 +323,20 @@ POname(clGetDeviceInfo)(cl_device_id   device,
     POCL_RETURN_GETINFO(cl_uint, 0);
   case CL_DEVICE_PREFERRED_PLATFORM_ATOMIC_ALIGNMENT:
     POCL_RETURN_GETINFO(cl_uint, 0);
+  case CL_DEVICE_EXTERNAL_MEMORY_IMPORT_HANDLE_TYPES_KHR:
+    if (strstr (device->extensions, "cl_khr_external_memory_dma_buf"))
+      {
+        cl_external_memory_handle_type_khr dma_buf
+            = CL_EXTERNAL_MEMORY_HANDLE_DMA_BUF_KHR;
+        POCL_RETURN_GETINFO_ARRAY (cl_external_memory_handle_type_khr, 1,
+                                   &dma_buf);
+      }
+    else
+      {
+        if (param_value_size_ret)
+          *param_value_size_ret = 0;
+        return CL_SUCCESS;
+      }
   case CL_DEVICE_SPIR_VERSIONS:
     if (strstr (device->extensions, "cl_khr_spir"))
       POCL_RETURN_GETINFO_STR ("1.2");
@@ -320,7 +344,11 @@ POname(clGetDeviceInfo)(cl_device_id   device,
       POCL_RETURN_GETINFO_STR ("");
 
   case CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES:
-    POCL_RETURN_GETINFO(cl_uint, 0);
+    if (device->on_dev_queue_props != 0)
+      POCL_RETURN_GETINFO (cl_device_device_enqueue_capabilities,
+                           CL_DEVICE_QUEUE_SUPPORTED
+                               | CL_DEVICE_QUEUE_REPLACEABLE_DEFAULT);
+    POCL_RETURN_GETINFO (cl_device_device_enqueue_capabilities, 0);
   case CL_DEVICE_QUEUE_ON_DEVICE_PROPERTIES:
     POCL_RETURN_GETINFO(cl_command_queue_properties, device->on_dev_queue_props);
   case CL_DEVICE_QUEUE_ON_HOST_PROPERTIES:
@@ -339,6 +367,18 @@ POname(clGetDeviceInfo)(cl_device_id   device,
   case CL_DEVICE_SUB_GROUP_INDEPENDENT_FORWARD_PROGRESS:
     POCL_RETURN_GETINFO (cl_bool,
                          device->sub_group_independent_forward_progress);
+  case CL_DEVICE_PERFORMANCE_POCL:
+    {
+      cl_device_performance_pocl perf = { 0, 0, 0 };
+      /* only measure when the values are asked for */
+      if (param_value != NULL)
+        {
+          cl_int err = pocl_device_performance (device, &perf);
+          if (err != CL_SUCCESS)
+            return err;
+        }
+      POCL_RETURN_GETINFO (cl_device_performance_pocl, perf);
+    }
   }
 
   if(device->ops->get_device_info_ext != NULL) {
@@ -22,6 +22,7 @@
 */
 
 #include "pocl_cl.h"
+#include "pocl_perf_counters.h"
 #include <string.h>
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -31,7 +32,7 @@ POname(clGetEventProfilingInfo)(cl_event event,
                         void *param_value,
                         size_t *param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  size_t const value_size = sizeof(cl_ulong);
+  size_t value_size = sizeof(cl_ulong);
 
   POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (event)),
                           CL_INVALID_COMMAND_QUEUE);
@@ -44,6 +45,23 @@ POname(clGetEventProfilingInfo)(cl_event event,
   POCL_RETURN_ERROR_ON((event->status != CL_COMPLETE), CL_PROFILING_INFO_NOT_AVAILABLE,
     "Cannot return profiling info on events not CL_COMPLETE yet\n");
 
+  if (param_name == CL_PROFILING_COMMAND_PERF_COUNTERS_POCL)
+    {
+      value_size = pocl_perf_num_counters * sizeof (cl_ulong);
+      POCL_RETURN_ERROR_ON ((value_size == 0), CL_PROFILING_INFO_NOT_AVAILABLE,
+                            "No counters were selected with "
+                            "POCL_PERF_COUNTERS\n");
+      if (param_value)
+        {
+          if (param_value_size < value_size)
+            return CL_INVALID_VALUE;
+          memcpy (param_value, event->profile->perf_counters, value_size);
+        }
+      if (param_value_size_ret)
+        *param_value_size_ret = value_size;
+      return CL_SUCCESS;
+    }
+
   if (param_value)
   {
     if (param_value_size < value_size) return CL_INVALID_VALUE;
@@ -51,20 +69,20 @@ POname(clGetEventProfilingInfo)(cl_event event,
     switch (param_name)
     {
     case CL_PROFILING_COMMAND_QUEUED:
-      *(cl_ulong*)param_value = event->time_queue;
+      *(cl_ulong*)param_value = event->profile->time_queue;
       break;
     case CL_PROFILING_COMMAND_SUBMIT:
-      *(cl_ulong*)param_value = event->time_submit;
+      *(cl_ulong*)param_value = event->profile->time_submit;
       break;
     case CL_PROFILING_COMMAND_START:
-      *(cl_ulong*)param_value = event->time_start;
+      *(cl_ulong*)param_value = event->profile->time_start;
       break;
     case CL_PROFILING_COMMAND_END:
-      *(cl_ulong*)param_value = event->time_end;
+      *(cl_ulong*)param_value = event->profile->time_end;
       break;
     case CL_PROFILING_COMMAND_COMPLETE:
       /* Child commands not supported */
-      *(cl_ulong *)param_value = event->time_end;
+      *(cl_ulong *)param_value = event->profile->time_end;
       break;
     default:
       return CL_INVALID_VALUE;
@@ -59,6 +59,48 @@ CL_API_SUFFIX__VERSION_1_2
 
   if (strcmp (func_name, "clSetContentSizeBufferPoCL") == 0)
     return (void *)&POname (clSetContentSizeBufferPoCL);
+  if (strcmp (func_name, "clGetStatisticsPoCL") == 0)
+    return (void *)&POname (clGetStatisticsPoCL);
+  if (strcmp (func_name, "clRegisterStaticWGFunctionsPoCL") == 0)
+    return (void *)&POname (clRegisterStaticWGFunctionsPoCL);
+  if (strcmp (func_name, "clEnqueueNDRangeKernelSplitPoCL") == 0)
+    return (void *)&POname (clEnqueueNDRangeKernelSplitPoCL);
+  if (strcmp (func_name, "clEnqueueNDRangeKernelBalancePoCL") == 0)
+    return (void *)&POname (clEnqueueNDRangeKernelBalancePoCL);
+  if (strcmp (func_name, "clEnqueueNDRangeKernelBatchPoCL") == 0)
+    return (void *)&POname (clEnqueueNDRangeKernelBatchPoCL);
+
+  /* cl_khr_command_buffer */
+  if (strcmp (func_name, "clCreateCommandBufferKHR") == 0)
+    return (void *)&POname (clCreateCommandBufferKHR);
+  if (strcmp (func_name, "clFinalizeCommandBufferKHR") == 0)
+    return (void *)&POname (clFinalizeCommandBufferKHR);
+  if (strcmp (func_name, "clRetainCommandBufferKHR") == 0)
+    return (void *)&POname (clRetainCommandBufferKHR);
+  if (strcmp (func_name, "clReleaseCommandBufferKHR") == 0)
+    return (void *)&POname (clReleaseCommandBufferKHR);
+  if (strcmp (func_name, "clEnqueueCommandBufferKHR") == 0)
+    return (void *)&POname (clEnqueueCommandBufferKHR);
+  if (strcmp (func_name, "clCommandBarrierWithWaitListKHR") == 0)
+    return (void *)&POname (clCommandBarrierWithWaitListKHR);
+  if (strcmp (func_name, "clCommandCopyBufferKHR") == 0)
+    return (void *)&POname (clCommandCopyBufferKHR);
+  if (strcmp (func_name, "clCommandFillBufferKHR") == 0)
+    return (void *)&POname (clCommandFillBufferKHR);
+  if (strcmp (func_name, "clCommandNDRangeKernelKHR") == 0)
+    return (void *)&POname (clCommandNDRangeKernelKHR);
+  if (strcmp (func_name, "clGetCommandBufferInfoKHR") == 0)
+    return (void *)&POname (clGetCommandBufferInfoKHR);
+
+  /* cl_khr_external_memory */
+  if (strcmp (func_name, "clEnqueueAcquireExternalMemObjectsKHR") == 0)
+    return (void *)&POname (clEnqueueAcquireExternalMemObjectsKHR);
+  if (strcmp (func_name, "clEnqueueReleaseExternalMemObjectsKHR") == 0)
+    return (void *)&POname (clEnqueueReleaseExternalMemObjectsKHR);
+
+  /* cl_khr_subgroups, which has the same signature as the 2.1 API */
+  if (strcmp (func_name, "clGetKernelSubGroupInfoKHR") == 0)
+    return (void *)&POname (clGetKernelSubGroupInfo);
 
   if (strcmp (func_name, "clGetPlatformInfo") == 0)
     return (void *)&POname(clGetPlatformInfo);
@@ -48,16 +48,65 @@ CL_API_ENTRY cl_int CL_API_ENTRY POname (clGetKernelSubGroupInfo) (
     }
 
   /* Check device for subgroup support */
-  if (device->max_num_sub_groups == 0)
+  if (device->max_num_sub_groups == 0 || device->max_sub_group_size == 0)
     {
       return CL_INVALID_OPERATION;
     }
 
-  /* Subgroups are not currently supported,
-     but in case device reports subgroup support
-  */
-  POCL_ABORT_UNIMPLEMENTED (
-      "device associated with the kernel falsely indicates "
-      "subgroup support\n");
-  return CL_INVALID_OPERATION;
+  /* The kernel compiler forms the sub-groups of max_sub_group_size
+     work-items with consecutive linear local ids. The last sub-group of
+     a work-group is partial if the work-group size is not a multiple of
+     it. */
+  size_t sg_size = device->max_sub_group_size;
+  size_t wg_size = 1;
+  size_t i;
+
+  switch (param_name)
+    {
+    case CL_KERNEL_MAX_SUB_GROUP_SIZE_FOR_NDRANGE:
+    case CL_KERNEL_SUB_GROUP_COUNT_FOR_NDRANGE:
+      {
+        POCL_RETURN_ERROR_ON (
+            (input_value == NULL || input_value_size == 0
+             || input_value_size % sizeof (size_t) != 0
+             || input_value_size > 3 * sizeof (size_t)),
+            CL_INVALID_VALUE,
+            "input_value must be a local size of 1 to 3 dimensions\n");
+        for (i = 0; i < input_value_size / sizeof (size_t); ++i)
+          wg_size *= ((const size_t *)input_value)[i];
+        if (param_name == CL_KERNEL_MAX_SUB_GROUP_SIZE_FOR_NDRANGE)
+          POCL_RETURN_GETINFO (size_t, min (sg_size, wg_size));
+        POCL_RETURN_GETINFO (size_t, (wg_size + sg_size - 1) / sg_size);
+      }
+    case CL_KERNEL_LOCAL_SIZE_FOR_SUB_GROUP_COUNT:
+      {
+        POCL_RETURN_ERROR_ON (
+            (input_value == NULL || input_value_size != sizeof (size_t)),
+            CL_INVALID_VALUE, "input_value must be a sub-group count\n");
+        size_t dims = (param_value != NULL)
+                          ? param_value_size / sizeof (size_t) : 3;
+        POCL_RETURN_ERROR_ON ((dims == 0 || dims > 3), CL_INVALID_VALUE,
+                              "param_value must have 1 to 3 dimensions\n");
+        size_t count = *(const size_t *)input_value;
+        size_t local_size[3] = { 0, 0, 0 };
+        /* A 1D work-group of count full sub-groups, or no local size if
+           it does not fit the device. */
+        if (count > 0 && count <= device->max_work_group_size / sg_size)
+          {
+            local_size[0] = count * sg_size;
+            for (i = 1; i < dims; ++i)
+              local_size[i] = 1;
+          }
+        POCL_RETURN_GETINFO_ARRAY (size_t, dims, local_size);
+      }
+    case CL_KERNEL_MAX_NUM_SUB_GROUPS:
+      POCL_RETURN_GETINFO (size_t, (device->max_work_group_size + sg_size - 1)
+                                       / sg_size);
+    case CL_KERNEL_COMPILE_NUM_SUB_GROUPS:
+      /* The kernels cannot request a number of sub-groups. */
+      POCL_RETURN_GETINFO (size_t, 0);
+    default:
+      return CL_INVALID_VALUE;
+    }
 }
+POsym(clGetKernelSubGroupInfo)
@@ -66,6 +66,26 @@ POname(clGetMemObjectInfo)(cl_mem      memobj ,
       POCL_RETURN_GETINFO (size_t, 0);
     else
       POCL_RETURN_GETINFO (size_t, memobj->origin);
+  case CL_MEM_ZERO_COPY_POCL:
+    {
+      cl_mem mem = memobj->parent ? memobj->parent : memobj;
+      cl_bool zero_copy = CL_FALSE;
+      unsigned i;
+      POCL_LOCK_OBJ (mem);
+      if (mem->mem_host_ptr != NULL)
+        {
+          zero_copy = CL_TRUE;
+          for (i = 0; i < mem->context->num_devices; ++i)
+            {
+              cl_device_id dev = mem->context->devices[i];
+              void *ptr = mem->device_ptrs[dev->global_mem_id].mem_ptr;
+              if (ptr != NULL && ptr != mem->mem_host_ptr)
+                zero_copy = CL_FALSE;
+            }
+        }
+      POCL_UNLOCK_OBJ (mem);
+      POCL_RETURN_GETINFO (cl_bool, zero_copy);
+    }
   }
   return CL_INVALID_VALUE;
 }
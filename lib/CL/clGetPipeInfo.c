@@ -23,10 +23,27 @@
 
 #include "pocl_util.h"
 
-/* Minimal OpenCL 3.0 conformant implementation when pipes are not supported */
 CL_API_ENTRY cl_int CL_API_ENTRY POname (clGetPipeInfo) (
     cl_mem pipe, cl_pipe_info param_name, size_t param_value_size,
     void *param_value, size_t *param_value_size_ret) CL_API_SUFFIX__VERSION_2_0
 {
-  return CL_INVALID_MEM_OBJECT;
-}
\ No newline at end of file
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (pipe)), CL_INVALID_MEM_OBJECT);
+
+  POCL_RETURN_ERROR_ON ((!pipe->is_pipe), CL_INVALID_MEM_OBJECT,
+                        "The memory object is not a pipe\n");
+
+  switch (param_name)
+    {
+    case CL_PIPE_PACKET_SIZE:
+      POCL_RETURN_GETINFO (cl_uint, (cl_uint)pipe->pipe_packet_size);
+    case CL_PIPE_MAX_PACKETS:
+      POCL_RETURN_GETINFO (cl_uint, (cl_uint)pipe->pipe_max_packets);
+    case CL_PIPE_PROPERTIES:
+      /* the pipes are created without properties */
+      if (param_value_size_ret)
+        *param_value_size_ret = 0;
+      return CL_SUCCESS;
+    }
+  return CL_INVALID_VALUE;
+}
+POsym (clGetPipeInfo)
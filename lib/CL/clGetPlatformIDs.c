@@ -174,17 +174,17 @@ struct _cl_icd_dispatch pocl_dispatch = {
   NULL, /* clCreateSamplerWithProperties */
   &POname(clSetKernelArgSVMPointer),
   &POname(clSetKernelExecInfo),
-  NULL, /* clGetKernelSubGroupInfoKHR */
+  &POname(clGetKernelSubGroupInfo), /* clGetKernelSubGroupInfoKHR */
   NULL, /* clCloneKernel */
   &POname(clCreateProgramWithIL),
-  NULL, /* &clUnknown139 */
+  &POname(clEnqueueSVMMigrateMem),
   &POname(clGetDeviceAndHostTimer),
   &POname(clGetHostTimer),
   &POname(clGetKernelSubGroupInfo),
   &POname(clSetDefaultDeviceCommandQueue),
   NULL, /* &clUnknown144 */
   NULL, /* &clUnknown145 */
-  NULL, /* &clUnknown146 */
+  &POname(clCreateBufferWithProperties), /* &clUnknown146 */
   NULL, /* &clUnknown147 */
   NULL, /* &clUnknown148 */
   NULL, /* &clUnknown149 */
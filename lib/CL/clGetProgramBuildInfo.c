@@ -69,7 +69,9 @@ POname(clGetProgramBuildInfo)(cl_program            program,
   switch (param_name) {
   case CL_PROGRAM_BUILD_STATUS:
     {
-      POCL_RETURN_GETINFO(cl_build_status, program->build_status);
+      POCL_RETURN_GETINFO (cl_build_status, (program->build_pending
+                                                 ? CL_BUILD_IN_PROGRESS
+                                                 : program->build_status));
     }
     
   case CL_PROGRAM_BUILD_OPTIONS:
@@ -125,6 +127,14 @@ POname(clGetProgramBuildInfo)(cl_program            program,
     {
       POCL_RETURN_GETINFO (size_t, device->global_var_pref_size);
     }
+  case CL_PROGRAM_BUILD_HASH_POCL:
+    {
+      int device_i = pocl_cl_device_built_index (program, device);
+      POCL_RETURN_ERROR_ON ((device_i < 0 || program->build_hash == NULL),
+                            CL_INVALID_PROGRAM_EXECUTABLE,
+                            "Program was not built for the device\n");
+      POCL_RETURN_GETINFO_STR ((const char *)program->build_hash[device_i]);
+    }
   }
   
   return CL_INVALID_VALUE;
@@ -0,0 +1,65 @@
+/* OpenCL runtime library: clGetStatisticsPoCL
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "pocl_cl.h"
+#include "pocl_stats.h"
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clGetStatisticsPoCL) (cl_platform_id platform, cl_uint num_entries,
+                              cl_ulong *values, const char **names,
+                              cl_uint *num_entries_ret)
+CL_API_SUFFIX__VERSION_1_2
+{
+  uint64_t current[POCL_STAT_NUM];
+  cl_platform_id tmp_platform;
+  cl_uint i;
+
+  POCL_RETURN_ERROR_COND ((platform == NULL), CL_INVALID_PLATFORM);
+  POname (clGetPlatformIDs) (1, &tmp_platform, NULL);
+  POCL_RETURN_ERROR_ON ((platform != tmp_platform), CL_INVALID_PLATFORM,
+                        "Can only return the statistics of the POCL "
+                        "platform\n");
+
+  POCL_RETURN_ERROR_COND ((num_entries == 0 && (values || names)),
+                          CL_INVALID_VALUE);
+  POCL_RETURN_ERROR_COND ((!values && !names && !num_entries_ret),
+                          CL_INVALID_VALUE);
+
+  if (num_entries > POCL_STAT_NUM)
+    num_entries = POCL_STAT_NUM;
+
+  if (values)
+    {
+      pocl_stats_read (current);
+      for (i = 0; i < num_entries; ++i)
+        values[i] = current[i];
+    }
+  if (names)
+    for (i = 0; i < num_entries; ++i)
+      names[i] = pocl_stat_name ((pocl_stat_id)i);
+  if (num_entries_ret)
+    *num_entries_ret = POCL_STAT_NUM;
+
+  return CL_SUCCESS;
+}
+POsym (clGetStatisticsPoCL)
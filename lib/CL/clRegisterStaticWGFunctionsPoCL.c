@@ -0,0 +1,45 @@
+/* OpenCL runtime library: clRegisterStaticWGFunctionsPoCL
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "pocl_cl.h"
+#include "pocl_static_wg.h"
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clRegisterStaticWGFunctionsPoCL) (
+    cl_platform_id platform, cl_uint num_functions,
+    const cl_static_wg_function_pocl *functions) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_platform_id tmp_platform;
+
+  POCL_RETURN_ERROR_COND ((platform == NULL), CL_INVALID_PLATFORM);
+  POname (clGetPlatformIDs) (1, &tmp_platform, NULL);
+  POCL_RETURN_ERROR_ON ((platform != tmp_platform), CL_INVALID_PLATFORM,
+                        "Can only register the WG functions to the POCL "
+                        "platform\n");
+
+  POCL_RETURN_ERROR_COND ((num_functions == 0 || functions == NULL),
+                          CL_INVALID_VALUE);
+
+  return pocl_static_wg_register (num_functions, functions);
+}
+POsym (clRegisterStaticWGFunctionsPoCL)
@@ -0,0 +1,64 @@
+/* OpenCL runtime library: clReleaseCommandBufferKHR
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_util.h"
+
+CL_API_ENTRY cl_int CL_API_CALL
+POname (clReleaseCommandBufferKHR) (cl_command_buffer_khr command_buffer)
+    CL_API_SUFFIX__VERSION_1_2
+{
+  int new_refcount;
+  cl_uint i;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_buffer)),
+                          CL_INVALID_COMMAND_BUFFER_KHR);
+
+  POCL_RELEASE_OBJECT (command_buffer, new_refcount);
+  POCL_MSG_PRINT_REFCOUNTS ("Release Command Buffer %p  %d\n",
+                            command_buffer, new_refcount);
+
+  if (new_refcount == 0)
+    {
+      VG_REFC_ZERO (command_buffer);
+      POCL_MSG_PRINT_REFCOUNTS ("Free Command Buffer %p\n", command_buffer);
+      cl_device_id dev = command_buffer->queue->device;
+      if (command_buffer->data && dev->ops->free_command_buffer)
+        dev->ops->free_command_buffer (dev, command_buffer);
+      for (i = 0; i < command_buffer->num_commands; ++i)
+        pocl_free_recorded_command (command_buffer->commands[i]);
+      POCL_MEM_FREE (command_buffer->commands);
+      POCL_MEM_FREE (command_buffer->properties);
+      if (command_buffer->last_enqueue)
+        POname (clReleaseEvent) (command_buffer->last_enqueue);
+      POname (clReleaseCommandQueue) (command_buffer->queue);
+      POCL_DESTROY_OBJECT (command_buffer);
+      POCL_MEM_FREE (command_buffer);
+    }
+  else
+    {
+      VG_REFC_NONZERO (command_buffer);
+    }
+
+  return CL_SUCCESS;
+}
+POsym (clReleaseCommandBufferKHR)
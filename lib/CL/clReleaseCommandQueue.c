@@ -48,6 +48,17 @@ POname(clReleaseCommandQueue)(cl_command_queue command_queue) CL_API_SUFFIX__VER
 
       POCL_ATOMIC_DEC (queue_c);
 
+      /* the default device queue is not retained by the context */
+      if (command_queue->properties & CL_QUEUE_ON_DEVICE)
+        {
+          unsigned i;
+          POCL_LOCK_OBJ (context);
+          for (i = 0; i < context->num_devices; ++i)
+            if (context->default_device_queues[i] == command_queue)
+              context->default_device_queues[i] = NULL;
+          POCL_UNLOCK_OBJ (context);
+        }
+
       /* hidden queues don't retain the context. */
       if ((command_queue->properties & CL_QUEUE_HIDDEN) == 0)
         POname (clReleaseContext) (context);
@@ -56,6 +67,8 @@ POname(clReleaseCommandQueue)(cl_command_queue command_queue) CL_API_SUFFIX__VER
       POCL_MSG_PRINT_REFCOUNTS ("Free Command Queue %p\n", command_queue);
       if (command_queue->device->ops->free_queue)
         command_queue->device->ops->free_queue (device, command_queue);
+      if (command_queue->batch_limit)
+        POCL_DESTROY_LOCK (command_queue->batch_lock);
       POCL_DESTROY_OBJECT (command_queue);
       POCL_MEM_FREE(command_queue);
     }
@@ -23,6 +23,7 @@
 */
 
 #include "devices/devices.h"
+#include "pocl_mem_management.h"
 #include "pocl_runtime_config.h"
 
 #ifdef ENABLE_LLVM
@@ -72,6 +73,7 @@ POname(clReleaseContext)(cl_context context) CL_API_SUFFIX__VERSION_1_0
         }
 
       POCL_MEM_FREE (context->default_queues);
+      POCL_MEM_FREE (context->default_device_queues);
       POCL_MEM_FREE(context->devices);
       POCL_MEM_FREE(context->properties);
 
@@ -82,6 +84,10 @@ POname(clReleaseContext)(cl_context context) CL_API_SUFFIX__VERSION_1_0
       pocl_llvm_release_context (context);
 #endif
 
+      pocl_host_mem_pool_destroy (context->host_mem_pool);
+      assert (context->mem_lru_first == NULL);
+      POCL_DESTROY_LOCK (context->mem_lru_lock);
+
       POCL_DESTROY_OBJECT (context);
       POCL_MEM_FREE(context);
 
@@ -68,6 +68,8 @@ POname(clReleaseEvent)(cl_event event) CL_API_SUFFIX__VERSION_1_0
       else
         POname(clReleaseContext) (event->context);
 
+      POCL_MEM_FREE (event->meta_data);
+      POCL_MEM_FREE (event->profile);
       POCL_DESTROY_OBJECT (event);
       pocl_mem_manager_free_event (event);
     }
@@ -21,6 +21,7 @@
    THE SOFTWARE.
 */
 
+#include "pocl_autotune.h"
 #include "pocl_cl.h"
 #include "pocl_util.h"
 
@@ -46,6 +47,15 @@ POname(clReleaseKernel)(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
       TP_FREE_KERNEL (kernel->context->id, kernel->id, kernel->name);
 
       POCL_MSG_PRINT_REFCOUNTS ("Free kernel %p\n", kernel);
+
+      /* the kernels of the blocks its launches enqueued on the device */
+      while (kernel->block_kernels != NULL)
+        {
+          cl_kernel block_kernel = kernel->block_kernels;
+          kernel->block_kernels = block_kernel->next_block_kernel;
+          POname (clReleaseKernel) (block_kernel);
+        }
+
       cl_program program = kernel->program;
       assert (program != NULL);
 
@@ -60,6 +70,7 @@ POname(clReleaseKernel)(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
             device->ops->free_kernel (device, program, kernel, i);
         }
 
+      pocl_kernel_args_release (kernel->args_snapshot);
       if (kernel->meta->total_argument_storage_size)
         {
           POCL_MEM_FREE (kernel->dyn_argument_storage);
@@ -76,6 +87,10 @@ POname(clReleaseKernel)(cl_kernel kernel) CL_API_SUFFIX__VERSION_1_0
       kernel->meta = NULL;
       POCL_MEM_FREE (kernel->data);
       POCL_MEM_FREE (kernel->dyn_arguments);
+      POCL_MEM_FREE (kernel->split_rates);
+      POCL_MEM_FREE (kernel->spec_last_values);
+      POCL_MEM_FREE (kernel->spec_same_count);
+      pocl_autotune_free (kernel);
       POCL_DESTROY_OBJECT (kernel);
       POCL_MEM_FREE (kernel);
       POCL_UNLOCK_OBJ (program);
@@ -23,6 +23,7 @@
 
 #include "devices.h"
 #include "pocl_cl.h"
+#include "pocl_util.h"
 #include "utlist.h"
 
 extern unsigned long buffer_c;
@@ -59,6 +60,8 @@ POname(clReleaseMemObject)(cl_mem memobj) CL_API_SUFFIX__VERSION_1_0
     {
       VG_REFC_ZERO (memobj);
 
+      pocl_mem_lru_remove (memobj);
+
       if (memobj->is_image)
         {
           TP_FREE_IMAGE (context->id, memobj->id);
@@ -104,10 +107,16 @@ POname(clReleaseMemObject)(cl_mem memobj) CL_API_SUFFIX__VERSION_1_0
           /* Free host mem allocated by the runtime */
           if (memobj->mem_host_ptr != NULL)
             {
-              if (memobj->flags & CL_MEM_USE_HOST_PTR)
+              if (memobj->is_external)
+                {
+                  pocl_unmap_dma_buf (memobj->mem_host_ptr, memobj->size,
+                                      memobj->external_fd);
+                  memobj->mem_host_ptr = NULL;
+                }
+              else if (memobj->flags & CL_MEM_USE_HOST_PTR)
                 memobj->mem_host_ptr = NULL; /* user allocated, do not free */
               else
-                POCL_MEM_FREE (memobj->mem_host_ptr);
+                pocl_free_mem_host_ptr (memobj);
             }
 
           POCL_MEM_FREE (memobj->device_ptrs);
@@ -105,11 +105,12 @@ POname(clReleaseProgram)(cl_program program) CL_API_SUFFIX__VERSION_1_0
               pocl_kernel_metadata_t *meta = &program->kernel_meta[i];
               POCL_MEM_FREE (meta->attributes);
               POCL_MEM_FREE (meta->name);
-              for (j = 0; j < meta->num_args; ++j)
-                {
-                  POCL_MEM_FREE (meta->arg_info[j].name);
-                  POCL_MEM_FREE (meta->arg_info[j].type_name);
-                }
+              if (meta->arg_info != NULL)
+                for (j = 0; j < meta->num_args; ++j)
+                  {
+                    POCL_MEM_FREE (meta->arg_info[j].name);
+                    POCL_MEM_FREE (meta->arg_info[j].type_name);
+                  }
               POCL_MEM_FREE (meta->arg_info);
               if (meta->data != NULL)
                 for (j = 0; j < program->num_devices; ++j)
@@ -124,6 +125,8 @@ POname(clReleaseProgram)(cl_program program) CL_API_SUFFIX__VERSION_1_0
 
       POCL_MEM_FREE (program->build_hash);
       POCL_MEM_FREE (program->compiler_options);
+      POCL_MEM_FREE (program->wg_specializations);
+      POCL_MEM_FREE (program->spec_arg_names);
       POCL_MEM_FREE (program->data);
 
       for (i = 0; i < program->num_builtin_kernels; ++i)
@@ -47,6 +47,11 @@ CL_API_SUFFIX__VERSION_1_2
                         CL_INVALID_MEM_OBJECT,
                         "The size buffer cannot be a sub-buffer\n");
 
+  /* the commands see sub-buffers as ranges of the parent, which has
+   * the content size for all of its sub-buffers */
+  POCL_RETURN_ERROR_ON ((buffer->parent != NULL), CL_INVALID_MEM_OBJECT,
+                        "The content buffer cannot be a sub-buffer\n");
+
   buffer->size_buffer = content_size_buffer;
   buffer->content_buffer = NULL;
 
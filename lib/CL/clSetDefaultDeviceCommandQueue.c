@@ -21,11 +21,43 @@
    IN THE SOFTWARE.
 */
 #include "pocl_cl.h"
+#include "pocl_util.h"
 
 CL_API_ENTRY cl_int CL_API_CALL POname (clSetDefaultDeviceCommandQueue) (
     cl_context context, cl_device_id device,
     cl_command_queue command_queue) CL_API_SUFFIX__VERSION_2_1
 {
-  return CL_INVALID_OPERATION;
+  unsigned i;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (context)), CL_INVALID_CONTEXT);
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (device)), CL_INVALID_DEVICE);
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_queue)),
+                          CL_INVALID_COMMAND_QUEUE);
+
+  POCL_RETURN_ERROR_ON ((device->on_dev_queue_props == 0),
+                        CL_INVALID_OPERATION,
+                        "The device does not support device queues\n");
+
+  POCL_RETURN_ERROR_ON (
+      ((command_queue->properties & CL_QUEUE_ON_DEVICE) == 0
+       || command_queue->context != context
+       || command_queue->device != device),
+      CL_INVALID_COMMAND_QUEUE,
+      "The queue is not a device queue of the device in the context\n");
+
+  for (i = 0; i < context->num_devices; i++)
+    if (context->devices[i] == pocl_real_dev (device))
+      break;
+  POCL_RETURN_ERROR_ON ((i == context->num_devices), CL_INVALID_DEVICE,
+                        "Could not find device in the context\n");
+
+  /* the queue stays the default until it is released */
+  POCL_LOCK_OBJ (context);
+  context->default_device_queues[i] = command_queue;
+  POCL_UNLOCK_OBJ (context);
+
+  return CL_SUCCESS;
 }
 POsym (clSetDefaultDeviceCommandQueue)
@@ -150,6 +150,11 @@ POname(clSetKernelArg)(cl_kernel kernel,
               !IS_CL_OBJECT_VALID ((const cl_mem)ptr_value),
               CL_INVALID_ARG_VALUE,
               "Arg %u is not a valid CL object\n", arg_index);
+          POCL_RETURN_ERROR_ON (
+              ((pi->type_qualifier & CL_KERNEL_ARG_TYPE_PIPE)
+               && !((const cl_mem)ptr_value)->is_pipe),
+              CL_INVALID_ARG_VALUE, "Arg %u is a pipe, but the value is not\n",
+              arg_index);
         }
     }
   else if (pi->type_size)
@@ -213,6 +218,7 @@ POname(clSetKernelArg)(cl_kernel kernel,
           value = pocl_aligned_malloc (arg_alignment, arg_alloc_size);
           if (value == NULL)
             {
+              pocl_kernel_args_changed (kernel, arg_index);
               return CL_OUT_OF_HOST_MEMORY;
             }
         }
@@ -223,11 +229,13 @@ POname(clSetKernelArg)(cl_kernel kernel,
           if (buf->parent != NULL)
             {
               p->offset = buf->origin;
+              p->sub_buffer_size = buf->size;
               buf = buf->parent;
             }
           else
             {
               p->offset = 0;
+              p->sub_buffer_size = 0;
             }
           memcpy (value, &buf, arg_size);
         }
@@ -244,6 +252,7 @@ POname(clSetKernelArg)(cl_kernel kernel,
 
   p->size = arg_size;
   p->is_set = 1;
+  pocl_kernel_args_changed (kernel, arg_index);
 
   return CL_SUCCESS;
 }
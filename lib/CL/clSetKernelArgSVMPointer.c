@@ -69,10 +69,12 @@ POname(clSetKernelArgSVMPointer)(cl_kernel kernel,
   memcpy (p->value, &arg_value, sizeof (void *));
 
   p->offset = 0;
+  p->sub_buffer_size = 0;
   p->is_set = 1;
   p->is_readonly = 0;
   p->is_svm = 1;
   p->size = sizeof (void *);
+  pocl_kernel_args_changed (kernel, arg_index);
 
   return CL_SUCCESS;
 }
@@ -34,19 +34,43 @@ POname(clSetKernelExecInfo)(cl_kernel  kernel ,
   POCL_RETURN_ERROR_ON((!kernel->context->svm_allocdev), CL_INVALID_CONTEXT,
                        "None of the devices in this context is SVM-capable\n");
 
-  /* TODO not sure what to actually do with indirect pointers..*/
+  /* The kernels access the SVM and system allocations in place, so the
+   * indirectly used pointers need no action, only validation. */
   switch (param_name)
     {
       case CL_KERNEL_EXEC_INFO_SVM_PTRS:
         {
+        POCL_RETURN_ERROR_ON (
+            ((param_value_size % sizeof (void *)) != 0
+             || (param_value_size > 0 && param_value == NULL)),
+            CL_INVALID_VALUE, "Invalid SVM pointer list\n");
         POCL_MSG_PRINT_INFO("clSetKernelExecInfo called with CL_KERNEL_EXEC_INFO_SVM_PTRS\n");
         break;
         }
       case CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM:
         {
+        POCL_RETURN_ERROR_ON (
+            (param_value_size != sizeof (cl_bool) || param_value == NULL),
+            CL_INVALID_VALUE, "param_value must be a cl_bool\n");
         cl_bool j = *(cl_bool*)param_value;
-        POCL_MSG_PRINT_INFO("clSetKernelExecInfo called with CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM: %i", j);
+        POCL_MSG_PRINT_INFO("clSetKernelExecInfo called with CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM: %i\n", j);
+        if (j == CL_FALSE)
+          break;
+        unsigned i;
+        for (i = 0; i < kernel->context->num_devices; ++i)
+          if (kernel->context->devices[i]->svm_caps
+              & CL_DEVICE_SVM_FINE_GRAIN_SYSTEM)
+            break;
+        POCL_RETURN_ERROR_ON ((i == kernel->context->num_devices),
+                              CL_INVALID_OPERATION,
+                              "None of the devices in this context supports "
+                              "fine-grained system SVM\n");
+        break;
         }
+      default:
+        POCL_RETURN_ERROR_ON (1, CL_INVALID_VALUE,
+                              "Unknown kernel exec info %u\n",
+                              (unsigned)param_name);
     }
 
   return CL_SUCCESS;
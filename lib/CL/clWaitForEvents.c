@@ -53,6 +53,7 @@ POname(clWaitForEvents)(cl_uint              num_events ,
       if (event_list[i]->command_type == CL_COMMAND_USER)
         continue;
       dev = event_list[i]->queue->device;
+      pocl_submit_batch (event_list[i]->queue);
       if (dev->ops->wait_event)
         dev->ops->wait_event (dev, event_list[i]);
       else
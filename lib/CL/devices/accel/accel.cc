@@ -28,15 +28,18 @@
 #include "common_driver.h"
 #include "devices.h"
 #include "pocl_cl.h"
+#include "pocl_runtime_config.h"
 #include "pocl_util.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <climits>
 #include <iostream>
 #include <set>
@@ -85,6 +88,21 @@
 
 #define AQL_PACKET_LENGTH (64)
 
+// Bounds of the interval of polling the completion signal, in microseconds.
+// The interval starts short for the kernels that finish quickly and doubles
+// up to the maximum for the long-running ones.
+#define ACCEL_POLL_MIN_US (1)
+#define ACCEL_POLL_MAX_US (1000)
+
+// How long to wait for the completion interrupt before reading the signal
+// again, in case the interrupt got lost.
+#define ACCEL_IRQ_TIMEOUT_MS (100)
+
+// Each AQL queue entry has a slot of this size at the same index in the
+// parameter memory, for the completion signal and the kernel arguments of
+// its packet.
+#define ACCEL_SLOT_SIZE (64)
+
 enum BuiltinKernelId : uint16_t {
   // CD = custom device, BI = built-in
   // 1D array byte copy, get_global_size(0) defines the size of data to copy
@@ -288,6 +306,19 @@ private:
   void *Data;
 };
 
+struct AccelEventData {
+  pocl_cond_t EventCond;
+  // The kernel has been written to the AQL queue.
+  bool Dispatched;
+  // The kernel waits for kernels in the AQL queue, so its packet must have
+  // the barrier bit.
+  bool NeedsBarrier;
+};
+
+struct AccelQueueData {
+  pocl_cond_t CQCond;
+};
+
 struct AccelData {
   size_t BaseAddress;
 
@@ -298,6 +329,8 @@ struct AccelData {
   memory_region_t AllocRegion;
 
   std::set<BIKD *> SupportedKernels;
+  // The descriptors of the fused kernels given in the device parameters.
+  std::vector<BIKD *> FusedKernels;
   // List of commands ready to be executed.
   _cl_command_node *ReadyList;
   // List of commands not yet ready to be executed.
@@ -307,8 +340,28 @@ struct AccelData {
 
   // Lock for device-side command queue manipulation
   pocl_lock_t AQLQueueLock;
+
+  // The UIO device of the completion interrupt, or -1 to poll the signals.
+  int IrqFd;
+
+  // The signal/argument slots of the AQL queue entries.
+  chunk_info_t *Slots;
+  uint32_t QueueLength;
+  // The commands of the packets in the AQL queue, indexed like the slots,
+  // NULL once retired.
+  std::vector<_cl_command_node *> InFlight;
+  // The index of the next packet to write, and of the oldest packet not
+  // retired yet; the slots are reused in order. Protected by AQLQueueLock.
+  uint32_t Submitted;
+  uint32_t Retired;
+  // Signalled when a packet is written to the queue, or on shutdown.
+  pocl_cond_t PacketCond;
+  pocl_thread_t CompletionThread;
+  bool ShutdownRequested;
 };
 
+static void *completionThread(void *data);
+
 void pocl_accel_init_device_ops(struct pocl_device_ops *ops) {
 
   ops->device_name = "accel";
@@ -327,7 +380,15 @@ void pocl_accel_init_device_ops(struct pocl_device_ops *ops) {
   ops->free_mapping_ptr = pocl_driver_free_mapping_ptr;
 
   ops->submit = pocl_accel_submit;
-  ops->flush = ops->join = pocl_accel_join;
+  ops->flush = pocl_accel_flush;
+  ops->join = pocl_accel_join;
+
+  ops->init_queue = pocl_accel_init_queue;
+  ops->free_queue = pocl_accel_free_queue;
+  ops->notify_cmdq_finished = pocl_accel_notify_cmdq_finished;
+  ops->notify_event_finished = pocl_accel_notify_event_finished;
+  ops->wait_event = pocl_accel_wait_event;
+  ops->free_event_data = pocl_accel_free_event_data;
 
   ops->write = pocl_accel_write;
   ops->read = pocl_accel_read;
@@ -344,9 +405,6 @@ void pocl_accel_init_device_ops(struct pocl_device_ops *ops) {
     ops->memfill = pocl_accel_memfill;
     ops->copy = pocl_accel_copy;
 
-    // new driver api (out-of-order): TODO implement these for accel
-    ops->wait_event = pocl_accel_wait_event;
-    ops->free_event_data = pocl_accel_free_event_data;
     ops->init_target_machine = NULL;
     ops->init_build = pocl_accel_init_build;
 #endif
@@ -440,6 +498,65 @@ cl_int pocl_accel_unmap_mem(void *data, pocl_mem_identifier *dst_mem_id,
 }
 
 
+static BIKD *findBuiltinKernel(BuiltinKernelId KernelId) {
+  size_t numBIKDs = sizeof(BIDescriptors) / sizeof(*BIDescriptors);
+  for (size_t i = 0; i < numBIKDs; ++i) {
+    if (BIDescriptors[i].KernelId == KernelId)
+      return &BIDescriptors[i];
+  }
+  return nullptr;
+}
+
+// Parses a fused kernel "<ID>=<ID0>+<ID1>+..." of the device parameters: a
+// chain of built-in kernels that the accelerator runs as one dispatch of
+// kernel ID <ID>, streaming the output of each stage to the next one instead
+// of through the device memory. The first argument of a stage is the input
+// streamed from the previous one and the last one its output, so the fused
+// kernel takes the arguments of the first stage except its output, then
+// those of the following stages except their first input, and the output of
+// the last stage. It is named by the stage names joined by '+'.
+static BIKD *parseFusedKernel(const char *Token) {
+  char *End;
+  unsigned long FusedId = strtoul(Token, &End, 0);
+  if (*End != '=')
+    POCL_ABORT("accel: Invalid fused kernel (%s) given\n", Token);
+
+  std::vector<BIKD *> Stages;
+  const char *P = End + 1;
+  while (true) {
+    unsigned long StageId = strtoul(P, &End, 0);
+    BIKD *Stage = End == P ? nullptr
+                           : findBuiltinKernel(
+                                 static_cast<BuiltinKernelId>(StageId));
+    if (Stage == nullptr || Stage->num_args < 2)
+      POCL_ABORT("accel: Invalid stage in fused kernel (%s) given\n", Token);
+    Stages.push_back(Stage);
+    if (*End == 0)
+      break;
+    if (*End != '+')
+      POCL_ABORT("accel: Invalid fused kernel (%s) given\n", Token);
+    P = End + 1;
+  }
+  if (Stages.size() < 2)
+    POCL_ABORT("accel: Fused kernel (%s) needs at least two stages\n", Token);
+
+  std::string Name;
+  std::vector<pocl_argument_info> ArgInfos;
+  for (size_t s = 0; s < Stages.size(); ++s) {
+    BIKD *Stage = Stages[s];
+    if (s > 0)
+      Name += "+";
+    Name += Stage->name;
+    unsigned First = s > 0 ? 1 : 0;
+    unsigned Last = s + 1 < Stages.size() ? Stage->num_args - 1
+                                          : Stage->num_args;
+    for (unsigned a = First; a < Last; ++a)
+      ArgInfos.push_back(Stage->arg_info[a]);
+  }
+  return new BIKD(static_cast<BuiltinKernelId>(FusedId), Name.c_str(),
+                  ArgInfos);
+}
+
 cl_int pocl_accel_init(unsigned j, cl_device_id dev, const char *parameters) {
 
   SETUP_DEVICE_CL_VERSION(1, 2);
@@ -468,6 +585,15 @@ cl_int pocl_accel_init(unsigned j, cl_device_id dev, const char *parameters) {
 
   std::string supportedList;
   while (paramToken = strtok_r(NULL, ",", &savePtr)) {
+    if (strchr(paramToken, '=')) {
+      BIKD *Fused = parseFusedKernel(paramToken);
+      if (supportedList.size() > 0)
+        supportedList += ";";
+      supportedList += Fused->name;
+      D->FusedKernels.push_back(Fused);
+      D->SupportedKernels.insert(Fused);
+      continue;
+    }
     auto token = strtoul(paramToken, NULL, 0);
     BuiltinKernelId kernelId = static_cast<BuiltinKernelId>(token);
     size_t numBIKDs = sizeof(BIDescriptors) / sizeof(*BIDescriptors);
@@ -523,10 +649,27 @@ cl_int pocl_accel_init(unsigned j, cl_device_id dev, const char *parameters) {
 
   pocl_init_mem_region(&D->AllocRegion, D->ParameterMemory.PhysAddress,
                        pmem_size);
+  pocl_set_mem_region_strategy(
+      &D->AllocRegion, pocl_get_mem_region_strategy_option(BALLOCS_SEGREGATED));
+  pocl_register_mem_region(&D->AllocRegion, "accel");
 
   // memory mapping done
   close(mem_fd);
 
+  // A UIO device that raises an interrupt when the accelerator writes a
+  // completion signal, if the platform has one.
+  char uioEnv[64];
+  snprintf(uioEnv, sizeof(uioEnv), "POCL_ACCEL%u_UIO", j);
+  const char *uioPath = pocl_get_string_option(uioEnv, NULL);
+  D->IrqFd = -1;
+  if (uioPath) {
+    D->IrqFd = open(uioPath, O_RDWR);
+    if (D->IrqFd == -1)
+      POCL_MSG_WARN("accel: could not open %s, polling the completion "
+                    "signals instead\n",
+                    uioPath);
+  }
+
   // Initialize AQL queue by setting all headers to invalid
   for (uint32_t i = 0; i < dmem_size; i += AQL_PACKET_LENGTH) {
     D->DataMemory.Write16(i, AQL_PACKET_INVALID);
@@ -546,6 +689,19 @@ cl_int pocl_accel_init(unsigned j, cl_device_id dev, const char *parameters) {
   POCL_INIT_LOCK(D->CommandListLock);
   POCL_INIT_LOCK(D->AQLQueueLock);
 
+  // The queue indices were reset to 0 above.
+  D->QueueLength = dmem_size / AQL_PACKET_LENGTH;
+  D->Slots = pocl_alloc_buffer_from_region(&D->AllocRegion,
+                                           D->QueueLength * ACCEL_SLOT_SIZE);
+  if (D->Slots == NULL) {
+    POCL_ABORT("accel: could not allocate the signal/argument slots\n");
+  }
+  D->InFlight.assign(D->QueueLength, nullptr);
+  D->Submitted = D->Retired = 0;
+  D->ShutdownRequested = false;
+  POCL_INIT_COND(D->PacketCond);
+  POCL_CREATE_THREAD(D->CompletionThread, completionThread, D);
+
   std::cout << "Custom device " << j << " initialized" << std::endl;
   return CL_SUCCESS;
 }
@@ -553,10 +709,24 @@ cl_int pocl_accel_init(unsigned j, cl_device_id dev, const char *parameters) {
 cl_int pocl_accel_uninit(unsigned /*j*/, cl_device_id device) {
   POCL_MSG_PRINT_INFO("accel: uninit\n");
   AccelData *D = (AccelData *)device->data;
+
+  POCL_LOCK(D->AQLQueueLock);
+  D->ShutdownRequested = true;
+  POCL_SIGNAL_COND(D->PacketCond);
+  POCL_UNLOCK(D->AQLQueueLock);
+  POCL_JOIN_THREAD(D->CompletionThread);
+  POCL_DESTROY_COND(D->PacketCond);
+  pocl_free_chunk(D->Slots);
+
   D->ControlMemory.Unmap();
   D->InstructionMemory.Unmap();
   D->DataMemory.Unmap();
   D->ParameterMemory.Unmap();
+  if (D->IrqFd != -1)
+    close(D->IrqFd);
+  pocl_unregister_mem_region(&D->AllocRegion);
+  for (auto Fused : D->FusedKernels)
+    delete Fused;
   delete D;
   return CL_SUCCESS;
 }
@@ -576,10 +746,7 @@ static cl_int
 pocl_accel_get_builtin_kernel_metadata(void *data, const char *kernel_name,
                                        pocl_kernel_metadata_t *target) {
   AccelData *D = (AccelData *)data;
-  BIKD *Desc = nullptr;
-  for (size_t i = 0; i < sizeof(BIDescriptors) / sizeof(BIDescriptors[0]);
-       ++i) {
-    Desc = &BIDescriptors[i];
+  for (BIKD *Desc : D->SupportedKernels) {
     if (std::string(Desc->name) == kernel_name) {
       memcpy(target, (pocl_kernel_metadata_t *)Desc,
              sizeof(pocl_kernel_metadata_t));
@@ -619,14 +786,73 @@ int pocl_accel_setup_metadata(cl_device_id device, cl_program program,
   return 1;
 }
 
+// Returns the physical address of the signal/argument slot of a queue entry.
+static size_t slotAddress(AccelData *D, uint32_t Index) {
+  return D->Slots->start_address + Index * ACCEL_SLOT_SIZE;
+}
+
+// Returns true if the command only waits for kernels already written to the
+// AQL queue of the device, which the barrier bit of its packet can order it
+// after. Called with the event and CommandListLock locked.
+static bool depsDispatched(cl_device_id Device, cl_event Event) {
+  event_node *N;
+  LL_FOREACH(Event->wait_list, N) {
+    cl_event Dep = N->event;
+    if (Dep->queue == NULL || Dep->queue->device != Device ||
+        Dep->command_type != CL_COMMAND_NDRANGE_KERNEL)
+      return false;
+    AccelEventData *DepData = (AccelEventData *)Dep->data;
+    if (DepData == NULL || !DepData->Dispatched)
+      return false;
+  }
+  return true;
+}
+
+// Kernels are set running as they enter the ready list, while their event is
+// locked, since scheduleCommands() writes them to the AQL queue holding
+// CommandListLock.
+static void setKernelRunning(_cl_command_node *Node) {
+  if (Node->type == CL_COMMAND_NDRANGE_KERNEL &&
+      Node->event->status == CL_SUBMITTED)
+    pocl_update_event_running_unlocked(Node->event);
+}
+
+// Moves a kernel to the ready list ahead of the completion of the kernels
+// it waits for, if they are all in the AQL queue. Called with the event and
+// CommandListLock locked.
+static bool pushBehindBarrier(AccelData &D, _cl_command_node *Node) {
+  if (Node->type != CL_COMMAND_NDRANGE_KERNEL ||
+      !depsDispatched(Node->device, Node->event))
+    return false;
+  ((AccelEventData *)Node->event->data)->NeedsBarrier = true;
+  pocl_update_event_submitted(Node->event);
+  setKernelRunning(Node);
+  CDL_PREPEND(D.ReadyList, Node);
+  return true;
+}
+
 static void scheduleCommands(AccelData &D) {
 
   _cl_command_node *Node;
 
   // Execute commands from ready list.
   while ((Node = D.ReadyList)) {
-    assert(pocl_command_is_ready(Node->event));
+    if (Node->type == CL_COMMAND_NDRANGE_KERNEL) {
+      assert(Node->event->status == CL_RUNNING);
+      // Kernels are only written to the AQL queue here, and complete in
+      // the completion thread. With the queue full, the completion thread
+      // schedules them once it retires packets.
+      POCL_LOCK(D.AQLQueueLock);
+      bool Full = D.Submitted - D.Retired == D.QueueLength;
+      POCL_UNLOCK(D.AQLQueueLock);
+      if (Full)
+        break;
+      CDL_DELETE(D.ReadyList, Node);
+      pocl_accel_run(&D, Node);
+      continue;
+    }
     assert(Node->event->status == CL_SUBMITTED);
+    assert(pocl_command_is_ready(Node->event));
     CDL_DELETE(D.ReadyList, Node);
     POCL_UNLOCK(D.CommandListLock);
     pocl_exec_command(Node);
@@ -637,11 +863,21 @@ static void scheduleCommands(AccelData &D) {
 
 void pocl_accel_submit(_cl_command_node *Node, cl_command_queue /*CQ*/) {
 
+  cl_event E = Node->event;
+  assert(E->data == NULL);
+  AccelEventData *ED = (AccelEventData *)calloc(1, sizeof(AccelEventData));
+  assert(ED);
+  POCL_INIT_COND(ED->EventCond);
+  E->data = (void *)ED;
+
   Node->ready = 1;
 
   struct AccelData *D = (AccelData *)Node->device->data;
   POCL_LOCK(D->CommandListLock);
-  pocl_command_push(Node, &D->ReadyList, &D->CommandList);
+  if (pocl_command_is_ready(E) || !pushBehindBarrier(*D, Node)) {
+    pocl_command_push(Node, &D->ReadyList, &D->CommandList);
+    setKernelRunning(Node);
+  }
 
   POCL_UNLOCK_OBJ(Node->event);
   scheduleCommands(*D);
@@ -649,7 +885,7 @@ void pocl_accel_submit(_cl_command_node *Node, cl_command_queue /*CQ*/) {
   return;
 }
 
-void pocl_accel_join(cl_device_id Device, cl_command_queue /*CQ*/) {
+void pocl_accel_flush(cl_device_id Device, cl_command_queue /*CQ*/) {
 
   struct AccelData *D = (AccelData *)Device->data;
   POCL_LOCK(D->CommandListLock);
@@ -658,6 +894,18 @@ void pocl_accel_join(cl_device_id Device, cl_command_queue /*CQ*/) {
   return;
 }
 
+void pocl_accel_join(cl_device_id Device, cl_command_queue CQ) {
+
+  pocl_accel_flush(Device, CQ);
+
+  POCL_LOCK_OBJ(CQ);
+  AccelQueueData *QD = (AccelQueueData *)CQ->data;
+  while (CQ->command_count > 0)
+    POCL_WAIT_COND(QD->CQCond, CQ->pocl_lock);
+  POCL_UNLOCK_OBJ(CQ);
+  return;
+}
+
 void pocl_accel_notify(cl_device_id Device, cl_event Event, cl_event Finished) {
 
   struct AccelData &D = *(AccelData *)Device->data;
@@ -672,21 +920,83 @@ void pocl_accel_notify(cl_device_id Device, cl_event Event, cl_event Finished) {
   if (!Node->ready)
     return;
 
+  // Already in the AQL queue behind a barrier.
+  if (Event->status != CL_QUEUED)
+    return;
+
   if (pocl_command_is_ready(Event)) {
-    if (Event->status == CL_QUEUED) {
-      pocl_update_event_submitted(Event);
-      POCL_LOCK(D.CommandListLock);
-      CDL_DELETE(D.CommandList, Node);
-      CDL_PREPEND(D.ReadyList, Node);
-      scheduleCommands(D);
-      POCL_UNLOCK(D.CommandListLock);
-    }
+    pocl_update_event_submitted(Event);
+    setKernelRunning(Node);
+    POCL_LOCK(D.CommandListLock);
+    CDL_DELETE(D.CommandList, Node);
+    CDL_PREPEND(D.ReadyList, Node);
+    scheduleCommands(D);
+    POCL_UNLOCK(D.CommandListLock);
     return;
   }
+
+  POCL_LOCK(D.CommandListLock);
+  CDL_DELETE(D.CommandList, Node);
+  if (pushBehindBarrier(D, Node))
+    scheduleCommands(D);
+  else
+    CDL_PREPEND(D.CommandList, Node);
+  POCL_UNLOCK(D.CommandListLock);
+}
+
+int pocl_accel_init_queue(cl_device_id /*Device*/, cl_command_queue Queue) {
+  AccelQueueData *QD = (AccelQueueData *)calloc(1, sizeof(AccelQueueData));
+  if (QD == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  POCL_INIT_COND(QD->CQCond);
+  Queue->data = QD;
+  return CL_SUCCESS;
+}
+
+int pocl_accel_free_queue(cl_device_id /*Device*/, cl_command_queue Queue) {
+  AccelQueueData *QD = (AccelQueueData *)Queue->data;
+  if (QD == NULL)
+    return CL_SUCCESS;
+  POCL_DESTROY_COND(QD->CQCond);
+  POCL_MEM_FREE(Queue->data);
+  return CL_SUCCESS;
+}
+
+void pocl_accel_notify_cmdq_finished(cl_command_queue CQ) {
+  /* must be called with CQ already locked.
+   * this must be a broadcast since there could be multiple
+   * user threads waiting on the same command queue */
+  AccelQueueData *QD = (AccelQueueData *)CQ->data;
+  POCL_BROADCAST_COND(QD->CQCond);
 }
 
-size_t scheduleNDRange(AccelData *data, _cl_command_run *run, size_t arg_size,
-                       void *arguments) {
+void pocl_accel_wait_event(cl_device_id /*Device*/, cl_event Event) {
+  AccelEventData *ED = (AccelEventData *)Event->data;
+
+  POCL_LOCK_OBJ(Event);
+  while (Event->status > CL_COMPLETE)
+    POCL_WAIT_COND(ED->EventCond, Event->pocl_lock);
+  POCL_UNLOCK_OBJ(Event);
+}
+
+void pocl_accel_free_event_data(cl_event Event) {
+  assert(Event->data != NULL);
+  AccelEventData *ED = (AccelEventData *)Event->data;
+  POCL_DESTROY_COND(ED->EventCond);
+  POCL_MEM_FREE(Event->data);
+}
+
+void pocl_accel_notify_event_finished(cl_event Event) {
+  AccelEventData *ED = (AccelEventData *)Event->data;
+  POCL_BROADCAST_COND(ED->EventCond);
+}
+
+// Writes the dispatch packet of a kernel and its arguments to the next entry
+// of the AQL queue, which has to have space. Called with CommandListLock
+// locked.
+void scheduleNDRange(AccelData *data, _cl_command_node *cmd, size_t arg_size,
+                     void *arguments) {
+  _cl_command_run *run = &cmd->command.run;
   int32_t kernelID = -1;
   for (auto supportedKernel : data->SupportedKernels) {
     if (strcmp(supportedKernel->name, run->kernel->name) == 0)
@@ -696,17 +1006,14 @@ size_t scheduleNDRange(AccelData *data, _cl_command_run *run, size_t arg_size,
   if (kernelID == -1) {
     POCL_ABORT("accel: scheduled an NDRange with unsupported kernel\n");
   }
-  // Additional space for a signal
-  size_t extraAlloc = sizeof(uint32_t);
-  chunk_info_t *chunk =
-      pocl_alloc_buffer_from_region(&data->AllocRegion, arg_size + extraAlloc);
-  assert(chunk && "Failed to allocate signal/argument buffer");
-
-  POCL_MSG_PRINT_INFO("accel: allocated 0x%zx bytes for signal/arguments "
-                      "from 0x%zx\n",
-                      arg_size + extraAlloc, chunk->start_address);
-  size_t signalAddress = chunk->start_address;
-  size_t argsAddress = signalAddress + extraAlloc;
+  AccelEventData *ED = (AccelEventData *)cmd->event->data;
+
+  POCL_LOCK(data->AQLQueueLock);
+
+  assert(data->Submitted - data->Retired < data->QueueLength);
+  uint32_t index = data->Submitted & (data->QueueLength - 1);
+  size_t signalAddress = slotAddress(data, index);
+  size_t argsAddress = signalAddress + sizeof(uint32_t);
   // Set initial signal value
   data->ParameterMemory.Write32(
       signalAddress - data->ParameterMemory.PhysAddress, 0);
@@ -730,39 +1037,128 @@ size_t scheduleNDRange(AccelData *data, _cl_command_run *run, size_t arg_size,
   packet.kernarg_address = argsAddress;
   packet.completion_signal = signalAddress;
 
-  POCL_LOCK(data->AQLQueueLock);
-
-  uint32_t queue_length = data->DataMemory.Size / AQL_PACKET_LENGTH;
-  uint32_t write_iter = data->ControlMemory.Read32(ACCEL_AQL_WRITE_LOW);
-  uint32_t read_iter = data->ControlMemory.Read32(ACCEL_AQL_READ_LOW);
-  while (write_iter >= read_iter + queue_length) {
-    read_iter = data->ControlMemory.Read32(ACCEL_AQL_READ_LOW);
-  }
-  uint32_t packet_loc = (write_iter & (queue_length - 1)) * AQL_PACKET_LENGTH;
+  uint32_t packet_loc = index * AQL_PACKET_LENGTH;
   data->DataMemory.CopyToMMAP(packet_loc + data->DataMemory.PhysAddress,
                               &packet, 64);
-  // finally, set header as not-invalid
+  // finally, set header as not-invalid; the barrier bit only for the
+  // kernels that wait for the ones before them, the others may run in
+  // parallel with those
   data->DataMemory.Write16(packet_loc,
-                           AQL_PACKET_KERNEL_DISPATCH | AQL_PACKET_BARRIER);
+                           AQL_PACKET_KERNEL_DISPATCH |
+                               (ED->NeedsBarrier ? AQL_PACKET_BARRIER : 0));
 
   // Increment queue index
   data->ControlMemory.Write32(ACCEL_AQL_WRITE_LOW, 1);
 
+  data->InFlight[index] = cmd;
+  ++data->Submitted;
+  ED->Dispatched = true;
+  POCL_SIGNAL_COND(data->PacketCond);
+
   POCL_UNLOCK(data->AQLQueueLock);
+}
 
-  return chunk->start_address;
+// Blocks until the interrupt of the UIO device is raised, or the timeout
+// passes. Returns false if the device can't be used for waiting.
+static bool waitForInterrupt(AccelData *data, size_t offset) {
+  // Unmask the interrupt first, then check the signal again: the
+  // accelerator may have completed before the unmasking.
+  uint32_t unmask = 1;
+  if (write(data->IrqFd, &unmask, sizeof(unmask)) != sizeof(unmask))
+    return false;
+  if (data->ParameterMemory.Read32(offset) != 0)
+    return true;
+  struct pollfd pfd = {data->IrqFd, POLLIN, 0};
+  if (poll(&pfd, 1, ACCEL_IRQ_TIMEOUT_MS) > 0) {
+    uint32_t irqCount;
+    if (read(data->IrqFd, &irqCount, sizeof(irqCount)) != sizeof(irqCount))
+      return false;
+  }
+  return true;
 }
 
+// Waits for the completion signal at the given physical address to be
+// written, and returns nonzero if the command failed.
 int waitOnEvent(AccelData *data, size_t event) {
   size_t offset = event - data->ParameterMemory.PhysAddress;
   uint32_t status;
-  do {
-    usleep(20000);
-    status = data->ParameterMemory.Read32(offset);
-  } while (status == 0);
+  unsigned delay = ACCEL_POLL_MIN_US;
+  while ((status = data->ParameterMemory.Read32(offset)) == 0) {
+    if (data->IrqFd != -1) {
+      if (waitForInterrupt(data, offset))
+        continue;
+      POCL_MSG_WARN("accel: waiting for the interrupt failed, polling the "
+                    "completion signals instead\n");
+      close(data->IrqFd);
+      data->IrqFd = -1;
+    }
+    usleep(delay);
+    delay = std::min(delay * 2, (unsigned)ACCEL_POLL_MAX_US);
+  }
   return status - 1;
 }
 
+// Retires the packets of the AQL queue as their completion signals are
+// written: waits for the oldest one, then completes all the outstanding
+// ones that have completed in one pass, and schedules the kernels that were
+// waiting for free queue entries.
+static void *completionThread(void *data) {
+  AccelData *D = (AccelData *)data;
+  std::vector<_cl_command_node *> Completed;
+
+  POCL_LOCK(D->AQLQueueLock);
+  while (true) {
+    if (D->Submitted == D->Retired) {
+      if (D->ShutdownRequested)
+        break;
+      POCL_WAIT_COND(D->PacketCond, D->AQLQueueLock);
+      continue;
+    }
+    uint32_t Oldest = D->Retired & (D->QueueLength - 1);
+    POCL_UNLOCK(D->AQLQueueLock);
+    waitOnEvent(D, slotAddress(D, Oldest));
+    POCL_LOCK(D->AQLQueueLock);
+
+    for (uint32_t i = D->Retired; i != D->Submitted; ++i) {
+      uint32_t Index = i & (D->QueueLength - 1);
+      _cl_command_node *Node = D->InFlight[Index];
+      if (Node == nullptr)
+        continue;
+      uint32_t Status = D->ParameterMemory.Read32(
+          slotAddress(D, Index) - D->ParameterMemory.PhysAddress);
+      if (Status == 0)
+        continue;
+      if (Status != 1) {
+        POCL_MSG_ERR("accel: command execution returned failure with "
+                     "kernel %s\n",
+                     Node->command.run.kernel->name);
+      } else {
+        POCL_MSG_PRINT_INFO("accel: successfully executed kernel %s\n",
+                            Node->command.run.kernel->name);
+      }
+      D->InFlight[Index] = nullptr;
+      Completed.push_back(Node);
+    }
+    while (D->Retired != D->Submitted &&
+           D->InFlight[D->Retired & (D->QueueLength - 1)] == nullptr)
+      ++D->Retired;
+    POCL_UNLOCK(D->AQLQueueLock);
+
+    for (auto Node : Completed)
+      POCL_UPDATE_EVENT_COMPLETE_MSG(Node->event,
+                                     "Event Enqueue NDRange       ");
+    Completed.clear();
+
+    POCL_LOCK(D->CommandListLock);
+    scheduleCommands(*D);
+    POCL_UNLOCK(D->CommandListLock);
+
+    POCL_LOCK(D->AQLQueueLock);
+  }
+  POCL_UNLOCK(D->AQLQueueLock);
+  return NULL;
+}
+
 void pocl_accel_run(void *data, _cl_command_node *cmd) {
   struct AccelData *D = (AccelData *)data;
   struct pocl_argument *al;
@@ -781,6 +1177,8 @@ void pocl_accel_run(void *data, _cl_command_node *cmd) {
       arg_size += meta->arg_info[i].type_size;
     }
   }
+  if (arg_size + sizeof(uint32_t) > ACCEL_SLOT_SIZE)
+    POCL_ABORT_UNIMPLEMENTED("accel: arguments larger than a queue slot");
 
   void *arguments = malloc(arg_size);
   char *current_arg = (char *)arguments;
@@ -822,14 +1220,6 @@ void pocl_accel_run(void *data, _cl_command_node *cmd) {
     }
   }
 
-  size_t event = scheduleNDRange(D, &cmd->command.run, arg_size, arguments);
+  scheduleNDRange(D, cmd, arg_size, arguments);
   free(arguments);
-  int fail = waitOnEvent(D, event);
-  if (fail) {
-    POCL_MSG_ERR("accel: command execution returned failure with kernel %s\n",
-                 kernel->name);
-  } else {
-    POCL_MSG_PRINT_INFO("accel: successfully executed kernel %s\n",
-                        kernel->name);
-  }
 }
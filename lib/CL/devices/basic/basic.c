@@ -43,6 +43,7 @@
 #include "pocl_cache.h"
 #include "pocl_file_util.h"
 #include "pocl_mem_management.h"
+#include "pocl_runtime_config.h"
 #include "pocl_timing.h"
 #include "pocl_workgroup_func.h"
 
@@ -60,6 +61,13 @@ struct data {
   /* Lock for command list related operations */
   pocl_lock_t cq_lock;
 
+  /* With POCL_BASIC_WORKER, the ready commands are run one at a time by a
+     worker thread instead of by the thread submitting them. */
+  int use_worker;
+  int worker_exit_requested;
+  pocl_cond_t worker_cond;
+  pocl_thread_t worker;
+
   /* Currently loaded kernel. */
   cl_kernel current_kernel;
 
@@ -113,6 +121,9 @@ pocl_basic_init_device_ops(struct pocl_device_ops *ops)
   ops->broadcast = pocl_broadcast;
   ops->notify = pocl_basic_notify;
   ops->flush = pocl_basic_flush;
+  ops->init_queue = pocl_basic_init_queue;
+  ops->free_queue = pocl_basic_free_queue;
+  ops->notify_cmdq_finished = pocl_basic_notify_cmdq_finished;
   ops->build_hash = pocl_basic_build_hash;
   ops->compute_local_size = pocl_default_local_size_optimizer;
 
@@ -145,7 +156,8 @@ pocl_basic_build_hash (cl_device_id device)
   char* res = calloc(1000, sizeof(char));
 #ifdef KERNELLIB_HOST_DISTRO_VARIANTS
   char *name = pocl_get_llvm_cpu_name ();
-  snprintf (res, 1000, "basic-%s-%s", HOST_DEVICE_BUILD_HASH, name);
+  snprintf (res, 1000, "basic-%s-%s-%s", HOST_DEVICE_BUILD_HASH, name,
+            pocl_get_distro_kernellib_variant ());
   POCL_MEM_FREE (name);
 #else
   snprintf (res, 1000, "basic-%s", HOST_DEVICE_BUILD_HASH);
@@ -165,6 +177,8 @@ pocl_basic_probe(struct pocl_device_ops *ops)
   return env_count;
 }
 
+static void basic_start_worker (struct data *d);
+
 cl_int
 pocl_basic_init (unsigned j, cl_device_id device, const char* parameters)
 {
@@ -190,7 +204,8 @@ pocl_basic_init (unsigned j, cl_device_id device, const char* parameters)
   pocl_init_default_device_infos (device);
   /* 0 is the host memory shared with all drivers that use it */
   device->global_mem_id = 0;
-  device->extensions = HOST_DEVICE_EXTENSIONS;
+  device->extensions
+      = HOST_DEVICE_EXTENSIONS HOST_DEVICE_EXTERNAL_MEMORY_EXTENSIONS;
 
   /* full memory consistency model for atomic memory and fence operations
   except CL_DEVICE_ATOMIC_SCOPE_ALL_DEVICES. see 
@@ -208,9 +223,11 @@ pocl_basic_init (unsigned j, cl_device_id device, const char* parameters)
                                       | CL_DEVICE_ATOMIC_SCOPE_DEVICE;
 
   device->svm_allocation_priority = 1;
-  /* OpenCL 2.0 properties */
+  /* OpenCL 2.0 properties. The host and the device share the address
+     space, so any host pointer can be given to the kernels. */
   device->svm_caps = CL_DEVICE_SVM_COARSE_GRAIN_BUFFER
-                     | CL_DEVICE_SVM_FINE_GRAIN_BUFFER | CL_DEVICE_SVM_ATOMICS;
+                     | CL_DEVICE_SVM_FINE_GRAIN_BUFFER
+                     | CL_DEVICE_SVM_FINE_GRAIN_SYSTEM | CL_DEVICE_SVM_ATOMICS;
 
   /* hwloc probes OpenCL device info at its initialization in case
      the OpenCL extension is enabled. This causes to printout 
@@ -223,6 +240,7 @@ pocl_basic_init (unsigned j, cl_device_id device, const char* parameters)
     ret = CL_INVALID_DEVICE;
 
   POCL_INIT_LOCK (d->cq_lock);
+  basic_start_worker (d);
 
   assert (device->printf_buffer_size > 0);
   d->printf_buffer = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
@@ -231,6 +249,8 @@ pocl_basic_init (unsigned j, cl_device_id device, const char* parameters)
 
   pocl_cpuinfo_detect_device_info(device);
   pocl_set_buffer_image_limits(device);
+  pocl_set_cpu_sub_group_limits (device);
+  pocl_set_cpu_pipe_limits (device);
 
   if (device->vendor_id == 0)
     device->vendor_id = CL_KHRONOS_VENDOR_ID_POCL;
@@ -437,6 +457,15 @@ cl_int
 pocl_basic_uninit (unsigned j, cl_device_id device)
 {
   struct data *d = (struct data*)device->data;
+  if (d->use_worker)
+    {
+      POCL_LOCK (d->cq_lock);
+      d->worker_exit_requested = 1;
+      POCL_SIGNAL_COND (d->worker_cond);
+      POCL_UNLOCK (d->cq_lock);
+      POCL_JOIN_THREAD (d->worker);
+      POCL_DESTROY_COND (d->worker_cond);
+    }
   POCL_DESTROY_LOCK (d->cq_lock);
   pocl_aligned_free (d->printf_buffer);
   POCL_MEM_FREE(d);
@@ -459,6 +488,7 @@ pocl_basic_reinit (unsigned j, cl_device_id device)
   assert (d->printf_buffer != NULL);
 
   POCL_INIT_LOCK (d->cq_lock);
+  basic_start_worker (d);
   device->data = d;
   return CL_SUCCESS;
 }
@@ -482,20 +512,64 @@ static void basic_command_scheduler (struct data *d)
   return;
 }
 
+static void *
+basic_worker (void *ptr)
+{
+  struct data *d = (struct data *)ptr;
+
+  POCL_LOCK (d->cq_lock);
+  while (1)
+    {
+      if (d->ready_list != NULL)
+        basic_command_scheduler (d);
+      else if (d->worker_exit_requested)
+        break;
+      else
+        POCL_WAIT_COND (d->worker_cond, d->cq_lock);
+    }
+  POCL_UNLOCK (d->cq_lock);
+  return NULL;
+}
+
+static void
+basic_start_worker (struct data *d)
+{
+  d->use_worker = pocl_get_bool_option ("POCL_BASIC_WORKER", 0);
+  if (!d->use_worker)
+    return;
+  d->worker_exit_requested = 0;
+  POCL_INIT_COND (d->worker_cond);
+  POCL_CREATE_THREAD (d->worker, basic_worker, d);
+}
+
+/* Runs the ready commands, or has the worker run them. Called with
+ * d->cq_lock held. */
+static void
+basic_run_ready (struct data *d)
+{
+  if (d->use_worker)
+    POCL_SIGNAL_COND (d->worker_cond);
+  else
+    basic_command_scheduler (d);
+}
+
 void
 pocl_basic_submit (_cl_command_node *node, cl_command_queue cq)
 {
   struct data *d = node->device->data;
 
   if (node != NULL && node->type == CL_COMMAND_NDRANGE_KERNEL)
-    pocl_check_kernel_dlhandle_cache (node, 1, 1);
+    {
+      pocl_choose_wg_specialization (node);
+      pocl_check_kernel_dlhandle_cache (node, 1, 1);
+    }
 
   node->ready = 1;
   POCL_LOCK (d->cq_lock);
   pocl_command_push(node, &d->ready_list, &d->command_list);
 
   POCL_UNLOCK_OBJ (node->event);
-  basic_command_scheduler (d);
+  basic_run_ready (d);
   POCL_UNLOCK (d->cq_lock);
 
   return;
@@ -506,7 +580,7 @@ void pocl_basic_flush (cl_device_id device, cl_command_queue cq)
   struct data *d = (struct data*)device->data;
 
   POCL_LOCK (d->cq_lock);
-  basic_command_scheduler (d);
+  basic_run_ready (d);
   POCL_UNLOCK (d->cq_lock);
 }
 
@@ -515,6 +589,16 @@ pocl_basic_join (cl_device_id device, cl_command_queue cq)
 {
   struct data *d = (struct data*)device->data;
 
+  if (d->use_worker)
+    {
+      pocl_cond_t *cq_cond = (pocl_cond_t *)cq->data;
+      POCL_LOCK_OBJ (cq);
+      while (cq->command_count > 0)
+        POCL_WAIT_COND (*cq_cond, cq->pocl_lock);
+      POCL_UNLOCK_OBJ (cq);
+      return;
+    }
+
   POCL_LOCK (d->cq_lock);
   basic_command_scheduler (d);
   POCL_UNLOCK (d->cq_lock);
@@ -545,23 +629,134 @@ pocl_basic_notify (cl_device_id device, cl_event event, cl_event finished)
           POCL_LOCK (d->cq_lock);
           CDL_DELETE (d->command_list, node);
           CDL_PREPEND (d->ready_list, node);
-          basic_command_scheduler (d);
+          basic_run_ready (d);
           POCL_UNLOCK (d->cq_lock);
         }
       return;
     }
 }
 
+int
+pocl_basic_init_queue (cl_device_id device, cl_command_queue queue)
+{
+  struct data *d = (struct data *)device->data;
+
+  queue->data = NULL;
+  if (!d->use_worker)
+    return CL_SUCCESS;
+  queue->data = malloc (sizeof (pocl_cond_t));
+  if (queue->data == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  POCL_INIT_COND (*(pocl_cond_t *)queue->data);
+  return CL_SUCCESS;
+}
+
+int
+pocl_basic_free_queue (cl_device_id device, cl_command_queue queue)
+{
+  if (queue->data == NULL)
+    return CL_SUCCESS;
+  POCL_DESTROY_COND (*(pocl_cond_t *)queue->data);
+  POCL_MEM_FREE (queue->data);
+  return CL_SUCCESS;
+}
+
+void
+pocl_basic_notify_cmdq_finished (cl_command_queue cq)
+{
+  /* called with cq locked; there can be several threads in join */
+  if (cq->data != NULL)
+    POCL_BROADCAST_COND (*(pocl_cond_t *)cq->data);
+}
+
 void
 pocl_basic_compile_kernel (_cl_command_node *cmd, cl_kernel kernel,
                            cl_device_id device, int specialize)
 {
+  /* Only make sure the linked binary is in the kernel cache (and thus in
+     the program binaries); the launches load it when needed. */
   if (cmd != NULL && cmd->type == CL_COMMAND_NDRANGE_KERNEL)
-    pocl_check_kernel_dlhandle_cache (cmd, 0, specialize);
+    {
+      char *module_fn = pocl_check_kernel_disk_cache (cmd, specialize);
+      POCL_MEM_FREE (module_fn);
+    }
 }
 
 /*********************** IMAGES ********************************/
 
+/* Where the pixels of an image, or of a linear host or buffer copy of a
+ * region of it, are: see POCL_IMAGE_X_OFFSET in pocl_image_rw_utils.h for
+ * the tiled layout. */
+typedef struct
+{
+  char *ptr;
+  size_t row_pitch;
+  size_t slice_pitch;
+  unsigned tile_shift;
+} image_layout_t;
+
+static void
+device_image_layout (cl_mem image, pocl_mem_identifier *mem_id,
+                     image_layout_t *l)
+{
+  l->ptr = (char *)mem_id->mem_ptr;
+  l->tile_shift = (unsigned)mem_id->extra;
+  if (l->tile_shift)
+    pocl_tiled_image_pitches (image, l->tile_shift, &l->row_pitch,
+                              &l->slice_pitch);
+  else
+    {
+      l->row_pitch = image->image_row_pitch;
+      l->slice_pitch = image->image_slice_pitch;
+    }
+}
+
+static size_t
+pixel_offset (const image_layout_t *l, size_t px, size_t x, size_t y,
+              size_t z)
+{
+  unsigned s = l->tile_shift;
+  size_t mask = ((size_t)1 << s) - 1;
+  return z * l->slice_pitch + px * (((x >> s) << (2 * s)) + (x & mask))
+         + (((y >> s) * l->row_pitch) << s) + ((y & mask) << s) * px;
+}
+
+/* The number of pixels from x on that are consecutive in memory. */
+static size_t
+pixel_run (const image_layout_t *l, size_t x)
+{
+  if (l->tile_shift == 0)
+    return SIZE_MAX;
+  size_t tile = (size_t)1 << l->tile_shift;
+  return tile - (x & (tile - 1));
+}
+
+/* Copies a region between two layouts, a run of consecutive pixels at a
+ * time. */
+static void
+copy_image_region (const image_layout_t *dst, const size_t *dst_origin,
+                   const image_layout_t *src, const size_t *src_origin,
+                   const size_t *region, size_t px)
+{
+  size_t x, y, z;
+  for (z = 0; z < region[2]; ++z)
+    for (y = 0; y < region[1]; ++y)
+      for (x = 0; x < region[0];)
+        {
+          size_t dx = dst_origin[0] + x, sx = src_origin[0] + x;
+          size_t n = min (region[0] - x,
+                          min (pixel_run (dst, dx), pixel_run (src, sx)));
+          memcpy (dst->ptr
+                      + pixel_offset (dst, px, dx, dst_origin[1] + y,
+                                      dst_origin[2] + z),
+                  src->ptr
+                      + pixel_offset (src, px, sx, src_origin[1] + y,
+                                      src_origin[2] + z),
+                  n * px);
+          x += n;
+        }
+}
+
 cl_int pocl_basic_copy_image_rect( void *data,
                                    cl_mem src_image,
                                    cl_mem dst_image,
@@ -594,6 +789,15 @@ cl_int pocl_basic_copy_image_rect( void *data,
       region[0], region[1], region[2],
       px);
 
+  if (src_mem_id->extra || dst_mem_id->extra)
+    {
+      image_layout_t src, dst;
+      device_image_layout (src_image, src_mem_id, &src);
+      device_image_layout (dst_image, dst_mem_id, &dst);
+      copy_image_region (&dst, dst_origin, &src, src_origin, region, px);
+      return CL_SUCCESS;
+    }
+
   pocl_driver_copy_rect (
       data, dst_mem_id, NULL, src_mem_id, NULL, adj_dst_origin, adj_src_origin,
       adj_region, dst_image->image_row_pitch, dst_image->image_slice_pitch,
@@ -637,6 +841,15 @@ cl_int pocl_basic_write_image_rect (  void *data,
   if (src_slice_pitch == 0)
     src_slice_pitch = src_row_pitch * region[1];
 
+  if (dst_mem_id->extra)
+    {
+      image_layout_t src = { (char *)ptr, src_row_pitch, src_slice_pitch, 0 };
+      image_layout_t dst;
+      device_image_layout (dst_image, dst_mem_id, &dst);
+      copy_image_region (&dst, origin, &src, zero_origin, region, px);
+      return CL_SUCCESS;
+    }
+
   const size_t adj_origin[3] = { origin[0] * px, origin[1], origin[2] };
   const size_t adj_region[3] = { region[0] * px, region[1], region[2] };
 
@@ -680,6 +893,16 @@ cl_int pocl_basic_read_image_rect(  void *data,
     dst_row_pitch = px * region[0];
   if (dst_slice_pitch == 0)
     dst_slice_pitch = dst_row_pitch * region[1];
+
+  if (src_mem_id->extra)
+    {
+      image_layout_t dst = { (char *)ptr, dst_row_pitch, dst_slice_pitch, 0 };
+      image_layout_t src;
+      device_image_layout (src_image, src_mem_id, &src);
+      copy_image_region (&dst, zero_origin, &src, origin, region, px);
+      return CL_SUCCESS;
+    }
+
   const size_t adj_origin[3] = { origin[0] * px, origin[1], origin[2] };
   const size_t adj_region[3] = { region[0] * px, region[1], region[2] };
 
@@ -743,6 +966,30 @@ pocl_basic_fill_image (void *data, cl_mem image,
                           region[0], region[1], region[2],
                           fill_pixel, pixel_size);
 
+  if (image_data->extra)
+    {
+      /* a tile row of pixels to copy the runs from */
+      char run[(1 << POCL_MAX_IMAGE_TILE_SHIFT) * sizeof (pixel_t)];
+      image_layout_t dst;
+      size_t i, j, k;
+      device_image_layout (image, image_data, &dst);
+      for (i = 0; i < ((size_t)1 << dst.tile_shift); ++i)
+        memcpy (run + i * pixel_size, fill_pixel, pixel_size);
+      for (k = 0; k < region[2]; ++k)
+        for (j = 0; j < region[1]; ++j)
+          for (i = 0; i < region[0];)
+            {
+              size_t x = origin[0] + i;
+              size_t n = min (region[0] - i, pixel_run (&dst, x));
+              memcpy (dst.ptr
+                          + pixel_offset (&dst, pixel_size, x, origin[1] + j,
+                                          origin[2] + k),
+                      run, n * pixel_size);
+              i += n;
+            }
+      return CL_SUCCESS;
+    }
+
   size_t row_pitch = image->image_row_pitch;
   size_t slice_pitch = image->image_slice_pitch;
   char *__restrict const adjusted_device_ptr
@@ -751,24 +998,55 @@ pocl_basic_fill_image (void *data, cl_mem image,
         + row_pitch * origin[1]
         + slice_pitch * origin[2];
 
-  size_t i, j, k;
+  size_t row_size = pixel_size * region[0];
+  size_t filled, j, k;
+
+  /* Fill the first row by doubling the filled part, then copy it to the
+   * other rows. */
+  if (row_size == 0)
+    return CL_SUCCESS;
+  memcpy (adjusted_device_ptr, fill_pixel, pixel_size);
+  for (filled = pixel_size; filled < row_size; filled *= 2)
+    memcpy (adjusted_device_ptr + filled, adjusted_device_ptr,
+            min (filled, row_size - filled));
 
   for (k = 0; k < region[2]; ++k)
-    for (j = 0; j < region[1]; ++j)
-      for (i = 0; i < region[0]; ++i)
-        memcpy (adjusted_device_ptr
-                  + pixel_size * i
-                  + row_pitch * j
-                  + slice_pitch * k,
-                fill_pixel,
-                pixel_size);
+    for (j = (k == 0); j < region[1]; ++j)
+      memcpy (adjusted_device_ptr + row_pitch * j + slice_pitch * k,
+              adjusted_device_ptr, row_size);
   return CL_SUCCESS;
 }
 
 /***************************************************************************/
+
+/* The SVM allocations backed by huge pages, which must be unmapped with
+ * their size. There are only a few such large allocations. */
+typedef struct huge_svm_alloc huge_svm_alloc;
+struct huge_svm_alloc
+{
+  void *ptr;
+  size_t size;
+  huge_svm_alloc *next;
+};
+static huge_svm_alloc *huge_svm_allocs = NULL;
+static pocl_lock_t huge_svm_lock = POCL_LOCK_INITIALIZER;
+
 void
 pocl_basic_svm_free (cl_device_id dev, void *svm_ptr)
 {
+  huge_svm_alloc *a;
+  POCL_LOCK (huge_svm_lock);
+  LL_SEARCH_SCALAR (huge_svm_allocs, a, ptr, svm_ptr);
+  if (a)
+    LL_DELETE (huge_svm_allocs, a);
+  POCL_UNLOCK (huge_svm_lock);
+
+  if (a)
+    {
+      pocl_huge_page_free (a->ptr, a->size);
+      POCL_MEM_FREE (a);
+      return;
+    }
   /* TODO we should somehow figure out the size argument
    * and call pocl_free_global_mem */
   pocl_aligned_free (svm_ptr);
@@ -778,6 +1056,23 @@ void *
 pocl_basic_svm_alloc (cl_device_id dev, cl_svm_mem_flags flags, size_t size)
 
 {
+  if (pocl_use_huge_pages (size))
+    {
+      huge_svm_alloc *a = (huge_svm_alloc *)malloc (sizeof (huge_svm_alloc));
+      if (a == NULL)
+        return NULL;
+      a->ptr = pocl_huge_page_alloc (size);
+      if (a->ptr == NULL)
+        {
+          POCL_MEM_FREE (a);
+          return NULL;
+        }
+      a->size = size;
+      POCL_LOCK (huge_svm_lock);
+      LL_PREPEND (huge_svm_allocs, a);
+      POCL_UNLOCK (huge_svm_lock);
+      return a->ptr;
+    }
   return pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, size);
 }
 
@@ -62,6 +62,16 @@
  * also for the case where there's a single region (basically heap) that
  * grows towards the stack or the global data area of the memory.
  *
+ * 4) The allocations are small and many, and they churn (e.g. kernel
+ * argument buffers of a long-running service).
+ *
+ * Searching through the chunk list and the fragmentation from reusing
+ * freed chunks as a whole become costly. A segregated-fit strategy keeps
+ * the unallocated chunks in power-of-two size class lists and splits the
+ * reused chunks. For large buffers, a binary buddy strategy allocates only
+ * power-of-two blocks, which wastes up to half of a block but always
+ * merges the freed blocks back to large ones.
+ *
  * @author Pekka Jääskeläinen 2011-2012
  *
  * @file bufalloc.c
@@ -70,6 +80,10 @@
 #include "bufalloc.h"
 #include "utlist.h"
 
+#ifndef __TCE_STANDALONE__
+#include <string.h>
+#endif
+
 //#define DEBUG_BUFALLOC
 
 
@@ -106,6 +120,189 @@ chunk_slack (chunk_info_t* chunk, size_t size, size_t* last_chunk_size)
   return end_chunk >= end_addr;
 }
 
+#if defined(BUFALLOC_NO_CHUNK_COALESCING) && !defined(BUFALLOC_NO_SIZE_CLASSES)
+#define BUFALLOC_NO_SIZE_CLASSES
+#endif
+
+static memory_address_t
+align_address (memory_region_t *region, memory_address_t addr)
+{
+  return (addr + region->alignment - 1) & ~(memory_address_t)(region->alignment - 1);
+}
+
+#ifndef BUFALLOC_NO_SIZE_CLASSES
+/* The floor of the 2-logarithm of the size. */
+static unsigned
+size_class (size_t size)
+{
+  unsigned c = 0;
+  while (size >>= 1)
+    ++c;
+  return c;
+}
+
+static void
+insert_free_chunk (memory_region_t *region, chunk_info_t *chunk)
+{
+  unsigned c = size_class (chunk->size);
+  chunk->prev_free = NULL;
+  chunk->next_free = region->size_classes[c];
+  if (chunk->next_free != NULL)
+    chunk->next_free->prev_free = chunk;
+  region->size_classes[c] = chunk;
+}
+
+/* Must be called before the size of the chunk changes. */
+static void
+remove_free_chunk (memory_region_t *region, chunk_info_t *chunk)
+{
+  if (chunk->prev_free != NULL)
+    chunk->prev_free->next_free = chunk->next_free;
+  else
+    region->size_classes[size_class (chunk->size)] = chunk->next_free;
+  if (chunk->next_free != NULL)
+    chunk->next_free->prev_free = chunk->prev_free;
+  chunk->next_free = chunk->prev_free = NULL;
+}
+
+/* Inserts a new chunk after the given one in the region's chunk list. */
+static void
+insert_chunk_after (memory_region_t *region, chunk_info_t *chunk,
+                    chunk_info_t *new_chunk)
+{
+  new_chunk->parent_region = region;
+  new_chunk->children = NULL;
+  new_chunk->prev = chunk;
+  new_chunk->next = chunk->next;
+  if (chunk->next != NULL)
+    chunk->next->prev = new_chunk;
+  else
+    region->chunks->prev = new_chunk;
+  chunk->next = new_chunk;
+  if (region->last_chunk == chunk)
+    region->last_chunk = new_chunk;
+}
+
+/**
+ * Allocates the first fitting chunk of the smallest size class that can
+ * have one, and splits the rest of it to a new unallocated chunk.
+ *
+ * All the chunks of the region start aligned. Must be called inside a
+ * locked region.
+ */
+static chunk_info_t *
+alloc_segregated (memory_region_t *region, size_t size)
+{
+  chunk_info_t *chunk = NULL, *rest;
+  memory_address_t end, rest_start;
+  unsigned c;
+
+  /* Only the chunks of the first class can be too small. */
+  for (c = size_class (size); c < BA_NUM_SIZE_CLASSES && chunk == NULL; ++c)
+    for (rest = region->size_classes[c]; rest != NULL; rest = rest->next_free)
+      if (chunk_slack (rest, size, NULL))
+        {
+          chunk = rest;
+          break;
+        }
+  if (chunk == NULL)
+    return NULL;
+
+  remove_free_chunk (region, chunk);
+  chunk->is_allocated = 1;
+
+  end = chunk->start_address + chunk->size;
+  rest_start = align_address (region, chunk->start_address + (size ? size : 1));
+  rest = region->free_chunks;
+  /* Without a free chunk info the chunk is used as a whole. */
+  if (rest_start >= end || rest == NULL)
+    return chunk;
+
+  DL_DELETE (region->free_chunks, rest);
+  chunk->size = rest_start - chunk->start_address;
+  rest->start_address = rest_start;
+  rest->size = end - rest_start;
+  rest->is_allocated = 0;
+  insert_chunk_after (region, chunk, rest);
+  insert_free_chunk (region, rest);
+  return chunk;
+}
+
+/**
+ * Allocates a block of the smallest power-of-two size that fits the
+ * requested size, splitting a larger block to halves until it fits.
+ *
+ * The unsplit upper halves are the unallocated buddies of the lower ones.
+ * Must be called inside a locked region.
+ */
+static chunk_info_t *
+alloc_buddy (memory_region_t *region, size_t size)
+{
+  chunk_info_t *chunk = NULL, *buddy;
+  size_t block = region->alignment;
+  unsigned c;
+
+  while (block < size)
+    {
+      block <<= 1;
+      if (block == 0)
+        return NULL;
+    }
+
+  for (c = size_class (block); c < BA_NUM_SIZE_CLASSES && chunk == NULL; ++c)
+    chunk = region->size_classes[c];
+  if (chunk == NULL)
+    return NULL;
+
+  remove_free_chunk (region, chunk);
+  chunk->is_allocated = 1;
+
+  /* Without a free chunk info the larger block is used as a whole. */
+  while (chunk->size > block && region->free_chunks != NULL)
+    {
+      buddy = region->free_chunks;
+      DL_DELETE (region->free_chunks, buddy);
+      chunk->size >>= 1;
+      buddy->start_address = chunk->start_address + chunk->size;
+      buddy->size = chunk->size;
+      buddy->is_allocated = 0;
+      insert_chunk_after (region, chunk, buddy);
+      insert_free_chunk (region, buddy);
+    }
+  return chunk;
+}
+
+/**
+ * Covers the initial chunk of the region with the largest power-of-two
+ * blocks that fit. The tail smaller than the alignment is left unused.
+ */
+static void
+init_buddy_blocks (memory_region_t *region)
+{
+  chunk_info_t *chunk = region->last_chunk, *next;
+  size_t rest = chunk->size, block;
+
+  while (1)
+    {
+      block = 1;
+      while ((block << 1) != 0 && (block << 1) <= rest)
+        block <<= 1;
+      chunk->size = block;
+      insert_free_chunk (region, chunk);
+      rest -= block;
+
+      next = region->free_chunks;
+      if (rest < region->alignment || next == NULL)
+        break;
+      DL_DELETE (region->free_chunks, next);
+      next->start_address = chunk->start_address + block;
+      next->is_allocated = 0;
+      insert_chunk_after (region, chunk, next);
+      chunk = next;
+    }
+}
+#endif
+
 /**
  * Tries to create a new chunk to the end of the given region.
  *
@@ -193,6 +390,25 @@ pocl_alloc_buffer_from_region (memory_region_t *region, size_t size)
      buffer to the end of the region without trying to reuse
      unallocated ones first. */
   chunk_info_t* chunk = NULL, *cursor;
+#ifndef BUFALLOC_NO_SIZE_CLASSES
+  if (region->strategy == BALLOCS_SEGREGATED
+      || region->strategy == BALLOCS_BUDDY)
+    {
+      BA_LOCK (region->lock);
+      if (region->strategy == BALLOCS_SEGREGATED)
+        chunk = alloc_segregated (region, size);
+      else
+        chunk = alloc_buddy (region, size);
+      BA_UNLOCK (region->lock);
+#ifdef DEBUG_BUFALLOC
+      printf ("#### after allocating %zu bytes in region %p\n", size, region);
+      print_chunks (region->chunks);
+      printf ("\n");
+#endif
+      return chunk;
+    }
+#endif
+
   if (region->strategy == BALLOCS_WASTEFUL)
     {
       chunk = append_new_chunk(region, size);
@@ -306,7 +522,7 @@ coalesce_chunks (chunk_info_t* first,
 
   /* The linked list head has a prev pointing to the last (sentinel),
      detect that here and do not merge first with the second. */
-  if (first->start_address > second->start_address) return second;
+  if (first->start_address >= second->start_address) return second;
 
 #ifdef DEBUG_BUFALLOC
   printf ("### coalescing chunks:\n");
@@ -330,6 +546,83 @@ coalesce_chunks (chunk_info_t* first,
 }
 #endif
 
+#ifndef BUFALLOC_NO_SIZE_CLASSES
+/* Must be called inside a locked region. */
+static void
+free_segregated (memory_region_t *region, chunk_info_t *chunk)
+{
+  chunk_info_t *prev = chunk->prev, *next = chunk->next;
+
+  if (prev != NULL && !prev->is_allocated
+      && prev->start_address < chunk->start_address)
+    {
+      remove_free_chunk (region, prev);
+      chunk = coalesce_chunks (prev, chunk);
+    }
+  if (next != NULL && !next->is_allocated)
+    {
+      remove_free_chunk (region, next);
+      coalesce_chunks (chunk, next);
+    }
+  insert_free_chunk (region, chunk);
+}
+
+/* Merges the freed block with its buddy as long as the buddy is free and
+   unsplit. Must be called inside a locked region. */
+static void
+free_buddy (memory_region_t *region, chunk_info_t *chunk)
+{
+  /* The first chunk is never merged away, it is the base of the blocks. */
+  memory_address_t base = region->chunks->start_address;
+  memory_address_t buddy_addr;
+  chunk_info_t *buddy, *tmp;
+
+  while (1)
+    {
+      buddy_addr
+          = base + ((chunk->start_address - base) ^ (memory_address_t)chunk->size);
+      buddy = (buddy_addr > chunk->start_address) ? chunk->next : chunk->prev;
+      if (buddy == NULL || buddy->start_address != buddy_addr
+          || buddy->is_allocated || buddy->size != chunk->size)
+        break;
+      remove_free_chunk (region, buddy);
+      if (buddy_addr < chunk->start_address)
+        {
+          tmp = chunk;
+          chunk = buddy;
+          buddy = tmp;
+        }
+      coalesce_chunks (chunk, buddy);
+    }
+  insert_free_chunk (region, chunk);
+}
+#endif
+
+/* Must be called inside a locked region. */
+static void
+release_chunk (memory_region_t *region, chunk_info_t *chunk)
+{
+#ifndef BUFALLOC_NO_SIZE_CLASSES
+  if (region->strategy == BALLOCS_SEGREGATED
+      || region->strategy == BALLOCS_BUDDY)
+    {
+      /* A chunk in the size class lists must not be inserted twice. */
+      if (!chunk->is_allocated)
+        return;
+      chunk->is_allocated = 0;
+      if (region->strategy == BALLOCS_SEGREGATED)
+        free_segregated (region, chunk);
+      else
+        free_buddy (region, chunk);
+      return;
+    }
+#endif
+  chunk->is_allocated = 0;
+#ifndef BUFALLOC_NO_CHUNK_COALESCING
+  coalesce_chunks (coalesce_chunks (chunk->prev, chunk), chunk->next);
+#endif
+}
+
 memory_region_t *
 free_buffer (memory_region_t *regions, memory_address_t addr)
 {
@@ -347,10 +640,7 @@ free_buffer (memory_region_t *regions, memory_address_t addr)
         {
           if (chunk->start_address == addr)
             {
-              chunk->is_allocated = 0;
-#ifndef BUFALLOC_NO_CHUNK_COALESCING
-              coalesce_chunks (coalesce_chunks (chunk->prev, chunk), chunk->next);
-#endif
+              release_chunk (region, chunk);
               BA_UNLOCK (region->lock);
 #ifdef DEBUG_BUFALLOC
               printf ("#### region %x after free_buffer at addr %x\n",
@@ -377,10 +667,7 @@ pocl_free_chunk (chunk_info_t *chunk)
 {
   memory_region_t *region = chunk->parent_region;
   BA_LOCK (region->lock);
-  chunk->is_allocated = 0;
-#ifndef BUFALLOC_NO_CHUNK_COALESCING
-  coalesce_chunks (coalesce_chunks (chunk->prev, chunk), chunk->next);
-#endif
+  release_chunk (region, chunk);
   BA_UNLOCK (region->lock);
 
 #ifdef DEBUG_BUFALLOC
@@ -391,30 +678,36 @@ pocl_free_chunk (chunk_info_t *chunk)
 
 }
 
-/** Initialize a memory_region_t.
- * @param region is a pointer to a existing memory_region_t data structure.
- * @param start the base address of the memory region to be managed.
- * @Param size  the size of the region (in bytes?)
- */
-void
-pocl_init_mem_region (memory_region_t *region, memory_address_t start,
-                      size_t size)
+/* Resets the region to a single unallocated chunk, set up for the
+   region's strategy. */
+static void
+reset_mem_region (memory_region_t *region)
 {
-  int i;
-  BA_INIT_LOCK (region->lock);
+  memory_address_t start = region->start_address;
+  size_t size = region->size;
+  unsigned i;
 
-  region->strategy = BALLOCS_WASTEFUL;
   region->chunks = NULL;
   region->free_chunks = NULL;
-  region->alignment = 64;
-  region->next = NULL;
-  region->prev = NULL;
+  for (i = 0; i < BA_NUM_SIZE_CLASSES; ++i)
+    region->size_classes[i] = NULL;
+
+  if (region->strategy == BALLOCS_SEGREGATED
+      || region->strategy == BALLOCS_BUDDY)
+    {
+      /* The chunks of these strategies always start aligned. */
+      memory_address_t aligned = align_address (region, start);
+      size = (aligned - start < size) ? size - (aligned - start) : 0;
+      start = aligned;
+    }
+
   /* Create the "sentinel chunk" */
   region->last_chunk = &region->all_chunks[0];
   region->last_chunk->start_address = start;
   region->last_chunk->size = size;
   region->last_chunk->is_allocated = 0;
   region->last_chunk->parent_region = region;
+  region->last_chunk->children = NULL;
 
   DL_APPEND(region->chunks, region->last_chunk);
 
@@ -422,8 +715,195 @@ pocl_init_mem_region (memory_region_t *region, memory_address_t start,
   for (i = 1; i < MAX_CHUNKS_IN_REGION; ++i)
     DL_APPEND (region->free_chunks, &region->all_chunks[i]);
 
+#ifndef BUFALLOC_NO_SIZE_CLASSES
+  if (region->strategy == BALLOCS_SEGREGATED)
+    insert_free_chunk (region, region->last_chunk);
+  else if (region->strategy == BALLOCS_BUDDY)
+    init_buddy_blocks (region);
+#endif
+}
+
+/** Initialize a memory_region_t.
+ * @param region is a pointer to a existing memory_region_t data structure.
+ * @param start the base address of the memory region to be managed.
+ * @Param size  the size of the region (in bytes?)
+ */
+void
+pocl_init_mem_region (memory_region_t *region, memory_address_t start,
+                      size_t size)
+{
+  BA_INIT_LOCK (region->lock);
+
+  region->strategy = BALLOCS_WASTEFUL;
+  region->start_address = start;
+  region->size = size;
+  region->alignment = 64;
+  region->next = NULL;
+  region->prev = NULL;
+  region->next_registered = NULL;
+  region->name = NULL;
+  reset_mem_region (region);
+
 #ifdef DEBUG_BUFALLOC
   printf ("#### memory region %x created. start: %x size: %u\n",
           region, start, size);
 #endif
 }
+
+/**
+ * Sets the allocation strategy of a memory region.
+ *
+ * Must be called before allocating from the region, after setting its
+ * alignment. The region is reset to a single unallocated chunk.
+ */
+void
+pocl_set_mem_region_strategy (memory_region_t *region,
+                              enum allocation_strategy strategy)
+{
+  BA_LOCK (region->lock);
+#ifdef BUFALLOC_NO_SIZE_CLASSES
+  if (strategy == BALLOCS_SEGREGATED || strategy == BALLOCS_BUDDY)
+    strategy = BALLOCS_TIGHT;
+#endif
+  region->strategy = strategy;
+  reset_mem_region (region);
+  BA_UNLOCK (region->lock);
+}
+
+/**
+ * Collects the usage statistics of a memory region.
+ */
+void
+pocl_mem_region_stats (memory_region_t *region, memory_region_stats_t *stats)
+{
+  chunk_info_t *chunk;
+
+  stats->total_size = region->size;
+  stats->allocated_size = 0;
+  stats->free_size = 0;
+  stats->largest_free_chunk = 0;
+  stats->allocated_chunks = 0;
+  stats->free_chunks = 0;
+
+  BA_LOCK (region->lock);
+  DL_FOREACH (region->chunks, chunk)
+    {
+      if (chunk->is_allocated)
+        {
+          stats->allocated_size += chunk->size;
+          ++stats->allocated_chunks;
+        }
+      else
+        {
+          stats->free_size += chunk->size;
+          ++stats->free_chunks;
+          if (chunk->size > stats->largest_free_chunk)
+            stats->largest_free_chunk = chunk->size;
+        }
+    }
+  BA_UNLOCK (region->lock);
+}
+
+#ifndef __TCE_STANDALONE__
+
+/* The regions printed by pocl_print_mem_region_stats (). */
+static memory_region_t *registered_regions = NULL;
+static pocl_lock_t registered_regions_lock = POCL_LOCK_INITIALIZER;
+
+/**
+ * Returns the strategy set with POCL_BUFALLOC_STRATEGY, or the given
+ * default one.
+ */
+enum allocation_strategy
+pocl_get_mem_region_strategy_option (enum allocation_strategy def)
+{
+  const char *s = pocl_get_string_option ("POCL_BUFALLOC_STRATEGY", NULL);
+  if (s == NULL)
+    return def;
+  if (strcmp (s, "wasteful") == 0)
+    return BALLOCS_WASTEFUL;
+  if (strcmp (s, "tight") == 0)
+    return BALLOCS_TIGHT;
+  if (strcmp (s, "segregated") == 0)
+    return BALLOCS_SEGREGATED;
+  if (strcmp (s, "buddy") == 0)
+    return BALLOCS_BUDDY;
+  POCL_MSG_WARN ("Unknown POCL_BUFALLOC_STRATEGY '%s'\n", s);
+  return def;
+}
+
+/**
+ * Adds the region to the ones whose statistics are printed with the
+ * system memory statistics. The name must outlive the registration.
+ */
+void
+pocl_register_mem_region (memory_region_t *region, const char *name)
+{
+  POCL_LOCK (registered_regions_lock);
+  region->name = name;
+  region->next_registered = registered_regions;
+  registered_regions = region;
+  POCL_UNLOCK (registered_regions_lock);
+}
+
+/**
+ * Removes a region added with pocl_register_mem_region (). Must be called
+ * before freeing a registered region.
+ */
+void
+pocl_unregister_mem_region (memory_region_t *region)
+{
+  memory_region_t **r;
+  POCL_LOCK (registered_regions_lock);
+  for (r = &registered_regions; *r != NULL; r = &(*r)->next_registered)
+    if (*r == region)
+      {
+        *r = region->next_registered;
+        break;
+      }
+  region->next_registered = NULL;
+  POCL_UNLOCK (registered_regions_lock);
+}
+
+void
+pocl_print_mem_region_stats ()
+{
+  memory_region_t *region;
+  memory_region_stats_t stats;
+
+  POCL_LOCK (registered_regions_lock);
+  for (region = registered_regions; region != NULL;
+       region = region->next_registered)
+    {
+      pocl_mem_region_stats (region, &stats);
+      /* The share of the unallocated memory that an allocation of the
+         whole unallocated size can't use. */
+      double fragmentation
+          = stats.free_size
+                ? 100.0
+                      * (1.0
+                         - (double)stats.largest_free_chunk / stats.free_size)
+                : 0.0;
+      POCL_MSG_PRINT_F (MEMORY, INFO, "",
+                        "____ Memory region %s (%s)\n"
+                        " ____ Size                           : %10zu KB\n"
+                        " ____ Allocated                      : %10zu KB"
+                        " in %u chunks\n"
+                        " ____ Unallocated                    : %10zu KB"
+                        " in %u chunks\n"
+                        " ____ Largest unallocated chunk      : %10zu KB\n"
+                        " ____ Fragmentation                  : %10.1f %%\n",
+                        region->name,
+                        region->strategy == BALLOCS_WASTEFUL     ? "wasteful"
+                        : region->strategy == BALLOCS_TIGHT      ? "tight"
+                        : region->strategy == BALLOCS_SEGREGATED ? "segregated"
+                                                                 : "buddy",
+                        stats.total_size >> 10, stats.allocated_size >> 10,
+                        stats.allocated_chunks, stats.free_size >> 10,
+                        stats.free_chunks, stats.largest_free_chunk >> 10,
+                        fragmentation);
+    }
+  POCL_UNLOCK (registered_regions_lock);
+}
+
+#endif
@@ -91,11 +91,21 @@ enum allocation_strategy
   {
     BALLOCS_WASTEFUL, /* try to fit to the end of the region first
                          (consumes the whole region quicker) */
-    BALLOCS_TIGHT     /* try to reuse old freed chunks first
+    BALLOCS_TIGHT,    /* try to reuse old freed chunks first
                          (for the case when the region grows dynamically e.g. towards stack)
                       */
+    BALLOCS_SEGREGATED, /* keep the unallocated chunks in power-of-two size
+                           class lists and split the reused chunks
+                           (allocation time does not grow with the number
+                           of chunks, for many small short-lived buffers) */
+    BALLOCS_BUDDY       /* binary buddy allocation of power-of-two blocks
+                           (bounded fragmentation for large buffers) */
   };
 
+/* The number of size classes of the unallocated chunk lists, one for each
+   power of two. */
+#define BA_NUM_SIZE_CLASSES (sizeof (size_t) * 8)
+
 #ifdef __TCE_STANDALONE__
 typedef AS_QUALIFIER volatile struct chunk_info chunk_info_t;
 typedef AS_QUALIFIER volatile struct memory_region memory_region_t;
@@ -118,6 +128,10 @@ struct chunk_info
   chunk_info_t* children;
   chunk_info_t* parent;
   memory_region_t* parent_region;
+  /* The size class list of the unallocated chunk (BALLOCS_SEGREGATED and
+     BALLOCS_BUDDY only). */
+  chunk_info_t* next_free;
+  chunk_info_t* prev_free;
 };
 
 /* Represents a single continuous region of memory from which smaller
@@ -139,13 +153,32 @@ struct memory_region
                                the last chunk is allocated, the region
                                is completely full. New chunks should be inserted
                                before this chunk. */
+  chunk_info_t *size_classes[BA_NUM_SIZE_CLASSES]; /* The unallocated chunks
+                                by the floor of the 2-logarithm of their size
+                                (BALLOCS_SEGREGATED) or their buddy order
+                                (BALLOCS_BUDDY). */
+  memory_address_t start_address;
+  size_t size;
   memory_region_t *next;
   memory_region_t *prev;
+  memory_region_t *next_registered; /* see pocl_register_mem_region () */
+  const char *name;
   enum allocation_strategy strategy;
   unsigned short alignment; /* alignment of the returned chunks in a 2's exponent byte count */
   ba_lock_t lock;
 };
 
+/* Usage statistics of a memory region. */
+typedef struct memory_region_stats
+{
+  size_t total_size;
+  size_t allocated_size;
+  size_t free_size;
+  size_t largest_free_chunk; /* the largest allocation that can succeed */
+  unsigned allocated_chunks;
+  unsigned free_chunks;
+} memory_region_stats_t;
+
 POCL_EXPORT
 chunk_info_t *pocl_alloc_buffer_from_region (memory_region_t *region,
                                              size_t size);
@@ -159,6 +192,29 @@ POCL_EXPORT
 void pocl_init_mem_region (
     memory_region_t *region, memory_address_t start, size_t size);
 
+POCL_EXPORT
+void pocl_set_mem_region_strategy (memory_region_t *region,
+                                   enum allocation_strategy strategy);
+
+POCL_EXPORT
+void pocl_mem_region_stats (memory_region_t *region,
+                            memory_region_stats_t *stats);
+
+#ifndef __TCE_STANDALONE__
+POCL_EXPORT
+enum allocation_strategy
+pocl_get_mem_region_strategy_option (enum allocation_strategy def);
+
+POCL_EXPORT
+void pocl_register_mem_region (memory_region_t *region, const char *name);
+
+POCL_EXPORT
+void pocl_unregister_mem_region (memory_region_t *region);
+
+POCL_EXPORT
+void pocl_print_mem_region_stats ();
+#endif
+
 chunk_info_t *create_sub_chunk (chunk_info_t *parent, size_t offset, size_t size);
 
 void
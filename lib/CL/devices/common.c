@@ -43,6 +43,7 @@
 #include "common.h"
 #include "pocl_shared.h"
 
+#include "bufalloc.h"
 #include "common_driver.h"
 #include "config.h"
 #include "config2.h"
@@ -52,8 +53,12 @@
 #include "pocl_file_util.h"
 #include "pocl_image_util.h"
 #include "pocl_mem_management.h"
+#include "pocl_perf_counters.h"
 #include "pocl_runtime_config.h"
+#include "pocl_static_wg.h"
+#include "pocl_stats.h"
 #include "pocl_timing.h"
+#include "pocl_tracing.h"
 #include "pocl_util.h"
 
 #ifdef HAVE_GETRLIMIT
@@ -98,38 +103,25 @@ unsigned long event_c;
  */
 
 #ifdef ENABLE_LLVM
+/* Generates the work-group function of the kernel and compiles it to an
+ * object file in memory, returned in objfile. If make_dir is set, creates
+ * the kernel's cache directory for the files derived from it. If
+ * object_key is not NULL, the key of the work-group function in the kernel
+ * object store is returned in it, and if the store already has the final
+ * binary, it is linked to final_binary_path instead and objfile is left
+ * NULL. Otherwise the cache lock of the key is returned in object_lock, to
+ * be released once the final binary has been stored. */
 static int
-llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
-              cl_device_id device, _cl_command_node *command, int specialize)
+llvm_codegen_object (unsigned device_i, cl_kernel kernel, cl_device_id device,
+                     _cl_command_node *command, int specialize, int make_dir,
+                     char **objfile, uint64_t *objfile_size, char *object_key,
+                     const char *final_binary_path, int *object_lock)
 {
-  POCL_MEASURE_START (llvm_codegen);
   int error = 0;
   void *llvm_module = NULL;
-
-  char tmp_module[POCL_FILENAME_LENGTH];
-  char tmp_objfile[POCL_FILENAME_LENGTH];
-
-  char *objfile = NULL;
-  uint64_t objfile_size = 0;
-
   cl_program program = kernel->program;
-
   const char *kernel_name = kernel->name;
-
-  /* $/parallel.bc */
-  char parallel_bc_path[POCL_FILENAME_LENGTH];
-  pocl_cache_work_group_function_path (parallel_bc_path, program, device_i,
-                                       kernel, command, specialize);
-
-  /* $/kernel.so */
-  char final_binary_path[POCL_FILENAME_LENGTH];
-  pocl_cache_final_binary_path (final_binary_path, program, device_i, kernel,
-                                command, specialize);
-
-  if (pocl_exists (final_binary_path))
-    goto FINISH;
-
-  assert (strlen (final_binary_path) < (POCL_FILENAME_LENGTH - 3));
+  uint64_t compile_start = pocl_gettimemono_ns ();
 
   error = pocl_llvm_generate_workgroup_function_nowrite (
       device_i, device, kernel, command, &llvm_module, specialize);
@@ -144,11 +136,15 @@ llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
 
   if (pocl_get_bool_option ("POCL_LEAVE_KERNEL_COMPILER_TEMP_FILES", 0))
     {
+      char parallel_bc_path[POCL_FILENAME_LENGTH];
+      pocl_cache_work_group_function_path (parallel_bc_path, program,
+                                           device_i, kernel, command,
+                                           specialize);
       POCL_MSG_PRINT_LLVM ("Writing parallel.bc to %s.\n", parallel_bc_path);
       error = pocl_cache_write_kernel_parallel_bc (
           llvm_module, program, device_i, kernel, command, specialize);
     }
-  else
+  else if (make_dir)
     {
       char kernel_parallel_path[POCL_FILENAME_LENGTH];
       pocl_cache_kernel_cachedir_path (kernel_parallel_path, program,
@@ -163,13 +159,21 @@ llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
       goto FINISH;
     }
 
-  /* May happen if another thread is building the same program & wins the llvm
-     lock. */
-  if (pocl_exists (final_binary_path))
-    goto FINISH;
+  if (object_key)
+    {
+      pocl_cache_object_key (object_key, kernel, device_i, command,
+                             specialize, llvm_module);
+      if (pocl_cache_fetch_object (object_key, final_binary_path) == 0)
+        goto FINISH;
+      /* whoever compiles the object stores it before releasing the lock */
+      *object_lock = pocl_cache_lock (POCL_CACHE_LOCK_OBJECT, object_key);
+      if (*object_lock >= 0
+          && pocl_cache_fetch_object (object_key, final_binary_path) == 0)
+        goto FINISH;
+    }
 
-  error = pocl_llvm_codegen (device, program, llvm_module, &objfile,
-                             &objfile_size);
+  error = pocl_llvm_codegen (device, program, llvm_module, objfile,
+                             objfile_size);
   if (error)
     {
       POCL_MSG_PRINT_LLVM ("pocl_llvm_codegen() failed for kernel %s\n",
@@ -177,6 +181,60 @@ llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
       goto FINISH;
     }
 
+FINISH:
+  pocl_destroy_llvm_module (llvm_module, kernel->context);
+  pocl_stat_add (POCL_STAT_KERNEL_COMPILES, 1);
+  pocl_stat_add (POCL_STAT_KERNEL_COMPILE_NS,
+                 pocl_gettimemono_ns () - compile_start);
+  return error;
+}
+
+static int
+llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
+              cl_device_id device, _cl_command_node *command, int specialize)
+{
+  POCL_MEASURE_START (llvm_codegen);
+  uint64_t codegen_start = pocl_gettimemono_ns ();
+  int error = 0;
+
+  char tmp_module[POCL_FILENAME_LENGTH];
+  char tmp_objfile[POCL_FILENAME_LENGTH];
+
+  char *objfile = NULL;
+  uint64_t objfile_size = 0;
+  SHA1_digest_t object_key;
+  int object_lock = -1;
+  int kernel_lock = -1;
+
+  cl_program program = kernel->program;
+
+  const char *kernel_name = kernel->name;
+
+  /* $/kernel.so */
+  char final_binary_path[POCL_FILENAME_LENGTH];
+  pocl_cache_final_binary_path (final_binary_path, program, device_i, kernel,
+                                command, specialize);
+
+  if (pocl_exists (final_binary_path))
+    goto FINISH;
+
+  /* Serialize the processes that miss the same kernel, including the
+   * work-group function generation; the holder releases the lock once the
+   * final binary has been renamed in place. */
+  kernel_lock = pocl_cache_lock (POCL_CACHE_LOCK_KERNEL, final_binary_path);
+  if (kernel_lock >= 0 && pocl_exists (final_binary_path))
+    goto FINISH;
+
+  assert (strlen (final_binary_path) < (POCL_FILENAME_LENGTH - 3));
+
+  error = llvm_codegen_object (device_i, kernel, device, command, specialize,
+                               1, &objfile, &objfile_size, (char *)object_key,
+                               final_binary_path, &object_lock);
+  if (error || objfile == NULL)
+    goto FINISH;
+
+  /* May happen if another thread is building the same program & wins the llvm
+     lock. */
   if (pocl_exists (final_binary_path))
     goto FINISH;
 
@@ -235,6 +293,8 @@ llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
       goto FINISH;
     }
 
+  pocl_cache_store_object ((char *)object_key, final_binary_path);
+
   /* if LEAVE_COMPILER_FILES, rename temporary kernel.so.o, else delete it */
   if (pocl_get_bool_option ("POCL_LEAVE_KERNEL_COMPILER_TEMP_FILES", 0))
     {
@@ -253,9 +313,13 @@ llvm_codegen (char *output, unsigned device_i, cl_kernel kernel,
     }
 
 FINISH:
-  pocl_destroy_llvm_module (llvm_module, kernel->context);
+  pocl_cache_unlock (object_lock);
+  pocl_cache_unlock (kernel_lock);
   POCL_MEM_FREE (objfile);
   POCL_MEASURE_FINISH (llvm_codegen);
+  if (pocl_tracing_spans_enabled)
+    pocl_tracing_span ("codegen", kernel_name, codegen_start,
+                       pocl_gettimemono_ns ());
 
   if (error)
     return error;
@@ -290,7 +354,17 @@ pocl_fill_dev_image_t (dev_image_t *di, struct pocl_argument *parg,
                               &(di->_num_channels), &(di->_elem_size));
 
   IMAGE1D_TO_BUFFER (mem);
-  di->_data = (mem->device_ptrs[device->global_mem_id].mem_ptr);
+  pocl_mem_identifier *mem_id = &mem->device_ptrs[device->global_mem_id];
+  di->_data = mem_id->mem_ptr;
+  di->_tile_shift = (cl_int)mem_id->extra;
+  if (di->_tile_shift)
+    {
+      size_t row_pitch, slice_pitch;
+      pocl_tiled_image_pitches (mem, di->_tile_shift, &row_pitch,
+                                &slice_pitch);
+      di->_row_pitch = row_pitch;
+      di->_slice_pitch = slice_pitch;
+    }
 }
 
 
@@ -450,9 +524,14 @@ pocl_exec_command (_cl_command_node *node)
               }
             else
               {
+                size_t size = pocl_migration_content_size (&cmd->migrate);
                 assert (dev->ops->read);
-                dev->ops->read (dev->data, mem->mem_host_ptr,
-                                cmd->migrate.mem_id, mem, 0, mem->size);
+                if (size)
+                  dev->ops->read (dev->data,
+                                  (char *)mem->mem_host_ptr
+                                      + cmd->migrate.offset,
+                                  cmd->migrate.mem_id, mem,
+                                  cmd->migrate.offset, size);
               }
             break;
           }
@@ -474,19 +553,28 @@ pocl_exec_command (_cl_command_node *node)
               }
             else
               {
+                size_t size = pocl_migration_content_size (&cmd->migrate);
                 assert (dev->ops->write);
-                dev->ops->write (dev->data, mem->mem_host_ptr,
-                                 cmd->migrate.mem_id, mem, 0, mem->size);
+                if (size)
+                  dev->ops->write (dev->data,
+                                   (char *)mem->mem_host_ptr
+                                       + cmd->migrate.offset,
+                                   cmd->migrate.mem_id, mem,
+                                   cmd->migrate.offset, size);
               }
             break;
           }
         case ENQUEUE_MIGRATE_TYPE_D2D:
           {
-            assert (dev->ops->can_migrate_d2d);
-            assert (dev->ops->migrate_d2d);
-            dev->ops->migrate_d2d (cmd->migrate.src_device, dev, mem,
-                                   cmd->migrate.src_id,
-                                   cmd->migrate.dst_id);
+            cl_device_id src_dev = cmd->migrate.src_device;
+            struct pocl_device_ops *ops
+                = (dev->ops->migrate_d2d ? dev->ops : src_dev->ops);
+            size_t size = pocl_migration_content_size (&cmd->migrate);
+            assert (ops->migrate_d2d);
+            if (size)
+              ops->migrate_d2d (src_dev, dev, mem, cmd->migrate.src_id,
+                                cmd->migrate.dst_id, cmd->migrate.offset,
+                                size);
             break;
           }
         case ENQUEUE_MIGRATE_TYPE_NOP:
@@ -685,53 +773,60 @@ pocl_exec_command (_cl_command_node *node)
       POCL_UPDATE_EVENT_COMPLETE_MSG (event, "Event SVM MemFill           ");
       break;
 
+    case CL_COMMAND_SVM_MIGRATE_MEM:
+      /* the SVM allocations of these devices are accessible to both the
+       * host and the device where they are, nothing to move */
+      pocl_update_event_running (event);
+      POCL_UPDATE_EVENT_COMPLETE_MSG (event, "Event SVM Migrate           ");
+      break;
+
     default:
       POCL_ABORT_UNIMPLEMENTED("");
       break;
     }
 }
 
-/* call with brc_event UNLOCKED. */
+/* call with brc_event UNLOCKED.
+ *
+ * The status of brc_event is final by now, so pocl_create_event_sync adds no
+ * more edges to it: its notify list is detached at once and the waiting
+ * events are then locked one at a time, each edge unlinked through its peer,
+ * instead of locking both events and searching the wait list per edge. */
 void
 pocl_broadcast (cl_event brc_event)
 {
+  event_node *targets;
   event_node *target;
   event_node *tmp;
 
-  while ((target = brc_event->notify_list))
+  POCL_LOCK_OBJ (brc_event);
+  targets = brc_event->notify_list;
+  brc_event->notify_list = NULL;
+  POCL_UNLOCK_OBJ (brc_event);
+
+  LL_FOREACH_SAFE (targets, target, tmp)
     {
-      pocl_lock_events_inorder (brc_event, target->event);
-      /* remove event from wait list */
-      LL_FOREACH (target->event->wait_list, tmp)
-        {
-          if (tmp->event == brc_event)
-            {
-              LL_DELETE (target->event->wait_list, tmp);
-              pocl_mem_manager_free_event_node (tmp);
-              break;
-            }
-        }
+      cl_event event = target->event;
+      POCL_LOCK_OBJ (event);
+      DL_DELETE (event->wait_list, target->peer);
 
-        if ((target->event->status == CL_SUBMITTED)
-            || (target->event->status == CL_QUEUED))
-          {
-            target->event->command->device->ops->notify (
-                target->event->command->device, target->event, brc_event);
-          }
+      if ((event->status == CL_SUBMITTED) || (event->status == CL_QUEUED))
+        event->command->device->ops->notify (event->command->device, event,
+                                             brc_event);
 
-        if (pocl_is_tracing_enabled() && target->event->meta_data)
-          {
-            pocl_event_md *md = target->event->meta_data;
-            for (size_t i = 0; i < md->num_deps; ++i)
-              if (md->dep_ids[i] == brc_event->id)
-                {
-                  md->dep_ts[i] = brc_event->time_end;
-                  break;
-                }
-          }
-        LL_DELETE (brc_event->notify_list, target);
-        pocl_unlock_events_inorder (brc_event, target->event);
-        pocl_mem_manager_free_event_node (target);
+      if (pocl_is_tracing_enabled () && event->meta_data)
+        {
+          pocl_event_md *md = event->meta_data;
+          for (size_t i = 0; i < md->num_deps; ++i)
+            if (md->dep_ids[i] == brc_event->id)
+              {
+                md->dep_ts[i] = pocl_event_profile_of (brc_event)->time_end;
+                break;
+              }
+        }
+      POCL_UNLOCK_OBJ (event);
+      pocl_mem_manager_free_event_node (target->peer);
+      pocl_mem_manager_free_event_node (target);
     }
 }
 
@@ -777,7 +872,7 @@ pocl_cmd_max_grid_dim_width (_cl_command_run *cmd)
 {
   return max (max (cmd->pc.local_size[0] * cmd->pc.num_groups[0],
                    cmd->pc.local_size[1] * cmd->pc.num_groups[1]),
-              cmd->pc.local_size[2] * cmd->pc.local_size[2]);
+              cmd->pc.local_size[2] * cmd->pc.num_groups[2]);
 }
 
 
@@ -798,18 +893,90 @@ struct pocl_dlhandle_cache_item
   int specialize;
   /* Maximum grid dimension this WG function works with. */
   size_t max_grid_dim_width;
+  /* The scalar argument values folded into the WG function. */
+  uint64_t spec_args;
+  uint64_t spec_arg_values[POCL_MAX_SPEC_ARGS];
+  /* If this is a first tier WG function of POCL_TIERED_COMPILATION. */
+  int fast;
 
   void *wg;
+  /* The optional launchers, NULL in the binaries built without them. */
+  void *wg_range;
+  void *wg_noalias;
+  void *wg_range_noalias;
   void *dlhandle;
+  /* Set instead of dlhandle if wg was loaded with the in-process JIT. */
+  void *jit_handle;
+  /* All the items, for eviction. */
   pocl_dlhandle_cache_item *next;
   pocl_dlhandle_cache_item *prev;
+  /* The next item in the same hash bucket. */
+  pocl_dlhandle_cache_item *bucket_next;
+  /* Key hash of the item. */
+  unsigned long key;
+  /* Value of dlhandle_clock at the last use, for LRU eviction. */
+  volatile unsigned long last_used;
   unsigned ref_count;
 };
 
 static pocl_dlhandle_cache_item *pocl_dlhandle_cache;
+/* Hash table of the cached items, keyed on the specialization tuple. */
+static pocl_dlhandle_cache_item **pocl_dlhandle_buckets;
+static unsigned pocl_dlhandle_num_buckets;
+static unsigned pocl_dlhandle_capacity;
+/* Advanced on every cache miss. */
+static unsigned long dlhandle_clock;
 static pocl_lock_t pocl_llvm_codegen_lock;
-static pocl_lock_t pocl_dlhandle_lock;
+/* Lookups take this for reading, so that they do not serialize; only
+ * insertion and eviction take it for writing. */
+static pthread_rwlock_t pocl_dlhandle_lock;
 static int pocl_dlhandle_cache_initialized;
+#ifdef ENABLE_LLVM
+static int pocl_bg_compile_enabled;
+static pocl_lock_t pocl_bg_compile_lock;
+static pthread_cond_t pocl_bg_compile_cond;
+#endif
+
+#define DEFAULT_CACHE_ITEMS 128
+
+#ifdef ENABLE_LLVM
+static void reset_bg_compile_after_fork ();
+#endif
+
+/* The fork handlers of POCL_PREFORK: the locks are held over the fork so
+   that the child gets the cache in a consistent state. The dlopened
+   handles stay valid in the child, which thus shares the WG functions
+   built before the fork with the parent instead of rebuilding them. */
+static void
+dlhandle_cache_prefork ()
+{
+#ifdef ENABLE_LLVM
+  POCL_LOCK (pocl_bg_compile_lock);
+#endif
+  POCL_LOCK (pocl_llvm_codegen_lock);
+  PTHREAD_CHECK (pthread_rwlock_wrlock (&pocl_dlhandle_lock));
+}
+
+static void
+dlhandle_cache_postfork_parent ()
+{
+  PTHREAD_CHECK (pthread_rwlock_unlock (&pocl_dlhandle_lock));
+  POCL_UNLOCK (pocl_llvm_codegen_lock);
+#ifdef ENABLE_LLVM
+  POCL_UNLOCK (pocl_bg_compile_lock);
+#endif
+}
+
+static void
+dlhandle_cache_postfork_child ()
+{
+  PTHREAD_CHECK (pthread_rwlock_unlock (&pocl_dlhandle_lock));
+  POCL_UNLOCK (pocl_llvm_codegen_lock);
+#ifdef ENABLE_LLVM
+  reset_bg_compile_after_fork ();
+  POCL_UNLOCK (pocl_bg_compile_lock);
+#endif
+}
 
 /* only to be called in basic/pthread/<other cpu driver> init */
 void
@@ -818,36 +985,111 @@ pocl_init_dlhandle_cache ()
   if (!pocl_dlhandle_cache_initialized)
     {
       POCL_INIT_LOCK (pocl_llvm_codegen_lock);
-      POCL_INIT_LOCK (pocl_dlhandle_lock);
+      PTHREAD_CHECK (pthread_rwlock_init (&pocl_dlhandle_lock, NULL));
+#ifdef ENABLE_LLVM
+      POCL_INIT_LOCK (pocl_bg_compile_lock);
+      PTHREAD_CHECK (pthread_cond_init (&pocl_bg_compile_cond, NULL));
+      pocl_bg_compile_enabled
+          = pocl_get_bool_option ("POCL_BACKGROUND_SPECIALIZATION", 0);
+#endif
+
+      int capacity = pocl_get_int_option ("POCL_DLHANDLE_CACHE_SIZE",
+                                          DEFAULT_CACHE_ITEMS);
+      pocl_dlhandle_capacity = capacity > 0 ? capacity : DEFAULT_CACHE_ITEMS;
+      /* a power of two, with a load factor of at most 1 */
+      pocl_dlhandle_num_buckets = 1;
+      while (pocl_dlhandle_num_buckets < pocl_dlhandle_capacity)
+        pocl_dlhandle_num_buckets <<= 1;
+      pocl_dlhandle_buckets = (pocl_dlhandle_cache_item **)calloc (
+          pocl_dlhandle_num_buckets, sizeof (pocl_dlhandle_cache_item *));
+      assert (pocl_dlhandle_buckets);
+
+      if (pocl_get_bool_option ("POCL_PREFORK", 0))
+        PTHREAD_CHECK (pthread_atfork (dlhandle_cache_prefork,
+                                       dlhandle_cache_postfork_parent,
+                                       dlhandle_cache_postfork_child));
+
       pocl_dlhandle_cache_initialized = 1;
    }
 }
 
 static unsigned handle_count = 0;
-#define MAX_CACHE_ITEMS 128
 
-/* must be called with pocl_dlhandle_lock LOCKED */
+/* The number of values in spec_arg_values for the spec_args mask. */
+static unsigned
+spec_arg_count (uint64_t spec_args)
+{
+  unsigned n = __builtin_popcountll (spec_args);
+  return n < POCL_MAX_SPEC_ARGS ? n : POCL_MAX_SPEC_ARGS;
+}
+
+/* Hashes the exact-match part of the specialization tuple. The grid width
+   is matched with <= and thus can't be part of the key. */
+static unsigned long
+dlhandle_key (_cl_command_run *run_cmd, int specialize, int goffs_zero)
+{
+  uint64_t h;
+  unsigned i;
+  /* the kernel hash is already a digest */
+  memcpy (&h, run_cmd->hash, sizeof (h));
+  for (i = 0; i < 3; ++i)
+    h = (h ^ run_cmd->pc.local_size[i]) * 0x100000001b3ULL;
+  h = (h
+       ^ (uint64_t)((run_cmd->fast_wg_func << 2) | (specialize << 1)
+                    | goffs_zero))
+      * 0x100000001b3ULL;
+  h = (h ^ run_cmd->spec_args) * 0x100000001b3ULL;
+  for (i = 0; i < spec_arg_count (run_cmd->spec_args); ++i)
+    h = (h ^ run_cmd->spec_arg_values[i]) * 0x100000001b3ULL;
+  return (unsigned long)(h ^ (h >> 32));
+}
+
+static pocl_dlhandle_cache_item **
+dlhandle_bucket (unsigned long key)
+{
+  return &pocl_dlhandle_buckets[key & (pocl_dlhandle_num_buckets - 1)];
+}
+
+/* must be called with pocl_dlhandle_lock held for writing */
 static pocl_dlhandle_cache_item *
 get_new_dlhandle_cache_item ()
 {
-  pocl_dlhandle_cache_item *ci = NULL;
+  pocl_dlhandle_cache_item *ci = NULL, *lru = NULL;
   const char *dl_error = NULL;
 
-  if (pocl_dlhandle_cache)
+  if (handle_count >= pocl_dlhandle_capacity)
     {
-      ci = pocl_dlhandle_cache->prev;
-      while (ci->ref_count > 0 && ci != pocl_dlhandle_cache)
-        ci = ci->prev;
+      DL_FOREACH (pocl_dlhandle_cache, ci)
+      {
+        if (ci->ref_count == 0
+            && (lru == NULL || ci->last_used < lru->last_used))
+          lru = ci;
+      }
     }
 
-  if ((handle_count >= MAX_CACHE_ITEMS) && ci && (ci != pocl_dlhandle_cache))
+  if (lru)
     {
-      DL_DELETE (pocl_dlhandle_cache, ci);
-      dlclose (ci->dlhandle);
-      dl_error = dlerror ();
-      if (dl_error != NULL)
-        POCL_ABORT ("dlclose() failed with error: %s\n", dl_error);
-      memset (ci, 0, sizeof (pocl_dlhandle_cache_item));
+      pocl_dlhandle_cache_item **pp = dlhandle_bucket (lru->key);
+      while (*pp != lru)
+        pp = &(*pp)->bucket_next;
+      *pp = lru->bucket_next;
+      DL_DELETE (pocl_dlhandle_cache, lru);
+
+#ifdef ENABLE_LLVM
+      if (lru->jit_handle)
+        pocl_llvm_jit_unload (lru->jit_handle);
+      else
+#endif
+      /* the statically linked WG functions have neither handle */
+      if (lru->dlhandle)
+        {
+          dlclose (lru->dlhandle);
+          dl_error = dlerror ();
+          if (dl_error != NULL)
+            POCL_ABORT ("dlclose() failed with error: %s\n", dl_error);
+        }
+      memset (lru, 0, sizeof (pocl_dlhandle_cache_item));
+      ci = lru;
     }
   else
     {
@@ -860,28 +1102,20 @@ get_new_dlhandle_cache_item ()
 }
 
 void
-pocl_release_dlhandle_cache (_cl_command_node *cmd)
+pocl_release_dlhandle_item (void *item)
 {
-  pocl_dlhandle_cache_item *ci = NULL, *found = NULL;
+  pocl_dlhandle_cache_item *ci = (pocl_dlhandle_cache_item *)item;
 
-  POCL_LOCK (pocl_dlhandle_lock);
-  DL_FOREACH (pocl_dlhandle_cache, ci)
-  {
-    if ((memcmp (ci->hash, cmd->command.run.hash, sizeof (pocl_kernel_hash_t))
-         == 0)
-        && (ci->local_wgs[0] == cmd->command.run.pc.local_size[0])
-        && (ci->local_wgs[1] == cmd->command.run.pc.local_size[1])
-        && (ci->local_wgs[2] == cmd->command.run.pc.local_size[2]))
-      {
-        found = ci;
-        break;
-      }
-  }
+  /* The item can't be evicted while referenced, so no lock is needed. */
+  assert (ci != NULL);
+  assert (ci->ref_count > 0);
+  POCL_ATOMIC_DEC (ci->ref_count);
+}
 
-  assert (found != NULL);
-  assert (found->ref_count > 0);
-  --found->ref_count;
-  POCL_UNLOCK (pocl_dlhandle_lock);
+void
+pocl_release_dlhandle_cache (_cl_command_node *cmd)
+{
+  pocl_release_dlhandle_item (cmd->command.run.dlhandle_item);
 }
 
 /**
@@ -912,6 +1146,7 @@ pocl_check_kernel_disk_cache (_cl_command_node *command, int specialized)
   if (pocl_exists (module_fn))
     {
       POCL_MSG_PRINT_INFO ("Using a cached WG function: %s\n", module_fn);
+      pocl_stat_add (POCL_STAT_DISK_CACHE_HITS, 1);
       return module_fn;
     }
 
@@ -920,10 +1155,14 @@ pocl_check_kernel_disk_cache (_cl_command_node *command, int specialized)
   if (p->binaries[dev_i])
     {
 #ifdef ENABLE_LLVM
-      POCL_LOCK (pocl_llvm_codegen_lock);
+      int serialize = !pocl_llvm_parallel_codegen ();
+      if (serialize)
+        POCL_LOCK (pocl_llvm_codegen_lock);
+      pocl_stat_add (POCL_STAT_DISK_CACHE_MISSES, 1);
       int error = llvm_codegen (module_fn, dev_i, k, command->device, command,
                                 specialized);
-      POCL_UNLOCK (pocl_llvm_codegen_lock);
+      if (serialize)
+        POCL_UNLOCK (pocl_llvm_codegen_lock);
       if (error)
         POCL_ABORT ("Final linking of kernel %s failed.\n", k->name);
       POCL_MSG_PRINT_INFO ("Built a %sWG function: %s\n",
@@ -961,37 +1200,480 @@ pocl_check_kernel_disk_cache (_cl_command_node *command, int specialized)
   return module_fn;
 }
 
+/* Looks up the optional launchers generated next to the WG function named
+   wg_name. They were added later than it, so the binaries built before do
+   not have them. */
+static void
+find_optional_launchers (pocl_dlhandle_cache_item *ci, const char *wg_name)
+{
+  static const char *suffixes[3] = { "_range", "_noalias", "_range_noalias" };
+  void **launchers[3] = { &ci->wg_range, &ci->wg_noalias,
+                          &ci->wg_range_noalias };
+  char name[WORKGROUP_STRING_LENGTH];
+  unsigned i;
+
+  for (i = 0; i < 3; ++i)
+    {
+      snprintf (name, WORKGROUP_STRING_LENGTH, "%s%s", wg_name, suffixes[i]);
+#ifdef ENABLE_LLVM
+      if (ci->jit_handle)
+        {
+          *launchers[i] = pocl_llvm_jit_lookup (ci->jit_handle, name);
+          continue;
+        }
+#endif
+      *launchers[i] = dlsym (ci->dlhandle, name);
+      (void)dlerror ();
+    }
+}
+
+static void
+set_run_cmd_wg (_cl_command_run *run_cmd, pocl_dlhandle_cache_item *ci)
+{
+  run_cmd->wg = ci->wg;
+  run_cmd->wg_range = ci->wg_range;
+  run_cmd->wg_noalias = ci->wg_noalias;
+  run_cmd->wg_range_noalias = ci->wg_range_noalias;
+  run_cmd->dlhandle_item = ci;
+}
+
+/* Returns 1 if the memory of two pointer arguments of the command may
+   overlap, with at least one of them writable. Only the buffers are
+   checked: the extents of SVM pointers and the memory of images are not
+   known here. */
+static int
+cmd_args_may_alias (_cl_command_node *command)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  pocl_kernel_metadata_t *meta = run_cmd->kernel->meta;
+  unsigned num_ptrs = 0;
+  char *starts[meta->num_args + 1];
+  char *ends[meta->num_args + 1];
+  char readonly[meta->num_args + 1];
+  unsigned i, j;
+
+  for (i = 0; i < meta->num_args; ++i)
+    {
+      struct pocl_argument *al = &run_cmd->arguments[i];
+      if (meta->arg_info[i].type == POCL_ARG_TYPE_IMAGE)
+        return 1;
+      if (meta->arg_info[i].type != POCL_ARG_TYPE_POINTER
+          || ARG_IS_LOCAL (meta->arg_info[i]) || al->value == NULL)
+        continue;
+      if (al->is_svm)
+        return 1;
+      cl_mem m = *(cl_mem *)al->value;
+      char *ptr = m->device_ptrs[command->device->global_mem_id].mem_ptr;
+      if (ptr == NULL)
+        return 1;
+      starts[num_ptrs] = ptr + al->offset;
+      ends[num_ptrs] = starts[num_ptrs]
+                       + (al->sub_buffer_size ? al->sub_buffer_size
+                                              : m->size - al->offset);
+      readonly[num_ptrs] = al->is_readonly;
+      for (j = 0; j < num_ptrs; ++j)
+        if (!(readonly[j] && readonly[num_ptrs])
+            && starts[num_ptrs] < ends[j] && starts[j] < ends[num_ptrs])
+          return 1;
+      ++num_ptrs;
+    }
+  return 0;
+}
 
 /* Look for a dlhandle in the dlhandle cache for the given kernel command.
-   If found, push the handle up in the cache to improve cache hit speed,
-   and return it. Otherwise return NULL. The caller should hold
-   pocl_dlhandle_lock. */
+   If found, mark it as recently used, add refcount references to it and
+   return it. Otherwise return NULL. The caller should hold
+   pocl_dlhandle_lock, at least for reading. */
 static pocl_dlhandle_cache_item *
-fetch_dlhandle_cache_item (_cl_command_run *run_cmd, int specialize)
+fetch_dlhandle_cache_item (_cl_command_run *run_cmd, int specialize,
+                           unsigned long key, unsigned refcount)
 {
-  pocl_dlhandle_cache_item *ci = NULL, *tmp = NULL;
+  pocl_dlhandle_cache_item *ci = NULL;
   size_t max_grid_width = pocl_cmd_max_grid_dim_width (run_cmd);
-  DL_FOREACH_SAFE (pocl_dlhandle_cache, ci, tmp)
+  int goffs_zero = run_cmd->pc.global_offset[0] == 0
+                   && run_cmd->pc.global_offset[1] == 0
+                   && run_cmd->pc.global_offset[2] == 0;
+
+  for (ci = *dlhandle_bucket (key); ci != NULL; ci = ci->bucket_next)
+    {
+      if (ci->key == key
+          && (memcmp (ci->hash, run_cmd->hash, sizeof (pocl_kernel_hash_t))
+              == 0)
+          && (ci->local_wgs[0] == run_cmd->pc.local_size[0])
+          && (ci->local_wgs[1] == run_cmd->pc.local_size[1])
+          && (ci->local_wgs[2] == run_cmd->pc.local_size[2])
+          && (max_grid_width <= ci->max_grid_dim_width)
+          && (ci->specialize == specialize)
+          && (ci->goffs_zero == goffs_zero)
+          && (ci->fast == run_cmd->fast_wg_func)
+          && (ci->spec_args == run_cmd->spec_args)
+          && (memcmp (ci->spec_arg_values, run_cmd->spec_arg_values,
+                      spec_arg_count (ci->spec_args) * sizeof (uint64_t))
+              == 0))
+        {
+          /* avoid dirtying the cache line when nothing changes */
+          if (ci->last_used != dlhandle_clock)
+            ci->last_used = dlhandle_clock;
+          if (refcount)
+            __sync_add_and_fetch (&ci->ref_count, refcount);
+          set_run_cmd_wg (run_cmd, ci);
+          return ci;
+        }
+    }
+  return NULL;
+}
+
+#ifdef ENABLE_LLVM
+
+/* Background building of work-group functions. While the specialized
+   binary for a launch configuration is being built, the launches use the
+   generic WG function, and while the fully optimized binary of a hot
+   kernel is built for POCL_TIERED_COMPILATION, its first tier one. */
+
+typedef struct pocl_bg_compile_job pocl_bg_compile_job;
+struct pocl_bg_compile_job
+{
+  /* A copy of the launching command, keeps a reference to its kernel. */
+  _cl_command_node command;
+  char binary_path[POCL_FILENAME_LENGTH];
+  int specialize;
+  int started;
+  int failed;
+  pocl_bg_compile_job *next;
+  pocl_bg_compile_job *prev;
+};
+
+/* The queued, running and failed jobs. */
+static pocl_bg_compile_job *pocl_bg_compile_jobs;
+static int pocl_bg_compile_thread_started;
+
+static void *
+bg_compile_thread (void *arg)
+{
+  pocl_bg_compile_job *job;
+  POCL_LOCK (pocl_bg_compile_lock);
+  while (1)
+    {
+      DL_FOREACH (pocl_bg_compile_jobs, job)
+      {
+        if (!job->started)
+          break;
+      }
+      if (job == NULL)
+        {
+          PTHREAD_CHECK (pthread_cond_wait (&pocl_bg_compile_cond,
+                                            &pocl_bg_compile_lock));
+          continue;
+        }
+      job->started = 1;
+      POCL_UNLOCK (pocl_bg_compile_lock);
+
+      cl_kernel k = job->command.command.run.kernel;
+      int serialize = !pocl_llvm_parallel_codegen ();
+      if (serialize)
+        POCL_LOCK (pocl_llvm_codegen_lock);
+      int error = llvm_codegen (job->binary_path, job->command.program_device_i,
+                                k, job->command.device, &job->command,
+                                job->specialize);
+      if (serialize)
+        POCL_UNLOCK (pocl_llvm_codegen_lock);
+      POCL_MSG_PRINT_INFO ("%s a WG function in the background: %s\n",
+                           error ? "Failed to build" : "Built",
+                           job->binary_path);
+      POname (clReleaseKernel) (k);
+
+      POCL_LOCK (pocl_bg_compile_lock);
+      if (error)
+        /* Keep the job around so the launches stay on the fallback
+           WG function instead of retrying the build. */
+        job->failed = 1;
+      else
+        {
+          DL_DELETE (pocl_bg_compile_jobs, job);
+          POCL_MEM_FREE (job);
+        }
+    }
+  POCL_UNLOCK (pocl_bg_compile_lock);
+  return NULL;
+}
+
+/* Must be called with pocl_bg_compile_lock held. */
+static void
+start_bg_compile_thread ()
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  if (pocl_bg_compile_thread_started)
+    return;
+  PTHREAD_CHECK (pthread_attr_init (&attr));
+  PTHREAD_CHECK (pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED));
+  PTHREAD_CHECK (pthread_create (&thread, &attr, bg_compile_thread, NULL));
+  PTHREAD_CHECK (pthread_attr_destroy (&attr));
+  pocl_bg_compile_thread_started = 1;
+}
+
+/* The thread doesn't exist in a forked child: the jobs it was running are
+   queued again, for a new thread started by the next defer_build. Called
+   with pocl_bg_compile_lock held. */
+static void
+reset_bg_compile_after_fork ()
+{
+  pocl_bg_compile_job *job;
+  DL_FOREACH (pocl_bg_compile_jobs, job)
   {
-    if ((memcmp (ci->hash, run_cmd->hash, sizeof (pocl_kernel_hash_t)) == 0)
-        && (ci->local_wgs[0] == run_cmd->pc.local_size[0])
-        && (ci->local_wgs[1] == run_cmd->pc.local_size[1])
-        && (ci->local_wgs[2] == run_cmd->pc.local_size[2])
-        && (max_grid_width <= ci->max_grid_dim_width)
-        && (ci->specialize == specialize)
-        && (ci->goffs_zero == (run_cmd->pc.global_offset[0] == 0
-                && run_cmd->pc.global_offset[1] == 0
-                && run_cmd->pc.global_offset[2] == 0)))
+    if (!job->failed)
+      job->started = 0;
+  }
+  pocl_bg_compile_thread_started = 0;
+  PTHREAD_CHECK (pthread_cond_init (&pocl_bg_compile_cond, NULL));
+}
+
+/* Returns 1 if the WG function for the command is not yet available and
+   the command should use a fallback one meanwhile. Queues the build in the
+   background if needed. */
+static int
+defer_build (_cl_command_node *command, int specialize)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  cl_kernel k = run_cmd->kernel;
+  cl_program p = k->program;
+  unsigned dev_i = command->program_device_i;
+  pocl_bg_compile_job *job;
+  char binary_path[POCL_FILENAME_LENGTH];
+  int defer = 0;
+
+  pocl_cache_final_binary_path (binary_path, p, dev_i, k, command,
+                                specialize);
+
+  POCL_LOCK (pocl_bg_compile_lock);
+  DL_FOREACH (pocl_bg_compile_jobs, job)
+  {
+    if (strcmp (job->binary_path, binary_path) == 0)
       {
-        /* move to the front of the line */
-        DL_DELETE (pocl_dlhandle_cache, ci);
-        DL_PREPEND (pocl_dlhandle_cache, ci);
-        ++ci->ref_count;
-        run_cmd->wg = ci->wg;
-        return ci;
+        defer = 1;
+        break;
       }
   }
-  return NULL;
+  /* the queued jobs of a forked child need a thread */
+  if (pocl_bg_compile_jobs != NULL)
+    start_bg_compile_thread ();
+  POCL_UNLOCK (pocl_bg_compile_lock);
+  if (defer || pocl_exists (binary_path))
+    return defer;
+
+  job = (pocl_bg_compile_job *)calloc (1, sizeof (pocl_bg_compile_job));
+  if (job == NULL)
+    return 0;
+  job->command = *command;
+  job->command.next = job->command.prev = NULL;
+  memcpy (job->binary_path, binary_path, POCL_FILENAME_LENGTH);
+  job->specialize = specialize;
+  POname (clRetainKernel) (k);
+
+  POCL_LOCK (pocl_bg_compile_lock);
+  start_bg_compile_thread ();
+  DL_APPEND (pocl_bg_compile_jobs, job);
+  PTHREAD_CHECK (pthread_cond_signal (&pocl_bg_compile_cond));
+  POCL_UNLOCK (pocl_bg_compile_lock);
+
+  POCL_MSG_PRINT_INFO ("Queued a background build of %s, using a fallback "
+                       "WG function meanwhile\n",
+                       binary_path);
+  return 1;
+}
+
+/* Returns 1 if the specialized WG function for the command is not yet
+   available and the command should use the generic one meanwhile. */
+static int
+pocl_defer_specialized_build (_cl_command_node *command)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  cl_kernel k = run_cmd->kernel;
+
+  /* Only if we can build it, and there is a generic version to use. */
+  if (!pocl_bg_compile_enabled
+      || k->program->binaries[command->program_device_i] == NULL
+      || run_cmd->force_generic_wg_func || k->meta->reqd_wg_size[0] > 0)
+    return 0;
+
+  return defer_build (command, 1);
+}
+
+/* POCL_TIERED_COMPILATION, -1 until read */
+static int pocl_tiered_launches = -1;
+
+/* Returns 1 if the fully optimized WG function for the command of a hot
+   kernel is not yet available and the command should use the first tier
+   one meanwhile. */
+static int
+pocl_defer_optimized_build (_cl_command_node *command, int specialize)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  cl_kernel k = run_cmd->kernel;
+
+  if (pocl_tiered_launches <= 0 || run_cmd->fast_wg_func
+      || k->program->binaries[command->program_device_i] == NULL)
+    return 0;
+
+  return defer_build (command, specialize);
+}
+
+#endif
+
+#ifdef ENABLE_LLVM
+static int pocl_kernel_jit = -1;
+
+/* Loads the WG function of the command with the in-process JIT from an
+   object file in memory, skipping the linking to a shared library and
+   dlopen(). With the kernel cache enabled, the object file is cached next
+   to where the shared library would be. Returns the JIT handle, or NULL
+   if the regular path should be used instead. */
+static void *
+jit_load_wg_function (_cl_command_node *command, int specialize, void **wg)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  cl_kernel k = run_cmd->kernel;
+  cl_program p = k->program;
+  unsigned dev_i = command->program_device_i;
+  char final_binary_path[POCL_FILENAME_LENGTH];
+  char objfile_path[POCL_FILENAME_LENGTH];
+  char workgroup_string[WORKGROUP_STRING_LENGTH];
+  char *objfile = NULL;
+  uint64_t objfile_size = 0;
+  void *handle = NULL;
+  int use_cache = pocl_cache_enabled ();
+
+  /* Without the IR, only the prebuilt shared libraries are available. */
+  if (p->binaries[dev_i] == NULL)
+    return NULL;
+
+  pocl_cache_final_binary_path (final_binary_path, p, dev_i, k, command,
+                                specialize);
+  /* A linked one is cached already, loading it is cheap. */
+  if (use_cache && pocl_exists (final_binary_path))
+    return NULL;
+  snprintf (objfile_path, POCL_FILENAME_LENGTH, "%s.o", final_binary_path);
+
+  if (!use_cache || !pocl_exists (objfile_path)
+      || pocl_read_file (objfile_path, &objfile, &objfile_size) != 0)
+    {
+      pocl_stat_add (POCL_STAT_DISK_CACHE_MISSES, 1);
+      int serialize = !pocl_llvm_parallel_codegen ();
+      if (serialize)
+        POCL_LOCK (pocl_llvm_codegen_lock);
+      int error
+          = llvm_codegen_object (dev_i, k, command->device, command,
+                                 specialize, use_cache, &objfile,
+                                 &objfile_size, NULL, NULL, NULL);
+      if (serialize)
+        POCL_UNLOCK (pocl_llvm_codegen_lock);
+      if (error)
+        {
+          POCL_MEM_FREE (objfile);
+          return NULL;
+        }
+      if (use_cache)
+        pocl_write_file (objfile_path, objfile, objfile_size, 0, 1);
+    }
+  else
+    pocl_stat_add (POCL_STAT_DISK_CACHE_HITS, 1);
+
+  snprintf (workgroup_string, WORKGROUP_STRING_LENGTH,
+            "_pocl_kernel_%s_workgroup", k->name);
+  *wg = pocl_llvm_jit_load (objfile, objfile_size, workgroup_string, &handle);
+  POCL_MEM_FREE (objfile);
+  if (*wg == NULL)
+    return NULL;
+
+  POCL_MSG_PRINT_INFO ("Loaded %s with the JIT\n", workgroup_string);
+  return handle;
+}
+#endif
+
+/* Takes a new cache item for the WG function of the command. Must be
+   called with pocl_dlhandle_lock held for writing. */
+static pocl_dlhandle_cache_item *
+new_dlhandle_cache_item (_cl_command_run *run_cmd, unsigned long key,
+                         unsigned initial_refcount, int specialize,
+                         int goffs_zero)
+{
+  pocl_dlhandle_cache_item *ci;
+
+  ++dlhandle_clock;
+  ci = get_new_dlhandle_cache_item ();
+  ci->key = key;
+  ci->last_used = dlhandle_clock;
+  memcpy (ci->hash, run_cmd->hash, sizeof (pocl_kernel_hash_t));
+  ci->local_wgs[0] = run_cmd->pc.local_size[0];
+  ci->local_wgs[1] = run_cmd->pc.local_size[1];
+  ci->local_wgs[2] = run_cmd->pc.local_size[2];
+  ci->ref_count = initial_refcount;
+  ci->specialize = specialize;
+  ci->goffs_zero = goffs_zero;
+  ci->fast = run_cmd->fast_wg_func;
+  ci->spec_args = run_cmd->spec_args;
+  memcpy (ci->spec_arg_values, run_cmd->spec_arg_values,
+          sizeof (ci->spec_arg_values));
+  return ci;
+}
+
+static void
+insert_dlhandle_cache_item (_cl_command_run *run_cmd,
+                            pocl_dlhandle_cache_item *ci)
+{
+  set_run_cmd_wg (run_cmd, ci);
+  DL_PREPEND (pocl_dlhandle_cache, ci);
+  pocl_dlhandle_cache_item **bucket = dlhandle_bucket (ci->key);
+  ci->bucket_next = *bucket;
+  *bucket = ci;
+}
+
+/* Uses the statically linked WG function of the command, if there is one.
+   Returns 1 if it did. The generic one serves the launches for which
+   there is no specialized one, as the argument values folded into a
+   specialized WG function are also passed to it. */
+static int
+use_static_wg_function (_cl_command_node *command, unsigned long key,
+                        unsigned initial_refcount, int specialize,
+                        int goffs_zero)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  const cl_static_wg_function_pocl *f = NULL;
+  pocl_dlhandle_cache_item *ci;
+  size_t max_grid_width = pocl_cmd_max_grid_dim_width (run_cmd);
+  size_t grid_limit = command->device->grid_width_specialization_limit;
+  int small_grid
+      = !run_cmd->force_large_grid_wg_func && max_grid_width < grid_limit;
+
+  if (specialize)
+    f = pocl_static_wg_lookup (run_cmd->hash, run_cmd->pc.local_size,
+                               goffs_zero, small_grid);
+  if (f == NULL)
+    f = pocl_static_wg_lookup (run_cmd->hash, NULL, 0, 0);
+  if (f == NULL)
+    return 0;
+
+  PTHREAD_CHECK (pthread_rwlock_wrlock (&pocl_dlhandle_lock));
+  ci = fetch_dlhandle_cache_item (run_cmd, specialize, key, initial_refcount);
+  if (ci == NULL)
+    {
+      ci = new_dlhandle_cache_item (run_cmd, key, initial_refcount,
+                                    specialize, goffs_zero);
+      ci->max_grid_dim_width = (f->flags & CL_STATIC_WG_SMALL_GRID_POCL)
+                                   ? grid_limit - 1
+                                   : SIZE_MAX;
+      ci->wg = f->wg;
+      ci->wg_range = f->wg_range;
+      ci->wg_noalias = f->wg_noalias;
+      ci->wg_range_noalias = f->wg_range_noalias;
+      insert_dlhandle_cache_item (run_cmd, ci);
+    }
+  PTHREAD_CHECK (pthread_rwlock_unlock (&pocl_dlhandle_lock));
+
+  POCL_MSG_PRINT_INFO ("Using a static WG function of %s\n",
+                       run_cmd->kernel->name);
+  pocl_stat_add (POCL_STAT_STATIC_WG_FUNCTIONS, 1);
+  return 1;
 }
 
 /**
@@ -1005,9 +1687,9 @@ fetch_dlhandle_cache_item (_cl_command_run *run_cmd, int specialize)
  *
  * TODO: This function is really specific to CPU (host) drivers since dlhandles
  * imply program loading to the same process as the host. Move to basic.c? */
-void
-pocl_check_kernel_dlhandle_cache (_cl_command_node *command,
-                                  unsigned initial_refcount, int specialize)
+static void
+check_kernel_dlhandle_cache (_cl_command_node *command,
+                             unsigned initial_refcount, int specialize)
 {
   char workgroup_string[WORKGROUP_STRING_LENGTH];
   pocl_dlhandle_cache_item *ci = NULL;
@@ -1019,70 +1701,307 @@ pocl_check_kernel_dlhandle_cache (_cl_command_node *command,
   if (!pocl_get_bool_option("POCL_WORK_GROUP_SPECIALIZATION", 1))
     specialize = 0;
 
-  POCL_LOCK (pocl_dlhandle_lock);
-  ci = fetch_dlhandle_cache_item (run_cmd, specialize);
+  int goffs_zero = run_cmd->pc.global_offset[0] == 0
+                   && run_cmd->pc.global_offset[1] == 0
+                   && run_cmd->pc.global_offset[2] == 0;
+  unsigned long key;
+#ifdef ENABLE_LLVM
+  int tried_optimized = 0;
+#endif
+
+RETRY:
+  /* the generic WG function has no argument values folded in */
+  if (!specialize)
+    run_cmd->spec_args = 0;
+  key = dlhandle_key (run_cmd, specialize, goffs_zero);
+
+  PTHREAD_CHECK (pthread_rwlock_rdlock (&pocl_dlhandle_lock));
+  ci = fetch_dlhandle_cache_item (run_cmd, specialize, key, initial_refcount);
+  PTHREAD_CHECK (pthread_rwlock_unlock (&pocl_dlhandle_lock));
   if (ci != NULL)
     {
-      POCL_UNLOCK (pocl_dlhandle_lock);
+      pocl_stat_add (POCL_STAT_DLHANDLE_CACHE_HITS, 1);
       return;
     }
 
-  /* Not found, build a new kernel and cache its dlhandle. */
-  ci = get_new_dlhandle_cache_item ();
-  memcpy (ci->hash, run_cmd->hash, sizeof (pocl_kernel_hash_t));
-  ci->local_wgs[0] = run_cmd->pc.local_size[0];
-  ci->local_wgs[1] = run_cmd->pc.local_size[1];
-  ci->local_wgs[2] = run_cmd->pc.local_size[2];
-  ci->ref_count = initial_refcount;
-  ci->specialize = specialize;
-  ci->goffs_zero = run_cmd->pc.global_offset[0] == 0
-                   && run_cmd->pc.global_offset[1] == 0
-                   && run_cmd->pc.global_offset[2] == 0;
-
-  size_t max_grid_width = pocl_cmd_max_grid_dim_width (run_cmd);
-  ci->max_grid_dim_width = max_grid_width;
+  /* The WG functions linked into the application come before the disk. */
+  if (use_static_wg_function (command, key, initial_refcount, specialize,
+                              goffs_zero))
+    return;
 
-  char *module_fn = pocl_check_kernel_disk_cache (command, specialize);
+#ifdef ENABLE_LLVM
+  /* A fully optimized WG function in the kernel cache loads as fast as a
+     first tier one. */
+  if (run_cmd->fast_wg_func && !tried_optimized)
+    {
+      char path[POCL_FILENAME_LENGTH];
+      tried_optimized = 1;
+      run_cmd->fast_wg_func = 0;
+      pocl_cache_final_binary_path (path, run_cmd->kernel->program,
+                                    command->program_device_i,
+                                    run_cmd->kernel, command, specialize);
+      if (pocl_exists (path))
+        goto RETRY;
+      strncat (path, ".o", POCL_FILENAME_LENGTH - strlen (path) - 1);
+      if (pocl_exists (path))
+        goto RETRY;
+      run_cmd->fast_wg_func = 1;
+    }
+  if (specialize && pocl_defer_specialized_build (command))
+    {
+      specialize = 0;
+      goto RETRY;
+    }
+  if (pocl_defer_optimized_build (command, specialize))
+    {
+      run_cmd->fast_wg_func = 1;
+      goto RETRY;
+    }
+#endif
 
-  // reset possibly existing error from calls from an ICD loader
-  (void)dlerror();
-  ci->dlhandle = dlopen (module_fn, RTLD_NOW | RTLD_LOCAL);
-  dl_error = dlerror ();
+  pocl_stat_add (POCL_STAT_DLHANDLE_CACHE_MISSES, 1);
 
-  if (ci->dlhandle == NULL || dl_error != NULL)
-    POCL_ABORT ("dlopen(\"%s\") failed with '%s'.\n"
-                "note: missing symbols in the kernel binary might be"
-                " reported as 'file not found' errors.\n",
-                module_fn, dl_error);
+  /* Build (or find) the binary before locking the cache, so that the
+     launches of the other kernels are not blocked meanwhile. */
+  char *module_fn = NULL;
+  void *jit_handle = NULL;
+  void *jit_wg = NULL;
+#ifdef ENABLE_LLVM
+  if (pocl_kernel_jit < 0)
+    pocl_kernel_jit
+        = pocl_get_bool_option ("POCL_KERNEL_JIT", !pocl_cache_enabled ());
+  if (pocl_kernel_jit)
+    jit_handle = jit_load_wg_function (command, specialize, &jit_wg);
+#endif
+  if (jit_handle == NULL)
+    module_fn = pocl_check_kernel_disk_cache (command, specialize);
 
-  snprintf (workgroup_string, WORKGROUP_STRING_LENGTH,
-            "_pocl_kernel_%s_workgroup", run_cmd->kernel->name);
+  PTHREAD_CHECK (pthread_rwlock_wrlock (&pocl_dlhandle_lock));
+  /* Another thread might have added it in the meantime. */
+  ci = fetch_dlhandle_cache_item (run_cmd, specialize, key, initial_refcount);
+  if (ci != NULL)
+    {
+      PTHREAD_CHECK (pthread_rwlock_unlock (&pocl_dlhandle_lock));
+      POCL_MEM_FREE (module_fn);
+#ifdef ENABLE_LLVM
+      if (jit_handle)
+        pocl_llvm_jit_unload (jit_handle);
+#endif
+      return;
+    }
 
-  ci->wg = dlsym (ci->dlhandle, workgroup_string);
-  dl_error = dlerror ();
+  /* Not found, build a new kernel and cache its dlhandle. */
+  ci = new_dlhandle_cache_item (run_cmd, key, initial_refcount, specialize,
+                                goffs_zero);
+  ci->max_grid_dim_width = pocl_cmd_max_grid_dim_width (run_cmd);
 
-  if (ci->wg == NULL || dl_error != NULL)
+  if (jit_handle)
     {
-      // Older OSX dyld APIs need the name without the underscore.
+      ci->jit_handle = jit_handle;
+      ci->wg = jit_wg;
       snprintf (workgroup_string, WORKGROUP_STRING_LENGTH,
-                "pocl_kernel_%s_workgroup", run_cmd->kernel->name);
-      ci->wg = dlsym (ci->dlhandle, workgroup_string);
+                "_pocl_kernel_%s_workgroup", run_cmd->kernel->name);
+      find_optional_launchers (ci, workgroup_string);
+    }
+  else
+    {
+      // reset possibly existing error from calls from an ICD loader
+      (void)dlerror();
+      ci->dlhandle = dlopen (module_fn, RTLD_NOW | RTLD_LOCAL);
       dl_error = dlerror ();
 
-      if (ci->wg == NULL || dl_error != NULL)
-        POCL_ABORT ("dlsym(\"%s\", \"%s\") failed with '%s'.\n"
+      if (ci->dlhandle == NULL || dl_error != NULL)
+        POCL_ABORT ("dlopen(\"%s\") failed with '%s'.\n"
                     "note: missing symbols in the kernel binary might be"
                     " reported as 'file not found' errors.\n",
-                    module_fn, workgroup_string, dl_error);
+                    module_fn, dl_error);
+
+      snprintf (workgroup_string, WORKGROUP_STRING_LENGTH,
+                "_pocl_kernel_%s_workgroup", run_cmd->kernel->name);
+
+      ci->wg = dlsym (ci->dlhandle, workgroup_string);
+      dl_error = dlerror ();
+
+      if (ci->wg == NULL || dl_error != NULL)
+        {
+          // Older OSX dyld APIs need the name without the underscore.
+          snprintf (workgroup_string, WORKGROUP_STRING_LENGTH,
+                    "pocl_kernel_%s_workgroup", run_cmd->kernel->name);
+          ci->wg = dlsym (ci->dlhandle, workgroup_string);
+          dl_error = dlerror ();
+
+          if (ci->wg == NULL || dl_error != NULL)
+            POCL_ABORT ("dlsym(\"%s\", \"%s\") failed with '%s'.\n"
+                        "note: missing symbols in the kernel binary might be"
+                        " reported as 'file not found' errors.\n",
+                        module_fn, workgroup_string, dl_error);
+        }
+
+      find_optional_launchers (ci, workgroup_string);
+      pocl_perf_map_add_library (ci->dlhandle);
     }
 
-  run_cmd->wg = ci->wg;
-  DL_PREPEND (pocl_dlhandle_cache, ci);
+  insert_dlhandle_cache_item (run_cmd, ci);
 
-  POCL_UNLOCK (pocl_dlhandle_lock);
+  PTHREAD_CHECK (pthread_rwlock_unlock (&pocl_dlhandle_lock));
   POCL_MEM_FREE (module_fn);
 }
 
+/* Returns 1 if the argument is named for the kernel in the comma separated
+   list of -cl-pocl-specialize-args=. An entry can be limited to one kernel
+   by prefixing it with the kernel name and a colon, e.g. "blur:radius". */
+static int
+is_named_spec_arg (const char *list, const char *kernel_name,
+                   const char *arg_name)
+{
+  size_t kernel_len = strlen (kernel_name);
+  size_t arg_len = strlen (arg_name);
+
+  while (*list)
+    {
+      size_t len = strcspn (list, ",");
+      const char *colon = memchr (list, ':', len);
+      const char *name = list;
+      size_t name_len = len;
+      if (colon != NULL)
+        {
+          name = colon + 1;
+          name_len = len - (name - list);
+        }
+      if ((colon == NULL
+           || ((size_t)(colon - list) == kernel_len
+               && strncmp (list, kernel_name, kernel_len) == 0))
+          && name_len == arg_len && strncmp (name, arg_name, arg_len) == 0)
+        return 1;
+      list += len;
+      if (*list == ',')
+        ++list;
+    }
+  return 0;
+}
+
+/* POCL_ARG_SPECIALIZATION, -1 until read */
+static int pocl_arg_spec_launches = -1;
+
+static void
+choose_specialized_args (_cl_command_node *command)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  cl_kernel k = run_cmd->kernel;
+  cl_program p = k->program;
+  pocl_kernel_metadata_t *meta = k->meta;
+  unsigned i, n = 0;
+
+  run_cmd->spec_args = 0;
+  memset (run_cmd->spec_arg_values, 0, sizeof (run_cmd->spec_arg_values));
+
+  if (pocl_arg_spec_launches < 0)
+    pocl_arg_spec_launches
+        = pocl_get_int_option ("POCL_ARG_SPECIALIZATION", 0);
+  /* The values can only be folded in when building from the IR. */
+  if ((pocl_arg_spec_launches <= 0 && p->spec_arg_names == NULL)
+      || p->binaries[command->program_device_i] == NULL
+      || run_cmd->force_generic_wg_func)
+    return;
+
+  POCL_LOCK_OBJ (k);
+  if (pocl_arg_spec_launches > 0 && k->spec_same_count == NULL)
+    {
+      k->spec_last_values
+          = (uint64_t *)calloc (meta->num_args, sizeof (uint64_t));
+      k->spec_same_count
+          = (unsigned *)calloc (meta->num_args, sizeof (unsigned));
+      if (k->spec_last_values == NULL || k->spec_same_count == NULL)
+        {
+          POCL_MEM_FREE (k->spec_last_values);
+          POCL_MEM_FREE (k->spec_same_count);
+        }
+    }
+
+  for (i = 0; i < meta->num_args && i < 64; ++i)
+    {
+      struct pocl_argument *al = &run_cmd->arguments[i];
+      pocl_argument_info *ai = &meta->arg_info[i];
+      uint64_t value = 0;
+      int chosen = 0;
+
+      if (ai->type != POCL_ARG_TYPE_NONE || ARGP_IS_LOCAL (ai)
+          || al->value == NULL || al->size == 0
+          || al->size > sizeof (uint64_t))
+        continue;
+      memcpy (&value, al->value, al->size);
+
+      if (p->spec_arg_names != NULL && ai->name != NULL)
+        chosen = is_named_spec_arg (p->spec_arg_names, k->name, ai->name);
+      if (k->spec_same_count != NULL)
+        {
+          if (k->spec_same_count[i] > 0 && k->spec_last_values[i] == value)
+            {
+              if (k->spec_same_count[i] < UINT_MAX)
+                ++k->spec_same_count[i];
+            }
+          else
+            {
+              k->spec_last_values[i] = value;
+              k->spec_same_count[i] = 1;
+            }
+          if (k->spec_same_count[i] >= (unsigned)pocl_arg_spec_launches)
+            chosen = 1;
+        }
+      if (chosen && n < POCL_MAX_SPEC_ARGS)
+        {
+          run_cmd->spec_args |= (uint64_t)1 << i;
+          run_cmd->spec_arg_values[n++] = value;
+        }
+    }
+  POCL_UNLOCK_OBJ (k);
+}
+
+/* Builds the WG functions of the first launches of a kernel with the faster
+   to compile pipeline. */
+static void
+choose_tier (_cl_command_node *command)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+
+  run_cmd->fast_wg_func = 0;
+#ifdef ENABLE_LLVM
+  cl_kernel k = run_cmd->kernel;
+  if (pocl_tiered_launches < 0)
+    pocl_tiered_launches
+        = pocl_get_int_option ("POCL_TIERED_COMPILATION", 0);
+  if (pocl_tiered_launches <= 0
+      || k->program->binaries[command->program_device_i] == NULL)
+    return;
+  if (POCL_ATOMIC_INC (k->launch_count) <= (uint64_t)pocl_tiered_launches)
+    run_cmd->fast_wg_func = 1;
+#endif
+}
+
+void
+pocl_choose_wg_specialization (_cl_command_node *command)
+{
+  choose_specialized_args (command);
+  choose_tier (command);
+}
+
+void
+pocl_check_kernel_dlhandle_cache (_cl_command_node *command,
+                                  unsigned initial_refcount, int specialize)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+
+  check_kernel_dlhandle_cache (command, initial_refcount, specialize);
+
+  /* Most launches do not pass overlapping buffers, but without restrict
+     the compiler cannot assume that. */
+  if (run_cmd->wg_noalias != NULL && !cmd_args_may_alias (command))
+    {
+      run_cmd->wg = run_cmd->wg_noalias;
+      run_cmd->wg_range = run_cmd->wg_range_noalias;
+    }
+}
+
 #endif
 
 
@@ -1170,6 +2089,9 @@ pocl_reinit_system_memory()
 {
   system_memory.currently_allocated = 0;
   system_memory.max_ever_allocated = 0;
+  /* the accounting starts over, so give the host memory cached for
+   * released buffers back to the system as well */
+  pocl_trim_host_mem_pools (0);
 }
 
 /* set maximum allocation sizes for buffers and images */
@@ -1228,6 +2150,72 @@ pocl_set_buffer_image_limits(cl_device_id device)
   device->image3d_max_width = device->image3d_max_height =
     device->image3d_max_depth = max_pixels;
 
+  /* Opt-in tiled storage of the 2D and 3D images, for kernels that read
+   * pixel neighbourhoods. */
+  int tile_size = pocl_get_int_option ("POCL_CPU_IMAGE_TILE_SIZE", 0);
+  device->image_tile_shift = 0;
+  if (tile_size > 1)
+    {
+      while (device->image_tile_shift < POCL_MAX_IMAGE_TILE_SHIFT
+             && (2 << device->image_tile_shift) <= tile_size)
+        ++device->image_tile_shift;
+      if ((1 << device->image_tile_shift) != tile_size)
+        POCL_MSG_WARN ("POCL_CPU_IMAGE_TILE_SIZE %i is not a power of two "
+                       "up to %i, using %i\n",
+                       tile_size, 1 << POCL_MAX_IMAGE_TILE_SHIFT,
+                       1 << device->image_tile_shift);
+    }
+}
+
+/* set up the sub-groups of the CPU devices. A sub-group is a chunk of
+ * work-items with consecutive linear local ids as wide as the vectorized
+ * work-item loops, so the sub-group functions operate on SIMD lanes */
+void
+pocl_set_cpu_sub_group_limits (cl_device_id device)
+{
+  device->max_sub_group_size = max (device->native_vector_width_float, 1);
+  device->max_num_sub_groups
+      = (device->max_work_group_size + device->max_sub_group_size - 1)
+        / device->max_sub_group_size;
+  device->sub_group_independent_forward_progress = CL_FALSE;
+}
+
+/* set up the OpenCL 2.0 pipes of the CPU devices, which are lock-free ring
+ * buffers in the host memory (see include/pocl_pipe.h) accessed with the
+ * pipe builtins of the kernel library. Their reservation ids hold both the
+ * first packet and the number of packets, thus need 64-bit pointers. */
+void
+pocl_set_cpu_pipe_limits (cl_device_id device)
+{
+#if HOST_DEVICE_CL_VERSION_MAJOR >= 2
+  if (device->address_bits != 64)
+    return;
+  device->pipe_support = CL_TRUE;
+  device->max_pipe_args = 16;
+  device->max_pipe_active_res = 16;
+  device->max_pipe_packet_size = 1024 * 1024;
+#endif
+}
+
+/* set up the OpenCL 2.0 device queues of the CPU devices whose drivers
+ * launch the kernels enqueued by the work-groups (see
+ * include/pocl_device_enqueue.h), if enabled with POCL_DEVICE_ENQUEUE.
+ * The device queue size only bounds the total size of the block literals
+ * of the pending child kernels. */
+void
+pocl_set_cpu_device_queue_limits (cl_device_id device)
+{
+#if defined(ENABLE_DEVICE_ENQUEUE) && HOST_DEVICE_CL_VERSION_MAJOR >= 2
+  if (device->address_bits != 64
+      || !pocl_get_bool_option ("POCL_DEVICE_ENQUEUE", 0))
+    return;
+  device->on_dev_queue_props
+      = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE;
+  device->dev_queue_pref_size = 16 * 1024;
+  device->dev_queue_max_size = 256 * 1024;
+  device->max_queues = 1;
+  device->max_events = 1024;
+#endif
 }
 
 void*
@@ -1240,7 +2228,10 @@ pocl_aligned_malloc_global_mem(cl_device_id device, size_t align, size_t size)
   if ((mem->total_alloc_limit - mem->currently_allocated) < size)
     goto ERROR;
 
-  retval = pocl_aligned_malloc (align, size);
+  if (pocl_use_huge_pages (size))
+    retval = pocl_huge_page_alloc (size);
+  else
+    retval = pocl_aligned_malloc (align, size);
   if (!retval)
     goto ERROR;
 
@@ -1265,7 +2256,10 @@ pocl_free_global_mem(cl_device_id device, void* ptr, size_t size)
   mem->currently_allocated -= size;
   POCL_UNLOCK (mem->pocl_lock);
 
-  POCL_MEM_FREE(ptr);
+  if (pocl_use_huge_pages (size))
+    pocl_huge_page_free (ptr, size);
+  else
+    POCL_MEM_FREE (ptr);
 }
 
 
@@ -1276,10 +2270,13 @@ pocl_print_system_memory_stats()
                     "____ Total available system memory  : %10" PRIu64 " KB\n"
                     " ____ Currently used system memory   : %10" PRIu64 " KB\n"
                     " ____ Max used system memory         : %10" PRIu64
-                    " KB\n",
+                    " KB\n"
+                    " ____ Cached buffer host memory      : %10zu KB\n",
                     system_memory.total_alloc_limit >> 10,
                     system_memory.currently_allocated >> 10,
-                    system_memory.max_ever_allocated >> 10);
+                    system_memory.max_ever_allocated >> 10,
+                    pocl_trim_host_mem_pools (SIZE_MAX) >> 10);
+  pocl_print_mem_region_stats ();
 }
 
 /* default WG size in each dimension & total WG size.
@@ -1476,6 +2473,7 @@ pocl_init_default_device_infos (cl_device_id dev)
   dev->partition_type = NULL;
 
   dev->device_side_printf = 1;
+  dev->binary_printf = 0;
   dev->printf_buffer_size = PRINTF_BUFFER_SIZE * 1024;
 
   dev->vendor = "pocl";
@@ -1512,8 +2510,10 @@ pocl_init_default_device_infos (cl_device_id dev)
   dev->global_var_max_size = 0;
   dev->global_var_pref_size = 0;
   dev->non_uniform_work_group_support = CL_FALSE;
+  dev->edge_work_groups = CL_FALSE;
   dev->max_num_sub_groups = 0;
   dev->sub_group_independent_forward_progress = CL_FALSE;
+  dev->max_sub_group_size = 0;
 
 #ifdef ENABLE_LLVM
 
@@ -39,6 +39,15 @@
 
 #define SETUP_DEVICE_CL_VERSION(a, b) XSETUP_DEVICE_CL_VERSION(a, b)
 
+/* The CPU devices run the kernels in the host memory, so the dma-bufs they
+ * import by mapping them need no copies */
+#ifdef __linux__
+#define HOST_DEVICE_EXTERNAL_MEMORY_EXTENSIONS                                \
+  " cl_khr_external_memory cl_khr_external_memory_dma_buf"
+#else
+#define HOST_DEVICE_EXTERNAL_MEMORY_EXTENSIONS ""
+#endif
+
 #define POCL_DEVICES_PREFERRED_VECTOR_WIDTH_CHAR    1
 #define POCL_DEVICES_PREFERRED_VECTOR_WIDTH_SHORT   1
 #define POCL_DEVICES_PREFERRED_VECTOR_WIDTH_INT     1
@@ -82,6 +91,15 @@ char *pocl_check_kernel_disk_cache (_cl_command_node *cmd, int specialized);
 POCL_EXPORT
 size_t pocl_cmd_max_grid_dim_width (_cl_command_run *cmd);
 
+/* Chooses the launch dependent parts of the WG function of the kernel
+   command: the scalar arguments to specialize it on, by the
+   -cl-pocl-specialize-args= build option and the POCL_ARG_SPECIALIZATION
+   launch count, and the POCL_TIERED_COMPILATION tier. Updates the launch
+   counts of the kernel, thus is to be called once per command, before
+   pocl_check_kernel_dlhandle_cache(). */
+POCL_EXPORT
+void pocl_choose_wg_specialization (_cl_command_node *command);
+
 POCL_EXPORT
 void pocl_check_kernel_dlhandle_cache (_cl_command_node *command,
                                        unsigned initial_refcount,
@@ -90,6 +108,10 @@ void pocl_check_kernel_dlhandle_cache (_cl_command_node *command,
 POCL_EXPORT
 void pocl_release_dlhandle_cache (_cl_command_node *cmd);
 
+/* Releases a dlhandle cache item taken from command.run.dlhandle_item. */
+POCL_EXPORT
+void pocl_release_dlhandle_item (void *item);
+
 POCL_EXPORT
 void pocl_setup_device_for_system_memory(cl_device_id device);
 
@@ -99,6 +121,15 @@ void pocl_reinit_system_memory();
 POCL_EXPORT
 void pocl_set_buffer_image_limits(cl_device_id device);
 
+POCL_EXPORT
+void pocl_set_cpu_sub_group_limits (cl_device_id device);
+
+POCL_EXPORT
+void pocl_set_cpu_pipe_limits (cl_device_id device);
+
+POCL_EXPORT
+void pocl_set_cpu_device_queue_limits (cl_device_id device);
+
 POCL_EXPORT
 void* pocl_aligned_malloc_global_mem(cl_device_id device, size_t align, size_t size);
 
@@ -29,6 +29,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pocl_binary.h"
 #include "pocl_cl.h"
 #include "utlist.h"
 
@@ -65,11 +70,11 @@ pocl_driver_read (void *data, void *__restrict__ host_ptr,
                   pocl_mem_identifier *src_mem_id, cl_mem src_buf,
                   size_t offset, size_t size)
 {
-  void *__restrict__ device_ptr = src_mem_id->mem_ptr;
+  char *__restrict__ device_ptr = (char *)src_mem_id->mem_ptr + offset;
   if (host_ptr == device_ptr)
     return;
 
-  memcpy (host_ptr, (char *)device_ptr + offset, size);
+  memcpy (host_ptr, device_ptr, size);
 }
 
 void
@@ -77,11 +82,11 @@ pocl_driver_write (void *data, const void *__restrict__ host_ptr,
                    pocl_mem_identifier *dst_mem_id, cl_mem dst_buf,
                    size_t offset, size_t size)
 {
-  void *__restrict__ device_ptr = dst_mem_id->mem_ptr;
+  char *__restrict__ device_ptr = (char *)dst_mem_id->mem_ptr + offset;
   if (host_ptr == device_ptr)
     return;
 
-  memcpy ((char *)device_ptr + offset, host_ptr, size);
+  memcpy (device_ptr, host_ptr, size);
 }
 
 void
@@ -111,17 +116,9 @@ pocl_driver_copy_with_size (void *data, pocl_mem_identifier *dst_mem_id,
     return;
 
   uint64_t *content_size = (uint64_t *)content_size_buf_mem_id->mem_ptr;
-  if (*content_size < (src_offset + size))
-    {
-      if (*content_size > src_offset)
-        {
-          size_t real_bytes = *content_size - src_offset;
-          size_t to_copy = real_bytes < size ? real_bytes : size;
-          memcpy (dst_ptr + dst_offset, src_ptr + src_offset, to_copy);
-        }
-    }
-  else
-    memcpy (dst_ptr + dst_offset, src_ptr + src_offset, size);
+  size_t to_copy = pocl_content_size_clamp (*content_size, src_offset, size);
+  if (to_copy)
+    memcpy (dst_ptr + dst_offset, src_ptr + src_offset, to_copy);
 }
 
 void
@@ -172,6 +169,13 @@ pocl_driver_copy_rect (void *data, pocl_mem_identifier *dst_mem_id,
       memcpy (adjusted_dst_ptr, adjusted_src_ptr,
               region[2] * region[1] * region[0]);
     }
+  else if (src_row_pitch == region[0] && dst_row_pitch == region[0])
+    {
+      /* the rows of each slice are contiguous on both sides */
+      for (k = 0; k < region[2]; ++k)
+        memcpy (adjusted_dst_ptr + dst_slice_pitch * k,
+                adjusted_src_ptr + src_slice_pitch * k, region[1] * region[0]);
+    }
   else
     {
       for (k = 0; k < region[2]; ++k)
@@ -298,85 +302,67 @@ pocl_driver_read_rect (void *data, void *__restrict__ const host_ptr,
     }
 }
 
+/* The fill pattern is replicated over a block of this many bytes, which is
+ * a multiple of every legal pattern size. */
+#define POCL_FILL_BLOCK_SIZE 256
+
 void
-pocl_driver_memfill (void *data, pocl_mem_identifier *dst_mem_id,
-                     cl_mem dst_buf, size_t size, size_t offset,
-                     const void *__restrict__ pattern, size_t pattern_size)
+pocl_fill_memory (void *__restrict__ dst, size_t size,
+                  const void *__restrict__ pattern, size_t pattern_size,
+                  int nontemporal)
 {
-  void *__restrict__ ptr = dst_mem_id->mem_ptr;
+  char *__restrict__ p = (char *)dst;
   size_t i;
-  unsigned j;
 
-  /* memfill size is in bytes, we wanto make it into elements */
-  size /= pattern_size;
-  offset /= pattern_size;
+  assert (POCL_FILL_BLOCK_SIZE % pattern_size == 0);
+  if (pattern_size == 1 && !nontemporal)
+    {
+      memset (p, *(const uint8_t *)pattern, size);
+      return;
+    }
+
+  /* the block plus the slack for a 16 byte load at any offset in it */
+  char block[POCL_FILL_BLOCK_SIZE + 16] __attribute__ ((aligned (16)));
+  for (i = 0; i < sizeof (block); i += pattern_size)
+    memcpy (block + i, pattern, min (pattern_size, sizeof (block) - i));
 
-  switch (pattern_size)
+#ifdef __SSE2__
+  if (nontemporal && size >= 64)
     {
-    case 1:
-      {
-        uint8_t *p = (uint8_t *)ptr + offset;
-        for (i = 0; i < size; i++)
-          p[i] = *(uint8_t *)pattern;
-      }
-      break;
-    case 2:
-      {
-        uint16_t *p = (uint16_t *)ptr + offset;
-        for (i = 0; i < size; i++)
-          p[i] = *(uint16_t *)pattern;
-      }
-      break;
-    case 4:
-      {
-        uint32_t *p = (uint32_t *)ptr + offset;
-        for (i = 0; i < size; i++)
-          p[i] = *(uint32_t *)pattern;
-      }
-      break;
-    case 8:
-      {
-        uint64_t *p = (uint64_t *)ptr + offset;
-        for (i = 0; i < size; i++)
-          p[i] = *(uint64_t *)pattern;
-      }
-      break;
-    case 16:
-      {
-        uint64_t *p = (uint64_t *)ptr + (offset << 1);
-        for (i = 0; i < size; i++)
-          for (j = 0; j < 2; j++)
-            p[(i << 1) + j] = *((uint64_t *)pattern + j);
-      }
-      break;
-    case 32:
-      {
-        uint64_t *p = (uint64_t *)ptr + (offset << 2);
-        for (i = 0; i < size; i++)
-          for (j = 0; j < 4; j++)
-            p[(i << 2) + j] = *((uint64_t *)pattern + j);
-      }
-      break;
-    case 64:
-      {
-        uint64_t *p = (uint64_t *)ptr + (offset << 3);
-        for (i = 0; i < size; i++)
-          for (j = 0; j < 8; j++)
-            p[(i << 3) + j] = *((uint64_t *)pattern + j);
-      }
-      break;
-    case 128:
-      {
-        uint64_t *p = (uint64_t *)ptr + (offset << 4);
-        for (i = 0; i < size; i++)
-          for (j = 0; j < 16; j++)
-            p[(i << 4) + j] = *((uint64_t *)pattern + j);
-      }
-      break;
-    default:
-      assert (0 && "Invalid pattern size");
-      break;
+      /* plain stores up to the first 16 byte boundary, then streaming
+       * stores that don't pull the destination into the caches */
+      size_t head = (16 - ((uintptr_t)p & 15)) & 15;
+      memcpy (p, block, head);
+      for (i = head; i + 16 <= size; i += 16)
+        _mm_stream_si128 (
+            (__m128i *)(p + i),
+            _mm_loadu_si128 (
+                (const __m128i *)(block + i % POCL_FILL_BLOCK_SIZE)));
+      _mm_sfence ();
+      memcpy (p + i, block + i % POCL_FILL_BLOCK_SIZE, size - i);
+      return;
+    }
+#endif
+
+  if (pattern_size == 1)
+    {
+      memset (p, *(const uint8_t *)pattern, size);
+      return;
     }
+
+  /* block sized copies, which the compiler turns into wide vector stores */
+  for (i = 0; i + POCL_FILL_BLOCK_SIZE <= size; i += POCL_FILL_BLOCK_SIZE)
+    memcpy (p + i, block, POCL_FILL_BLOCK_SIZE);
+  memcpy (p + i, block, size - i);
+}
+
+void
+pocl_driver_memfill (void *data, pocl_mem_identifier *dst_mem_id,
+                     cl_mem dst_buf, size_t size, size_t offset,
+                     const void *__restrict__ pattern, size_t pattern_size)
+{
+  pocl_fill_memory ((char *)dst_mem_id->mem_ptr + offset, size, pattern,
+                    pattern_size, size >= POCL_FILL_NONTEMPORAL_MIN);
 }
 
 cl_int
@@ -394,7 +380,12 @@ pocl_driver_map_mem (void *data, pocl_mem_identifier *src_mem_id,
   if (map->host_ptr == (src_device_ptr + map->offset))
     NULL;
   else
-    memcpy (map->host_ptr, src_device_ptr + map->offset, map->size);
+    {
+      POCL_MSG_PRINT_MEMORY ("Map of buffer %p is not zero-copy, copying "
+                             "%zu bytes\n",
+                             src_buf, map->size);
+      memcpy (map->host_ptr, src_device_ptr + map->offset, map->size);
+    }
 
   return CL_SUCCESS;
 }
@@ -411,7 +402,12 @@ pocl_driver_unmap_mem (void *data, pocl_mem_identifier *dst_mem_id,
   else
     {
       if (map->map_flags != CL_MAP_READ)
-        memcpy (dst_device_ptr + map->offset, map->host_ptr, map->size);
+        {
+          POCL_MSG_PRINT_MEMORY ("Unmap of buffer %p is not zero-copy, "
+                                 "copying %zu bytes\n",
+                                 dst_buf, map->size);
+          memcpy (dst_device_ptr + map->offset, map->host_ptr, map->size);
+        }
     }
 
   return CL_SUCCESS;
@@ -446,14 +442,42 @@ pocl_driver_free_mapping_ptr (void *data, pocl_mem_identifier *mem_id,
   if (map->host_ptr == NULL)
     return CL_SUCCESS;
 
-  if ((mem->mem_host_ptr != NULL)
-      && map->host_ptr != (mem->mem_host_ptr + map->offset))
+  if ((mem->mem_host_ptr == NULL)
+      || map->host_ptr != (mem->mem_host_ptr + map->offset))
     pocl_aligned_free (map->host_ptr);
 
   map->host_ptr = NULL;
   return CL_SUCCESS;
 }
 
+/* Returns the tile shift the CPU devices store the image in, 0 for the
+ * linear layout. Only the 2D and 3D images (and 2D image arrays) whose
+ * storage pocl allocates are tiled; the images on a buffer or on memory
+ * the application gave or asked to be host accessible stay linear, and
+ * zero-copy. */
+unsigned
+pocl_cpu_image_tile_shift (cl_device_id device, cl_mem image)
+{
+  if (device->image_tile_shift == 0 || !image->is_image
+      || image->image_height == 0 || image->buffer != NULL
+      || (image->flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)))
+    return 0;
+  return device->image_tile_shift;
+}
+
+/* The row and slice pitches in bytes of an image stored in tiles. The width
+ * and the height are padded to whole tiles; a row of tiles then takes
+ * row_pitch << tile_shift bytes. */
+void
+pocl_tiled_image_pitches (cl_mem image, unsigned tile_shift,
+                          size_t *row_pitch, size_t *slice_pitch)
+{
+  size_t tile = (size_t)1 << tile_shift;
+  size_t px = image->image_elem_size * image->image_channels;
+  *row_pitch = (image->image_width + tile - 1) / tile * tile * px;
+  *slice_pitch = (image->image_height + tile - 1) / tile * tile * *row_pitch;
+}
+
 cl_int
 pocl_driver_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
 {
@@ -473,8 +497,51 @@ pocl_driver_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
   if (svm_dev && svm_dev->global_mem_id == 0 && svm_dev->ops->svm_register)
     svm_dev->ops->svm_register (svm_dev, mem->mem_host_ptr, mem->size);
 
-  p->version = mem->mem_host_ptr_version;
-  p->mem_ptr = mem->mem_host_ptr;
+  /* The device uses mem_host_ptr directly, so that maps, unmaps and
+   * migrations of the buffer need no copies, unless a CL_MEM_USE_HOST_PTR
+   * pointer is not aligned enough for the kernels. Then the device gets
+   * storage of its own that the contents are migrated to and from. */
+  unsigned tile_shift = pocl_cpu_image_tile_shift (device, mem);
+  if (tile_shift)
+    {
+      /* Tiled images are (un)tiled by the image read and write callbacks
+       * when they are migrated. */
+      size_t row_pitch, slice_pitch, size;
+      pocl_tiled_image_pitches (mem, tile_shift, &row_pitch, &slice_pitch);
+      size = slice_pitch
+             * max (max (mem->image_depth, mem->image_array_size), (size_t)1);
+      p->extra_ptr = pocl_aligned_malloc (device->mem_base_addr_align, size);
+      if (p->extra_ptr == NULL)
+        {
+          pocl_release_mem_host_ptr (mem);
+          return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+      p->extra = tile_shift;
+      p->version = 0;
+      p->mem_ptr = p->extra_ptr;
+    }
+  else if ((mem->flags & CL_MEM_USE_HOST_PTR)
+      && ((uintptr_t)mem->mem_host_ptr % device->mem_base_addr_align) != 0)
+    {
+      POCL_MSG_PRINT_MEMORY ("USE_HOST_PTR %p of buffer %p is not aligned to "
+                             "%u bytes, the buffer is not zero-copy\n",
+                             mem->mem_host_ptr, mem,
+                             device->mem_base_addr_align);
+      p->extra_ptr = pocl_aligned_malloc (device->mem_base_addr_align,
+                                          mem->size);
+      if (p->extra_ptr == NULL)
+        {
+          pocl_release_mem_host_ptr (mem);
+          return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        }
+      p->version = 0;
+      p->mem_ptr = p->extra_ptr;
+    }
+  else
+    {
+      p->version = mem->mem_host_ptr_version;
+      p->mem_ptr = mem->mem_host_ptr;
+    }
 
   POCL_MSG_PRINT_MEMORY ("Basic device ALLOC %p / size %zu \n", p->mem_ptr,
                          mem->size);
@@ -490,6 +557,12 @@ pocl_driver_free (cl_device_id device, cl_mem mem)
     svm_dev->ops->svm_unregister (svm_dev, mem->mem_host_ptr, mem->size);
 
   pocl_mem_identifier *p = &mem->device_ptrs[device->global_mem_id];
+  if (p->extra_ptr)
+    {
+      pocl_aligned_free (p->extra_ptr);
+      p->extra_ptr = NULL;
+    }
+  p->extra = 0;
   pocl_release_mem_host_ptr (mem);
   p->mem_ptr = NULL;
   p->version = 0;
@@ -738,31 +811,86 @@ pocl_driver_supports_binary (cl_device_id device, const size_t length,
 #endif
 }
 
-/* Build the dynamic WG sized parallel.bc and device specific code,
-   for each kernel. This must be called *after* metadata has been setup  */
-int
-pocl_driver_build_poclbinary (cl_program program, cl_uint device_i)
+/* Builds the specialized WG functions in the comma separated list for the
+   kernel. An entry can be limited to one kernel by prefixing it with the
+   kernel name and a colon, e.g. "vecadd:128-1-1-goffs0". */
+static void
+build_wg_specializations (_cl_command_node *cmd, cl_kernel kernel,
+                          cl_device_id device, const char *list)
 {
-  unsigned i;
-  _cl_command_node cmd;
-  cl_device_id device = program->devices[device_i];
+  char *temp = strdup (list);
+  char *token;
+  char *rest = temp;
 
-  assert (program->build_status == CL_BUILD_SUCCESS);
-  if (program->num_kernels == 0)
-    return CL_SUCCESS;
+  while ((token = strtok_r (rest, ",", &rest)))
+    {
+      char *colon = strchr (token, ':');
+      if (colon != NULL)
+        {
+          *colon = 0;
+          if (strcmp (token, kernel->name) != 0)
+            continue;
+          token = colon + 1;
+        }
 
-  /* For binaries of other than Executable type (libraries, compiled but
-   * not linked programs, etc), do not attempt to compile the kernels. */
-  if (program->binary_type != CL_PROGRAM_BINARY_TYPE_EXECUTABLE)
-    return CL_SUCCESS;
+      /* By default don't specialize for the origo global offset. */
+      cmd->command.run.pc.global_offset[0]
+          = cmd->command.run.pc.global_offset[1]
+          = cmd->command.run.pc.global_offset[2] = 1;
+
+      /* By default don't specialize for the local size. */
+      cmd->command.run.pc.local_size[0] = cmd->command.run.pc.local_size[1]
+          = cmd->command.run.pc.local_size[2] = 0;
+
+      /* By default don't specialize for a small grid size. */
+      cmd->command.run.force_large_grid_wg_func = 1;
+
+      /* The format of the specialization follows the format of the
+         cache directory. E.g. 128-1-1-goffs0, 13-1-1-goffs0-smallgrid
+         or 0-0-0-goffs0. We thus assume the local size is always given
+         first. */
+
+      char *param1 = NULL, *param2 = NULL;
+      sscanf (token, "%lu-%lu-%lu-%m[^-]-%m[^-]",
+              &cmd->command.run.pc.local_size[0],
+              &cmd->command.run.pc.local_size[1],
+              &cmd->command.run.pc.local_size[2], &param1, &param2);
+      if (param1 != NULL)
+        {
+          if (strncmp (param1, "goffs0", 6) == 0)
+            {
+              cmd->command.run.pc.global_offset[0]
+                  = cmd->command.run.pc.global_offset[1]
+                  = cmd->command.run.pc.global_offset[2] = 0;
 
-  memset (&cmd, 0, sizeof (_cl_command_node));
-  cmd.type = CL_COMMAND_NDRANGE_KERNEL;
+              if (param2 != NULL && strncmp (param2, "smallgrid", 8) == 0)
+                {
+                  cmd->command.run.force_large_grid_wg_func = 0;
+                }
+            }
+          else if (strncmp (param1, "smallgrid", 8) == 0)
+            {
+              cmd->command.run.force_large_grid_wg_func = 0;
+            }
+        }
+      free (param1);
+      free (param2);
 
-  POCL_LOCK_OBJ (program);
+      device->ops->compile_kernel (cmd, kernel, device, 1);
+    }
+  free (temp);
+}
 
-  assert (program->binaries[device_i]);
+/* Builds the generic WG function and the requested specialized ones
+   for one kernel of the program. */
+static void
+build_kernel_binaries (cl_program program, cl_uint device_i, unsigned kernel_i)
+{
+  _cl_command_node cmd;
+  cl_device_id device = program->devices[device_i];
 
+  memset (&cmd, 0, sizeof (_cl_command_node));
+  cmd.type = CL_COMMAND_NDRANGE_KERNEL;
   cmd.device = device;
   cmd.program_device_i = device_i;
 
@@ -773,92 +901,121 @@ pocl_driver_build_poclbinary (cl_program program, cl_uint device_i)
   fake_k.next = NULL;
   cl_kernel kernel = &fake_k;
 
-  for (i = 0; i < program->num_kernels; i++)
+  fake_k.meta = &program->kernel_meta[kernel_i];
+  fake_k.name = fake_k.meta->name;
+  cmd.command.run.hash = fake_k.meta->build_hash[device_i];
+
+  size_t local_x = 0, local_y = 0, local_z = 0;
+
+  if (kernel->meta->reqd_wg_size[0] > 0
+      && kernel->meta->reqd_wg_size[1] > 0
+      && kernel->meta->reqd_wg_size[2] > 0)
     {
-      fake_k.meta = &program->kernel_meta[i];
-      fake_k.name = fake_k.meta->name;
-      cmd.command.run.hash = fake_k.meta->build_hash[device_i];
+      local_x = kernel->meta->reqd_wg_size[0];
+      local_y = kernel->meta->reqd_wg_size[1];
+      local_z = kernel->meta->reqd_wg_size[2];
+    }
 
-      size_t local_x = 0, local_y = 0, local_z = 0;
+  cmd.command.run.pc.local_size[0] = local_x;
+  cmd.command.run.pc.local_size[1] = local_y;
+  cmd.command.run.pc.local_size[2] = local_z;
+
+  cmd.command.run.kernel = kernel;
+
+  cmd.command.run.pc.global_offset[0] = cmd.command.run.pc.global_offset[1]
+      = cmd.command.run.pc.global_offset[2] = 0;
+
+  /* Force generate a generic WG function to ensure all local sizes
+     can be executed using the binary. */
+  device->ops->compile_kernel (&cmd, kernel, device, 0);
+  /* Then generate specialized ones as requested via the
+     POCL_BINARY_SPECIALIZE_WG configuration option and the
+     -cl-pocl-specialize= build option. */
+  build_wg_specializations (&cmd, kernel, device,
+                            pocl_get_string_option ("POCL_BINARY_SPECIALIZE_WG",
+                                                    ""));
+  if (program->wg_specializations)
+    build_wg_specializations (&cmd, kernel, device,
+                              program->wg_specializations);
+}
 
-      if (kernel->meta->reqd_wg_size[0] > 0
-          && kernel->meta->reqd_wg_size[1] > 0
-          && kernel->meta->reqd_wg_size[2] > 0)
-        {
-          local_x = kernel->meta->reqd_wg_size[0];
-          local_y = kernel->meta->reqd_wg_size[1];
-          local_z = kernel->meta->reqd_wg_size[2];
-        }
+typedef struct
+{
+  cl_program program;
+  cl_uint device_i;
+  /* the next kernel to build */
+  volatile unsigned next_kernel;
+} build_kernels_state;
+
+static void *
+build_kernels_worker (void *arg)
+{
+  build_kernels_state *state = (build_kernels_state *)arg;
+  unsigned i;
+  while ((i = __sync_fetch_and_add (&state->next_kernel, 1))
+         < state->program->num_kernels)
+    build_kernel_binaries (state->program, state->device_i, i);
+  return NULL;
+}
 
-      cmd.command.run.pc.local_size[0] = local_x;
-      cmd.command.run.pc.local_size[1] = local_y;
-      cmd.command.run.pc.local_size[2] = local_z;
+/* Build the dynamic WG sized parallel.bc and device specific code,
+   for each kernel. This must be called *after* metadata has been setup.
+   With POCL_COMPILE_THREADS > 1 the kernels are built concurrently. */
+int
+pocl_driver_build_poclbinary (cl_program program, cl_uint device_i)
+{
+  unsigned i;
 
-      cmd.command.run.kernel = kernel;
+  assert (program->build_status == CL_BUILD_SUCCESS);
+  if (program->num_kernels == 0)
+    return CL_SUCCESS;
 
-      cmd.command.run.pc.global_offset[0] = cmd.command.run.pc.global_offset[1]
-          = cmd.command.run.pc.global_offset[2] = 0;
+  /* For binaries of other than Executable type (libraries, compiled but
+   * not linked programs, etc), do not attempt to compile the kernels. */
+  if (program->binary_type != CL_PROGRAM_BINARY_TYPE_EXECUTABLE)
+    return CL_SUCCESS;
 
-      /* Force generate a generic WG function to ensure all local sizes
-         can be executed using the binary. */
-      device->ops->compile_kernel (&cmd, kernel, device, 0);
-      /* Then generate specialized ones as requested via the
-         POCL_BINARY_SPECIALIZE_WG configuration option. */
-      char *temp
-          = strdup (pocl_get_string_option ("POCL_BINARY_SPECIALIZE_WG", ""));
-      char *token;
-      char *rest = temp;
+  POCL_LOCK_OBJ (program);
 
-      while ((token = strtok_r (rest, ",", &rest)))
-        {
-          /* By default don't specialize for the origo global offset. */
-          cmd.command.run.pc.global_offset[0]
-              = cmd.command.run.pc.global_offset[1]
-              = cmd.command.run.pc.global_offset[2] = 1;
-
-          /* By default don't specialize for the local size. */
-          cmd.command.run.pc.local_size[0] = cmd.command.run.pc.local_size[1]
-              = cmd.command.run.pc.local_size[2] = 0;
-
-          /* By default don't specialize for a small grid size. */
-          cmd.command.run.force_large_grid_wg_func = 1;
-
-          /* The format of the specialization follows the format of the
-             cache directory. E.g. 128-1-1-goffs0, 13-1-1-goffs0-smallgrid
-             or 0-0-0-goffs0. We thus assume the local size is always given
-             first. */
-
-          char *param1 = NULL, *param2 = NULL;
-          int params_found
-              = sscanf (token, "%lu-%lu-%lu-%m[^-]-%m[^-]",
-                        &cmd.command.run.pc.local_size[0],
-                        &cmd.command.run.pc.local_size[1],
-                        &cmd.command.run.pc.local_size[2], &param1, &param2);
-          if (param1 != NULL)
-            {
-              if (strncmp (param1, "goffs0", 6) == 0)
-                {
-                  cmd.command.run.pc.global_offset[0]
-                      = cmd.command.run.pc.global_offset[1]
-                      = cmd.command.run.pc.global_offset[2] = 0;
-
-                  if (param2 != NULL && strncmp (param2, "smallgrid", 8) == 0)
-                    {
-                      cmd.command.run.force_large_grid_wg_func = 0;
-                    }
-                }
-              else if (strncmp (param1, "smallgrid", 8) == 0)
-                {
-                  cmd.command.run.force_large_grid_wg_func = 0;
-                }
-            }
-          free (param1);
-          free (param2);
+  assert (program->binaries[device_i]);
 
-          device->ops->compile_kernel (&cmd, kernel, device, 1);
-        }
-      free (temp);
-    }
+  for (i = 0; i < program->num_kernels; ++i)
+    if (pocl_binary_load_kernel_metadata (program, &program->kernel_meta[i])
+        != CL_SUCCESS)
+      {
+        POCL_UNLOCK_OBJ (program);
+        return CL_OUT_OF_HOST_MEMORY;
+      }
+
+  unsigned num_threads = 1;
+#ifdef ENABLE_LLVM
+  /* Only the CPU drivers' compile_kernel is known to be reentrant. */
+  if (pocl_llvm_parallel_codegen ()
+      && (program->devices[device_i]->type & CL_DEVICE_TYPE_CPU))
+    num_threads = pocl_get_int_option ("POCL_COMPILE_THREADS", 1);
+#endif
+  if (num_threads > program->num_kernels)
+    num_threads = program->num_kernels;
+
+  build_kernels_state state = { program, device_i, 0 };
+  pthread_t *threads = NULL;
+  unsigned num_started = 0;
+  if (num_threads > 1)
+    threads = (pthread_t *)calloc (num_threads - 1, sizeof (pthread_t));
+  if (threads)
+    for (i = 0; i < num_threads - 1; ++i)
+      {
+        if (pthread_create (&threads[i], NULL, build_kernels_worker, &state))
+          break;
+        ++num_started;
+      }
+
+  /* this thread works too */
+  build_kernels_worker (&state);
+
+  for (i = 0; i < num_started; ++i)
+    PTHREAD_CHECK (pthread_join (threads[i], NULL));
+  POCL_MEM_FREE (threads);
 
   POCL_UNLOCK_OBJ (program);
 
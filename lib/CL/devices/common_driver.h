@@ -54,6 +54,16 @@ POCL_EXPORT
                               const size_t *src_origin, const size_t *region,
                               size_t dst_row_pitch, size_t dst_slice_pitch,
                               size_t src_row_pitch, size_t src_slice_pitch);
+/* Fills of at least this many bytes use non-temporal stores where
+ * available, because they would only flush the caches. */
+#define POCL_FILL_NONTEMPORAL_MIN (8 * 1024 * 1024)
+
+/* Fills size bytes at dst with the pattern, size being a multiple of
+ * pattern_size. */
+POCL_EXPORT
+  void pocl_fill_memory (void *__restrict__ dst, size_t size,
+                         const void *__restrict__ pattern,
+                         size_t pattern_size, int nontemporal);
 POCL_EXPORT
   void pocl_driver_memfill (void *data, pocl_mem_identifier *dst_mem_id,
                             cl_mem dst_buf, size_t size, size_t offset,
@@ -74,6 +84,16 @@ POCL_EXPORT
   cl_int pocl_driver_free_mapping_ptr (void *data, pocl_mem_identifier *mem_id,
                                        cl_mem mem, mem_mapping_t *map);
 
+/* The largest tile shift of the tiled CPU images (32x32 pixel tiles). */
+#define POCL_MAX_IMAGE_TILE_SHIFT 5
+
+POCL_EXPORT
+unsigned pocl_cpu_image_tile_shift (cl_device_id device, cl_mem image);
+
+POCL_EXPORT
+void pocl_tiled_image_pitches (cl_mem image, unsigned tile_shift,
+                               size_t *row_pitch, size_t *slice_pitch);
+
 POCL_EXPORT
 cl_int pocl_driver_alloc_mem_obj (cl_device_id device, cl_mem mem,
                                   void *host_ptr);
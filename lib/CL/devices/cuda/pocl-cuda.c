@@ -33,12 +33,16 @@
 #include "pocl-ptx-gen.h"
 #include "pocl_cache.h"
 #include "pocl_file_util.h"
+#include "pocl_image_util.h"
 #include "pocl_llvm.h"
+#include "pocl_local_size.h"
 #include "pocl_mem_management.h"
 #include "pocl_runtime_config.h"
 #include "pocl_timing.h"
 #include "pocl_util.h"
 
+#include "_kernel_constants.h"
+
 #include <string.h>
 
 #include <cuda.h>
@@ -49,6 +53,81 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+/* The CUDA device ordinals peer access is tracked for. */
+#define POCL_CUDA_MAX_PEERS 64
+
+/* Transfers between device memory and pageable host memory larger than
+ * this are pipelined in chunks of this size through page-locked staging
+ * buffers, POCL_CUDA_STAGING_SLOTS of them in flight at a time. */
+#define POCL_CUDA_STAGING_SIZE (4 * 1024 * 1024)
+#define POCL_CUDA_STAGING_SLOTS 2
+
+/* The most compute streams of an out-of-order queue. */
+#define POCL_CUDA_MAX_STREAMS 16
+
+/* The fills of the patterns of 8 to 128 bytes. Each thread stores the
+ * 64-bit words at its index and at its multiples of the grid size from
+ * there, of the pattern repeated to 128 bytes. The blocks are multiples of
+ * 16 threads, so a thread stores the same word of the pattern throughout.
+ * Generated with the NVPTX backend of LLVM. */
+static const char pocl_cuda_fill_ptx[]
+    = ".version 3.2\n"
+      ".target sm_30\n"
+      ".address_size 64\n"
+      "\n"
+      ".visible .entry pocl_cuda_fill(\n"
+      "\t.param .u64 dst,\n"
+      "\t.param .u64 num_words,\n"
+      "\t.param .align 8 .b8 pattern[128]\n"
+      ")\n"
+      "{\n"
+      "\t.reg .pred %p<3>;\n"
+      "\t.reg .b32 %r<5>;\n"
+      "\t.reg .b64 %rd<12>;\n"
+      "\n"
+      "\tld.param.u64 %rd1, [num_words];\n"
+      "\tmov.u32 %r1, %tid.x;\n"
+      "\tmov.u32 %r2, %ctaid.x;\n"
+      "\tmov.u32 %r3, %ntid.x;\n"
+      "\tcvt.u64.u32 %rd2, %r1;\n"
+      "\tmul.wide.u32 %rd3, %r2, %r3;\n"
+      "\tadd.s64 %rd4, %rd3, %rd2;\n"
+      "\tsetp.ge.u64 %p1, %rd4, %rd1;\n"
+      "\t@%p1 bra DONE;\n"
+      "\tld.param.u64 %rd5, [dst];\n"
+      "\tmov.b64 %rd6, pattern;\n"
+      "\tmov.u32 %r4, %nctaid.x;\n"
+      "\tmul.wide.u32 %rd7, %r4, %r3;\n"
+      "\tand.b64 %rd8, %rd2, 15;\n"
+      "\tshl.b64 %rd8, %rd8, 3;\n"
+      "\tadd.s64 %rd8, %rd6, %rd8;\n"
+      "\tld.param.u64 %rd9, [%rd8];\n"
+      "\tshl.b64 %rd10, %rd4, 3;\n"
+      "\tadd.s64 %rd10, %rd5, %rd10;\n"
+      "\tshl.b64 %rd11, %rd7, 3;\n"
+      "LOOP:\n"
+      "\tst.global.u64 [%rd10], %rd9;\n"
+      "\tadd.s64 %rd4, %rd4, %rd7;\n"
+      "\tadd.s64 %rd10, %rd10, %rd11;\n"
+      "\tsetp.lt.u64 %p2, %rd4, %rd1;\n"
+      "\t@%p2 bra LOOP;\n"
+      "DONE:\n"
+      "\tret;\n"
+      "}\n";
+
+/* The threads of a block of the fill kernel, and the most blocks. */
+#define POCL_CUDA_FILL_BLOCK 256
+#define POCL_CUDA_FILL_MAX_BLOCKS 4096
+
+/* A page-locked staging buffer, and the event of the last copy from or to
+ * it, which must complete before the buffer is reused. */
+typedef struct pocl_cuda_staging_s
+{
+  void *ptr;
+  CUevent done;
+  struct pocl_cuda_staging_s *next;
+} pocl_cuda_staging_t;
+
 typedef struct pocl_cuda_device_data_s
 {
   CUdevice device;
@@ -58,45 +137,158 @@ typedef struct pocl_cuda_device_data_s
   char libdevice[PATH_MAX];
   pocl_lock_t compile_lock;
   int supports_cu_mem_host_register;
+  /* whether this device's context can access the memory of the device with
+   * the given ordinal: 0 = not checked yet, 1 = enabled, -1 = impossible */
+  signed char peer_access[POCL_CUDA_MAX_PEERS];
+  /* the free staging buffers of the device's context */
+  pocl_lock_t staging_lock;
+  pocl_cuda_staging_t *staging;
+  /* the SVM allocations are managed memory; with concurrent access, the
+   * host and the device can use it at the same time, and it can be
+   * prefetched and given usage hints */
+  int supports_managed_memory;
+  int concurrent_managed_access;
+  /* the module of pocl_cuda_fill_ptx and its kernel; NULL if the module
+   * did not load, when the fills use strided memsets instead */
+  CUmodule builtin_module;
+  CUfunction fill_kernel;
+  /* signalled when a kernel variant has been compiled */
+  pocl_cond_t compile_cond;
+  /* the kernel variants waiting for the background compile threads, see
+   * POCL_CUDA_COMPILE_THREADS; protected by compile_lock */
+  struct pocl_cuda_compile_job_s *compile_jobs;
+  pocl_cond_t compile_jobs_cond;
+  pthread_t *compile_threads;
+  unsigned num_compile_threads;
+  int compile_shutdown;
 } pocl_cuda_device_data_t;
 
 typedef struct pocl_cuda_queue_data_s
 {
-  CUstream stream;
+  /* An in-order queue has a single stream. An out-of-order one spreads its
+   * kernels over num_streams streams and its transfers to copy_stream, and
+   * orders them by waiting for the CUDA events of the dependencies. */
+  CUstream streams[POCL_CUDA_MAX_STREAMS];
+  unsigned num_streams;
+  unsigned next_stream;
+  CUstream copy_stream;
   int use_threads;
   pthread_t submit_thread;
   pthread_t finalize_thread;
   pthread_mutex_t lock;
   pthread_cond_t pending_cond;
-  pthread_cond_t running_cond;
+  /* signalled by the completion callbacks when finalize_waiting > 0 */
+  pthread_cond_t completed_cond;
   _cl_command_node *volatile pending_queue;
-  _cl_command_node *volatile running_queue;
+  /* the commands whose completion callback has run, newest first; the
+   * callbacks push to it without locking */
+  struct pocl_cuda_event_data_s *completed;
+  /* the completed commands, oldest first, that are waiting for their
+   * dependencies to be finalized; only used by the finalizing thread */
+  struct pocl_cuda_event_data_s *ready;
+  int finalize_waiting;
+  /* held by the thread finalizing the completed commands */
+  pthread_mutex_t finalize_lock;
   cl_command_queue queue;
 } pocl_cuda_queue_data_t;
 
-typedef struct pocl_cuda_kernel_data_s
+/* A kernel compiled for one specialization. The key mirrors the cache
+ * directory of the work-group function, so every variant has its own
+ * PTX and CUBIN. */
+typedef struct pocl_cuda_kernel_variant_s
 {
+  size_t local_size[3];
+  int has_offsets;
+  int specialized;
+  int smallgrid;
+  /* 0 while the variant is being compiled */
+  int ready;
   CUmodule module;
-  CUmodule module_offsets;
   CUfunction kernel;
-  CUfunction kernel_offsets;
+  CUdeviceptr constant_mem_base;
+  size_t constant_mem_size;
+  struct pocl_cuda_kernel_variant_s *next;
+} pocl_cuda_kernel_variant_t;
+
+/* The kernel parameters are limited to 4 KiB by CUDA. */
+#define POCL_CUDA_MAX_PARAM_SIZE 4096
+
+typedef struct pocl_cuda_kernel_data_s
+{
+  pocl_cuda_kernel_variant_t *variants;
   size_t *alignments;
+  /* Offsets of the parameters in the packed argument buffer, the last one
+   * is work_dim. */
+  size_t *param_offsets;
+  unsigned num_params;
+  size_t param_size;
 } pocl_cuda_kernel_data_t;
 
+/* A kernel variant to compile in the background. The command is a copy
+ * with the sizes and the hash of the variant, and holds a reference to
+ * the kernel. */
+typedef struct pocl_cuda_compile_job_s
+{
+  _cl_command_node cmd;
+  pocl_cuda_kernel_data_t *kdata;
+  pocl_cuda_kernel_variant_t *variant;
+  struct pocl_cuda_compile_job_s *next;
+} pocl_cuda_compile_job_t;
+
+/* The CUDA graph a command buffer is run as, captured at its first enqueue
+ * and launched by the later ones. It's captured again if a buffer has been
+ * reallocated, since the device addresses are in the graph. */
+typedef struct pocl_cuda_graph_s
+{
+  pocl_lock_t lock;
+#if CUDA_VERSION >= 10000
+  CUgraph graph;
+  CUgraphExec exec;
+#endif
+  /* the device addresses of the buffers of the command, at the capture */
+  void **mem_ptrs;
+  size_t num_mem_ptrs;
+} pocl_cuda_graph_t;
+
+/* The CUDA array of an image, at the extra_ptr of its pocl_mem_identifier,
+ * and the objects the kernels access it through. The mem_ptr is the device
+ * copy of the cuda_image_t of these, the kernel argument of the image. */
+typedef struct pocl_cuda_image_data_s
+{
+  CUarray array;
+  CUsurfObject surface;
+  /* at POCL_CUDA_TEXTURE_INDEX of the sampler state; the integer images
+   * can't be filtered, and alias the nearest textures to the linear ones */
+  CUtexObject textures[POCL_CUDA_NUM_TEXTURES];
+} pocl_cuda_image_data_t;
+
 typedef struct pocl_cuda_event_data_s
 {
   CUevent start;
   CUevent end;
+  /* the stream the command was submitted to */
+  CUstream stream;
   volatile int events_ready;
   cl_int *ext_event_flag;
   pthread_cond_t event_cond;
   volatile unsigned num_ext_events;
+  /* for the completion callback */
+  cl_event event;
+  pocl_cuda_queue_data_t *queue_data;
+  struct pocl_cuda_event_data_s *next_completed;
 } pocl_cuda_event_data_t;
 
 extern unsigned int pocl_num_devices;
 
 void *pocl_cuda_submit_thread (void *);
 void *pocl_cuda_finalize_thread (void *);
+void *pocl_cuda_compile_thread (void *);
+void pocl_cuda_finalize_command (cl_device_id device, cl_event event);
+void pocl_cuda_submit_batch (_cl_command_node *batch, cl_command_queue cq);
+void pocl_cuda_compute_local_size (cl_device_id dev, cl_kernel kernel,
+                                   size_t global_x, size_t global_y,
+                                   size_t global_z, size_t *local_x,
+                                   size_t *local_y, size_t *local_z);
 
 static void
 pocl_cuda_abort_on_error (CUresult result, unsigned line, const char *func,
@@ -205,13 +397,19 @@ pocl_cuda_init_device_ops (struct pocl_device_ops *ops)
   ops->uninit = pocl_cuda_uninit;
   ops->reinit = NULL;
   ops->init = pocl_cuda_init;
+  ops->init_deferred = pocl_cuda_init_deferred;
   ops->init_queue = pocl_cuda_init_queue;
   ops->free_queue = pocl_cuda_free_queue;
+  ops->can_run_command_buffer = pocl_cuda_can_run_command_buffer;
+  ops->free_command_buffer = pocl_cuda_free_command_buffer;
 
   ops->alloc_mem_obj = pocl_cuda_alloc_mem_obj;
   ops->free = pocl_cuda_free;
+  ops->svm_alloc = pocl_cuda_svm_alloc;
+  ops->svm_free = pocl_cuda_svm_free;
 
   ops->submit = pocl_cuda_submit;
+  ops->submit_batch = pocl_cuda_submit_batch;
   ops->notify = pocl_cuda_notify;
   ops->broadcast = pocl_broadcast;
   ops->wait_event = pocl_cuda_wait_event;
@@ -224,10 +422,12 @@ pocl_cuda_init_device_ops (struct pocl_device_ops *ops)
   ops->notify_event_finished = pocl_cuda_notify_event_finished;
 
   ops->get_device_info_ext = pocl_cuda_handle_cl_nv_device_attribute_query;
+  ops->compute_local_size = pocl_cuda_compute_local_size;
   ops->build_source = pocl_driver_build_source;
   ops->link_program = pocl_driver_link_program;
   ops->build_binary = pocl_driver_build_binary;
   ops->free_program = pocl_driver_free_program;
+  ops->create_kernel = pocl_cuda_create_kernel;
   ops->setup_metadata = pocl_driver_setup_metadata;
   ops->supports_binary = pocl_driver_supports_binary;
   ops->build_poclbinary = pocl_driver_build_poclbinary;
@@ -237,8 +437,8 @@ pocl_cuda_init_device_ops (struct pocl_device_ops *ops)
   ops->get_mapping_ptr = pocl_driver_get_mapping_ptr;
   ops->free_mapping_ptr = pocl_driver_free_mapping_ptr;
 
-  ops->can_migrate_d2d = NULL;
-  ops->migrate_d2d = NULL;
+  ops->can_migrate_d2d = pocl_cuda_can_migrate_d2d;
+  ops->migrate_d2d = pocl_cuda_migrate_d2d;
   ops->read = NULL;
   ops->read_rect = NULL;
   ops->write = NULL;
@@ -250,11 +450,33 @@ pocl_cuda_init_device_ops (struct pocl_device_ops *ops)
   ops->run = NULL;
 }
 
+/* The formats of the CUDA arrays with 1, 2 and 4 channels, read and
+ * written as the OpenCL formats of them. BGRA is RGBA swizzled by the
+ * kernel library. */
+static const cl_image_format pocl_cuda_image_formats[] = {
+#define POCL_CUDA_CHANNEL_TYPES(order)                                        \
+  { order, CL_SNORM_INT8 }, { order, CL_SNORM_INT16 },                        \
+      { order, CL_UNORM_INT8 }, { order, CL_UNORM_INT16 },                    \
+      { order, CL_SIGNED_INT8 }, { order, CL_SIGNED_INT16 },                  \
+      { order, CL_SIGNED_INT32 }, { order, CL_UNSIGNED_INT8 },                \
+      { order, CL_UNSIGNED_INT16 }, { order, CL_UNSIGNED_INT32 },             \
+      { order, CL_HALF_FLOAT }, { order, CL_FLOAT }
+  POCL_CUDA_CHANNEL_TYPES (CL_R),
+  POCL_CUDA_CHANNEL_TYPES (CL_RG),
+  POCL_CUDA_CHANNEL_TYPES (CL_RGBA),
+#undef POCL_CUDA_CHANNEL_TYPES
+  { CL_BGRA, CL_UNORM_INT8 },
+  { CL_BGRA, CL_SNORM_INT8 },
+  { CL_BGRA, CL_SIGNED_INT8 },
+  { CL_BGRA, CL_UNSIGNED_INT8 },
+};
+
 cl_int
 pocl_cuda_init (unsigned j, cl_device_id dev, const char *parameters)
 {
   CUresult result;
   int ret = CL_SUCCESS;
+  unsigned i;
 
   if (dev->data)
     return ret;
@@ -278,8 +500,17 @@ pocl_cuda_init (unsigned j, cl_device_id dev, const char *parameters)
   dev->local_as_id = 3;
   dev->constant_as_id = 1;
 
-  /* TODO: Get images working */
-  dev->image_support = CL_FALSE;
+  dev->image_support = CL_TRUE;
+  for (i = 0; i < NUM_OPENCL_IMAGE_TYPES; ++i)
+    {
+      dev->image_formats[i] = pocl_cuda_image_formats;
+      dev->num_image_formats[i] = sizeof (pocl_cuda_image_formats)
+                                  / sizeof (cl_image_format);
+    }
+  /* the kernel library reads and writes only the CUDA arrays */
+  i = opencl_image_type_to_index (CL_MEM_OBJECT_IMAGE1D_BUFFER);
+  dev->image_formats[i] = NULL;
+  dev->num_image_formats[i] = 0;
 
   dev->autolocals_to_args
       = POCL_AUTOLOCALS_TO_ARGS_ONLY_IF_DYNAMIC_LOCALS_PRESENT;
@@ -344,6 +575,16 @@ pocl_cuda_init (unsigned j, cl_device_id dev, const char *parameters)
 #else
       data->supports_cu_mem_host_register = 1;
 #endif
+      GET_CU_PROP (MAXIMUM_TEXTURE2D_WIDTH, dev->image2d_max_width);
+      GET_CU_PROP (MAXIMUM_TEXTURE2D_HEIGHT, dev->image2d_max_height);
+      GET_CU_PROP (MAXIMUM_TEXTURE3D_WIDTH, dev->image3d_max_width);
+      GET_CU_PROP (MAXIMUM_TEXTURE3D_HEIGHT, dev->image3d_max_height);
+      GET_CU_PROP (MAXIMUM_TEXTURE3D_DEPTH, dev->image3d_max_depth);
+      GET_CU_PROP (MAXIMUM_TEXTURE2D_LAYERED_LAYERS,
+                   dev->image_max_array_size);
+      GET_CU_PROP (MANAGED_MEMORY, data->supports_managed_memory);
+      GET_CU_PROP (CONCURRENT_MANAGED_ACCESS,
+                   data->concurrent_managed_access);
     }
   if (CUDA_CHECK_ERROR (result, "cuDeviceGetAttribute"))
     ret = CL_INVALID_DEVICE;
@@ -373,6 +614,17 @@ pocl_cuda_init (unsigned j, cl_device_id dev, const char *parameters)
 
   dev->local_mem_type = CL_LOCAL;
 
+  /* OpenCL 2.0 properties. The SVM allocations are CUDA managed memory,
+     which the host can use concurrently with the device only when the
+     device supports it. */
+  if (data->supports_managed_memory)
+    {
+      dev->svm_allocation_priority = 2;
+      dev->svm_caps = CL_DEVICE_SVM_COARSE_GRAIN_BUFFER;
+      if (data->concurrent_managed_access)
+        dev->svm_caps |= CL_DEVICE_SVM_FINE_GRAIN_BUFFER;
+    }
+
   /* Get GPU architecture name */
   int sm_maj = 0, sm_min = 0;
   if (ret != CL_INVALID_DEVICE)
@@ -399,41 +651,76 @@ pocl_cuda_init (unsigned j, cl_device_id dev, const char *parameters)
 
   dev->device_side_printf = 0;
 
-  /* Create context */
-  if (ret != CL_INVALID_DEVICE)
-    {
-      result = cuCtxCreate (&data->context, CU_CTX_MAP_HOST, data->device);
-      if (CUDA_CHECK_ERROR (result, "cuCtxCreate"))
-        ret = CL_INVALID_DEVICE;
-    }
-
-  /* Create epoch event for timing info */
-  if (ret != CL_INVALID_DEVICE)
-    {
-      result = cuEventCreate (&data->epoch_event, CU_EVENT_DEFAULT);
-      CUDA_CHECK_ERROR (result, "cuEventCreate");
-
-      data->epoch = pocl_gettimemono_ns ();
-
-      result = cuEventRecord (data->epoch_event, 0);
-      result = cuEventSynchronize (data->epoch_event);
-      if (CUDA_CHECK_ERROR (result, "cuEventSynchronize"))
-        ret = CL_INVALID_DEVICE;
-    }
-
-  /* Get global memory size */
-  size_t memfree = 0, memtotal = 0;
+  /* Get global memory size; unlike cuMemGetInfo, this needs no context */
+  size_t memtotal = 0;
   if (ret != CL_INVALID_DEVICE)
-    result = cuMemGetInfo (&memfree, &memtotal);
+    result = cuDeviceTotalMem (&memtotal, data->device);
   dev->max_mem_alloc_size = max (memtotal / 4, 128 * 1024 * 1024);
   dev->global_mem_size = memtotal;
 
   dev->data = data;
 
   POCL_INIT_LOCK (data->compile_lock);
+  POCL_INIT_COND (data->compile_cond);
+  POCL_INIT_COND (data->compile_jobs_cond);
+  POCL_INIT_LOCK (data->staging_lock);
+
   return ret;
 }
 
+/* Creating the CUDA context takes long, so it is left until the device is
+ * first used in an OpenCL context. */
+cl_int
+pocl_cuda_init_deferred (cl_device_id dev)
+{
+  pocl_cuda_device_data_t *data = (pocl_cuda_device_data_t *)dev->data;
+  CUresult result;
+
+  result = cuCtxCreate (&data->context, CU_CTX_MAP_HOST, data->device);
+  if (CUDA_CHECK_ERROR (result, "cuCtxCreate"))
+    return CL_DEVICE_NOT_AVAILABLE;
+
+  /* Create epoch event for timing info */
+  result = cuEventCreate (&data->epoch_event, CU_EVENT_DEFAULT);
+  CUDA_CHECK_ERROR (result, "cuEventCreate");
+
+  data->epoch = pocl_gettimemono_ns ();
+
+  result = cuEventRecord (data->epoch_event, 0);
+  result = cuEventSynchronize (data->epoch_event);
+  if (CUDA_CHECK_ERROR (result, "cuEventSynchronize"))
+    return CL_DEVICE_NOT_AVAILABLE;
+
+  result = cuModuleLoadData (&data->builtin_module, pocl_cuda_fill_ptx);
+  if (!CUDA_CHECK_ERROR (result, "cuModuleLoadData"))
+    {
+      result = cuModuleGetFunction (&data->fill_kernel, data->builtin_module,
+                                    "pocl_cuda_fill");
+      if (CUDA_CHECK_ERROR (result, "cuModuleGetFunction"))
+        data->fill_kernel = NULL;
+    }
+  else
+    data->builtin_module = NULL;
+
+  /* Start the threads that compile the kernels in the background */
+  int num_threads = pocl_get_int_option ("POCL_CUDA_COMPILE_THREADS", 0);
+  if (num_threads > 0)
+    {
+      int i;
+      data->compile_threads
+          = (pthread_t *)calloc (num_threads, sizeof (pthread_t));
+      for (i = 0; i < num_threads; ++i)
+        {
+          if (pthread_create (&data->compile_threads[i], NULL,
+                              pocl_cuda_compile_thread, dev))
+            break;
+          ++data->num_compile_threads;
+        }
+    }
+
+  return CL_SUCCESS;
+}
+
 cl_int
 pocl_cuda_init_queue (cl_device_id device, cl_command_queue queue)
 {
@@ -444,19 +731,42 @@ pocl_cuda_init_queue (cl_device_id device, cl_command_queue queue)
   queue->data = queue_data;
   queue_data->queue = queue;
 
-  CUresult result
-      = cuStreamCreate (&queue_data->stream, CU_STREAM_NON_BLOCKING);
-  if (CUDA_CHECK_ERROR (result, "cuStreamCreate"))
-    return CL_OUT_OF_RESOURCES;
+  queue_data->num_streams = 1;
+  if (queue->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+    {
+      int n = pocl_get_int_option ("POCL_CUDA_QUEUE_STREAMS", 4);
+      queue_data->num_streams
+          = (n < 1) ? 1 : (n > POCL_CUDA_MAX_STREAMS ? POCL_CUDA_MAX_STREAMS : n);
+    }
+
+  CUresult result;
+  unsigned i;
+  for (i = 0; i < queue_data->num_streams; ++i)
+    {
+      result = cuStreamCreate (&queue_data->streams[i], CU_STREAM_NON_BLOCKING);
+      if (CUDA_CHECK_ERROR (result, "cuStreamCreate"))
+        return CL_OUT_OF_RESOURCES;
+    }
+  if (queue->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+    {
+      result
+          = cuStreamCreate (&queue_data->copy_stream, CU_STREAM_NON_BLOCKING);
+      if (CUDA_CHECK_ERROR (result, "cuStreamCreate"))
+        return CL_OUT_OF_RESOURCES;
+    }
+  else
+    queue_data->copy_stream = queue_data->streams[0];
 
   queue_data->use_threads
       = !pocl_get_bool_option ("POCL_CUDA_DISABLE_QUEUE_THREADS", 1);
 
+  PTHREAD_CHECK (pthread_mutex_init (&queue_data->lock, NULL));
+  PTHREAD_CHECK (pthread_cond_init (&queue_data->completed_cond, NULL));
+  PTHREAD_CHECK (pthread_mutex_init (&queue_data->finalize_lock, NULL));
+
   if (queue_data->use_threads)
     {
-      PTHREAD_CHECK (pthread_mutex_init (&queue_data->lock, NULL));
       PTHREAD_CHECK (pthread_cond_init (&queue_data->pending_cond, NULL));
-      PTHREAD_CHECK (pthread_cond_init (&queue_data->running_cond, NULL));
       int err = pthread_create (&queue_data->submit_thread, NULL,
                                 pocl_cuda_submit_thread, queue_data);
       if (err)
@@ -483,10 +793,15 @@ pocl_cuda_free_queue (cl_device_id device, cl_command_queue queue)
   pocl_cuda_queue_data_t *queue_data = (pocl_cuda_queue_data_t *)queue->data;
 
   cuCtxSetCurrent (((pocl_cuda_device_data_t *)queue->device->data)->context);
-  cuStreamDestroy (queue_data->stream);
+  unsigned i;
+  for (i = 0; i < queue_data->num_streams; ++i)
+    cuStreamDestroy (queue_data->streams[i]);
+  if (queue_data->copy_stream != queue_data->streams[0])
+    cuStreamDestroy (queue_data->copy_stream);
 
   assert (queue_data->pending_queue == NULL);
-  assert (queue_data->running_queue == NULL);
+  assert (queue_data->completed == NULL);
+  assert (queue_data->ready == NULL);
 
   /* Kill queue threads */
   if (queue_data->use_threads)
@@ -494,11 +809,15 @@ pocl_cuda_free_queue (cl_device_id device, cl_command_queue queue)
       PTHREAD_CHECK (pthread_mutex_lock (&queue_data->lock));
       queue_data->queue = NULL;
       PTHREAD_CHECK (pthread_cond_signal (&queue_data->pending_cond));
-      PTHREAD_CHECK (pthread_cond_signal (&queue_data->running_cond));
+      PTHREAD_CHECK (pthread_cond_broadcast (&queue_data->completed_cond));
       PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
       PTHREAD_CHECK (pthread_join (queue_data->submit_thread, NULL));
       PTHREAD_CHECK (pthread_join (queue_data->finalize_thread, NULL));
+      PTHREAD_CHECK (pthread_cond_destroy (&queue_data->pending_cond));
     }
+  PTHREAD_CHECK (pthread_cond_destroy (&queue_data->completed_cond));
+  PTHREAD_CHECK (pthread_mutex_destroy (&queue_data->finalize_lock));
+  PTHREAD_CHECK (pthread_mutex_destroy (&queue_data->lock));
   return CL_SUCCESS;
 }
 
@@ -543,11 +862,37 @@ cl_int
 pocl_cuda_uninit (unsigned j, cl_device_id device)
 {
   pocl_cuda_device_data_t *data = device->data;
+  unsigned i;
 
-  if (device->available) {
+  /* Stop the compile threads, the kernels left in the queue are not
+   * compiled anymore */
+  POCL_LOCK (data->compile_lock);
+  data->compile_shutdown = 1;
+  POCL_BROADCAST_COND (data->compile_jobs_cond);
+  POCL_UNLOCK (data->compile_lock);
+  for (i = 0; i < data->num_compile_threads; ++i)
+    PTHREAD_CHECK (pthread_join (data->compile_threads[i], NULL));
+  POCL_MEM_FREE (data->compile_threads);
+  pocl_cuda_compile_job_t *job, *next_job;
+  LL_FOREACH_SAFE (data->compile_jobs, job, next_job)
+    POCL_MEM_FREE (job);
+
+  /* The context only exists if the device was ever used */
+  if (device->available && data->context != NULL) {
+      pocl_cuda_staging_t *st, *tmp;
+      LL_FOREACH_SAFE (data->staging, st, tmp)
+        {
+          cuEventSynchronize (st->done);
+          cuEventDestroy (st->done);
+          cuMemFreeHost (st->ptr);
+          POCL_MEM_FREE (st);
+        }
+      if (data->builtin_module != NULL)
+        cuModuleUnload (data->builtin_module);
       cuEventDestroy (data->epoch_event);
       cuCtxDestroy (data->context);
   }
+  POCL_DESTROY_LOCK (data->staging_lock);
 
   POCL_MEM_FREE (data);
   device->data = NULL;
@@ -559,6 +904,228 @@ pocl_cuda_uninit (unsigned j, cl_device_id device)
   return CL_SUCCESS;
 }
 
+/* The geometry of the image in the CUDA array convention: the layers of a
+ * 1D array are its z coordinate, like those of a 2D array. Converts the
+ * origin and the region of an image command in place. */
+static void
+pocl_cuda_array_coords (cl_mem image, size_t *origin, size_t *region)
+{
+  if (image->type == CL_MEM_OBJECT_IMAGE1D_ARRAY)
+    {
+      origin[2] = origin[1];
+      origin[1] = 0;
+      region[2] = region[1];
+      region[1] = 1;
+    }
+}
+
+/* The region of the whole image, as the image commands give it. */
+static void
+pocl_cuda_image_region (cl_mem image, size_t *region)
+{
+  region[0] = image->image_width;
+  region[1] = image->image_height ? image->image_height : 1;
+  region[2] = image->image_depth ? image->image_depth : 1;
+  if (image->type == CL_MEM_OBJECT_IMAGE1D_ARRAY)
+    region[1] = image->image_array_size;
+  else if (image->type == CL_MEM_OBJECT_IMAGE2D_ARRAY)
+    region[2] = image->image_array_size;
+}
+
+static CUarray_format
+pocl_cuda_array_format (cl_channel_type type)
+{
+  switch (type)
+    {
+    case CL_SNORM_INT8:
+    case CL_SIGNED_INT8:
+      return CU_AD_FORMAT_SIGNED_INT8;
+    case CL_SNORM_INT16:
+    case CL_SIGNED_INT16:
+      return CU_AD_FORMAT_SIGNED_INT16;
+    case CL_SIGNED_INT32:
+      return CU_AD_FORMAT_SIGNED_INT32;
+    case CL_UNORM_INT8:
+    case CL_UNSIGNED_INT8:
+      return CU_AD_FORMAT_UNSIGNED_INT8;
+    case CL_UNORM_INT16:
+    case CL_UNSIGNED_INT16:
+      return CU_AD_FORMAT_UNSIGNED_INT16;
+    case CL_UNSIGNED_INT32:
+      return CU_AD_FORMAT_UNSIGNED_INT32;
+    case CL_HALF_FLOAT:
+      return CU_AD_FORMAT_HALF;
+    default:
+      return CU_AD_FORMAT_FLOAT;
+    }
+}
+
+static CUaddress_mode
+pocl_cuda_address_mode (unsigned addressing)
+{
+  switch (addressing)
+    {
+    case CLK_ADDRESS_CLAMP:
+      return CU_TR_ADDRESS_MODE_BORDER;
+    case CLK_ADDRESS_REPEAT:
+      return CU_TR_ADDRESS_MODE_WRAP;
+    case CLK_ADDRESS_MIRRORED_REPEAT:
+      return CU_TR_ADDRESS_MODE_MIRROR;
+    default:
+      /* CLK_ADDRESS_NONE leaves the reads outside the image undefined */
+      return CU_TR_ADDRESS_MODE_CLAMP;
+    }
+}
+
+static void pocl_cuda_free_image (pocl_mem_identifier *p);
+static void pocl_cuda_submit_image_rect (CUstream stream, cl_mem image,
+                                         pocl_mem_identifier *mem_id,
+                                         int to_image, void *host_ptr,
+                                         CUdeviceptr device_ptr,
+                                         const size_t *origin,
+                                         const size_t *region,
+                                         size_t row_pitch,
+                                         size_t slice_pitch);
+
+/* Allocates the CUDA array of the image, and the texture and surface
+ * objects of it, to p. */
+static cl_int
+pocl_cuda_alloc_image (cl_device_id device, cl_mem mem,
+                       pocl_mem_identifier *p)
+{
+  CUresult result;
+  size_t region[3];
+  pocl_cuda_image_region (mem, region);
+
+  CUDA_ARRAY3D_DESCRIPTOR desc;
+  memset (&desc, 0, sizeof (desc));
+  desc.Width = region[0];
+  desc.Format = pocl_cuda_array_format (mem->image_channel_data_type);
+  desc.NumChannels = mem->image_channels;
+  desc.Flags = CUDA_ARRAY3D_SURFACE_LDST;
+  switch (mem->type)
+    {
+    case CL_MEM_OBJECT_IMAGE1D_ARRAY:
+      desc.Depth = region[1];
+      desc.Flags |= CUDA_ARRAY3D_LAYERED;
+      break;
+    case CL_MEM_OBJECT_IMAGE2D_ARRAY:
+      desc.Flags |= CUDA_ARRAY3D_LAYERED;
+      /* fallthrough */
+    case CL_MEM_OBJECT_IMAGE3D:
+      desc.Height = region[1];
+      desc.Depth = region[2];
+      break;
+    case CL_MEM_OBJECT_IMAGE2D:
+      desc.Height = region[1];
+      break;
+    default:
+      break;
+    }
+
+  pocl_cuda_image_data_t *img = calloc (1, sizeof (pocl_cuda_image_data_t));
+  if (img == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  p->extra_ptr = img;
+
+  result = cuArray3DCreate (&img->array, &desc);
+  if (CUDA_CHECK_ERROR (result, "cuArray3DCreate"))
+    {
+      pocl_cuda_free_image (p);
+      return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+  CUDA_RESOURCE_DESC res;
+  memset (&res, 0, sizeof (res));
+  res.resType = CU_RESOURCE_TYPE_ARRAY;
+  res.res.array.hArray = img->array;
+  result = cuSurfObjectCreate (&img->surface, &res);
+  CUDA_CHECK (result, "cuSurfObjectCreate");
+
+  int is_integer = (mem->image_channel_data_type >= CL_SIGNED_INT8
+                    && mem->image_channel_data_type <= CL_UNSIGNED_INT32);
+  unsigned i;
+  for (i = 0; i < POCL_CUDA_NUM_TEXTURES; ++i)
+    {
+      int linear = (i >= POCL_CUDA_NUM_TEXTURES / 2);
+      unsigned state = linear ? i - POCL_CUDA_NUM_TEXTURES / 2 : i;
+      if (linear && is_integer)
+        {
+          img->textures[i] = img->textures[state];
+          continue;
+        }
+
+      CUDA_TEXTURE_DESC tex;
+      memset (&tex, 0, sizeof (tex));
+      tex.addressMode[0] = tex.addressMode[1] = tex.addressMode[2]
+          = pocl_cuda_address_mode (state & 0xe);
+      tex.filterMode = linear ? CU_TR_FILTER_MODE_LINEAR
+                              : CU_TR_FILTER_MODE_POINT;
+      if (state & CLK_NORMALIZED_COORDS_TRUE)
+        tex.flags |= CU_TRSF_NORMALIZED_COORDINATES;
+      if (is_integer)
+        tex.flags |= CU_TRSF_READ_AS_INTEGER;
+      result = cuTexObjectCreate (&img->textures[i], &res, &tex, NULL);
+      CUDA_CHECK (result, "cuTexObjectCreate");
+    }
+
+  /* the device copy of the descriptor the kernels get */
+  cuda_image_t di;
+  memset (&di, 0, sizeof (di));
+  di._base._width = mem->image_width;
+  di._base._height = mem->image_height;
+  di._base._depth = mem->image_depth;
+  di._base._row_pitch = mem->image_row_pitch;
+  di._base._slice_pitch = mem->image_slice_pitch;
+  di._base._order = mem->image_channel_order;
+  di._base._image_array_size = mem->image_array_size;
+  di._base._data_type = mem->image_channel_data_type;
+  pocl_get_image_information (mem->image_channel_order,
+                              mem->image_channel_data_type,
+                              &di._base._num_channels, &di._base._elem_size);
+  for (i = 0; i < POCL_CUDA_NUM_TEXTURES; ++i)
+    di._textures[i] = img->textures[i];
+  di._surface = img->surface;
+
+  CUdeviceptr d;
+  result = cuMemAlloc (&d, sizeof (di));
+  if (CUDA_CHECK_ERROR (result, "cuMemAlloc"))
+    {
+      pocl_cuda_free_image (p);
+      return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+  result = cuMemcpyHtoD (d, &di, sizeof (di));
+  CUDA_CHECK (result, "cuMemcpyHtoD");
+  p->mem_ptr = (void *)d;
+
+  return CL_SUCCESS;
+}
+
+static void
+pocl_cuda_free_image (pocl_mem_identifier *p)
+{
+  pocl_cuda_image_data_t *img = (pocl_cuda_image_data_t *)p->extra_ptr;
+  unsigned i;
+  for (i = 0; i < POCL_CUDA_NUM_TEXTURES; ++i)
+    {
+      /* the aliases of the nearest textures */
+      if (img->textures[i] == 0
+          || (i >= POCL_CUDA_NUM_TEXTURES / 2
+              && img->textures[i]
+                     == img->textures[i - POCL_CUDA_NUM_TEXTURES / 2]))
+        continue;
+      cuTexObjectDestroy (img->textures[i]);
+    }
+  if (img->surface)
+    cuSurfObjectDestroy (img->surface);
+  if (img->array)
+    cuArrayDestroy (img->array);
+  if (p->mem_ptr)
+    cuMemFree ((CUdeviceptr)p->mem_ptr);
+  free (img);
+  p->extra_ptr = NULL;
+}
+
 cl_int
 pocl_cuda_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
 {
@@ -573,6 +1140,11 @@ pocl_cuda_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
   p->version = 0;
   cl_mem_flags flags = mem->flags;
 
+  /* the content of the host pointer, if any, is written to the array by
+   * the migration before the first use */
+  if (mem->is_image && !IS_IMAGE1D_BUFFER (mem))
+    return pocl_cuda_alloc_image (device, mem, p);
+
   if (flags & CL_MEM_USE_HOST_PTR)
     {
       if (!((pocl_cuda_device_data_t *)device->data)->supports_cu_mem_host_register)
@@ -606,8 +1178,11 @@ pocl_cuda_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
   /* preallocate host visible memory */
   else if ((flags & CL_MEM_ALLOC_HOST_PTR) && (mem->mem_host_ptr == NULL))
     {
+      /* portable, so that the other CUDA devices of the context get
+       * page-locked transfers from it too */
       result = cuMemHostAlloc (&p->extra_ptr, mem->size,
-                               CU_MEMHOSTREGISTER_DEVICEMAP);
+                               CU_MEMHOSTALLOC_DEVICEMAP
+                                   | CU_MEMHOSTALLOC_PORTABLE);
       CUDA_CHECK (result, "cuMemHostAlloc");
       result = cuMemHostGetDevicePointer ((CUdeviceptr *)&b, p->extra_ptr, 0);
       CUDA_CHECK (result, "cuMemHostGetDevicePointer");
@@ -646,13 +1221,116 @@ pocl_cuda_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
   return err;
 }
 
+/* Enables the access of dest's context to the memory of source, if the
+ * GPUs support it. Returns 1 if the access is enabled. */
+static int
+pocl_cuda_enable_peer_access (pocl_cuda_device_data_t *dest,
+                              pocl_cuda_device_data_t *source)
+{
+  if (dest->device < 0 || dest->device >= POCL_CUDA_MAX_PEERS
+      || source->device < 0 || source->device >= POCL_CUDA_MAX_PEERS)
+    return 0;
+
+  signed char *access = &dest->peer_access[source->device];
+  if (*access == 0)
+    {
+      int can_access = 0;
+      CUresult result
+          = cuDeviceCanAccessPeer (&can_access, dest->device, source->device);
+      if (result == CUDA_SUCCESS && can_access)
+        {
+          cuCtxSetCurrent (dest->context);
+          result = cuCtxEnablePeerAccess (source->context, 0);
+          if (result == CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED)
+            result = CUDA_SUCCESS;
+          CUDA_CHECK_ERROR (result, "cuCtxEnablePeerAccess");
+        }
+      *access = (result == CUDA_SUCCESS && can_access) ? 1 : -1;
+      POCL_MSG_PRINT_CUDA ("Peer access from device %d to device %d: %s\n",
+                           dest->device, source->device,
+                           (*access > 0 ? "enabled" : "unavailable"));
+    }
+  return *access > 0;
+}
+
+int
+pocl_cuda_can_migrate_d2d (cl_device_id dest, cl_device_id source)
+{
+  /* between CUDA devices with peer-to-peer copies, once the destination
+   * has access to the memory of the source */
+  if (dest->ops == source->ops)
+    return pocl_cuda_enable_peer_access (
+               (pocl_cuda_device_data_t *)dest->data,
+               (pocl_cuda_device_data_t *)source->data)
+               ? 2
+               : 0;
+
+  /* a CPU device keeps its buffers in host memory, so they can be copied to
+   * straight from the GPU instead of through mem_host_ptr */
+  if ((dest->type & CL_DEVICE_TYPE_CPU) && dest->global_mem_id == 0)
+    return 1;
+
+  return 0;
+}
+
+/* Called by the CPU device drivers, which don't implement migrate_d2d, for
+ * the migrations from a CUDA device. Those between CUDA devices are
+ * submitted to the streams in pocl_cuda_submit_node. */
+int
+pocl_cuda_migrate_d2d (cl_device_id src_dev, cl_device_id dst_dev,
+                       cl_mem mem, pocl_mem_identifier *src_mem_id,
+                       pocl_mem_identifier *dst_mem_id, size_t offset,
+                       size_t size)
+{
+  pocl_cuda_device_data_t *src_data = (pocl_cuda_device_data_t *)src_dev->data;
+  assert (dst_dev->ops != src_dev->ops);
+
+  cuCtxSetCurrent (src_data->context);
+  if (mem->is_image && !IS_IMAGE1D_BUFFER (mem))
+    {
+      size_t origin[3] = { 0, 0, 0 };
+      size_t region[3];
+      pocl_cuda_image_region (mem, region);
+      /* the tiled images of the CPU devices are written by the driver from
+       * a linear copy */
+      void *ptr = dst_mem_id->extra ? malloc (mem->size) : dst_mem_id->mem_ptr;
+      if (ptr == NULL)
+        return -1;
+      pocl_cuda_submit_image_rect (0, mem, src_mem_id, 0, ptr, 0, origin,
+                                   region, mem->image_row_pitch,
+                                   mem->image_slice_pitch);
+      CUresult result = cuStreamSynchronize (0);
+      CUDA_CHECK (result, "cuStreamSynchronize");
+      if (dst_mem_id->extra)
+        {
+          dst_dev->ops->write_image_rect (dst_dev->data, mem, dst_mem_id, ptr,
+                                          NULL, origin, region,
+                                          mem->image_row_pitch,
+                                          mem->image_slice_pitch, 0);
+          free (ptr);
+        }
+      return 0;
+    }
+  POCL_MSG_PRINT_CUDA ("cuMemcpyDtoH %p -> %p / %zu B \n",
+                       src_mem_id->mem_ptr, dst_mem_id->mem_ptr, size);
+  /* page-locked when the host memory is the CUDA driver's allocation, or is
+   * registered by it (CL_MEM_ALLOC_HOST_PTR / CL_MEM_USE_HOST_PTR) */
+  CUresult result
+      = cuMemcpyDtoH ((char *)dst_mem_id->mem_ptr + offset,
+                      (CUdeviceptr)src_mem_id->mem_ptr + offset, size);
+  CUDA_CHECK (result, "cuMemcpyDtoH");
+  return 0;
+}
+
 void
 pocl_cuda_free (cl_device_id device, cl_mem mem_obj)
 {
   cuCtxSetCurrent (((pocl_cuda_device_data_t *)device->data)->context);
   pocl_mem_identifier *p = &mem_obj->device_ptrs[device->global_mem_id];
 
-  if (mem_obj->flags & CL_MEM_USE_HOST_PTR)
+  if (mem_obj->is_image && !IS_IMAGE1D_BUFFER (mem_obj))
+    pocl_cuda_free_image (p);
+  else if (mem_obj->flags & CL_MEM_USE_HOST_PTR)
     {
 #if defined __arm__
       cuMemFree ((CUdeviceptr)p->mem_ptr);
@@ -679,45 +1357,304 @@ pocl_cuda_free (cl_device_id device, cl_mem mem_obj)
   p->version = 0;
 }
 
+/* Returns 1 if the host memory is page-locked for the CUDA contexts. */
+static int
+pocl_cuda_is_page_locked (const void *host_ptr)
+{
+  unsigned int type = 0;
+  CUresult result = cuPointerGetAttribute (
+      &type, CU_POINTER_ATTRIBUTE_MEMORY_TYPE, (CUdeviceptr)host_ptr);
+  return (result == CUDA_SUCCESS && type == CU_MEMORYTYPE_HOST);
+}
+
+/* Returns 1 if the pointer is to CUDA managed memory. */
+static int
+pocl_cuda_is_managed (const void *ptr)
+{
+  unsigned int managed = 0;
+  CUresult result = cuPointerGetAttribute (
+      &managed, CU_POINTER_ATTRIBUTE_IS_MANAGED, (CUdeviceptr)ptr);
+  return (result == CUDA_SUCCESS && managed);
+}
+
+void *
+pocl_cuda_svm_alloc (cl_device_id dev, cl_svm_mem_flags flags, size_t size)
+{
+  pocl_cuda_device_data_t *data = (pocl_cuda_device_data_t *)dev->data;
+
+  if ((flags & CL_MEM_SVM_ATOMICS)
+      && ((dev->svm_caps & CL_DEVICE_SVM_ATOMICS) == 0))
+    {
+      POCL_MSG_ERR ("This device doesn't support SVM Atomics\n");
+      return NULL;
+    }
+
+  if ((flags & CL_MEM_SVM_FINE_GRAIN_BUFFER)
+      && ((dev->svm_caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) == 0))
+    {
+      POCL_MSG_ERR ("This device doesn't support SVM Fine grained Buffer\n");
+      return NULL;
+    }
+
+  cuCtxSetCurrent (data->context);
+  CUdeviceptr ptr;
+  CUresult result = cuMemAllocManaged (&ptr, size, CU_MEM_ATTACH_GLOBAL);
+  if (CUDA_CHECK_ERROR (result, "cuMemAllocManaged"))
+    return NULL;
+
+#if CUDA_VERSION >= 8000
+  /* The kernels only read a read-only allocation, so its pages can be
+   * duplicated to every processor reading them. The others are kept in the
+   * device memory, and the host's accesses map or migrate them from there,
+   * instead of the pages moving to whichever processor touched them last. */
+  if (data->concurrent_managed_access)
+    {
+      if (flags & CL_MEM_READ_ONLY)
+        result = cuMemAdvise (ptr, size, CU_MEM_ADVISE_SET_READ_MOSTLY,
+                              data->device);
+      else
+        result = cuMemAdvise (ptr, size, CU_MEM_ADVISE_SET_PREFERRED_LOCATION,
+                              data->device);
+      CUDA_CHECK_ERROR (result, "cuMemAdvise");
+    }
+#endif
+
+  return (void *)ptr;
+}
+
 void
-pocl_cuda_submit_read (CUstream stream, void *host_ptr, const void *device_ptr,
-                       size_t offset, size_t cb)
+pocl_cuda_svm_free (cl_device_id dev, void *svm_ptr)
 {
-  POCL_MSG_PRINT_CUDA ("cuMemcpyDtoHAsync %p -> %p / %zu B \n", device_ptr, host_ptr, cb);
-  CUresult result = cuMemcpyDtoHAsync (
-      host_ptr, (CUdeviceptr) (device_ptr + offset), cb, stream);
-  CUDA_CHECK (result, "cuMemcpyDtoHAsync");
+  cuCtxSetCurrent (((pocl_cuda_device_data_t *)dev->data)->context);
+  CUresult result = cuMemFree ((CUdeviceptr)svm_ptr);
+  CUDA_CHECK (result, "cuMemFree");
+}
+
+/* Prefetches the managed memory of the SVM pointers to the host or the
+ * device. Without concurrent managed access, the pages move by themselves
+ * when the kernels are launched and the host touches them, and the pointers
+ * the host has allocated are accessible to the device where they are. */
+static void
+pocl_cuda_submit_svm_migrate (CUstream stream, cl_device_id dev,
+                              _cl_command_svm_migrate *cmd)
+{
+#if CUDA_VERSION >= 8000
+  pocl_cuda_device_data_t *data = (pocl_cuda_device_data_t *)dev->data;
+  if (!data->concurrent_managed_access)
+    return;
+
+  CUdevice dst = (cmd->flags & CL_MIGRATE_MEM_OBJECT_HOST) ? CU_DEVICE_CPU
+                                                           : data->device;
+  unsigned i;
+  for (i = 0; i < cmd->num_svm_pointers; ++i)
+    {
+      CUdeviceptr ptr = (CUdeviceptr)cmd->svm_pointers[i];
+      size_t size = cmd->sizes[i];
+      if (!pocl_cuda_is_managed (cmd->svm_pointers[i]))
+        continue;
+      if (size == 0)
+        {
+          CUdeviceptr base;
+          CUresult result = cuMemGetAddressRange (&base, &size, ptr);
+          CUDA_CHECK (result, "cuMemGetAddressRange");
+          size -= ptr - base;
+        }
+      CUresult result = cuMemPrefetchAsync (ptr, size, dst, stream);
+      CUDA_CHECK (result, "cuMemPrefetchAsync");
+    }
+#endif
+}
+
+/* Takes a staging buffer from the pool of the device, or allocates one if
+ * the pool is empty. Returns NULL if no page-locked memory could be
+ * allocated. */
+static pocl_cuda_staging_t *
+pocl_cuda_get_staging (pocl_cuda_device_data_t *data)
+{
+  pocl_cuda_staging_t *st;
+  POCL_LOCK (data->staging_lock);
+  st = data->staging;
+  if (st)
+    LL_DELETE (data->staging, st);
+  POCL_UNLOCK (data->staging_lock);
+  if (st)
+    return st;
+
+  st = calloc (1, sizeof (pocl_cuda_staging_t));
+  if (st == NULL)
+    return NULL;
+  if (cuMemHostAlloc (&st->ptr, POCL_CUDA_STAGING_SIZE, 0) != CUDA_SUCCESS)
+    {
+      POCL_MEM_FREE (st);
+      return NULL;
+    }
+  CUresult result = cuEventCreate (&st->done, CU_EVENT_DISABLE_TIMING);
+  CUDA_CHECK (result, "cuEventCreate");
+  return st;
+}
+
+static void
+pocl_cuda_put_staging (pocl_cuda_device_data_t *data, pocl_cuda_staging_t *st)
+{
+  POCL_LOCK (data->staging_lock);
+  LL_PREPEND (data->staging, st);
+  POCL_UNLOCK (data->staging_lock);
+}
+
+/* Takes POCL_CUDA_STAGING_SLOTS staging buffers for a pipelined transfer.
+ * Returns 0 if there is not enough page-locked memory for them. */
+static int
+pocl_cuda_get_staging_slots (pocl_cuda_device_data_t *data,
+                             pocl_cuda_staging_t **slots)
+{
+  unsigned i, j;
+  for (i = 0; i < POCL_CUDA_STAGING_SLOTS; ++i)
+    {
+      slots[i] = pocl_cuda_get_staging (data);
+      if (slots[i] == NULL)
+        {
+          for (j = 0; j < i; ++j)
+            pocl_cuda_put_staging (data, slots[j]);
+          POCL_MSG_PRINT_CUDA ("Could not allocate staging buffers\n");
+          return 0;
+        }
+    }
+  return 1;
+}
+
+void
+pocl_cuda_submit_read (pocl_cuda_device_data_t *data, CUstream stream,
+                       void *host_ptr, const void *device_ptr, size_t offset,
+                       size_t cb)
+{
+  pocl_cuda_staging_t *slots[POCL_CUDA_STAGING_SLOTS];
+  CUresult result;
+
+  if (cb <= POCL_CUDA_STAGING_SIZE || pocl_cuda_is_page_locked (host_ptr)
+      || !pocl_cuda_get_staging_slots (data, slots))
+    {
+      POCL_MSG_PRINT_CUDA ("cuMemcpyDtoHAsync %p -> %p / %zu B \n",
+                           device_ptr, host_ptr, cb);
+      result = cuMemcpyDtoHAsync (
+          host_ptr, (CUdeviceptr) (device_ptr + offset), cb, stream);
+      CUDA_CHECK (result, "cuMemcpyDtoHAsync");
+      return;
+    }
+
+  /* A copy to pageable memory returns only once it has completed, both
+   * with cuMemcpyDtoHAsync and here. The chunks are copied out of the
+   * staging buffers while the next ones are being transferred. */
+  POCL_MSG_PRINT_CUDA ("staged cuMemcpyDtoHAsync %p -> %p / %zu B \n",
+                       device_ptr, host_ptr, cb);
+  size_t num_chunks
+      = (cb + POCL_CUDA_STAGING_SIZE - 1) / POCL_CUDA_STAGING_SIZE;
+  size_t i;
+  for (i = 0; i < num_chunks + POCL_CUDA_STAGING_SLOTS; ++i)
+    {
+      pocl_cuda_staging_t *st = slots[i % POCL_CUDA_STAGING_SLOTS];
+      if (i >= POCL_CUDA_STAGING_SLOTS)
+        {
+          size_t done = i - POCL_CUDA_STAGING_SLOTS;
+          size_t done_offset = done * POCL_CUDA_STAGING_SIZE;
+          result = cuEventSynchronize (st->done);
+          CUDA_CHECK (result, "cuEventSynchronize");
+          memcpy ((char *)host_ptr + done_offset, st->ptr,
+                  min (cb - done_offset, POCL_CUDA_STAGING_SIZE));
+        }
+      else
+        {
+          /* a write pipelined through the buffer may still be reading it */
+          result = cuStreamWaitEvent (stream, st->done, 0);
+          CUDA_CHECK (result, "cuStreamWaitEvent");
+        }
+      if (i < num_chunks)
+        {
+          size_t chunk_offset = i * POCL_CUDA_STAGING_SIZE;
+          result = cuMemcpyDtoHAsync (
+              st->ptr, (CUdeviceptr) (device_ptr + offset + chunk_offset),
+              min (cb - chunk_offset, POCL_CUDA_STAGING_SIZE), stream);
+          CUDA_CHECK (result, "cuMemcpyDtoHAsync");
+          result = cuEventRecord (st->done, stream);
+          CUDA_CHECK (result, "cuEventRecord");
+        }
+    }
+
+  for (i = 0; i < POCL_CUDA_STAGING_SLOTS; ++i)
+    pocl_cuda_put_staging (data, slots[i]);
+}
+
+/* Fills size bytes at dst with the pattern of 8 to 128 bytes with the
+ * fill kernel. */
+static CUresult
+pocl_cuda_launch_fill (pocl_cuda_device_data_t *data, CUstream stream,
+                       CUdeviceptr dst, size_t size, const void *pattern,
+                       size_t pattern_size)
+{
+  uint64_t words[16];
+  uint64_t num_words = size / sizeof (uint64_t);
+  size_t i;
+
+  for (i = 0; i < sizeof (words); i += pattern_size)
+    memcpy ((char *)words + i, pattern, pattern_size);
+
+  size_t num_blocks
+      = (num_words + POCL_CUDA_FILL_BLOCK - 1) / POCL_CUDA_FILL_BLOCK;
+  if (num_blocks == 0)
+    return CUDA_SUCCESS;
+  if (num_blocks > POCL_CUDA_FILL_MAX_BLOCKS)
+    num_blocks = POCL_CUDA_FILL_MAX_BLOCKS;
+
+  void *params[] = { &dst, &num_words, words };
+  return cuLaunchKernel (data->fill_kernel, num_blocks, 1, 1,
+                         POCL_CUDA_FILL_BLOCK, 1, 1, 0, stream, params, NULL);
 }
 
 void
-pocl_cuda_submit_memfill (CUstream stream, void *mem_ptr, size_t size_in_bytes,
-                          size_t offset, const void *pattern,
-                          size_t pattern_size)
+pocl_cuda_submit_memfill (pocl_cuda_device_data_t *data, CUstream stream,
+                          void *mem_ptr, size_t size_in_bytes, size_t offset,
+                          const void *pattern, size_t pattern_size)
 {
+  CUdeviceptr dst = (CUdeviceptr) (((char *)mem_ptr) + offset);
   CUresult result;
+  size_t i;
   switch (pattern_size)
     {
     case 1:
-      result
-          = cuMemsetD8Async ((CUdeviceptr) (((char *)mem_ptr) + offset),
-                             *(unsigned char *)pattern, size_in_bytes, stream);
+      result = cuMemsetD8Async (dst, *(unsigned char *)pattern, size_in_bytes,
+                                stream);
       break;
     case 2:
-      result = cuMemsetD16Async ((CUdeviceptr) (((char *)mem_ptr) + offset),
-                                 *(unsigned short *)pattern, size_in_bytes / 2,
-                                 stream);
+      result = cuMemsetD16Async (dst, *(unsigned short *)pattern,
+                                 size_in_bytes / 2, stream);
       break;
     case 4:
-      result = cuMemsetD32Async ((CUdeviceptr) (((char *)mem_ptr) + offset),
-                                 *(unsigned int *)pattern, size_in_bytes / 4,
-                                 stream);
+      result = cuMemsetD32Async (dst, *(unsigned int *)pattern,
+                                 size_in_bytes / 4, stream);
       break;
     case 8:
     case 16:
     case 32:
     case 64:
     case 128:
-      POCL_ABORT_UNIMPLEMENTED ("fill_kernel with pattern_size >=8");
+      if (data->fill_kernel != NULL)
+        {
+          result = pocl_cuda_launch_fill (data, stream, dst, size_in_bytes,
+                                          pattern, pattern_size);
+          CUDA_CHECK (result, "cuLaunchKernel");
+          return;
+        }
+      /* a memset of a column of 32-bit words a pattern apart for each
+       * word of the pattern */
+      for (i = 0; i < pattern_size; i += 4)
+        {
+          unsigned int word;
+          memcpy (&word, (const char *)pattern + i, sizeof (word));
+          result = cuMemsetD2D32Async (dst + i, pattern_size, word, 1,
+                                       size_in_bytes / pattern_size, stream);
+          if (result != CUDA_SUCCESS)
+            break;
+        }
+      break;
     default:
       POCL_ABORT ("unrecognized pattern_size");
     }
@@ -725,22 +1662,89 @@ pocl_cuda_submit_memfill (CUstream stream, void *mem_ptr, size_t size_in_bytes,
 }
 
 void
-pocl_cuda_submit_write (CUstream stream, const void *host_ptr,
-                        void *device_ptr, size_t offset, size_t cb)
+pocl_cuda_submit_write (pocl_cuda_device_data_t *data, CUstream stream,
+                        const void *host_ptr, void *device_ptr, size_t offset,
+                        size_t cb)
 {
-  POCL_MSG_PRINT_CUDA ("cuMemcpyHtoDAsync %p -> %p / %zu B \n", host_ptr, device_ptr, cb);
-  CUresult result = cuMemcpyHtoDAsync ((CUdeviceptr) (device_ptr + offset),
-                                       host_ptr, cb, stream);
-  CUDA_CHECK (result, "cuMemcpyHtoDAsync");
-}
+  pocl_cuda_staging_t *slots[POCL_CUDA_STAGING_SLOTS];
+  CUresult result;
 
-void
-pocl_cuda_submit_copy (CUstream stream, void*__restrict__ src_mem_ptr,
-                       size_t src_offset,  void *__restrict__ dst_mem_ptr,
-                       size_t dst_offset, size_t cb)
-{
-  void *src_ptr = src_mem_ptr + src_offset;
-  void *dst_ptr = dst_mem_ptr + dst_offset;
+  if (cb <= POCL_CUDA_STAGING_SIZE || pocl_cuda_is_page_locked (host_ptr)
+      || !pocl_cuda_get_staging_slots (data, slots))
+    {
+      POCL_MSG_PRINT_CUDA ("cuMemcpyHtoDAsync %p -> %p / %zu B \n",
+                           host_ptr, device_ptr, cb);
+      result = cuMemcpyHtoDAsync ((CUdeviceptr) (device_ptr + offset),
+                                  host_ptr, cb, stream);
+      CUDA_CHECK (result, "cuMemcpyHtoDAsync");
+      return;
+    }
+
+  /* Each chunk is copied to a staging buffer once the previous transfer
+   * from it has completed, so the copies overlap with the transfers of
+   * the previous chunks. The last transfers may still be in flight when
+   * the buffers go back to the pool; their events guard the reuse. */
+  POCL_MSG_PRINT_CUDA ("staged cuMemcpyHtoDAsync %p -> %p / %zu B \n",
+                       host_ptr, device_ptr, cb);
+  size_t chunk_offset;
+  size_t i = 0;
+  for (chunk_offset = 0; chunk_offset < cb;
+       chunk_offset += POCL_CUDA_STAGING_SIZE, ++i)
+    {
+      pocl_cuda_staging_t *st = slots[i % POCL_CUDA_STAGING_SLOTS];
+      size_t chunk = min (cb - chunk_offset, POCL_CUDA_STAGING_SIZE);
+      result = cuEventSynchronize (st->done);
+      CUDA_CHECK (result, "cuEventSynchronize");
+      memcpy (st->ptr, (const char *)host_ptr + chunk_offset, chunk);
+      result = cuMemcpyHtoDAsync (
+          (CUdeviceptr) (device_ptr + offset + chunk_offset), st->ptr, chunk,
+          stream);
+      CUDA_CHECK (result, "cuMemcpyHtoDAsync");
+      result = cuEventRecord (st->done, stream);
+      CUDA_CHECK (result, "cuEventRecord");
+    }
+
+  for (i = 0; i < POCL_CUDA_STAGING_SLOTS; ++i)
+    pocl_cuda_put_staging (data, slots[i]);
+}
+
+/* cl_pocl_content_size: the size of a migration or a copy of a buffer
+ * with a content size depends on the commands before it, so they have to
+ * finish before it is submitted. */
+static size_t
+pocl_cuda_migration_size (CUstream stream, _cl_command_migrate *migrate)
+{
+  if (migrate->content_size == NULL)
+    return migrate->size;
+
+  CUresult result = cuStreamSynchronize (stream);
+  CUDA_CHECK (result, "cuStreamSynchronize");
+  return pocl_migration_content_size (migrate);
+}
+
+static size_t
+pocl_cuda_copy_size (CUstream stream, _cl_command_copy *copy)
+{
+  uint64_t content_size;
+  if (copy->src_content_size == NULL)
+    return copy->size;
+
+  CUresult result = cuStreamSynchronize (stream);
+  CUDA_CHECK (result, "cuStreamSynchronize");
+  result = cuMemcpyDtoH (&content_size,
+                         (CUdeviceptr)copy->src_content_size_mem_id->mem_ptr,
+                         sizeof (content_size));
+  CUDA_CHECK (result, "cuMemcpyDtoH");
+  return pocl_content_size_clamp (content_size, copy->src_offset, copy->size);
+}
+
+void
+pocl_cuda_submit_copy (CUstream stream, void*__restrict__ src_mem_ptr,
+                       size_t src_offset,  void *__restrict__ dst_mem_ptr,
+                       size_t dst_offset, size_t cb)
+{
+  void *src_ptr = src_mem_ptr + src_offset;
+  void *dst_ptr = dst_mem_ptr + dst_offset;
 
   if (src_ptr == dst_ptr)
     return;
@@ -752,6 +1756,70 @@ pocl_cuda_submit_copy (CUstream stream, void*__restrict__ src_mem_ptr,
   CUDA_CHECK (result, "cuMemcpyDtoDAsync");
 }
 
+/* Submits the rectangular copy between buffers, or a buffer and host
+ * memory, with the simplest copy that does it. The slices that follow each
+ * other without a gap on both sides are rows of one 2D copy, and the rows
+ * that do so one linear copy, which run faster than the 3D copies. */
+static void
+pocl_cuda_submit_buffer_rect (CUstream stream, const CUDA_MEMCPY3D *params)
+{
+  CUresult result;
+
+  if (params->Depth > 1
+      && (params->srcHeight != params->Height
+          || params->dstHeight != params->Height))
+    {
+      result = cuMemcpy3DAsync (params, stream);
+      CUDA_CHECK (result, "cuMemcpy3DAsync");
+      return;
+    }
+
+  size_t src_y = params->srcZ * params->srcHeight + params->srcY;
+  size_t dst_y = params->dstZ * params->dstHeight + params->dstY;
+  size_t height = params->Height * params->Depth;
+
+  if (height == 1
+      || (params->srcPitch == params->WidthInBytes
+          && params->dstPitch == params->WidthInBytes))
+    {
+      size_t size = params->WidthInBytes * height;
+      size_t src_offset = src_y * params->srcPitch + params->srcXInBytes;
+      size_t dst_offset = dst_y * params->dstPitch + params->dstXInBytes;
+      if (params->srcMemoryType == CU_MEMORYTYPE_HOST)
+        result = cuMemcpyHtoDAsync (params->dstDevice + dst_offset,
+                                    (const char *)params->srcHost + src_offset,
+                                    size, stream);
+      else if (params->dstMemoryType == CU_MEMORYTYPE_HOST)
+        result = cuMemcpyDtoHAsync ((char *)params->dstHost + dst_offset,
+                                    params->srcDevice + src_offset, size,
+                                    stream);
+      else
+        result = cuMemcpyDtoDAsync (params->dstDevice + dst_offset,
+                                    params->srcDevice + src_offset, size,
+                                    stream);
+      CUDA_CHECK (result, "cuMemcpy*Async");
+      return;
+    }
+
+  CUDA_MEMCPY2D params2d = { 0 };
+  params2d.srcXInBytes = params->srcXInBytes;
+  params2d.srcY = src_y;
+  params2d.srcMemoryType = params->srcMemoryType;
+  params2d.srcHost = params->srcHost;
+  params2d.srcDevice = params->srcDevice;
+  params2d.srcPitch = params->srcPitch;
+  params2d.dstXInBytes = params->dstXInBytes;
+  params2d.dstY = dst_y;
+  params2d.dstMemoryType = params->dstMemoryType;
+  params2d.dstHost = params->dstHost;
+  params2d.dstDevice = params->dstDevice;
+  params2d.dstPitch = params->dstPitch;
+  params2d.WidthInBytes = params->WidthInBytes;
+  params2d.Height = height;
+  result = cuMemcpy2DAsync (&params2d, stream);
+  CUDA_CHECK (result, "cuMemcpy2DAsync");
+}
+
 void
 pocl_cuda_submit_read_rect (CUstream stream, void *__restrict__ const host_ptr,
                             void *__restrict__ const device_ptr,
@@ -787,8 +1855,7 @@ pocl_cuda_submit_read_rect (CUstream stream, void *__restrict__ const host_ptr,
   params.srcPitch = buffer_row_pitch;
   params.srcHeight = buffer_slice_pitch / buffer_row_pitch;
 
-  CUresult result = cuMemcpy3DAsync (&params, stream);
-  CUDA_CHECK (result, "cuMemcpy3DAsync");
+  pocl_cuda_submit_buffer_rect (stream, &params);
 }
 
 void
@@ -827,8 +1894,7 @@ pocl_cuda_submit_write_rect (CUstream stream,
   params.dstPitch = buffer_row_pitch;
   params.dstHeight = buffer_slice_pitch / buffer_row_pitch;
 
-  CUresult result = cuMemcpy3DAsync (&params, stream);
-  CUDA_CHECK (result, "cuMemcpy3DAsync");
+  pocl_cuda_submit_buffer_rect (stream, &params);
 }
 
 void
@@ -868,8 +1934,7 @@ pocl_cuda_submit_copy_rect (CUstream stream,
 
   params.srcMemoryType = params.dstMemoryType = CU_MEMORYTYPE_DEVICE;
 
-  CUresult result = cuMemcpy3DAsync (&params, stream);
-  CUDA_CHECK (result, "cuMemcpy3DAsync");
+  pocl_cuda_submit_buffer_rect (stream, &params);
 }
 
 void
@@ -910,33 +1975,301 @@ pocl_cuda_submit_unmap_mem (CUstream stream, pocl_mem_identifier *dst_mem_id,
   return NULL;
 }
 
+/* Submits the copy of the region of the image at origin between its CUDA
+ * array and the linear memory at host_ptr, or at device_ptr if host_ptr is
+ * NULL: to the array if to_image is set. The pitches of the linear memory
+ * are those of the image commands, zero for a tightly packed region; the
+ * layers of a 1D array are its rows. */
+static void
+pocl_cuda_submit_image_rect (CUstream stream, cl_mem image,
+                             pocl_mem_identifier *mem_id, int to_image,
+                             void *host_ptr, CUdeviceptr device_ptr,
+                             const size_t *origin, const size_t *region,
+                             size_t row_pitch, size_t slice_pitch)
+{
+  pocl_cuda_image_data_t *img = (pocl_cuda_image_data_t *)mem_id->extra_ptr;
+  CUDA_MEMCPY3D params = { 0 };
+  size_t px = image->image_elem_size * image->image_channels;
+  size_t o[3] = { origin[0], origin[1], origin[2] };
+  size_t r[3] = { region[0], region[1], region[2] };
+
+  if (row_pitch == 0)
+    row_pitch = px * region[0];
+  if (slice_pitch == 0)
+    slice_pitch = row_pitch * region[1];
+  if (image->type == CL_MEM_OBJECT_IMAGE1D_ARRAY)
+    slice_pitch = row_pitch;
+  pocl_cuda_array_coords (image, o, r);
+
+  POCL_MSG_PRINT_CUDA ("cuMemcpy3D / %s_IMAGE %p %p \n",
+                       (to_image ? "WRITE" : "READ"), img->array,
+                       (host_ptr ? host_ptr : (void *)device_ptr));
+
+  params.WidthInBytes = r[0] * px;
+  params.Height = r[1];
+  params.Depth = r[2];
+
+  CUmemorytype linear_type
+      = host_ptr ? CU_MEMORYTYPE_HOST : CU_MEMORYTYPE_DEVICE;
+  if (to_image)
+    {
+      params.srcMemoryType = linear_type;
+      params.srcHost = host_ptr;
+      params.srcDevice = device_ptr;
+      params.srcPitch = row_pitch;
+      params.srcHeight = slice_pitch / row_pitch;
+
+      params.dstMemoryType = CU_MEMORYTYPE_ARRAY;
+      params.dstArray = img->array;
+      params.dstXInBytes = o[0] * px;
+      params.dstY = o[1];
+      params.dstZ = o[2];
+    }
+  else
+    {
+      params.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+      params.srcArray = img->array;
+      params.srcXInBytes = o[0] * px;
+      params.srcY = o[1];
+      params.srcZ = o[2];
+
+      params.dstMemoryType = linear_type;
+      params.dstHost = host_ptr;
+      params.dstDevice = device_ptr;
+      params.dstPitch = row_pitch;
+      params.dstHeight = slice_pitch / row_pitch;
+    }
+
+  CUresult result = cuMemcpy3DAsync (&params, stream);
+  CUDA_CHECK (result, "cuMemcpy3DAsync");
+}
+
+/* Submits the copy of a region between the CUDA arrays of two images, of
+ * the same device, or of peer devices if the contexts differ. */
+static void
+pocl_cuda_submit_copy_image_rect (CUstream stream, cl_mem src_image,
+                                  pocl_mem_identifier *src_mem_id,
+                                  CUcontext src_context, cl_mem dst_image,
+                                  pocl_mem_identifier *dst_mem_id,
+                                  CUcontext dst_context,
+                                  const size_t *src_origin,
+                                  const size_t *dst_origin,
+                                  const size_t *region)
+{
+  pocl_cuda_image_data_t *src
+      = (pocl_cuda_image_data_t *)src_mem_id->extra_ptr;
+  pocl_cuda_image_data_t *dst
+      = (pocl_cuda_image_data_t *)dst_mem_id->extra_ptr;
+  size_t px = src_image->image_elem_size * src_image->image_channels;
+  size_t so[3] = { src_origin[0], src_origin[1], src_origin[2] };
+  size_t dso[3] = { dst_origin[0], dst_origin[1], dst_origin[2] };
+  size_t r[3] = { region[0], region[1], region[2] };
+  size_t dr[3] = { region[0], region[1], region[2] };
+  pocl_cuda_array_coords (src_image, so, r);
+  pocl_cuda_array_coords (dst_image, dso, dr);
+
+  /* the layers of a 1D array copied to the rows of a 2D image, or the
+   * other way, are copied one at a time */
+  size_t rows = 1;
+  if (r[1] != dr[1])
+    {
+      rows = region[1];
+      r[1] = r[2] = 1;
+    }
+
+  POCL_MSG_PRINT_CUDA ("cuMemcpy3D / COPY_IMAGE %p -> %p \n", src->array,
+                       dst->array);
+
+  size_t j;
+  for (j = 0; j < rows; ++j)
+    {
+      CUDA_MEMCPY3D_PEER params = { 0 };
+      params.WidthInBytes = r[0] * px;
+      params.Height = r[1];
+      params.Depth = r[2];
+
+      params.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+      params.srcArray = src->array;
+      params.srcContext = src_context;
+      params.srcXInBytes = so[0] * px;
+      params.srcY = so[1] + (src_image->type != CL_MEM_OBJECT_IMAGE1D_ARRAY
+                                 ? j : 0);
+      params.srcZ = so[2] + (src_image->type == CL_MEM_OBJECT_IMAGE1D_ARRAY
+                                 ? j : 0);
+
+      params.dstMemoryType = CU_MEMORYTYPE_ARRAY;
+      params.dstArray = dst->array;
+      params.dstContext = dst_context;
+      params.dstXInBytes = dso[0] * px;
+      params.dstY = dso[1] + (dst_image->type != CL_MEM_OBJECT_IMAGE1D_ARRAY
+                                  ? j : 0);
+      params.dstZ = dso[2] + (dst_image->type == CL_MEM_OBJECT_IMAGE1D_ARRAY
+                                  ? j : 0);
+
+      CUresult result = cuMemcpy3DPeerAsync (&params, stream);
+      CUDA_CHECK (result, "cuMemcpy3DPeerAsync");
+    }
+}
+
+#if CUDA_VERSION >= 10000
+static void CUDA_CB
+pocl_cuda_free_host_data (void *data)
+{
+  free (data);
+}
+#else
+static void CUDA_CB
+pocl_cuda_free_host_data (CUstream stream, CUresult status, void *data)
+{
+  free (data);
+}
+#endif
+
+/* Fills the region of the image with the pixel. The pixels are written to
+ * a host copy of the region, which is freed after the copy has run. */
+static void
+pocl_cuda_submit_fill_image (CUstream stream, cl_mem image,
+                             pocl_mem_identifier *mem_id,
+                             const size_t *origin, const size_t *region,
+                             pixel_t fill_pixel, size_t pixel_size)
+{
+  size_t num_pixels = region[0] * region[1] * region[2];
+  char *pixels = malloc (num_pixels * pixel_size);
+  size_t i;
+  if (pixels == NULL)
+    POCL_ABORT ("[CUDA] Out of host memory for filling an image\n");
+  for (i = 0; i < num_pixels; ++i)
+    memcpy (pixels + i * pixel_size, fill_pixel, pixel_size);
+
+  pocl_cuda_submit_image_rect (stream, image, mem_id, 1, pixels, 0, origin,
+                               region, 0, 0);
+#if CUDA_VERSION >= 10000
+  CUresult result = cuLaunchHostFunc (stream, pocl_cuda_free_host_data, pixels);
+  CUDA_CHECK (result, "cuLaunchHostFunc");
+#else
+  CUresult result
+      = cuStreamAddCallback (stream, pocl_cuda_free_host_data, pixels, 0);
+  CUDA_CHECK (result, "cuStreamAddCallback");
+#endif
+}
+
+static pocl_cuda_kernel_variant_t *
+find_kernel_variant (pocl_cuda_kernel_data_t *kdata, const size_t *local_size,
+                     int has_offsets, int specialized, int smallgrid)
+{
+  pocl_cuda_kernel_variant_t *v;
+  for (v = kdata->variants; v != NULL; v = v->next)
+    if (v->has_offsets == has_offsets && v->specialized == specialized
+        && v->smallgrid == smallgrid && v->local_size[0] == local_size[0]
+        && v->local_size[1] == local_size[1]
+        && v->local_size[2] == local_size[2])
+      return v;
+  return NULL;
+}
+
+/* Returns the pocl_ptx_gen math options for the build options of the
+ * program. -cl-fast-relaxed-math also flushes the denormals, like
+ * nvcc --use_fast_math does. */
+static int
+cuda_math_flags (cl_program program)
+{
+  const char *options = program->compiler_options;
+  int flags = program->flush_denorms ? POCL_PTX_GEN_FTZ : 0;
+  if (options == NULL)
+    return flags;
+  if (strstr (options, "-cl-fast-relaxed-math") != NULL)
+    flags |= POCL_PTX_GEN_FTZ | POCL_PTX_GEN_FAST_MATH;
+  if (strstr (options, "-cl-unsafe-math-optimizations") != NULL)
+    flags |= POCL_PTX_GEN_FAST_MATH;
+  return flags;
+}
+
+/* Returns the kernel data of the program's kernel, creating it on the first
+ * use. Called with the compile lock held. */
 static pocl_cuda_kernel_data_t *
-load_or_generate_kernel (cl_kernel kernel, cl_device_id device,
-                         int has_offsets, unsigned device_i,
-                         _cl_command_node *command, int specialized)
+get_kernel_data (cl_kernel kernel, unsigned device_i)
 {
-  CUresult result;
   pocl_kernel_metadata_t *meta = kernel->meta;
-  /* Check if we already have a compiled kernel function */
   pocl_cuda_kernel_data_t *kdata
       = (pocl_cuda_kernel_data_t *)meta->data[device_i];
-  if (kdata)
-    {
-      if ((has_offsets && kdata->kernel_offsets)
-          || (!has_offsets && kdata->kernel))
-        return kdata;
-    }
-  else
+  if (kdata == NULL)
     {
       /* TODO: when can we release this? */
       kdata = meta->data[device_i]
           = (void *)calloc (1, sizeof (pocl_cuda_kernel_data_t));
     }
+  return kdata;
+}
+
+/* Adds a variant that is not compiled yet to the kernel data, the caller
+ * compiles it. Called with the compile lock held. */
+static pocl_cuda_kernel_variant_t *
+add_kernel_variant (pocl_cuda_kernel_data_t *kdata, const size_t *local_size,
+                    int has_offsets, int specialized, int smallgrid)
+{
+  pocl_cuda_kernel_variant_t *variant
+      = calloc (1, sizeof (pocl_cuda_kernel_variant_t));
+  memcpy (variant->local_size, local_size, sizeof (variant->local_size));
+  variant->has_offsets = has_offsets;
+  variant->specialized = specialized;
+  variant->smallgrid = smallgrid;
+  variant->next = kdata->variants;
+  kdata->variants = variant;
+  return variant;
+}
+
+/* The local size and the grid specialization of the variant for the
+ * command. */
+static void
+kernel_variant_key (cl_device_id device, _cl_command_node *command,
+                    int specialized, size_t *local_size, int *smallgrid)
+{
+  _cl_command_run *run_cmd = &command->command.run;
+  memset (local_size, 0, 3 * sizeof (size_t));
+  *smallgrid = 0;
+  if (specialized)
+    {
+      memcpy (local_size, run_cmd->pc.local_size, 3 * sizeof (size_t));
+      *smallgrid = !run_cmd->force_large_grid_wg_func
+                   && pocl_cmd_max_grid_dim_width (run_cmd)
+                          < device->grid_width_specialization_limit;
+    }
+}
 
+/* Compiles a variant added by add_kernel_variant and marks it ready. The
+ * compile lock is not held, so the variants of different kernels compile
+ * concurrently. */
+static void
+compile_kernel_variant (cl_kernel kernel, cl_device_id device,
+                        unsigned device_i, _cl_command_node *command,
+                        pocl_cuda_kernel_data_t *kdata,
+                        pocl_cuda_kernel_variant_t *variant)
+{
+  CUresult result;
+  pocl_kernel_metadata_t *meta = kernel->meta;
   pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+  int has_offsets = variant->has_offsets;
+  int specialized = variant->specialized;
+
   cuCtxSetCurrent (ddata->context);
 
-  POCL_LOCK(ddata->compile_lock);
+  char bc_filename[POCL_FILENAME_LENGTH];
+  pocl_cache_work_group_function_path (bc_filename, kernel->program, device_i,
+                                       kernel, command, specialized);
+
+  char ptx_filename[POCL_FILENAME_LENGTH];
+  strcpy (ptx_filename, bc_filename);
+  strncat (ptx_filename, ".ptx", POCL_FILENAME_LENGTH - 1);
+
+  char cubin_filename[POCL_FILENAME_LENGTH];
+  strcpy (cubin_filename, bc_filename);
+  strncat (cubin_filename, ".cubin", POCL_FILENAME_LENGTH - 1);
+
+  /* Other processes missing the same variant wait for this one to write
+   * the CUBIN instead of generating it too. */
+  int kernel_lock = -1;
+  if (!pocl_exists (cubin_filename))
+    kernel_lock = pocl_cache_lock (POCL_CACHE_LOCK_KERNEL, cubin_filename);
 
   /* Generate the parallel bitcode file linked with the kernel library */
   int error = pocl_llvm_generate_workgroup_function (device_i, device, kernel,
@@ -948,105 +2281,453 @@ load_or_generate_kernel (cl_kernel kernel, cl_device_id device,
       assert (error == 0);
     }
 
-  char bc_filename[POCL_FILENAME_LENGTH];
-  pocl_cache_work_group_function_path (bc_filename, kernel->program, device_i,
-                                       kernel, command, specialized);
-
-  char ptx_filename[POCL_FILENAME_LENGTH];
-  strcpy (ptx_filename, bc_filename);
-  strncat (ptx_filename, ".ptx", POCL_FILENAME_LENGTH - 1);
-
   if (!pocl_exists (ptx_filename))
     {
       /* Generate PTX from LLVM bitcode */
       if (pocl_ptx_gen (bc_filename, ptx_filename, kernel->name,
                         device->llvm_cpu,
                         ((pocl_cuda_device_data_t *)device->data)->libdevice,
-                        has_offsets))
+                        has_offsets, specialized ? variant->local_size : NULL,
+                        cuda_math_flags (kernel->program)))
         POCL_ABORT ("pocl-cuda: failed to generate PTX\n");
     }
 
-  /* Load PTX module */
+  /* Load the CUBIN, compiling the PTX to it for the device first if it's
+   * not in the kernel cache yet. The CUBIN is next to the PTX in the
+   * program's cache directory, so it's also stored in the poclbinary, and
+   * the later runs load native code without JIT compiling the PTX. */
   /* TODO: When can we unload the module? */
   CUmodule module;
 
-  if (!(pocl_debug_messages_filter & POCL_DEBUG_FLAG_CUDA))
+  if (pocl_exists (cubin_filename))
     {
-      result = cuModuleLoad (&module, ptx_filename);
+      result = cuModuleLoad (&module, cubin_filename);
       CUDA_CHECK (result, "cuModuleLoad");
     }
   else
     {
-      struct stat st;
-      stat (ptx_filename, &st);
-
-      const int fd = open (ptx_filename, O_RDONLY);
-      assert (fd != -1);
-
-      char *buffer = (char *)malloc (st.st_size + 1);
-      const ssize_t r = read (fd, buffer, st.st_size);
-      assert (r == st.st_size);
-
-      buffer[r] = '\0';
-      close (fd);
-
       unsigned int log_size = 1 << 12;
-      char *log = (char *)malloc (log_size);
+      char *error_log = (char *)calloc (log_size, 1);
+      char *info_log = (char *)calloc (log_size, 1);
+      int verbose = (pocl_debug_messages_filter & POCL_DEBUG_FLAG_CUDA) != 0;
 
       CUjit_option opt[]
-          = { CU_JIT_ERROR_LOG_BUFFER, CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES };
-      void *val[] = { log, (void *)log_size };
-      result = cuModuleLoadDataEx (&module, buffer,
-                                   sizeof (opt) / sizeof (opt[0]), opt, val);
-
-      unsigned int out_size = (unsigned int)val[1];
-
-      if (out_size > 0 || result != CUDA_SUCCESS)
-        POCL_MSG_PRINT_CUDA ("cuModuleLoadDataEx(%s) log: %s\n", ptx_filename,
-                             log);
-
-      CUDA_CHECK (result, "cuModuleLoadDataEx");
-
-      free (log);
-      free (buffer);
+          = { CU_JIT_ERROR_LOG_BUFFER, CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES,
+              CU_JIT_INFO_LOG_BUFFER, CU_JIT_INFO_LOG_BUFFER_SIZE_BYTES,
+              CU_JIT_LOG_VERBOSE };
+      void *val[]
+          = { error_log, (void *)(uintptr_t)log_size, info_log,
+              (void *)(uintptr_t)log_size, (void *)(uintptr_t)verbose };
+      CUlinkState link_state;
+      void *cubin;
+      size_t cubin_size;
+
+      result = cuLinkCreate (sizeof (opt) / sizeof (opt[0]), opt, val,
+                             &link_state);
+      CUDA_CHECK (result, "cuLinkCreate");
+      result = cuLinkAddFile (link_state, CU_JIT_INPUT_PTX, ptx_filename, 0,
+                              NULL, NULL);
+      if (result == CUDA_SUCCESS)
+        result = cuLinkComplete (link_state, &cubin, &cubin_size);
+
+      if (verbose || result != CUDA_SUCCESS)
+        POCL_MSG_PRINT_CUDA ("PTX to CUBIN (%s) log: %s%s\n", ptx_filename,
+                             info_log, error_log);
+      CUDA_CHECK (result, "cuLinkComplete");
+
+      if (pocl_write_file (cubin_filename, (const char *)cubin, cubin_size, 0,
+                           1))
+        POCL_MSG_WARN ("pocl-cuda: failed to write %s\n", cubin_filename);
+      result = cuModuleLoadData (&module, cubin);
+      CUDA_CHECK (result, "cuModuleLoadData");
+
+      cuLinkDestroy (link_state);
+      free (error_log);
+      free (info_log);
     }
+  pocl_cache_unlock (kernel_lock);
 
   /* Get kernel function */
   CUfunction function;
   result = cuModuleGetFunction (&function, module, kernel->name);
   CUDA_CHECK (result, "cuModuleGetFunction");
 
-  /* Get pointer aligment */
+  /* Get pointer aligment and parameter layout */
+  POCL_LOCK (ddata->compile_lock);
   if (!kdata->alignments)
     {
       kdata->alignments
           = calloc (meta->num_args + meta->num_locals + 4, sizeof (size_t));
-      pocl_cuda_get_ptr_arg_alignment (bc_filename, kernel->name,
-                                       kdata->alignments);
+      kdata->param_offsets
+          = calloc (meta->num_args + meta->num_locals + 4, sizeof (size_t));
+      pocl_cuda_get_arg_layout (bc_filename, kernel->name, kdata->alignments,
+                                kdata->param_offsets, &kdata->num_params,
+                                &kdata->param_size);
+      assert (kdata->num_params >= meta->num_args);
+      assert (kdata->num_params <= meta->num_args + meta->num_locals + 3);
+      if (kdata->param_size > POCL_CUDA_MAX_PARAM_SIZE)
+        POCL_ABORT ("[CUDA] Kernel parameters of %s take %zu bytes, more "
+                    "than the %u supported\n",
+                    kernel->name, kdata->param_size,
+                    POCL_CUDA_MAX_PARAM_SIZE);
     }
 
-  if (has_offsets)
+  variant->module = module;
+  variant->kernel = function;
+  /* Get handle to constant memory buffer */
+  cuModuleGetGlobal (&variant->constant_mem_base, &variant->constant_mem_size,
+                     module, "_constant_memory_region_");
+  variant->ready = 1;
+  POCL_BROADCAST_COND (ddata->compile_cond);
+  POCL_UNLOCK (ddata->compile_lock);
+}
+
+/* Returns the kernel compiled for the command, generating it on the first
+ * use. When specialized, the local size of the command is compiled in, so
+ * a kernel launched with several local sizes gets one variant for each.
+ * If another thread is compiling the variant, waits for it. */
+static pocl_cuda_kernel_variant_t *
+load_or_generate_kernel (cl_kernel kernel, cl_device_id device,
+                         int has_offsets, unsigned device_i,
+                         _cl_command_node *command, int specialized,
+                         pocl_cuda_kernel_data_t **kdata_out)
+{
+  pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+  size_t local_size[3];
+  int smallgrid;
+  kernel_variant_key (device, command, specialized, local_size, &smallgrid);
+
+  POCL_LOCK (ddata->compile_lock);
+  pocl_cuda_kernel_data_t *kdata = get_kernel_data (kernel, device_i);
+  *kdata_out = kdata;
+
+  pocl_cuda_kernel_variant_t *variant = find_kernel_variant (
+      kdata, local_size, has_offsets, specialized, smallgrid);
+  if (variant == NULL)
     {
-      kdata->module_offsets = module;
-      kdata->kernel_offsets = function;
+      variant = add_kernel_variant (kdata, local_size, has_offsets,
+                                    specialized, smallgrid);
+      POCL_UNLOCK (ddata->compile_lock);
+      compile_kernel_variant (kernel, device, device_i, command, kdata,
+                              variant);
+      return variant;
     }
-  else
+
+  while (!variant->ready)
+    POCL_WAIT_COND (ddata->compile_cond, ddata->compile_lock);
+  POCL_UNLOCK (ddata->compile_lock);
+
+  return variant;
+}
+
+/* Queues the variant to be compiled by the background compile threads.
+ * Called with the compile lock held. */
+static void
+queue_kernel_variant (pocl_cuda_device_data_t *ddata, cl_kernel kernel,
+                      _cl_command_node *command,
+                      pocl_cuda_kernel_data_t *kdata,
+                      pocl_cuda_kernel_variant_t *variant)
+{
+  pocl_cuda_compile_job_t *job = calloc (1, sizeof (pocl_cuda_compile_job_t));
+  memcpy (&job->cmd, command, sizeof (_cl_command_node));
+  job->cmd.command.run.kernel = kernel;
+  job->cmd.command.run.arguments = NULL;
+  job->cmd.command.run.args_snapshot = NULL;
+  job->cmd.event = NULL;
+  job->cmd.next = job->cmd.prev = NULL;
+  job->kdata = kdata;
+  job->variant = variant;
+  POname (clRetainKernel) (kernel);
+  LL_APPEND (ddata->compile_jobs, job);
+  POCL_SIGNAL_COND (ddata->compile_jobs_cond);
+}
+
+void *
+pocl_cuda_compile_thread (void *data)
+{
+  cl_device_id device = (cl_device_id)data;
+  pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+
+  POCL_LOCK (ddata->compile_lock);
+  while (1)
+    {
+      while (ddata->compile_jobs == NULL && !ddata->compile_shutdown)
+        POCL_WAIT_COND (ddata->compile_jobs_cond, ddata->compile_lock);
+      if (ddata->compile_shutdown)
+        break;
+
+      pocl_cuda_compile_job_t *job = ddata->compile_jobs;
+      LL_DELETE (ddata->compile_jobs, job);
+      POCL_UNLOCK (ddata->compile_lock);
+
+      cl_kernel kernel = job->cmd.command.run.kernel;
+      compile_kernel_variant (kernel, device, job->cmd.program_device_i,
+                              &job->cmd, job->kdata, job->variant);
+      POname (clReleaseKernel) (kernel);
+      POCL_MEM_FREE (job);
+
+      POCL_LOCK (ddata->compile_lock);
+    }
+  POCL_UNLOCK (ddata->compile_lock);
+
+  return NULL;
+}
+
+/* Returns the kernel to launch the command with. With the background
+ * compilation, the specialized variant is queued for compiling if it's
+ * missing, and the generic variant is launched until it's ready, so the
+ * enqueue only waits if the generic one is still being compiled. */
+static pocl_cuda_kernel_variant_t *
+pick_kernel_variant (cl_kernel kernel, cl_device_id device, int has_offsets,
+                     unsigned device_i, _cl_command_node *command,
+                     pocl_cuda_kernel_data_t **kdata_out)
+{
+  pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+  if (ddata->num_compile_threads == 0)
+    return load_or_generate_kernel (kernel, device, has_offsets, device_i,
+                                    command, 1, kdata_out);
+
+  size_t local_size[3];
+  int smallgrid;
+  kernel_variant_key (device, command, 1, local_size, &smallgrid);
+  const size_t generic_size[3] = { 0, 0, 0 };
+
+  POCL_LOCK (ddata->compile_lock);
+  pocl_cuda_kernel_data_t *kdata = get_kernel_data (kernel, device_i);
+  *kdata_out = kdata;
+
+  pocl_cuda_kernel_variant_t *variant = find_kernel_variant (
+      kdata, local_size, has_offsets, 1, smallgrid);
+  if (variant == NULL || !variant->ready)
+    {
+      pocl_cuda_kernel_variant_t *generic
+          = find_kernel_variant (kdata, generic_size, has_offsets, 0, 0);
+      if (generic != NULL)
+        {
+          if (variant == NULL)
+            {
+              variant = add_kernel_variant (kdata, local_size, has_offsets, 1,
+                                            smallgrid);
+              queue_kernel_variant (ddata, kernel, command, kdata, variant);
+            }
+          variant = generic;
+        }
+    }
+
+  if (variant == NULL)
     {
-      kdata->module = module;
-      kdata->kernel = function;
+      POCL_UNLOCK (ddata->compile_lock);
+      return load_or_generate_kernel (kernel, device, has_offsets, device_i,
+                                      command, 1, kdata_out);
     }
 
+  while (!variant->ready)
+    POCL_WAIT_COND (ddata->compile_cond, ddata->compile_lock);
   POCL_UNLOCK (ddata->compile_lock);
 
-  return kdata;
+  return variant;
+}
+
+/* Fills cmd like a launch of the generic variant of the kernel, the one
+ * that runs with any local size. */
+static void
+init_generic_command (_cl_command_node *cmd, cl_kernel kernel,
+                      cl_device_id device, unsigned device_i)
+{
+  pocl_kernel_metadata_t *meta = kernel->meta;
+  memset (cmd, 0, sizeof (_cl_command_node));
+  cmd->type = CL_COMMAND_NDRANGE_KERNEL;
+  cmd->device = device;
+  cmd->program_device_i = device_i;
+  cmd->command.run.kernel = kernel;
+  cmd->command.run.hash = meta->build_hash[device_i];
+  if (meta->reqd_wg_size[0] > 0 && meta->reqd_wg_size[1] > 0
+      && meta->reqd_wg_size[2] > 0)
+    memcpy (cmd->command.run.pc.local_size, meta->reqd_wg_size,
+            sizeof (cmd->command.run.pc.local_size));
+}
+
+/* Queues the generic variant of a new kernel for the background compile
+ * threads, so that its first enqueue doesn't wait for the compilation. */
+int
+pocl_cuda_create_kernel (cl_device_id device, cl_program program,
+                         cl_kernel kernel, unsigned device_i)
+{
+  pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+  if (ddata->num_compile_threads == 0
+      || program->binary_type != CL_PROGRAM_BINARY_TYPE_EXECUTABLE)
+    return CL_SUCCESS;
+
+  _cl_command_node cmd;
+  init_generic_command (&cmd, kernel, device, device_i);
+
+  const size_t generic_size[3] = { 0, 0, 0 };
+  POCL_LOCK (ddata->compile_lock);
+  pocl_cuda_kernel_data_t *kdata = get_kernel_data (kernel, device_i);
+  if (find_kernel_variant (kdata, generic_size, 0, 0, 0) == NULL)
+    {
+      pocl_cuda_kernel_variant_t *variant
+          = add_kernel_variant (kdata, generic_size, 0, 0, 0);
+      queue_kernel_variant (ddata, kernel, &cmd, kdata, variant);
+    }
+  POCL_UNLOCK (ddata->compile_lock);
+
+  return CL_SUCCESS;
+}
+
+/* The dynamic shared memory of a launch with the kernel's current
+ * arguments: the __local arguments and the automatic locals, laid out like
+ * pocl_cuda_submit_kernel does. */
+static size_t
+kernel_shared_mem_size (cl_kernel kernel, pocl_cuda_kernel_data_t *kdata)
+{
+  pocl_kernel_metadata_t *meta = kernel->meta;
+  size_t bytes = 0, size, align;
+  unsigned i;
+
+  for (i = 0; i < meta->num_args + meta->num_locals; ++i)
+    {
+      if (i < meta->num_args)
+        {
+          if (meta->arg_info[i].type != POCL_ARG_TYPE_POINTER
+              || !ARG_IS_LOCAL (meta->arg_info[i]))
+            continue;
+          size = kernel->dyn_arguments[i].size;
+        }
+      else if (i < kdata->num_params)
+        size = meta->local_sizes[i - meta->num_args];
+      else
+        break;
+      align = kdata->alignments[i];
+      if (align && bytes % align)
+        bytes += align - (bytes % align);
+      bytes += size;
+    }
+  return bytes;
+}
+
+/* The local size with the most threads up to limit that divides the
+ * global size, preferring whole warps and a wide x dimension. */
+static void
+pick_local_size (cl_device_id dev, size_t limit, const size_t *global,
+                 size_t *local)
+{
+  size_t best_full = 0, best = 0, x, y, z;
+  local[0] = local[1] = local[2] = 1;
+
+  for (x = min (dev->max_work_item_sizes[0], min (global[0], limit)); x >= 1;
+       --x)
+    {
+      if (global[0] % x)
+        continue;
+      for (y = 1; y <= min (dev->max_work_item_sizes[1], global[1])
+                  && x * y <= limit;
+           ++y)
+        {
+          if (global[1] % y)
+            continue;
+          for (z = 1; z <= min (dev->max_work_item_sizes[2], global[2])
+                      && x * y * z <= limit;
+               ++z)
+            {
+              if (global[2] % z)
+                continue;
+              size_t n = x * y * z;
+              int full = (n % 32) == 0;
+              if ((full && n > best_full) || (!best_full && !full && n > best))
+                {
+                  local[0] = x;
+                  local[1] = y;
+                  local[2] = z;
+                  if (full)
+                    best_full = n;
+                  else
+                    best = n;
+                }
+            }
+        }
+    }
+}
+
+/* Picks the local size for a launch without one from the occupancy of the
+ * kernel: cuOccupancyMaxPotentialBlockSize gives the block size that
+ * reaches the highest occupancy with the registers and the shared memory
+ * the kernel uses, and the smallest grid that fills the GPU with it. The
+ * block is made smaller if the global size doesn't give that many
+ * blocks. */
+void
+pocl_cuda_compute_local_size (cl_device_id dev, cl_kernel kernel,
+                              size_t global_x, size_t global_y,
+                              size_t global_z, size_t *local_x,
+                              size_t *local_y, size_t *local_z)
+{
+  unsigned device_i;
+  for (device_i = 0; device_i < kernel->program->num_devices; ++device_i)
+    if (kernel->program->devices[device_i] == dev)
+      break;
+  assert (device_i < kernel->program->num_devices);
+
+  /* The occupancy is queried from the generic variant, since the local size
+   * the specialized ones are compiled for is not known yet. */
+  _cl_command_node cmd;
+  pocl_cuda_kernel_data_t *kdata;
+  init_generic_command (&cmd, kernel, dev, device_i);
+  pocl_cuda_kernel_variant_t *variant = load_or_generate_kernel (
+      kernel, dev, 0, device_i, &cmd, 0, &kdata);
+
+  size_t shared_mem = kernel_shared_mem_size (kernel, kdata);
+  int min_grid = 0, block = 0;
+  CUresult result = cuOccupancyMaxPotentialBlockSize (
+      &min_grid, &block, variant->kernel, NULL, shared_mem,
+      (int)dev->max_work_group_size);
+  if (result != CUDA_SUCCESS || block <= 0)
+    {
+      pocl_default_local_size_optimizer (dev, kernel, global_x, global_y,
+                                         global_z, local_x, local_y, local_z);
+      return;
+    }
+
+  if (pocl_is_option_set ("POCL_DEBUG"))
+    {
+      int regs = 0;
+      cuFuncGetAttribute (&regs, CU_FUNC_ATTRIBUTE_NUM_REGS, variant->kernel);
+      POCL_MSG_PRINT_CUDA ("%s: %d registers, %zu bytes of shared memory, "
+                           "block size %d, minimum grid %d\n",
+                           kernel->name, regs, shared_mem, block, min_grid);
+    }
+
+  const size_t global[3] = { global_x, global_y, global_z };
+  size_t local[3];
+  size_t limit = (size_t)block;
+  while (1)
+    {
+      pick_local_size (dev, limit, global, local);
+      size_t groups = (global_x / local[0]) * (global_y / local[1])
+                      * (global_z / local[2]);
+      if (groups >= (size_t)min_grid || limit <= 64)
+        break;
+      limit /= 2;
+    }
+
+  *local_x = local[0];
+  *local_y = local[1];
+  *local_z = local[2];
+}
+
+static int
+cmd_has_offsets (_cl_command_node *cmd)
+{
+  size_t *offs = cmd->command.run.pc.global_offset;
+  return offs[0] || offs[1] || offs[2];
 }
 
 void
 pocl_cuda_compile_kernel (_cl_command_node *cmd, cl_kernel kernel,
                           cl_device_id device, int specialize)
 {
-  load_or_generate_kernel (kernel, device, 0, cmd->program_device_i, cmd,
-                           specialize);
+  pocl_cuda_kernel_data_t *kdata;
+  load_or_generate_kernel (kernel, device, cmd_has_offsets (cmd),
+                           cmd->program_device_i, cmd, specialize, &kdata);
 }
 
 void
@@ -1060,39 +2741,34 @@ pocl_cuda_submit_kernel (CUstream stream, _cl_command_node *cmd,
   pocl_kernel_metadata_t *meta = kernel->meta;
 
   /* Check if we need to handle global work offsets */
-  int has_offsets =
-    (pc.global_offset[0] || pc.global_offset[1] || pc.global_offset[2]);
+  int has_offsets = cmd_has_offsets (cmd);
 
   /* Get kernel function */
-  pocl_cuda_kernel_data_t *kdata = load_or_generate_kernel (
-      kernel, device, has_offsets, cmd->program_device_i, cmd, 1);
-  CUmodule module = has_offsets ? kdata->module_offsets : kdata->module;
-  CUfunction function = has_offsets ? kdata->kernel_offsets : kdata->kernel;
-
-  /* Prepare kernel arguments */
-  void *null = NULL;
+  pocl_cuda_kernel_data_t *kdata;
+  pocl_cuda_kernel_variant_t *variant = pick_kernel_variant (
+      kernel, device, has_offsets, cmd->program_device_i, cmd, &kdata);
+  CUfunction function = variant->kernel;
+
+  /* Pack the arguments to the parameter buffer at the offsets computed
+   * when the kernel was first compiled */
+  char params[POCL_CUDA_MAX_PARAM_SIZE] __attribute__ ((aligned (16)));
+  size_t params_size = kdata->param_size;
   unsigned sharedMemBytes = 0;
-  void *params[meta->num_args + meta->num_locals + 4];
-  unsigned sharedMemOffsets[meta->num_args + meta->num_locals];
   unsigned constantMemBytes = 0;
-  unsigned constantMemOffsets[meta->num_args];
-  unsigned globalOffsets[3];
-
-  /* Get handle to constant memory buffer */
-  size_t constant_mem_size;
-  CUdeviceptr constant_mem_base = 0;
-  cuModuleGetGlobal (&constant_mem_base, &constant_mem_size, module,
-                     "_constant_memory_region_");
+  CUdeviceptr constant_mem_base = variant->constant_mem_base;
+  unsigned offset;
+  CUdeviceptr ptr;
 
   CUresult result;
   unsigned i;
   for (i = 0; i < meta->num_args; i++)
     {
       pocl_argument_type type = meta->arg_info[i].type;
+      char *param = params + kdata->param_offsets[i];
       switch (type)
         {
         case POCL_ARG_TYPE_NONE:
-          params[i] = arguments[i].value;
+          memcpy (param, arguments[i].value, arguments[i].size);
           break;
         case POCL_ARG_TYPE_POINTER:
           {
@@ -1105,8 +2781,8 @@ pocl_cuda_submit_kernel (CUstream stream, _cl_command_node *cmd,
                 if (sharedMemBytes % align)
                   sharedMemBytes += align - (sharedMemBytes % align);
 
-                sharedMemOffsets[i] = sharedMemBytes;
-                params[i] = sharedMemOffsets + i;
+                offset = sharedMemBytes;
+                memcpy (param, &offset, sizeof (offset));
 
                 sharedMemBytes += size;
               }
@@ -1134,104 +2810,441 @@ pocl_cuda_submit_kernel (CUstream stream, _cl_command_node *cmd,
                                          src, mem->size, stream);
                 CUDA_CHECK (result, "cuMemcpyDtoDAsync");
 
-                constantMemOffsets[i] = constantMemBytes;
-                params[i] = constantMemOffsets + i;
+                offset = constantMemBytes;
+                memcpy (param, &offset, sizeof (offset));
 
                 constantMemBytes += mem->size;
               }
             else
               {
-                assert (arguments[i].is_svm == 0);
-                if (arguments[i].value)
+                ptr = 0;
+                if (arguments[i].is_svm)
+                  {
+                    ptr = (CUdeviceptr) * (void **)arguments[i].value
+                          + arguments[i].offset;
+                  }
+                else if (arguments[i].value)
                   {
                     cl_mem mem = *(void **)arguments[i].value;
-                    params[i] = &mem->device_ptrs[device->global_mem_id].mem_ptr
-                                + arguments[i].offset;
+                    ptr = (CUdeviceptr)mem->device_ptrs[device->global_mem_id]
+                              .mem_ptr;
 
                     /* On ARM with USE_HOST_PTR, perform explicit copy to
                      * device */
                     if ((mem->flags & CL_MEM_USE_HOST_PTR) &&
                         !((pocl_cuda_device_data_t *)device->data)->supports_cu_mem_host_register)
                       {
-                        cuMemcpyHtoD (*(CUdeviceptr *)(params[i]),
-                                      mem->mem_host_ptr, mem->size);
+                        cuMemcpyHtoD (ptr, mem->mem_host_ptr, mem->size);
                         cuStreamSynchronize (0);
                       }
+                    ptr += arguments[i].offset;
                   }
-                else
-                  {
-                    params[i] = &null;
-                  }
+                memcpy (param, &ptr, sizeof (ptr));
               }
             break;
           }
         case POCL_ARG_TYPE_IMAGE:
+          {
+            /* the device copy of the cuda_image_t of the array */
+            cl_mem mem = *(cl_mem *)arguments[i].value;
+            ptr = (CUdeviceptr)mem->device_ptrs[device->global_mem_id].mem_ptr;
+            memcpy (param, &ptr, sizeof (ptr));
+            break;
+          }
         case POCL_ARG_TYPE_SAMPLER:
-          POCL_ABORT ("Unhandled argument type for CUDA\n");
-          break;
+          {
+            /* the sampler_t bitfield, in the place of the pointer */
+            dev_sampler_t ds;
+            pocl_fill_dev_sampler_t (&ds, &arguments[i]);
+            ptr = (CUdeviceptr)ds;
+            memcpy (param, &ptr, sizeof (ptr));
+            break;
+          }
         }
     }
 
-  if (constantMemBytes > constant_mem_size)
+  if (constantMemBytes > variant->constant_mem_size)
     POCL_ABORT ("[CUDA] Total constant buffer size %u exceeds %lu allocated\n",
-                constantMemBytes, constant_mem_size);
+                constantMemBytes, variant->constant_mem_size);
 
+  /* Deal with automatic local allocations */
+  /* TODO: Would be better to remove arguments and make these static GEPs
+   */
   unsigned arg_index = meta->num_args;
-
-  if (sharedMemBytes != 0)
+  for (i = 0; arg_index < kdata->num_params && i < meta->num_locals;
+       ++i, ++arg_index)
     {
-      /* Deal with automatic local allocations if there are local function args
-       */
-      /* TODO: Would be better to remove arguments and make these static GEPs
-       */
-      for (i = 0; i < meta->num_locals; ++i, ++arg_index)
-        {
-          size_t size = meta->local_sizes[i];
-          size_t align = kdata->alignments[arg_index];
+      size_t size = meta->local_sizes[i];
+      size_t align = kdata->alignments[arg_index];
 
-          /* Pad offset to align memory */
-          if (sharedMemBytes % align)
-            sharedMemBytes += align - (sharedMemBytes % align);
+      /* Pad offset to align memory */
+      if (sharedMemBytes % align)
+        sharedMemBytes += align - (sharedMemBytes % align);
 
-          sharedMemOffsets[arg_index] = sharedMemBytes;
-          sharedMemBytes += size;
-          params[arg_index] = sharedMemOffsets + arg_index;
-        }
+      offset = sharedMemBytes;
+      memcpy (params + kdata->param_offsets[arg_index], &offset,
+              sizeof (offset));
+      sharedMemBytes += size;
     }
 
   /* Add global work dimensionality */
-  params[arg_index++] = &pc.work_dim;
-
-  /* Add global offsets if necessary */
-  if (has_offsets)
-    {
-      globalOffsets[0] = pc.global_offset[0];
-      globalOffsets[1] = pc.global_offset[1];
-      globalOffsets[2] = pc.global_offset[2];
-      params[arg_index++] = globalOffsets + 0;
-      params[arg_index++] = globalOffsets + 1;
-      params[arg_index++] = globalOffsets + 2;
-    }
+  memcpy (params + kdata->param_offsets[kdata->num_params], &pc.work_dim,
+          sizeof (cl_uint));
 
   /* Launch kernel */
+  void *config[] = { CU_LAUNCH_PARAM_BUFFER_POINTER, params,
+                     CU_LAUNCH_PARAM_BUFFER_SIZE, &params_size,
+                     CU_LAUNCH_PARAM_END };
   result = cuLaunchKernel (function, pc.num_groups[0], pc.num_groups[1],
                            pc.num_groups[2], pc.local_size[0],
                            pc.local_size[1], pc.local_size[2], sharedMemBytes,
-                           stream, params, NULL);
+                           stream, NULL, config);
   CUDA_CHECK (result, "cuLaunchKernel");
 }
 
+int
+pocl_cuda_can_run_command_buffer (cl_device_id device,
+                                  cl_command_buffer_khr command_buffer)
+{
+#if CUDA_VERSION >= 10000
+  pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+  cl_uint i;
+
+  if (command_buffer->data)
+    return 1;
+  if (!pocl_get_bool_option ("POCL_CUDA_GRAPHS", 1))
+    return 0;
+  /* the explicit copies of the USE_HOST_PTR buffers synchronize */
+  if (!ddata->supports_cu_mem_host_register)
+    return 0;
+
+  /* only the commands that are asynchronous on the stream can be
+   * captured to a graph */
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    {
+      _cl_command_node *node = &command_buffer->commands[i]->node;
+      switch (node->type)
+        {
+        case CL_COMMAND_NDRANGE_KERNEL:
+        case CL_COMMAND_BARRIER:
+        case CL_COMMAND_FILL_BUFFER:
+          break;
+        case CL_COMMAND_COPY_BUFFER:
+          if (node->command.copy.src_content_size != NULL)
+            return 0;
+          break;
+        default:
+          return 0;
+        }
+    }
+
+  pocl_cuda_graph_t *graph = calloc (1, sizeof (pocl_cuda_graph_t));
+  if (graph == NULL)
+    return 0;
+  POCL_INIT_LOCK (graph->lock);
+  command_buffer->data = graph;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+void
+pocl_cuda_free_command_buffer (cl_device_id device,
+                               cl_command_buffer_khr command_buffer)
+{
+  pocl_cuda_graph_t *graph = (pocl_cuda_graph_t *)command_buffer->data;
+#if CUDA_VERSION >= 10000
+  pocl_cuda_device_data_t *ddata = (pocl_cuda_device_data_t *)device->data;
+  cuCtxSetCurrent (ddata->context);
+  /* a graph still running is freed when it completes */
+  if (graph->exec)
+    cuGraphExecDestroy (graph->exec);
+  if (graph->graph)
+    cuGraphDestroy (graph->graph);
+#endif
+  POCL_DESTROY_LOCK (graph->lock);
+  POCL_MEM_FREE (graph->mem_ptrs);
+  POCL_MEM_FREE (graph);
+  command_buffer->data = NULL;
+}
+
+#if CUDA_VERSION >= 10000
+/* Captures the recorded commands of the command buffer to graph, in the
+ * order they were recorded, which satisfies the sync points too. */
+static void
+pocl_cuda_capture_command_buffer (CUstream stream, cl_device_id device,
+                                  cl_command_buffer_khr command_buffer,
+                                  pocl_cuda_graph_t *graph)
+{
+  CUresult result;
+  cl_uint i;
+
+  /* compile the kernels first, loading the modules is not allowed while
+   * capturing */
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    {
+      _cl_command_node *node = &command_buffer->commands[i]->node;
+      if (node->type == CL_COMMAND_NDRANGE_KERNEL)
+        {
+          pocl_cuda_kernel_data_t *kdata;
+          load_or_generate_kernel (node->command.run.kernel, device,
+                                   cmd_has_offsets (node),
+                                   node->program_device_i, node, 1, &kdata);
+        }
+    }
+
+  result = cuStreamBeginCapture (stream, CU_STREAM_CAPTURE_MODE_RELAXED);
+  CUDA_CHECK (result, "cuStreamBeginCapture");
+
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    {
+      _cl_command_node *node = &command_buffer->commands[i]->node;
+      _cl_command_t *cmd = &node->command;
+      switch (node->type)
+        {
+        case CL_COMMAND_NDRANGE_KERNEL:
+          pocl_cuda_submit_kernel (stream, node, device, NULL);
+          break;
+        case CL_COMMAND_COPY_BUFFER:
+          pocl_cuda_submit_copy (stream, cmd->copy.src_mem_id->mem_ptr,
+                                 cmd->copy.src_offset,
+                                 cmd->copy.dst_mem_id->mem_ptr,
+                                 cmd->copy.dst_offset, cmd->copy.size);
+          break;
+        case CL_COMMAND_FILL_BUFFER:
+          pocl_cuda_submit_memfill (device->data, stream,
+                                    cmd->memfill.dst_mem_id->mem_ptr,
+                                    cmd->memfill.size, cmd->memfill.offset,
+                                    cmd->memfill.pattern,
+                                    cmd->memfill.pattern_size);
+          break;
+        default:
+          break;
+        }
+    }
+
+  result = cuStreamEndCapture (stream, &graph->graph);
+  CUDA_CHECK (result, "cuStreamEndCapture");
+#if CUDA_VERSION >= 11040
+  result = cuGraphInstantiateWithFlags (&graph->exec, graph->graph, 0);
+#else
+  result = cuGraphInstantiate (&graph->exec, graph->graph, NULL, NULL, 0);
+#endif
+  CUDA_CHECK (result, "cuGraphInstantiate");
+}
+
+/* Runs a command buffer enqueued as one command: launches its graph,
+ * capturing it first at the first enqueue, or if a buffer of it has been
+ * reallocated since the capture. */
+static void
+pocl_cuda_submit_command_buffer (CUstream stream, _cl_command_node *node,
+                                 cl_device_id device)
+{
+  cl_command_buffer_khr command_buffer
+      = node->command.command_buffer.command_buffer;
+  pocl_cuda_graph_t *graph = (pocl_cuda_graph_t *)command_buffer->data;
+  cl_event event = node->event;
+  CUresult result;
+  size_t i;
+
+  POCL_LOCK (graph->lock);
+
+  int valid = graph->exec != NULL && graph->num_mem_ptrs == event->num_buffers;
+  for (i = 0; valid && i < event->num_buffers; ++i)
+    valid = graph->mem_ptrs[i]
+            == event->mem_objs[i]->device_ptrs[device->global_mem_id].mem_ptr;
+
+  if (!valid)
+    {
+      if (graph->exec)
+        {
+          POCL_MSG_PRINT_CUDA ("recapturing the graph of command buffer %p, "
+                               "a buffer has moved\n",
+                               command_buffer);
+          cuGraphExecDestroy (graph->exec);
+          cuGraphDestroy (graph->graph);
+          graph->exec = NULL;
+          graph->graph = NULL;
+        }
+      pocl_cuda_capture_command_buffer (stream, device, command_buffer,
+                                        graph);
+
+      graph->mem_ptrs
+          = realloc (graph->mem_ptrs, event->num_buffers * sizeof (void *));
+      graph->num_mem_ptrs = event->num_buffers;
+      for (i = 0; i < event->num_buffers; ++i)
+        graph->mem_ptrs[i]
+            = event->mem_objs[i]->device_ptrs[device->global_mem_id].mem_ptr;
+    }
+
+  result = cuGraphLaunch (graph->exec, stream);
+  CUDA_CHECK (result, "cuGraphLaunch");
+
+  POCL_UNLOCK (graph->lock);
+}
+#endif
+
+/* Returns the stream of the queue to submit node to: transfers go to the
+ * copy stream, to overlap with the kernels, and the other commands go to
+ * the compute streams in turn. */
+static CUstream
+pocl_cuda_pick_stream (pocl_cuda_queue_data_t *queue_data,
+                       _cl_command_node *node)
+{
+  switch (node->type)
+    {
+    case CL_COMMAND_READ_BUFFER:
+    case CL_COMMAND_WRITE_BUFFER:
+    case CL_COMMAND_COPY_BUFFER:
+    case CL_COMMAND_READ_BUFFER_RECT:
+    case CL_COMMAND_WRITE_BUFFER_RECT:
+    case CL_COMMAND_COPY_BUFFER_RECT:
+    case CL_COMMAND_MAP_BUFFER:
+    case CL_COMMAND_UNMAP_MEM_OBJECT:
+    case CL_COMMAND_MIGRATE_MEM_OBJECTS:
+    case CL_COMMAND_READ_IMAGE:
+    case CL_COMMAND_WRITE_IMAGE:
+    case CL_COMMAND_COPY_IMAGE:
+    case CL_COMMAND_COPY_BUFFER_TO_IMAGE:
+    case CL_COMMAND_COPY_IMAGE_TO_BUFFER:
+    case CL_COMMAND_MAP_IMAGE:
+    case CL_COMMAND_SVM_MEMCPY:
+    case CL_COMMAND_SVM_MAP:
+    case CL_COMMAND_SVM_MIGRATE_MEM:
+      return queue_data->copy_stream;
+    default:
+      break;
+    }
+
+  if (queue_data->num_streams == 1)
+    return queue_data->streams[0];
+  unsigned i = queue_data->next_stream++ % queue_data->num_streams;
+  return queue_data->streams[i];
+}
+
+/* Run by CUDA when a command has completed. Pushes it to the completed
+ * commands of its queue, and wakes up the finalizing thread if it sleeps.
+ * CUDA API calls are not allowed here. */
+static void CUDA_CB
+pocl_cuda_command_done (void *data)
+{
+  pocl_cuda_event_data_t *event_data = (pocl_cuda_event_data_t *)data;
+  pocl_cuda_queue_data_t *queue_data = event_data->queue_data;
+
+  pocl_cuda_event_data_t *head
+      = __atomic_load_n (&queue_data->completed, __ATOMIC_RELAXED);
+  do
+    event_data->next_completed = head;
+  while (!__atomic_compare_exchange_n (&queue_data->completed, &head,
+                                       event_data, 1, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED));
+
+  if (__atomic_load_n (&queue_data->finalize_waiting, __ATOMIC_SEQ_CST))
+    {
+      PTHREAD_CHECK (pthread_mutex_lock (&queue_data->lock));
+      PTHREAD_CHECK (pthread_cond_broadcast (&queue_data->completed_cond));
+      PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
+    }
+}
+
+#if CUDA_VERSION < 10000
+static void CUDA_CB
+pocl_cuda_stream_callback (CUstream stream, CUresult status, void *data)
+{
+  pocl_cuda_command_done (data);
+}
+#endif
+
+/* Finalizes the commands of the queue whose completion callback has run,
+ * all of them at once, in the order the callbacks ran. A command whose
+ * dependencies have not been finalized yet (they ran on another stream,
+ * or are in another queue) is kept until a later call. Called with
+ * finalize_lock held. */
+static void
+pocl_cuda_finalize_completed (cl_device_id device,
+                              pocl_cuda_queue_data_t *queue_data)
+{
+  pocl_cuda_event_data_t *batch
+      = __atomic_exchange_n (&queue_data->completed, NULL, __ATOMIC_ACQUIRE);
+  pocl_cuda_event_data_t **tail = &queue_data->ready;
+  pocl_cuda_event_data_t *e, *next, *fifo = NULL;
+  int progress = 1;
+
+  /* the callbacks push the newest first */
+  for (e = batch; e != NULL; e = next)
+    {
+      next = e->next_completed;
+      e->next_completed = fifo;
+      fifo = e;
+    }
+  while (*tail)
+    tail = &(*tail)->next_completed;
+  *tail = fifo;
+
+  while (progress)
+    {
+      progress = 0;
+      pocl_cuda_event_data_t **p = &queue_data->ready;
+      while (*p)
+        {
+          e = *p;
+          if (e->event->wait_list == NULL)
+            {
+              *p = e->next_completed;
+              pocl_cuda_finalize_command (device, e->event);
+              progress = 1;
+            }
+          else
+            p = &e->next_completed;
+        }
+    }
+}
+
+/* Sleeps until a completion callback runs, or for at most a millisecond if
+ * timed, or until the queue is released. */
+static void
+pocl_cuda_wait_completed (pocl_cuda_queue_data_t *queue_data, int timed)
+{
+  PTHREAD_CHECK (pthread_mutex_lock (&queue_data->lock));
+  __atomic_add_fetch (&queue_data->finalize_waiting, 1, __ATOMIC_SEQ_CST);
+  if (queue_data->queue
+      && __atomic_load_n (&queue_data->completed, __ATOMIC_SEQ_CST) == NULL)
+    {
+      if (timed)
+        {
+          struct timespec ts;
+          clock_gettime (CLOCK_REALTIME, &ts);
+          ts.tv_nsec += 1000000;
+          if (ts.tv_nsec >= 1000000000)
+            {
+              ts.tv_sec += 1;
+              ts.tv_nsec -= 1000000000;
+            }
+          pthread_cond_timedwait (&queue_data->completed_cond,
+                                  &queue_data->lock, &ts);
+        }
+      else
+        PTHREAD_CHECK (pthread_cond_wait (&queue_data->completed_cond,
+                                          &queue_data->lock));
+    }
+  __atomic_sub_fetch (&queue_data->finalize_waiting, 1, __ATOMIC_SEQ_CST);
+  PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
+}
+
 void
 pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
 {
   CUresult result;
-  CUstream stream = ((pocl_cuda_queue_data_t *)cq->data)->stream;
+  CUstream stream
+      = pocl_cuda_pick_stream ((pocl_cuda_queue_data_t *)cq->data, node);
 
   if (!locked)
   POCL_LOCK_OBJ (node->event);
 
   pocl_cuda_event_data_t *event_data
       = (pocl_cuda_event_data_t *)node->event->data;
+  event_data->stream = stream;
 
   /* Process event dependencies */
   event_node *dep = NULL;
@@ -1245,16 +3258,16 @@ pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
       if (dep->event->command_type != CL_COMMAND_USER
           && dep->event->queue->device->ops == cq->device->ops)
         {
-          /* Block stream on event, but only for different queues */
-          if (dep->event->queue != node->event->queue)
-            {
-              pocl_cuda_event_data_t *dep_data
-                  = (pocl_cuda_event_data_t *)dep->event->data;
+          pocl_cuda_event_data_t *dep_data
+              = (pocl_cuda_event_data_t *)dep->event->data;
 
-              /* Wait until dependency has finished being submitted */
-              while (!dep_data->events_ready)
-                ;
+          /* Wait until dependency has finished being submitted */
+          while (!dep_data->events_ready)
+            ;
 
+          /* Block stream on event, but only for different streams */
+          if (dep_data->stream != stream)
+            {
               result = cuStreamWaitEvent (stream, dep_data->end, 0);
               CUDA_CHECK (result, "cuStreamWaitEvent");
             }
@@ -1308,19 +3321,22 @@ pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
     {
     case CL_COMMAND_READ_BUFFER:
       pocl_cuda_submit_read (
-          stream, cmd->read.dst_host_ptr, cmd->read.src_mem_id->mem_ptr,
+          dev->data, stream, cmd->read.dst_host_ptr, cmd->read.src_mem_id->mem_ptr,
           node->command.read.offset, node->command.read.size);
       break;
     case CL_COMMAND_WRITE_BUFFER:
       pocl_cuda_submit_write (
-          stream, cmd->write.src_host_ptr, cmd->write.dst_mem_id->mem_ptr,
+          dev->data, stream, cmd->write.src_host_ptr, cmd->write.dst_mem_id->mem_ptr,
           node->command.write.offset, node->command.write.size);
       break;
     case CL_COMMAND_COPY_BUFFER:
       {
-        pocl_cuda_submit_copy (
-            stream, cmd->copy.src_mem_id->mem_ptr, cmd->copy.src_offset,
-            cmd->copy.dst_mem_id->mem_ptr, cmd->copy.dst_offset, cmd->copy.size);
+        size_t size = pocl_cuda_copy_size (stream, &cmd->copy);
+        if (size)
+          pocl_cuda_submit_copy (stream, cmd->copy.src_mem_id->mem_ptr,
+                                 cmd->copy.src_offset,
+                                 cmd->copy.dst_mem_id->mem_ptr,
+                                 cmd->copy.dst_offset, size);
         break;
       }
     case CL_COMMAND_READ_BUFFER_RECT:
@@ -1375,7 +3391,16 @@ pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
     case CL_COMMAND_UNMAP_MEM_OBJECT:
       {
         cl_mem buffer = event->mem_objs[0];
-        assert (buffer->is_image == CL_FALSE);
+        if (buffer->is_image && !IS_IMAGE1D_BUFFER (buffer))
+          {
+            mem_mapping_t *map = cmd->unmap.mapping;
+            if (map->map_flags != CL_MAP_READ)
+              pocl_cuda_submit_image_rect (
+                  stream, buffer, cmd->unmap.mem_id, 1, map->host_ptr, 0,
+                  map->origin, map->region, map->row_pitch,
+                  map->slice_pitch);
+            break;
+          }
         pocl_cuda_submit_unmap_mem (
             stream,
             cmd->unmap.mem_id,
@@ -1395,22 +3420,84 @@ pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
         case ENQUEUE_MIGRATE_TYPE_D2H:
           {
             cl_mem mem = event->mem_objs[0];
-            pocl_cuda_submit_read (stream, mem->mem_host_ptr,
-                                   cmd->migrate.mem_id->mem_ptr, 0, mem->size);
+            if (mem->is_image && !IS_IMAGE1D_BUFFER (mem))
+              {
+                size_t origin[3] = { 0, 0, 0 };
+                size_t region[3];
+                pocl_cuda_image_region (mem, region);
+                pocl_cuda_submit_image_rect (
+                    stream, mem, cmd->migrate.mem_id, 0, mem->mem_host_ptr,
+                    0, origin, region, mem->image_row_pitch,
+                    mem->image_slice_pitch);
+                break;
+              }
+            size_t size = pocl_cuda_migration_size (stream, &cmd->migrate);
+            if (size)
+              pocl_cuda_submit_read (
+                  dev->data, stream,
+                  (char *)mem->mem_host_ptr + cmd->migrate.offset,
+                  cmd->migrate.mem_id->mem_ptr, cmd->migrate.offset, size);
             break;
           }
         case ENQUEUE_MIGRATE_TYPE_H2D:
           {
             cl_mem mem = event->mem_objs[0];
-            pocl_cuda_submit_write (stream, mem->mem_host_ptr,
-                                    cmd->migrate.mem_id->mem_ptr, 0,
-                                    mem->size);
+            if (mem->is_image && !IS_IMAGE1D_BUFFER (mem))
+              {
+                size_t origin[3] = { 0, 0, 0 };
+                size_t region[3];
+                pocl_cuda_image_region (mem, region);
+                pocl_cuda_submit_image_rect (
+                    stream, mem, cmd->migrate.mem_id, 1, mem->mem_host_ptr,
+                    0, origin, region, mem->image_row_pitch,
+                    mem->image_slice_pitch);
+                break;
+              }
+            size_t size = pocl_cuda_migration_size (stream, &cmd->migrate);
+            if (size)
+              pocl_cuda_submit_write (
+                  dev->data, stream,
+                  (char *)mem->mem_host_ptr + cmd->migrate.offset,
+                  cmd->migrate.mem_id->mem_ptr, cmd->migrate.offset, size);
             break;
           }
         case ENQUEUE_MIGRATE_TYPE_D2D:
           {
-            POCL_ABORT_UNIMPLEMENTED (
-                "CUDA does not support D2D migration.\n");
+            cl_device_id src_dev = cmd->migrate.src_device;
+            cl_mem mem = event->mem_objs[0];
+            if (src_dev->ops != dev->ops)
+              POCL_ABORT_UNIMPLEMENTED (
+                  "CUDA only supports D2D migration from CUDA devices.\n");
+            pocl_cuda_device_data_t *src_data
+                = (pocl_cuda_device_data_t *)src_dev->data;
+            pocl_cuda_device_data_t *dst_data
+                = (pocl_cuda_device_data_t *)dev->data;
+            if (mem->is_image && !IS_IMAGE1D_BUFFER (mem))
+              {
+                size_t origin[3] = { 0, 0, 0 };
+                size_t region[3];
+                pocl_cuda_image_region (mem, region);
+                pocl_cuda_submit_copy_image_rect (
+                    stream, mem, cmd->migrate.src_id, src_data->context, mem,
+                    cmd->migrate.dst_id, dst_data->context, origin, origin,
+                    region);
+                break;
+              }
+            size_t size = pocl_cuda_migration_size (stream, &cmd->migrate);
+            if (size == 0)
+              break;
+            POCL_MSG_PRINT_CUDA ("cuMemcpyPeerAsync %p -> %p / %zu B \n",
+                                 cmd->migrate.src_id->mem_ptr,
+                                 cmd->migrate.dst_id->mem_ptr, size);
+            result = cuMemcpyPeerAsync (
+                (CUdeviceptr)cmd->migrate.dst_id->mem_ptr
+                    + cmd->migrate.offset,
+                dst_data->context,
+                (CUdeviceptr)cmd->migrate.src_id->mem_ptr
+                    + cmd->migrate.offset,
+                src_data->context, size, stream);
+            CUDA_CHECK (result, "cuMemcpyPeerAsync");
+            break;
           }
         case ENQUEUE_MIGRATE_TYPE_NOP:
           {
@@ -1423,25 +3510,105 @@ pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
     case CL_COMMAND_BARRIER:
       break;
 
+#if CUDA_VERSION >= 10000
+    case CL_COMMAND_COMMAND_BUFFER_KHR:
+      pocl_cuda_submit_command_buffer (stream, node, dev);
+      break;
+#endif
+
     case CL_COMMAND_FILL_BUFFER:
-      pocl_cuda_submit_memfill (stream, cmd->memfill.dst_mem_id->mem_ptr,
+      pocl_cuda_submit_memfill (dev->data, stream,
+                                cmd->memfill.dst_mem_id->mem_ptr,
                                 cmd->memfill.size, cmd->memfill.offset,
                                 cmd->memfill.pattern,
                                 cmd->memfill.pattern_size);
       break;
+
+    case CL_COMMAND_SVM_MEMCPY:
+      result = cuMemcpyAsync ((CUdeviceptr)cmd->svm_memcpy.dst,
+                              (CUdeviceptr)cmd->svm_memcpy.src,
+                              cmd->svm_memcpy.size, stream);
+      CUDA_CHECK (result, "cuMemcpyAsync");
+      break;
+    case CL_COMMAND_SVM_MEMFILL:
+      pocl_cuda_submit_memfill (dev->data, stream, cmd->svm_fill.svm_ptr,
+                                cmd->svm_fill.size, 0,
+                                cmd->svm_fill.pattern,
+                                cmd->svm_fill.pattern_size);
+      break;
+    case CL_COMMAND_SVM_MAP:
+      {
+        /* bring the pages the host is going to access over in one go */
+        _cl_command_svm_migrate migrate
+            = { 1, (const void **)&cmd->svm_map.svm_ptr, &cmd->svm_map.size,
+                CL_MIGRATE_MEM_OBJECT_HOST };
+        pocl_cuda_submit_svm_migrate (stream, dev, &migrate);
+        break;
+      }
+    case CL_COMMAND_SVM_MIGRATE_MEM:
+      pocl_cuda_submit_svm_migrate (stream, dev, &cmd->svm_migrate);
+      break;
+    case CL_COMMAND_SVM_UNMAP:
+      /* the managed memory is coherent at the command boundaries */
+      break;
+    case CL_COMMAND_SVM_FREE:
+      /* freed in pocl_cuda_finalize_command, after the commands before it
+       * have completed */
+      break;
     case CL_COMMAND_READ_IMAGE:
+      pocl_cuda_submit_image_rect (
+          stream, cmd->read_image.src, cmd->read_image.src_mem_id, 0,
+          (char *)cmd->read_image.dst_host_ptr + cmd->read_image.dst_offset,
+          0, cmd->read_image.origin, cmd->read_image.region,
+          cmd->read_image.dst_row_pitch, cmd->read_image.dst_slice_pitch);
+      break;
+    case CL_COMMAND_COPY_IMAGE_TO_BUFFER:
+      pocl_cuda_submit_image_rect (
+          stream, cmd->read_image.src, cmd->read_image.src_mem_id, 0, NULL,
+          (CUdeviceptr)cmd->read_image.dst_mem_id->mem_ptr
+              + cmd->read_image.dst_offset,
+          cmd->read_image.origin, cmd->read_image.region, 0, 0);
+      break;
     case CL_COMMAND_WRITE_IMAGE:
-    case CL_COMMAND_COPY_IMAGE:
+      pocl_cuda_submit_image_rect (
+          stream, cmd->write_image.dst, cmd->write_image.dst_mem_id, 1,
+          (char *)cmd->write_image.src_host_ptr + cmd->write_image.src_offset,
+          0, cmd->write_image.origin, cmd->write_image.region,
+          cmd->write_image.src_row_pitch, cmd->write_image.src_slice_pitch);
+      break;
     case CL_COMMAND_COPY_BUFFER_TO_IMAGE:
-    case CL_COMMAND_COPY_IMAGE_TO_BUFFER:
+      pocl_cuda_submit_image_rect (
+          stream, cmd->write_image.dst, cmd->write_image.dst_mem_id, 1, NULL,
+          (CUdeviceptr)cmd->write_image.src_mem_id->mem_ptr
+              + cmd->write_image.src_offset,
+          cmd->write_image.origin, cmd->write_image.region, 0, 0);
+      break;
+    case CL_COMMAND_COPY_IMAGE:
+      {
+        CUcontext context = ((pocl_cuda_device_data_t *)dev->data)->context;
+        pocl_cuda_submit_copy_image_rect (
+            stream, cmd->copy_image.src, cmd->copy_image.src_mem_id, context,
+            cmd->copy_image.dst, cmd->copy_image.dst_mem_id, context,
+            cmd->copy_image.src_origin, cmd->copy_image.dst_origin,
+            cmd->copy_image.region);
+        break;
+      }
     case CL_COMMAND_FILL_IMAGE:
+      pocl_cuda_submit_fill_image (
+          stream, event->mem_objs[0], cmd->fill_image.mem_id,
+          cmd->fill_image.origin, cmd->fill_image.region,
+          cmd->fill_image.fill_pixel, cmd->fill_image.pixel_size);
+      break;
     case CL_COMMAND_MAP_IMAGE:
+      {
+        mem_mapping_t *map = cmd->map.mapping;
+        if (!(map->map_flags & CL_MAP_WRITE_INVALIDATE_REGION))
+          pocl_cuda_submit_image_rect (
+              stream, event->mem_objs[0], cmd->map.mem_id, 0, map->host_ptr,
+              0, map->origin, map->region, map->row_pitch, map->slice_pitch);
+        break;
+      }
     case CL_COMMAND_NATIVE_KERNEL:
-    case CL_COMMAND_SVM_FREE:
-    case CL_COMMAND_SVM_MAP:
-    case CL_COMMAND_SVM_UNMAP:
-    case CL_COMMAND_SVM_MEMCPY:
-    case CL_COMMAND_SVM_MEMFILL:
     default:
       POCL_ABORT_UNIMPLEMENTED (pocl_command_to_str (node->type));
       break;
@@ -1457,6 +3624,18 @@ pocl_cuda_submit_node (_cl_command_node *node, cl_command_queue cq, int locked)
   CUDA_CHECK (result, "cuEventRecord");
 
   event_data->events_ready = 1;
+
+  /* Get the completion delivered by a callback after the command */
+  event_data->event = node->event;
+  event_data->queue_data = (pocl_cuda_queue_data_t *)cq->data;
+#if CUDA_VERSION >= 10000
+  result = cuLaunchHostFunc (stream, pocl_cuda_command_done, event_data);
+  CUDA_CHECK (result, "cuLaunchHostFunc");
+#else
+  result = cuStreamAddCallback (stream, pocl_cuda_stream_callback, event_data,
+                                0);
+  CUDA_CHECK (result, "cuStreamAddCallback");
+#endif
 }
 
 void
@@ -1487,6 +3666,38 @@ pocl_cuda_submit (_cl_command_node *node, cl_command_queue cq)
     }
 }
 
+void
+pocl_cuda_submit_batch (_cl_command_node *batch, cl_command_queue cq)
+{
+  pocl_cuda_queue_data_t *queue_data = (pocl_cuda_queue_data_t *)cq->data;
+  _cl_command_node *node, *tmp;
+
+  if (!queue_data->use_threads)
+    {
+      DL_FOREACH_SAFE (batch, node, tmp)
+        {
+          POCL_LOCK_OBJ (node->event);
+          pocl_cuda_submit (node, cq);
+        }
+      return;
+    }
+
+  /* Hand the whole batch to the submit thread at once */
+  DL_FOREACH (batch, node)
+    {
+      pocl_cuda_event_data_t *p = (pocl_cuda_event_data_t *)calloc (
+          1, sizeof (pocl_cuda_event_data_t));
+      PTHREAD_CHECK (pthread_cond_init (&p->event_cond, NULL));
+      POCL_LOCK_OBJ (node->event);
+      node->event->data = p;
+      POCL_UNLOCK_OBJ (node->event);
+    }
+  PTHREAD_CHECK (pthread_mutex_lock (&queue_data->lock));
+  DL_CONCAT (queue_data->pending_queue, batch);
+  PTHREAD_CHECK (pthread_cond_signal (&queue_data->pending_cond));
+  PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
+}
+
 void
 pocl_cuda_notify (cl_device_id device, cl_event event, cl_event finished)
 {
@@ -1517,7 +3728,16 @@ pocl_cuda_notify (cl_device_id device, cl_event event, cl_event finished)
 void
 pocl_cuda_flush (cl_device_id device, cl_command_queue cq)
 {
-  /* TODO: Something here? */
+  pocl_cuda_queue_data_t *queue_data = (pocl_cuda_queue_data_t *)cq->data;
+
+  /* Without the queue threads, the completed commands are finalized by the
+   * threads calling into the driver */
+  if (!queue_data->use_threads
+      && pthread_mutex_trylock (&queue_data->finalize_lock) == 0)
+    {
+      pocl_cuda_finalize_completed (device, queue_data);
+      PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->finalize_lock));
+    }
 }
 
 void
@@ -1545,7 +3765,8 @@ pocl_cuda_finalize_command (cl_device_id device, cl_event event)
             {
               if (meta->arg_info[i].type == POCL_ARG_TYPE_POINTER)
                 {
-                  if (!ARG_IS_LOCAL (meta->arg_info[i]) && arguments[i].value)
+                  if (!ARG_IS_LOCAL (meta->arg_info[i]) && arguments[i].value
+                      && !arguments[i].is_svm)
                     {
                       cl_mem mem = *(void **)arguments[i].value;
                       if (mem->flags & CL_MEM_USE_HOST_PTR)
@@ -1562,6 +3783,18 @@ pocl_cuda_finalize_command (cl_device_id device, cl_event event)
         }
     }
 
+  if (event->command_type == CL_COMMAND_SVM_FREE)
+    {
+      _cl_command_svm_free *cmd = &event->command->command.svm_free;
+      unsigned i;
+      if (cmd->pfn_free_func)
+        cmd->pfn_free_func (cmd->queue, cmd->num_svm_pointers,
+                            cmd->svm_pointers, cmd->data);
+      else
+        for (i = 0; i < cmd->num_svm_pointers; i++)
+          pocl_cuda_svm_free (device, cmd->svm_pointers[i]);
+    }
+
   /* Handle failed events */
 
   pocl_update_event_running (event);
@@ -1598,26 +3831,58 @@ pocl_cuda_update_event (cl_device_id device, cl_event event)
           &diff, ((pocl_cuda_device_data_t *)device->data)->epoch_event,
           event_data->start);
       CUDA_CHECK (result, "cuEventElapsedTime");
-      event->time_start = epoch + (cl_ulong)(diff * 1e6);
-      event->time_start = max (event->time_start, epoch + 1);
+      pocl_event_profile *prof = event->profile;
+      prof->time_start = epoch + (cl_ulong)(diff * 1e6);
+      prof->time_start = max (prof->time_start, epoch + 1);
 
       result = cuEventElapsedTime (
           &diff, ((pocl_cuda_device_data_t *)device->data)->epoch_event,
           event_data->end);
       CUDA_CHECK (result, "cuEventElapsedTime");
-      event->time_end = epoch + (cl_ulong)(diff * 1e6);
-      event->time_end = max (event->time_end, event->time_start + 1);
+      prof->time_end = epoch + (cl_ulong)(diff * 1e6);
+      prof->time_end = max (prof->time_end, prof->time_start + 1);
     }
 }
 
 void
 pocl_cuda_wait_event_recurse (cl_device_id device, cl_event event)
 {
-  while (event->wait_list)
-    pocl_cuda_wait_event_recurse (device, event->wait_list->event);
+  pocl_cuda_queue_data_t *queue_data
+      = (pocl_cuda_queue_data_t *)event->queue->data;
+  pocl_cuda_event_data_t *e_d = (pocl_cuda_event_data_t *)event->data;
 
-  if (event->status > CL_COMPLETE)
-    pocl_cuda_finalize_command (device, event);
+  while (event->status > CL_COMPLETE)
+    {
+      /* The dependencies can be in other queues, whose completed commands
+       * are only finalized by the threads waiting for them */
+      if (event->wait_list)
+        {
+          cl_event dep = event->wait_list->event;
+          if (dep->queue == NULL || dep->queue->device->ops != device->ops)
+            POCL_ABORT (
+                "Can't handle non-CUDA dependencies without queue threads\n");
+          pocl_cuda_wait_event_recurse (dep->queue->device, dep);
+          continue;
+        }
+
+      if (pthread_mutex_trylock (&queue_data->finalize_lock) == 0)
+        {
+          pocl_cuda_finalize_completed (device, queue_data);
+          PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->finalize_lock));
+        }
+      if (event->status <= CL_COMPLETE)
+        break;
+
+      /* Wait for the device with the CUDA event, which has the least
+       * latency, then for the completion callback, which follows it */
+      if (e_d && e_d->events_ready)
+        {
+          cuCtxSetCurrent (
+              ((pocl_cuda_device_data_t *)device->data)->context);
+          cuEventSynchronize (e_d->end);
+        }
+      pocl_cuda_wait_completed (queue_data, 1);
+    }
 }
 
 void
@@ -1728,15 +3993,7 @@ pocl_cuda_submit_thread (void *data)
 
       /* Submit command, if we found one */
       if (node)
-        {
-          pocl_cuda_submit_node (node, queue_data->queue, 0);
-
-          /* Add command to running queue */
-          PTHREAD_CHECK (pthread_mutex_lock (&queue_data->lock));
-          DL_APPEND (queue_data->running_queue, node);
-          PTHREAD_CHECK (pthread_cond_signal (&queue_data->running_cond));
-          PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
-        }
+        pocl_cuda_submit_node (node, queue_data->queue, 0);
     }
 
   return NULL;
@@ -1755,32 +4012,16 @@ pocl_cuda_finalize_thread (void *data)
     /* This queue has already been released */
     return NULL;
 
-  while (1)
+  /* Finalize the commands in batches, as their completion callbacks run.
+   * Wake up every millisecond while some wait for their dependencies, in
+   * case those complete without a callback to this queue. */
+  PTHREAD_CHECK (pthread_mutex_lock (&queue_data->finalize_lock));
+  while (queue_data->queue)
     {
-      /* Attempt to get next node from running queue */
-      _cl_command_node *node = NULL;
-      PTHREAD_CHECK (pthread_mutex_lock (&queue_data->lock));
-      if (!queue_data->queue)
-        {
-          PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
-          break;
-        }
-      if (!queue_data->running_queue)
-        {
-          PTHREAD_CHECK (pthread_cond_wait (&queue_data->running_cond,
-                                            &queue_data->lock));
-        }
-      if (queue_data->running_queue)
-        {
-          node = queue_data->running_queue;
-          DL_DELETE (queue_data->running_queue, node);
-        }
-      PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->lock));
-
-      /* Wait for command to finish, if we found one */
-      if (node)
-        pocl_cuda_finalize_command (queue->device, node->event);
+      pocl_cuda_wait_completed (queue_data, queue_data->ready != NULL);
+      pocl_cuda_finalize_completed (queue->device, queue_data);
     }
+  PTHREAD_CHECK (pthread_mutex_unlock (&queue_data->finalize_lock));
 
   return NULL;
 }
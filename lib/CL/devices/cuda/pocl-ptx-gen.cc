@@ -32,6 +32,7 @@
 
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LegacyPassManager.h"
@@ -50,6 +51,7 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
+#include <algorithm>
 #include <set>
 
 namespace llvm {
@@ -62,12 +64,16 @@ static void fixLocalMemArgs(llvm::Module *Module, const char *KernelName);
 static void fixPrintF(llvm::Module *Module);
 static void handleGetWorkDim(llvm::Module *Module, const char *KernelName);
 static void linkLibDevice(llvm::Module *Module, const char *KernelName,
-                          const char *LibDevicePath);
+                          const char *LibDevicePath, int MathFlags);
+static void mapImageIntrinsics(llvm::Module *Module);
 static void mapLibDeviceCalls(llvm::Module *Module);
+static void specializeLocalSize(llvm::Module *Module, const char *KernelName,
+                                const size_t *LocalSize);
 
 int pocl_ptx_gen(const char *BitcodeFilename, const char *PTXFilename,
                  const char *KernelName, const char *Arch,
-                 const char *LibDevicePath, int HasOffsets) {
+                 const char *LibDevicePath, int HasOffsets,
+                 const size_t *LocalSize, int MathFlags) {
   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
       llvm::MemoryBuffer::getFile(BitcodeFilename);
   if (!Buffer) {
@@ -90,8 +96,11 @@ int pocl_ptx_gen(const char *BitcodeFilename, const char *PTXFilename,
   fixLocalMemArgs(Module->get(), KernelName);
   handleGetWorkDim(Module->get(), KernelName);
   addKernelAnnotations(Module->get(), KernelName);
+  if (LocalSize)
+    specializeLocalSize(Module->get(), KernelName, LocalSize);
   mapLibDeviceCalls(Module->get());
-  linkLibDevice(Module->get(), KernelName, LibDevicePath);
+  mapImageIntrinsics(Module->get());
+  linkLibDevice(Module->get(), KernelName, LibDevicePath, MathFlags);
   if (pocl_get_bool_option("POCL_CUDA_DUMP_NVVM", 0)) {
     std::string ModuleString;
     llvm::raw_string_ostream ModuleStringStream(ModuleString);
@@ -128,8 +137,11 @@ int pocl_ptx_gen(const char *BitcodeFilename, const char *PTXFilename,
     return 1;
   }
 
-  // TODO: Set options?
+  // With fast math, the backend selects the approximate forms of the single
+  // precision division and square root.
   llvm::TargetOptions Options;
+  if (MathFlags & POCL_PTX_GEN_FAST_MATH)
+    Options.UnsafeFPMath = true;
 
   // TODO: CPU and features?
   std::unique_ptr<llvm::TargetMachine> Machine(
@@ -193,6 +205,47 @@ void addKernelAnnotations(llvm::Module *Module, const char *KernelName) {
   Annotations->addOperand(Node);
 }
 
+// Specialize the kernel for a block size: the reqntid annotations let ptxas
+// allocate the registers for exactly that many threads, and the reads of
+// the block size become constants, so the index math folds.
+void specializeLocalSize(llvm::Module *Module, const char *KernelName,
+                         const size_t *LocalSize) {
+  llvm::LLVMContext &Context = Module->getContext();
+  llvm::Type *I32 = llvm::Type::getInt32Ty(Context);
+  auto *Function = Module->getFunction(KernelName);
+  auto *Annotations = Module->getOrInsertNamedMetadata("nvvm.annotations");
+  static const char *const ReqNTid[] = {"reqntidx", "reqntidy", "reqntidz"};
+  static const char *const Intrinsics[] = {"llvm.nvvm.read.ptx.sreg.ntid.x",
+                                           "llvm.nvvm.read.ptx.sreg.ntid.y",
+                                           "llvm.nvvm.read.ptx.sreg.ntid.z"};
+  static const char *const Wrappers[] = {"get_nvvm_ntid_x", "get_nvvm_ntid_y",
+                                         "get_nvvm_ntid_z"};
+
+  for (unsigned Dim = 0; Dim < 3; ++Dim) {
+    llvm::Constant *Size = llvm::ConstantInt::get(I32, LocalSize[Dim]);
+    Annotations->addOperand(llvm::MDNode::get(
+        Context, {llvm::ValueAsMetadata::get(Function),
+                  llvm::MDString::get(Context, ReqNTid[Dim]),
+                  llvm::ConstantAsMetadata::get(Size)}));
+
+    for (const char *Name : {Intrinsics[Dim], Wrappers[Dim]}) {
+      llvm::Function *Read = Module->getFunction(Name);
+      if (!Read)
+        continue;
+      std::vector<llvm::CallInst *> Calls;
+      for (auto *U : Read->users())
+        if (auto *Call = llvm::dyn_cast<llvm::CallInst>(U))
+          if (Call->getCalledFunction() == Read)
+            Calls.push_back(Call);
+      for (auto *Call : Calls) {
+        Call->replaceAllUsesWith(
+            llvm::ConstantInt::get(Call->getType(), LocalSize[Dim]));
+        Call->eraseFromParent();
+      }
+    }
+  }
+}
+
 // PTX doesn't support variadic functions, so we need to modify the IR to
 // support printf. The vprintf system call that is provided is described here:
 // http://docs.nvidia.com/cuda/ptx-writers-guide-to-interoperability/index.html#system-calls
@@ -587,6 +640,40 @@ int findLibDevice(char LibDevicePath[PATH_MAX], const char *Arch) {
   return 1;
 }
 
+// Replace the __nvvm_reflect queries of libdevice for the precision of the
+// single precision division and square root with constants. NVVMReflect only
+// answers __CUDA_FTZ (from the module flag) and __CUDA_ARCH, and treats the
+// others as zero, which would select the approximate versions.
+static void resolvePrecisionReflect(llvm::Module *Module, bool Precise) {
+  llvm::Function *Reflect = Module->getFunction("__nvvm_reflect");
+  if (!Reflect)
+    return;
+
+  std::vector<llvm::User *> Users(Reflect->user_begin(), Reflect->user_end());
+  for (auto *U : Users) {
+    llvm::CallInst *Call = llvm::dyn_cast<llvm::CallInst>(U);
+    if (!Call)
+      continue;
+
+    // The argument is a (cast) pointer to a constant C string.
+    const llvm::GlobalVariable *Str = llvm::dyn_cast<llvm::GlobalVariable>(
+        Call->getArgOperand(0)->stripPointerCasts());
+    if (!Str || !Str->hasInitializer())
+      continue;
+    const llvm::ConstantDataSequential *Data =
+        llvm::dyn_cast<llvm::ConstantDataSequential>(Str->getInitializer());
+    if (!Data || !Data->isCString())
+      continue;
+    llvm::StringRef Name = Data->getAsCString();
+    if (Name != "__CUDA_PREC_DIV" && Name != "__CUDA_PREC_SQRT")
+      continue;
+
+    Call->replaceAllUsesWith(
+        llvm::ConstantInt::get(Call->getType(), Precise ? 1 : 0));
+    Call->eraseFromParent();
+  }
+}
+
 // Link CUDA's libdevice bitcode library to provide implementations for most of
 // the OpenCL math functions.
 // TODO: Can we link libdevice into the kernel library at pocl build time?
@@ -594,7 +681,7 @@ int findLibDevice(char LibDevicePath[PATH_MAX], const char *Arch) {
 // Had some issues with the earlier pocl LLVM passes crashing on the libdevice
 // code - needs more investigation.
 void linkLibDevice(llvm::Module *Module, const char *KernelName,
-                   const char *LibDevicePath) {
+                   const char *LibDevicePath, int MathFlags) {
   auto Buffer = llvm::MemoryBuffer::getFile(LibDevicePath);
   if (!Buffer)
     POCL_ABORT("[CUDA] failed to open libdevice library file\n");
@@ -626,17 +713,32 @@ void linkLibDevice(llvm::Module *Module, const char *KernelName,
   Passes.add(llvm::createInternalizePass(PreserveKernel));
 
   // Add NVVM reflect module flags to set math options.
-  // TODO: Determine correct FTZ value from frontend compiler options.
   llvm::LLVMContext &Context = Module->getContext();
+  int FTZ = (MathFlags & POCL_PTX_GEN_FTZ) ? 1 : 0;
   llvm::Type *I32 = llvm::Type::getInt32Ty(Context);
   llvm::Metadata *FourMD =
       llvm::ValueAsMetadata::get(llvm::ConstantInt::getSigned(I32, 4));
   llvm::Metadata *NameMD = llvm::MDString::get(Context, "nvvm-reflect-ftz");
-  llvm::Metadata *OneMD =
-      llvm::ConstantAsMetadata::get(llvm::ConstantInt::getSigned(I32, 1));
+  llvm::Metadata *FTZMD =
+      llvm::ConstantAsMetadata::get(llvm::ConstantInt::getSigned(I32, FTZ));
   llvm::MDNode *ReflectFlag =
-      llvm::MDNode::get(Context, {FourMD, NameMD, OneMD});
+      llvm::MDNode::get(Context, {FourMD, NameMD, FTZMD});
   Module->addModuleFlag(ReflectFlag);
+  resolvePrecisionReflect(Module, (MathFlags & POCL_PTX_GEN_FAST_MATH) == 0);
+
+  // The backend selects the .ftz forms of the single precision instructions
+  // by the denormal mode of the functions.
+  if (FTZ) {
+    for (llvm::Function &F : *Module) {
+      if (F.isDeclaration())
+        continue;
+#ifdef LLVM_OLDER_THAN_11_0
+      F.addFnAttr("nvptx-f32ftz", "true");
+#else
+      F.addFnAttr("denormal-fp-math-f32", "preserve-sign,preserve-sign");
+#endif
+    }
+  }
 
   // Run optimization passes to clean up unused functions etc.
   llvm::PassManagerBuilder Builder;
@@ -671,8 +773,11 @@ void convertPtrArgsToOffsets(llvm::Module *Module, const char *KernelName,
   for (auto &Arg : Function->args()) {
     // Check for local memory pointer.
     llvm::Type *ArgType = Arg.getType();
+    // The samplers are in the constant address space, but are passed by
+    // value, see pocl_cuda_submit_kernel.
     if (ArgType->isPointerTy() &&
-        ArgType->getPointerAddressSpace() == AddrSpace) {
+        ArgType->getPointerAddressSpace() == AddrSpace &&
+        !pocl::is_sampler_type(*ArgType)) {
       NeedsArgOffsets = true;
 
       // Create new argument for offset into shared memory allocation.
@@ -899,9 +1004,98 @@ void mapLibDeviceCalls(llvm::Module *Module) {
   }
 }
 
-int pocl_cuda_get_ptr_arg_alignment(const char *BitcodeFilename,
-                                    const char *KernelName,
-                                    size_t *Alignments) {
+static unsigned getVectorWidth(llvm::Type *Type) {
+#ifdef LLVM_OLDER_THAN_11_0
+  return llvm::cast<llvm::VectorType>(Type)->getNumElements();
+#else
+  return llvm::cast<llvm::FixedVectorType>(Type)->getNumElements();
+#endif
+}
+
+// Replace the calls of the texture and surface instructions of the CUDA
+// kernel library, __pocl_nvvm_X, with the NVVM intrinsics llvm.nvvm.X, the
+// underscores of X being dots. The intrinsics take and return the elements
+// of the vectors of the library declarations.
+void mapImageIntrinsics(llvm::Module *Module) {
+  const llvm::StringRef Prefix = "__pocl_nvvm_";
+  llvm::LLVMContext &Context = Module->getContext();
+
+  std::vector<llvm::Function *> Placeholders;
+  for (auto &Function : *Module)
+    if (Function.isDeclaration() && Function.getName().startswith(Prefix))
+      Placeholders.push_back(&Function);
+
+  for (llvm::Function *Function : Placeholders) {
+    std::string Name =
+        "llvm.nvvm." + Function->getName().substr(Prefix.size()).str();
+    std::replace(Name.begin(), Name.end(), '_', '.');
+
+    llvm::FunctionType *PlaceholderType = Function->getFunctionType();
+    std::vector<llvm::Type *> ParamTypes;
+    for (llvm::Type *Type : PlaceholderType->params()) {
+      if (Type->isVectorTy())
+        ParamTypes.insert(ParamTypes.end(), getVectorWidth(Type),
+                          llvm::cast<llvm::VectorType>(Type)->getElementType());
+      else
+        ParamTypes.push_back(Type);
+    }
+    llvm::Type *ResultType = PlaceholderType->getReturnType();
+    llvm::VectorType *ResultVector = llvm::dyn_cast<llvm::VectorType>(ResultType);
+    if (ResultVector)
+      ResultType = llvm::StructType::get(
+          Context, std::vector<llvm::Type *>(getVectorWidth(ResultVector),
+                                             ResultVector->getElementType()));
+    llvm::FunctionType *IntrinsicType =
+        llvm::FunctionType::get(ResultType, ParamTypes, false);
+#ifdef LLVM_OLDER_THAN_9_0
+    llvm::Constant *Intrinsic =
+        Module->getOrInsertFunction(Name, IntrinsicType);
+#else
+    llvm::FunctionCallee Intrinsic =
+        Module->getOrInsertFunction(Name, IntrinsicType);
+#endif
+
+    std::vector<llvm::Value *> Users(Function->user_begin(),
+                                     Function->user_end());
+    for (auto &U : Users) {
+      llvm::CallInst *Call = llvm::dyn_cast<llvm::CallInst>(U);
+      if (!Call)
+        continue;
+
+      llvm::IRBuilder<> Builder(Call);
+      std::vector<llvm::Value *> Args;
+      for (auto Arg = Call->arg_begin(); Arg != Call->arg_end(); ++Arg) {
+        llvm::Value *Value = Arg->get();
+        if (!Value->getType()->isVectorTy()) {
+          Args.push_back(Value);
+          continue;
+        }
+        for (unsigned i = 0; i < getVectorWidth(Value->getType()); ++i)
+          Args.push_back(Builder.CreateExtractElement(Value, i));
+      }
+
+      llvm::Value *Result = Builder.CreateCall(Intrinsic, Args);
+      if (ResultVector) {
+        llvm::Value *Vector = llvm::UndefValue::get(ResultVector);
+        for (unsigned i = 0; i < getVectorWidth(ResultVector); ++i)
+          Vector = Builder.CreateInsertElement(
+              Vector, Builder.CreateExtractValue(Result, i), i);
+        Result = Vector;
+      }
+      Result->takeName(Call);
+      Call->replaceAllUsesWith(Result);
+      Call->eraseFromParent();
+    }
+
+    if (Function->use_empty())
+      Function->eraseFromParent();
+  }
+}
+
+int pocl_cuda_get_arg_layout(const char *BitcodeFilename,
+                             const char *KernelName, size_t *Alignments,
+                             size_t *Offsets, unsigned *NumParams,
+                             size_t *ParamSize) {
   // Create buffer for bitcode file.
   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
       llvm::MemoryBuffer::getFile(BitcodeFilename);
@@ -924,18 +1118,42 @@ int pocl_cuda_get_ptr_arg_alignment(const char *BitcodeFilename,
   if (!Kernel)
     POCL_ABORT("[CUDA] kernel function not found in module\n");
 
-  // Calculate alignment for each argument.
+  // Calculate alignment for each argument, and lay out the parameters as
+  // they are after pocl_ptx_gen: local and constant pointers become 32-bit
+  // offsets, and the 32-bit work_dim is appended.
   const llvm::DataLayout &DL = (*Module)->getDataLayout();
+  size_t Offset = 0;
   for (auto &Arg : Kernel->args()) {
     unsigned i = Arg.getArgNo();
     llvm::Type *Type = Arg.getType();
-    if (!Type->isPointerTy())
+    size_t Size, Align;
+    if (!Type->isPointerTy()) {
       Alignments[i] = 0;
-    else {
+      Size = DL.getTypeAllocSize(Type);
+      Align = DL.getABITypeAlignment(Type);
+    } else {
       llvm::Type *ElemType = Type->getPointerElementType();
-      Alignments[i] = DL.getTypeAllocSize(ElemType);
+      // the images and the samplers point to opaque structs
+      Alignments[i] = ElemType->isSized() ? DL.getTypeAllocSize(ElemType) : 0;
+      unsigned AS = Type->getPointerAddressSpace();
+      if (Arg.hasByValAttr()) {
+        Size = DL.getTypeAllocSize(ElemType);
+        Align = DL.getABITypeAlignment(ElemType);
+      } else if ((AS == 3 || AS == 4) && !pocl::is_sampler_type(*Type)) {
+        Size = Align = sizeof(uint32_t);
+      } else {
+        Size = Align = DL.getPointerSize(AS);
+      }
     }
+    Offset = (Offset + Align - 1) & ~(Align - 1);
+    Offsets[i] = Offset;
+    Offset += Size;
   }
+  *NumParams = Kernel->arg_size();
+
+  Offset = (Offset + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+  Offsets[*NumParams] = Offset;
+  *ParamSize = Offset + sizeof(uint32_t);
 
   return 0;
 }
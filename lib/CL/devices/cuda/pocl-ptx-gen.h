@@ -35,22 +35,35 @@ extern "C"
 #define PATH_MAX 4096
 #endif
 
+/* The math options of pocl_ptx_gen, from the build options of the program. */
+/* FTZ flushes the single precision denormals to zero, FAST_MATH allows the */
+/* approximate single precision division and square root. */
+#define POCL_PTX_GEN_FTZ 0x1
+#define POCL_PTX_GEN_FAST_MATH 0x2
+
 /* Search for the libdevice bitcode library for the given GPU architecture. */
 /* Returns zero on success, non-zero on failure. */
 int findLibDevice(char LibDevicePath[PATH_MAX], const char *Arch);
 
 /* Generate a PTX file from an LLVM bitcode file. */
+/* If LocalSize is not NULL, the kernel is specialized for that block size. */
+/* MathFlags is a combination of the POCL_PTX_GEN_* math options. */
 /* Returns zero on success, non-zero on failure. */
 int pocl_ptx_gen (const char *BitcodeFilename, const char *PTXFilename,
                   const char *KernelName, const char *Arch,
-                  const char *LibDevicePath, int HasOffsets);
+                  const char *LibDevicePath, int HasOffsets,
+                  const size_t *LocalSize, int MathFlags);
 
 /* Populate the Alignments array with the required pointer alignments for */
-/* each kernel argument. */
+/* each kernel argument, and the Offsets array with the offset of each */
+/* parameter in the packed argument buffer of cuLaunchKernel. NumParams is */
+/* set to the number of kernel arguments in the bitcode; the work_dim */
+/* parameter added by pocl_ptx_gen follows them, at Offsets[*NumParams]. */
 /* Returns zero on success, non-zero on failure. */
-int pocl_cuda_get_ptr_arg_alignment(const char *BitcodeFilename,
-                                    const char *KernelName,
-                                    size_t *Alignments);
+int pocl_cuda_get_arg_layout(const char *BitcodeFilename,
+                             const char *KernelName, size_t *Alignments,
+                             size_t *Offsets, unsigned *NumParams,
+                             size_t *ParamSize);
 
 #ifdef __cplusplus
 }
@@ -44,10 +44,14 @@
 
 #include "common.h"
 #include "devices.h"
+#include "pocl_autotune.h"
 #include "pocl_cache.h"
 #include "pocl_debug.h"
+#include "pocl_perf_counters.h"
 #include "pocl_runtime_config.h"
 #include "pocl_shared.h"
+#include "pocl_stats.h"
+#include "pocl_timing.h"
 #include "pocl_tracing.h"
 #include "pocl_util.h"
 
@@ -82,6 +86,10 @@
 #include "proxy/pocl_proxy.h"
 #endif
 
+#ifdef BUILD_REMOTE_CLIENT
+#include "remote/pocl_remote.h"
+#endif
+
 #ifdef BUILD_VULKAN
 #include "vulkan/pocl-vulkan.h"
 #endif
@@ -145,6 +153,9 @@ static init_device_ops pocl_devices_init_ops[] = {
 #ifdef BUILD_PROXY
   INIT_DEV (proxy),
 #endif
+#ifdef BUILD_REMOTE_CLIENT
+  INIT_DEV (remote),
+#endif
 #ifdef BUILD_VULKAN
   INIT_DEV (vulkan),
 #endif
@@ -174,6 +185,9 @@ char pocl_device_types[POCL_NUM_DEVICE_TYPES][30] = {
 #ifdef BUILD_PROXY
   "proxy",
 #endif
+#ifdef BUILD_REMOTE_CLIENT
+  "remote",
+#endif
 #ifdef BUILD_VULKAN
   "vulkan",
 #endif
@@ -378,6 +392,7 @@ pocl_uninit_devices ()
               retval = ret;
               goto FINISH;
             }
+          d->deferred_init_done = 0;
 #ifdef ENABLE_LOADABLE_DRIVERS
           if (pocl_device_handles[i] != NULL)
             {
@@ -441,6 +456,110 @@ FINISH:
   return retval;
 }
 
+/* The devices of one driver whose deferred initialization is pending. */
+typedef struct
+{
+  struct pocl_device_ops *ops;
+  cl_device_id *devices;
+  unsigned num_devices;
+  cl_int errcode;
+  pocl_thread_t thread;
+} deferred_init_job;
+
+static void *
+run_deferred_init (void *arg)
+{
+  deferred_init_job *job = (deferred_init_job *)arg;
+  unsigned i;
+
+  for (i = 0; i < job->num_devices; ++i)
+    {
+      cl_device_id dev = job->devices[i];
+      uint64_t start = pocl_gettimemono_ns ();
+      job->errcode = job->ops->init_deferred (dev);
+      if (job->errcode != CL_SUCCESS)
+        {
+          POCL_MSG_ERR ("Deferred initialization of %s failed\n",
+                        dev->long_name);
+          break;
+        }
+      dev->deferred_init_done = 1;
+      POCL_MSG_PRINT_GENERAL ("Deferred initialization of %s took %" PRIu64
+                              " us\n",
+                              dev->long_name,
+                              (pocl_gettimemono_ns () - start) / 1000);
+    }
+  return NULL;
+}
+
+cl_int
+pocl_init_deferred_devices (cl_uint num_devices, const cl_device_id *devices)
+{
+  deferred_init_job *jobs;
+  cl_device_id *pending;
+  unsigned i, j, num_jobs = 0;
+  cl_int errcode = CL_SUCCESS;
+
+  POCL_LOCK (pocl_init_lock);
+
+  jobs = (deferred_init_job *)alloca (num_devices * sizeof (deferred_init_job));
+  pending = (cl_device_id *)alloca (num_devices * sizeof (cl_device_id));
+
+  /* One job per driver whose devices are pending. The devices of a driver
+   * are set up one after another, since they might share its state. */
+  for (i = 0; i < num_devices; ++i)
+    {
+      cl_device_id dev = devices[i];
+      if (dev->ops->init_deferred == NULL || dev->deferred_init_done)
+        continue;
+      for (j = 0; j < num_jobs; ++j)
+        if (jobs[j].ops == dev->ops)
+          break;
+      if (j == num_jobs)
+        {
+          jobs[j].ops = dev->ops;
+          jobs[j].num_devices = 0;
+          jobs[j].errcode = CL_SUCCESS;
+          ++num_jobs;
+        }
+      ++jobs[j].num_devices;
+    }
+
+  if (num_jobs == 0)
+    goto FINISH;
+
+  /* give each job its slice of pending */
+  for (j = 0; j < num_jobs; ++j)
+    {
+      jobs[j].devices = pending;
+      pending += jobs[j].num_devices;
+      jobs[j].num_devices = 0;
+    }
+  for (i = 0; i < num_devices; ++i)
+    {
+      cl_device_id dev = devices[i];
+      if (dev->ops->init_deferred == NULL || dev->deferred_init_done)
+        continue;
+      for (j = 0; jobs[j].ops != dev->ops; ++j)
+        ;
+      jobs[j].devices[jobs[j].num_devices++] = dev;
+    }
+
+  for (j = 1; j < num_jobs; ++j)
+    POCL_CREATE_THREAD (jobs[j].thread, run_deferred_init, &jobs[j]);
+  run_deferred_init (&jobs[0]);
+  for (j = 1; j < num_jobs; ++j)
+    POCL_JOIN_THREAD (jobs[j].thread);
+
+  for (j = 0; j < num_jobs; ++j)
+    if (jobs[j].errcode != CL_SUCCESS)
+      errcode = jobs[j].errcode;
+
+FINISH:
+  POCL_UNLOCK (pocl_init_lock);
+  return errcode;
+}
+
 cl_int
 pocl_init_devices ()
 {
@@ -490,7 +609,11 @@ pocl_init_devices ()
   POCL_GOTO_ERROR_ON ((pocl_cache_init_topdir ()), CL_DEVICE_NOT_FOUND,
                       "Cache directory initialization failed");
 
+  pocl_timing_init (pocl_get_bool_option ("POCL_TSC_TIMER", 1));
+  pocl_perf_counters_init ();
+  pocl_stats_init ();
   pocl_event_tracing_init ();
+  pocl_autotune_init ();
 
 #ifdef HAVE_SLEEP
   int delay = pocl_get_int_option ("POCL_STARTUP_DELAY", 0);
@@ -49,6 +49,11 @@ cl_int pocl_init_devices();
 
 cl_int pocl_uninit_devices ();
 
+/* Runs the deferred initialization (pocl_device_ops.init_deferred) of the
+ * devices that have not had it yet, one thread per driver. */
+cl_int pocl_init_deferred_devices (cl_uint num_devices,
+                                   const cl_device_id *devices);
+
 /**
  * \brief Get the count of devices for a specific type
  * \param device_type the device type for which we want the count of devices
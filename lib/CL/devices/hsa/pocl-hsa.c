@@ -108,15 +108,39 @@
    when clReleaseKernel is called to get a safe point where to release the
    kernel entry from the inmemory cache. */
 #define HSA_KERNEL_CACHE_SIZE 4096
+/* Number of hash chains the kernel cache entries are linked to. */
+#define HSA_KERNEL_CACHE_BUCKETS 1024
 #define COMMAND_LIST_SIZE 4096
 #define EVENT_LIST_SIZE 511
+/* Size of the preallocated kernel argument slots. Launches with a larger
+   kernarg segment allocate their own. */
+#define HSA_KERNARG_SLOT_SIZE 2048
+/* Maximum number of running kernels a kernel can wait for on the agent,
+   through barrier-AND packets, instead of waiting for them on the host. */
+#define HSA_BARRIER_DEPS 15
+/* Dependency signals of a barrier-AND packet */
+#define HSA_BARRIER_AND_SIGNALS 5
 
 typedef struct pocl_hsa_event_data_s {
   /* Address of the space where this kernel launch's arguments were stored. */
   void *kernargs;
+  /* Index of the kernarg pool slot the arguments are in, or -1 if they
+     were allocated separately. */
+  int kernarg_slot;
   /* The location of the pocl context struct in the Agent's global mem. */
   void *context;
   pthread_cond_t event_cond;
+
+  /* The completion signal of the kernel, 0 handle until it's launched. */
+  hsa_signal_t signal;
+  /* The signal is destroyed once the kernel has finished and the kernels
+     whose barrier-AND packets wait on it have finished too. */
+  unsigned signal_users;
+  int finished;
+  /* The kernels this kernel waits for with barrier-AND packets, retained
+     until it finishes. */
+  cl_event barrier_deps[HSA_BARRIER_DEPS];
+  unsigned num_barrier_deps;
 } pocl_hsa_event_data_t;
 
 /* Simple statically-sized kernel data cache */
@@ -146,6 +170,9 @@ typedef struct pocl_hsa_kernel_cache_s {
   /* Maximum grid dimension this WG function works with. */
   size_t max_grid_dim_width;
 
+  /* 1 + index of the next entry in the same hash chain, 0 ends it. */
+  unsigned next;
+
 } pocl_hsa_kernel_cache_t;
 
 /* data for driver pthread */
@@ -156,9 +183,21 @@ typedef struct pocl_hsa_device_pthread_data_s {
   size_t running_list_size;
 
   /* Queue list (for pushing work to the agent);
-   * multiple queues per device */
+   * multiple queues per device, the kernels of an OpenCL command queue
+   * always go to the same one */
   hsa_queue_t **queues;
-  size_t num_queues, last_queue;
+  size_t num_queues;
+
+  /* Kernel argument slots of HSA_KERNARG_SLOT_SIZE bytes, one per running
+   * event, allocated once from the kernarg region; and the stack of the
+   * free slot indices */
+  char *kernarg_pool;
+  unsigned kernarg_free[EVENT_LIST_SIZE];
+  unsigned kernarg_num_free;
+
+  /* kernels moved from the wait list to the ready list ahead of the
+   * completion of the kernels they wait for */
+  cl_event promoted[COMMAND_LIST_SIZE + 1];
 } pocl_hsa_device_pthread_data_t;
 
 typedef struct pocl_hsa_device_data_s {
@@ -174,6 +213,8 @@ typedef struct pocl_hsa_device_data_s {
   /* Per-program data cache to simplify program compiling stage */
   pocl_hsa_kernel_cache_t kernel_cache[HSA_KERNEL_CACHE_SIZE];
   unsigned kernel_cache_lastptr;
+  /* 1 + index of the first entry of each hash chain, 0 if empty */
+  unsigned kernel_cache_buckets[HSA_KERNEL_CACHE_BUCKETS];
 
   /* kernel signal wait timeout hint, in HSA runtime units */
   uint64_t timeout;
@@ -1115,13 +1156,128 @@ compile_parallel_bc_to_brig (char *brigfile, _cl_command_node *cmd,
   return 0;
 }
 
+/* The path of the finalized code object of the work-group function, next
+   to its BRIG file in the kernel cache directory, which also puts it in the
+   poclbinary of the program. */
+static void
+pocl_hsa_code_object_path (char *path, _cl_command_node *cmd, int specialize)
+{
+  _cl_command_run *run_cmd = &cmd->command.run;
+  pocl_cache_work_group_function_path (path, run_cmd->kernel->program,
+                                       cmd->program_device_i, run_cmd->kernel,
+                                       cmd, specialize);
+  strncat (path, ".hsaco", POCL_FILENAME_LENGTH - 1);
+}
+
+static hsa_status_t
+pocl_hsa_serialize_alloc (size_t size, hsa_callback_data_t data,
+                          void **address)
+{
+  *address = malloc (size);
+  return *address ? HSA_STATUS_SUCCESS : HSA_STATUS_ERROR_OUT_OF_RESOURCES;
+}
+
+/* Finalizes the BRIG of the work-group function for the agent, and stores
+   the code object in the cache for the next runs. */
+static void
+pocl_hsa_finalize_brig (pocl_hsa_device_data_t *d, _cl_command_node *cmd,
+                        int specialize, const char *code_object_path,
+                        hsa_code_object_t *code_object)
+{
+  char brigfile[POCL_FILENAME_LENGTH];
+  char *brig_blob;
+
+  if (compile_parallel_bc_to_brig (brigfile, cmd, specialize))
+    POCL_ABORT("Compiling LLVM IR -> HSAIL -> BRIG failed.\n");
+
+  POCL_MSG_PRINT_HSA ("loading binary from file %s.\n", brigfile);
+  uint64_t filesize = 0;
+  int read = pocl_read_file(brigfile, &brig_blob, &filesize);
+
+  if (read != 0)
+    POCL_ABORT("pocl-hsa: could not read the binary.\n");
+
+  POCL_MSG_PRINT_HSA ("BRIG binary size: %lu.\n", filesize);
+
+  hsa_ext_module_t hsa_module = (hsa_ext_module_t)brig_blob;
+
+  hsa_ext_program_t hsa_program;
+  memset (&hsa_program, 0, sizeof (hsa_ext_program_t));
+
+  HSA_CHECK(hsa_ext_program_create
+    (HSA_MACHINE_MODEL_LARGE, HSA_PROFILE_FULL,
+     HSA_DEFAULT_FLOAT_ROUNDING_MODE_DEFAULT, NULL,
+     &hsa_program));
+
+  HSA_CHECK(hsa_ext_program_add_module (hsa_program, hsa_module));
+
+  hsa_isa_t isa;
+  HSA_CHECK(hsa_agent_get_info (d->agent, HSA_AGENT_INFO_ISA, &isa));
+
+  hsa_ext_control_directives_t control_directives;
+  memset (&control_directives, 0, sizeof (hsa_ext_control_directives_t));
+
+  HSA_CHECK(hsa_ext_program_finalize
+    (hsa_program, isa, 0, control_directives, "",
+     HSA_CODE_OBJECT_TYPE_PROGRAM, code_object));
+
+  HSA_CHECK(hsa_ext_program_destroy(hsa_program));
+
+  free (brig_blob);
+
+  void *serialized;
+  size_t serialized_size;
+  if (hsa_code_object_serialize (*code_object, pocl_hsa_serialize_alloc,
+                                 (hsa_callback_data_t){ 0 }, "", &serialized,
+                                 &serialized_size)
+      == HSA_STATUS_SUCCESS)
+    {
+      if (pocl_write_file (code_object_path, serialized, serialized_size, 0,
+                           0))
+        POCL_MSG_WARN ("pocl-hsa: could not write the code object to %s\n",
+                       code_object_path);
+      free (serialized);
+    }
+}
+
+/* The hash chain of the cache entries of the kernel with the given hash,
+   specialized to the given local size. */
+static unsigned
+pocl_hsa_kernel_cache_bucket (const pocl_kernel_hash_t hash, uint64_t local_x,
+                              uint64_t local_y, uint64_t local_z)
+{
+  uint64_t h;
+  memcpy (&h, hash, sizeof (h));
+  h ^= local_x * 0x9E3779B97F4A7C15ULL;
+  h ^= local_y * 0xC2B2AE3D27D4EB4FULL;
+  h ^= local_z * 0x165667B19E3779F9ULL;
+  h ^= h >> 29;
+  return (unsigned)(h % HSA_KERNEL_CACHE_BUCKETS);
+}
+
+/* Links the just filled cache entry i to its hash chain. */
+static void
+pocl_hsa_kernel_cache_link (pocl_hsa_device_data_t *d, unsigned i)
+{
+  pocl_hsa_kernel_cache_t *e = &d->kernel_cache[i];
+  unsigned b = pocl_hsa_kernel_cache_bucket (e->kernel_hash, e->local_x,
+                                             e->local_y, e->local_z);
+  e->next = d->kernel_cache_buckets[b];
+  d->kernel_cache_buckets[b] = i + 1;
+}
+
 static pocl_hsa_kernel_cache_t *
 pocl_hsa_find_mem_cached_kernel (pocl_hsa_device_data_t *d,
                                  _cl_command_run *cmd)
 {
-  size_t i;
-  for (i = 0; i < HSA_KERNEL_CACHE_SIZE; i++)
+  unsigned i, next;
+  unsigned b = pocl_hsa_kernel_cache_bucket (
+      cmd->hash, cmd->pc.local_size[0], cmd->pc.local_size[1],
+      cmd->pc.local_size[2]);
+  for (next = d->kernel_cache_buckets[b]; next != 0;
+       next = d->kernel_cache[i].next)
     {
+      i = next - 1;
       if (((d->kernel_cache[i].kernel == NULL)
            || (memcmp (d->kernel_cache[i].kernel_hash, cmd->hash,
                        sizeof (pocl_kernel_hash_t))
@@ -1237,6 +1393,7 @@ pocl_hsa_compile_kernel_native (_cl_command_node *cmd, cl_kernel kernel,
                 ? SIZE_MAX
                 : device->grid_width_specialization_limit;
       d->kernel_cache[i].hsa_exe.handle = exe.handle;
+      pocl_hsa_kernel_cache_link (d, i);
       d->kernel_cache_lastptr++;
     }
   else
@@ -1286,9 +1443,6 @@ void
 pocl_hsa_compile_kernel_hsail (_cl_command_node *cmd, cl_kernel kernel,
                                cl_device_id device, int specialize)
 {
-  char brigfile[POCL_FILENAME_LENGTH];
-  char *brig_blob;
-
   pocl_hsa_device_data_t *d = (pocl_hsa_device_data_t*)device->data;
 
   hsa_executable_t final_obj;
@@ -1314,40 +1468,26 @@ pocl_hsa_compile_kernel_hsail (_cl_command_node *cmd, cl_kernel kernel,
         return;
     }
 
-  if (compile_parallel_bc_to_brig (brigfile, cmd, specialize))
-    POCL_ABORT("Compiling LLVM IR -> HSAIL -> BRIG failed.\n");
-
-  POCL_MSG_PRINT_HSA ("loading binary from file %s.\n", brigfile);
-  uint64_t filesize = 0;
-  int read = pocl_read_file(brigfile, &brig_blob, &filesize);
-
-  if (read != 0)
-    POCL_ABORT("pocl-hsa: could not read the binary.\n");
-
-  POCL_MSG_PRINT_HSA ("BRIG binary size: %lu.\n", filesize);
-
-  hsa_ext_module_t hsa_module = (hsa_ext_module_t)brig_blob;
-
-  hsa_ext_program_t hsa_program;
-  memset (&hsa_program, 0, sizeof (hsa_ext_program_t));
-
-  HSA_CHECK(hsa_ext_program_create
-    (HSA_MACHINE_MODEL_LARGE, HSA_PROFILE_FULL,
-     HSA_DEFAULT_FLOAT_ROUNDING_MODE_DEFAULT, NULL,
-     &hsa_program));
-
-  HSA_CHECK(hsa_ext_program_add_module (hsa_program, hsa_module));
-
-  hsa_isa_t isa;
-  HSA_CHECK(hsa_agent_get_info (d->agent, HSA_AGENT_INFO_ISA, &isa));
-
-  hsa_ext_control_directives_t control_directives;
-  memset (&control_directives, 0, sizeof (hsa_ext_control_directives_t));
-
+  /* A code object finalized by an earlier run is loaded as is. */
+  char code_object_path[POCL_FILENAME_LENGTH];
+  char *code_object_blob;
+  uint64_t code_object_size = 0;
   hsa_code_object_t code_object;
-  HSA_CHECK(hsa_ext_program_finalize
-    (hsa_program, isa, 0, control_directives, "",
-     HSA_CODE_OBJECT_TYPE_PROGRAM, &code_object));
+  pocl_hsa_code_object_path (code_object_path, cmd, specialize);
+  if (pocl_exists (code_object_path)
+      && pocl_read_file (code_object_path, &code_object_blob,
+                         &code_object_size)
+             == 0)
+    {
+      POCL_MSG_PRINT_HSA ("loading code object from file %s.\n",
+                          code_object_path);
+      HSA_CHECK (hsa_code_object_deserialize (
+          code_object_blob, code_object_size, "", &code_object));
+      free (code_object_blob);
+    }
+  else
+    pocl_hsa_finalize_brig (d, cmd, specialize, code_object_path,
+                            &code_object);
 
   HSA_CHECK(hsa_executable_create (d->agent_profile,
                                   HSA_EXECUTABLE_STATE_UNFROZEN,
@@ -1358,10 +1498,6 @@ pocl_hsa_compile_kernel_hsail (_cl_command_node *cmd, cl_kernel kernel,
 
   HSA_CHECK(hsa_executable_freeze (final_obj, NULL));
 
-  HSA_CHECK(hsa_ext_program_destroy(hsa_program));
-
-  free (brig_blob);
-
   i = d->kernel_cache_lastptr;
   if (i < HSA_KERNEL_CACHE_SIZE)
     {
@@ -1369,6 +1505,7 @@ pocl_hsa_compile_kernel_hsail (_cl_command_node *cmd, cl_kernel kernel,
       memcpy (d->kernel_cache[i].kernel_hash, cmd->command.run.hash,
               sizeof (pocl_kernel_hash_t));
       d->kernel_cache[i].hsa_exe.handle = final_obj.handle;
+      pocl_hsa_kernel_cache_link (d, i);
       d->kernel_cache_lastptr++;
     }
   else
@@ -1503,6 +1640,31 @@ pocl_hsa_get_timer_value(void *data)
   } \
   while (0)
 
+/* Returns true if the event is a kernel that only waits for kernels
+   already launched to the agent, which barrier-AND packets can order it
+   after. Called with the event locked. */
+static int
+pocl_hsa_deps_launched (cl_device_id device, cl_event event)
+{
+  event_node *n;
+  unsigned num_deps = 0;
+
+  if (event->command->type != CL_COMMAND_NDRANGE_KERNEL)
+    return 0;
+  LL_FOREACH (event->wait_list, n)
+    {
+      cl_event dep = n->event;
+      if (dep->queue == NULL || dep->queue->device != device
+          || dep->command_type != CL_COMMAND_NDRANGE_KERNEL)
+        return 0;
+      pocl_hsa_event_data_t *dep_data = (pocl_hsa_event_data_t *)dep->data;
+      if (dep_data == NULL || dep_data->signal.handle == 0
+          || ++num_deps > HSA_BARRIER_DEPS)
+        return 0;
+    }
+  return 1;
+}
+
 void
 pocl_hsa_submit (_cl_command_node *node, cl_command_queue cq)
 {
@@ -1513,7 +1675,8 @@ pocl_hsa_submit (_cl_command_node *node, cl_command_queue cq)
   PTHREAD_CHECK (pthread_mutex_lock (&d->list_mutex));
 
   node->ready = 1;
-  if (pocl_command_is_ready (node->event))
+  if (pocl_command_is_ready (node->event)
+      || pocl_hsa_deps_launched (device, node->event))
     {
       pocl_update_event_submitted (node->event);
       PN_ADD(d->ready_list, node->event);
@@ -1598,34 +1761,32 @@ pocl_hsa_notify (cl_device_id device, cl_event event, cl_event finished)
   if (!node->ready)
     return;
 
-  if (pocl_command_is_ready (event))
+  /* already on the ready list, behind barrier-AND packets */
+  if (event->status != CL_QUEUED)
+    return;
+
+  if (pocl_command_is_ready (event)
+      || pocl_hsa_deps_launched (device, event))
     {
-      if (event->status == CL_QUEUED)
+      pocl_update_event_submitted (event);
+      PTHREAD_CHECK(pthread_mutex_lock(&d->list_mutex));
+
+      size_t i = 0;
+      for(i = 0; i < d->wait_list_size; i++)
+        if (d->wait_list[i] == event)
+          break;
+      if (i < d->wait_list_size)
         {
-          pocl_update_event_submitted (event);
-          PTHREAD_CHECK(pthread_mutex_lock(&d->list_mutex));
-
-          size_t i = 0;
-          for(i = 0; i < d->wait_list_size; i++)
-            if (d->wait_list[i] == event)
-              break;
-          if (i < d->wait_list_size)
-            {
-              POCL_MSG_PRINT_INFO("event %" PRIu64 " wait_list -> ready_list\n",
-                                  event->id);
-              PN_ADD(d->ready_list, event);
-              PN_REMOVE(d->wait_list, i);
-            }
-          else
-            POCL_ABORT("cant move event %" PRIu64 " from waitlist to"
-                       " readylist - not found in waitlist\n", event->id);
-          added_to_readylist = 1;
-          PTHREAD_CHECK(pthread_mutex_unlock(&d->list_mutex));
+          POCL_MSG_PRINT_INFO("event %" PRIu64 " wait_list -> ready_list\n",
+                              event->id);
+          PN_ADD(d->ready_list, event);
+          PN_REMOVE(d->wait_list, i);
         }
       else
-        POCL_MSG_WARN ("node->ready was 1 but event %" PRIu64 " is"
-                       " not queued: status %i!\n",
-                       event->id, event->status);
+        POCL_ABORT("cant move event %" PRIu64 " from waitlist to"
+                   " readylist - not found in waitlist\n", event->id);
+      added_to_readylist = 1;
+      PTHREAD_CHECK(pthread_mutex_unlock(&d->list_mutex));
     }
 
   if (added_to_readylist)
@@ -1674,6 +1835,57 @@ static hsa_signal_condition_t less_than_sigcond_array[EVENT_LIST_SIZE + 1];
 static int signal_array_initialized = 0;
 #endif
 
+/* Reserves a packet slot in the queue, waiting while it is full. */
+static uint64_t
+pocl_hsa_reserve_packet (hsa_queue_t *queue, size_t queue_index)
+{
+  uint64_t packet_id = hsa_queue_add_write_index_relaxed (queue, 1);
+  while ((packet_id - hsa_queue_load_read_index_acquire (queue))
+         >= queue->size)
+    {
+      /* device queue is full. TODO this isn't the optimal solution */
+      POCL_MSG_WARN("pocl-hsa: queue %" PRIuS " overloaded\n", queue_index);
+      usleep(2000);
+    }
+  return packet_id;
+}
+
+/* Writes barrier-AND packets to the queue that block the packets after
+   them until the given signals have reached zero. */
+static void
+pocl_hsa_write_barriers (hsa_queue_t *queue, size_t queue_index,
+                         const hsa_signal_t *signals, unsigned num_signals)
+{
+  const uint64_t queue_mask = queue->size - 1;
+  unsigned i, j;
+
+  for (i = 0; i < num_signals; i += HSA_BARRIER_AND_SIGNALS)
+    {
+      uint64_t packet_id = pocl_hsa_reserve_packet (queue, queue_index);
+      hsa_barrier_and_packet_t *barrier
+          = &(((hsa_barrier_and_packet_t *)(queue->base_address))
+                  [packet_id & queue_mask]);
+
+      barrier->reserved1 = 0;
+      for (j = 0; j < HSA_BARRIER_AND_SIGNALS; j++)
+        barrier->dep_signal[j].handle
+            = (i + j < num_signals) ? signals[i + j].handle : 0;
+      barrier->reserved2 = 0;
+      barrier->completion_signal.handle = 0;
+
+      uint16_t header = (uint16_t)HSA_FENCE_SCOPE_SYSTEM
+                        << HSA_PACKET_HEADER_ACQUIRE_FENCE_SCOPE;
+      header |= (uint16_t)HSA_FENCE_SCOPE_SYSTEM
+                << HSA_PACKET_HEADER_RELEASE_FENCE_SCOPE;
+      header |= (uint16_t)HSA_PACKET_TYPE_BARRIER_AND
+                << HSA_PACKET_HEADER_TYPE;
+      __atomic_store_n ((uint32_t *)(&barrier->header), (uint32_t)header,
+                        __ATOMIC_RELEASE);
+
+      hsa_signal_store_relaxed (queue->doorbell_signal, packet_id);
+    }
+}
+
 static void
 pocl_hsa_launch (pocl_hsa_device_data_t *d, cl_event event)
 {
@@ -1691,25 +1903,49 @@ pocl_hsa_launch (pocl_hsa_device_data_t *d, cl_event event)
       = pocl_hsa_find_mem_cached_kernel (d, run_cmd);
   assert (cached_data);
 
-  HSA_CHECK(hsa_memory_allocate (d->kernarg_region,
-				 cached_data->args_segment_size,
-				 &event_data->kernargs));
-
-  dd->last_queue = (dd->last_queue + 1) % dd->num_queues;
-  hsa_queue_t* last_queue = dd->queues[dd->last_queue];
-  const uint64_t queue_mask = last_queue->size - 1;
+  if (cached_data->args_segment_size <= HSA_KERNARG_SLOT_SIZE
+      && dd->kernarg_num_free > 0)
+    {
+      unsigned slot = dd->kernarg_free[--dd->kernarg_num_free];
+      event_data->kernarg_slot = (int)slot;
+      event_data->kernargs
+          = dd->kernarg_pool + (size_t)slot * HSA_KERNARG_SLOT_SIZE;
+    }
+  else
+    {
+      event_data->kernarg_slot = -1;
+      HSA_CHECK (hsa_memory_allocate (d->kernarg_region,
+                                      cached_data->args_segment_size,
+                                      &event_data->kernargs));
+    }
 
-  uint64_t packet_id = hsa_queue_add_write_index_relaxed (last_queue, 1);
-  while ((packet_id - hsa_queue_load_read_index_acquire (last_queue))
-         >= last_queue->size)
+  /* The kernels still in the wait list are running on the agent; wait for
+     them there. */
+  hsa_signal_t dep_signals[HSA_BARRIER_DEPS];
+  event_node *n;
+  event_data->num_barrier_deps = 0;
+  LL_FOREACH (event->wait_list, n)
     {
-      /* device queue is full. TODO this isn't the optimal solution */
-      POCL_MSG_WARN("pocl-hsa: queue %" PRIuS " overloaded\n", dd->last_queue);
-      usleep(2000);
+      pocl_hsa_event_data_t *dep_data
+          = (pocl_hsa_event_data_t *)n->event->data;
+      assert (event_data->num_barrier_deps < HSA_BARRIER_DEPS);
+      assert (dep_data->signal.handle != 0);
+      dep_data->signal_users++;
+      dep_signals[event_data->num_barrier_deps] = dep_data->signal;
+      event_data->barrier_deps[event_data->num_barrier_deps++] = n->event;
     }
 
+  size_t queue_index = event->queue->id % dd->num_queues;
+  hsa_queue_t *queue = dd->queues[queue_index];
+  const uint64_t queue_mask = queue->size - 1;
+
+  pocl_hsa_write_barriers (queue, queue_index, dep_signals,
+                           event_data->num_barrier_deps);
+
+  uint64_t packet_id = pocl_hsa_reserve_packet (queue, queue_index);
+
   kernel_packet =
-      &(((hsa_kernel_dispatch_packet_t*)(last_queue->base_address))
+      &(((hsa_kernel_dispatch_packet_t*)(queue->base_address))
         [packet_id & queue_mask]);
 
   if (!HSAIL_ENABLED && !d->device->spmd)
@@ -1764,6 +2000,9 @@ pocl_hsa_launch (pocl_hsa_device_data_t *d, cl_event event)
 
   HSA_CHECK (
       hsa_signal_create (1, 1, &d->agent, &kernel_packet->completion_signal));
+  event_data->signal = kernel_packet->completion_signal;
+  event_data->signal_users = 0;
+  event_data->finished = 0;
 
   setup_kernel_args (d, cmd, event_data,
                      cached_data->args_segment_size, &total_group_size);
@@ -1803,7 +2042,7 @@ pocl_hsa_launch (pocl_hsa_device_data_t *d, cl_event event)
                     __ATOMIC_RELEASE);
 
   /* ring the doorbell to start execution */
-  hsa_signal_store_relaxed (last_queue->doorbell_signal, packet_id);
+  hsa_signal_store_relaxed (queue->doorbell_signal, packet_id);
 
   if (dd->running_list_size > EVENT_LIST_SIZE)
     POCL_ABORT("running events list too big\n");
@@ -1816,6 +2055,18 @@ pocl_hsa_launch (pocl_hsa_device_data_t *d, cl_event event)
 
   pocl_update_event_running_unlocked (event);
   POCL_UNLOCK_OBJ (event);
+
+  /* They cannot complete before this thread finishes them. */
+  for (i = 0; i < event_data->num_barrier_deps; i++)
+    POname (clRetainEvent) (event_data->barrier_deps[i]);
+}
+
+/* Destroys the completion signal of a kernel once nothing waits on it. */
+static void
+pocl_hsa_release_signal (pocl_hsa_event_data_t *event_data)
+{
+  if (event_data->finished && event_data->signal_users == 0)
+    hsa_signal_destroy (event_data->signal);
 }
 
 static void
@@ -1844,10 +2095,24 @@ pocl_hsa_ndrange_event_finished (pocl_hsa_device_data_t *d, size_t i)
                              "HSA NDrange Kernel (HSA clock)", j);
 #endif
 
-  hsa_signal_destroy (dd->running_signals[i]);
+  event_data->finished = 1;
+  pocl_hsa_release_signal (event_data);
   dd->running_signals[i] = dd->running_signals[dd->running_list_size];
 
-  hsa_memory_free (event_data->kernargs);
+  unsigned j;
+  for (j = 0; j < event_data->num_barrier_deps; j++)
+    {
+      pocl_hsa_event_data_t *dep_data
+          = (pocl_hsa_event_data_t *)event_data->barrier_deps[j]->data;
+      dep_data->signal_users--;
+      pocl_hsa_release_signal (dep_data);
+    }
+
+  if (event_data->kernarg_slot >= 0)
+    dd->kernarg_free[dd->kernarg_num_free++]
+        = (unsigned)event_data->kernarg_slot;
+  else
+    hsa_memory_free (event_data->kernargs);
   hsa_memory_free (event_data->context);
 
   POCL_UNLOCK_OBJ (event);
@@ -1858,54 +2123,144 @@ pocl_hsa_ndrange_event_finished (pocl_hsa_device_data_t *d, size_t i)
       bzero (d->printf_write_pos, sizeof (size_t));
     }
 
+  unsigned num_barrier_deps = event_data->num_barrier_deps;
+  cl_event barrier_deps[HSA_BARRIER_DEPS];
+  memcpy (barrier_deps, event_data->barrier_deps,
+          num_barrier_deps * sizeof (cl_event));
+
   POCL_UPDATE_EVENT_COMPLETE (event);
+
+  for (j = 0; j < num_barrier_deps; j++)
+    POname (clReleaseEvent) (barrier_deps[j]);
+}
+
+/* Returns true if the kernels the event waited for on the agent have been
+   finished. */
+static int
+pocl_hsa_barrier_deps_finished (cl_event event)
+{
+  pocl_hsa_event_data_t *event_data = (pocl_hsa_event_data_t *)event->data;
+  unsigned i;
+  for (i = 0; i < event_data->num_barrier_deps; i++)
+    if (!((pocl_hsa_event_data_t *)event_data->barrier_deps[i]->data)
+             ->finished)
+      return 0;
+  return 1;
 }
 
 static void
 check_running_signals (pocl_hsa_device_data_t *d)
 {
   unsigned i;
+  int finished_any;
   pocl_hsa_device_pthread_data_t *dd = &d->driver_data;
-  for (i = 0; i < dd->running_list_size; i++)
+
+  /* A kernel is finished after the kernels it waited for, which can be
+     later in the list. */
+  do
     {
-      if (hsa_signal_load_acquire (dd->running_signals[i]) < 1)
+      finished_any = 0;
+      i = 0;
+      while (i < dd->running_list_size)
         {
-          pocl_hsa_ndrange_event_finished (d, i);
+          if (hsa_signal_load_acquire (dd->running_signals[i]) < 1
+              && pocl_hsa_barrier_deps_finished (dd->running_events[i]))
+            {
+              /* moves the last running event to i */
+              pocl_hsa_ndrange_event_finished (d, i);
+              finished_any = 1;
+            }
+          else
+            i++;
         }
     }
+  while (finished_any && dd->running_list_size > 0);
 }
 
-static int
-pocl_hsa_run_ready_commands (pocl_hsa_device_data_t *d)
+/* Moves the waiting kernels whose dependencies have all been launched to
+   the ready list. The events are only try-locked since the wait list is
+   locked after them elsewhere; the ones missed become ready when their
+   dependencies complete. Returns the number of kernels moved. */
+static size_t
+pocl_hsa_promote_waiting_kernels (pocl_hsa_device_data_t *d)
 {
-  check_running_signals (d);
-  int enqueued_ndrange = 0;
+  pocl_hsa_device_pthread_data_t *dd = &d->driver_data;
+  size_t i, num_promoted = 0;
 
   PTHREAD_CHECK (pthread_mutex_lock (&d->list_mutex));
-  while (d->ready_list_size)
+  for (i = d->wait_list_size; i > 0; i--)
     {
-      cl_event e = d->ready_list[0];
-      PN_REMOVE (d->ready_list, 0);
-      PTHREAD_CHECK (pthread_mutex_unlock (&d->list_mutex));
-      if (e->command->type == CL_COMMAND_NDRANGE_KERNEL)
+      cl_event e = d->wait_list[i - 1];
+      if (pthread_mutex_trylock (&e->pocl_lock) != 0)
+        continue;
+      if (e->status == CL_QUEUED && e->command->ready
+          && pocl_hsa_deps_launched (d->device, e))
         {
-          d->device->ops->compile_kernel (
-              e->command, e->command->command.run.kernel, e->queue->device, 1);
-          pocl_hsa_launch (d, e);
-          enqueued_ndrange = 1;
-          POCL_MSG_PRINT_INFO ("NDrange event %" PRIu64 " launched, remove"
-                               " from readylist\n", e->id);
+          PN_REMOVE (d->wait_list, i - 1);
+          dd->promoted[num_promoted++] = e;
         }
       else
+        POCL_UNLOCK_OBJ (e);
+    }
+  PTHREAD_CHECK (pthread_mutex_unlock (&d->list_mutex));
+
+  /* Submitted outside of the list lock, since that can run callbacks. No
+     one else moves them meanwhile: notify() ignores submitted events. */
+  for (i = 0; i < num_promoted; i++)
+    {
+      pocl_update_event_submitted (dd->promoted[i]);
+      POCL_UNLOCK_OBJ (dd->promoted[i]);
+    }
+
+  PTHREAD_CHECK (pthread_mutex_lock (&d->list_mutex));
+  for (i = 0; i < num_promoted; i++)
+    PN_ADD (d->ready_list, dd->promoted[i]);
+  PTHREAD_CHECK (pthread_mutex_unlock (&d->list_mutex));
+
+  return num_promoted;
+}
+
+static int
+pocl_hsa_run_ready_commands (pocl_hsa_device_data_t *d)
+{
+  check_running_signals (d);
+  int enqueued_ndrange = 0;
+  int launched;
+
+  do
+    {
+      launched = 0;
+      PTHREAD_CHECK (pthread_mutex_lock (&d->list_mutex));
+      while (d->ready_list_size)
         {
-          POCL_MSG_PRINT_INFO ("running non-NDrange event %" PRIu64 ","
-                               " remove from readylist\n", e->id);
-          pocl_exec_command (e->command);
+          cl_event e = d->ready_list[0];
+          PN_REMOVE (d->ready_list, 0);
+          PTHREAD_CHECK (pthread_mutex_unlock (&d->list_mutex));
+          if (e->command->type == CL_COMMAND_NDRANGE_KERNEL)
+            {
+              d->device->ops->compile_kernel (
+                  e->command, e->command->command.run.kernel,
+                  e->queue->device, 1);
+              pocl_hsa_launch (d, e);
+              launched = 1;
+              POCL_MSG_PRINT_INFO ("NDrange event %" PRIu64 " launched,"
+                                   " remove from readylist\n", e->id);
+            }
+          else
+            {
+              POCL_MSG_PRINT_INFO ("running non-NDrange event %" PRIu64 ","
+                                   " remove from readylist\n", e->id);
+              pocl_exec_command (e->command);
+            }
+          check_running_signals (d);
+          PTHREAD_CHECK (pthread_mutex_lock (&d->list_mutex));
         }
-      check_running_signals (d);
-      PTHREAD_CHECK (pthread_mutex_lock (&d->list_mutex));
+      PTHREAD_CHECK (pthread_mutex_unlock (&d->list_mutex));
+      enqueued_ndrange |= launched;
     }
-  PTHREAD_CHECK (pthread_mutex_unlock (&d->list_mutex));
+  /* the kernels waiting for the launched ones can be launched too */
+  while (launched && pocl_hsa_promote_waiting_kernels (d) > 0);
+
   return enqueued_ndrange;
 }
 
@@ -1938,7 +2293,6 @@ pocl_hsa_driver_pthread (void *cldev)
 #endif
 
   dd->running_list_size = 0;
-  dd->last_queue = 0;
   dd->num_queues = d->hw_schedulers;  // TODO this is somewhat arbitrary.
   POCL_MSG_PRINT_HSA ("Queues: %" PRIuS "\n", dd->num_queues);
 
@@ -1964,6 +2318,13 @@ pocl_hsa_driver_pthread (void *cldev)
 #endif
     }
 
+  HSA_CHECK (hsa_memory_allocate (d->kernarg_region,
+                                  EVENT_LIST_SIZE * HSA_KERNARG_SLOT_SIZE,
+                                  (void **)&dd->kernarg_pool));
+  for (i = 0; i < EVENT_LIST_SIZE; i++)
+    dd->kernarg_free[i] = EVENT_LIST_SIZE - 1 - i;
+  dd->kernarg_num_free = EVENT_LIST_SIZE;
+
   while (1)
     {
       /* reset the signal. Disabled for now; see below */
@@ -2025,6 +2386,7 @@ EXIT_PTHREAD:
   for (i = 0; i < dd->num_queues; i++)
     HSA_CHECK (hsa_queue_destroy (dd->queues[i]));
   POCL_MEM_FREE (dd->queues);
+  hsa_memory_free (dd->kernarg_pool);
 
   POname (clReleaseDevice) (device);
 
@@ -2046,7 +2408,7 @@ pocl_hsa_update_event (cl_device_id device, cl_event event)
   if (event->data == NULL && event->status == CL_QUEUED)
     {
       pocl_hsa_event_data_t *e_d
-          = (pocl_hsa_event_data_t *)malloc (sizeof (pocl_hsa_event_data_t));
+          = (pocl_hsa_event_data_t *)calloc (1, sizeof (pocl_hsa_event_data_t));
       assert (e_d);
       PTHREAD_CHECK (pthread_cond_init (&e_d->event_cond, NULL));
       event->data = (void *)e_d;
@@ -2060,20 +2422,20 @@ pocl_hsa_update_event (cl_device_id device, cl_event event)
     {
     case CL_QUEUED:
       if (event->queue->properties & CL_QUEUE_PROFILING_ENABLE)
-        event->time_queue = pocl_hsa_get_timer_value (device->data);
+        event->profile->time_queue = pocl_hsa_get_timer_value (device->data);
       break;
     case CL_SUBMITTED:
       if (event->queue->properties & CL_QUEUE_PROFILING_ENABLE)
-        event->time_submit = pocl_hsa_get_timer_value (device->data);
+        event->profile->time_submit = pocl_hsa_get_timer_value (device->data);
       break;
     case CL_RUNNING:
       if (event->queue->properties & CL_QUEUE_PROFILING_ENABLE)
-        event->time_start = pocl_hsa_get_timer_value (device->data);
+        event->profile->time_start = pocl_hsa_get_timer_value (device->data);
       break;
     case CL_FAILED:
     case CL_COMPLETE:
       if (event->queue->properties & CL_QUEUE_PROFILING_ENABLE)
-        event->time_end = pocl_hsa_get_timer_value (device->data);
+        event->profile->time_end = pocl_hsa_get_timer_value (device->data);
       break;
     }
 }
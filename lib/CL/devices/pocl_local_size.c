@@ -63,11 +63,62 @@ divide_chain (size_t a, size_t b, size_t c)
   return (b % a == 0 && c % b == 0);
 }
 
+size_t
+pocl_cache_fitting_wg_size (cl_kernel kernel, size_t cache_size)
+{
+  if (kernel == NULL)
+    return SIZE_MAX;
+
+  pocl_kernel_metadata_t *meta = kernel->meta;
+  size_t private_per_wi = meta->private_mem_per_wi;
+  size_t local_stride = meta->local_mem_wi_stride;
+  if (private_per_wi == 0 && local_stride == 0)
+    return SIZE_MAX;
+
+  /* The local memory allocated per work-group: the __local buffer
+   * arguments and the automatic locals. */
+  size_t local_mem = 0, i;
+  for (i = 0; i < meta->num_args; ++i)
+    {
+      if (ARG_IS_LOCAL (meta->arg_info[i]))
+        local_mem += kernel->dyn_arguments[i].size;
+    }
+  for (i = 0; i < meta->num_locals; ++i)
+    local_mem += meta->local_sizes[i];
+
+  /* The working set of a work-group of N work-items is estimated as
+   * max (local_mem, N * local_stride) + N * private_per_wi: the local
+   * arrays indexed by the local id grow with the group even where the
+   * kernel allocates them statically with a worst-case size, and the
+   * private variables are replicated per work-item by the work-group
+   * function. Both terms have to fit. */
+  size_t fit = cache_size / (local_stride + private_per_wi);
+  if (private_per_wi > 0)
+    {
+      size_t private_fit
+          = local_mem < cache_size
+                ? (cache_size - local_mem) / private_per_wi : 0;
+      fit = min (fit, private_fit);
+    }
+  return max (fit, (size_t)1);
+}
+
+/* The cache a work-group's working set should fit in: the share of one CPU
+ * of the L2 cache when the cache levels are known, else local_mem_size. */
+static size_t
+work_group_cache_size (cl_device_id dev)
+{
+  unsigned level = dev->cpu_cache_size[1] ? 1 : 0;
+  if (dev->cpu_cache_size[level] == 0)
+    return dev->local_mem_size;
+  return dev->cpu_cache_size[level] / max (dev->cpu_cache_sharing[level], 1u);
+}
+
 void
-pocl_default_local_size_optimizer (cl_device_id dev, size_t global_x,
-                                   size_t global_y, size_t global_z,
-                                   size_t *local_x, size_t *local_y,
-                                   size_t *local_z)
+pocl_default_local_size_optimizer (cl_device_id dev, cl_kernel kernel,
+                                   size_t global_x, size_t global_y,
+                                   size_t global_z, size_t *local_x,
+                                   size_t *local_y, size_t *local_z)
 {
   /* Tries figure out a local size which utilizes all the device's resources
    * efficiently. Assume work-groups are scheduled to compute units, so
@@ -90,6 +141,26 @@ pocl_default_local_size_optimizer (cl_device_id dev, size_t global_x,
   POCL_MSG_PRINT_INFO ("Preferred WG size multiple %zu\n",
                        preferred_wg_multiple);
 
+  /* When the local memory is just a part of the (cached) global memory, as
+   * on CPUs, work-groups whose working set does not fit in the CPU's share
+   * of the L2 cache thrash it on every work-item loop iteration.
+   * Treat the largest fitting size as the maximum, but do not go below the
+   * SIMD width, where the loss of vectorization would cost more. */
+  if (dev->local_mem_type == CL_GLOBAL)
+    {
+      size_t cache_size = work_group_cache_size (dev);
+      size_t fitting_group_size
+          = pocl_cache_fitting_wg_size (kernel, cache_size);
+      fitting_group_size = max (fitting_group_size, preferred_wg_multiple);
+      if (fitting_group_size < max_group_size)
+        {
+          POCL_MSG_PRINT_INFO ("Limiting the WG size to %zu to fit the "
+                               "working set in %zu bytes of cache\n",
+                               fitting_group_size, cache_size);
+          max_group_size = fitting_group_size;
+        }
+    }
+
   /* However, we have some constraints about the local size:
    * 1. local_{x,y,z} must divide global_{x,y,z} exactly, at least
    *    as long as we only support uniform group sizes (i.e. OpenCL 1.x);
@@ -304,10 +375,10 @@ pocl_default_local_size_optimizer (cl_device_id dev, size_t global_x,
 }
 
 void
-pocl_wg_utilization_maximizer (cl_device_id dev, size_t global_x,
-                               size_t global_y, size_t global_z,
-                               size_t *local_x, size_t *local_y,
-                               size_t *local_z)
+pocl_wg_utilization_maximizer (cl_device_id dev, cl_kernel kernel,
+                               size_t global_x, size_t global_y,
+                               size_t global_z, size_t *local_x,
+                               size_t *local_y, size_t *local_z)
 {
   size_t max_group_size = dev->max_work_group_size;
   *local_x = *local_y = *local_z = 1;
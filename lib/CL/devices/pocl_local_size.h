@@ -26,12 +26,14 @@
 
 #include "pocl_cl.h"
 /* The generic local size optimizer used by default, in case there's no target
- * specific one defined in the device driver. */
+ * specific one defined in the device driver. For devices whose local memory
+ * is emulated in the (cached) global memory, also limits the work-group size
+ * so that the working set of the kernel fits in the local_mem_size. */
 POCL_EXPORT
-void pocl_default_local_size_optimizer (cl_device_id dev, size_t global_x,
-                                        size_t global_y, size_t global_z,
-                                        size_t *local_x, size_t *local_y,
-                                        size_t *local_z);
+void pocl_default_local_size_optimizer (cl_device_id dev, cl_kernel kernel,
+                                        size_t global_x, size_t global_y,
+                                        size_t global_z, size_t *local_x,
+                                        size_t *local_y, size_t *local_z);
 
 /* Can be used for devices which support only small work-groups and prefer
  * them to be maximally utilized to use as many of the SIMD lanes as possible.
@@ -40,8 +42,14 @@ void pocl_default_local_size_optimizer (cl_device_id dev, size_t global_x,
  * search, thus should not be used with devices with a large work-group
  * support. */
 POCL_EXPORT
-void pocl_wg_utilization_maximizer (cl_device_id dev, size_t global_x,
-                                    size_t global_y, size_t global_z,
-                                    size_t *local_x, size_t *local_y,
-                                    size_t *local_z);
+void pocl_wg_utilization_maximizer (cl_device_id dev, cl_kernel kernel,
+                                    size_t global_x, size_t global_y,
+                                    size_t global_z, size_t *local_x,
+                                    size_t *local_y, size_t *local_z);
+
+/* Returns the largest work-group size whose estimated working set (the
+ * kernel's local memory plus the per-work-item private and __local memory)
+ * fits in cache_size bytes, or SIZE_MAX if the kernel has no estimate. */
+POCL_EXPORT
+size_t pocl_cache_fitting_wg_size (cl_kernel kernel, size_t cache_size);
 #endif
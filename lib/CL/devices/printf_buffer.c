@@ -0,0 +1,539 @@
+/* printf_buffer.c - Formatting the binary printf buffers of CPU devices.
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pocl_context.h"
+#include "printf_buffer.h"
+
+/* The output is written in blocks of this size. */
+#define OUTPUT_BUFFER_SIZE 4096
+/* Large enough for the conversions of all but very wide fields. */
+#define CONVERSION_BUFFER_SIZE 1200
+
+/* The format string errors, reported as by __pocl_printf_format_full() in
+   lib/kernel/printf.c. */
+#define ERROR_STRING " printf format string error: 0x"
+
+#define ERROR_NULL_AFTER_FORMAT_SIGN 0x11
+#define ERROR_REPEATED_FLAG_MINUS 0x12
+#define ERROR_REPEATED_FLAG_PLUS 0x13
+#define ERROR_REPEATED_FLAG_SPACE 0x14
+#define ERROR_REPEATED_FLAG_SHARP 0x15
+#define ERROR_REPEATED_FLAG_ZERO 0x16
+#define ERROR_FIELD_WIDTH_OVERFLOW 0x18
+#define ERROR_PRECISION_OVERFLOW 0x19
+#define ERROR_VECTOR_LENGTH_ZERO 0x20
+#define ERROR_VECTOR_LENGTH_OVERFLOW 0x21
+#define ERROR_VECTOR_LENGTH_UNKNOWN 0x22
+#define ERROR_VECTOR_LENGTH_WITHOUT_ELEMENT_SIZE 0x23
+#define ERROR_HL_MODIFIER_USED_WITHOUT_VECTOR_LENGTH 0x24
+#define ERROR_C_CONVERSION_SPECIFIER 0x25
+#define ERROR_FLAGS_WITH_S_CONVERSION_SPECIFIER 0x26
+#define ERROR_VECTOR_LENGTH_WITH_S_CONVERSION_SPECIFIER 0x27
+#define ERROR_LENGTH_MODIFIER_WITH_S_CONVERSION_SPECIFIER 0x28
+#define ERROR_FLAGS_WITH_P_CONVERSION_SPECIFIER 0x29
+#define ERROR_PRECISION_WITH_P_CONVERSION_SPECIFIER 0x30
+#define ERROR_VECTOR_LENGTH_WITH_P_CONVERSION_SPECIFIER 0x31
+#define ERROR_LENGTH_MODIFIER_WITH_P_CONVERSION_SPECIFIER 0x32
+#define ERROR_UNKNOWN_CONVERSION_SPECIFIER 0x33
+
+typedef struct
+{
+  char data[OUTPUT_BUFFER_SIZE];
+  size_t size;
+} output_buffer;
+
+static void
+flush_output (output_buffer *out)
+{
+  size_t written = 0;
+  while (written < out->size)
+    {
+      ssize_t r = write (STDOUT_FILENO, out->data + written,
+                         out->size - written);
+      if (r <= 0)
+        break;
+      written += r;
+    }
+  out->size = 0;
+}
+
+static void
+append_output (output_buffer *out, const char *str, size_t len)
+{
+  while (len > 0)
+    {
+      size_t n = OUTPUT_BUFFER_SIZE - out->size;
+      if (n > len)
+        n = len;
+      memcpy (out->data + out->size, str, n);
+      out->size += n;
+      str += n;
+      len -= n;
+      if (out->size == OUTPUT_BUFFER_SIZE)
+        flush_output (out);
+    }
+}
+
+/* Appends a single C printf conversion of the given spec. */
+static void
+append_conversion (output_buffer *out, const char *spec, ...)
+{
+  char buf[CONVERSION_BUFFER_SIZE];
+  va_list ap;
+  va_start (ap, spec);
+  int len = vsnprintf (buf, sizeof (buf), spec, ap);
+  va_end (ap);
+  if (len < 0)
+    return;
+  if ((size_t)len < sizeof (buf))
+    {
+      append_output (out, buf, len);
+      return;
+    }
+
+  char *wide = malloc (len + 1);
+  if (wide == NULL)
+    return;
+  va_start (ap, spec);
+  vsnprintf (wide, len + 1, spec, ap);
+  va_end (ap);
+  append_output (out, wide, len);
+  free (wide);
+}
+
+/* Reads the native endian unsigned integer of the given byte size. */
+static uint64_t
+read_uint (const char *arg, size_t size)
+{
+  uint8_t u8;
+  uint16_t u16;
+  uint32_t u32;
+  uint64_t u64;
+  switch (size)
+    {
+    case 1:
+      memcpy (&u8, arg, 1);
+      return u8;
+    case 2:
+      memcpy (&u16, arg, 2);
+      return u16;
+    case 4:
+      memcpy (&u32, arg, 4);
+      return u32;
+    default:
+      memcpy (&u64, arg, 8);
+      return u64;
+    }
+}
+
+static int64_t
+read_int (const char *arg, size_t size)
+{
+  uint64_t u = read_uint (arg, size);
+  switch (size)
+    {
+    case 1:
+      return (int8_t)u;
+    case 2:
+      return (int16_t)u;
+    case 4:
+      return (int32_t)u;
+    default:
+      return (int64_t)u;
+    }
+}
+
+/* Formats one record, of which the arguments are between args and end. */
+static void
+format_record (output_buffer *out, const char *format, const char *args,
+               const char *end)
+{
+  char ch;
+  unsigned errcode;
+
+  while ((ch = *format++))
+    {
+      if (ch != '%')
+        {
+          append_output (out, &ch, 1);
+          continue;
+        }
+
+      ch = *format++;
+      if (ch == 0)
+        {
+          errcode = ERROR_NULL_AFTER_FORMAT_SIGN;
+          goto error;
+        }
+      if (ch == '%')
+        {
+          append_output (out, &ch, 1);
+          continue;
+        }
+
+      /* The C printf conversion spec for a single element. */
+      char spec[64] = "%";
+      size_t spec_len = 1;
+
+      /* Flags */
+      int align_left = 0, always_sign = 0, space = 0, alt = 0, zero = 0;
+      for (;; ch = *format++)
+        {
+          int *flag;
+          unsigned repeated;
+          switch (ch)
+            {
+            case '-':
+              flag = &align_left;
+              repeated = ERROR_REPEATED_FLAG_MINUS;
+              break;
+            case '+':
+              flag = &always_sign;
+              repeated = ERROR_REPEATED_FLAG_PLUS;
+              break;
+            case ' ':
+              flag = &space;
+              repeated = ERROR_REPEATED_FLAG_SPACE;
+              break;
+            case '#':
+              flag = &alt;
+              repeated = ERROR_REPEATED_FLAG_SHARP;
+              break;
+            case '0':
+              flag = &zero;
+              repeated = ERROR_REPEATED_FLAG_ZERO;
+              break;
+            default:
+              goto flags_done;
+            }
+          if (*flag)
+            {
+              errcode = repeated;
+              goto error;
+            }
+          *flag = 1;
+          spec[spec_len++] = ch;
+        }
+    flags_done:;
+      if (align_left)
+        zero = 0;
+
+      /* Field width */
+      size_t field_width = 0;
+      while (ch >= '0' && ch <= '9')
+        {
+          if (field_width > (INT32_MAX - 9) / 10)
+            {
+              errcode = ERROR_FIELD_WIDTH_OVERFLOW;
+              goto error;
+            }
+          field_width = 10 * field_width + (ch - '0');
+          ch = *format++;
+        }
+      if (field_width > 0)
+        spec_len += sprintf (spec + spec_len, "%zu", field_width);
+
+      /* Precision */
+      int precision = -1;
+      if (ch == '.')
+        {
+          precision = 0;
+          ch = *format++;
+          while (ch >= '0' && ch <= '9')
+            {
+              if (precision > (INT32_MAX - 9) / 10)
+                {
+                  errcode = ERROR_PRECISION_OVERFLOW;
+                  goto error;
+                }
+              precision = 10 * precision + (ch - '0');
+              ch = *format++;
+            }
+          spec_len += sprintf (spec + spec_len, ".%d", precision);
+        }
+
+      /* Vector specifier */
+      size_t vector_length = 0;
+      if (ch == 'v')
+        {
+          ch = *format++;
+          while (ch >= '0' && ch <= '9')
+            {
+              if (ch == '0' && vector_length == 0)
+                {
+                  errcode = ERROR_VECTOR_LENGTH_ZERO;
+                  goto error;
+                }
+              if (vector_length > (INT32_MAX - 9) / 10)
+                {
+                  errcode = ERROR_VECTOR_LENGTH_OVERFLOW;
+                  goto error;
+                }
+              vector_length = 10 * vector_length + (ch - '0');
+              ch = *format++;
+            }
+          if (!(vector_length == 2 || vector_length == 3
+                || vector_length == 4 || vector_length == 8
+                || vector_length == 16))
+            {
+              errcode = ERROR_VECTOR_LENGTH_UNKNOWN;
+              goto error;
+            }
+        }
+
+      /* Length modifier, the element size in bytes */
+      size_t length = 0;
+      if (ch == 'h')
+        {
+          ch = *format++;
+          if (ch == 'h')
+            {
+              ch = *format++;
+              length = 1;
+            }
+          else if (ch == 'l')
+            {
+              ch = *format++;
+              length = 4;
+            }
+          else
+            length = 2;
+        }
+      else if (ch == 'l')
+        {
+          ch = *format++;
+          length = 8;
+        }
+      if (vector_length > 0 && length == 0)
+        {
+          errcode = ERROR_VECTOR_LENGTH_WITHOUT_ELEMENT_SIZE;
+          goto error;
+        }
+      if (vector_length == 0 && length == 4)
+        {
+          errcode = ERROR_HL_MODIFIER_USED_WITHOUT_VECTOR_LENGTH;
+          goto error;
+        }
+      if (vector_length == 0)
+        vector_length = 1;
+
+      size_t size;
+      switch (ch)
+        {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+          {
+            size_t elem_size = length == 0 ? 4 : length;
+            size = vector_length * elem_size;
+            if (args + size > end)
+              return;
+            strcpy (spec + spec_len, "ll?");
+            spec[spec_len + 2] = ch;
+            for (size_t i = 0; i < vector_length; ++i)
+              {
+                if (i != 0)
+                  append_output (out, ",", 1);
+                const char *arg = args + i * elem_size;
+                if (ch == 'd' || ch == 'i')
+                  append_conversion (out, spec,
+                                     (long long)read_int (arg, elem_size));
+                else
+                  append_conversion (
+                      out, spec, (unsigned long long)read_uint (arg, elem_size));
+              }
+            break;
+          }
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+          {
+            if (length == 1 || length == 2)
+              {
+                /* half is not supported either by the formatting printf */
+                errcode = ERROR_UNKNOWN_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            size_t elem_size = length == 8 ? 8 : 4;
+            size = vector_length * elem_size;
+            if (args + size > end)
+              return;
+            spec[spec_len] = ch;
+            spec[spec_len + 1] = 0;
+            for (size_t i = 0; i < vector_length; ++i)
+              {
+                if (i != 0)
+                  append_output (out, ",", 1);
+                double val;
+                if (elem_size == 8)
+                  memcpy (&val, args + i * elem_size, 8);
+                else
+                  {
+                    float f;
+                    memcpy (&f, args + i * elem_size, 4);
+                    val = f;
+                  }
+                /* NaNs are printed always positive, as by the formatting
+                 * printf. */
+                if (isnan (val))
+                  val = fabs (val);
+                append_conversion (out, spec, val);
+              }
+            break;
+          }
+
+        case 'c':
+          {
+            if (always_sign || space || alt || zero || precision >= 0
+                || vector_length != 1 || length != 0)
+              {
+                errcode = ERROR_C_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            size = 1;
+            if (args + size > end)
+              return;
+            strcpy (spec + spec_len, "c");
+            append_conversion (out, spec, (int)(unsigned char)args[0]);
+            break;
+          }
+
+        case 's':
+          {
+            if (always_sign || space || alt || zero)
+              {
+                errcode = ERROR_FLAGS_WITH_S_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            if (vector_length != 1)
+              {
+                errcode = ERROR_VECTOR_LENGTH_WITH_S_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            if (length != 0)
+              {
+                errcode = ERROR_LENGTH_MODIFIER_WITH_S_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            const char *nul = memchr (args, 0, end - args);
+            if (nul == NULL)
+              return;
+            size = nul - args + 1;
+            strcpy (spec + spec_len, "s");
+            append_conversion (out, spec, args);
+            break;
+          }
+
+        case 'p':
+          {
+            if (always_sign || space || alt || zero)
+              {
+                errcode = ERROR_FLAGS_WITH_P_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            if (precision >= 0)
+              {
+                errcode = ERROR_PRECISION_WITH_P_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            if (vector_length != 1)
+              {
+                errcode = ERROR_VECTOR_LENGTH_WITH_P_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            if (length != 0)
+              {
+                errcode = ERROR_LENGTH_MODIFIER_WITH_P_CONVERSION_SPECIFIER;
+                goto error;
+              }
+            size = sizeof (uintptr_t);
+            if (args + size > end)
+              return;
+            /* The pointers are printed in the alternate hex form. */
+            memmove (spec + 2, spec + 1, spec_len);
+            spec[1] = '#';
+            strcpy (spec + spec_len + 1, "llx");
+            append_conversion (
+                out, spec,
+                (unsigned long long)read_uint (args, sizeof (uintptr_t)));
+            break;
+          }
+
+        default:
+          errcode = ERROR_UNKNOWN_CONVERSION_SPECIFIER;
+          goto error;
+        }
+
+      /* The arguments are in 8 byte aligned slots. */
+      args += (size + 7) & ~(size_t)7;
+    }
+  return;
+
+error:;
+  char code[3] = { '0' + (char)(errcode >> 4), '0' + (char)(errcode & 7),
+                   '\n' };
+  append_output (out, ERROR_STRING, strlen (ERROR_STRING));
+  append_output (out, code, sizeof (code));
+}
+
+void
+pocl_write_printf_buffer (const char *buffer, size_t size)
+{
+  output_buffer out;
+  out.size = 0;
+
+  size_t pos = 0;
+  while (pos + POCL_PRINTF_RECORD_HEADER_SIZE <= size)
+    {
+      uint32_t record_size;
+      uint64_t format;
+      memcpy (&record_size, buffer + pos, sizeof (record_size));
+      memcpy (&format, buffer + pos + 8, sizeof (format));
+      if (record_size < POCL_PRINTF_RECORD_HEADER_SIZE
+          || record_size > size - pos)
+        break;
+      format_record (&out, (const char *)(uintptr_t)format,
+                     buffer + pos + POCL_PRINTF_RECORD_HEADER_SIZE,
+                     buffer + pos + record_size);
+      pos += record_size;
+    }
+
+  flush_output (&out);
+}
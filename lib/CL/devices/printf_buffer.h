@@ -0,0 +1,47 @@
+/* printf_buffer.h - Formatting the binary printf buffers of CPU devices.
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#ifndef POCL_PRINTF_BUFFER_H
+#define POCL_PRINTF_BUFFER_H
+
+#include <stddef.h>
+
+#include "pocl_export.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Formats the records the binary printf of the kernels (see
+ * __pocl_printf_binary in lib/kernel/printf.c) wrote to the first size bytes
+ * of the buffer, and writes the output to the standard output. The output
+ * matches the one of the formatting printf, except that the conversions are
+ * done by the C library. */
+POCL_EXPORT
+void pocl_write_printf_buffer (const char *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
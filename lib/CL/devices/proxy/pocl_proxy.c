@@ -101,11 +101,47 @@ typedef struct proxy_queue_data_s
 
 } proxy_queue_data_t;
 
+/* Maximum number of backend commands a command can wait for in the
+ * backend, instead of them completing first. */
+#define PROXY_MAX_BACKEND_DEPS 16
+
+/* The queue thread flushes the backend queue after this many commands, and
+ * whenever it runs out of commands. */
+#define PROXY_FLUSH_BATCH 16
+
 typedef struct pocl_proxy_event_data_s
 {
   pocl_cond_t event_cond;
+  /* the event of the backend command, NULL until the command is enqueued to
+   * the backend, or if it needed no backend command */
+  cl_event backend_event;
+  /* backend events of the commands this one still waits for */
+  cl_event backend_deps[PROXY_MAX_BACKEND_DEPS];
+  cl_uint num_backend_deps;
 } pocl_proxy_event_data_t;
 
+#define PROXY_EVENT_DATA(node)                                                \
+  ((pocl_proxy_event_data_t *)(node)->event->data)
+
+/* An argument as last set on the backend kernel */
+typedef struct proxy_kernel_arg_s
+{
+  size_t size;
+  /* copy of the value, NULL for local and NULL pointer arguments */
+  char *value;
+  int valid;
+} proxy_kernel_arg_t;
+
+typedef struct proxy_kernel_data_s
+{
+  cl_kernel kernel;
+  /* the queue threads share the backend kernel; held from setting the
+   * arguments until the kernel is enqueued */
+  pocl_lock_t lock;
+  proxy_kernel_arg_t *args;
+  unsigned num_args;
+} proxy_kernel_data_t;
+
 static const char proxy_device_name[] = "proxy";
 static cl_uint num_platforms = 0;
 static proxy_platform_data_t *platforms = NULL;
@@ -719,6 +755,20 @@ pocl_proxy_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
       if (r != CL_SUCCESS)
         POCL_MSG_ERR ("proxy: image alloc failed with %i\n", r);
     }
+  else if ((mem->flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR))
+           && mem->mem_host_ptr != NULL)
+    {
+      /* mem_host_ptr lives as long as the buffer with these flags; let the
+       * backend use it as its host storage, so the migrations to and from
+       * it, which pass the same pointer, need not copy. */
+      buf = clCreateBuffer (proxy_ctx,
+                            (reduced_flags & (~CL_MEM_ALLOC_HOST_PTR))
+                                | CL_MEM_USE_HOST_PTR,
+                            mem->size, mem->mem_host_ptr, &r);
+
+      if (r != CL_SUCCESS)
+        POCL_MSG_ERR ("proxy: mem alloc failed with %i\n", r);
+    }
   else
     {
       buf = clCreateBuffer (proxy_ctx, reduced_flags, mem->size, NULL, &r);
@@ -974,6 +1024,74 @@ set_build_log (cl_device_id proxy_dev, cl_program program,
 
 /******************************************************************************/
 
+/* Writes the path of the backend binary of a program built from the given
+   source with the given options to path. Returns nonzero if the binary
+   should not be cached: the backend doesn't support binaries, the kernel
+   cache is disabled, or the source includes files whose changes the key
+   would miss. */
+static int
+proxy_binary_cache_path (char *path, cl_device_id device, const char *source,
+                         const char *options)
+{
+  proxy_device_data_t *d = (proxy_device_data_t *)device->data;
+  if (!d->backend->supports_binaries || strstr (source, "#include"))
+    return -1;
+
+  SHA1_CTX hash_ctx;
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  pocl_SHA1_Init (&hash_ctx);
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)source, strlen (source));
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)options, strlen (options) + 1);
+  char *dev_hash = device->ops->build_hash (device);
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)dev_hash, strlen (dev_hash));
+  free (dev_hash);
+  pocl_SHA1_Final (&hash_ctx, digest);
+
+  char name[2 * SHA1_DIGEST_SIZE + 16] = "proxy-";
+  char *c = name + strlen (name);
+  size_t i;
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    {
+      *c++ = (digest[i] & 0x0F) + 65;
+      *c++ = ((digest[i] & 0xF0) >> 4) + 65;
+    }
+  strcpy (c, ".bin");
+
+  return pocl_cache_device_cache_path (path, name);
+}
+
+/* Builds the backend program from a binary cached by an earlier source
+   build. */
+static int
+proxy_build_cached_binary (cl_program *prog, cl_context context,
+                           proxy_device_data_t *d, const char *path,
+                           const char *options)
+{
+  char *binary = NULL;
+  uint64_t size = 0;
+  int err;
+
+  if (pocl_read_file (path, &binary, &size) != 0)
+    return CL_BUILD_PROGRAM_FAILURE;
+
+  size_t binary_size = (size_t)size;
+  const unsigned char *b = (const unsigned char *)binary;
+  cl_int status = CL_INVALID_VALUE;
+  *prog = clCreateProgramWithBinary (context, 1, &d->device_id, &binary_size,
+                                     &b, &status, &err);
+  free (binary);
+  if (err != CL_SUCCESS)
+    return err;
+
+  err = clBuildProgram (*prog, 1, &d->device_id, options, NULL, NULL);
+  if (err != CL_SUCCESS)
+    {
+      clReleaseProgram (*prog);
+      *prog = NULL;
+    }
+  return err;
+}
+
 int
 pocl_proxy_build_source (cl_program program, cl_uint device_i,
                          cl_uint num_input_headers,
@@ -1003,12 +1121,28 @@ pocl_proxy_build_source (cl_program program, cl_uint device_i,
   // context, num_sources, sources, source_lens, &err);
   size_t len = strlen (program->source);
   const char *source = program->source;
-  prog = clCreateProgramWithSource (context, 1, &source, &len, &err);
-  if (err)
-    return err;
 
-  if (link_program)
+  char binary_cache_path[POCL_FILENAME_LENGTH];
+  int use_binary_cache
+      = link_program
+        && proxy_binary_cache_path (binary_cache_path, device, source,
+                                    options)
+               == 0;
+  if (use_binary_cache && pocl_exists (binary_cache_path)
+      && proxy_build_cached_binary (&prog, context, d, binary_cache_path,
+                                    options)
+             == CL_SUCCESS)
+    {
+      POCL_MSG_PRINT_PROXY ("built from cached binary %s\n",
+                            binary_cache_path);
+      set_build_log (d->device_id, program, prog, device_i);
+      use_binary_cache = 0;
+    }
+  else if (link_program)
     {
+      prog = clCreateProgramWithSource (context, 1, &source, &len, &err);
+      if (err)
+        return err;
       err = clBuildProgram (prog, 1, &d->device_id, options, NULL, NULL);
       set_build_log (d->device_id, program, prog, device_i);
       if (err)
@@ -1016,6 +1150,10 @@ pocl_proxy_build_source (cl_program program, cl_uint device_i,
     }
   else
     {
+      prog = clCreateProgramWithSource (context, 1, &source, &len, &err);
+      if (err)
+        return err;
+
       cl_uint i;
       cl_program *local_input_headers = NULL;
       if (num_input_headers > 0)
@@ -1075,6 +1213,9 @@ pocl_proxy_build_source (cl_program program, cl_uint device_i,
       POCL_MSG_PRINT_PROXY ("BINARY SIZE [%u]: %zu \n", device_i,
                             program->binary_sizes[device_i]);
 
+      if (use_binary_cache)
+        pocl_write_file (binary_cache_path, binary, binary_size, 0, 0);
+
       // TODO program->binaries, program->binary_sizes set up, but caching on
       // them is wrong
       pocl_SHA1_Update (&hash_ctx, (uint8_t *)program->binaries[device_i],
@@ -1333,9 +1474,19 @@ pocl_proxy_create_kernel (cl_device_id device, cl_program program,
 
   int err = 0;
   cl_kernel proxy_ker = clCreateKernel (proxy_prog, kernel->name, &err);
+  if (err != CL_SUCCESS)
+    return err;
 
-  if (err == CL_SUCCESS)
-    kernel->data[device_i] = (void *)proxy_ker;
+  proxy_kernel_data_t *kd
+      = (proxy_kernel_data_t *)calloc (1, sizeof (proxy_kernel_data_t));
+  assert (kd);
+  kd->kernel = proxy_ker;
+  kd->num_args = kernel->meta->num_args;
+  kd->args = (proxy_kernel_arg_t *)calloc (kd->num_args + 1,
+                                           sizeof (proxy_kernel_arg_t));
+  assert (kd->args);
+  POCL_INIT_LOCK (kd->lock);
+  kernel->data[device_i] = (void *)kd;
 
   return err;
 }
@@ -1350,10 +1501,16 @@ pocl_proxy_free_kernel (cl_device_id device, cl_program program,
   if (kernel->data[device_i] == NULL)
     return CL_SUCCESS;
 
-  cl_kernel proxy_ker = (cl_kernel)kernel->data[device_i];
+  proxy_kernel_data_t *kd = (proxy_kernel_data_t *)kernel->data[device_i];
 
-  int err = clReleaseKernel (proxy_ker);
+  int err = clReleaseKernel (kd->kernel);
 
+  unsigned i;
+  for (i = 0; i < kd->num_args; ++i)
+    free (kd->args[i].value);
+  POCL_MEM_FREE (kd->args);
+  POCL_DESTROY_LOCK (kd->lock);
+  POCL_MEM_FREE (kd);
   kernel->data[device_i] = NULL;
 
   return err;
@@ -1487,6 +1644,29 @@ proxy_push_command (_cl_command_node *node)
   POCL_FAST_UNLOCK (qd->wq_lock);
 }
 
+/* Returns true if the commands the event still waits for have all been
+ * enqueued to the backend context of the device, so the backend can order
+ * the command after them. Called with the event locked. */
+static int
+proxy_deps_in_backend (cl_device_id device, cl_event event)
+{
+  event_node *n;
+  unsigned num_deps = 0;
+
+  LL_FOREACH (event->wait_list, n)
+    {
+      cl_event dep = n->event;
+      if (dep->queue == NULL || dep->queue->device != device)
+        return 0;
+      pocl_proxy_event_data_t *dep_data
+          = (pocl_proxy_event_data_t *)dep->data;
+      if (dep_data == NULL || dep_data->backend_event == NULL
+          || ++num_deps > PROXY_MAX_BACKEND_DEPS)
+        return 0;
+    }
+  return 1;
+}
+
 void
 pocl_proxy_submit (_cl_command_node *node, cl_command_queue cq)
 {
@@ -1501,7 +1681,7 @@ pocl_proxy_submit (_cl_command_node *node, cl_command_queue cq)
   e->data = (void *)e_d;
 
   node->ready = 1;
-  if (pocl_command_is_ready (e))
+  if (pocl_command_is_ready (e) || proxy_deps_in_backend (node->device, e))
     {
       pocl_update_event_submitted (e);
       proxy_push_command (node);
@@ -1550,6 +1730,11 @@ pocl_proxy_notify (cl_device_id device, cl_event event, cl_event finished)
 {
   _cl_command_node *node = event->command;
 
+  /* already pushed, waiting for its dependencies in the backend, which
+   * fails it too if they fail */
+  if (event->status != CL_QUEUED)
+    return;
+
   if (finished->status < CL_COMPLETE)
     {
       pocl_update_event_failed (event);
@@ -1559,9 +1744,9 @@ pocl_proxy_notify (cl_device_id device, cl_event event, cl_event finished)
   if (!node->ready)
     return;
 
-  if (pocl_command_is_ready (node->event))
+  if (pocl_command_is_ready (node->event)
+      || proxy_deps_in_backend (device, event))
     {
-      assert (event->status == CL_QUEUED);
       pocl_update_event_submitted (event);
       proxy_push_command (node);
     }
@@ -1593,6 +1778,8 @@ pocl_proxy_free_event_data (cl_event event)
 {
   assert (event->data != NULL);
   pocl_proxy_event_data_t *e_d = (pocl_proxy_event_data_t *)event->data;
+  if (e_d->backend_event)
+    clReleaseEvent (e_d->backend_event);
   POCL_DESTROY_COND (e_d->event_cond);
   POCL_MEM_FREE (event->data);
 }
@@ -1606,10 +1793,19 @@ pocl_proxy_notify_event_finished (cl_event event)
 
 /*****************************************************************************/
 
+/* The commands are enqueued without waiting for them; they complete in
+ * proxy_backend_event_done(). */
 #define ENQUEUE(code)                                                         \
   int res = code;                                                             \
-  assert (res == CL_SUCCESS);                                                 \
-  clFinish (cq);
+  assert (res == CL_SUCCESS);
+
+/* The wait list and event arguments of the node's backend command. */
+#define BACKEND_EVENTS(node)                                                  \
+  PROXY_EVENT_DATA (node)->num_backend_deps,                                  \
+      (PROXY_EVENT_DATA (node)->num_backend_deps                              \
+           ? PROXY_EVENT_DATA (node)->backend_deps                            \
+           : NULL),                                                           \
+      &PROXY_EVENT_DATA (node)->backend_event
 
 #if defined(ENABLE_OPENGL_INTEROP) || defined(ENABLE_EGL_INTEROP)
 static void
@@ -1623,11 +1819,11 @@ pocl_proxy_enque_acquire_gl (void *data, cl_command_queue cq,
     proxy_objs[i] = (cl_mem)objs[i]->device_ptrs[global_mem_id].mem_ptr;
 
 #ifdef ENABLE_EGL_INTEROP
-  ENQUEUE (
-      clEnqueueAcquireEGLObjectsKHR (cq, num_objs, proxy_objs, 0, NULL, NULL));
+  ENQUEUE (clEnqueueAcquireEGLObjectsKHR (cq, num_objs, proxy_objs,
+                                  BACKEND_EVENTS (node)));
 #else
-  ENQUEUE (
-      clEnqueueAcquireGLObjects (cq, num_objs, proxy_objs, 0, NULL, NULL));
+  ENQUEUE (clEnqueueAcquireGLObjects (cq, num_objs, proxy_objs,
+                                  BACKEND_EVENTS (node)));
 #endif
 }
 
@@ -1642,11 +1838,11 @@ pocl_proxy_enque_release_gl (void *data, cl_command_queue cq,
     proxy_objs[i] = (cl_mem)objs[i]->device_ptrs[global_mem_id].mem_ptr;
 
 #ifdef ENABLE_EGL_INTEROP
-  ENQUEUE (
-      clEnqueueReleaseEGLObjectsKHR (cq, num_objs, proxy_objs, 0, NULL, NULL));
+  ENQUEUE (clEnqueueReleaseEGLObjectsKHR (cq, num_objs, proxy_objs,
+                                  BACKEND_EVENTS (node)));
 #else
-  ENQUEUE (
-      clEnqueueReleaseGLObjects (cq, num_objs, proxy_objs, 0, NULL, NULL));
+  ENQUEUE (clEnqueueReleaseGLObjects (cq, num_objs, proxy_objs,
+                                  BACKEND_EVENTS (node)));
 #endif
 }
 #endif
@@ -1659,8 +1855,8 @@ pocl_proxy_enque_read (void *data, cl_command_queue cq, _cl_command_node *node,
 {
   cl_mem mem = (cl_mem)src_mem_id->mem_ptr;
 
-  ENQUEUE (clEnqueueReadBuffer (cq, mem, CL_FALSE, offset, size, host_ptr, 0,
-                                NULL, NULL));
+  ENQUEUE (clEnqueueReadBuffer (cq, mem, CL_FALSE, offset, size, host_ptr,
+                                BACKEND_EVENTS (node)));
 }
 
 static void
@@ -1672,8 +1868,8 @@ pocl_proxy_enque_write (void *data, cl_command_queue cq,
 {
   cl_mem mem = (cl_mem)dst_mem_id->mem_ptr;
 
-  ENQUEUE (clEnqueueWriteBuffer (cq, mem, CL_FALSE, offset, size, host_ptr, 0,
-                                 NULL, NULL));
+  ENQUEUE (clEnqueueWriteBuffer (cq, mem, CL_FALSE, offset, size, host_ptr,
+                                 BACKEND_EVENTS (node)));
 }
 
 static int
@@ -1690,8 +1886,8 @@ pocl_proxy_enque_copy (void *data, cl_command_queue cq, _cl_command_node *node,
       return 1;
     }
 
-  ENQUEUE (clEnqueueCopyBuffer (cq, src, dst, src_offset, dst_offset, size, 0,
-                                NULL, NULL));
+  ENQUEUE (clEnqueueCopyBuffer (cq, src, dst, src_offset, dst_offset, size,
+                                BACKEND_EVENTS (node)));
   return 0;
 }
 
@@ -1728,7 +1924,8 @@ pocl_proxy_enque_copy_rect (void *data, cl_command_queue cq,
 
   ENQUEUE (clEnqueueCopyBufferRect (
       cq, src, dst, src_origin, dst_origin, region, src_row_pitch,
-      src_slice_pitch, dst_row_pitch, dst_slice_pitch, 0, NULL, NULL));
+      src_slice_pitch, dst_row_pitch, dst_slice_pitch,
+      BACKEND_EVENTS (node)));
 }
 
 static void
@@ -1761,8 +1958,8 @@ pocl_proxy_enque_write_rect (
 
   ENQUEUE (clEnqueueWriteBufferRect (
       cq, mem, CL_FALSE, buffer_origin, host_origin, region, buffer_row_pitch,
-      buffer_slice_pitch, host_row_pitch, host_slice_pitch, host_ptr, 0, NULL,
-      NULL));
+      buffer_slice_pitch, host_row_pitch, host_slice_pitch, host_ptr,
+      BACKEND_EVENTS (node)));
 }
 
 static void
@@ -1779,8 +1976,8 @@ pocl_proxy_enque_read_rect (
 
   ENQUEUE (clEnqueueReadBufferRect (
       cq, mem, CL_FALSE, buffer_origin, host_origin, region, buffer_row_pitch,
-      buffer_slice_pitch, host_row_pitch, host_slice_pitch, host_ptr, 0, NULL,
-      NULL));
+      buffer_slice_pitch, host_row_pitch, host_slice_pitch, host_ptr,
+      BACKEND_EVENTS (node)));
   /*
     POCL_MSG_PRINT_PROXY ("ASYNC READ: \nregion %zu %zu %zu\n"
                   "  buffer_origin %zu %zu %zu\n"
@@ -1809,7 +2006,7 @@ pocl_proxy_enque_memfill (void *data, cl_command_queue cq,
   cl_mem mem = (cl_mem)dst_mem_id->mem_ptr;
 
   ENQUEUE (clEnqueueFillBuffer (cq, mem, pattern, pattern_size, offset, size,
-                                0, NULL, NULL));
+                                BACKEND_EVENTS (node)));
 }
 
 static int
@@ -1830,8 +2027,8 @@ pocl_proxy_enque_map_mem (void *data, cl_command_queue cq,
                            "to dst_host_ptr %p\n",
                            src_mem_id, offset, host_ptr);
   */
-  ENQUEUE (clEnqueueReadBuffer (cq, mem, CL_FALSE, offset, size, host_ptr, 0,
-                                NULL, NULL));
+  ENQUEUE (clEnqueueReadBuffer (cq, mem, CL_FALSE, offset, size, host_ptr,
+                                BACKEND_EVENTS (node)));
 
   return 0;
 }
@@ -1862,25 +2059,54 @@ pocl_proxy_enque_unmap_mem (void *data, cl_command_queue cq,
   else
     {
       ENQUEUE (clEnqueueWriteBuffer (cq, dst, CL_FALSE, offset, size, host_ptr,
-                                     0, NULL, NULL));
+                                     BACKEND_EVENTS (node)));
     }
   return 0;
 }
 
+/* Sets an argument of the backend kernel, unless it already has the same
+   value from an earlier launch. Called with the kernel data locked. */
+static void
+proxy_set_kernel_arg (proxy_kernel_data_t *kd, unsigned i, size_t size,
+                      const void *value)
+{
+  proxy_kernel_arg_t *a = &kd->args[i];
+  if (a->valid && a->size == size
+      && ((value == NULL && a->value == NULL)
+          || (value != NULL && a->value != NULL
+              && memcmp (a->value, value, size) == 0)))
+    return;
+
+  int err = clSetKernelArg (kd->kernel, i, size, value);
+  assert (err == CL_SUCCESS);
+
+  POCL_MEM_FREE (a->value);
+  if (value != NULL)
+    {
+      a->value = (char *)malloc (size);
+      assert (a->value);
+      memcpy (a->value, value, size);
+    }
+  a->size = size;
+  a->valid = 1;
+}
+
 static void
 pocl_proxy_enque_run (cl_device_id pocl_device, void *data, unsigned device_i,
                       cl_command_queue cq, _cl_command_node *node)
 {
   struct pocl_argument *al = NULL;
   unsigned i;
-  int err;
   cl_kernel pocl_kernel = node->command.run.kernel;
   assert (pocl_device == node->device);
   unsigned program_i = node->program_device_i;
 
   pocl_kernel_metadata_t *kernel_md = pocl_kernel->meta;
 
-  cl_kernel kernel = (cl_kernel)pocl_kernel->data[program_i];
+  proxy_kernel_data_t *kd = (proxy_kernel_data_t *)pocl_kernel->data[program_i];
+  cl_kernel kernel = kd->kernel;
+
+  POCL_LOCK (kd->lock);
 
   /* Process the kernel arguments. Find out what needs to be updated. */
   for (i = 0; i < kernel_md->num_args; ++i)
@@ -1889,8 +2115,7 @@ pocl_proxy_enque_run (cl_device_id pocl_device, void *data, unsigned device_i,
       assert (al->is_set > 0);
       if (ARG_IS_LOCAL (kernel_md->arg_info[i]))
         {
-          err = clSetKernelArg (kernel, i, al->size, NULL);
-          assert (err == CL_SUCCESS);
+          proxy_set_kernel_arg (kd, i, al->size, NULL);
         }
       else if ((kernel_md->arg_info[i].type == POCL_ARG_TYPE_POINTER)
                || (kernel_md->arg_info[i].type == POCL_ARG_TYPE_IMAGE))
@@ -1901,29 +2126,25 @@ pocl_proxy_enque_run (cl_device_id pocl_device, void *data, unsigned device_i,
               cl_mem mem
                   = (cl_mem)pocl_mem->device_ptrs[pocl_device->global_mem_id]
                         .mem_ptr;
-              err = clSetKernelArg (kernel, i, sizeof (cl_mem), &mem);
-              assert (err == CL_SUCCESS);
+              proxy_set_kernel_arg (kd, i, sizeof (cl_mem), &mem);
             }
           else
             {
               POCL_MSG_WARN ("NULL PTR ARG DETECTED: %s / ARG %i: %s \n",
                              kernel_md->name, i, kernel_md->arg_info[i].name);
-              err = clSetKernelArg (kernel, i, sizeof (cl_mem), NULL);
-              assert (err == CL_SUCCESS);
+              proxy_set_kernel_arg (kd, i, sizeof (cl_mem), NULL);
             }
         }
       else if (kernel_md->arg_info[i].type == POCL_ARG_TYPE_SAMPLER)
         {
           cl_sampler pocl_sampler = *(cl_sampler *)(al->value);
           cl_sampler samp = (cl_sampler)pocl_sampler->device_data[device_i];
-          err = clSetKernelArg (kernel, i, sizeof (cl_sampler), &samp);
-          assert (err == CL_SUCCESS);
+          proxy_set_kernel_arg (kd, i, sizeof (cl_sampler), &samp);
         }
       else
         {
           assert (kernel_md->arg_info[i].type == POCL_ARG_TYPE_NONE);
-          err = clSetKernelArg (kernel, i, al->size, al->value);
-          assert (err == CL_SUCCESS);
+          proxy_set_kernel_arg (kd, i, al->size, al->value);
         }
     }
 
@@ -1940,7 +2161,9 @@ pocl_proxy_enque_run (cl_device_id pocl_device, void *data, unsigned device_i,
                       node->command.run.pc.global_offset[2] };
 
   ENQUEUE (clEnqueueNDRangeKernel (cq, kernel, node->command.run.pc.work_dim,
-                                   offset, global, local, 0, NULL, NULL));
+                                   offset, global, local,
+                                   BACKEND_EVENTS (node)));
+  POCL_UNLOCK (kd->lock);
 }
 
 static cl_int
@@ -1968,7 +2191,7 @@ pocl_proxy_enque_copy_image_rect (
   */
 
   ENQUEUE (clEnqueueCopyImage (cq, src_img, dst_img, src_origin, dst_origin,
-                               region, 0, NULL, NULL));
+                               region, BACKEND_EVENTS (node)));
   return 0;
 }
 
@@ -2009,14 +2232,15 @@ pocl_proxy_enque_write_image_rect (void *data, cl_command_queue cq,
       assert (src_mem_id);
       cl_mem src = (cl_mem)src_mem_id->mem_ptr;
       ENQUEUE (clEnqueueCopyBufferToImage (cq, src, dst_img, src_offset,
-                                           origin, region, 0, NULL, NULL));
+                                           origin, region,
+                                           BACKEND_EVENTS (node)));
     }
   else
     {
       assert (src_mem_id == NULL);
       ENQUEUE (clEnqueueWriteImage (cq, dst_img, CL_FALSE, origin, region,
                                     src_row_pitch, src_slice_pitch,
-                                    src_host_ptr, 0, NULL, NULL));
+                                    src_host_ptr, BACKEND_EVENTS (node)));
     }
 
   return 0;
@@ -2060,14 +2284,14 @@ pocl_proxy_enque_read_image_rect (void *data, cl_command_queue cq,
       assert (dst_mem_id);
       cl_mem dst = (cl_mem)dst_mem_id->mem_ptr;
       ENQUEUE (clEnqueueCopyImageToBuffer (cq, src_img, dst, origin, region,
-                                           dst_offset, 0, NULL, NULL));
+                                           dst_offset, BACKEND_EVENTS (node)));
     }
   else
     {
       assert (dst_mem_id == NULL);
       ENQUEUE (clEnqueueReadImage (cq, src_img, CL_FALSE, origin, region,
                                    dst_row_pitch, dst_slice_pitch,
-                                   dst_host_ptr, 0, NULL, NULL));
+                                   dst_host_ptr, BACKEND_EVENTS (node)));
     }
 
   return 0;
@@ -2090,7 +2314,7 @@ pocl_proxy_enque_map_image (void *data, cl_command_queue cq,
 
   ENQUEUE (clEnqueueReadImage (cq, mem, CL_FALSE, map->origin, map->region,
                                map->row_pitch, map->slice_pitch, map->host_ptr,
-                               0, NULL, NULL));
+                               BACKEND_EVENTS (node)));
   return 0;
 }
 
@@ -2111,7 +2335,7 @@ pocl_proxy_enque_unmap_image (void *data, cl_command_queue cq,
 
   ENQUEUE (clEnqueueWriteImage (cq, mem, CL_FALSE, map->origin, map->region,
                                 map->row_pitch, map->slice_pitch,
-                                map->host_ptr, 0, NULL, NULL));
+                                map->host_ptr, BACKEND_EVENTS (node)));
   return 0;
 }
 
@@ -2133,8 +2357,8 @@ pocl_proxy_enque_fill_image (void *data, cl_command_queue cq,
                             region[0], region[1], region[2]);
   */
 
-  ENQUEUE (
-      clEnqueueFillImage (cq, mem, fill_pixel, origin, region, 0, NULL, NULL));
+  ENQUEUE (clEnqueueFillImage (cq, mem, fill_pixel, origin, region,
+                               BACKEND_EVENTS (node)));
   return 0;
 }
 
@@ -2163,21 +2387,93 @@ pocl_proxy_enque_migrate_d2d (void *dest_data, void *source_data,
   POCL_MSG_PRINT_PROXY ("internal migrate D2D called\n");
 
   cl_mem_migration_flags flags = 0;
-  ENQUEUE (
-      clEnqueueMigrateMemObjects (cq, 1, &actual_mem, flags, 0, NULL, NULL));
+  ENQUEUE (clEnqueueMigrateMemObjects (cq, 1, &actual_mem, flags,
+                                       BACKEND_EVENTS (node)));
 }
 
 /*****************************************************************************/
 
+static void CL_CALLBACK
+proxy_backend_event_done (cl_event backend_event, cl_int status, void *data)
+{
+  cl_event event = (cl_event)data;
+
+  if (status < 0)
+    {
+      POCL_LOCK_OBJ (event);
+      pocl_update_event_failed (event);
+      POCL_UNLOCK_OBJ (event);
+      return;
+    }
+
+  const char *cstr = pocl_command_to_str (event->command->type);
+  char msg[128] = "Event ";
+  strncat (msg, cstr, 127);
+
+  POCL_UPDATE_EVENT_COMPLETE_MSG (event, msg);
+}
+
+/* Pushes the commands waiting for the event whose dependencies are now all
+ * in the backend. They are only try-locked, since the events are locked in
+ * the other order elsewhere; the ones missed are pushed when their
+ * dependencies complete. */
+static void
+proxy_push_dependents (cl_event event, cl_command_queue cq_id)
+{
+  event_node *n;
+  int other_queue = 0;
+
+  POCL_LOCK_OBJ (event);
+  LL_FOREACH (event->notify_list, n)
+    {
+      cl_event waiting = n->event;
+      if (pthread_mutex_trylock (&waiting->pocl_lock) != 0)
+        continue;
+      _cl_command_node *node = waiting->command;
+      if (waiting->status == CL_QUEUED && node != NULL && node->ready
+          && node->device == event->queue->device
+          && proxy_deps_in_backend (node->device, waiting))
+        {
+          pocl_update_event_submitted (waiting);
+          proxy_push_command (node);
+          other_queue |= (waiting->queue != event->queue);
+        }
+      POCL_UNLOCK_OBJ (waiting);
+    }
+  POCL_UNLOCK_OBJ (event);
+
+  /* the backend command must be flushed for a command in another backend
+   * queue to wait for it */
+  if (other_queue)
+    clFlush (cq_id);
+}
+
 static void
 proxy_exec_command (_cl_command_node *node, cl_device_id dev,
                     proxy_device_data_t *d, proxy_queue_data_t *qd)
 {
   _cl_command_t *cmd = &node->command;
   cl_event event = node->event;
-  const char *cstr = NULL;
+  pocl_proxy_event_data_t *e_d = (pocl_proxy_event_data_t *)event->data;
   cl_command_queue cq_id = qd->proxied_id;
   unsigned context_device_i = qd->context_device_i;
+  event_node *n;
+  cl_uint i;
+
+  /* The commands still in the wait list have been enqueued to the backend;
+   * the backend command waits for their backend events. */
+  POCL_LOCK_OBJ (event);
+  e_d->num_backend_deps = 0;
+  LL_FOREACH (event->wait_list, n)
+    {
+      pocl_proxy_event_data_t *dep_data
+          = (pocl_proxy_event_data_t *)n->event->data;
+      assert (dep_data->backend_event != NULL);
+      assert (e_d->num_backend_deps < PROXY_MAX_BACKEND_DEPS);
+      clRetainEvent (dep_data->backend_event);
+      e_d->backend_deps[e_d->num_backend_deps++] = dep_data->backend_event;
+    }
+  POCL_UNLOCK_OBJ (event);
 
   pocl_update_event_running (event);
 
@@ -2208,8 +2504,11 @@ proxy_exec_command (_cl_command_node *node, cl_device_id dev,
               }
             else
               {
-                pocl_proxy_enque_read (d, cq_id, node, m->mem_host_ptr,
-                                       cmd->migrate.mem_id, m, 0, m->size);
+                pocl_proxy_enque_read (
+                    d, cq_id, node,
+                    (char *)m->mem_host_ptr + cmd->migrate.offset,
+                    cmd->migrate.mem_id, m, cmd->migrate.offset,
+                    cmd->migrate.size);
               }
             break;
           }
@@ -2235,8 +2534,11 @@ proxy_exec_command (_cl_command_node *node, cl_device_id dev,
               }
             else
               {
-                pocl_proxy_enque_write (d, cq_id, node, m->mem_host_ptr,
-                                        cmd->migrate.mem_id, m, 0, m->size);
+                pocl_proxy_enque_write (
+                    d, cq_id, node,
+                    (char *)m->mem_host_ptr + cmd->migrate.offset,
+                    cmd->migrate.mem_id, m, cmd->migrate.offset,
+                    cmd->migrate.size);
               }
             break;
           }
@@ -2405,7 +2707,6 @@ proxy_exec_command (_cl_command_node *node, cl_device_id dev,
       goto FINISH_COMMAND;
 
     case CL_COMMAND_MARKER:
-      clFlush (cq_id);
     case CL_COMMAND_BARRIER:
       goto FINISH_COMMAND;
 
@@ -2415,11 +2716,29 @@ proxy_exec_command (_cl_command_node *node, cl_device_id dev,
 
 FINISH_COMMAND:
 
-  cstr = pocl_command_to_str (node->type);
-  char msg[128] = "Event ";
-  strncat (msg, cstr, 127);
+  /* a command that needed no backend command still completes after the
+   * ones it waits for */
+  if (e_d->backend_event == NULL && e_d->num_backend_deps > 0)
+    {
+      int err = clEnqueueMarkerWithWaitList (cq_id, BACKEND_EVENTS (node));
+      assert (err == CL_SUCCESS);
+    }
 
-  POCL_UPDATE_EVENT_COMPLETE_MSG (event, msg);
+  for (i = 0; i < e_d->num_backend_deps; ++i)
+    clReleaseEvent (e_d->backend_deps[i]);
+  e_d->num_backend_deps = 0;
+
+  if (e_d->backend_event == NULL)
+    {
+      proxy_backend_event_done (NULL, CL_COMPLETE, event);
+      return;
+    }
+
+  proxy_push_dependents (event, cq_id);
+
+  int err = clSetEventCallback (e_d->backend_event, CL_COMPLETE,
+                                proxy_backend_event_done, event);
+  assert (err == CL_SUCCESS);
 }
 
 static void *
@@ -2430,6 +2749,7 @@ pocl_proxy_queue_pthread (void *ptr)
   _cl_command_node *cmd = NULL;
   cl_device_id device = qd->queue->device;
   proxy_device_data_t *d = (proxy_device_data_t *)device->data;
+  unsigned unflushed = 0;
   POCL_FAST_LOCK (qd->wq_lock);
 
   while (1)
@@ -2446,20 +2766,35 @@ pocl_proxy_queue_pthread (void *ptr)
           DL_DELETE (qd->work_queue, cmd);
           POCL_FAST_UNLOCK (qd->wq_lock);
 
-          assert (pocl_command_is_ready (cmd->event));
           assert (cmd->event->status == CL_SUBMITTED);
 
+          cl_command_queue cq_id = qd->proxied_id;
           proxy_exec_command (cmd, device, d, qd);
           /* if the proxy_exec_command called proxy_free_cmd_queue(),
            * return immediately */
           if (qd->cq_thread_exit_requested && qd->cq_thread_id==0)
             return NULL;
 
+          if (++unflushed == PROXY_FLUSH_BATCH)
+            {
+              clFlush (cq_id);
+              unflushed = 0;
+            }
+
           POCL_FAST_LOCK (qd->wq_lock);
         }
 
       if ((qd->work_queue == NULL) && (qd->cq_thread_exit_requested == 0))
         {
+          /* the backend commands complete once flushed */
+          if (unflushed)
+            {
+              POCL_FAST_UNLOCK (qd->wq_lock);
+              clFlush (qd->proxied_id);
+              unflushed = 0;
+              POCL_FAST_LOCK (qd->wq_lock);
+              continue;
+            }
           POCL_WAIT_COND (qd->wakeup_cond, qd->wq_lock);
         }
     }
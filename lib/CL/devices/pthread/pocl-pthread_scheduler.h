@@ -29,6 +29,15 @@
 
 #include "pocl-pthread_utils.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define POCL_CPU_RELAX() _mm_pause ()
+#elif defined(__aarch64__) || defined(__arm__)
+#define POCL_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define POCL_CPU_RELAX() (void)0
+#endif
+
 #ifdef __GNUC__
 #pragma GCC visibility push(hidden)
 #endif
@@ -40,9 +49,23 @@ cl_int pthread_scheduler_init (cl_device_id device);
 
 void pthread_scheduler_uninit ();
 
+/* Returns nonzero if the NUMA-aware placement is enabled */
+int pthread_scheduler_numa_aware ();
+
 /* Gives ready-to-execute command for scheduler */
 void pthread_scheduler_push_command (_cl_command_node *cmd);
 
+/* With POCL_PTHREAD_KERNEL_FUSION, tries to append the NDRange command
+ * node, which waits only for the previous NDRange command of its in-order
+ * queue, to the chain of fused commands of that one. Must be called with
+ * node->event locked. */
+void pthread_scheduler_try_fuse (_cl_command_node *node);
+
+/* With POCL_PTHREAD_HOST_ASSIST, runs WGs of the queued kernels on the
+ * calling (application) thread until done (arg) returns nonzero or there
+ * is nothing left to help with. */
+void pthread_scheduler_assist (int (*done) (void *), void *arg);
+
 #ifdef __GNUC__
 #pragma GCC visibility pop
 #endif
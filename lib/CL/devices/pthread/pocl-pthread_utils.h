@@ -34,7 +34,43 @@
 #pragma GCC visibility push(hidden)
 #endif
 
+/* A contiguous range [start, end) of work-group indices owned by a single
+ * driver thread in the work-stealing scheduler. Both bounds are packed into
+ * one 64bit word so the owner and the thieves can update it with a single
+ * CAS. Ranges only ever shrink, so a stale value can never reappear. */
+typedef struct pocl_wg_range
+{
+  volatile uint64_t range;
+} __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE))) pocl_wg_range;
+
+/* What one thread did for one kernel launch, with POCL_PTHREAD_WG_TIMELINE.
+ * Each thread only writes its own entry. */
+typedef struct pocl_wg_thread_timeline
+{
+  uint64_t first_start_ns;
+  uint64_t last_end_ns;
+  uint64_t busy_ns;
+  unsigned num_wgs;
+  unsigned num_chunks;
+} __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE))) pocl_wg_thread_timeline;
+
 typedef struct kernel_run_command kernel_run_command;
+
+/* A kernel enqueued by a work-group, and the host NDRange whose event
+ * waits for all such kernels under it, see pthread_enqueue_kernel(). */
+typedef struct pthread_child pthread_child;
+typedef struct pthread_enqueue_tree pthread_enqueue_tree;
+
+/* A command buffer of clEnqueueNDRangeKernelBatchPoCL being run: the
+ * copies of its recorded NDRanges that its run commands point to, and the
+ * number of them that have not finished yet. */
+typedef struct pthread_batch
+{
+  _cl_command_node *cmd;
+  uint64_t remaining;
+  _cl_command_node nodes[];
+} pthread_batch;
+
 struct kernel_run_command
 {
   void *data;
@@ -42,39 +78,112 @@ struct kernel_run_command
   cl_device_id device;
   _cl_command_node *cmd;
   pocl_workgroup_func workgroup;
+  /* Runs a row of WGs in one call, NULL if the binary has none. */
+  pocl_workgroup_range_func workgroup_range;
   struct pocl_argument *kernel_args;
   kernel_run_command *prev;
   kernel_run_command *next;
   unsigned long ref_count;
+  /* set by the thread taking the last WGs, without wq_lock_fast; the
+   * command is then unlinked from the kernel queue by the next thread
+   * holding the lock */
+  volatile int exhausted;
+
+  /* Bump arena for the argument arrays and image descriptors, placed right
+   * after this struct in the same allocation. It's reset when the command
+   * is recycled, which happens in finalize_kernel_command(). */
+  char *arena;
+  size_t arena_size;
+  size_t arena_used;
+  /* the driver thread whose cache this command is returned to */
+  void *owner;
+  kernel_run_command *free_next;
+  /* the commands fused to this one, see pthread_scheduler_try_fuse */
+  kernel_run_command *fused_next;
+  /* the batch this command is a part of, see pocl_pthread_prepare_batch */
+  pthread_batch *batch;
+  /* Device-side enqueue: the child this command runs, NULL for the
+   * commands of the host; the enqueue tree it is a part of, set by the
+   * first enqueue of a host command; and the children to release when it
+   * is finalized (CLK_ENQUEUE_FLAGS_WAIT_KERNEL). */
+  pthread_child *child;
+  pthread_enqueue_tree *volatile tree;
+  pthread_child *volatile deferred;
+  /* the ready queue of the command by its queue's priority hint, and the
+   * most threads that may work on it by its throttle hint, see
+   * set_run_scheduling() */
+  unsigned priority;
+  unsigned max_threads;
+  /* POCL_PTHREAD_FAIR_SHARE: the context of the command, the chunks of WGs
+   * it may take in a quantum while other contexts have ready kernels, and
+   * the chunks it has taken in the current one */
+  cl_context context;
+  unsigned quantum_chunks;
+  volatile unsigned quantum_used;
 
   /* actual kernel arguments. these are setup once at the kernel setup
    * phase, then each thread sets up the local arguments for itself. */
   void **arguments;
   /* this is required b/c there's an additional level of indirection */
   void **arguments2;
+  /* the local memory the local arguments and the automatic locals take
+   * in setup_kernel_arg_array_with_locals() */
+  size_t local_mem_size;
 
   POCL_FAST_LOCK_T lock __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
   size_t remaining_wgs __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
   size_t wgs_dealt;
 
+  /* per-thread WG ranges, used only by the work-stealing scheduler.
+   * wg_ranges[i] belongs to the thread with index (wg_range_base + i).
+   * With wg_ranges_by_node, there is instead one range per NUMA node,
+   * shared by all the threads of the node. */
+  pocl_wg_range *wg_ranges;
+  unsigned num_wg_ranges;
+  unsigned wg_range_base;
+  int wg_ranges_by_node;
+
+  /* If nonzero, consecutive WG indices are mapped to tiles of
+   * wg_tile_w x wg_tile_h WGs in the XY plane instead of rows, so a
+   * thread's chunk of WGs is a compact 2D block. */
+  unsigned wg_tile_w;
+  unsigned wg_tile_h;
+
+  /* per-thread timelines, indexed by the thread index, or NULL if
+   * POCL_PTHREAD_WG_TIMELINE is not set. push_ns is when the kernel was
+   * made available to the threads. */
+  pocl_wg_thread_timeline *timeline;
+  unsigned num_timelines;
+  uint64_t push_ns;
+
+  /* For a bulk memory command split by pocl_pthread_prepare_mem_command,
+   * the function that runs its chunks [start, end] of mem_chunk_size bytes
+   * (rows for a rect copy) in place of the WGs. NULL for kernels. */
+  void (*mem_chunks) (kernel_run_command *k, size_t start, size_t end);
+  size_t mem_chunk_size;
+
+  /* The WGs at the edges of a non-uniform grid (see
+   * _cl_command_run.edge_size): edge_mask has bit d set if the last WG in
+   * dimension d is smaller. For each combination of those bits, the WG
+   * function specialized for the smaller local sizes, its dlhandle cache
+   * item and the context it runs with. */
+  unsigned edge_mask;
+  pocl_workgroup_func edge_wg[8];
+  void *edge_dlhandle[8];
+  struct pocl_context edge_pc[8];
+
   struct pocl_context pc __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
 } __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
-#ifdef USE_POCL_MEMMANAGER
-void pocl_init_kernel_run_command_manager (void);
-void pocl_init_thread_argument_manager ();
-kernel_run_command* new_kernel_run_command ();
-void free_kernel_run_command (kernel_run_command *k);
-#else
-#define pocl_init_kernel_run_command_manager() NULL
-#define pocl_init_thread_argument_manager() NULL
-#define new_kernel_run_command()                                              \
-  (kernel_run_command *)pocl_aligned_malloc (HOST_CPU_CACHELINE_SIZE,         \
-                                             sizeof (kernel_run_command))
-#define free_kernel_run_command(k) free (k)
-#endif
+/* Size of the argument arena allocated together with each
+ * kernel_run_command. Enough for the argument arrays of kernels with
+ * a couple of hundred arguments; larger ones fall back to the heap. */
+#define POCL_PTHREAD_ARG_ARENA_SIZE 4096
+
+void *pthread_arena_alloc (kernel_run_command *k, size_t size);
+void pthread_arena_free (kernel_run_command *k, void *ptr);
 
 void setup_kernel_arg_array (kernel_run_command *k);
 void setup_kernel_arg_array_with_locals (void **arguments, void **arguments2,
@@ -47,9 +47,11 @@
 #include "cpuinfo.h"
 #include "topology/pocl_topology.h"
 #include "common.h"
+#include "common_driver.h"
 #include "devices.h"
 #include "pocl_util.h"
 #include "pocl_mem_management.h"
+#include "pocl_timing.h"
 
 #ifdef ENABLE_LLVM
 #include "pocl_llvm.h"
@@ -79,6 +81,7 @@ pocl_pthread_init_device_ops(struct pocl_device_ops *ops)
   ops->probe = pocl_pthread_probe;
   ops->uninit = pocl_pthread_uninit;
   ops->reinit = pocl_pthread_reinit;
+  ops->init_deferred = pocl_pthread_init_deferred;
   ops->init = pocl_pthread_init;
   ops->run = pocl_pthread_run;
   ops->join = pocl_pthread_join;
@@ -93,8 +96,12 @@ pocl_pthread_init_device_ops(struct pocl_device_ops *ops)
   ops->free_event_data = pocl_pthread_free_event_data;
   ops->build_hash = pocl_pthread_build_hash;
 
+  ops->alloc_mem_obj = pocl_pthread_alloc_mem_obj;
+
   ops->init_queue = pocl_pthread_init_queue;
   ops->free_queue = pocl_pthread_free_queue;
+
+  ops->can_run_command_buffer = pocl_pthread_can_run_command_buffer;
 }
 
 char *
@@ -103,7 +110,8 @@ pocl_pthread_build_hash (cl_device_id device)
   char* res = calloc(1000, sizeof(char));
 #ifdef KERNELLIB_HOST_DISTRO_VARIANTS
   char *name = pocl_get_llvm_cpu_name ();
-  snprintf (res, 1000, "pthread-%s-%s", HOST_DEVICE_BUILD_HASH, name);
+  snprintf (res, 1000, "pthread-%s-%s-%s", HOST_DEVICE_BUILD_HASH, name,
+            pocl_get_distro_kernellib_variant ());
   POCL_MEM_FREE (name);
 #else
   snprintf (res, 1000, "pthread-%s", HOST_DEVICE_BUILD_HASH);
@@ -122,8 +130,9 @@ pocl_pthread_probe (struct pocl_device_ops *ops)
   return env_count;
 }
 
-static cl_device_partition_property pthread_partition_properties[2]
-    = { CL_DEVICE_PARTITION_EQUALLY, CL_DEVICE_PARTITION_BY_COUNTS };
+static cl_device_partition_property pthread_partition_properties[3]
+    = { CL_DEVICE_PARTITION_EQUALLY, CL_DEVICE_PARTITION_BY_COUNTS,
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN };
 
 #define FALLBACK_MAX_THREAD_COUNT 8
 
@@ -143,9 +152,22 @@ pocl_pthread_init (unsigned j, cl_device_id device, const char* parameters)
   device->data = d;
 
   pocl_init_default_device_infos (device);
+  /* the kernels only store the printf arguments, the scheduler formats
+     them after the work-groups */
+  device->binary_printf = 1;
+  /* work_group_scheduler runs the edge WGs of a non-uniform grid */
+  device->edge_work_groups = CL_TRUE;
+  /* the kernels poll the preemption points of the driver threads, which
+     run the work of the higher priority queues there */
+  device->preemption_points
+      = pocl_get_bool_option ("POCL_PREEMPTION_POINTS", 0);
   /* 0 is the host memory shared with all drivers that use it */
   device->global_mem_id = 0;
-  device->extensions = HOST_DEVICE_EXTENSIONS;
+  /* the scheduler has ready queues per priority and caps the threads of
+     the throttled queues */
+  device->extensions
+      = HOST_DEVICE_EXTENSIONS " cl_khr_priority_hints cl_khr_throttle_hints"
+          HOST_DEVICE_EXTERNAL_MEMORY_EXTENSIONS;
 
   device->on_host_queue_props
       = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE;
@@ -166,9 +188,11 @@ pocl_pthread_init (unsigned j, cl_device_id device, const char* parameters)
                                        | CL_DEVICE_ATOMIC_SCOPE_DEVICE;
 
   device->svm_allocation_priority = 1;
-  /* OpenCL 2.0 properties */
+  /* OpenCL 2.0 properties. The host and the device share the address
+     space, so any host pointer can be given to the kernels. */
   device->svm_caps = CL_DEVICE_SVM_COARSE_GRAIN_BUFFER
-                     | CL_DEVICE_SVM_FINE_GRAIN_BUFFER | CL_DEVICE_SVM_ATOMICS;
+                     | CL_DEVICE_SVM_FINE_GRAIN_BUFFER
+                     | CL_DEVICE_SVM_FINE_GRAIN_SYSTEM | CL_DEVICE_SVM_ATOMICS;
 
   /* hwloc probes OpenCL device info at its initialization in case
      the OpenCL extension is enabled. This causes to printout 
@@ -191,6 +215,15 @@ pocl_pthread_init (unsigned j, cl_device_id device, const char* parameters)
 
   pocl_cpuinfo_detect_device_info(device);
   pocl_set_buffer_image_limits(device);
+  pocl_set_cpu_sub_group_limits (device);
+  pocl_set_cpu_pipe_limits (device);
+  pocl_set_cpu_device_queue_limits (device);
+
+  /* The driver threads allocate only the local memory of the kernels they
+   * run, so a larger limit costs nothing for the kernels not using it. */
+  int local_mem_kb = pocl_get_int_option ("POCL_PTHREAD_LOCAL_MEM_SIZE", 0);
+  if (local_mem_kb > 0)
+    device->local_mem_size = (cl_ulong)local_mem_kb * 1024;
 
   /* in case hwloc doesn't provide a PCI ID, let's generate
      a vendor id that hopefully is unique across vendors. */
@@ -203,16 +236,25 @@ pocl_pthread_init (unsigned j, cl_device_id device, const char* parameters)
 
   // pthread has elementary partitioning support
   device->max_sub_devices = device->max_compute_units;
-  device->num_partition_properties = 2;
+  /* partitioning by affinity domain requires the topology */
+  device->num_partition_properties
+      = (device->affinity_domains && device->num_cpus > 0) ? 3 : 2;
   device->partition_properties = pthread_partition_properties;
   device->num_partition_types = 0;
   device->partition_type = NULL;
 
+  return CL_SUCCESS;
+}
+
+/* The driver threads are started when the first context with a pthread
+ * device is created, so that only listing the devices stays cheap. */
+cl_int
+pocl_pthread_init_deferred (cl_device_id device)
+{
   cl_int ret = CL_SUCCESS;
   if (!scheduler_initialized)
     {
-      pocl_init_dlhandle_cache();
-      pocl_init_kernel_run_command_manager();
+      pocl_init_dlhandle_cache ();
       ret = pthread_scheduler_init (device);
       if (ret == CL_SUCCESS)
         {
@@ -251,17 +293,35 @@ pocl_pthread_reinit (unsigned j, cl_device_id device)
   d->current_kernel = NULL;
   device->data = d;
 
-  cl_int ret = CL_SUCCESS;
-  if (!scheduler_initialized)
+  /* the scheduler is restarted by pocl_pthread_init_deferred */
+  return CL_SUCCESS;
+}
+
+cl_int
+pocl_pthread_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
+{
+  int fresh_alloc = (mem->mem_host_ptr == NULL);
+  cl_int err = pocl_driver_alloc_mem_obj (device, mem, host_ptr);
+  if (err != CL_SUCCESS || !fresh_alloc || !pthread_scheduler_numa_aware ())
+    return err;
+
+  /* The backing store was just allocated and not touched yet. With
+   * NUMA-aware placement the WGs are spread over all the nodes, so
+   * interleave the pages over the nodes instead of placing them all
+   * on the node of the allocating thread. Only whole pages can be bound. */
+  size_t page_size = (size_t)sysconf (_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)mem->mem_host_ptr;
+  uintptr_t end = start + mem->size;
+  start = (start + page_size - 1) & ~(uintptr_t) (page_size - 1);
+  end = end & ~(uintptr_t) (page_size - 1);
+  if (end > start)
     {
-      ret = pthread_scheduler_init (device);
-      if (ret == CL_SUCCESS)
-        {
-          scheduler_initialized = 1;
-        }
+      if (pocl_topology_interleave_memory ((void *)start, end - start) != 0)
+        POCL_MSG_PRINT_MEMORY ("Could not interleave buffer %p pages\n",
+                               mem->mem_host_ptr);
     }
 
-  return ret;
+  return CL_SUCCESS;
 }
 
 void
@@ -274,24 +334,98 @@ void
 pocl_pthread_submit (_cl_command_node *node, cl_command_queue cq)
 {
   node->ready = 1;
+  if (node->type == CL_COMMAND_NDRANGE_KERNEL)
+    node->command.run.fusion_open = 1;
   if (pocl_command_is_ready (node->event))
     {
       pocl_update_event_submitted (node->event);
       pthread_scheduler_push_command (node);
     }
+  else if (node->type == CL_COMMAND_NDRANGE_KERNEL)
+    pthread_scheduler_try_fuse (node);
   POCL_UNLOCK_OBJ (node->event);
   return;
 }
 
+/* The NDRanges of clEnqueueNDRangeKernelBatchPoCL run as one command, whose
+ * WGs the scheduler takes from all of them. */
+int
+pocl_pthread_can_run_command_buffer (cl_device_id device,
+                                     cl_command_buffer_khr command_buffer)
+{
+  cl_uint i;
+
+  if (!command_buffer->independent)
+    return 0;
+  for (i = 0; i < command_buffer->num_commands; ++i)
+    if (command_buffer->commands[i]->node.type != CL_COMMAND_NDRANGE_KERNEL)
+      return 0;
+  return 1;
+}
+
 void
 pocl_pthread_flush(cl_device_id device, cl_command_queue cq)
 {
 
 }
 
+static int
+queue_is_empty (void *arg)
+{
+  return ((volatile struct _cl_command_queue *)arg)->command_count == 0;
+}
+
+static int
+event_is_finished (void *arg)
+{
+  return ((volatile struct _cl_event *)arg)->status <= CL_COMPLETE;
+}
+
+/* Busy-waits, with exponential backoff between the polls, until done (arg)
+ * or until the spin window of cq runs out; the caller then sleeps on its
+ * condition as usual. The window doubles (up to cq->wait_spin_ns) when the
+ * spinning succeeds and halves when it does not, so that waits for long
+ * commands soon stop burning the CPU. The window is only a hint, so the
+ * concurrent updates are not synchronized. */
+static void
+spin_wait (cl_command_queue cq, int (*done) (void *), void *arg)
+{
+  cl_ulong window = cq->wait_spin_window_ns;
+  if (window == 0)
+    {
+      /* let an occasional wait try again */
+      if (cq->wait_spin_ns)
+        cq->wait_spin_window_ns = 1000;
+      return;
+    }
+
+  uint64_t deadline = pocl_gettimemono_ns () + window;
+  unsigned pauses = 1, i;
+  do
+    {
+      if (done (arg))
+        {
+          window *= 2;
+          cq->wait_spin_window_ns
+              = (window > cq->wait_spin_ns) ? cq->wait_spin_ns : window;
+          return;
+        }
+      for (i = 0; i < pauses; ++i)
+        POCL_CPU_RELAX ();
+      if (pauses < 64)
+        pauses *= 2;
+    }
+  while (pocl_gettimemono_ns () < deadline);
+  cq->wait_spin_window_ns = window / 2;
+}
+
 void
 pocl_pthread_join(cl_device_id device, cl_command_queue cq)
 {
+  pthread_scheduler_assist (queue_is_empty, cq);
+  if (cq->wait_spin_ns)
+    spin_wait (cq, queue_is_empty, cq);
+
   POCL_LOCK_OBJ (cq);
   pthread_cond_t *cq_cond = (pthread_cond_t *)cq->data;
   while (1)
@@ -371,6 +505,10 @@ void pocl_pthread_wait_event (cl_device_id device, cl_event event)
 {
   struct event_data *e_d = event->data;
 
+  pthread_scheduler_assist (event_is_finished, event);
+  if (event->queue->wait_spin_ns)
+    spin_wait (event->queue, event_is_finished, event);
+
   POCL_LOCK_OBJ (event);
   while (event->status > CL_COMPLETE)
     {
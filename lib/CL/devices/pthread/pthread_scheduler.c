@@ -27,6 +27,9 @@
 #include <sched.h>
 #endif
 
+#include <errno.h>
+#include <fenv.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <string.h>
 #include <time.h>
@@ -36,20 +39,49 @@
 #include "pocl_cl.h"
 #include "pocl-pthread.h"
 #include "pocl-pthread_utils.h"
+#include "pocl_device_enqueue.h"
+#include "pocl_local_size.h"
 #include "utlist.h"
 #include "pocl_util.h"
 #include "common.h"
+#include "common_driver.h"
 #include "pocl_mem_management.h"
+#include "pocl_perf_counters.h"
+#include "pocl_stats.h"
+#include "pocl_timing.h"
+#include "topology/pocl_topology.h"
+#include "pocl_tracing.h"
+#include "printf_buffer.h"
 
 static void* pocl_pthread_driver_thread (void *p);
+static void free_run_cmd_list (kernel_run_command *k);
+static void run_preempting_work (thread_data *td);
+static void release_wg_children (thread_data *td);
+static void finalize_enqueued_run (thread_data *td, kernel_run_command *k);
+static void init_device_enqueue (cl_device_id device);
+
+/* The ready queues of the commands and kernels, one per
+ * cl_khr_priority_hints level, see queue_priority_level(). */
+#define POCL_PTHREAD_NUM_PRIORITIES 3
+
+/* The local memory and printf buffer of a kernel run from a preemption
+ * point, while the preempted kernel keeps using those of the thread. */
+typedef struct
+{
+  void *local_mem;
+  size_t local_mem_size;
+  void *printf_buffer;
+} nested_buffers;
 
 struct pool_thread_data
 {
   pthread_t thread __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
   unsigned long executed_commands;
-  /* per-CU (= per-thread) local memory */
+  /* per-CU (= per-thread) local memory, grown to the largest need of the
+   * kernels the thread has run, see reserve_local_mem */
   void *local_mem;
+  size_t local_mem_size;
   unsigned current_ftz;
   unsigned num_threads;
   /* index of this particular thread
@@ -59,6 +91,62 @@ struct pool_thread_data
   unsigned index;
   /* printf buffer*/
   void *printf_buffer;
+  /* state of the PRNG used for picking victims in work-stealing mode */
+  uint32_t steal_seed;
+
+  /* per-thread wait slot: the thread sleeps on its own condition
+   * (with scheduler.wq_lock_fast held), and pushers wake up only
+   * as many sleeping threads as there is work for. Both are
+   * protected by scheduler.wq_lock_fast. */
+  pthread_cond_t wakeup_cond;
+  int sleeping;
+  /* set while the thread busy-waits before going to sleep; pushers
+   * clear it instead of signaling wakeup_cond. Written under
+   * scheduler.wq_lock_fast, polled without it. */
+  volatile int spinning;
+  /* NUMA node of the CPU this thread runs on */
+  unsigned numa_node;
+  /* set once the thread has been pinned to its own CPU */
+  int pinned;
+  /* the relative capacity of that CPU, POCL_CPU_CAPACITY_MAX on the
+   * fastest CPUs and on hosts whose CPUs are all alike */
+  unsigned capacity;
+
+  /* Cache of kernel_run_commands (each with its argument arena) for the
+   * kernels prepared by this thread, so that a steady-state launch does
+   * no heap allocation. free_run_cmds is only touched by this thread;
+   * whichever thread finalizes a command pushes it to returned_run_cmds. */
+  kernel_run_command *free_run_cmds;
+  kernel_run_command *volatile returned_run_cmds;
+
+  /* this thread's POCL_PERF_COUNTERS, -1 if not opened */
+  int perf_fds[POCL_PERF_MAX_COUNTERS];
+
+  /* Elastic pool: running is set while the slot has a live thread,
+   * joinable while a thread created for the slot has not been joined.
+   * Both are protected by scheduler.wq_lock_fast. initial is set for the
+   * threads started by pthread_scheduler_init, which wait on init_barrier. */
+  int running;
+  int joinable;
+  int initial;
+
+  /* POCL_PREEMPTION_POINTS: the kernels poll preempt.requested, which the
+   * pushers of higher priority work set when run_level (the priority of
+   * the kernel the thread runs, POCL_PTHREAD_NUM_PRIORITIES if none) is
+   * lower, and then run that work in run_preempting_work with the
+   * buffers of nested[nested_depth]. */
+  struct pocl_preempt_point preempt
+      __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
+  volatile unsigned run_level;
+  unsigned nested_depth;
+  nested_buffers nested[POCL_PTHREAD_NUM_PRIORITIES - 1];
+
+  /* Device-side enqueue: the callbacks the WGs run by the thread reach
+   * through their context, the kernel of the running WG, and the children
+   * the WG has enqueued with CLK_ENQUEUE_FLAGS_WAIT_WORK_GROUP. */
+  struct pocl_device_enqueue device_enqueue;
+  kernel_run_command *enqueuing;
+  pthread_child *wg_children;
 } __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
 typedef struct scheduler_data_
@@ -67,13 +155,25 @@ typedef struct scheduler_data_
   unsigned printf_buf_size;
 
   struct pool_thread_data *thread_pool;
-  size_t local_mem_size;
+  /* of the driver threads, 0 for the default */
+  size_t stack_size;
 
-  _cl_command_node *work_queue
+  _cl_command_node *work_queue[POCL_PTHREAD_NUM_PRIORITIES]
+      __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
+  kernel_run_command *kernel_queue[POCL_PTHREAD_NUM_PRIORITIES];
+  /* incremented every time a kernel is pushed to kernel_queue; threads
+   * working on a kernel use it to notice they should rebalance */
+  volatile unsigned kernel_queue_gen;
+
+  /* The commands pushed by pthread_scheduler_push_command, a lock-free
+   * LIFO linked through their next pointers. The threads move them to
+   * work_queue in one batch, with wq_lock_fast held, see drain_inbox(). */
+  _cl_command_node *volatile inbox
       __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
-  kernel_run_command *kernel_queue;
+  /* the threads sleeping on their wakeup_cond; updated with wq_lock_fast
+   * held, read by the pushers without it */
+  volatile unsigned num_sleeping;
 
-  pthread_cond_t wake_pool __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
   POCL_FAST_LOCK_T wq_lock_fast __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
   int thread_pool_shutdown_requested;
@@ -82,10 +182,389 @@ typedef struct scheduler_data_
       __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
   int worker_out_of_memory;
+
+  /* if nonzero, use the work-stealing WG scheduler instead of the
+   * default one which hands out chunks of WGs under k->lock */
+  int work_stealing;
+
+  /* if nonzero, hand out the WGs of 2D/3D grids in XY tiles instead of
+   * in row-major order */
+  int wg_order_tiled;
+
+  /* Idle policy: an idle thread busy-waits for at most max_spin_ns for new
+   * work before sleeping. The actual window is derived from the running
+   * average of the time between pushes (updated without wq_lock_fast by
+   * the command pushes, see record_push_time):
+   * spinning only pays off if the next command is likely to arrive soon. */
+  uint64_t max_spin_ns;
+  uint64_t last_push_ns;
+  uint64_t avg_interarrival_ns;
+
+  /* NUMA-aware placement: threads are bound to the CPUs of their node
+   * and each node gets a contiguous block of the WG index space.
+   * The topology arrays are owned by the root device. */
+  int numa_aware;
+  unsigned num_numa_nodes;
+  unsigned num_cpus;
+  const unsigned *cpu_numa_node;
+  const unsigned *cpu_os_index;
+  /* Hybrid CPUs: the capacities of the CPUs, NULL if they are all alike */
+  const unsigned *cpu_capacity;
+
+  /* Host assist: an application thread blocked in a wait runs WGs with
+   * host_td (index num_threads, i.e. no subdevice's) until the wait is
+   * over. Only one thread at a time, the others just wait. */
+  int host_assist;
+  volatile int host_assist_busy;
+  struct pool_thread_data *host_td;
+
+  /* if nonzero, chains of kernels that only access their buffers at
+   * get_global_id(0) run work-group by work-group together */
+  int kernel_fusion;
+
+  /* if nonzero, the kernels are compiled with preemption points, and the
+   * pushers of higher priority work request the threads running lower
+   * priority kernels to yield, see run_preempting_work */
+  int preemption_points;
+
+  /* if nonzero, the threads record when they run the chunks of WGs of
+   * each kernel, and the per-kernel imbalance is printed at exit */
+  int wg_timeline;
+
+  /* Fair share between contexts: while kernels of several contexts are
+   * ready (contended, updated with wq_lock_fast held), a kernel may take
+   * at most fair_share_chunks times the weight of its context chunks of
+   * WGs per quantum; a new quantum starts when all the ready kernels have
+   * used theirs. 0 disables. */
+  unsigned fair_share_chunks;
+  volatile int contended;
+
+  /* buffer reads, writes, copies and fills of at least this many bytes
+   * are split into chunks that the threads run like WGs; 0 disables */
+  size_t bulk_mem_min;
+
+  /* Elastic pool: only min_threads threads are started at init, the rest
+   * when there is work no idle thread can take. Threads above min_threads
+   * exit after sleeping for idle_timeout_ms. num_running is protected by
+   * wq_lock_fast. */
+  int elastic;
+  unsigned min_threads;
+  unsigned idle_timeout_ms;
+  unsigned num_running;
+
+  /* POCL_PREFORK: fork() waits in its prepare handler on fork_cond until
+   * the pool is idle, with fork_waiting set meanwhile. The threads don't
+   * exist in the child, which starts them again when it first queues
+   * work (restart_after_fork). All protected by wq_lock_fast. */
+  pthread_cond_t fork_cond;
+  int fork_waiting;
+  int restart_after_fork;
+
+  /* the device_enqueue of the threads, see init_device_enqueue() */
+  struct pocl_device_enqueue device_enqueue;
 } scheduler_data __attribute__ ((aligned (HOST_CPU_CACHELINE_SIZE)));
 
 static scheduler_data scheduler;
 
+/* Per-kernel summary of the WG timelines, see summarize_wg_timeline(). */
+#define POCL_PTHREAD_TIMELINE_MAX_KERNELS 256
+
+typedef struct wg_timeline_stats
+{
+  char *name;
+  unsigned long launches;
+  uint64_t span_ns;
+  uint64_t dispatch_ns;
+  uint64_t tail_ns;
+  uint64_t busy_ns;
+  /* thread-time the launches could have used, threads * span */
+  uint64_t capacity_ns;
+  /* max / mean busy time of the threads that ran WGs, in 1/1000 */
+  uint64_t imbalance_sum;
+  uint64_t worst_imbalance;
+  uint64_t threads;
+  uint64_t chunks;
+  uint64_t wgs;
+} wg_timeline_stats;
+
+static wg_timeline_stats timeline_stats[POCL_PTHREAD_TIMELINE_MAX_KERNELS];
+static wg_timeline_stats timeline_other;
+static pocl_lock_t timeline_lock;
+
+static int
+order_by_span (const void *a, const void *b)
+{
+  const wg_timeline_stats *x = *(wg_timeline_stats *const *)a;
+  const wg_timeline_stats *y = *(wg_timeline_stats *const *)b;
+  return (x->span_ns < y->span_ns) - (x->span_ns > y->span_ns);
+}
+
+static void
+print_wg_timeline_stats ()
+{
+  wg_timeline_stats *sorted[POCL_PTHREAD_TIMELINE_MAX_KERNELS + 1];
+  unsigned i, n = 0;
+
+  POCL_LOCK (timeline_lock);
+  for (i = 0; i < POCL_PTHREAD_TIMELINE_MAX_KERNELS; ++i)
+    if (timeline_stats[i].launches)
+      sorted[n++] = &timeline_stats[i];
+  if (timeline_other.launches)
+    sorted[n++] = &timeline_other;
+  if (n == 0)
+    {
+      POCL_UNLOCK (timeline_lock);
+      return;
+    }
+  qsort (sorted, n, sizeof (wg_timeline_stats *), order_by_span);
+
+  printf ("\n");
+  printf ("     %-30s %8s %10s %10s %10s %6s %6s %5s %7s %9s\n",
+          "pthread WG timeline", "launches", "avg us", "wait us", "tail us",
+          "imbal", "worst", "eff", "threads", "WGs/chunk");
+  for (i = 0; i < n; ++i)
+    {
+      wg_timeline_stats *st = sorted[i];
+      unsigned long l = st->launches;
+      printf ("%3u) %-30.30s %8lu %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+              " %6.2f %6.2f %4" PRIu64 "%% %7.1f %9.1f\n",
+              i + 1, st == &timeline_other ? "(other)" : st->name, l,
+              st->span_ns / l / 1000, st->dispatch_ns / l / 1000,
+              st->tail_ns / l / 1000, st->imbalance_sum / 1000.0 / l,
+              st->worst_imbalance / 1000.0,
+              st->busy_ns * 100 / (st->capacity_ns + !st->capacity_ns),
+              (double)st->threads / l,
+              (double)st->wgs / (st->chunks + !st->chunks));
+    }
+  fflush (stdout);
+  POCL_UNLOCK (timeline_lock);
+}
+
+static void
+init_wg_timeline_stats ()
+{
+  static int initialized = 0;
+  if (initialized)
+    return;
+  initialized = 1;
+  POCL_INIT_LOCK (timeline_lock);
+  atexit (print_wg_timeline_stats);
+}
+
+/* Adds the timelines of a finished kernel to the stats of its kernel.
+ * The fused kernels are accounted to the first one. */
+static void
+summarize_wg_timeline (kernel_run_command *k)
+{
+  uint64_t first_start = UINT64_MAX, first_end = UINT64_MAX, last_end = 0;
+  uint64_t busy = 0, max_busy = 0;
+  unsigned threads = 0, chunks = 0, wgs = 0, i;
+
+  for (i = 0; i < k->num_timelines; ++i)
+    {
+      pocl_wg_thread_timeline *tl = &k->timeline[i];
+      if (tl->num_chunks == 0)
+        continue;
+      ++threads;
+      chunks += tl->num_chunks;
+      wgs += tl->num_wgs;
+      busy += tl->busy_ns;
+      max_busy = max (max_busy, tl->busy_ns);
+      first_start = min (first_start, tl->first_start_ns);
+      first_end = min (first_end, tl->last_end_ns);
+      last_end = max (last_end, tl->last_end_ns);
+    }
+  if (threads == 0)
+    return;
+
+  uint64_t span = last_end - first_start;
+  uint64_t mean_busy = busy / threads;
+  uint64_t imbalance = max_busy * 1000 / (mean_busy + !mean_busy);
+  /* the idle threads of the (sub)device count against the efficiency */
+  unsigned device_threads = max (k->device->max_compute_units, threads);
+  const char *name = k->kernel->name;
+
+  POCL_LOCK (timeline_lock);
+  wg_timeline_stats *st = &timeline_other;
+  for (i = 0; i < POCL_PTHREAD_TIMELINE_MAX_KERNELS; ++i)
+    {
+      if (timeline_stats[i].name == NULL)
+        {
+          timeline_stats[i].name = strdup (name);
+          if (timeline_stats[i].name)
+            st = &timeline_stats[i];
+          break;
+        }
+      if (strcmp (timeline_stats[i].name, name) == 0)
+        {
+          st = &timeline_stats[i];
+          break;
+        }
+    }
+  ++st->launches;
+  st->span_ns += span;
+  st->dispatch_ns += first_start > k->push_ns ? first_start - k->push_ns : 0;
+  st->tail_ns += last_end - first_end;
+  st->busy_ns += busy;
+  st->capacity_ns += span * device_threads;
+  st->imbalance_sum += imbalance;
+  st->worst_imbalance = max (st->worst_imbalance, imbalance);
+  st->threads += threads;
+  st->chunks += chunks;
+  st->wgs += wgs;
+  POCL_UNLOCK (timeline_lock);
+}
+
+/* Starts a driver thread in the slot, joining its previous thread first.
+ * Must be called with wq_lock_fast held, or before the threads run. */
+static int
+start_thread (struct pool_thread_data *td)
+{
+  if (td->joinable)
+    {
+      /* the previous thread has released the lock for good */
+      PTHREAD_CHECK (pthread_join (td->thread, NULL));
+      td->joinable = 0;
+    }
+  pthread_attr_t attr;
+  PTHREAD_CHECK (pthread_attr_init (&attr));
+  if (scheduler.stack_size > 0
+      && pthread_attr_setstacksize (&attr, scheduler.stack_size) != 0)
+    POCL_MSG_WARN ("Could not set the stack size of the pthread driver "
+                   "threads to %zu bytes\n",
+                   scheduler.stack_size);
+  int failed = pthread_create (&td->thread, &attr, pocl_pthread_driver_thread,
+                               (void *)td);
+  PTHREAD_CHECK (pthread_attr_destroy (&attr));
+  if (failed)
+    return 0;
+  td->joinable = 1;
+  td->running = 1;
+  ++scheduler.num_running;
+  return 1;
+}
+
+/* Returns 1 if no command or kernel is ready and all the live threads
+ * sleep. Must be called with wq_lock_fast held. */
+static int
+pool_is_idle ()
+{
+  unsigned i;
+  if (scheduler.inbox != NULL)
+    return 0;
+  for (i = 0; i < POCL_PTHREAD_NUM_PRIORITIES; ++i)
+    if (scheduler.work_queue[i] != NULL || scheduler.kernel_queue[i] != NULL)
+      return 0;
+  if (scheduler.host_assist_busy)
+    return 0;
+  for (i = 0; i < scheduler.num_threads; ++i)
+    if (scheduler.thread_pool[i].running && !scheduler.thread_pool[i].sleeping)
+      return 0;
+  return 1;
+}
+
+/* Called by the threads going to sleep or retiring, with wq_lock_fast
+ * held. */
+static void
+notify_fork_waiter ()
+{
+  if (scheduler.fork_waiting)
+    PTHREAD_CHECK (pthread_cond_signal (&scheduler.fork_cond));
+}
+
+/* The fork handlers of POCL_PREFORK. The prepare handler keeps
+ * wq_lock_fast locked over the fork, so the threads take no work
+ * meanwhile. The commands the other application threads push meanwhile
+ * are dropped from the inbox of the child, where those threads don't
+ * exist either. */
+static void
+pthread_scheduler_prefork ()
+{
+  if (scheduler.thread_pool == NULL)
+    return;
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  scheduler.fork_waiting = 1;
+  while (!pool_is_idle ())
+    PTHREAD_CHECK (
+        pthread_cond_wait (&scheduler.fork_cond, &scheduler.wq_lock_fast));
+  scheduler.fork_waiting = 0;
+}
+
+static void
+pthread_scheduler_postfork_parent ()
+{
+  if (scheduler.thread_pool == NULL)
+    return;
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+}
+
+/* Frees the buffers of the kernels the thread has run from its preemption
+ * point. */
+static void
+free_nested_buffers (thread_data *td)
+{
+  unsigned i;
+  for (i = 0; i < POCL_PTHREAD_NUM_PRIORITIES - 1; ++i)
+    {
+      pocl_aligned_free (td->nested[i].local_mem);
+      pocl_aligned_free (td->nested[i].printf_buffer);
+      td->nested[i].local_mem = td->nested[i].printf_buffer = NULL;
+      td->nested[i].local_mem_size = 0;
+    }
+}
+
+/* The yield of the preemption point of the thread, called by its kernels
+ * once they see preempt.requested. */
+static void
+preempt_yield (struct pocl_preempt_point *point)
+{
+  run_preempting_work (
+      (thread_data *)((char *)point - offsetof (thread_data, preempt)));
+}
+
+/* Only the forking thread exists in the child: the slots of the others are
+ * emptied, with the buffers they had allocated, and the threads are
+ * started again by wake_idle_threads. The cached run commands and the
+ * kernels built by the parent stay valid. */
+static void
+pthread_scheduler_postfork_child ()
+{
+  unsigned i;
+  if (scheduler.thread_pool == NULL)
+    return;
+  for (i = 0; i < scheduler.num_threads; ++i)
+    {
+      struct pool_thread_data *td = &scheduler.thread_pool[i];
+      if (td->running)
+        {
+          pocl_aligned_free (td->printf_buffer);
+          pocl_aligned_free (td->local_mem);
+          td->printf_buffer = td->local_mem = NULL;
+          td->local_mem_size = 0;
+          free_nested_buffers (td);
+          pocl_perf_counters_close (td->perf_fds);
+        }
+      td->running = td->joinable = td->sleeping = td->spinning = 0;
+      PTHREAD_CHECK (pthread_cond_init (&td->wakeup_cond, NULL));
+    }
+  pocl_stat_gauge_add (POCL_STAT_PTHREAD_THREADS,
+                       -(int64_t)scheduler.num_running);
+  scheduler.num_running = 0;
+  scheduler.num_sleeping = 0;
+  scheduler.inbox = NULL;
+  scheduler.restart_after_fork = 1;
+  PTHREAD_CHECK (pthread_cond_init (&scheduler.fork_cond, NULL));
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+}
+
+static void
+register_fork_handlers ()
+{
+  PTHREAD_CHECK (pthread_atfork (pthread_scheduler_prefork,
+                                 pthread_scheduler_postfork_parent,
+                                 pthread_scheduler_postfork_child));
+}
+
 cl_int
 pthread_scheduler_init (cl_device_id device)
 {
@@ -93,8 +572,6 @@ pthread_scheduler_init (cl_device_id device)
   size_t num_worker_threads = device->max_compute_units;
   POCL_FAST_INIT (scheduler.wq_lock_fast);
 
-  PTHREAD_CHECK (pthread_cond_init (&(scheduler.wake_pool), NULL));
-
   scheduler.thread_pool = pocl_aligned_malloc (
       HOST_CPU_CACHELINE_SIZE,
       num_worker_threads * sizeof (struct pool_thread_data));
@@ -106,21 +583,153 @@ pthread_scheduler_init (cl_device_id device)
   scheduler.printf_buf_size = device->printf_buffer_size;
   assert (device->printf_buffer_size > 0);
 
-  /* safety margin - aligning pointers later (in kernel arg setup)
-   * may require more local memory than actual local mem size.
-   * TODO fix this */
-  scheduler.local_mem_size = device->local_mem_size + device->max_parameter_size * MAX_EXTENDED_ALIGNMENT;
+  /* The local memory of the threads is allocated when they run kernels
+   * that need it, and the private arrays of the work-items are on their
+   * stacks. POCL_PTHREAD_STACK_SIZE is in KB. */
+  scheduler.stack_size
+      = (size_t)pocl_get_int_option ("POCL_PTHREAD_STACK_SIZE", 0) * 1024;
+
+  int min_threads = pocl_get_int_option ("POCL_PTHREAD_MIN_THREADS", 0);
+  scheduler.elastic
+      = (min_threads > 0 && (size_t)min_threads < num_worker_threads);
+  scheduler.min_threads
+      = scheduler.elastic ? (unsigned)min_threads : num_worker_threads;
+  int idle_timeout
+      = pocl_get_int_option ("POCL_PTHREAD_IDLE_TIMEOUT_MS", 5000);
+  scheduler.idle_timeout_ms = idle_timeout > 0 ? (unsigned)idle_timeout : 1;
+  scheduler.num_running = 0;
 
   PTHREAD_CHECK (pthread_barrier_init (&scheduler.init_barrier, NULL,
-                                       num_worker_threads + 1));
+                                       scheduler.min_threads + 1));
   scheduler.worker_out_of_memory = 0;
 
+  const char *wg_order
+      = pocl_get_string_option ("POCL_PTHREAD_WG_ORDER", "rowmajor");
+  if (strcmp (wg_order, "tiled") == 0)
+    scheduler.wg_order_tiled = 1;
+  else
+    {
+      if (strcmp (wg_order, "rowmajor") != 0)
+        POCL_MSG_WARN ("Unknown POCL_PTHREAD_WG_ORDER value '%s', "
+                       "using 'rowmajor'\n", wg_order);
+      scheduler.wg_order_tiled = 0;
+    }
+
+  /* On hybrid CPUs the threads of the slower cores finish their share
+   * later, which the work-stealing scheduler evens out. */
+  const char *sched_mode = pocl_get_string_option (
+      "POCL_PTHREAD_SCHEDULER",
+      device->num_cpu_kinds > 1 ? "stealing" : "chunked");
+  if (strcmp (sched_mode, "stealing") == 0)
+    scheduler.work_stealing = 1;
+  else
+    {
+      if (strcmp (sched_mode, "chunked") != 0)
+        POCL_MSG_WARN ("Unknown POCL_PTHREAD_SCHEDULER value '%s', "
+                       "using 'chunked'\n", sched_mode);
+      scheduler.work_stealing = 0;
+    }
+
+  scheduler.num_cpus = device->num_cpus;
+  scheduler.cpu_numa_node = device->cpu_numa_node;
+  scheduler.cpu_os_index = device->cpu_os_index;
+  scheduler.cpu_capacity = device->cpu_capacity;
+  scheduler.num_numa_nodes = device->num_numa_nodes;
+  scheduler.numa_aware = 0;
+  if (pocl_get_bool_option ("POCL_PTHREAD_NUMA", 0))
+    {
+      if (device->num_numa_nodes > 1 && device->cpu_numa_node != NULL)
+        scheduler.numa_aware = 1;
+      else
+        POCL_MSG_PRINT_GENERAL ("POCL_PTHREAD_NUMA: the host has a single "
+                                "NUMA node, ignoring\n");
+    }
+
+  scheduler.max_spin_ns
+      = (uint64_t)pocl_get_int_option ("POCL_PTHREAD_SPIN_USEC", 0) * 1000;
+
+  scheduler.kernel_fusion
+      = pocl_get_bool_option ("POCL_PTHREAD_KERNEL_FUSION", 0);
+
+  scheduler.preemption_points = device->preemption_points;
+
+  init_device_enqueue (device);
+
+  scheduler.wg_timeline = pocl_get_bool_option ("POCL_PTHREAD_WG_TIMELINE", 0);
+
+  int fair_share = pocl_get_int_option ("POCL_PTHREAD_FAIR_SHARE", 0);
+  scheduler.fair_share_chunks = fair_share > 0 ? (unsigned)fair_share : 0;
+  scheduler.contended = 0;
+
+  int bulk_mem_min
+      = pocl_get_int_option ("POCL_PTHREAD_BULK_MEM_MIN", 4 * 1024 * 1024);
+  scheduler.bulk_mem_min = bulk_mem_min > 0 ? (size_t)bulk_mem_min : 0;
+  if (scheduler.wg_timeline)
+    init_wg_timeline_stats ();
+
+  scheduler.host_assist = 0;
+  scheduler.host_assist_busy = 0;
+  scheduler.host_td = NULL;
+  if (pocl_get_bool_option ("POCL_PTHREAD_HOST_ASSIST", 0))
+    {
+      thread_data *htd = pocl_aligned_malloc (HOST_CPU_CACHELINE_SIZE,
+                                              sizeof (thread_data));
+      if (htd)
+        {
+          memset (htd, 0, sizeof (thread_data));
+          htd->index = num_worker_threads;
+          htd->num_threads = num_worker_threads;
+          htd->capacity = POCL_CPU_CAPACITY_MAX;
+          htd->steal_seed = 2654435761U * (htd->index + 1);
+          /* never pin the application's thread */
+          htd->pinned = 1;
+          /* the application's threads have no counters open */
+          for (i = 0; i < POCL_PERF_MAX_COUNTERS; ++i)
+            htd->perf_fds[i] = -1;
+          htd->printf_buffer = pocl_aligned_malloc (
+              MAX_EXTENDED_ALIGNMENT, scheduler.printf_buf_size);
+          /* never asked to yield, see request_preemption */
+          htd->preempt.yield = preempt_yield;
+          htd->device_enqueue = scheduler.device_enqueue;
+          htd->run_level = POCL_PTHREAD_NUM_PRIORITIES;
+          scheduler.host_td = htd;
+          if (htd->printf_buffer)
+            scheduler.host_assist = 1;
+        }
+    }
+  scheduler.last_push_ns = 0;
+  scheduler.avg_interarrival_ns = UINT64_MAX;
+
+  /* The handlers can't be unregistered, so they are registered once and
+   * check whether the pool exists. */
+  PTHREAD_CHECK (pthread_cond_init (&scheduler.fork_cond, NULL));
+  scheduler.fork_waiting = 0;
+  scheduler.restart_after_fork = 0;
+  if (pocl_get_bool_option ("POCL_PREFORK", 0))
+    {
+      static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+      PTHREAD_CHECK (pthread_once (&fork_handlers_once,
+                                   register_fork_handlers));
+    }
+
   for (i = 0; i < num_worker_threads; ++i)
     {
       scheduler.thread_pool[i].index = i;
-      PTHREAD_CHECK (pthread_create (&scheduler.thread_pool[i].thread, NULL,
-                                     pocl_pthread_driver_thread,
-                                     (void *)&scheduler.thread_pool[i]));
+      scheduler.thread_pool[i].capacity
+          = scheduler.cpu_capacity
+                ? scheduler.cpu_capacity[i % scheduler.num_cpus]
+                : POCL_CPU_CAPACITY_MAX;
+      if (scheduler.cpu_numa_node)
+        scheduler.thread_pool[i].numa_node
+            = scheduler.cpu_numa_node[i % scheduler.num_cpus];
+      PTHREAD_CHECK (
+          pthread_cond_init (&scheduler.thread_pool[i].wakeup_cond, NULL));
+    }
+  for (i = 0; i < scheduler.min_threads; ++i)
+    {
+      scheduler.thread_pool[i].initial = 1;
+      if (!start_thread (&scheduler.thread_pool[i]))
+        POCL_ABORT ("pthread_create failed\n");
     }
 
   PTHREAD_CHECK2 (PTHREAD_BARRIER_SERIAL_THREAD,
@@ -135,6 +744,12 @@ pthread_scheduler_init (cl_device_id device)
   return CL_SUCCESS;
 }
 
+int
+pthread_scheduler_numa_aware ()
+{
+  return scheduler.numa_aware;
+}
+
 void
 pthread_scheduler_uninit ()
 {
@@ -142,102 +757,547 @@ pthread_scheduler_uninit ()
 
   POCL_FAST_LOCK (scheduler.wq_lock_fast);
   scheduler.thread_pool_shutdown_requested = 1;
-  PTHREAD_CHECK (pthread_cond_broadcast (&scheduler.wake_pool));
+  for (i = 0; i < scheduler.num_threads; ++i)
+    {
+      scheduler.thread_pool[i].sleeping = 0;
+      scheduler.thread_pool[i].spinning = 0;
+      PTHREAD_CHECK (
+          pthread_cond_signal (&scheduler.thread_pool[i].wakeup_cond));
+    }
+  scheduler.num_sleeping = 0;
   POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
 
   for (i = 0; i < scheduler.num_threads; ++i)
     {
-      PTHREAD_CHECK (pthread_join (scheduler.thread_pool[i].thread, NULL));
+      struct pool_thread_data *td = &scheduler.thread_pool[i];
+      if (td->joinable)
+        PTHREAD_CHECK (pthread_join (td->thread, NULL));
+      PTHREAD_CHECK (pthread_cond_destroy (&td->wakeup_cond));
+      /* left behind by the threads which retired */
+      pocl_aligned_free (td->printf_buffer);
+      pocl_aligned_free (td->local_mem);
+      free_nested_buffers (td);
+      free_run_cmd_list (td->free_run_cmds);
+      free_run_cmd_list (td->returned_run_cmds);
     }
 
   pocl_aligned_free (scheduler.thread_pool);
+  scheduler.thread_pool = NULL;
+  PTHREAD_CHECK (pthread_cond_destroy (&scheduler.fork_cond));
+  if (scheduler.host_td)
+    {
+      pocl_aligned_free (scheduler.host_td->printf_buffer);
+      pocl_aligned_free (scheduler.host_td->local_mem);
+      free_nested_buffers (scheduler.host_td);
+      free_run_cmd_list (scheduler.host_td->free_run_cmds);
+      free_run_cmd_list (scheduler.host_td->returned_run_cmds);
+      pocl_aligned_free (scheduler.host_td);
+      scheduler.host_td = NULL;
+    }
+  scheduler.host_assist = 0;
   POCL_FAST_DESTROY (scheduler.wq_lock_fast);
-  PTHREAD_CHECK (pthread_cond_destroy (&scheduler.wake_pool));
   PTHREAD_CHECK (pthread_barrier_destroy (&scheduler.init_barrier));
 
   scheduler.thread_pool_shutdown_requested = 0;
 }
 
-/* push_command and push_kernel MUST use broadcast and wake up all threads,
-   because commands can be for subdevices (= not all threads) */
-void pthread_scheduler_push_command (_cl_command_node *cmd)
+/* Wakes up at most max_threads sleeping threads that are allowed to run
+ * commands of the given (sub)device. With an elastic pool, the remaining
+ * work is given to newly started threads. Must be called with wq_lock_fast
+ * held.
+ *
+ * Threads which are awake always recheck both queues before going to sleep,
+ * so it's safe to wake up fewer threads than there is work for. */
+static void
+wake_idle_threads (cl_device_id subd, unsigned max_threads)
 {
-  POCL_FAST_LOCK (scheduler.wq_lock_fast);
-  DL_APPEND (scheduler.work_queue, cmd);
-  PTHREAD_CHECK (pthread_cond_broadcast (&scheduler.wake_pool));
-  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+  unsigned i;
+  unsigned first = 0;
+  unsigned last = scheduler.num_threads;
+
+  if (scheduler.restart_after_fork)
+    {
+      /* the first work queued in a forked child */
+      scheduler.restart_after_fork = 0;
+      for (i = 0; i < scheduler.min_threads; ++i)
+        if (!start_thread (&scheduler.thread_pool[i]))
+          POCL_MSG_WARN ("Could not restart the pthread worker %u after "
+                         "fork\n",
+                         i);
+    }
+
+  if (subd && subd->parent_device)
+    {
+      first = subd->core_start;
+      last = subd->core_start + subd->core_count;
+    }
+
+  for (i = first; i < last && max_threads > 0; ++i)
+    {
+      struct pool_thread_data *td = &scheduler.thread_pool[i];
+      if (td->spinning)
+        {
+          td->spinning = 0;
+          --max_threads;
+        }
+      else if (td->sleeping)
+        {
+          td->sleeping = 0;
+          --scheduler.num_sleeping;
+          PTHREAD_CHECK (pthread_cond_signal (&td->wakeup_cond));
+          --max_threads;
+        }
+    }
+
+  if (!scheduler.elastic || scheduler.thread_pool_shutdown_requested)
+    return;
+  for (i = first; i < last && max_threads > 0; ++i)
+    {
+      struct pool_thread_data *td = &scheduler.thread_pool[i];
+      if (!td->running && start_thread (td))
+        --max_threads;
+    }
 }
 
+/* Updates the average time between pushes, used to size the spin window.
+ * May be called without wq_lock_fast: the pushes racing on the average
+ * only lose a sample of it. */
+static int shall_we_run_this (thread_data *td, cl_device_id subd);
+
 static void
-pthread_scheduler_push_kernel (kernel_run_command *run_cmd)
+record_push_time ()
 {
-  POCL_FAST_LOCK (scheduler.wq_lock_fast);
-  DL_APPEND (scheduler.kernel_queue, run_cmd);
-  PTHREAD_CHECK (pthread_cond_broadcast (&scheduler.wake_pool));
-  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+  if (scheduler.max_spin_ns == 0)
+    return;
+
+  uint64_t now = pocl_gettimemono_ns ();
+  uint64_t last = __sync_lock_test_and_set (&scheduler.last_push_ns, now);
+  if (last > 0 && now > last)
+    {
+      uint64_t delta = now - last;
+      if (scheduler.avg_interarrival_ns == UINT64_MAX)
+        scheduler.avg_interarrival_ns = delta;
+      else
+        /* exponential moving average, alpha = 1/8 */
+        scheduler.avg_interarrival_ns
+            = scheduler.avg_interarrival_ns
+              - scheduler.avg_interarrival_ns / 8 + delta / 8;
+    }
 }
 
-/* if subd is not a subdevice, returns 1
- * if subd is subdevice, takes a look at the subdevice CUs
- * and if they match the current driver thread, returns 1
- * otherwise returns 0 */
+/* Returns the busy-wait window for an idle thread, in nanoseconds.
+ * Must be called with wq_lock_fast held. */
+static uint64_t
+get_spin_window ()
+{
+  if (scheduler.max_spin_ns == 0
+      || scheduler.avg_interarrival_ns > scheduler.max_spin_ns)
+    return 0;
+  return min (scheduler.max_spin_ns, 2 * scheduler.avg_interarrival_ns);
+}
+
+/* Busy-waits until a pusher hands work to this thread by clearing
+ * td->spinning or a command arrives in the inbox, or until the window
+ * expires. Must be called with
+ * wq_lock_fast held; releases it while spinning. Returns 1 if the thread
+ * received work, 0 if it should go to sleep. */
 static int
-shall_we_run_this (thread_data *td, cl_device_id subd)
+spin_for_work (thread_data *td, uint64_t window_ns)
+{
+  unsigned i;
+  td->spinning = 1;
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+
+  uint64_t deadline = pocl_gettimemono_ns () + window_ns;
+  do
+    {
+      for (i = 0; i < 64 && td->spinning && scheduler.inbox == NULL; ++i)
+        POCL_CPU_RELAX ();
+    }
+  while (td->spinning && scheduler.inbox == NULL
+         && pocl_gettimemono_ns () < deadline);
+
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  if (td->spinning)
+    {
+      td->spinning = 0;
+      return scheduler.inbox != NULL;
+    }
+  return 1;
+}
+
+/* The ready queue of the commands of cq: 0 for CL_QUEUE_PRIORITY_HIGH_KHR,
+ * 1 for CL_QUEUE_PRIORITY_MED_KHR and the queues without a hint, 2 for
+ * CL_QUEUE_PRIORITY_LOW_KHR. The threads take work from the highest
+ * priority queue that has some for them. */
+static inline unsigned
+queue_priority_level (cl_command_queue cq)
+{
+  if (cq == NULL)
+    return 1;
+  switch (cq->priority)
+    {
+    case CL_QUEUE_PRIORITY_HIGH_KHR:
+      return 0;
+    case CL_QUEUE_PRIORITY_LOW_KHR:
+      return 2;
+    default:
+      return 1;
+    }
+}
+
+/* Sets the ready queue of run_cmd, and the most threads that may work on it
+ * at once: all the threads of its device for CL_QUEUE_THROTTLE_HIGH_KHR and
+ * the queues without a hint, half of them for CL_QUEUE_THROTTLE_MED_KHR and
+ * a quarter for CL_QUEUE_THROTTLE_LOW_KHR. Also sets its fair share. */
+static void
+set_run_scheduling (kernel_run_command *run_cmd)
 {
+  cl_command_queue cq = run_cmd->cmd->event->queue;
+  cl_device_id subd = run_cmd->device;
+  unsigned num_threads = scheduler.num_threads;
 
   if (subd && subd->parent_device)
+    num_threads = subd->core_count;
+
+  run_cmd->priority = queue_priority_level (cq);
+  run_cmd->max_threads = num_threads;
+  if (cq && cq->throttle == CL_QUEUE_THROTTLE_MED_KHR)
+    run_cmd->max_threads = (num_threads + 1) / 2;
+  else if (cq && cq->throttle == CL_QUEUE_THROTTLE_LOW_KHR)
+    run_cmd->max_threads = max (num_threads / 4, 1U);
+
+  run_cmd->context = run_cmd->cmd->event->context;
+  run_cmd->quantum_chunks
+      = scheduler.fair_share_chunks * run_cmd->context->scheduling_weight;
+  run_cmd->quantum_used = 0;
+}
+
+/* Sets scheduler.contended if the ready kernels with WGs left are of more
+ * than one context. Must be called with wq_lock_fast held. */
+static void
+update_contention ()
+{
+  kernel_run_command *k;
+  cl_context first = NULL;
+  unsigned level;
+
+  if (scheduler.fair_share_chunks == 0)
+    return;
+
+  for (level = 0; level < POCL_PTHREAD_NUM_PRIORITIES; ++level)
+    DL_FOREACH (scheduler.kernel_queue[level], k)
     {
-      if (!((td->index >= subd->core_start)
-            && (td->index < (subd->core_start + subd->core_count))))
+      if (k->remaining_wgs == 0)
+        continue;
+      if (first == NULL)
+        first = k->context;
+      else if (k->context != first)
         {
-          return 0;
+          scheduler.contended = 1;
+          return;
         }
     }
-  return 1;
+  scheduler.contended = 0;
 }
 
-/* Maximum and minimum chunk sizes for get_wg_index_range().
- * Each pthread driver's thread fetches work from a kernel's WG pool in
- * chunks, this determines the limits (scaled up by # of threads). */
-#define POCL_PTHREAD_MAX_WGS 256
-#define POCL_PTHREAD_MIN_WGS 32
+/* Returns nonzero if k may take another chunk of WGs in this quantum, and
+ * counts it. Read without wq_lock_fast; a thread may overshoot by a chunk
+ * when another context's kernel has just been pushed. */
+static inline int
+within_fair_share (kernel_run_command *k)
+{
+  if (scheduler.fair_share_chunks == 0)
+    return 1;
+  unsigned used = __sync_fetch_and_add (&k->quantum_used, 1);
+  return !scheduler.contended || used < k->quantum_chunks;
+}
 
-static int
-get_wg_index_range (kernel_run_command *k, unsigned *start_index,
-                    unsigned *end_index, int *last_wgs, unsigned num_threads)
+/* Moves the commands pushed since the last drain to the ready queues, in
+ * the order they were pushed. Must be called with wq_lock_fast held, which
+ * makes the threads the only consumer of the inbox. */
+static void
+drain_inbox ()
 {
-  const unsigned scaled_max_wgs = POCL_PTHREAD_MAX_WGS * num_threads;
-  const unsigned scaled_min_wgs = POCL_PTHREAD_MIN_WGS * num_threads;
+  _cl_command_node *cmd, *next, *fifo = NULL;
 
-  unsigned limit;
-  unsigned max_wgs;
-  POCL_FAST_LOCK (k->lock);
-  if (k->remaining_wgs == 0)
+  if (scheduler.inbox == NULL)
+    return;
+  /* taking the whole LIFO at once leaves the pushers nothing to race on */
+  cmd = __sync_lock_test_and_set (&scheduler.inbox, NULL);
+  for (; cmd != NULL; cmd = next)
     {
-      POCL_FAST_UNLOCK (k->lock);
-      return 0;
+      next = cmd->next;
+      cmd->next = fifo;
+      fifo = cmd;
+    }
+  for (cmd = fifo; cmd != NULL; cmd = next)
+    {
+      next = cmd->next;
+      DL_APPEND (
+          scheduler.work_queue[queue_priority_level (cmd->event->queue)],
+          cmd);
     }
+}
 
-  /* If the work is comprised of huge number of WGs of small WIs,
-   * then get_wg_index_range() becomes a problem on manycore CPUs
-   * because lock contention on k->lock.
-   *
-   * If we have enough workgroups, scale up the requests linearly by
-   * num_threads, otherwise fallback to smaller workgroups.
-   */
-  if (k->remaining_wgs <= (scaled_max_wgs * num_threads))
-    limit = scaled_min_wgs;
-  else
-    limit = scaled_max_wgs;
+/* Unlinks the kernels whose last WGs have been taken, see
+ * kernel_run_command.exhausted. Must be called with wq_lock_fast held. */
+static void
+prune_kernel_queue ()
+{
+  kernel_run_command *k, *tmp;
+  unsigned level;
+  int pruned = 0;
 
-  // divide two integers rounding up, i.e. ceil(k->remaining_wgs/num_threads)
-  const unsigned wgs_per_thread = (1 + (k->remaining_wgs - 1) / num_threads);
-  max_wgs = min (limit, wgs_per_thread);
-  max_wgs = min (max_wgs, k->remaining_wgs);
-  assert (max_wgs > 0);
+  for (level = 0; level < POCL_PTHREAD_NUM_PRIORITIES; ++level)
+    DL_FOREACH_SAFE (scheduler.kernel_queue[level], k, tmp)
+    {
+      if (!k->exhausted)
+        continue;
+      DL_DELETE (scheduler.kernel_queue[level], k);
+      k->exhausted = 0;
+      pocl_stat_gauge_add (POCL_STAT_PTHREAD_KERNEL_QUEUE_DEPTH, -1);
+      pruned = 1;
+    }
+  if (pruned)
+    update_contention ();
+}
 
-  *start_index = k->wgs_dealt;
-  *end_index = k->wgs_dealt + max_wgs-1;
+/* Asks the threads running kernels of a lower priority than level, which
+ * may run the work of subd, to yield at their next preemption point. The
+ * run levels of the kernels are set with wq_lock_fast held, and a thread
+ * that starts a command's kernel later still comes back for new work after
+ * its current chunk of WGs, see kernel_queue_gen. */
+static void
+request_preemption (cl_device_id subd, unsigned level)
+{
+  unsigned i;
+  for (i = 0; i < scheduler.num_threads; ++i)
+    {
+      thread_data *td = &scheduler.thread_pool[i];
+      unsigned run_level = td->run_level;
+      if (level < run_level && run_level < POCL_PTHREAD_NUM_PRIORITIES
+          && shall_we_run_this (td, subd))
+        td->preempt.requested = 1;
+    }
+}
+
+/* A command is executed by a single thread, so it's enough to wake up one.
+ * The command goes to the inbox without wq_lock_fast, which is only taken
+ * to wake up a sleeping thread or to start one. The CAS of the push and the
+ * barrier of a thread going to sleep order them: either the thread sees the
+ * command in the inbox, or the pusher sees the thread in num_sleeping. The
+ * spinning threads poll the inbox. */
+void pthread_scheduler_push_command (_cl_command_node *cmd)
+{
+  unsigned level = queue_priority_level (cmd->event->queue);
+  _cl_command_node *head;
+
+  record_push_time ();
+  do
+    {
+      head = scheduler.inbox;
+      cmd->next = head;
+    }
+  while (!__sync_bool_compare_and_swap (&scheduler.inbox, head, cmd));
+  pocl_stat_add (POCL_STAT_PTHREAD_COMMANDS, 1);
+  pocl_stat_gauge_add (POCL_STAT_PTHREAD_WORK_QUEUE_DEPTH, 1);
+  /* the threads running lower priority kernels come back for it after
+   * their current chunk of WGs; the queues are only peeked at here */
+  unsigned l;
+  for (l = level + 1; l < POCL_PTHREAD_NUM_PRIORITIES; ++l)
+    if (scheduler.kernel_queue[l] != NULL)
+      {
+        __sync_add_and_fetch (&scheduler.kernel_queue_gen, 1);
+        break;
+      }
+
+  if (scheduler.preemption_points)
+    request_preemption (cmd->device, level);
+
+  if (scheduler.num_sleeping == 0 && !scheduler.restart_after_fork
+      && !(scheduler.elastic
+           && scheduler.num_running < scheduler.num_threads))
+    return;
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  wake_idle_threads (cmd->device, 1);
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+}
+
+/* The thread pushing the kernel runs it too, so wake up only as many other
+ * threads as there are WGs left for them. Bumping kernel_queue_gen makes
+ * the threads running other kernels come back for new work after their
+ * current chunk of WGs, so a higher priority kernel gets them then. */
+static void
+pthread_scheduler_push_kernel (kernel_run_command *run_cmd)
+{
+  set_run_scheduling (run_cmd);
+  run_cmd->exhausted = 0;
+
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  record_push_time ();
+  DL_APPEND (scheduler.kernel_queue[run_cmd->priority], run_cmd);
+  update_contention ();
+  pocl_stat_add (POCL_STAT_PTHREAD_KERNELS, 1);
+  pocl_stat_gauge_add (POCL_STAT_PTHREAD_KERNEL_QUEUE_DEPTH, 1);
+  __sync_add_and_fetch (&scheduler.kernel_queue_gen, 1);
+  if (scheduler.preemption_points)
+    request_preemption (run_cmd->device, run_cmd->priority);
+  if (run_cmd->remaining_wgs > 1 && run_cmd->max_threads > 1)
+    {
+      size_t others = min (run_cmd->remaining_wgs - 1,
+                           (size_t)run_cmd->max_threads - 1);
+      wake_idle_threads (run_cmd->device,
+                         (unsigned)min (others, (size_t)scheduler.num_threads));
+    }
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+}
+
+/* The most commands in one fused chain. */
+#define POCL_PTHREAD_MAX_FUSED 8
+
+/* Returns nonzero if the WGs of b can run right after the WGs of the same
+ * index of a: both only access their buffers at get_global_id(0), and
+ * they have the same uniform 1D grid and floating point setup. */
+static int
+kernels_are_fusable (_cl_command_node *a, _cl_command_node *b)
+{
+  _cl_command_run *ra = &a->command.run, *rb = &b->command.run;
+  unsigned d;
+
+  if (!ra->kernel->meta->gid_local_access
+      || !rb->kernel->meta->gid_local_access)
+    return 0;
+  if (ra->kernel->program->flush_denorms != rb->kernel->program->flush_denorms)
+    return 0;
+  if (ra->pc.num_groups[1] != 1 || ra->pc.num_groups[2] != 1)
+    return 0;
+  for (d = 0; d < 3; ++d)
+    if (ra->pc.num_groups[d] != rb->pc.num_groups[d]
+        || ra->pc.local_size[d] != rb->pc.local_size[d]
+        || ra->pc.global_offset[d] != rb->pc.global_offset[d]
+        || ra->edge_size[d] != 0 || rb->edge_size[d] != 0)
+      return 0;
+  return 1;
+}
+
+void
+pthread_scheduler_try_fuse (_cl_command_node *node)
+{
+  cl_event event = node->event;
+  event_node *dep = event->wait_list;
+
+  if (!scheduler.kernel_fusion
+      || (event->queue->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+    return;
+  if (dep == NULL || dep->next != NULL)
+    return;
+
+  /* The previous command can't finish (and free its node) before it has
+   * removed itself from our wait list, which needs our lock. */
+  cl_event prev = dep->event;
+  _cl_command_node *prev_node = prev->command;
+  if (prev->queue != event->queue || prev_node == NULL
+      || prev_node->type != CL_COMMAND_NDRANGE_KERNEL
+      || prev_node->device != node->device
+      || !kernels_are_fusable (prev_node, node))
+    return;
+
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  _cl_command_node *head = prev_node->command.run.fused_head
+                               ? prev_node->command.run.fused_head
+                               : prev_node;
+  _cl_command_run *hr = &head->command.run;
+  _cl_command_node *tail = hr->fused_tail ? hr->fused_tail : head;
+  if (hr->fusion_open && tail == prev_node
+      && hr->fused_count + 1 < POCL_PTHREAD_MAX_FUSED)
+    {
+      tail->command.run.fused_next = node;
+      hr->fused_tail = node;
+      ++hr->fused_count;
+      node->command.run.fused_head = head;
+      /* pocl_pthread_notify leaves it alone, it runs with the head */
+      node->ready = 0;
+      POCL_MSG_PRINT_GENERAL ("fused event %" PRIu64 " to %" PRIu64 "\n",
+                                event->id, head->event->id);
+    }
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+}
+
+/* if subd is not a subdevice, returns 1
+ * if subd is subdevice, takes a look at the subdevice CUs
+ * and if they match the current driver thread, returns 1
+ * otherwise returns 0 */
+static int
+shall_we_run_this (thread_data *td, cl_device_id subd)
+{
+
+  if (subd && subd->parent_device)
+    {
+      if (!((td->index >= subd->core_start)
+            && (td->index < (subd->core_start + subd->core_count))))
+        {
+          return 0;
+        }
+    }
+  return 1;
+}
+
+/* Maximum and minimum chunk sizes for get_wg_index_range().
+ * Each pthread driver's thread fetches work from a kernel's WG pool in
+ * chunks, this determines the limits (scaled up by # of threads). */
+#define POCL_PTHREAD_MAX_WGS 256
+#define POCL_PTHREAD_MIN_WGS 32
+
+/* The capacity the WG shares of the thread are scaled by. Only a pinned
+ * thread is known to run on its CPU; the OS moves the others around. */
+static inline unsigned
+thread_capacity (thread_data *td)
+{
+  return td->pinned ? td->capacity : POCL_CPU_CAPACITY_MAX;
+}
+
+static int
+get_wg_index_range (kernel_run_command *k, unsigned *start_index,
+                    unsigned *end_index, int *last_wgs, unsigned num_threads,
+                    unsigned capacity)
+{
+  const unsigned scaled_max_wgs = POCL_PTHREAD_MAX_WGS * num_threads;
+  const unsigned scaled_min_wgs = POCL_PTHREAD_MIN_WGS * num_threads;
+
+  unsigned limit;
+  unsigned max_wgs;
+  POCL_FAST_LOCK (k->lock);
+  if (k->remaining_wgs == 0)
+    {
+      POCL_FAST_UNLOCK (k->lock);
+      return 0;
+    }
+
+  /* If the work is comprised of huge number of WGs of small WIs,
+   * then get_wg_index_range() becomes a problem on manycore CPUs
+   * because lock contention on k->lock.
+   *
+   * If we have enough workgroups, scale up the requests linearly by
+   * num_threads, otherwise fallback to smaller workgroups.
+   */
+  if (k->remaining_wgs <= (scaled_max_wgs * num_threads))
+    limit = scaled_min_wgs;
+  else
+    limit = scaled_max_wgs;
+
+  // divide two integers rounding up, i.e. ceil(k->remaining_wgs/num_threads)
+  const unsigned wgs_per_thread = (1 + (k->remaining_wgs - 1) / num_threads);
+  max_wgs = min (limit, wgs_per_thread);
+  /* a slower core takes smaller chunks, so it doesn't hold up the end */
+  if (capacity < POCL_CPU_CAPACITY_MAX)
+    max_wgs = max (1u, (unsigned)((uint64_t)max_wgs * capacity
+                                  / POCL_CPU_CAPACITY_MAX));
+  max_wgs = min (max_wgs, k->remaining_wgs);
+  assert (max_wgs > 0);
+
+  *start_index = k->wgs_dealt;
+  *end_index = k->wgs_dealt + max_wgs-1;
   k->remaining_wgs -= max_wgs;
   k->wgs_dealt += max_wgs;
   if (k->remaining_wgs == 0)
@@ -247,152 +1307,1954 @@ get_wg_index_range (kernel_run_command *k, unsigned *start_index,
   return 1;
 }
 
-inline static void translate_wg_index_to_3d_index (kernel_run_command *k,
-                                                   unsigned index,
-                                                   size_t *index_3d,
-                                                   unsigned xy_slice,
-                                                   unsigned row_size)
+#define WG_RANGE_PACK(start, end) (((uint64_t) (end) << 32) | (start))
+#define WG_RANGE_START(r) ((unsigned)((r)&0xFFFFFFFFUL))
+#define WG_RANGE_END(r) ((unsigned)((r) >> 32))
+
+/* Sets up the per-thread WG ranges for the work-stealing scheduler.
+ * Each thread that may run the command gets a contiguous slice of the WG
+ * index space, sized by the capacity of its CPU. */
+static int
+setup_wg_ranges (kernel_run_command *k, size_t num_groups)
+{
+  unsigned i;
+  unsigned base = 0;
+  unsigned num_ranges = scheduler.num_threads;
+  cl_device_id subd = k->device;
+
+  if (subd && subd->parent_device)
+    {
+      base = subd->core_start;
+      num_ranges = subd->core_count;
+    }
+  assert (num_ranges > 0);
+  if (num_groups > UINT32_MAX)
+    return 0;
+
+  k->wg_ranges = pthread_arena_alloc (k, num_ranges * sizeof (pocl_wg_range));
+  if (k->wg_ranges == NULL)
+    return 0;
+
+  uint64_t total_capacity = 0, capacity_before = 0;
+  for (i = 0; i < num_ranges; ++i)
+    total_capacity += thread_capacity (&scheduler.thread_pool[base + i]);
+  for (i = 0; i < num_ranges; ++i)
+    {
+      uint64_t start = num_groups * capacity_before / total_capacity;
+      capacity_before += thread_capacity (&scheduler.thread_pool[base + i]);
+      uint64_t end = num_groups * capacity_before / total_capacity;
+      k->wg_ranges[i].range = WG_RANGE_PACK (start, end);
+    }
+  k->wg_range_base = base;
+  k->num_wg_ranges = num_ranges;
+  return 1;
+}
+
+/* Like setup_wg_ranges(), but with one range per NUMA node. Each node gets
+ * a contiguous block of WGs, sized by the number of threads it has for
+ * this (sub)device. */
+static int
+setup_wg_ranges_by_node (kernel_run_command *k, size_t num_groups)
+{
+  unsigned i;
+  unsigned first = 0;
+  unsigned count = scheduler.num_threads;
+  unsigned num_nodes = scheduler.num_numa_nodes;
+  unsigned threads_per_node[num_nodes];
+  cl_device_id subd = k->device;
+
+  if (subd && subd->parent_device)
+    {
+      first = subd->core_start;
+      count = subd->core_count;
+    }
+  if (num_groups > UINT32_MAX)
+    return 0;
+
+  memset (threads_per_node, 0, sizeof (threads_per_node));
+  for (i = first; i < first + count; ++i)
+    ++threads_per_node[scheduler.thread_pool[i].numa_node];
+
+  k->wg_ranges = pthread_arena_alloc (k, num_nodes * sizeof (pocl_wg_range));
+  if (k->wg_ranges == NULL)
+    return 0;
+
+  unsigned threads_before = 0;
+  for (i = 0; i < num_nodes; ++i)
+    {
+      uint64_t start = (uint64_t)num_groups * threads_before / count;
+      threads_before += threads_per_node[i];
+      uint64_t end = (uint64_t)num_groups * threads_before / count;
+      k->wg_ranges[i].range = WG_RANGE_PACK (start, end);
+    }
+  k->wg_range_base = 0;
+  k->num_wg_ranges = num_nodes;
+  k->wg_ranges_by_node = 1;
+  return 1;
+}
+
+/* Takes a chunk of WGs from the front of the given range. Returns the number
+ * of WGs taken, 0 if the range is empty. The chunk size decreases as the
+ * range drains, so there's something left to steal near the end. */
+static unsigned
+pop_wg_range (pocl_wg_range *r, unsigned *start_index)
+{
+  uint64_t old, new;
+  unsigned start, end, n;
+  do
+    {
+      old = r->range;
+      start = WG_RANGE_START (old);
+      end = WG_RANGE_END (old);
+      if (start >= end)
+        return 0;
+      n = (end - start + 7) / 8;
+      new = WG_RANGE_PACK (start + n, end);
+    }
+  while (POCL_ATOMIC_CAS (&r->range, old, new) != old);
+
+  *start_index = start;
+  return n;
+}
+
+/* Steals the back half of the victim's range into the thief's range
+ * (which must be empty). Returns 0 if the victim had nothing to steal. */
+static int
+steal_wg_range (pocl_wg_range *victim, pocl_wg_range *thief)
+{
+  uint64_t old, new;
+  unsigned start, end, half;
+  do
+    {
+      old = victim->range;
+      start = WG_RANGE_START (old);
+      end = WG_RANGE_END (old);
+      if (start >= end)
+        return 0;
+      half = (end - start + 1) / 2;
+      new = WG_RANGE_PACK (start, end - half);
+    }
+  while (POCL_ATOMIC_CAS (&victim->range, old, new) != old);
+
+  /* only the owner refills its own empty range and thieves never touch
+   * empty ranges, so a plain store is sufficient here */
+  thief->range = WG_RANGE_PACK (end - half, end);
+  return 1;
+}
+
+static int
+get_wg_index_range_stealing (kernel_run_command *k, thread_data *td,
+                             unsigned *start_index, unsigned *end_index,
+                             int *last_wgs)
+{
+  unsigned i, n;
+  assert (td->index >= k->wg_range_base);
+  unsigned own = td->index - k->wg_range_base;
+  assert (own < k->num_wg_ranges);
+  pocl_wg_range *own_range = &k->wg_ranges[own];
+
+  n = pop_wg_range (own_range, start_index);
+  if (n == 0)
+    {
+      /* start from a random victim to avoid all thieves hammering
+       * the same range; then scan the rest linearly */
+      uint32_t x = td->steal_seed;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      td->steal_seed = x;
+
+      for (i = 0; i < k->num_wg_ranges; ++i)
+        {
+          unsigned victim = (x + i) % k->num_wg_ranges;
+          if (victim == own)
+            continue;
+          if (steal_wg_range (&k->wg_ranges[victim], own_range))
+            {
+              n = pop_wg_range (own_range, start_index);
+              if (n > 0)
+                break;
+            }
+        }
+      if (n == 0)
+        return 0;
+    }
+
+  *end_index = *start_index + n - 1;
+  if (__sync_sub_and_fetch (&k->remaining_wgs, (size_t)n) == 0)
+    *last_wgs = 1;
+  return 1;
+}
+
+/* The node ranges are shared by several threads, so instead of stealing
+ * into the own range, a thread whose node has run out of WGs takes them
+ * directly from the other nodes' blocks. */
+static int
+get_wg_index_range_numa (kernel_run_command *k, thread_data *td,
+                         unsigned *start_index, unsigned *end_index,
+                         int *last_wgs)
+{
+  unsigned i, n;
+  unsigned own = td->numa_node;
+  assert (own < k->num_wg_ranges);
+
+  n = pop_wg_range (&k->wg_ranges[own], start_index);
+  for (i = 1; n == 0 && i < k->num_wg_ranges; ++i)
+    n = pop_wg_range (&k->wg_ranges[(own + i) % k->num_wg_ranges],
+                      start_index);
+  if (n == 0)
+    return 0;
+
+  *end_index = *start_index + n - 1;
+  if (__sync_sub_and_fetch (&k->remaining_wgs, (size_t)n) == 0)
+    *last_wgs = 1;
+  return 1;
+}
+
+static int
+get_wg_range (kernel_run_command *k, thread_data *td, unsigned *start_index,
+              unsigned *end_index, int *last_wgs)
+{
+  if (k->wg_ranges_by_node)
+    return get_wg_index_range_numa (k, td, start_index, end_index, last_wgs);
+  else if (k->wg_ranges)
+    return get_wg_index_range_stealing (k, td, start_index, end_index,
+                                        last_wgs);
+  else
+    return get_wg_index_range (k, start_index, end_index, last_wgs,
+                               td->num_threads, thread_capacity (td));
+}
+
+/* Maximum width and height of the XY tiles with POCL_PTHREAD_WG_ORDER=tiled.
+ * Tiles of 8x8 WGs roughly match the chunk sizes of get_wg_index_range(). */
+#define POCL_PTHREAD_WG_TILE_SIZE 8
+
+/* Chooses the tile shape of the WG ordering from the grid shape. 1D grids,
+ * and grids that are a single tile wide, are left in row-major order. */
+static void
+setup_wg_tiles (kernel_run_command *k)
+{
+  size_t nx = k->pc.num_groups[0];
+  size_t ny = k->pc.num_groups[1];
+
+  k->wg_tile_w = k->wg_tile_h = 0;
+  if (ny < 2 || nx <= POCL_PTHREAD_WG_TILE_SIZE)
+    return;
+
+  k->wg_tile_w = POCL_PTHREAD_WG_TILE_SIZE;
+  k->wg_tile_h = (unsigned)min (ny, (size_t)POCL_PTHREAD_WG_TILE_SIZE);
+}
+
+inline static void translate_wg_index_to_3d_index (kernel_run_command *k,
+                                                   unsigned index,
+                                                   size_t *index_3d,
+                                                   unsigned xy_slice,
+                                                   unsigned row_size)
+{
+  index_3d[2] = index / xy_slice;
+  if (k->wg_tile_w == 0)
+    {
+      index_3d[1] = (index % xy_slice) / row_size;
+      index_3d[0] = (index % xy_slice) % row_size;
+      return;
+    }
+
+  /* The XY plane is cut into bands of wg_tile_h rows, each band into
+   * tiles of wg_tile_w columns, and the WGs in a tile are in row-major
+   * order. The last band and the last tile of each band can be smaller. */
+  unsigned num_rows = xy_slice / row_size;
+  unsigned in_slice = index % xy_slice;
+  unsigned band_size = row_size * k->wg_tile_h;
+  unsigned band = in_slice / band_size;
+  unsigned in_band = in_slice % band_size;
+  unsigned band_h = min (k->wg_tile_h, num_rows - band * k->wg_tile_h);
+  unsigned tile_size = k->wg_tile_w * band_h;
+  unsigned tile = in_band / tile_size;
+  unsigned in_tile = in_band % tile_size;
+  unsigned tile_w = min (k->wg_tile_w, row_size - tile * k->wg_tile_w);
+
+  index_3d[1] = band * k->wg_tile_h + in_tile / tile_w;
+  index_3d[0] = tile * k->wg_tile_w + in_tile % tile_w;
+}
+
+/* Returns the number of WGs from index on, up to end_index, that are next
+ * to each other in the same row of the grid (of the tile, if tiled) and
+ * can be run with one call of the range launcher. The edge WG at the end
+ * of the row is left out, as it runs a function of its own. */
+inline static unsigned
+wg_row_run_length (kernel_run_command *k, unsigned index, unsigned end_index,
+                   const size_t *index_3d, unsigned row_size)
+{
+  size_t row_end = row_size;
+  if (k->wg_tile_w != 0)
+    row_end = min (row_end,
+                   (index_3d[0] / k->wg_tile_w + 1) * k->wg_tile_w);
+  if (k->edge_mask & 1)
+    row_end = min (row_end, (size_t)row_size - 1);
+  return (unsigned)min (row_end - index_3d[0], (size_t)end_index - index + 1);
+}
+
+/* Returns 1 if the (sub)device has been created by partitioning along an
+ * affinity domain, at any level. */
+static int
+is_affinity_domain_subdevice (cl_device_id subd)
+{
+  for (; subd && subd->parent_device; subd = subd->parent_device)
+    if (subd->num_partition_types > 0
+        && subd->partition_type[0] == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN)
+      return 1;
+  return 0;
+}
+
+/* Pins the thread to its own CPU, so that it stays within the affinity
+ * domain of the sub-devices it runs, and reallocates its local memory and
+ * printf buffer so that it's first-touched from that domain. */
+static void
+pin_thread_to_own_cpu (thread_data *td)
+{
+  td->pinned = 1;
+#ifdef __linux__
+  if (scheduler.cpu_os_index == NULL)
+    return;
+
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  CPU_SET (scheduler.cpu_os_index[td->index % scheduler.num_cpus], &set);
+  if (pthread_setaffinity_np (td->thread, sizeof (cpu_set_t), &set) != 0)
+    return;
+
+  void *local_mem
+      = td->local_mem_size > 0
+            ? pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, td->local_mem_size)
+            : NULL;
+  void *printf_buffer = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
+                                             scheduler.printf_buf_size);
+  if ((local_mem == NULL && td->local_mem_size > 0) || printf_buffer == NULL)
+    {
+      /* keep the old ones */
+      pocl_aligned_free (local_mem);
+      pocl_aligned_free (printf_buffer);
+      return;
+    }
+  if (local_mem)
+    memset (local_mem, 0, td->local_mem_size);
+  memset (printf_buffer, 0, scheduler.printf_buf_size);
+  pocl_aligned_free (td->local_mem);
+  pocl_aligned_free (td->printf_buffer);
+  td->local_mem = local_mem;
+  td->printf_buffer = printf_buffer;
+#endif
+}
+
+#define POCL_PTHREAD_MIN_LOCAL_MEM 4096
+
+/* Grows the local memory of the thread to at least size bytes, rounded up
+ * to a power of two so that the kernels needing a little more than the
+ * previous ones do not reallocate it every time. */
+static void
+reserve_local_mem (thread_data *td, size_t size)
+{
+  if (size <= td->local_mem_size)
+    return;
+  size_t capacity = pocl_size_ceil2_64 (size);
+  if (capacity < POCL_PTHREAD_MIN_LOCAL_MEM)
+    capacity = POCL_PTHREAD_MIN_LOCAL_MEM;
+  void *local_mem = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, capacity);
+  if (local_mem == NULL)
+    POCL_ABORT ("pthread worker %u: out of memory for %zu bytes of local "
+                "memory\n",
+                td->index, size);
+  pocl_aligned_free (td->local_mem);
+  td->local_mem = local_mem;
+  td->local_mem_size = capacity;
+}
+
+/* Writes out the printf output the work-groups have stored to the buffer
+ * of the thread, and empties the buffer. */
+static void
+flush_printf_buffer (kernel_run_command *k, struct pocl_context *pc)
+{
+  uint32_t position = *pc->printf_buffer_position;
+  if (position == 0)
+    return;
+
+  if (k->device->binary_printf)
+    pocl_write_printf_buffer ((const char *)pc->printf_buffer, position);
+  else
+    write (STDOUT_FILENO, pc->printf_buffer, position);
+  *pc->printf_buffer_position = 0;
+}
+
+/* Allocates the per-thread timelines of k, with an entry also for the
+ * host assist thread. Without them the kernel just isn't recorded. */
+static void
+setup_wg_timeline (kernel_run_command *k)
+{
+  unsigned n = scheduler.num_threads + 1;
+  k->timeline = pthread_arena_alloc (k, n * sizeof (pocl_wg_thread_timeline));
+  if (k->timeline == NULL)
+    return;
+  memset (k->timeline, 0, n * sizeof (pocl_wg_thread_timeline));
+  k->num_timelines = n;
+  k->push_ns = pocl_gettimemono_ns ();
+}
+
+/* Records a chunk of num_wgs WGs that the thread started at start_ns. */
+static void
+record_wg_chunk (kernel_run_command *k, pocl_wg_thread_timeline *tl,
+                 uint64_t start_ns, unsigned num_wgs)
+{
+  uint64_t end_ns = pocl_gettimemono_ns ();
+  if (tl->num_chunks == 0)
+    tl->first_start_ns = start_ns;
+  tl->last_end_ns = end_ns;
+  tl->busy_ns += end_ns - start_ns;
+  tl->num_wgs += num_wgs;
+  ++tl->num_chunks;
+  if (pocl_tracing_spans_enabled)
+    pocl_tracing_span ("wg-chunk", k->kernel->name, start_ns, end_ns);
+}
+
+/* Runs chunks of a bulk memory command like work_group_scheduler runs WGs. */
+static int
+mem_chunk_scheduler (kernel_run_command *k,
+                     struct pool_thread_data *thread_data, unsigned queue_gen)
+{
+  unsigned start_index;
+  unsigned end_index;
+  int last_wgs = 0;
+
+  if (!get_wg_range (k, thread_data, &start_index, &end_index, &last_wgs))
+    return 0;
+
+  uint64_t trace_start
+      = pocl_tracing_spans_enabled ? pocl_gettimemono_ns () : 0;
+  do
+    {
+      if (last_wgs)
+        k->exhausted = 1;
+      k->mem_chunks (k, start_index, end_index);
+    }
+  while (scheduler.kernel_queue_gen == queue_gen && within_fair_share (k)
+         && get_wg_range (k, thread_data, &start_index, &end_index,
+                          &last_wgs));
+
+  if (pocl_tracing_spans_enabled)
+    pocl_tracing_span ("mem-chunks", pocl_command_to_str (k->cmd->type),
+                       trace_start, pocl_gettimemono_ns ());
+  return 1;
+}
+
+/* Executes WGs of the kernel until its pool is drained, or until another
+ * kernel is pushed to the kernel queue (kernel_queue_gen differs from the
+ * given queue_gen). In the latter case the thread returns to the scheduler
+ * to pick again, so that the threads get split between the ready kernels.
+ * A kernel is only finalized by the last thread leaving it once all its
+ * WGs have been dealt; one left earlier stays in the queue for the next. */
+static int
+work_group_scheduler (kernel_run_command *k,
+                      struct pool_thread_data *thread_data,
+                      unsigned queue_gen)
+{
+  if (k->mem_chunks)
+    return mem_chunk_scheduler (k, thread_data, queue_gen);
+
+  kernel_run_command *f;
+  unsigned num_fused = 0, num_slots = 0;
+  for (f = k; f != NULL; f = f->fused_next)
+    {
+      ++num_fused;
+      num_slots += f->kernel->meta->num_args + f->kernel->meta->num_locals + 1;
+    }
+
+  /* the argument arrays and contexts of k and the commands fused to it */
+  void *arguments[num_slots];
+  void *arguments2[num_slots];
+  kernel_run_command *fused[num_fused];
+  void **fused_args[num_fused];
+  struct pocl_context pcs[num_fused];
+  struct pocl_context *pc = &pcs[0];
+  unsigned i, j;
+  unsigned start_index;
+  unsigned end_index;
+  int last_wgs = 0;
+
+  if (!get_wg_range (k, thread_data, &start_index, &end_index, &last_wgs))
+    return 0;
+
+  assert (end_index >= start_index);
+  uint64_t trace_start
+      = pocl_tracing_spans_enabled ? pocl_gettimemono_ns () : 0;
+  uint64_t perf_start[POCL_PERF_MAX_COUNTERS];
+  if (pocl_perf_num_counters)
+    pocl_perf_counters_read (thread_data->perf_fds, perf_start);
+
+  if (!thread_data->pinned && is_affinity_domain_subdevice (k->device))
+    pin_thread_to_own_cpu (thread_data);
+
+  /* the fused WGs run one after another, so they can all use the whole
+   * local memory of the thread */
+  size_t local_mem_size = 0;
+  for (f = k; f != NULL; f = f->fused_next)
+    if (f->local_mem_size > local_mem_size)
+      local_mem_size = f->local_mem_size;
+  reserve_local_mem (thread_data, local_mem_size);
+
+  uint32_t position = 0;
+  num_slots = 0;
+  for (j = 0, f = k; f != NULL; ++j, f = f->fused_next)
+    {
+      fused[j] = f;
+      fused_args[j] = &arguments[num_slots];
+      setup_kernel_arg_array_with_locals (
+          fused_args[j], &arguments2[num_slots], f, thread_data->local_mem,
+          thread_data->local_mem_size);
+      num_slots += f->kernel->meta->num_args + f->kernel->meta->num_locals + 1;
+      memcpy (&pcs[j], &f->pc, sizeof (struct pocl_context));
+
+      // capacity already set up
+      pcs[j].printf_buffer = thread_data->printf_buffer;
+      pcs[j].printf_buffer_position = &position;
+      pcs[j].preempt = (uchar *)&thread_data->preempt;
+      pcs[j].device_enqueue = (uchar *)&thread_data->device_enqueue;
+    }
+  assert (pc->printf_buffer != NULL);
+  assert (pc->printf_buffer_capacity > 0);
+  assert (pc->printf_buffer_position != NULL);
+
+  /* Flush to zero is only set once at start of kernel (because FTZ is
+   * a compilation option), but we need to reset rounding mode after every
+   * iteration (since it can be changed during kernel execution). */
+  unsigned flush = k->kernel->program->flush_denorms;
+  if (thread_data->current_ftz != flush)
+    {
+      pocl_set_ftz (flush);
+      thread_data->current_ftz = flush;
+    }
+
+  /* this may run from a preemption point of another kernel's WG, which
+   * continues with its own children afterwards. The kernels enqueuing
+   * children are never fused, see kernels_are_fusable(). */
+  kernel_run_command *outer_enqueuing = thread_data->enqueuing;
+  pthread_child *outer_wg_children = thread_data->wg_children;
+  thread_data->enqueuing = k;
+  thread_data->wg_children = NULL;
+
+  /* the edge WGs print to the same buffer */
+  struct pocl_context edge_pcs[k->edge_mask ? 8 : 1];
+  if (k->edge_mask)
+    for (j = 1; j < 8; ++j)
+      if ((j & k->edge_mask) == j)
+        {
+          edge_pcs[j] = k->edge_pc[j];
+          edge_pcs[j].printf_buffer = thread_data->printf_buffer;
+          edge_pcs[j].printf_buffer_position = &position;
+          edge_pcs[j].preempt = (uchar *)&thread_data->preempt;
+          edge_pcs[j].device_enqueue = (uchar *)&thread_data->device_enqueue;
+        }
+
+  unsigned slice_size = k->pc.num_groups[0] * k->pc.num_groups[1];
+  unsigned row_size = k->pc.num_groups[0];
+  pocl_wg_thread_timeline *tl = NULL;
+  if (k->timeline && thread_data->index < k->num_timelines)
+    tl = &k->timeline[thread_data->index];
+
+  /* The WGs of a range launcher call cannot flush the printf buffer in
+   * between, so it is dropped once the kernel has printed something. It is
+   * never used for fused commands, as their WGs must interleave. */
+  pocl_workgroup_range_func workgroup_range
+      = num_fused == 1 ? k->workgroup_range : NULL;
+
+  do
+    {
+      if (last_wgs)
+        k->exhausted = 1;
+
+      uint64_t chunk_start = tl ? pocl_gettimemono_ns () : 0;
+      for (i = start_index; i <= end_index; ++i)
+        {
+          size_t gids[3];
+          translate_wg_index_to_3d_index (k, i, gids,
+                                          slice_size, row_size);
+
+#ifdef DEBUG_MT
+          printf("### exec_wg: gid_x %zu, gid_y %zu, gid_z %zu\n",
+                 gids[0], gids[1], gids[2]);
+#endif
+          unsigned edge = 0;
+          if (k->edge_mask)
+            for (j = 0; j < 3; ++j)
+              if ((k->edge_mask & (1 << j))
+                  && gids[j] == k->pc.num_groups[j] - 1)
+                edge |= 1 << j;
+          if (edge)
+            {
+              /* edge grids are never fused */
+              pocl_set_default_rm ();
+              k->edge_wg[edge] ((uint8_t *)fused_args[0],
+                                (uint8_t *)&edge_pcs[edge], gids[0], gids[1],
+                                gids[2]);
+            }
+          else if (workgroup_range != NULL)
+            {
+              unsigned run_length
+                  = wg_row_run_length (k, i, end_index, gids, row_size);
+              /* the rounding mode is reset once for the whole run */
+              pocl_set_default_rm ();
+              workgroup_range ((uint8_t *)fused_args[0], (uint8_t *)pc,
+                               gids[0], gids[0] + run_length, gids[1],
+                               gids[2]);
+              i += run_length - 1;
+            }
+          else
+            for (j = 0; j < num_fused; ++j)
+              {
+                pocl_set_default_rm ();
+                fused[j]->workgroup ((uint8_t *)fused_args[j],
+                                     (uint8_t *)&pcs[j], gids[0], gids[1],
+                                     gids[2]);
+              }
+          /* the children waiting for the WG(s) just run */
+          if (thread_data->wg_children != NULL)
+            release_wg_children (thread_data);
+          /* flush the printf output early enough for the buffer not to
+             overflow in the following work-groups */
+          if (position > pc->printf_buffer_capacity / 2)
+            flush_printf_buffer (k, pc);
+          if (position != 0)
+            workgroup_range = NULL;
+          /* the kernels without loops only yield in between their WGs */
+          if (thread_data->preempt.requested)
+            run_preempting_work (thread_data);
+        }
+      if (tl)
+        record_wg_chunk (k, tl, chunk_start, end_index - start_index + 1);
+    }
+  while (scheduler.kernel_queue_gen == queue_gen && within_fair_share (k)
+         && get_wg_range (k, thread_data, &start_index, &end_index,
+                          &last_wgs));
+
+  flush_printf_buffer (k, pc);
+  thread_data->enqueuing = outer_enqueuing;
+  thread_data->wg_children = outer_wg_children;
+
+  /* the counters of the fused kernels go to the first one */
+  if (pocl_perf_num_counters)
+    {
+      uint64_t perf_end[POCL_PERF_MAX_COUNTERS];
+      pocl_perf_counters_read (thread_data->perf_fds, perf_end);
+      pocl_perf_counters_add (k->cmd->event, perf_start, perf_end);
+    }
+
+  if (pocl_tracing_spans_enabled)
+    pocl_tracing_span ("work-groups", k->kernel->name, trace_start,
+                       pocl_gettimemono_ns ());
+
+  num_slots = 0;
+  for (j = 0; j < num_fused; ++j)
+    {
+      f = fused[j];
+      free_kernel_arg_array_with_locals (fused_args[j], &arguments2[num_slots],
+                                         f);
+      num_slots += f->kernel->meta->num_args + f->kernel->meta->num_locals + 1;
+    }
+
+  return 1;
+}
+
+/* The argument arena starts at the first suitably aligned offset after
+ * the struct. */
+#define RUN_CMD_ARENA_OFFSET                                                  \
+  ((sizeof (kernel_run_command) + MAX_EXTENDED_ALIGNMENT - 1)                 \
+   & ~(size_t) (MAX_EXTENDED_ALIGNMENT - 1))
+#define RUN_CMD_ALIGNMENT                                                     \
+  (MAX_EXTENDED_ALIGNMENT > HOST_CPU_CACHELINE_SIZE                           \
+       ? MAX_EXTENDED_ALIGNMENT                                               \
+       : HOST_CPU_CACHELINE_SIZE)
+
+/* Takes a kernel_run_command from the thread's cache, or allocates a new
+ * one if the cache is empty. */
+static kernel_run_command *
+alloc_kernel_run_command (thread_data *td)
+{
+  kernel_run_command *k = td->free_run_cmds;
+  if (k == NULL)
+    /* grab everything the other threads have returned so far */
+    k = __sync_lock_test_and_set (&td->returned_run_cmds, NULL);
+
+  if (k)
+    td->free_run_cmds = k->free_next;
+  else
+    {
+      k = pocl_aligned_malloc (RUN_CMD_ALIGNMENT, RUN_CMD_ARENA_OFFSET
+                                                      + POCL_PTHREAD_ARG_ARENA_SIZE);
+      if (k == NULL)
+        return NULL;
+    }
+
+  memset (k, 0, sizeof (kernel_run_command));
+  k->arena = (char *)k + RUN_CMD_ARENA_OFFSET;
+  k->arena_size = POCL_PTHREAD_ARG_ARENA_SIZE;
+  k->arena_used = 0;
+  k->owner = td;
+  return k;
+}
+
+/* Returns the command to the cache of the thread that allocated it. Only
+ * the owner ever takes from returned_run_cmds, and it takes the whole
+ * list at once, so a CAS push is safe from ABA. */
+static void
+release_kernel_run_command (kernel_run_command *k)
+{
+  thread_data *owner = (thread_data *)k->owner;
+  kernel_run_command *old;
+  do
+    {
+      old = owner->returned_run_cmds;
+      k->free_next = old;
+    }
+  while (POCL_ATOMIC_CAS (&owner->returned_run_cmds, old, k) != old);
+}
+
+static void
+free_run_cmd_list (kernel_run_command *k)
+{
+  while (k)
+    {
+      kernel_run_command *next = k->free_next;
+      pocl_aligned_free (k);
+      k = next;
+    }
+}
+
+/* Completes the batch once its last NDRange has finished. */
+static void
+complete_batch_part (pthread_batch *batch)
+{
+  if (POCL_ATOMIC_DEC (batch->remaining) == 0)
+    {
+      POCL_UPDATE_EVENT_COMPLETE_MSG (batch->cmd->event,
+                                      "NDRange Batch         ");
+      free (batch);
+    }
+}
+
+static void
+finalize_kernel_command (struct pool_thread_data *thread_data,
+                         kernel_run_command *k)
+{
+#ifdef DEBUG_MT
+  printf("### kernel %s finished\n", k->cmd->command.run.kernel->name);
+#endif
+
+  kernel_run_command *f, *next;
+
+  if (k->mem_chunks)
+    {
+      POCL_UPDATE_EVENT_COMPLETE_MSG (k->cmd->event, "Bulk Memory Command   ");
+      POCL_FAST_DESTROY (k->lock);
+      release_kernel_run_command (k);
+      return;
+    }
+
+  for (f = k; f != NULL; f = f->fused_next)
+    {
+      free_kernel_arg_array (f);
+      pocl_release_dlhandle_cache (f->cmd);
+    }
+  for (unsigned edge = 1; edge < 8; ++edge)
+    if (k->edge_dlhandle[edge])
+      pocl_release_dlhandle_item (k->edge_dlhandle[edge]);
+
+  if (k->wg_ranges)
+    pthread_arena_free (k, k->wg_ranges);
+  if (k->timeline)
+    {
+      summarize_wg_timeline (k);
+      pthread_arena_free (k, k->timeline);
+    }
+
+  if (k->tree)
+    finalize_enqueued_run (thread_data, k);
+  else if (k->batch)
+    complete_batch_part (k->batch);
+  else
+    /* in queue order: each fused command waits for the previous one */
+    for (f = k; f != NULL; f = f->fused_next)
+      POCL_UPDATE_EVENT_COMPLETE_MSG (f->cmd->event, "NDRange Kernel        ");
+
+  POCL_FAST_DESTROY (k->lock);
+  for (f = k; f != NULL; f = next)
+    {
+      next = f->fused_next;
+      release_kernel_run_command (f);
+    }
+}
+
+/* Fetches the WG functions of the edge WGs of a non-uniform grid. The edge
+ * WGs run with the smaller local size, and a global offset moved so that
+ * offset + group id * local size still gives their first global id. */
+static void
+setup_edge_wgs (kernel_run_command *run_cmd, _cl_command_node *cmd)
+{
+  _cl_command_run *run = &cmd->command.run;
+  unsigned edge, d;
+
+  for (d = 0; d < 3; ++d)
+    if (run->edge_size[d] != 0)
+      run_cmd->edge_mask |= 1 << d;
+
+  for (edge = 1; edge < 8; ++edge)
+    {
+      if ((edge & run_cmd->edge_mask) != edge)
+        continue;
+      /* the dlhandle cache keys the WG functions by the local size */
+      _cl_command_node edge_cmd = *cmd;
+      struct pocl_context *pc = &edge_cmd.command.run.pc;
+      for (d = 0; d < 3; ++d)
+        if (edge & (1 << d))
+          {
+            pc->global_offset[d] += (pc->num_groups[d] - 1)
+                                    * (pc->local_size[d] - run->edge_size[d]);
+            pc->local_size[d] = run->edge_size[d];
+          }
+      pocl_check_kernel_dlhandle_cache (&edge_cmd, 1, 1);
+      run_cmd->edge_wg[edge] = edge_cmd.command.run.wg;
+      run_cmd->edge_dlhandle[edge] = edge_cmd.command.run.dlhandle_item;
+      run_cmd->edge_pc[edge] = *pc;
+      run_cmd->edge_pc[edge].printf_buffer = NULL;
+      run_cmd->edge_pc[edge].printf_buffer_capacity
+          = scheduler.printf_buf_size;
+      run_cmd->edge_pc[edge].printf_buffer_position = NULL;
+      run_cmd->edge_pc[edge].preempt = NULL;
+      run_cmd->edge_pc[edge].device_enqueue = NULL;
+    }
+}
+
+/* Sets up the fields of run_cmd that the WGs of cmd read. */
+static void
+init_kernel_run_command (kernel_run_command *run_cmd, void *data,
+                         _cl_command_node *cmd)
+{
+  struct pocl_context *pc = &cmd->command.run.pc;
+
+  pocl_choose_wg_specialization (cmd);
+  pocl_check_kernel_dlhandle_cache (cmd, 1, 1);
+
+  run_cmd->data = data;
+  run_cmd->kernel = cmd->command.run.kernel;
+  run_cmd->device = cmd->device;
+  run_cmd->pc = *pc;
+  run_cmd->cmd = cmd;
+  run_cmd->pc.printf_buffer = NULL;
+  run_cmd->pc.printf_buffer_capacity = scheduler.printf_buf_size;
+  run_cmd->pc.printf_buffer_position = NULL;
+  run_cmd->pc.preempt = NULL;
+  run_cmd->pc.device_enqueue = NULL;
+  run_cmd->workgroup = cmd->command.run.wg;
+  run_cmd->workgroup_range = cmd->command.run.wg_range;
+  run_cmd->kernel_args = cmd->command.run.arguments;
+  run_cmd->fused_next = NULL;
+
+  setup_edge_wgs (run_cmd, cmd);
+  setup_kernel_arg_array (run_cmd);
+}
+
+/* Gives the commands from node on back to pocl_pthread_notify, which
+ * pushes them when the previous one finishes. */
+static void
+unfuse_commands (_cl_command_node *node)
+{
+  while (node)
+    {
+      _cl_command_node *next = node->command.run.fused_next;
+      POCL_LOCK_OBJ (node->event);
+      node->command.run.fused_head = NULL;
+      node->command.run.fused_next = NULL;
+      node->ready = 1;
+      POCL_UNLOCK_OBJ (node->event);
+      node = next;
+    }
+}
+
+/* Sets up the run commands of the commands fused to cmd, and links them
+ * to run_cmd. */
+static void
+prepare_fused_kernels (void *data, _cl_command_node *cmd,
+                       kernel_run_command *run_cmd, thread_data *td)
+{
+  _cl_command_node *node = cmd->command.run.fused_next;
+  kernel_run_command *tail = run_cmd;
+
+  while (node)
+    {
+      kernel_run_command *f = alloc_kernel_run_command (td);
+      if (f == NULL)
+        {
+          /* the rest run unfused */
+          _cl_command_node *prev = tail->cmd;
+          prev->command.run.fused_next = NULL;
+          unfuse_commands (node);
+          return;
+        }
+      init_kernel_run_command (f, data, node);
+      tail->fused_next = f;
+      tail = f;
+
+      POCL_LOCK_OBJ (node->event);
+      pocl_update_event_submitted (node->event);
+      pocl_update_event_running_unlocked (node->event);
+      POCL_UNLOCK_OBJ (node->event);
+      node = node->command.run.fused_next;
+    }
+}
+
+/* Sets up run_cmd for running all the WGs of cmd. */
+static void
+setup_kernel_run (kernel_run_command *run_cmd, void *data,
+                  _cl_command_node *cmd)
+{
+  struct pocl_context *pc = &cmd->command.run.pc;
+  size_t num_groups = pc->num_groups[0] * pc->num_groups[1] * pc->num_groups[2];
+
+  init_kernel_run_command (run_cmd, data, cmd);
+  run_cmd->remaining_wgs = num_groups;
+  run_cmd->wgs_dealt = 0;
+  run_cmd->next = NULL;
+  run_cmd->ref_count = 0;
+  run_cmd->exhausted = 0;
+  run_cmd->wg_ranges = NULL;
+  run_cmd->num_wg_ranges = 0;
+  run_cmd->wg_range_base = 0;
+  run_cmd->wg_ranges_by_node = 0;
+  run_cmd->wg_tile_w = 0;
+  run_cmd->wg_tile_h = 0;
+  POCL_FAST_INIT (run_cmd->lock);
+
+  if (scheduler.wg_order_tiled)
+    setup_wg_tiles (run_cmd);
+
+  if (scheduler.wg_timeline)
+    setup_wg_timeline (run_cmd);
+
+  /* fall back to the chunked scheduler if the per-thread ranges
+   * can't be allocated. The per-thread ranges of the work-stealing
+   * scheduler are contiguous per node already. */
+  if (scheduler.work_stealing && num_groups > 0)
+    setup_wg_ranges (run_cmd, num_groups);
+  else if (scheduler.numa_aware && num_groups > 0)
+    setup_wg_ranges_by_node (run_cmd, num_groups);
+}
+
+static void
+pocl_pthread_prepare_kernel (void *data, _cl_command_node *cmd,
+                             thread_data *td)
+{
+  kernel_run_command *run_cmd;
+
+  run_cmd = alloc_kernel_run_command (td);
+  if (run_cmd == NULL)
+    {
+      unfuse_commands (cmd->command.run.fused_next);
+      POCL_LOCK_OBJ (cmd->event);
+      pocl_update_event_failed (cmd->event);
+      POCL_UNLOCK_OBJ (cmd->event);
+      return;
+    }
+
+  setup_kernel_run (run_cmd, data, cmd);
+
+  pocl_update_event_running (cmd->event);
+
+  prepare_fused_kernels (data, cmd, run_cmd, td);
+
+  pthread_scheduler_push_kernel (run_cmd);
+}
+
+/* OpenCL 2.0 device-side enqueue, see include/pocl_device_enqueue.h.
+ *
+ * A kernel enqueued by a work-group (a child) runs as a kernel_run_command
+ * of its own, which the thread releasing the child pushes to the kernel
+ * queue, copying the block literal and the NDRange at the enqueue: the
+ * enqueuing thread at once with CLK_ENQUEUE_FLAGS_NO_WAIT, after the WG
+ * with CLK_ENQUEUE_FLAGS_WAIT_WORK_GROUP, and the thread finalizing the
+ * enqueuing kernel with CLK_ENQUEUE_FLAGS_WAIT_KERNEL; and in each case,
+ * the thread completing the last event of its wait list. A host NDRange
+ * and all the children under it form its enqueue tree, and its event
+ * only completes once the whole tree has. The children find their kernels
+ * by name among the block kernels of the kernel of the host NDRange. */
+
+typedef struct pthread_wait pthread_wait;
+
+/* A clk_event_t of the kernels: the event of a child or a marker, or a
+ * user event. Not complete while status is positive. */
+typedef struct pthread_device_event
+{
+  uint64_t refcount;
+  volatile int status;
+  POCL_FAST_LOCK_T lock;
+  /* the entries of the wait lists waiting for it, protected by lock */
+  pthread_wait *waiters;
+} pthread_device_event;
+
+/* An event of the wait list of a child. */
+struct pthread_wait
+{
+  pthread_child *child;
+  pthread_wait *next;
+};
+
+struct pthread_enqueue_tree
+{
+  /* the command of the host NDRange, or its batch, completed with the
+   * last kernel of the tree */
+  _cl_command_node *cmd;
+  pthread_batch *batch;
+  /* the kernel of the host NDRange, which keeps the block kernels */
+  cl_kernel kernel;
+  /* the kernels of the tree not finished yet */
+  volatile uint64_t outstanding;
+};
+
+/* A child kernel or a marker (enqueue_marker), and its event. */
+struct pthread_child
+{
+  /* the command node of the enqueuing kernel, with the kernel (NULL for
+   * a marker), the NDRange and the arguments of the child */
+  _cl_command_node node;
+  void *data;
+  pthread_enqueue_tree *tree;
+  pthread_device_event *event;
+  /* the device queue, and the bytes the child takes from its size */
+  cl_command_queue queue;
+  size_t size;
+  /* 1 until released by the enqueue flags, plus the events of the wait
+   * list that have not completed */
+  volatile uint64_t pending;
+  /* the status of a failed event of the wait list, or CL_COMPLETE */
+  volatile int status;
+  /* in thread_data.wg_children or kernel_run_command.deferred */
+  pthread_child *next;
+  /* the copy of the block literal, the argument 0 of the kernel */
+  void *block;
+  pthread_wait *waits;
+  struct pocl_argument args[];
+};
+
+#define DEVICE_ENQUEUE_THREAD(de)                                             \
+  ((thread_data *)((char *)(de) - offsetof (thread_data, device_enqueue)))
+
+/* CLK_NULL_EVENT is all ones. */
+#define IS_DEVICE_EVENT(ev) ((ev) != NULL && (ev) != (void *)-1)
+
+static pthread_device_event *
+create_device_event (int status, uint64_t refcount)
+{
+  pthread_device_event *ev
+      = (pthread_device_event *)malloc (sizeof (pthread_device_event));
+  if (ev == NULL)
+    return NULL;
+  ev->refcount = refcount;
+  ev->status = status;
+  ev->waiters = NULL;
+  POCL_FAST_INIT (ev->lock);
+  return ev;
+}
+
+static void
+release_device_event (pthread_device_event *ev)
+{
+  if (POCL_ATOMIC_DEC (ev->refcount) == 0)
+    {
+      POCL_FAST_DESTROY (ev->lock);
+      free (ev);
+    }
+}
+
+static void launch_child (thread_data *td, pthread_child *c);
+
+/* Launches the child once it's released and its wait list is complete. */
+static void
+release_child (thread_data *td, pthread_child *c)
+{
+  if (POCL_ATOMIC_DEC (c->pending) == 0)
+    launch_child (td, c);
+}
+
+static void
+complete_device_event (thread_data *td, pthread_device_event *ev, int status)
+{
+  pthread_wait *w, *next;
+
+  POCL_FAST_LOCK (ev->lock);
+  if (ev->status <= CL_COMPLETE)
+    {
+      POCL_FAST_UNLOCK (ev->lock);
+      return;
+    }
+  ev->status = status;
+  w = ev->waiters;
+  ev->waiters = NULL;
+  POCL_FAST_UNLOCK (ev->lock);
+
+  for (; w != NULL; w = next)
+    {
+      next = w->next;
+      if (status < 0)
+        w->child->status = status;
+      release_child (td, w->child);
+    }
+}
+
+/* Completes the command of the host NDRange once the last kernel of its
+ * enqueue tree has finished. */
+static void
+release_enqueue_tree (pthread_enqueue_tree *tree)
+{
+  if (POCL_ATOMIC_DEC (tree->outstanding) != 0)
+    return;
+  if (tree->batch)
+    complete_batch_part (tree->batch);
+  else
+    POCL_UPDATE_EVENT_COMPLETE_MSG (tree->cmd->event,
+                                    "NDRange Kernel        ");
+  free (tree);
+}
+
+static void
+finish_child (thread_data *td, pthread_child *c, int status)
+{
+  pthread_enqueue_tree *tree = c->tree;
+
+  complete_device_event (td, c->event, status);
+  release_device_event (c->event);
+  __sync_sub_and_fetch (&c->queue->device_queue_used, c->size);
+  pocl_aligned_free (c);
+  release_enqueue_tree (tree);
+}
+
+static void
+launch_child (thread_data *td, pthread_child *c)
+{
+  kernel_run_command *run_cmd;
+
+  /* a marker, or a child whose wait list failed */
+  if (c->node.command.run.kernel == NULL || c->status != CL_COMPLETE)
+    {
+      finish_child (td, c, c->status);
+      return;
+    }
+
+  run_cmd = alloc_kernel_run_command (td);
+  if (run_cmd == NULL)
+    {
+      finish_child (td, c, CL_OUT_OF_HOST_MEMORY);
+      return;
+    }
+  setup_kernel_run (run_cmd, c->data, &c->node);
+  run_cmd->child = c;
+  run_cmd->tree = c->tree;
+  pthread_scheduler_push_kernel (run_cmd);
+}
+
+static void
+release_wg_children (thread_data *td)
+{
+  pthread_child *c = td->wg_children, *next;
+  td->wg_children = NULL;
+  for (; c != NULL; c = next)
+    {
+      next = c->next;
+      release_child (td, c);
+    }
+}
+
+/* Called from finalize_kernel_command for the kernels of enqueue trees. */
+static void
+finalize_enqueued_run (thread_data *td, kernel_run_command *k)
+{
+  pthread_child *c = __sync_lock_test_and_set (&k->deferred, NULL), *next;
+  for (; c != NULL; c = next)
+    {
+      next = c->next;
+      release_child (td, c);
+    }
+
+  if (k->child)
+    finish_child (td, k->child, CL_COMPLETE);
+  else
+    release_enqueue_tree (k->tree);
+}
+
+/* Returns the enqueue tree of the running kernel k, creating it at the
+ * first enqueue of a host NDRange. */
+static pthread_enqueue_tree *
+get_enqueue_tree (kernel_run_command *k)
+{
+  pthread_enqueue_tree *tree = k->tree, *old;
+  if (tree != NULL)
+    return tree;
+
+  tree = (pthread_enqueue_tree *)malloc (sizeof (pthread_enqueue_tree));
+  if (tree == NULL)
+    return NULL;
+  tree->cmd = k->cmd;
+  tree->batch = k->batch;
+  tree->kernel = k->kernel;
+  /* for the host NDRange itself */
+  tree->outstanding = 1;
+  old = POCL_ATOMIC_CAS (&k->tree, NULL, tree);
+  if (old != NULL)
+    {
+      /* another WG of the kernel was first */
+      free (tree);
+      tree = old;
+    }
+  return tree;
+}
+
+/* Returns the block kernel of the given name of the enqueue tree. */
+static cl_kernel
+get_block_kernel (kernel_run_command *k, pthread_enqueue_tree *tree,
+                  const char *name)
+{
+  cl_kernel root = tree->kernel, kernel;
+  cl_int err;
+
+  if (strcmp (k->kernel->name, name) == 0)
+    return k->kernel;
+
+  POCL_LOCK_OBJ (root);
+  for (kernel = root->block_kernels; kernel != NULL;
+       kernel = kernel->next_block_kernel)
+    if (strcmp (kernel->name, name) == 0)
+      break;
+  if (kernel == NULL)
+    {
+      kernel = POname (clCreateKernel) (root->program, name, &err);
+      if (kernel != NULL)
+        {
+          kernel->next_block_kernel = root->block_kernels;
+          root->block_kernels = kernel;
+        }
+    }
+  POCL_UNLOCK_OBJ (root);
+  return kernel;
+}
+
+static int
+is_device_queue (void *queue)
+{
+  cl_command_queue q = (cl_command_queue)queue;
+  return q != NULL && (q->properties & CL_QUEUE_ON_DEVICE);
+}
+
+static int
+check_wait_list (uint num_events, void *const *wait_list)
+{
+  uint i;
+  if ((num_events == 0) != (wait_list == NULL))
+    return 0;
+  for (i = 0; i < num_events; ++i)
+    if (!IS_DEVICE_EVENT (wait_list[i]))
+      return 0;
+  return 1;
+}
+
+/* Allocates a child of the running kernel k with the given number of
+ * arguments, wait list and block literal, and takes its space from the
+ * device queue. */
+static int
+alloc_child (thread_data *td, void *queue, unsigned num_args,
+             uint num_events, void *block, pthread_child **child)
+{
+  kernel_run_command *k = td->enqueuing;
+  cl_command_queue q = (cl_command_queue)queue;
+  size_t block_size = block ? *(uint *)block : 0;
+  size_t waits_offset
+      = sizeof (pthread_child) + num_args * sizeof (struct pocl_argument);
+  size_t block_offset
+      = (waits_offset + num_events * sizeof (pthread_wait)
+         + MAX_EXTENDED_ALIGNMENT - 1)
+        & ~(size_t) (MAX_EXTENDED_ALIGNMENT - 1);
+  size_t size = block_offset + block_size;
+  pthread_child *c;
+
+  if (__sync_add_and_fetch (&q->device_queue_used, size) > q->size)
+    {
+      __sync_sub_and_fetch (&q->device_queue_used, size);
+      return POCL_CLK_DEVICE_QUEUE_FULL;
+    }
+  c = (pthread_child *)pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, size);
+  if (c == NULL)
+    {
+      __sync_sub_and_fetch (&q->device_queue_used, size);
+      return POCL_CLK_ENQUEUE_FAILURE;
+    }
+
+  c->node = *k->cmd;
+  c->node.command.run.kernel = NULL;
+  c->data = k->data;
+  c->tree = NULL;
+  c->event = NULL;
+  c->queue = q;
+  c->size = size;
+  c->status = CL_COMPLETE;
+  c->next = NULL;
+  c->waits = (pthread_wait *)((char *)c + waits_offset);
+  c->block = block ? (char *)c + block_offset : NULL;
+  if (block)
+    memcpy (c->block, block, block_size);
+  *child = c;
+  return POCL_CLK_SUCCESS;
+}
+
+/* Makes the allocated child c a part of the enqueue tree, and releases it
+ * as the flags tell. */
+static int
+submit_child (thread_data *td, pthread_child *c, pthread_enqueue_tree *tree,
+              int flags, uint num_events, void *const *wait_list,
+              void **event_ret)
+{
+  kernel_run_command *k = td->enqueuing;
+  pthread_child *old;
+  uint i;
+
+  c->event = create_device_event (CL_QUEUED, event_ret ? 2 : 1);
+  if (c->event == NULL)
+    {
+      __sync_sub_and_fetch (&c->queue->device_queue_used, c->size);
+      pocl_aligned_free (c);
+      return POCL_CLK_EVENT_ALLOCATION_FAILURE;
+    }
+  c->tree = tree;
+  POCL_ATOMIC_INC (tree->outstanding);
+
+  c->pending = num_events + 1;
+  for (i = 0; i < num_events; ++i)
+    {
+      pthread_device_event *ev = (pthread_device_event *)wait_list[i];
+      pthread_wait *w = &c->waits[i];
+      w->child = c;
+      POCL_FAST_LOCK (ev->lock);
+      if (ev->status > CL_COMPLETE)
+        {
+          w->next = ev->waiters;
+          ev->waiters = w;
+          w = NULL;
+        }
+      POCL_FAST_UNLOCK (ev->lock);
+      if (w == NULL)
+        continue;
+      if (ev->status < 0)
+        c->status = ev->status;
+      /* not the last one, which the flags release */
+      POCL_ATOMIC_DEC (c->pending);
+    }
+  if (event_ret)
+    *event_ret = c->event;
+
+  switch (flags)
+    {
+    case POCL_ENQUEUE_FLAGS_WAIT_WORK_GROUP:
+      c->next = td->wg_children;
+      td->wg_children = c;
+      break;
+    case POCL_ENQUEUE_FLAGS_WAIT_KERNEL:
+      do
+        {
+          old = k->deferred;
+          c->next = old;
+        }
+      while (POCL_ATOMIC_CAS (&k->deferred, old, c) != old);
+      break;
+    default:
+      release_child (td, c);
+    }
+  return POCL_CLK_SUCCESS;
+}
+
+static int
+pthread_enqueue_kernel (struct pocl_device_enqueue *de, void *queue,
+                        int flags, const pocl_ndrange *range,
+                        uint num_events, void *const *wait_list,
+                        void **event_ret, const char *kernel_name,
+                        void *block, uint num_locals,
+                        const ulong *local_sizes)
+{
+  thread_data *td = DEVICE_ENQUEUE_THREAD (de);
+  kernel_run_command *k = td->enqueuing;
+  cl_device_id dev = pocl_real_dev (k->device);
+  size_t global[3], local[3], offset[3];
+  pthread_enqueue_tree *tree;
+  pthread_child *c;
+  cl_kernel kernel;
+  unsigned d, i;
+  int err;
+
+  if (!is_device_queue (queue))
+    return POCL_CLK_INVALID_QUEUE;
+  if (flags != POCL_ENQUEUE_FLAGS_NO_WAIT
+      && flags != POCL_ENQUEUE_FLAGS_WAIT_KERNEL
+      && flags != POCL_ENQUEUE_FLAGS_WAIT_WORK_GROUP)
+    return POCL_CLK_ENQUEUE_FAILURE;
+  if (!check_wait_list (num_events, wait_list))
+    return POCL_CLK_INVALID_EVENT_WAIT_LIST;
+  if (range->work_dim < 1 || range->work_dim > 3)
+    return POCL_CLK_INVALID_NDRANGE;
+
+  for (d = 0; d < 3; ++d)
+    {
+      int used = d < range->work_dim;
+      global[d] = used ? range->global_size[d] : 1;
+      local[d] = used ? range->local_size[d] : 1;
+      offset[d] = used ? range->global_offset[d] : 0;
+      if (global[d] == 0)
+        return POCL_CLK_INVALID_NDRANGE;
+    }
+
+  tree = get_enqueue_tree (k);
+  if (tree == NULL)
+    return POCL_CLK_ENQUEUE_FAILURE;
+  kernel = get_block_kernel (k, tree, kernel_name);
+  if (kernel == NULL || kernel->meta->num_args != num_locals + 1)
+    return POCL_CLK_ENQUEUE_FAILURE;
+
+  /* a zero local size lets the device choose it */
+  if (local[0] == 0 || local[1] == 0 || local[2] == 0)
+    {
+      if (dev->ops->compute_local_size)
+        dev->ops->compute_local_size (dev, kernel, global[0], global[1],
+                                      global[2], &local[0], &local[1],
+                                      &local[2]);
+      else
+        pocl_default_local_size_optimizer (dev, kernel, global[0], global[1],
+                                           global[2], &local[0], &local[1],
+                                           &local[2]);
+    }
+  if (local[0] * local[1] * local[2] > dev->max_work_group_size)
+    return POCL_CLK_INVALID_NDRANGE;
+  for (d = 0; d < 3; ++d)
+    {
+      if (local[d] == 0 || local[d] > dev->max_work_item_sizes[d])
+        return POCL_CLK_INVALID_NDRANGE;
+      /* the smaller last WGs only run on the kernels not telling them
+       * apart, see nonuniform_local_size() */
+      if (global[d] % local[d] != 0
+          && !(dev->edge_work_groups && kernel->meta->nonuniform_safe))
+        return POCL_CLK_INVALID_NDRANGE;
+    }
+
+  err = alloc_child (td, queue, num_locals + 1, num_events, block, &c);
+  if (err != POCL_CLK_SUCCESS)
+    return err;
+
+  c->args[0].size = sizeof (void *);
+  c->args[0].offset = 0;
+  c->args[0].sub_buffer_size = 0;
+  c->args[0].value = &c->block;
+  c->args[0].is_set = 1;
+  c->args[0].is_readonly = 0;
+  c->args[0].is_svm = 1;
+  for (i = 0; i < num_locals; ++i)
+    {
+      struct pocl_argument *al = &c->args[i + 1];
+      memset (al, 0, sizeof (struct pocl_argument));
+      al->size = local_sizes[i];
+      al->is_set = 1;
+    }
+
+  _cl_command_run *run = &c->node.command.run;
+  memset (run, 0, sizeof (_cl_command_run));
+  run->kernel = kernel;
+  run->hash = kernel->meta->build_hash[c->node.program_device_i];
+  run->arguments = c->args;
+  run->pc = k->cmd->command.run.pc;
+  run->pc.work_dim = range->work_dim;
+  for (d = 0; d < 3; ++d)
+    {
+      run->pc.local_size[d] = local[d];
+      run->pc.num_groups[d] = (global[d] + local[d] - 1) / local[d];
+      run->pc.global_offset[d] = offset[d];
+      run->edge_size[d] = global[d] % local[d];
+    }
+
+  return submit_child (td, c, tree, flags, num_events, wait_list, event_ret);
+}
+
+static int
+pthread_enqueue_marker (struct pocl_device_enqueue *de, void *queue,
+                        uint num_events, void *const *wait_list,
+                        void **event_ret)
+{
+  thread_data *td = DEVICE_ENQUEUE_THREAD (de);
+  pthread_enqueue_tree *tree;
+  pthread_child *c;
+  int err;
+
+  if (!is_device_queue (queue))
+    return POCL_CLK_INVALID_QUEUE;
+  if (num_events == 0 || !check_wait_list (num_events, wait_list))
+    return POCL_CLK_INVALID_EVENT_WAIT_LIST;
+
+  tree = get_enqueue_tree (td->enqueuing);
+  if (tree == NULL)
+    return POCL_CLK_ENQUEUE_FAILURE;
+  err = alloc_child (td, queue, 0, num_events, NULL, &c);
+  if (err != POCL_CLK_SUCCESS)
+    return err;
+  return submit_child (td, c, tree, POCL_ENQUEUE_FLAGS_NO_WAIT, num_events,
+                       wait_list, event_ret);
+}
+
+static void *
+pthread_create_user_event (struct pocl_device_enqueue *de)
+{
+  pthread_device_event *ev = create_device_event (CL_SUBMITTED, 1);
+  return ev ? ev : (void *)-1;
+}
+
+static void
+pthread_set_user_event_status (struct pocl_device_enqueue *de, void *event,
+                               int status)
+{
+  if (IS_DEVICE_EVENT (event) && status <= CL_COMPLETE)
+    complete_device_event (DEVICE_ENQUEUE_THREAD (de),
+                           (pthread_device_event *)event, status);
+}
+
+static void
+pthread_retain_device_event (struct pocl_device_enqueue *de, void *event)
+{
+  if (IS_DEVICE_EVENT (event))
+    POCL_ATOMIC_INC (((pthread_device_event *)event)->refcount);
+}
+
+static void
+pthread_release_device_event (struct pocl_device_enqueue *de, void *event)
+{
+  if (IS_DEVICE_EVENT (event))
+    release_device_event ((pthread_device_event *)event);
+}
+
+static void *
+pthread_get_default_queue (struct pocl_device_enqueue *de)
+{
+  kernel_run_command *k = DEVICE_ENQUEUE_THREAD (de)->enqueuing;
+  cl_context context = k->cmd->event->context;
+  cl_device_id dev = pocl_real_dev (k->device);
+  cl_command_queue queue = NULL;
+  unsigned i;
+
+  POCL_LOCK_OBJ (context);
+  for (i = 0; i < context->num_devices; ++i)
+    if (context->devices[i] == dev)
+      queue = context->default_device_queues[i];
+  POCL_UNLOCK_OBJ (context);
+  return queue;
+}
+
+static void
+init_device_enqueue (cl_device_id device)
+{
+  struct pocl_device_enqueue *de = &scheduler.device_enqueue;
+  de->enqueue_kernel = pthread_enqueue_kernel;
+  de->enqueue_marker = pthread_enqueue_marker;
+  de->create_user_event = pthread_create_user_event;
+  de->set_user_event_status = pthread_set_user_event_status;
+  de->retain_event = pthread_retain_device_event;
+  de->release_event = pthread_release_device_event;
+  de->get_default_queue = pthread_get_default_queue;
+  de->max_work_group_size = device->max_work_group_size;
+  de->preferred_work_group_size_multiple
+      = device->preferred_wg_size_multiple;
+}
+
+/* Runs the NDRanges of a command buffer of clEnqueueNDRangeKernelBatchPoCL
+ * as one command: a run command is made of a copy of each recorded NDRange,
+ * and all of them are pushed to the kernel queue at once, so the threads
+ * pick the WGs of whichever NDRange has the most left instead of waiting
+ * for the small ones one by one. The command completes when the last one
+ * finishes, in finalize_kernel_command. */
+static void
+pocl_pthread_prepare_batch (void *data, _cl_command_node *cmd,
+                            thread_data *td)
+{
+  cl_command_buffer_khr command_buffer
+      = cmd->command.command_buffer.command_buffer;
+  cl_uint i, n = command_buffer->num_commands;
+  kernel_run_command *runs = NULL, *run_cmd, *tmp;
+  size_t wgs = 0;
+
+  pthread_batch *batch = (pthread_batch *)malloc (
+      sizeof (pthread_batch) + n * sizeof (_cl_command_node));
+  if (batch == NULL)
+    goto ERROR;
+  batch->cmd = cmd;
+  batch->remaining = n;
+
+  /* allocate all the run commands first, so that nothing needs to be
+   * undone if one fails */
+  for (i = 0; i < n; ++i)
+    {
+      run_cmd = alloc_kernel_run_command (td);
+      if (run_cmd == NULL)
+        goto ERROR;
+      DL_APPEND (runs, run_cmd);
+    }
+
+  for (i = 0, run_cmd = runs; i < n; ++i, run_cmd = tmp)
+    {
+      _cl_command_node *node = &batch->nodes[i];
+      /* the recorded NDRange stays alive, with its arguments, as long as
+       * the command keeps the command buffer */
+      *node = command_buffer->commands[i]->node;
+      node->event = cmd->event;
+      node->device = cmd->device;
+      node->command.run.fused_head = NULL;
+      node->command.run.fused_next = NULL;
+
+      /* setup_kernel_run clears the list link */
+      tmp = run_cmd->next;
+      setup_kernel_run (run_cmd, data, node);
+      set_run_scheduling (run_cmd);
+      run_cmd->next = tmp;
+      run_cmd->batch = batch;
+      wgs += run_cmd->remaining_wgs;
+    }
+
+  pocl_update_event_running (cmd->event);
+
+  /* the NDRanges of the batch all come from the same queue */
+  unsigned level = runs->priority;
+  size_t max_threads = n * (size_t)runs->max_threads;
+
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  record_push_time ();
+  DL_CONCAT (scheduler.kernel_queue[level], runs);
+  update_contention ();
+  pocl_stat_add (POCL_STAT_PTHREAD_KERNELS, n);
+  pocl_stat_gauge_add (POCL_STAT_PTHREAD_KERNEL_QUEUE_DEPTH, n);
+  __sync_add_and_fetch (&scheduler.kernel_queue_gen, 1);
+  if (wgs > 1 && max_threads > 1)
+    wake_idle_threads (cmd->device,
+                       (unsigned)min (min (wgs, max_threads) - 1,
+                                      (size_t)scheduler.num_threads));
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+  return;
+
+ERROR:
+  DL_FOREACH_SAFE (runs, run_cmd, tmp)
+  {
+    DL_DELETE (runs, run_cmd);
+    release_kernel_run_command (run_cmd);
+  }
+  POCL_MEM_FREE (batch);
+  POCL_LOCK_OBJ (cmd->event);
+  pocl_update_event_failed (cmd->event);
+  POCL_UNLOCK_OBJ (cmd->event);
+}
+
+/* Chunk size of the bulk memory commands. Small enough for the chunks of
+ * a command over the threshold to keep all the threads busy, large enough
+ * for a thread to stream through its chunk at full speed. */
+#define POCL_PTHREAD_MEM_CHUNK_SIZE (256 * 1024)
+
+static void
+mem_chunks_read (kernel_run_command *k, size_t start, size_t end)
+{
+  _cl_command_node *node = k->cmd;
+  _cl_command_read *c = &node->command.read;
+  size_t offset = start * k->mem_chunk_size;
+  size_t size = min ((end + 1) * k->mem_chunk_size, c->size) - offset;
+  node->device->ops->read (k->data, (char *)c->dst_host_ptr + offset,
+                           c->src_mem_id, node->event->mem_objs[0],
+                           c->offset + offset, size);
+}
+
+static void
+mem_chunks_write (kernel_run_command *k, size_t start, size_t end)
+{
+  _cl_command_node *node = k->cmd;
+  _cl_command_write *c = &node->command.write;
+  size_t offset = start * k->mem_chunk_size;
+  size_t size = min ((end + 1) * k->mem_chunk_size, c->size) - offset;
+  node->device->ops->write (k->data, (const char *)c->src_host_ptr + offset,
+                            c->dst_mem_id, node->event->mem_objs[0],
+                            c->offset + offset, size);
+}
+
+static void
+mem_chunks_copy (kernel_run_command *k, size_t start, size_t end)
 {
-  index_3d[2] = index / xy_slice;
-  index_3d[1] = (index % xy_slice) / row_size;
-  index_3d[0] = (index % xy_slice) % row_size;
+  _cl_command_node *node = k->cmd;
+  _cl_command_copy *c = &node->command.copy;
+  size_t offset = start * k->mem_chunk_size;
+  size_t size = min ((end + 1) * k->mem_chunk_size, c->size) - offset;
+  node->device->ops->copy (k->data, c->dst_mem_id, c->dst, c->src_mem_id,
+                           c->src, c->dst_offset + offset,
+                           c->src_offset + offset, size);
 }
 
-static int
-work_group_scheduler (kernel_run_command *k,
-                      struct pool_thread_data *thread_data)
+/* The chunk size is a multiple of every pattern size, so each chunk starts
+ * at a whole pattern. The stores bypass the caches when the whole fill is
+ * too large to stay in them. */
+static void
+mem_chunks_fill (kernel_run_command *k, size_t start, size_t end)
 {
-  pocl_kernel_metadata_t *meta = k->kernel->meta;
+  _cl_command_fill_mem *c = &k->cmd->command.memfill;
+  size_t offset = start * k->mem_chunk_size;
+  size_t size = min ((end + 1) * k->mem_chunk_size, c->size) - offset;
+  pocl_fill_memory ((char *)c->dst_mem_id->mem_ptr + c->offset + offset,
+                    size, c->pattern, c->pattern_size,
+                    c->size >= POCL_FILL_NONTEMPORAL_MIN);
+}
 
-  void *arguments[meta->num_args + meta->num_locals + 1];
-  void *arguments2[meta->num_args + meta->num_locals + 1];
-  struct pocl_context pc;
-  unsigned i;
-  unsigned start_index;
-  unsigned end_index;
-  int last_wgs = 0;
+/* The chunks of the rect and image commands are bands of mem_chunk_size
+ * consecutive rows, counting the rows of all the slices in order, so each
+ * thread copies rows that are next to each other in both memories. Sets
+ * [*row, *end_row) to the rows of the chunks [start, end] of a region. */
+static void
+chunk_rows (kernel_run_command *k, size_t start, size_t end,
+            const size_t *region, size_t *row, size_t *end_row)
+{
+  *row = start * k->mem_chunk_size;
+  *end_row = min ((end + 1) * k->mem_chunk_size, region[1] * region[2]);
+}
 
-  if (!get_wg_index_range (k, &start_index, &end_index, &last_wgs,
-                           thread_data->num_threads))
+/* Sets *y, *z and *n to the row and slice of the next band of the rows
+ * [*row, end_row) that lies within one slice, and to its number of rows,
+ * and advances *row past it. Returns 0 when no rows are left. */
+static int
+next_row_band (size_t *row, size_t end_row, const size_t *region, size_t *y,
+               size_t *z, size_t *n)
+{
+  if (*row >= end_row)
     return 0;
+  *y = *row % region[1];
+  *z = *row / region[1];
+  *n = min (region[1] - *y, end_row - *row);
+  *row += *n;
+  return 1;
+}
 
-  assert (end_index >= start_index);
-
-  setup_kernel_arg_array_with_locals (
-      (void **)&arguments, (void **)&arguments2, k, thread_data->local_mem,
-      scheduler.local_mem_size);
-  memcpy (&pc, &k->pc, sizeof (struct pocl_context));
-
-  // capacity and position already set up
-  pc.printf_buffer = thread_data->printf_buffer;
-  uint32_t position = 0;
-  pc.printf_buffer_position = &position;
-  assert (pc.printf_buffer != NULL);
-  assert (pc.printf_buffer_capacity > 0);
-  assert (pc.printf_buffer_position != NULL);
+static void
+mem_chunks_copy_rect (kernel_run_command *k, size_t start, size_t end)
+{
+  _cl_command_node *node = k->cmd;
+  _cl_command_copy_rect *c = &node->command.copy_rect;
+  size_t row, end_row, y, z, n;
 
-  /* Flush to zero is only set once at start of kernel (because FTZ is
-   * a compilation option), but we need to reset rounding mode after every
-   * iteration (since it can be changed during kernel execution). */
-  unsigned flush = k->kernel->program->flush_denorms;
-  if (thread_data->current_ftz != flush)
+  chunk_rows (k, start, end, c->region, &row, &end_row);
+  while (next_row_band (&row, end_row, c->region, &y, &z, &n))
     {
-      pocl_set_ftz (flush);
-      thread_data->current_ftz = flush;
+      size_t dst_origin[3]
+          = { c->dst_origin[0], c->dst_origin[1] + y, c->dst_origin[2] + z };
+      size_t src_origin[3]
+          = { c->src_origin[0], c->src_origin[1] + y, c->src_origin[2] + z };
+      size_t region[3] = { c->region[0], n, 1 };
+      node->device->ops->copy_rect (
+          k->data, c->dst_mem_id, c->dst, c->src_mem_id, c->src, dst_origin,
+          src_origin, region, c->dst_row_pitch, c->dst_slice_pitch,
+          c->src_row_pitch, c->src_slice_pitch);
     }
+}
 
-  unsigned slice_size = k->pc.num_groups[0] * k->pc.num_groups[1];
-  unsigned row_size = k->pc.num_groups[0];
+static size_t
+image_pixel_size (cl_mem image)
+{
+  return image->image_elem_size * image->image_channels;
+}
 
-  do
+/* Serves both clEnqueueReadImage and clEnqueueCopyImageToBuffer. */
+static void
+mem_chunks_read_image (kernel_run_command *k, size_t start, size_t end)
+{
+  _cl_command_node *node = k->cmd;
+  _cl_command_read_image *c = &node->command.read_image;
+  size_t row_pitch = c->dst_row_pitch, slice_pitch = c->dst_slice_pitch;
+  size_t row, end_row, y, z, n;
+
+  if (row_pitch == 0)
+    row_pitch = image_pixel_size (c->src) * c->region[0];
+  if (slice_pitch == 0)
+    slice_pitch = row_pitch * c->region[1];
+
+  chunk_rows (k, start, end, c->region, &row, &end_row);
+  while (next_row_band (&row, end_row, c->region, &y, &z, &n))
     {
-      if (last_wgs)
-        {
-          POCL_FAST_LOCK (scheduler.wq_lock_fast);
-          DL_DELETE (scheduler.kernel_queue, k);
-          POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
-        }
-
-      for (i = start_index; i <= end_index; ++i)
-        {
-          size_t gids[3];
-          translate_wg_index_to_3d_index (k, i, gids,
-                                          slice_size, row_size);
-
-#ifdef DEBUG_MT
-          printf("### exec_wg: gid_x %zu, gid_y %zu, gid_z %zu\n",
-                 gids[0], gids[1], gids[2]);
-#endif
-          pocl_set_default_rm ();
-          k->workgroup ((uint8_t*)arguments, (uint8_t*)&pc,
-			gids[0], gids[1], gids[2]);
-        }
+      size_t origin[3] = { c->origin[0], c->origin[1] + y, c->origin[2] + z };
+      size_t region[3] = { c->region[0], n, 1 };
+      node->device->ops->read_image_rect (
+          k->data, c->src, c->src_mem_id, c->dst_host_ptr, c->dst_mem_id,
+          origin, region, row_pitch, slice_pitch,
+          c->dst_offset + z * slice_pitch + y * row_pitch);
     }
-  while (get_wg_index_range (k, &start_index, &end_index, &last_wgs,
-                             thread_data->num_threads));
+}
 
-  if (position > 0)
+/* Serves both clEnqueueWriteImage and clEnqueueCopyBufferToImage. */
+static void
+mem_chunks_write_image (kernel_run_command *k, size_t start, size_t end)
+{
+  _cl_command_node *node = k->cmd;
+  _cl_command_write_image *c = &node->command.write_image;
+  size_t row_pitch = c->src_row_pitch, slice_pitch = c->src_slice_pitch;
+  size_t row, end_row, y, z, n;
+
+  if (row_pitch == 0)
+    row_pitch = image_pixel_size (c->dst) * c->region[0];
+  if (slice_pitch == 0)
+    slice_pitch = row_pitch * c->region[1];
+
+  chunk_rows (k, start, end, c->region, &row, &end_row);
+  while (next_row_band (&row, end_row, c->region, &y, &z, &n))
     {
-      write (STDOUT_FILENO, pc.printf_buffer, position);
+      size_t origin[3] = { c->origin[0], c->origin[1] + y, c->origin[2] + z };
+      size_t region[3] = { c->region[0], n, 1 };
+      node->device->ops->write_image_rect (
+          k->data, c->dst, c->dst_mem_id, c->src_host_ptr, c->src_mem_id,
+          origin, region, row_pitch, slice_pitch,
+          c->src_offset + z * slice_pitch + y * row_pitch);
     }
+}
 
-  free_kernel_arg_array_with_locals ((void **)&arguments, (void **)&arguments2,
-                                     k);
+static void
+mem_chunks_copy_image (kernel_run_command *k, size_t start, size_t end)
+{
+  _cl_command_node *node = k->cmd;
+  _cl_command_copy_image *c = &node->command.copy_image;
+  size_t row, end_row, y, z, n;
 
-  return 1;
+  chunk_rows (k, start, end, c->region, &row, &end_row);
+  while (next_row_band (&row, end_row, c->region, &y, &z, &n))
+    {
+      size_t dst_origin[3]
+          = { c->dst_origin[0], c->dst_origin[1] + y, c->dst_origin[2] + z };
+      size_t src_origin[3]
+          = { c->src_origin[0], c->src_origin[1] + y, c->src_origin[2] + z };
+      size_t region[3] = { c->region[0], n, 1 };
+      node->device->ops->copy_image_rect (k->data, c->src, c->dst,
+                                          c->src_mem_id, c->dst_mem_id,
+                                          src_origin, dst_origin, region);
+    }
 }
 
 static void
-finalize_kernel_command (struct pool_thread_data *thread_data,
-                         kernel_run_command *k)
+mem_chunks_fill_image (kernel_run_command *k, size_t start, size_t end)
 {
-#ifdef DEBUG_MT
-  printf("### kernel %s finished\n", k->cmd->command.run.kernel->name);
-#endif
+  _cl_command_node *node = k->cmd;
+  _cl_command_fill_image *c = &node->command.fill_image;
+  size_t row, end_row, y, z, n;
 
-  free_kernel_arg_array (k);
+  chunk_rows (k, start, end, c->region, &row, &end_row);
+  while (next_row_band (&row, end_row, c->region, &y, &z, &n))
+    {
+      size_t origin[3] = { c->origin[0], c->origin[1] + y, c->origin[2] + z };
+      size_t region[3] = { c->region[0], n, 1 };
+      node->device->ops->fill_image (k->data, node->event->mem_objs[0],
+                                     c->mem_id, origin, region, c->orig_pixel,
+                                     c->fill_pixel, c->pixel_size);
+    }
+}
 
-  pocl_release_dlhandle_cache (k->cmd);
+/* If cmd is a buffer or image read, write, copy or fill of at least
+ * scheduler.bulk_mem_min bytes, pushes it to the kernel queue split into
+ * chunks, and returns 1. Otherwise returns 0, and cmd is run as usual. */
+static int
+pocl_pthread_prepare_mem_command (_cl_command_node *cmd, thread_data *td)
+{
+  _cl_command_t *c = &cmd->command;
+  void (*mem_chunks) (kernel_run_command *, size_t, size_t) = NULL;
+  size_t size = 0, chunk_size = POCL_PTHREAD_MEM_CHUNK_SIZE, num_chunks;
+  /* the region of the commands split into bands of rows */
+  const size_t *region = NULL;
+  size_t row_size = 0;
+
+  if (scheduler.bulk_mem_min == 0)
+    return 0;
 
-  POCL_UPDATE_EVENT_COMPLETE_MSG (k->cmd->event, "NDRange Kernel        ");
+  switch (cmd->type)
+    {
+    case CL_COMMAND_READ_BUFFER:
+      mem_chunks = mem_chunks_read;
+      size = c->read.size;
+      break;
+    case CL_COMMAND_WRITE_BUFFER:
+      mem_chunks = mem_chunks_write;
+      size = c->write.size;
+      break;
+    case CL_COMMAND_COPY_BUFFER:
+      /* the content size is only known when the command runs */
+      if (c->copy.src_content_size != NULL)
+        return 0;
+      mem_chunks = mem_chunks_copy;
+      size = c->copy.size;
+      break;
+    case CL_COMMAND_FILL_BUFFER:
+      mem_chunks = mem_chunks_fill;
+      size = c->memfill.size;
+      break;
+    case CL_COMMAND_COPY_BUFFER_RECT:
+      mem_chunks = mem_chunks_copy_rect;
+      region = c->copy_rect.region;
+      row_size = region[0];
+      break;
+    case CL_COMMAND_READ_IMAGE:
+    case CL_COMMAND_COPY_IMAGE_TO_BUFFER:
+      mem_chunks = mem_chunks_read_image;
+      region = c->read_image.region;
+      row_size = image_pixel_size (c->read_image.src) * region[0];
+      break;
+    case CL_COMMAND_WRITE_IMAGE:
+    case CL_COMMAND_COPY_BUFFER_TO_IMAGE:
+      mem_chunks = mem_chunks_write_image;
+      region = c->write_image.region;
+      row_size = image_pixel_size (c->write_image.dst) * region[0];
+      break;
+    case CL_COMMAND_COPY_IMAGE:
+      mem_chunks = mem_chunks_copy_image;
+      region = c->copy_image.region;
+      row_size = image_pixel_size (c->copy_image.src) * region[0];
+      break;
+    case CL_COMMAND_FILL_IMAGE:
+      mem_chunks = mem_chunks_fill_image;
+      region = c->fill_image.region;
+      row_size = c->fill_image.pixel_size * region[0];
+      break;
+    default:
+      return 0;
+    }
 
-  POCL_FAST_DESTROY (k->lock);
-  free_kernel_run_command (k);
-}
+  if (region != NULL)
+    {
+      size = row_size * region[1] * region[2];
+      chunk_size = max ((size_t)1, chunk_size / max (row_size, (size_t)1));
+    }
 
-static void
-pocl_pthread_prepare_kernel (void *data, _cl_command_node *cmd)
-{
-  kernel_run_command *run_cmd;
-  cl_kernel kernel = cmd->command.run.kernel;
-  struct pocl_context *pc = &cmd->command.run.pc;
+  if (size < scheduler.bulk_mem_min)
+    return 0;
 
-  pocl_check_kernel_dlhandle_cache (cmd, 1, 1);
+  kernel_run_command *run_cmd = alloc_kernel_run_command (td);
+  if (run_cmd == NULL)
+    return 0;
 
-  size_t num_groups = pc->num_groups[0] * pc->num_groups[1] * pc->num_groups[2];
+  if (region != NULL)
+    num_chunks = (region[1] * region[2] + chunk_size - 1) / chunk_size;
+  else
+    num_chunks = (size + chunk_size - 1) / chunk_size;
 
-  run_cmd = new_kernel_run_command ();
-  run_cmd->data = data;
-  run_cmd->kernel = kernel;
+  run_cmd->data = cmd->device->data;
   run_cmd->device = cmd->device;
-  run_cmd->pc = *pc;
   run_cmd->cmd = cmd;
-  run_cmd->pc.printf_buffer = NULL;
-  run_cmd->pc.printf_buffer_capacity = scheduler.printf_buf_size;
-  run_cmd->pc.printf_buffer_position = NULL;
-  run_cmd->remaining_wgs = num_groups;
+  run_cmd->mem_chunks = mem_chunks;
+  run_cmd->mem_chunk_size = chunk_size;
+  run_cmd->remaining_wgs = num_chunks;
   run_cmd->wgs_dealt = 0;
-  run_cmd->workgroup = cmd->command.run.wg;
-  run_cmd->kernel_args = cmd->command.run.arguments;
-  run_cmd->next = NULL;
-  run_cmd->ref_count = 0;
   POCL_FAST_INIT (run_cmd->lock);
 
-  setup_kernel_arg_array (run_cmd);
-
   pocl_update_event_running (cmd->event);
-
   pthread_scheduler_push_kernel (run_cmd);
+  return 1;
 }
 
 /*
@@ -418,36 +3280,302 @@ pocl_pthread_prepare_kernel (void *data, _cl_command_node *cmd)
  */
 
 static _cl_command_node *
-check_cmd_queue_for_device (thread_data *td)
+check_cmd_queue_for_device (thread_data *td, unsigned max_level)
 {
   _cl_command_node *cmd;
-  DL_FOREACH (scheduler.work_queue, cmd)
-  {
-    cl_device_id subd = cmd->device;
-    if (shall_we_run_this (td, subd))
-      {
-        DL_DELETE (scheduler.work_queue, cmd);
-        return cmd;
-      }
-  }
+  unsigned level;
+  drain_inbox ();
+  for (level = 0; level < max_level; ++level)
+    DL_FOREACH (scheduler.work_queue[level], cmd)
+    {
+      cl_device_id subd = cmd->device;
+      if (shall_we_run_this (td, subd))
+        {
+          DL_DELETE (scheduler.work_queue[level], cmd);
+          pocl_stat_gauge_add (POCL_STAT_PTHREAD_WORK_QUEUE_DEPTH, -1);
+          /* no more commands can be fused to it */
+          if (cmd->type == CL_COMMAND_NDRANGE_KERNEL)
+            cmd->command.run.fusion_open = 0;
+          return cmd;
+        }
+    }
 
   return NULL;
 }
 
+/* Returns nonzero if there is a command for this thread in a higher
+ * priority queue than level. */
+static int
+check_cmd_queue_above (thread_data *td, unsigned level)
+{
+  _cl_command_node *cmd;
+  unsigned l;
+  drain_inbox ();
+  for (l = 0; l < level; ++l)
+    DL_FOREACH (scheduler.work_queue[l], cmd)
+    {
+      if (shall_we_run_this (td, cmd->device))
+        return 1;
+    }
+  return 0;
+}
+
+/* Starts a new fair share quantum for all the ready kernels. Must be
+ * called with wq_lock_fast held. */
+static void
+start_fair_share_quantum ()
+{
+  kernel_run_command *k;
+  unsigned level;
+  for (level = 0; level < POCL_PTHREAD_NUM_PRIORITIES; ++level)
+    DL_FOREACH (scheduler.kernel_queue[level], k)
+    {
+      k->quantum_used = 0;
+    }
+}
+
+/* Picks the kernel with the most remaining WGs per thread already working
+ * on it (counting this one), which splits the threads between the ready
+ * kernels in proportion to their remaining work. Ties go to the kernel
+ * that was queued first. Only the highest priority queue with a kernel
+ * this thread may join is considered; the kernels that already have as
+ * many threads as their throttle allows are skipped. remaining_wgs is read
+ * without k->lock, it's only a heuristic.
+ *
+ * While kernels of several contexts are ready with POCL_PTHREAD_FAIR_SHARE,
+ * the kernel with the most chunks left in its quantum is picked instead,
+ * so that a newly pushed kernel of another context gets threads at once,
+ * and the kernels that have used their quantum are skipped.
+ *
+ * Only the queues of a higher priority than max_level are considered. */
 static kernel_run_command *
-check_kernel_queue_for_device (thread_data *td)
+check_kernel_queue_for_device (thread_data *td, unsigned max_level)
 {
   kernel_run_command *cmd;
-  DL_FOREACH (scheduler.kernel_queue, cmd)
-  {
-    cl_device_id subd = cmd->device;
-    if (shall_we_run_this (td, subd))
-      return cmd;
-  }
+  kernel_run_command *best = NULL;
+  size_t best_score = 0;
+  unsigned level;
+  int over_share = 0;
+
+  prune_kernel_queue ();
+RESCAN:
+  for (level = 0; level < max_level && best == NULL && !over_share;
+       ++level)
+    DL_FOREACH (scheduler.kernel_queue[level], cmd)
+    {
+      cl_device_id subd = cmd->device;
+      if (shall_we_run_this (td, subd) && cmd->ref_count < cmd->max_threads
+          && !cmd->exhausted)
+        {
+          size_t score = cmd->remaining_wgs / (cmd->ref_count + 1);
+          if (scheduler.contended)
+            {
+              if (cmd->quantum_used >= cmd->quantum_chunks)
+                {
+                  over_share = 1;
+                  continue;
+                }
+              score = cmd->quantum_chunks - cmd->quantum_used;
+            }
+          if (best == NULL || score > best_score)
+            {
+              best = cmd;
+              best_score = score;
+            }
+        }
+    }
+
+  /* the kernels this thread could run have all used their quantum */
+  if (best == NULL && over_share)
+    {
+      start_fair_share_quantum ();
+      over_share = 0;
+      goto RESCAN;
+    }
+
+  return best;
+}
 
+/* Like check_kernel_queue_for_device, but for the host thread, which has no
+ * range of its own in the work-stealing scheduler. */
+static kernel_run_command *
+check_kernel_queue_for_host (thread_data *td)
+{
+  kernel_run_command *cmd;
+  unsigned level;
+  prune_kernel_queue ();
+  for (level = 0; level < POCL_PTHREAD_NUM_PRIORITIES; ++level)
+    DL_FOREACH (scheduler.kernel_queue[level], cmd)
+    {
+      if (cmd->wg_ranges && !cmd->wg_ranges_by_node)
+        continue;
+      if (cmd->remaining_wgs > 0 && !cmd->exhausted
+          && cmd->ref_count < cmd->max_threads
+          && shall_we_run_this (td, cmd->device))
+        return cmd;
+    }
   return NULL;
 }
 
+void
+pthread_scheduler_assist (int (*done) (void *), void *arg)
+{
+  thread_data *td = scheduler.host_td;
+  kernel_run_command *run_cmd;
+  fenv_t fenv;
+
+  if (!scheduler.host_assist
+      || __sync_lock_test_and_set (&scheduler.host_assist_busy, 1))
+    return;
+
+  /* the kernels change the FTZ and rounding modes */
+  fegetenv (&fenv);
+  td->current_ftz = 213;
+
+  while (!done (arg))
+    {
+      POCL_FAST_LOCK (scheduler.wq_lock_fast);
+      run_cmd = check_kernel_queue_for_host (td);
+      if (run_cmd == NULL)
+        {
+          POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+          break;
+        }
+      ++run_cmd->ref_count;
+      unsigned queue_gen = scheduler.kernel_queue_gen;
+      POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+
+      work_group_scheduler (run_cmd, td, queue_gen);
+
+      POCL_FAST_LOCK (scheduler.wq_lock_fast);
+      if ((--run_cmd->ref_count) == 0 && run_cmd->remaining_wgs == 0)
+        {
+          /* no thread may pick it up once it's finalized */
+          prune_kernel_queue ();
+          POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+          finalize_kernel_command (td, run_cmd);
+        }
+      else
+        POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+    }
+
+  fesetenv (&fenv);
+  __sync_lock_release (&scheduler.host_assist_busy);
+}
+
+/* Runs a command taken from the work queue, without wq_lock_fast. */
+static void
+run_command (_cl_command_node *cmd, thread_data *td)
+{
+  assert (pocl_command_is_ready (cmd->event));
+
+  if (cmd->type == CL_COMMAND_NDRANGE_KERNEL)
+    {
+      pocl_pthread_prepare_kernel (cmd->device->data, cmd, td);
+    }
+  else if (cmd->type == CL_COMMAND_COMMAND_BUFFER_KHR)
+    {
+      pocl_pthread_prepare_batch (cmd->device->data, cmd, td);
+    }
+  else if (!pocl_pthread_prepare_mem_command (cmd, td))
+    {
+      pocl_exec_command (cmd);
+    }
+
+  ++td->executed_commands;
+}
+
+/* Runs the kernels and commands of a higher priority than the kernel the
+ * thread is running, from the preemption point of that kernel. Their WGs
+ * use the buffers of the next nested level, as the preempted WG still
+ * uses the local memory and printf buffer of the thread. The preempted
+ * kernel continues once the thread finds no more such work. */
+static void
+run_preempting_work (thread_data *td)
+{
+  unsigned level = td->run_level;
+  td->preempt.requested = 0;
+  if (level == 0 || level >= POCL_PTHREAD_NUM_PRIORITIES)
+    return;
+
+  /* each level runs work of a higher priority than the one below */
+  assert (td->nested_depth < POCL_PTHREAD_NUM_PRIORITIES - 1);
+  nested_buffers *nb = &td->nested[td->nested_depth];
+  if (nb->printf_buffer == NULL)
+    {
+      nb->printf_buffer = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
+                                               scheduler.printf_buf_size);
+      if (nb->printf_buffer == NULL)
+        return;
+    }
+  ++td->nested_depth;
+
+  nested_buffers outer = { td->local_mem, td->local_mem_size,
+                           td->printf_buffer };
+  td->local_mem = nb->local_mem;
+  td->local_mem_size = nb->local_mem_size;
+  td->printf_buffer = nb->printf_buffer;
+  unsigned outer_ftz = td->current_ftz;
+
+  kernel_run_command *run_cmd;
+  _cl_command_node *cmd;
+  POCL_FAST_LOCK (scheduler.wq_lock_fast);
+  while (1)
+    {
+      run_cmd = check_kernel_queue_for_device (td, level);
+      if (run_cmd && check_cmd_queue_above (td, run_cmd->priority))
+        run_cmd = NULL;
+      if (run_cmd)
+        {
+          ++run_cmd->ref_count;
+          unsigned queue_gen = scheduler.kernel_queue_gen;
+          td->run_level = run_cmd->priority;
+          POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+
+          work_group_scheduler (run_cmd, td, queue_gen);
+
+          POCL_FAST_LOCK (scheduler.wq_lock_fast);
+          td->run_level = level;
+          if ((--run_cmd->ref_count) == 0 && run_cmd->remaining_wgs == 0)
+            {
+              prune_kernel_queue ();
+              POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+              finalize_kernel_command (td, run_cmd);
+              POCL_FAST_LOCK (scheduler.wq_lock_fast);
+            }
+          continue;
+        }
+
+      cmd = check_cmd_queue_for_device (td, level);
+      if (cmd == NULL)
+        break;
+      POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+      run_command (cmd, td);
+      POCL_FAST_LOCK (scheduler.wq_lock_fast);
+    }
+  POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+
+  /* the nested kernels may have grown the local memory */
+  nb->local_mem = td->local_mem;
+  nb->local_mem_size = td->local_mem_size;
+  nb->printf_buffer = td->printf_buffer;
+  td->local_mem = outer.local_mem;
+  td->local_mem_size = outer.local_mem_size;
+  td->printf_buffer = outer.printf_buffer;
+  --td->nested_depth;
+
+  if (td->current_ftz != outer_ftz)
+    {
+      pocl_set_ftz (outer_ftz);
+      td->current_ftz = outer_ftz;
+    }
+  pocl_set_default_rm ();
+}
+
+/* returned by pthread_scheduler_get_work when an idle thread of an
+ * elastic pool should exit */
+#define POCL_PTHREAD_THREAD_RETIRE 2
+
 static int
 pthread_scheduler_get_work (thread_data *td)
 {
@@ -461,18 +3589,26 @@ pthread_scheduler_get_work (thread_data *td)
 RETRY:
   do_exit = scheduler.thread_pool_shutdown_requested;
 
-  run_cmd = check_kernel_queue_for_device (td);
+  run_cmd = check_kernel_queue_for_device (td, POCL_PTHREAD_NUM_PRIORITIES);
+  /* a command of a higher priority queue, possibly its kernel, goes first */
+  if (run_cmd && check_cmd_queue_above (td, run_cmd->priority))
+    run_cmd = NULL;
   /* execute kernel if available */
   if (run_cmd)
     {
       ++run_cmd->ref_count;
+      unsigned queue_gen = scheduler.kernel_queue_gen;
+      td->run_level = run_cmd->priority;
       POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
 
-      work_group_scheduler (run_cmd, td);
+      work_group_scheduler (run_cmd, td, queue_gen);
 
       POCL_FAST_LOCK (scheduler.wq_lock_fast);
-      if ((--run_cmd->ref_count) == 0)
+      td->run_level = POCL_PTHREAD_NUM_PRIORITIES;
+      if ((--run_cmd->ref_count) == 0 && run_cmd->remaining_wgs == 0)
         {
+          /* no thread may pick it up once it's finalized */
+          prune_kernel_queue ();
           POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
           finalize_kernel_command (td, run_cmd);
           POCL_FAST_LOCK (scheduler.wq_lock_fast);
@@ -480,31 +3616,83 @@ RETRY:
     }
 
   /* execute a command if available */
-  cmd = check_cmd_queue_for_device (td);
+  cmd = check_cmd_queue_for_device (td, POCL_PTHREAD_NUM_PRIORITIES);
   if (cmd)
     {
       POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
-
-      assert (pocl_command_is_ready (cmd->event));
-
-      if (cmd->type == CL_COMMAND_NDRANGE_KERNEL)
-        {
-          pocl_pthread_prepare_kernel (cmd->device->data, cmd);
-        }
-      else
-        {
-          pocl_exec_command (cmd);
-        }
-
+      run_command (cmd, td);
       POCL_FAST_LOCK (scheduler.wq_lock_fast);
-      ++td->executed_commands;
     }
 
   /* if neither a command nor a kernel was available, sleep */
   if ((cmd == NULL) && (run_cmd == NULL) && (do_exit == 0))
     {
-      PTHREAD_CHECK (
-          pthread_cond_wait (&scheduler.wake_pool, &scheduler.wq_lock_fast));
+      uint64_t window = get_spin_window ();
+      if (window > 0 && spin_for_work (td, window))
+        {
+          pocl_stat_add (POCL_STAT_PTHREAD_SPIN_WAKEUPS, 1);
+          goto RETRY;
+        }
+
+      /* in an elastic pool, the threads above min_threads retire after
+       * idle_timeout_ms asleep */
+      int timed = scheduler.elastic;
+      struct timespec deadline;
+      if (timed)
+        {
+          clock_gettime (CLOCK_REALTIME, &deadline);
+          uint64_t ns = deadline.tv_nsec
+                        + (uint64_t)scheduler.idle_timeout_ms * 1000000;
+          deadline.tv_sec += ns / 1000000000;
+          deadline.tv_nsec = ns % 1000000000;
+        }
+
+      td->sleeping = 1;
+      ++scheduler.num_sleeping;
+      /* pairs with the CAS of pthread_scheduler_push_command */
+      __sync_synchronize ();
+      if (scheduler.inbox != NULL)
+        {
+          td->sleeping = 0;
+          --scheduler.num_sleeping;
+          goto RETRY;
+        }
+      notify_fork_waiter ();
+      do
+        {
+          if (!timed)
+            PTHREAD_CHECK (pthread_cond_wait (&td->wakeup_cond,
+                                              &scheduler.wq_lock_fast));
+          else if (pthread_cond_timedwait (&td->wakeup_cond,
+                                           &scheduler.wq_lock_fast,
+                                           &deadline)
+                       == ETIMEDOUT
+                   && td->sleeping)
+            {
+              if (scheduler.num_running > scheduler.min_threads)
+                {
+                  td->sleeping = 0;
+                  --scheduler.num_sleeping;
+                  td->running = 0;
+                  --scheduler.num_running;
+                  /* a pusher that still counted this thread waits for
+                   * the lock, and starts a new one if needed */
+                  __sync_synchronize ();
+                  if (scheduler.inbox == NULL)
+                    {
+                      notify_fork_waiter ();
+                      POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+                      return POCL_PTHREAD_THREAD_RETIRE;
+                    }
+                  td->running = 1;
+                  ++scheduler.num_running;
+                  break;
+                }
+              timed = 0;
+            }
+        }
+      while (td->sleeping);
+      pocl_stat_add (POCL_STAT_PTHREAD_IDLE_WAKEUPS, 1);
       goto RETRY;
     }
 
@@ -525,38 +3713,101 @@ pocl_pthread_driver_thread (void *p)
    * force a first FTZ setup */
   td->current_ftz = 213;
   td->num_threads = scheduler.num_threads;
+  /* xorshift must not be seeded with zero */
+  td->steal_seed = 2654435761U * (td->index + 1);
+  /* a previous thread of the slot may have pinned itself */
+  td->pinned = 0;
+  /* the buffers are only allocated by the threads that get started, so an
+   * elastic pool which stays small doesn't hold them for every CPU */
   td->printf_buffer = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
                                            scheduler.printf_buf_size);
-
-  assert (scheduler.local_mem_size > 0);
-  td->local_mem = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
-                                       scheduler.local_mem_size);
+  /* the local memory is allocated by the first kernel needing it */
+  td->local_mem = NULL;
+  td->local_mem_size = 0;
+  td->preempt.requested = 0;
+  td->preempt.yield = preempt_yield;
+  td->run_level = POCL_PTHREAD_NUM_PRIORITIES;
+  td->nested_depth = 0;
+  td->device_enqueue = scheduler.device_enqueue;
+  td->enqueuing = NULL;
+  td->wg_children = NULL;
 #ifdef __linux__
   if (pocl_get_bool_option ("POCL_AFFINITY", 0))
     {
       cpu_set_t set;
       CPU_ZERO (&set);
-      CPU_SET (td->index, &set);
+      if (scheduler.cpu_os_index)
+        CPU_SET (scheduler.cpu_os_index[td->index % scheduler.num_cpus],
+                 &set);
+      else
+        CPU_SET (td->index, &set);
+      PTHREAD_CHECK (
+          pthread_setaffinity_np (td->thread, sizeof (cpu_set_t), &set));
+      td->pinned = 1;
+    }
+  else if (scheduler.numa_aware)
+    {
+      /* bind to the whole node, and let the OS balance within it */
+      unsigned i;
+      cpu_set_t set;
+      CPU_ZERO (&set);
+      for (i = 0; i < scheduler.num_cpus; ++i)
+        if (scheduler.cpu_numa_node[i] == td->numa_node)
+          CPU_SET (scheduler.cpu_os_index[i], &set);
       PTHREAD_CHECK (
           pthread_setaffinity_np (td->thread, sizeof (cpu_set_t), &set));
     }
 #endif
 
-  if (td->printf_buffer == NULL || td->local_mem == NULL)
+  if (td->printf_buffer == NULL)
     {
-      POCL_ATOMIC_INC (scheduler.worker_out_of_memory);
+      if (td->initial)
+        POCL_ATOMIC_INC (scheduler.worker_out_of_memory);
+      else
+        {
+          /* the pool just doesn't grow */
+          POCL_MSG_WARN ("pthread worker %u: out of memory\n", td->index);
+          pocl_aligned_free (td->printf_buffer);
+          td->printf_buffer = NULL;
+          POCL_FAST_LOCK (scheduler.wq_lock_fast);
+          td->running = 0;
+          --scheduler.num_running;
+          notify_fork_waiter ();
+          POCL_FAST_UNLOCK (scheduler.wq_lock_fast);
+          return NULL;
+        }
     }
 
-  PTHREAD_CHECK2 (PTHREAD_BARRIER_SERIAL_THREAD,
-                  pthread_barrier_wait (&scheduler.init_barrier));
+  pocl_perf_counters_open (td->perf_fds);
+  pocl_stat_gauge_add (POCL_STAT_PTHREAD_THREADS, 1);
+
+  char thread_name[32];
+  snprintf (thread_name, sizeof (thread_name), "pthread worker %u",
+            td->index);
+  pocl_tracing_thread_name (thread_name);
+
+  if (td->initial)
+    {
+      td->initial = 0;
+      PTHREAD_CHECK2 (PTHREAD_BARRIER_SERIAL_THREAD,
+                      pthread_barrier_wait (&scheduler.init_barrier));
+    }
 
   while (1)
     {
       do_exit = pthread_scheduler_get_work (td);
       if (do_exit)
         {
+          /* the run commands stay with the slot: the kernels prepared by
+           * this thread may still return theirs to it, and the next
+           * thread of the slot reuses them */
           pocl_aligned_free (td->printf_buffer);
           pocl_aligned_free (td->local_mem);
+          td->printf_buffer = td->local_mem = NULL;
+          td->local_mem_size = 0;
+          free_nested_buffers (td);
+          pocl_perf_counters_close (td->perf_fds);
+          pocl_stat_gauge_add (POCL_STAT_PTHREAD_THREADS, -1);
           pthread_exit (NULL);
         }
     }
@@ -29,60 +29,6 @@
 #include "pocl-pthread.h"
 #include "pocl_mem_management.h"
 
-#ifdef USE_POCL_MEMMANAGER
-
-static kernel_run_command *volatile kernel_pool = 0;
-static int kernel_pool_initialized = 0;
-static pocl_lock_t kernel_pool_lock;
-
-
-void pocl_init_kernel_run_command_manager (void)
-{
-  if (!kernel_pool_initialized)
-    {
-      kernel_pool_initialized = 1;
-      POCL_INIT_LOCK (kernel_pool_lock);
-    }
-}
-
-void pocl_init_thread_argument_manager (void)
-{
-  if (!kernel_pool_initialized)
-    {
-      kernel_pool_initialized = 1;
-      POCL_INIT_LOCK (kernel_pool_lock);
-    }
-}
-
-kernel_run_command* new_kernel_run_command ()
-{
-  kernel_run_command *volatile k = NULL;
-  POCL_LOCK (kernel_pool_lock);
-  if ((k = kernel_pool))
-    {
-      LL_DELETE (kernel_pool, k);
-      memset (k, 0, sizeof(kernel_run_command));
-      PTHREAD_CHECK (pthread_mutex_init (&k->lock, NULL));
-      POCL_UNLOCK (kernel_pool_lock);
-      return k;
-    }
-
-  POCL_UNLOCK (kernel_pool_lock);
-  k = (kernel_run_command*)calloc (1, sizeof (kernel_run_command));
-  PTHREAD_CHECK (pthread_mutex_init (&k->lock, NULL));
-  return k;
-}
-
-void free_kernel_run_command (kernel_run_command *k)
-{
-  POCL_LOCK (kernel_pool_lock);
-  PTHREAD_CHECK (pthread_mutex_destroy (&k->lock));
-  LL_PREPEND (kernel_pool, k);
-  POCL_UNLOCK (kernel_pool_lock);
-}
-
-#endif
-
 #define ARGS_SIZE (sizeof (void *) * (meta->num_args + meta->num_locals + 1))
 
 static char *
@@ -97,6 +43,32 @@ align_ptr (char *p)
   return (char *)r;
 }
 
+/* Allocates from the argument arena of the command, or from the heap
+ * if the arena is exhausted. Aligned to MAX_EXTENDED_ALIGNMENT. */
+void *
+pthread_arena_alloc (kernel_run_command *k, size_t size)
+{
+  size_t start = (k->arena_used + MAX_EXTENDED_ALIGNMENT - 1)
+                 & ~(size_t) (MAX_EXTENDED_ALIGNMENT - 1);
+  if (k->arena && start + size <= k->arena_size)
+    {
+      k->arena_used = start + size;
+      return k->arena + start;
+    }
+  return pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, size);
+}
+
+/* Frees memory from pthread_arena_alloc(). Memory in the arena itself
+ * is reclaimed only when the whole arena is reset. */
+void
+pthread_arena_free (kernel_run_command *k, void *ptr)
+{
+  if (k->arena && (char *)ptr >= k->arena
+      && (char *)ptr < k->arena + k->arena_size)
+    return;
+  POCL_MEM_FREE (ptr);
+}
+
 /* called from kernel setup code.
  * Sets up the actual arguments, except the local ones. */
 void
@@ -108,10 +80,9 @@ setup_kernel_arg_array (kernel_run_command *k)
   cl_uint i;
   void **arguments;
   void **arguments2;
-  k->arguments = arguments
-      = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, ARGS_SIZE);
-  k->arguments2 = arguments2
-      = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT, ARGS_SIZE);
+  k->arguments = arguments = pthread_arena_alloc (k, ARGS_SIZE);
+  k->arguments2 = arguments2 = pthread_arena_alloc (k, ARGS_SIZE);
+  k->local_mem_size = 0;
 
   for (i = 0; i < meta->num_args; ++i)
     {
@@ -120,6 +91,9 @@ setup_kernel_arg_array (kernel_run_command *k)
         {
           arguments[i] = NULL;
           arguments2[i] = NULL;
+          if (!k->device->device_alloca_locals)
+            k->local_mem_size
+                = (size_t)align_ptr ((char *)(k->local_mem_size + al->size));
         }
       else if (meta->arg_info[i].type == POCL_ARG_TYPE_POINTER)
         {
@@ -151,8 +125,7 @@ setup_kernel_arg_array (kernel_run_command *k)
         {
           dev_image_t di;
           pocl_fill_dev_image_t (&di, al, k->device);
-          void *devptr = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
-                                              sizeof (dev_image_t));
+          void *devptr = pthread_arena_alloc (k, sizeof (dev_image_t));
           arguments[i] = &arguments2[i];
           arguments2[i] = devptr;
           memcpy (devptr, &di, sizeof (dev_image_t));
@@ -168,6 +141,11 @@ setup_kernel_arg_array (kernel_run_command *k)
       else
         arguments[i] = al->value;
     }
+
+  if (!k->device->device_alloca_locals)
+    for (i = 0; i < meta->num_locals; ++i)
+      k->local_mem_size = (size_t)align_ptr (
+          (char *)(k->local_mem_size + meta->local_sizes[i]));
 }
 
 /* called from each driver thread.
@@ -254,12 +232,15 @@ free_kernel_arg_array (kernel_run_command *k)
         }
       else if (meta->arg_info[i].type == POCL_ARG_TYPE_IMAGE)
         {
-          POCL_MEM_FREE (arguments2[i]);
+          pthread_arena_free (k, arguments2[i]);
+          arguments2[i] = NULL;
         }
     }
 
-  POCL_MEM_FREE (k->arguments);
-  POCL_MEM_FREE (k->arguments2);
+  pthread_arena_free (k, k->arguments);
+  pthread_arena_free (k, k->arguments2);
+  k->arguments = NULL;
+  k->arguments2 = NULL;
 }
 
 /* called from each driver thread.
@@ -0,0 +1,1810 @@
+/* pocl_remote.c - a pocl device driver for the OpenCL devices of other nodes,
+   which pocld serves over TCP
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* The structure follows the proxy driver, with the calls to the backend
+ * OpenCL replaced by the messages of remote_protocol.h: each pocl command
+ * queue has a thread that sends its ready commands to the server without
+ * waiting for them, and a reader thread per server completes them as the
+ * server replies. The commands that only wait for commands already sent to
+ * the same server are sent right away too, with the server's events of
+ * those commands as their wait list, so that the event graph of a server's
+ * commands is resolved in the server. The buffers stay allocated in the
+ * servers; the migrations between the devices of two servers are pulled by
+ * the destination server directly from the source server. */
+
+#include "config.h"
+#include "pocl_remote.h"
+#include "common.h"
+#include "devices.h"
+#include "remote_protocol.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pocl_cl.h"
+#include "pocl_mem_management.h"
+#include "pocl_timing.h"
+#include "pocl_util.h"
+#include "common_driver.h"
+#include "utlist.h"
+
+/*****************************************************************************/
+
+/* A message waiting for its reply: a synchronous message, or a command
+ * waiting to complete. */
+typedef struct remote_pending_s
+{
+  uint64_t id;
+  /* the command, NULL for a synchronous message */
+  _cl_command_node *node;
+  /* where the data the command completes with goes; with is_rect, the
+   * region of the host memory the packed data is unpacked to */
+  char *dst;
+  size_t dst_size;
+  int is_rect;
+  size_t region[3];
+  size_t row_pitch;
+  size_t slice_pitch;
+  /* the reply of a synchronous message */
+  int done;
+  int32_t status;
+  char *payload;
+  uint64_t payload_size;
+  struct remote_pending_s *prev, *next;
+} remote_pending_t;
+
+/* A connection to a pocld, shared by the devices used of it */
+typedef struct remote_server_s
+{
+  char *address;
+  int fd;
+  uint64_t session;
+  uint32_t num_devices;
+
+  /* held while a message is written, so that the messages of the queue
+   * threads don't interleave */
+  pocl_lock_t send_lock;
+
+  /* protects pending and dead */
+  pocl_lock_t lock;
+  /* for the threads waiting for the reply of a synchronous message */
+  pocl_cond_t reply_cond;
+  remote_pending_t *pending;
+  /* set when the connection failed; the later messages fail right away */
+  int dead;
+
+  uint64_t last_id;
+  pocl_thread_t reader;
+  struct remote_server_s *next;
+} remote_server_t;
+
+typedef struct remote_device_data_s
+{
+  remote_server_t *server;
+  /* index of the device in the server */
+  uint32_t index;
+  /* the device info strings of the device point here */
+  remote_device_info_t info;
+  /* the bytes of the buffers allocated on the device, and their limit set
+     with POCL_REMOTE_MEMORY_LIMIT, 0 for none */
+  pocl_lock_t mem_lock;
+  size_t mem_allocated;
+  size_t mem_limit;
+} remote_device_data_t;
+
+typedef struct remote_queue_data_s
+{
+  // lock
+  ALIGN_CACHE (pocl_lock_t wq_lock);
+  // ready to send queue
+  _cl_command_node *work_queue;
+
+  // for user threads that are waiting on clFinish
+  ALIGN_CACHE (pocl_cond_t wait_cond);
+
+  // for waking up the queue thread
+  ALIGN_CACHE (pocl_cond_t wakeup_cond);
+
+  // id of the queue in the server
+  uint64_t id;
+  // pocl queue id
+  cl_command_queue queue;
+
+  // ask the thread to exit
+  int cq_thread_exit_requested;
+  /* queue pthread */
+  pocl_thread_t cq_thread_id;
+
+} remote_queue_data_t;
+
+typedef struct remote_event_data_s
+{
+  pocl_cond_t event_cond;
+  /* the server the command was sent to and the id of its event there, 0
+   * until the command has been sent */
+  remote_server_t *server;
+  uint64_t id;
+} remote_event_data_t;
+
+/* The build of a program for a device */
+typedef struct remote_program_data_s
+{
+  uint64_t id;
+  /* the kernel metadata the server replied, until setup_metadata() */
+  remote_stream metadata;
+} remote_program_data_t;
+
+typedef struct remote_kernel_data_s
+{
+  uint64_t id;
+} remote_kernel_data_t;
+
+/* The id of the server's buffer of a pocl_mem_identifier, whose mem_ptr is
+ * the server. */
+#define REMOTE_MEM_ID(mem_id) ((mem_id)->extra)
+
+static const char remote_device_name[] = "remote";
+static remote_server_t *servers = NULL;
+static pocl_lock_t servers_lock = POCL_LOCK_INITIALIZER;
+
+void
+pocl_remote_init_device_ops (struct pocl_device_ops *ops)
+{
+  memset (ops, 0, sizeof (struct pocl_device_ops));
+  ops->device_name = remote_device_name;
+
+  ops->probe = pocl_remote_probe;
+  ops->init = pocl_remote_init;
+  ops->uninit = pocl_remote_uninit;
+  ops->reinit = pocl_remote_reinit;
+
+  ops->alloc_mem_obj = pocl_remote_alloc_mem_obj;
+  ops->free = pocl_remote_free;
+  ops->can_migrate_d2d = pocl_remote_can_migrate_d2d;
+  ops->get_mapping_ptr = pocl_driver_get_mapping_ptr;
+  ops->free_mapping_ptr = pocl_driver_free_mapping_ptr;
+
+  ops->create_kernel = pocl_remote_create_kernel;
+  ops->free_kernel = pocl_remote_free_kernel;
+  ops->init_queue = pocl_remote_init_queue;
+  ops->free_queue = pocl_remote_free_queue;
+
+  ops->build_source = pocl_remote_build_source;
+  ops->build_binary = pocl_remote_build_binary;
+  ops->free_program = pocl_remote_free_program;
+  ops->setup_metadata = pocl_remote_setup_metadata;
+  ops->supports_binary = NULL;
+
+  ops->join = pocl_remote_join;
+  ops->submit = pocl_remote_submit;
+  ops->broadcast = pocl_broadcast;
+  ops->notify = pocl_remote_notify;
+  ops->flush = pocl_remote_flush;
+  ops->wait_event = pocl_remote_wait_event;
+  ops->free_event_data = pocl_remote_free_event_data;
+  ops->notify_cmdq_finished = pocl_remote_notify_cmdq_finished;
+  ops->notify_event_finished = pocl_remote_notify_event_finished;
+  ops->build_hash = pocl_remote_build_hash;
+}
+
+char *
+pocl_remote_build_hash (cl_device_id device)
+{
+  char *res = (char *)calloc (1000, sizeof (char));
+  snprintf (res, 1000, "pocl-remote: %s %s", device->short_name,
+            device->driver_version);
+  return res;
+}
+
+unsigned
+pocl_remote_probe (struct pocl_device_ops *ops)
+{
+  int env_count = pocl_device_get_env_count (ops->device_name);
+  if (env_count <= 0)
+    return 0;
+
+  POCL_MSG_PRINT_REMOTE ("Requested %i remote devices.\n", env_count);
+  return env_count;
+}
+
+/*****************************************************************************/
+
+static uint64_t
+remote_new_id (remote_server_t *s)
+{
+  return POCL_ATOMIC_INC (s->last_id);
+}
+
+/* Removes the message with the id from the pending ones and returns it, or
+ * NULL if it's not pending. Called with the server locked. */
+static remote_pending_t *
+remote_take_pending (remote_server_t *s, uint64_t id)
+{
+  remote_pending_t *p;
+  DL_FOREACH (s->pending, p)
+    {
+      if (p->id == id)
+        {
+          DL_DELETE (s->pending, p);
+          return p;
+        }
+    }
+  return NULL;
+}
+
+/* Writes a message: the header, the parameters and the data. */
+static int
+remote_send (remote_server_t *s, remote_msg_header *h, const void *params,
+             size_t params_size, const void *data, size_t data_size)
+{
+  int err;
+  h->payload_size = params_size + data_size;
+
+  POCL_LOCK (s->send_lock);
+  err = remote_send_all (s->fd, h, sizeof (*h));
+  if (err == 0 && params_size > 0)
+    err = remote_send_all (s->fd, params, params_size);
+  if (err == 0 && data_size > 0)
+    err = remote_send_all (s->fd, data, data_size);
+  POCL_UNLOCK (s->send_lock);
+
+  if (err)
+    POCL_MSG_ERR ("remote: sending to %s failed\n", s->address);
+  return err;
+}
+
+/* Sends a message without waiting for a reply. */
+static int
+remote_send_async (remote_server_t *s, uint32_t type, uint32_t device,
+                   uint64_t obj, remote_stream *params)
+{
+  remote_msg_header h;
+  memset (&h, 0, sizeof (h));
+  h.type = type;
+  h.device = device;
+  h.obj = obj;
+  h.id = remote_new_id (s);
+  return remote_send (s, &h, params ? params->data : NULL,
+                      params ? params->size : 0, NULL, 0);
+}
+
+/* Sends a synchronous message and waits for its reply. Returns the status
+ * the server replied, with the payload of the reply in reply, which the
+ * caller frees. */
+static int
+remote_rpc (remote_server_t *s, remote_msg_header *h, remote_stream *params,
+            remote_stream *reply)
+{
+  remote_pending_t p;
+  memset (&p, 0, sizeof (p));
+  memset (reply, 0, sizeof (*reply));
+  h->id = p.id = remote_new_id (s);
+
+  POCL_LOCK (s->lock);
+  if (s->dead)
+    {
+      POCL_UNLOCK (s->lock);
+      return CL_DEVICE_NOT_AVAILABLE;
+    }
+  DL_APPEND (s->pending, &p);
+  POCL_UNLOCK (s->lock);
+
+  int err = remote_send (s, h, params ? params->data : NULL,
+                         params ? params->size : 0, NULL, 0);
+
+  POCL_LOCK (s->lock);
+  /* unless the reader thread took it already */
+  if (err && remote_take_pending (s, p.id) != NULL)
+    {
+      p.done = 1;
+      p.status = CL_DEVICE_NOT_AVAILABLE;
+    }
+  while (!p.done)
+    POCL_WAIT_COND (s->reply_cond, s->lock);
+  POCL_UNLOCK (s->lock);
+
+  reply->data = p.payload;
+  reply->size = reply->capacity = (size_t)p.payload_size;
+  return p.status;
+}
+
+/* Copies a region between the host memory with the pitches and a packed
+ * buffer. */
+static void
+remote_copy_region (char *host, size_t row_pitch, size_t slice_pitch,
+                    char *packed, const size_t *region, int to_packed)
+{
+  size_t y, z;
+  for (z = 0; z < region[2]; ++z)
+    for (y = 0; y < region[1]; ++y)
+      {
+        char *h = host + z * slice_pitch + y * row_pitch;
+        char *p = packed + (z * region[1] + y) * region[0];
+        if (to_packed)
+          memcpy (p, h, region[0]);
+        else
+          memcpy (h, p, region[0]);
+      }
+}
+
+static void
+remote_complete_command (remote_pending_t *p, int32_t status)
+{
+  cl_event event = p->node->event;
+  POCL_MEM_FREE (p);
+
+  if (status != CL_SUCCESS)
+    {
+      POCL_MSG_ERR ("remote: command %" PRIu64 " failed with %i\n",
+                    event->id, status);
+      POCL_LOCK_OBJ (event);
+      pocl_update_event_failed (event);
+      POCL_UNLOCK_OBJ (event);
+      return;
+    }
+
+  const char *cstr = pocl_command_to_str (event->command->type);
+  char msg[128] = "Event ";
+  strncat (msg, cstr, 127);
+
+  POCL_UPDATE_EVENT_COMPLETE_MSG (event, msg);
+}
+
+/* Receives the data a command completed with to where it goes. Returns
+ * nonzero if the connection failed. */
+static int
+remote_recv_command_data (remote_server_t *s, remote_pending_t *p,
+                          remote_reply_header *r)
+{
+  if (r->payload_size == 0)
+    return 0;
+
+  if (r->payload_size != p->dst_size || p->dst == NULL)
+    {
+      POCL_MSG_ERR ("remote: command %" PRIu64 " completed with %" PRIu64
+                    " bytes instead of %zu\n",
+                    r->id, r->payload_size, p->dst_size);
+      r->status = CL_OUT_OF_RESOURCES;
+      return remote_recv_discard (s->fd, r->payload_size);
+    }
+
+  if (!p->is_rect)
+    return remote_recv_all (s->fd, p->dst, p->dst_size);
+
+  char *packed = (char *)malloc (p->dst_size);
+  if (packed == NULL)
+    {
+      r->status = CL_OUT_OF_HOST_MEMORY;
+      return remote_recv_discard (s->fd, r->payload_size);
+    }
+  int err = remote_recv_all (s->fd, packed, p->dst_size);
+  if (err == 0)
+    remote_copy_region (p->dst, p->row_pitch, p->slice_pitch, packed,
+                        p->region, 0);
+  free (packed);
+  return err;
+}
+
+/* Fails the pending messages of a server whose connection failed. */
+static void
+remote_server_failed (remote_server_t *s)
+{
+  remote_pending_t *p, *tmp, *commands = NULL;
+
+  POCL_LOCK (s->lock);
+  s->dead = 1;
+  DL_FOREACH_SAFE (s->pending, p, tmp)
+    {
+      DL_DELETE (s->pending, p);
+      if (p->node)
+        DL_APPEND (commands, p);
+      else
+        {
+          p->status = CL_DEVICE_NOT_AVAILABLE;
+          p->done = 1;
+        }
+    }
+  POCL_BROADCAST_COND (s->reply_cond);
+  POCL_UNLOCK (s->lock);
+
+  DL_FOREACH_SAFE (commands, p, tmp)
+    {
+      DL_DELETE (commands, p);
+      remote_complete_command (p, CL_DEVICE_NOT_AVAILABLE);
+    }
+}
+
+static void *
+remote_reader_pthread (void *ptr)
+{
+  remote_server_t *s = (remote_server_t *)ptr;
+  remote_reply_header r;
+
+  while (remote_recv_all (s->fd, &r, sizeof (r)) == 0)
+    {
+      POCL_LOCK (s->lock);
+      remote_pending_t *p = remote_take_pending (s, r.id);
+      POCL_UNLOCK (s->lock);
+
+      if (p == NULL)
+        {
+          POCL_MSG_ERR ("remote: reply to unknown message %" PRIu64 "\n",
+                        r.id);
+          if (remote_recv_discard (s->fd, r.payload_size) != 0)
+            break;
+          continue;
+        }
+
+      if (p->node == NULL)
+        {
+          char *payload = NULL;
+          int err = 0;
+          if (r.payload_size > 0)
+            {
+              payload = (char *)malloc (r.payload_size);
+              err = (payload == NULL)
+                    || remote_recv_all (s->fd, payload, r.payload_size);
+            }
+          POCL_LOCK (s->lock);
+          if (err)
+            {
+              POCL_MEM_FREE (payload);
+              r.status = CL_DEVICE_NOT_AVAILABLE;
+              r.payload_size = 0;
+            }
+          p->payload = payload;
+          p->payload_size = r.payload_size;
+          p->status = r.status;
+          p->done = 1;
+          POCL_BROADCAST_COND (s->reply_cond);
+          POCL_UNLOCK (s->lock);
+          if (err)
+            break;
+          continue;
+        }
+
+      if (remote_recv_command_data (s, p, &r) != 0)
+        {
+          remote_complete_command (p, CL_DEVICE_NOT_AVAILABLE);
+          break;
+        }
+      remote_complete_command (p, r.status);
+    }
+
+  POCL_MSG_ERR ("remote: lost the connection to %s\n", s->address);
+  shutdown (s->fd, SHUT_RDWR);
+  remote_server_failed (s);
+  return NULL;
+}
+
+/* Returns the connection to the server at the address, connecting to it
+ * and opening the session on first use. */
+static remote_server_t *
+remote_get_server (const char *address)
+{
+  remote_server_t *s;
+  remote_msg_header h;
+  remote_stream params = { 0 }, reply = { 0 };
+
+  POCL_LOCK (servers_lock);
+  LL_FOREACH (servers, s)
+    {
+      if (strcmp (s->address, address) == 0)
+        {
+          POCL_UNLOCK (servers_lock);
+          return s;
+        }
+    }
+
+  s = (remote_server_t *)calloc (1, sizeof (remote_server_t));
+  if (s == NULL)
+    goto ERROR;
+  s->fd = remote_connect (address);
+  if (s->fd < 0)
+    {
+      POCL_MSG_ERR ("remote: can't connect to %s\n", address);
+      goto ERROR;
+    }
+  s->address = strdup (address);
+  POCL_INIT_LOCK (s->send_lock);
+  POCL_INIT_LOCK (s->lock);
+  POCL_INIT_COND (s->reply_cond);
+  POCL_CREATE_THREAD (s->reader, remote_reader_pthread, s);
+
+  memset (&h, 0, sizeof (h));
+  h.type = REMOTE_MSG_HELLO;
+  remote_put_u32 (&params, POCL_REMOTE_PROTOCOL_VERSION);
+  int err = remote_rpc (s, &h, &params, &reply);
+  remote_stream_free (&params);
+  s->session = remote_get_u64 (&reply);
+  s->num_devices = remote_get_u32 (&reply);
+  if (err != CL_SUCCESS || reply.error)
+    {
+      POCL_MSG_ERR ("remote: %s refused the session: %i\n", address, err);
+      remote_stream_free (&reply);
+      /* the reader thread keeps the connection */
+      shutdown (s->fd, SHUT_RDWR);
+      POCL_UNLOCK (servers_lock);
+      return NULL;
+    }
+  remote_stream_free (&reply);
+
+  POCL_MSG_PRINT_REMOTE ("Session %" PRIu64 " with %s, %u devices\n",
+                         s->session, address, s->num_devices);
+  LL_APPEND (servers, s);
+  POCL_UNLOCK (servers_lock);
+  return s;
+
+ERROR:
+  POCL_MEM_FREE (s);
+  POCL_UNLOCK (servers_lock);
+  return NULL;
+}
+
+static void
+remote_setup_device_info (cl_device_id dev, remote_device_data_t *d)
+{
+  remote_device_info_t *info = &d->info;
+
+  dev->type = info->type;
+  dev->vendor_id = info->vendor_id;
+  dev->max_compute_units = info->max_compute_units;
+  dev->max_clock_frequency = info->max_clock_frequency;
+  dev->address_bits = info->address_bits;
+  dev->mem_base_addr_align = info->mem_base_addr_align;
+  if (dev->mem_base_addr_align < 4)
+    dev->mem_base_addr_align = MAX_EXTENDED_ALIGNMENT;
+  // This one is deprecated (and seems to be always 128)
+  dev->min_data_type_align_size = 128;
+
+  dev->global_mem_size = info->global_mem_size;
+  dev->max_mem_alloc_size = info->max_mem_alloc_size;
+  dev->global_mem_cache_size = info->global_mem_cache_size;
+  dev->global_mem_cache_type = info->global_mem_cache_type;
+  dev->global_mem_cacheline_size = info->global_mem_cacheline_size;
+  dev->local_mem_type = info->local_mem_type;
+  dev->local_mem_size = info->local_mem_size;
+  dev->max_constant_buffer_size = info->max_constant_buffer_size;
+  dev->max_constant_args = info->max_constant_args;
+  dev->max_parameter_size = info->max_parameter_size;
+
+  dev->max_work_item_dimensions = info->max_work_item_dimensions;
+  dev->max_work_group_size = info->max_work_group_size;
+  dev->max_work_item_sizes[0] = info->max_work_item_sizes[0];
+  dev->max_work_item_sizes[1] = info->max_work_item_sizes[1];
+  dev->max_work_item_sizes[2] = info->max_work_item_sizes[2];
+
+  dev->native_vector_width_char = info->native_vector_width[0];
+  dev->native_vector_width_short = info->native_vector_width[1];
+  dev->native_vector_width_int = info->native_vector_width[2];
+  dev->native_vector_width_long = info->native_vector_width[3];
+  dev->native_vector_width_float = info->native_vector_width[4];
+  dev->native_vector_width_double = info->native_vector_width[5];
+  dev->preferred_vector_width_char = info->preferred_vector_width[0];
+  dev->preferred_vector_width_short = info->preferred_vector_width[1];
+  dev->preferred_vector_width_int = info->preferred_vector_width[2];
+  dev->preferred_vector_width_long = info->preferred_vector_width[3];
+  dev->preferred_vector_width_float = info->preferred_vector_width[4];
+  dev->preferred_vector_width_double = info->preferred_vector_width[5];
+
+  dev->single_fp_config = info->single_fp_config;
+  dev->double_fp_config = info->double_fp_config;
+  dev->printf_buffer_size = info->printf_buffer_size;
+  dev->profiling_timer_resolution = info->profiling_timer_resolution;
+  dev->endian_little = info->endian_little;
+  dev->error_correction_support = info->error_correction_support;
+
+  /* the host memory is the client's, not the server's */
+  dev->host_unified_memory = CL_FALSE;
+  /* the images and the samplers are not sent to the servers */
+  dev->image_support = CL_FALSE;
+  dev->execution_capabilities = CL_EXEC_KERNEL;
+  dev->queue_properties = CL_QUEUE_PROFILING_ENABLE;
+  dev->available = info->available;
+  dev->compiler_available = info->compiler_available;
+  /* the programs are built from source in one step in the server */
+  dev->linker_available = CL_FALSE;
+  dev->has_64bit_long = 1;
+
+  /* the version of the server's device, "OpenCL <major>.<minor> ...",
+     at most 1.2: the commands of the 2.0 API (SVM, pipes and the device
+     side queues) are not forwarded to the servers */
+  unsigned major = 0, minor = 0;
+  if (sscanf (info->version, "OpenCL %u.%u", &major, &minor) != 2)
+    {
+      POCL_MSG_WARN ("remote: unknown device version '%s', using 1.2\n",
+                     info->version);
+      major = 1;
+      minor = 2;
+    }
+  dev->cl_version_int = major * 100 + minor * 10;
+  if (dev->cl_version_int > 120)
+    {
+      dev->cl_version_int = 120;
+      snprintf (info->version, sizeof (info->version), "OpenCL 1.2 %s",
+                info->name);
+      snprintf (info->opencl_c_version, sizeof (info->opencl_c_version),
+                "OpenCL C 1.2 %s", info->name);
+    }
+
+  dev->short_name = info->name;
+  dev->long_name = info->name;
+  dev->vendor = info->vendor;
+  dev->version = info->version;
+  dev->driver_version = info->driver_version;
+  dev->cl_version_std = info->opencl_c_version;
+  dev->profile = info->profile;
+  dev->extensions = info->extensions;
+}
+
+cl_int
+pocl_remote_init (unsigned j, cl_device_id dev, const char *parameters)
+{
+  remote_device_data_t *d;
+  remote_server_t *s;
+  remote_msg_header h;
+  remote_stream reply;
+  unsigned index = 0;
+  char address[256];
+
+  if (parameters == NULL)
+    {
+      POCL_MSG_ERR ("remote: set POCL_REMOTE%u_PARAMETERS to "
+                    "host[:port][/device]\n",
+                    j);
+      return CL_INVALID_DEVICE;
+    }
+
+  const char *slash = strchr (parameters, '/');
+  size_t len = slash ? (size_t)(slash - parameters) : strlen (parameters);
+  if (len == 0 || len >= sizeof (address))
+    return CL_INVALID_DEVICE;
+  memcpy (address, parameters, len);
+  address[len] = 0;
+  if (slash)
+    index = (unsigned)atoi (slash + 1);
+
+  s = remote_get_server (address);
+  if (s == NULL)
+    return CL_INVALID_DEVICE;
+  if (index >= s->num_devices)
+    {
+      POCL_MSG_ERR ("remote: %s has no device %u\n", address, index);
+      return CL_INVALID_DEVICE;
+    }
+
+  d = (remote_device_data_t *)calloc (1, sizeof (remote_device_data_t));
+  if (d == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  d->server = s;
+  d->index = index;
+
+  memset (&h, 0, sizeof (h));
+  h.type = REMOTE_MSG_DEVICE_INFO;
+  h.device = index;
+  int err = remote_rpc (s, &h, NULL, &reply);
+  if (err != CL_SUCCESS || reply.size != sizeof (remote_device_info_t))
+    {
+      POCL_MSG_ERR ("remote: failed to get the info of device %u of %s\n",
+                    index, address);
+      remote_stream_free (&reply);
+      POCL_MEM_FREE (d);
+      return CL_INVALID_DEVICE;
+    }
+  memcpy (&d->info, reply.data, sizeof (remote_device_info_t));
+  remote_stream_free (&reply);
+
+  dev->data = d;
+  remote_setup_device_info (dev, d);
+
+  POCL_INIT_LOCK (d->mem_lock);
+  int limit_mb = pocl_get_int_option ("POCL_REMOTE_MEMORY_LIMIT", 0);
+  if (limit_mb > 0)
+    {
+      d->mem_limit = (size_t)limit_mb << 20;
+      if (dev->global_mem_size > d->mem_limit)
+        dev->global_mem_size = d->mem_limit;
+      if (dev->max_mem_alloc_size > d->mem_limit)
+        dev->max_mem_alloc_size = d->mem_limit;
+    }
+
+  POCL_MSG_PRINT_REMOTE ("Device %u: %s of %s\n", j, dev->long_name,
+                         address);
+  return CL_SUCCESS;
+}
+
+cl_int
+pocl_remote_uninit (unsigned j, cl_device_id device)
+{
+  return CL_SUCCESS;
+}
+
+cl_int
+pocl_remote_reinit (unsigned j, cl_device_id device)
+{
+  return CL_SUCCESS;
+}
+
+/*****************************************************************************/
+
+int
+pocl_remote_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  pocl_mem_identifier *p = &mem->device_ptrs[device->global_mem_id];
+  remote_msg_header h;
+  remote_stream params = { 0 }, reply;
+  assert (p->mem_ptr == NULL);
+
+  if (mem->is_image)
+    return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+
+  /* reserve the memory before the allocation in the server */
+  POCL_LOCK (d->mem_lock);
+  if (d->mem_limit && d->mem_allocated + mem->size > d->mem_limit)
+    {
+      POCL_UNLOCK (d->mem_lock);
+      POCL_MSG_PRINT_MEMORY ("remote: %zu bytes over the memory limit\n",
+                             mem->size);
+      return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+  d->mem_allocated += mem->size;
+  POCL_UNLOCK (d->mem_lock);
+
+  memset (&h, 0, sizeof (h));
+  h.type = REMOTE_MSG_CREATE_BUFFER;
+  h.device = d->index;
+  h.obj = remote_new_id (d->server);
+  remote_put_u64 (&params, mem->size);
+  remote_put_u64 (&params, mem->flags
+                               & (CL_MEM_READ_WRITE | CL_MEM_READ_ONLY
+                                  | CL_MEM_WRITE_ONLY));
+  int err = remote_rpc (d->server, &h, &params, &reply);
+  remote_stream_free (&params);
+  remote_stream_free (&reply);
+  if (err != CL_SUCCESS)
+    {
+      POCL_MSG_ERR ("remote: mem alloc failed with %i\n", err);
+      POCL_LOCK (d->mem_lock);
+      d->mem_allocated -= mem->size;
+      POCL_UNLOCK (d->mem_lock);
+      return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+    }
+
+  p->mem_ptr = d->server;
+  REMOTE_MEM_ID (p) = h.obj;
+  p->version = 0;
+
+  POCL_MSG_PRINT_MEMORY ("remote DEVICE ALLOC ID %" PRIu64 " SIZE %zu\n",
+                         h.obj, mem->size);
+  return CL_SUCCESS;
+}
+
+void
+pocl_remote_free (cl_device_id device, cl_mem mem)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  pocl_mem_identifier *p = &mem->device_ptrs[device->global_mem_id];
+  assert (p->mem_ptr != NULL);
+
+  remote_send_async (d->server, REMOTE_MSG_FREE_BUFFER, d->index,
+                     REMOTE_MEM_ID (p), NULL);
+
+  POCL_LOCK (d->mem_lock);
+  d->mem_allocated -= mem->size;
+  POCL_UNLOCK (d->mem_lock);
+
+  POCL_MSG_PRINT_MEMORY ("remote DEVICE FREED ID %" PRIu64 " SIZE %zu\n",
+                         REMOTE_MEM_ID (p), mem->size);
+  p->mem_ptr = NULL;
+  REMOTE_MEM_ID (p) = 0;
+  p->version = 0;
+}
+
+int
+pocl_remote_can_migrate_d2d (cl_device_id dest, cl_device_id source)
+{
+  /* the destination server pulls the data, also from another server */
+  return dest->ops == source->ops;
+}
+
+/*****************************************************************************/
+
+int
+pocl_remote_build_source (cl_program program, cl_uint device_i,
+                          cl_uint num_input_headers,
+                          const cl_program *input_headers,
+                          const char **header_include_names, int link_program)
+{
+  cl_device_id device = program->devices[device_i];
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  remote_msg_header h;
+  remote_stream params = { 0 }, reply;
+
+  POCL_RETURN_ERROR_ON ((!link_program), CL_COMPILE_PROGRAM_FAILURE,
+                        "remote devices only build programs from source "
+                        "with clBuildProgram\n");
+
+  assert (program->data[device_i] == NULL);
+  assert (program->source);
+
+  memset (&h, 0, sizeof (h));
+  h.type = REMOTE_MSG_BUILD_PROGRAM;
+  h.device = d->index;
+  h.obj = remote_new_id (d->server);
+  remote_put_str (&params, program->compiler_options);
+  remote_put_str (&params, program->source);
+  POCL_MSG_PRINT_REMOTE ("SOURCE BUILD: device %u ||| options %s \n",
+                         device_i, program->compiler_options);
+  int err = remote_rpc (d->server, &h, &params, &reply);
+  remote_stream_free (&params);
+
+  assert (program->build_log[device_i] == NULL);
+  char *log = remote_get_str (&reply);
+  if (log != NULL && log[0] != 0)
+    program->build_log[device_i] = log;
+  else
+    POCL_MEM_FREE (log);
+
+  if (err != CL_SUCCESS)
+    {
+      remote_stream_free (&reply);
+      return err;
+    }
+
+  remote_program_data_t *pd
+      = (remote_program_data_t *)calloc (1, sizeof (remote_program_data_t));
+  if (pd == NULL)
+    {
+      remote_stream_free (&reply);
+      return CL_OUT_OF_HOST_MEMORY;
+    }
+  pd->id = h.obj;
+  pd->metadata = reply;
+  program->data[device_i] = pd;
+
+  program->binary_sizes[device_i] = 0;
+  program->binaries[device_i] = NULL;
+
+  SHA1_CTX hash_ctx;
+  pocl_SHA1_Init (&hash_ctx);
+  // TODO caching on source is unreliable, ignores includes
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)program->source,
+                    strlen (program->source));
+  if (program->compiler_options)
+    pocl_SHA1_Update (&hash_ctx, (const uint8_t *)program->compiler_options,
+                      strlen (program->compiler_options));
+
+  assert (program->build_hash[device_i][2] == 0);
+
+  char *dev_hash = device->ops->build_hash (device);
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)dev_hash, strlen (dev_hash));
+  free (dev_hash);
+
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  pocl_SHA1_Final (&hash_ctx, digest);
+
+  unsigned char *hashstr = program->build_hash[device_i];
+  size_t i;
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    {
+      *hashstr++ = (digest[i] & 0x0F) + 65;
+      *hashstr++ = ((digest[i] & 0xF0) >> 4) + 65;
+    }
+  *hashstr = 0;
+
+  program->build_hash[device_i][2] = '/';
+
+  return CL_SUCCESS;
+}
+
+int
+pocl_remote_build_binary (cl_program program, cl_uint device_i,
+                          int link_program, int spir_build)
+{
+  POCL_RETURN_ERROR_ON (1, CL_BUILD_PROGRAM_FAILURE,
+                        "remote devices do not support binaries\n");
+}
+
+int
+pocl_remote_free_program (cl_device_id device, cl_program program,
+                          unsigned program_device_i)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+
+  // this can happen if the build fails
+  if (program->data == NULL || program->data[program_device_i] == NULL)
+    return CL_SUCCESS;
+
+  remote_program_data_t *pd
+      = (remote_program_data_t *)program->data[program_device_i];
+  remote_send_async (d->server, REMOTE_MSG_FREE_PROGRAM, d->index, pd->id,
+                     NULL);
+  remote_stream_free (&pd->metadata);
+  POCL_MEM_FREE (pd);
+  program->data[program_device_i] = NULL;
+
+  return CL_SUCCESS;
+}
+
+static void
+remote_free_kernel_metadata (pocl_kernel_metadata_t *meta)
+{
+  unsigned i;
+  for (i = 0; i < meta->num_args; ++i)
+    {
+      POCL_MEM_FREE (meta->arg_info[i].type_name);
+      POCL_MEM_FREE (meta->arg_info[i].name);
+    }
+  POCL_MEM_FREE (meta->arg_info);
+  POCL_MEM_FREE (meta->local_sizes);
+  POCL_MEM_FREE (meta->name);
+  POCL_MEM_FREE (meta->attributes);
+  POCL_MEM_FREE (meta->data);
+}
+
+/* Reads the metadata of a kernel the server found out with -cl-kernel-arg-info
+ * and by trying clSetKernelArg with different sizes, like the proxy driver. */
+static void
+remote_get_kernel_metadata (pocl_kernel_metadata_t *meta, cl_uint num_devices,
+                            remote_stream *s)
+{
+  cl_uint i;
+
+  meta->data = (void **)calloc (num_devices, sizeof (void *));
+  meta->has_arg_metadata = (-1);
+  meta->name = remote_get_str (s);
+  meta->attributes = remote_get_str (s);
+  if (meta->attributes && meta->attributes[0] == 0)
+    POCL_MEM_FREE (meta->attributes);
+  for (i = 0; i < 3; ++i)
+    meta->reqd_wg_size[i] = remote_get_u64 (s);
+  meta->num_locals = 1;
+  meta->local_sizes = (size_t *)calloc (1, sizeof (size_t));
+  if (meta->local_sizes)
+    meta->local_sizes[0] = remote_get_u64 (s);
+
+  cl_uint num_args = remote_get_u32 (s);
+  if (s->error || num_args == 0 || num_args > 10000)
+    return;
+  meta->arg_info
+      = (pocl_argument_info *)calloc (num_args, sizeof (pocl_argument_info));
+  if (meta->arg_info == NULL)
+    {
+      s->error = 1;
+      return;
+    }
+  meta->num_args = num_args;
+
+  for (i = 0; i < num_args; ++i)
+    {
+      pocl_argument_info *pi = &meta->arg_info[i];
+      uint32_t kind = remote_get_u32 (s);
+      pi->address_qualifier = remote_get_u32 (s);
+      pi->access_qualifier = remote_get_u32 (s);
+      pi->type_qualifier = remote_get_u64 (s);
+      pi->type_size = (unsigned)remote_get_u64 (s);
+      pi->type_name = remote_get_str (s);
+      pi->name = remote_get_str (s);
+      switch (kind)
+        {
+        case REMOTE_ARG_BUFFER:
+        case REMOTE_ARG_LOCAL:
+          pi->type = POCL_ARG_TYPE_POINTER;
+          break;
+        case REMOTE_ARG_IMAGE:
+          pi->type = POCL_ARG_TYPE_IMAGE;
+          break;
+        case REMOTE_ARG_SAMPLER:
+          pi->type = POCL_ARG_TYPE_SAMPLER;
+          break;
+        default:
+          pi->type = POCL_ARG_TYPE_NONE;
+        }
+
+      POCL_MSG_PRINT_REMOTE ("KERNEL %s ARGUMENT %u NAME %s "
+                             "TYPENAME %s TYPE %u SIZE %u\n",
+                             meta->name, i, pi->name, pi->type_name,
+                             pi->type, pi->type_size);
+    }
+}
+
+int
+pocl_remote_setup_metadata (cl_device_id device, cl_program program,
+                            unsigned program_device_i)
+{
+  remote_program_data_t *pd
+      = (remote_program_data_t *)program->data[program_device_i];
+  if (pd == NULL)
+    return 0;
+
+  remote_stream *s = &pd->metadata;
+  cl_uint num_kernels = remote_get_u32 (s);
+  cl_uint i;
+
+  assert (program->kernel_meta == NULL);
+  pocl_kernel_metadata_t *p = NULL;
+  if (num_kernels > 0)
+    {
+      p = (pocl_kernel_metadata_t *)calloc (num_kernels,
+                                            sizeof (pocl_kernel_metadata_t));
+      if (p == NULL)
+        return 0;
+      for (i = 0; i < num_kernels && !s->error; ++i)
+        remote_get_kernel_metadata (p + i, program->num_devices, s);
+    }
+
+  if (s->error)
+    {
+      POCL_MSG_ERR ("remote: invalid kernel metadata from the server\n");
+      for (i = 0; i < num_kernels; ++i)
+        remote_free_kernel_metadata (p + i);
+      POCL_MEM_FREE (p);
+      remote_stream_free (s);
+      return 0;
+    }
+
+  program->kernel_meta = p;
+  program->num_kernels = num_kernels;
+  remote_stream_free (s);
+  POCL_MSG_PRINT_REMOTE ("Num kernels: %zu\n", program->num_kernels);
+  return 1;
+}
+
+int
+pocl_remote_create_kernel (cl_device_id device, cl_program program,
+                           cl_kernel kernel, unsigned device_i)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  remote_program_data_t *pd = (remote_program_data_t *)program->data[device_i];
+  remote_stream params = { 0 };
+  assert (pd);
+  assert (kernel->data[device_i] == NULL);
+
+  remote_kernel_data_t *kd
+      = (remote_kernel_data_t *)calloc (1, sizeof (remote_kernel_data_t));
+  if (kd == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  kd->id = remote_new_id (d->server);
+
+  /* the server creates the kernel before it gets the commands that run it,
+   * and fails them if it could not */
+  remote_put_u64 (&params, pd->id);
+  remote_put_str (&params, kernel->name);
+  int err = remote_send_async (d->server, REMOTE_MSG_CREATE_KERNEL, d->index,
+                               kd->id, &params);
+  remote_stream_free (&params);
+  if (err)
+    {
+      POCL_MEM_FREE (kd);
+      return CL_OUT_OF_RESOURCES;
+    }
+
+  kernel->data[device_i] = kd;
+  return CL_SUCCESS;
+}
+
+int
+pocl_remote_free_kernel (cl_device_id device, cl_program program,
+                         cl_kernel kernel, unsigned device_i)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  assert (kernel->data != NULL);
+
+  // may happen if creating kernel fails
+  if (kernel->data[device_i] == NULL)
+    return CL_SUCCESS;
+
+  remote_kernel_data_t *kd = (remote_kernel_data_t *)kernel->data[device_i];
+  remote_send_async (d->server, REMOTE_MSG_FREE_KERNEL, d->index, kd->id,
+                     NULL);
+  POCL_MEM_FREE (kd);
+  kernel->data[device_i] = NULL;
+
+  return CL_SUCCESS;
+}
+
+static void *pocl_remote_queue_pthread (void *ptr);
+
+int
+pocl_remote_init_queue (cl_device_id device, cl_command_queue queue)
+{
+  assert (queue->data == NULL);
+
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  remote_stream params = { 0 };
+
+  remote_queue_data_t *qd = (remote_queue_data_t *)pocl_aligned_malloc (
+      HOST_CPU_CACHELINE_SIZE, sizeof (remote_queue_data_t));
+  if (qd == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  memset (qd, 0, sizeof (remote_queue_data_t));
+
+  qd->id = remote_new_id (d->server);
+  remote_put_u64 (&params, queue->properties
+                               & (CL_QUEUE_PROFILING_ENABLE
+                                  | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+  int err = remote_send_async (d->server, REMOTE_MSG_CREATE_QUEUE, d->index,
+                               qd->id, &params);
+  remote_stream_free (&params);
+  if (err)
+    {
+      pocl_aligned_free (qd);
+      return CL_OUT_OF_RESOURCES;
+    }
+  queue->data = qd;
+
+  POCL_INIT_COND (qd->wakeup_cond);
+  POCL_INIT_COND (qd->wait_cond);
+  POCL_INIT_LOCK (qd->wq_lock);
+  qd->work_queue = NULL;
+  qd->queue = queue;
+
+  qd->cq_thread_exit_requested = 0;
+  POCL_CREATE_THREAD (qd->cq_thread_id, pocl_remote_queue_pthread, qd);
+
+  return CL_SUCCESS;
+}
+
+int
+pocl_remote_free_queue (cl_device_id device, cl_command_queue queue)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  remote_queue_data_t *qd = (remote_queue_data_t *)queue->data;
+
+  if (queue->data == NULL)
+    return CL_SUCCESS;
+
+  POCL_FAST_LOCK (qd->wq_lock);
+  qd->cq_thread_exit_requested = 1;
+  POCL_SIGNAL_COND (qd->wakeup_cond);
+  POCL_FAST_UNLOCK (qd->wq_lock);
+
+  POCL_JOIN_THREAD (qd->cq_thread_id);
+  qd->cq_thread_id = 0;
+
+  remote_send_async (d->server, REMOTE_MSG_FREE_QUEUE, d->index, qd->id,
+                     NULL);
+
+  qd->work_queue = NULL;
+  POCL_DESTROY_COND (qd->wakeup_cond);
+  POCL_DESTROY_COND (qd->wait_cond);
+  POCL_DESTROY_LOCK (qd->wq_lock);
+  pocl_aligned_free (qd);
+  queue->data = NULL;
+  return CL_SUCCESS;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+static void
+remote_push_command (_cl_command_node *node)
+{
+  cl_command_queue cq = node->event->queue;
+  remote_queue_data_t *qd = (remote_queue_data_t *)cq->data;
+
+  POCL_FAST_LOCK (qd->wq_lock);
+  DL_APPEND (qd->work_queue, node);
+  POCL_SIGNAL_COND (qd->wakeup_cond);
+  POCL_FAST_UNLOCK (qd->wq_lock);
+}
+
+/* Returns true if the commands the event still waits for have all been
+ * sent to the server of the device, so the server can order the command
+ * after them. Called with the event locked. */
+static int
+remote_deps_on_server (cl_device_id device, cl_event event)
+{
+  remote_device_data_t *d = (remote_device_data_t *)device->data;
+  event_node *n;
+
+  LL_FOREACH (event->wait_list, n)
+    {
+      cl_event dep = n->event;
+      if (dep->queue == NULL || dep->queue->device->ops != device->ops)
+        return 0;
+      remote_event_data_t *dep_data = (remote_event_data_t *)dep->data;
+      if (dep_data == NULL || dep_data->id == 0
+          || dep_data->server != d->server)
+        return 0;
+    }
+  return 1;
+}
+
+void
+pocl_remote_submit (_cl_command_node *node, cl_command_queue cq)
+{
+  cl_event e = node->event;
+  assert (e->data == NULL);
+
+  remote_event_data_t *e_d = NULL;
+  e_d = calloc (1, sizeof (remote_event_data_t));
+  assert (e_d);
+
+  POCL_INIT_COND (e_d->event_cond);
+  e->data = (void *)e_d;
+
+  node->ready = 1;
+  if (pocl_command_is_ready (e) || remote_deps_on_server (node->device, e))
+    {
+      pocl_update_event_submitted (e);
+      remote_push_command (node);
+    }
+  POCL_UNLOCK_OBJ (e);
+  return;
+}
+
+void
+pocl_remote_notify_cmdq_finished (cl_command_queue cq)
+{
+  /* must be called with CQ already locked.
+   * this must be a broadcast since there could be multiple
+   * user threads waiting on the same command queue */
+  remote_queue_data_t *dd = (remote_queue_data_t *)cq->data;
+  POCL_BROADCAST_COND (dd->wait_cond);
+}
+
+void
+pocl_remote_join (cl_device_id device, cl_command_queue cq)
+{
+  POCL_LOCK_OBJ (cq);
+  remote_queue_data_t *dd = (remote_queue_data_t *)cq->data;
+
+  while (1)
+    {
+      if (cq->command_count == 0)
+        {
+          POCL_UNLOCK_OBJ (cq);
+          return;
+        }
+      else
+        {
+          POCL_WAIT_COND (dd->wait_cond, cq->pocl_lock);
+        }
+    }
+}
+
+void
+pocl_remote_flush (cl_device_id device, cl_command_queue cq)
+{
+}
+
+void
+pocl_remote_notify (cl_device_id device, cl_event event, cl_event finished)
+{
+  _cl_command_node *node = event->command;
+
+  /* already pushed, waiting for its dependencies in the server, which
+   * fails it too if they fail */
+  if (event->status != CL_QUEUED)
+    return;
+
+  if (finished->status < CL_COMPLETE)
+    {
+      pocl_update_event_failed (event);
+      return;
+    }
+
+  if (!node->ready)
+    return;
+
+  if (pocl_command_is_ready (node->event)
+      || remote_deps_on_server (device, event))
+    {
+      pocl_update_event_submitted (event);
+      remote_push_command (node);
+    }
+}
+
+void
+pocl_remote_wait_event (cl_device_id device, cl_event event)
+{
+  POCL_MSG_PRINT_REMOTE ("device->wait_event on event %zu\n", event->id);
+  remote_event_data_t *e_d = (remote_event_data_t *)event->data;
+
+  POCL_LOCK_OBJ (event);
+  while (event->status > CL_COMPLETE)
+    {
+      POCL_WAIT_COND (e_d->event_cond, event->pocl_lock);
+    }
+  POCL_UNLOCK_OBJ (event);
+
+  POCL_MSG_PRINT_INFO ("event wait finished with status: %i\n", event->status);
+  assert (event->status <= CL_COMPLETE);
+}
+
+void
+pocl_remote_free_event_data (cl_event event)
+{
+  assert (event->data != NULL);
+  remote_event_data_t *e_d = (remote_event_data_t *)event->data;
+  /* no command waits for the event in the server anymore */
+  if (e_d->id)
+    remote_send_async (e_d->server, REMOTE_MSG_RELEASE_EVENT, 0, e_d->id,
+                       NULL);
+  POCL_DESTROY_COND (e_d->event_cond);
+  POCL_MEM_FREE (event->data);
+}
+
+void
+pocl_remote_notify_event_finished (cl_event event)
+{
+  remote_event_data_t *e_d = (remote_event_data_t *)event->data;
+  POCL_BROADCAST_COND (e_d->event_cond);
+}
+
+/*****************************************************************************/
+
+/* Pushes the commands of the same server waiting for the event whose
+ * dependencies are now all sent. They are only try-locked, since the events
+ * are locked in the other order elsewhere; the ones missed are pushed when
+ * their dependencies complete. */
+static void
+remote_push_dependents (cl_event event, remote_server_t *s)
+{
+  event_node *n;
+
+  POCL_LOCK_OBJ (event);
+  LL_FOREACH (event->notify_list, n)
+    {
+      cl_event waiting = n->event;
+      if (pthread_mutex_trylock (&waiting->pocl_lock) != 0)
+        continue;
+      _cl_command_node *node = waiting->command;
+      if (waiting->status == CL_QUEUED && node != NULL && node->ready
+          && node->device->ops == event->queue->device->ops
+          && ((remote_device_data_t *)node->device->data)->server == s
+          && remote_deps_on_server (node->device, waiting))
+        {
+          pocl_update_event_submitted (waiting);
+          remote_push_command (node);
+        }
+      POCL_UNLOCK_OBJ (waiting);
+    }
+  POCL_UNLOCK_OBJ (event);
+}
+
+/* Writes the wait list of the command: the server's events of the commands
+ * it still waits for, which remote_deps_on_server() found sent to the same
+ * server. The others in the wait list have completed already. */
+static void
+remote_put_wait_list (remote_stream *params, cl_event event)
+{
+  event_node *n;
+  uint32_t num_deps = 0;
+
+  POCL_LOCK_OBJ (event);
+  LL_FOREACH (event->wait_list, n)
+    {
+      cl_event dep = n->event;
+      if (dep->queue != NULL && dep->queue->device->ops == event->queue->device->ops
+          && ((remote_event_data_t *)dep->data)->id != 0)
+        ++num_deps;
+    }
+  remote_put_u32 (params, num_deps);
+  LL_FOREACH (event->wait_list, n)
+    {
+      cl_event dep = n->event;
+      if (dep->queue != NULL && dep->queue->device->ops == event->queue->device->ops
+          && ((remote_event_data_t *)dep->data)->id != 0)
+        remote_put_u64 (params, ((remote_event_data_t *)dep->data)->id);
+    }
+  POCL_UNLOCK_OBJ (event);
+}
+
+static void
+remote_put_read (remote_msg_header *h, remote_stream *params,
+                 remote_pending_t *p, pocl_mem_identifier *mem_id,
+                 void *host_ptr, size_t offset, size_t size)
+{
+  h->type = REMOTE_MSG_READ;
+  h->obj = REMOTE_MEM_ID (mem_id);
+  remote_put_u64 (params, offset);
+  remote_put_u64 (params, size);
+  p->dst = (char *)host_ptr;
+  p->dst_size = size;
+}
+
+static void
+remote_put_write (remote_msg_header *h, remote_stream *params,
+                  pocl_mem_identifier *mem_id, size_t offset, size_t size)
+{
+  h->type = REMOTE_MSG_WRITE;
+  h->obj = REMOTE_MEM_ID (mem_id);
+  remote_put_u64 (params, offset);
+  remote_put_u64 (params, size);
+}
+
+static void
+remote_put_rect (remote_msg_header *h, remote_stream *params, uint32_t type,
+                 pocl_mem_identifier *mem_id, const size_t *buffer_origin,
+                 const size_t *region, size_t buffer_row_pitch,
+                 size_t buffer_slice_pitch)
+{
+  unsigned i;
+  h->type = type;
+  h->obj = REMOTE_MEM_ID (mem_id);
+  for (i = 0; i < 3; ++i)
+    remote_put_u64 (params, buffer_origin[i]);
+  for (i = 0; i < 3; ++i)
+    remote_put_u64 (params, region[i]);
+  remote_put_u64 (params, buffer_row_pitch);
+  remote_put_u64 (params, buffer_slice_pitch);
+}
+
+/* Writes the kernel launch. Returns nonzero if an argument can't be sent. */
+static int
+remote_put_run (remote_msg_header *h, remote_stream *params,
+                _cl_command_node *node)
+{
+  cl_kernel kernel = node->command.run.kernel;
+  pocl_kernel_metadata_t *meta = kernel->meta;
+  struct pocl_context *pc = &node->command.run.pc;
+  remote_kernel_data_t *kd
+      = (remote_kernel_data_t *)kernel->data[node->program_device_i];
+  unsigned i;
+
+  h->type = REMOTE_MSG_RUN;
+  h->obj = kd->id;
+  remote_put_u32 (params, pc->work_dim);
+  for (i = 0; i < 3; ++i)
+    remote_put_u64 (params, pc->global_offset[i]);
+  for (i = 0; i < 3; ++i)
+    remote_put_u64 (params, pc->num_groups[i] * pc->local_size[i]);
+  for (i = 0; i < 3; ++i)
+    remote_put_u64 (params, pc->local_size[i]);
+
+  remote_put_u32 (params, meta->num_args);
+  for (i = 0; i < meta->num_args; ++i)
+    {
+      struct pocl_argument *al = &node->command.run.arguments[i];
+      pocl_argument_info *ai = &meta->arg_info[i];
+      if (ARG_IS_LOCAL (meta->arg_info[i]))
+        {
+          remote_put_u32 (params, REMOTE_ARG_LOCAL);
+          remote_put_u64 (params, al->size);
+        }
+      else if (ai->type == POCL_ARG_TYPE_POINTER)
+        {
+          uint64_t id = 0;
+          if (al->value)
+            {
+              cl_mem m = *(cl_mem *)al->value;
+              id = REMOTE_MEM_ID (
+                  &m->device_ptrs[node->device->global_mem_id]);
+            }
+          remote_put_u32 (params, REMOTE_ARG_BUFFER);
+          remote_put_u64 (params, al->sub_buffer_size);
+          remote_put_u64 (params, id);
+          remote_put_u64 (params, al->offset);
+        }
+      else if (ai->type == POCL_ARG_TYPE_NONE)
+        {
+          remote_put_u32 (params, REMOTE_ARG_POD);
+          remote_put_u64 (params, al->size);
+          remote_put (params, al->value, al->size);
+        }
+      else
+        {
+          POCL_MSG_ERR ("remote: argument %u of kernel %s has an unsupported "
+                        "type\n",
+                        i, meta->name);
+          return -1;
+        }
+    }
+  return 0;
+}
+
+/* Sends the command to the server without waiting for it; it completes in
+ * the reader thread. */
+static void
+remote_exec_command (_cl_command_node *node, remote_queue_data_t *qd)
+{
+  _cl_command_t *cmd = &node->command;
+  cl_event event = node->event;
+  remote_event_data_t *e_d = (remote_event_data_t *)event->data;
+  remote_device_data_t *d = (remote_device_data_t *)node->device->data;
+  remote_server_t *s = d->server;
+  remote_msg_header h;
+  remote_stream params = { 0 };
+  const void *data = NULL;
+  size_t data_size = 0;
+  char *packed = NULL;
+  int failed = 0;
+
+  remote_pending_t *p
+      = (remote_pending_t *)calloc (1, sizeof (remote_pending_t));
+  assert (p);
+  memset (&h, 0, sizeof (h));
+  h.queue = qd->id;
+  h.id = p->id = remote_new_id (s);
+  p->node = node;
+
+  remote_put_wait_list (&params, event);
+
+  pocl_update_event_running (event);
+
+  switch (node->type)
+    {
+    case CL_COMMAND_MIGRATE_MEM_OBJECTS:
+      {
+        cl_mem m = event->mem_objs[0];
+        switch (cmd->migrate.type)
+          {
+          case ENQUEUE_MIGRATE_TYPE_D2H:
+            POCL_MSG_PRINT_REMOTE ("export D2H, device %s\n",
+                                   node->device->long_name);
+            remote_put_read (&h, &params, p, cmd->migrate.mem_id,
+                             (char *)m->mem_host_ptr + cmd->migrate.offset,
+                             cmd->migrate.offset, cmd->migrate.size);
+            break;
+          case ENQUEUE_MIGRATE_TYPE_H2D:
+            POCL_MSG_PRINT_REMOTE ("import H2D, device %s\n",
+                                   node->device->long_name);
+            remote_put_write (&h, &params, cmd->migrate.mem_id,
+                              cmd->migrate.offset, cmd->migrate.size);
+            data = (char *)m->mem_host_ptr + cmd->migrate.offset;
+            data_size = cmd->migrate.size;
+            break;
+          case ENQUEUE_MIGRATE_TYPE_D2D:
+            {
+              remote_device_data_t *src_d
+                  = (remote_device_data_t *)cmd->migrate.src_device->data;
+              POCL_MSG_PRINT_REMOTE ("migrate D2D, %s -> %s\n",
+                                     cmd->migrate.src_device->long_name,
+                                     node->device->long_name);
+              h.type = REMOTE_MSG_MIGRATE_D2D;
+              h.obj = REMOTE_MEM_ID (cmd->migrate.dst_id);
+              remote_put_u64 (&params, REMOTE_MEM_ID (cmd->migrate.src_id));
+              remote_put_u64 (&params, cmd->migrate.offset);
+              remote_put_u64 (&params, cmd->migrate.size);
+              remote_put_str (&params, src_d->server == s
+                                           ? ""
+                                           : src_d->server->address);
+              remote_put_u64 (&params, src_d->server->session);
+              break;
+            }
+          case ENQUEUE_MIGRATE_TYPE_NOP:
+            h.type = REMOTE_MSG_MARKER;
+            break;
+          }
+        break;
+      }
+
+    case CL_COMMAND_READ_BUFFER:
+      remote_put_read (&h, &params, p, cmd->read.src_mem_id,
+                       cmd->read.dst_host_ptr, cmd->read.offset,
+                       cmd->read.size);
+      break;
+
+    case CL_COMMAND_WRITE_BUFFER:
+      remote_put_write (&h, &params, cmd->write.dst_mem_id, cmd->write.offset,
+                        cmd->write.size);
+      data = cmd->write.src_host_ptr;
+      data_size = cmd->write.size;
+      break;
+
+    case CL_COMMAND_COPY_BUFFER:
+      h.type = REMOTE_MSG_COPY;
+      h.obj = REMOTE_MEM_ID (cmd->copy.dst_mem_id);
+      remote_put_u64 (&params, REMOTE_MEM_ID (cmd->copy.src_mem_id));
+      remote_put_u64 (&params, cmd->copy.src_offset);
+      remote_put_u64 (&params, cmd->copy.dst_offset);
+      remote_put_u64 (&params, cmd->copy.size);
+      break;
+
+    case CL_COMMAND_READ_BUFFER_RECT:
+      {
+        const size_t *region = cmd->read_rect.region;
+        const size_t *host_origin = cmd->read_rect.host_origin;
+        remote_put_rect (&h, &params, REMOTE_MSG_READ_RECT,
+                         cmd->read_rect.src_mem_id,
+                         cmd->read_rect.buffer_origin, region,
+                         cmd->read_rect.buffer_row_pitch,
+                         cmd->read_rect.buffer_slice_pitch);
+        p->is_rect = 1;
+        p->dst = (char *)cmd->read_rect.dst_host_ptr + host_origin[0]
+                 + host_origin[1] * cmd->read_rect.host_row_pitch
+                 + host_origin[2] * cmd->read_rect.host_slice_pitch;
+        p->dst_size = region[0] * region[1] * region[2];
+        memcpy (p->region, region, sizeof (p->region));
+        p->row_pitch = cmd->read_rect.host_row_pitch;
+        p->slice_pitch = cmd->read_rect.host_slice_pitch;
+        break;
+      }
+
+    case CL_COMMAND_WRITE_BUFFER_RECT:
+      {
+        const size_t *region = cmd->write_rect.region;
+        const size_t *host_origin = cmd->write_rect.host_origin;
+        remote_put_rect (&h, &params, REMOTE_MSG_WRITE_RECT,
+                         cmd->write_rect.dst_mem_id,
+                         cmd->write_rect.buffer_origin, region,
+                         cmd->write_rect.buffer_row_pitch,
+                         cmd->write_rect.buffer_slice_pitch);
+        data_size = region[0] * region[1] * region[2];
+        packed = (char *)malloc (data_size);
+        if (packed == NULL)
+          {
+            failed = 1;
+            break;
+          }
+        remote_copy_region ((char *)cmd->write_rect.src_host_ptr
+                                + host_origin[0]
+                                + host_origin[1]
+                                      * cmd->write_rect.host_row_pitch
+                                + host_origin[2]
+                                      * cmd->write_rect.host_slice_pitch,
+                            cmd->write_rect.host_row_pitch,
+                            cmd->write_rect.host_slice_pitch, packed, region,
+                            1);
+        data = packed;
+        break;
+      }
+
+    case CL_COMMAND_COPY_BUFFER_RECT:
+      {
+        unsigned i;
+        h.type = REMOTE_MSG_COPY_RECT;
+        h.obj = REMOTE_MEM_ID (cmd->copy_rect.dst_mem_id);
+        remote_put_u64 (&params, REMOTE_MEM_ID (cmd->copy_rect.src_mem_id));
+        for (i = 0; i < 3; ++i)
+          remote_put_u64 (&params, cmd->copy_rect.src_origin[i]);
+        for (i = 0; i < 3; ++i)
+          remote_put_u64 (&params, cmd->copy_rect.dst_origin[i]);
+        for (i = 0; i < 3; ++i)
+          remote_put_u64 (&params, cmd->copy_rect.region[i]);
+        remote_put_u64 (&params, cmd->copy_rect.src_row_pitch);
+        remote_put_u64 (&params, cmd->copy_rect.src_slice_pitch);
+        remote_put_u64 (&params, cmd->copy_rect.dst_row_pitch);
+        remote_put_u64 (&params, cmd->copy_rect.dst_slice_pitch);
+        break;
+      }
+
+    case CL_COMMAND_FILL_BUFFER:
+      h.type = REMOTE_MSG_FILL;
+      h.obj = REMOTE_MEM_ID (cmd->memfill.dst_mem_id);
+      remote_put_u64 (&params, cmd->memfill.offset);
+      remote_put_u64 (&params, cmd->memfill.size);
+      remote_put_u32 (&params, cmd->memfill.pattern_size);
+      remote_put (&params, cmd->memfill.pattern, cmd->memfill.pattern_size);
+      break;
+
+    case CL_COMMAND_MAP_BUFFER:
+      {
+        mem_mapping_t *map = cmd->map.mapping;
+        remote_put_read (&h, &params, p, cmd->map.mem_id, map->host_ptr,
+                         map->offset, map->size);
+        break;
+      }
+
+    case CL_COMMAND_UNMAP_MEM_OBJECT:
+      {
+        mem_mapping_t *map = cmd->unmap.mapping;
+        /* equality test, because it could be CL_MAP_READ |
+         * CL_MAP_WRITE(..invalidate) which has to be handled like a write */
+        if (map->map_flags == CL_MAP_READ)
+          h.type = REMOTE_MSG_MARKER;
+        else
+          {
+            remote_put_write (&h, &params, cmd->unmap.mem_id, map->offset,
+                              map->size);
+            data = map->host_ptr;
+            data_size = map->size;
+          }
+        break;
+      }
+
+    case CL_COMMAND_NDRANGE_KERNEL:
+      failed = remote_put_run (&h, &params, node);
+      break;
+
+    case CL_COMMAND_MARKER:
+    case CL_COMMAND_BARRIER:
+      h.type = REMOTE_MSG_MARKER;
+      break;
+
+    default:
+      POCL_MSG_ERR ("remote: unsupported command %s\n",
+                    pocl_command_to_str (node->type));
+      failed = 1;
+    }
+
+  if (failed || params.error)
+    {
+      remote_stream_free (&params);
+      POCL_MEM_FREE (packed);
+      remote_complete_command (p, CL_OUT_OF_RESOURCES);
+      return;
+    }
+
+  /* the reader thread may complete the command before the send returns */
+  POname (clRetainEvent) (event);
+
+  POCL_LOCK (s->lock);
+  int dead = s->dead;
+  if (!dead)
+    DL_APPEND (s->pending, p);
+  POCL_UNLOCK (s->lock);
+
+  if (dead)
+    remote_complete_command (p, CL_DEVICE_NOT_AVAILABLE);
+  else if (remote_send (s, &h, params.data, params.size, data, data_size)
+           != 0)
+    {
+      POCL_LOCK (s->lock);
+      p = remote_take_pending (s, h.id);
+      POCL_UNLOCK (s->lock);
+      if (p)
+        remote_complete_command (p, CL_DEVICE_NOT_AVAILABLE);
+    }
+  else
+    {
+      /* the commands waiting for it can now be sent to the server too */
+      POCL_LOCK_OBJ (event);
+      e_d->server = s;
+      e_d->id = h.id;
+      POCL_UNLOCK_OBJ (event);
+      remote_push_dependents (event, s);
+    }
+
+  POname (clReleaseEvent) (event);
+  remote_stream_free (&params);
+  POCL_MEM_FREE (packed);
+}
+
+static void *
+pocl_remote_queue_pthread (void *ptr)
+{
+  remote_queue_data_t *qd = (remote_queue_data_t *)ptr;
+  _cl_command_node *cmd = NULL;
+
+  POCL_FAST_LOCK (qd->wq_lock);
+
+  while (1)
+    {
+      if (qd->cq_thread_exit_requested)
+        {
+          POCL_FAST_UNLOCK (qd->wq_lock);
+          return NULL;
+        }
+
+      cmd = qd->work_queue;
+      if (cmd)
+        {
+          DL_DELETE (qd->work_queue, cmd);
+          POCL_FAST_UNLOCK (qd->wq_lock);
+
+          assert (cmd->event->status == CL_SUBMITTED);
+          remote_exec_command (cmd, qd);
+
+          POCL_FAST_LOCK (qd->wq_lock);
+        }
+
+      if ((qd->work_queue == NULL) && (qd->cq_thread_exit_requested == 0))
+        POCL_WAIT_COND (qd->wakeup_cond, qd->wq_lock);
+    }
+}
@@ -0,0 +1,421 @@
+/* remote_protocol.h - the messages between the remote driver and pocld
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* This header is included both by the remote driver and by pocld, which
+   only links to an OpenCL library, so it uses nothing but the C library.
+
+   Every message is a remote_msg_header followed by payload_size bytes of
+   payload, which starts with the parameters of the message written with
+   remote_put_*() and, for the messages carrying data, ends with the data.
+   The commands also start their parameters with their wait list. pocld
+   handles the messages of a connection in the order they arrive, replying
+   to the synchronous ones right away with a REMOTE_MSG_REPLY, and to the
+   commands with a REMOTE_MSG_COMPLETE once they complete; the other
+   messages get no reply. The client chooses the ids of all the objects and
+   the messages of its session, so it never waits for pocld to name them.
+
+   The integers and the remote_device_info_t are sent in the host byte
+   order, so the client and the servers must have the same one. */
+
+#ifndef POCL_REMOTE_PROTOCOL_H
+#define POCL_REMOTE_PROTOCOL_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define POCL_REMOTE_DEFAULT_PORT 10998
+#define POCL_REMOTE_PROTOCOL_VERSION 1
+
+typedef enum
+{
+  /* opens the session of a client: u32 version; replies u64 session id,
+   * u32 number of devices */
+  REMOTE_MSG_HELLO = 1,
+  /* replies the remote_device_info_t of the device */
+  REMOTE_MSG_DEVICE_INFO,
+  /* obj = buffer: u64 size, u64 flags */
+  REMOTE_MSG_CREATE_BUFFER,
+  REMOTE_MSG_FREE_BUFFER,
+  /* obj = program: str options, str source; replies str build log, and the
+   * kernel metadata if the build succeeded */
+  REMOTE_MSG_BUILD_PROGRAM,
+  REMOTE_MSG_FREE_PROGRAM,
+  /* obj = kernel: u64 program, str name */
+  REMOTE_MSG_CREATE_KERNEL,
+  REMOTE_MSG_FREE_KERNEL,
+  /* obj = queue: u64 properties */
+  REMOTE_MSG_CREATE_QUEUE,
+  REMOTE_MSG_FREE_QUEUE,
+  /* forgets the event of a command, which no later command waits for */
+  REMOTE_MSG_RELEASE_EVENT,
+
+  /* The commands, whose id is the id of their event. */
+  /* obj = buffer: u64 offset, u64 size; completes with the data */
+  REMOTE_MSG_READ,
+  /* obj = buffer: u64 offset, u64 size, data */
+  REMOTE_MSG_WRITE,
+  /* obj = dst buffer: u64 src buffer, u64 src offset, u64 dst offset,
+   * u64 size */
+  REMOTE_MSG_COPY,
+  /* obj = buffer: u64 buffer origin[3], u64 region[3], u64 row pitch,
+   * u64 slice pitch; completes with the region packed */
+  REMOTE_MSG_READ_RECT,
+  /* as READ_RECT, followed by the region packed */
+  REMOTE_MSG_WRITE_RECT,
+  /* obj = dst buffer: u64 src buffer, u64 src origin[3], u64 dst origin[3],
+   * u64 region[3], u64 src row pitch, u64 src slice pitch,
+   * u64 dst row pitch, u64 dst slice pitch */
+  REMOTE_MSG_COPY_RECT,
+  /* obj = buffer: u64 offset, u64 size, u32 pattern size, pattern */
+  REMOTE_MSG_FILL,
+  /* obj = kernel: u32 work_dim, u64 offset[3], u64 global[3],
+   * u64 local[3], u32 num_args, and for each argument u32 kind, u64 size,
+   * and then the size bytes of a POD argument, or for a buffer the u64
+   * buffer (0 for NULL) and the u64 origin of the sub-buffer of size bytes
+   * in it, size being 0 for the whole buffer */
+  REMOTE_MSG_RUN,
+  REMOTE_MSG_MARKER,
+  /* obj = dst buffer: u64 src buffer, u64 offset, u64 size, str address of
+   * the server with the src buffer, empty for this one, u64 session of the
+   * src buffer */
+  REMOTE_MSG_MIGRATE_D2D,
+
+  /* Sent by a pocld to another, outside of any session: obj = buffer,
+   * u64 session, u64 offset, u64 size; replies the data */
+  REMOTE_MSG_PEER_READ,
+
+  REMOTE_MSG_REPLY,
+  REMOTE_MSG_COMPLETE,
+} remote_msg_type;
+
+typedef struct
+{
+  uint32_t type;
+  /* index of the device in the server, for the messages that create
+   * objects of a device */
+  uint32_t device;
+  /* id of the message; of the event, for a command */
+  uint64_t id;
+  /* the object the message creates or uses */
+  uint64_t obj;
+  /* the queue of a command */
+  uint64_t queue;
+  uint64_t payload_size;
+} remote_msg_header;
+
+typedef struct
+{
+  /* REMOTE_MSG_REPLY or REMOTE_MSG_COMPLETE */
+  uint32_t type;
+  /* an OpenCL error code */
+  int32_t status;
+  /* id of the message replied to */
+  uint64_t id;
+  uint64_t payload_size;
+} remote_reply_header;
+
+/* The kinds of the kernel arguments, in the kernel metadata and RUN */
+#define REMOTE_ARG_POD 0
+#define REMOTE_ARG_BUFFER 1
+#define REMOTE_ARG_LOCAL 2
+#define REMOTE_ARG_IMAGE 3
+#define REMOTE_ARG_SAMPLER 4
+
+#define REMOTE_INFO_STRING_SIZE 256
+#define REMOTE_INFO_EXTENSIONS_SIZE 4096
+
+/* The device info the client presents its devices with. The 64-bit fields
+   come first, so that the layout has no padding. */
+typedef struct
+{
+  uint64_t type;
+  uint64_t global_mem_size;
+  uint64_t max_mem_alloc_size;
+  uint64_t global_mem_cache_size;
+  uint64_t local_mem_size;
+  uint64_t max_constant_buffer_size;
+  uint64_t max_parameter_size;
+  uint64_t max_work_group_size;
+  uint64_t max_work_item_sizes[3];
+  uint64_t printf_buffer_size;
+  uint64_t profiling_timer_resolution;
+  uint64_t single_fp_config;
+  uint64_t double_fp_config;
+  uint32_t vendor_id;
+  uint32_t max_compute_units;
+  uint32_t max_clock_frequency;
+  uint32_t address_bits;
+  uint32_t mem_base_addr_align;
+  uint32_t global_mem_cacheline_size;
+  uint32_t global_mem_cache_type;
+  uint32_t local_mem_type;
+  uint32_t max_work_item_dimensions;
+  uint32_t max_constant_args;
+  /* char, short, int, long, float, double */
+  uint32_t native_vector_width[6];
+  uint32_t preferred_vector_width[6];
+  uint32_t endian_little;
+  uint32_t error_correction_support;
+  uint32_t compiler_available;
+  uint32_t available;
+  char name[REMOTE_INFO_STRING_SIZE];
+  char vendor[REMOTE_INFO_STRING_SIZE];
+  char version[REMOTE_INFO_STRING_SIZE];
+  char driver_version[REMOTE_INFO_STRING_SIZE];
+  char opencl_c_version[REMOTE_INFO_STRING_SIZE];
+  char profile[REMOTE_INFO_STRING_SIZE];
+  char extensions[REMOTE_INFO_EXTENSIONS_SIZE];
+} remote_device_info_t;
+
+/*****************************************************************************/
+
+/* A growing buffer the parameters are written to, or a received payload
+   they are read from. */
+typedef struct
+{
+  char *data;
+  size_t size;
+  size_t capacity;
+  /* read position */
+  size_t pos;
+  /* set when a read went past the end, or a write failed to grow */
+  int error;
+} remote_stream;
+
+static inline void
+remote_put (remote_stream *s, const void *p, size_t n)
+{
+  if (s->size + n > s->capacity)
+    {
+      size_t capacity = s->capacity ? s->capacity : 256;
+      while (capacity < s->size + n)
+        capacity *= 2;
+      char *data = (char *)realloc (s->data, capacity);
+      if (data == NULL)
+        {
+          s->error = 1;
+          return;
+        }
+      s->data = data;
+      s->capacity = capacity;
+    }
+  memcpy (s->data + s->size, p, n);
+  s->size += n;
+}
+
+static inline void
+remote_put_u32 (remote_stream *s, uint32_t v)
+{
+  remote_put (s, &v, sizeof (v));
+}
+
+static inline void
+remote_put_u64 (remote_stream *s, uint64_t v)
+{
+  remote_put (s, &v, sizeof (v));
+}
+
+static inline void
+remote_put_str (remote_stream *s, const char *str)
+{
+  uint32_t len = str ? (uint32_t)strlen (str) : 0;
+  remote_put_u32 (s, len);
+  remote_put (s, str, len);
+}
+
+static inline const void *
+remote_get (remote_stream *s, size_t n)
+{
+  if (s->error || s->pos + n > s->size)
+    {
+      s->error = 1;
+      return NULL;
+    }
+  const void *p = s->data + s->pos;
+  s->pos += n;
+  return p;
+}
+
+static inline uint32_t
+remote_get_u32 (remote_stream *s)
+{
+  uint32_t v = 0;
+  const void *p = remote_get (s, sizeof (v));
+  if (p)
+    memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline uint64_t
+remote_get_u64 (remote_stream *s)
+{
+  uint64_t v = 0;
+  const void *p = remote_get (s, sizeof (v));
+  if (p)
+    memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+/* Returns the string as a malloc'd copy, or NULL on error. */
+static inline char *
+remote_get_str (remote_stream *s)
+{
+  uint32_t len = remote_get_u32 (s);
+  const char *p = (const char *)remote_get (s, len);
+  if (p == NULL)
+    return NULL;
+  char *str = (char *)malloc (len + 1);
+  if (str == NULL)
+    {
+      s->error = 1;
+      return NULL;
+    }
+  memcpy (str, p, len);
+  str[len] = 0;
+  return str;
+}
+
+static inline void
+remote_stream_free (remote_stream *s)
+{
+  free (s->data);
+  memset (s, 0, sizeof (*s));
+}
+
+/*****************************************************************************/
+
+/* Sends all the n bytes, returns 0 or -1 if the connection failed. */
+static inline int
+remote_send_all (int fd, const void *buf, size_t n)
+{
+  const char *p = (const char *)buf;
+  while (n > 0)
+    {
+      ssize_t r = send (fd, p, n, MSG_NOSIGNAL);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return -1;
+      p += r;
+      n -= (size_t)r;
+    }
+  return 0;
+}
+
+/* Receives exactly n bytes, returns 0 or -1 if the connection closed or
+   failed. */
+static inline int
+remote_recv_all (int fd, void *buf, size_t n)
+{
+  char *p = (char *)buf;
+  while (n > 0)
+    {
+      ssize_t r = recv (fd, p, n, 0);
+      if (r < 0 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        return -1;
+      p += r;
+      n -= (size_t)r;
+    }
+  return 0;
+}
+
+/* Receives and drops n bytes. */
+static inline int
+remote_recv_discard (int fd, uint64_t n)
+{
+  char buf[4096];
+  while (n > 0)
+    {
+      size_t chunk = n < sizeof (buf) ? (size_t)n : sizeof (buf);
+      if (remote_recv_all (fd, buf, chunk) != 0)
+        return -1;
+      n -= chunk;
+    }
+  return 0;
+}
+
+/* Splits "host[:port]" to host (at most host_size bytes) and port.
+   Returns 0 or -1 if the host does not fit. */
+static inline int
+remote_parse_address (const char *address, char *host, size_t host_size,
+                      unsigned *port)
+{
+  const char *colon = strrchr (address, ':');
+  size_t len = colon ? (size_t)(colon - address) : strlen (address);
+  if (len + 1 > host_size)
+    return -1;
+  memcpy (host, address, len);
+  host[len] = 0;
+  *port = colon ? (unsigned)atoi (colon + 1) : POCL_REMOTE_DEFAULT_PORT;
+  return 0;
+}
+
+/* Connects to "host[:port]", returns the socket or -1. The messages are
+   small and pipelined, so Nagle's algorithm only delays them. */
+static inline int
+remote_connect (const char *address)
+{
+  char host[256], port_str[16];
+  unsigned port;
+  struct addrinfo hints, *res, *ai;
+  int fd = -1, one = 1;
+
+  if (remote_parse_address (address, host, sizeof (host), &port) != 0)
+    return -1;
+  snprintf (port_str, sizeof (port_str), "%u", port);
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (host, port_str, &hints, &res) != 0)
+    return -1;
+
+  for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+        continue;
+      if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      close (fd);
+      fd = -1;
+    }
+  freeaddrinfo (res);
+
+  if (fd >= 0)
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  return fd;
+}
+
+#endif
@@ -73,7 +73,8 @@ typedef struct tce_queue_data_s {
 TCEDevice::TCEDevice(cl_device_id dev, const char *adfName)
     : local_as(NULL), global_as(NULL), private_as(NULL), machine_file(adfName),
       parent(dev), currentProgram(NULL), curKernelAddr(0), curKernel(NULL),
-      shutdownRequested(false), globalCycleCount(0),  work_queue(NULL) {
+      shutdownRequested(false), globalCycleCount(0),  work_queue(NULL),
+      runningLaunch(NULL) {
 
   POCL_INIT_LOCK(wq_lock);
   POCL_INIT_COND(wakeup_cond);
@@ -91,6 +92,7 @@ TCEDevice::TCEDevice(cl_device_id dev, const char *adfName)
 }
 
 TCEDevice::~TCEDevice() {
+  pocl_unregister_mem_region(&global_mem);
   POCL_DESTROY_LOCK(wq_lock);
   POCL_DESTROY_COND(wakeup_cond);
   POCL_DESTROY_LOCK(tce_compile_lock);
@@ -207,6 +209,9 @@ TCEDevice::initMemoryManagement(const TTAMachine::Machine& mach) {
   pocl_init_mem_region
     (&global_mem, (memory_address_t)global_as->start() + TTA_UNALLOCATED_GLOBAL_SPACE + sizeof(__kernel_exec_cmd),
      parent->global_mem_size);
+  pocl_set_mem_region_strategy(
+      &global_mem, pocl_get_mem_region_strategy_option(BALLOCS_SEGREGATED));
+  pocl_register_mem_region(&global_mem, "tce global");
 }
 
 #define SUBST(x) "  -DKERNEL_EXE_CMD_OFFSET=" # x
@@ -495,8 +500,14 @@ void pocl_tce_compile_kernel(_cl_command_node *Command, cl_kernel Kernel,
     if (access(AssemblyFileName.c_str(), F_OK) != 0) {
       Error = snprintf(ByteCode, POCL_FILENAME_LENGTH + 13, "%s%s", CacheDir,
                        POCL_PARALLEL_BC_FILENAME);
+      /* The program goes to the kernel cache (and to poclbinaries), so
+         it's built to a temporary file and renamed, not to let other
+         processes load a partially written one. */
+      char TempTpef[POCL_FILENAME_LENGTH];
+      std::string TempPrefix = std::string(CacheDir) + "/parallel";
+      pocl_mk_tempname(TempTpef, TempPrefix.c_str(), ".tpef", NULL);
       TCEString BuildCmd = Dev->tceccCommandLine(RunCommand, TempDir, ByteCode,
-                                                 AssemblyFileName);
+                                                 TempTpef);
 
 #ifdef DEBUG_TTA_DRIVER
       std::cerr << "CMD: " << BuildCmd << std::endl;
@@ -506,6 +517,7 @@ void pocl_tce_compile_kernel(_cl_command_node *Command, cl_kernel Kernel,
       POCL_MEASURE_FINISH(TCE_COMPILATION);
       if (Error != 0)
         POCL_ABORT("Error while running tcecc.\n");
+      pocl_rename(TempTpef, AssemblyFileName.c_str());
     }
   }
 
@@ -524,56 +536,18 @@ void pocl_tce_compile_kernel(_cl_command_node *Command, cl_kernel Kernel,
     }                                                                         \
   while (0)
 
-void
-pocl_tce_run(void *data, _cl_command_node* cmd)
+/* Writes the arguments and the context of the kernel command to the device
+   memory. This doesn't touch the loaded program, so it can be done while
+   the previous kernel is still running. */
+static tce_kernel_launch *
+pocl_tce_prepare_run(TCEDevice *d, _cl_command_node *cmd)
 {
-  assert(cmd->type == CL_COMMAND_NDRANGE_KERNEL);
-
-  TCEDevice *d = (TCEDevice*)data;
-  uint32_t kernelAddr;
   unsigned i;
   uint32_t s;
 
-  assert(d != NULL);
-  assert(cmd->command.run.kernel);
-  assert(cmd->command.run.device_data);
-
-  if (d->isNewKernel(&(cmd->command.run))) {
-    std::string assemblyFileName((const char*)cmd->command.run.device_data);
-    assemblyFileName += "/parallel.tpef";
-
-    std::string kernelMdSymbolName = "_";
-    kernelMdSymbolName += cmd->command.run.kernel->name;
-    kernelMdSymbolName += "_md";
-
-    try {
-      d->loadProgramToDevice(assemblyFileName);
-      d->restartProgram();
-    } catch (Exception &e) {
-      std::cerr << "error: " << e.errorMessage() << std::endl;
-      POCL_ABORT("error: Failed to load program to the TTA.\n");
-    }
-
-    const TTAProgram::Program* prog = d->currentProgram;
-    assert (prog != NULL);
-    
-    const TTAProgram::GlobalScope& globalScope = prog->globalScopeConst();
-    
-    try {
-      kernelAddr = globalScope.dataLabel(kernelMdSymbolName).address().location();
-    } catch (const KeyNotFound& e) {
-      POCL_ABORT("Could not find the shared data structures from the device binary.\n");
-    }
-    // cache the currently device loaded kernel info 
-    d->updateCurrentKernel(&(cmd->command.run), kernelAddr);
-  } else {
-    // Same kernel, no need to recompile
-    d->restartProgram();
-    kernelAddr = d->curKernelAddr;
-  }
-
-  __kernel_exec_cmd dev_cmd;
-  dev_cmd.kernel_meta = pocl_byteswap_uint32_t(kernelAddr, d->needsByteSwap);
+  tce_kernel_launch *launch = new tce_kernel_launch;
+  launch->cmd = cmd;
+  launch->gmem_count = 0;
 
   /* assume 8KB is enough for kernargs */
   char *temp = (char *)alloca(8200);
@@ -582,22 +556,9 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
 
   struct pocl_argument *al;
 
-  typedef std::vector<chunk_info_t*> ChunkVector;
-  /* Chunks to be freed after the kernel finishes. */
-  ChunkVector tempChunks;
-
   cl_kernel kernel = cmd->command.run.kernel;
   pocl_kernel_metadata_t *meta = kernel->meta;
 
-  /* these are for the generated standalone code.
-   *
-   * With argbuffer, all kernel arguments (pointers & scalars) are stored
-   * in a single buffer; pointers could be anywhere in that buffer, therefore
-   * it's easier to save their position-in-the-argbuffer into temporary array,
-   * than to recalculate everything again when we need those positions.*/
-  uint32_t gmem_ptr_positions[1024];
-  uint32_t gmem_count = 0;
-
   for (i = 0; i < meta->num_args; ++i)
     {
       al = &(cmd->command.run.arguments[i]);
@@ -619,7 +580,7 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
           printf ("host: allocated %zu bytes of local memory for arg %u @ %lu\n",
                   al->size, i, local_chunk->start_address);
 #endif
-          tempChunks.push_back(local_chunk);
+          launch->tempChunks.push_back(local_chunk);
         }
       else if (meta->arg_info[i].type == POCL_ARG_TYPE_POINTER)
         {
@@ -642,7 +603,8 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
           POCL_MSG_PRINT_TCE("PTR ARG: %u WRITE POS: %p\n", address, write_pos);
           CHECK_AND_ALIGN_ARGBUFFER(4);
           if (address)
-            gmem_ptr_positions[gmem_count++] = (uint32_t)(write_pos - temp);
+            launch->gmem_ptr_positions[launch->gmem_count++]
+                = (uint32_t)(write_pos - temp);
           *(uint32_t *)write_pos = address;
           write_pos += 4;
         }
@@ -679,7 +641,7 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
       printf ("host: allocated %zu bytes of local memory for automated local arg %u @ %lu\n",
               s, (meta->num_args + i), local_chunk->start_address);
 #endif
-      tempChunks.push_back(local_chunk);
+      launch->tempChunks.push_back(local_chunk);
     }
 
     /* Allocate globalmem for kernel args here. */
@@ -690,9 +652,12 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
     POCL_MSG_PRINT_TCE("COPYING %u bytes to KERNARGS: %u \n", s,
                        (uint32_t)kernargs->start_address);
     d->copyHostToDevice(temp, kernargs->start_address, s);
+    launch->tempChunks.push_back(kernargs);
 
     chunk_info_t *context = pocl_alloc_buffer_from_region(
         &d->global_mem, sizeof(struct pocl_context32));
+    assert(context);
+    launch->tempChunks.push_back(context);
     pocl_context32 temp_ctx;
     temp_ctx.work_dim =
         pocl_byteswap_uint32_t(cmd->command.run.pc.work_dim, d->needsByteSwap);
@@ -724,6 +689,7 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
     d->copyHostToDevice(&temp_ctx, context->start_address,
                         sizeof(struct pocl_context32));
 
+    __kernel_exec_cmd &dev_cmd = launch->dev_cmd;
     dev_cmd.status = pocl_byteswap_uint32_t(POCL_KST_FREE, d->needsByteSwap);
     dev_cmd.args =
         pocl_byteswap_uint32_t(kernargs->start_address, d->needsByteSwap);
@@ -733,12 +699,60 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
     dev_cmd.ctx_size = pocl_byteswap_uint32_t(s, d->needsByteSwap);
     s = write_pos - temp;
     dev_cmd.args_size = pocl_byteswap_uint32_t(s, d->needsByteSwap);
-    dev_cmd.kernel_meta = pocl_byteswap_uint32_t(kernelAddr, d->needsByteSwap);
-    POCL_MSG_PRINT_TCE("KERNEL %s IS AT: %u \n", kernel->name,
-                       dev_cmd.kernel_meta);
-    POCL_MSG_PRINT_TCE("ARGS %u   CTX %u   ARG_S %u    CTX_S %u \n",
-                       dev_cmd.args, dev_cmd.ctx, dev_cmd.args_size,
-                       dev_cmd.ctx_size);
+
+    return launch;
+}
+
+/* Loads the kernel's program to the device, unless it is already there,
+   and starts the prepared command. The previous kernel must have
+   finished. */
+static void
+pocl_tce_launch(TCEDevice *d, tce_kernel_launch *launch)
+{
+  _cl_command_node *cmd = launch->cmd;
+  uint32_t kernelAddr;
+
+  if (d->isNewKernel(&(cmd->command.run))) {
+    std::string assemblyFileName((const char*)cmd->command.run.device_data);
+    assemblyFileName += "/parallel.tpef";
+
+    std::string kernelMdSymbolName = "_";
+    kernelMdSymbolName += cmd->command.run.kernel->name;
+    kernelMdSymbolName += "_md";
+
+    try {
+      d->loadProgramToDevice(assemblyFileName);
+      d->restartProgram();
+    } catch (Exception &e) {
+      std::cerr << "error: " << e.errorMessage() << std::endl;
+      POCL_ABORT("error: Failed to load program to the TTA.\n");
+    }
+
+    const TTAProgram::Program* prog = d->currentProgram;
+    assert (prog != NULL);
+    
+    const TTAProgram::GlobalScope& globalScope = prog->globalScopeConst();
+    
+    try {
+      kernelAddr = globalScope.dataLabel(kernelMdSymbolName).address().location();
+    } catch (const KeyNotFound& e) {
+      POCL_ABORT("Could not find the shared data structures from the device binary.\n");
+    }
+    // cache the currently device loaded kernel info 
+    d->updateCurrentKernel(&(cmd->command.run), kernelAddr);
+  } else {
+    // Same kernel, no need to recompile
+    d->restartProgram();
+    kernelAddr = d->curKernelAddr;
+  }
+
+  __kernel_exec_cmd &dev_cmd = launch->dev_cmd;
+  dev_cmd.kernel_meta = pocl_byteswap_uint32_t(kernelAddr, d->needsByteSwap);
+  POCL_MSG_PRINT_TCE("KERNEL %s IS AT: %u \n", cmd->command.run.kernel->name,
+                     dev_cmd.kernel_meta);
+  POCL_MSG_PRINT_TCE("ARGS %u   CTX %u   ARG_S %u    CTX_S %u \n",
+                     dev_cmd.args, dev_cmd.ctx, dev_cmd.args_size,
+                     dev_cmd.ctx_size);
 
 #ifdef DEBUG_TTA_DRIVER
     printf("host: waiting for the device command queue (@ %x) to get room.\n",
@@ -763,42 +777,38 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
   d->writeWordToDevice(d->statusAddr, POCL_KST_READY);
   dev_cmd.status = pocl_byteswap_uint32_t(POCL_KST_READY, d->needsByteSwap);
 
-  d->notifyKernelRunCommandSent(dev_cmd, &cmd->command.run, gmem_ptr_positions,
-                                gmem_count);
+  d->notifyKernelRunCommandSent(dev_cmd, &cmd->command.run,
+                                launch->gmem_ptr_positions,
+                                launch->gmem_count);
 
 #ifdef DEBUG_TTA_DRIVER
   printf("host: commmand queue status: %x\n",
          d->readWordFromDevice(d->statusAddr));
-
-  printf("host: waiting for the command to get executed.\n");
 #endif
-  /* Wait until the command has executed. */
-  unsigned long ticks = 0;
-  do {
-#ifdef DEBUG_TTA_DRIVER
+}
 
-    if ((ticks % 50) == 0)
-      printf("host: commmand queue status: %x\n",
-             d->readWordFromDevice(d->statusAddr));
-#endif
-      usleep(20000);
-      ++ticks;
-  } while (d->readWordFromDevice(d->statusAddr) != POCL_KST_FINISHED);
+static bool
+pocl_tce_run_finished(TCEDevice *d)
+{
+  return d->readWordFromDevice(d->statusAddr) == POCL_KST_FINISHED;
+}
 
+/* Frees the command queue entry and the memory of a finished kernel. */
+static void
+pocl_tce_release_run(TCEDevice *d, tce_kernel_launch *launch)
+{
 #ifdef DEBUG_TTA_DRIVER
   printf( "host: done. Freeing the command queue entry.\n");
 #endif
   /* We are done with this kernel, free the command queue entry. */
   d->writeWordToDevice(d->statusAddr, POCL_KST_FREE);
 
-  for (ChunkVector::iterator i = tempChunks.begin();
-       i != tempChunks.end(); ++i) 
+  for (ChunkVector::iterator i = launch->tempChunks.begin();
+       i != launch->tempChunks.end(); ++i) 
     pocl_free_chunk(*i);
 
-  pocl_free_chunk(kernargs);
-  pocl_free_chunk(context);
-
-  POCL_MEM_FREE(cmd->command.run.device_data);
+  POCL_MEM_FREE(launch->cmd->command.run.device_data);
+  delete launch;
 
 #ifdef DEBUG_TTA_DRIVER
   printf("host: local memory allocations:\n");
@@ -809,6 +819,33 @@ pocl_tce_run(void *data, _cl_command_node* cmd)
 #endif
 }
 
+void
+pocl_tce_run(void *data, _cl_command_node* cmd)
+{
+  assert(cmd->type == CL_COMMAND_NDRANGE_KERNEL);
+
+  TCEDevice *d = (TCEDevice*)data;
+
+  assert(d != NULL);
+  assert(cmd->command.run.kernel);
+  assert(cmd->command.run.device_data);
+
+  tce_kernel_launch *launch = pocl_tce_prepare_run(d, cmd);
+  pocl_tce_launch(d, launch);
+
+#ifdef DEBUG_TTA_DRIVER
+  printf("host: waiting for the command to get executed.\n");
+#endif
+  /* Wait until the command has executed. */
+  unsigned pollUs = TCE_POLL_MIN_US;
+  while (!pocl_tce_run_finished(d)) {
+    usleep(pollUs);
+    pollUs = std::min(pollUs * 2, (unsigned)TCE_POLL_MAX_US);
+  }
+
+  pocl_tce_release_run(d, launch);
+}
+
 cl_int
 pocl_tce_map_mem (void *data,
                   pocl_mem_identifier * src_mem_id,
@@ -903,6 +940,12 @@ pocl_tce_build_hash (cl_device_id device)
   return strdup(tce_dev->build_hash.c_str());
 }
 
+/* A rectangle whose rows and slices follow each other without gaps is
+   copied in one transfer, not row by row. */
+#define TCE_RECT_IS_CONTIGUOUS(row_pitch, slice_pitch)                        \
+  ((row_pitch) == region[0]                                                   \
+   && (region[2] == 1 || (slice_pitch) == region[0] * region[1]))
+
 void
 pocl_tce_copy_rect (void *data,
                     pocl_mem_identifier * dst_mem_id,
@@ -926,6 +969,14 @@ pocl_tce_copy_rect (void *data,
 
   size_t j, k;
 
+  if (TCE_RECT_IS_CONTIGUOUS(src_row_pitch, src_slice_pitch)
+      && TCE_RECT_IS_CONTIGUOUS(dst_row_pitch, dst_slice_pitch)) {
+    d->copyDeviceToDevice(src_chunk->start_address + src_offset,
+                          dst_chunk->start_address + dst_offset,
+                          region[0] * region[1] * region[2]);
+    return;
+  }
+
   /* TODO: handle overlaping regions */
   
   for (k = 0; k < region[2]; ++k)
@@ -961,6 +1012,13 @@ pocl_tce_write_rect (void *data,
 
   size_t j, k;
 
+  if (TCE_RECT_IS_CONTIGUOUS(buffer_row_pitch, buffer_slice_pitch)
+      && TCE_RECT_IS_CONTIGUOUS(host_row_pitch, host_slice_pitch)) {
+    d->copyHostToDevice(adjusted_host_ptr, adjusted_dst_ptr,
+                        region[0] * region[1] * region[2]);
+    return;
+  }
+
   /* TODO: handle overlaping regions */
     
   for (k = 0; k < region[2]; ++k)
@@ -1000,6 +1058,13 @@ pocl_tce_read_rect (void *data,
 
   size_t j, k;
 
+  if (TCE_RECT_IS_CONTIGUOUS(buffer_row_pitch, buffer_slice_pitch)
+      && TCE_RECT_IS_CONTIGUOUS(host_row_pitch, host_slice_pitch)) {
+    d->copyDeviceToHost(adjusted_src_ptr, adjusted_host_ptr,
+                        region[0] * region[1] * region[2]);
+    return;
+  }
+
   /* TODO: handle overlaping regions */
 
   for (k = 0; k < region[2]; ++k)
@@ -1162,8 +1227,29 @@ void pocl_tce_notify_event_finished(cl_event event) {
 /*****************************************************************************/
 /*****************************************************************************/
 
+/* Waits for the running kernel to finish and completes its event. */
+static void pocl_tce_finish_running(TCEDevice *d) {
+  tce_kernel_launch *launch = d->runningLaunch;
+  unsigned pollUs = TCE_POLL_MIN_US;
+  while (!pocl_tce_run_finished(d)) {
+    usleep(pollUs);
+    pollUs = std::min(pollUs * 2, (unsigned)TCE_POLL_MAX_US);
+  }
+  d->runningLaunch = NULL;
+
+  cl_event event = launch->cmd->event;
+  pocl_tce_release_run(d, launch);
+  POCL_UPDATE_EVENT_COMPLETE_MSG(event, "Event Enqueue NDRange       ");
+}
+
+/* The commands in the work queue are ready, so they don't depend on the
+   running kernel: while it runs, the driver thread executes the other
+   commands, e.g. the buffer writes for the next kernels, and compiles and
+   writes the arguments of the next kernel, which then only waits for the
+   running one to start. */
 void *pocl_tce_driver_thread(void *cldev) {
   TCEDevice *d = (TCEDevice *)cldev;
+  unsigned pollUs = TCE_POLL_MIN_US;
 
   POCL_FAST_LOCK(d->wq_lock);
 
@@ -1184,15 +1270,35 @@ void *pocl_tce_driver_thread(void *cldev) {
       assert(pocl_command_is_ready(cmd->event));
       assert(cmd->event->status == CL_SUBMITTED);
 
-      if (cmd->type == CL_COMMAND_NDRANGE_KERNEL)
+      if (cmd->type == CL_COMMAND_NDRANGE_KERNEL) {
         pocl_tce_compile_kernel(cmd, cmd->command.run.kernel, cmd->device, 1);
+        tce_kernel_launch *launch = pocl_tce_prepare_run(d, cmd);
+        if (d->runningLaunch != NULL)
+          pocl_tce_finish_running(d);
+        pocl_update_event_running(cmd->event);
+        pocl_tce_launch(d, launch);
+        d->runningLaunch = launch;
+        pollUs = TCE_POLL_MIN_US;
+      } else
+        pocl_exec_command(cmd);
 
-      pocl_exec_command(cmd);
+      POCL_FAST_LOCK(d->wq_lock);
+      goto RETRY;
+    }
 
+    if (d->runningLaunch != NULL) {
+      POCL_FAST_UNLOCK(d->wq_lock);
+      if (pocl_tce_run_finished(d)) {
+        pocl_tce_finish_running(d);
+      } else {
+        usleep(pollUs);
+        pollUs = std::min(pollUs * 2, (unsigned)TCE_POLL_MAX_US);
+      }
       POCL_FAST_LOCK(d->wq_lock);
+      goto RETRY;
     }
 
-    if ((d->work_queue == NULL) && (d->shutdownRequested == false)) {
+    if (d->shutdownRequested == false) {
       POCL_WAIT_COND(d->wakeup_cond, d->wq_lock);
       goto RETRY;
     }
@@ -29,6 +29,7 @@
 #ifdef __cplusplus
 
 #include <string>
+#include <vector>
 
 #include "TCEString.hh"
 #include "pocl_device.h"
@@ -42,6 +43,20 @@ namespace TTAProgram {
   class Program;
 }
 
+typedef std::vector<chunk_info_t *> ChunkVector;
+
+/* A kernel command whose arguments and context have been written to the
+   device memory, and the memory to free after it has finished. */
+struct tce_kernel_launch {
+  _cl_command_node *cmd;
+  __kernel_exec_cmd dev_cmd;
+  ChunkVector tempChunks;
+  /* The positions of the global buffer pointers in the argument buffer,
+     for the standalone programs. */
+  uint32_t gmem_ptr_positions[1024];
+  uint32_t gmem_count;
+};
+
 class TCEDevice {
  public:
   TCEDevice(cl_device_id dev, const char* adfName);
@@ -135,6 +150,9 @@ class TCEDevice {
   pocl_cond_t wakeup_cond;
   pocl_lock_t tce_compile_lock;
   _cl_command_node *work_queue;
+  /* The kernel the driver thread has started on the device, NULL if
+     none is running. */
+  tce_kernel_launch *runningLaunch;
 };
 
 void *pocl_tce_driver_thread (void *cldev);
@@ -157,6 +175,11 @@ void *pocl_tce_driver_thread (void *cldev);
  * should start after this + sizeof(kernel_exe_cmd) */
 #define TTA_UNALLOCATED_GLOBAL_SPACE 2048
 
+/* The interval of polling the device for the end of a kernel starts from
+   the minimum and doubles up to the maximum while the kernel runs. */
+#define TCE_POLL_MIN_US 10
+#define TCE_POLL_MAX_US 20000
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -21,7 +21,9 @@
    THE SOFTWARE.
 */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "config.h"
@@ -42,6 +44,86 @@
 
 #endif
 
+/* The relative capacity (up to 1024) Linux reports for the CPU, mostly on
+ * ARM big.LITTLE hosts, or 0 if unknown. */
+static unsigned
+read_linux_cpu_capacity (unsigned os_index)
+{
+#if defined(__linux__) || defined(__ANDROID__)
+  char path[64];
+  char *content;
+  uint64_t filesize;
+  unsigned capacity = 0;
+
+  snprintf (path, sizeof (path),
+            "/sys/devices/system/cpu/cpu%u/cpu_capacity", os_index);
+  if (pocl_read_file (path, &content, &filesize) == 0)
+    {
+      capacity = (unsigned)atoi (content);
+      POCL_MEM_FREE (content);
+    }
+  return capacity;
+#else
+  return 0;
+#endif
+}
+
+/* Numbers the core kinds from the capacities in device->cpu_capacity: the
+ * CPUs of equal capacity are of the same kind, and kind 0 is the fastest.
+ * The capacities are scaled to POCL_CPU_CAPACITY_MAX for the fastest CPUs. Drops the
+ * arrays again if all the CPUs are alike. */
+static void
+assign_cpu_kinds (cl_device_id device)
+{
+  unsigned *capacity = device->cpu_capacity;
+  unsigned i, j, max_capacity = 0, num_kinds = 0;
+
+  device->cpu_kind = calloc (device->num_cpus, sizeof (unsigned));
+  if (device->cpu_kind == NULL)
+    goto homogeneous;
+
+  for (i = 0; i < device->num_cpus; ++i)
+    max_capacity = max (max_capacity, capacity[i]);
+  if (max_capacity == 0)
+    goto homogeneous;
+  for (i = 0; i < device->num_cpus; ++i)
+    capacity[i] = capacity[i] ? (unsigned)((uint64_t)capacity[i]
+                                           * POCL_CPU_CAPACITY_MAX
+                                           / max_capacity)
+                              : POCL_CPU_CAPACITY_MAX;
+
+  /* the kind is the number of distinct capacities above the CPU's */
+  for (i = 0; i < device->num_cpus; ++i)
+    {
+      unsigned kind = 0;
+      for (j = 0; j < device->num_cpus; ++j)
+        {
+          unsigned k;
+          if (capacity[j] <= capacity[i])
+            continue;
+          /* count each capacity at its first CPU only */
+          for (k = 0; k < j && capacity[k] != capacity[j]; ++k)
+            ;
+          if (k == j)
+            ++kind;
+        }
+      device->cpu_kind[i] = kind;
+      num_kinds = max (num_kinds, kind + 1);
+    }
+  if (num_kinds < 2)
+    goto homogeneous;
+
+  device->num_cpu_kinds = num_kinds;
+  device->affinity_domains |= CL_DEVICE_AFFINITY_DOMAIN_CORE_KIND_POCL;
+  POCL_MSG_PRINT_GENERAL ("Hybrid CPU with %u kinds of cores\n", num_kinds);
+  return;
+
+homogeneous:
+  POCL_MEM_FREE (device->cpu_kind);
+  POCL_MEM_FREE (device->cpu_capacity);
+  device->num_cpu_kinds = 1;
+}
+
 /*
  * Sets up:
  *  max_compute_units
@@ -51,10 +133,195 @@
  *  global_mem_cache_size
  *  local_mem_size
  *  max_constant_buffer_size
+ *  cpu_cache_size, cpu_cache_line_size, cpu_cache_sharing
  */
 
 #ifdef ENABLE_HWLOC
 
+/* Kept loaded after detection if the host has more than one NUMA node,
+ * for setting memory binding policies later. */
+static hwloc_topology_t pocl_numa_topology = NULL;
+
+/* Records the NUMA node and the OS index of every PU. */
+static void
+detect_numa_nodes (hwloc_topology_t topology, cl_device_id device)
+{
+  int num_pus = hwloc_get_nbobjs_by_type (topology, HWLOC_OBJ_PU);
+  int num_nodes = hwloc_get_nbobjs_by_type (topology, HWLOC_OBJ_NUMANODE);
+  int i, n;
+
+  if (num_pus <= 0)
+    return;
+  if (num_nodes <= 0)
+    num_nodes = 1;
+
+  if (device->cpu_numa_node == NULL)
+    {
+      device->cpu_numa_node = calloc (num_pus, sizeof (unsigned));
+      device->cpu_os_index = calloc (num_pus, sizeof (unsigned));
+      if (device->cpu_numa_node == NULL || device->cpu_os_index == NULL)
+        {
+          POCL_MEM_FREE (device->cpu_numa_node);
+          POCL_MEM_FREE (device->cpu_os_index);
+          return;
+        }
+    }
+
+  for (i = 0; i < num_pus; ++i)
+    {
+      hwloc_obj_t pu = hwloc_get_obj_by_type (topology, HWLOC_OBJ_PU, i);
+      device->cpu_os_index[i] = pu->os_index;
+      device->cpu_numa_node[i] = 0;
+      for (n = 0; n < num_nodes; ++n)
+        {
+          hwloc_obj_t node
+              = hwloc_get_obj_by_type (topology, HWLOC_OBJ_NUMANODE, n);
+          if (node && node->cpuset
+              && hwloc_bitmap_isincluded (pu->cpuset, node->cpuset))
+            {
+              device->cpu_numa_node[i] = n;
+              break;
+            }
+        }
+    }
+
+  device->num_cpus = num_pus;
+  device->num_numa_nodes = num_nodes;
+  device->affinity_domains |= CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+}
+
+/* Records the logical index of the unified cache of the given level
+ * shared by each PU into *cache_ids. Must be called after
+ * detect_numa_nodes(). */
+static void
+detect_cache_domains (hwloc_topology_t topology, cl_device_id device,
+                      unsigned level, unsigned **cache_ids,
+                      cl_device_affinity_domain domain)
+{
+  unsigned i;
+  int depth = hwloc_get_cache_type_depth (topology, level,
+                                          HWLOC_OBJ_CACHE_UNIFIED);
+  if (depth < 0 || device->num_cpus == 0)
+    return;
+
+  if (*cache_ids == NULL)
+    {
+      *cache_ids = calloc (device->num_cpus, sizeof (unsigned));
+      if (*cache_ids == NULL)
+        return;
+    }
+
+  for (i = 0; i < device->num_cpus; ++i)
+    {
+      hwloc_obj_t pu = hwloc_get_obj_by_type (topology, HWLOC_OBJ_PU, i);
+      hwloc_obj_t cache
+          = hwloc_get_ancestor_obj_by_depth (topology, depth, pu);
+      (*cache_ids)[i] = cache ? cache->logical_index : 0;
+    }
+  device->affinity_domains |= domain;
+}
+
+/* Records the kind and the relative capacity of every PU. Linux's
+ * cpu_capacity is used where it exists, else the maximum frequency of the
+ * hwloc CPU kind, else its efficiency rank. Must be called after
+ * detect_numa_nodes(). */
+static void
+detect_cpu_kinds (hwloc_topology_t topology, cl_device_id device)
+{
+  unsigned i;
+  int nr_kinds = 1;
+
+  if (device->num_cpus == 0)
+    return;
+#if HWLOC_API_VERSION >= 0x00020400
+  nr_kinds = hwloc_cpukinds_get_nr (topology, 0);
+#endif
+
+  device->cpu_capacity = calloc (device->num_cpus, sizeof (unsigned));
+  if (device->cpu_capacity == NULL)
+    return;
+
+  for (i = 0; i < device->num_cpus; ++i)
+    {
+      unsigned capacity = read_linux_cpu_capacity (device->cpu_os_index[i]);
+#if HWLOC_API_VERSION >= 0x00020400
+      if (capacity == 0 && nr_kinds > 1)
+        {
+          hwloc_obj_t pu = hwloc_get_obj_by_type (topology, HWLOC_OBJ_PU, i);
+          /* the kinds are ordered from the least to the most efficient */
+          int kind = hwloc_cpukinds_get_by_cpuset (topology, pu->cpuset, 0);
+          unsigned nr_infos, j;
+          struct hwloc_info_s *infos;
+          if (kind >= 0
+              && hwloc_cpukinds_get_info (topology, kind, NULL, NULL,
+                                          &nr_infos, &infos, 0) == 0)
+            {
+              for (j = 0; j < nr_infos; ++j)
+                if (strcmp (infos[j].name, "FrequencyMaxMHz") == 0)
+                  capacity = (unsigned)atoi (infos[j].value);
+              if (capacity == 0)
+                capacity = (unsigned)(kind + 1) * POCL_CPU_CAPACITY_MAX
+                           / nr_kinds;
+            }
+        }
+#endif
+      device->cpu_capacity[i] = capacity;
+    }
+
+  assign_cpu_kinds (device);
+}
+
+/* Records the size, the line size and the sharing of the first data (or
+ * unified) cache of each level into device->cpu_cache_*. */
+static void
+detect_cache_levels (hwloc_topology_t topology, cl_device_id device)
+{
+  unsigned level;
+
+  for (level = 1; level <= 3; ++level)
+    {
+      hwloc_obj_t cache;
+      int depth = hwloc_get_cache_type_depth (topology, level,
+                                              HWLOC_OBJ_CACHE_DATA);
+      if (depth < 0)
+        depth = hwloc_get_cache_type_depth (topology, level,
+                                            HWLOC_OBJ_CACHE_UNIFIED);
+      if (depth < 0)
+        continue;
+      cache = hwloc_get_obj_by_depth (topology, depth, 0);
+      if (cache == NULL || cache->attr == NULL)
+        continue;
+      device->cpu_cache_size[level - 1] = cache->attr->cache.size;
+      device->cpu_cache_line_size[level - 1] = cache->attr->cache.linesize;
+      device->cpu_cache_sharing[level - 1]
+          = cache->cpuset ? hwloc_bitmap_weight (cache->cpuset) : 1;
+      POCL_MSG_PRINT_GENERAL ("L%u cache: %zu bytes, %u byte lines, shared "
+                              "by %u CPUs\n",
+                              level, (size_t)device->cpu_cache_size[level - 1],
+                              device->cpu_cache_line_size[level - 1],
+                              device->cpu_cache_sharing[level - 1]);
+    }
+}
+
+int
+pocl_topology_interleave_memory (void *ptr, size_t size)
+{
+  if (pocl_numa_topology == NULL)
+    return -1;
+
+#ifdef HWLOC_API_2
+  return hwloc_set_area_membind (
+      pocl_numa_topology, ptr, size,
+      hwloc_topology_get_topology_nodeset (pocl_numa_topology),
+      HWLOC_MEMBIND_INTERLEAVE, HWLOC_MEMBIND_BYNODESET);
+#else
+  return hwloc_set_area_membind_nodeset (
+      pocl_numa_topology, ptr, size,
+      hwloc_topology_get_topology_nodeset (pocl_numa_topology),
+      HWLOC_MEMBIND_INTERLEAVE, 0);
+#endif
+}
+
 int
 pocl_topology_detect_device_info(cl_device_id device)
 {
@@ -131,6 +398,15 @@ pocl_topology_detect_device_info(cl_device_id device)
   if(depth != HWLOC_TYPE_DEPTH_UNKNOWN)
     device->max_compute_units = hwloc_get_nbobjs_by_depth(pocl_topology, depth);
 
+  detect_numa_nodes (pocl_topology, device);
+  detect_cache_domains (pocl_topology, device, 3, &device->cpu_l3_cache,
+                        CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE);
+  detect_cache_domains (pocl_topology, device, 2, &device->cpu_l2_cache,
+                        CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE);
+  if (device->cpu_kind == NULL)
+    detect_cpu_kinds (pocl_topology, device);
+  detect_cache_levels (pocl_topology, device);
+
   /* Find information about global memory cache by looking at the first
    * cache covering the first PU */
   size_t shared_cache_size = 0, nonshared_cache_size = 0, cacheline_size = 0;
@@ -197,6 +473,13 @@ pocl_topology_detect_device_info(cl_device_id device)
       device->local_mem_size = nonshared_cache_size;
       device->max_constant_buffer_size = nonshared_cache_size;
     }
+  /* keep the topology around for memory binding on NUMA hosts */
+  if (device->num_numa_nodes > 1 && pocl_numa_topology == NULL)
+    {
+      pocl_numa_topology = pocl_topology;
+      return ret;
+    }
+
   // Destroy topology object and return
 exit_destroy:
   hwloc_topology_destroy (pocl_topology);
@@ -207,11 +490,92 @@ exit_destroy:
 // #ifdef HWLOC
 #elif defined(__linux__) || defined(__ANDROID__)
 
+int
+pocl_topology_interleave_memory (void *ptr, size_t size)
+{
+  return -1;
+}
+
 #define L3_CACHE_SIZE "/sys/devices/system/cpu/cpu0/cache/index3/size"
 #define L2_CACHE_SIZE "/sys/devices/system/cpu/cpu0/cache/index2/size"
+#define CACHE_INDEX "/sys/devices/system/cpu/cpu0/cache/index"
 #define CPUS "/sys/devices/system/cpu/possible"
 #define MEMINFO "/proc/meminfo"
 
+/* Reads the given attribute of the index-th cache of cpu0. Returns 0 on
+ * success, the content must be freed by the caller. */
+static int
+read_cache_attr (unsigned index, const char *attr, char **content)
+{
+  char path[96];
+  uint64_t filesize;
+  snprintf (path, sizeof (path), CACHE_INDEX "%u/%s", index, attr);
+  return pocl_read_file (path, content, &filesize);
+}
+
+/* Counts the CPUs of a list like "0-3,8-11". */
+static unsigned
+count_cpu_list (const char *list)
+{
+  unsigned count = 0;
+  while (*list)
+    {
+      char *end;
+      unsigned long first = strtoul (list, &end, 10), last = first;
+      if (end == list)
+        break;
+      if (*end == '-')
+        last = strtoul (end + 1, &end, 10);
+      if (last >= first)
+        count += (unsigned)(last - first + 1);
+      if (*end != ',')
+        break;
+      list = end + 1;
+    }
+  return count;
+}
+
+/* Records the size, the line size and the sharing of the data (or unified)
+ * caches of cpu0 into device->cpu_cache_*. */
+static void
+detect_cache_levels (cl_device_id device)
+{
+  unsigned index;
+  char *content;
+
+  for (index = 0; read_cache_attr (index, "level", &content) == 0; ++index)
+    {
+      unsigned level = (unsigned)atoi (content);
+      int is_instruction;
+      POCL_MEM_FREE (content);
+      if (level < 1 || level > 3)
+        continue;
+      if (read_cache_attr (index, "type", &content) != 0)
+        continue;
+      is_instruction = strncmp (content, "Instruction", 11) == 0;
+      POCL_MEM_FREE (content);
+      if (is_instruction)
+        continue;
+
+      /* the size is given in kilobytes, e.g. "32K" */
+      if (read_cache_attr (index, "size", &content) == 0)
+        {
+          device->cpu_cache_size[level - 1] = (cl_ulong)atol (content) * 1024;
+          POCL_MEM_FREE (content);
+        }
+      if (read_cache_attr (index, "coherency_line_size", &content) == 0)
+        {
+          device->cpu_cache_line_size[level - 1] = (cl_uint)atoi (content);
+          POCL_MEM_FREE (content);
+        }
+      if (read_cache_attr (index, "shared_cpu_list", &content) == 0)
+        {
+          device->cpu_cache_sharing[level - 1] = count_cpu_list (content);
+          POCL_MEM_FREE (content);
+        }
+    }
+}
+
 int
 pocl_topology_detect_device_info (cl_device_id device)
 {
@@ -246,6 +610,10 @@ pocl_topology_detect_device_info (cl_device_id device)
         }
     }
 
+  detect_cache_levels (device);
+  if (device->cpu_cache_line_size[0] > 0)
+    device->global_mem_cacheline_size = device->cpu_cache_line_size[0];
+
   /* global_mem_size */
   if (pocl_read_file (MEMINFO, &content, &filesize) == 0)
     {
@@ -291,6 +659,32 @@ pocl_topology_detect_device_info (cl_device_id device)
       device->max_compute_units = 1;
     }
 
+  /* big.LITTLE: without hwloc, the CPUs are only known by their OS index,
+   * so record them in that order if their capacities differ */
+  if (device->cpu_kind == NULL && device->max_compute_units > 1)
+    {
+      unsigned i, num_cpus = device->max_compute_units;
+      device->cpu_capacity = calloc (num_cpus, sizeof (unsigned));
+      device->cpu_os_index = calloc (num_cpus, sizeof (unsigned));
+      if (device->cpu_capacity && device->cpu_os_index)
+        {
+          device->num_cpus = num_cpus;
+          for (i = 0; i < num_cpus; ++i)
+            {
+              device->cpu_os_index[i] = i;
+              device->cpu_capacity[i] = read_linux_cpu_capacity (i);
+            }
+          assign_cpu_kinds (device);
+        }
+      else
+        POCL_MEM_FREE (device->cpu_capacity);
+      if (device->cpu_kind == NULL)
+        {
+          POCL_MEM_FREE (device->cpu_os_index);
+          device->num_cpus = 0;
+        }
+    }
+
   return 0;
 }
 
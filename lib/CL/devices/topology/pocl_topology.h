@@ -33,7 +33,16 @@
 
 #include "pocl_cl.h"
 
+/* The capacity of the fastest CPUs in cl_device_id.cpu_capacity. */
+#define POCL_CPU_CAPACITY_MAX 1024
+
 POCL_EXPORT
 int pocl_topology_detect_device_info(cl_device_id device);
 
+/* Interleaves the pages of the given (not yet touched) memory area across
+ * all NUMA nodes of the host. Returns 0 on success, -1 if unsupported or
+ * if the host has a single NUMA node. */
+POCL_EXPORT
+int pocl_topology_interleave_memory (void *ptr, size_t size);
+
 #endif /* POCL_TOPOLOGY_H */
@@ -33,10 +33,8 @@
  *
  * Doesnt work / unfinished / non-optimal:
  *
- * VMA (virtual memory allocator) on device memory, currently
- * driver just calls vkAllocateMemory for each cl_mem allocation
- *
- * CL_MEM_USE_HOST_PTR is broken,
+ * CL_MEM_USE_HOST_PTR is broken (except with VK_EXT_external_memory_host
+ * on iGPUs),
  * CL_MEM_ALLOC_HOST_PTR is ignored
  *
  * properly cleanup objects, check for memory leaks
@@ -45,17 +43,8 @@
  *
  * descriptor set should be cached (setup once per kernel, then just update)
  *
- * there's a device limit on max WG count
- *    (the amount of local WGs that can be executed by a single command)
- *    - need to handle global size > than that
- *    - need offset in get_global_id()
- *
  * image / sampler support support missing
  *
- * global offsets of kernel enqueue are ignored (should be solved by
- * compiling two versions of each program, one with goffsets and one
- * without, then select at runtime which to use)
- *
  * some things that are stored per-kernel should be stored per-program,
  * and v-v (e.g. compiled shader)
  *
@@ -68,8 +57,6 @@
  * where possible, onto their GLSL 4.5 built-in equivalents"
  * - this is not the best, they have unknown precision
  *
- * maybe use push constants for POD arguments instead of UBO
- *
  * stop using deprecated clspv-reflection, instead extract the
  * kernel metadata from the SPIR-V file itself, clspv now puts it there
  *
@@ -133,6 +120,28 @@ typedef struct buf_data
 #define MAX_BUFS 128
 #define MAX_PODS 128
 
+#define MAX_SPEC_CONSTANTS 128
+
+/* how clspv passes the POD arguments of a kernel: in push constants if
+ * they fit in maxPushConstantsSize, otherwise in a uniform buffer, or a
+ * storage buffer if that is too small as well */
+#define POD_IN_UBO 0
+#define POD_IN_SSBO 1
+#define POD_IN_PUSH_CONSTANTS 2
+/* the limit of vkCmdUpdateBuffer */
+#define MAX_POD_BYTES 65536
+
+/* A pipeline of a kernel, compiled for one set of specialization constant
+ * values: the local size followed by the element counts of the __local
+ * arguments. */
+typedef struct pocl_vulkan_pipeline_s
+{
+  uint32_t spec_data[MAX_SPEC_CONSTANTS];
+  uint32_t spec_size;
+  VkPipeline pipeline;
+  struct pocl_vulkan_pipeline_s *next;
+} pocl_vulkan_pipeline_t;
+
 typedef struct pocl_vulkan_kernel_data_s
 {
   /* these are parsed from clspv provided descriptor map.
@@ -149,6 +158,14 @@ typedef struct pocl_vulkan_kernel_data_s
   /* since POD arguments are pushed via a buffer (kernarg_buf),
    * total size helps with preallocating kernarg buffer */
   size_t num_pod_bytes;
+  /* one of POD_IN_*, from the argKind of the descriptor map */
+  int pod_kind;
+  /* the offset of the global offset (3 x uint32) in the push constants,
+   * or UINT32_MAX if the kernel doesn't use it */
+  uint32_t global_offset_pc;
+  /* the size of the push constants, including the PODs if those are
+   * passed in them */
+  size_t num_push_constant_bytes;
 
   /* constants are also preallocated, this is the total size */
   size_t num_constant_bytes;
@@ -171,22 +188,74 @@ typedef struct pocl_vulkan_kernel_data_s
   VkDeviceSize constant_buf_offset;
   VkDeviceSize constant_buf_size;
   chunk_info_t *constant_chunk;
+
+  /* the layouts only depend on the arguments of the kernel, they are
+   * created on the first launch and reused by the later ones */
+  VkDescriptorSetLayout dsl;
+  VkDescriptorSetLayout const_dsl;
+  VkPipelineLayout pipeline_layout;
+  pocl_vulkan_pipeline_t *pipelines;
 } pocl_vulkan_kernel_data_t;
 
 
 typedef struct pocl_vulkan_event_data_s
 {
   pthread_cond_t event_cond;
+  /* 1 once the command is in the work queue of the device; set under
+   * wq_lock_fast */
+  int pushed;
+  /* the execution times from the timestamp queries around the command,
+   * in the time base of pocl_gettimemono_ns (); 0 if not measured */
+  cl_ulong time_start, time_end;
 } pocl_vulkan_event_data_t;
 
+/* A command buffer of the submission ring, with the command it runs and
+ * the fence signaled when it has completed */
+typedef struct pocl_vulkan_cb_slot_s
+{
+  VkCommandBuffer cb;
+  VkFence fence;
+  _cl_command_node *cmd;
+  /* freed when the command buffer is retired */
+  VkDescriptorSet descriptor_sets[2];
+  /* the value compute_timeline gets when it completes */
+  uint64_t serial;
+} pocl_vulkan_cb_slot_t;
+
+/* the size of the memory blocks the buffers are suballocated from; a
+ * buffer larger than half of it gets a block of its own */
+#define MEM_BLOCK_SIZE (64 * 1024 * 1024)
+
+/* the number of subgroups in the workgroups picked for NULL local sizes */
+#define DEFAULT_WG_SUBGROUPS 4
+
+/* a vkAllocateMemory of one memory type that buffers are bound into at
+ * offsets, managed as a bufalloc region */
+typedef struct pocl_vulkan_mem_block_s
+{
+  VkDeviceMemory memory;
+  /* the whole block if the memory type is host visible, else NULL */
+  void *mapped;
+  uint32_t type;
+  /* the number of buffers bound into the block */
+  unsigned num_buffers;
+  memory_region_t region;
+  struct pocl_vulkan_mem_block_s *next;
+} pocl_vulkan_mem_block_t;
+
 typedef struct pocl_vulkan_mem_data_s
 {
   /* For devices which can't directly transfer to/from host memory */
   VkBuffer staging_buf;
   VkDeviceMemory staging_mem;
+  /* the offset of staging_buf in staging_mem */
+  VkDeviceSize staging_offset;
   /* Device-local memory buffer */
   VkBuffer device_buf;
   VkDeviceMemory device_mem;
+  /* the blocks and chunks the buffers are bound to */
+  pocl_vulkan_mem_block_t *staging_block, *device_block;
+  chunk_info_t *staging_chunk, *device_chunk;
 } pocl_vulkan_mem_data_t;
 
 typedef struct pocl_vulkan_device_data_s
@@ -197,9 +266,31 @@ typedef struct pocl_vulkan_device_data_s
   VkQueue compute_queue;
   uint32_t compute_queue_fam_index;
 
+  /* a transfer-only queue of a discrete GPU, for the staging copies of
+   * reads and writes, which then run while kernels are in flight */
+  int has_transfer_queue;
+  VkQueue transfer_queue;
+  VkCommandPool transfer_command_pool;
+  VkCommandBuffer transfer_command_buffer;
+  VkFence transfer_fence;
+  /* timeline semaphores counting the submissions of the two queues; each
+   * submission waits for the other queue's last value it depends on */
+  VkSemaphore compute_timeline, transfer_timeline;
+  uint64_t compute_submitted, compute_retired, transfer_submitted;
+
+  /* the queue families the buffers are shared by */
+  VkSharingMode buf_sharing_mode;
+  uint32_t num_buf_queue_fams;
+  uint32_t buf_queue_fams[2];
+
   VkCommandPool command_pool;
   VkDescriptorPool buf_descriptor_pool;
 
+  /* the pipelines compiled so far, saved to pipeline_cache_path (empty if
+   * the kernel cache is disabled) when a new one is added */
+  VkPipelineCache pipeline_cache;
+  char pipeline_cache_path[POCL_FILENAME_LENGTH];
+
   VkSubmitInfo submit_info;
   VkCommandBufferBeginInfo cmd_buf_begin_info;
 
@@ -224,10 +315,13 @@ typedef struct pocl_vulkan_device_data_s
   VkPhysicalDeviceMemoryProperties mem_props;
 
   /* Unlike in OpenCL, Vulkan devices have WG count limits (-> grid size
-   * limits).
-   * TODO pocl must launch multiple times if WG count > this limit */
+   * limits); larger grids are dispatched in several parts */
   uint32_t max_wg_count[4];
 
+  /* the workgroup size picked for launches without a local size, a few
+   * subgroups instead of the maximum, so that more groups fit on a CU */
+  size_t default_wg_size;
+
   /* device limits */
   VkDeviceSize host_staging_mem_size, device_mem_size;
   /* memory types*/
@@ -235,8 +329,34 @@ typedef struct pocl_vulkan_device_data_s
       kernarg_mem_type, constant_mem_type;
   uint32_t min_ubo_align, min_stor_align, min_map_align;
 
+  /* minImportedHostPointerAlignment if CL_MEM_USE_HOST_PTR buffers can be
+   * imported with VK_EXT_external_memory_host, else 0 */
+  VkDeviceSize host_ptr_import_align;
+#ifdef VK_EXT_external_memory_host
+  PFN_vkGetMemoryHostPointerPropertiesEXT get_host_ptr_props;
+#endif
+
+  /* the memory blocks of all memory types, protected by mem_lock */
+  pocl_vulkan_mem_block_t *mem_blocks;
+  pocl_lock_t mem_lock;
+
   VkCommandBuffer command_buffer;
   VkCommandBuffer tmp_command_buffer;
+  /* signaled by the command buffers submit_CB waits for */
+  VkFence sync_fence;
+
+  /* the kernels and buffer copies are submitted without waiting; the
+   * ring_count slots from ring_head are in flight, in submission order */
+  pocl_vulkan_cb_slot_t ring[MAX_CMD_BUFFERS];
+  unsigned ring_head, ring_count;
+
+  /* two timestamp queries for each slot of the ring, written before and
+   * after its commands */
+  VkQueryPool timestamp_pool;
+  /* the timestampValidBits of the queue, 0 if it has no timestamps */
+  uint32_t timestamp_valid_bits;
+  /* a device timestamp and the pocl_gettimemono_ns () time it was taken */
+  uint64_t timestamp_epoch, host_epoch;
 
   /* integrated GPUs have different Vulkan memory layout */
   int device_is_iGPU;
@@ -323,6 +443,34 @@ pocl_vulkan_get_best_compute_queue (VkPhysicalDevice dev,
   return VK_SUCCESS;
 }
 
+/* Finds a queue family for transfers only, which is usually a DMA
+ * engine of a discrete GPU */
+static VkResult
+pocl_vulkan_get_transfer_queue (VkPhysicalDevice dev,
+                                uint32_t *transfer_queue_index)
+{
+  VkQueueFamilyProperties queue_preps[128];
+  uint32_t queue_prep_count = 0;
+  uint32_t i;
+
+  vkGetPhysicalDeviceQueueFamilyProperties (dev, &queue_prep_count, NULL);
+  assert (queue_prep_count < 128);
+  vkGetPhysicalDeviceQueueFamilyProperties (dev, &queue_prep_count,
+                                            queue_preps);
+
+  for (i = 0; i < queue_prep_count; i++)
+    {
+      VkQueueFlags flags = queue_preps[i].queueFlags;
+      if ((flags & VK_QUEUE_TRANSFER_BIT)
+          && !(flags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT)))
+        {
+          *transfer_queue_index = i;
+          return VK_SUCCESS;
+        }
+    }
+  return VK_ERROR_FEATURE_NOT_PRESENT;
+}
+
 /* Memory for OpenCL constant memory and kernel arguments */
 #define KERNARG_BUFFER_SIZE (2 << 20)
 #define CONSTANT_BUFFER_SIZE (8 << 20)
@@ -597,6 +745,42 @@ pocl_vulkan_enqueue_staging_buffer_copy (pocl_vulkan_device_data_t *d,
                         &memory_barrier, 0, 0, 0, 0);
 }
 
+/* the largest divisor of n that is at most limit */
+static size_t
+largest_divisor (size_t n, size_t limit)
+{
+  size_t i;
+  for (i = (limit < n ? limit : n); i > 1; --i)
+    if (n % i == 0)
+      return i;
+  return 1;
+}
+
+/* Picks the local size of a launch without one. The local size is a
+ * specialization constant of the pipeline, so any size works without
+ * recompiling; the X dimension is filled first, up to default_wg_size. */
+static void
+pocl_vulkan_compute_local_size (cl_device_id dev, cl_kernel kernel,
+                                size_t global_x, size_t global_y,
+                                size_t global_z, size_t *local_x,
+                                size_t *local_y, size_t *local_z)
+{
+  pocl_vulkan_device_data_t *d = (pocl_vulkan_device_data_t *)dev->data;
+  size_t left = d->default_wg_size;
+
+  *local_x = largest_divisor (
+      global_x, left < dev->max_work_item_sizes[0]
+                    ? left : dev->max_work_item_sizes[0]);
+  left /= *local_x;
+  *local_y = largest_divisor (
+      global_y, left < dev->max_work_item_sizes[1]
+                    ? left : dev->max_work_item_sizes[1]);
+  left /= *local_y;
+  *local_z = largest_divisor (
+      global_z, left < dev->max_work_item_sizes[2]
+                    ? left : dev->max_work_item_sizes[2]);
+}
+
 /********************************************************************/
 
 void
@@ -614,6 +798,7 @@ pocl_vulkan_init_device_ops (struct pocl_device_ops *ops)
   ops->write = pocl_vulkan_write;
   ops->write_rect = pocl_vulkan_write_rect;
   ops->copy = pocl_vulkan_copy;
+  ops->copy_with_size = pocl_vulkan_copy_with_size;
   ops->copy_rect = pocl_vulkan_copy_rect;
   ops->memfill = pocl_vulkan_memfill;
   ops->map_mem = pocl_vulkan_map_mem;
@@ -644,9 +829,10 @@ pocl_vulkan_init_device_ops (struct pocl_device_ops *ops)
   ops->notify = pocl_vulkan_notify;
   ops->flush = pocl_vulkan_flush;
   ops->build_hash = pocl_vulkan_build_hash;
+  ops->compute_local_size = pocl_vulkan_compute_local_size;
 
-  /* TODO get timing data from Vulkan API */
-  /* ops->get_timer_value = pocl_vulkan_get_timer_value; */
+  /* the kernels and the buffer copies get their execution times from
+   * timestamp queries, see pocl_vulkan_update_event () */
 
   ops->wait_event = pocl_vulkan_wait_event;
   ops->notify_event_finished = pocl_vulkan_notify_event_finished;
@@ -674,13 +860,17 @@ pocl_vulkan_init_device_ops (struct pocl_device_ops *ops)
 }
 
 /* The binary format version that this driver code can read. */
-#define VULKAN_BINARY_FORMAT "1"
+#define VULKAN_BINARY_FORMAT "2"
 
 char *
 pocl_vulkan_build_hash (cl_device_id device)
 {
-  char *res = (char *)malloc (32);
-  snprintf (res, 32, "pocl-vulkan-clspv " VULKAN_BINARY_FORMAT);
+  /* clspv is given the push constant limit of the device, which decides
+   * where the PODs go, so the cached SPIR-V is only valid for the same */
+  pocl_vulkan_device_data_t *d = (pocl_vulkan_device_data_t *)device->data;
+  char *res = (char *)malloc (64);
+  snprintf (res, 64, "pocl-vulkan-clspv " VULKAN_BINARY_FORMAT " pc%u",
+            d->dev_props.limits.maxPushConstantsSize);
   return res;
 }
 
@@ -855,6 +1045,211 @@ pocl_vulkan_probe (struct pocl_device_ops *ops)
   return pocl_vulkan_device_count;
 }
 
+/* Creates the pipeline cache of the device, filled with the pipelines
+ * saved by the earlier runs if the kernel cache is enabled. The file is
+ * named by the pipelineCacheUUID, which changes with the driver version. */
+static void
+pocl_vulkan_create_pipeline_cache (pocl_vulkan_device_data_t *d)
+{
+  char name[VK_UUID_SIZE * 2 + 32];
+  char *content = NULL;
+  uint64_t content_size = 0;
+  unsigned i;
+
+  for (i = 0; i < VK_UUID_SIZE; ++i)
+    sprintf (name + 2 * i, "%02x", d->dev_props.pipelineCacheUUID[i]);
+  strcpy (name + 2 * VK_UUID_SIZE, ".vkpipelinecache");
+
+  if (pocl_cache_device_cache_path (d->pipeline_cache_path, name) == 0)
+    {
+      if (pocl_exists (d->pipeline_cache_path))
+        pocl_read_file (d->pipeline_cache_path, &content, &content_size);
+    }
+  else
+    d->pipeline_cache_path[0] = 0;
+
+  VkPipelineCacheCreateInfo cache_info
+      = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO, NULL, 0,
+          (size_t)content_size, content };
+  VkResult res = vkCreatePipelineCache (d->device, &cache_info, NULL,
+                                        &d->pipeline_cache);
+  if (res != VK_SUCCESS && content != NULL)
+    {
+      POCL_MSG_PRINT_VULKAN ("ignoring the unusable pipeline cache %s\n",
+                             d->pipeline_cache_path);
+      cache_info.initialDataSize = 0;
+      cache_info.pInitialData = NULL;
+      res = vkCreatePipelineCache (d->device, &cache_info, NULL,
+                                   &d->pipeline_cache);
+    }
+  VULKAN_CHECK (res);
+  POCL_MEM_FREE (content);
+}
+
+/* Creates the timestamp query pool of the ring and pairs a device
+ * timestamp with the host time, with VK_EXT_calibrated_timestamps if the
+ * device supports the host's monotonic clock, otherwise by writing a
+ * timestamp and taking the host time around the wait for it. */
+static void
+pocl_vulkan_setup_timestamps (pocl_vulkan_device_data_t *d,
+                              VkPhysicalDevice pd, uint32_t queue_fam,
+                              int have_calibrated_timestamps)
+{
+  VkQueueFamilyProperties queue_props[128];
+  uint32_t queue_prop_count = 128;
+  vkGetPhysicalDeviceQueueFamilyProperties (pd, &queue_prop_count,
+                                            queue_props);
+  d->timestamp_valid_bits = queue_props[queue_fam].timestampValidBits;
+  if (d->timestamp_valid_bits == 0)
+    return;
+
+  VkQueryPoolCreateInfo pool_info
+      = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+          NULL,
+          0,
+          VK_QUERY_TYPE_TIMESTAMP,
+          2 * MAX_CMD_BUFFERS,
+          0 };
+  VULKAN_CHECK (
+      vkCreateQueryPool (d->device, &pool_info, NULL, &d->timestamp_pool));
+
+#if defined(VK_EXT_calibrated_timestamps) && defined(CLOCK_MONOTONIC_RAW)
+  /* pocl_gettimemono_ns () reads CLOCK_MONOTONIC_RAW on Linux */
+  PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT get_domains
+      = (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)
+          vkGetInstanceProcAddr (
+              pocl_vulkan_instance,
+              "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+  PFN_vkGetCalibratedTimestampsEXT get_timestamps
+      = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr (
+          d->device, "vkGetCalibratedTimestampsEXT");
+  if (have_calibrated_timestamps && get_domains && get_timestamps)
+    {
+      VkTimeDomainEXT domains[16];
+      uint32_t num_domains = 16, i, have_device = 0, have_host = 0;
+      get_domains (pd, &num_domains, domains);
+      for (i = 0; i < num_domains; ++i)
+        {
+          have_device |= domains[i] == VK_TIME_DOMAIN_DEVICE_EXT;
+          have_host |= domains[i] == VK_TIME_DOMAIN_CLOCK_MONOTONIC_RAW_EXT;
+        }
+
+      VkCalibratedTimestampInfoEXT info[2]
+          = { { VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, NULL,
+                VK_TIME_DOMAIN_DEVICE_EXT },
+              { VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, NULL,
+                VK_TIME_DOMAIN_CLOCK_MONOTONIC_RAW_EXT } };
+      uint64_t timestamps[2], deviation;
+      if (have_device && have_host
+          && get_timestamps (d->device, 2, info, timestamps, &deviation)
+                 == VK_SUCCESS)
+        {
+          d->timestamp_epoch = timestamps[0];
+          d->host_epoch = timestamps[1];
+          POCL_MSG_PRINT_VULKAN ("calibrated timestamps, deviation %" PRIu64
+                                 " ns\n",
+                                 deviation);
+          return;
+        }
+    }
+#endif
+
+  VkCommandBuffer cb = d->tmp_command_buffer;
+  VULKAN_CHECK (vkResetCommandBuffer (cb, 0));
+  VULKAN_CHECK (vkBeginCommandBuffer (cb, &d->cmd_buf_begin_info));
+  vkCmdResetQueryPool (cb, d->timestamp_pool, 0, 1);
+  vkCmdWriteTimestamp (cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                       d->timestamp_pool, 0);
+  VULKAN_CHECK (vkEndCommandBuffer (cb));
+
+  d->submit_info.pCommandBuffers = &cb;
+  uint64_t before = pocl_gettimemono_ns ();
+  VULKAN_CHECK (
+      vkQueueSubmit (d->compute_queue, 1, &d->submit_info, d->sync_fence));
+  VULKAN_CHECK (
+      vkWaitForFences (d->device, 1, &d->sync_fence, VK_TRUE, UINT64_MAX));
+  uint64_t after = pocl_gettimemono_ns ();
+  VULKAN_CHECK (vkResetFences (d->device, 1, &d->sync_fence));
+
+  VULKAN_CHECK (vkGetQueryPoolResults (
+      d->device, d->timestamp_pool, 0, 1, sizeof (uint64_t),
+      &d->timestamp_epoch, sizeof (uint64_t), VK_QUERY_RESULT_64_BIT));
+  d->host_epoch = before + (after - before) / 2;
+}
+
+/* Creates the command buffer, fence and timeline semaphores of the
+ * transfer queue. */
+static void
+pocl_vulkan_setup_transfer_queue (pocl_vulkan_device_data_t *d,
+                                  uint32_t queue_fam)
+{
+  vkGetDeviceQueue (d->device, queue_fam, 0, &d->transfer_queue);
+
+  VkCommandPoolCreateInfo pool_cinfo
+      = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, NULL,
+          VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
+              | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+          queue_fam };
+  VULKAN_CHECK (vkCreateCommandPool (d->device, &pool_cinfo, NULL,
+                                     &d->transfer_command_pool));
+
+  VkCommandBufferAllocateInfo alloc_cinfo
+      = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, NULL,
+          d->transfer_command_pool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1 };
+  VULKAN_CHECK (vkAllocateCommandBuffers (d->device, &alloc_cinfo,
+                                          &d->transfer_command_buffer));
+
+  VkFenceCreateInfo fence_info
+      = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, NULL, 0 };
+  VULKAN_CHECK (
+      vkCreateFence (d->device, &fence_info, NULL, &d->transfer_fence));
+
+#ifdef VK_KHR_timeline_semaphore
+  VkSemaphoreTypeCreateInfoKHR type_info
+      = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR, NULL,
+          VK_SEMAPHORE_TYPE_TIMELINE_KHR, 0 };
+  VkSemaphoreCreateInfo sem_info
+      = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, &type_info, 0 };
+  VULKAN_CHECK (
+      vkCreateSemaphore (d->device, &sem_info, NULL, &d->compute_timeline));
+  VULKAN_CHECK (
+      vkCreateSemaphore (d->device, &sem_info, NULL, &d->transfer_timeline));
+#endif
+  d->compute_submitted = d->compute_retired = d->transfer_submitted = 0;
+}
+
+/* Converts a device timestamp to the time base of pocl_gettimemono_ns (). */
+static uint64_t
+pocl_vulkan_timestamp_to_host (pocl_vulkan_device_data_t *d, uint64_t ts)
+{
+  uint64_t mask = d->timestamp_valid_bits >= 64
+                      ? UINT64_MAX
+                      : ((1ULL << d->timestamp_valid_bits) - 1);
+  uint64_t ticks = (ts - d->timestamp_epoch) & mask;
+  return d->host_epoch
+         + (uint64_t)((double)ticks * d->dev_props.limits.timestampPeriod);
+}
+
+/* Writes the pipeline cache of the device to the kernel cache. */
+static void
+pocl_vulkan_save_pipeline_cache (pocl_vulkan_device_data_t *d)
+{
+  size_t size = 0;
+
+  if (d->pipeline_cache_path[0] == 0)
+    return;
+
+  VULKAN_CHECK (
+      vkGetPipelineCacheData (d->device, d->pipeline_cache, &size, NULL));
+  char *data = malloc (size);
+  if (data == NULL)
+    return;
+  if (vkGetPipelineCacheData (d->device, d->pipeline_cache, &size, data)
+      == VK_SUCCESS)
+    pocl_write_file (d->pipeline_cache_path, data, size, 0, 0);
+  free (data);
+}
+
 cl_int
 pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
 {
@@ -897,7 +1292,7 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
    * VK_KHR_shader_non_semantic_info
    */
 
-  const char *requested_exts[4];
+  const char *requested_exts[8];
   uint32_t requested_ext_count = 0;
 
   uint32_t dev_ext_count = 0;
@@ -909,9 +1304,41 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
   assert (dev_ext_count < 256);
 
   int have_amd_shader_core_properties = 0;
+  int have_external_memory_host = 0;
+  int have_calibrated_timestamps = 0;
+  int have_timeline_semaphore = 0;
   int have_needed_extensions = 0;
   for (i = 0; i < dev_ext_count; ++i)
     {
+#ifdef VK_KHR_timeline_semaphore
+      if (strncmp ("VK_KHR_timeline_semaphore", dev_exts[i].extensionName,
+                   VK_MAX_EXTENSION_NAME_SIZE)
+          == 0)
+        {
+          have_timeline_semaphore = 1;
+          requested_exts[requested_ext_count++] = "VK_KHR_timeline_semaphore";
+        }
+#endif
+#ifdef VK_EXT_calibrated_timestamps
+      if (strncmp ("VK_EXT_calibrated_timestamps", dev_exts[i].extensionName,
+                   VK_MAX_EXTENSION_NAME_SIZE)
+          == 0)
+        {
+          have_calibrated_timestamps = 1;
+          requested_exts[requested_ext_count++]
+              = "VK_EXT_calibrated_timestamps";
+        }
+#endif
+#ifdef VK_EXT_external_memory_host
+      if (strncmp ("VK_EXT_external_memory_host", dev_exts[i].extensionName,
+                   VK_MAX_EXTENSION_NAME_SIZE)
+          == 0)
+        {
+          have_external_memory_host = 1;
+          requested_exts[requested_ext_count++]
+              = "VK_EXT_external_memory_host";
+        }
+#endif
 #ifdef VK_AMD_shader_core_properties
       if (strncmp ("VK_AMD_shader_core_properties", dev_exts[i].extensionName,
                    VK_MAX_EXTENSION_NAME_SIZE)
@@ -964,32 +1391,46 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
     dev->available = CL_TRUE;
 
     /* get device properties */
-  if (have_amd_shader_core_properties)
+  vkGetPhysicalDeviceProperties (pd, &d->dev_props);
+  dev->max_compute_units = 1;
+  uint32_t subgroup_size = 0;
+  int have_subgroup_properties
+      = d->dev_props.apiVersion >= VK_API_VERSION_1_1;
+  if (have_amd_shader_core_properties || have_subgroup_properties)
     {
       VkPhysicalDeviceProperties2 general_props;
       VkPhysicalDeviceShaderCorePropertiesAMD shader_core_properties;
+      VkPhysicalDeviceSubgroupProperties subgroup_properties;
 
       shader_core_properties.pNext = NULL;
       shader_core_properties.sType
           = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_CORE_PROPERTIES_AMD;
+      subgroup_properties.pNext = NULL;
+      subgroup_properties.sType
+          = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
 
-      general_props.pNext = &shader_core_properties;
+      general_props.pNext = NULL;
       general_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      if (have_amd_shader_core_properties)
+        {
+          shader_core_properties.pNext = general_props.pNext;
+          general_props.pNext = &shader_core_properties;
+        }
+      if (have_subgroup_properties)
+        {
+          subgroup_properties.pNext = general_props.pNext;
+          general_props.pNext = &subgroup_properties;
+        }
 
       vkGetPhysicalDeviceProperties2 (pocl_vulkan_devices[j], &general_props);
 
-      memcpy (&d->dev_props, &general_props.properties,
-              sizeof (VkPhysicalDeviceProperties));
-
-      dev->max_compute_units
-          = shader_core_properties.shaderEngineCount
-            * shader_core_properties.shaderArraysPerEngineCount
-            * shader_core_properties.computeUnitsPerShaderArray;
-    }
-  else
-    {
-      vkGetPhysicalDeviceProperties (pd, &d->dev_props);
-      dev->max_compute_units = 1;
+      if (have_amd_shader_core_properties)
+        dev->max_compute_units
+            = shader_core_properties.shaderEngineCount
+              * shader_core_properties.shaderArraysPerEngineCount
+              * shader_core_properties.computeUnitsPerShaderArray;
+      if (have_subgroup_properties)
+        subgroup_size = subgroup_properties.subgroupSize;
     }
 
   /* TODO get this from Vulkan API */
@@ -1027,11 +1468,41 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
   /* TODO: Get images working */
   dev->image_support = CL_FALSE;
 
+  /* a discrete GPU gets a transfer queue too, if it has a transfer-only
+   * family and timeline semaphores to order the copies with the kernels */
+  VkDeviceQueueCreateInfo queue_cinfos[2]
+      = { queue_fam_cinfo, queue_fam_cinfo };
+  uint32_t transfer_queue_fam = comp_queue_fam;
+  void *dev_cinfo_next = NULL;
+  d->has_transfer_queue = 0;
+#ifdef VK_KHR_timeline_semaphore
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features
+      = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+          NULL, VK_FALSE };
+  if (have_timeline_semaphore
+      && d->dev_props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU
+      && pocl_vulkan_get_transfer_queue (pd, &transfer_queue_fam)
+             == VK_SUCCESS)
+    {
+      VkPhysicalDeviceFeatures2 features2
+          = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, &timeline_features };
+      vkGetPhysicalDeviceFeatures2 (pd, &features2);
+      if (timeline_features.timelineSemaphore)
+        {
+          d->has_transfer_queue = 1;
+          queue_cinfos[1].queueFamilyIndex = transfer_queue_fam;
+          dev_cinfo_next = &timeline_features;
+          POCL_MSG_PRINT_VULKAN ("Vulkan Dev %u using Transfer Queue Fam: %u\n",
+                                 j, transfer_queue_fam);
+        }
+    }
+#endif
+
   VkDeviceCreateInfo dev_cinfo = { VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+                                   dev_cinfo_next,
                                    0,
-                                   0,
-                                   1,
-                                   &queue_fam_cinfo,
+                                   1 + d->has_transfer_queue,
+                                   queue_cinfos,
                                    0, /* deprecated */
                                    0, /* deprecated */
                                    requested_ext_count,
@@ -1061,8 +1532,8 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
     {
       dev->vendor = "Unknown";
     }
-  /* TODO get from API */
-  dev->preferred_wg_size_multiple = 64;
+  /* the subgroup size, if the device reports it */
+  dev->preferred_wg_size_multiple = subgroup_size ? subgroup_size : 64;
 
   VkPhysicalDeviceType dtype = d->dev_props.deviceType;
   dev->short_name = dev->long_name = d->dev_props.deviceName;
@@ -1087,6 +1558,30 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
       return CL_SUCCESS;
     }
 
+  /* the iGPUs share the memory with the host, so they can use the memory
+   * of CL_MEM_USE_HOST_PTR buffers in place */
+  d->host_ptr_import_align = 0;
+#ifdef VK_EXT_external_memory_host
+  if (have_external_memory_host && d->device_is_iGPU)
+    {
+      VkPhysicalDeviceExternalMemoryHostPropertiesEXT host_props;
+      host_props.sType
+          = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+      host_props.pNext = NULL;
+
+      VkPhysicalDeviceProperties2 props2;
+      props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      props2.pNext = &host_props;
+      vkGetPhysicalDeviceProperties2 (pocl_vulkan_devices[j], &props2);
+
+      d->get_host_ptr_props
+          = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr (
+              d->device, "vkGetMemoryHostPointerPropertiesEXT");
+      if (d->get_host_ptr_props != NULL)
+        d->host_ptr_import_align = host_props.minImportedHostPointerAlignment;
+    }
+#endif
+
   dev->execution_capabilities = CL_EXEC_KERNEL;
   dev->address_bits = 64;
   /* TODO: (cl_uint)d->dev_props.limits.minStorageBufferOffsetAlignment * 8; */
@@ -1161,6 +1656,9 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
   dev->max_work_item_sizes[2] = d->dev_props.limits.maxComputeWorkGroupSize[2];
   dev->max_work_group_size
       = d->dev_props.limits.maxComputeWorkGroupInvocations;
+  d->default_wg_size = DEFAULT_WG_SUBGROUPS * dev->preferred_wg_size_multiple;
+  if (d->default_wg_size > dev->max_work_group_size)
+    d->default_wg_size = dev->max_work_group_size;
 
   /* Vulkan devices typically don't have unlimited number of groups per
    * command, unlike OpenCL */
@@ -1175,8 +1673,18 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
   d->compute_queue_fam_index = comp_queue_fam;
   vkGetDeviceQueue (d->device, comp_queue_fam, 0, &d->compute_queue);
 
+  /* the buffers are used by both queues without ownership transfers */
+  d->buf_queue_fams[0] = comp_queue_fam;
+  d->buf_queue_fams[1] = transfer_queue_fam;
+  d->num_buf_queue_fams = 1 + d->has_transfer_queue;
+  d->buf_sharing_mode = d->has_transfer_queue ? VK_SHARING_MODE_CONCURRENT
+                                              : VK_SHARING_MODE_EXCLUSIVE;
+
   pocl_vulkan_setup_memory_types (dev, d, pd);
 
+  d->mem_blocks = NULL;
+  POCL_INIT_LOCK (d->mem_lock);
+
   dev->global_mem_size = d->device_mem_size;
   dev->global_mem_cacheline_size = HOST_CPU_CACHELINE_SIZE;
   dev->global_mem_cache_size = 32768; /* TODO we should detect somehow.. */
@@ -1205,6 +1713,22 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
   d->command_buffer = tmp[0];
   d->tmp_command_buffer = tmp[1];
 
+  if (d->has_transfer_queue)
+    pocl_vulkan_setup_transfer_queue (d, transfer_queue_fam);
+
+  VkFenceCreateInfo fence_info
+      = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, NULL, 0 };
+  VULKAN_CHECK (vkCreateFence (d->device, &fence_info, NULL, &d->sync_fence));
+  alloc_cinfo.commandBufferCount = 1;
+  for (i = 0; i < MAX_CMD_BUFFERS; ++i)
+    {
+      VULKAN_CHECK (
+          vkAllocateCommandBuffers (d->device, &alloc_cinfo, &d->ring[i].cb));
+      VULKAN_CHECK (
+          vkCreateFence (d->device, &fence_info, NULL, &d->ring[i].fence));
+    }
+  d->ring_head = d->ring_count = 0;
+
   d->submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
   d->submit_info.pNext = NULL;
   d->submit_info.waitSemaphoreCount = 0;
@@ -1236,6 +1760,11 @@ pocl_vulkan_init (unsigned j, cl_device_id dev, const char *parameters)
                                          &descriptor_pool_create_info,
                                          NULL, &d->buf_descriptor_pool));
 
+  pocl_vulkan_create_pipeline_cache (d);
+
+  pocl_vulkan_setup_timestamps (d, pd, comp_queue_fam,
+                                have_calibrated_timestamps);
+
   POCL_INIT_COND (d->wakeup_cond);
 
   POCL_FAST_INIT (d->wq_lock_fast);
@@ -1357,6 +1886,14 @@ pocl_vulkan_build_source (cl_program program, cl_uint device_i,
 
   char program_spv_path_temp[POCL_FILENAME_LENGTH];
   pocl_cache_tempname (program_spv_path_temp, ".spv", NULL);
+  /* the PODs of a kernel go to push constants if they fit, else to the
+   * UBO; the descriptor map tells which one clspv picked */
+  pocl_vulkan_device_data_t *d
+      = (pocl_vulkan_device_data_t *)program->devices[device_i]->data;
+  char max_push_constants[64];
+  snprintf (max_push_constants, sizeof (max_push_constants),
+            "--max-pushconstant-size=%u",
+            d->dev_props.limits.maxPushConstantsSize);
   char *COMPILATION[1024]
       = { CLSPV,
           "-x=cl",
@@ -1364,7 +1901,9 @@ pocl_vulkan_build_source (cl_program program, cl_uint device_i,
           "-cl-kernel-arg-info",
           "--keep-unused-arguments",
           "--uniform-workgroup-size",
-          /* "--pod-pushconstant",*/ /* TODO push constants should be faster */
+          "--pod-pushconstant",
+          max_push_constants,
+          "--global-offset-push-constant",
           "--pod-ubo",
           "--cluster-pod-kernel-args",
           "-o",
@@ -1536,6 +2075,33 @@ int
 pocl_vulkan_free_program (cl_device_id device, cl_program program,
                           unsigned program_device_i)
 {
+  pocl_vulkan_device_data_t *d = (pocl_vulkan_device_data_t *)device->data;
+  unsigned i;
+
+  /* the pipelines and layouts cached for the kernels */
+  for (i = 0; i < program->num_kernels; ++i)
+    {
+      pocl_kernel_metadata_t *meta = &program->kernel_meta[i];
+      if (meta->data == NULL || meta->data[program_device_i] == NULL)
+        continue;
+      pocl_vulkan_kernel_data_t *pp = meta->data[program_device_i];
+      pocl_vulkan_pipeline_t *p, *tmp;
+      LL_FOREACH_SAFE (pp->pipelines, p, tmp)
+        {
+          vkDestroyPipeline (d->device, p->pipeline, NULL);
+          free (p);
+        }
+      pp->pipelines = NULL;
+      if (pp->pipeline_layout != VK_NULL_HANDLE)
+        vkDestroyPipelineLayout (d->device, pp->pipeline_layout, NULL);
+      if (pp->dsl != VK_NULL_HANDLE)
+        vkDestroyDescriptorSetLayout (d->device, pp->dsl, NULL);
+      if (pp->const_dsl != VK_NULL_HANDLE)
+        vkDestroyDescriptorSetLayout (d->device, pp->const_dsl, NULL);
+      pp->pipeline_layout = VK_NULL_HANDLE;
+      pp->dsl = pp->const_dsl = VK_NULL_HANDLE;
+    }
+
   POCL_MEM_FREE (program->data[program_device_i]);
   return 0;
 }
@@ -1584,8 +2150,8 @@ parse_arg_line (pocl_kernel_metadata_t *p, pocl_vulkan_kernel_data_t *pp,
   token = NULL;
 
   char *arg_name = NULL;
-  unsigned ord, dSet, binding, offset, kind = UINT32_MAX, size, elemSize,
-                                       specID = UINT32_MAX;
+  unsigned ord = 0, dSet = 0, binding = 0, offset = 0, kind = UINT32_MAX,
+           size, elemSize, specID = UINT32_MAX;
   for (size_t j = 0; j < num_tokens; j += 2)
     {
       if (strcmp (tokens[j], "kernel") == 0)
@@ -1631,6 +2197,18 @@ parse_arg_line (pocl_kernel_metadata_t *p, pocl_vulkan_kernel_data_t *pp,
           else if (strcmp (tokens[j + 1], "pod_ubo") == 0)
             {
               kind = POCL_ARG_TYPE_NONE;
+              pp->pod_kind = POD_IN_UBO;
+            }
+          /* kernel,boxadd,arg,SZ,argOrdinal,5,offset,8,argKind,pod_pushconstant,argSize,4 */
+          else if (strcmp (tokens[j + 1], "pod_pushconstant") == 0)
+            {
+              kind = POCL_ARG_TYPE_NONE;
+              pp->pod_kind = POD_IN_PUSH_CONSTANTS;
+            }
+          else if (strcmp (tokens[j + 1], "pod") == 0)
+            {
+              kind = POCL_ARG_TYPE_NONE;
+              pp->pod_kind = POD_IN_SSBO;
             }
           /* kernel,matrix_transpose,arg,tile,argOrdinal,2,argKind,local,arrayElemSize,4,arrayNumElemSpecId,3 */
           else if (strcmp (tokens[j + 1], "local") == 0)
@@ -1704,7 +2282,10 @@ parse_arg_line (pocl_kernel_metadata_t *p, pocl_vulkan_kernel_data_t *pp,
       pp->pods[pp->num_pods].ord = ord;
       ++pp->num_pods;
 
-      pp->num_pod_bytes += size;
+      /* the PODs may be padded, or follow the global offset in the push
+       * constants */
+      if (offset + size > pp->num_pod_bytes)
+        pp->num_pod_bytes = offset + size;
     }
 
   /* TODO constants !!! */
@@ -1741,6 +2322,7 @@ pocl_vulkan_setup_metadata (cl_device_id device, cl_program program,
   pocl_kernel_metadata_t kernel_meta_array[1024];
   pocl_kernel_metadata_t *p = NULL;
   unsigned num_kernels = 0;
+  unsigned global_offset_pc = UINT32_MAX, global_offset_size;
 
   for (size_t i = 0; i < num_lines; ++i)
     {
@@ -1758,6 +2340,24 @@ pocl_vulkan_setup_metadata (cl_device_id device, cl_program program,
           assert (p != NULL);
           parse_arg_line (p, p->data[program_device_i], lines[i]);
         }
+      /* pushconstant,name,global_offset,offset,0,size,12 */
+      if (sscanf (lines[i], "pushconstant,name,global_offset,offset,%u,size,%u",
+                  &global_offset_pc, &global_offset_size)
+          == 2)
+        assert (global_offset_size == 3 * sizeof (uint32_t));
+    }
+
+  for (size_t k = 0; k < num_kernels; ++k)
+    {
+      pocl_vulkan_kernel_data_t *pp
+          = kernel_meta_array[k].data[program_device_i];
+      pp->global_offset_pc = global_offset_pc;
+      if (pp->num_pods > 0 && pp->pod_kind == POD_IN_PUSH_CONSTANTS)
+        pp->num_push_constant_bytes = pp->num_pod_bytes;
+      if (global_offset_pc != UINT32_MAX)
+        pp->num_push_constant_bytes
+            = max (pp->num_push_constant_bytes,
+                   global_offset_pc + 3 * sizeof (uint32_t));
     }
 
   for (size_t i = 0; i < num_lines; ++i)
@@ -1798,25 +2398,59 @@ pocl_vulkan_build_poclbinary (cl_program program, cl_uint device_i)
 
 /********************************************************************/
 
+/* Returns 1 if all the events the event still waits for are commands
+ * already in the work queue of this device. Those are submitted to the
+ * Vulkan queue first, and every command buffer of the ring starts with a
+ * barrier on the earlier ones, so the command can be pushed right away.
+ * Called with wq_lock_fast held. */
+static int
+vulkan_deps_pushed (cl_device_id dev, cl_event event)
+{
+  event_node *n;
+
+  LL_FOREACH (event->wait_list, n)
+    {
+      cl_event dep = n->event;
+      if (dep->queue == NULL || dep->queue->device != dev)
+        return 0;
+      pocl_vulkan_event_data_t *dep_d = (pocl_vulkan_event_data_t *)dep->data;
+      if (dep_d == NULL || !dep_d->pushed)
+        return 0;
+    }
+  return 1;
+}
+
+/* Pushes the command to the work queue if nothing it waits for runs
+ * outside this device. Called with the event locked, which holds the
+ * driver thread off the command until it is marked submitted. */
 static void
 vulkan_push_command (cl_device_id dev, _cl_command_node *cmd)
 {
   pocl_vulkan_device_data_t *d = (pocl_vulkan_device_data_t *)dev->data;
+  pocl_vulkan_event_data_t *e_d = (pocl_vulkan_event_data_t *)cmd->event->data;
+  int push;
+
   POCL_FAST_LOCK (d->wq_lock_fast);
-  DL_APPEND (d->work_queue, cmd);
-  POCL_SIGNAL_COND (d->wakeup_cond);
+  push = !e_d->pushed
+         && (pocl_command_is_ready (cmd->event)
+             || vulkan_deps_pushed (dev, cmd->event));
+  if (push)
+    {
+      e_d->pushed = 1;
+      DL_APPEND (d->work_queue, cmd);
+      POCL_SIGNAL_COND (d->wakeup_cond);
+    }
   POCL_FAST_UNLOCK (d->wq_lock_fast);
+
+  if (push)
+    pocl_update_event_submitted (cmd->event);
 }
 
 void
 pocl_vulkan_submit (_cl_command_node *node, cl_command_queue cq)
 {
   node->ready = 1;
-  if (pocl_command_is_ready (node->event))
-    {
-      pocl_update_event_submitted (node->event);
-      vulkan_push_command (cq->device, node);
-    }
+  vulkan_push_command (cq->device, node);
   POCL_UNLOCK_OBJ (node->event);
   return;
 }
@@ -1896,6 +2530,11 @@ void
 pocl_vulkan_notify (cl_device_id device, cl_event event, cl_event finished)
 {
   _cl_command_node *node = event->command;
+  pocl_vulkan_event_data_t *e_d = (pocl_vulkan_event_data_t *)event->data;
+
+  /* pushed already, after the commands it waits for */
+  if (e_d->pushed)
+    return;
 
   if (finished->status < CL_COMPLETE)
     {
@@ -1908,11 +2547,7 @@ pocl_vulkan_notify (cl_device_id device, cl_event event, cl_event finished)
 
   POCL_MSG_PRINT_VULKAN ("notify on event %zu \n", event->id);
 
-  if (pocl_command_is_ready (node->event))
-    {
-      pocl_update_event_submitted (event);
-      vulkan_push_command (device, node);
-    }
+  vulkan_push_command (device, node);
 
   return;
 }
@@ -1923,13 +2558,28 @@ pocl_vulkan_update_event (cl_device_id device, cl_event event)
   pocl_vulkan_event_data_t *e_d = NULL;
   if (event->data == NULL && event->status == CL_QUEUED)
     {
-      e_d = (pocl_vulkan_event_data_t *)malloc (
-          sizeof (pocl_vulkan_event_data_t));
+      e_d = (pocl_vulkan_event_data_t *)calloc (
+          1, sizeof (pocl_vulkan_event_data_t));
       assert (e_d);
 
       POCL_INIT_COND (e_d->event_cond);
       event->data = (void *)e_d;
     }
+  else if (event->status == CL_COMPLETE && event->data != NULL
+           && event->queue != NULL
+           && (event->queue->properties & CL_QUEUE_PROFILING_ENABLE))
+    {
+      /* Replace the host times with the device execution times, which
+       * don't include the submission and the fence wait latency. The
+       * calibration isn't exact, so keep the times in order. */
+      e_d = (pocl_vulkan_event_data_t *)event->data;
+      if (e_d->time_end != 0)
+        {
+          pocl_event_profile *prof = event->profile;
+          prof->time_start = max (e_d->time_start, prof->time_submit);
+          prof->time_end = max (e_d->time_end, prof->time_start);
+        }
+    }
 }
 
 void
@@ -1950,20 +2600,217 @@ pocl_vulkan_wait_event (cl_device_id device, cl_event event)
 
 #define POCL_VK_FENCE_TIMEOUT (60ULL * 1000ULL * 1000ULL * 1000ULL)
 
+/* How long the driver thread waits for the oldest command buffer of the
+ * ring before checking its work queue again */
+#define POCL_VK_RETIRE_POLL_TIMEOUT (200ULL * 1000ULL)
+
 static void submit_CB (pocl_vulkan_device_data_t *d, VkCommandBuffer *cmdbuf_p)
 {
-  VkFence fence;
+  d->submit_info.pCommandBuffers = cmdbuf_p;
+  VULKAN_CHECK (
+      vkQueueSubmit (d->compute_queue, 1, &d->submit_info, d->sync_fence));
 
-  VkFenceCreateInfo fCreateInfo = {
-    VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, NULL, 0 };
+  VULKAN_CHECK (vkWaitForFences (d->device, 1, &d->sync_fence, VK_TRUE,
+                                 POCL_VK_FENCE_TIMEOUT));
+  VULKAN_CHECK (vkResetFences (d->device, 1, &d->sync_fence));
+}
 
-  VULKAN_CHECK (vkCreateFence (d->device, &fCreateInfo, NULL, &fence));
+/* Waits up to timeout ns for the oldest command buffer of the ring, then
+ * retires it and the following ones that have completed too: frees their
+ * descriptor sets and completes their commands. */
+static void
+pocl_vulkan_retire (pocl_vulkan_device_data_t *d, uint64_t timeout)
+{
+  unsigned i;
 
-  d->submit_info.pCommandBuffers = cmdbuf_p;
-  VULKAN_CHECK (vkQueueSubmit (d->compute_queue, 1, &d->submit_info, fence));
+  while (d->ring_count > 0)
+    {
+      pocl_vulkan_cb_slot_t *slot = &d->ring[d->ring_head];
+      VkResult res
+          = vkWaitForFences (d->device, 1, &slot->fence, VK_TRUE, timeout);
+      if (res == VK_TIMEOUT && timeout < POCL_VK_FENCE_TIMEOUT)
+        return;
+      VULKAN_CHECK (res);
+      VULKAN_CHECK (vkResetFences (d->device, 1, &slot->fence));
+      timeout = 0;
+
+      for (i = 0; i < 2; ++i)
+        if (slot->descriptor_sets[i])
+          {
+            VULKAN_CHECK (vkFreeDescriptorSets (
+                d->device, d->buf_descriptor_pool, 1,
+                &slot->descriptor_sets[i]));
+            slot->descriptor_sets[i] = NULL;
+          }
+
+      _cl_command_node *cmd = slot->cmd;
+      slot->cmd = NULL;
+      d->compute_retired = slot->serial;
+      d->ring_head = (d->ring_head + 1) % MAX_CMD_BUFFERS;
+      --d->ring_count;
+
+      if (cmd == NULL)
+        continue;
+      if (d->timestamp_valid_bits
+          && (cmd->event->queue->properties & CL_QUEUE_PROFILING_ENABLE))
+        {
+          uint64_t ts[2];
+          pocl_vulkan_event_data_t *e_d
+              = (pocl_vulkan_event_data_t *)cmd->event->data;
+          if (vkGetQueryPoolResults (
+                  d->device, d->timestamp_pool,
+                  2 * (uint32_t)(slot - d->ring), 2, sizeof (ts), ts,
+                  sizeof (uint64_t), VK_QUERY_RESULT_64_BIT)
+              == VK_SUCCESS)
+            {
+              e_d->time_start = pocl_vulkan_timestamp_to_host (d, ts[0]);
+              e_d->time_end = pocl_vulkan_timestamp_to_host (d, ts[1]);
+            }
+        }
+      if (cmd->type == CL_COMMAND_NDRANGE_KERNEL)
+        POCL_UPDATE_EVENT_COMPLETE_MSG (cmd->event,
+                                        "Event Enqueue NDRange       ");
+      else
+        POCL_UPDATE_EVENT_COMPLETE_MSG (cmd->event,
+                                        "Event Copy Buffer           ");
+    }
+}
+
+/* Waits for all the command buffers of the ring. */
+static void
+pocl_vulkan_drain (pocl_vulkan_device_data_t *d)
+{
+  while (d->ring_count > 0)
+    pocl_vulkan_retire (d, POCL_VK_FENCE_TIMEOUT);
+}
+
+/* Returns the next free command buffer of the ring, waiting for the oldest
+ * one if all are in flight, with recording begun by a barrier that makes
+ * it wait for the results of the earlier submissions. */
+static pocl_vulkan_cb_slot_t *
+pocl_vulkan_ring_begin (pocl_vulkan_device_data_t *d)
+{
+  if (d->ring_count == MAX_CMD_BUFFERS)
+    pocl_vulkan_retire (d, POCL_VK_FENCE_TIMEOUT);
+
+  pocl_vulkan_cb_slot_t *slot
+      = &d->ring[(d->ring_head + d->ring_count) % MAX_CMD_BUFFERS];
+  VULKAN_CHECK (vkResetCommandBuffer (slot->cb, 0));
+  VULKAN_CHECK (vkBeginCommandBuffer (slot->cb, &d->cmd_buf_begin_info));
+
+  VkMemoryBarrier barrier;
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.pNext = NULL;
+  barrier.srcAccessMask
+      = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask
+      = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT
+        | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT
+        | VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier (
+      slot->cb,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+      0, 1, &barrier, 0, NULL, 0, NULL);
+
+  /* a bottom of pipe timestamp is written once the earlier submissions
+   * have finished, i.e. when the commands of the slot can start */
+  if (d->timestamp_valid_bits)
+    {
+      uint32_t q = 2 * (uint32_t)(slot - d->ring);
+      vkCmdResetQueryPool (slot->cb, d->timestamp_pool, q, 2);
+      vkCmdWriteTimestamp (slot->cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           d->timestamp_pool, q);
+    }
+  return slot;
+}
+
+/* Submits the recorded command buffer of the slot without waiting. The
+ * command (if any) is completed when the slot is retired. */
+static void
+pocl_vulkan_ring_submit (pocl_vulkan_device_data_t *d,
+                         pocl_vulkan_cb_slot_t *slot, _cl_command_node *cmd)
+{
+  if (d->timestamp_valid_bits)
+    vkCmdWriteTimestamp (slot->cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         d->timestamp_pool, 2 * (uint32_t)(slot - d->ring) + 1);
+  VULKAN_CHECK (vkEndCommandBuffer (slot->cb));
+  slot->cmd = cmd;
+  VkSubmitInfo submit_info = d->submit_info;
+  submit_info.pCommandBuffers = &slot->cb;
+#ifdef VK_KHR_timeline_semaphore
+  /* wait for the copies on the transfer queue before it */
+  VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  VkTimelineSemaphoreSubmitInfoKHR timeline_info;
+  if (d->has_transfer_queue)
+    {
+      slot->serial = ++d->compute_submitted;
+      timeline_info.sType
+          = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+      timeline_info.pNext = NULL;
+      timeline_info.waitSemaphoreValueCount = 1;
+      timeline_info.pWaitSemaphoreValues = &d->transfer_submitted;
+      timeline_info.signalSemaphoreValueCount = 1;
+      timeline_info.pSignalSemaphoreValues = &slot->serial;
+      submit_info.pNext = &timeline_info;
+      submit_info.waitSemaphoreCount = 1;
+      submit_info.pWaitSemaphores = &d->transfer_timeline;
+      submit_info.pWaitDstStageMask = &wait_stage;
+      submit_info.signalSemaphoreCount = 1;
+      submit_info.pSignalSemaphores = &d->compute_timeline;
+    }
+#endif
+  VULKAN_CHECK (
+      vkQueueSubmit (d->compute_queue, 1, &submit_info, slot->fence));
+  ++d->ring_count;
+}
+
+/* Copies between a buffer and its staging buffer and waits for it. With a
+ * transfer queue, the copy doesn't wait for the kernels in flight, only
+ * for the ones retired already (which the command depends on, if at all),
+ * for their writes to be visible to it. */
+static void
+pocl_vulkan_staging_copy (pocl_vulkan_device_data_t *d, VkBuffer src,
+                          VkBuffer dst, size_t offset, size_t size)
+{
+  VkCommandBuffer cb
+      = d->has_transfer_queue ? d->transfer_command_buffer : d->command_buffer;
+  VULKAN_CHECK (vkResetCommandBuffer (cb, 0));
+  VULKAN_CHECK (vkBeginCommandBuffer (cb, &d->cmd_buf_begin_info));
+  VkBufferCopy copy;
+  copy.srcOffset = offset;
+  copy.dstOffset = offset;
+  copy.size = size;
+  vkCmdCopyBuffer (cb, src, dst, 1, &copy);
+  VULKAN_CHECK (vkEndCommandBuffer (cb));
+
+  if (!d->has_transfer_queue)
+    {
+      submit_CB (d, &cb);
+      return;
+    }
 
-  VULKAN_CHECK (vkWaitForFences (d->device, 1, &fence, VK_TRUE, POCL_VK_FENCE_TIMEOUT));
-  vkDestroyFence (d->device, fence, NULL);
+#ifdef VK_KHR_timeline_semaphore
+  uint64_t signal_value = d->transfer_submitted + 1;
+  VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  VkTimelineSemaphoreSubmitInfoKHR timeline_info
+      = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR, NULL, 1,
+          &d->compute_retired, 1, &signal_value };
+  VkSubmitInfo submit_info = d->submit_info;
+  submit_info.pNext = &timeline_info;
+  submit_info.waitSemaphoreCount = 1;
+  submit_info.pWaitSemaphores = &d->compute_timeline;
+  submit_info.pWaitDstStageMask = &wait_stage;
+  submit_info.pCommandBuffers = &cb;
+  submit_info.signalSemaphoreCount = 1;
+  submit_info.pSignalSemaphores = &d->transfer_timeline;
+  VULKAN_CHECK (vkQueueSubmit (d->transfer_queue, 1, &submit_info,
+                               d->transfer_fence));
+  d->transfer_submitted = signal_value;
+  VULKAN_CHECK (vkWaitForFences (d->device, 1, &d->transfer_fence, VK_TRUE,
+                                 POCL_VK_FENCE_TIMEOUT));
+  VULKAN_CHECK (vkResetFences (d->device, 1, &d->transfer_fence));
+#endif
 }
 
 static void
@@ -1978,30 +2825,23 @@ pocl_vulkan_dev2host (pocl_vulkan_device_data_t *d,
 
   if (d->needs_staging_mem)
     {
-      size_t size2 = pocl_align_value(size, d->dev_props.limits.nonCoherentAtomSize);
-      size_t offset2 = offset;
-      if (offset2 + size2 > mem_id->extra)
-        offset2 = mem_id->extra - size2;
+      /* the flushed range must be aligned to nonCoherentAtomSize; the
+       * chunk of the staging buffer is padded to it */
+      size_t atom = d->dev_props.limits.nonCoherentAtomSize;
+      size_t offset2 = offset / atom * atom;
+      size_t size2 = pocl_align_value (offset + size - offset2, atom);
+      if (offset2 + size2 > pocl_align_value (mem_id->extra, atom))
+        size2 = pocl_align_value (mem_id->extra, atom) - offset2;
 
       /* copy dev mem -> staging mem */
-      VkCommandBuffer cb = d->command_buffer;
-      VULKAN_CHECK (vkResetCommandBuffer (cb, 0));
-      VULKAN_CHECK (vkBeginCommandBuffer (cb, &d->cmd_buf_begin_info));
-      VkBufferCopy copy;
-      copy.srcOffset = offset2;
-      copy.dstOffset = offset2;
-      copy.size = size2;
-
-      /* POCL_MSG_ERR ("DEV2HOST : %zu / %zu \n", offset, size); */
-      vkCmdCopyBuffer (cb, memdata->device_buf, memdata->staging_buf, 1,
-                       &copy);
-      VULKAN_CHECK (vkEndCommandBuffer (cb));
-      submit_CB (d, &cb);
+      pocl_vulkan_staging_copy (d, memdata->device_buf, memdata->staging_buf,
+                                offset, size);
 
       /* copy staging mem -> host_ptr */
       VkMappedMemoryRange mem_range
           = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, NULL,
-              memdata->staging_mem, offset2, size2 };
+              memdata->staging_mem, memdata->staging_offset + offset2,
+              size2 };
       /* TODO only if non-coherent */
       VULKAN_CHECK (vkInvalidateMappedMemoryRanges (d->device, 1, &mem_range));
     }
@@ -2028,31 +2868,25 @@ pocl_vulkan_host2dev (pocl_vulkan_device_data_t *d,
 
   if (d->needs_staging_mem)
     {
-      size_t size2 = pocl_align_value(size, d->dev_props.limits.nonCoherentAtomSize);
-      size_t offset2 = offset;
-      if (offset2 + size2 > mem_id->extra)
-        offset2 = mem_id->extra - size2;
+      /* the flushed range must be aligned to nonCoherentAtomSize; the
+       * chunk of the staging buffer is padded to it */
+      size_t atom = d->dev_props.limits.nonCoherentAtomSize;
+      size_t offset2 = offset / atom * atom;
+      size_t size2 = pocl_align_value (offset + size - offset2, atom);
+      if (offset2 + size2 > pocl_align_value (mem_id->extra, atom))
+        size2 = pocl_align_value (mem_id->extra, atom) - offset2;
 
       /* POCL_MSG_ERR ("HOST2DEV : %zu / %zu\n", offset, size); */
       VkMappedMemoryRange mem_range
           = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, NULL,
-              memdata->staging_mem, offset2, size2 };
+              memdata->staging_mem, memdata->staging_offset + offset2,
+              size2 };
       /* TODO only if non-coherent */
       VULKAN_CHECK (vkFlushMappedMemoryRanges (d->device, 1, &mem_range));
 
       /* copy staging mem -> dev mem */
-      VkCommandBuffer cb = d->command_buffer;
-      VULKAN_CHECK (vkResetCommandBuffer (cb, 0));
-      VULKAN_CHECK (vkBeginCommandBuffer (cb, &d->cmd_buf_begin_info));
-      VkBufferCopy copy;
-      copy.srcOffset = offset2;
-      copy.dstOffset = offset2;
-      copy.size = size2;
-
-      vkCmdCopyBuffer (cb, memdata->staging_buf, memdata->device_buf, 1,
-                       &copy);
-      VULKAN_CHECK (vkEndCommandBuffer (cb));
-      submit_CB (d, &cb);
+      pocl_vulkan_staging_copy (d, memdata->staging_buf, memdata->device_buf,
+                                offset, size);
     }
 }
 
@@ -2095,22 +2929,40 @@ pocl_vulkan_copy (void *data, pocl_mem_identifier *dst_mem_id, cl_mem dst_buf,
   pocl_vulkan_mem_data_t *dst = dst_mem_id->mem_ptr;
 
   /* copy dev mem -> dev mem */
-  VkCommandBuffer cb = d->command_buffer;
-  VULKAN_CHECK (vkResetCommandBuffer (cb, 0));
-  VULKAN_CHECK (vkBeginCommandBuffer (cb, &d->cmd_buf_begin_info));
+  pocl_vulkan_cb_slot_t *slot = pocl_vulkan_ring_begin (d);
   VkBufferCopy copy;
   copy.srcOffset = src_offset;
   copy.dstOffset = dst_offset;
   copy.size = size;
-  vkCmdCopyBuffer (cb, src->device_buf, dst->device_buf, 1, &copy);
-  VULKAN_CHECK (vkEndCommandBuffer (cb));
-  submit_CB (d, &cb);
+  vkCmdCopyBuffer (slot->cb, src->device_buf, dst->device_buf, 1, &copy);
+  pocl_vulkan_ring_submit (d, slot, NULL);
+  pocl_vulkan_drain (d);
 }
 
-/* TODO implement these callbacks */
 void
-pocl_vulkan_copy_rect (void *data,
-                      pocl_mem_identifier * dst_mem_id,
+pocl_vulkan_copy_with_size (void *data, pocl_mem_identifier *dst_mem_id,
+                            cl_mem dst_buf, pocl_mem_identifier *src_mem_id,
+                            cl_mem src_buf,
+                            pocl_mem_identifier *content_size_buf_mem_id,
+                            cl_mem content_size_buf, size_t dst_offset,
+                            size_t src_offset, size_t size)
+{
+  pocl_vulkan_device_data_t *d = (pocl_vulkan_device_data_t *)data;
+  uint64_t content_size;
+
+  pocl_vulkan_dev2host (
+      d, (pocl_vulkan_mem_data_t *)content_size_buf_mem_id->mem_ptr,
+      content_size_buf_mem_id, &content_size, 0, sizeof (content_size));
+  size = pocl_content_size_clamp (content_size, src_offset, size);
+  if (size)
+    pocl_vulkan_copy (data, dst_mem_id, dst_buf, src_mem_id, src_buf,
+                      dst_offset, src_offset, size);
+}
+
+/* TODO implement these callbacks */
+void
+pocl_vulkan_copy_rect (void *data,
+                      pocl_mem_identifier * dst_mem_id,
                       cl_mem dst_buf,
                       pocl_mem_identifier * src_mem_id,
                       cl_mem src_buf,
@@ -2217,7 +3069,7 @@ pocl_vulkan_setup_kernel_arguments (
     VkDescriptorSetLayoutBinding *bindings,
     VkDescriptorBufferInfo *descriptor_buffer_info,
     VkDescriptorSetLayoutBinding *const_binding,
-    VkDescriptorBufferInfo *const_descriptor_buffer_info)
+    VkDescriptorBufferInfo *const_descriptor_buffer_info, char *pod_data)
 {
   _cl_command_run *co = &cmd->command.run;
   cl_kernel kernel = co->kernel;
@@ -2282,7 +3134,14 @@ pocl_vulkan_setup_kernel_arguments (
   /* preallocate buffers if needed */
   VkMemoryRequirements mem_req;
 
-  if (pp->kernarg_buf == NULL && pp->num_pods > 0)
+  /* the PODs in push constants need no buffer or descriptor */
+  int pod_descriptor
+      = pp->num_pods > 0 && pp->pod_kind != POD_IN_PUSH_CONSTANTS;
+  VkDescriptorType pod_descriptor_type = pp->pod_kind == POD_IN_SSBO
+                                             ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+                                             : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+
+  if (pp->kernarg_buf == NULL && pod_descriptor)
     {
       assert (pp->num_pod_bytes > 0);
 
@@ -2292,6 +3151,7 @@ pocl_vulkan_setup_kernel_arguments (
         VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, NULL, 0, kernarg_aligned_size,
 
         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+            | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
             | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
             | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
 
@@ -2390,21 +3250,11 @@ pocl_vulkan_setup_kernel_arguments (
    * a descriptor binding in that kernel's corresponding DescriptorSet.
    */
 
-  char *kernarg_pod_ptr;
-
-  if (pp->num_pods > 0)
-    {
-      if (d->kernarg_is_mappable)
-        {
-          VULKAN_CHECK (vkMapMemory (
-              d->device, d->kernarg_mem, pp->kernarg_buf_offset,
-              pp->kernarg_buf_size, 0, (void **)(&kernarg_pod_ptr)));
-        }
-      else
-        {
-          kernarg_pod_ptr = d->staging_mapped;
-        }
-    }
+  /* the PODs are collected to pod_data, which the command buffer writes to
+   * the kernarg buffer, so that the earlier launches in flight still read
+   * their own values */
+  char *kernarg_pod_ptr = pod_data;
+  assert (pp->num_pod_bytes <= MAX_POD_BYTES);
 
   cl_uint i;
   for (i = 0; i < kernel->meta->num_args; ++i)
@@ -2526,21 +3376,8 @@ pocl_vulkan_setup_kernel_arguments (
         }
     }
 
-  if (pp->num_pods > 0)
-    {
-      if (d->kernarg_is_mappable)
-        {
-          vkUnmapMemory (d->device, d->kernarg_mem);
-        }
-      else
-        {
-          pocl_vulkan_enqueue_staging_buffer_copy (d, pp->kernarg_buf,
-                                                   pp->kernarg_buf_size);
-        }
-    }
-
   /* PODs: setup descriptor & bindings for PODs; last binding in DS 0 */
-  if (pp->num_pods > 0)
+  if (pod_descriptor)
     {
       /* add the kernarg memory */
       descriptor_buffer_info[current].buffer
@@ -2550,7 +3387,7 @@ pocl_vulkan_setup_kernel_arguments (
 
       assert (pp->pods[0].binding == current);
       bindings[current].binding = current;
-      bindings[current].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      bindings[current].descriptorType = pod_descriptor_type;
       bindings[current].descriptorCount = 1;
       bindings[current].pImmutableSamplers = 0;
       bindings[current].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
@@ -2575,14 +3412,27 @@ pocl_vulkan_setup_kernel_arguments (
         entries[i].constantID, entries[i].offset, entries[i].size,
         spec_data[i]);
 
-  VkDescriptorSetLayoutCreateInfo dslCreateInfo
-      = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-          NULL,
-          0,
-          current,
-          bindings };
-  VULKAN_CHECK (
-      vkCreateDescriptorSetLayout (d->device, &dslCreateInfo, NULL, dsl));
+  if (pp->dsl == VK_NULL_HANDLE)
+    {
+      VkDescriptorSetLayoutCreateInfo dslCreateInfo
+          = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+              NULL,
+              0,
+              current,
+              bindings };
+      VULKAN_CHECK (vkCreateDescriptorSetLayout (d->device, &dslCreateInfo,
+                                                 NULL, &pp->dsl));
+    }
+  *dsl = pp->dsl;
+
+  /* a kernel with only PODs in push constants binds no descriptor sets */
+  if (current == 0 && pp->num_constant_bytes == 0)
+    {
+      *ds = NULL;
+      *const_ds = NULL;
+      *const_dsl = NULL;
+      return;
+    }
 
   VkDescriptorSetAllocateInfo descriptorSetallocate_info
       = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, 0,
@@ -2591,21 +3441,25 @@ pocl_vulkan_setup_kernel_arguments (
       vkAllocateDescriptorSets (d->device, &descriptorSetallocate_info, ds));
 
   /* cl_mem arguments */
-  VkWriteDescriptorSet writeDescriptorSet
-      = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-          0,
-          *ds, /* dstSet */
-          0,   /* dstBinding */
-          0,   /* dstArrayElement */
-          (pp->num_pods > 0) ? current-1 : current, /* descriptorCount */
-          VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /* descriptorType */
-          0,
-          descriptor_buffer_info,
-          0 };
-  vkUpdateDescriptorSets (d->device, 1, &writeDescriptorSet, 0, 0);
+  uint32_t num_buf_descriptors = pod_descriptor ? current - 1 : current;
+  if (num_buf_descriptors > 0)
+    {
+      VkWriteDescriptorSet writeDescriptorSet
+          = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+              0,
+              *ds, /* dstSet */
+              0,   /* dstBinding */
+              0,   /* dstArrayElement */
+              num_buf_descriptors, /* descriptorCount */
+              VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, /* descriptorType */
+              0,
+              descriptor_buffer_info,
+              0 };
+      vkUpdateDescriptorSets (d->device, 1, &writeDescriptorSet, 0, 0);
+    }
 
   /* setup descriptor & bindings POD arguments in UBO */
-  if (pp->num_pods > 0)
+  if (pod_descriptor)
     {
       VkWriteDescriptorSet writeDescriptorSet2
           = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
@@ -2614,7 +3468,7 @@ pocl_vulkan_setup_kernel_arguments (
               current-1,   /* dstBinding */
               0,   /* dstArrayElement */
               1, /* descriptorCount */
-              VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, /* descriptorType */
+              pod_descriptor_type, /* descriptorType */
               0,
               &descriptor_buffer_info[current-1],
               0 };
@@ -2636,11 +3490,15 @@ pocl_vulkan_setup_kernel_arguments (
       const_binding->pImmutableSamplers = 0;
       const_binding->stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
-      VkDescriptorSetLayoutCreateInfo dslCreateInfo
-          = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, 0, 0, 1,
-              const_binding };
-      VULKAN_CHECK (vkCreateDescriptorSetLayout (d->device, &dslCreateInfo,
-                                                 NULL, const_dsl));
+      if (pp->const_dsl == VK_NULL_HANDLE)
+        {
+          VkDescriptorSetLayoutCreateInfo dslCreateInfo
+              = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO, 0, 0,
+                  1, const_binding };
+          VULKAN_CHECK (vkCreateDescriptorSetLayout (
+              d->device, &dslCreateInfo, NULL, &pp->const_dsl));
+        }
+      *const_dsl = pp->const_dsl;
 
       VkDescriptorSetAllocateInfo descriptorSetallocate_info
           = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO, 0,
@@ -2668,10 +3526,97 @@ pocl_vulkan_setup_kernel_arguments (
     }
 }
 
-void
-pocl_vulkan_run (void *data, _cl_command_node *cmd)
+/* Returns the pipeline of the kernel for the specialization constants,
+ * creating it (and the pipeline layout, on the first launch) if the kernel
+ * hasn't been launched with them before. Creating a pipeline compiles the
+ * shader for the device, unless the pipeline cache already has it. */
+static VkPipeline
+pocl_vulkan_get_pipeline (pocl_vulkan_device_data_t *d,
+                          pocl_vulkan_kernel_data_t *pp, cl_kernel kernel,
+                          VkShaderModule compute_shader,
+                          VkSpecializationInfo *spec_info,
+                          uint32_t num_set_layouts,
+                          VkDescriptorSetLayout *set_layouts)
+{
+  pocl_vulkan_pipeline_t *p;
+
+  LL_FOREACH (pp->pipelines, p)
+    {
+      if (p->spec_size == spec_info->dataSize
+          && memcmp (p->spec_data, spec_info->pData, p->spec_size) == 0)
+        return p->pipeline;
+    }
+
+  if (pp->pipeline_layout == VK_NULL_HANDLE)
+    {
+      VkPipelineLayoutCreateInfo pipeline_layout_create_info;
+      pipeline_layout_create_info.sType
+          = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+      pipeline_layout_create_info.pNext = NULL;
+      pipeline_layout_create_info.flags = 0;
+      VkPushConstantRange push_constant_range;
+      push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+      push_constant_range.offset = 0;
+      push_constant_range.size
+          = pocl_align_value (pp->num_push_constant_bytes, 4);
+      if (pp->num_push_constant_bytes > 0)
+        {
+          pipeline_layout_create_info.pPushConstantRanges
+              = &push_constant_range;
+          pipeline_layout_create_info.pushConstantRangeCount = 1;
+        }
+      else
+        {
+          pipeline_layout_create_info.pPushConstantRanges = 0;
+          pipeline_layout_create_info.pushConstantRangeCount = 0;
+        }
+      pipeline_layout_create_info.setLayoutCount = num_set_layouts;
+      pipeline_layout_create_info.pSetLayouts = set_layouts;
+      VULKAN_CHECK (vkCreatePipelineLayout (d->device,
+                                            &pipeline_layout_create_info,
+                                            NULL, &pp->pipeline_layout));
+    }
+
+  VkPipelineShaderStageCreateInfo shader_stage_info;
+  shader_stage_info.sType
+      = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shader_stage_info.pNext = NULL;
+  shader_stage_info.flags = 0;
+  shader_stage_info.pSpecializationInfo = spec_info;
+  shader_stage_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  shader_stage_info.module = compute_shader;
+  shader_stage_info.pName = kernel->name;
+
+  VkComputePipelineCreateInfo pipeline_create_info;
+  pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipeline_create_info.pNext = NULL;
+  /* for the grids dispatched in parts */
+  pipeline_create_info.flags = VK_PIPELINE_CREATE_DISPATCH_BASE_BIT;
+  pipeline_create_info.stage = shader_stage_info;
+  pipeline_create_info.layout = pp->pipeline_layout;
+  pipeline_create_info.basePipelineIndex = 0;
+  pipeline_create_info.basePipelineHandle = 0;
+
+  p = calloc (1, sizeof (pocl_vulkan_pipeline_t));
+  assert (spec_info->dataSize <= sizeof (p->spec_data));
+  memcpy (p->spec_data, spec_info->pData, spec_info->dataSize);
+  p->spec_size = spec_info->dataSize;
+  VULKAN_CHECK (vkCreateComputePipelines (d->device, d->pipeline_cache, 1,
+                                          &pipeline_create_info, NULL,
+                                          &p->pipeline));
+  LL_PREPEND (pp->pipelines, p);
+  POCL_MSG_PRINT_VULKAN ("created a pipeline for kernel %s\n", kernel->name);
+
+  pocl_vulkan_save_pipeline_cache (d);
+  return p->pipeline;
+}
+
+/* Records the kernel launch into a command buffer of the ring and submits
+ * it. The command completes when pocl_vulkan_retire() finds it finished. */
+static void
+pocl_vulkan_submit_run (pocl_vulkan_device_data_t *d, _cl_command_node *cmd,
+                        _cl_command_node *completed_cmd)
 {
-  pocl_vulkan_device_data_t *d = data;
   _cl_command_run *co = &cmd->command.run;
   cl_device_id dev = cmd->device;
   assert (cmd->type == CL_COMMAND_NDRANGE_KERNEL);
@@ -2682,108 +3627,216 @@ pocl_vulkan_run (void *data, _cl_command_node *cmd)
   size_t wg_y = pc->num_groups[1];
   size_t wg_z = pc->num_groups[2];
 
-  /* TODO we need working global offsets
-   * before we can handle arbitrary group sizes */
-  assert (wg_x < d->max_wg_count[0]);
-  assert (wg_y < d->max_wg_count[1]);
-  assert (wg_z < d->max_wg_count[2]);
-
   POCL_MSG_PRINT_VULKAN ("WG X %zu Y %zu Z %zu \n", wg_x, wg_y, wg_z);
 
   VkDescriptorSet descriptor_sets[2] = { NULL, NULL };
   VkDescriptorSetLayout descriptor_set_layouts[2];
   VkSpecializationInfo specInfo;
-  uint32_t spec_data[128];
-  VkSpecializationMapEntry entries[128];
+  uint32_t spec_data[MAX_SPEC_CONSTANTS];
+  VkSpecializationMapEntry entries[MAX_SPEC_CONSTANTS];
   VkDescriptorSetLayoutBinding bindings[128];
   VkDescriptorBufferInfo descriptor_buffer_info[128];
   VkDescriptorSetLayoutBinding const_binding;
   VkDescriptorBufferInfo const_descriptor_buffer_info;
-  VkPipelineLayout pipeline_layout;
-  VkPipeline pipeline;
   VkShaderModule compute_shader = NULL;
+  char pod_data[MAX_POD_BYTES];
 
   pocl_vulkan_setup_kernel_arguments (
       d, cmd->device, cmd, &compute_shader, descriptor_sets,
       descriptor_sets + 1, descriptor_set_layouts, descriptor_set_layouts + 1,
       &specInfo, spec_data, entries, bindings, descriptor_buffer_info,
-      &const_binding, &const_descriptor_buffer_info);
+      &const_binding, &const_descriptor_buffer_info, pod_data);
 
-  VkPipelineShaderStageCreateInfo shader_stage_info;
-  shader_stage_info.sType
-      = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shader_stage_info.pNext = NULL;
-  shader_stage_info.flags = 0;
-  shader_stage_info.pSpecializationInfo = &specInfo;
-  shader_stage_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-  shader_stage_info.module = compute_shader;
-  shader_stage_info.pName = kernel->name;
+  pocl_vulkan_kernel_data_t *pp = kernel->meta->data[cmd->program_device_i];
+  uint32_t num_sets = descriptor_sets[1] ? 2 : (descriptor_sets[0] ? 1 : 0);
+  VkPipeline pipeline
+      = pocl_vulkan_get_pipeline (d, pp, kernel, compute_shader, &specInfo,
+                                  num_sets, descriptor_set_layouts);
+  VkPipelineLayout pipeline_layout = pp->pipeline_layout;
 
-  VkPipelineLayoutCreateInfo pipeline_layout_create_info;
-  pipeline_layout_create_info.sType
-      = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipeline_layout_create_info.pNext = NULL;
-  pipeline_layout_create_info.flags = 0;
-  pipeline_layout_create_info.pPushConstantRanges = 0;
-  pipeline_layout_create_info.pushConstantRangeCount = 0;
-  if (descriptor_sets[1])
-    pipeline_layout_create_info.setLayoutCount = 2;
-  else
-    pipeline_layout_create_info.setLayoutCount = 1;
-  pipeline_layout_create_info.pSetLayouts = descriptor_set_layouts;
-  VULKAN_CHECK (vkCreatePipelineLayout (
-      d->device, &pipeline_layout_create_info, NULL, &pipeline_layout));
+  pocl_vulkan_cb_slot_t *slot = pocl_vulkan_ring_begin (d);
+  VkCommandBuffer cb = slot->cb;
 
-  VkComputePipelineCreateInfo pipeline_create_info;
-  pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-  pipeline_create_info.pNext = NULL;
-  pipeline_create_info.flags = 0;
-  pipeline_create_info.stage = shader_stage_info;
-  pipeline_create_info.layout = pipeline_layout;
-  pipeline_create_info.basePipelineIndex = 0;
-  pipeline_create_info.basePipelineHandle = 0;
+  /* vkCmdUpdateBuffer and vkCmdPushConstants take a multiple of 4 bytes */
+  size_t pod_size = pocl_align_value (pp->num_pod_bytes, 4);
+  if (pp->num_pods > 0)
+    memset (pod_data + pp->num_pod_bytes, 0, pod_size - pp->num_pod_bytes);
 
-  VULKAN_CHECK (vkCreateComputePipelines (
-      d->device, VK_NULL_HANDLE, 1, &pipeline_create_info, NULL, &pipeline));
+  if (pp->num_pods > 0 && pp->pod_kind != POD_IN_PUSH_CONSTANTS)
+    {
+      vkCmdUpdateBuffer (cb, pp->kernarg_buf, 0, pod_size, pod_data);
+
+      VkMemoryBarrier memory_barrier;
+      memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      memory_barrier.pNext = NULL;
+      memory_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      memory_barrier.dstAccessMask = VK_ACCESS_UNIFORM_READ_BIT;
+      vkCmdPipelineBarrier (cb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                            &memory_barrier, 0, NULL, 0, NULL);
+    }
 
-  VkCommandBuffer cb = d->command_buffer;
-  VULKAN_CHECK (vkResetCommandBuffer (cb, 0));
+  vkCmdBindPipeline (cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  if (num_sets > 0)
+    vkCmdBindDescriptorSets (cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             pipeline_layout, 0, num_sets, descriptor_sets, 0,
+                             NULL);
+  if (pp->num_push_constant_bytes > 0)
+    {
+      /* the PODs in a buffer were copied by vkCmdUpdateBuffer already,
+       * so pod_data can be reused for the push constants */
+      size_t push_size = pocl_align_value (pp->num_push_constant_bytes, 4);
+      if (pp->num_pods > 0 && pp->pod_kind == POD_IN_PUSH_CONSTANTS)
+        memset (pod_data + pod_size, 0, push_size - min (pod_size, push_size));
+      else
+        memset (pod_data, 0, push_size);
+      if (pp->global_offset_pc != UINT32_MAX)
+        {
+          uint32_t global_offset[3]
+              = { (uint32_t)pc->global_offset[0],
+                  (uint32_t)pc->global_offset[1],
+                  (uint32_t)pc->global_offset[2] };
+          memcpy (pod_data + pp->global_offset_pc, global_offset,
+                  sizeof (global_offset));
+        }
+      vkCmdPushConstants (cb, pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                          push_size, pod_data);
+    }
 
-  VkCommandBufferBeginInfo begin_info;
-  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.pNext = NULL;
-  begin_info.flags
-      = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-      /* the buffer is only submitted and used once in this application. */
+  /* a grid over the WG count limits is dispatched in parts; the base
+   * group of vkCmdDispatchBase keeps the group and global ids of the
+   * parts continuous */
+  if (wg_x <= d->max_wg_count[0] && wg_y <= d->max_wg_count[1]
+      && wg_z <= d->max_wg_count[2])
+    vkCmdDispatch (cb, (uint32_t)wg_x, (uint32_t)wg_y, (uint32_t)wg_z);
+  else
+    {
+      size_t x, y, z;
+      for (z = 0; z < wg_z; z += d->max_wg_count[2])
+        for (y = 0; y < wg_y; y += d->max_wg_count[1])
+          for (x = 0; x < wg_x; x += d->max_wg_count[0])
+            vkCmdDispatchBase (
+                cb, (uint32_t)x, (uint32_t)y, (uint32_t)z,
+                (uint32_t)min (wg_x - x, (size_t)d->max_wg_count[0]),
+                (uint32_t)min (wg_y - y, (size_t)d->max_wg_count[1]),
+                (uint32_t)min (wg_z - z, (size_t)d->max_wg_count[2]));
+    }
 
-  begin_info.pInheritanceInfo = NULL;
-  VULKAN_CHECK (
-      vkBeginCommandBuffer (cb, &begin_info)); /* start recording commands. */
+  slot->descriptor_sets[0] = descriptor_sets[0];
+  slot->descriptor_sets[1] = descriptor_sets[1];
+  pocl_vulkan_ring_submit (d, slot, completed_cmd);
+}
 
-  vkCmdBindPipeline (cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
-  vkCmdBindDescriptorSets (cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout,
-                           0, ((descriptor_sets[1] ? 2 : 1)), descriptor_sets,
-                           0, NULL);
+void
+pocl_vulkan_run (void *data, _cl_command_node *cmd)
+{
+  pocl_vulkan_device_data_t *d = data;
+  pocl_vulkan_submit_run (d, cmd, NULL);
+  pocl_vulkan_drain (d);
+}
 
-  vkCmdDispatch (cb, (uint32_t)wg_x, (uint32_t)wg_y, (uint32_t)wg_z);
-  VULKAN_CHECK (vkEndCommandBuffer (cb)); /* end recording commands. */
+/* Whether the command only does staging copies between the host and a
+ * buffer, which run on the transfer queue: the reads, writes and maps, and
+ * the migrations of buffers to and from the host. */
+static int
+vulkan_is_transfer (pocl_vulkan_device_data_t *d, _cl_command_node *cmd)
+{
+  if (!d->has_transfer_queue)
+    return 0;
 
-  submit_CB (d, &cb);
+  switch (cmd->type)
+    {
+    case CL_COMMAND_READ_BUFFER:
+    case CL_COMMAND_WRITE_BUFFER:
+    case CL_COMMAND_MAP_BUFFER:
+    case CL_COMMAND_UNMAP_MEM_OBJECT:
+      return 1;
+    case CL_COMMAND_MIGRATE_MEM_OBJECTS:
+      if (cmd->command.migrate.type == ENQUEUE_MIGRATE_TYPE_NOP)
+        return 1;
+      if (cmd->command.migrate.type == ENQUEUE_MIGRATE_TYPE_D2D)
+        return 0;
+      return !cmd->event->mem_objs[0]->is_image;
+    default:
+      return 0;
+    }
+}
 
+/* Before waiting for the kernels in flight, starts the migrations further
+ * in the work queue that wait for nothing unfinished, i.e. the imports of
+ * the buffers of the commands enqueued after the one about to wait, so
+ * that they are copied while the kernels run. */
+static void
+vulkan_start_prefetches (pocl_vulkan_device_data_t *d)
+{
+  _cl_command_node *cmd, *next;
+
+  if (!d->has_transfer_queue || d->ring_count == 0)
+    return;
+
+  POCL_FAST_LOCK (d->wq_lock_fast);
+  for (cmd = d->work_queue; cmd != NULL; cmd = next)
+    {
+      next = cmd->next;
+      if (cmd->type != CL_COMMAND_MIGRATE_MEM_OBJECTS
+          || !vulkan_is_transfer (d, cmd)
+          || !pocl_command_is_ready (cmd->event))
+        continue;
+      DL_DELETE (d->work_queue, cmd);
+      POCL_FAST_UNLOCK (d->wq_lock_fast);
+      pocl_exec_command (cmd);
+      POCL_FAST_LOCK (d->wq_lock_fast);
+      /* the work queue may have changed meanwhile */
+      next = d->work_queue;
+    }
+  POCL_FAST_UNLOCK (d->wq_lock_fast);
+}
+
+/* Starts a command from the work queue. The kernels and the buffer copies
+ * are only submitted; the other commands access the memory from the host
+ * or wait for the device anyway, so they first wait for everything in
+ * flight and then run as before. */
+static void
+vulkan_start_command (pocl_vulkan_device_data_t *d, _cl_command_node *cmd)
+{
+  if (cmd->type == CL_COMMAND_NDRANGE_KERNEL)
+    {
+      pocl_update_event_running (cmd->event);
+      pocl_vulkan_submit_run (d, cmd, cmd);
+    }
+  else if (cmd->type == CL_COMMAND_COPY_BUFFER
+           && cmd->command.copy.src_content_size == NULL)
+    {
+      _cl_command_copy *co = &cmd->command.copy;
+      pocl_vulkan_mem_data_t *src = co->src_mem_id->mem_ptr;
+      pocl_vulkan_mem_data_t *dst = co->dst_mem_id->mem_ptr;
+      pocl_update_event_running (cmd->event);
 
-  if (descriptor_sets[0]) {
-    vkDestroyDescriptorSetLayout (d->device, descriptor_set_layouts[0], NULL);
-    VULKAN_CHECK (vkFreeDescriptorSets (d->device, d->buf_descriptor_pool,
-                                        1, descriptor_sets));
-  }
-  if (descriptor_sets[1]) {
-    vkDestroyDescriptorSetLayout (d->device, descriptor_set_layouts[1], NULL);
-    VULKAN_CHECK (vkFreeDescriptorSets (d->device, d->buf_descriptor_pool,
-                                        1, descriptor_sets+1));
-  }
+      pocl_vulkan_cb_slot_t *slot = pocl_vulkan_ring_begin (d);
+      VkBufferCopy copy;
+      copy.srcOffset = co->src_offset;
+      copy.dstOffset = co->dst_offset;
+      copy.size = co->size;
+      vkCmdCopyBuffer (slot->cb, src->device_buf, dst->device_buf, 1, &copy);
+      pocl_vulkan_ring_submit (d, slot, cmd);
+    }
+  else
+    {
+      /* the staging copies on the transfer queue can overlap the kernels
+       * in flight, unless the command waits for them */
+      int overlap
+          = vulkan_is_transfer (d, cmd) && pocl_command_is_ready (cmd->event);
+      if (!overlap)
+        {
+          vulkan_start_prefetches (d);
+          pocl_vulkan_drain (d);
+        }
+      pocl_exec_command (cmd);
+      return;
+    }
 
-  vkDestroyPipelineLayout (d->device, pipeline_layout, NULL);
-  vkDestroyPipeline (d->device, pipeline, NULL);
+  /* complete whatever has finished meanwhile */
+  pocl_vulkan_retire (d, 0);
 }
 
 static size_t
@@ -2803,13 +3856,19 @@ RETRY:
       DL_DELETE (d->work_queue, cmd);
       POCL_FAST_UNLOCK (d->wq_lock_fast);
 
-      assert (pocl_command_is_ready (cmd->event));
-      assert (cmd->event->status == CL_SUBMITTED);
-
-      pocl_exec_command (cmd);
+      /* the event may still wait for commands submitted before it, and
+       * the thread that pushed it may still hold it to mark it submitted */
+      vulkan_start_command (d, cmd);
 
       POCL_FAST_LOCK (d->wq_lock_fast);
     }
+  else if (d->ring_count > 0)
+    {
+      POCL_FAST_UNLOCK (d->wq_lock_fast);
+      pocl_vulkan_retire (d, POCL_VK_RETIRE_POLL_TIMEOUT);
+      POCL_FAST_LOCK (d->wq_lock_fast);
+      goto RETRY;
+    }
 
   if ((cmd == NULL) && (do_exit == 0))
     {
@@ -2862,9 +3921,9 @@ pocl_vulkan_actual_memobj_size (pocl_vulkan_device_data_t *d, cl_mem mem,
           mem->size,
           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
               | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-          VK_SHARING_MODE_EXCLUSIVE,
-          1,
-          &d->compute_queue_fam_index };
+          d->buf_sharing_mode,
+          d->num_buf_queue_fams,
+          d->buf_queue_fams };
 
   VULKAN_CHECK (vkCreateBuffer (d->device, &buffer_info, NULL, &buffer));
 
@@ -2880,6 +3939,201 @@ pocl_vulkan_actual_memobj_size (pocl_vulkan_device_data_t *d, cl_mem mem,
   return p->extra;
 }
 
+/* Binds a buffer into a block of the memory type, creating a new block if
+ * none has room. Returns NULL if the memory is exhausted. */
+static chunk_info_t *
+pocl_vulkan_suballoc (pocl_vulkan_device_data_t *d, uint32_t type,
+                      const VkMemoryRequirements *req, VkBuffer buf,
+                      pocl_vulkan_mem_block_t **block_out)
+{
+  pocl_vulkan_mem_block_t *b;
+  chunk_info_t *chunk = NULL;
+  /* the offsets of the buffers are used for descriptors and flushed
+   * ranges too, and padding the sizes keeps the flushed ranges inside
+   * the chunks */
+  size_t align = max (req->alignment, d->min_stor_align);
+  align = max (align, d->dev_props.limits.nonCoherentAtomSize);
+  /* the alignment of a region is 16 bits */
+  assert (align <= 32768);
+  size_t size = pocl_align_value (req->size, align);
+
+  POCL_LOCK (d->mem_lock);
+  LL_FOREACH (d->mem_blocks, b)
+    {
+      if (b->type != type || (b->region.alignment % align) != 0
+          || b->region.size < size)
+        continue;
+      chunk = pocl_alloc_buffer_from_region (&b->region, size);
+      if (chunk != NULL)
+        break;
+    }
+
+  if (chunk == NULL)
+    {
+      int dedicated = size > MEM_BLOCK_SIZE / 2;
+      VkDeviceSize block_size = dedicated ? size : MEM_BLOCK_SIZE;
+      VkMemoryAllocateInfo allocate_info
+          = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, block_size,
+              type };
+      VkDeviceMemory m;
+      /* out of device memory is not fatal, the runtime can evict other
+       * buffers and retry */
+      VkResult res = vkAllocateMemory (d->device, &allocate_info, NULL, &m);
+      if (res == VK_ERROR_OUT_OF_DEVICE_MEMORY
+          || res == VK_ERROR_OUT_OF_HOST_MEMORY)
+        {
+          POCL_MSG_PRINT_MEMORY (
+              "VULKAN block alloc of %zu bytes of type %u failed\n",
+              (size_t)block_size, type);
+          POCL_UNLOCK (d->mem_lock);
+          return NULL;
+        }
+      VULKAN_CHECK (res);
+
+      b = (pocl_vulkan_mem_block_t *)calloc (1, sizeof (*b));
+      b->memory = m;
+      b->type = type;
+      int host_visible = (d->mem_props.memoryTypes[type].propertyFlags
+                          & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+                         != 0;
+      if (host_visible)
+        VULKAN_CHECK (
+            vkMapMemory (d->device, m, 0, VK_WHOLE_SIZE, 0, &b->mapped));
+      pocl_init_mem_region (&b->region, 0, block_size);
+      b->region.alignment = align;
+      pocl_set_mem_region_strategy (
+          &b->region, dedicated ? BALLOCS_TIGHT
+                                : pocl_get_mem_region_strategy_option (
+                                    BALLOCS_SEGREGATED));
+      pocl_register_mem_region (&b->region, host_visible
+                                                ? "vulkan host-visible"
+                                                : "vulkan device-local");
+      LL_PREPEND (d->mem_blocks, b);
+      POCL_MSG_PRINT_MEMORY ("VULKAN new block of %zu bytes of type %u\n",
+                             (size_t)block_size, type);
+
+      chunk = pocl_alloc_buffer_from_region (&b->region, size);
+      assert (chunk != NULL);
+    }
+
+  ++b->num_buffers;
+  POCL_UNLOCK (d->mem_lock);
+
+  VULKAN_CHECK (
+      vkBindBufferMemory (d->device, buf, b->memory, chunk->start_address));
+  *block_out = b;
+  return chunk;
+}
+
+/* Releases a chunk of pocl_vulkan_suballoc, and the block with it if it
+ * is left empty and is not the last block of its memory type. */
+static void
+pocl_vulkan_suballoc_free (pocl_vulkan_device_data_t *d,
+                           pocl_vulkan_mem_block_t *block,
+                           chunk_info_t *chunk)
+{
+  pocl_vulkan_mem_block_t *b;
+
+  POCL_LOCK (d->mem_lock);
+  pocl_free_chunk (chunk);
+  if (--block->num_buffers == 0)
+    {
+      int keep = block->region.size == MEM_BLOCK_SIZE;
+      LL_FOREACH (d->mem_blocks, b)
+        if (b != block && b->type == block->type)
+          keep = 0;
+      if (!keep)
+        {
+          LL_DELETE (d->mem_blocks, block);
+          pocl_unregister_mem_region (&block->region);
+          /* this also unmaps it */
+          vkFreeMemory (d->device, block->memory, NULL);
+          POCL_MEM_FREE (block);
+        }
+    }
+  POCL_UNLOCK (d->mem_lock);
+}
+
+#ifdef VK_EXT_external_memory_host
+/* Imports the host memory of a CL_MEM_USE_HOST_PTR buffer as the memory of
+ * its device buffer, so the kernels and the mappings use it in place.
+ * Returns 0 if it can't be imported (e.g. it is not aligned enough). */
+static int
+pocl_vulkan_import_host_ptr (pocl_vulkan_device_data_t *d, cl_mem mem,
+                             pocl_vulkan_mem_data_t *memdata)
+{
+  VkDeviceSize align = d->host_ptr_import_align;
+  void *host_ptr = mem->mem_host_ptr;
+  const VkExternalMemoryHandleTypeFlagBits handle_type
+      = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+  uint32_t i, type = UINT32_MAX;
+
+  if (align == 0 || host_ptr == NULL || ((uintptr_t)host_ptr % align) != 0
+      || (mem->size % align) != 0)
+    return 0;
+
+  VkMemoryHostPointerPropertiesEXT ptr_props;
+  ptr_props.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+  ptr_props.pNext = NULL;
+  if (d->get_host_ptr_props (d->device, handle_type, host_ptr, &ptr_props)
+      != VK_SUCCESS)
+    return 0;
+
+  VkExternalMemoryBufferCreateInfo external_info
+      = { VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO, NULL,
+          handle_type };
+  VkBufferCreateInfo buffer_info
+      = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+          &external_info,
+          0,
+          mem->size,
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+              | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+          d->buf_sharing_mode,
+          d->num_buf_queue_fams,
+          d->buf_queue_fams };
+  VkBuffer b;
+  VULKAN_CHECK (vkCreateBuffer (d->device, &buffer_info, NULL, &b));
+
+  VkMemoryRequirements memReq;
+  vkGetBufferMemoryRequirements (d->device, b, &memReq);
+  uint32_t type_bits = ptr_props.memoryTypeBits & memReq.memoryTypeBits;
+  /* prefer the type of the other buffers */
+  if (type_bits & (1u << d->device_mem_type))
+    type = d->device_mem_type;
+  else
+    for (i = 0; i < d->mem_props.memoryTypeCount && type == UINT32_MAX; ++i)
+      if ((type_bits & (1u << i))
+          && (d->mem_props.memoryTypes[i].propertyFlags
+              & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+        type = i;
+
+  if (type == UINT32_MAX || memReq.size > mem->size)
+    {
+      vkDestroyBuffer (d->device, b, NULL);
+      return 0;
+    }
+
+  VkImportMemoryHostPointerInfoEXT import_info
+      = { VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT, NULL,
+          handle_type, host_ptr };
+  VkMemoryAllocateInfo allocate_info
+      = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, &import_info, mem->size,
+          type };
+  VkDeviceMemory m;
+  if (vkAllocateMemory (d->device, &allocate_info, NULL, &m) != VK_SUCCESS)
+    {
+      vkDestroyBuffer (d->device, b, NULL);
+      return 0;
+    }
+  VULKAN_CHECK (vkBindBufferMemory (d->device, b, m, 0));
+
+  memdata->device_buf = b;
+  memdata->device_mem = m;
+  return 1;
+}
+#endif
+
 int
 pocl_vulkan_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
 {
@@ -2902,10 +4156,19 @@ pocl_vulkan_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
   /* actual size already set up. */
   pocl_vulkan_mem_data_t *memdata
       = (pocl_vulkan_mem_data_t *)calloc (1, sizeof (pocl_vulkan_mem_data_t));
-  VkDeviceMemory m;
-  /* TODO host_ptr argument / CL_MEM_USE_HOST_PTR */
   void *vk_host_ptr = NULL;
 
+#ifdef VK_EXT_external_memory_host
+  if ((mem->flags & CL_MEM_USE_HOST_PTR) && !d->needs_staging_mem
+      && pocl_vulkan_import_host_ptr (d, mem, memdata))
+    {
+      vk_host_ptr = mem->mem_host_ptr;
+      POCL_MSG_PRINT_MEMORY ("VULKAN imported host ptr %p of %zu bytes\n",
+                             vk_host_ptr, mem->size);
+      goto FINISH;
+    }
+#endif
+
   /* DEVICE MEM */
   VkBufferCreateInfo buffer_info
       = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -2914,52 +4177,65 @@ pocl_vulkan_alloc_mem_obj (cl_device_id device, cl_mem mem, void *host_ptr)
           actual_mem_size,
           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
               | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-          VK_SHARING_MODE_EXCLUSIVE,
-          1,
-          &d->compute_queue_fam_index };
-
-  VkMemoryAllocateInfo allocate_info
-      = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, actual_mem_size,
-          d->device_mem_type };
+          d->buf_sharing_mode,
+          d->num_buf_queue_fams,
+          d->buf_queue_fams };
 
   VULKAN_CHECK (vkCreateBuffer (d->device, &buffer_info, NULL, &b));
   memdata->device_buf = b;
-  VULKAN_CHECK (vkAllocateMemory (d->device, &allocate_info, NULL, &m));
-  memdata->device_mem = m;
   vkGetBufferMemoryRequirements (d->device, memdata->device_buf, &memReq);
   assert (actual_mem_size == memReq.size);
-  VULKAN_CHECK (vkBindBufferMemory (d->device, memdata->device_buf,
-                                    memdata->device_mem, 0));
+  memdata->device_chunk = pocl_vulkan_suballoc (
+      d, d->device_mem_type, &memReq, b, &memdata->device_block);
+  if (memdata->device_chunk == NULL)
+    {
+      vkDestroyBuffer (d->device, b, NULL);
+      POCL_MEM_FREE (memdata);
+      goto ERROR;
+    }
+  memdata->device_mem = memdata->device_block->memory;
 
   /* STAGING MEM */
   if (d->needs_staging_mem)
     {
+      uint32_t type;
       if (mem->flags & (CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY))
-        allocate_info.memoryTypeIndex = d->host_staging_write_type;
+        type = d->host_staging_write_type;
       else
-        allocate_info.memoryTypeIndex = d->host_staging_read_type;
+        type = d->host_staging_read_type;
 
       VULKAN_CHECK (vkCreateBuffer (d->device, &buffer_info, NULL, &b));
       memdata->staging_buf = b;
-      VULKAN_CHECK (vkAllocateMemory (d->device, &allocate_info, NULL, &m));
-      memdata->staging_mem = m;
       vkGetBufferMemoryRequirements (d->device, memdata->staging_buf, &memReq);
       assert (actual_mem_size == memReq.size);
-      VULKAN_CHECK (vkBindBufferMemory (d->device, memdata->staging_buf,
-                                        memdata->staging_mem, 0));
-
-      VULKAN_CHECK (vkMapMemory (d->device, memdata->staging_mem, 0,
-                                 actual_mem_size, 0, &vk_host_ptr));
+      memdata->staging_chunk = pocl_vulkan_suballoc (
+          d, type, &memReq, b, &memdata->staging_block);
+      if (memdata->staging_chunk == NULL)
+        {
+          vkDestroyBuffer (d->device, b, NULL);
+          vkDestroyBuffer (d->device, memdata->device_buf, NULL);
+          pocl_vulkan_suballoc_free (d, memdata->device_block,
+                                     memdata->device_chunk);
+          POCL_MEM_FREE (memdata);
+          goto ERROR;
+        }
+      memdata->staging_mem = memdata->staging_block->memory;
+      memdata->staging_offset = memdata->staging_chunk->start_address;
+      vk_host_ptr
+          = (char *)memdata->staging_block->mapped + memdata->staging_offset;
     }
   else
     {
       memdata->staging_buf = 0;
       memdata->staging_mem = 0;
 
-      VULKAN_CHECK (vkMapMemory (d->device, memdata->device_mem, 0,
-                                 actual_mem_size, 0, &vk_host_ptr));
+      vk_host_ptr = (char *)memdata->device_block->mapped
+                    + memdata->device_chunk->start_address;
     }
 
+#ifdef VK_EXT_external_memory_host
+FINISH:
+#endif
   p->mem_ptr = memdata;
   p->version = 0;
   p->extra_ptr = vk_host_ptr;
@@ -2986,21 +4262,18 @@ pocl_vulkan_free (cl_device_id device, cl_mem mem)
 
   if (d->needs_staging_mem)
     {
-      vkUnmapMemory (d->device, memdata->staging_mem);
-
       vkDestroyBuffer (d->device, memdata->staging_buf, NULL);
-      vkFreeMemory (d->device, memdata->staging_mem, NULL);
-
-      vkDestroyBuffer (d->device, memdata->device_buf, NULL);
-      vkFreeMemory (d->device, memdata->device_mem, NULL);
+      pocl_vulkan_suballoc_free (d, memdata->staging_block,
+                                 memdata->staging_chunk);
     }
-  else
-    {
-      vkUnmapMemory (d->device, memdata->device_mem);
 
-      vkDestroyBuffer (d->device, memdata->device_buf, NULL);
-      vkFreeMemory (d->device, memdata->device_mem, NULL);
-    }
+  vkDestroyBuffer (d->device, memdata->device_buf, NULL);
+  /* imported host memory has no block */
+  if (memdata->device_block == NULL)
+    vkFreeMemory (d->device, memdata->device_mem, NULL);
+  else
+    pocl_vulkan_suballoc_free (d, memdata->device_block,
+                               memdata->device_chunk);
 
   POCL_MSG_PRINT_MEMORY ("VULKAN DEVICE FREE PTR %p SIZE %zu \n", p->mem_ptr,
                          mem->size);
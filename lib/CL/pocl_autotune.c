@@ -0,0 +1,409 @@
+/* OpenCL runtime library: local size autotuning
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pocl_autotune.h"
+#include "pocl_cache.h"
+#include "pocl_file_util.h"
+#include "pocl_runtime_config.h"
+#include "pocl_util.h"
+#include "utlist.h"
+
+int pocl_autotune_enabled = 0;
+
+/* Each candidate runs this many times and its fastest run counts, so that
+   the cold caches of the first launch don't decide. */
+#define POCL_AUTOTUNE_RUNS 2
+#define POCL_AUTOTUNE_MAX_CANDIDATES 8
+#define POCL_AUTOTUNE_FILENAME "/local_sizes"
+
+struct pocl_autotune_entry
+{
+  /* the key: the program device index and the global size class */
+  unsigned device_i;
+  cl_uint work_dim;
+  unsigned size_class[3];
+
+  /* set once the winner is known, measured or loaded from the cache */
+  int tuned;
+  size_t local[3];
+
+  size_t candidates[POCL_AUTOTUNE_MAX_CANDIDATES][3];
+  /* the fastest run of each candidate, 0 if none has finished */
+  uint64_t best_ns[POCL_AUTOTUNE_MAX_CANDIDATES];
+  unsigned num_candidates;
+  /* the launches that measure a candidate, and those of them finished */
+  unsigned issued;
+  unsigned measured;
+
+  pocl_autotune_entry *next;
+};
+
+typedef struct autotune_run
+{
+  cl_kernel kernel;
+  pocl_autotune_entry *entry;
+  unsigned candidate;
+} autotune_run;
+
+void
+pocl_autotune_init ()
+{
+  pocl_autotune_enabled
+      = pocl_get_bool_option ("POCL_AUTOTUNE_LOCAL_SIZE", 0);
+}
+
+static unsigned
+size_class (size_t size)
+{
+  unsigned c = 0;
+  while (size >>= 1)
+    ++c;
+  return c;
+}
+
+/* Returns 1 if local is a valid local size for global on dev. */
+static int
+local_size_fits (cl_device_id dev, cl_uint work_dim, const size_t *global,
+                 const size_t *local)
+{
+  cl_uint i;
+  size_t total = 1;
+  for (i = 0; i < work_dim; ++i)
+    {
+      if (local[i] == 0 || local[i] > dev->max_work_item_sizes[i]
+          || global[i] % local[i] != 0)
+        return 0;
+      total *= local[i];
+    }
+  return total <= dev->max_work_group_size;
+}
+
+static void
+add_candidate (pocl_autotune_entry *e, cl_device_id dev,
+               const size_t *global, const size_t *local)
+{
+  unsigned i;
+  if (e->num_candidates == POCL_AUTOTUNE_MAX_CANDIDATES
+      || !local_size_fits (dev, e->work_dim, global, local))
+    return;
+  for (i = 0; i < e->num_candidates; ++i)
+    if (memcmp (e->candidates[i], local, 3 * sizeof (size_t)) == 0)
+      return;
+  memcpy (e->candidates[e->num_candidates++], local, 3 * sizeof (size_t));
+}
+
+/* The candidates are the local size of the optimizer, and the ones with one
+   of its dimensions 2 or 4 times larger or smaller. */
+static void
+setup_candidates (pocl_autotune_entry *e, cl_device_id dev,
+                  const size_t *global, const size_t *local)
+{
+  static const size_t factors[] = { 2, 4 };
+  size_t l[3];
+  cl_uint d;
+  unsigned f;
+
+  add_candidate (e, dev, global, local);
+  for (d = 0; d < e->work_dim; ++d)
+    for (f = 0; f < sizeof (factors) / sizeof (factors[0]); ++f)
+      {
+        memcpy (l, local, sizeof (l));
+        l[d] = local[d] * factors[f];
+        add_candidate (e, dev, global, l);
+        if (local[d] % factors[f] == 0)
+          {
+            l[d] = local[d] / factors[f];
+            add_candidate (e, dev, global, l);
+          }
+      }
+
+  if (e->num_candidates < 2)
+    {
+      /* nothing to choose from */
+      e->tuned = 1;
+      memcpy (e->local, local, sizeof (e->local));
+    }
+}
+
+static pocl_autotune_entry *
+find_entry (cl_kernel kernel, unsigned device_i, cl_uint work_dim,
+            const unsigned *classes)
+{
+  pocl_autotune_entry *e;
+  LL_FOREACH (kernel->autotune_entries, e)
+    if (e->device_i == device_i && e->work_dim == work_dim
+        && memcmp (e->size_class, classes, sizeof (e->size_class)) == 0)
+      return e;
+  return NULL;
+}
+
+static pocl_autotune_entry *
+new_entry (cl_kernel kernel, unsigned device_i, cl_uint work_dim,
+           const unsigned *classes)
+{
+  pocl_autotune_entry *e
+      = (pocl_autotune_entry *)calloc (1, sizeof (pocl_autotune_entry));
+  if (e == NULL)
+    return NULL;
+  e->device_i = device_i;
+  e->work_dim = work_dim;
+  memcpy (e->size_class, classes, sizeof (e->size_class));
+  LL_PREPEND (kernel->autotune_entries, e);
+  return e;
+}
+
+static int
+tuned_file_path (char *path, cl_kernel kernel, unsigned device_i)
+{
+  if (!pocl_cache_enabled ())
+    return -1;
+  pocl_cache_kernel_cachedir (path, kernel->program, device_i, kernel->name);
+  if (strlen (path) + sizeof (POCL_AUTOTUNE_FILENAME) > POCL_FILENAME_LENGTH)
+    return -1;
+  return 0;
+}
+
+/* Loads the local sizes tuned by the earlier processes. Called with the
+   kernel locked. */
+static void
+load_tuned (cl_kernel kernel, unsigned device_i)
+{
+  char path[POCL_FILENAME_LENGTH];
+  char *content = NULL, *p;
+  uint64_t size = 0;
+  unsigned work_dim, classes[3];
+  size_t local[3];
+  int n;
+
+  if (tuned_file_path (path, kernel, device_i))
+    return;
+  strcat (path, POCL_AUTOTUNE_FILENAME);
+  if (!pocl_exists (path) || pocl_read_file (path, &content, &size) != 0)
+    return;
+
+  /* pocl_read_file adds no terminating zero */
+  p = (char *)realloc (content, size + 1);
+  if (p == NULL)
+    {
+      POCL_MEM_FREE (content);
+      return;
+    }
+  content = p;
+  content[size] = 0;
+
+  while (sscanf (p, "%u %u %u %u %zu %zu %zu\n%n", &work_dim, &classes[0],
+                 &classes[1], &classes[2], &local[0], &local[1], &local[2],
+                 &n)
+         == 7)
+    {
+      p += n;
+      if (work_dim < 1 || work_dim > 3
+          || find_entry (kernel, device_i, work_dim, classes))
+        continue;
+      pocl_autotune_entry *e = new_entry (kernel, device_i, work_dim, classes);
+      if (e == NULL)
+        break;
+      e->tuned = 1;
+      memcpy (e->local, local, sizeof (e->local));
+    }
+  POCL_MEM_FREE (content);
+}
+
+/* Writes out the tuned local sizes of the kernel on the device, including
+   the ones loaded from the file. */
+static void
+save_tuned (cl_kernel kernel, unsigned device_i)
+{
+  char path[POCL_FILENAME_LENGTH];
+  pocl_autotune_entry *e;
+  size_t len = 0, cap = 0;
+  char *content = NULL;
+
+  if (tuned_file_path (path, kernel, device_i))
+    return;
+
+  POCL_LOCK_OBJ (kernel);
+  LL_FOREACH (kernel->autotune_entries, e)
+    if (e->device_i == device_i && e->tuned)
+      cap += 128;
+  content = (char *)malloc (cap + 1);
+  if (content != NULL)
+    LL_FOREACH (kernel->autotune_entries, e)
+      if (e->device_i == device_i && e->tuned)
+        len += snprintf (content + len, cap + 1 - len,
+                         "%u %u %u %u %zu %zu %zu\n", e->work_dim,
+                         e->size_class[0], e->size_class[1], e->size_class[2],
+                         e->local[0], e->local[1], e->local[2]);
+  POCL_UNLOCK_OBJ (kernel);
+
+  if (content != NULL && pocl_mkdir_p (path) == 0)
+    {
+      strcat (path, POCL_AUTOTUNE_FILENAME);
+      pocl_write_file (path, content, len, 0, 0);
+    }
+  POCL_MEM_FREE (content);
+}
+
+int
+pocl_autotune_local_size (cl_kernel kernel, cl_command_queue queue,
+                          cl_uint work_dim, const size_t *global,
+                          size_t *local, pocl_autotune_entry **entry)
+{
+  cl_program program = kernel->program;
+  cl_device_id dev = queue->device;
+  cl_device_id realdev = pocl_real_dev (dev);
+  unsigned classes[3], device_i;
+  int candidate = -1;
+  cl_uint i;
+
+  /* the devices with their own timer only time the profiled queues */
+  if (dev->has_own_timer && !(queue->properties & CL_QUEUE_PROFILING_ENABLE))
+    return -1;
+
+  for (device_i = 0; device_i < program->num_devices; ++device_i)
+    if (program->devices[device_i] == realdev)
+      break;
+  if (device_i == program->num_devices)
+    return -1;
+
+  for (i = 0; i < 3; ++i)
+    classes[i] = i < work_dim ? size_class (global[i]) : 0;
+
+  POCL_LOCK_OBJ (kernel);
+  if (kernel->autotune_loaded == NULL)
+    kernel->autotune_loaded = (char *)calloc (program->num_devices, 1);
+  if (kernel->autotune_loaded && !kernel->autotune_loaded[device_i])
+    {
+      kernel->autotune_loaded[device_i] = 1;
+      load_tuned (kernel, device_i);
+    }
+
+  pocl_autotune_entry *e = find_entry (kernel, device_i, work_dim, classes);
+  if (e == NULL)
+    {
+      e = new_entry (kernel, device_i, work_dim, classes);
+      if (e)
+        setup_candidates (e, dev, global, local);
+    }
+
+  if (e == NULL)
+    ;
+  else if (e->tuned)
+    {
+      if (local_size_fits (dev, work_dim, global, e->local))
+        memcpy (local, e->local, sizeof (e->local));
+    }
+  else if (e->issued < e->num_candidates * POCL_AUTOTUNE_RUNS)
+    {
+      unsigned c = e->issued % e->num_candidates;
+      if (local_size_fits (dev, work_dim, global, e->candidates[c]))
+        {
+          memcpy (local, e->candidates[c], sizeof (e->candidates[c]));
+          candidate = (int)c;
+          *entry = e;
+        }
+    }
+  POCL_UNLOCK_OBJ (kernel);
+
+  return candidate;
+}
+
+static void CL_CALLBACK
+autotune_run_finished (cl_event event, cl_int status, void *data)
+{
+  autotune_run *run = (autotune_run *)data;
+  cl_kernel kernel = run->kernel;
+  pocl_autotune_entry *e = run->entry;
+  unsigned c = run->candidate, i, best = 0;
+  uint64_t ns = 0;
+  int save = 0;
+
+  const pocl_event_profile *prof = pocl_event_profile_of (event);
+  if (status == CL_COMPLETE && prof->time_end > prof->time_start)
+    ns = prof->time_end - prof->time_start;
+
+  POCL_LOCK_OBJ (kernel);
+  if (ns > 0 && (e->best_ns[c] == 0 || ns < e->best_ns[c]))
+    e->best_ns[c] = ns;
+  ++e->measured;
+  if (!e->tuned && e->measured == e->num_candidates * POCL_AUTOTUNE_RUNS)
+    {
+      for (i = 1; i < e->num_candidates; ++i)
+        if (e->best_ns[i] > 0
+            && (e->best_ns[best] == 0 || e->best_ns[i] < e->best_ns[best]))
+          best = i;
+      memcpy (e->local, e->candidates[best], sizeof (e->local));
+      e->tuned = 1;
+      save = 1;
+      POCL_MSG_PRINT_INFO ("Tuned the local size of %s to %zu x %zu x %zu "
+                           "(%" PRIu64 " ns)\n",
+                           kernel->name, e->local[0], e->local[1],
+                           e->local[2], e->best_ns[best]);
+    }
+  POCL_UNLOCK_OBJ (kernel);
+
+  if (save)
+    save_tuned (kernel, e->device_i);
+
+  POname (clReleaseKernel) (kernel);
+  POCL_MEM_FREE (run);
+}
+
+void
+pocl_autotune_measure (cl_kernel kernel, pocl_autotune_entry *entry,
+                       int candidate, cl_event event)
+{
+  autotune_run *run = (autotune_run *)malloc (sizeof (autotune_run));
+  if (run == NULL)
+    return;
+  run->kernel = kernel;
+  run->entry = entry;
+  run->candidate = (unsigned)candidate;
+
+  POCL_LOCK_OBJ (kernel);
+  ++entry->issued;
+  POCL_UNLOCK_OBJ (kernel);
+
+  POname (clRetainKernel) (kernel);
+  /* the command is not enqueued yet, nothing else looks at the event */
+  if (pocl_event_alloc_profile (event))
+    event->timestamped = 1;
+  POname (clSetEventCallback) (event, CL_COMPLETE, autotune_run_finished,
+                               run);
+}
+
+void
+pocl_autotune_free (cl_kernel kernel)
+{
+  pocl_autotune_entry *e, *tmp;
+  LL_FOREACH_SAFE (kernel->autotune_entries, e, tmp)
+    {
+      LL_DELETE (kernel->autotune_entries, e);
+      POCL_MEM_FREE (e);
+    }
+  POCL_MEM_FREE (kernel->autotune_loaded);
+}
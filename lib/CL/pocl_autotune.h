@@ -0,0 +1,62 @@
+/* OpenCL runtime library: local size autotuning
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* With POCL_AUTOTUNE_LOCAL_SIZE, the NDRange launches of a kernel with no
+   local size are tuned per device and per global size class, the class being
+   the floor of the log2 of the global size in each dimension. The first
+   launches of a class run a few candidate local sizes around the one the
+   device's optimizer chose, round-robin, and the commands are timed with the
+   profiling time stamps. The candidate with the fastest run is used by the
+   later launches of the class, and is stored in the kernel's directory in
+   the kernel cache, from where the later processes load it. */
+
+#ifndef POCL_AUTOTUNE_H
+#define POCL_AUTOTUNE_H
+
+#include "pocl_cl.h"
+
+/* Set to 1 by pocl_autotune_init if POCL_AUTOTUNE_LOCAL_SIZE is set. */
+extern int pocl_autotune_enabled;
+
+typedef struct pocl_autotune_entry pocl_autotune_entry;
+
+void pocl_autotune_init ();
+
+/* Called with the local size the device's optimizer chose for a launch of
+   kernel on queue in local. Replaces it with the tuned local size of the
+   global size class, if there is one. Otherwise, if the class is being
+   tuned, replaces it with the candidate the launch is to measure, and
+   returns the index of the candidate and its entry in *entry, to be given
+   to pocl_autotune_measure. Returns -1 if the launch measures nothing. */
+int pocl_autotune_local_size (cl_kernel kernel, cl_command_queue queue,
+                              cl_uint work_dim, const size_t *global,
+                              size_t *local, pocl_autotune_entry **entry);
+
+/* Times the command of event, which runs the given candidate. */
+void pocl_autotune_measure (cl_kernel kernel, pocl_autotune_entry *entry,
+                            int candidate, cl_event event);
+
+/* Frees the tuning state of a kernel that is being released. */
+void pocl_autotune_free (cl_kernel kernel);
+
+#endif
@@ -30,6 +30,7 @@
 #include "pocl_binary.h"
 #include "pocl_cache.h"
 #include "pocl_file_util.h"
+#include "pocl_util.h"
 
 #include <sys/stat.h>
 #include <dirent.h>
@@ -54,9 +55,24 @@
                           add has_arg_metadata & kernel attributes */
 /* changes for version 8: compilation parameters are stored in module metadata
                           */
+/* changes for version 9: the files of program.bc and the kernel cachedirs
+                          are no longer serialized inline, but in a data
+                          area at the end of the binary, indexed by a table
+                          of contents right after the header. Kernel records
+                          have binaries_size 0. This allows locating (and
+                          unpacking) single files without parsing the whole
+                          binary. */
+/* changes for version 10: kernel records store the per-work-item private
+                           memory and __local stride estimates */
+/* changes for version 11: kernel records store gid_local_access */
+/* changes for version 12: kernel records store nonuniform_safe */
 
 #define FIRST_SUPPORTED_POCLCC_VERSION 8
-#define POCLCC_VERSION 8
+#define POCLCC_VERSION 12
+/* the first version with the table of contents */
+#define POCLCC_TOC_VERSION 9
+/* alignment of the files in the data area, relative to the binary start */
+#define POCLCC_DATA_ALIGNMENT 64
 
 /* pocl binary structures */
 
@@ -64,7 +80,12 @@
  * 1) for integer values, endianness is forced to LITTLE_ENDIAN
  * 2) pointers in general are not written at all, rather reconstructed from data
  * 3) char* strings are written as: | uint32_t strlen | strlen bytes of content |
- * 4) files are written as two strings: | uint32_t | relative filename | uint32_t | content |
+ * 4) in versions < 9, files are written as two strings:
+ *    | uint32_t | relative filename | uint32_t | content |
+ * 5) from version 9 on, the table of contents after the header is
+ *    | uint32_t num_files | num_files * toc entry |, each entry being
+ *    | uint32_t | relative filename | uint64_t offset | uint64_t size |,
+ *    with the offset of the file content relative to the binary start.
  */
 
 typedef struct pocl_binary_kernel_s
@@ -97,6 +118,12 @@ typedef struct pocl_binary_kernel_s
 
   uint64_t has_arg_metadata;
 
+  /* per-work-item memory footprint estimates */
+  uint64_t private_mem_per_wi;
+  uint64_t local_mem_wi_stride;
+  uint32_t gid_local_access;
+  uint32_t nonuniform_safe;
+
   uint32_t sizeof_attributes;
   char* attributes;
 
@@ -289,32 +316,52 @@ pocl_binary_get_kernel_count (cl_program program, unsigned device_i)
 }
 /***********************************************************/
 
-/* serializes a single file. */
-static unsigned char*
-serialize_file(char* path, size_t basedir_offset, unsigned char* buffer)
+/* A file of the program's cache directory to serialize. */
+typedef struct pocl_binary_file_s
 {
-  char* content;
-  uint64_t fsize;
-  char* p = path + basedir_offset;
-  BUFFER_STORE_STR(p);
-  pocl_read_file(path, &content, &fsize);
-  BUFFER_STORE_STR2(content, fsize);
-  free(content);
-  return buffer;
+  char path[POCL_FILENAME_LENGTH];
+  /* offset of the relative path in path */
+  size_t basedir_offset;
+  /* in the serialized binary, the location of the offset & size fields
+   * of the file's TOC entry */
+  unsigned char *toc_slot;
+} pocl_binary_file;
+
+typedef struct pocl_binary_file_list_s
+{
+  pocl_binary_file *files;
+  unsigned num;
+  unsigned capacity;
+} pocl_binary_file_list;
+
+static void
+add_file (pocl_binary_file_list *list, const char *path, size_t basedir_offset)
+{
+  if (list->num == list->capacity)
+    {
+      list->capacity = list->capacity ? list->capacity * 2 : 16;
+      list->files = realloc (list->files,
+                             list->capacity * sizeof (pocl_binary_file));
+      assert (list->files);
+    }
+  pocl_binary_file *f = &list->files[list->num++];
+  strncpy (f->path, path, POCL_FILENAME_LENGTH - 1);
+  f->path[POCL_FILENAME_LENGTH - 1] = 0;
+  f->basedir_offset = basedir_offset;
+  f->toc_slot = NULL;
 }
 
-/* recursively serializes files/directories by calling
- * either itself (on directory), or serialize_file (on files) */
-static unsigned char*
-recursively_serialize_path (char* path,
-                            size_t basedir_offset,
-                            unsigned char* buffer)
+/* recursively collects files/directories by calling
+ * either itself (on directory), or add_file (on files) */
+static void
+recursively_collect_path (char *path, size_t basedir_offset,
+                          pocl_binary_file_list *list)
 {
   struct stat st;
   stat (path, &st);
 
   if (S_ISREG (st.st_mode))
-    buffer = serialize_file (path, basedir_offset, buffer);
+    add_file (list, path, basedir_offset);
 
   if (S_ISDIR (st.st_mode))
     {
@@ -331,21 +378,16 @@ recursively_serialize_path (char* path,
           if (strcmp (entry->d_name, ".") == 0) continue;
           if (strcmp (entry->d_name, "..") == 0) continue;
           strcpy (p, entry->d_name);
-          buffer =
-            recursively_serialize_path (subpath, basedir_offset, buffer);
+          recursively_collect_path (subpath, basedir_offset, list);
         }
       closedir (d);
     }
-
-  return buffer;
 }
 
-/* serializes an entire pocl kernel cachedir. */
-static unsigned char*
-serialize_kernel_cachedir (cl_program program,
-                           const char* kernel_name,
-                           unsigned device_i,
-                           unsigned char* buffer)
+/* collects the files of an entire pocl kernel cachedir. */
+static void
+collect_kernel_cachedir (cl_program program, const char *kernel_name,
+                         unsigned device_i, pocl_binary_file_list *list)
 {
   char path[POCL_FILENAME_LENGTH];
   char basedir[POCL_FILENAME_LENGTH];
@@ -357,11 +399,9 @@ serialize_kernel_cachedir (cl_program program,
   POCL_MSG_PRINT_INFO ("Kernel %s: recur serializing cachedir %s\n",
                        kernel_name, path);
   if (pocl_exists (path))
-    buffer = recursively_serialize_path (path, basedir_len, buffer);
+    recursively_collect_path (path, basedir_len, list);
   else
     POCL_MSG_ERR ("CAN't serialize %s - doesn't exist \n", path);
-
-  return buffer;
 }
 
 /* serializes a single kernel */
@@ -396,6 +436,10 @@ pocl_binary_serialize_kernel_to_buffer(cl_program program,
   uint32_t attrlen = meta->attributes ? strlen (meta->attributes) : 0;
   BUFFER_STORE_STR2(meta->attributes, attrlen);
   BUFFER_STORE(meta->has_arg_metadata, uint64_t);
+  BUFFER_STORE (meta->private_mem_per_wi, uint64_t);
+  BUFFER_STORE (meta->local_mem_wi_stride, uint64_t);
+  BUFFER_STORE (meta->gid_local_access, uint32_t);
+  BUFFER_STORE (meta->nonuniform_safe, uint32_t);
 
   /***********************************************************************/
   unsigned char *start = buffer;
@@ -414,9 +458,9 @@ pocl_binary_serialize_kernel_to_buffer(cl_program program,
 
   uint32_t arginfo_size = buffer - start;
 
-  unsigned char *end
-      = serialize_kernel_cachedir (program, meta->name, device_i, buffer);
-  uint64_t binaries_size = end - buffer;
+  /* the kernel cachedir files are in the data area */
+  unsigned char *end = buffer;
+  uint64_t binaries_size = 0;
 
   /* write struct size properly */
   buffer = buf;
@@ -485,31 +529,87 @@ deserialize_kernel_cachedir (char* basedir, unsigned char* buffer, size_t bytes)
   return (buffer + done);
 }
 
+/* An entry of the table of contents, pointing into the binary. */
+typedef struct pocl_binary_toc_entry_s
+{
+  const char *relpath;
+  uint32_t relpath_len;
+  uint64_t offset;
+  uint64_t size;
+} pocl_binary_toc_entry;
+
+static unsigned char *
+read_toc_entry (unsigned char *buffer, pocl_binary_toc_entry *e)
+{
+  BUFFER_READ (e->relpath_len, uint32_t);
+  e->relpath = (const char *)buffer;
+  buffer += e->relpath_len;
+  BUFFER_READ (e->offset, uint64_t);
+  BUFFER_READ (e->size, uint64_t);
+  return buffer;
+}
 
+/* Writes the file of the TOC entry into basedir, unless it exists. */
+static int
+unpack_toc_entry (const unsigned char *binary, pocl_binary_toc_entry *e,
+                  char *basedir, size_t offset)
+{
+  if (offset + e->relpath_len >= POCL_FILENAME_LENGTH)
+    return CL_INVALID_BINARY;
+  memcpy (basedir + offset, e->relpath, e->relpath_len);
+  basedir[offset + e->relpath_len] = 0;
 
-/* Deserializes a single kernel.
+  int error = 0;
+  if (!pocl_exists (basedir))
+    {
+      char *dir = strdup (basedir);
+      char *dirpath = dirname (dir);
+      if (!pocl_exists (dirpath))
+        pocl_mkdir_p (dirpath);
+      free (dir);
+      error = pocl_write_file (basedir, (const char *)binary + e->offset,
+                               e->size, 0, 1);
+    }
+  basedir[offset] = 0;
+  return error ? CL_OUT_OF_RESOURCES : CL_SUCCESS;
+}
 
-   This has two modes of operation:
+/* Returns the position of the first kernel record, skipping program.bc
+ * (before version 9) or the table of contents. */
+static unsigned char *
+skip_to_kernels (pocl_binary *b, unsigned char *buffer)
+{
+  if (b->version >= POCLCC_TOC_VERSION)
+    {
+      uint32_t num_files, i;
+      pocl_binary_toc_entry e;
+      BUFFER_READ (num_files, uint32_t);
+      for (i = 0; i < num_files; ++i)
+        buffer = read_toc_entry (buffer, &e);
+      return buffer;
+    }
 
-   1) if kernel_index is >= 0 it only fills in pocl_binary_kernel
-   with metadata (doesn't unpack files) and only if the name matches - used by
-   pocl_binary_get_kernel_metadata()
+  size_t len;
+  /* skip real path of program.bc */
+  BUFFER_READ(len, uint32_t);
+  assert (len > 0);
+  buffer += len;
 
-   2) if name_len and name_match are NULL, unpacks kernel cachedir on disk, but
-   does not set up kernel metadata of pocl_binary_kernel argument - used by
-   pocl_binary_deserialize()
- */
+  /* skip content of program.bc */
+  BUFFER_READ(len, uint32_t);
+  assert (len > 0);
+  buffer += len;
+  return buffer;
+}
 
-static int
-pocl_binary_deserialize_kernel_from_buffer (pocl_binary *b,
-                                            unsigned char **buf,
-                                            pocl_binary_kernel *kernel,
-                                            pocl_kernel_metadata_t *meta,
-                                            char *basedir)
+
+
+/* Reads the head of a kernel record: the sizes, the name, the numbers of
+   arguments and locals and reqd_wg_size. Returns the position after it. */
+static unsigned char *
+read_kernel_record_head (unsigned char *buffer, pocl_binary_kernel *kernel)
 {
   unsigned i;
-  unsigned char *buffer = *buf;
-  uint64_t *dynarg_sizes;
 
   memset(kernel, 0, sizeof(pocl_binary_kernel));
   BUFFER_READ(kernel->struct_size, uint64_t);
@@ -519,84 +619,116 @@ pocl_binary_deserialize_kernel_from_buffer (pocl_binary *b,
   BUFFER_READ(kernel->num_args, uint32_t);
   BUFFER_READ(kernel->num_locals, uint32_t);
 
-  dynarg_sizes = alloca (sizeof(uint64_t) * kernel->num_args);
-
   for (i = 0; i < OPENCL_MAX_DIMENSION; i++)
     {
       BUFFER_READ(kernel->reqd_wg_size[i], uint64_t);
     }
+  return buffer;
+}
 
-  if (meta)
+/* Reads the rest of the metadata of a kernel record, from the position
+   read_kernel_record_head() returned, into kernel and the arg_info of
+   meta. */
+static int
+read_kernel_record_metadata (pocl_binary *b, unsigned char *buffer,
+                             pocl_binary_kernel *kernel,
+                             pocl_kernel_metadata_t *meta)
+{
+  unsigned i;
+  uint64_t *dynarg_sizes = alloca (sizeof(uint64_t) * kernel->num_args);
+
+  if (b->version < 7)
     {
-      if (b->version < 7)
+      for (i = 0; i < kernel->num_args; i++)
         {
-          for (i = 0; i < kernel->num_args; i++)
-            {
-              BUFFER_READ (dynarg_sizes[i], uint64_t);
-            }
+          BUFFER_READ (dynarg_sizes[i], uint64_t);
         }
+    }
 
-      kernel->local_sizes = calloc (kernel->num_locals, sizeof (size_t));
-      for (i = 0; i < kernel->num_locals; i++)
+  kernel->local_sizes = calloc (kernel->num_locals, sizeof (size_t));
+  for (i = 0; i < kernel->num_locals; i++)
+    {
+      uint64_t temp;
+      BUFFER_READ (temp, uint64_t);
+      kernel->local_sizes[i] = temp;
+    }
+
+  if (b->version >= 7)
+    {
+      BUFFER_READ_STR2(kernel->attributes, kernel->sizeof_attributes);
+      BUFFER_READ(kernel->has_arg_metadata, uint64_t);
+    }
+  else
+    {
+      kernel->attributes = NULL;
+      kernel->has_arg_metadata = (-1);
+    }
+
+  if (b->version >= 10)
+    {
+      BUFFER_READ (kernel->private_mem_per_wi, uint64_t);
+      BUFFER_READ (kernel->local_mem_wi_stride, uint64_t);
+    }
+  if (b->version >= 11)
+    {
+      BUFFER_READ (kernel->gid_local_access, uint32_t);
+    }
+  if (b->version >= 12)
+    {
+      BUFFER_READ (kernel->nonuniform_safe, uint32_t);
+    }
+
+  meta->arg_info = calloc (kernel->num_args, sizeof (struct pocl_argument_info));
+  POCL_RETURN_ERROR_COND ((!meta->arg_info), CL_OUT_OF_HOST_MEMORY);
+
+  for (i = 0; i < kernel->num_args; i++)
+    {
+      pocl_argument_info *ai = &meta->arg_info[i];
+      BUFFER_READ (ai->access_qualifier, cl_kernel_arg_access_qualifier);
+      BUFFER_READ (ai->address_qualifier, cl_kernel_arg_address_qualifier);
+      BUFFER_READ (ai->type_qualifier, cl_kernel_arg_type_qualifier);
+      if (b->version < 7)
         {
-          uint64_t temp;
-          BUFFER_READ (temp, uint64_t);
-          kernel->local_sizes[i] = temp;
+          char t1, t2;
+          BUFFER_READ (t1, char);
+          BUFFER_READ (t2, char);
         }
 
+      BUFFER_READ (ai->type, uint32_t);
       if (b->version >= 7)
         {
-          BUFFER_READ_STR2(kernel->attributes, kernel->sizeof_attributes);
-          BUFFER_READ(kernel->has_arg_metadata, uint64_t);
+          BUFFER_READ (ai->type_size, uint32_t);
         }
       else
         {
-          kernel->attributes = NULL;
-          kernel->has_arg_metadata = (-1);
+          ai->type_size = dynarg_sizes[i];
         }
+      BUFFER_READ_STR (ai->name);
+      BUFFER_READ_STR (ai->type_name);
+    }
 
-      meta->arg_info = calloc (kernel->num_args, sizeof (struct pocl_argument_info));
-      POCL_RETURN_ERROR_COND ((!meta->arg_info), CL_OUT_OF_HOST_MEMORY);
+  return CL_SUCCESS;
+}
 
-      for (i = 0; i < kernel->num_args; i++)
-        {
-          pocl_argument_info *ai = &meta->arg_info[i];
-          BUFFER_READ (ai->access_qualifier, cl_kernel_arg_access_qualifier);
-          BUFFER_READ (ai->address_qualifier, cl_kernel_arg_address_qualifier);
-          BUFFER_READ (ai->type_qualifier, cl_kernel_arg_type_qualifier);
-          if (b->version < 7)
-            {
-              char t1, t2;
-              BUFFER_READ (t1, char);
-              BUFFER_READ (t2, char);
-            }
-
-          BUFFER_READ (ai->type, uint32_t);
-          if (b->version >= 7)
-            {
-              BUFFER_READ (ai->type_size, uint32_t);
-            }
-          else
-            {
-              ai->type_size = dynarg_sizes[i];
-            }
-          BUFFER_READ_STR (ai->name);
-          BUFFER_READ_STR (ai->type_name);
-        }
+/* Unpacks the kernel cachedir of a kernel record of a binary older than
+   POCLCC_TOC_VERSION on disk, and skips to the next record - used by
+   pocl_binary_deserialize(). */
+static int
+pocl_binary_deserialize_kernel_from_buffer (unsigned char **buf,
+                                            pocl_binary_kernel *kernel,
+                                            char *basedir)
+{
+  unsigned char *buffer;
 
-    }
-  else
-    {
-      /* skip the arg_info and all kernel metadata */
-      buffer = *buf + (kernel->struct_size - kernel->binaries_size);
-      deserialize_kernel_cachedir (basedir, buffer, kernel->binaries_size);
-      POCL_MEM_FREE (kernel->kernel_name);
-    }
+  read_kernel_record_head (*buf, kernel);
+  POCL_MEM_FREE (kernel->kernel_name);
+
+  /* skip the arg_info and all kernel metadata */
+  buffer = *buf + (kernel->struct_size - kernel->binaries_size);
+  deserialize_kernel_cachedir (basedir, buffer, kernel->binaries_size);
 
-  /* always skip to the next kernel */
   *buf = *buf + kernel->struct_size;
   return CL_SUCCESS;
-
 }
 
 /***********************************************************/
@@ -610,6 +742,19 @@ pocl_binary_serialize(cl_program program, unsigned device_i, size_t *size)
   unsigned char *start = buffer;
 
   unsigned num_kernels = program->num_kernels;
+  unsigned i;
+
+  /* the records of the kernels not created yet may be in the binary
+   * written here */
+  POCL_LOCK_OBJ (program);
+  for (i = 0; i < num_kernels; i++)
+    if (pocl_binary_load_kernel_metadata (program, &program->kernel_meta[i])
+        != CL_SUCCESS)
+      {
+        POCL_UNLOCK_OBJ (program);
+        return CL_OUT_OF_HOST_MEMORY;
+      }
+  POCL_UNLOCK_OBJ (program);
 
   memcpy(buffer, POCLCC_STRING_ID, POCLCC_STRING_ID_LENGTH);
   buffer += POCLCC_STRING_ID_LENGTH;
@@ -632,9 +777,40 @@ pocl_binary_serialize(cl_program program, unsigned device_i, size_t *size)
   char program_bc_path[POCL_FILENAME_LENGTH];
   pocl_cache_program_bc_path (program_bc_path, program, device_i);
   POCL_MSG_PRINT_INFO ("serializing program.bc: %s\n", program_bc_path);
-  buffer = serialize_file (program_bc_path, basedir_len, buffer);
 
-  unsigned i;
+  pocl_binary_file_list files = { NULL, 0, 0 };
+  pocl_cache_write_program_bc (program, device_i);
+  if (pocl_exists (program_bc_path))
+    add_file (&files, program_bc_path, basedir_len);
+  /* the SPIR-V and the clspv descriptor map of the Vulkan driver, stored
+   * next to program.bc; with these the binary loads without clspv */
+  const char *sidecars[] = { "spv", "map" };
+  for (i = 0; i < 2; i++)
+    {
+      char sidecar_path[POCL_FILENAME_LENGTH];
+      size_t len = strlen (program_bc_path);
+      assert (len > 2);
+      snprintf (sidecar_path, POCL_FILENAME_LENGTH, "%.*s%s", (int)(len - 2),
+                program_bc_path, sidecars[i]);
+      if (pocl_exists (sidecar_path))
+        add_file (&files, sidecar_path, basedir_len);
+    }
+  for (i = 0; i < num_kernels; i++)
+    collect_kernel_cachedir (program, program->kernel_meta[i].name, device_i,
+                             &files);
+
+  /* table of contents; the offsets and sizes are filled in below */
+  BUFFER_STORE (files.num, uint32_t);
+  for (i = 0; i < files.num; i++)
+    {
+      char *p = files.files[i].path + files.files[i].basedir_offset;
+      BUFFER_STORE_STR (p);
+      files.files[i].toc_slot = buffer;
+      BUFFER_STORE (0, uint64_t);
+      BUFFER_STORE (0, uint64_t);
+      assert (buffer < end_of_buffer);
+    }
+
   for (i=0; i < num_kernels; i++)
     {
       buffer = pocl_binary_serialize_kernel_to_buffer
@@ -642,6 +818,30 @@ pocl_binary_serialize(cl_program program, unsigned device_i, size_t *size)
       assert(buffer <= end_of_buffer);
     }
 
+  /* data area */
+  for (i = 0; i < files.num; i++)
+    {
+      char *content = NULL;
+      uint64_t fsize = 0;
+      size_t pad = (POCLCC_DATA_ALIGNMENT
+                    - (size_t)(buffer - start) % POCLCC_DATA_ALIGNMENT)
+                   % POCLCC_DATA_ALIGNMENT;
+      memset (buffer, 0, pad);
+      buffer += pad;
+      pocl_read_file (files.files[i].path, &content, &fsize);
+      assert (buffer + fsize <= end_of_buffer);
+
+      unsigned char *data = buffer;
+      buffer = files.files[i].toc_slot;
+      BUFFER_STORE ((uint64_t)(data - start), uint64_t);
+      BUFFER_STORE (fsize, uint64_t);
+      if (fsize)
+        memcpy (data, content, fsize);
+      free (content);
+      buffer = data + fsize;
+    }
+  free (files.files);
+
   if (size)
     *size = (buffer - start);
   return CL_SUCCESS;
@@ -665,6 +865,31 @@ pocl_binary_deserialize(cl_program program, unsigned device_i)
   char basedir[POCL_FILENAME_LENGTH];
   pocl_cache_program_path (basedir, program, device_i);
   size_t basedir_len = strlen (basedir);
+
+  if (b.version >= POCLCC_TOC_VERSION)
+    {
+      /* Only unpack the program-level files (program.bc and its
+       * SPIR-V sidecars); the kernel
+       * cachedirs are unpacked by pocl_binary_unpack_kernel() when the
+       * kernels are created. */
+      uint32_t num_files, i;
+      pocl_binary_toc_entry e;
+      BUFFER_READ (num_files, uint32_t);
+      for (i = 0; i < num_files; ++i)
+        {
+          buffer = read_toc_entry (buffer, &e);
+          POCL_RETURN_ERROR_COND ((e.offset + e.size > sizeof_buffer),
+                                  CL_INVALID_BINARY);
+          POCL_RETURN_ERROR_COND ((e.relpath_len == 0), CL_INVALID_BINARY);
+          if (memchr (e.relpath + 1, '/', e.relpath_len - 1) == NULL
+              && unpack_toc_entry (program->pocl_binaries[device_i], &e,
+                                   basedir, basedir_len)
+                     != CL_SUCCESS)
+            goto ERROR;
+        }
+      return CL_SUCCESS;
+    }
+
   buffer += deserialize_file (buffer, basedir, basedir_len);
 
   pocl_binary_kernel k;
@@ -672,7 +897,7 @@ pocl_binary_deserialize(cl_program program, unsigned device_i)
   for (i = 0; i < b.num_kernels; i++)
     {
       pocl_cache_program_path (basedir, program, device_i);
-      if (pocl_binary_deserialize_kernel_from_buffer (&b, &buffer, &k, NULL, basedir)
+      if (pocl_binary_deserialize_kernel_from_buffer (&buffer, &k, basedir)
           != CL_SUCCESS)
         goto ERROR;
       assert (buffer <= end_of_buffer);
@@ -727,54 +952,122 @@ pocl_binary_get_kernels_metadata (cl_program program, unsigned device_i)
   pocl_binary b;
   memset(&b, 0, sizeof (pocl_binary));
   pocl_binary_kernel k;
-  memset(&k, 0, sizeof (pocl_binary_kernel));
 
   unsigned char* buffer = read_header (&b, binary);
   POCL_RETURN_ERROR_ON ((!pocl_binary_check_binary (device, binary)),
                         CL_INVALID_PROGRAM,
                         "Deserialized a binary, but it doesn't seem to be "
                         "for this device.\n");
-  size_t len;
-  /* skip real path of program.bc */
-  BUFFER_READ(len, uint32_t);
-  assert (len > 0);
-  buffer += len;
-
-  /* skip content of program.bc */
-  BUFFER_READ(len, uint32_t);
-  assert (len > 0);
-  buffer += len;
+  buffer = skip_to_kernels (&b, buffer);
 
   unsigned j;
   assert (b.num_kernels > 0);
   assert (b.num_kernels == program->num_kernels);
 
-  /* for each kernel, setup its metadata */
+  /* for each kernel, only read the head of its record; the rest of the
+   * metadata is read by pocl_binary_load_kernel_metadata() when the
+   * kernel is created */
   for (j = 0; j < b.num_kernels; j++)
     {
       pocl_kernel_metadata_t *km = &program->kernel_meta[j];
 
-      POCL_RETURN_ERROR_ON (pocl_binary_deserialize_kernel_from_buffer (
-                                 &b, &buffer, &k, km, NULL),
+      read_kernel_record_head (buffer, &k);
+      POCL_RETURN_ERROR_ON ((k.kernel_name == NULL || k.struct_size == 0),
                             CL_INVALID_PROGRAM,
                             "Can't deserialize kernel %u \n", j);
 
       km->num_args = k.num_args;
       km->num_locals = k.num_locals;
-      km->local_sizes = k.local_sizes;
-      km->attributes = k.attributes;
-      km->has_arg_metadata = k.has_arg_metadata;
       km->name = k.kernel_name;
-      km->data
-          = (void **)calloc (program->associated_num_devices, sizeof (void *));
-      assert (km->name);
+      km->binary_record = (size_t)(buffer - binary);
+      km->binary_device_i = device_i;
 
       unsigned l;
       for (l = 0; l < OPENCL_MAX_DIMENSION; l++)
         {
           km->reqd_wg_size[l] = k.reqd_wg_size[l];
         }
+      buffer += k.struct_size;
     }
 
   return CL_SUCCESS;
 }
+
+cl_int
+pocl_binary_load_kernel_metadata (cl_program program,
+                                  pocl_kernel_metadata_t *meta)
+{
+  if (meta->binary_record == 0)
+    return CL_SUCCESS;
+
+  unsigned char *binary = program->pocl_binaries[meta->binary_device_i];
+  assert (binary != NULL);
+
+  pocl_binary b;
+  pocl_binary_kernel k;
+  read_header (&b, binary);
+  unsigned char *buffer
+      = read_kernel_record_head (binary + meta->binary_record, &k);
+  POCL_MEM_FREE (k.kernel_name);
+  POCL_RETURN_ERROR_ON (
+      (read_kernel_record_metadata (&b, buffer, &k, meta) != CL_SUCCESS),
+      CL_OUT_OF_HOST_MEMORY, "Can't deserialize the metadata of kernel %s\n",
+      meta->name);
+
+  meta->local_sizes = k.local_sizes;
+  meta->attributes = k.attributes;
+  meta->has_arg_metadata = k.has_arg_metadata;
+  meta->private_mem_per_wi = k.private_mem_per_wi;
+  meta->local_mem_wi_stride = k.local_mem_wi_stride;
+  meta->gid_local_access = k.gid_local_access;
+  meta->nonuniform_safe = k.nonuniform_safe;
+  meta->data
+      = (void **)calloc (program->associated_num_devices, sizeof (void *));
+  pocl_setup_argument_storage_size (meta);
+  meta->binary_record = 0;
+
+  return CL_SUCCESS;
+}
+
+cl_int
+pocl_binary_unpack_kernel (cl_program program, unsigned device_i,
+                           const char *kernel_name)
+{
+  unsigned char *binary = program->pocl_binaries[device_i];
+  size_t sizeof_binary = program->pocl_binary_sizes[device_i];
+  char prefix[POCL_FILENAME_LENGTH];
+  char basedir[POCL_FILENAME_LENGTH];
+
+  if (binary == NULL)
+    return CL_SUCCESS;
+
+  pocl_binary b;
+  unsigned char *buffer = read_header (&b, binary);
+  /* older binaries are unpacked completely by pocl_binary_deserialize() */
+  if (b.version < POCLCC_TOC_VERSION)
+    return CL_SUCCESS;
+
+  int prefix_len
+      = snprintf (prefix, POCL_FILENAME_LENGTH, "/%s/", kernel_name);
+  POCL_RETURN_ERROR_COND ((prefix_len >= POCL_FILENAME_LENGTH),
+                          CL_INVALID_KERNEL_NAME);
+  pocl_cache_program_path (basedir, program, device_i);
+  size_t basedir_len = strlen (basedir);
+
+  uint32_t num_files, i;
+  pocl_binary_toc_entry e;
+  BUFFER_READ (num_files, uint32_t);
+  for (i = 0; i < num_files; ++i)
+    {
+      buffer = read_toc_entry (buffer, &e);
+      if (e.relpath_len <= (uint32_t)prefix_len
+          || strncmp (e.relpath, prefix, prefix_len) != 0)
+        continue;
+      POCL_RETURN_ERROR_COND ((e.offset + e.size > sizeof_binary),
+                              CL_INVALID_BINARY);
+      cl_int error = unpack_toc_entry (binary, &e, basedir, basedir_len);
+      if (error != CL_SUCCESS)
+        return error;
+    }
+  return CL_SUCCESS;
+}
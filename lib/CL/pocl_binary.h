@@ -58,10 +58,24 @@ void pocl_binary_set_program_buildhash(cl_program program,
 /* returns the number of kernels without unpacking the binary */
 cl_uint pocl_binary_get_kernel_count (cl_program program, unsigned device_i);
 
-/* sets up cl_kernel's metadata, without unpacking the binary in pocl kcache */
+/* sets up the names, the numbers of arguments and locals and reqd_wg_size
+ * of the kernels, without unpacking the binary in pocl kcache; the rest of
+ * their metadata is loaded by pocl_binary_load_kernel_metadata() */
 cl_int pocl_binary_get_kernels_metadata (cl_program program,
                                          unsigned device_i);
 
+/* decodes the rest of the metadata of a kernel set up by
+ * pocl_binary_get_kernels_metadata() from its record in the binary, if it
+ * has not been yet. The program must be locked. */
+cl_int pocl_binary_load_kernel_metadata (cl_program program,
+                                         pocl_kernel_metadata_t *meta);
+
+/* unpacks the cachedir files of a single kernel from
+ * program->pocl_binaries[device_i] into pocl cache, if they
+ * were not yet unpacked by pocl_binary_deserialize() */
+cl_int pocl_binary_unpack_kernel (cl_program program, unsigned device_i,
+                                  const char *kernel_name);
+
 #ifdef __GNUC__
 #pragma GCC visibility pop
 #endif
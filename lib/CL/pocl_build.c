@@ -39,6 +39,7 @@
 
 #include "pocl_cl.h"
 #ifdef ENABLE_LLVM
+#include "common_driver.h"
 #include "pocl_llvm.h"
 #endif
 #include "pocl_util.h"
@@ -48,6 +49,10 @@
 #include "pocl_runtime_config.h"
 #include "pocl_binary.h"
 #include "pocl_shared.h"
+#include "pocl_timing.h"
+#include "pocl_stats.h"
+#include "pocl_tracing.h"
+#include "utlist.h"
 
 #define REQUIRES_CR_SQRT_DIV_ERR                                              \
   "-cl-fp32-correctly-rounded-divide-sqrt build option "                      \
@@ -202,6 +207,21 @@ process_options (const char *options, char *modded_options, char *link_options,
   token = strtok_r (temp_options, " ", &saveptr);
   while (token != NULL)
     {
+      /* pocl's own option, not passed to the frontend */
+      if (strncmp (token, "-cl-pocl-specialize=", 20) == 0)
+        {
+          POCL_MEM_FREE (program->wg_specializations);
+          program->wg_specializations = strdup (token + 20);
+          token = strtok_r (NULL, " ", &saveptr);
+          continue;
+        }
+      if (strncmp (token, "-cl-pocl-specialize-args=", 25) == 0)
+        {
+          POCL_MEM_FREE (program->spec_arg_names);
+          program->spec_arg_names = strdup (token + 25);
+          token = strtok_r (NULL, " ", &saveptr);
+          continue;
+        }
       /* check if parameter is supported compiler parameter */
       if (strncmp (token, "-cl", 3) == 0 || strncmp (token, "-w", 2) == 0
           || strncmp (token, "-Werror", 7) == 0)
@@ -392,23 +412,31 @@ ERROR:
 /* Unique hash for a device + program build + kernel name combination.
    NOTE: this does NOT take into account the local WG sizes or other
    specialization properties. */
-static void
-pocl_calculate_kernel_hash (cl_program program, unsigned kernel_i,
-                            unsigned device_i)
+void
+pocl_compute_kernel_hash (const SHA1_digest_t build_hash,
+                          const char *kernel_name, pocl_kernel_hash_t hash)
 {
   SHA1_CTX hash_ctx;
   pocl_SHA1_Init (&hash_ctx);
 
-  char *n = program->kernel_meta[kernel_i].name;
-  pocl_SHA1_Update (&hash_ctx, (uint8_t *)program->build_hash[device_i],
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)build_hash,
                     sizeof (SHA1_digest_t));
-  pocl_SHA1_Update (&hash_ctx, (uint8_t *)n, strlen (n));
+  pocl_SHA1_Update (&hash_ctx, (const uint8_t *)kernel_name,
+                    strlen (kernel_name));
 
   uint8_t digest[SHA1_DIGEST_SIZE];
   pocl_SHA1_Final (&hash_ctx, digest);
 
-  memcpy (program->kernel_meta[kernel_i].build_hash[device_i], digest,
-          sizeof (pocl_kernel_hash_t));
+  memcpy (hash, digest, sizeof (pocl_kernel_hash_t));
+}
+
+static void
+pocl_calculate_kernel_hash (cl_program program, unsigned kernel_i,
+                            unsigned device_i)
+{
+  pocl_compute_kernel_hash (program->build_hash[device_i],
+                            program->kernel_meta[kernel_i].name,
+                            program->kernel_meta[kernel_i].build_hash[device_i]);
 }
 
 static void
@@ -427,15 +455,18 @@ free_meta (cl_program program)
             continue;
           POCL_MEM_FREE (meta->attributes);
           POCL_MEM_FREE (meta->name);
-          for (j = 0; j < meta->num_args; ++j)
-            {
-              POCL_MEM_FREE (meta->arg_info[j].name);
-              POCL_MEM_FREE (meta->arg_info[j].type_name);
-            }
+          /* the kernels of pocl binaries have neither until created */
+          if (meta->arg_info != NULL)
+            for (j = 0; j < meta->num_args; ++j)
+              {
+                POCL_MEM_FREE (meta->arg_info[j].name);
+                POCL_MEM_FREE (meta->arg_info[j].type_name);
+              }
           POCL_MEM_FREE (meta->arg_info);
-          for (j = 0; j < program->num_devices; ++j)
-            if (meta->data[j] != NULL)
-              meta->data[j] = NULL; // TODO free data in driver callback
+          if (meta->data != NULL)
+            for (j = 0; j < program->num_devices; ++j)
+              if (meta->data[j] != NULL)
+                meta->data[j] = NULL; // TODO free data in driver callback
           POCL_MEM_FREE (meta->data);
           POCL_MEM_FREE (meta->local_sizes);
         }
@@ -495,7 +526,7 @@ clean_program_on_rebuild (cl_program program, int from_error)
 static int
 setup_kernel_metadata (cl_program program)
 {
-  size_t i, j;
+  size_t i;
   cl_uint device_i;
   assert (program->kernel_meta == NULL);
   assert (program->num_kernels == 0);
@@ -535,27 +566,11 @@ setup_kernel_metadata (cl_program program)
       (setup_successful == 0), CL_INVALID_BINARY,
       "Could not find kernel metadata in the built program\n");
 
-  /* calculate argument storage size */
+  /* calculate argument storage size, for the kernels of pocl binaries
+     when their metadata is loaded */
   for (i = 0; i < program->num_kernels; ++i)
-    {
-      program->kernel_meta[i].total_argument_storage_size = 0;
-      if (program->kernel_meta[i].num_args > 0)
-        {
-          size_t total = 0;
-          for (j = 0; j < program->kernel_meta[i].num_args; ++j)
-            {
-              /* if one of the arguments have size 0,
-                 the driver couldn't figure it out. In that case,
-                 leave total_argument_storage_size == zero, and use
-                 the old way of setting arguments. */
-              if (program->kernel_meta[i].arg_info[j].type_size == 0)
-                break;
-              total += program->kernel_meta[i].arg_info[j].type_size;
-            }
-          if (j >= program->kernel_meta[i].num_args)
-            program->kernel_meta[i].total_argument_storage_size = total;
-        }
-    }
+    if (program->kernel_meta[i].binary_record == 0)
+      pocl_setup_argument_storage_size (&program->kernel_meta[i]);
 
   return CL_SUCCESS;
 }
@@ -586,21 +601,157 @@ setup_device_kernel_hashes (cl_program program)
     }
 }
 
-cl_int
-compile_and_link_program(int compile_program,
-                         int link_program,
-                         cl_program program,
-                         cl_uint num_devices,
-                         const cl_device_id *device_list,
-                         const char *options,
-                         cl_uint num_input_headers,
-                         const cl_program *input_headers,
-                         const char **header_include_names,
-                         cl_uint num_input_programs,
-                         const cl_program *input_programs,
-                         void (CL_CALLBACK *pfn_notify) (cl_program program,
-                                                         void *user_data),
-                         void *user_data)
+#ifdef ENABLE_LLVM
+static int
+strings_equal (const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp (a, b) == 0;
+}
+
+/* Compares the strings that the device callback returns for the two
+   devices. */
+static int
+device_strings_equal (char *(*callback) (cl_device_id), cl_device_id a,
+                      cl_device_id b)
+{
+  if (callback == NULL)
+    return 1;
+  char *sa = callback (a);
+  char *sb = callback (b);
+  int equal = strings_equal (sa, sb);
+  POCL_MEM_FREE (sa);
+  POCL_MEM_FREE (sb);
+  return equal;
+}
+
+/* The same for the build options that ops->init_build adds. */
+static int
+init_build_equal (cl_device_id a, cl_device_id b)
+{
+  if (a->ops->init_build == NULL)
+    return 1;
+  char *sa = a->ops->init_build (a->data);
+  char *sb = b->ops->init_build (b->data);
+  int equal = strings_equal (sa, sb);
+  POCL_MEM_FREE (sa);
+  POCL_MEM_FREE (sb);
+  return equal;
+}
+
+/* Whether building a program from source gives the same binary for both
+   devices: they have the same driver that uses the common LLVM build, and
+   agree on everything that goes into the compiler invocation, the kernel
+   library and the build hash. */
+static int
+devices_share_builds (cl_device_id a, cl_device_id b)
+{
+  if (a->ops != b->ops || a->ops->build_source != pocl_driver_build_source)
+    return 0;
+  if (a->llvm_target_triplet == NULL
+      || !strings_equal (a->llvm_target_triplet, b->llvm_target_triplet)
+      || !strings_equal (a->llvm_cpu, b->llvm_cpu)
+      || !strings_equal (a->extensions, b->extensions)
+      || !strings_equal (a->cl_version_std, b->cl_version_std))
+    return 0;
+  if (a->cl_version_int != b->cl_version_int
+      || a->address_bits != b->address_bits
+      || a->endian_little != b->endian_little
+      || a->image_support != b->image_support
+      || a->has_64bit_long != b->has_64bit_long
+      || a->global_var_max_size != b->global_var_max_size
+      || a->global_as_id != b->global_as_id || a->spmd != b->spmd
+      || a->device_aux_functions != b->device_aux_functions)
+    return 0;
+  return device_strings_equal (a->ops->build_hash, a, b)
+         && init_build_equal (a, b);
+}
+
+/* Returns the index of an already built device whose build from source the
+   device at device_i can take over, or -1. */
+static int
+find_shared_build (cl_program program, unsigned device_i)
+{
+  unsigned i;
+  cl_device_id device = program->devices[device_i];
+
+  if (!pocl_get_bool_option ("POCL_SHARE_DEVICE_BUILDS", 1))
+    return -1;
+
+  for (i = 0; i < device_i; ++i)
+    if (program->binaries[i] != NULL
+        && devices_share_builds (program->devices[i], device))
+      return (int)i;
+  return -1;
+}
+
+/* Gives the device at device_i the build of the identical device at
+   shared_i: its build hash, so that the two use the same cache directory and
+   the kernels compiled for one are found by the other, and copies of its
+   binary and build log. The LLVM module is parsed from the binary, as each
+   device frees its own. */
+static int
+share_device_build (cl_program program, unsigned device_i, unsigned shared_i)
+{
+  size_t size = program->binary_sizes[shared_i];
+
+  POCL_MSG_PRINT_LLVM ("device %s shares the build of device %s\n",
+                       program->devices[device_i]->short_name,
+                       program->devices[shared_i]->short_name);
+
+  memcpy (program->build_hash[device_i], program->build_hash[shared_i],
+          sizeof (SHA1_digest_t));
+  if (program->build_log[shared_i])
+    program->build_log[device_i] = strdup (program->build_log[shared_i]);
+
+  POCL_MEM_FREE (program->binaries[device_i]);
+  program->binaries[device_i] = (unsigned char *)malloc (size);
+  POCL_RETURN_ERROR_COND ((program->binaries[device_i] == NULL),
+                          CL_OUT_OF_HOST_MEMORY);
+  memcpy (program->binaries[device_i], program->binaries[shared_i], size);
+  program->binary_sizes[device_i] = size;
+
+  return pocl_llvm_read_program_llvm_irs (program, device_i, NULL);
+}
+#endif
+
+/* The checks of the program state for a build, with the program lock held.
+   A build queued in the background makes the others fail, apart from the
+   one that runs it. */
+static cl_int
+check_program_buildable (cl_program program, int link_program, int async_job)
+{
+  POCL_RETURN_ERROR_ON ((program->build_pending && !async_job),
+                        CL_INVALID_OPERATION,
+                        "A build of the program is in progress\n");
+
+  POCL_RETURN_ERROR_ON (program->kernels, CL_INVALID_OPERATION,
+                        "Program already has kernels\n");
+
+  POCL_RETURN_ERROR_ON (
+      (program->source == NULL && program->binaries == NULL
+       && program->builtin_kernel_names == NULL),
+      CL_INVALID_PROGRAM,
+      "Program doesn't have sources, binaries nor builtin-kernel names. You "
+      "need "
+      "to call clCreateProgramWith{Binary|Source|BuiltinKernels} first\n");
+
+  POCL_RETURN_ERROR_ON (((program->source == NULL) && (link_program == 0)),
+                        CL_INVALID_OPERATION,
+                        "Cannot clCompileProgram when program has no source\n");
+
+  return CL_SUCCESS;
+}
+
+/* Builds the program in the calling thread. */
+static cl_int
+build_program (int compile_program, int link_program, cl_program program,
+               cl_uint num_devices, const cl_device_id *device_list,
+               const char *options, cl_uint num_input_headers,
+               const cl_program *input_headers,
+               const char **header_include_names, cl_uint num_input_programs,
+               const cl_program *input_programs, int async_job)
 {
   char link_options[512];
   int errcode, error;
@@ -619,35 +770,11 @@ compile_and_link_program(int compile_program,
   int build_error_code
       = (link_program ? CL_BUILD_PROGRAM_FAILURE : CL_COMPILE_PROGRAM_FAILURE);
 
-  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (!IS_CL_OBJECT_VALID (program)),
-                        CL_INVALID_PROGRAM);
-
-  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (num_devices > 0 && device_list == NULL),
-                        CL_INVALID_VALUE);
-  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (num_devices == 0 && device_list != NULL),
-                        CL_INVALID_VALUE);
-
-  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (pfn_notify == NULL && user_data != NULL),
-                        CL_INVALID_VALUE);
-
   POCL_LOCK_OBJ (program);
 
-  POCL_GOTO_LABEL_ON (FINISH, program->kernels, CL_INVALID_OPERATION,
-                      "Program already has kernels\n");
-
-  POCL_GOTO_LABEL_ON (
-      FINISH,
-      (program->source == NULL && program->binaries == NULL
-       && program->builtin_kernel_names == NULL),
-      CL_INVALID_PROGRAM,
-      "Program doesn't have sources, binaries nor builtin-kernel names. You "
-      "need "
-      "to call clCreateProgramWith{Binary|Source|BuiltinKernels} first\n");
-
-  POCL_GOTO_LABEL_ON (FINISH,
-                      ((program->source == NULL) && (link_program == 0)),
-                      CL_INVALID_OPERATION,
-                      "Cannot clCompileProgram when program has no source\n");
+  errcode = check_program_buildable (program, link_program, async_job);
+  if (errcode != CL_SUCCESS)
+    goto FINISH;
 
   program->main_build_log[0] = 0;
 
@@ -655,6 +782,8 @@ compile_and_link_program(int compile_program,
 
   /* TODO this should be somehow utilized at linking */
   POCL_MEM_FREE (program->compiler_options);
+  POCL_MEM_FREE (program->wg_specializations);
+  POCL_MEM_FREE (program->spec_arg_names);
 
   if (extra_build_options)
     {
@@ -733,6 +862,8 @@ compile_and_link_program(int compile_program,
   for (device_i = 0; device_i < program->num_devices; ++device_i)
     {
       cl_device_id device = program->devices[device_i];
+      uint64_t build_start = pocl_gettimemono_ns ();
+      int shared_build = 0;
 
       if (requires_cr_sqrt_div
           && !(device->single_fp_config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT))
@@ -783,9 +914,18 @@ compile_and_link_program(int compile_program,
                 "support building programs from source\n",
                 device->long_name);
 
-          error = device->ops->build_source (
-              program, device_i, num_input_headers, input_headers,
-              header_include_names, (create_library ? 0 : link_program));
+#ifdef ENABLE_LLVM
+          int shared_i = find_shared_build (program, device_i);
+          if (shared_i >= 0)
+            {
+              error = share_device_build (program, device_i, shared_i);
+              shared_build = 1;
+            }
+          else
+#endif
+            error = device->ops->build_source (
+                program, device_i, num_input_headers, input_headers,
+                header_include_names, (create_library ? 0 : link_program));
 
           if (error != CL_SUCCESS)
             {
@@ -833,10 +973,25 @@ compile_and_link_program(int compile_program,
       if (!program->builtin_kernel_names)
         pocl_cache_update_program_last_access (program, device_i);
 
+      uint64_t build_end = pocl_gettimemono_ns ();
+      if (shared_build)
+        pocl_stat_add (POCL_STAT_SHARED_PROGRAM_BUILDS, 1);
+      else
+        {
+          pocl_stat_add (POCL_STAT_PROGRAM_BUILDS, 1);
+          pocl_stat_add (POCL_STAT_PROGRAM_BUILD_NS,
+                         build_end - build_start);
+        }
+      if (pocl_tracing_spans_enabled)
+        pocl_tracing_span ("build", device->short_name, build_start,
+                           build_end);
+
       ++actually_built;
     }
   assert (actually_built == program->num_devices);
 
+  pocl_cache_enforce_size_limit ();
+
   program->binary_type = CL_PROGRAM_BINARY_TYPE_EXECUTABLE;
   /* if program will be compiled using clCompileProgram its binary_type
    * will be set to CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT.
@@ -895,6 +1050,287 @@ ERROR_CLEAN_OPTIONS:
 FINISH:
   POCL_UNLOCK_OBJ (program);
 
+  /* Build the requested work-group function specializations now, so that
+     they are in the cache and in the poclbinaries. */
+  if (errcode == CL_SUCCESS && program->wg_specializations
+      && program->binary_type == CL_PROGRAM_BINARY_TYPE_EXECUTABLE)
+    for (device_i = 0; device_i < program->num_devices; device_i++)
+      {
+        cl_device_id device = program->devices[device_i];
+        if (device->ops->build_poclbinary)
+          device->ops->build_poclbinary (program, device_i);
+      }
+
+  return errcode;
+}
+
+/* Asynchronous builds. A clBuildProgram or clCompileProgram given a
+   callback returns once the build is queued, and a pool of up to
+   POCL_BUILD_THREADS threads, started on demand, runs the queued builds,
+   so that the builds of different programs overlap with each other and
+   with the application. The kernels of the program are only created after
+   its build has finished, see pocl_wait_program_build. */
+
+typedef struct pocl_build_job pocl_build_job;
+struct pocl_build_job
+{
+  /* keeps a reference to the program and to the headers */
+  cl_program program;
+  int link_program;
+  cl_uint num_devices;
+  cl_device_id *device_list;
+  char *options;
+  cl_uint num_input_headers;
+  cl_program *input_headers;
+  char **header_include_names;
+  void (CL_CALLBACK *pfn_notify) (cl_program program, void *user_data);
+  void *user_data;
+  pocl_build_job *next;
+  pocl_build_job *prev;
+};
+
+static pocl_lock_t pocl_build_lock = POCL_LOCK_INITIALIZER;
+/* signaled when a job is queued */
+static pocl_cond_t pocl_build_cond = PTHREAD_COND_INITIALIZER;
+/* broadcast when the build of a program has finished */
+static pocl_cond_t pocl_build_done_cond = PTHREAD_COND_INITIALIZER;
+static pocl_build_job *pocl_build_jobs;
+static unsigned pocl_build_threads;
+static unsigned pocl_build_idle_threads;
+
+static void
+free_build_job (pocl_build_job *job)
+{
+  cl_uint i;
+  for (i = 0; i < job->num_input_headers; ++i)
+    {
+      POname (clReleaseProgram) (job->input_headers[i]);
+      POCL_MEM_FREE (job->header_include_names[i]);
+    }
+  POCL_MEM_FREE (job->input_headers);
+  POCL_MEM_FREE (job->header_include_names);
+  POCL_MEM_FREE (job->device_list);
+  POCL_MEM_FREE (job->options);
+  POCL_MEM_FREE (job);
+}
+
+static void
+run_build_job (pocl_build_job *job)
+{
+  cl_program program = job->program;
+  uint64_t build_start = pocl_gettimemono_ns ();
+
+  cl_int errcode = build_program (
+      1, job->link_program, program, job->num_devices, job->device_list,
+      job->options, job->num_input_headers, job->input_headers,
+      (const char **)job->header_include_names, 0, NULL, 1);
+
+  POCL_MSG_PRINT_LLVM ("background build of program %" PRIu64
+                       " finished in %" PRIu64 " ns: %d\n",
+                       program->id, pocl_gettimemono_ns () - build_start,
+                       errcode);
+
+  /* the callback may create the kernels */
+  POCL_LOCK_OBJ (program);
+  POCL_LOCK (pocl_build_lock);
+  program->build_pending = 0;
+  POCL_BROADCAST_COND (pocl_build_done_cond);
+  POCL_UNLOCK (pocl_build_lock);
+  POCL_UNLOCK_OBJ (program);
+
+  job->pfn_notify (program, job->user_data);
+
+  free_build_job (job);
+  POname (clReleaseProgram) (program);
+}
+
+static void *
+build_thread (void *arg)
+{
+  pocl_build_job *job;
+  POCL_LOCK (pocl_build_lock);
+  while (1)
+    {
+      while (pocl_build_jobs == NULL)
+        {
+          ++pocl_build_idle_threads;
+          POCL_WAIT_COND (pocl_build_cond, pocl_build_lock);
+          --pocl_build_idle_threads;
+        }
+      job = pocl_build_jobs;
+      DL_DELETE (pocl_build_jobs, job);
+      POCL_UNLOCK (pocl_build_lock);
+
+      run_build_job (job);
+
+      POCL_LOCK (pocl_build_lock);
+    }
+  POCL_UNLOCK (pocl_build_lock);
+  return NULL;
+}
+
+/* Must be called with pocl_build_lock held. Returns 0 if there is no
+   thread for the job. */
+static int
+wake_build_thread ()
+{
+  unsigned max_threads = pocl_get_int_option ("POCL_BUILD_THREADS", 2);
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (pocl_build_idle_threads > 0)
+    {
+      POCL_SIGNAL_COND (pocl_build_cond);
+      return 1;
+    }
+  if (pocl_build_threads >= max_threads)
+    return pocl_build_threads > 0;
+
+  PTHREAD_CHECK (pthread_attr_init (&attr));
+  PTHREAD_CHECK (pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED));
+  int error = pthread_create (&thread, &attr, build_thread, NULL);
+  PTHREAD_CHECK (pthread_attr_destroy (&attr));
+  if (error)
+    return pocl_build_threads > 0;
+  ++pocl_build_threads;
+  return 1;
+}
+
+/* Queues the build of the program for the pool. Returns CL_SUCCESS once
+   queued, or the error of a build that cannot start. */
+static cl_int
+queue_build (int link_program, cl_program program, cl_uint num_devices,
+             const cl_device_id *device_list, const char *options,
+             cl_uint num_input_headers, const cl_program *input_headers,
+             const char **header_include_names,
+             void (CL_CALLBACK *pfn_notify) (cl_program program,
+                                             void *user_data),
+             void *user_data)
+{
+  cl_int errcode = CL_OUT_OF_HOST_MEMORY;
+  cl_uint i;
+
+  pocl_build_job *job
+      = (pocl_build_job *)calloc (1, sizeof (pocl_build_job));
+  if (job == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+  job->program = program;
+  job->link_program = link_program;
+  job->pfn_notify = pfn_notify;
+  job->user_data = user_data;
+  if (num_devices > 0)
+    {
+      job->device_list
+          = (cl_device_id *)malloc (num_devices * sizeof (cl_device_id));
+      if (job->device_list == NULL)
+        goto ERROR;
+      memcpy (job->device_list, device_list,
+              num_devices * sizeof (cl_device_id));
+      job->num_devices = num_devices;
+    }
+  if (options != NULL && (job->options = strdup (options)) == NULL)
+    goto ERROR;
+  if (num_input_headers > 0)
+    {
+      job->input_headers
+          = (cl_program *)calloc (num_input_headers, sizeof (cl_program));
+      job->header_include_names
+          = (char **)calloc (num_input_headers, sizeof (char *));
+      if (job->input_headers == NULL || job->header_include_names == NULL)
+        goto ERROR;
+      for (i = 0; i < num_input_headers; ++i)
+        {
+          job->header_include_names[i] = strdup (header_include_names[i]);
+          if (job->header_include_names[i] == NULL)
+            goto ERROR;
+          job->input_headers[i] = input_headers[i];
+          POCL_RETAIN_OBJECT (input_headers[i]);
+          job->num_input_headers = i + 1;
+        }
+    }
+
+  POCL_RETAIN_OBJECT (program);
+  POCL_LOCK_OBJ (program);
+  errcode = check_program_buildable (program, link_program, 0);
+  if (errcode == CL_SUCCESS)
+    {
+      POCL_LOCK (pocl_build_lock);
+      if (wake_build_thread ())
+        {
+          DL_APPEND (pocl_build_jobs, job);
+          program->build_pending = 1;
+        }
+      else
+        errcode = CL_OUT_OF_RESOURCES;
+      POCL_UNLOCK (pocl_build_lock);
+    }
+  POCL_UNLOCK_OBJ (program);
+  if (errcode == CL_SUCCESS)
+    return CL_SUCCESS;
+  POname (clReleaseProgram) (program);
+
+ERROR:
+  /* releases the headers retained so far */
+  free_build_job (job);
+  return errcode;
+}
+
+void
+pocl_wait_program_build (cl_program program)
+{
+  POCL_LOCK (pocl_build_lock);
+  while (program->build_pending)
+    POCL_WAIT_COND (pocl_build_done_cond, pocl_build_lock);
+  POCL_UNLOCK (pocl_build_lock);
+}
+
+cl_int
+compile_and_link_program(int compile_program,
+                         int link_program,
+                         cl_program program,
+                         cl_uint num_devices,
+                         const cl_device_id *device_list,
+                         const char *options,
+                         cl_uint num_input_headers,
+                         const cl_program *input_headers,
+                         const char **header_include_names,
+                         cl_uint num_input_programs,
+                         const cl_program *input_programs,
+                         void (CL_CALLBACK *pfn_notify) (cl_program program,
+                                                         void *user_data),
+                         void *user_data)
+{
+  int errcode;
+
+  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (!IS_CL_OBJECT_VALID (program)),
+                        CL_INVALID_PROGRAM);
+
+  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (num_devices > 0 && device_list == NULL),
+                        CL_INVALID_VALUE);
+  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (num_devices == 0 && device_list != NULL),
+                        CL_INVALID_VALUE);
+
+  POCL_GOTO_LABEL_COND (PFN_NOTIFY, (pfn_notify == NULL && user_data != NULL),
+                        CL_INVALID_VALUE);
+
+  /* clLinkProgram returns the program it creates only after the build */
+  if (pfn_notify != NULL && compile_program
+      && pocl_get_bool_option ("POCL_ASYNC_BUILD", 1))
+    {
+      errcode = queue_build (link_program, program, num_devices, device_list,
+                             options, num_input_headers, input_headers,
+                             header_include_names, pfn_notify, user_data);
+      if (errcode == CL_SUCCESS)
+        return CL_SUCCESS;
+      goto PFN_NOTIFY;
+    }
+
+  errcode = build_program (compile_program, link_program, program,
+                           num_devices, device_list, options,
+                           num_input_headers, input_headers,
+                           header_include_names, num_input_programs,
+                           input_programs, 0);
+
 PFN_NOTIFY:
   if (pfn_notify)
     pfn_notify (program, user_data);
@@ -21,11 +21,23 @@
    IN THE SOFTWARE.
 */
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include <utime.h>
+
+#ifdef __linux__
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#endif
 
 #include "config.h"
 #include "pocl_build_timestamp.h"
@@ -38,9 +50,11 @@
 #include "pocl_cache.h"
 #include "pocl_file_util.h"
 #include "pocl_llvm.h"
+#include "pocl_util.h"
 
 #include "pocl_cl.h"
 #include "pocl_runtime_config.h"
+#include "pocl_timing.h"
 
 #define POCL_LAST_ACCESSED_FILENAME "/last_accessed"
 /* The filename in which the program's build log is stored */
@@ -51,12 +65,37 @@
 /* The filename in which the program LLVM bc is stored in the program's temp
  * dir. */
 #define POCL_PROGRAM_BC_FILENAME "/program.bc"
+/* The directory of the content-addressed kernel object store. */
+#define POCL_OBJECT_STORE_DIRNAME "/objects"
+/* The directory of the precompiled OpenCL C builtin headers. */
+#define POCL_PCH_DIRNAME "/pch"
+#define POCL_SPIRV_DIRNAME "/spirv"
+#define POCL_LOCKS_DIRNAME "/locks"
+#define POCL_CACHE_LOCK_STRIPES 64
+/* The directory of the per-device driver caches. */
+#define POCL_DEVICE_CACHE_DIRNAME "/devices"
+/* The lock file taken by the process pruning the cache. */
+#define POCL_PRUNE_LOCK_FILENAME "/prune.lock"
+/* The subdirectory of the cache directory with the entries keyed by the
+   fast hash. The SHA-1 keyed ones are in the cache directory itself, so
+   the two schemes never share an entry, and the pruning of one skips the
+   entries of the other, since it only visits the two-character hash
+   directories. */
+#define POCL_FASTHASH_LAYOUT_NAME "fasthash-v1"
+/* Minimum time in seconds between two size limit checks of a process. */
+#define POCL_CACHE_PRUNE_INTERVAL 60
+/* Entries accessed during this many seconds are never evicted, as
+   other processes might still be building into them. */
+#define POCL_CACHE_PRUNE_GRACE 60
 
 static char cache_topdir[POCL_FILENAME_LENGTH];
 static char tempfile_pattern[POCL_FILENAME_LENGTH];
 static char tempdir_pattern[POCL_FILENAME_LENGTH];
 static int cache_topdir_initialized = 0;
 static int use_kernel_cache = 0;
+/* nonzero if the cache keys are computed with the fast hash instead of
+   SHA-1, see POCL_CACHE_HASH */
+static int use_fast_hash = 1;
 
 /* sanity check on SHA1 digest emptiness */
 static unsigned buildhash_is_valid(cl_program   program, unsigned     device_i)
@@ -99,29 +138,33 @@ void pocl_cache_program_bc_path(char*        program_bc_path,
                        device_i, POCL_PROGRAM_BC_FILENAME);
 }
 
-/* Return the cache directory for the given work-group function.
-   If specialized = 1, specialization parameters are derived from run_cmd,
-   otherwise a generic directory name is returned.
-
-   The current specialization parameters are:
-   - local size
-   - if the global offset is zero (in all dimensions) or not
-   - if the grid size in any dimension is smaller than a device
-   specified limit ("smallgrid" specialization)
-*/
-void
-pocl_cache_kernel_cachedir_path (char *kernel_cachedir_path,
-                                 cl_program program, unsigned program_device_i,
-                                 cl_kernel kernel, const char *append_str,
-                                 _cl_command_node *command, int specialized)
+/* Writes the per-kernel, per-specialization part of a kernel cache
+   directory path,
+   "/<kernel>/<local size>[-goffs0][-smallgrid][-a<arg>_<value>...][-fast]"
+   followed by append_str,
+   to tempstring. */
+static void
+kernel_specialization_path (char *tempstring, cl_kernel kernel,
+                            const char *append_str, _cl_command_node *command,
+                            int specialized)
 {
   int bytes_written;
   _cl_command_run *run_cmd = &command->command.run;
-  char tempstring[POCL_FILENAME_LENGTH];
   cl_device_id dev = command->device;
   size_t max_grid_width = pocl_cmd_max_grid_dim_width (run_cmd);
+  char spec_args[POCL_MAX_SPEC_ARGS * 24 + 1];
+  unsigned i, n = 0;
+  size_t len = 0;
+
+  spec_args[0] = 0;
+  for (i = 0; specialized && i < 64 && n < POCL_MAX_SPEC_ARGS; ++i)
+    if (run_cmd->spec_args & ((uint64_t)1 << i))
+      len += snprintf (spec_args + len, sizeof (spec_args) - len,
+                       "-a%u_%" PRIx64, i, run_cmd->spec_arg_values[n++]);
+
   bytes_written = snprintf (
-      tempstring, POCL_FILENAME_LENGTH, "/%s/%zu-%zu-%zu%s%s%s", kernel->name,
+      tempstring, POCL_FILENAME_LENGTH, "/%s/%zu-%zu-%zu%s%s%s%s%s",
+      kernel->name,
       !specialized ? 0 : run_cmd->pc.local_size[0],
       !specialized ? 0 : run_cmd->pc.local_size[1],
       !specialized ? 0 : run_cmd->pc.local_size[2],
@@ -134,9 +177,32 @@ pocl_cache_kernel_cachedir_path (char *kernel_cachedir_path,
               && max_grid_width < dev->grid_width_specialization_limit
           ? "-smallgrid"
           : "",
-      append_str);
+      spec_args, run_cmd->fast_wg_func ? "-fast" : "", append_str);
   assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
+}
+
+/* Return the cache directory for the given work-group function.
+   If specialized = 1, specialization parameters are derived from run_cmd,
+   otherwise a generic directory name is returned.
 
+   The current specialization parameters are:
+   - local size
+   - if the global offset is zero (in all dimensions) or not
+   - if the grid size in any dimension is smaller than a device
+   specified limit ("smallgrid" specialization)
+   - the values of the scalar arguments in run_cmd->spec_args
+   In addition, the first tier WG functions of POCL_TIERED_COMPILATION get
+   a directory of their own.
+*/
+void
+pocl_cache_kernel_cachedir_path (char *kernel_cachedir_path,
+                                 cl_program program, unsigned program_device_i,
+                                 cl_kernel kernel, const char *append_str,
+                                 _cl_command_node *command, int specialized)
+{
+  char tempstring[POCL_FILENAME_LENGTH];
+  kernel_specialization_path (tempstring, kernel, append_str, command,
+                              specialized);
   program_device_dir (kernel_cachedir_path, program, program_device_i, tempstring);
 }
 
@@ -360,42 +426,80 @@ pocl_cache_write_kernel_parallel_bc (void *bc, cl_program program,
 
 /******************************************************************************/
 
+static const char *builtin_seed = POCL_VERSION_BASE POCL_BUILD_TIMESTAMP
+#ifdef ENABLE_LLVM
+    LLVM_VERSION POCL_KERNELLIB_SHA1
+#endif
+    ;
+
+static void
+digest_to_hashstr (unsigned char *hashstr, const uint8_t *digest)
+{
+  unsigned i;
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    {
+      *hashstr++ = (digest[i] & 0x0F) + 65;
+      *hashstr++ = ((digest[i] & 0xF0) >> 4) + 65;
+    }
+  *hashstr = 0;
+}
+
 static inline void
 build_program_compute_hash (cl_program program, unsigned device_i,
                             const char *hash_source, size_t source_len)
 {
-    SHA1_CTX hash_ctx;
-    unsigned i;
+    pocl_hash_ctx hash_ctx;
     cl_device_id device = program->devices[device_i];
 
-    static const char *builtin_seed = POCL_VERSION_BASE POCL_BUILD_TIMESTAMP
-#ifdef ENABLE_LLVM
-        LLVM_VERSION POCL_KERNELLIB_SHA1
-#endif
-        ;
-
-    pocl_SHA1_Init(&hash_ctx);
-    pocl_SHA1_Update (&hash_ctx, (uint8_t *)builtin_seed,
+    pocl_hash_init (&hash_ctx, use_fast_hash);
+    pocl_hash_update (&hash_ctx, (uint8_t *)builtin_seed,
                       strlen (builtin_seed));
 
     assert (hash_source);
     assert (source_len > 0);
-    pocl_SHA1_Update (&hash_ctx, (uint8_t *)hash_source, source_len);
+    pocl_hash_update (&hash_ctx, (uint8_t *)hash_source, source_len);
 
     if (program->compiler_options)
-        pocl_SHA1_Update(&hash_ctx, (uint8_t*) program->compiler_options,
-                         strlen(program->compiler_options));
+        pocl_hash_update (&hash_ctx, (uint8_t *)program->compiler_options,
+                          strlen (program->compiler_options));
 
 #ifdef ENABLE_LLVM
     /* The kernel compiler work-group function method affects the
        produced binary heavily. */
     if (device->llvm_target_triplet)
       {
+        if (device->llvm_cpu)
+          pocl_hash_update (&hash_ctx, (uint8_t *)device->llvm_cpu,
+                            strlen (device->llvm_cpu));
         const char *wg_method
             = pocl_get_string_option ("POCL_WORK_GROUP_METHOD", NULL);
         if (wg_method)
-          pocl_SHA1_Update (&hash_ctx, (uint8_t *)wg_method,
+          pocl_hash_update (&hash_ctx, (uint8_t *)wg_method,
                             strlen (wg_method));
+        const char *wg_versions
+            = pocl_get_string_option ("POCL_WORK_GROUP_GENERIC_VERSIONS",
+                                      NULL);
+        if (wg_versions)
+          pocl_hash_update (&hash_ctx, (uint8_t *)wg_versions,
+                            strlen (wg_versions));
+        const char *fiber_threshold
+            = pocl_get_string_option ("POCL_FIBER_THRESHOLD", NULL);
+        if (fiber_threshold)
+          {
+            pocl_hash_update (&hash_ctx, (uint8_t *)"fibers", 6);
+            pocl_hash_update (&hash_ctx, (uint8_t *)fiber_threshold,
+                              strlen (fiber_threshold));
+          }
+        if (device->preemption_points)
+          pocl_hash_update (&hash_ctx, (uint8_t *)"preempt", 7);
+        if (pocl_get_bool_option ("POCL_WORK_ITEM_PREFETCH", 0))
+          {
+            const char *distance = pocl_get_string_option (
+                "POCL_WORK_ITEM_PREFETCH_DISTANCE", "0");
+            pocl_hash_update (&hash_ctx, (uint8_t *)"prefetch", 8);
+            pocl_hash_update (&hash_ctx, (uint8_t *)distance,
+                              strlen (distance));
+          }
       }
 #endif
 
@@ -403,27 +507,264 @@ build_program_compute_hash (cl_program program, unsigned device_i,
     if (device->ops->build_hash)
       {
         char *dev_hash = device->ops->build_hash(device);
-        pocl_SHA1_Update(&hash_ctx, (const uint8_t *)dev_hash, strlen(dev_hash));
+        pocl_hash_update (&hash_ctx, (const uint8_t *)dev_hash,
+                          strlen (dev_hash));
         free(dev_hash);
       }
 
     uint8_t digest[SHA1_DIGEST_SIZE];
-    pocl_SHA1_Final(&hash_ctx, digest);
+    pocl_hash_final (&hash_ctx, digest);
 
-    unsigned char* hashstr = program->build_hash[device_i];
-    for (i=0; i < SHA1_DIGEST_SIZE; i++)
-        {
-            *hashstr++ = (digest[i] & 0x0F) + 65;
-            *hashstr++ = ((digest[i] & 0xF0) >> 4) + 65;
-        }
-    *hashstr = 0;
+    digest_to_hashstr (program->build_hash[device_i], digest);
 
     program->build_hash[device_i][2] = '/';
 }
 
 
+/******************************************************************************/
+
+/* A secondary cache tier shared by several nodes, consulted on misses of
+ * the local cache and updated after successful builds. Its entries are
+ * named by their path relative to the cache top directory. */
+typedef struct pocl_cache_tier pocl_cache_tier;
+struct pocl_cache_tier
+{
+  /* Copies the entry to the (nonexisting) local path.
+   * Returns 0 if the entry was found. */
+  int (*fetch) (pocl_cache_tier *tier, const char *name, const char *path);
+  /* Uploads the local file at path as the entry. */
+  void (*store) (pocl_cache_tier *tier, const char *name, const char *path);
+  char location[POCL_FILENAME_LENGTH];
+};
+
+static pocl_cache_tier remote_tier;
+static pocl_cache_tier *secondary_tier = NULL;
+
+/* A directory, e.g. on NFS, laid out like the local cache directory. */
+static int
+dir_tier_fetch (pocl_cache_tier *tier, const char *name, const char *path)
+{
+  char remote_path[POCL_FILENAME_LENGTH];
+  char *content = NULL;
+  uint64_t size = 0;
+  snprintf (remote_path, POCL_FILENAME_LENGTH, "%s/%s", tier->location, name);
+  if (!pocl_exists (remote_path)
+      || pocl_read_file (remote_path, &content, &size))
+    return -1;
+  int error = pocl_write_file (path, content, size, 0, 1);
+  POCL_MEM_FREE (content);
+  return error;
+}
+
+static void
+dir_tier_store (pocl_cache_tier *tier, const char *name, const char *path)
+{
+  char remote_path[POCL_FILENAME_LENGTH];
+  char remote_dir[POCL_FILENAME_LENGTH];
+  char *content = NULL;
+  uint64_t size = 0;
+  snprintf (remote_path, POCL_FILENAME_LENGTH, "%s/%s", tier->location, name);
+  if (pocl_exists (remote_path))
+    return;
+  strcpy (remote_dir, remote_path);
+  *strrchr (remote_dir, '/') = 0;
+  if (pocl_mkdir_p (remote_dir) || pocl_read_file (path, &content, &size))
+    return;
+  /* pocl_write_file() writes a temporary file next to remote_path and
+   * renames it in place, so concurrent uploaders do not corrupt it. */
+  pocl_write_file (remote_path, content, size, 0, 1);
+  POCL_MEM_FREE (content);
+}
+
+/* An external helper command, invoked as "<helper> get <name> <path>" and
+ * "<helper> put <name> <path>", which can implement e.g. HTTP or object
+ * storage backends. The get command must exit with 0 only if it wrote
+ * the entry to path. */
+static int
+cmd_tier_fetch (pocl_cache_tier *tier, const char *name, const char *path)
+{
+  char *const args[] = { tier->location, "get", (char *)name, (char *)path,
+                         NULL };
+  return pocl_run_command (args);
+}
+
+static void
+cmd_tier_store (pocl_cache_tier *tier, const char *name, const char *path)
+{
+  char *const args[] = { tier->location, "put", (char *)name, (char *)path,
+                         NULL };
+  if (pocl_run_command (args))
+    POCL_MSG_PRINT_GENERAL ("Uploading %s to the remote cache failed\n",
+                            name);
+}
+
+/* Sets up the secondary tier from POCL_CACHE_REMOTE, which is either a
+ * directory path, optionally prefixed with "dir:", or "cmd:<helper>". */
+static void
+init_secondary_tier ()
+{
+  const char *remote = pocl_get_string_option ("POCL_CACHE_REMOTE", NULL);
+  if (remote == NULL || remote[0] == 0)
+    return;
+
+  if (strncmp (remote, "cmd:", 4) == 0)
+    {
+      remote_tier.fetch = cmd_tier_fetch;
+      remote_tier.store = cmd_tier_store;
+      remote += 4;
+    }
+  else
+    {
+      remote_tier.fetch = dir_tier_fetch;
+      remote_tier.store = dir_tier_store;
+      if (strncmp (remote, "dir:", 4) == 0)
+        remote += 4;
+    }
+
+  if (strlen (remote) >= POCL_FILENAME_LENGTH)
+    {
+      POCL_MSG_ERR ("POCL_CACHE_REMOTE is longer than the maximum filename "
+                    "length, ignoring it\n");
+      return;
+    }
+  strcpy (remote_tier.location, remote);
+  secondary_tier = &remote_tier;
+  POCL_MSG_PRINT_GENERAL ("Using remote kernel cache %s\n", remote);
+}
+
+/* Fetches the entry name of the secondary tier to the local path, through
+ * a temporary file so other processes never see it partially written. */
+/* The name of an entry in the secondary tier, which keeps the entries of
+ * the two hash schemes apart like the local cache does. */
+static void
+secondary_tier_name (char *tier_name, const char *name)
+{
+  snprintf (tier_name, POCL_FILENAME_LENGTH, "%s%s",
+            use_fast_hash ? POCL_FASTHASH_LAYOUT_NAME "/" : "", name);
+}
+
+static int
+secondary_tier_fetch (const char *name, const char *path)
+{
+  char tmp_path[POCL_FILENAME_LENGTH];
+  char dir[POCL_FILENAME_LENGTH];
+  char tier_name[POCL_FILENAME_LENGTH];
+
+  if (secondary_tier == NULL)
+    return -1;
+  secondary_tier_name (tier_name, name);
+
+  if (pocl_cache_tempname (tmp_path, NULL, NULL))
+    return -1;
+  pocl_remove (tmp_path);
+
+  int error = secondary_tier->fetch (secondary_tier, tier_name, tmp_path);
+  if (error == 0)
+    {
+      strcpy (dir, path);
+      *strrchr (dir, '/') = 0;
+      error = pocl_mkdir_p (dir);
+    }
+  if (error == 0)
+    error = pocl_rename (tmp_path, path);
+  if (error)
+    {
+      if (pocl_exists (tmp_path))
+        pocl_remove (tmp_path);
+      return -1;
+    }
+
+  POCL_MSG_PRINT_GENERAL ("Fetched %s from the remote cache\n", name);
+  return 0;
+}
+
+static void
+secondary_tier_store (const char *name, const char *path)
+{
+  char tier_name[POCL_FILENAME_LENGTH];
+
+  if (secondary_tier == NULL)
+    return;
+  secondary_tier_name (tier_name, name);
+  secondary_tier->store (secondary_tier, tier_name, path);
+}
+
+int
+pocl_cache_fetch_remote_program_bc (cl_program program, unsigned device_i)
+{
+  char name[POCL_FILENAME_LENGTH];
+  char program_bc_path[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache || secondary_tier == NULL)
+    return -1;
+
+  snprintf (name, POCL_FILENAME_LENGTH, "%s" POCL_PROGRAM_BC_FILENAME,
+            program->build_hash[device_i]);
+  pocl_cache_program_bc_path (program_bc_path, program, device_i);
+  return secondary_tier_fetch (name, program_bc_path);
+}
+
+void
+pocl_cache_store_remote_program_bc (cl_program program, unsigned device_i)
+{
+  char name[POCL_FILENAME_LENGTH];
+  char program_bc_path[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache || secondary_tier == NULL)
+    return;
+
+  snprintf (name, POCL_FILENAME_LENGTH, "%s" POCL_PROGRAM_BC_FILENAME,
+            program->build_hash[device_i]);
+  pocl_cache_program_bc_path (program_bc_path, program, device_i);
+  secondary_tier_store (name, program_bc_path);
+}
+
 /******************************************************************************/
 
+int
+pocl_cache_enabled ()
+{
+  return use_kernel_cache;
+}
+
+int
+pocl_cache_write_program_bc (cl_program program, unsigned device_i)
+{
+  char program_bc_path[POCL_FILENAME_LENGTH];
+
+  /* the binaries of the other devices are not LLVM IR */
+  if (program->devices[device_i]->llvm_target_triplet == NULL)
+    return 0;
+  pocl_cache_program_bc_path (program_bc_path, program, device_i);
+  if (pocl_exists (program_bc_path))
+    return 0;
+  if (program->binaries[device_i] == NULL)
+    return -1;
+  return pocl_write_file (program_bc_path,
+                          (const char *)program->binaries[device_i],
+                          program->binary_sizes[device_i], 0, 1);
+}
+
+/* Syncing the written files only protects the cache against a crash of the
+ * system, which is pointless for the files removed with the program and
+ * for a cache in memory. */
+static int
+cache_needs_file_sync ()
+{
+  const char *sync = pocl_get_string_option ("POCL_CACHE_FSYNC", "auto");
+
+  if (strcmp (sync, "auto") != 0)
+    return pocl_get_bool_option ("POCL_CACHE_FSYNC", 1);
+  if (!use_kernel_cache)
+    return 0;
+#ifdef __linux__
+  struct statfs fs;
+  if (statfs (cache_topdir, &fs) == 0 && fs.f_type == TMPFS_MAGIC)
+    return 0;
+#endif
+  return 1;
+}
+
 int
 pocl_cache_init_topdir ()
 {
@@ -433,6 +774,12 @@ pocl_cache_init_topdir ()
   use_kernel_cache
       = pocl_get_bool_option ("POCL_KERNEL_CACHE", POCL_KERNEL_CACHE_DEFAULT);
 
+  const char *hash = pocl_get_string_option ("POCL_CACHE_HASH", "fast");
+  if (strcmp (hash, "sha1") == 0)
+    use_fast_hash = 0;
+  else if (strcmp (hash, "fast") != 0)
+    POCL_MSG_WARN ("Unknown POCL_CACHE_HASH %s, using the fast hash\n", hash);
+
   const char *tmp_path = pocl_get_string_option ("POCL_CACHE_DIR", NULL);
   int needed;
 
@@ -476,6 +823,10 @@ pocl_cache_init_topdir ()
 #endif
     }
 
+  if (use_fast_hash && needed < POCL_FILENAME_LENGTH)
+    needed += snprintf (cache_topdir + needed, POCL_FILENAME_LENGTH - needed,
+                        "/" POCL_FASTHASH_LAYOUT_NAME);
+
   if (needed >= POCL_FILENAME_LENGTH)
     {
       POCL_MSG_ERR ("pocl: cache path longer than maximum filename length\n");
@@ -522,8 +873,15 @@ pocl_cache_init_topdir ()
         assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
       }
 
+    pocl_set_file_sync (cache_needs_file_sync ());
+
     cache_topdir_initialized = 1;
 
+    if (use_kernel_cache)
+      init_secondary_tier ();
+
+    pocl_cache_enforce_size_limit ();
+
     return 0;
 }
 
@@ -600,3 +958,478 @@ void pocl_cache_cleanup_cachedir(cl_program program) {
 }
 
 /******************************************************************************/
+
+/* The content-addressed object store keeps one copy of each final
+ * work-group function binary under objects/, keyed by the hash of its
+ * work-group function bitcode, the device and the specialization. The
+ * program cache directories hold hard links to the objects, so the same
+ * kernel built from different programs takes disk space only once. */
+
+static void
+object_store_path (char *path, const char *key)
+{
+  int bytes_written
+      = snprintf (path, POCL_FILENAME_LENGTH, "%s" POCL_OBJECT_STORE_DIRNAME "/%s",
+                  cache_topdir, key);
+  assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
+}
+
+#ifdef ENABLE_LLVM
+void
+pocl_cache_object_key (char *key, cl_kernel kernel, unsigned device_i,
+                       _cl_command_node *command, int specialize,
+                       void *llvm_module)
+{
+  pocl_hash_ctx hash_ctx;
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  char spec[POCL_FILENAME_LENGTH];
+  cl_device_id device = kernel->program->devices[device_i];
+  const char **flag;
+
+  pocl_hash_init (&hash_ctx, use_fast_hash);
+  pocl_hash_update (&hash_ctx, (uint8_t *)builtin_seed,
+                    strlen (builtin_seed));
+
+  pocl_llvm_hash_module (kernel->context, llvm_module, &hash_ctx);
+
+  if (device->ops->build_hash)
+    {
+      char *dev_hash = device->ops->build_hash (device);
+      pocl_hash_update (&hash_ctx, (const uint8_t *)dev_hash,
+                        strlen (dev_hash));
+      free (dev_hash);
+    }
+  for (flag = device->final_linkage_flags; flag && *flag; ++flag)
+    pocl_hash_update (&hash_ctx, (const uint8_t *)*flag, strlen (*flag) + 1);
+
+  kernel_specialization_path (spec, kernel, "", command, specialize);
+  pocl_hash_update (&hash_ctx, (const uint8_t *)spec, strlen (spec));
+
+  pocl_hash_final (&hash_ctx, digest);
+  digest_to_hashstr ((unsigned char *)key, digest);
+  key[2] = '/';
+}
+#endif
+
+int
+pocl_cache_fetch_object (const char *key, const char *path)
+{
+  char object_path[POCL_FILENAME_LENGTH];
+  char tmp_path[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache)
+    return -1;
+
+  object_store_path (object_path, key);
+  if (!pocl_exists (object_path))
+    {
+      char name[POCL_FILENAME_LENGTH];
+      snprintf (name, POCL_FILENAME_LENGTH, "%s/%s",
+                POCL_OBJECT_STORE_DIRNAME + 1, key);
+      if (secondary_tier_fetch (name, object_path))
+        return -1;
+    }
+
+  /* Link under a temporary name and rename it in place, so that other
+   * processes never see a half-created kernel binary at path. */
+  if (pocl_cache_tempname (tmp_path, ".so", NULL))
+    return -1;
+  pocl_remove (tmp_path);
+  if (link (object_path, tmp_path))
+    return -1;
+  if (pocl_rename (tmp_path, path))
+    {
+      pocl_remove (tmp_path);
+      return -1;
+    }
+
+  /* The modification time of an object is its last access time. */
+  utime (object_path, NULL);
+  POCL_MSG_PRINT_GENERAL ("Found %s in the kernel object store\n", path);
+  return 0;
+}
+
+void
+pocl_cache_store_object (const char *key, const char *path)
+{
+  char object_path[POCL_FILENAME_LENGTH];
+  char object_dir[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache)
+    return;
+
+  object_store_path (object_path, key);
+  strcpy (object_dir, object_path);
+  *strrchr (object_dir, '/') = 0;
+  if (pocl_mkdir_p (object_dir))
+    return;
+
+  /* A concurrent writer might have stored the same object first, in which
+   * case link() fails with EEXIST. The contents are equal by construction,
+   * so the existing one is kept. */
+  if (link (path, object_path))
+    {
+      if (errno != EEXIST)
+        POCL_MSG_PRINT_GENERAL (
+            "Could not add %s to the kernel object store\n", path);
+      return;
+    }
+
+  char name[POCL_FILENAME_LENGTH];
+  snprintf (name, POCL_FILENAME_LENGTH, "%s/%s", POCL_OBJECT_STORE_DIRNAME + 1,
+            key);
+  secondary_tier_store (name, object_path);
+}
+
+int
+pocl_cache_builtin_pch_path (char *path, const char *options)
+{
+  pocl_hash_ctx hash_ctx;
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  unsigned char hashstr[SHA1_DIGEST_SIZE * 2 + 1];
+  char pch_dir[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache)
+    return -1;
+
+  pocl_hash_init (&hash_ctx, use_fast_hash);
+  pocl_hash_update (&hash_ctx, (uint8_t *)builtin_seed,
+                    strlen (builtin_seed));
+  pocl_hash_update (&hash_ctx, (const uint8_t *)options, strlen (options));
+  pocl_hash_final (&hash_ctx, digest);
+  digest_to_hashstr (hashstr, digest);
+
+  snprintf (pch_dir, POCL_FILENAME_LENGTH, "%s" POCL_PCH_DIRNAME,
+            cache_topdir);
+  if (pocl_mkdir_p (pch_dir))
+    return -1;
+
+  int bytes_written = snprintf (path, POCL_FILENAME_LENGTH, "%s/%s.pch",
+                                pch_dir, hashstr);
+  assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
+  return 0;
+}
+
+int
+pocl_cache_lock (int kind, const char *name)
+{
+  char lock_path[POCL_FILENAME_LENGTH];
+  uint32_t stripe = 2166136261U;
+  const char *c;
+
+  if (!use_kernel_cache)
+    return -1;
+
+  /* FNV-1a; the lock files are never removed, since a process could be
+   * waiting on one */
+  for (c = name; *c; ++c)
+    stripe = (stripe ^ (unsigned char)*c) * 16777619U;
+  stripe %= POCL_CACHE_LOCK_STRIPES;
+
+  snprintf (lock_path, POCL_FILENAME_LENGTH, "%s" POCL_LOCKS_DIRNAME,
+            cache_topdir);
+  if (pocl_mkdir_p (lock_path))
+    return -1;
+  static const char *kind_names[] = { "program", "object", "kernel" };
+  assert (kind >= 0 && kind <= POCL_CACHE_LOCK_KERNEL);
+  int bytes_written = snprintf (
+      lock_path, POCL_FILENAME_LENGTH, "%s" POCL_LOCKS_DIRNAME "/%s-%02u",
+      cache_topdir, kind_names[kind], stripe);
+  assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
+
+  int fd = open (lock_path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  if (flock (fd, LOCK_EX | LOCK_NB))
+    {
+      uint64_t start = pocl_gettimemono_ns ();
+      if (errno != EWOULDBLOCK || flock (fd, LOCK_EX))
+        {
+          close (fd);
+          return -1;
+        }
+      POCL_MSG_PRINT_GENERAL ("Waited %" PRIu64 " us for the build of %s "
+                              "by another process or thread\n",
+                              (pocl_gettimemono_ns () - start) / 1000, name);
+    }
+  return fd;
+}
+
+void
+pocl_cache_unlock (int lock)
+{
+  if (lock < 0)
+    return;
+  flock (lock, LOCK_UN);
+  close (lock);
+}
+
+int
+pocl_cache_spirv_bitcode_path (char *path, const char *spirv, size_t size)
+{
+  pocl_hash_ctx hash_ctx;
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  unsigned char hashstr[SHA1_DIGEST_SIZE * 2 + 1];
+  char spirv_dir[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache)
+    return -1;
+
+  /* the translation depends on the LLVM of this build */
+  pocl_hash_init (&hash_ctx, use_fast_hash);
+  pocl_hash_update (&hash_ctx, (uint8_t *)builtin_seed,
+                    strlen (builtin_seed));
+  pocl_hash_update (&hash_ctx, (const uint8_t *)spirv, size);
+  pocl_hash_final (&hash_ctx, digest);
+  digest_to_hashstr (hashstr, digest);
+
+  snprintf (spirv_dir, POCL_FILENAME_LENGTH, "%s" POCL_SPIRV_DIRNAME,
+            cache_topdir);
+  if (pocl_mkdir_p (spirv_dir))
+    return -1;
+
+  int bytes_written = snprintf (path, POCL_FILENAME_LENGTH, "%s/%s.bc",
+                                spirv_dir, hashstr);
+  assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
+  return 0;
+}
+
+int
+pocl_cache_device_cache_path (char *path, const char *name)
+{
+  char dir[POCL_FILENAME_LENGTH];
+
+  if (!use_kernel_cache)
+    return -1;
+
+  snprintf (dir, POCL_FILENAME_LENGTH, "%s" POCL_DEVICE_CACHE_DIRNAME,
+            cache_topdir);
+  if (pocl_mkdir_p (dir))
+    return -1;
+
+  int bytes_written
+      = snprintf (path, POCL_FILENAME_LENGTH, "%s/%s", dir, name);
+  assert (bytes_written > 0 && bytes_written < POCL_FILENAME_LENGTH);
+  return 0;
+}
+
+/******************************************************************************/
+
+typedef struct
+{
+  char path[POCL_FILENAME_LENGTH];
+  time_t last_access;
+  uint64_t size;
+  int is_object;
+} cache_entry;
+
+typedef struct
+{
+  cache_entry *entries;
+  size_t num;
+  size_t capacity;
+} cache_entry_list;
+
+static void
+cache_entry_add (cache_entry_list *list, const char *path, time_t last_access,
+                 uint64_t size, int is_object)
+{
+  if (list->num == list->capacity)
+    {
+      size_t capacity = list->capacity ? list->capacity * 2 : 64;
+      cache_entry *entries
+          = realloc (list->entries, capacity * sizeof (cache_entry));
+      if (entries == NULL)
+        return;
+      list->entries = entries;
+      list->capacity = capacity;
+    }
+  cache_entry *e = &list->entries[list->num++];
+  strncpy (e->path, path, POCL_FILENAME_LENGTH - 1);
+  e->path[POCL_FILENAME_LENGTH - 1] = 0;
+  e->last_access = last_access;
+  e->size = size;
+  e->is_object = is_object;
+}
+
+static int
+cache_entry_compare (const void *a, const void *b)
+{
+  const cache_entry *x = (const cache_entry *)a;
+  const cache_entry *y = (const cache_entry *)b;
+  return (x->last_access > y->last_access) - (x->last_access < y->last_access);
+}
+
+/* Returns the size of the files under path which are not links to the
+ * object store; those are accounted for in the store itself. */
+static uint64_t
+private_files_size (const char *path)
+{
+  uint64_t size = 0;
+  struct dirent *ent;
+  DIR *dir = opendir (path);
+  if (dir == NULL)
+    return 0;
+
+  while ((ent = readdir (dir)) != NULL)
+    {
+      char child[POCL_FILENAME_LENGTH];
+      struct stat st;
+      if (strcmp (ent->d_name, ".") == 0 || strcmp (ent->d_name, "..") == 0)
+        continue;
+      snprintf (child, POCL_FILENAME_LENGTH, "%s/%s", path, ent->d_name);
+      if (lstat (child, &st))
+        continue;
+      if (S_ISDIR (st.st_mode))
+        size += private_files_size (child);
+      else if (S_ISREG (st.st_mode) && st.st_nlink == 1)
+        size += st.st_size;
+    }
+  closedir (dir);
+  return size;
+}
+
+/* Collects the entries of a "XX/YYYY..." hash-named directory tree:
+ * program cache directories of topdir, or objects of the object store.
+ * Only objects no program links to anymore are eviction candidates.
+ * If total is not NULL, the size of all the entries is added to it. */
+static void
+collect_cache_entries (const char *topdir, int object_store,
+                       cache_entry_list *list, uint64_t *total)
+{
+  struct dirent *top_ent, *ent;
+  DIR *top = opendir (topdir);
+  if (top == NULL)
+    return;
+
+  while ((top_ent = readdir (top)) != NULL)
+    {
+      char prefix[POCL_FILENAME_LENGTH];
+      /* Hash directories are named by the first two hash characters. */
+      if (strlen (top_ent->d_name) != 2 || top_ent->d_name[0] == '.')
+        continue;
+      snprintf (prefix, POCL_FILENAME_LENGTH, "%s/%s", topdir,
+                top_ent->d_name);
+      DIR *dir = opendir (prefix);
+      if (dir == NULL)
+        continue;
+
+      while ((ent = readdir (dir)) != NULL)
+        {
+          char path[POCL_FILENAME_LENGTH];
+          char last_accessed[POCL_FILENAME_LENGTH];
+          struct stat st;
+          uint64_t size;
+          if (ent->d_name[0] == '.')
+            continue;
+          snprintf (path, POCL_FILENAME_LENGTH, "%s/%s", prefix, ent->d_name);
+          if (lstat (path, &st))
+            continue;
+
+          if (object_store)
+            {
+              if (!S_ISREG (st.st_mode))
+                continue;
+              size = st.st_size;
+              if (st.st_nlink == 1)
+                cache_entry_add (list, path, st.st_mtime, size, 1);
+            }
+          else
+            {
+              if (!S_ISDIR (st.st_mode))
+                continue;
+              size = private_files_size (path);
+              snprintf (last_accessed, POCL_FILENAME_LENGTH, "%s%s", path,
+                        POCL_LAST_ACCESSED_FILENAME);
+              if (stat (last_accessed, &st) == 0 || stat (path, &st) == 0)
+                cache_entry_add (list, path, st.st_mtime, size, 0);
+            }
+          if (total)
+            *total += size;
+        }
+      closedir (dir);
+    }
+  closedir (top);
+}
+
+/* Evicts the least recently used entries until total is at most target. */
+static void
+evict_cache_entries (cache_entry_list *list, uint64_t *total, uint64_t target,
+                     time_t now)
+{
+  size_t i;
+  qsort (list->entries, list->num, sizeof (cache_entry), cache_entry_compare);
+  for (i = 0; i < list->num && *total > target; ++i)
+    {
+      cache_entry *e = &list->entries[i];
+      if (now - e->last_access < POCL_CACHE_PRUNE_GRACE)
+        break;
+      POCL_MSG_PRINT_GENERAL ("Evicting %s from the kernel cache\n", e->path);
+      int error = e->is_object ? pocl_remove (e->path) : pocl_rm_rf (e->path);
+      if (error == 0)
+        *total = (*total > e->size) ? *total - e->size : 0;
+    }
+  list->num = 0;
+}
+
+void
+pocl_cache_enforce_size_limit ()
+{
+  static time_t last_check = 0;
+  char lock_path[POCL_FILENAME_LENGTH];
+  char store_path[POCL_FILENAME_LENGTH];
+  cache_entry_list list = { NULL, 0, 0 };
+  uint64_t total = 0;
+
+  if (!use_kernel_cache)
+    return;
+
+  int max_size = pocl_get_int_option ("POCL_CACHE_MAX_SIZE", 0);
+  if (max_size <= 0)
+    return;
+
+  time_t now = time (NULL);
+  if (last_check != 0 && now - last_check < POCL_CACHE_PRUNE_INTERVAL)
+    return;
+  last_check = now;
+
+  /* Only one process at a time prunes the cache, the others skip it. */
+  snprintf (lock_path, POCL_FILENAME_LENGTH, "%s" POCL_PRUNE_LOCK_FILENAME,
+            cache_topdir);
+  int fd = open (lock_path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  if (flock (fd, LOCK_EX | LOCK_NB))
+    {
+      close (fd);
+      return;
+    }
+
+  uint64_t limit = (uint64_t)max_size << 20;
+  /* Prune below the limit so that the next builds do not trigger it. */
+  uint64_t target = limit / 10 * 9;
+  snprintf (store_path, POCL_FILENAME_LENGTH, "%s" POCL_OBJECT_STORE_DIRNAME,
+            cache_topdir);
+
+  collect_cache_entries (cache_topdir, 0, &list, &total);
+  collect_cache_entries (store_path, 1, &list, &total);
+  POCL_MSG_PRINT_GENERAL ("Kernel cache size %" PRIu64 " bytes, limit %" PRIu64
+                          "\n",
+                          total, limit);
+
+  if (total > limit)
+    {
+      evict_cache_entries (&list, &total, target, now);
+      /* Evicting program directories unreferences their objects, which
+       * are evicted next if needed. */
+      if (total > target)
+        {
+          collect_cache_entries (store_path, 1, &list, NULL);
+          evict_cache_entries (&list, &total, target, now);
+        }
+    }
+
+  free (list.entries);
+  flock (fd, LOCK_UN);
+  close (fd);
+}
@@ -0,0 +1,369 @@
+/* OpenCL runtime library: device performance calibration
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "pocl_calibrate.h"
+#include "pocl_cache.h"
+#include "pocl_file_util.h"
+#include "pocl_timing.h"
+#include "pocl_util.h"
+
+#include <string.h>
+
+/* The most bytes the copy kernel copies. */
+#define CALIBRATION_COPY_SIZE (64 * 1024 * 1024)
+/* The work-items of the multiply-add kernel per compute unit. */
+#define CALIBRATION_MAD_ITEMS_PER_CU 8192
+/* The float operations of a work-item of the multiply-add kernel: 256
+ * iterations of 8 multiply-adds. */
+#define CALIBRATION_MAD_FLOPS (256 * 8 * 2)
+/* The timed runs of the copy and multiply-add kernels, after a warm-up
+ * one; the shortest counts. */
+#define CALIBRATION_RUNS 3
+/* The launches of the empty kernel the latency is averaged over. */
+#define CALIBRATION_LAUNCHES 16
+
+static const char calibration_source[]
+    = "kernel void copy (global const float4 *src, global float4 *dst)\n"
+      "{\n"
+      "  size_t i = get_global_id (0);\n"
+      "  dst[i] = src[i];\n"
+      "}\n"
+      "\n"
+      "kernel void mad_chains (global float *dst, float a, float b)\n"
+      "{\n"
+      "  float x0 = (float)get_global_id (0);\n"
+      "  float x1 = x0 + 1.0f, x2 = x0 + 2.0f, x3 = x0 + 3.0f;\n"
+      "  float x4 = x0 + 4.0f, x5 = x0 + 5.0f, x6 = x0 + 6.0f;\n"
+      "  float x7 = x0 + 7.0f;\n"
+      "  for (int i = 0; i < 256; ++i)\n"
+      "    {\n"
+      "      x0 = mad (x0, a, b); x1 = mad (x1, a, b);\n"
+      "      x2 = mad (x2, a, b); x3 = mad (x3, a, b);\n"
+      "      x4 = mad (x4, a, b); x5 = mad (x5, a, b);\n"
+      "      x6 = mad (x6, a, b); x7 = mad (x7, a, b);\n"
+      "    }\n"
+      "  dst[get_global_id (0)] = x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7;\n"
+      "}\n"
+      "\n"
+      "kernel void empty (void)\n"
+      "{\n"
+      "}\n";
+
+/* Protects the performance and performance_state of the devices, and
+ * serializes the measurements. */
+static pocl_lock_t calibrate_lock = POCL_LOCK_INITIALIZER;
+
+/* Writes the path of the device's results in the kernel cache to path.
+ * Returns nonzero if the kernel cache is disabled. */
+static int
+calibration_path (cl_device_id device, char *path)
+{
+  SHA1_CTX ctx;
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  char name[sizeof ("calibration-") + 2 * SHA1_DIGEST_SIZE];
+  unsigned i;
+
+  pocl_SHA1_Init (&ctx);
+  if (device->ops->build_hash)
+    {
+      char *build_hash = device->ops->build_hash (device);
+      pocl_SHA1_Update (&ctx, (const uint8_t *)build_hash,
+                        strlen (build_hash));
+      free (build_hash);
+    }
+  if (device->long_name)
+    pocl_SHA1_Update (&ctx, (const uint8_t *)device->long_name,
+                      strlen (device->long_name) + 1);
+  if (device->driver_version)
+    pocl_SHA1_Update (&ctx, (const uint8_t *)device->driver_version,
+                      strlen (device->driver_version) + 1);
+  pocl_SHA1_Update (&ctx, (const uint8_t *)&device->max_compute_units,
+                    sizeof (device->max_compute_units));
+  pocl_SHA1_Update (&ctx, (const uint8_t *)&device->global_mem_size,
+                    sizeof (device->global_mem_size));
+  pocl_SHA1_Final (&ctx, digest);
+
+  strcpy (name, "calibration-");
+  for (i = 0; i < SHA1_DIGEST_SIZE; ++i)
+    sprintf (name + strlen ("calibration-") + 2 * i, "%02x", digest[i]);
+  return pocl_cache_device_cache_path (path, name);
+}
+
+static int
+read_cached (cl_device_id device, cl_device_performance_pocl *perf)
+{
+  char path[POCL_FILENAME_LENGTH];
+  char *content = NULL;
+  uint64_t size = 0;
+  unsigned long long bandwidth, flops, latency;
+
+  if (calibration_path (device, path) || !pocl_exists (path)
+      || pocl_read_file (path, &content, &size))
+    return -1;
+  int n = sscanf (content,
+                  "global_mem_bandwidth %llu flops %llu "
+                  "launch_latency_ns %llu",
+                  &bandwidth, &flops, &latency);
+  POCL_MEM_FREE (content);
+  if (n != 3)
+    return -1;
+  perf->global_mem_bandwidth = bandwidth;
+  perf->flops = flops;
+  perf->launch_latency_ns = latency;
+  return 0;
+}
+
+static void
+write_cached (cl_device_id device, const cl_device_performance_pocl *perf)
+{
+  char path[POCL_FILENAME_LENGTH];
+  char content[256];
+
+  if (calibration_path (device, path))
+    return;
+  int n = snprintf (content, sizeof (content),
+                    "global_mem_bandwidth %llu\n"
+                    "flops %llu\n"
+                    "launch_latency_ns %llu\n",
+                    (unsigned long long)perf->global_mem_bandwidth,
+                    (unsigned long long)perf->flops,
+                    (unsigned long long)perf->launch_latency_ns);
+  pocl_write_file (path, content, n, 0, 0);
+}
+
+/* Runs the kernel over global work-items and returns the time it ran on
+ * the device, from the profiling time stamps, or 0 on an error. */
+static cl_ulong
+run_timed (cl_command_queue queue, cl_kernel kernel, size_t global)
+{
+  cl_event event = NULL;
+  cl_ulong start = 0, end = 0;
+
+  cl_int err = POname (clEnqueueNDRangeKernel) (queue, kernel, 1, NULL,
+                                                &global, NULL, 0, NULL, &event);
+  if (err != CL_SUCCESS)
+    return 0;
+  err = POname (clWaitForEvents) (1, &event);
+  if (err == CL_SUCCESS)
+    err = POname (clGetEventProfilingInfo) (
+        event, CL_PROFILING_COMMAND_START, sizeof (start), &start, NULL);
+  if (err == CL_SUCCESS)
+    err = POname (clGetEventProfilingInfo) (event, CL_PROFILING_COMMAND_END,
+                                            sizeof (end), &end, NULL);
+  POname (clReleaseEvent) (event);
+  return (err == CL_SUCCESS && end > start) ? end - start : 0;
+}
+
+/* The shortest time of CALIBRATION_RUNS runs after a warm-up one. */
+static cl_ulong
+best_time (cl_command_queue queue, cl_kernel kernel, size_t global)
+{
+  cl_ulong best = 0;
+  unsigned i;
+
+  for (i = 0; i <= CALIBRATION_RUNS; ++i)
+    {
+      cl_ulong time = run_timed (queue, kernel, global);
+      if (time == 0)
+        return 0;
+      if (i > 0 && (best == 0 || time < best))
+        best = time;
+    }
+  return best;
+}
+
+static cl_int
+measure (cl_device_id device, cl_device_performance_pocl *perf)
+{
+  cl_context context = NULL;
+  cl_command_queue queue = NULL;
+  cl_program program = NULL;
+  cl_kernel copy = NULL, mad = NULL, empty = NULL;
+  cl_mem src = NULL, dst = NULL;
+  const char *source = calibration_source;
+  cl_float zero = 0.0f, a = 0.999f, b = 0.001f;
+  size_t one = 1;
+  cl_ulong time;
+  unsigned i;
+  cl_int err;
+
+  POCL_RETURN_ERROR_ON ((!device->compiler_available), CL_INVALID_OPERATION,
+                        "Device %s has no compiler for the calibration "
+                        "kernels\n",
+                        device->short_name);
+
+  context = POname (clCreateContext) (NULL, 1, &device, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  queue = POname (clCreateCommandQueue) (context, device,
+                                         CL_QUEUE_PROFILING_ENABLE, &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  program = POname (clCreateProgramWithSource) (context, 1, &source, NULL,
+                                                &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  err = POname (clBuildProgram) (program, 1, &device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  copy = POname (clCreateKernel) (program, "copy", &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  mad = POname (clCreateKernel) (program, "mad_chains", &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  empty = POname (clCreateKernel) (program, "empty", &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+
+  size_t size = device->max_mem_alloc_size / 2;
+  if (size > CALIBRATION_COPY_SIZE)
+    size = CALIBRATION_COPY_SIZE;
+  size &= ~(size_t)15;
+  src = POname (clCreateBuffer) (context, CL_MEM_READ_WRITE, size, NULL,
+                                 &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  dst = POname (clCreateBuffer) (context, CL_MEM_READ_WRITE, size, NULL,
+                                 &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  err = POname (clEnqueueFillBuffer) (queue, src, &zero, sizeof (zero), 0,
+                                      size, 0, NULL, NULL);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+
+  POname (clSetKernelArg) (copy, 0, sizeof (cl_mem), &src);
+  POname (clSetKernelArg) (copy, 1, sizeof (cl_mem), &dst);
+  time = best_time (queue, copy, size / 16);
+  perf->global_mem_bandwidth
+      = time ? (cl_ulong)(2.0 * (double)size * 1e9 / (double)time) : 0;
+
+  size_t mad_items = (size_t)device->max_compute_units
+                     * CALIBRATION_MAD_ITEMS_PER_CU;
+  if (mad_items > size / sizeof (cl_float))
+    mad_items = size / sizeof (cl_float);
+  POname (clSetKernelArg) (mad, 0, sizeof (cl_mem), &dst);
+  POname (clSetKernelArg) (mad, 1, sizeof (cl_float), &a);
+  POname (clSetKernelArg) (mad, 2, sizeof (cl_float), &b);
+  time = best_time (queue, mad, mad_items);
+  perf->flops = time ? (cl_ulong)((double)mad_items * CALIBRATION_MAD_FLOPS
+                                  * 1e9 / (double)time)
+                     : 0;
+
+  /* the latency as the application sees it, from the host clock */
+  err = POname (clEnqueueNDRangeKernel) (queue, empty, 1, NULL, &one, NULL,
+                                         0, NULL, NULL);
+  if (err == CL_SUCCESS)
+    err = POname (clFinish) (queue);
+  uint64_t start = pocl_gettimemono_ns ();
+  for (i = 0; i < CALIBRATION_LAUNCHES && err == CL_SUCCESS; ++i)
+    {
+      err = POname (clEnqueueNDRangeKernel) (queue, empty, 1, NULL, &one,
+                                             NULL, 0, NULL, NULL);
+      if (err == CL_SUCCESS)
+        err = POname (clFinish) (queue);
+    }
+  perf->launch_latency_ns
+      = (pocl_gettimemono_ns () - start) / CALIBRATION_LAUNCHES;
+
+  if (err == CL_SUCCESS
+      && (perf->global_mem_bandwidth == 0 || perf->flops == 0))
+    err = CL_OUT_OF_RESOURCES;
+
+ERROR:
+  if (src)
+    POname (clReleaseMemObject) (src);
+  if (dst)
+    POname (clReleaseMemObject) (dst);
+  if (copy)
+    POname (clReleaseKernel) (copy);
+  if (mad)
+    POname (clReleaseKernel) (mad);
+  if (empty)
+    POname (clReleaseKernel) (empty);
+  if (program)
+    POname (clReleaseProgram) (program);
+  if (queue)
+    POname (clReleaseCommandQueue) (queue);
+  if (context)
+    POname (clReleaseContext) (context);
+  return err;
+}
+
+/* Looks the device up in the kernel cache the first time. Called with
+ * calibrate_lock held. */
+static void
+lookup_cached (cl_device_id device)
+{
+  if (device->performance_state != 0)
+    return;
+  if (read_cached (device, &device->performance) == 0)
+    device->performance_state = 1;
+  else
+    device->performance_state = -1;
+}
+
+cl_int
+pocl_device_performance (cl_device_id device,
+                         cl_device_performance_pocl *perf)
+{
+  cl_int err = CL_SUCCESS;
+
+  POCL_LOCK (calibrate_lock);
+  lookup_cached (device);
+  if (device->performance_state != 1)
+    {
+      uint64_t start = pocl_gettimemono_ns ();
+      err = measure (device, &device->performance);
+      if (err == CL_SUCCESS)
+        {
+          device->performance_state = 1;
+          write_cached (device, &device->performance);
+          POCL_MSG_PRINT_INFO (
+              "Calibrated %s in %" PRIu64 " ms: %" PRIu64
+              " B/s, %" PRIu64 " flop/s, %" PRIu64 " ns per launch\n",
+              device->short_name, (pocl_gettimemono_ns () - start) / 1000000,
+              (uint64_t)device->performance.global_mem_bandwidth,
+              (uint64_t)device->performance.flops,
+              (uint64_t)device->performance.launch_latency_ns);
+        }
+    }
+  if (err == CL_SUCCESS)
+    *perf = device->performance;
+  POCL_UNLOCK (calibrate_lock);
+  return err;
+}
+
+double
+pocl_device_calibrated_flops (cl_device_id device)
+{
+  double flops = 0.0;
+
+  POCL_LOCK (calibrate_lock);
+  lookup_cached (device);
+  if (device->performance_state == 1)
+    flops = (double)device->performance.flops;
+  POCL_UNLOCK (calibrate_lock);
+  return flops;
+}
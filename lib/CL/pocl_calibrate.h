@@ -0,0 +1,45 @@
+/* OpenCL runtime library: device performance calibration
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* The CL_DEVICE_PERFORMANCE_POCL of a device is measured the first time it
+   is queried, in a context of its own with three small kernels: a copy
+   between two buffers, chains of multiply-adds and an empty kernel. The
+   results are stored in the devices directory of the kernel cache, named
+   by a hash of the device's build hash and its identity, from where the
+   later processes read them without measuring again. */
+
+#ifndef POCL_CALIBRATE_H
+#define POCL_CALIBRATE_H
+
+#include "pocl_cl.h"
+
+/* Returns the performance of the device in *perf, measuring it if neither
+   this process nor the kernel cache has it yet. */
+cl_int pocl_device_performance (cl_device_id device,
+                                cl_device_performance_pocl *perf);
+
+/* Returns the measured float operations per second of the device, if this
+   process or the kernel cache has them, without measuring. 0 otherwise. */
+double pocl_device_calibrated_flops (cl_device_id device);
+
+#endif
@@ -371,6 +371,8 @@ typedef struct pocl_argument {
    * At enqueue time, subbuffers are converted to buffers + offset into them.
    */
   uint64_t offset;
+  /* the size of the subbuffer, or 0 if the argument is not a subbuffer */
+  uint64_t sub_buffer_size;
   void *value;
   /* 1 if this argument has been set by clSetKernelArg */
   char is_set;
@@ -381,6 +383,17 @@ typedef struct pocl_argument {
   char is_svm;
 } pocl_argument;
 
+/* An immutable copy of the arguments set to a kernel, with the values
+ * packed in one allocation. The commands launching the kernel share it
+ * until an argument is set to a different value. */
+typedef struct pocl_kernel_args
+{
+  struct pocl_argument *arguments;
+  char *storage;
+  /* held by the kernel, while current, and by each command using it */
+  uint64_t refcount;
+} pocl_kernel_args;
+
 typedef struct event_node event_node;
 
 /**
@@ -421,6 +434,12 @@ struct pocl_device_ops {
      with node->event locked, and must return with it unlocked. */
   void (*submit) (_cl_command_node *node, cl_command_queue cq);
 
+  /* optional; if set, the commands of the non-hidden queues are collected
+     and given to submit_batch as one list (linked by next/prev, in enqueue
+     order) on clFlush and friends, or once POCL_SUBMIT_BATCH_SIZE commands
+     are waiting. Called with the events of the nodes unlocked. */
+  void (*submit_batch) (_cl_command_node *batch, cl_command_queue cq);
+
   /* join is called by clFinish and this function blocks until all the enqueued
      commands are finished. Called by the user thread; see notify_cmdq_finished
      for the driver thread counterpart. */
@@ -494,6 +513,12 @@ struct pocl_device_ops {
   /* reinitializes the driver for a particular device. Called after uninit;
    * the first initialization is done by 'init'. May be NULL */
   cl_int (*reinit) (unsigned j, cl_device_id device);
+  /* Optional. The expensive part of the initialization, e.g. creating
+   * hardware contexts or thread pools, which 'init' can leave to this.
+   * Called once before the device is first used in a context, or again
+   * after uninit; the devices of different drivers are set up in parallel.
+   * 'init' must still fill in everything clGetDeviceInfo returns. */
+  cl_int (*init_deferred) (cl_device_id device);
 
   /* allocate a buffer in device memory */
   cl_int (*alloc_mem_obj) (cl_device_id device, cl_mem mem_obj, void* host_ptr);
@@ -503,12 +528,16 @@ struct pocl_device_ops {
   /* return >0 if driver can migrate directly between devices.
    * Priority between devices signalled by larger numbers. */
   int (*can_migrate_d2d) (cl_device_id dest, cl_device_id source);
-  /* migrate buffer content directly between devices */
+  /* migrate the given byte range of a buffer's content directly between
+   * devices. Called in the destination device's command execution, with
+   * the ops of the destination device, or of the source device if the
+   * destination doesn't implement it. */
   int (*migrate_d2d) (cl_device_id src_dev,
                       cl_device_id dst_dev,
                       cl_mem mem,
                       pocl_mem_identifier *src_mem_id,
-                      pocl_mem_identifier *dst_mem_id);
+                      pocl_mem_identifier *dst_mem_id,
+                      size_t offset, size_t size);
 
   /* SVM Ops */
   void (*svm_free) (cl_device_id dev, void *svm_ptr);
@@ -710,6 +739,16 @@ struct pocl_device_ops {
   int (*init_context) (cl_device_id device, cl_context context);
   int (*free_context) (cl_device_id device, cl_context context);
 
+  /* Optional. Returns non-zero if the driver runs the enqueues of a
+   * finalized command buffer as one CL_COMMAND_COMMAND_BUFFER_KHR command,
+   * instead of a command for each recorded command. The driver can keep
+   * its data of the command buffer in command_buffer->data, and frees it
+   * in free_command_buffer. */
+  int (*can_run_command_buffer) (cl_device_id device,
+                                 cl_command_buffer_khr command_buffer);
+  void (*free_command_buffer) (cl_device_id device,
+                               cl_command_buffer_khr command_buffer);
+
   /* clEnqueueNDRangeKernel */
   void (*run) (void *data, _cl_command_node *cmd);
   /* for clEnqueueNativeKernel. may be NULL */
@@ -805,11 +844,12 @@ struct pocl_device_ops {
 
   /* The device can override this function to perform driver-specific
    * optimizations to the local size dimensions, whenever the decision
-   * is left to the runtime. */
-  void (*compute_local_size) (cl_device_id dev, size_t global_x,
-                              size_t global_y, size_t global_z,
-                              size_t *local_x, size_t *local_y,
-                              size_t *local_z);
+   * is left to the runtime. The kernel's metadata and argument sizes
+   * can be used to account for its memory footprint. */
+  void (*compute_local_size) (cl_device_id dev, cl_kernel kernel,
+                              size_t global_x, size_t global_y,
+                              size_t global_z, size_t *local_x,
+                              size_t *local_y, size_t *local_z);
 
   cl_int (*get_device_info_ext) (cl_device_id dev, cl_device_info param_name,
                                  size_t param_value_size, void * param_value,
@@ -855,6 +895,36 @@ struct _cl_device_id {
   unsigned core_start;
   unsigned core_count;
 
+  /* NUMA topology of host CPU devices, recorded by
+   * pocl_topology_detect_device_info(). Both arrays have num_cpus entries,
+   * indexed by the CPU's position in hwloc's logical order:
+   * cpu_numa_node[i] is the NUMA node (logical index) of the i-th CPU, and
+   * cpu_os_index[i] its OS CPU number. NULL if the topology is unknown. */
+  unsigned num_numa_nodes;
+  unsigned num_cpus;
+  unsigned *cpu_numa_node;
+  unsigned *cpu_os_index;
+  /* the L3 / L2 cache (logical index) shared by the i-th CPU, indexed like
+   * cpu_numa_node. NULL if unknown. */
+  unsigned *cpu_l3_cache;
+  unsigned *cpu_l2_cache;
+  /* Hybrid CPUs: the core kind of the i-th CPU, 0 for the most performant
+   * kind, and its relative capacity, 1024 for the fastest CPUs. Indexed
+   * like cpu_numa_node, NULL unless the host has several kinds of cores
+   * (num_cpu_kinds > 1). */
+  unsigned num_cpu_kinds;
+  unsigned *cpu_kind;
+  unsigned *cpu_capacity;
+  /* The data caches of the CPUs by level, index 0 being L1: the size and
+   * the line size in bytes, and the number of CPUs sharing one cache.
+   * 0 where the level is missing or unknown. */
+  cl_ulong cpu_cache_size[3];
+  cl_uint cpu_cache_line_size[3];
+  cl_uint cpu_cache_sharing[3];
+  /* the affinity domains for which the above was detected, i.e. those
+   * CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN can partition along */
+  cl_device_affinity_domain affinity_domains;
+
   cl_uint max_work_item_dimensions;
   /* when enabled, Workgroup LLVM pass will replace all printf() calls
    * with calls to __pocl_printf and recursively change functions to
@@ -862,10 +932,20 @@ struct _cl_device_id {
    * Currently the pthread/basic devices require this; other devices
    * implement printf their own way. */
   int device_side_printf;
+  /* when enabled with device_side_printf, the printf() calls store the
+   * format string address and the raw arguments to the printf buffer
+   * instead of the formatted output. The driver must then format the
+   * buffer with pocl_write_printf_buffer(). */
+  int binary_printf;
   size_t max_work_item_sizes[3];
   size_t max_work_group_size;
   size_t preferred_wg_size_multiple;
   cl_bool non_uniform_work_group_support;
+  /* The driver runs the last work-group of the dimensions with a non-zero
+   * _cl_command_run.edge_size with that local size, so the runtime can
+   * pick a local size that doesn't divide the global size for the kernels
+   * with nonuniform_safe. Not visible to the application. */
+  cl_bool edge_work_groups;
   cl_uint preferred_vector_width_char;
   cl_uint preferred_vector_width_short;
   cl_uint preferred_vector_width_int;
@@ -894,6 +974,9 @@ struct _cl_device_id {
   size_t image3d_max_depth;
   size_t image_max_buffer_size;
   size_t image_max_array_size;
+  /* CPU devices: if nonzero, the 2D and 3D images are stored in square
+   * tiles of 1 << image_tile_shift pixels, see pocl_cpu_image_tile_shift() */
+  cl_uint image_tile_shift;
   cl_uint max_samplers;
   size_t max_parameter_size;
   cl_uint mem_base_addr_align;
@@ -916,6 +999,9 @@ struct _cl_device_id {
   size_t profiling_timer_resolution;
   cl_bool endian_little;
   cl_bool available;
+  /* nonzero once ops->init_deferred has run, see
+     pocl_init_deferred_devices */
+  int deferred_init_done;
   cl_bool compiler_available;
   cl_bool linker_available;
   /* Is the target a Single Program Multiple Data machine? If not,
@@ -983,6 +1069,9 @@ struct _cl_device_id {
      having a disjoint physical local memory per work-group or having the
      runtime/driver allocate the local space. */
   int device_alloca_locals;
+  /* Poll the preemption point of the context struct at the back-edges of
+     the loops of the work-group functions, see struct pocl_preempt_point */
+  int preemption_points;
 
   /* If > 0, specialized versions of the work-group functions are generated
      which assume each grid dimension is of at most the given width. This
@@ -1043,6 +1132,9 @@ struct _cl_device_id {
 
   cl_uint max_num_sub_groups;
   cl_bool sub_group_independent_forward_progress;
+  /* The number of work-items in a sub-group, 0 if the device does not
+     support sub-groups. The kernel compiler forms the sub-groups of it. */
+  cl_uint max_sub_group_size;
 
   /* image formats supported by the device, per image type */
   const cl_image_format *image_formats[NUM_OPENCL_IMAGE_TYPES];
@@ -1057,6 +1149,18 @@ struct _cl_device_id {
   cl_device_atomic_capabilities atomic_fence_capabilities;
 
   cl_bool pipe_support;
+
+  /* clEnqueueNDRangeKernelBalancePoCL: the predicted run time of the
+   * NDRanges it has enqueued on the device that have not finished yet,
+   * and their number; protected by the device lock */
+  uint64_t balance_pending_ns;
+  unsigned balance_pending;
+
+  /* CL_DEVICE_PERFORMANCE_POCL, and whether it is known: 1 if it is, -1
+   * if the kernel cache did not have it, 0 if not looked up yet; protected
+   * by the lock of pocl_calibrate.c */
+  cl_device_performance_pocl performance;
+  int performance_state;
 };
 
 #define DEVICE_SVM_FINEGR(dev) (dev->svm_caps & (CL_DEVICE_SVM_FINE_GRAIN_BUFFER \
@@ -1074,6 +1178,8 @@ struct _cl_platform_id {
   POCL_ICD_OBJECT_PLATFORM_ID
 }; 
 
+typedef struct pocl_host_mem_pool pocl_host_mem_pool;
+
 struct _cl_context {
   POCL_ICD_OBJECT
   POCL_OBJECT;
@@ -1084,6 +1190,8 @@ struct _cl_context {
   /* implementation */
   unsigned num_devices;
   unsigned num_properties;
+  /* CL_CONTEXT_SCHEDULING_WEIGHT_POCL, 1 if not given */
+  cl_uint scheduling_weight;
 
   /*********************************************************************/
   /* these values depend on which devices are in context;
@@ -1112,6 +1220,10 @@ struct _cl_context {
    * device). */
   cl_command_queue *default_queues;
 
+  /* The default device queues (CL_QUEUE_ON_DEVICE_DEFAULT) of the devices,
+   * NULL until created. They are not retained by the context. */
+  cl_command_queue *default_device_queues;
+
   /* The minimal required buffer alignment for all devices in the context.
    * E.g. for clCreateSubBuffer:
    * CL_MISALIGNED_SUB_BUFFER_OFFSET is returned in errcode_ret if there are no
@@ -1120,6 +1232,16 @@ struct _cl_context {
    */
   size_t min_buffer_alignment;
 
+  /* Caches the host memory of released buffers for new ones,
+   * NULL if disabled. */
+  pocl_host_mem_pool *host_mem_pool;
+
+  /* The buffers with device memory allocated, least recently used first;
+   * the eviction order when a device runs out of memory. */
+  pocl_lock_t mem_lru_lock;
+  cl_mem mem_lru_first;
+  cl_mem mem_lru_last;
+
 #ifdef ENABLE_LLVM
   void *llvm_context_data;
 #endif
@@ -1148,6 +1270,28 @@ struct _cl_command_queue {
   struct _cl_event *barrier;
   unsigned long command_count; /* counter for unfinished command enqueued */
   pocl_data_sync_item last_event;
+  /* commands waiting for submit_batch, and how many of them are allowed to
+     wait (0 = the queue submits each command at once) */
+  _cl_command_node *batch;
+  unsigned batch_size;
+  unsigned batch_limit;
+  /* keeps the batches of the queue in order when they are submitted
+     from several threads */
+  pocl_lock_t batch_lock;
+  /* the longest time a host wait on the queue busy-waits before sleeping
+     (0 = never), and the current window, which adapts to how often the
+     spinning succeeds */
+  cl_ulong wait_spin_ns;
+  cl_ulong wait_spin_window_ns;
+  /* the CL_QUEUE_PRIORITY_KHR and CL_QUEUE_THROTTLE_KHR hints, 0 if not
+     given. The drivers that support them treat 0 as medium priority and
+     high throttle. */
+  cl_queue_priority_khr priority;
+  cl_queue_throttle_khr throttle;
+  /* the CL_QUEUE_SIZE of a device queue, and the bytes of it that the
+     commands enqueued into it by the kernels take until they finish */
+  cl_uint size;
+  size_t device_queue_used;
 
   /* device specific data */
   void *data;
@@ -1249,6 +1393,11 @@ struct _cl_mem {
   /* reference count; when it reaches 0,
    * the mem_host_ptr is automatically freed */
   uint mem_host_ptr_refcount;
+  /* mem_host_ptr was allocated from the context's host memory pool */
+  char mem_host_ptr_pooled;
+  /* the buffer was evicted from a device to mem_host_ptr, which holds a
+   * mem_host_ptr_refcount until the buffer is used on a device again */
+  char mem_host_ptr_evicted;
 
   /* array of device-specific memory bookkeeping structs.
      The location of some device's struct is determined by
@@ -1261,9 +1410,24 @@ struct _cl_mem {
    * if any device has lower version in device_ptrs[]->version,
    * the buffer content on that device is invalid */
   uint64_t latest_version;
+  /* for migrating only the modified part of a buffer;
+   *
+   * while dirty_version == latest_version, the content of any copy
+   * (device_ptrs[] or mem_host_ptr) with version >= dirty_base_version
+   * differs from the latest content only in [dirty_start, dirty_end) */
+  uint64_t dirty_base_version;
+  uint64_t dirty_version;
+  size_t dirty_start;
+  size_t dirty_end;
   /* the event that last changed (written to) the buffer, this
    * is used as a "from "dependency for any migration commands */
   cl_event last_event;
+  /* the number of unfinished commands using the buffer, and of the
+   * commands being created for it; a buffer can be evicted only
+   * when this is zero */
+  uint64_t command_count;
+  /* the context's LRU list of buffers with device memory */
+  struct _cl_mem *lru_prev, *lru_next;
 
 
   /* A linked list of regions of the buffer mapped to the
@@ -1292,6 +1456,13 @@ struct _cl_mem {
   CLeglDisplayKHR egl_display;
   CLeglImageKHR egl_image;
 
+  /* cl_khr_external_memory_dma_buf: the buffer is a mapping of the dma-buf
+   * external_fd (a dup of the imported one) in mem_host_ptr, which the
+   * devices use as a CL_MEM_USE_HOST_PTR buffer */
+  cl_bool is_external;
+  int external_fd;
+  cl_uint is_external_acquired;
+
   /* for images, a flag for each device in context,
    * whether that device supports this */
   int *device_supports_this_image;
@@ -1345,6 +1516,26 @@ typedef struct pocl_kernel_metadata_s
    * the total size here. see struct _cl_kernel on why */
   size_t total_argument_storage_size;
 
+  /* Estimates of the memory a single work-item occupies, from the analysis
+   * of the kernel's IR: the bytes of private (stack) variables, and the
+   * bytes of __local memory consecutive work-items advance by when indexing
+   * local arrays with get_local_id(0). 0 if unknown. The local size
+   * optimizer uses these to keep the work-group's working set in cache. */
+  size_t private_mem_per_wi;
+  size_t local_mem_wi_stride;
+
+  /* 1 if the analysis of the IR shows that each work-item accesses the
+   * buffer arguments only at element get_global_id(0), which lets the CPU
+   * driver fuse chains of such kernels over the same 1D grid. */
+  cl_uint gid_local_access;
+
+  /* 1 if the kernel can't tell the work-groups at the edges of a
+   * non-uniform grid from the others: it doesn't query the global size,
+   * the global offset or the local size, and has no barriers or
+   * work-group functions. The CPU driver then runs awkward global sizes
+   * with a large local size and smaller edge work-groups. */
+  cl_uint nonuniform_safe;
+
   /* array[program->num_devices] */
   pocl_kernel_hash_t *build_hash;
 
@@ -1354,6 +1545,13 @@ typedef struct pocl_kernel_metadata_s
 
   /* device-specific METAdata, void* array[program->num_devices] */
   void **data;
+
+  /* For the kernels of pocl binaries, the offset of the kernel's record in
+     program->pocl_binaries[binary_device_i] until the rest of the metadata
+     is read from there, when the kernel is first created: only the name,
+     num_args, num_locals and reqd_wg_size are set before. 0 otherwise. */
+  size_t binary_record;
+  cl_uint binary_device_i;
 } pocl_kernel_metadata_t;
 
 #define MAIN_PROGRAM_LOG_SIZE 6400
@@ -1381,6 +1579,12 @@ struct _cl_program {
   char *source;
   /* The options in the last clBuildProgram call for this Program. */
   char *compiler_options;
+  /* The work-group function specializations to build together with the
+     program, from the -cl-pocl-specialize= build option. */
+  char *wg_specializations;
+  /* The scalar arguments to specialize the WG functions on, from the
+     -cl-pocl-specialize-args= build option. */
+  char *spec_arg_names;
 
   /* per-device binaries, in device-specific format */
   size_t *binary_sizes;
@@ -1413,6 +1617,10 @@ struct _cl_program {
   char main_build_log[MAIN_PROGRAM_LOG_SIZE];
   /* Use to store build status */
   cl_build_status build_status;
+  /* A clBuildProgram or clCompileProgram with a callback is queued or
+     running in the background, see pocl_build.c. Written with both the
+     program lock and the build pool lock held. */
+  int build_pending;
   /* Use to store binary type */
   cl_program_binary_type binary_type;
 
@@ -1438,6 +1646,9 @@ struct _cl_kernel {
   /* The kernel arguments that are set with clSetKernelArg().
      These are copied to the command queue command at enqueue. */
   struct pocl_argument *dyn_arguments;
+  /* The snapshot of dyn_arguments taken at the last enqueue, or NULL when
+     an argument has been changed since. Protected by the kernel lock. */
+  pocl_kernel_args *args_snapshot;
 
   /* if total_argument_storage_size is known, we preallocate storage for
    * actual kernel arguments here, instead of allocating it by one for
@@ -1456,6 +1667,32 @@ struct _cl_kernel {
   char *dyn_argument_storage;
   void **dyn_argument_offsets;
 
+  /* clEnqueueNDRangeKernelSplitPoCL and clEnqueueNDRangeKernelBalancePoCL:
+   * the measured work-items per nanosecond of the kernel on each device of
+   * the context, 0 until the first such enqueue on the device has
+   * finished */
+  double *split_rates;
+
+  /* POCL_AUTOTUNE_LOCAL_SIZE: the local sizes tuned, or being tuned, for
+   * the launches with no local size, and for each device of the program,
+   * whether the ones stored in the kernel cache have been loaded */
+  struct pocl_autotune_entry *autotune_entries;
+  char *autotune_loaded;
+
+  /* POCL_ARG_SPECIALIZATION: the value of each scalar argument at the
+   * last launch on a CPU device, and the number of launches in a row it
+   * has had that value. Protected by the kernel lock. */
+  uint64_t *spec_last_values;
+  unsigned *spec_same_count;
+  /* POCL_TIERED_COMPILATION: the launches of the kernel on a CPU device */
+  uint64_t launch_count;
+
+  /* The kernels of the blocks that the launches of this kernel enqueue on
+   * the device (see pocl_device_enqueue.h), linked through their
+   * next_block_kernel. Protected by the kernel lock. */
+  struct _cl_kernel *block_kernels;
+  struct _cl_kernel *next_block_kernel;
+
   /* for program's linked list of kernels */
   struct _cl_kernel *next;
 };
@@ -1470,72 +1707,104 @@ struct event_callback_item
 };
 
 
+/* A dependency edge is a pair of nodes: one in the notify_list of the
+ * notifier, one in the wait_list of the waiting event, pointing to each other
+ * via peer so that either can be unlinked without searching the other list. */
 struct event_node
 {
   cl_event event;
   event_node *next;
+  event_node *prev;
+  event_node *peer;
 };
 
 #define MAX_EVENT_DEPS 60
 
+/* the most counters POCL_PERF_COUNTERS can select */
+#define POCL_PERF_MAX_COUNTERS 4
+
 /* Optional metadata for events for improved profile data readability etc. */
 typedef struct _pocl_event_md
 {
-  /* The kernel executed by the NDRange command associated with the event,
-     if any. */
-  cl_kernel kernel;
-
   size_t num_deps;
   // event IDs on which this event depends
   uint64_t dep_ids[MAX_EVENT_DEPS];
+  // the queue IDs of those ^^^ events, 0 for user events
+  uint64_t dep_queue_ids[MAX_EVENT_DEPS];
   // the finish time of those ^^^ event IDs
   cl_ulong dep_ts[MAX_EVENT_DEPS];
 } pocl_event_md;
 
 
+/* The profiling data of an event, apart from the event as most of the
+   events have none. */
+typedef struct _pocl_event_profile
+{
+  /* time stamps of the different phases of execution */
+  cl_ulong time_queue;  /* the enqueue time */
+  cl_ulong time_submit; /* the time the command was submitted to the device */
+  cl_ulong time_start;  /* the time the command actually started executing */
+  cl_ulong time_end;    /* the finish time of the command */
+  /* hardware performance counter totals, in the order of
+   * POCL_PERF_COUNTERS, see pocl_perf_counters.h */
+  cl_ulong perf_counters[POCL_PERF_MAX_COUNTERS];
+} pocl_event_profile;
+
 typedef struct _cl_event _cl_event;
 struct _cl_event {
   POCL_ICD_OBJECT
   POCL_OBJECT;
-  cl_context context;
-  cl_command_queue queue;
+  /* The fields the scheduling of the command looks at, next to each other
+   * after the lock, so that they share a cache line. */
+
+  /* The execution status of the command this event is monitoring. */
+  cl_int status;
   cl_command_type command_type;
+  /* impicit event = an event for pocl's internal use, not visible to user */
+  short implicit_event;
+  /* if set, at the completion of event, the mem_host_ptr_refcount should be
+   * lowered and memory freed if it's 0 */
+  short release_mem_host_ptr_after;
+  /* the POCL_TRACING_FILTER verdict, decided at the first status update:
+   * 0 = not decided yet, 1 = traced, -1 = filtered out */
+  short trace_filtered;
+  /* if set, time_start and time_end are recorded even if the queue has no
+   * CL_QUEUE_PROFILING_ENABLE, see pocl_autotune_measure */
+  short timestamped;
+  cl_command_queue queue;
   _cl_command_node *command;
 
-  /* list of callback functions */
-  event_callback_item *callback_list;
-
   /* list of devices needing completion notification for this event */
   event_node *notify_list;
+  /* the unfinished events this one depends on; doubly linked, the nodes
+   * are unlinked by pocl_broadcast of the notifier */
   event_node *wait_list;
 
+  _cl_event *next;
+  _cl_event *prev;
+
+  cl_context context;
+
   /* OoO doesn't use sync points -> put used buffers here */
   size_t num_buffers;
   cl_mem *mem_objs;
 
-  /* Profiling data: time stamps of the different phases of execution. */
-  cl_ulong time_queue;  /* the enqueue time */
-  cl_ulong time_submit; /* the time the command was submitted to the device */
-  cl_ulong time_start;  /* the time the command actually started executing */
-  cl_ulong time_end;    /* the finish time of the command */
-
   /* Device specific data */
   void *data;
 
-  /* Additional (optional data) used to make profile data more readable etc. */
-  pocl_event_md *meta_data;
+  /* The rarely used parts, allocated when needed. */
 
-  /* The execution status of the command this event is monitoring. */
-  cl_int status;
-  /* impicit event = an event for pocl's internal use, not visible to user */
-  short implicit_event;
-  /* if set, at the completion of event, the mem_host_ptr_refcount should be
-   * lowered and memory freed if it's 0 */
-  short release_mem_host_ptr_after;
+  /* list of callback functions */
+  event_callback_item *callback_list;
 
+  /* The time stamps and the performance counters, for the events of the
+   * queues with CL_QUEUE_PROFILING_ENABLE, the timestamped ones and all of
+   * them with POCL_PERF_COUNTERS; NULL for the others. Read with
+   * pocl_event_profile_of. */
+  pocl_event_profile *profile;
 
-  _cl_event *next;
-  _cl_event *prev;
+  /* Additional (optional data) used to make profile data more readable etc. */
+  pocl_event_md *meta_data;
 };
 
 typedef struct _pocl_user_event_data
@@ -1554,6 +1823,35 @@ struct _cl_sampler {
   void**              device_data;
 };
 
+/* cl_khr_command_buffer: a list of validated commands, enqueued again
+   without the validation by every clEnqueueCommandBufferKHR */
+struct _pocl_recorded_command;
+struct _cl_command_buffer_khr
+{
+  POCL_OBJECT;
+  cl_context context;
+  /* the queue the commands are recorded for */
+  cl_command_queue queue;
+  /* the properties given at creation, with the terminating 0 */
+  cl_command_buffer_properties_khr *properties;
+  cl_uint num_properties;
+  cl_command_buffer_flags_khr flags;
+  int finalized;
+  /* the recorded commands; the sync point of a command is its index */
+  struct _pocl_recorded_command **commands;
+  cl_uint num_commands;
+  cl_uint max_commands;
+  /* the index of the latest recorded barrier, -1 if none */
+  cl_int last_barrier;
+  /* the event of the latest enqueue, for the pending state */
+  cl_event last_enqueue;
+  /* the data of the driver that runs the command buffer as one command */
+  void *data;
+  /* set for the command buffers of clEnqueueNDRangeKernelBatchPoCL: the
+     recorded NDRanges can run in any order, and concurrently */
+  int independent;
+};
+
 #define CL_FAILED (-1)
 
 #ifndef __cplusplus
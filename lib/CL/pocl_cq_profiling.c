@@ -23,94 +23,438 @@
 */
 
 #include "pocl_cq_profiling.h"
+#include "pocl_perf_counters.h"
 #include "pocl_cl.h"
+#include "pocl_runtime_config.h"
 #include "pocl_util.h"
 
-/* for bzero */
-#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
 
-/* Maximum number of events collected. */
-#define POCL_CQ_PROFILING_MAX_EVENTS 1000000
-#define POCL_CQ_PROFILING_MAX_KERNELS 1000
+/* Statistics are aggregated into fixed size tables as the commands finish,
+   and the events are not kept. The commands that don't fit in a full table
+   are counted in its "(other)" entry. */
+#define POCL_CQ_PROFILING_MAX_STATS 512
+
+/* Durations are counted in a log-linear histogram: 4 buckets per power of
+   two, so the percentiles are within 25% of the exact ones. */
+#define POCL_CQ_PROFILING_HIST_BUCKETS 256
+
+/* The longest path ending at each of the recently finished commands, by
+   event ID. A dependency that was evicted from here contributes nothing to
+   the path of its dependents, which only shortens the reported critical
+   path of graphs wider than this. */
+#define POCL_CQ_PROFILING_PATH_SLOTS 16384
+
+/* The most commands of the critical path printed. */
+#define POCL_CQ_PROFILING_MAX_PATH_PRINT 16
 
 int pocl_cq_profiling_enabled = 0;
-static unsigned cq_events_collected = 0;
-static cl_event *profiled_cq_events = NULL;
 
-struct kernel_stats
+typedef struct cq_stats
 {
-  cl_kernel kernel;
-  unsigned long time;
+  /* the kernel name, or NULL for the per-queue statistics */
+  char *name;
+  size_t local_size[3];
+  uint64_t queue_id;
+  int used;
+
   unsigned long launches;
-};
+  uint64_t total_ns;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint32_t hist[POCL_CQ_PROFILING_HIST_BUCKETS];
+  /* totals of the POCL_PERF_COUNTERS */
+  uint64_t perf[POCL_PERF_MAX_COUNTERS];
+} cq_stats;
+
+typedef struct cq_stats_table
+{
+  const char *title;
+  cq_stats *slots;
+  unsigned num_used;
+  cq_stats other;
+} cq_stats_table;
+
+typedef struct cq_path_slot
+{
+  uint64_t event_id;
+  uint64_t pred_id;
+  uint64_t path_ns;
+  uint64_t duration_ns;
+  unsigned path_cmds;
+  cl_command_type type;
+  /* the per-kernel entry, for printing the path */
+  cq_stats *kernel;
+} cq_path_slot;
+
+static pocl_lock_t cq_profiling_lock;
+static cq_stats_table kernel_table = { "kernel" };
+static cq_stats_table local_size_table = { "kernel, local size" };
+static cq_stats_table queue_table = { "queue" };
+static cq_path_slot *path_slots = NULL;
+static cq_path_slot critical_path;
+static uint64_t first_start_ns = UINT64_MAX;
+static uint64_t last_end_ns = 0;
+static unsigned long total_commands = 0;
+static uint64_t total_ns = 0;
+
+static int dump_pipe[2] = { -1, -1 };
+
+static unsigned
+hist_bucket (uint64_t ns)
+{
+  if (ns < 4)
+    return (unsigned)ns;
+  unsigned e = 63 - __builtin_clzll (ns);
+  return 4 * (e - 1) + (unsigned)((ns >> (e - 2)) & 3);
+}
+
+static uint64_t
+hist_bucket_low (unsigned b)
+{
+  if (b < 4)
+    return b;
+  return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+/* Returns the approximate p-th percentile, 0 < p <= 100. */
+static uint64_t
+stats_percentile (const cq_stats *st, unsigned p)
+{
+  uint64_t rank = (st->launches * p + 99) / 100;
+  uint64_t seen = 0;
+  unsigned b;
+  for (b = 0; b < POCL_CQ_PROFILING_HIST_BUCKETS; ++b)
+    {
+      seen += st->hist[b];
+      if (seen >= rank)
+        break;
+    }
+  if (b == POCL_CQ_PROFILING_HIST_BUCKETS)
+    return st->max_ns;
+  uint64_t high = (b + 1 < POCL_CQ_PROFILING_HIST_BUCKETS)
+                      ? hist_bucket_low (b + 1)
+                      : st->max_ns;
+  uint64_t v = (hist_bucket_low (b) + high) / 2;
+  return (v < st->min_ns) ? st->min_ns : ((v > st->max_ns) ? st->max_ns : v);
+}
+
+static void
+stats_add (cq_stats *st, uint64_t ns)
+{
+  if (st->launches == 0 || ns < st->min_ns)
+    st->min_ns = ns;
+  if (ns > st->max_ns)
+    st->max_ns = ns;
+  st->launches++;
+  st->total_ns += ns;
+  st->hist[hist_bucket (ns)]++;
+}
+
+/* Returns the entry of the table for the given key, creating it if
+   needed. */
+static cq_stats *
+stats_lookup (cq_stats_table *t, const char *name, const size_t *local_size,
+              uint64_t queue_id)
+{
+  uint64_t h = 14695981039346656037ULL;
+  const char *c;
+  unsigned i;
+
+  for (c = name; c && *c; ++c)
+    h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+  for (i = 0; local_size && i < 3; ++i)
+    h = (h ^ local_size[i]) * 1099511628211ULL;
+  h = (h ^ queue_id) * 1099511628211ULL;
+
+  unsigned pos = h % POCL_CQ_PROFILING_MAX_STATS;
+  for (i = 0; i < POCL_CQ_PROFILING_MAX_STATS; ++i)
+    {
+      cq_stats *st = &t->slots[(pos + i) % POCL_CQ_PROFILING_MAX_STATS];
+      if (!st->used)
+        {
+          /* keep a slot free so that lookups terminate */
+          if (t->num_used + 1 >= POCL_CQ_PROFILING_MAX_STATS)
+            break;
+          st->name = name ? strdup (name) : NULL;
+          if (name && st->name == NULL)
+            break;
+          if (local_size)
+            memcpy (st->local_size, local_size, sizeof (st->local_size));
+          st->queue_id = queue_id;
+          st->used = 1;
+          t->num_used++;
+          return st;
+        }
+      if (st->queue_id == queue_id
+          && (name == NULL ? st->name == NULL
+                           : (st->name && strcmp (st->name, name) == 0))
+          && (local_size == NULL
+              || memcmp (st->local_size, local_size, sizeof (st->local_size))
+                     == 0))
+        return st;
+    }
+  return &t->other;
+}
+
+/* Records the longest path of the task graph ending at the event. */
+static void
+path_add (cl_event event, uint64_t ns, cq_stats *kernel)
+{
+  cq_path_slot best_pred = { 0 };
+  pocl_event_md *md = event->meta_data;
+  size_t i;
+
+  for (i = 0; md && i < md->num_deps; ++i)
+    {
+      cq_path_slot *dep
+          = &path_slots[md->dep_ids[i] % POCL_CQ_PROFILING_PATH_SLOTS];
+      if (dep->event_id == md->dep_ids[i] && dep->path_ns > best_pred.path_ns)
+        best_pred = *dep;
+    }
+
+  cq_path_slot *slot = &path_slots[event->id % POCL_CQ_PROFILING_PATH_SLOTS];
+  slot->event_id = event->id;
+  slot->pred_id = best_pred.event_id;
+  slot->path_ns = best_pred.path_ns + ns;
+  slot->duration_ns = ns;
+  slot->path_cmds = best_pred.path_cmds + 1;
+  slot->type = event->command_type;
+  slot->kernel = kernel;
+  if (slot->path_ns > critical_path.path_ns)
+    critical_path = *slot;
+}
+
+void
+pocl_cq_profiling_event_complete (cl_event event)
+{
+  cl_command_queue cq = event->queue;
+  _cl_command_node *node = event->command;
+
+  const pocl_event_profile *prof = pocl_event_profile_of (event);
+  if (!(cq->properties & CL_QUEUE_PROFILING_ENABLE) || node == NULL
+      || prof->time_end < prof->time_start)
+    return;
+
+  uint64_t ns = prof->time_end - prof->time_start;
+  cq_stats *kernel = NULL;
+
+  POCL_LOCK (cq_profiling_lock);
+  if (node->type == CL_COMMAND_NDRANGE_KERNEL)
+    {
+      const char *name = node->command.run.kernel->name;
+      kernel = stats_lookup (&kernel_table, name, NULL, 0);
+      stats_add (kernel, ns);
+      unsigned i;
+      for (i = 0; i < pocl_perf_num_counters; ++i)
+        kernel->perf[i] += prof->perf_counters[i];
+      stats_add (stats_lookup (&local_size_table, name,
+                               node->command.run.pc.local_size, 0),
+                 ns);
+      total_commands++;
+      total_ns += ns;
+    }
+  stats_add (stats_lookup (&queue_table, NULL, NULL, cq->id), ns);
+  path_add (event, ns, kernel);
+  if (prof->time_start < first_start_ns)
+    first_start_ns = prof->time_start;
+  if (prof->time_end > last_end_ns)
+    last_end_ns = prof->time_end;
+  POCL_UNLOCK (cq_profiling_lock);
+}
 
 static int
 order_by_time (const void *a, const void *b)
 {
-  if (((struct kernel_stats *)a)->time < ((struct kernel_stats *)b)->time)
+  const cq_stats *sa = *(const cq_stats **)a, *sb = *(const cq_stats **)b;
+  if (sa->total_ns < sb->total_ns)
     return 1;
-  else if (((struct kernel_stats *)a)->time > ((struct kernel_stats *)b)->time)
+  else if (sa->total_ns > sb->total_ns)
     return -1;
   else
     return 0;
 }
 
 static void
-pocl_atexit ()
+print_stats_table (cq_stats_table *t)
 {
-  unsigned long total_time = 0;
-  unsigned long total_commands = 0;
-  unsigned long different_kernels = 0;
+  cq_stats *sorted[POCL_CQ_PROFILING_MAX_STATS + 1];
+  unsigned n = 0, i;
+
+  for (i = 0; i < POCL_CQ_PROFILING_MAX_STATS; ++i)
+    if (t->slots[i].used)
+      sorted[n++] = &t->slots[i];
+  if (t->other.launches)
+    sorted[n++] = &t->other;
+  if (n == 0)
+    return;
+  qsort (sorted, n, sizeof (cq_stats *), order_by_time);
 
-  struct kernel_stats kernel_statistics[cq_events_collected];
-  bzero_s (&kernel_statistics, sizeof (kernel_statistics));
+  uint64_t table_ns = 0;
+  for (i = 0; i < n; ++i)
+    table_ns += sorted[i]->total_ns;
 
-  /* First statistics computation round. */
-  for (unsigned i = 0; i < cq_events_collected; ++i)
+  printf ("\n");
+  printf ("     %-40s %10s %15s %4s %10s %10s %10s\n", t->title, "launches",
+          "total us", "", "avg us", "p50 us", "p99 us");
+  for (i = 0; i < n; ++i)
     {
-      cl_event e = profiled_cq_events[i];
-      cl_kernel kernel = e->meta_data->kernel;
-      unsigned long kernel_t = e->time_end - e->time_start;
-      total_time += kernel_t;
-      total_commands++;
+      cq_stats *st = sorted[i];
+      char label[64];
+      if (st == &t->other)
+        snprintf (label, sizeof (label), "(other)");
+      else if (st->name == NULL)
+        snprintf (label, sizeof (label), "queue %" PRIu64, st->queue_id);
+      else if (t == &local_size_table)
+        snprintf (label, sizeof (label), "%.30s %zux%zux%zu", st->name,
+                  st->local_size[0], st->local_size[1], st->local_size[2]);
+      else
+        snprintf (label, sizeof (label), "%s", st->name);
+      printf ("%3u) %-40s %10lu %15" PRIu64 " %3" PRIu64 "%% %10" PRIu64
+              " %10" PRIu64 " %10" PRIu64 "\n",
+              i + 1, label, st->launches, st->total_ns / 1000,
+              st->total_ns * 100 / (table_ns + !table_ns),
+              st->total_ns / st->launches / 1000,
+              stats_percentile (st, 50) / 1000,
+              stats_percentile (st, 99) / 1000);
+    }
+}
+
+/* Prints the per launch averages of the counters of the kernels, and the
+   instructions per cycle if both are counted. */
+static void
+print_perf_table (cq_stats_table *t)
+{
+  cq_stats *sorted[POCL_CQ_PROFILING_MAX_STATS + 1];
+  unsigned n = 0, i, c;
+  int cycles = pocl_perf_counter_index ("cycles");
+  int instructions = pocl_perf_counter_index ("instructions");
 
-      unsigned k_i = 0;
-      while (k_i < different_kernels
-             && strcmp (kernel_statistics[k_i].kernel->name, kernel->name)
-                    != 0)
-        ++k_i;
+  for (i = 0; i < POCL_CQ_PROFILING_MAX_STATS; ++i)
+    if (t->slots[i].used)
+      sorted[n++] = &t->slots[i];
+  if (t->other.launches)
+    sorted[n++] = &t->other;
+  if (n == 0)
+    return;
+  qsort (sorted, n, sizeof (cq_stats *), order_by_time);
 
-      if (kernel_statistics[k_i].kernel == NULL)
-        {
-          kernel_statistics[k_i].kernel = kernel;
-          different_kernels++;
-        }
-      kernel_statistics[k_i].time += kernel_t;
-      kernel_statistics[k_i].launches++;
+  printf ("\n");
+  printf ("     %-40s", "kernel, counters per launch");
+  for (c = 0; c < pocl_perf_num_counters; ++c)
+    printf (" %16.16s", pocl_perf_counter_name (c));
+  if (cycles >= 0 && instructions >= 0)
+    printf (" %6s", "IPC");
+  printf ("\n");
+  for (i = 0; i < n; ++i)
+    {
+      cq_stats *st = sorted[i];
+      printf ("%3u) %-40.40s", i + 1,
+              st == &t->other ? "(other)" : st->name);
+      for (c = 0; c < pocl_perf_num_counters; ++c)
+        printf (" %16" PRIu64, st->perf[c] / st->launches);
+      if (cycles >= 0 && instructions >= 0)
+        printf (" %6.2f", (double)st->perf[instructions]
+                              / (st->perf[cycles] + !st->perf[cycles]));
+      printf ("\n");
     }
+}
+
+static void
+print_critical_path ()
+{
+  if (critical_path.path_cmds == 0)
+    return;
 
   printf ("\n");
-  printf ("     %-30s %10s %15s %3s  %10s\n", "kernel", "launches", "total us",
-          "", "avg us");
-  qsort (kernel_statistics, different_kernels, sizeof (struct kernel_stats),
-         order_by_time);
+  printf ("     critical path: %u commands, %" PRIu64 " us", critical_path.path_cmds,
+          critical_path.path_ns / 1000);
+  if (last_end_ns > first_start_ns)
+    printf (" of %" PRIu64 " us between the first start and the last end",
+            (last_end_ns - first_start_ns) / 1000);
+  printf ("\n");
 
-  for (unsigned long i = 0; i < different_kernels; ++i)
+  /* walk back from the end, as far as the slots still hold the path */
+  cq_path_slot cur = critical_path;
+  unsigned i;
+  for (i = 0; i < POCL_CQ_PROFILING_MAX_PATH_PRINT; ++i)
     {
-      printf ("%3lu) %-30s %10lu %15lu %3lu%% %10lu\n", i + 1,
-              kernel_statistics[i].kernel->name, kernel_statistics[i].launches,
-              kernel_statistics[i].time,
-              kernel_statistics[i].time * 100 / total_time,
-              kernel_statistics[i].time / kernel_statistics[i].launches);
+      printf ("     %3u) event %-10" PRIu64 " %-30s %15" PRIu64 " us\n", i + 1,
+              cur.event_id,
+              cur.kernel ? (cur.kernel->name ? cur.kernel->name : "(other)")
+                         : pocl_command_to_str (cur.type),
+              cur.duration_ns / 1000);
+      if (cur.pred_id == 0)
+        return;
+      cq_path_slot *pred
+          = &path_slots[cur.pred_id % POCL_CQ_PROFILING_PATH_SLOTS];
+      if (pred->event_id != cur.pred_id)
+        break;
+      cur = *pred;
     }
-  printf ("     %-30s %10s %15s %3s %10s\n", "",
-          "==========", "==========", "====", "==========");
+  printf ("     ...\n");
+}
+
+void
+pocl_cq_profiling_dump ()
+{
+  POCL_LOCK (cq_profiling_lock);
+  print_stats_table (&kernel_table);
+  if (pocl_perf_num_counters)
+    print_perf_table (&kernel_table);
+  print_stats_table (&local_size_table);
+  print_stats_table (&queue_table);
 
   /* Add !total_commands to avoid a division by 0 if total_commands is 0 */
-  printf ("     %-30s %10lu %15lu %4s %10lu\n", "", total_commands, total_time,
-          "100%", total_time / (total_commands + !total_commands) );
+  printf ("     %-40s %10lu %15" PRIu64 " %4s %10" PRIu64 "\n", "all kernels",
+          total_commands, total_ns / 1000, "",
+          total_ns / (total_commands + !total_commands) / 1000);
+  print_critical_path ();
+  fflush (stdout);
+  POCL_UNLOCK (cq_profiling_lock);
+}
+
+static void
+pocl_atexit ()
+{
+  pocl_cq_profiling_dump ();
+}
+
+static void
+dump_signal_handler (int sig)
+{
+  int saved_errno = errno;
+  char c = 1;
+  /* the dump thread prints */
+  ssize_t r = write (dump_pipe[1], &c, 1);
+  (void)r;
+  errno = saved_errno;
+}
+
+/* Dumps the statistics every interval seconds, and when woken up by the
+   signal handler. */
+static void *
+dump_thread (void *arg)
+{
+  int interval = (int)(intptr_t)arg;
+  struct pollfd pfd = { dump_pipe[0], POLLIN, 0 };
+  char buf[64];
 
-  /* TODO: Critical path information of the task graph. */
+  while (1)
+    {
+      int r = poll (&pfd, 1, interval > 0 ? interval * 1000 : -1);
+      if (r < 0 && errno != EINTR)
+        return NULL;
+      if (r > 0 && read (dump_pipe[0], buf, sizeof (buf)) <= 0)
+        return NULL;
+      if (r != 0 || interval > 0)
+        pocl_cq_profiling_dump ();
+    }
+  return NULL;
 }
 
 /* Initialize the profiling data structures, if not yet done. */
@@ -118,25 +462,45 @@ pocl_atexit ()
 void
 pocl_cq_profiling_init ()
 {
-  profiled_cq_events
-      = (cl_event *)malloc (sizeof (cl_event *) * POCL_CQ_PROFILING_MAX_EVENTS);
+  POCL_INIT_LOCK (cq_profiling_lock);
+  kernel_table.slots = calloc (POCL_CQ_PROFILING_MAX_STATS, sizeof (cq_stats));
+  local_size_table.slots
+      = calloc (POCL_CQ_PROFILING_MAX_STATS, sizeof (cq_stats));
+  queue_table.slots = calloc (POCL_CQ_PROFILING_MAX_STATS, sizeof (cq_stats));
+  path_slots = calloc (POCL_CQ_PROFILING_PATH_SLOTS, sizeof (cq_path_slot));
+  if (!kernel_table.slots || !local_size_table.slots || !queue_table.slots
+      || !path_slots)
+    {
+      POCL_MSG_ERR ("CQ profiler: out of memory, profiling disabled\n");
+      return;
+    }
   atexit (pocl_atexit);
   pocl_cq_profiling_enabled = 1;
-}
 
-/* Registers the event for profiling. Retains it to keep it alive until stats
-   have been collected.
-*/
+  int interval = pocl_get_int_option ("POCL_CQ_PROFILING_INTERVAL", 0);
+  int sig = pocl_get_int_option ("POCL_CQ_PROFILING_SIGNAL", 0);
+  if (interval <= 0 && sig <= 0)
+    return;
 
-void
-pocl_cq_profiling_register_event (cl_event event)
-{
-  POname(clRetainEvent) (event);
-  if (event->meta_data == NULL)
-    event->meta_data = (pocl_event_md *)malloc (sizeof (pocl_event_md));
+  if (pipe (dump_pipe) != 0)
+    {
+      POCL_MSG_ERR ("CQ profiler: can't create the dump pipe\n");
+      return;
+    }
+  fcntl (dump_pipe[1], F_SETFL, O_NONBLOCK);
+  if (sig > 0)
+    {
+      struct sigaction sa;
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = dump_signal_handler;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset (&sa.sa_mask);
+      if (sigaction (sig, &sa, NULL) != 0)
+        POCL_MSG_ERR ("CQ profiler: can't install a handler for signal %d\n",
+                      sig);
+    }
 
-  unsigned cq_events_pos = POCL_ATOMIC_INC (cq_events_collected) - 1;
-  if (cq_events_pos >= POCL_CQ_PROFILING_MAX_EVENTS)
-    POCL_ABORT ("CQ profiler reached the limit on tracked events.");
-  profiled_cq_events[cq_events_pos] = event;
+  pocl_thread_t thread;
+  POCL_CREATE_THREAD (thread, dump_thread, (void *)(intptr_t)interval);
+  PTHREAD_CHECK (pthread_detach (thread));
 }
@@ -29,8 +29,10 @@
    which is expected to be a minimally intrusive per-device specific way to
    collect time stamps. The events with the profiling time stamps are just
    accumulated until there is a "non-intrusive" spot to collect/analyze the data.
-   The default implementation just accumulates all the events and analyzes them
-   atexit() with a simple per kernel execution time printout.
+   The finished commands are aggregated right away into bounded per kernel,
+   per local size and per queue statistics, and into the longest path of the
+   task graph observed so far, so no events are retained. The statistics are
+   printed atexit(), and optionally at an interval or on a signal.
 
    One thing to keep in mind is that the command queue time stamps are per-device
    timer stamps, and there is no requirement (AFAIK) to have a synchronized
@@ -50,6 +52,10 @@
 extern int pocl_cq_profiling_enabled;
 
 void pocl_cq_profiling_init ();
-void pocl_cq_profiling_register_event (cl_event event);
+/* Aggregates the timings of the event. Called with the event locked, when
+   it has completed. */
+void pocl_cq_profiling_event_complete (cl_event event);
+/* Prints the statistics collected so far. */
+void pocl_cq_profiling_dump ();
 
 #endif
@@ -56,6 +56,8 @@ static pocl_lock_t console_mutex;
           pocl_debug_messages_filter |= POCL_DEBUG_FLAG_CACHE;
         else if (strncmp (ptr, "proxy", 5) == 0)
           pocl_debug_messages_filter |= POCL_DEBUG_FLAG_PROXY;
+        else if (strncmp (ptr, "remote", 6) == 0)
+          pocl_debug_messages_filter |= POCL_DEBUG_FLAG_REMOTE;
         else if (strncmp (ptr, "llvm", 4) == 0)
           pocl_debug_messages_filter |= POCL_DEBUG_FLAG_LLVM;
         else if (strncmp (ptr, "refc", 4) == 0)
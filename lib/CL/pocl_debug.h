@@ -92,6 +92,7 @@ extern "C" {
 #define POCL_DEBUG_FLAG_CUDA 0x400
 #define POCL_DEBUG_FLAG_ACCEL 0x800
 #define POCL_DEBUG_FLAG_PROXY 0x1000
+#define POCL_DEBUG_FLAG_REMOTE 0x2000
 
 
 #define POCL_DEBUG_FLAG_VULKAN 0x80000
@@ -236,6 +237,8 @@ POCL_EXPORT
 
     #define POCL_MSG_PRINT_PROXY2(errcode, ...) POCL_MSG_PRINT_INFO_F(PROXY, errcode, __VA_ARGS__)
     #define POCL_MSG_PRINT_PROXY(...) POCL_MSG_PRINT_INFO_F(PROXY, "", __VA_ARGS__)
+    #define POCL_MSG_PRINT_REMOTE2(errcode, ...) POCL_MSG_PRINT_INFO_F(REMOTE, errcode, __VA_ARGS__)
+    #define POCL_MSG_PRINT_REMOTE(...) POCL_MSG_PRINT_INFO_F(REMOTE, "", __VA_ARGS__)
     #define POCL_MSG_PRINT_VULKAN2(errcode, ...) POCL_MSG_PRINT_INFO_F(VULKAN, errcode, __VA_ARGS__)
     #define POCL_MSG_PRINT_VULKAN(...) POCL_MSG_PRINT_INFO_F(VULKAN, "", __VA_ARGS__)
     #define POCL_MSG_PRINT_CUDA2(errcode, ...) POCL_MSG_PRINT_INFO_F(CUDA, errcode, __VA_ARGS__)
@@ -283,6 +286,8 @@ POCL_EXPORT
     #define POCL_MSG_PRINT_ACCEL(...)  do {} while (0)
     #define POCL_MSG_PRINT_PROXY2(...)  do {} while (0)
     #define POCL_MSG_PRINT_PROXY(...)  do {} while (0)
+    #define POCL_MSG_PRINT_REMOTE2(...)  do {} while (0)
+    #define POCL_MSG_PRINT_REMOTE(...)  do {} while (0)
     #define POCL_MSG_PRINT_VULKAN2(...)  do {} while (0)
     #define POCL_MSG_PRINT_VULKAN(...)  do {} while (0)
     #define POCL_MSG_PRINT_CUDA2(...)  do {} while (0)
@@ -203,6 +203,35 @@ ERROR:
   return -1;
 }
 
+static int sync_written_files = 1;
+
+void
+pocl_set_file_sync (int sync)
+{
+  sync_written_files = sync;
+}
+
+static int
+sync_file (int fd)
+{
+  if (!sync_written_files)
+    return 0;
+#ifdef HAVE_FDATASYNC
+  if (fdatasync (fd))
+    {
+      POCL_MSG_ERR ("fdatasync() failed\n");
+      return -1;
+    }
+#elif defined(HAVE_FSYNC)
+  if (fsync (fd))
+    {
+      POCL_MSG_ERR ("fsync() failed\n");
+      return -1;
+    }
+#endif
+  return 0;
+}
+
 /* Atomic write - with rename() */
 int
 pocl_write_file (const char *path, const char *content, uint64_t count,
@@ -220,7 +249,13 @@ pocl_write_file (const char *path, const char *content, uint64_t count,
           if (!append)
             return 0;
         } 
+#ifndef _WIN32
+      /* rename() replaces the file atomically, removing it first would
+       * let concurrent readers miss it */
+      else if (append)
+#else
       else 
+#endif
         {
           int res = pocl_remove(path);
           if (res)
@@ -254,19 +289,8 @@ pocl_write_file (const char *path, const char *content, uint64_t count,
       return -1;
     }
 
-#ifdef HAVE_FDATASYNC
-  if (fdatasync (fd))
-    {
-      POCL_MSG_ERR ("fdatasync() failed\n");
-      return errno;
-    }
-#elif defined(HAVE_FSYNC)
-  if (fsync (fd))
-    {
-      POCL_MSG_ERR ("fsync() failed\n");
-      return errno;
-    }
-#endif
+  if (sync_file (fd))
+    return errno;
 
   if (close (fd) < 0)
     return errno;
@@ -394,16 +418,8 @@ pocl_write_tempfile (char *output_path, const char *prefix, const char *suffix,
         }
     }
 
-#ifdef HAVE_FDATASYNC
-  if (fdatasync (fd))
-    {
-      POCL_MSG_ERR ("fdatasync() failed\n");
-      return errno;
-    }
-#elif defined(HAVE_FSYNC)
-  if (fsync (fd))
+  if (sync_file (fd))
     return errno;
-#endif
 
   err = 0;
   if (ret_fd)
@@ -222,3 +222,222 @@ void pocl_SHA1_Final(SHA1_CTX* context, uint8_t digest[SHA1_DIGEST_SIZE])
     memset(context->count, 0, 8);
     memset(finalcount, 0, 8);	/* SWR */
 }
+
+/******************************************************************************/
+
+/* The fast hash: two XXH64 streams with different seeds over the same
+   data, for 128 bits of the non-cryptographic strength that the cache
+   keys need, stretched to SHA1_DIGEST_SIZE bytes so that the keys keep
+   their length. */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static const uint64_t fasthash_seeds[2] = { 0, 0x9E3779B97F4A7C15ULL };
+
+static inline uint64_t
+xxh_rotl64 (uint64_t x, unsigned r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh_read64 (const uint8_t *p)
+{
+  uint64_t v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline uint32_t
+xxh_read32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline uint64_t
+xxh_round (uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = xxh_rotl64 (acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh_merge_round (uint64_t acc, uint64_t val)
+{
+  acc ^= xxh_round (0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t
+xxh_avalanche (uint64_t h)
+{
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  return h ^ (h >> 32);
+}
+
+/* Runs the 32-byte stripes of data through both streams. */
+static void
+fasthash_stripes (FASTHASH_CTX *context, const uint8_t *data, size_t n)
+{
+  uint64_t a[4], b[4];
+  unsigned l;
+
+  memcpy (a, context->acc[0], sizeof (a));
+  memcpy (b, context->acc[1], sizeof (b));
+  for (; n > 0; --n, data += 32)
+    for (l = 0; l < 4; ++l)
+      {
+        uint64_t in = xxh_read64 (data + 8 * l);
+        a[l] = xxh_round (a[l], in);
+        b[l] = xxh_round (b[l], in);
+      }
+  memcpy (context->acc[0], a, sizeof (a));
+  memcpy (context->acc[1], b, sizeof (b));
+}
+
+void
+pocl_FastHash_Init (FASTHASH_CTX *context)
+{
+  unsigned s;
+  for (s = 0; s < 2; ++s)
+    {
+      uint64_t seed = fasthash_seeds[s];
+      context->acc[s][0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+      context->acc[s][1] = seed + XXH_PRIME64_2;
+      context->acc[s][2] = seed;
+      context->acc[s][3] = seed - XXH_PRIME64_1;
+    }
+  context->total_len = 0;
+  context->buffer_len = 0;
+}
+
+void
+pocl_FastHash_Update (FASTHASH_CTX *context, const uint8_t *data,
+                      const size_t len)
+{
+  size_t n = len;
+
+  context->total_len += len;
+  if (context->buffer_len + n < 32)
+    {
+      memcpy (context->buffer + context->buffer_len, data, n);
+      context->buffer_len += (uint32_t)n;
+      return;
+    }
+
+  if (context->buffer_len > 0)
+    {
+      size_t fill = 32 - context->buffer_len;
+      memcpy (context->buffer + context->buffer_len, data, fill);
+      fasthash_stripes (context, context->buffer, 1);
+      data += fill;
+      n -= fill;
+      context->buffer_len = 0;
+    }
+
+  fasthash_stripes (context, data, n / 32);
+  data += n / 32 * 32;
+  n %= 32;
+  memcpy (context->buffer, data, n);
+  context->buffer_len = (uint32_t)n;
+}
+
+/* The XXH64 finalization of stream s. */
+static uint64_t
+fasthash_final_stream (const FASTHASH_CTX *context, unsigned s)
+{
+  const uint64_t *v = context->acc[s];
+  const uint8_t *p = context->buffer;
+  uint32_t n = context->buffer_len;
+  uint64_t h;
+
+  if (context->total_len >= 32)
+    {
+      unsigned l;
+      h = xxh_rotl64 (v[0], 1) + xxh_rotl64 (v[1], 7) + xxh_rotl64 (v[2], 12)
+          + xxh_rotl64 (v[3], 18);
+      for (l = 0; l < 4; ++l)
+        h = xxh_merge_round (h, v[l]);
+    }
+  else
+    h = fasthash_seeds[s] + XXH_PRIME64_5;
+
+  h += context->total_len;
+
+  for (; n >= 8; n -= 8, p += 8)
+    {
+      h ^= xxh_round (0, xxh_read64 (p));
+      h = xxh_rotl64 (h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+  if (n >= 4)
+    {
+      h ^= (uint64_t)xxh_read32 (p) * XXH_PRIME64_1;
+      h = xxh_rotl64 (h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+      n -= 4;
+      p += 4;
+    }
+  for (; n > 0; --n, ++p)
+    {
+      h ^= (*p) * XXH_PRIME64_5;
+      h = xxh_rotl64 (h, 11) * XXH_PRIME64_1;
+    }
+
+  return xxh_avalanche (h);
+}
+
+void
+pocl_FastHash_Final (FASTHASH_CTX *context, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+  uint64_t h[3];
+  unsigned i;
+
+  h[0] = fasthash_final_stream (context, 0);
+  h[1] = fasthash_final_stream (context, 1);
+  h[2] = xxh_avalanche (h[0] ^ xxh_rotl64 (h[1], 32));
+  /* endian independent, like the SHA-1 digest */
+  for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+    digest[i] = (uint8_t)(h[i / 8] >> ((7 - (i & 7)) * 8));
+
+  memset (context, 0, sizeof (*context));
+}
+
+/******************************************************************************/
+
+void
+pocl_hash_init (pocl_hash_ctx *context, int fast)
+{
+  context->fast = fast;
+  if (fast)
+    pocl_FastHash_Init (&context->u.fast);
+  else
+    pocl_SHA1_Init (&context->u.sha1);
+}
+
+void
+pocl_hash_update (pocl_hash_ctx *context, const uint8_t *data,
+                  const size_t len)
+{
+  if (context->fast)
+    pocl_FastHash_Update (&context->u.fast, data, len);
+  else
+    pocl_SHA1_Update (&context->u.sha1, data, len);
+}
+
+void
+pocl_hash_final (pocl_hash_ctx *context, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+  if (context->fast)
+    pocl_FastHash_Final (&context->u.fast, digest);
+  else
+    pocl_SHA1_Final (&context->u.sha1, digest);
+}
@@ -48,6 +48,46 @@ void pocl_SHA1_Update(SHA1_CTX* context, const uint8_t* data, const size_t len);
 POCL_EXPORT
 void pocl_SHA1_Final(SHA1_CTX* context, uint8_t digest[SHA1_DIGEST_SIZE]);
 
+/* A non-cryptographic hash several times faster than SHA-1, for keys that
+   only need to tell apart non-adversarial inputs, such as the kernel cache
+   keys. Its digests are SHA1_DIGEST_SIZE bytes, too. */
+typedef struct
+{
+  uint64_t acc[2][4];
+  uint64_t total_len;
+  uint8_t buffer[32];
+  uint32_t buffer_len;
+} FASTHASH_CTX;
+
+POCL_EXPORT
+void pocl_FastHash_Init (FASTHASH_CTX *context);
+POCL_EXPORT
+void pocl_FastHash_Update (FASTHASH_CTX *context, const uint8_t *data,
+                           const size_t len);
+POCL_EXPORT
+void pocl_FastHash_Final (FASTHASH_CTX *context,
+                          uint8_t digest[SHA1_DIGEST_SIZE]);
+
+/* Either of the above, chosen at init. */
+typedef struct
+{
+  int fast;
+  union
+  {
+    SHA1_CTX sha1;
+    FASTHASH_CTX fast;
+  } u;
+} pocl_hash_ctx;
+
+POCL_EXPORT
+void pocl_hash_init (pocl_hash_ctx *context, int fast);
+POCL_EXPORT
+void pocl_hash_update (pocl_hash_ctx *context, const uint8_t *data,
+                       const size_t len);
+POCL_EXPORT
+void pocl_hash_final (pocl_hash_ctx *context,
+                      uint8_t digest[SHA1_DIGEST_SIZE]);
+
 #ifdef __cplusplus
 }
 #endif
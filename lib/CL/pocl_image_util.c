@@ -433,11 +433,7 @@ write_float4_pixel (cl_float4 color, void *data, int type)
     }
   if (type == CL_HALF_FLOAT)
     {
-      /* TODO: convert to builtins */
-      ((uint16_t *)data)[0] = float_to_half (color.s0);
-      ((uint16_t *)data)[1] = float_to_half (color.s1);
-      ((uint16_t *)data)[2] = float_to_half (color.s2);
-      ((uint16_t *)data)[3] = float_to_half (color.s3);
+      float_to_half_array ((uint16_t *)data, color.s, 4);
       return;
     }
   const cl_float f127 = ((cl_float) (CL_CHAR_MAX));
@@ -499,7 +495,6 @@ write_float_pixel (cl_float color, void *data, int type)
     }
   if (type == CL_HALF_FLOAT)
     {
-      /* TODO: convert to builtins */
       *((uint16_t *)data) = float_to_half (color);
       return;
     }
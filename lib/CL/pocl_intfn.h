@@ -128,6 +128,7 @@ POdeclsym(clEnqueueSVMMap)
 POdeclsym(clEnqueueSVMMemcpy)
 POdeclsym(clEnqueueSVMMemFill)
 POdeclsym(clEnqueueSVMUnmap)
+POdeclsym(clEnqueueSVMMigrateMem)
 POdeclsym(clSVMFree)
 POdeclsym(clSVMAlloc)
 POdeclsym(clSetKernelArgSVMPointer)
@@ -144,8 +145,26 @@ POdeclsym(clEnqueueAcquireGLObjects)
 POdeclsym(clEnqueueReleaseGLObjects)
 POdeclsym(clGetGLContextInfoKHR)
 POdeclsym(clSetContentSizeBufferPoCL)
+POdeclsym(clGetStatisticsPoCL)
+POdeclsym(clRegisterStaticWGFunctionsPoCL)
+POdeclsym(clEnqueueNDRangeKernelSplitPoCL)
+POdeclsym(clEnqueueNDRangeKernelBalancePoCL)
+POdeclsym(clEnqueueNDRangeKernelBatchPoCL)
+POdeclsym(clCreateCommandBufferKHR)
+POdeclsym(clFinalizeCommandBufferKHR)
+POdeclsym(clRetainCommandBufferKHR)
+POdeclsym(clReleaseCommandBufferKHR)
+POdeclsym(clEnqueueCommandBufferKHR)
+POdeclsym(clCommandBarrierWithWaitListKHR)
+POdeclsym(clCommandCopyBufferKHR)
+POdeclsym(clCommandFillBufferKHR)
+POdeclsym(clCommandNDRangeKernelKHR)
+POdeclsym(clGetCommandBufferInfoKHR)
 POdeclsym(clCreatePipe)
 POdeclsym(clGetPipeInfo)
+POdeclsym(clCreateBufferWithProperties)
+POdeclsym(clEnqueueAcquireExternalMemObjectsKHR)
+POdeclsym(clEnqueueReleaseExternalMemObjectsKHR)
 POdeclsym(clSetDefaultDeviceCommandQueue)
 POdeclsym(clGetDeviceAndHostTimer)
 POdeclsym(clGetHostTimer)
@@ -37,6 +37,12 @@ extern "C" {
   /* Returns the cpu name as reported by LLVM. */
   POCL_EXPORT
   char *pocl_get_llvm_cpu_name ();
+#ifdef KERNELLIB_HOST_DISTRO_VARIANTS
+  /* Returns the kernel library variant of a "distro" build that suits the
+   * host CPU, or the one forced with POCL_KERNELLIB_VARIANT. */
+  POCL_EXPORT
+  const char *pocl_get_distro_kernellib_variant ();
+#endif
   /* Returns if the cpu supports FMA instruction (uses LLVM). */
   int cpu_has_fma ();
 
@@ -91,6 +97,15 @@ extern "C" {
   void pocl_llvm_create_context (cl_context ctx);
   void pocl_llvm_release_context (cl_context ctx);
 
+#ifdef HAVE_LLVM_SPIRV_LIB
+  /* Translates the SPIR-V module in memory to LLVM bitcode in the LLVM
+   * context of ctx, with the linked translator library. *output is
+   * malloc'ed. Returns nonzero on failure. */
+  int pocl_llvm_spirv_to_bitcode (cl_context ctx, const char *spirv,
+                                  size_t size, char **output,
+                                  uint64_t *output_size);
+#endif
+
   /**
    * Update the program->binaries[] representation of the kernels
    * from the program->data[] LLVM IR representation.
@@ -111,6 +126,28 @@ extern "C" {
   int pocl_llvm_codegen (cl_device_id device, cl_program program, void *modp,
                          char **output, uint64_t *output_size);
 
+  /* Updates hash_ctx with the bitcode of the given work-group function
+   * module, for keying it in the kernel object store. */
+  void pocl_llvm_hash_module (cl_context ctx, void *modp,
+                              pocl_hash_ctx *hash_ctx);
+
+  /* Returns nonzero if the backend of pocl_llvm_codegen() runs in a
+   * per-thread LLVM context, so that callers need not serialize it. */
+  int pocl_llvm_parallel_codegen ();
+
+  /* Loads the object file in memory into a new in-process JIT instance,
+   * without linking it to a shared library, and returns the address of
+   * the function symbol in it, or NULL on failure. *handle is set to the
+   * JIT instance, to be released with pocl_llvm_jit_unload(). */
+  void *pocl_llvm_jit_load (const char *object, uint64_t size,
+                            const char *symbol, void **handle);
+
+  /* Returns the address of another symbol of the object loaded with
+   * pocl_llvm_jit_load(), or NULL if it has none. */
+  void *pocl_llvm_jit_lookup (void *handle, const char *symbol);
+
+  void pocl_llvm_jit_unload (void *handle);
+
   /* Parse program file and populate program's llvm_irs */
   int pocl_llvm_read_program_llvm_irs (cl_program program, unsigned device_i,
                                        const char *path);
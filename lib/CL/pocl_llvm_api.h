@@ -22,6 +22,7 @@
    THE SOFTWARE.
 */
 
+#include "pocl_cache.h"
 #include "pocl_llvm.h"
 
 #ifndef POCL_LLVM_API_H
@@ -34,6 +35,8 @@
 #include <map>
 #include <string>
 
+#include "linker.h"
+
 #ifdef __GNUC__
 #pragma GCC visibility push(hidden)
 #endif
@@ -67,7 +70,22 @@ public:
   ~PoclCompilerMutexGuard();
 };
 
+/* Holds a pocl_cache_lock() for its scope, none if name is NULL. */
+class PoclCacheLockGuard {
+  PoclCacheLockGuard(const PoclCacheLockGuard &) = delete;
+  void operator=(const PoclCacheLockGuard &) = delete;
+  int lock;
+
+public:
+  PoclCacheLockGuard(int kind, const char *name)
+      : lock(name ? pocl_cache_lock(kind, name) : -1) {}
+  ~PoclCacheLockGuard() { pocl_cache_unlock(lock); }
+};
+
 llvm::Module *parseModuleIR (const char *path, llvm::LLVMContext *c);
+/* Parses only the module level parts of the bitcode file, the function
+ * bodies are materialized on demand. */
+llvm::Module *parseModuleIRLazy (const char *path, llvm::LLVMContext *c);
 void writeModuleIRtoString(const llvm::Module *mod, std::string& dest);
 llvm::Module *parseModuleIRMem (const char *input_stream, size_t size,
                                 llvm::LLVMContext *c);
@@ -86,12 +104,28 @@ POCL_EXPORT bool getModuleStringMetadata (const llvm::Module &mod,
 POCL_EXPORT bool getModuleBoolMetadata (const llvm::Module &mod,
                                         const char *key, bool &data);
 
+/* Module metadata set on program modules which are not linked with the
+ * kernel library; their work-group functions are linked with it instead. */
+#define POCL_KERNEL_LIB_UNLINKED_MD "pocl_kernel_lib_unlinked"
+
 void clearKernelPasses();
 void clearTargetMachines();
 
 extern std::string currentWgMethod;
 
-typedef std::map<cl_device_id, llvm::Module *> kernelLibraryMapTy;
+/* The kernel library modules by the target triple and CPU of the devices;
+   with the context kept across cl_contexts the devices can come and go. */
+typedef std::map<std::string, llvm::Module *> kernelLibraryMapTy;
+/* The kernel library modules by file, shared by the devices which use the
+   same one. Owns the modules. */
+typedef std::map<std::string, llvm::Module *> kernelLibraryFileMapTy;
+/* The kernels run through the work-group function specialization
+   independent kernel compiler passes, by program.bc and kernel name. */
+typedef std::map<std::pair<const llvm::Module *, std::string>,
+                 llvm::Module *>
+    preparedKernelMapTy;
+/* The memoized call graphs of the kernel library modules, see link(). */
+typedef std::map<const llvm::Module *, LinkerCallGraph> libraryCallGraphMapTy;
 struct PoclLLVMContextData
 {
   pocl_lock_t Lock;
@@ -101,8 +135,21 @@ struct PoclLLVMContextData
   llvm::raw_string_ostream *poclDiagStream;
   llvm::DiagnosticPrinterRawOStream *poclDiagPrinter;
   kernelLibraryMapTy *kernelLibraryMap;
+  kernelLibraryFileMapTy *kernelLibraryFiles;
+  preparedKernelMapTy *preparedKernels;
+  libraryCallGraphMapTy *libraryCallGraphs;
 };
 
+/* Returns the OpenCL C built-in function library bitcode for the device,
+ * loading it on first use. */
+llvm::Module *getKernelLibrary(cl_device_id device,
+                               PoclLLVMContextData *llvm_ctx);
+
+/* Returns true if the build options of the program select the relaxed
+ * precision math builtins (-cl-fast-relaxed-math or
+ * -cl-unsafe-math-optimizations). */
+bool programUsesRelaxedMath(cl_program program);
+
 #ifdef __GNUC__
 #pragma GCC visibility pop
 #endif
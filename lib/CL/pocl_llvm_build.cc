@@ -49,8 +49,11 @@ IGNORE_COMPILER_WARNING("-Wstrict-aliasing")
 
 #include "llvm/Transforms/Utils/Cloning.h"
 
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
 
 #ifndef LLVM_OLDER_THAN_11_0
 #include "llvm/Support/Host.h"
@@ -66,6 +69,7 @@ IGNORE_COMPILER_WARNING("-Wstrict-aliasing")
 #endif
 
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <regex>
 
@@ -159,8 +163,143 @@ static void get_build_log(cl_program program,
   appendToProgramBuildLog(program, device_i, log);
 }
 
-static llvm::Module *getKernelLibrary(cl_device_id device,
-                                      PoclLLVMContextData *llvm_ctx);
+
+/* Clang records the annotate attributes of the kernels only in
+ * llvm.global.annotations. Turn the pocl_* ones into metadata of the
+ * kernel functions, which is copied with them to the work-group function
+ * modules, for the kernel compiler passes. */
+static void kernelAnnotationsToMetadata(llvm::Module *Mod) {
+  llvm::GlobalVariable *Annotations =
+      Mod->getGlobalVariable("llvm.global.annotations");
+  if (Annotations == nullptr || !Annotations->hasInitializer())
+    return;
+  llvm::ConstantArray *Entries =
+      dyn_cast<llvm::ConstantArray>(Annotations->getInitializer());
+  if (Entries == nullptr)
+    return;
+  for (llvm::Value *Op : Entries->operands()) {
+    llvm::ConstantStruct *Entry = dyn_cast<llvm::ConstantStruct>(Op);
+    if (Entry == nullptr || Entry->getNumOperands() < 2)
+      continue;
+    llvm::Function *F =
+        dyn_cast<llvm::Function>(Entry->getOperand(0)->stripPointerCasts());
+    llvm::GlobalVariable *Str = dyn_cast<llvm::GlobalVariable>(
+        Entry->getOperand(1)->stripPointerCasts());
+    if (F == nullptr || Str == nullptr || !Str->hasInitializer())
+      continue;
+    llvm::ConstantDataArray *Data =
+        dyn_cast<llvm::ConstantDataArray>(Str->getInitializer());
+    if (Data == nullptr || !Data->isCString())
+      continue;
+    StringRef Name = Data->getAsCString();
+    if (Name.startswith("pocl_"))
+      F->setMetadata(Name, llvm::MDNode::get(Mod->getContext(), {}));
+  }
+}
+
+/* Gives the kernel Clang made of a block passed to enqueue_kernel() the
+ * metadata of an OpenCL kernel: its first argument is the block literal,
+ * a global buffer, and the rest are the local buffers of the block. */
+static void makeBlockKernel(llvm::Function *Kernel) {
+  llvm::LLVMContext &C = Kernel->getContext();
+  llvm::Type *Int32T = llvm::Type::getInt32Ty(C);
+  llvm::SmallVector<llvm::Metadata *, 4> AddrSpaces, AccessQuals, Types,
+      TypeQuals, Names;
+  for (unsigned i = 0; i < Kernel->arg_size(); ++i) {
+    AddrSpaces.push_back(llvm::ConstantAsMetadata::get(
+        llvm::ConstantInt::get(Int32T, i == 0 ? 1 : 3)));
+    AccessQuals.push_back(llvm::MDString::get(C, "none"));
+    Types.push_back(llvm::MDString::get(C, "void*"));
+    TypeQuals.push_back(llvm::MDString::get(C, ""));
+    Names.push_back(llvm::MDString::get(
+        C, i == 0 ? std::string("block") : "local" + std::to_string(i - 1)));
+  }
+  Kernel->setMetadata("kernel_arg_addr_space", llvm::MDNode::get(C, AddrSpaces));
+  Kernel->setMetadata("kernel_arg_access_qual",
+                      llvm::MDNode::get(C, AccessQuals));
+  Kernel->setMetadata("kernel_arg_type", llvm::MDNode::get(C, Types));
+  Kernel->setMetadata("kernel_arg_base_type", llvm::MDNode::get(C, Types));
+  Kernel->setMetadata("kernel_arg_type_qual", llvm::MDNode::get(C, TypeQuals));
+  Kernel->setMetadata("kernel_arg_name", llvm::MDNode::get(C, Names));
+  Kernel->setLinkage(llvm::GlobalValue::ExternalLinkage);
+
+  /* The block literal also points to the invoke function the kernel calls,
+   * which would then be compiled into the work-group functions of the
+   * enqueuing kernels, with the work-item functions of the child kernel that
+   * only its own work-group function defines. The literal is only read
+   * through the kernel argument, so the pointer is cleared, and the kernel
+   * and the direct calls of the block get a copy of the function. */
+  llvm::Function *Invoke = nullptr;
+  for (llvm::BasicBlock &BB : *Kernel)
+    for (llvm::Instruction &I : BB)
+      if (llvm::CallInst *Call = dyn_cast<llvm::CallInst>(&I))
+        if (Call->getCalledFunction() != nullptr &&
+            !Call->getCalledFunction()->isDeclaration())
+          Invoke = Call->getCalledFunction();
+  if (Invoke == nullptr)
+    return;
+  llvm::ValueToValueMapTy VMap;
+  llvm::Function *Body = llvm::CloneFunction(Invoke, VMap);
+  Body->takeName(Invoke);
+  std::vector<llvm::CallInst *> Calls;
+  for (llvm::User *U : Invoke->users())
+    if (llvm::CallInst *Call = dyn_cast<llvm::CallInst>(U))
+      if (Call->getCalledFunction() == Invoke)
+        Calls.push_back(Call);
+  for (llvm::CallInst *Call : Calls)
+    Call->setCalledFunction(Body);
+  Invoke->replaceAllUsesWith(
+      llvm::ConstantPointerNull::get(Invoke->getType()));
+  Invoke->eraseFromParent();
+}
+
+/* Clang passes the kernel it makes of the block given to enqueue_kernel()
+ * to the __enqueue_kernel_* and __get_kernel_*_impl functions in the same
+ * operand. Make each of them a kernel of the program, and pass its name
+ * instead, which the device looks the child kernel up with, see
+ * include/pocl_device_enqueue.h. */
+static void promoteEnqueuedBlockKernels(llvm::Module *Mod) {
+  static const std::pair<const char *, unsigned> Builtins[] = {
+      {"__enqueue_kernel_basic", 3},
+      {"__enqueue_kernel_varargs", 3},
+      {"__enqueue_kernel_basic_events", 6},
+      {"__enqueue_kernel_events_varargs", 6},
+      {"__get_kernel_work_group_size_impl", 0},
+      {"__get_kernel_preferred_work_group_size_multiple_impl", 0},
+      {"__get_kernel_max_sub_group_size_for_ndrange_impl", 1},
+      {"__get_kernel_sub_group_count_for_ndrange_impl", 1}};
+  std::map<llvm::Function *, llvm::Constant *> KernelNames;
+
+  for (const auto &Builtin : Builtins) {
+    llvm::Function *F = Mod->getFunction(Builtin.first);
+    if (F == nullptr)
+      continue;
+    for (llvm::User *U : F->users()) {
+      llvm::CallInst *Call = dyn_cast<llvm::CallInst>(U);
+      if (Call == nullptr || Call->arg_size() <= Builtin.second)
+        continue;
+      llvm::Value *Op = Call->getArgOperand(Builtin.second);
+      llvm::Function *Kernel =
+          dyn_cast<llvm::Function>(Op->stripPointerCasts());
+      if (Kernel == nullptr || Kernel->isDeclaration())
+        continue;
+      llvm::Constant *&Name = KernelNames[Kernel];
+      if (Name == nullptr) {
+        makeBlockKernel(Kernel);
+        llvm::Constant *Str = llvm::ConstantDataArray::getString(
+            Mod->getContext(), Kernel->getName());
+        llvm::GlobalVariable *GV = new llvm::GlobalVariable(
+            *Mod, Str->getType(), true, llvm::GlobalValue::PrivateLinkage,
+            Str, Kernel->getName() + ".name");
+        GV->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+        Name = GV;
+      }
+      Call->setArgOperand(Builtin.second,
+                          llvm::ConstantExpr::getPointerBitCastOrAddrSpaceCast(
+                              Name, Op->getType()));
+    }
+  }
+}
 
 static std::string getPoclPrivateDataDir() {
 #ifdef ENABLE_RELOCATION
@@ -179,6 +318,41 @@ static std::string getPoclPrivateDataDir() {
     return POCL_INSTALL_PRIVATE_DATADIR;
 }
 
+#ifndef LLVM_OLDER_THAN_10_0
+// Precompiles the builtin headers listed in the preprocessor includes of
+// Base into a PCH at PCHPath. The last include becomes the main input of
+// the PCH, the rest stay as implicit includes in front of it.
+static int generateBuiltinPCH(const CompilerInvocation &Base,
+                              const char *PCHPath) {
+  char TempPCH[POCL_FILENAME_LENGTH];
+  if (pocl_cache_tempname(TempPCH, ".pch", NULL))
+    return -1;
+
+  auto Invocation = std::make_shared<CompilerInvocation>(Base);
+  PreprocessorOptions &po = Invocation->getPreprocessorOpts();
+  FrontendOptions &fe = Invocation->getFrontendOpts();
+  std::string MainHeader = po.Includes.back();
+  po.Includes.pop_back();
+  fe.Inputs.clear();
+  fe.Inputs.push_back(FrontendInputFile(
+      MainHeader, clang::InputKind(clang::Language::OpenCL).getHeader()));
+  fe.OutputFile.assign(TempPCH);
+
+  CompilerInstance PCHCI;
+  PCHCI.setInvocation(Invocation);
+  PCHCI.createDiagnostics(new clang::TextDiagnosticBuffer(), true);
+
+  clang::GeneratePCHAction GeneratePCH;
+  if (!PCHCI.ExecuteAction(GeneratePCH) || pocl_rename(TempPCH, PCHPath)) {
+    pocl_remove(TempPCH);
+    POCL_MSG_PRINT_LLVM("Could not precompile the builtin headers\n");
+    return -1;
+  }
+  POCL_MSG_PRINT_LLVM("Precompiled the builtin headers to %s\n", PCHPath);
+  return 0;
+}
+#endif
+
 int pocl_llvm_build_program(cl_program program,
                             unsigned device_i,
                             cl_uint num_input_headers,
@@ -281,6 +455,12 @@ int pocl_llvm_build_program(cl_program program,
       cl_ext += ",";
     }
   }
+#ifndef LLVM_OLDER_THAN_13_0
+  if (device->pipe_support)
+    cl_ext += "+__opencl_c_pipes,";
+  if (device->on_dev_queue_props != 0)
+    cl_ext += "+__opencl_c_device_enqueue,";
+#endif
   if (!cl_ext.empty()) {
     cl_ext.back() = ' '; // replace last "," with space
     ss << "-cl-ext=-all," << cl_ext;
@@ -296,7 +476,9 @@ int pocl_llvm_build_program(cl_program program,
   ss << "-DPOCL_DEVICE_ADDRESS_BITS=" << device->address_bits << " ";
   ss << "-D__USE_CLANG_OPENCL_C_H ";
 #ifndef LLVM_OLDER_THAN_13_0
-  ss << "-Dreserve_id_t=unsigned ";
+  // The pipe builtins use the real reserve_id_t.
+  if (!device->pipe_support)
+    ss << "-Dreserve_id_t=unsigned ";
 #endif
 
   ss << "-xcl ";
@@ -510,6 +692,42 @@ int pocl_llvm_build_program(cl_program program,
   if (device->llvm_cpu != NULL)
     ta.CPU = device->llvm_cpu;
 
+  // Parsing the builtin headers dominates the front-end time of most
+  // programs, so they are precompiled once per device and option set.
+  // The PCH must be built with the same options it is used with, which
+  // are thus part of its key, except the per-build temporary include dir.
+  char PCHPath[POCL_FILENAME_LENGTH];
+  PCHPath[0] = 0;
+#ifndef LLVM_OLDER_THAN_10_0
+  if (pocl_get_bool_option("POCL_KERNEL_PCH", 1)) {
+    std::string PCHKey = ss.str();
+    if (num_input_headers > 0) {
+      std::string TempIncludeOpt =
+          std::string("-I") + temp_include_dir + " ";
+      size_t Pos = PCHKey.find(TempIncludeOpt);
+      if (Pos != std::string::npos)
+        PCHKey.erase(Pos, TempIncludeOpt.size());
+    }
+    // Clang rejects a PCH whose headers were modified after it was built.
+    for (const std::string &Include : po.Includes) {
+      llvm::sys::fs::file_status Status;
+      PCHKey += Include + " ";
+      if (!llvm::sys::fs::status(Include, Status))
+        PCHKey += std::to_string(
+                      Status.getLastModificationTime().time_since_epoch()
+                          .count()) + " ";
+    }
+    if (pocl_cache_builtin_pch_path(PCHPath, PCHKey.c_str()) != 0 ||
+        (!pocl_exists(PCHPath) &&
+         generateBuiltinPCH(pocl_build, PCHPath) != 0))
+      PCHPath[0] = 0;
+  }
+  if (PCHPath[0]) {
+    po.Includes.clear();
+    po.ImplicitPCHInclude = PCHPath;
+  }
+#endif
+
 #ifdef DEBUG_POCL_LLVM_API
   std::cout << "### Triple: " << ta.Triple.c_str() <<  ", CPU: " << ta.CPU.c_str();
 #endif
@@ -587,6 +805,32 @@ int pocl_llvm_build_program(cl_program program,
     return CL_BUILD_PROGRAM_FAILURE;
   }
 
+  // With a PCH the preprocessed output lacks the builtin headers; the
+  // PCH name, which is a hash of them, stands in for them in the hash.
+  if (PCHPath[0]) {
+    size_t PCHPathLen = strlen(PCHPath);
+    char *HashSource = (char *)malloc(PCHPathLen + PreprocessedSize);
+    memcpy(HashSource, PCHPath, PCHPathLen);
+    memcpy(HashSource + PCHPathLen, PreprocessedOut, PreprocessedSize);
+    POCL_MEM_FREE(PreprocessedOut);
+    PreprocessedOut = HashSource;
+    PreprocessedSize += PCHPathLen;
+  }
+
+  // The program.bc of clCompileProgram lacks the kernel library, so it
+  // must not be found by a clBuildProgram of the same source, or the
+  // other way around.
+  if (!linking_program) {
+    const char CompileTag[] = "compile";
+    size_t TagLen = sizeof(CompileTag) - 1;
+    char *HashSource = (char *)malloc(TagLen + PreprocessedSize);
+    memcpy(HashSource, CompileTag, TagLen);
+    memcpy(HashSource + TagLen, PreprocessedOut, PreprocessedSize);
+    POCL_MEM_FREE(PreprocessedOut);
+    PreprocessedOut = HashSource;
+    PreprocessedSize += TagLen;
+  }
+
   pocl_cache_create_program_cachedir(program, device_i, PreprocessedOut,
                                      static_cast<size_t>(PreprocessedSize), program_bc_path);
 
@@ -594,6 +838,17 @@ int pocl_llvm_build_program(cl_program program,
 
   unlink_source(fe);
 
+  /* Another process building the same program writes program.bc before
+   * releasing the lock. */
+  PoclCacheLockGuard CacheLock(
+      POCL_CACHE_LOCK_PROGRAM,
+      pocl_exists(program_bc_path)
+          ? nullptr
+          : (const char *)program->build_hash[device_i]);
+
+  if (!pocl_exists(program_bc_path))
+    pocl_cache_fetch_remote_program_bc(program, device_i);
+
   if (pocl_exists(program_bc_path)) {
     char *binary = nullptr;
     uint64_t fsize;
@@ -625,9 +880,6 @@ int pocl_llvm_build_program(cl_program program,
     return CL_SUCCESS;
   }
 
-  // TODO: use pch: it is possible to disable the strict checking for
-  // the compilation flags used to compile it and the current translation
-  // unit via the preprocessor options directly.
   clang::EmitLLVMOnlyAction EmitLLVM(llvm_ctx->Context);
   success = CI.ExecuteAction(EmitLLVM);
 
@@ -648,6 +900,9 @@ int pocl_llvm_build_program(cl_program program,
   else
     ++llvm_ctx->number_of_IRs;
 
+  kernelAnnotationsToMetadata(mod);
+  promoteEnqueuedBlockKernels(mod);
+
   if (mod->getModuleFlag("PIC Level") == nullptr)
     mod->setPICLevel(PICLevel::BigPIC);
 #ifndef __PPC64__
@@ -658,12 +913,17 @@ int pocl_llvm_build_program(cl_program program,
   // link w kernel lib, but not if we're called from clCompileProgram()
   // Later this should be replaced with indexed linking of source code
   // and/or bitcode for each kernel.
-  if (linking_program) {
+  // With POCL_LAZY_BUILD, the kernel library is linked separately to the
+  // work-group function of each kernel when the kernel is first compiled.
+  if (linking_program && pocl_get_bool_option("POCL_LAZY_BUILD", 0)) {
+    setModuleBoolMetadata(mod, POCL_KERNEL_LIB_UNLINKED_MD, true);
+  } else if (linking_program) {
     llvm::Module *libmodule = getKernelLibrary(device, llvm_ctx);
     assert(libmodule != NULL);
     std::string log("Error(s) while linking: \n");
     if (link(mod, libmodule, log, device->global_as_id,
-             device->device_aux_functions)) {
+             device->device_aux_functions, programUsesRelaxedMath(program),
+             &(*llvm_ctx->libraryCallGraphs)[libmodule])) {
       appendToProgramBuildLog(program, device_i, log);
       std::string msg = getDiagString(ctx);
       appendToProgramBuildLog(program, device_i, msg);
@@ -676,12 +936,17 @@ int pocl_llvm_build_program(cl_program program,
 
   program->data[device_i] = mod;
 
-  POCL_MSG_PRINT_LLVM("Writing program.bc to %s.\n", program_bc_path);
+  /* Without the kernel cache the build directory is removed with the
+   * program, so program.bc is written only if it is needed, for
+   * pocl_binary_serialize(). */
+  if (pocl_cache_enabled()) {
+    POCL_MSG_PRINT_LLVM("Writing program.bc to %s.\n", program_bc_path);
+    error = pocl_write_module(mod, program_bc_path, 0);
+    if (error)
+      return error;
 
-  /* Always retain program.bc */
-  error = pocl_write_module(mod, program_bc_path, 0);
-  if(error)
-    return error;
+    pocl_cache_store_remote_program_bc(program, device_i);
+  }
 
   /* To avoid writing & reading the same back,
    * save program->binaries[i]
@@ -720,6 +985,65 @@ int pocl_llvm_link_program(cl_program program, unsigned device_i,
   llvm::Module *libmodule = getKernelLibrary(device, llvm_ctx);
   assert(libmodule != NULL);
 
+  /* The linked program is cached on the input binaries, in their order, and
+     on the kind of the link, as a library and an executable of the same
+     objects differ. */
+  concated_binaries.append(spir ? "spir" : (link_program ? "link" : "lib"));
+  for (i = 0; i < num_input_programs; i++) {
+    assert(cur_device_binaries[i]);
+    assert(cur_device_binary_sizes[i]);
+    concated_binaries.append((char *)cur_device_binaries[i],
+                             cur_device_binary_sizes[i]);
+  }
+
+  error = pocl_cache_create_program_cachedir(program, device_i,
+                                     concated_binaries.c_str(),
+                                     concated_binaries.size(),
+                                     program_bc_path);
+  if (error)
+    {
+      POCL_MSG_ERR ("pocl_cache_create_program_cachedir(%s)"
+                    " failed with %i\n", program_bc_path, error);
+      return error;
+    }
+
+  /* Another process linking the same objects writes program.bc before
+   * releasing the lock. */
+  PoclCacheLockGuard CacheLock(
+      POCL_CACHE_LOCK_PROGRAM,
+      pocl_exists(program_bc_path)
+          ? nullptr
+          : (const char *)program->build_hash[device_i]);
+
+  if (!pocl_exists(program_bc_path))
+    pocl_cache_fetch_remote_program_bc(program, device_i);
+
+  if (pocl_exists(program_bc_path)) {
+    char *binary = nullptr;
+    uint64_t fsize;
+    POCL_MSG_PRINT_LLVM("Reading the linked program.bc from %s.\n",
+                        program_bc_path);
+    int r = pocl_read_file(program_bc_path, &binary, &fsize);
+    POCL_RETURN_ERROR_ON(r, CL_LINK_PROGRAM_FAILURE,
+                         "Failed to read binaries from program.bc to "
+                         "memory: %s\n",
+                         program_bc_path);
+
+    if (program->binaries[device_i])
+      POCL_MEM_FREE(program->binaries[device_i]);
+    program->binary_sizes[device_i] = (size_t)fsize;
+    program->binaries[device_i] = (unsigned char *)binary;
+
+    if (*modptr != nullptr) {
+      delete *modptr;
+      --llvm_ctx->number_of_IRs;
+    }
+    *modptr = parseModuleIR(program_bc_path, llvm_ctx->Context);
+    assert(*modptr);
+    ++llvm_ctx->number_of_IRs;
+
+    return CL_SUCCESS;
+  }
 
   if (spir) {
 #ifdef ENABLE_SPIR
@@ -728,9 +1052,6 @@ int pocl_llvm_link_program(cl_program program, unsigned device_i,
                          CL_LINK_PROGRAM_FAILURE,
                          "SPIR is only supported on little-endian devices\n");
 
-    concated_binaries.append((char *)cur_device_binaries[0],
-                             cur_device_binary_sizes[0]);
-
     linked_module =
         parseModuleIRMem((char *)cur_device_binaries[0],
                          cur_device_binary_sizes[0], llvm_ctx->Context);
@@ -770,11 +1091,6 @@ int pocl_llvm_link_program(cl_program program, unsigned device_i,
         new llvm::Module(StringRef("linked_program"), *llvm_ctx->Context));
 
     for (i = 0; i < num_input_programs; i++) {
-      assert(cur_device_binaries[i]);
-      assert(cur_device_binary_sizes[i]);
-      concated_binaries.append((char *)cur_device_binaries[i],
-                               cur_device_binary_sizes[i]);
-
       llvm::Module *p = (llvm::Module *)cur_llvm_irs[i];
       assert(p);
 
@@ -805,7 +1121,8 @@ int pocl_llvm_link_program(cl_program program, unsigned device_i,
     // linked all the programs together, now link in the kernel library
     std::string log("Error(s) while linking: \n");
     if (link(linked_module, libmodule, log, device->global_as_id,
-             device->device_aux_functions)) {
+             device->device_aux_functions, programUsesRelaxedMath(program),
+             &(*llvm_ctx->libraryCallGraphs)[libmodule])) {
       appendToProgramBuildLog(program, device_i, log);
       std::string msg = getDiagString(ctx);
       appendToProgramBuildLog(program, device_i, msg);
@@ -817,25 +1134,14 @@ int pocl_llvm_link_program(cl_program program, unsigned device_i,
   *modptr = linked_module;
   ++llvm_ctx->number_of_IRs;
 
-  /* TODO currently cached on concated binary contents (in undefined order),
-     this is not terribly useful (but we have to store it somewhere..) */
-  error = pocl_cache_create_program_cachedir(program, device_i,
-                                     concated_binaries.c_str(),
-                                     concated_binaries.size(),
-                                     program_bc_path);
-  if (error)
-    {
-      POCL_MSG_ERR ("pocl_cache_create_program_cachedir(%s)"
-                    " failed with %i\n", program_bc_path, error);
+  if (pocl_cache_enabled()) {
+    POCL_MSG_PRINT_LLVM("Writing program.bc to %s.\n", program_bc_path);
+    error = pocl_write_module(linked_module, program_bc_path, 0);
+    if (error)
       return error;
-    }
 
-  POCL_MSG_PRINT_LLVM("Writing program.bc to %s.\n", program_bc_path);
-
-  /* Always retain program.bc for metadata */
-  error = pocl_write_module(linked_module, program_bc_path, 0);
-  if (error)
-    return error;
+    pocl_cache_store_remote_program_bc(program, device_i);
+  }
 
   /* To avoid writing & reading the same back, save program->binaries[i] */
   std::string content;
@@ -854,7 +1160,7 @@ int pocl_llvm_link_program(cl_program program, unsigned device_i,
 
 /* for "distro" style kernel libs, return which kernellib to use, at runtime */
 #ifdef KERNELLIB_HOST_DISTRO_VARIANTS
-const char *getX86KernelLibName() {
+static const char *getX86KernelLibName() {
   StringMap<bool> Features;
   const char *res = NULL;
 
@@ -884,26 +1190,71 @@ const char *getX86KernelLibName() {
       && Features["popcnt"] && Features["lzcnt"] && Features["f16c"]
       && Features["fma"] && Features["bmi"] && Features["bmi2"])
     res = "avx2";
-  if (Features["avx512f"] )
+  /* The avx512 library is built for skylake-avx512, which the Xeon Phis
+     with only the foundation and the conflict/prefetch subsets can't run. */
+  if (Features["avx512f"] && Features["avx512cd"] && Features["avx512bw"]
+      && Features["avx512dq"] && Features["avx512vl"])
     res = "avx512";
 
   return res;
 }
+
+static const char *getPPCKernelLibName() {
+  /* pwr8 code runs on every later POWER generation. */
+  StringRef CPU = llvm::sys::getHostCPUName();
+  if (CPU == "pwr9" || CPU == "pwr10")
+    return "pwr9";
+  return "pwr8";
+}
+
+const char *pocl_get_distro_kernellib_variant() {
+  static const char *Variant = NULL;
+  if (Variant != NULL)
+    return Variant;
+
+  const char *Forced = pocl_get_string_option("POCL_KERNELLIB_VARIANT", NULL);
+  if (Forced != NULL && Forced[0] != 0) {
+    POCL_MSG_PRINT_LLVM("Using the %s kernel library variant as requested.\n",
+                        Forced);
+    Variant = Forced;
+    return Variant;
+  }
+
+  Triple HostTriple(llvm::sys::getProcessTriple());
+  if (HostTriple.getArch() == Triple::x86_64 ||
+      HostTriple.getArch() == Triple::x86)
+    Variant = getX86KernelLibName();
+  else if (HostTriple.getArch() == Triple::ppc64le)
+    Variant = getPPCKernelLibName();
+  else
+    Variant = "cyclone";
+  return Variant;
+}
 #endif
 
 
 /**
  * Return the OpenCL C built-in function library bitcode
  * for the given device.
+ *
+ * The library is loaded lazily from the mmapped file: only its symbol
+ * table and globals are read up front, and the linker materializes the
+ * bodies of the builtins the programs actually call. The devices using the
+ * same library file share the module.
  */
-static llvm::Module *getKernelLibrary(cl_device_id device,
-                                      PoclLLVMContextData *llvm_ctx) {
+llvm::Module *getKernelLibrary(cl_device_id device,
+                               PoclLLVMContextData *llvm_ctx) {
   Triple triple(device->llvm_target_triplet);
   llvm::LLVMContext *llvmContext = llvm_ctx->Context;
   kernelLibraryMapTy *kernelLibraryMap = llvm_ctx->kernelLibraryMap;
 
-  if (kernelLibraryMap->find(device) != kernelLibraryMap->end())
-    return kernelLibraryMap->at(device);
+  std::string target = device->llvm_target_triplet;
+  target += '/';
+  if (device->llvm_cpu)
+    target += device->llvm_cpu;
+  auto FoundTarget = kernelLibraryMap->find(target);
+  if (FoundTarget != kernelLibraryMap->end())
+    return FoundTarget->second;
 
   const char *subdir = "host";
   bool is_host = true;
@@ -950,7 +1301,7 @@ static llvm::Module *getKernelLibrary(cl_device_id device,
   if (is_host) {
     kernellib += '-';
 #ifdef KERNELLIB_HOST_DISTRO_VARIANTS
-    kernellib += getX86KernelLibName();
+    kernellib += pocl_get_distro_kernellib_variant();
 #else
     kernellib_fallback = kernellib;
     kernellib_fallback += OCL_KERNEL_TARGET_CPU;
@@ -963,30 +1314,45 @@ static llvm::Module *getKernelLibrary(cl_device_id device,
 
   llvm::Module *lib;
 
-  if (pocl_exists(kernellib.c_str()))
-    {
-      POCL_MSG_PRINT_LLVM("Using %s as the built-in lib.\n", kernellib.c_str());
-      lib = parseModuleIR(kernellib.c_str(), llvmContext);
-    }
-  else
-    {
+  if (!pocl_exists(kernellib.c_str())) {
 #ifndef KERNELLIB_HOST_DISTRO_VARIANTS
-      if (is_host && pocl_exists(kernellib_fallback.c_str()))
-        {
-          POCL_MSG_WARN("Using fallback %s as the built-in lib.\n",
-                        kernellib_fallback.c_str());
-          lib = parseModuleIR(kernellib_fallback.c_str(), llvmContext);
-        }
-      else
+    if (is_host && pocl_exists(kernellib_fallback.c_str())) {
+      POCL_MSG_WARN("Using fallback %s as the built-in lib.\n",
+                    kernellib_fallback.c_str());
+      kernellib = kernellib_fallback;
+    } else
 #endif
-        POCL_ABORT("Kernel library file %s doesn't exist.\n", kernellib.c_str());
-    }
-  assert (lib != NULL);
-  kernelLibraryMap->insert(std::make_pair(device, lib));
+      POCL_ABORT("Kernel library file %s doesn't exist.\n", kernellib.c_str());
+  }
+
+  // the devices of the same target share the module
+  kernelLibraryFileMapTy *kernelLibraryFiles = llvm_ctx->kernelLibraryFiles;
+  auto Found = kernelLibraryFiles->find(kernellib);
+  if (Found != kernelLibraryFiles->end()) {
+    lib = Found->second;
+  } else {
+    POCL_MSG_PRINT_LLVM("Using %s as the built-in lib.\n", kernellib.c_str());
+    lib = parseModuleIRLazy(kernellib.c_str(), llvmContext);
+    assert (lib != NULL);
+    kernelLibraryFiles->insert(std::make_pair(kernellib, lib));
+  }
+  kernelLibraryMap->insert(std::make_pair(target, lib));
 
   return lib;
 }
 
+/**
+ * Returns true if the build options of the program allow binding the math
+ * builtins to their relaxed precision versions in the kernel library.
+ */
+bool programUsesRelaxedMath(cl_program program) {
+  if (program->compiler_options == nullptr)
+    return false;
+  std::string options(program->compiler_options);
+  return options.find("cl-fast-relaxed-math") != std::string::npos ||
+         options.find("cl-unsafe-math-optimizations") != std::string::npos;
+}
+
 /**
  * Invoke the Clang compiler through its Driver API.
  *
@@ -34,6 +34,11 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/DataLayout.h>
+#include <llvm/IR/GetElementPtrTypeIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/SmallVector.h>
 
 #include <string>
@@ -170,6 +175,8 @@ static int pocl_get_kernel_arg_module_metadata(llvm::Function *Kernel,
             current_arg->type_qualifier |= CL_KERNEL_ARG_TYPE_RESTRICT;
           if (val.find("volatile") != std::string::npos)
             current_arg->type_qualifier |= CL_KERNEL_ARG_TYPE_VOLATILE;
+          if (val.find("pipe") != std::string::npos)
+            current_arg->type_qualifier |= CL_KERNEL_ARG_TYPE_PIPE;
         } else if (meta_name == "kernel_arg_name") {
           assert(has_meta_for_every_arg && "kernel_arg_name meta incomplete");
           kernel_meta->has_arg_metadata |= POCL_HAS_KERNEL_ARG_NAME;
@@ -195,6 +202,7 @@ static std::map<std::string, unsigned> type_size_map = {
   {std::string("uint"), (4)},
   {std::string("long"), (8)},
   {std::string("ulong"), (8)},
+  {std::string("queue_t"), sizeof(void *)},
 
 
   {std::string("char2"), (1*2)},
@@ -411,6 +419,8 @@ static int pocl_get_kernel_arg_function_metadata(llvm::Function *Kernel,
       current_arg->type_qualifier |= CL_KERNEL_ARG_TYPE_RESTRICT;
     if (val.find("volatile") != std::string::npos)
       current_arg->type_qualifier |= CL_KERNEL_ARG_TYPE_VOLATILE;
+    if (val.find("pipe") != std::string::npos)
+      current_arg->type_qualifier |= CL_KERNEL_ARG_TYPE_PIPE;
   }
 
   // kernel_arg_name
@@ -444,6 +454,306 @@ static int pocl_get_kernel_arg_function_metadata(llvm::Function *Kernel,
 
 /*****************************************************************************/
 
+// Returns the factor by which V grows per unit of get_local_id(0), or 0 if
+// V is not (visibly) an affine function of it.
+static uint64_t getLocalIdXFactor(llvm::Value *V, unsigned Depth = 0) {
+  if (Depth > 8)
+    return 0;
+
+  if (CallInst *Call = dyn_cast<CallInst>(V)) {
+    Function *Callee = Call->getCalledFunction();
+    if (Callee == nullptr || Callee->getName() != "_Z12get_local_idj")
+      return 0;
+    ConstantInt *Dim = dyn_cast<ConstantInt>(Call->getArgOperand(0));
+    return (Dim != nullptr && Dim->isZero()) ? 1 : 0;
+  }
+
+  if (CastInst *Cast = dyn_cast<CastInst>(V))
+    return getLocalIdXFactor(Cast->getOperand(0), Depth + 1);
+
+  BinaryOperator *BO = dyn_cast<BinaryOperator>(V);
+  if (BO == nullptr)
+    return 0;
+  llvm::Value *A = BO->getOperand(0), *B = BO->getOperand(1);
+  ConstantInt *C = dyn_cast<ConstantInt>(B);
+  switch (BO->getOpcode()) {
+  case Instruction::Add:
+  case Instruction::Sub:
+    return std::max(getLocalIdXFactor(A, Depth + 1),
+                    getLocalIdXFactor(B, Depth + 1));
+  case Instruction::Mul:
+    if (C == nullptr) {
+      C = dyn_cast<ConstantInt>(A);
+      A = B;
+    }
+    return C ? getLocalIdXFactor(A, Depth + 1) * C->getZExtValue() : 0;
+  case Instruction::Shl:
+    return C ? getLocalIdXFactor(A, Depth + 1) << C->getZExtValue() : 0;
+  default:
+    return 0;
+  }
+}
+
+// Returns the bytes by which the address Ptr advances per unit of
+// get_local_id(0), if Ptr points into one of the LocalBases.
+static uint64_t
+getLocalAccessStride(llvm::Value *Ptr, const DataLayout &DL,
+                     const SmallPtrSetImpl<llvm::Value *> &LocalBases) {
+  uint64_t Stride = 0;
+  Ptr = Ptr->stripPointerCasts();
+  while (GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr)) {
+    for (gep_type_iterator I = gep_type_begin(GEP), E = gep_type_end(GEP);
+         I != E; ++I) {
+      if (I.isStruct())
+        continue;
+      uint64_t Factor = getLocalIdXFactor(I.getOperand());
+      if (Factor > 0)
+        Stride += Factor * DL.getTypeAllocSize(I.getIndexedType());
+    }
+    Ptr = GEP->getPointerOperand()->stripPointerCasts();
+  }
+  return LocalBases.count(Ptr) ? Stride : 0;
+}
+
+// Estimates the per-work-item memory footprint of the kernel: the private
+// variables of the kernel and the functions it calls, and the largest
+// stride of its get_local_id(0)-indexed accesses to the __local arrays.
+static void
+getPerWorkItemFootprint(llvm::Function *Kernel, const DataLayout &DL,
+                        const SmallVectorImpl<GlobalVariable *> &Locals,
+                        pocl_kernel_metadata_t *Meta) {
+  SmallPtrSet<llvm::Value *, 8> LocalBases;
+  for (GlobalVariable *GV : Locals)
+    LocalBases.insert(GV);
+  unsigned ArgI = 0;
+  for (llvm::Argument &Arg : Kernel->args()) {
+    if (ARG_IS_LOCAL(Meta->arg_info[ArgI]))
+      LocalBases.insert(&Arg);
+    ++ArgI;
+  }
+
+  uint64_t LocalStride = 0;
+  for (llvm::BasicBlock &BB : *Kernel) {
+    for (llvm::Instruction &I : BB) {
+      llvm::Value *Ptr = nullptr;
+      if (LoadInst *Load = dyn_cast<LoadInst>(&I))
+        Ptr = Load->getPointerOperand();
+      else if (StoreInst *Store = dyn_cast<StoreInst>(&I))
+        Ptr = Store->getPointerOperand();
+      else if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I))
+        Ptr = RMW->getPointerOperand();
+      else if (AtomicCmpXchgInst *CmpXchg = dyn_cast<AtomicCmpXchgInst>(&I))
+        Ptr = CmpXchg->getPointerOperand();
+      if (Ptr != nullptr)
+        LocalStride = std::max(LocalStride,
+                               getLocalAccessStride(Ptr, DL, LocalBases));
+    }
+  }
+
+  uint64_t PrivateSize = 0;
+  SmallPtrSet<llvm::Function *, 8> Visited;
+  SmallVector<llvm::Function *, 8> Worklist;
+  Worklist.push_back(Kernel);
+  Visited.insert(Kernel);
+  while (!Worklist.empty()) {
+    llvm::Function *F = Worklist.pop_back_val();
+    for (llvm::BasicBlock &BB : *F) {
+      for (llvm::Instruction &I : BB) {
+        if (AllocaInst *Alloca = dyn_cast<AllocaInst>(&I)) {
+          ConstantInt *Count = dyn_cast<ConstantInt>(Alloca->getArraySize());
+          if (Count != nullptr)
+            PrivateSize += DL.getTypeAllocSize(Alloca->getAllocatedType()) *
+                           Count->getZExtValue();
+        } else if (CallInst *Call = dyn_cast<CallInst>(&I)) {
+          llvm::Function *Callee = Call->getCalledFunction();
+          if (Callee != nullptr && !Callee->isDeclaration() &&
+              Visited.insert(Callee).second)
+            Worklist.push_back(Callee);
+        }
+      }
+    }
+  }
+
+  Meta->private_mem_per_wi = PrivateSize;
+  Meta->local_mem_wi_stride = LocalStride;
+}
+
+// Returns true if V is get_global_id(0), possibly extended or truncated.
+static bool isGlobalIdX(llvm::Value *V) {
+  while (CastInst *Cast = dyn_cast<CastInst>(V))
+    V = Cast->getOperand(0);
+  CallInst *Call = dyn_cast<CallInst>(V);
+  if (Call == nullptr)
+    return false;
+  Function *Callee = Call->getCalledFunction();
+  if (Callee == nullptr || Callee->getName() != "_Z13get_global_idj")
+    return false;
+  ConstantInt *Dim = dyn_cast<ConstantInt>(Call->getArgOperand(0));
+  return Dim != nullptr && Dim->isZero();
+}
+
+// Returns true if the uses of the buffer pointer V only load or store
+// elements of the get_global_id(0)'th element of it. AtGid tells whether
+// the element has been selected already, constant indices are allowed on
+// top of it (e.g. for struct members).
+static bool usesOnlyGlobalIdX(llvm::Value *V, bool AtGid, unsigned Depth = 0) {
+  if (Depth > 8)
+    return false;
+  for (llvm::User *U : V->users()) {
+    if (LoadInst *Load = dyn_cast<LoadInst>(U)) {
+      if (!AtGid || Load->isVolatile())
+        return false;
+    } else if (StoreInst *Store = dyn_cast<StoreInst>(U)) {
+      if (!AtGid || Store->getValueOperand() == V || Store->isVolatile())
+        return false;
+    } else if (isa<BitCastInst>(U) || isa<AddrSpaceCastInst>(U)) {
+      if (!usesOnlyGlobalIdX(U, AtGid, Depth + 1))
+        return false;
+    } else if (GEPOperator *GEP = dyn_cast<GEPOperator>(U)) {
+      if (GEP->getPointerOperand() != V || GEP->getNumIndices() == 0)
+        return false;
+      auto I = GEP->idx_begin();
+      bool Selects = !AtGid && isGlobalIdX(*I);
+      if (!Selects && !isa<ConstantInt>(*I))
+        return false;
+      if (AtGid && !cast<ConstantInt>(*I)->isZero())
+        return false;
+      for (++I; I != GEP->idx_end(); ++I)
+        if (!isa<ConstantInt>(*I))
+          return false;
+      if (!usesOnlyGlobalIdX(GEP, AtGid || Selects, Depth + 1))
+        return false;
+    } else if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U)) {
+      if (!isa<DbgInfoIntrinsic>(II))
+        return false;
+    } else
+      return false;
+  }
+  return true;
+}
+
+// Returns true if each work-item of the kernel accesses its buffer
+// arguments only at the element get_global_id(0), and no other global
+// memory than constant program-scope data. Then the WGs of a chain of
+// such kernels over the same 1D grid only communicate with the WG of the
+// same index of the previous kernel.
+static bool accessesOnlyGlobalIdX(llvm::Function *Kernel,
+                                  pocl_kernel_metadata_t *Meta) {
+  SmallPtrSet<llvm::Value *, 8> PrivateOrLocal;
+  unsigned ArgI = 0;
+  for (llvm::Argument &Arg : Kernel->args()) {
+    struct pocl_argument_info &AI = Meta->arg_info[ArgI++];
+    if (AI.type == POCL_ARG_TYPE_IMAGE)
+      return false;
+    if (AI.type != POCL_ARG_TYPE_POINTER)
+      continue;
+    if (ARG_IS_LOCAL(AI))
+      PrivateOrLocal.insert(&Arg);
+    else if (!usesOnlyGlobalIdX(&Arg, false))
+      return false;
+  }
+
+  for (llvm::BasicBlock &BB : *Kernel) {
+    for (llvm::Instruction &I : BB) {
+      if (CallInst *Call = dyn_cast<CallInst>(&I)) {
+        if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(Call)) {
+          if (isa<DbgInfoIntrinsic>(II) ||
+              II->getIntrinsicID() == Intrinsic::lifetime_start ||
+              II->getIntrinsicID() == Intrinsic::lifetime_end)
+            continue;
+        }
+        llvm::Function *Callee = Call->getCalledFunction();
+        // user functions that were not inlined could do anything
+        if (Callee == nullptr || !Callee->isDeclaration())
+          return false;
+        for (llvm::Value *Op : Call->args())
+          if (Op->getType()->isPointerTy())
+            return false;
+        continue;
+      }
+      llvm::Value *Ptr = nullptr;
+      if (LoadInst *Load = dyn_cast<LoadInst>(&I))
+        Ptr = Load->getPointerOperand();
+      else if (StoreInst *Store = dyn_cast<StoreInst>(&I))
+        Ptr = Store->getPointerOperand();
+      else if (isa<AtomicRMWInst>(&I) || isa<AtomicCmpXchgInst>(&I))
+        return false;
+      if (Ptr == nullptr)
+        continue;
+      // the buffer arguments were checked above
+      llvm::Value *Base = Ptr->stripPointerCasts();
+      while (GEPOperator *GEP = dyn_cast<GEPOperator>(Base))
+        Base = GEP->getPointerOperand()->stripPointerCasts();
+      if (isa<llvm::Argument>(Base) || isa<AllocaInst>(Base) ||
+          PrivateOrLocal.count(Base))
+        continue;
+      GlobalVariable *GV = dyn_cast<GlobalVariable>(Base);
+      if (GV != nullptr && (GV->isConstant() ||
+                            pocl::isAutomaticLocal(Kernel->getName().str(),
+                                                   *GV)))
+        continue;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if the kernel can't tell a work-group with a smaller local
+// size at the edge of a non-uniform grid from the others. The work-item
+// and group ids stay correct there, but the global size, global offset and
+// local size the kernel library computes from the context don't, and the
+// barriers and work-group functions might assume the local size.
+static bool isNonUniformSafe(llvm::Function *Kernel) {
+  static const char *const Unsafe[] = {
+      "get_global_size", "get_global_offset", "get_local_size",
+      "get_enqueued_local_size", "get_global_linear_id", "barrier",
+      "work_group_", "sub_group_"};
+  // the ids whose library implementations read the context correctly
+  static const char *const Safe[] = {"get_global_id", "get_local_id",
+                                     "get_group_id", "get_num_groups",
+                                     "get_work_dim"};
+
+  SmallPtrSet<llvm::Function *, 8> Visited;
+  SmallVector<llvm::Function *, 8> Worklist;
+  Worklist.push_back(Kernel);
+  Visited.insert(Kernel);
+  while (!Worklist.empty()) {
+    llvm::Function *F = Worklist.pop_back_val();
+    for (llvm::BasicBlock &BB : *F) {
+      for (llvm::Instruction &I : BB) {
+        for (llvm::Value *Op : I.operands()) {
+          GlobalVariable *GV =
+              dyn_cast<GlobalVariable>(Op->stripPointerCasts());
+          if (GV != nullptr &&
+              (GV->getName().startswith("_local_size_") ||
+               GV->getName().startswith("_global_offset_")))
+            return false;
+        }
+        CallInst *Call = dyn_cast<CallInst>(&I);
+        if (Call == nullptr || isa<IntrinsicInst>(Call))
+          continue;
+        llvm::Function *Callee = Call->getCalledFunction();
+        if (Callee == nullptr)
+          return false;
+        StringRef Name = Callee->getName();
+        bool IsSafe = false;
+        for (const char *S : Safe)
+          IsSafe |= Name.contains(S);
+        if (IsSafe)
+          continue;
+        for (const char *U : Unsafe)
+          if (Name.contains(U))
+            return false;
+        if (!Callee->isDeclaration() && Visited.insert(Callee).second)
+          Worklist.push_back(Callee);
+      }
+    }
+  }
+  return true;
+}
+
+/*****************************************************************************/
+
 int pocl_llvm_get_kernels_metadata(cl_program program, unsigned device_i) {
 
   cl_context ctx = program->context;
@@ -546,6 +856,11 @@ int pocl_llvm_get_kernels_metadata(cl_program program, unsigned device_i) {
       #endif
     }
 
+    getPerWorkItemFootprint(KernelFunction, *TD, locals, meta);
+    POCL_MSG_PRINT_LLVM("Kernel %s: %zu bytes of private memory per WI, "
+                        "__local stride %zu bytes\n", meta->name,
+                        meta->private_mem_per_wi, meta->local_mem_wi_stride);
+
     i = 0;
     for (llvm::Function::const_arg_iterator ii = KernelFunction->arg_begin(),
                                             ee = KernelFunction->arg_end();
@@ -559,6 +874,10 @@ int pocl_llvm_get_kernels_metadata(cl_program program, unsigned device_i) {
         // index 0 is for function attributes, parameters start at 1.
         // TODO: detect the address space from MD.
       }
+      // a device queue is passed as the cl_command_queue handle itself
+      if (ArgInfo.type_name != nullptr &&
+          std::strcmp(ArgInfo.type_name, "queue_t") == 0)
+        ArgInfo.type = POCL_ARG_TYPE_NONE;
       if (pocl::is_image_type(*t)) {
         ArgInfo.type = POCL_ARG_TYPE_IMAGE;
       } else if (pocl::is_sampler_type(*t)) {
@@ -567,6 +886,12 @@ int pocl_llvm_get_kernels_metadata(cl_program program, unsigned device_i) {
       i++;
     }
 
+    meta->gid_local_access = accessesOnlyGlobalIdX(KernelFunction, meta);
+    if (meta->gid_local_access)
+      POCL_MSG_PRINT_LLVM("Kernel %s accesses its buffers only at "
+                          "get_global_id(0)\n", meta->name);
+    meta->nonuniform_safe = isNonUniformSafe(KernelFunction);
+
     std::stringstream attrstr;
     std::string vectypehint;
 
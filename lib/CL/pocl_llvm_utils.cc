@@ -65,6 +65,11 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #endif
 #include <llvm-c/Core.h>
 
+#ifdef HAVE_LLVM_SPIRV_LIB
+#include <LLVMSPIRVLib.h>
+#include <sstream>
+#endif
+
 using namespace llvm;
 
 #include <string>
@@ -75,6 +80,29 @@ llvm::Module *parseModuleIR(const char *path, llvm::LLVMContext *c) {
   return parseIRFile(path, Err, *c).release();
 }
 
+llvm::Module *parseModuleIRLazy(const char *path, llvm::LLVMContext *c) {
+  // Without a null terminator the bitcode is always mmapped, so the pages
+  // of the function bodies never materialized are never read, and the page
+  // cache is shared by all the processes loading the file.
+#ifndef LLVM_OLDER_THAN_13_0
+  auto Buffer = MemoryBuffer::getFile(path, /*IsText=*/false,
+                                      /*RequiresNullTerminator=*/false);
+#else
+  auto Buffer = MemoryBuffer::getFile(path, /*FileSize=*/-1,
+                                      /*RequiresNullTerminator=*/false);
+#endif
+  if (Buffer && isBitcode((const unsigned char *)(*Buffer)->getBufferStart(),
+                          (const unsigned char *)(*Buffer)->getBufferEnd())) {
+    auto M = getOwningLazyBitcodeModule(std::move(*Buffer), *c);
+    if (M)
+      return M->release();
+    consumeError(M.takeError());
+    return nullptr;
+  }
+  SMDiagnostic Err;
+  return getLazyIRFileModule(path, Err, *c).release();
+}
+
 void writeModuleIRtoString(const llvm::Module *mod, std::string& dest) {
   llvm::raw_string_ostream sos(dest);
 #ifdef LLVM_OLDER_THAN_7_0
@@ -122,6 +150,11 @@ static int getModuleTriple(const char *input_stream, size_t size,
 }
 
 char *pocl_get_llvm_cpu_name() {
+  // allow cross-compiling e.g. poclbinaries for another CPU
+  const char *cpu_override = pocl_get_string_option("POCL_LLVM_CPU_NAME", NULL);
+  if (cpu_override && cpu_override[0])
+    return strdup(cpu_override);
+
   StringRef r = llvm::sys::getHostCPUName();
 
   // LLVM may return an empty string -- treat as generic
@@ -288,7 +321,7 @@ void InitializeLLVM() {
     currentWgMethod =
         pocl_get_string_option("POCL_WORK_GROUP_METHOD", "loopvec");
 
-    if (currentWgMethod == "loopvec") {
+    if (currentWgMethod == "loopvec" || currentWgMethod == "cbs") {
 
       O = opts["scalarize-load-store"];
       assert(O && "could not find LLVM option 'scalarize-load-store'");
@@ -309,6 +342,17 @@ void InitializeLLVM() {
       // TODO: If enabled then parallel region construction code needs
       // improvements and make sure it doesn't disallow other optimizations like
       // vectorization.
+      // Versions of the generic work-group functions for common local
+      // sizes, see Workgroup::createLocalSizeXVersions().
+      O = opts["wg-generic-local-size-x-versions"];
+      assert(O && "could not find LLVM option "
+                  "'wg-generic-local-size-x-versions'");
+      const char *Versions =
+          pocl_get_string_option("POCL_WORK_GROUP_GENERIC_VERSIONS", "auto");
+      if (StringRef(Versions) != "0")
+        O->addOccurrence(1, StringRef("wg-generic-local-size-x-versions"),
+                         StringRef(Versions), false);
+
       O = opts["jump-threading-threshold"];
       assert(O && "could not find LLVM option 'jump-threading-threshold'");
       O->addOccurrence(1, StringRef("jump-threading-threshold"), StringRef("0"),
@@ -343,6 +387,36 @@ void InitializeLLVM() {
       assert(O && "could not find LLVM option 'debug'");
       O->addOccurrence(1, StringRef("debug"), StringRef("true"), false);
     }
+    if (pocl_get_bool_option("POCL_CONTEXT_ARRAY_LAYOUT", 1) == 0) {
+      // Store all values live across barriers to plain context arrays.
+      O = opts["wi-context-remat"];
+      assert(O && "could not find LLVM option 'wi-context-remat'");
+      O->addOccurrence(1, StringRef("wi-context-remat"), StringRef("false"),
+                       false);
+      O = opts["wi-context-layout"];
+      assert(O && "could not find LLVM option 'wi-context-layout'");
+      O->addOccurrence(1, StringRef("wi-context-layout"), StringRef("false"),
+                       false);
+    }
+    if (pocl_get_bool_option("POCL_PRIVATIZE_GLOBAL_ATOMICS", 1) == 0) {
+      O = opts["privatize-global-atomics"];
+      assert(O && "could not find LLVM option 'privatize-global-atomics'");
+      O->addOccurrence(1, StringRef("privatize-global-atomics"),
+                       StringRef("false"), false);
+    }
+    if (pocl_get_bool_option("POCL_WORK_ITEM_PREFETCH", 0)) {
+      O = opts["wi-prefetch"];
+      assert(O && "could not find LLVM option 'wi-prefetch'");
+      O->addOccurrence(1, StringRef("wi-prefetch"), StringRef("true"), false);
+      const char *Distance =
+          pocl_get_string_option("POCL_WORK_ITEM_PREFETCH_DISTANCE", NULL);
+      if (Distance != NULL) {
+        O = opts["wi-prefetch-distance"];
+        assert(O && "could not find LLVM option 'wi-prefetch-distance'");
+        O->addOccurrence(1, StringRef("wi-prefetch-distance"),
+                         StringRef(Distance), false);
+      }
+    }
 #if LLVM_MAJOR == 9
     O = opts["unroll-threshold"];
     assert(O && "could not find LLVM option 'unroll-threshold'");
@@ -358,12 +432,6 @@ or one times! clang: for the   --unroll-threshold option: may only occur zero or
 one times!
 */
 
-void UnInitializeLLVM() {
-  clearKernelPasses();
-  clearTargetMachines();
-  LLVMInitialized = false;
-}
-
 #define GLOBAL_LLVM_CONTEXT
 
 #ifdef GLOBAL_LLVM_CONTEXT
@@ -371,6 +439,20 @@ static PoclLLVMContextData *GlobalLLVMContext = nullptr;
 static unsigned GlobalLLVMContextRefcount = 0;
 #endif
 
+static void destroyLLVMContextData(PoclLLVMContextData *data);
+
+void UnInitializeLLVM() {
+  clearKernelPasses();
+  clearTargetMachines();
+#ifdef GLOBAL_LLVM_CONTEXT
+  if (GlobalLLVMContext != nullptr && GlobalLLVMContextRefcount == 0) {
+    destroyLLVMContextData(GlobalLLVMContext);
+    GlobalLLVMContext = nullptr;
+  }
+#endif
+  LLVMInitialized = false;
+}
+
 void pocl_llvm_create_context(cl_context ctx) {
 
   POCL_MSG_PRINT_LLVM("creating LLVM context\n");
@@ -396,6 +478,9 @@ void pocl_llvm_create_context(cl_context ctx) {
 
   data->kernelLibraryMap = new kernelLibraryMapTy;
   assert(data->kernelLibraryMap);
+  data->kernelLibraryFiles = new kernelLibraryFileMapTy;
+  data->preparedKernels = new preparedKernelMapTy;
+  data->libraryCallGraphs = new libraryCallGraphMapTy;
   POCL_INIT_LOCK(data->Lock);
 
   LLVMContextSetDiagnosticHandler(wrap(data->Context),
@@ -409,45 +494,86 @@ void pocl_llvm_create_context(cl_context ctx) {
 #endif
 }
 
+static void destroyLLVMContextData(PoclLLVMContextData *data) {
+
+  delete data->poclDiagPrinter;
+  delete data->poclDiagStream;
+  delete data->poclDiagString;
+
+  assert(data->kernelLibraryMap);
+  // the call graphs refer to the functions of the libraries
+  delete data->libraryCallGraphs;
+  // void cleanKernelLibrary(cl_context ctx) {
+  for (auto &I : *data->kernelLibraryFiles)
+    delete I.second;
+  delete data->kernelLibraryFiles;
+  delete data->kernelLibraryMap;
+
+  for (auto &I : *data->preparedKernels)
+    delete I.second;
+  delete data->preparedKernels;
+  POCL_DESTROY_LOCK(data->Lock);
+
+  delete data->Context;
+  delete data;
+}
+
 void pocl_llvm_release_context(cl_context ctx) {
 
   POCL_MSG_PRINT_LLVM("releasing LLVM context\n");
 
+  PoclLLVMContextData *data = (PoclLLVMContextData *)ctx->llvm_context_data;
+  assert(data);
+  ctx->llvm_context_data = nullptr;
+
 #ifdef GLOBAL_LLVM_CONTEXT
   --GlobalLLVMContextRefcount;
   if (GlobalLLVMContextRefcount > 0)
     return;
 #endif
 
-  PoclLLVMContextData *data = (PoclLLVMContextData *)ctx->llvm_context_data;
-  assert(data);
-
   if (data->number_of_IRs > 0) {
     POCL_ABORT("still have references to IRs - can't release LLVM context !\n");
   }
 
-  delete data->poclDiagPrinter;
-  delete data->poclDiagStream;
-  delete data->poclDiagString;
+#ifdef GLOBAL_LLVM_CONTEXT
+  // Keep the kernel libraries loaded for the next context, it would
+  // otherwise load them again; UnInitializeLLVM() releases them.
+  return;
+#else
+  destroyLLVMContextData(data);
+#endif
+}
 
-  assert(data->kernelLibraryMap);
-  // void cleanKernelLibrary(cl_context ctx) {
-  for (auto i = data->kernelLibraryMap->begin(),
-            e = data->kernelLibraryMap->end();
-       i != e; ++i) {
-    delete (llvm::Module *)i->second;
+#ifdef HAVE_LLVM_SPIRV_LIB
+int pocl_llvm_spirv_to_bitcode(cl_context ctx, const char *spirv,
+                               size_t size, char **output,
+                               uint64_t *output_size) {
+  PoclLLVMContextData *llvm_ctx = (PoclLLVMContextData *)ctx->llvm_context_data;
+  assert(llvm_ctx);
+  PoclCompilerMutexGuard lockHolder(&llvm_ctx->Lock);
+
+  std::istringstream Input(std::string(spirv, size));
+  llvm::Module *Mod = nullptr;
+  std::string ErrMsg;
+  if (!llvm::readSpirv(*llvm_ctx->Context, Input, Mod, ErrMsg)) {
+    POCL_MSG_ERR("SPIR-V translation failed: %s\n", ErrMsg.c_str());
+    delete Mod;
+    return -1;
   }
-  data->kernelLibraryMap->clear();
-  delete data->kernelLibraryMap;
-  POCL_DESTROY_LOCK(data->Lock);
 
-  delete data->Context;
-  delete data;
-  ctx->llvm_context_data = nullptr;
-#ifdef GLOBAL_LLVM_CONTEXT
-  GlobalLLVMContext = nullptr;
-#endif
+  std::string Bitcode;
+  writeModuleIRtoString(Mod, Bitcode);
+  delete Mod;
+
+  *output = (char *)malloc(Bitcode.size());
+  if (*output == nullptr)
+    return -1;
+  memcpy(*output, Bitcode.data(), Bitcode.size());
+  *output_size = Bitcode.size();
+  return 0;
 }
+#endif
 
 #define POCL_METADATA_ROOT "pocl_meta"
 
@@ -29,6 +29,8 @@
 #include "pocl_cache.h"
 #include "pocl_file_util.h"
 #include "pocl_llvm_api.h"
+#include "pocl_perf_counters.h"
+#include "pocl_timing.h"
 
 #include <string>
 #include <map>
@@ -52,6 +54,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
 
 #include <llvm/Target/TargetOptions.h>
 #include <llvm/Target/TargetMachine.h>
@@ -66,9 +69,20 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/LegacyPassManager.h>
 
+#ifndef LLVM_OLDER_THAN_11_0
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/MemoryBuffer.h>
+#endif
+
 #define PassManager legacy::PassManager
 
 #include "linker.h"
+#include "LLVMUtils.h"
 
 // Enable to get the LLVM pass execution timing report dumped to console after
 // each work-group IR function generation. Requires LLVM > 7.
@@ -81,8 +95,183 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #define CODEGEN_FILE_TYPE_NS TargetMachine
 #endif
 
+// The kernel compile report needs the always enabled statistics and
+// the JSON writer.
+#ifndef LLVM_OLDER_THAN_10_0
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Support/JSON.h>
+#define POCL_COMPILE_REPORT
+#endif
+
 using namespace llvm;
 
+#ifdef POCL_COMPILE_REPORT
+
+/* The kernel compile report (POCL_KERNEL_COMPILE_REPORT): the time each
+   step of the kernel compiler pipeline took and the instruction counts
+   around it, followed by the outcome of the work-group function
+   generation, written as JSON next to the specialization's parallel.bc. */
+
+static bool compileReportEnabled() {
+  static int Enabled = -1;
+  if (Enabled < 0)
+    Enabled = pocl_get_bool_option("POCL_KERNEL_COMPILE_REPORT", 0);
+  return Enabled;
+}
+
+namespace {
+
+struct CompileReportStep {
+  std::string Pass;
+  uint64_t TimeNs;
+  uint64_t InstructionsAfter;
+};
+
+// The steps of the kernel being compiled. The kernel compiler runs one
+// kernel at a time, like the shared per device pass managers assume.
+std::vector<CompileReportStep> ReportSteps;
+uint64_t ReportStartNs;
+uint64_t ReportLastTimeNs;
+uint64_t ReportStartInstructions;
+
+// Records the pipeline step added just before it. This is a function
+// pass so that it does not split the function pass managers of the
+// pipeline, thus the steps accumulate over the functions of the module.
+class CompileReportProbe : public FunctionPass {
+public:
+  static char ID;
+  CompileReportProbe(unsigned Step, const std::string &Pass)
+      : FunctionPass(ID), Step(Step), Pass(Pass) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+  }
+
+  StringRef getPassName() const override { return "pocl compile report"; }
+
+  bool runOnFunction(Function &F) override {
+    uint64_t Now = pocl_gettimemono_ns();
+    if (ReportSteps.size() <= Step)
+      ReportSteps.resize(Step + 1);
+    CompileReportStep &S = ReportSteps[Step];
+    S.Pass = Pass;
+    S.TimeNs += Now - ReportLastTimeNs;
+    S.InstructionsAfter += F.getInstructionCount();
+    // Do not account the counting to the next step.
+    ReportLastTimeNs = pocl_gettimemono_ns();
+    return false;
+  }
+
+private:
+  unsigned Step;
+  std::string Pass;
+};
+
+char CompileReportProbe::ID = 0;
+
+} // namespace
+
+static void startCompileReport(const Module &M) {
+  ResetStatistics();
+  ReportSteps.clear();
+  ReportStartInstructions = 0;
+  for (const Function &F : M)
+    ReportStartInstructions += F.getInstructionCount();
+  ReportStartNs = ReportLastTimeNs = pocl_gettimemono_ns();
+}
+
+static void writeCompileReport(const char *Path, cl_device_id Device,
+                               cl_kernel Kernel, const Module &M,
+                               bool PreparedCached) {
+  uint64_t TotalNs = pocl_gettimemono_ns() - ReportStartNs;
+
+  std::map<std::string, uint64_t> Stats;
+  for (const auto &Stat : GetStatistics())
+    Stats[Stat.first.str()] += Stat.second;
+
+  std::string Method = "none";
+  if (Stats["LoopKernels"])
+    Method = currentWgMethod == "loopvec" ? "loopvec" : "loops";
+  else if (Stats["ReplicatedKernels"])
+    Method = "repl";
+  else if (Stats["SubCFGKernels"])
+    Method = "cbs";
+  else if (Stats["FiberKernels"])
+    Method = "fibers";
+
+  // The vectorization outcome of the final work-group function. The
+  // vectorizers' own statistics are included below only if LLVM was built
+  // with statistics enabled.
+  uint64_t VectorInstructions = 0;
+  for (const Function &F : M)
+    for (const BasicBlock &BB : F)
+      for (const Instruction &I : BB) {
+        const Value *V = &I;
+        if (const StoreInst *Store = dyn_cast<StoreInst>(&I))
+          V = Store->getValueOperand();
+        if (V->getType()->isVectorTy())
+          ++VectorInstructions;
+      }
+
+  std::string Report;
+  raw_string_ostream OS(Report);
+  json::OStream J(OS, 2);
+  J.object([&] {
+    J.attribute("kernel", Kernel->name);
+    J.attribute("device", Device->short_name);
+    J.attribute("wg_method", Method);
+    J.attribute("total_us", (int64_t)(TotalNs / 1000));
+    // The passes shared by the specializations ran earlier.
+    J.attribute("prepared_kernel_cached", PreparedCached);
+    J.attributeArray("passes", [&] {
+      uint64_t Instructions = ReportStartInstructions;
+      for (const CompileReportStep &Step : ReportSteps) {
+        if (Step.Pass.empty())
+          continue;
+        J.object([&] {
+          J.attribute("pass", Step.Pass);
+          J.attribute("time_us", (int64_t)(Step.TimeNs / 1000));
+          J.attribute("instructions_before", (int64_t)Instructions);
+          J.attribute("instructions_after", (int64_t)Step.InstructionsAfter);
+        });
+        Instructions = Step.InstructionsAfter;
+      }
+    });
+    J.attribute("parallel_regions",
+                (int64_t)(Stats["NumParallelRegions"] + Stats["NumSubCFGs"]));
+    J.attribute("context_array_bytes", (int64_t)Stats["ContextArrayBytes"]);
+    // The parallel regions whose work-item loops were interchanged to
+    // make their memory accesses consecutive in the vectorized dimension.
+    J.attributeObject("interchanged_wi_loops", [&] {
+      J.attribute("y_innermost", (int64_t)Stats["InnermostLoopY"]);
+      J.attribute("z_innermost", (int64_t)Stats["InnermostLoopZ"]);
+    });
+    // The kernel loops the work-items were parallelized inside of, and
+    // those left innermost for the vectorizer.
+    J.attributeObject("kernel_loops", [&] {
+      J.attribute("parallel_outer", (int64_t)Stats["ParallelOuterLoops"]);
+      J.attribute("vectorized_inner", (int64_t)Stats["InnerKernelLoops"]);
+    });
+    J.attribute("vector_instructions", (int64_t)VectorInstructions);
+    J.attribute("vectorized", VectorInstructions > 0);
+    J.attributeObject("statistics", [&] {
+      for (const auto &Stat : Stats)
+        if (Stat.second)
+          J.attribute(Stat.first, (int64_t)Stat.second);
+    });
+  });
+  OS << "\n";
+  OS.flush();
+
+  if (pocl_write_file(Path, Report.c_str(), Report.size(), 0, 0))
+    POCL_MSG_WARN("Could not write the compile report %s\n", Path);
+  else
+    POCL_MSG_PRINT_LLVM("Wrote the compile report of %s to %s\n",
+                        Kernel->name, Path);
+}
+
+#endif
+
 /**
  * Prepare the kernel compiler passes.
  *
@@ -93,6 +282,8 @@ using namespace llvm;
 
 static std::map<cl_device_id, llvm::TargetMachine *> targetMachines;
 static std::map<cl_device_id, PassManager *> kernelPasses;
+static std::map<cl_device_id, PassManager *> kernelPreparePasses;
+static std::map<cl_device_id, PassManager *> kernelFastPasses;
 
 /* FIXME: these options should come from the cl_device, and
  * cl_program's options. */
@@ -121,13 +312,20 @@ void clearKernelPasses() {
   }
 
   kernelPasses.clear();
-}
 
-// Returns the TargetMachine instance or zero if no triple is provided.
-static TargetMachine *GetTargetMachine(cl_device_id device, Triple &triple) {
+  for (auto &I : kernelPreparePasses)
+    delete I.second;
+  kernelPreparePasses.clear();
 
-  if (targetMachines.find(device) != targetMachines.end())
-    return targetMachines[device];
+  for (auto &I : kernelFastPasses)
+    delete I.second;
+  kernelFastPasses.clear();
+}
+
+// Creates a new TargetMachine instance, or returns zero if no triple is
+// provided.
+static TargetMachine *CreateTargetMachine(cl_device_id device,
+                                          Triple &triple) {
 
   std::string Error;
   // Triple TheTriple(device->llvm_target_triplet);
@@ -158,19 +356,77 @@ static TargetMachine *GetTargetMachine(cl_device_id device, Triple &triple) {
   assert(TM != NULL && "llvm target has no targetMachine constructor");
   if (device->ops->init_target_machine)
     device->ops->init_target_machine(device->data, TM);
-  targetMachines[device] = TM;
 
   return TM;
 }
+
+// Returns the shared TargetMachine instance of the device, or zero if no
+// triple is provided. Must be called with the context lock held.
+static TargetMachine *GetTargetMachine(cl_device_id device, Triple &triple) {
+
+  if (targetMachines.find(device) != targetMachines.end())
+    return targetMachines[device];
+
+  TargetMachine *TM = CreateTargetMachine(device, triple);
+  if (TM)
+    targetMachines[device] = TM;
+  return TM;
+}
+
+/* State for running the LLVM backend without the context lock: each
+ * compiling thread gets its own LLVMContext and TargetMachines. */
+struct PoclCodegenWorker {
+  llvm::LLVMContext Context;
+  std::map<cl_device_id, llvm::TargetMachine *> TargetMachines;
+
+  llvm::TargetMachine *getTargetMachine(cl_device_id Device, Triple &T) {
+    auto I = TargetMachines.find(Device);
+    if (I != TargetMachines.end())
+      return I->second;
+    llvm::TargetMachine *TM = CreateTargetMachine(Device, T);
+    TargetMachines[Device] = TM;
+    return TM;
+  }
+
+  ~PoclCodegenWorker() {
+    for (auto &I : TargetMachines)
+      delete I.second;
+  }
+};
+
+static PoclCodegenWorker &getCodegenWorker() {
+  static thread_local PoclCodegenWorker Worker;
+  return Worker;
+}
+
+/* Returns true if the kernel compiler may run the backend for different
+ * kernels concurrently, see POCL_COMPILE_THREADS. */
+int pocl_llvm_parallel_codegen() {
+  static int Enabled = -1;
+  if (Enabled < 0)
+    Enabled = pocl_get_int_option("POCL_COMPILE_THREADS", 1) > 1;
+  return Enabled;
+}
 /* helpers copied from LLVM opt END */
 
-static PassManager &kernel_compiler_passes(cl_device_id device) {
+/* With Prepare, returns the passes that do not depend on the work-group
+   function specialization, which run once per kernel (see
+   getPreparedKernel()), otherwise the rest of the kernel compiler passes.
+   With Fast, the latter do a cheaper -O1 without the vectorizers at the
+   end, for the first tier of POCL_TIERED_COMPILATION. */
+static PassManager &kernel_compiler_passes(cl_device_id device,
+                                           bool Prepare = false,
+                                           bool Fast = false) {
 
   PassManager *Passes = nullptr;
+  PassManager *PreparePasses = nullptr;
+  PassManager *FastPasses = nullptr;
   PassRegistry *Registry = nullptr;
 
   if (kernelPasses.find(device) != kernelPasses.end()) {
-    return *kernelPasses[device];
+    if (Prepare)
+      return *kernelPreparePasses[device];
+    return Fast ? *kernelFastPasses[device] : *kernelPasses[device];
   }
 
   bool SPMDDevice = device->spmd;
@@ -178,16 +434,13 @@ static PassManager &kernel_compiler_passes(cl_device_id device) {
   Registry = PassRegistry::getPassRegistry();
 
   Passes = new PassManager();
+  PreparePasses = new PassManager();
+  FastPasses = new PassManager();
 
   // Need to setup the target info for target specific passes. */
   Triple triple(device->llvm_target_triplet);
   TargetMachine *Machine = GetTargetMachine(device, triple);
 
-  if (Machine)
-    Passes->add(
-        createTargetTransformInfoWrapperPass(Machine->getTargetIRAnalysis()));
-
-
   /* Disables automated generation of libcalls from code patterns.
      TCE doesn't have a runtime linker which could link the libs later on.
      Also the libcalls might be harmful for WG autovectorization where we
@@ -195,7 +448,13 @@ static PassManager &kernel_compiler_passes(cl_device_id device) {
      a memcpy */
   TargetLibraryInfoImpl TLII(triple);
   TLII.disableAllFunctions();
-  Passes->add(new TargetLibraryInfoWrapperPass(TLII));
+
+  for (PassManager *PM : {PreparePasses, Passes, FastPasses}) {
+    if (Machine)
+      PM->add(
+          createTargetTransformInfoWrapperPass(Machine->getTargetIRAnalysis()));
+    PM->add(new TargetLibraryInfoWrapperPass(TLII));
+  }
 
   /* The kernel compiler passes to run, in order.
 
@@ -223,7 +482,6 @@ static PassManager &kernel_compiler_passes(cl_device_id device) {
   passes.push_back("remove-optnone");
   passes.push_back("optimize-wi-func-calls");
   passes.push_back("handle-samplers");
-  passes.push_back("workitem-handler-chooser");
   passes.push_back("mem2reg");
   passes.push_back("domtree");
   passes.push_back("automatic-locals");
@@ -245,7 +503,24 @@ static PassManager &kernel_compiler_passes(cl_device_id device) {
   // is dead code lying around.
   passes.push_back("STANDARD_OPTS");
 
+  // None of the passes above depend on the local size or the other
+  // properties of the work-group function specialization, thus they are run
+  // only once per kernel and the result is reused by all its
+  // specializations. The passes below run per specialization.
+  passes.push_back("PREPARED");
+  passes.push_back("workitem-handler-chooser");
+
   if (!SPMDDevice) {
+    // Lower the work-group collectives to code accumulating in the
+    // work-item loops before the barriers they add are processed.
+    passes.push_back("workgroup-collectives");
+    // Drop the barriers that do not order any work-item memory accesses
+    // for the specialized local size, so kernels with only defensive
+    // barriers take the single parallel region path.
+    passes.push_back("remove-redundant-barriers");
+    // Move the kernels the chooser runs as work-item fibers to their fiber
+    // bodies, leaving the other passes only the call of the fiber runtime.
+    passes.push_back("workitemfibers");
     passes.push_back("simplifycfg");
     passes.push_back("loop-simplify");
     passes.push_back("uniformity");
@@ -261,6 +536,19 @@ static PassManager &kernel_compiler_passes(cl_device_id device) {
     passes.push_back("workitemrepl");
     //passes.push_back("print-module");
     passes.push_back("workitemloops");
+    passes.push_back("subcfgformation");
+    // The work-items of a work-group now run one after another, so their
+    // atomics to the local memory need no locking.
+    passes.push_back("workgroup-atomics");
+    passes.push_back("hoist-uniform");
+    passes.push_back("uniform-div");
+    passes.push_back("workitem-prefetch");
+    // Poll the preemption point of the driver thread in the loops, after
+    // the prefetches so that those see the loops as the WorkitemLoops made
+    // them.
+    passes.push_back("workitem-preemption");
+    if (currentWgMethod == "loopvec")
+      passes.push_back("workitem-vector-hints");
     // Remove the (pseudo) barriers.   They have no use anymore due to the
     // work-item loop control taking care of them.
     passes.push_back("remove-barriers");
@@ -300,49 +588,82 @@ static PassManager &kernel_compiler_passes(cl_device_id device) {
 
   passes.push_back("remove-barriers");
 
-  // Now actually add the listed passes to the PassManager.
+#ifdef POCL_COMPILE_REPORT
+  bool Report = compileReportEnabled();
+  // The statistics get collected only after enabling them.
+  if (Report)
+    EnableStatistics(false);
+#endif
+  // The pass managers the passes are currently added to.
+  std::vector<PassManager *> PMs = {PreparePasses};
+
+  // Records the step of the pipeline added last in the compile report.
+  unsigned ReportStep = 0;
+  auto addReportProbe = [&](PassManager *PM, const std::string &Pass) {
+#ifdef POCL_COMPILE_REPORT
+    if (Report)
+      PM->add(new CompileReportProbe(ReportStep, Pass));
+#endif
+  };
+
+  // Now actually add the listed passes to the PassManagers.
   for (unsigned i = 0; i < passes.size(); ++i) {
-    // This is (more or less) -O3.
-    if (passes[i] == "STANDARD_OPTS") {
-      PassManagerBuilder Builder;
-      Builder.OptLevel = 3;
-      Builder.SizeLevel = 0;
-
-      // These need to be setup in addition to invoking the passes
-      // to get the vectorizers initialized properly. Assume SPMD
-      // devices do not want to vectorize intra work-item at this
-      // stage.
-      if (currentWgMethod == "loopvec" && !SPMDDevice) {
-        Builder.LoopVectorize = true;
-        Builder.SLPVectorize = true;
-      } else {
-        Builder.LoopVectorize = false;
-        Builder.SLPVectorize = false;
-      }
-      Builder.VerifyInput = true;
-      Builder.VerifyOutput = true;
-      Builder.populateModulePassManager(*Passes);
-      continue;
-    }
-    if (passes[i] == "automatic-locals") {
-      Passes->add(pocl::createAutomaticLocalsPass(device->autolocals_to_args));
+    if (passes[i] == "PREPARED") {
+      PMs = {Passes, FastPasses};
       continue;
     }
+    for (PassManager *PM : PMs) {
+      // This is (more or less) -O3.
+      if (passes[i] == "STANDARD_OPTS") {
+        PassManagerBuilder Builder;
+        Builder.OptLevel = PM == FastPasses ? 1 : 3;
+        Builder.SizeLevel = 0;
+
+        // These need to be setup in addition to invoking the passes
+        // to get the vectorizers initialized properly. Assume SPMD
+        // devices do not want to vectorize intra work-item at this
+        // stage.
+        if ((currentWgMethod == "loopvec" || currentWgMethod == "cbs") &&
+            !SPMDDevice && PM != FastPasses) {
+          Builder.LoopVectorize = true;
+          Builder.SLPVectorize = true;
+        } else {
+          Builder.LoopVectorize = false;
+          Builder.SLPVectorize = false;
+        }
+        Builder.VerifyInput = true;
+        Builder.VerifyOutput = true;
+        Builder.populateModulePassManager(*PM);
+        addReportProbe(PM, PM == FastPasses ? "O1" : "O3");
+        continue;
+      }
+      if (passes[i] == "automatic-locals") {
+        PM->add(pocl::createAutomaticLocalsPass(device->autolocals_to_args));
+        addReportProbe(PM, passes[i]);
+        continue;
+      }
 
-    const PassInfo *PIs = Registry->getPassInfo(StringRef(passes[i]));
-    if (PIs) {
-      // std::cout << "-"<<passes[i] << " ";
-      Pass *thispass = PIs->createPass();
-      Passes->add(thispass);
-    } else {
-      std::cerr << "Failed to create kernel compiler pass " << passes[i]
-                << std::endl;
-      POCL_ABORT("FAIL\n");
+      const PassInfo *PIs = Registry->getPassInfo(StringRef(passes[i]));
+      if (PIs) {
+        // std::cout << "-"<<passes[i] << " ";
+        Pass *thispass = PIs->createPass();
+        PM->add(thispass);
+        addReportProbe(PM, passes[i]);
+      } else {
+        std::cerr << "Failed to create kernel compiler pass " << passes[i]
+                  << std::endl;
+        POCL_ABORT("FAIL\n");
+      }
     }
+    ++ReportStep;
   }
 
   kernelPasses[device] = Passes;
-  return *Passes;
+  kernelPreparePasses[device] = PreparePasses;
+  kernelFastPasses[device] = FastPasses;
+  if (Prepare)
+    return *PreparePasses;
+  return Fast ? *FastPasses : *Passes;
 }
 
 void pocl_destroy_llvm_module(void *modp, cl_context ctx) {
@@ -362,6 +683,233 @@ void pocl_destroy_llvm_module(void *modp, cl_context ctx) {
 namespace pocl {
 }
 
+/* Declares the native width vector overloads of the math builtins the
+ * kernel calls, so linking with the kernel library pulls them in for the
+ * workitem-vector-hints pass. */
+static void declareVectorBuiltinVariants(llvm::Module *ParallelBC,
+                                         cl_device_id Device,
+                                         PoclLLVMContextData *llvm_ctx,
+                                         std::vector<llvm::Function *> &Added) {
+  llvm::Module *LibModule = getKernelLibrary(Device, llvm_ctx);
+  std::vector<llvm::Function *> Builtins;
+  for (llvm::Function &F : *ParallelBC)
+    Builtins.push_back(&F);
+
+  for (llvm::Function *F : Builtins) {
+    unsigned Width = pocl::isDoubleBuiltin(*F)
+                         ? Device->native_vector_width_double
+                         : Device->native_vector_width_float;
+    std::string VecName = pocl::getVectorBuiltinName(*F, Width);
+    if (VecName.empty() || ParallelBC->getFunction(VecName) != nullptr)
+      continue;
+    llvm::Function *LibFunc = LibModule->getFunction(VecName);
+    if (LibFunc == nullptr || LibFunc->isDeclaration())
+      continue;
+    Added.push_back(llvm::Function::Create(
+        pocl::getVectorBuiltinType(*F, Width),
+        llvm::Function::ExternalLinkage, VecName, ParallelBC));
+  }
+}
+
+/* Returns the kernel copied from the program.bc of the device and run
+   through the kernel compiler passes that do not depend on the work-group
+   function specialization. The result is kept until the program.bc is
+   freed, so the specializations of the kernel only run the rest of the
+   passes on a copy of it. Cached is set if the kernel was prepared
+   earlier. Returns nullptr if linking the kernel library fails. */
+static llvm::Module *getPreparedKernel(unsigned DeviceI, cl_device_id Device,
+                                       cl_kernel Kernel,
+                                       PoclLLVMContextData *llvm_ctx,
+                                       bool &Cached) {
+  cl_program Program = Kernel->program;
+  llvm::Module *ProgramBC = (llvm::Module *)Program->data[DeviceI];
+
+  auto Key = std::make_pair((const llvm::Module *)ProgramBC,
+                            std::string(Kernel->name));
+  auto Found = llvm_ctx->preparedKernels->find(Key);
+  Cached = Found != llvm_ctx->preparedKernels->end();
+  if (Cached)
+    return Found->second;
+
+  // Create an empty Module and copy only the kernel+callgraph from
+  // program.bc.
+  llvm::Module *PreparedBC =
+      new llvm::Module(StringRef("parallel_bc"), *llvm_ctx->Context);
+
+  PreparedBC->setTargetTriple(ProgramBC->getTargetTriple());
+  PreparedBC->setDataLayout(ProgramBC->getDataLayout());
+
+  copyKernelFromBitcode(Kernel->name, PreparedBC, ProgramBC,
+                        Device->global_as_id, Device->device_aux_functions);
+
+  bool LibUnlinked = false;
+  getModuleBoolMetadata(*ProgramBC, POCL_KERNEL_LIB_UNLINKED_MD, LibUnlinked);
+
+  std::vector<llvm::Function *> VectorVariants;
+  if (currentWgMethod == "loopvec" && !Device->spmd)
+    declareVectorBuiltinVariants(PreparedBC, Device, llvm_ctx,
+                                 VectorVariants);
+
+  if (LibUnlinked || !VectorVariants.empty()) {
+    // The program was built with POCL_LAZY_BUILD, or the kernel needs the
+    // vector variants of builtins: link only the callgraph of this kernel
+    // with the kernel library.
+    llvm::Module *LibModule = getKernelLibrary(Device, llvm_ctx);
+    std::string Log;
+    if (link(PreparedBC, LibModule, Log, Device->global_as_id,
+             Device->device_aux_functions, programUsesRelaxedMath(Program),
+             &(*llvm_ctx->libraryCallGraphs)[LibModule])) {
+      POCL_MSG_ERR("Linking kernel %s with the kernel library failed:\n%s",
+                   Kernel->name, Log.c_str());
+      delete PreparedBC;
+      return nullptr;
+    }
+  }
+
+  if (Device->device_aux_functions) {
+    std::string concat;
+    const char **tmp = Device->device_aux_functions;
+    while (*tmp != nullptr) {
+      concat.append(*tmp);
+      ++tmp;
+      if (*tmp)
+        concat.append(";");
+    }
+    setModuleStringMetadata(PreparedBC, "device_aux_functions",
+                            concat.c_str());
+  }
+
+  setModuleIntMetadata(PreparedBC, "device_address_bits",
+                       Device->address_bits);
+  setModuleBoolMetadata(PreparedBC, "device_arg_buffer_launcher",
+                        Device->arg_buffer_launcher);
+  setModuleBoolMetadata(PreparedBC, "device_grid_launcher",
+                        Device->grid_launcher);
+  setModuleBoolMetadata(PreparedBC, "device_is_spmd", Device->spmd);
+
+  setModuleStringMetadata(PreparedBC, "KernelName", Kernel->name);
+
+  setModuleIntMetadata(PreparedBC, "device_global_as_id",
+                       Device->global_as_id);
+  setModuleIntMetadata(PreparedBC, "device_local_as_id", Device->local_as_id);
+  setModuleIntMetadata(PreparedBC, "device_constant_as_id",
+                       Device->constant_as_id);
+  setModuleIntMetadata(PreparedBC, "device_args_as_id", Device->args_as_id);
+  setModuleIntMetadata(PreparedBC, "device_context_as_id",
+                       Device->context_as_id);
+
+  setModuleIntMetadata(PreparedBC, "device_native_vector_width_float",
+                       Device->native_vector_width_float);
+  setModuleIntMetadata(PreparedBC, "device_native_vector_width_double",
+                       Device->native_vector_width_double);
+  setModuleIntMetadata(PreparedBC, "device_sub_group_size",
+                       Device->max_sub_group_size);
+
+  setModuleBoolMetadata(PreparedBC, "device_side_printf",
+                        Device->device_side_printf);
+  setModuleBoolMetadata(PreparedBC, "device_binary_printf",
+                        Device->binary_printf);
+  setModuleBoolMetadata(PreparedBC, "device_alloca_locals",
+                        Device->device_alloca_locals);
+  setModuleBoolMetadata(PreparedBC, "device_preemption_points",
+                        Device->preemption_points);
+
+  setModuleIntMetadata(PreparedBC, "device_max_witem_dim",
+                       Device->max_work_item_dimensions);
+  setModuleIntMetadata(PreparedBC, "device_max_witem_sizes_0",
+                       Device->max_work_item_sizes[0]);
+  setModuleIntMetadata(PreparedBC, "device_max_witem_sizes_1",
+                       Device->max_work_item_sizes[1]);
+  setModuleIntMetadata(PreparedBC, "device_max_witem_sizes_2",
+                       Device->max_work_item_sizes[2]);
+
+  for (unsigned Level = 1; Level <= 3; ++Level) {
+    if (Device->cpu_cache_size[Level - 1] == 0)
+      continue;
+    std::string Suffix = "_l" + std::to_string(Level);
+    setModuleIntMetadata(PreparedBC, ("device_cache_size" + Suffix).c_str(),
+                         Device->cpu_cache_size[Level - 1]);
+    setModuleIntMetadata(PreparedBC,
+                         ("device_cache_line_size" + Suffix).c_str(),
+                         Device->cpu_cache_line_size[Level - 1]);
+    setModuleIntMetadata(PreparedBC,
+                         ("device_cache_sharing" + Suffix).c_str(),
+                         Device->cpu_cache_sharing[Level - 1]);
+  }
+
+#ifdef POCL_COMPILE_REPORT
+  if (compileReportEnabled())
+    startCompileReport(*PreparedBC);
+#endif
+  POCL_MEASURE_START(llvm_kernel_prepare);
+  kernel_compiler_passes(Device, true).run(*PreparedBC);
+  POCL_MEASURE_FINISH(llvm_kernel_prepare);
+
+  (*llvm_ctx->preparedKernels)[Key] = PreparedBC;
+  return PreparedBC;
+}
+
+// Replaces the uses of the scalar kernel arguments in RunCommand->spec_args
+// with their values, so that the WG function is generated, and its loops
+// unrolled and vectorized, for them.
+static void foldSpecializedArgs(llvm::Module *M, cl_kernel Kernel,
+                                _cl_command_run *RunCommand) {
+  llvm::Function *F = M->getFunction(Kernel->name);
+  if (F == nullptr)
+    return;
+
+  unsigned N = 0;
+  for (unsigned I = 0; I < Kernel->meta->num_args && I < 64; ++I) {
+    if (!(RunCommand->spec_args & ((uint64_t)1 << I)))
+      continue;
+    if (N == POCL_MAX_SPEC_ARGS)
+      break;
+    uint64_t Raw = RunCommand->spec_arg_values[N++];
+    if (I >= F->arg_size())
+      continue;
+    llvm::Argument *Arg = F->getArg(I);
+    llvm::Type *T = Arg->getType();
+    unsigned Bits = T->getPrimitiveSizeInBits().getFixedValue();
+    uint64_t Value;
+    // The values are the raw bytes of the argument.
+    switch (Bits) {
+    case 8: {
+      uint8_t V;
+      memcpy(&V, &Raw, sizeof(V));
+      Value = V;
+      break;
+    }
+    case 16: {
+      uint16_t V;
+      memcpy(&V, &Raw, sizeof(V));
+      Value = V;
+      break;
+    }
+    case 32: {
+      uint32_t V;
+      memcpy(&V, &Raw, sizeof(V));
+      Value = V;
+      break;
+    }
+    case 64:
+      Value = Raw;
+      break;
+    default:
+      continue;
+    }
+
+    llvm::Constant *C = nullptr;
+    if (T->isIntegerTy())
+      C = llvm::ConstantInt::get(T, Value);
+    else if (T->isHalfTy() || T->isFloatTy() || T->isDoubleTy())
+      C = llvm::ConstantFP::get(
+          T->getContext(),
+          llvm::APFloat(T->getFltSemantics(), llvm::APInt(Bits, Value)));
+    if (C != nullptr)
+      Arg->replaceAllUsesWith(C);
+  }
+}
+
 int pocl_llvm_generate_workgroup_function_nowrite(
     unsigned DeviceI, cl_device_id Device, cl_kernel Kernel,
     _cl_command_node *Command, void **Output, int Specialize) {
@@ -379,18 +927,17 @@ int pocl_llvm_generate_workgroup_function_nowrite(
 #endif
   assert(Program->data[DeviceI] != nullptr);
 
-  llvm::Module *ProgramBC = (llvm::Module *)Program->data[DeviceI];
-
-  // Create an empty Module and copy only the kernel+callgraph from
-  // program.bc.
-  llvm::Module *ParallelBC =
-      new llvm::Module(StringRef("parallel_bc"), *llvm_ctx->Context);
+  bool PreparedCached = false;
+  llvm::Module *PreparedBC =
+      getPreparedKernel(DeviceI, Device, Kernel, llvm_ctx, PreparedCached);
+  if (PreparedBC == nullptr)
+    return CL_BUILD_PROGRAM_FAILURE;
 
-  ParallelBC->setTargetTriple(ProgramBC->getTargetTriple());
-  ParallelBC->setDataLayout(ProgramBC->getDataLayout());
-
-  copyKernelFromBitcode(Kernel->name, ParallelBC, ProgramBC,
-                        Device->global_as_id, Device->device_aux_functions);
+  llvm::Module *ParallelBC = CloneModule(*PreparedBC).release();
+#ifdef POCL_COMPILE_REPORT
+  if (PreparedCached && compileReportEnabled())
+    startCompileReport(*ParallelBC);
+#endif
 
   // Set to true to generate a global offset 0 specialized WG function.
   bool WGAssumeZeroGlobalOffset;
@@ -430,26 +977,6 @@ int pocl_llvm_generate_workgroup_function_nowrite(
     WGMaxGridDimWidth = 0;
   }
 
-  if (Device->device_aux_functions) {
-    std::string concat;
-    const char **tmp = Device->device_aux_functions;
-    while (*tmp != nullptr) {
-      concat.append(*tmp);
-      ++tmp;
-      if (*tmp)
-        concat.append(";");
-    }
-    setModuleStringMetadata(ParallelBC, "device_aux_functions", concat.c_str());
-  }
-
-  setModuleIntMetadata(ParallelBC, "device_address_bits", Device->address_bits);
-  setModuleBoolMetadata(ParallelBC, "device_arg_buffer_launcher",
-                        Device->arg_buffer_launcher);
-  setModuleBoolMetadata(ParallelBC, "device_grid_launcher",
-                        Device->grid_launcher);
-  setModuleBoolMetadata(ParallelBC, "device_is_spmd", Device->spmd);
-
-  setModuleStringMetadata(ParallelBC, "KernelName", Kernel->name);
   setModuleIntMetadata(ParallelBC, "WGMaxGridDimWidth", WGMaxGridDimWidth);
   setModuleIntMetadata(ParallelBC, "WGLocalSizeX", WGLocalSizeX);
   setModuleIntMetadata(ParallelBC, "WGLocalSizeY", WGLocalSizeY);
@@ -457,39 +984,53 @@ int pocl_llvm_generate_workgroup_function_nowrite(
   setModuleBoolMetadata(ParallelBC, "WGDynamicLocalSize", WGDynamicLocalSize);
   setModuleBoolMetadata(ParallelBC, "WGAssumeZeroGlobalOffset",
                         WGAssumeZeroGlobalOffset);
-
-  setModuleIntMetadata(ParallelBC, "device_global_as_id", Device->global_as_id);
-  setModuleIntMetadata(ParallelBC, "device_local_as_id", Device->local_as_id);
-  setModuleIntMetadata(ParallelBC, "device_constant_as_id",
-                       Device->constant_as_id);
-  setModuleIntMetadata(ParallelBC, "device_args_as_id", Device->args_as_id);
-  setModuleIntMetadata(ParallelBC, "device_context_as_id",
-                       Device->context_as_id);
-
-  setModuleBoolMetadata(ParallelBC, "device_side_printf",
-                        Device->device_side_printf);
-  setModuleBoolMetadata(ParallelBC, "device_alloca_locals",
-                        Device->device_alloca_locals);
-
-  setModuleIntMetadata(ParallelBC, "device_max_witem_dim",
-                       Device->max_work_item_dimensions);
-  setModuleIntMetadata(ParallelBC, "device_max_witem_sizes_0",
-                       Device->max_work_item_sizes[0]);
-  setModuleIntMetadata(ParallelBC, "device_max_witem_sizes_1",
-                       Device->max_work_item_sizes[1]);
-  setModuleIntMetadata(ParallelBC, "device_max_witem_sizes_2",
-                       Device->max_work_item_sizes[2]);
+  if (Specialize && RunCommand->spec_args)
+    foldSpecializedArgs(ParallelBC, Kernel, RunCommand);
 
 #ifdef DUMP_LLVM_PASS_TIMINGS
   llvm::TimePassesIsEnabled = true;
 #endif
   POCL_MEASURE_START(llvm_workgroup_ir_func_gen);
-  kernel_compiler_passes(Device).run(*ParallelBC);
+  kernel_compiler_passes(Device, false, RunCommand->fast_wg_func)
+      .run(*ParallelBC);
   POCL_MEASURE_FINISH(llvm_workgroup_ir_func_gen);
+
+  // The work-group functions of the fiber method call the fiber runtime,
+  // which the kernel linked earlier did not.
+  llvm::Function *FibersRun = ParallelBC->getFunction("__pocl_fibers_run");
+  if (FibersRun != nullptr && FibersRun->isDeclaration()) {
+    // __pocl_fibers_run takes the address of __pocl_fiber_start, so that
+    // is copied first.
+    static const char *FiberFunctions[] = {"__pocl_fiber_start",
+                                           "__pocl_fiber_barrier",
+                                           "__pocl_fibers_run", nullptr};
+    llvm::Module *LibModule = getKernelLibrary(Device, llvm_ctx);
+    if (linkFunctions(ParallelBC, LibModule, FiberFunctions,
+                      Device->global_as_id,
+                      &(*llvm_ctx->libraryCallGraphs)[LibModule])) {
+      POCL_MSG_ERR("The kernel library lacks the fiber runtime\n");
+      delete ParallelBC;
+      return CL_BUILD_PROGRAM_FAILURE;
+    }
+  }
 #ifdef DUMP_LLVM_PASS_TIMINGS
   llvm::reportAndResetTimings();
 #endif
 
+#ifdef POCL_COMPILE_REPORT
+  if (compileReportEnabled()) {
+    char ReportPath[POCL_FILENAME_LENGTH];
+    pocl_cache_kernel_cachedir_path(ReportPath, Program, DeviceI, Kernel, "",
+                                    Command, Specialize);
+    if (pocl_mkdir_p(ReportPath) == 0) {
+      strncat(ReportPath, POCL_COMPILE_REPORT_FILENAME,
+              POCL_FILENAME_LENGTH - strlen(ReportPath) - 1);
+      writeCompileReport(ReportPath, Device, Kernel, *ParallelBC,
+                         PreparedCached);
+    }
+  }
+#endif
+
   // Print loop vectorizer remarks if enabled.
   if (pocl_get_bool_option("POCL_VECTORIZER_REMARKS", 0) == 1) {
     std::cout << getDiagString(ctx);
@@ -571,13 +1112,22 @@ void pocl_llvm_free_llvm_irs(cl_program program, unsigned device_i) {
   PoclCompilerMutexGuard lockHolder(&llvm_ctx->Lock);
   if (program->data[device_i]) {
     llvm::Module *mod = (llvm::Module *)program->data[device_i];
+    preparedKernelMapTy &Prepared = *llvm_ctx->preparedKernels;
+    for (auto I = Prepared.begin(); I != Prepared.end();) {
+      if (I->first.first == mod) {
+        delete I->second;
+        I = Prepared.erase(I);
+      } else
+        ++I;
+    }
     delete mod;
     --llvm_ctx->number_of_IRs;
     program->data[device_i] = nullptr;
   }
 }
 
-/* writes fresh program.bc and program->binaries[i] from LLVM IR module. */
+/* writes fresh program->binaries[i], and program.bc if the kernel cache is
+ * enabled, from LLVM IR module. */
 int pocl_llvm_update_binaries(cl_program program, cl_uint device_i) {
 
   cl_context ctx = program->context;
@@ -599,13 +1149,15 @@ int pocl_llvm_update_binaries(cl_program program, cl_uint device_i) {
 
   POCL_MEM_FREE(program->binaries[i]);
 
-  pocl_cache_program_bc_path(program_bc_path, program, i);
-  error =
-      pocl_write_module((llvm::Module *)program->data[i], program_bc_path, 1);
-  assert(error == 0);
-  if (error) {
-    POCL_MSG_ERR("pocl_write_module(%s) failed!\n", program_bc_path);
-    return error;
+  if (pocl_cache_enabled()) {
+    pocl_cache_program_bc_path(program_bc_path, program, i);
+    error = pocl_write_module((llvm::Module *)program->data[i],
+                              program_bc_path, 1);
+    assert(error == 0);
+    if (error) {
+      POCL_MSG_ERR("pocl_write_module(%s) failed!\n", program_bc_path);
+      return error;
+    }
   }
 
   std::string content;
@@ -634,6 +1186,22 @@ static void initPassManagerForCodeGen(PassManager& PM, cl_device_id Device) {
   PM.add(TLIPass);
 }
 
+static int emitObject(cl_device_id Device, llvm::TargetMachine *Target,
+                      llvm::Module *Input, char **Output,
+                      uint64_t *OutputSize);
+
+/* Feeds the bitcode of the work-group function module modp to the hash. */
+void pocl_llvm_hash_module(cl_context ctx, void *Modp,
+                           pocl_hash_ctx *HashCtx) {
+  PoclLLVMContextData *llvm_ctx = (PoclLLVMContextData *)ctx->llvm_context_data;
+  std::string Bitcode;
+  {
+    PoclCompilerMutexGuard lockHolder(&llvm_ctx->Lock);
+    writeModuleIRtoString((llvm::Module *)Modp, Bitcode);
+  }
+  pocl_hash_update(HashCtx, (const uint8_t *)Bitcode.data(), Bitcode.size());
+}
+
 /* Run LLVM codegen on input file (parallel-optimized).
  * modp = llvm::Module* of parallel.bc
  * Output native object file (<kernel>.so.o). */
@@ -642,18 +1210,44 @@ int pocl_llvm_codegen(cl_device_id Device, cl_program program, void *Modp,
 
   cl_context ctx = program->context;
   PoclLLVMContextData *llvm_ctx = (PoclLLVMContextData *)ctx->llvm_context_data;
-  PoclCompilerMutexGuard lockHolder(&llvm_ctx->Lock);
 
   llvm::Module *Input = (llvm::Module *)Modp;
   assert(Input);
   *Output = nullptr;
 
+  llvm::Triple Triple(Device->llvm_target_triplet);
+
+  if (pocl_llvm_parallel_codegen()) {
+    // Only the serialization touches the shared context, the backend runs
+    // on a private copy of the module.
+    std::string Bitcode;
+    {
+      PoclCompilerMutexGuard lockHolder(&llvm_ctx->Lock);
+      writeModuleIRtoString(Input, Bitcode);
+    }
+    PoclCodegenWorker &Worker = getCodegenWorker();
+    std::unique_ptr<llvm::Module> Private(
+        parseModuleIRMem(Bitcode.data(), Bitcode.size(), &Worker.Context));
+    if (!Private) {
+      POCL_MSG_ERR("Could not parse the work-group function module\n");
+      return -1;
+    }
+    return emitObject(Device, Worker.getTargetMachine(Device, Triple),
+                      Private.get(), Output, OutputSize);
+  }
+
+  PoclCompilerMutexGuard lockHolder(&llvm_ctx->Lock);
+  return emitObject(Device, GetTargetMachine(Device, Triple), Input, Output,
+                    OutputSize);
+}
+
+static int emitObject(cl_device_id Device, llvm::TargetMachine *Target,
+                      llvm::Module *Input, char **Output,
+                      uint64_t *OutputSize) {
+
   PassManager PMObj;
   initPassManagerForCodeGen(PMObj, Device);
 
-  llvm::Triple Triple(Device->llvm_target_triplet);
-  llvm::TargetMachine *Target = GetTargetMachine(Device, Triple);
-
   // First try direct object code generation from LLVM, if supported by the
   // LLVM backend for the target.
   bool LLVMGeneratesObjectFiles = true;
@@ -742,4 +1336,150 @@ int pocl_llvm_codegen(cl_device_id Device, cl_program program, void *Modp,
   return Res;
 
 }
+#ifndef LLVM_OLDER_THAN_11_0
+namespace {
+// Appends the functions of the objects loaded to the JIT to the perf map.
+class PerfMapListener : public llvm::JITEventListener {
+public:
+  void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &L)
+      override {
+    // The debug object has the load addresses of the sections applied.
+    llvm::object::OwningBinary<llvm::object::ObjectFile> DebugObj =
+        L.getObjectForDebug(Obj);
+    if (DebugObj.getBinary() == nullptr)
+      return;
+    for (const auto &P :
+         llvm::object::computeSymbolSizes(*DebugObj.getBinary())) {
+      llvm::object::SymbolRef Sym = P.first;
+      llvm::Expected<llvm::object::SymbolRef::Type> Type = Sym.getType();
+      if (!Type) {
+        llvm::consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != llvm::object::SymbolRef::ST_Function)
+        continue;
+      llvm::Expected<llvm::StringRef> Name = Sym.getName();
+      if (!Name) {
+        llvm::consumeError(Name.takeError());
+        continue;
+      }
+      llvm::Expected<uint64_t> Addr = Sym.getAddress();
+      if (!Addr) {
+        llvm::consumeError(Addr.takeError());
+        continue;
+      }
+      pocl_perf_map_add(*Addr, P.second, Name->str().c_str());
+    }
+  }
+};
+} // namespace
+
+// The listeners selected with POCL_PROFILER_SYMBOLS, shared by all the JIT
+// instances. The jitdump and VTune ones are null unless LLVM was built with
+// LLVM_USE_PERF and LLVM_USE_INTEL_JITEVENTS.
+static std::vector<llvm::JITEventListener *> &getJITEventListeners() {
+  static std::vector<llvm::JITEventListener *> Listeners = []() {
+    std::vector<llvm::JITEventListener *> L;
+    if (pocl_profiler_symbols & POCL_PROFILER_SYMBOLS_PERFMAP)
+      L.push_back(new PerfMapListener());
+    if (pocl_profiler_symbols & POCL_PROFILER_SYMBOLS_JITDUMP) {
+      llvm::JITEventListener *Perf =
+          llvm::JITEventListener::createPerfJITEventListener();
+      if (Perf)
+        L.push_back(Perf);
+      else
+        POCL_MSG_WARN("POCL_PROFILER_SYMBOLS: LLVM was built without "
+                      "the perf jitdump support\n");
+    }
+    if (pocl_profiler_symbols & POCL_PROFILER_SYMBOLS_VTUNE) {
+      llvm::JITEventListener *VTune =
+          llvm::JITEventListener::createIntelJITEventListener();
+      if (VTune)
+        L.push_back(VTune);
+      else
+        POCL_MSG_WARN("POCL_PROFILER_SYMBOLS: LLVM was built without "
+                      "the VTune JIT API support\n");
+    }
+    return L;
+  }();
+  return Listeners;
+}
+#endif
+
+void *pocl_llvm_jit_load(const char *Object, uint64_t Size,
+                         const char *Symbol, void **Handle) {
+  *Handle = nullptr;
+#ifdef LLVM_OLDER_THAN_11_0
+  return nullptr;
+#else
+  llvm::orc::LLJITBuilder Builder;
+  std::vector<llvm::JITEventListener *> &Listeners = getJITEventListeners();
+  if (!Listeners.empty())
+    Builder.setObjectLinkingLayerCreator(
+        [&Listeners](llvm::orc::ExecutionSession &ES, const llvm::Triple &TT)
+            -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+          auto Layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+              ES, []() { return std::make_unique<llvm::SectionMemoryManager>(); });
+          for (llvm::JITEventListener *L : Listeners)
+            Layer->registerJITEventListener(*L);
+          return std::unique_ptr<llvm::orc::ObjectLayer>(std::move(Layer));
+        });
+  auto JIT = Builder.create();
+  if (!JIT) {
+    POCL_MSG_PRINT_LLVM("Creating the JIT failed: %s\n",
+                        toString(JIT.takeError()).c_str());
+    return nullptr;
+  }
+  std::unique_ptr<llvm::orc::LLJIT> J = std::move(*JIT);
+
+  // Resolve the references to libc/libm etc. from the current process, as
+  // the dynamic linker would.
+  auto Gen = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      J->getDataLayout().getGlobalPrefix());
+  if (!Gen) {
+    POCL_MSG_PRINT_LLVM("JIT symbol generator failed: %s\n",
+                        toString(Gen.takeError()).c_str());
+    return nullptr;
+  }
+  J->getMainJITDylib().addGenerator(std::move(*Gen));
+
+  if (llvm::Error E = J->addObjectFile(llvm::MemoryBuffer::getMemBufferCopy(
+          StringRef(Object, Size), Symbol))) {
+    POCL_MSG_PRINT_LLVM("Adding the object to the JIT failed: %s\n",
+                        toString(std::move(E)).c_str());
+    return nullptr;
+  }
+
+  auto Sym = J->lookup(Symbol);
+  if (!Sym) {
+    POCL_MSG_PRINT_LLVM("JIT lookup of %s failed: %s\n", Symbol,
+                        toString(Sym.takeError()).c_str());
+    return nullptr;
+  }
+
+  *Handle = J.release();
+  return (void *)Sym->getAddress();
+#endif
+}
+
+void *pocl_llvm_jit_lookup(void *Handle, const char *Symbol) {
+#ifdef LLVM_OLDER_THAN_11_0
+  return nullptr;
+#else
+  auto Sym = ((llvm::orc::LLJIT *)Handle)->lookup(Symbol);
+  if (!Sym) {
+    llvm::consumeError(Sym.takeError());
+    return nullptr;
+  }
+  return (void *)Sym->getAddress();
+#endif
+}
+
+void pocl_llvm_jit_unload(void *Handle) {
+#ifndef LLVM_OLDER_THAN_11_0
+  delete (llvm::orc::LLJIT *)Handle;
+#endif
+}
+
 /* vim: set ts=4 expandtab: */
@@ -23,6 +23,7 @@
 
 #include "pocl_mem_management.h"
 #include "pocl.h"
+#include "pocl_util.h"
 #include "utlist.h"
 #include <string.h>
 
@@ -38,20 +39,164 @@ cl_event pocl_mem_manager_new_event ()
 
 #else
 
-typedef struct _mem_manager
+#include <pthread.h>
+#include <stddef.h>
+
+/* Freed objects are kept in a small per-thread cache in front of a global
+ * lock-free stack, so that allocation and freeing on the enqueue hot path
+ * touch no shared state most of the time. Objects move between the two in
+ * batches. Objects are only ever pushed to the global stack (a chain at a
+ * time) and it is emptied wholesale with an atomic exchange, so it does
+ * not suffer from the ABA problem and needs no tagged pointers. */
+
+/* A thread's cache flushes POCL_MM_BATCH objects to the global stack once
+ * it holds 2 * POCL_MM_BATCH of them. */
+#define POCL_MM_BATCH 32
+
+typedef struct _mem_freelist
+{
+  void *volatile head;
+  /* offset of the "next" pointer used for linking the objects */
+  size_t link_offset;
+} pocl_mem_freelist;
+
+typedef struct _mem_cache
+{
+  void *head;
+  unsigned count;
+} pocl_mem_cache;
+
+enum
 {
-  pocl_lock_t event_lock;
-  pocl_lock_t cmd_lock;
-  pocl_lock_t event_node_lock;
+  MM_EVENT = 0,
+  MM_COMMAND,
+  MM_EVENT_NODE,
+  MM_NUM_TYPES
+};
 
-  cl_event event_list;
-  _cl_command_node *volatile cmd_list;
-  event_node *event_node_list;
+typedef struct _mem_thread_cache
+{
+  pocl_mem_cache caches[MM_NUM_TYPES];
+} pocl_mem_thread_cache;
+
+typedef struct _mem_manager
+{
+  pocl_mem_freelist lists[MM_NUM_TYPES];
+  pthread_key_t cache_key;
 } pocl_mem_manager;
 
+#define MM_LINK(list, obj)                                                    \
+  (*(void **)((char *)(obj) + (list)->link_offset))
 
 static pocl_mem_manager *mm = NULL;
 
+/* Pushes the chain first..last to the global stack. */
+static void
+push_chain (pocl_mem_freelist *list, void *first, void *last)
+{
+  void *old;
+  do
+    {
+      old = list->head;
+      MM_LINK (list, last) = old;
+    }
+  while (POCL_ATOMIC_CAS (&list->head, old, first) != old);
+}
+
+static void
+flush_cache (pocl_mem_freelist *list, pocl_mem_cache *cache, unsigned count)
+{
+  void *first = cache->head;
+  void *last = first;
+  unsigned i;
+
+  if (first == NULL)
+    return;
+  for (i = 1; i < count && MM_LINK (list, last) != NULL; ++i)
+    last = MM_LINK (list, last);
+
+  cache->head = MM_LINK (list, last);
+  cache->count -= i;
+  push_chain (list, first, last);
+}
+
+/* Called at thread exit, returns the cached objects to the global stacks
+ * so that they can be reused by other threads. */
+static void
+thread_cache_destructor (void *ptr)
+{
+  pocl_mem_thread_cache *tc = (pocl_mem_thread_cache *)ptr;
+  unsigned i;
+  for (i = 0; i < MM_NUM_TYPES; ++i)
+    flush_cache (&mm->lists[i], &tc->caches[i], tc->caches[i].count);
+  free (tc);
+}
+
+static pocl_mem_cache *
+get_cache (unsigned type)
+{
+  pocl_mem_thread_cache *tc
+      = (pocl_mem_thread_cache *)pthread_getspecific (mm->cache_key);
+  if (tc == NULL)
+    {
+      tc = (pocl_mem_thread_cache *)calloc (1, sizeof (pocl_mem_thread_cache));
+      if (tc == NULL || pthread_setspecific (mm->cache_key, tc) != 0)
+        {
+          free (tc);
+          return NULL;
+        }
+    }
+  return &tc->caches[type];
+}
+
+/* Returns a recycled object of the given type, or NULL if none is free. */
+static void *
+pop_object (unsigned type)
+{
+  pocl_mem_freelist *list = &mm->lists[type];
+  pocl_mem_cache *cache = get_cache (type);
+  void *obj;
+
+  if (cache == NULL)
+    return NULL;
+
+  if (cache->head == NULL)
+    {
+      /* Refill: take everything from the global stack. */
+      if (list->head == NULL)
+        return NULL;
+      cache->head = __sync_lock_test_and_set (&list->head, NULL);
+      cache->count = 0;
+      for (obj = cache->head; obj != NULL; obj = MM_LINK (list, obj))
+        ++cache->count;
+      if (cache->head == NULL)
+        return NULL;
+    }
+
+  obj = cache->head;
+  cache->head = MM_LINK (list, obj);
+  --cache->count;
+  return obj;
+}
+
+static void
+push_object (unsigned type, void *obj)
+{
+  pocl_mem_freelist *list = &mm->lists[type];
+  pocl_mem_cache *cache = get_cache (type);
+
+  if (cache == NULL)
+    {
+      push_chain (list, obj, obj);
+      return;
+    }
+
+  MM_LINK (list, obj) = cache->head;
+  cache->head = obj;
+  if (++cache->count >= 2 * POCL_MM_BATCH)
+    flush_cache (list, cache, POCL_MM_BATCH);
+}
+
 void pocl_init_mem_manager (void)
 {
   static unsigned int init_done = 0;
@@ -66,25 +211,22 @@ void pocl_init_mem_manager (void)
   if (!mm)
     {
       mm = (pocl_mem_manager*) calloc (1, sizeof (pocl_mem_manager));
-      POCL_INIT_LOCK (mm->event_lock);
-      POCL_INIT_LOCK (mm->cmd_lock);
-      POCL_INIT_LOCK (mm->event_node_lock);
+      mm->lists[MM_EVENT].link_offset = offsetof (struct _cl_event, next);
+      mm->lists[MM_COMMAND].link_offset = offsetof (_cl_command_node, next);
+      mm->lists[MM_EVENT_NODE].link_offset = offsetof (event_node, next);
+      pthread_key_create (&mm->cache_key, thread_cache_destructor);
     }
   POCL_UNLOCK(pocl_init_lock);
 }
 
 cl_event pocl_mem_manager_new_event ()
 {
-  cl_event ev = NULL;
-  POCL_LOCK (mm->event_lock);
-  if ((ev = mm->event_list))
+  cl_event ev = (cl_event)pop_object (MM_EVENT);
+  if (ev)
     {
-      LL_DELETE (mm->event_list, ev);
-      POCL_UNLOCK (mm->event_lock);
       POCL_INIT_OBJECT (ev); /* reinit the pocl_lock mutex */
       return ev;
     }
-  POCL_UNLOCK (mm->event_lock);
 
   ev = (struct _cl_event*) calloc (1, sizeof (struct _cl_event));
   POCL_INIT_OBJECT(ev);
@@ -94,19 +236,12 @@ cl_event pocl_mem_manager_new_event ()
 void pocl_mem_manager_free_event (cl_event event)
 {
   assert (event->status <= CL_COMPLETE);
-  POCL_LOCK (mm->event_lock);
-  LL_PREPEND (mm->event_list, event);
-  POCL_UNLOCK(mm->event_lock);
+  push_object (MM_EVENT, event);
 }
 
 _cl_command_node* pocl_mem_manager_new_command ()
 {
-  _cl_command_node *cmd = NULL;
-  POCL_LOCK (mm->cmd_lock);
-  if ((cmd = mm->cmd_list))
-    LL_DELETE (mm->cmd_list, cmd);
-  POCL_UNLOCK (mm->cmd_lock);
-  
+  _cl_command_node *cmd = (_cl_command_node *)pop_object (MM_COMMAND);
   if (cmd)
     {
       memset (cmd, 0, sizeof (struct _cl_command_node));
@@ -117,19 +252,12 @@ _cl_command_node* pocl_mem_manager_new_command ()
 
 void pocl_mem_manager_free_command (_cl_command_node *cmd_ptr)
 {
-  POCL_LOCK (mm->cmd_lock);
-  LL_PREPEND (mm->cmd_list, cmd_ptr);
-  POCL_UNLOCK(mm->cmd_lock);
+  push_object (MM_COMMAND, cmd_ptr);
 }
 
 event_node* pocl_mem_manager_new_event_node ()
 {
-  event_node *ed = NULL;
-  POCL_LOCK(mm->event_node_lock);
-  if ((ed = mm->event_node_list))
-    LL_DELETE (mm->event_node_list, ed);
-  POCL_UNLOCK (mm->event_node_lock);
-  
+  event_node *ed = (event_node *)pop_object (MM_EVENT_NODE);
   if (ed)
     {
       memset (ed, 0, sizeof(event_node));
@@ -141,9 +269,308 @@ event_node* pocl_mem_manager_new_event_node ()
 
 void pocl_mem_manager_free_event_node (event_node *ed)
 {
-  POCL_LOCK (mm->event_node_lock);
-  LL_PREPEND (mm->event_node_list, ed);
-  POCL_UNLOCK (mm->event_node_lock);
+  push_object (MM_EVENT_NODE, ed);
+}
+
+#endif
+
+/* Host memory pools: the memory of released large buffers is kept per
+ * context in exact-capacity size class lists, so that creating and
+ * releasing temporary buffers does not reach mmap/munmap and page in new
+ * memory every time. The capacities step by a quarter of a power of two,
+ * and from POCL_HUGE_PAGE_SIZE up they are multiples of it and aligned to
+ * it, so that transparent huge pages can back them. With POCL_HUGE_PAGES,
+ * the blocks of at least a huge page are huge page allocations. The cached
+ * memory of a
+ * pool is limited to POCL_HOST_MEM_POOL_SIZE MBs, beyond which the least
+ * recently cached blocks are freed. */
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+/* smaller buffers are malloc'd as usual */
+#define POCL_HOST_MEM_POOL_MIN_SIZE 4096
+#define POCL_HOST_MEM_POOL_ALIGNMENT 4096
+#define POCL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define POCL_HOST_MEM_POOL_CLASSES (sizeof (size_t) * 8 * 4)
+#define POCL_HOST_MEM_POOL_DEFAULT_SIZE_MB 256
+
+/* The header of a cached block, stored in the block itself. */
+typedef struct pocl_host_mem_block pocl_host_mem_block;
+struct pocl_host_mem_block
+{
+  size_t capacity;
+  unsigned size_class;
+  pocl_host_mem_block *next, *prev;         /* in the size class */
+  pocl_host_mem_block *lru_next, *lru_prev; /* most recent first */
+};
+
+struct pocl_host_mem_pool
+{
+  pocl_lock_t lock;
+  pocl_host_mem_block *classes[POCL_HOST_MEM_POOL_CLASSES];
+  pocl_host_mem_block *lru, *lru_last;
+  size_t cached_size;
+  size_t limit;
+  uint64_t hits, misses;
+  pocl_host_mem_pool *next_pool;
+};
+
+/* all the pools, for trimming them together */
+static pocl_host_mem_pool *host_mem_pools = NULL;
+static pocl_lock_t host_mem_pools_lock = POCL_LOCK_INITIALIZER;
+
+/* Returns the capacity of the block for the size and its size class, or 0
+ * if the size is not pooled. */
+static size_t
+host_mem_capacity (size_t size, unsigned *size_class)
+{
+  unsigned l = 0;
+  size_t step, capacity;
+
+  if (size < POCL_HOST_MEM_POOL_MIN_SIZE)
+    return 0;
+  while ((size >> (l + 1)) != 0)
+    ++l;
+  step = (size_t)1 << (l - 2);
+  capacity = (size + step - 1) & ~(step - 1);
+  if (capacity >= POCL_HUGE_PAGE_SIZE)
+    capacity = pocl_align_value (capacity, POCL_HUGE_PAGE_SIZE);
+  if (pocl_huge_page_size () > POCL_HUGE_PAGE_SIZE
+      && capacity >= pocl_huge_page_size ())
+    capacity = pocl_align_value (capacity, pocl_huge_page_size ());
+  if (capacity < size)
+    return 0;
+
+  /* the rounded capacities are size class boundaries as well */
+  l = 0;
+  while ((capacity >> (l + 1)) != 0)
+    ++l;
+  *size_class = l * 4 + (unsigned)(capacity >> (l - 2)) - 4;
+  return capacity;
+}
+
+static void
+unlink_host_mem_block (pocl_host_mem_pool *pool, pocl_host_mem_block *b)
+{
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    pool->classes[b->size_class] = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    pool->lru = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    pool->lru_last = b->lru_prev;
+
+  pool->cached_size -= b->capacity;
+}
+
+/* Takes the least recently cached blocks off the pool until it caches at
+ * most keep bytes, and returns them linked by their next pointers. Call
+ * with the pool locked. */
+static pocl_host_mem_block *
+take_lru_host_mem_blocks (pocl_host_mem_pool *pool, size_t keep)
+{
+  pocl_host_mem_block *freed = NULL;
+
+  while (pool->cached_size > keep && pool->lru_last != NULL)
+    {
+      pocl_host_mem_block *b = pool->lru_last;
+      unlink_host_mem_block (pool, b);
+      b->next = freed;
+      freed = b;
+    }
+  return freed;
+}
+
+static void
+free_host_mem_block (void *ptr, size_t capacity)
+{
+  if (pocl_use_huge_pages (capacity))
+    pocl_huge_page_free (ptr, capacity);
+  else
+    pocl_aligned_free (ptr);
+}
+
+static void
+free_host_mem_blocks (pocl_host_mem_block *b)
+{
+  while (b != NULL)
+    {
+      pocl_host_mem_block *next = b->next;
+      free_host_mem_block (b, b->capacity);
+      b = next;
+    }
 }
 
+pocl_host_mem_pool *
+pocl_host_mem_pool_create (size_t alignment)
+{
+  int limit_mb = pocl_get_int_option ("POCL_HOST_MEM_POOL_SIZE",
+                                      POCL_HOST_MEM_POOL_DEFAULT_SIZE_MB);
+  if (limit_mb <= 0 || alignment > POCL_HOST_MEM_POOL_ALIGNMENT)
+    return NULL;
+
+  pocl_host_mem_pool *pool
+      = (pocl_host_mem_pool *)calloc (1, sizeof (pocl_host_mem_pool));
+  if (pool == NULL)
+    return NULL;
+  POCL_INIT_LOCK (pool->lock);
+  pool->limit = (size_t)limit_mb << 20;
+
+  POCL_LOCK (host_mem_pools_lock);
+  pool->next_pool = host_mem_pools;
+  host_mem_pools = pool;
+  POCL_UNLOCK (host_mem_pools_lock);
+  return pool;
+}
+
+void
+pocl_host_mem_pool_destroy (pocl_host_mem_pool *pool)
+{
+  pocl_host_mem_pool **p;
+  if (pool == NULL)
+    return;
+
+  POCL_LOCK (host_mem_pools_lock);
+  for (p = &host_mem_pools; *p != NULL; p = &(*p)->next_pool)
+    if (*p == pool)
+      {
+        *p = pool->next_pool;
+        break;
+      }
+  POCL_UNLOCK (host_mem_pools_lock);
+
+  POCL_MSG_PRINT_MEMORY ("Host memory pool %p: %" PRIu64 " hits, %" PRIu64
+                         " misses\n",
+                         pool, pool->hits, pool->misses);
+  free_host_mem_blocks (take_lru_host_mem_blocks (pool, 0));
+  POCL_DESTROY_LOCK (pool->lock);
+  POCL_MEM_FREE (pool);
+}
+
+void *
+pocl_host_mem_pool_alloc (pocl_host_mem_pool *pool, size_t size)
+{
+  unsigned size_class;
+  size_t capacity = host_mem_capacity (size, &size_class);
+  pocl_host_mem_block *b;
+  void *p;
+
+  if (capacity == 0)
+    return NULL;
+
+  POCL_LOCK (pool->lock);
+  b = pool->classes[size_class];
+  if (b != NULL)
+    {
+      unlink_host_mem_block (pool, b);
+      ++pool->hits;
+    }
+  else
+    ++pool->misses;
+  POCL_UNLOCK (pool->lock);
+  if (b != NULL)
+    return b;
+
+  if (pocl_use_huge_pages (capacity))
+    {
+      p = pocl_huge_page_alloc (capacity);
+      if (p == NULL)
+        {
+          pocl_trim_host_mem_pools (0);
+          p = pocl_huge_page_alloc (capacity);
+        }
+    }
+  else if (capacity >= POCL_HUGE_PAGE_SIZE)
+    {
+      p = pocl_aligned_malloc (POCL_HUGE_PAGE_SIZE, capacity);
+      if (p == NULL)
+        {
+          /* give the cached memory back and retry */
+          pocl_trim_host_mem_pools (0);
+          p = pocl_aligned_malloc (POCL_HUGE_PAGE_SIZE, capacity);
+        }
+#ifdef MADV_HUGEPAGE
+      if (p != NULL)
+        madvise (p, capacity, MADV_HUGEPAGE);
 #endif
+    }
+  else
+    {
+      p = pocl_aligned_malloc (POCL_HOST_MEM_POOL_ALIGNMENT, capacity);
+      if (p == NULL)
+        {
+          pocl_trim_host_mem_pools (0);
+          p = pocl_aligned_malloc (POCL_HOST_MEM_POOL_ALIGNMENT, capacity);
+        }
+    }
+  return p;
+}
+
+void
+pocl_host_mem_pool_free (pocl_host_mem_pool *pool, void *ptr, size_t size)
+{
+  unsigned size_class;
+  size_t capacity = host_mem_capacity (size, &size_class);
+  pocl_host_mem_block *b = (pocl_host_mem_block *)ptr, *freed;
+
+  assert (capacity > 0);
+  if (capacity > pool->limit)
+    {
+      free_host_mem_block (ptr, capacity);
+      return;
+    }
+
+  b->capacity = capacity;
+  b->size_class = size_class;
+  POCL_LOCK (pool->lock);
+  b->prev = NULL;
+  b->next = pool->classes[size_class];
+  if (b->next)
+    b->next->prev = b;
+  pool->classes[size_class] = b;
+  b->lru_prev = NULL;
+  b->lru_next = pool->lru;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b;
+  else
+    pool->lru_last = b;
+  pool->lru = b;
+  pool->cached_size += capacity;
+
+  freed = (pool->cached_size > pool->limit)
+              ? take_lru_host_mem_blocks (pool, pool->limit)
+              : NULL;
+  POCL_UNLOCK (pool->lock);
+
+  free_host_mem_blocks (freed);
+}
+
+size_t
+pocl_trim_host_mem_pools (size_t keep)
+{
+  pocl_host_mem_pool *pool;
+  pocl_host_mem_block *freed;
+  size_t cached = 0;
+
+  POCL_LOCK (host_mem_pools_lock);
+  for (pool = host_mem_pools; pool != NULL; pool = pool->next_pool)
+    {
+      POCL_LOCK (pool->lock);
+      freed = take_lru_host_mem_blocks (pool, keep);
+      cached += pool->cached_size;
+      POCL_UNLOCK (pool->lock);
+      free_host_mem_blocks (freed);
+    }
+  POCL_UNLOCK (host_mem_pools_lock);
+  return cached;
+}
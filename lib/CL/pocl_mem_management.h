@@ -64,6 +64,24 @@ cl_event pocl_mem_manager_new_event ();
 
 #endif
 
+/* Returns a host memory pool for the buffers of a context whose buffers
+ * need at most the given alignment, or NULL if pooling is disabled. */
+pocl_host_mem_pool *pocl_host_mem_pool_create (size_t alignment);
+
+void pocl_host_mem_pool_destroy (pocl_host_mem_pool *pool);
+
+/* Returns NULL if the size isn't pooled or the allocation fails; the
+ * memory must then be allocated the usual way. */
+void *pocl_host_mem_pool_alloc (pocl_host_mem_pool *pool, size_t size);
+
+/* The size must be the one the memory was allocated with. */
+void pocl_host_mem_pool_free (pocl_host_mem_pool *pool, void *ptr,
+                              size_t size);
+
+/* Frees the least recently cached memory of every pool until each of them
+ * caches at most keep bytes. Returns the bytes still cached in total. */
+size_t pocl_trim_host_mem_pools (size_t keep);
+
 #ifdef __GNUC__
 #pragma GCC visibility pop
 #endif
@@ -0,0 +1,372 @@
+/* OpenCL runtime library: per-command hardware performance counters
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "pocl_debug.h"
+#include "pocl_perf_counters.h"
+#include "pocl_runtime_config.h"
+
+unsigned pocl_perf_num_counters = 0;
+int pocl_profiler_symbols = 0;
+
+#define POCL_PERF_MAX_NAME 32
+
+typedef struct perf_counter_type
+{
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} perf_counter_type;
+
+static char counter_names[POCL_PERF_MAX_COUNTERS][POCL_PERF_MAX_NAME];
+
+#ifdef __linux__
+
+#define HW_CACHE_MISS(cache)                                                  \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8)                               \
+   | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const perf_counter_type counter_types[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+  { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  { "stalled-cycles-backend", PERF_TYPE_HARDWARE,
+    PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+  { "l1d-misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS (PERF_COUNT_HW_CACHE_L1D) },
+  { "llc-misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS (PERF_COUNT_HW_CACHE_LL) },
+  { "dtlb-misses", PERF_TYPE_HW_CACHE,
+    HW_CACHE_MISS (PERF_COUNT_HW_CACHE_DTLB) },
+};
+
+static perf_counter_type counters[POCL_PERF_MAX_COUNTERS];
+
+/* Sets up the counter from a name of counter_types or "raw:<hex>", the
+   model specific event code (e.g. of the vector instructions retired). */
+static int
+parse_counter (const char *name, perf_counter_type *c)
+{
+  unsigned i;
+  if (strncmp (name, "raw:", 4) == 0)
+    {
+      char *end;
+      c->config = strtoull (name + 4, &end, 16);
+      c->type = PERF_TYPE_RAW;
+      return *end == 0 && end != name + 4;
+    }
+  for (i = 0; i < sizeof (counter_types) / sizeof (counter_types[0]); ++i)
+    if (strcmp (name, counter_types[i].name) == 0)
+      {
+        *c = counter_types[i];
+        return 1;
+      }
+  return 0;
+}
+
+static void
+parse_profiler_symbols ()
+{
+  const char *env = pocl_get_string_option ("POCL_PROFILER_SYMBOLS", NULL);
+  if (env == NULL || *env == 0)
+    return;
+
+  char *list = strdup (env);
+  char *save = NULL, *tok;
+  for (tok = strtok_r (list, ",", &save); tok != NULL;
+       tok = strtok_r (NULL, ",", &save))
+    {
+      if (strcmp (tok, "perfmap") == 0)
+        pocl_profiler_symbols |= POCL_PROFILER_SYMBOLS_PERFMAP;
+      else if (strcmp (tok, "jitdump") == 0)
+        pocl_profiler_symbols |= POCL_PROFILER_SYMBOLS_JITDUMP;
+      else if (strcmp (tok, "vtune") == 0)
+        pocl_profiler_symbols |= POCL_PROFILER_SYMBOLS_VTUNE;
+      else
+        POCL_MSG_WARN ("POCL_PROFILER_SYMBOLS: unknown value '%s'\n", tok);
+    }
+  free (list);
+}
+
+void
+pocl_perf_counters_init ()
+{
+  parse_profiler_symbols ();
+
+  const char *env = pocl_get_string_option ("POCL_PERF_COUNTERS", NULL);
+  if (env == NULL || *env == 0)
+    return;
+
+  char *list = strdup (env);
+  char *save = NULL, *tok;
+  unsigned n = 0;
+  for (tok = strtok_r (list, ",", &save); tok != NULL;
+       tok = strtok_r (NULL, ",", &save))
+    {
+      if (n == POCL_PERF_MAX_COUNTERS)
+        {
+          POCL_MSG_WARN ("POCL_PERF_COUNTERS: at most %d counters, ignoring "
+                         "'%s' and the rest\n",
+                         POCL_PERF_MAX_COUNTERS, tok);
+          break;
+        }
+      if (strlen (tok) >= POCL_PERF_MAX_NAME
+          || !parse_counter (tok, &counters[n]))
+        {
+          POCL_MSG_WARN ("POCL_PERF_COUNTERS: unknown counter '%s'\n", tok);
+          continue;
+        }
+      strcpy (counter_names[n], tok);
+      ++n;
+    }
+  free (list);
+  pocl_perf_num_counters = n;
+}
+
+void
+pocl_perf_counters_open (int *fds)
+{
+  static int warned = 0;
+  unsigned i;
+
+  for (i = 0; i < POCL_PERF_MAX_COUNTERS; ++i)
+    fds[i] = -1;
+  for (i = 0; i < pocl_perf_num_counters; ++i)
+    {
+      struct perf_event_attr attr;
+      memset (&attr, 0, sizeof (attr));
+      attr.size = sizeof (attr);
+      attr.type = counters[i].type;
+      attr.config = counters[i].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[i] = (int)syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (fds[i] < 0 && !POCL_ATOMIC_CAS (&warned, 0, 1))
+        POCL_MSG_WARN ("POCL_PERF_COUNTERS: can't open '%s', check "
+                       "/proc/sys/kernel/perf_event_paranoid\n",
+                       counter_names[i]);
+    }
+}
+
+void
+pocl_perf_counters_close (int *fds)
+{
+  unsigned i;
+  for (i = 0; i < POCL_PERF_MAX_COUNTERS; ++i)
+    if (fds[i] >= 0)
+      {
+        close (fds[i]);
+        fds[i] = -1;
+      }
+}
+
+void
+pocl_perf_counters_read (const int *fds, uint64_t *values)
+{
+  unsigned i;
+  for (i = 0; i < pocl_perf_num_counters; ++i)
+    if (fds[i] < 0 || read (fds[i], &values[i], sizeof (uint64_t))
+                          != sizeof (uint64_t))
+      values[i] = 0;
+}
+
+static pthread_mutex_t perf_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *perf_map = NULL;
+
+void
+pocl_perf_map_add (uint64_t addr, uint64_t size, const char *name)
+{
+  if (!(pocl_profiler_symbols & POCL_PROFILER_SYMBOLS_PERFMAP) || size == 0)
+    return;
+
+  pthread_mutex_lock (&perf_map_lock);
+  if (perf_map == NULL)
+    {
+      char path[64];
+      snprintf (path, sizeof (path), "/tmp/perf-%d.map", (int)getpid ());
+      perf_map = fopen (path, "a");
+      if (perf_map == NULL)
+        {
+          POCL_MSG_WARN ("POCL_PROFILER_SYMBOLS: can't open %s\n", path);
+          pocl_profiler_symbols &= ~POCL_PROFILER_SYMBOLS_PERFMAP;
+        }
+    }
+  if (perf_map)
+    {
+      fprintf (perf_map, "%" PRIx64 " %" PRIx64 " %s\n", addr, size, name);
+      /* perf reads the map when the profiled process has exited, or
+         while it runs with perf top */
+      fflush (perf_map);
+    }
+  pthread_mutex_unlock (&perf_map_lock);
+}
+
+/* Walks the symbol table in the library's file, or the dynamic one if the
+   file is stripped. */
+void
+pocl_perf_map_add_library (void *dlhandle)
+{
+  struct link_map *lm = NULL;
+  struct stat st;
+
+  if (!(pocl_profiler_symbols & POCL_PROFILER_SYMBOLS_PERFMAP)
+      || dlinfo (dlhandle, RTLD_DI_LINKMAP, &lm) != 0 || lm == NULL)
+    return;
+
+  int fd = open (lm->l_name, O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat (fd, &st) != 0 || (size_t)st.st_size < sizeof (ElfW (Ehdr)))
+    {
+      close (fd);
+      return;
+    }
+  const char *file
+      = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (file == MAP_FAILED)
+    return;
+
+  const ElfW (Ehdr) *eh = (const ElfW (Ehdr) *)file;
+  if (memcmp (eh->e_ident, ELFMAG, SELFMAG) != 0
+      || eh->e_shoff + (size_t)eh->e_shnum * sizeof (ElfW (Shdr))
+             > (size_t)st.st_size)
+    goto OUT;
+
+  const ElfW (Shdr) *sh = (const ElfW (Shdr) *)(file + eh->e_shoff);
+  const ElfW (Shdr) *symtab = NULL;
+  unsigned i;
+  for (i = 0; i < eh->e_shnum; ++i)
+    if (sh[i].sh_type == SHT_SYMTAB
+        || (sh[i].sh_type == SHT_DYNSYM && symtab == NULL))
+      symtab = &sh[i];
+  if (symtab == NULL || symtab->sh_link >= eh->e_shnum
+      || symtab->sh_offset + symtab->sh_size > (size_t)st.st_size)
+    goto OUT;
+  const ElfW (Shdr) *strtab = &sh[symtab->sh_link];
+  if (strtab->sh_offset + strtab->sh_size > (size_t)st.st_size)
+    goto OUT;
+
+  const ElfW (Sym) *syms = (const ElfW (Sym) *)(file + symtab->sh_offset);
+  const char *strs = file + strtab->sh_offset;
+  size_t n = symtab->sh_size / sizeof (ElfW (Sym));
+  for (i = 0; i < n; ++i)
+    {
+      if (ELF64_ST_TYPE (syms[i].st_info) != STT_FUNC
+          || syms[i].st_shndx == SHN_UNDEF || syms[i].st_size == 0
+          || syms[i].st_name >= strtab->sh_size)
+        continue;
+      pocl_perf_map_add (lm->l_addr + syms[i].st_value, syms[i].st_size,
+                         strs + syms[i].st_name);
+    }
+
+OUT:
+  munmap ((void *)file, st.st_size);
+}
+
+#else
+
+void
+pocl_perf_counters_init ()
+{
+  if (pocl_get_string_option ("POCL_PERF_COUNTERS", NULL))
+    POCL_MSG_WARN ("POCL_PERF_COUNTERS is only supported on Linux\n");
+  if (pocl_get_string_option ("POCL_PROFILER_SYMBOLS", NULL))
+    POCL_MSG_WARN ("POCL_PROFILER_SYMBOLS is only supported on Linux\n");
+}
+
+void
+pocl_perf_map_add (uint64_t addr, uint64_t size, const char *name)
+{
+}
+
+void
+pocl_perf_map_add_library (void *dlhandle)
+{
+}
+
+void
+pocl_perf_counters_open (int *fds)
+{
+  unsigned i;
+  for (i = 0; i < POCL_PERF_MAX_COUNTERS; ++i)
+    fds[i] = -1;
+}
+
+void
+pocl_perf_counters_close (int *fds)
+{
+}
+
+void
+pocl_perf_counters_read (const int *fds, uint64_t *values)
+{
+}
+
+#endif
+
+const char *
+pocl_perf_counter_name (unsigned i)
+{
+  return i < pocl_perf_num_counters ? counter_names[i] : NULL;
+}
+
+int
+pocl_perf_counter_index (const char *name)
+{
+  unsigned i;
+  for (i = 0; i < pocl_perf_num_counters; ++i)
+    if (strcmp (counter_names[i], name) == 0)
+      return (int)i;
+  return -1;
+}
+
+void
+pocl_perf_counters_add (cl_event event, const uint64_t *start,
+                        const uint64_t *end)
+{
+  unsigned i;
+  for (i = 0; i < pocl_perf_num_counters; ++i)
+    if (end[i] > start[i])
+      __sync_fetch_and_add (&event->profile->perf_counters[i],
+                            end[i] - start[i]);
+}
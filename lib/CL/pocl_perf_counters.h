@@ -0,0 +1,110 @@
+/* OpenCL runtime library: per-command hardware performance counters
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* The counters listed in POCL_PERF_COUNTERS are opened with perf_event_open
+   by every thread that runs commands (for now, the pthread driver threads),
+   counting only that thread in user mode. A thread reads its counters
+   before and after each piece of a command it runs and adds the
+   differences to the command's event, so the totals of a command cover all
+   the threads that worked on it. They are returned by
+   clGetEventProfilingInfo(CL_PROFILING_COMMAND_PERF_COUNTERS_POCL) and
+   printed by the cq profiler.
+
+   POCL_PROFILER_SYMBOLS makes the kernels visible to the profilers: the
+   functions of the loaded kernel libraries and JIT objects are appended
+   to /tmp/perf-<pid>.map, and the JIT objects can also be reported to the
+   perf jitdump and VTune JIT interfaces of LLVM. */
+
+#ifndef POCL_PERF_COUNTERS_H
+#define POCL_PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#include "pocl_cl.h"
+#include "pocl_export.h"
+
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* The number of counters selected with POCL_PERF_COUNTERS, 0 if none. */
+POCL_EXPORT
+extern unsigned pocl_perf_num_counters;
+
+#define POCL_PROFILER_SYMBOLS_PERFMAP 1
+#define POCL_PROFILER_SYMBOLS_JITDUMP 2
+#define POCL_PROFILER_SYMBOLS_VTUNE 4
+
+/* The POCL_PROFILER_SYMBOLS_* selected with POCL_PROFILER_SYMBOLS. */
+POCL_EXPORT
+extern int pocl_profiler_symbols;
+
+/* Parses POCL_PERF_COUNTERS and POCL_PROFILER_SYMBOLS. */
+void pocl_perf_counters_init ();
+
+/* Returns the name of the i-th counter, as given in POCL_PERF_COUNTERS. */
+const char *pocl_perf_counter_name (unsigned i);
+
+/* Returns the index of the named counter, or -1 if it's not selected. */
+int pocl_perf_counter_index (const char *name);
+
+/* Opens the counters for the calling thread into fds
+   (POCL_PERF_MAX_COUNTERS entries). The counters that can't be opened
+   get -1 and always read 0. */
+POCL_EXPORT
+void pocl_perf_counters_open (int *fds);
+
+POCL_EXPORT
+void pocl_perf_counters_close (int *fds);
+
+/* Reads the counters opened with pocl_perf_counters_open. */
+POCL_EXPORT
+void pocl_perf_counters_read (const int *fds, uint64_t *values);
+
+/* Adds end - start of each counter to the totals of the event. Can be
+   called by several threads at a time. */
+POCL_EXPORT
+void pocl_perf_counters_add (cl_event event, const uint64_t *start,
+                             const uint64_t *end);
+
+/* Appends the function at addr to the perf map. */
+void pocl_perf_map_add (uint64_t addr, uint64_t size, const char *name);
+
+/* Appends the functions of the dlopen()ed library to the perf map. */
+POCL_EXPORT
+void pocl_perf_map_add_library (void *dlhandle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif
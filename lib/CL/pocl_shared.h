@@ -90,6 +90,16 @@ compile_and_link_program(int compile_program,
                                                          void *user_data),
                          void *user_data);
 
+/* Waits for the build of the program that clBuildProgram or
+   clCompileProgram queued in the background, if any. */
+void pocl_wait_program_build (cl_program program);
+
+/* The hash of a kernel of the program build, as in kernel->meta->build_hash,
+   which the dlhandle cache is keyed on. */
+void pocl_compute_kernel_hash (const SHA1_digest_t build_hash,
+                               const char *kernel_name,
+                               pocl_kernel_hash_t hash);
+
 int context_set_properties (cl_context context,
                             const cl_context_properties *properties);
 
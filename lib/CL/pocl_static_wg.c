@@ -0,0 +1,177 @@
+/* OpenCL runtime library: the registry of statically linked WG functions
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include <string.h>
+
+#include "pocl_static_wg.h"
+#include "pocl_shared.h"
+
+typedef struct
+{
+  pocl_kernel_hash_t hash;
+  const cl_static_wg_function_pocl *f;
+} static_wg_entry;
+
+/* Only grows; the lookups happen on the dlhandle cache misses, which are
+   rare after the first launches. */
+static static_wg_entry *entries;
+static unsigned num_entries;
+static unsigned entries_capacity;
+static pocl_lock_t entries_lock = POCL_LOCK_INITIALIZER;
+
+cl_int
+pocl_static_wg_register (cl_uint num_functions,
+                         const cl_static_wg_function_pocl *functions)
+{
+  SHA1_digest_t build_hash;
+  cl_uint i;
+
+  for (i = 0; i < num_functions; ++i)
+    {
+      const cl_static_wg_function_pocl *f = &functions[i];
+      POCL_RETURN_ERROR_ON ((f->build_hash == NULL || f->kernel_name == NULL
+                             || f->wg == NULL),
+                            CL_INVALID_VALUE,
+                            "WG function %u is incomplete\n", i);
+      POCL_RETURN_ERROR_ON ((strlen (f->build_hash) >= sizeof (SHA1_digest_t)),
+                            CL_INVALID_VALUE,
+                            "WG function %u has an invalid build hash\n", i);
+      POCL_RETURN_ERROR_ON ((f->flags
+                             & ~(cl_bitfield)(CL_STATIC_WG_GOFFS_ZERO_POCL
+                                              | CL_STATIC_WG_SMALL_GRID_POCL)),
+                            CL_INVALID_VALUE,
+                            "WG function %u has unknown flags\n", i);
+    }
+
+  POCL_LOCK (entries_lock);
+  if (num_entries + num_functions > entries_capacity)
+    {
+      unsigned capacity = entries_capacity ? entries_capacity : 64;
+      while (capacity < num_entries + num_functions)
+        capacity *= 2;
+      static_wg_entry *n = (static_wg_entry *)realloc (
+          entries, capacity * sizeof (static_wg_entry));
+      if (n == NULL)
+        {
+          POCL_UNLOCK (entries_lock);
+          return CL_OUT_OF_HOST_MEMORY;
+        }
+      entries = n;
+      entries_capacity = capacity;
+    }
+  for (i = 0; i < num_functions; ++i)
+    {
+      static_wg_entry *e = &entries[num_entries++];
+      /* the build hashes are hashed with their zero padding */
+      memset (build_hash, 0, sizeof (SHA1_digest_t));
+      memcpy (build_hash, functions[i].build_hash,
+              strlen (functions[i].build_hash));
+      pocl_compute_kernel_hash (build_hash, functions[i].kernel_name,
+                                e->hash);
+      e->f = &functions[i];
+      POCL_MSG_PRINT_INFO ("Registered a static WG function of %s/%s\n",
+                           functions[i].build_hash, functions[i].kernel_name);
+    }
+  POCL_UNLOCK (entries_lock);
+  return CL_SUCCESS;
+}
+
+static int
+is_generic (const cl_static_wg_function_pocl *f)
+{
+  return f->local_size[0] == 0 && f->local_size[1] == 0
+         && f->local_size[2] == 0;
+}
+
+const cl_static_wg_function_pocl *
+pocl_static_wg_lookup (const pocl_kernel_hash_t hash, const size_t *local_size,
+                       int goffs_zero, int small_grid)
+{
+  const cl_static_wg_function_pocl *found = NULL;
+  unsigned i;
+
+  if (num_entries == 0)
+    return NULL;
+
+  POCL_LOCK (entries_lock);
+  for (i = 0; i < num_entries; ++i)
+    {
+      const cl_static_wg_function_pocl *f = entries[i].f;
+      if (memcmp (entries[i].hash, hash, sizeof (pocl_kernel_hash_t)) != 0)
+        continue;
+      if (local_size == NULL)
+        {
+          if (is_generic (f))
+            {
+              found = f;
+              break;
+            }
+          continue;
+        }
+      if (f->local_size[0] != local_size[0]
+          || f->local_size[1] != local_size[1]
+          || f->local_size[2] != local_size[2]
+          || ((f->flags & CL_STATIC_WG_GOFFS_ZERO_POCL) && !goffs_zero)
+          || ((f->flags & CL_STATIC_WG_SMALL_GRID_POCL) && !small_grid))
+        continue;
+      /* prefer the most specialized one */
+      if (found == NULL || found->flags < f->flags)
+        found = f;
+    }
+  POCL_UNLOCK (entries_lock);
+  return found;
+}
+
+int
+pocl_static_wg_has_kernel (const char *build_hash, const char *kernel_name)
+{
+  int found = 0;
+  unsigned i;
+
+  if (num_entries == 0)
+    return 0;
+
+  POCL_LOCK (entries_lock);
+  for (i = 0; i < num_entries && !found; ++i)
+    found = is_generic (entries[i].f)
+            && strcmp (entries[i].f->build_hash, build_hash) == 0
+            && strcmp (entries[i].f->kernel_name, kernel_name) == 0;
+  POCL_UNLOCK (entries_lock);
+  return found;
+}
+
+int
+pocl_static_wg_has_build (const char *build_hash)
+{
+  int found = 0;
+  unsigned i;
+
+  if (num_entries == 0)
+    return 0;
+
+  POCL_LOCK (entries_lock);
+  for (i = 0; i < num_entries && !found; ++i)
+    found = strcmp (entries[i].f->build_hash, build_hash) == 0;
+  POCL_UNLOCK (entries_lock);
+  return found;
+}
@@ -0,0 +1,70 @@
+/* OpenCL runtime library: the registry of statically linked WG functions
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* The WG functions registered with clRegisterStaticWGFunctionsPoCL, which
+   the CPU devices look up by the kernel hash before the kernel cache, so
+   that the applications that have their kernels linked in need neither
+   the compiler nor a writable cache directory. */
+
+#ifndef POCL_STATIC_WG_H
+#define POCL_STATIC_WG_H
+
+#include "pocl_cl.h"
+
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+cl_int pocl_static_wg_register (cl_uint num_functions,
+                                const cl_static_wg_function_pocl *functions);
+
+/* Returns the WG function of the kernel specialized for the local size
+   and the properties, or the generic one if local_size is NULL. Returns
+   NULL if there is none. */
+POCL_EXPORT
+const cl_static_wg_function_pocl *
+pocl_static_wg_lookup (const pocl_kernel_hash_t hash, const size_t *local_size,
+                       int goffs_zero, int small_grid);
+
+/* Returns 1 if the generic WG function of the kernel of the program build
+   is registered, so that it needs nothing from the kernel cache. */
+int pocl_static_wg_has_kernel (const char *build_hash,
+                               const char *kernel_name);
+
+/* Returns 1 if any WG functions of the program build are registered. */
+int pocl_static_wg_has_build (const char *build_hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif
@@ -0,0 +1,212 @@
+/* OpenCL runtime library: runtime statistics counters
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pocl_cl.h"
+#include "pocl_debug.h"
+#include "pocl_runtime_config.h"
+#include "pocl_stats.h"
+
+static const char *stat_names[POCL_STAT_NUM] = {
+  "pocl_dlhandle_cache_hits_total",
+  "pocl_dlhandle_cache_misses_total",
+  "pocl_disk_cache_hits_total",
+  "pocl_disk_cache_misses_total",
+  "pocl_static_wg_functions_total",
+  "pocl_program_builds_total",
+  "pocl_program_build_seconds_total",
+  "pocl_shared_program_builds_total",
+  "pocl_kernel_compiles_total",
+  "pocl_kernel_compile_seconds_total",
+  "pocl_migrations_total",
+  "pocl_migrated_bytes_total",
+  "pocl_pthread_commands_total",
+  "pocl_pthread_kernels_total",
+  "pocl_pthread_idle_wakeups_total",
+  "pocl_pthread_spin_wakeups_total",
+  "pocl_pthread_work_queue_depth",
+  "pocl_pthread_kernel_queue_depth",
+  "pocl_pthread_threads",
+};
+
+/* A thread's copy of the counters. Only the owner writes it. */
+typedef struct stats_block stats_block;
+struct stats_block
+{
+  volatile uint64_t values[POCL_STAT_NUM_COUNTERS];
+  stats_block *next;
+  stats_block *prev;
+};
+
+/* The blocks of the live threads, and the sums of the exited ones. The
+   lock is only taken when a thread starts or exits, and by the readers. */
+static stats_block *stats_blocks = NULL;
+static uint64_t retired[POCL_STAT_NUM_COUNTERS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static volatile int64_t gauges[POCL_STAT_NUM - POCL_STAT_NUM_COUNTERS];
+
+static char *stats_file = NULL;
+static int stats_interval = 0;
+
+static void
+retire_block (void *p)
+{
+  stats_block *b = (stats_block *)p;
+  unsigned i;
+
+  pthread_mutex_lock (&stats_lock);
+  for (i = 0; i < POCL_STAT_NUM_COUNTERS; ++i)
+    retired[i] += b->values[i];
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    stats_blocks = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  pthread_mutex_unlock (&stats_lock);
+  free (b);
+}
+
+static void
+create_stats_key ()
+{
+  pthread_key_create (&stats_key, retire_block);
+}
+
+void
+pocl_stat_add (pocl_stat_id id, uint64_t n)
+{
+  pthread_once (&stats_key_once, create_stats_key);
+  stats_block *b = (stats_block *)pthread_getspecific (stats_key);
+  if (b == NULL)
+    {
+      b = (stats_block *)calloc (1, sizeof (stats_block));
+      if (b == NULL)
+        return;
+      pthread_mutex_lock (&stats_lock);
+      b->next = stats_blocks;
+      if (stats_blocks)
+        stats_blocks->prev = b;
+      stats_blocks = b;
+      pthread_mutex_unlock (&stats_lock);
+      pthread_setspecific (stats_key, b);
+    }
+  b->values[id] += n;
+}
+
+void
+pocl_stat_gauge_add (pocl_stat_id id, int64_t delta)
+{
+  __sync_fetch_and_add (&gauges[id - POCL_STAT_NUM_COUNTERS], delta);
+}
+
+void
+pocl_stats_read (uint64_t *values)
+{
+  stats_block *b;
+  unsigned i;
+
+  pthread_mutex_lock (&stats_lock);
+  memcpy (values, retired, sizeof (retired));
+  for (b = stats_blocks; b != NULL; b = b->next)
+    for (i = 0; i < POCL_STAT_NUM_COUNTERS; ++i)
+      values[i] += b->values[i];
+  pthread_mutex_unlock (&stats_lock);
+  for (i = POCL_STAT_NUM_COUNTERS; i < POCL_STAT_NUM; ++i)
+    {
+      int64_t g = gauges[i - POCL_STAT_NUM_COUNTERS];
+      values[i] = g > 0 ? (uint64_t)g : 0;
+    }
+}
+
+const char *
+pocl_stat_name (pocl_stat_id id)
+{
+  return id < POCL_STAT_NUM ? stat_names[id] : NULL;
+}
+
+/* Writes the statistics to a temporary file and renames it over
+   POCL_STATS_FILE, so that a scraper never sees a partial file. */
+static void
+write_stats_file ()
+{
+  uint64_t values[POCL_STAT_NUM];
+  char tmp[POCL_FILENAME_LENGTH];
+  unsigned i;
+
+  pocl_stats_read (values);
+  snprintf (tmp, sizeof (tmp), "%s.%d.tmp", stats_file, (int)getpid ());
+  FILE *f = fopen (tmp, "w");
+  if (f == NULL)
+    return;
+  for (i = 0; i < POCL_STAT_NUM; ++i)
+    {
+      const char *type = i < POCL_STAT_NUM_COUNTERS ? "counter" : "gauge";
+      fprintf (f, "# TYPE %s %s\n", stat_names[i], type);
+      if (i == POCL_STAT_PROGRAM_BUILD_NS || i == POCL_STAT_KERNEL_COMPILE_NS)
+        fprintf (f, "%s %.9f\n", stat_names[i], values[i] / 1e9);
+      else
+        fprintf (f, "%s %" PRIu64 "\n", stat_names[i], values[i]);
+    }
+  if (fclose (f) != 0 || rename (tmp, stats_file) != 0)
+    remove (tmp);
+}
+
+static void *
+stats_export_thread (void *arg)
+{
+  while (1)
+    {
+      sleep (stats_interval);
+      write_stats_file ();
+    }
+  return NULL;
+}
+
+void
+pocl_stats_init ()
+{
+  const char *file = pocl_get_string_option ("POCL_STATS_FILE", NULL);
+  if (file == NULL || *file == 0 || stats_file != NULL)
+    return;
+  stats_file = strdup (file);
+  if (stats_file == NULL)
+    return;
+  atexit (write_stats_file);
+
+  stats_interval = pocl_get_int_option ("POCL_STATS_INTERVAL", 10);
+  if (stats_interval <= 0)
+    return;
+  pocl_thread_t thread;
+  POCL_CREATE_THREAD (thread, stats_export_thread, NULL);
+  PTHREAD_CHECK (pthread_detach (thread));
+}
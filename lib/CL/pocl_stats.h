@@ -0,0 +1,99 @@
+/* OpenCL runtime library: runtime statistics counters
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* Counters of the runtime's internal events (cache hits, compilations,
+   migrations, the pthread scheduler's activity), for monitoring. Each
+   thread increments its own copy of the counters without atomics; the
+   readers sum the copies. The gauges are shared and updated atomically.
+   They are read with clGetStatisticsPoCL, and written to POCL_STATS_FILE
+   in the Prometheus text format. */
+
+#ifndef POCL_STATS_H
+#define POCL_STATS_H
+
+#include <stdint.h>
+
+#include "pocl_export.h"
+
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum
+{
+  POCL_STAT_DLHANDLE_CACHE_HITS,
+  POCL_STAT_DLHANDLE_CACHE_MISSES,
+  POCL_STAT_DISK_CACHE_HITS,
+  POCL_STAT_DISK_CACHE_MISSES,
+  POCL_STAT_STATIC_WG_FUNCTIONS,
+  POCL_STAT_PROGRAM_BUILDS,
+  POCL_STAT_PROGRAM_BUILD_NS,
+  POCL_STAT_SHARED_PROGRAM_BUILDS,
+  POCL_STAT_KERNEL_COMPILES,
+  POCL_STAT_KERNEL_COMPILE_NS,
+  POCL_STAT_MIGRATIONS,
+  POCL_STAT_MIGRATED_BYTES,
+  POCL_STAT_PTHREAD_COMMANDS,
+  POCL_STAT_PTHREAD_KERNELS,
+  POCL_STAT_PTHREAD_IDLE_WAKEUPS,
+  POCL_STAT_PTHREAD_SPIN_WAKEUPS,
+  POCL_STAT_NUM_COUNTERS,
+  /* gauges */
+  POCL_STAT_PTHREAD_WORK_QUEUE_DEPTH = POCL_STAT_NUM_COUNTERS,
+  POCL_STAT_PTHREAD_KERNEL_QUEUE_DEPTH,
+  POCL_STAT_PTHREAD_THREADS,
+  POCL_STAT_NUM
+} pocl_stat_id;
+
+/* Starts the export to POCL_STATS_FILE, if set. */
+void pocl_stats_init ();
+
+/* Adds n to the calling thread's copy of the counter. */
+POCL_EXPORT
+void pocl_stat_add (pocl_stat_id id, uint64_t n);
+
+/* Adds delta to the gauge. */
+POCL_EXPORT
+void pocl_stat_gauge_add (pocl_stat_id id, int64_t delta);
+
+/* Returns the current values of all the statistics, POCL_STAT_NUM of
+   them. */
+void pocl_stats_read (uint64_t *values);
+
+/* Returns the name of the statistic, as exported to Prometheus. */
+const char *pocl_stat_name (pocl_stat_id id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif
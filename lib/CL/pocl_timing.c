@@ -49,6 +49,15 @@
 
 #include "pocl_timing.h"
 
+#if defined(HAVE_CLOCK_GETTIME) && defined(__GNUC__)                         \
+    && (defined(__x86_64__) || defined(__aarch64__))
+#  define POCL_HAVE_CYCLE_COUNTER
+#  ifdef __x86_64__
+#    include <cpuid.h>
+#    include <x86intrin.h>
+#  endif
+#endif
+
 #ifdef HAVE_CLOCK_GETTIME
 // clock_gettime is (at best) nanosec res
 const unsigned pocl_timer_resolution = 1;
@@ -107,6 +116,181 @@ uint64_t pocl_gettimemono_ns() {
 #endif
 }
 
+#ifdef POCL_HAVE_CYCLE_COUNTER
+
+/* The counter is converted with ns = base_ns + (ticks - base_ticks) * mult
+ * / 2^32, plus a correction of corr / 2^32 per tick for the first
+ * slew_ticks ticks. Once the counter has advanced by slew_ticks from the
+ * base, the next reader moves the base there, recomputes mult from the
+ * whole time since the calibration, and sets the correction to slew away
+ * the difference to pocl_gettimemono_ns() over the next slew_ticks. So the
+ * converted time never jumps (or goes backwards) but doesn't drift either.
+ * slew_ticks starts short, as the first estimate of mult is rough, and
+ * grows to a second. The readers retry if the base changed under them (a
+ * seqlock). */
+static struct
+{
+  unsigned seq;
+  uint64_t base_ticks;
+  uint64_t base_ns;
+  uint64_t mult;
+  int64_t corr;
+  uint64_t slew_ticks;
+} cycle_timer;
+
+static int cycle_timer_enabled = 0;
+static int cycle_timer_updating = 0;
+static uint64_t calib_ticks, calib_ns, ticks_per_sec;
+
+static inline uint64_t
+read_cycle_counter ()
+{
+#ifdef __x86_64__
+  return __rdtsc ();
+#else
+  uint64_t v;
+  __asm__ volatile ("isb; mrs %0, cntvct_el0" : "=r"(v) : : "memory");
+  return v;
+#endif
+}
+
+static int
+have_invariant_counter ()
+{
+#ifdef __x86_64__
+  unsigned eax, ebx, ecx, edx;
+  /* the invariant TSC bit of the advanced power management leaf */
+  if (!__get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (edx >> 8) & 1;
+#else
+  /* the generic timer ticks at a constant rate */
+  return 1;
+#endif
+}
+
+static uint64_t
+cycle_timer_mult (uint64_t ticks, uint64_t ns)
+{
+  return (uint64_t)(((unsigned __int128)ns << 32) / ticks);
+}
+
+static uint64_t
+cycle_timer_convert (uint64_t delta)
+{
+  uint64_t slewed = delta < cycle_timer.slew_ticks ? delta
+                                                    : cycle_timer.slew_ticks;
+  return cycle_timer.base_ns
+         + (uint64_t)(((unsigned __int128)delta * cycle_timer.mult) >> 32)
+         + (uint64_t)(((__int128)slewed * cycle_timer.corr) >> 32);
+}
+
+static void
+cycle_timer_rebase (uint64_t now_ticks, uint64_t now_ns)
+{
+  uint64_t mono_ns = pocl_gettimemono_ns ();
+  uint64_t mult
+      = cycle_timer_mult (now_ticks - calib_ticks, mono_ns - calib_ns);
+  uint64_t slew_ticks = cycle_timer.slew_ticks * 2;
+  if (slew_ticks > ticks_per_sec)
+    slew_ticks = ticks_per_sec;
+  /* at most 1/16 faster or slower while slewing */
+  int64_t offset = (int64_t)(mono_ns - now_ns);
+  int64_t corr = (int64_t)(((__int128)offset << 32) / (__int128)slew_ticks);
+  int64_t max_corr = (int64_t)(mult / 16);
+  if (corr > max_corr)
+    corr = max_corr;
+  if (corr < -max_corr)
+    corr = -max_corr;
+
+  __atomic_add_fetch (&cycle_timer.seq, 1, __ATOMIC_ACQ_REL);
+  cycle_timer.base_ticks = now_ticks;
+  cycle_timer.base_ns = now_ns;
+  cycle_timer.mult = mult;
+  cycle_timer.corr = corr;
+  cycle_timer.slew_ticks = slew_ticks;
+  __atomic_add_fetch (&cycle_timer.seq, 1, __ATOMIC_RELEASE);
+}
+
+int
+pocl_timing_init (int use_tsc)
+{
+  if (!use_tsc || !have_invariant_counter ())
+    return 0;
+
+  uint64_t t0 = read_cycle_counter ();
+  uint64_t ns0 = pocl_gettimemono_ns ();
+  uint64_t t1, ns1;
+  /* a short first estimate, refined by cycle_timer_rebase() */
+  do
+    {
+      t1 = read_cycle_counter ();
+      ns1 = pocl_gettimemono_ns ();
+    }
+  while (ns1 - ns0 < 1000000);
+  if (t1 <= t0)
+    return 0;
+
+  calib_ticks = t0;
+  calib_ns = ns0;
+  ticks_per_sec = (uint64_t)(((unsigned __int128)(t1 - t0) * 1000000000)
+                             / (ns1 - ns0));
+  cycle_timer.base_ticks = t1;
+  cycle_timer.base_ns = ns1;
+  cycle_timer.mult = cycle_timer_mult (t1 - t0, ns1 - ns0);
+  cycle_timer.corr = 0;
+  cycle_timer.slew_ticks = ticks_per_sec / 64;
+  cycle_timer_enabled = 1;
+  return 1;
+}
+
+uint64_t
+pocl_gettime_event_ns ()
+{
+  if (!cycle_timer_enabled)
+    return pocl_gettimemono_ns ();
+
+  uint64_t ticks, ns, delta, base_ticks, slew_ticks;
+  unsigned seq;
+  do
+    {
+      seq = __atomic_load_n (&cycle_timer.seq, __ATOMIC_ACQUIRE);
+      ticks = read_cycle_counter ();
+      base_ticks = cycle_timer.base_ticks;
+      slew_ticks = cycle_timer.slew_ticks;
+      delta = ticks - base_ticks;
+      ns = cycle_timer_convert (delta);
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ((seq & 1)
+         || seq != __atomic_load_n (&cycle_timer.seq, __ATOMIC_RELAXED));
+
+  if (delta > slew_ticks
+      && !__atomic_exchange_n (&cycle_timer_updating, 1, __ATOMIC_ACQUIRE))
+    {
+      if (cycle_timer.base_ticks == base_ticks)
+        cycle_timer_rebase (ticks, ns);
+      __atomic_store_n (&cycle_timer_updating, 0, __ATOMIC_RELEASE);
+    }
+  return ns;
+}
+
+#else
+
+int
+pocl_timing_init (int use_tsc)
+{
+  return 0;
+}
+
+uint64_t
+pocl_gettime_event_ns ()
+{
+  return pocl_gettimemono_ns ();
+}
+
+#endif
+
 int pocl_gettimereal(int *year, int *mon, int *day, int *hour, int *min, int *sec, int* nanosec)
 {
 #if defined(HAVE_CLOCK_GETTIME) || defined(__APPLE__) || defined(HAVE_GETTIMEOFDAY)
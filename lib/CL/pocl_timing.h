@@ -37,6 +37,16 @@ extern const unsigned pocl_timer_resolution;
 POCL_EXPORT
 uint64_t pocl_gettimemono_ns();
 
+/* Sets up the timer of pocl_gettime_event_ns(). With use_tsc, it reads the
+ * invariant TSC (x86-64) or the virtual counter (AArch64) when the CPU has
+ * one, calibrated against pocl_gettimemono_ns(). Returns 1 if it does. */
+int pocl_timing_init (int use_tsc);
+
+/* The time stamps of the events, in the time base of pocl_gettimemono_ns()
+ * but cheaper to read: without a system call when the counter is used. */
+POCL_EXPORT
+uint64_t pocl_gettime_event_ns ();
+
 int pocl_gettimereal(int *year, int *mon, int *day, int *hour, int *min, int *sec, int* nanosec);
 
 #ifdef __cplusplus
@@ -33,6 +33,7 @@
 #include <netdb.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -52,8 +53,140 @@ static const struct pocl_event_tracer lttng_tracer;
 static int tracing_initialized = 0;
 static uint8_t event_trace_filter = 0xF;
 
+/* The POCL_TRACING_FILTER criteria besides the statuses. An event is traced
+ * if it matches one of the given entries of every kind, and then only every
+ * Nth such event with sample=N. The verdict is cached on the event, so the
+ * filtered out events only pay one comparison per status update. */
+#define MAX_TRACE_FILTERS 16
+static int event_filter_active = 0;
+static char *type_filters[MAX_TRACE_FILTERS];
+static unsigned num_type_filters = 0;
+static char *kernel_filters[MAX_TRACE_FILTERS];
+static unsigned num_kernel_filters = 0;
+static uint64_t queue_filters[MAX_TRACE_FILTERS];
+static unsigned num_queue_filters = 0;
+static unsigned long sample_every = 0;
+static uint64_t sample_counter = 0;
+
 static const struct pocl_event_tracer *event_tracer = NULL;
 
+/* Event callbacks are run by one callback thread, in the order their status
+ * changes were reached, so that a slow callback does not hold up the driver
+ * thread that completed the command. POCL_EVENT_CALLBACK_THREAD=0 runs
+ * them inline instead. */
+typedef struct callback_job callback_job;
+struct callback_job
+{
+  cl_event event;
+  event_callback_item *cb;
+  callback_job *next;
+};
+
+static pthread_once_t callback_thread_once = PTHREAD_ONCE_INIT;
+static int use_callback_thread = 0;
+static pocl_lock_t callback_lock;
+static pocl_cond_t callback_cond;
+static callback_job *callback_jobs = NULL;
+static callback_job *callback_jobs_tail = NULL;
+static pocl_thread_t callback_thread;
+
+static void *
+pocl_callback_thread (void *arg)
+{
+  callback_job *job;
+
+  while (1)
+    {
+      POCL_LOCK (callback_lock);
+      while (callback_jobs == NULL)
+        POCL_WAIT_COND (callback_cond, callback_lock);
+      job = callback_jobs;
+      callback_jobs = job->next;
+      if (callback_jobs == NULL)
+        callback_jobs_tail = NULL;
+      POCL_UNLOCK (callback_lock);
+
+      job->cb->callback_function (job->event, job->cb->trigger_status,
+                                  job->cb->user_data);
+      /* the callback item lives as long as the event */
+      POname (clReleaseEvent) (job->event);
+      free (job);
+    }
+  return NULL;
+}
+
+static void
+init_callback_thread ()
+{
+  use_callback_thread
+      = pocl_get_bool_option ("POCL_EVENT_CALLBACK_THREAD", 1);
+  if (!use_callback_thread)
+    return;
+  POCL_INIT_LOCK (callback_lock);
+  POCL_INIT_COND (callback_cond);
+  POCL_CREATE_THREAD (callback_thread, pocl_callback_thread, NULL);
+  PTHREAD_CHECK (pthread_detach (callback_thread));
+}
+
+static int
+match_any (char **globs, unsigned num_globs, const char *str)
+{
+  unsigned i;
+  for (i = 0; i < num_globs; ++i)
+    if (fnmatch (globs[i], str, 0) == 0)
+      return 1;
+  return 0;
+}
+
+static int
+event_matches_filter (cl_event event)
+{
+  unsigned i;
+
+  if (num_type_filters
+      && !match_any (type_filters, num_type_filters,
+                     pocl_command_to_str (event->command_type)))
+    return 0;
+
+  if (num_kernel_filters)
+    {
+      if (event->command == NULL
+          || (event->command_type != CL_COMMAND_NDRANGE_KERNEL
+              && event->command_type != CL_COMMAND_TASK))
+        return 0;
+      if (!match_any (kernel_filters, num_kernel_filters,
+                      event->command->command.run.kernel->name))
+        return 0;
+    }
+
+  if (num_queue_filters)
+    {
+      if (event->queue == NULL)
+        return 0;
+      for (i = 0; i < num_queue_filters; ++i)
+        if (queue_filters[i] == event->queue->id)
+          break;
+      if (i == num_queue_filters)
+        return 0;
+    }
+
+  if (sample_every > 1
+      && (POCL_ATOMIC_INC (sample_counter) - 1) % sample_every != 0)
+    return 0;
+
+  return 1;
+}
+
+static int
+event_is_traced (cl_event event)
+{
+  if (!event_filter_active)
+    return 1;
+  if (event->trace_filtered == 0)
+    event->trace_filtered = event_matches_filter (event) ? 1 : -1;
+  return event->trace_filtered > 0;
+}
+
 /* Called with event locked, and must also return with a locked event. */
 void
 pocl_event_updated (cl_event event, int status)
@@ -61,57 +194,104 @@ pocl_event_updated (cl_event event, int status)
   event_callback_item *cb_ptr;
 
   if (event_tracer && event_tracer->event_updated
-      && ((1 << status) & event_trace_filter))
+      && ((1 << status) & event_trace_filter) && event_is_traced (event))
     event_tracer->event_updated (event, status);
 
+  if (pocl_cq_profiling_enabled && status == CL_COMPLETE)
+    pocl_cq_profiling_event_complete (event);
+
   /* Event callback handling calls functions in the same order
      they were added if the status matches the specified one. */
   for (cb_ptr = event->callback_list; cb_ptr; cb_ptr = cb_ptr->next)
     {
-      if (cb_ptr->trigger_status == status)
+      if (cb_ptr->trigger_status != status)
+        continue;
+
+      PTHREAD_CHECK (pthread_once (&callback_thread_once,
+                                   init_callback_thread));
+      callback_job *job = NULL;
+      if (use_callback_thread)
+        job = (callback_job *)malloc (sizeof (callback_job));
+      if (job == NULL)
         {
           POCL_UNLOCK_OBJ (event);
           cb_ptr->callback_function (event, cb_ptr->trigger_status,
                                      cb_ptr->user_data);
           POCL_LOCK_OBJ (event);
+          continue;
         }
+
+      POCL_RETAIN_OBJECT_UNLOCKED (event);
+      job->event = event;
+      job->cb = cb_ptr;
+      job->next = NULL;
+      POCL_LOCK (callback_lock);
+      if (callback_jobs_tail)
+        callback_jobs_tail->next = job;
+      else
+        callback_jobs = job;
+      callback_jobs_tail = job;
+      POCL_SIGNAL_COND (callback_cond);
+      POCL_UNLOCK (callback_lock);
     }
 }
 
+/* Parses POCL_TRACING_FILTER: a comma separated list of the statuses to
+ * trace (queued, submitted, running, complete; all if none is given), and
+ * type=GLOB (the command type names of pocl_command_to_str), kernel=GLOB,
+ * queue=ID and sample=N entries. */
 static void
 pocl_parse_event_filter ()
 {
   const char *trace_filter;
-  char *tmp_str, *save_ptr, *token;
+  char *filter_str, *tmp_str, *save_ptr, *token;
+  uint8_t status_filter = 0;
 
   trace_filter = pocl_get_string_option ("POCL_TRACING_FILTER", NULL);
   if (trace_filter == NULL)
     return;
 
-  tmp_str = strdup (trace_filter);
+  filter_str = tmp_str = strdup (trace_filter);
   if (tmp_str == NULL)
     return;
 
-  event_trace_filter = 0;
   while (1)
     {
       token = strtok_r (tmp_str, ",", &save_ptr);
       if (token == NULL)
         goto PARSE_OUT;
+      tmp_str = NULL;
+
       if (strcmp (token, "queued") == 0)
-        event_trace_filter |= (1 << CL_QUEUED);
+        status_filter |= (1 << CL_QUEUED);
       else if (strcmp (token, "submitted") == 0)
-        event_trace_filter |= (1 << CL_SUBMITTED);
+        status_filter |= (1 << CL_SUBMITTED);
       else if (strcmp (token, "running") == 0)
-        event_trace_filter |= (1 << CL_RUNNING);
+        status_filter |= (1 << CL_RUNNING);
       else if (strcmp (token, "complete") == 0)
-        event_trace_filter |= (1 << CL_COMPLETE);
-
-      tmp_str = NULL;
+        status_filter |= (1 << CL_COMPLETE);
+      else if (strncmp (token, "type=", 5) == 0
+               && num_type_filters < MAX_TRACE_FILTERS)
+        type_filters[num_type_filters++] = strdup (token + 5);
+      else if (strncmp (token, "kernel=", 7) == 0
+               && num_kernel_filters < MAX_TRACE_FILTERS)
+        kernel_filters[num_kernel_filters++] = strdup (token + 7);
+      else if (strncmp (token, "queue=", 6) == 0
+               && num_queue_filters < MAX_TRACE_FILTERS)
+        queue_filters[num_queue_filters++] = strtoull (token + 6, NULL, 0);
+      else if (strncmp (token, "sample=", 7) == 0)
+        sample_every = strtoul (token + 7, NULL, 0);
+      else
+        POCL_MSG_WARN ("Ignoring unknown POCL_TRACING_FILTER entry '%s'\n",
+                       token);
     }
 
 PARSE_OUT:
-  free (tmp_str);
+  free (filter_str);
+  if (status_filter)
+    event_trace_filter = status_filter;
+  event_filter_active = num_type_filters || num_kernel_filters
+                        || num_queue_filters || sample_every > 1;
 }
 
 //#################################################################
@@ -167,8 +347,9 @@ text_tracer_event_updated (cl_event event, int status)
 
   cl_ulong ts;
   int statuses[] = { CL_QUEUED, CL_SUBMITTED, CL_RUNNING, CL_COMPLETE };
-  cl_ulong times[] = { event->time_queue, event->time_submit,
-                       event->time_start, event->time_end };
+  const pocl_event_profile *prof = pocl_event_profile_of (event);
+  cl_ulong times[] = { prof->time_queue, prof->time_submit, prof->time_start,
+                       prof->time_end };
 
   cl_ulong ev_id = event->id;
   assert (ev_id && "No EV ID");
@@ -363,6 +544,308 @@ static const struct pocl_event_tracer cq_profiler = {
   NULL
 };
 
+//#################################################################
+/* Chrome trace format writer (POCL_TRACING=perfetto), for chrome://tracing
+ * and ui.perfetto.dev. Each thread appends fixed size records to its own
+ * ring buffer without locking, overwriting the oldest ones when full, and
+ * the JSON is only written at exit. The commands are shown on one track
+ * per command queue, with flow arrows from their dependencies, and the
+ * spans of pocl's own work (builds, codegen, work-groups) on one track per
+ * thread.
+ */
+
+/* Records per thread. */
+#define PERFETTO_RING_RECORDS 16384
+
+enum perfetto_record_kind
+{
+  PERFETTO_COMMAND = 1,
+  PERFETTO_SPAN,
+  PERFETTO_FLOW
+};
+
+typedef struct perfetto_record
+{
+  uint64_t ts;
+  uint64_t dur;
+  /* the event ID of a command, the ID of a flow */
+  uint64_t id;
+  /* the queue ID of a command or flow target */
+  uint64_t track;
+  /* the queue and the end time of the source of a flow */
+  uint64_t src_track;
+  uint64_t src_ts;
+  uint8_t kind;
+  char category[15];
+  char name[48];
+} perfetto_record;
+
+typedef struct perfetto_ring perfetto_ring;
+struct perfetto_ring
+{
+  perfetto_ring *next;
+  unsigned index;
+  char thread_name[32];
+  volatile uint64_t written;
+  perfetto_record records[PERFETTO_RING_RECORDS];
+};
+
+int pocl_tracing_spans_enabled = 0;
+
+static pthread_key_t perfetto_ring_key;
+static perfetto_ring *volatile perfetto_rings = NULL;
+static volatile unsigned perfetto_num_rings = 0;
+static volatile uint64_t perfetto_flow_ids = 0;
+static volatile int perfetto_written = 0;
+static const char *perfetto_output = NULL;
+
+static perfetto_ring *
+perfetto_get_ring ()
+{
+  perfetto_ring *ring
+      = (perfetto_ring *)pthread_getspecific (perfetto_ring_key);
+  if (ring)
+    return ring;
+
+  ring = (perfetto_ring *)calloc (1, sizeof (perfetto_ring));
+  if (ring == NULL)
+    return NULL;
+  ring->index = POCL_ATOMIC_INC (perfetto_num_rings);
+  snprintf (ring->thread_name, sizeof (ring->thread_name), "thread %u",
+            ring->index);
+  if (pthread_setspecific (perfetto_ring_key, ring) != 0)
+    {
+      free (ring);
+      return NULL;
+    }
+  /* the rings live until exit, for writing the trace */
+  perfetto_ring *old;
+  do
+    {
+      old = perfetto_rings;
+      ring->next = old;
+    }
+  while (POCL_ATOMIC_CAS (&perfetto_rings, old, ring) != old);
+  return ring;
+}
+
+/* Returns the next record of the calling thread, to be filled and then
+ * published with perfetto_commit. */
+static perfetto_record *
+perfetto_next (perfetto_ring *ring)
+{
+  return &ring->records[ring->written % PERFETTO_RING_RECORDS];
+}
+
+static void
+perfetto_commit (perfetto_ring *ring)
+{
+  __atomic_store_n (&ring->written, ring->written + 1, __ATOMIC_RELEASE);
+}
+
+void
+pocl_tracing_span (const char *category, const char *name, uint64_t start_ns,
+                   uint64_t end_ns)
+{
+  perfetto_ring *ring = perfetto_get_ring ();
+  if (ring == NULL)
+    return;
+  perfetto_record *r = perfetto_next (ring);
+  r->kind = PERFETTO_SPAN;
+  r->ts = start_ns;
+  r->dur = end_ns - start_ns;
+  r->track = ring->index;
+  snprintf (r->category, sizeof (r->category), "%s", category);
+  snprintf (r->name, sizeof (r->name), "%s", name);
+  perfetto_commit (ring);
+}
+
+void
+pocl_tracing_thread_name (const char *name)
+{
+  if (!pocl_tracing_spans_enabled)
+    return;
+  perfetto_ring *ring = perfetto_get_ring ();
+  if (ring)
+    snprintf (ring->thread_name, sizeof (ring->thread_name), "%s", name);
+}
+
+static void
+perfetto_tracer_event_updated (cl_event event, int status)
+{
+  _cl_command_node *node = event->command;
+  cl_command_queue cq = event->queue;
+
+  if (status != CL_COMPLETE || node == NULL || cq == NULL)
+    return;
+
+  perfetto_ring *ring = perfetto_get_ring ();
+  if (ring == NULL)
+    return;
+
+  const pocl_event_profile *prof = pocl_event_profile_of (event);
+  perfetto_record *r = perfetto_next (ring);
+  r->kind = PERFETTO_COMMAND;
+  r->ts = prof->time_start;
+  r->dur = (prof->time_end > prof->time_start)
+               ? prof->time_end - prof->time_start
+               : 0;
+  r->id = event->id;
+  r->track = cq->id;
+  snprintf (r->category, sizeof (r->category), "%s",
+            cq->device->short_name);
+  if (node->type == CL_COMMAND_NDRANGE_KERNEL)
+    snprintf (r->name, sizeof (r->name), "%s", node->command.run.kernel->name);
+  else
+    snprintf (r->name, sizeof (r->name), "%s",
+              pocl_command_to_str (event->command_type));
+  perfetto_commit (ring);
+
+  pocl_event_md *md = event->meta_data;
+  size_t i;
+  for (i = 0; md && i < md->num_deps; ++i)
+    {
+      /* the dependencies on user events have no track */
+      if (md->dep_queue_ids[i] == 0 || md->dep_ts[i] == 0)
+        continue;
+      r = perfetto_next (ring);
+      r->kind = PERFETTO_FLOW;
+      r->id = POCL_ATOMIC_INC (perfetto_flow_ids);
+      r->ts = prof->time_start;
+      r->track = cq->id;
+      r->src_track = md->dep_queue_ids[i];
+      /* inside the source slice, for the viewers to bind to it */
+      r->src_ts = md->dep_ts[i] - 1;
+      perfetto_commit (ring);
+    }
+}
+
+/* Chrome traces have microsecond timestamps. */
+#define PERFETTO_US(ns) ((ns) / 1000), (unsigned)((ns) % 1000)
+
+static void
+perfetto_write_metadata (FILE *f, unsigned pid, uint64_t tid,
+                         const char *name, int *first)
+{
+  fprintf (f,
+           "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+           "\"tid\":%" PRIu64 ",\"args\":{\"name\":\"%s\"}}",
+           *first ? "" : ",\n", pid, tid, name);
+  *first = 0;
+}
+
+static void
+perfetto_tracer_write ()
+{
+  if (__sync_lock_test_and_set (&perfetto_written, 1))
+    return;
+
+  FILE *f = fopen (perfetto_output, "w");
+  if (f == NULL)
+    {
+      POCL_MSG_ERR ("PERFETTO TRACER: can't open %s\n", perfetto_output);
+      return;
+    }
+
+  /* pid 1 has the queue tracks, pid 2 the thread tracks */
+  int first = 1;
+  fprintf (f, "{\"traceEvents\":[\n"
+              "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"args\":{\"name\":\"pocl command queues\"}},\n"
+              "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+              "\"args\":{\"name\":\"pocl threads\"}}");
+  first = 0;
+
+  uint64_t *queues = NULL;
+  size_t num_queues = 0, i;
+  perfetto_ring *ring;
+  for (ring = perfetto_rings; ring; ring = ring->next)
+    {
+      perfetto_write_metadata (f, 2, ring->index, ring->thread_name, &first);
+
+      uint64_t end = __atomic_load_n (&ring->written, __ATOMIC_ACQUIRE);
+      uint64_t n = (end > PERFETTO_RING_RECORDS) ? PERFETTO_RING_RECORDS : end;
+      uint64_t k;
+      for (k = end - n; k < end; ++k)
+        {
+          perfetto_record *r = &ring->records[k % PERFETTO_RING_RECORDS];
+          switch (r->kind)
+            {
+            case PERFETTO_COMMAND:
+              for (i = 0; i < num_queues; ++i)
+                if (queues[i] == r->track)
+                  break;
+              if (i == num_queues)
+                {
+                  uint64_t *q = realloc (queues, (num_queues + 1)
+                                                     * sizeof (uint64_t));
+                  if (q)
+                    {
+                      queues = q;
+                      queues[num_queues++] = r->track;
+                      char qname[32];
+                      snprintf (qname, sizeof (qname), "queue %" PRIu64,
+                                r->track);
+                      perfetto_write_metadata (f, 1, r->track, qname, &first);
+                    }
+                }
+              fprintf (f,
+                       ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                       "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+                       "\"pid\":1,\"tid\":%" PRIu64
+                       ",\"args\":{\"event\":%" PRIu64 "}}",
+                       r->name, r->category, PERFETTO_US (r->ts),
+                       PERFETTO_US (r->dur), r->track, r->id);
+              break;
+            case PERFETTO_SPAN:
+              fprintf (f,
+                       ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                       "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+                       "\"pid\":2,\"tid\":%" PRIu64 "}",
+                       r->name, r->category, PERFETTO_US (r->ts),
+                       PERFETTO_US (r->dur), r->track);
+              break;
+            case PERFETTO_FLOW:
+              fprintf (f,
+                       ",\n{\"name\":\"dep\",\"cat\":\"dep\",\"ph\":\"s\","
+                       "\"id\":%" PRIu64 ",\"ts\":%" PRIu64 ".%03u,"
+                       "\"pid\":1,\"tid\":%" PRIu64 "}",
+                       r->id, PERFETTO_US (r->src_ts), r->src_track);
+              fprintf (f,
+                       ",\n{\"name\":\"dep\",\"cat\":\"dep\",\"ph\":\"f\","
+                       "\"bp\":\"e\",\"id\":%" PRIu64
+                       ",\"ts\":%" PRIu64 ".%03u,"
+                       "\"pid\":1,\"tid\":%" PRIu64 "}",
+                       r->id, PERFETTO_US (r->ts), r->track);
+              break;
+            default:
+              break;
+            }
+        }
+    }
+  fprintf (f, "\n]}\n");
+  fclose (f);
+  free (queues);
+}
+
+static void
+perfetto_tracer_init ()
+{
+  perfetto_output
+      = pocl_get_string_option ("POCL_TRACING_OPT", "pocl_trace.json");
+  if (pthread_key_create (&perfetto_ring_key, NULL) != 0)
+    POCL_ABORT ("Failed to create the perfetto tracer key\n");
+  pocl_tracing_spans_enabled = 1;
+  atexit (perfetto_tracer_write);
+}
+
+static const struct pocl_event_tracer perfetto_tracer = {
+  "perfetto",
+  perfetto_tracer_init,
+  perfetto_tracer_write,
+  perfetto_tracer_event_updated,
+};
+
 //#################################################################
 
 #ifdef HAVE_LTTNG_UST
@@ -536,7 +1019,8 @@ static const struct pocl_event_tracer *pocl_event_tracers[]
 #ifdef HAVE_LTTNG_UST
         &lttng_tracer,
 #endif
-        &cq_profiler
+        &cq_profiler,
+        &perfetto_tracer
       };
 
 #define POCL_TRACER_COUNT                                                     \
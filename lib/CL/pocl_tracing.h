@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "pocl_cl.h"
+#include "pocl_export.h"
 
 #ifdef __GNUC__
 #pragma GCC visibility push(hidden)
@@ -47,6 +48,21 @@ void pocl_event_tracing_init ();
 /* Stops event tracing system */
 void pocl_event_tracing_finish ();
 
+/* Set when the tracer records spans of pocl's own work, with
+   pocl_tracing_span. */
+POCL_EXPORT
+extern int pocl_tracing_spans_enabled;
+
+/* Records the span of work from start_ns to end_ns (pocl_gettimemono_ns)
+   on the track of the calling thread. */
+POCL_EXPORT
+void pocl_tracing_span (const char *category, const char *name,
+                        uint64_t start_ns, uint64_t end_ns);
+
+/* Names the track of the calling thread. */
+POCL_EXPORT
+void pocl_tracing_thread_name (const char *name);
+
 /* Struct of trace handlers. */
 struct pocl_event_tracer
 {
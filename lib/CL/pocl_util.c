@@ -38,6 +38,11 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <utime.h>
+#ifdef __linux__
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#endif
 #else
 #  include "vccompat.hpp"
 #endif
@@ -46,9 +51,12 @@
 #include "devices.h"
 #include "pocl_cache.h"
 #include "pocl_file_util.h"
+#include "pocl_half.h"
 #include "pocl_llvm.h"
 #include "pocl_mem_management.h"
+#include "pocl_perf_counters.h"
 #include "pocl_runtime_config.h"
+#include "pocl_stats.h"
 #include "pocl_timing.h"
 #include "pocl_util.h"
 #include "utlist.h"
@@ -361,6 +369,103 @@ pocl_aligned_malloc (size_t alignment, size_t size)
 #endif
 }
 
+#define POCL_THP_SIZE ((size_t)2 << 20)
+
+/* 0 if POCL_HUGE_PAGES is off */
+static size_t huge_page_size = 0;
+/* the mmap flags for the huge pages, 0 for transparent huge pages only */
+static int huge_page_mmap_flags = 0;
+static pthread_once_t huge_page_once = PTHREAD_ONCE_INIT;
+
+static void
+init_huge_pages (void)
+{
+  const char *mode = pocl_get_string_option ("POCL_HUGE_PAGES", "off");
+  if (strcmp (mode, "off") == 0 || strcmp (mode, "0") == 0)
+    return;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (strcmp (mode, "thp") == 0)
+    huge_page_size = POCL_THP_SIZE;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  else if (strcmp (mode, "2M") == 0)
+    {
+      huge_page_size = POCL_THP_SIZE;
+      huge_page_mmap_flags = MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+    }
+  else if (strcmp (mode, "1G") == 0)
+    {
+      huge_page_size = (size_t)1 << 30;
+      huge_page_mmap_flags = MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+    }
+#endif
+  else
+    POCL_MSG_WARN ("Unknown POCL_HUGE_PAGES mode '%s'\n", mode);
+#else
+  POCL_MSG_WARN ("POCL_HUGE_PAGES is not supported on this system\n");
+#endif
+}
+
+size_t
+pocl_huge_page_size (void)
+{
+  PTHREAD_CHECK (pthread_once (&huge_page_once, init_huge_pages));
+  return huge_page_size;
+}
+
+int
+pocl_use_huge_pages (size_t size)
+{
+  size_t page = pocl_huge_page_size ();
+  return page != 0 && size >= page;
+}
+
+void *
+pocl_huge_page_alloc (size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  assert (pocl_use_huge_pages (size));
+  size_t len = pocl_align_value (size, huge_page_size);
+  char *p = MAP_FAILED;
+
+  if (huge_page_mmap_flags)
+    {
+      p = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | huge_page_mmap_flags, -1, 0);
+      if (p != MAP_FAILED)
+        return p;
+      POCL_MSG_PRINT_MEMORY ("No free %zu KB huge pages for %zu bytes, "
+                             "using transparent huge pages\n",
+                             huge_page_size >> 10, size);
+    }
+
+  /* Transparent huge pages need 2MB aligned memory; map one page more and
+   * unmap the unaligned head and tail. */
+  p = mmap (NULL, len + POCL_THP_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  size_t head = pocl_align_value ((uintptr_t)p, POCL_THP_SIZE) - (uintptr_t)p;
+  if (head)
+    munmap (p, head);
+  if (POCL_THP_SIZE - head)
+    munmap (p + head + len, POCL_THP_SIZE - head);
+  p += head;
+  madvise (p, len, MADV_HUGEPAGE);
+  return p;
+#else
+  return NULL;
+#endif
+}
+
+void
+pocl_huge_page_free (void *ptr, size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (ptr)
+    munmap (ptr, pocl_align_value (size, huge_page_size));
+#endif
+}
+
 #if 0
 void
 pocl_aligned_free (void *ptr)
@@ -417,7 +522,8 @@ pocl_unlock_events_inorder (cl_event ev1, cl_event ev2)
  * we don't want to enqueue >1 migrations for the same buffer.
  */
 static void
-sort_and_uniq (cl_mem *objs, char *readonly_flags, size_t *num_objs)
+sort_and_uniq (cl_mem *objs, char *readonly_flags, pocl_mem_range *ranges,
+               size_t *num_objs)
 {
   size_t i;
   ssize_t j;
@@ -428,50 +534,81 @@ sort_and_uniq (cl_mem *objs, char *readonly_flags, size_t *num_objs)
    * replace with actual storage */
   for (i = 0; i < n; ++i)
     if (objs[i]->buffer)
-      objs[i] = objs[i]->buffer;
+      {
+        objs[i] = objs[i]->buffer;
+        if (ranges)
+          ranges[i].size = 0;
+      }
 
   /* sort by obj id */
   for (i = 1; i < n; ++i)
     {
       cl_mem buf = objs[i];
       char c = readonly_flags[i];
+      pocl_mem_range r = { 0, 0 };
+      if (ranges)
+        r = ranges[i];
       for (j = (i - 1); ((j >= 0) && (objs[j]->id > buf->id)); --j)
         {
           objs[j + 1] = objs[j];
           readonly_flags[j + 1] = readonly_flags[j];
+          if (ranges)
+            ranges[j + 1] = ranges[j];
         }
       objs[j + 1] = buf;
       readonly_flags[j + 1] = c;
+      if (ranges)
+        ranges[j + 1] = r;
     }
 
-  /* skip the first i objects which are different */
+  /* uniq; a buffer is written if any of its uses writes it, and the
+   * written range covers the ranges of all the writing uses */
+  size_t k = 0;
   for (i = 1; i < n; ++i)
-    if (objs[i - 1] == objs[i])
-      break;
-
-  /* uniq */
-  size_t k = i;
-  while (i < n)
     {
-      if (objs[k] != objs[i])
+      if (objs[i] != objs[k])
         {
+          ++k;
           objs[k] = objs[i];
           readonly_flags[k] = readonly_flags[i];
-          ++k;
+          if (ranges)
+            ranges[k] = ranges[i];
+          continue;
         }
-      else
+
+      if (ranges && !readonly_flags[i])
         {
-          readonly_flags[k] = readonly_flags[k] & readonly_flags[i];
+          if (readonly_flags[k])
+            ranges[k] = ranges[i];
+          else if (ranges[k].size == 0 || ranges[i].size == 0)
+            ranges[k].size = 0;
+          else
+            {
+              size_t start = min (ranges[k].offset, ranges[i].offset);
+              size_t end = max (ranges[k].offset + ranges[k].size,
+                                ranges[i].offset + ranges[i].size);
+              ranges[k].offset = start;
+              ranges[k].size = end - start;
+            }
         }
-      ++i;
+      readonly_flags[k] = readonly_flags[k] & readonly_flags[i];
     }
 
-  *num_objs = k;
+  *num_objs = k + 1;
 }
 
 extern unsigned long event_c;
 extern unsigned long uevent_c;
 
+int
+pocl_event_alloc_profile (cl_event event)
+{
+  if (event->profile == NULL)
+    event->profile
+        = (pocl_event_profile *)calloc (1, sizeof (pocl_event_profile));
+  return event->profile != NULL;
+}
+
 cl_int
 pocl_create_event (cl_event *event, cl_command_queue command_queue,
                    cl_command_type command_type, size_t num_buffers,
@@ -487,6 +624,18 @@ pocl_create_event (cl_event *event, cl_command_queue command_queue,
   if (*event == NULL)
     return CL_OUT_OF_HOST_MEMORY;
 
+  /* the other events get no time stamps */
+  if (command_queue
+      && ((command_queue->properties & CL_QUEUE_PROFILING_ENABLE)
+          || pocl_perf_num_counters)
+      && !pocl_event_alloc_profile (*event))
+    {
+      POCL_DESTROY_OBJECT (*event);
+      pocl_mem_manager_free_event (*event);
+      *event = NULL;
+      return CL_OUT_OF_HOST_MEMORY;
+    }
+
   (*event)->context = context;
   (*event)->queue = command_queue;
 
@@ -501,10 +650,14 @@ pocl_create_event (cl_event *event, cl_command_queue command_queue,
   (*event)->num_buffers = num_buffers;
   if (num_buffers > 0)
     {
+      size_t i;
       (*event)->mem_objs = (cl_mem *)malloc (num_buffers * sizeof (cl_mem));
       memcpy ((*event)->mem_objs, buffers, num_buffers * sizeof (cl_mem));
+      for (i = 0; i < num_buffers; ++i)
+        POCL_ATOMIC_INC (buffers[i]->command_count);
     }
   (*event)->status = CL_QUEUED;
+  (*event)->trace_filtered = 0;
 
   if (command_type == CL_COMMAND_USER)
     POCL_ATOMIC_INC (uevent_c);
@@ -518,6 +671,10 @@ pocl_create_event (cl_event *event, cl_command_queue command_queue,
   return CL_SUCCESS;
 }
 
+/* Adds an edge from notifier_event to waiting_event. The wait list given to
+ * an enqueue can name the same event twice; that just adds two edges, both
+ * removed when the notifier finishes, so there is no search for duplicates
+ * (which made building a node with thousands of dependencies quadratic). */
 static int
 pocl_create_event_sync (cl_event waiting_event, cl_event notifier_event)
 {
@@ -531,31 +688,37 @@ pocl_create_event_sync (cl_event waiting_event, cl_event notifier_event)
                          " , notifier %" PRIu64 "\n",
                          waiting_event->id, notifier_event->id);
 
+  notify_target = pocl_mem_manager_new_event_node ();
+  wait_list_item = pocl_mem_manager_new_event_node ();
+  if (!notify_target || !wait_list_item)
+    {
+      if (notify_target)
+        pocl_mem_manager_free_event_node (notify_target);
+      if (wait_list_item)
+        pocl_mem_manager_free_event_node (wait_list_item);
+      return CL_OUT_OF_HOST_MEMORY;
+    }
+  notify_target->event = waiting_event;
+  notify_target->peer = wait_list_item;
+  wait_list_item->event = notifier_event;
+  wait_list_item->peer = notify_target;
+
   pocl_lock_events_inorder (waiting_event, notifier_event);
 
   assert (notifier_event->pocl_refcount != 0);
   assert (waiting_event != notifier_event);
 
-  LL_FOREACH (waiting_event->wait_list, wait_list_item)
+  /* pocl_broadcast has run or is about to run for it */
+  if (notifier_event->status == CL_COMPLETE)
     {
-      if (wait_list_item->event == notifier_event)
-        {
-          POCL_MSG_PRINT_EVENTS ("Skipping event sync creation \n");
-          goto FINISH;
-        }
+      pocl_unlock_events_inorder (waiting_event, notifier_event);
+      pocl_mem_manager_free_event_node (notify_target);
+      pocl_mem_manager_free_event_node (wait_list_item);
+      return CL_SUCCESS;
     }
 
-  if (notifier_event->status == CL_COMPLETE)
-    goto FINISH;
-  notify_target = pocl_mem_manager_new_event_node();
-  wait_list_item = pocl_mem_manager_new_event_node();
-  if (!notify_target || !wait_list_item)
-    return CL_OUT_OF_HOST_MEMORY;
-    
-  notify_target->event = waiting_event;
-  wait_list_item->event = notifier_event;
   LL_PREPEND (notifier_event->notify_list, notify_target);
-  LL_PREPEND (waiting_event->wait_list, wait_list_item);
+  DL_PREPEND (waiting_event->wait_list, wait_list_item);
 
   if (pocl_is_tracing_enabled ())
     {
@@ -563,33 +726,242 @@ pocl_create_event_sync (cl_event waiting_event, cl_event notifier_event)
         waiting_event->meta_data = (pocl_event_md *) calloc (1, sizeof (pocl_event_md));
       pocl_event_md *md = waiting_event->meta_data;
       if (md->num_deps < MAX_EVENT_DEPS)
-        md->dep_ids[md->num_deps++] = notifier_event->id;
+        {
+          md->dep_queue_ids[md->num_deps]
+              = notifier_event->queue ? notifier_event->queue->id : 0;
+          md->dep_ids[md->num_deps++] = notifier_event->id;
+        }
     }
 
-FINISH:
   pocl_unlock_events_inorder (waiting_event, notifier_event);
   return CL_SUCCESS;
 }
 
+/* Removes mem from the LRU list of its context, if it is in it.
+ * Must be called with the mem_lru_lock held. */
+static void
+pocl_mem_lru_unlink (cl_context context, cl_mem mem)
+{
+  if (mem->lru_prev)
+    mem->lru_prev->lru_next = mem->lru_next;
+  else if (context->mem_lru_first == mem)
+    context->mem_lru_first = mem->lru_next;
+  else
+    return;
+
+  if (mem->lru_next)
+    mem->lru_next->lru_prev = mem->lru_prev;
+  else
+    context->mem_lru_last = mem->lru_prev;
+  mem->lru_prev = mem->lru_next = NULL;
+}
+
+/* Moves mem to the most recently used end of the LRU list. */
+static void
+pocl_mem_lru_touch (cl_mem mem)
+{
+  cl_context context = mem->context;
+  POCL_LOCK (context->mem_lru_lock);
+  pocl_mem_lru_unlink (context, mem);
+  mem->lru_prev = context->mem_lru_last;
+  if (context->mem_lru_last)
+    context->mem_lru_last->lru_next = mem;
+  else
+    context->mem_lru_first = mem;
+  context->mem_lru_last = mem;
+  POCL_UNLOCK (context->mem_lru_lock);
+}
+
+void
+pocl_mem_lru_remove (cl_mem mem)
+{
+  cl_context context = mem->context;
+  POCL_LOCK (context->mem_lru_lock);
+  pocl_mem_lru_unlink (context, mem);
+  POCL_UNLOCK (context->mem_lru_lock);
+}
+
+/* Whether the memory of mem on dev can be freed: nothing uses the buffer
+ * on the device, and its host memory is the runtime's, not the user's or
+ * a driver's preallocation. Must be called with mem locked. */
+static int
+pocl_mem_evictable (cl_device_id dev, cl_mem mem)
+{
+  pocl_mem_identifier *p = &mem->device_ptrs[dev->global_mem_id];
+  return mem->pocl_refcount > 0 && p->mem_ptr != NULL
+         && mem->command_count == 0 && mem->map_count == 0
+         && (mem->flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)) == 0;
+}
+
+/* Returns the least recently used buffer that could be evicted from dev,
+ * other than the objs of the command being created, retained. */
+static cl_mem
+pocl_find_eviction_victim (cl_device_id dev, cl_mem *objs, size_t num_objs)
+{
+  cl_context context = objs[0]->context;
+  cl_mem mem, victim = NULL;
+  size_t i;
+
+  POCL_LOCK (context->mem_lru_lock);
+  for (mem = context->mem_lru_first; mem != NULL && victim == NULL;
+       mem = mem->lru_next)
+    {
+      for (i = 0; i < num_objs; ++i)
+        if (objs[i] == mem)
+          break;
+      if (i < num_objs)
+        continue;
+
+      POCL_LOCK_OBJ (mem);
+      if (pocl_mem_evictable (dev, mem))
+        {
+          POCL_RETAIN_OBJECT_UNLOCKED (mem);
+          victim = mem;
+        }
+      POCL_UNLOCK_OBJ (mem);
+    }
+  POCL_UNLOCK (context->mem_lru_lock);
+
+  return victim;
+}
+
+/* Frees the memory of mem on dev, after migrating its content to
+ * mem_host_ptr if the host does not have the latest version yet. The next
+ * command using the buffer on a device migrates it back as usual.
+ * Releases mem; returns 1 if the memory was freed. */
+static int
+pocl_evict_mem (cl_device_id dev, cl_mem mem)
+{
+  cl_context context = mem->context;
+  pocl_mem_identifier *p = &mem->device_ptrs[dev->global_mem_id];
+  cl_command_queue cq = NULL;
+  int need_export = 0, have_hostptr = 0, evicted = 0;
+  unsigned i;
+
+  for (i = 0; i < context->num_devices; ++i)
+    if (pocl_real_dev (context->devices[i]) == dev)
+      cq = context->default_queues[i];
+
+  /* hold the host copy over the export, whose own reference to it ends
+   * when it completes */
+  POCL_LOCK_OBJ (mem);
+  if (cq != NULL && pocl_mem_evictable (dev, mem)
+      && pocl_alloc_or_retain_mem_host_ptr (mem) == 0)
+    {
+      have_hostptr = 1;
+      need_export = (mem->mem_host_ptr_version < mem->latest_version);
+    }
+  POCL_UNLOCK_OBJ (mem);
+
+  if (have_hostptr && need_export)
+    {
+      _cl_command_node *cmd = NULL;
+      cl_event ev = NULL;
+      char rdonly = 1;
+      POCL_MSG_PRINT_MEMORY ("Evicting buffer %p from %s to the host\n", mem,
+                             dev->short_name);
+      if (pocl_create_command_migrate (&cmd, cq, CL_MIGRATE_MEM_OBJECT_HOST,
+                                       &ev, 0, NULL, 1, &mem, &rdonly)
+          == CL_SUCCESS)
+        {
+          cmd->command.migrate.type = ENQUEUE_MIGRATE_TYPE_NOP;
+          pocl_command_enqueue (cq, cmd);
+          POname (clWaitForEvents) (1, &ev);
+          POname (clReleaseEvent) (ev);
+        }
+    }
+
+  /* a command may have started using the buffer meanwhile */
+  POCL_LOCK_OBJ (mem);
+  if (have_hostptr && pocl_mem_evictable (dev, mem)
+      && mem->mem_host_ptr_version == mem->latest_version)
+    {
+      POCL_MSG_PRINT_MEMORY ("Evicted buffer %p from %s, %zu bytes\n", mem,
+                             dev->short_name, mem->size);
+      dev->ops->free (dev, mem);
+      p->mem_ptr = NULL;
+      p->version = 0;
+      evicted = 1;
+      if (!mem->mem_host_ptr_evicted)
+        {
+          /* our reference now keeps the host copy */
+          mem->mem_host_ptr_evicted = 1;
+          have_hostptr = 0;
+        }
+    }
+  if (have_hostptr)
+    pocl_release_mem_host_ptr (mem);
+  POCL_UNLOCK_OBJ (mem);
+
+  POname (clReleaseMemObject) (mem);
+  return evicted;
+}
+
+/* Ends the pins can_run_command took on the buffers. */
+static void
+pocl_unpin_mem_objs (size_t num_objs, cl_mem *objs)
+{
+  size_t i;
+  for (i = 0; i < num_objs; ++i)
+    POCL_ATOMIC_DEC (objs[i]->command_count);
+}
+
+/* Whether the global memory of dev is the host's: the CPU drivers share
+ * the global memory id 0 for it, but the first device of any driver also
+ * gets the id 0 by default. */
+static int
+pocl_dev_mem_is_host (cl_device_id dev)
+{
+  return dev->global_mem_id == 0 && dev->host_unified_memory;
+}
+
 /* preallocate the buffers on destination device.
- * if any allocation fails, we can't run this command. */
+ * if any allocation fails, we can't run this command.
+ *
+ * If the device is out of memory, the least recently used buffers no
+ * command is using are evicted from it. The buffers are pinned (their
+ * command_count raised) so that they can't be evicted until the command's
+ * events take over. */
 static int
 can_run_command (cl_device_id dev, size_t num_objs, cl_mem *objs)
 {
   size_t i;
-  int errcode;
 
   for (i = 0; i < num_objs; ++i)
     {
-      pocl_mem_identifier *p = &objs[i]->device_ptrs[dev->global_mem_id];
-      // skip already allocated
-      if (p->mem_ptr)
-        continue;
+      cl_mem mem = objs[i];
+      pocl_mem_identifier *p = &mem->device_ptrs[dev->global_mem_id];
+      int allocated;
 
-      assert (dev->ops->alloc_mem_obj);
-      errcode = dev->ops->alloc_mem_obj (dev, objs[i], NULL);
-      if (errcode != CL_SUCCESS)
-        return CL_FALSE;
+      for (;;)
+        {
+          POCL_LOCK_OBJ (mem);
+          allocated = (p->mem_ptr != NULL);
+          if (!allocated)
+            {
+              assert (dev->ops->alloc_mem_obj);
+              allocated
+                  = (dev->ops->alloc_mem_obj (dev, mem, NULL) == CL_SUCCESS);
+            }
+          if (allocated)
+            POCL_ATOMIC_INC (mem->command_count);
+          POCL_UNLOCK_OBJ (mem);
+
+          if (allocated || pocl_dev_mem_is_host (dev))
+            break;
+
+          cl_mem victim = pocl_find_eviction_victim (dev, objs, num_objs);
+          if (victim == NULL || !pocl_evict_mem (dev, victim))
+            break;
+        }
+
+      if (!allocated)
+        {
+          pocl_unpin_mem_objs (i, objs);
+          return CL_FALSE;
+        }
+      if (!pocl_dev_mem_is_host (dev))
+        pocl_mem_lru_touch (mem);
     }
 
   return CL_TRUE;
@@ -606,6 +978,11 @@ pocl_create_command_struct (_cl_command_node **cmd,
   int err;
   cl_event *event = NULL;
 
+  /* only the kernels can enqueue to the device queues */
+  POCL_RETURN_ERROR_ON ((command_queue->properties & CL_QUEUE_ON_DEVICE),
+                        CL_INVALID_COMMAND_QUEUE,
+                        "Cannot enqueue host commands to a device queue\n");
+
   *cmd = pocl_mem_manager_new_command ();
   if (*cmd == NULL)
     return CL_OUT_OF_HOST_MEMORY;
@@ -641,10 +1018,14 @@ pocl_create_command_struct (_cl_command_node **cmd,
   (*cmd)->device = command_queue->device;
   (*cmd)->event->command = (*cmd);
 
-  /* Form event synchronizations based on the given wait list */
+  /* Form event synchronizations based on the given wait list. A command
+     waiting in the batch of another queue must reach its device, or this
+     one could wait for it forever. */
   for (i = 0; i < num_events; ++i)
     {
       cl_event wle = wait_list[i];
+      if (wle->queue != NULL && wle->queue != command_queue)
+        pocl_submit_batch (wle->queue);
       pocl_create_event_sync ((*event), wle);
     }
   POCL_MSG_PRINT_EVENTS (
@@ -653,10 +1034,173 @@ pocl_create_command_struct (_cl_command_node **cmd,
   return CL_SUCCESS;
 }
 
+/* Updates the dirty range of mem after a command that writes write_range
+ * of it (NULL or size 0 = anything) raised latest_version from
+ * prev_version. */
+static void
+pocl_update_dirty_range (cl_mem mem, uint64_t prev_version,
+                         const pocl_mem_range *write_range)
+{
+  uint64_t new_version = mem->latest_version;
+
+  if (write_range == NULL || write_range->size == 0 || mem->is_image
+      || new_version != prev_version + 1)
+    {
+      /* only the copies with the new version are up to date */
+      mem->dirty_base_version = new_version;
+      mem->dirty_start = mem->dirty_end = 0;
+    }
+  else
+    {
+      size_t start = write_range->offset;
+      size_t end = write_range->offset + write_range->size;
+      if (mem->dirty_version != prev_version)
+        {
+          /* the versions before prev_version are unknown, start over */
+          mem->dirty_base_version = prev_version;
+          mem->dirty_start = start;
+          mem->dirty_end = end;
+        }
+      else if (mem->dirty_start == mem->dirty_end)
+        {
+          mem->dirty_start = start;
+          mem->dirty_end = end;
+        }
+      else
+        {
+          mem->dirty_start = min (mem->dirty_start, start);
+          mem->dirty_end = max (mem->dirty_end, end);
+        }
+    }
+  mem->dirty_version = new_version;
+}
+
+/* Returns the range of mem a copy with the given version needs to get
+ * from a copy with the latest version. */
+static void
+pocl_get_migration_range (cl_mem mem, uint64_t version, size_t *offset,
+                          size_t *size)
+{
+  if (!mem->is_image && mem->dirty_version == mem->latest_version
+      && version >= mem->dirty_base_version)
+    {
+      *offset = mem->dirty_start;
+      *size = mem->dirty_end - mem->dirty_start;
+    }
+  else
+    {
+      *offset = 0;
+      *size = mem->size;
+    }
+}
+
+/* cl_pocl_content_size: brings the host copy of a size buffer up to date
+ * for the migrations of its content buffer, and takes a reference on the
+ * buffer and its host copy. Returns 0 with *size_ev set to the event the
+ * migrations must wait for (can be NULL), or -1 if the content size is not
+ * known and the whole range must be migrated. */
+static int
+pocl_export_content_size (cl_mem size_buf, cl_event *size_ev)
+{
+  cl_context context = size_buf->context;
+  cl_command_queue cq = NULL;
+  _cl_command_node *cmd = NULL;
+  char rdonly = 1;
+  size_t i;
+
+  *size_ev = NULL;
+  POCL_LOCK_OBJ (size_buf);
+  if (size_buf->mem_host_ptr == NULL)
+    {
+      /* never written with the host copy around: nothing to export from,
+       * unless a device has a newer version */
+      if (size_buf->mem_host_ptr_version == size_buf->latest_version
+          || pocl_alloc_mem_host_ptr (size_buf) != 0)
+        {
+          POCL_UNLOCK_OBJ (size_buf);
+          return -1;
+        }
+    }
+  POCL_RETAIN_OBJECT_UNLOCKED (size_buf);
+  ++size_buf->mem_host_ptr_refcount;
+
+  if (size_buf->mem_host_ptr_version == size_buf->latest_version)
+    {
+      /* only wait for the last writer */
+      *size_ev = size_buf->last_event;
+      if (*size_ev)
+        POname (clRetainEvent) (*size_ev);
+      POCL_UNLOCK_OBJ (size_buf);
+      return 0;
+    }
+
+  for (i = 0; i < context->num_devices; ++i)
+    if (size_buf->device_ptrs[context->devices[i]->global_mem_id].version
+        == size_buf->latest_version)
+      {
+        cq = context->default_queues[i];
+        break;
+      }
+  POCL_UNLOCK_OBJ (size_buf);
+  assert (cq != NULL);
+
+  if (pocl_create_command_migrate (&cmd, cq, CL_MIGRATE_MEM_OBJECT_HOST,
+                                   size_ev, 0, NULL, 1, &size_buf, &rdonly)
+      != CL_SUCCESS)
+    {
+      pocl_release_content_size (size_buf);
+      *size_ev = NULL;
+      return -1;
+    }
+  cmd->command.migrate.type = ENQUEUE_MIGRATE_TYPE_NOP;
+  pocl_command_enqueue (cq, cmd);
+  return 0;
+}
+
+/* Gives a migration command a reference to the size buffer of its
+ * buffer, see pocl_export_content_size. */
+static void
+pocl_set_migration_content_size (_cl_command_node *cmd, cl_mem size_buf)
+{
+  POCL_LOCK_OBJ (size_buf);
+  POCL_RETAIN_OBJECT_UNLOCKED (size_buf);
+  ++size_buf->mem_host_ptr_refcount;
+  POCL_UNLOCK_OBJ (size_buf);
+  cmd->command.migrate.content_size = size_buf;
+}
+
+void
+pocl_release_content_size (cl_mem size_buf)
+{
+  POCL_LOCK_OBJ (size_buf);
+  pocl_release_mem_host_ptr (size_buf);
+  POCL_UNLOCK_OBJ (size_buf);
+  POname (clReleaseMemObject) (size_buf);
+}
+
+size_t
+pocl_content_size_clamp (uint64_t content_size, size_t offset, size_t size)
+{
+  if (content_size <= offset)
+    return 0;
+  return min (size, content_size - offset);
+}
+
+size_t
+pocl_migration_content_size (const _cl_command_migrate *cmd)
+{
+  if (cmd->content_size == NULL)
+    return cmd->size;
+  return pocl_content_size_clamp (
+      *(const uint64_t *)cmd->content_size->mem_host_ptr, cmd->offset,
+      cmd->size);
+}
+
 static int
 pocl_create_migration_commands (cl_device_id dev, cl_event final_event,
                                 cl_mem mem, pocl_mem_identifier *p,
                                 const char readonly,
+                                const pocl_mem_range *write_range,
                                 cl_command_type command_type,
                                 cl_mem_migration_flags mig_flags)
 {
@@ -759,6 +1303,13 @@ pocl_create_migration_commands (cl_device_id dev, cl_event final_event,
     assert ((p->version == mem->latest_version) ||
             (mem->mem_host_ptr_version == mem->latest_version));
 
+  /* the part of the buffer the export (to mem_host_ptr) and the import
+   * (to this device) have to copy, before their versions change below */
+  size_t export_offset, export_size, import_offset, import_size;
+  pocl_get_migration_range (mem, mem->mem_host_ptr_version, &export_offset,
+                            &export_size);
+  pocl_get_migration_range (mem, p->version, &import_offset, &import_size);
+
   /*****************************************************************/
 
   /* buffer must be already allocated on this device's globalmem */
@@ -842,8 +1393,10 @@ FINISH_VER_SETUP:
   /* if the command is a write-use, increase the version. */
   if (!readonly)
     {
+      uint64_t prev_version = mem->latest_version;
       ++p->version;
       mem->latest_version = p->version;
+      pocl_update_dirty_range (mem, prev_version, write_range);
     }
 
   if (do_need_hostptr)
@@ -857,37 +1410,62 @@ FINISH_VER_SETUP:
       /* allocate mem_host_ptr here if needed... */
       if (mem->mem_host_ptr == NULL)
         {
-          size_t align = max (mem->context->min_buffer_alignment, 16);
-          mem->mem_host_ptr = pocl_aligned_malloc (align, mem->size);
-          assert ((mem->mem_host_ptr != NULL)
+          int err = pocl_alloc_mem_host_ptr (mem);
+          assert ((err == 0)
                   && "Cannot allocate backing memory for mem_host_ptr!\n");
         }
     }
 
+  cl_mem size_buf = mem->is_image ? NULL : mem->size_buffer;
+
   POCL_UNLOCK_OBJ (mem);
 
   /*****************************************************************/
 
+  /* with cl_pocl_content_size, the migrations only copy the valid bytes,
+   * which they read from the host copy of the size buffer */
+  cl_event size_ev = NULL;
+  if (size_buf != NULL
+      && (!(do_export || do_import)
+          || pocl_export_content_size (size_buf, &size_ev) != 0))
+    size_buf = NULL;
+
   /* enqueue a command for export.
    * Put the previous last event into its waitlist. */
   if (do_export)
     {
       assert (ex_cq);
       assert (ex_dev);
+      cl_event export_wait[2];
+      cl_uint num_export_wait = 0;
+      if (previous_last_event)
+        export_wait[num_export_wait++] = previous_last_event;
+      if (size_ev)
+        export_wait[num_export_wait++] = size_ev;
       errcode = pocl_create_command_struct (
           &cmd_export, ex_cq, CL_COMMAND_MIGRATE_MEM_OBJECTS,
           &ev_export, // event_p
-          (previous_last_event ? 1 : 0),
-          (previous_last_event ? &previous_last_event : NULL), // waitlist
-          1, &mem                                              // buffer list
+          num_export_wait,
+          (num_export_wait ? export_wait : NULL), // waitlist
+          1, &mem                                 // buffer list
       );
       assert (errcode == CL_SUCCESS);
       if (do_need_hostptr)
         ev_export->release_mem_host_ptr_after = 1;
+      if (size_buf)
+        pocl_set_migration_content_size (cmd_export, size_buf);
 
       cmd_export->command.migrate.mem_id
           = &mem->device_ptrs[ex_dev->global_mem_id];
-      cmd_export->command.migrate.type = ENQUEUE_MIGRATE_TYPE_D2H;
+      cmd_export->command.migrate.type
+          = (export_size ? ENQUEUE_MIGRATE_TYPE_D2H : ENQUEUE_MIGRATE_TYPE_NOP);
+      cmd_export->command.migrate.offset = export_offset;
+      cmd_export->command.migrate.size = export_size;
+      if (export_size)
+        {
+          pocl_stat_add (POCL_STAT_MIGRATIONS, 1);
+          pocl_stat_add (POCL_STAT_MIGRATED_BYTES, export_size);
+        }
 
       pocl_command_enqueue (ex_cq, cmd_export);
 
@@ -901,18 +1479,27 @@ FINISH_VER_SETUP:
       /* the import command must depend on (wait for) either the export
        * command, or the buffer's previous last event. Can be NULL if there's
        * no last event or export command */
-      cl_event import_wait_ev = (ev_export ? ev_export : previous_last_event);
+      cl_event import_wait[2];
+      cl_uint num_import_wait = 0;
+      if (ev_export)
+        import_wait[num_import_wait++] = ev_export;
+      else if (previous_last_event)
+        import_wait[num_import_wait++] = previous_last_event;
+      if (size_ev && ev_export == NULL)
+        import_wait[num_import_wait++] = size_ev;
 
       errcode = pocl_create_command_struct (
           &cmd_import, dev_cq, CL_COMMAND_MIGRATE_MEM_OBJECTS,
           &ev_import, // event_p
-          (import_wait_ev ? 1 : 0),
-          (import_wait_ev ? &import_wait_ev : NULL), // waitlist
-          1, &mem                                    // buffer list
+          num_import_wait,
+          (num_import_wait ? import_wait : NULL), // waitlist
+          1, &mem                                 // buffer list
       );
       assert (errcode == CL_SUCCESS);
       if (do_need_hostptr)
         ev_import->release_mem_host_ptr_after = 1;
+      if (size_buf)
+        pocl_set_migration_content_size (cmd_import, size_buf);
 
       if (can_directly_mig)
         {
@@ -922,14 +1509,26 @@ FINISH_VER_SETUP:
               = &mem->device_ptrs[ex_dev->global_mem_id];
           cmd_import->command.migrate.dst_id
               = &mem->device_ptrs[dev->global_mem_id];
+          cmd_import->command.migrate.offset = import_offset;
+          cmd_import->command.migrate.size = import_size;
         }
       else
         {
-          cmd_import->command.migrate.type = ENQUEUE_MIGRATE_TYPE_H2D;
+          cmd_import->command.migrate.type
+              = (import_size ? ENQUEUE_MIGRATE_TYPE_H2D
+                             : ENQUEUE_MIGRATE_TYPE_NOP);
+          cmd_import->command.migrate.offset = import_offset;
+          cmd_import->command.migrate.size = import_size;
           cmd_import->command.migrate.mem_id
               = &mem->device_ptrs[dev->global_mem_id];
         }
 
+      if (import_size)
+        {
+          pocl_stat_add (POCL_STAT_MIGRATIONS, 1);
+          pocl_stat_add (POCL_STAT_MIGRATED_BYTES, import_size);
+        }
+
       pocl_command_enqueue (dev_cq, cmd_import);
 
       /* because explicit event */
@@ -942,6 +1541,10 @@ FINISH_VER_SETUP:
   /* we don't need it anymore. */
   if (previous_last_event)
     POname (clReleaseEvent (previous_last_event));
+  if (size_ev)
+    POname (clReleaseEvent (size_ev));
+  if (size_buf)
+    pocl_release_content_size (size_buf);
 
   /* the final event must depend on the export/import commands */
   if (last_migration_event)
@@ -966,6 +1569,80 @@ FINISH_VER_SETUP:
   return CL_SUCCESS;
 }
 
+cl_int
+pocl_gather_mem_slices (cl_mem mem, cl_uint num_parts,
+                        const cl_command_queue *part_queues,
+                        const cl_event *part_events,
+                        const pocl_mem_range *slices, cl_event *export_events)
+{
+  cl_uint i, j;
+  int errcode;
+
+  POCL_LOCK_OBJ (mem);
+  uint64_t prev_version = mem->latest_version;
+  ++mem->latest_version;
+  mem->mem_host_ptr_version = mem->latest_version;
+  pocl_update_dirty_range (mem, prev_version, NULL);
+  if (mem->mem_host_ptr == NULL)
+    {
+      int err = pocl_alloc_mem_host_ptr (mem);
+      assert ((err == 0)
+              && "Cannot allocate backing memory for mem_host_ptr!\n");
+    }
+  /* the export commands release the buffer and the host copy */
+  mem->mem_host_ptr_refcount += num_parts;
+  for (i = 0; i < num_parts; ++i)
+    POCL_RETAIN_OBJECT_UNLOCKED (mem);
+  POCL_UNLOCK_OBJ (mem);
+
+  for (i = 0; i < num_parts; ++i)
+    {
+      cl_device_id dev = pocl_real_dev (part_queues[i]->device);
+      cl_command_queue ex_cq = NULL;
+      _cl_command_node *cmd_export = NULL;
+      for (j = 0; j < mem->context->num_devices; ++j)
+        if (mem->context->devices[j] == dev)
+          ex_cq = mem->context->default_queues[j];
+      assert (ex_cq != NULL);
+
+      errcode = pocl_create_command_struct (
+          &cmd_export, ex_cq, CL_COMMAND_MIGRATE_MEM_OBJECTS,
+          &export_events[i], 1, &part_events[i], 1, &mem);
+      assert (errcode == CL_SUCCESS);
+      export_events[i]->release_mem_host_ptr_after = 1;
+
+      cmd_export->command.migrate.mem_id
+          = &mem->device_ptrs[dev->global_mem_id];
+      cmd_export->command.migrate.type
+          = (slices[i].size ? ENQUEUE_MIGRATE_TYPE_D2H
+                            : ENQUEUE_MIGRATE_TYPE_NOP);
+      cmd_export->command.migrate.offset = slices[i].offset;
+      cmd_export->command.migrate.size = slices[i].size;
+      if (slices[i].size)
+        {
+          pocl_stat_add (POCL_STAT_MIGRATIONS, 1);
+          pocl_stat_add (POCL_STAT_MIGRATED_BYTES, slices[i].size);
+        }
+
+      pocl_command_enqueue (ex_cq, cmd_export);
+    }
+
+  return CL_SUCCESS;
+}
+
+void
+pocl_set_mem_last_event (cl_mem mem, cl_event event)
+{
+  POCL_LOCK_OBJ (mem);
+  cl_event previous_last_event = mem->last_event;
+  POname (clRetainEvent) (event);
+  mem->last_event = event;
+  POCL_UNLOCK_OBJ (mem);
+
+  if (previous_last_event)
+    POname (clReleaseEvent) (previous_last_event);
+}
+
 static cl_int
 pocl_create_command_full (_cl_command_node **cmd,
                           cl_command_queue command_queue,
@@ -973,6 +1650,7 @@ pocl_create_command_full (_cl_command_node **cmd,
                           cl_uint num_events, const cl_event *wait_list,
                           size_t num_buffers, cl_mem *buffers,
                           char *readonly_flags,
+                          pocl_mem_range *write_ranges,
                           cl_mem_migration_flags mig_flags)
 {
   cl_device_id dev = pocl_real_dev (command_queue->device);
@@ -988,7 +1666,7 @@ pocl_create_command_full (_cl_command_node **cmd,
       assert (readonly_flags);
 
       if (num_buffers > 1)
-        sort_and_uniq (buffers, readonly_flags, &num_buffers);
+        sort_and_uniq (buffers, readonly_flags, write_ranges, &num_buffers);
 
       if (can_run_command (dev, num_buffers, buffers) == CL_FALSE)
         return CL_OUT_OF_RESOURCES;
@@ -1000,7 +1678,10 @@ pocl_create_command_full (_cl_command_node **cmd,
                                     num_events, wait_list, num_buffers,
                                     buffers);
   if (err)
-    return err;
+    {
+      pocl_unpin_mem_objs (num_buffers, buffers);
+      return err;
+    }
   cl_event final_event = (*cmd)->event;
 
   /* retain once for every buffer; this is because we set every buffer's
@@ -1013,11 +1694,27 @@ pocl_create_command_full (_cl_command_node **cmd,
 
   for (i = 0; i < num_buffers; ++i)
     {
+      cl_mem mem = buffers[i];
       pocl_create_migration_commands (
-          dev, final_event, buffers[i],
-          &buffers[i]->device_ptrs[dev->global_mem_id], readonly_flags[i],
+          dev, final_event, mem, &mem->device_ptrs[dev->global_mem_id],
+          readonly_flags[i], (write_ranges ? &write_ranges[i] : NULL),
           command_type, mig_flags);
+
+      /* an evicted buffer is back on a device, or being migrated there
+       * with a reference to the host copy of its own */
+      if ((mig_flags & CL_MIGRATE_MEM_OBJECT_HOST) == 0
+          && mem->mem_host_ptr_evicted)
+        {
+          POCL_LOCK_OBJ (mem);
+          if (mem->mem_host_ptr_evicted)
+            {
+              mem->mem_host_ptr_evicted = 0;
+              pocl_release_mem_host_ptr (mem);
+            }
+          POCL_UNLOCK_OBJ (mem);
+        }
     }
+  pocl_unpin_mem_objs (num_buffers, buffers);
 
   return err;
 }
@@ -1032,7 +1729,7 @@ pocl_create_command_migrate (_cl_command_node **cmd,
 {
   return pocl_create_command_full (
       cmd, command_queue, CL_COMMAND_MIGRATE_MEM_OBJECTS, event_p, num_events,
-      wait_list, num_buffers, buffers, readonly_flags, flags);
+      wait_list, num_buffers, buffers, readonly_flags, NULL, flags);
 }
 
 cl_int
@@ -1043,7 +1740,160 @@ pocl_create_command (_cl_command_node **cmd, cl_command_queue command_queue,
 {
   return pocl_create_command_full (cmd, command_queue, command_type, event_p,
                                    num_events, wait_list, num_buffers, buffers,
-                                   readonly_flags, 0);
+                                   readonly_flags, NULL, 0);
+}
+
+cl_int
+pocl_create_command_ranges (_cl_command_node **cmd,
+                            cl_command_queue command_queue,
+                            cl_command_type command_type, cl_event *event_p,
+                            cl_uint num_events, const cl_event *wait_list,
+                            size_t num_buffers, cl_mem *buffers,
+                            char *readonly_flags, pocl_mem_range *write_ranges)
+{
+  return pocl_create_command_full (cmd, command_queue, command_type, event_p,
+                                   num_events, wait_list, num_buffers, buffers,
+                                   readonly_flags, write_ranges, 0);
+}
+
+static void pocl_ndrange_node_cleanup (_cl_command_node *node);
+
+cl_int
+pocl_create_recorded_command (
+    _cl_command_node **cmd, cl_command_buffer_khr command_buffer,
+    cl_command_queue command_queue, cl_command_type command_type,
+    cl_uint num_sync_points, const cl_sync_point_khr *sync_point_wait_list,
+    size_t num_buffers, const cl_mem *buffers, const char *readonly_flags,
+    const pocl_mem_range *write_ranges)
+{
+  pocl_recorded_command *rec;
+  size_t i;
+
+  POCL_RETURN_ERROR_COND ((!IS_CL_OBJECT_VALID (command_buffer)),
+                          CL_INVALID_COMMAND_BUFFER_KHR);
+  assert (command_queue == command_buffer->queue);
+
+  POCL_RETURN_ERROR_ON ((command_buffer->finalized),
+                        CL_INVALID_OPERATION,
+                        "the command buffer is already finalized\n");
+
+  POCL_RETURN_ERROR_COND (
+      ((num_sync_points > 0 && sync_point_wait_list == NULL)
+       || (num_sync_points == 0 && sync_point_wait_list != NULL)),
+      CL_INVALID_SYNC_POINT_WAIT_LIST_KHR);
+
+  for (i = 0; i < num_sync_points; ++i)
+    POCL_RETURN_ERROR_ON (
+        (sync_point_wait_list[i] >= command_buffer->num_commands),
+        CL_INVALID_SYNC_POINT_WAIT_LIST_KHR,
+        "sync point %u has not been recorded\n", sync_point_wait_list[i]);
+
+  rec = (pocl_recorded_command *)calloc (1, sizeof (pocl_recorded_command));
+  if (rec == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+
+  rec->node.type = command_type;
+  rec->node.device = command_queue->device;
+
+  rec->num_sync_points = num_sync_points;
+  if (num_sync_points > 0)
+    {
+      rec->sync_points = (cl_sync_point_khr *)malloc (
+          num_sync_points * sizeof (cl_sync_point_khr));
+      memcpy (rec->sync_points, sync_point_wait_list,
+              num_sync_points * sizeof (cl_sync_point_khr));
+    }
+
+  rec->num_buffers = num_buffers;
+  if (num_buffers > 0)
+    {
+      rec->buffers = (cl_mem *)malloc (num_buffers * sizeof (cl_mem));
+      rec->readonly_flags = (char *)malloc (num_buffers);
+      rec->write_ranges
+          = (pocl_mem_range *)calloc (num_buffers, sizeof (pocl_mem_range));
+      memcpy (rec->buffers, buffers, num_buffers * sizeof (cl_mem));
+      memcpy (rec->readonly_flags, readonly_flags, num_buffers);
+      if (write_ranges)
+        memcpy (rec->write_ranges, write_ranges,
+                num_buffers * sizeof (pocl_mem_range));
+      for (i = 0; i < num_buffers; ++i)
+        POname (clRetainMemObject) (buffers[i]);
+    }
+
+  *cmd = &rec->node;
+  return CL_SUCCESS;
+}
+
+void
+pocl_command_record (cl_command_buffer_khr command_buffer,
+                     _cl_command_node *cmd, cl_sync_point_khr *sync_point)
+{
+  pocl_recorded_command *rec = (pocl_recorded_command *)cmd;
+  cl_uint i, first = 0, num_extra = 0;
+
+  POCL_LOCK_OBJ (command_buffer);
+  cl_uint index = command_buffer->num_commands;
+
+  /* the commands after a barrier wait for it, and a barrier without
+     a wait list for everything recorded since the barrier before it */
+  if (command_buffer->last_barrier >= 0)
+    {
+      first = (cl_uint)command_buffer->last_barrier;
+      num_extra = 1;
+    }
+  if (cmd->type == CL_COMMAND_BARRIER && rec->num_sync_points == 0)
+    num_extra = index - first;
+  if (num_extra > 0)
+    {
+      rec->sync_points = (cl_sync_point_khr *)realloc (
+          rec->sync_points,
+          (rec->num_sync_points + num_extra) * sizeof (cl_sync_point_khr));
+      for (i = 0; i < num_extra; ++i)
+        rec->sync_points[rec->num_sync_points++] = first + i;
+    }
+  if (cmd->type == CL_COMMAND_BARRIER)
+    command_buffer->last_barrier = (cl_int)index;
+
+  if (index == command_buffer->max_commands)
+    {
+      command_buffer->max_commands
+          = command_buffer->max_commands ? command_buffer->max_commands * 2
+                                         : 16;
+      command_buffer->commands = (pocl_recorded_command **)realloc (
+          command_buffer->commands,
+          command_buffer->max_commands * sizeof (pocl_recorded_command *));
+    }
+  command_buffer->commands[index] = rec;
+  ++command_buffer->num_commands;
+  POCL_UNLOCK_OBJ (command_buffer);
+
+  if (sync_point)
+    *sync_point = index;
+}
+
+void
+pocl_free_recorded_command (pocl_recorded_command *rec)
+{
+  size_t i;
+
+  switch (rec->node.type)
+    {
+    case CL_COMMAND_NDRANGE_KERNEL:
+      pocl_ndrange_node_cleanup (&rec->node);
+      break;
+
+    case CL_COMMAND_FILL_BUFFER:
+      pocl_aligned_free (rec->node.command.memfill.pattern);
+      break;
+    }
+
+  for (i = 0; i < rec->num_buffers; ++i)
+    POname (clReleaseMemObject) (rec->buffers[i]);
+  POCL_MEM_FREE (rec->buffers);
+  POCL_MEM_FREE (rec->readonly_flags);
+  POCL_MEM_FREE (rec->write_ranges);
+  POCL_MEM_FREE (rec->sync_points);
+  POCL_MEM_FREE (rec);
 }
 
 /* call with node->event UNLOCKED */
@@ -1051,60 +1901,72 @@ void pocl_command_enqueue (cl_command_queue command_queue,
                           _cl_command_node *node)
 {
   cl_event event;
+  int in_order
+      = !(command_queue->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
 
   POCL_LOCK_OBJ (command_queue);
 
-  /* in case of in-order queue, synchronize to previously enqueued command
-     if available */
-  if (!(command_queue->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
-    {
-      POCL_MSG_PRINT_EVENTS ("In-order Q; adding event syncs\n");
-      if (command_queue->last_event.event)
-        {
-          pocl_create_event_sync (node->event,
-                                  command_queue->last_event.event);
-        }
-    }
-
   ++command_queue->command_count;
   /* in case of in-order queue, synchronize to previously enqueued command
-     if available */
-  if (!(command_queue->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+     if available. That command already waits for any barrier before it,
+     so the in-order queues need neither the barrier syncs nor the list of
+     the enqueued events below. */
+  if (in_order)
     {
       if (command_queue->last_event.event)
         {
+          POCL_MSG_PRINT_EVENTS ("In-order Q; adding event syncs\n");
           pocl_create_event_sync (node->event,
                                   command_queue->last_event.event);
         }
+      else if (command_queue->barrier)
+        pocl_create_event_sync (node->event, command_queue->barrier);
     }
-  /* Command queue is out-of-order queue. If command type is a barrier, then
-     synchronize to all previously enqueued commands to make sure they are
-     executed before the barrier. */
-  else if ((node->type == CL_COMMAND_BARRIER
-            || node->type == CL_COMMAND_MARKER)
-           && node->command.barrier.has_wait_list == 0)
+  else
     {
-      POCL_MSG_PRINT_EVENTS ("Barrier; adding event syncs\n");
-      DL_FOREACH (command_queue->events, event)
+      /* Command queue is out-of-order queue. If command type is a barrier,
+         then synchronize to all previously enqueued commands to make sure
+         they are executed before the barrier. */
+      if ((node->type == CL_COMMAND_BARRIER
+           || node->type == CL_COMMAND_MARKER)
+          && node->command.barrier.has_wait_list == 0)
         {
-          pocl_create_event_sync (node->event, event);
+          POCL_MSG_PRINT_EVENTS ("Barrier; adding event syncs\n");
+          DL_FOREACH (command_queue->events, event)
+            {
+              pocl_create_event_sync (node->event, event);
+            }
         }
+
+      if (node->type != CL_COMMAND_BARRIER && command_queue->barrier)
+        pocl_create_event_sync (node->event, command_queue->barrier);
+      DL_APPEND (command_queue->events, node->event);
     }
 
   if (node->type == CL_COMMAND_BARRIER)
     command_queue->barrier = node->event;
-  else
-    {
-      if (command_queue->barrier)
-        {
-          pocl_create_event_sync (node->event, command_queue->barrier);
-        }
-    }
-  DL_APPEND (command_queue->events, node->event);
 
   POCL_MSG_PRINT_EVENTS ("Pushed Event %" PRIu64 " to CQ %" PRIu64 ".\n",
                          node->event->id, command_queue->id);
   command_queue->last_event.event = node->event;
+
+  /* with submit_batch, the command waits in the queue until a flush, or
+     until the batch is full; it is added while the queue is still locked,
+     so that the batch stays in the enqueue order */
+  if (command_queue->batch_limit)
+    {
+      POCL_LOCK_OBJ (node->event);
+      assert (node->event->status == CL_QUEUED);
+      assert (command_queue == node->event->queue);
+      pocl_update_event_queued (node->event);
+      POCL_UNLOCK_OBJ (node->event);
+      DL_APPEND (command_queue->batch, node);
+      int full = (++command_queue->batch_size >= command_queue->batch_limit);
+      POCL_UNLOCK_OBJ (command_queue);
+      if (full)
+        pocl_submit_batch (command_queue);
+      return;
+    }
   POCL_UNLOCK_OBJ (command_queue);
 
   POCL_LOCK_OBJ (node->event);
@@ -1116,14 +1978,67 @@ void pocl_command_enqueue (cl_command_queue command_queue,
 
 }
 
+void
+pocl_submit_batch (cl_command_queue command_queue)
+{
+  _cl_command_node *batch;
+
+  if (command_queue->batch_limit == 0)
+    return;
+
+  POCL_LOCK (command_queue->batch_lock);
+  POCL_LOCK_OBJ (command_queue);
+  batch = command_queue->batch;
+  command_queue->batch = NULL;
+  command_queue->batch_size = 0;
+  POCL_UNLOCK_OBJ (command_queue);
+
+  if (batch)
+    command_queue->device->ops->submit_batch (batch, command_queue);
+  POCL_UNLOCK (command_queue->batch_lock);
+}
+
+int
+pocl_alloc_mem_host_ptr (cl_mem mem)
+{
+  cl_context context = mem->context;
+  assert (mem->mem_host_ptr == NULL);
+
+  if (context->host_mem_pool)
+    mem->mem_host_ptr
+        = pocl_host_mem_pool_alloc (context->host_mem_pool, mem->size);
+  mem->mem_host_ptr_pooled = (mem->mem_host_ptr != NULL);
+  if (mem->mem_host_ptr == NULL)
+    {
+      size_t align = max (context->min_buffer_alignment, 16);
+      if (pocl_use_huge_pages (mem->size))
+        mem->mem_host_ptr = pocl_huge_page_alloc (mem->size);
+      else
+        mem->mem_host_ptr = pocl_aligned_malloc (align, mem->size);
+    }
+  return (mem->mem_host_ptr == NULL) ? -1 : 0;
+}
+
+void
+pocl_free_mem_host_ptr (cl_mem mem)
+{
+  if (mem->mem_host_ptr_pooled)
+    pocl_host_mem_pool_free (mem->context->host_mem_pool, mem->mem_host_ptr,
+                             mem->size);
+  else if (pocl_use_huge_pages (mem->size))
+    pocl_huge_page_free (mem->mem_host_ptr, mem->size);
+  else
+    pocl_aligned_free (mem->mem_host_ptr);
+  mem->mem_host_ptr = NULL;
+  mem->mem_host_ptr_pooled = 0;
+}
+
 int
 pocl_alloc_or_retain_mem_host_ptr (cl_mem mem)
 {
   if (mem->mem_host_ptr == NULL)
     {
-      size_t align = max (mem->context->min_buffer_alignment, 16);
-      mem->mem_host_ptr = pocl_aligned_malloc (align, mem->size);
-      if (mem->mem_host_ptr == NULL)
+      if (pocl_alloc_mem_host_ptr (mem) != 0)
         return -1;
       mem->mem_host_ptr_version = 0;
       mem->mem_host_ptr_refcount = 0;
@@ -1139,13 +2054,62 @@ pocl_release_mem_host_ptr (cl_mem mem)
   --mem->mem_host_ptr_refcount;
   if (mem->mem_host_ptr_refcount == 0 && mem->mem_host_ptr != NULL)
     {
-      pocl_aligned_free (mem->mem_host_ptr);
-      mem->mem_host_ptr = NULL;
+      pocl_free_mem_host_ptr (mem);
       mem->mem_host_ptr_version = 0;
     }
   return 0;
 }
 
+void *
+pocl_map_dma_buf (int fd, size_t size, int writable, int *mapped_fd)
+{
+#ifdef __linux__
+  int own_fd = dup (fd);
+  if (own_fd < 0)
+    return NULL;
+  void *ptr = mmap (NULL, size, PROT_READ | (writable ? PROT_WRITE : 0),
+                    MAP_SHARED, own_fd, 0);
+  if (ptr == MAP_FAILED)
+    {
+      close (own_fd);
+      return NULL;
+    }
+  *mapped_fd = own_fd;
+  return ptr;
+#else
+  return NULL;
+#endif
+}
+
+void
+pocl_unmap_dma_buf (void *ptr, size_t size, int mapped_fd)
+{
+#ifdef __linux__
+  munmap (ptr, size);
+  close (mapped_fd);
+#endif
+}
+
+int
+pocl_dma_buf_sync (cl_mem mem, int start)
+{
+#ifdef __linux__
+  struct dma_buf_sync sync;
+  sync.flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END)
+               | ((mem->flags & CL_MEM_READ_ONLY) ? DMA_BUF_SYNC_READ
+                                                   : DMA_BUF_SYNC_RW);
+  int r;
+  do
+    r = ioctl (mem->external_fd, DMA_BUF_IOCTL_SYNC, &sync);
+  while (r < 0 && (errno == EINTR || errno == EAGAIN));
+  /* the fds of other kinds of shared memory (e.g. memfds) are coherent
+     with the CPU without the cache maintenance */
+  if (r < 0 && errno != ENOTTY && errno != EINVAL)
+    return -1;
+#endif
+  return 0;
+}
+
 /* call (and return) with node->event locked */
 void
 pocl_command_push (_cl_command_node *node,
@@ -1194,15 +2158,143 @@ pocl_unmap_command_finished (cl_event event, _cl_command_t *cmd)
   POCL_UNLOCK_OBJ (mem);
 }
 
-static void
-pocl_ndrange_node_cleanup (_cl_command_node *node)
+/* The alignment and allocation size of an argument value in a snapshot.
+ * FIXME: this is a cludge to determine an acceptable alignment, we should
+ * probably extract the argument alignment from the LLVM bytecode during
+ * kernel header generation. */
+static size_t
+kernel_arg_value_alignment (size_t size)
+{
+  size_t alignment = pocl_size_ceil2 (size);
+  if (alignment >= MAX_EXTENDED_ALIGNMENT)
+    alignment = MAX_EXTENDED_ALIGNMENT;
+  return alignment;
+}
+
+pocl_kernel_args *
+pocl_kernel_args_snapshot (cl_kernel kernel)
 {
-  cl_uint i;
-  for (i = 0; i < node->command.run.kernel->meta->num_args; ++i)
+  cl_uint i, num_args = kernel->meta->num_args;
+  const struct pocl_argument *src = kernel->dyn_arguments;
+  pocl_kernel_args *args;
+  size_t size = 0;
+
+  POCL_LOCK_OBJ (kernel);
+  args = kernel->args_snapshot;
+  if (args != NULL)
     {
-      pocl_aligned_free (node->command.run.arguments[i].value);
+      POCL_ATOMIC_INC (args->refcount);
+      POCL_UNLOCK_OBJ (kernel);
+      return args;
     }
-  POCL_MEM_FREE (node->command.run.arguments);
+
+  args = (pocl_kernel_args *)malloc (sizeof (pocl_kernel_args)
+                                     + num_args * sizeof (pocl_argument));
+  if (args == NULL)
+    goto ERROR;
+  args->arguments = (struct pocl_argument *)(args + 1);
+  memcpy (args->arguments, src, num_args * sizeof (pocl_argument));
+
+  for (i = 0; i < num_args; ++i)
+    if (src[i].value != NULL)
+      {
+        size_t alignment = kernel_arg_value_alignment (src[i].size);
+        assert (src[i].size > 0);
+        size = (size + alignment - 1) & ~(alignment - 1);
+        size += max (src[i].size, alignment);
+      }
+  args->storage = pocl_aligned_malloc (MAX_EXTENDED_ALIGNMENT,
+                                       max (size, (size_t)1));
+  if (args->storage == NULL)
+    {
+      POCL_MEM_FREE (args);
+      goto ERROR;
+    }
+
+  size = 0;
+  for (i = 0; i < num_args; ++i)
+    if (src[i].value != NULL)
+      {
+        size_t alignment = kernel_arg_value_alignment (src[i].size);
+        size = (size + alignment - 1) & ~(alignment - 1);
+        args->arguments[i].value = args->storage + size;
+        memcpy (args->arguments[i].value, src[i].value, src[i].size);
+        size += max (src[i].size, alignment);
+      }
+
+  /* the kernel's reference and the caller's */
+  args->refcount = 2;
+  kernel->args_snapshot = args;
+
+ERROR:
+  POCL_UNLOCK_OBJ (kernel);
+  return args;
+}
+
+void
+pocl_kernel_args_retain (pocl_kernel_args *args)
+{
+  POCL_ATOMIC_INC (args->refcount);
+}
+
+void
+pocl_kernel_args_release (pocl_kernel_args *args)
+{
+  if (args == NULL || POCL_ATOMIC_DEC (args->refcount) > 0)
+    return;
+  pocl_aligned_free (args->storage);
+  POCL_MEM_FREE (args);
+}
+
+void
+pocl_kernel_args_changed (cl_kernel kernel, cl_uint arg_index)
+{
+  const struct pocl_argument *p = &kernel->dyn_arguments[arg_index];
+  pocl_kernel_args *args;
+
+  POCL_LOCK_OBJ (kernel);
+  args = kernel->args_snapshot;
+  if (args != NULL)
+    {
+      const struct pocl_argument *old = &args->arguments[arg_index];
+      if (old->size == p->size && old->offset == p->offset
+          && old->sub_buffer_size == p->sub_buffer_size
+          && old->is_set == p->is_set && old->is_readonly == p->is_readonly
+          && old->is_svm == p->is_svm
+          && (old->value == NULL) == (p->value == NULL)
+          && (p->value == NULL || memcmp (old->value, p->value, p->size) == 0))
+        args = NULL;
+      else
+        kernel->args_snapshot = NULL;
+    }
+  POCL_UNLOCK_OBJ (kernel);
+  pocl_kernel_args_release (args);
+}
+
+void
+pocl_setup_argument_storage_size (pocl_kernel_metadata_t *meta)
+{
+  size_t total = 0;
+  cl_uint j;
+
+  meta->total_argument_storage_size = 0;
+  for (j = 0; j < meta->num_args; ++j)
+    {
+      /* if one of the arguments have size 0,
+         the driver couldn't figure it out. In that case,
+         leave total_argument_storage_size == zero, and use
+         the old way of setting arguments. */
+      if (meta->arg_info[j].type_size == 0)
+        return;
+      total += meta->arg_info[j].type_size;
+    }
+  meta->total_argument_storage_size = total;
+}
+
+static void
+pocl_ndrange_node_cleanup (_cl_command_node *node)
+{
+  pocl_kernel_args_release (node->command.run.args_snapshot);
   POname(clReleaseKernel)(node->command.run.kernel);
 }
 
@@ -1631,6 +2723,9 @@ pocl_setup_context (cl_context context)
 
   assert (alignment > 0);
   context->min_buffer_alignment = alignment;
+  context->host_mem_pool = pocl_host_mem_pool_create (max (alignment, 16));
+  POCL_INIT_LOCK (context->mem_lru_lock);
+  context->mem_lru_first = context->mem_lru_last = NULL;
   return CL_SUCCESS;
 }
 
@@ -1751,6 +2846,14 @@ pocl_command_to_str (cl_command_type cmd)
       return "svm_map";
     case CL_COMMAND_SVM_UNMAP:
       return "svm_unmap";
+    case CL_COMMAND_SVM_MIGRATE_MEM:
+      return "svm_migrate_mem";
+    case CL_COMMAND_COMMAND_BUFFER_KHR:
+      return "command_buffer";
+    case CL_COMMAND_ACQUIRE_EXTERNAL_MEM_OBJECTS_KHR:
+      return "acquire_external_mem_objects";
+    case CL_COMMAND_RELEASE_EXTERNAL_MEM_OBJECTS_KHR:
+      return "release_external_mem_objects";
     }
 
   return "unknown";
@@ -1901,7 +3004,7 @@ pocl_update_event_queued (cl_event event)
   cl_command_queue cq = event->queue;
   if ((cq->properties & CL_QUEUE_PROFILING_ENABLE)
       && (cq->device->has_own_timer == 0))
-    event->time_queue = pocl_gettimemono_ns ();
+    event->profile->time_queue = pocl_gettime_event_ns ();
 
   POCL_MSG_PRINT_EVENTS ("Event queued: %" PRIu64 "\n", event->id);
 
@@ -1921,7 +3024,7 @@ pocl_update_event_submitted (cl_event event)
   event->status = CL_SUBMITTED;
   if ((cq->properties & CL_QUEUE_PROFILING_ENABLE)
       && (cq->device->has_own_timer == 0))
-    event->time_submit = pocl_gettimemono_ns ();
+    event->profile->time_submit = pocl_gettime_event_ns ();
 
   POCL_MSG_PRINT_EVENTS ("Event submitted: %" PRIu64 "\n", event->id);
 
@@ -1938,9 +3041,9 @@ pocl_update_event_running_unlocked (cl_event event)
 
   cl_command_queue cq = event->queue;
   event->status = CL_RUNNING;
-  if ((cq->properties & CL_QUEUE_PROFILING_ENABLE)
+  if ((cq->properties & CL_QUEUE_PROFILING_ENABLE || event->timestamped)
       && (cq->device->has_own_timer == 0))
-    event->time_start = pocl_gettimemono_ns ();
+    event->profile->time_start = pocl_gettime_event_ns ();
 
   POCL_MSG_PRINT_EVENTS ("Event running: %" PRIu64 "\n", event->id);
 
@@ -1975,6 +3078,11 @@ static void pocl_free_event_node (cl_event event)
       pocl_aligned_free (node->command.svm_fill.pattern);
       break;
 
+    case CL_COMMAND_SVM_MIGRATE_MEM:
+      POCL_MEM_FREE (node->command.svm_migrate.svm_pointers);
+      POCL_MEM_FREE (node->command.svm_migrate.sizes);
+      break;
+
     case CL_COMMAND_NATIVE_KERNEL:
       POCL_MEM_FREE (node->command.native.args);
       break;
@@ -1982,6 +3090,16 @@ static void pocl_free_event_node (cl_event event)
     case CL_COMMAND_UNMAP_MEM_OBJECT:
       pocl_unmap_command_finished (event, &node->command);
       break;
+
+    case CL_COMMAND_MIGRATE_MEM_OBJECTS:
+      if (node->command.migrate.content_size)
+        pocl_release_content_size (node->command.migrate.content_size);
+      break;
+
+    case CL_COMMAND_COMMAND_BUFFER_KHR:
+      POname (clReleaseCommandBufferKHR) (
+          node->command.command_buffer.command_buffer);
+      break;
     }
   pocl_mem_manager_free_command (node);
   event->command = NULL;
@@ -2013,12 +3131,18 @@ pocl_update_event_finished (cl_int status, const char *func, unsigned line,
   assert (event->queue != NULL);
   assert (event->status > CL_COMPLETE);
 
+  /* before the status changes, so that the buffers are free for
+   * eviction once a wait for the event returns */
+  size_t i;
+  for (i = 0; i < event->num_buffers; ++i)
+    POCL_ATOMIC_DEC (event->mem_objs[i]->command_count);
+
   cl_command_queue cq = event->queue;
   POCL_LOCK_OBJ (cq);
   POCL_LOCK_OBJ (event);
-  if ((cq->properties & CL_QUEUE_PROFILING_ENABLE)
+  if ((cq->properties & CL_QUEUE_PROFILING_ENABLE || event->timestamped)
       && (cq->device->has_own_timer == 0))
-    event->time_end = pocl_gettimemono_ns ();
+    event->profile->time_end = pocl_gettime_event_ns ();
 
   struct pocl_device_ops *ops = cq->device->ops;
   event->status = status;
@@ -2038,7 +3162,9 @@ pocl_update_event_finished (cl_int status, const char *func, unsigned line,
     cq->barrier = NULL;
   if (cq->last_event.event == event)
     cq->last_event.event = NULL;
-  DL_DELETE (cq->events, event);
+  /* only the out-of-order queues keep the list, see pocl_command_enqueue */
+  if (cq->properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+    DL_DELETE (cq->events, event);
 
   POCL_UNLOCK_OBJ (cq);
   /* note that we must unlock the CmqQ before calling pocl_event_updated,
@@ -2052,7 +3178,9 @@ pocl_update_event_finished (cl_int status, const char *func, unsigned line,
   if (msg != NULL)
     {
       pocl_debug_print_duration (
-          func, line, msg, (uint64_t) (event->time_end - event->time_start));
+          func, line, msg,
+          (uint64_t)(pocl_event_profile_of (event)->time_end
+                     - pocl_event_profile_of (event)->time_start));
     }
 #endif
 
@@ -2088,85 +3216,25 @@ pocl_update_event_complete (const char *func, unsigned line,
 }
 
 /*
- * float 2 half / half 2 float
+ * float 2 half / half 2 float, see pocl_half.h
  */
 
-static int const shift = 13;
-static int const shiftSign = 16;
-
-static int32_t const infN = 0x7F800000;  /* flt32 infinity */
-static int32_t const maxN = 0x477FE000;  /* max flt16 normal as a flt32 */
-static int32_t const minN = 0x38800000;  /* min flt16 normal as a flt32 */
-static int32_t const signN = 0x80000000; /* flt32 sign bit */
-
-/* static int32_t const infC = infN >> shift;
- * static int32_t const infC = 0x3FC00;
- * static int32_t const nanN = (infC + 1) << shift; // minimum flt16 nan as a flt32
- */
-static int32_t const nanN = 0x7f802000;
-/* static int32_t const maxC = maxN >> shift; */
-static int32_t const maxC = 0x23bff;
-/* static int32_t const minC = minN >> shift;
- * static int32_t const minC = 0x1c400;
- * static int32_t const signC = signN >> shiftSign; // flt16 sign bit
- */
-static int32_t const signC = 0x40000; /* flt16 sign bit */
-
-static int32_t const mulN = 0x52000000; /* (1 << 23) / minN */
-static int32_t const mulC = 0x33800000; /* minN / (1 << (23 - shift)) */
-
-static int32_t const subC = 0x003FF; /* max flt32 subnormal down shifted */
-static int32_t const norC = 0x00400; /* min flt32 normal down shifted */
-
-/* static int32_t const maxD = infC - maxC - 1; */
-static int32_t const maxD = 0x1c000;
-/* static int32_t const minD = minC - subC - 1; */
-static int32_t const minD = 0x1c000;
-
-typedef union
-{
-  float f;
-  int32_t si;
-  uint32_t ui;
-} H2F_Bits;
-
 float
 half_to_float (uint16_t value)
 {
-  H2F_Bits v;
-  v.ui = value;
-  int32_t sign = v.si & signC;
-  v.si ^= sign;
-  sign <<= shiftSign;
-  v.si ^= ((v.si + minD) ^ v.si) & -(v.si > subC);
-  v.si ^= ((v.si + maxD) ^ v.si) & -(v.si > maxC);
-  H2F_Bits s;
-  s.si = mulC;
-  s.f *= v.si;
-  int32_t mask = -(norC > v.si);
-  v.si <<= shift;
-  v.si ^= (s.si ^ v.si) & mask;
-  v.si |= sign;
-  return v.f;
+  return pocl_half_to_float (value);
 }
 
 uint16_t
 float_to_half (float value)
 {
-  H2F_Bits v, s;
-  v.f = value;
-  uint32_t sign = v.si & signN;
-  v.si ^= sign;
-  sign >>= shiftSign;
-  s.si = mulN;
-  s.si = s.f * v.f;
-  v.si ^= (s.si ^ v.si) & -(minN > v.si);
-  v.si ^= (infN ^ v.si) & -((infN > v.si) & (v.si > maxN));
-  v.si ^= (nanN ^ v.si) & -((nanN > v.si) & (v.si > infN));
-  v.ui >>= shift;
-  v.si ^= ((v.si - maxD) ^ v.si) & -(v.si > maxC);
-  v.si ^= ((v.si - minD) ^ v.si) & -(v.si > subC);
-  return v.ui | sign;
+  return pocl_float_to_half (value);
+}
+
+void
+float_to_half_array (uint16_t *dst, const float *src, size_t n)
+{
+  pocl_float_to_half_array (dst, src, n);
 }
 
 /* SPIR-V magic header */
@@ -82,6 +82,26 @@ POCL_EXPORT
 void *pocl_aligned_malloc(size_t alignment, size_t size);
 #define pocl_aligned_free(x) POCL_MEM_FREE(x)
 
+/* Huge page backed memory for large buffers, as set with POCL_HUGE_PAGES.
+ *
+ * pocl_use_huge_pages returns nonzero if an allocation of the given size
+ * must be made with pocl_huge_page_alloc; it depends only on the size for
+ * the lifetime of the process, so it tells how to free the memory as well.
+ * pocl_huge_page_alloc falls back to transparent huge pages if there are
+ * no free huge pages, and returns NULL only when out of memory. */
+
+POCL_EXPORT
+size_t pocl_huge_page_size (void);
+
+POCL_EXPORT
+int pocl_use_huge_pages (size_t size);
+
+POCL_EXPORT
+void *pocl_huge_page_alloc (size_t size);
+
+POCL_EXPORT
+void pocl_huge_page_free (void *ptr, size_t size);
+
 /* locks / unlocks two events in order of their event-id.
  * This avoids any potential deadlocks of threads should
  * they try to lock events in opposite order. */
@@ -93,6 +113,18 @@ cl_int pocl_create_event (cl_event *event, cl_command_queue command_queue,
                           cl_command_type command_type, size_t num_buffers,
                           const cl_mem* buffers, cl_context context);
 
+/* Gives the event a zeroed profile, if it has none. Returns 0 if out of
+ * memory. */
+int pocl_event_alloc_profile (cl_event event);
+
+/* The profile of the event, read as zeros if the event has none. */
+static inline const pocl_event_profile *
+pocl_event_profile_of (cl_event event)
+{
+  static const pocl_event_profile no_profile = { 0 };
+  return event->profile ? event->profile : &no_profile;
+}
+
 cl_int pocl_create_command (_cl_command_node **cmd,
                             cl_command_queue command_queue,
                             cl_command_type command_type, cl_event *event,
@@ -100,6 +132,147 @@ cl_int pocl_create_command (_cl_command_node **cmd,
                             size_t num_buffers, cl_mem *buffers,
                             char *readonly_flags);
 
+/* A byte range of a buffer a command writes to; size 0 means
+ * the command can write anywhere in the buffer. */
+typedef struct pocl_mem_range
+{
+  size_t offset;
+  size_t size;
+} pocl_mem_range;
+
+/* Same as pocl_create_command, but write_ranges[i] tells which bytes
+ * of buffers[i] the command can modify, so that the following migrations
+ * of the buffer only need to copy those. write_ranges can be NULL. */
+cl_int pocl_create_command_ranges (_cl_command_node **cmd,
+                                   cl_command_queue command_queue,
+                                   cl_command_type command_type,
+                                   cl_event *event, cl_uint num_events,
+                                   const cl_event *wait_list,
+                                   size_t num_buffers, cl_mem *buffers,
+                                   char *readonly_flags,
+                                   pocl_mem_range *write_ranges);
+
+/* A command recorded in a command buffer: the node as it is enqueued
+ * (without an event), and what pocl_create_command_ranges needs to
+ * enqueue it again. */
+typedef struct _pocl_recorded_command
+{
+  /* must be the first member, the recording calls handle only this */
+  _cl_command_node node;
+  size_t num_buffers;
+  cl_mem *buffers;
+  char *readonly_flags;
+  pocl_mem_range *write_ranges;
+  cl_uint num_sync_points;
+  cl_sync_point_khr *sync_points;
+} pocl_recorded_command;
+
+/* Starts recording a command in command_buffer. Validates the command
+ * buffer, the queue and the sync points, and returns in *cmd the node
+ * that the caller fills like one from pocl_create_command_ranges before
+ * passing it to pocl_command_record. Retains the buffers. */
+cl_int pocl_create_recorded_command (
+    _cl_command_node **cmd, cl_command_buffer_khr command_buffer,
+    cl_command_queue command_queue, cl_command_type command_type,
+    cl_uint num_sync_points, const cl_sync_point_khr *sync_point_wait_list,
+    size_t num_buffers, const cl_mem *buffers, const char *readonly_flags,
+    const pocl_mem_range *write_ranges);
+
+/* Appends a command from pocl_create_recorded_command to its command
+ * buffer, and returns its sync point in *sync_point if not NULL. */
+void pocl_command_record (cl_command_buffer_khr command_buffer,
+                          _cl_command_node *cmd,
+                          cl_sync_point_khr *sync_point);
+
+/* Frees a recorded command and releases what it retained. */
+void pocl_free_recorded_command (pocl_recorded_command *rec);
+
+/* The enqueue calls that can also be recorded: with command_buffer NULL,
+ * they enqueue the command in command_queue after event_wait_list;
+ * otherwise they record it in command_buffer (for its queue, given as
+ * command_queue) after sync_point_wait_list. */
+cl_int pocl_ndrange_kernel_common (
+    cl_command_buffer_khr command_buffer, cl_command_queue command_queue,
+    cl_kernel kernel, cl_uint work_dim, const size_t *global_work_offset,
+    const size_t *global_work_size, const size_t *local_work_size,
+    cl_uint num_items_in_wait_list, const cl_event *event_wait_list,
+    cl_event *event, const cl_sync_point_khr *sync_point_wait_list,
+    cl_sync_point_khr *sync_point);
+
+/* Enqueues a part of clEnqueueNDRangeKernelSplitPoCL: validates and
+ * enqueues it like clEnqueueNDRangeKernel, except that the buffers the
+ * kernel writes get no new version, so the parts on different devices
+ * don't wait for each other's writes. */
+cl_int pocl_ndrange_kernel_split_part (
+    cl_command_queue command_queue, cl_kernel kernel, cl_uint work_dim,
+    const size_t *global_work_offset, const size_t *global_work_size,
+    const size_t *local_work_size, cl_uint num_items_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event);
+
+/* Returns the index of the queue's device in the context. */
+unsigned pocl_context_device_index (cl_context context,
+                                    cl_command_queue queue);
+
+/* Allocates kernel->split_rates if it isn't yet. Called with the kernel
+ * locked. */
+cl_int pocl_kernel_alloc_split_rates (cl_kernel kernel);
+
+/* Updates kernel->split_rates[device_i] from the time the NDRange of
+ * work_items enqueued at enqueue_time took, when its event has finished
+ * with status: its run time with profiling, otherwise the time since the
+ * enqueue, which includes the migrations it waited for. Returns that time
+ * in nanoseconds. */
+uint64_t pocl_ndrange_update_rate (cl_event event, cl_int status,
+                                   cl_kernel kernel, unsigned device_i,
+                                   size_t work_items, uint64_t enqueue_time);
+
+/* After the parts of a split NDRange, which wrote slices[i] of mem on the
+ * device of part_queues[i], makes the host copy of mem its new latest
+ * version by exporting each slice from its device after part_events[i].
+ * Returns the events of the exports in export_events. */
+cl_int pocl_gather_mem_slices (cl_mem mem, cl_uint num_parts,
+                               const cl_command_queue *part_queues,
+                               const cl_event *part_events,
+                               const pocl_mem_range *slices,
+                               cl_event *export_events);
+
+/* Makes event the last event of mem, which the next commands using mem
+ * wait for. */
+void pocl_set_mem_last_event (cl_mem mem, cl_event event);
+
+cl_int pocl_copy_buffer_common (
+    cl_command_buffer_khr command_buffer, cl_command_queue command_queue,
+    cl_mem src_buffer, cl_mem dst_buffer, size_t src_offset,
+    size_t dst_offset, size_t size, cl_uint num_items_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event,
+    const cl_sync_point_khr *sync_point_wait_list,
+    cl_sync_point_khr *sync_point);
+
+cl_int pocl_fill_buffer_common (
+    cl_command_buffer_khr command_buffer, cl_command_queue command_queue,
+    cl_mem buffer, const void *pattern, size_t pattern_size, size_t offset,
+    size_t size, cl_uint num_items_in_wait_list,
+    const cl_event *event_wait_list, cl_event *event,
+    const cl_sync_point_khr *sync_point_wait_list,
+    cl_sync_point_khr *sync_point);
+
+/* Returns the snapshot of the arguments currently set to kernel, as needed
+ * by a NDRange command, with a reference for the caller. The snapshot is
+ * only copied from the kernel's arguments when one has changed. */
+pocl_kernel_args *pocl_kernel_args_snapshot (cl_kernel kernel);
+
+void pocl_kernel_args_retain (pocl_kernel_args *args);
+
+void pocl_kernel_args_release (pocl_kernel_args *args);
+
+/* Called by clSetKernelArg* after setting the argument arg_index of kernel;
+ * drops the kernel's snapshot unless the argument is unchanged in it. */
+void pocl_kernel_args_changed (cl_kernel kernel, cl_uint arg_index);
+
+/* Sets the total_argument_storage_size of the kernel metadata from the
+ * type sizes of its arguments, 0 if one of them is unknown. */
+void pocl_setup_argument_storage_size (pocl_kernel_metadata_t *meta);
+
 cl_int pocl_create_command_migrate (_cl_command_node **cmd,
                                     cl_command_queue command_queue,
                                     cl_mem_migration_flags flags,
@@ -113,12 +286,51 @@ cl_int pocl_create_command_migrate (_cl_command_node **cmd,
 void pocl_command_enqueue (cl_command_queue command_queue,
                           _cl_command_node *node);
 
+/* Gives the commands collected on command_queue to the submit_batch
+ * of its device, if there are any. */
+void pocl_submit_batch (cl_command_queue command_queue);
+
 POCL_EXPORT
 int pocl_alloc_or_retain_mem_host_ptr (cl_mem mem);
 
 POCL_EXPORT
 int pocl_release_mem_host_ptr (cl_mem mem);
 
+/* Allocates and frees the runtime's own mem_host_ptr, regardless of
+ * the refcount. */
+int pocl_alloc_mem_host_ptr (cl_mem mem);
+
+void pocl_free_mem_host_ptr (cl_mem mem);
+
+/* Maps the dma-buf fd of an imported buffer to the host memory with a
+ * duplicate of the fd, which is returned in mapped_fd. Returns NULL if
+ * the fd cannot be mapped. */
+void *pocl_map_dma_buf (int fd, size_t size, int writable, int *mapped_fd);
+
+/* Undoes pocl_map_dma_buf. */
+void pocl_unmap_dma_buf (void *ptr, size_t size, int mapped_fd);
+
+/* Brackets the host (i.e. CPU device) accesses to an imported buffer with
+ * the DMA_BUF_IOCTL_SYNC cache maintenance of the exporter. */
+int pocl_dma_buf_sync (cl_mem mem, int start);
+
+/* Removes a buffer that is being freed from the eviction order of the
+ * context's buffers. */
+void pocl_mem_lru_remove (cl_mem mem);
+
+/* cl_pocl_content_size: returns how many bytes of [offset, offset + size)
+ * of a buffer are below its content size, i.e. need to be copied. */
+POCL_EXPORT
+size_t pocl_content_size_clamp (uint64_t content_size, size_t offset,
+                                size_t size);
+
+/* Same for the range of a migration command. */
+POCL_EXPORT
+size_t pocl_migration_content_size (const _cl_command_migrate *cmd);
+
+/* Drops a migration command's reference to a size buffer. */
+void pocl_release_content_size (cl_mem size_buf);
+
 /* does several sanity checks on buffer & given memory region */
 int pocl_buffer_boundcheck(cl_mem buffer, size_t offset, size_t size);
 /* same as above just 2 buffers */
@@ -229,10 +441,13 @@ int pocl_run_command_capture_output (char *capture_string,
                                      size_t *captured_bytes,
                                      char *const *args);
 
+/* Round to nearest even, as the conversion instructions of the CPUs. */
 uint16_t float_to_half (float value);
 
 float half_to_float (uint16_t value);
 
+void float_to_half_array (uint16_t *dst, const float *src, size_t n);
+
 /* returns !0 if binary is SPIR-V bitcode with OpCapability Kernel
  * OpenCL-style bitcode produced by e.g. llvm-spirv */
 int pocl_bitcode_is_spirv_execmodel_kernel (const char *bitcode, size_t size);
@@ -27,6 +27,26 @@
    THE SOFTWARE.
 */
 
+/* The saturating conversions of the float vectors use the pack
+ * instructions of SSE2, see convert_type_sat_sse2.c */
+
+#ifdef __SSE2__
+#define DECLARE_FLOAT2SAT(TYPE, SUFFIX)                                       \
+  TYPE##4 _cl_float2##TYPE##4##SUFFIX (const float4 x);                       \
+  TYPE##8 _cl_float2##TYPE##8##SUFFIX (const float8 x);                       \
+  TYPE##16 _cl_float2##TYPE##16##SUFFIX (const float16 x);
+
+#define DECLARE_FLOAT2SAT_TYPES(SUFFIX)                                       \
+  DECLARE_FLOAT2SAT (char, SUFFIX)                                            \
+  DECLARE_FLOAT2SAT (uchar, SUFFIX)                                           \
+  DECLARE_FLOAT2SAT (short, SUFFIX)                                           \
+  DECLARE_FLOAT2SAT (ushort, SUFFIX)                                          \
+  DECLARE_FLOAT2SAT (int, SUFFIX)
+
+DECLARE_FLOAT2SAT_TYPES (_sat)
+DECLARE_FLOAT2SAT_TYPES (_sat_rte)
+#endif
+
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char convert_char(char x)
 {
@@ -30034,28 +30054,40 @@ char3 convert_char3_sat(float3 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char4 convert_char4_sat(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2char4_sat(x);
+#else
   char4 y = convert_char4(x);
   y = select(y, (char4)CHAR_MIN, convert_char4(x < (float4)(-0x1p+7f)));
   y = select(y, (char4)CHAR_MAX, convert_char4(x >= (float4)(0x1p+7f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char8 convert_char8_sat(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2char8_sat(x);
+#else
   char8 y = convert_char8(x);
   y = select(y, (char8)CHAR_MIN, convert_char8(x < (float8)(-0x1p+7f)));
   y = select(y, (char8)CHAR_MAX, convert_char8(x >= (float8)(0x1p+7f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char16 convert_char16_sat(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2char16_sat(x);
+#else
   char16 y = convert_char16(x);
   y = select(y, (char16)CHAR_MIN, convert_char16(x < (float16)(-0x1p+7f)));
   y = select(y, (char16)CHAR_MAX, convert_char16(x >= (float16)(0x1p+7f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -30088,28 +30120,40 @@ uchar3 convert_uchar3_sat(float3 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 uchar4 convert_uchar4_sat(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2uchar4_sat(x);
+#else
   uchar4 y = convert_uchar4(x);
   y = select(y, (uchar4)0, as_uchar4(convert_char4(x < (float4)0.0f)));
   y = select(y, (uchar4)UCHAR_MAX, as_uchar4(convert_char4(x >= (float4)(0x1p+8f))));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 uchar8 convert_uchar8_sat(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2uchar8_sat(x);
+#else
   uchar8 y = convert_uchar8(x);
   y = select(y, (uchar8)0, as_uchar8(convert_char8(x < (float8)0.0f)));
   y = select(y, (uchar8)UCHAR_MAX, as_uchar8(convert_char8(x >= (float8)(0x1p+8f))));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 uchar16 convert_uchar16_sat(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2uchar16_sat(x);
+#else
   uchar16 y = convert_uchar16(x);
   y = select(y, (uchar16)0, as_uchar16(convert_char16(x < (float16)0.0f)));
   y = select(y, (uchar16)UCHAR_MAX, as_uchar16(convert_char16(x >= (float16)(0x1p+8f))));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -30142,28 +30186,40 @@ short3 convert_short3_sat(float3 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 short4 convert_short4_sat(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2short4_sat(x);
+#else
   short4 y = convert_short4(x);
   y = select(y, (short4)SHRT_MIN, convert_short4(x < (float4)(-0x1p+15f)));
   y = select(y, (short4)SHRT_MAX, convert_short4(x >= (float4)(0x1p+15f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 short8 convert_short8_sat(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2short8_sat(x);
+#else
   short8 y = convert_short8(x);
   y = select(y, (short8)SHRT_MIN, convert_short8(x < (float8)(-0x1p+15f)));
   y = select(y, (short8)SHRT_MAX, convert_short8(x >= (float8)(0x1p+15f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 short16 convert_short16_sat(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2short16_sat(x);
+#else
   short16 y = convert_short16(x);
   y = select(y, (short16)SHRT_MIN, convert_short16(x < (float16)(-0x1p+15f)));
   y = select(y, (short16)SHRT_MAX, convert_short16(x >= (float16)(0x1p+15f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -30196,28 +30252,40 @@ ushort3 convert_ushort3_sat(float3 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 ushort4 convert_ushort4_sat(float4 x)
 {
+#ifdef __SSE4_1__
+  return _cl_float2ushort4_sat(x);
+#else
   ushort4 y = convert_ushort4(x);
   y = select(y, (ushort4)0, as_ushort4(convert_short4(x < (float4)0.0f)));
   y = select(y, (ushort4)USHRT_MAX, as_ushort4(convert_short4(x >= (float4)(0x1p+16f))));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 ushort8 convert_ushort8_sat(float8 x)
 {
+#ifdef __SSE4_1__
+  return _cl_float2ushort8_sat(x);
+#else
   ushort8 y = convert_ushort8(x);
   y = select(y, (ushort8)0, as_ushort8(convert_short8(x < (float8)0.0f)));
   y = select(y, (ushort8)USHRT_MAX, as_ushort8(convert_short8(x >= (float8)(0x1p+16f))));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 ushort16 convert_ushort16_sat(float16 x)
 {
+#ifdef __SSE4_1__
+  return _cl_float2ushort16_sat(x);
+#else
   ushort16 y = convert_ushort16(x);
   y = select(y, (ushort16)0, as_ushort16(convert_short16(x < (float16)0.0f)));
   y = select(y, (ushort16)USHRT_MAX, as_ushort16(convert_short16(x >= (float16)(0x1p+16f))));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -30250,28 +30318,40 @@ int3 convert_int3_sat(float3 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 int4 convert_int4_sat(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2int4_sat(x);
+#else
   int4 y = convert_int4(x);
   y = select(y, (int4)INT_MIN, convert_int4(x < (float4)(-0x1p+31f)));
   y = select(y, (int4)INT_MAX, convert_int4(x >= (float4)(0x1p+31f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 int8 convert_int8_sat(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2int8_sat(x);
+#else
   int8 y = convert_int8(x);
   y = select(y, (int8)INT_MIN, convert_int8(x < (float8)(-0x1p+31f)));
   y = select(y, (int8)INT_MAX, convert_int8(x >= (float8)(0x1p+31f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 int16 convert_int16_sat(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2int16_sat(x);
+#else
   int16 y = convert_int16(x);
   y = select(y, (int16)INT_MIN, convert_int16(x < (float16)(-0x1p+31f)));
   y = select(y, (int16)INT_MAX, convert_int16(x >= (float16)(0x1p+31f)));
   return y;
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43268,8 +43348,12 @@ char4 convert_char4_rte(float4 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char4 convert_char4_sat_rte(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2char4_sat_rte(x);
+#else
   x = rint(x);
   return convert_char4_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43322,8 +43406,12 @@ char8 convert_char8_rte(float8 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char8 convert_char8_sat_rte(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2char8_sat_rte(x);
+#else
   x = rint(x);
   return convert_char8_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43376,8 +43464,12 @@ char16 convert_char16_rte(float16 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 char16 convert_char16_sat_rte(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2char16_sat_rte(x);
+#else
   x = rint(x);
   return convert_char16_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43592,8 +43684,12 @@ uchar4 convert_uchar4_rte(float4 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 uchar4 convert_uchar4_sat_rte(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2uchar4_sat_rte(x);
+#else
   x = rint(x);
   return convert_uchar4_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43646,8 +43742,12 @@ uchar8 convert_uchar8_rte(float8 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 uchar8 convert_uchar8_sat_rte(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2uchar8_sat_rte(x);
+#else
   x = rint(x);
   return convert_uchar8_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43700,8 +43800,12 @@ uchar16 convert_uchar16_rte(float16 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 uchar16 convert_uchar16_sat_rte(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2uchar16_sat_rte(x);
+#else
   x = rint(x);
   return convert_uchar16_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43916,8 +44020,12 @@ short4 convert_short4_rte(float4 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 short4 convert_short4_sat_rte(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2short4_sat_rte(x);
+#else
   x = rint(x);
   return convert_short4_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -43970,8 +44078,12 @@ short8 convert_short8_rte(float8 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 short8 convert_short8_sat_rte(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2short8_sat_rte(x);
+#else
   x = rint(x);
   return convert_short8_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44024,8 +44136,12 @@ short16 convert_short16_rte(float16 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 short16 convert_short16_sat_rte(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2short16_sat_rte(x);
+#else
   x = rint(x);
   return convert_short16_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44240,8 +44356,12 @@ ushort4 convert_ushort4_rte(float4 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 ushort4 convert_ushort4_sat_rte(float4 x)
 {
+#ifdef __SSE4_1__
+  return _cl_float2ushort4_sat_rte(x);
+#else
   x = rint(x);
   return convert_ushort4_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44294,8 +44414,12 @@ ushort8 convert_ushort8_rte(float8 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 ushort8 convert_ushort8_sat_rte(float8 x)
 {
+#ifdef __SSE4_1__
+  return _cl_float2ushort8_sat_rte(x);
+#else
   x = rint(x);
   return convert_ushort8_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44348,8 +44472,12 @@ ushort16 convert_ushort16_rte(float16 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 ushort16 convert_ushort16_sat_rte(float16 x)
 {
+#ifdef __SSE4_1__
+  return _cl_float2ushort16_sat_rte(x);
+#else
   x = rint(x);
   return convert_ushort16_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44564,8 +44692,12 @@ int4 convert_int4_rte(float4 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 int4 convert_int4_sat_rte(float4 x)
 {
+#ifdef __SSE2__
+  return _cl_float2int4_sat_rte(x);
+#else
   x = rint(x);
   return convert_int4_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44618,8 +44750,12 @@ int8 convert_int8_rte(float8 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 int8 convert_int8_sat_rte(float8 x)
 {
+#ifdef __SSE2__
+  return _cl_float2int8_sat_rte(x);
+#else
   x = rint(x);
   return convert_int8_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
@@ -44672,8 +44808,12 @@ int16 convert_int16_rte(float16 x)
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
 int16 convert_int16_sat_rte(float16 x)
 {
+#ifdef __SSE2__
+  return _cl_float2int16_sat_rte(x);
+#else
   x = rint(x);
   return convert_int16_sat(x);
+#endif
 }
 
 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READNONE
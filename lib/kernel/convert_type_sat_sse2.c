@@ -0,0 +1,245 @@
+/* OpenCL built-in library: saturating float conversions on x86-64
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* The convert_<int type>N_sat and _sat_rte of the float vectors of 4, 8
+ * and 16 lanes for convert_type.cl, with these builtins from Clang:
+ *    BUILTIN(__builtin_ia32_cvttps2dq, "V4iV4f", "")
+ *    BUILTIN(__builtin_ia32_cvtps2dq, "V4iV4f", "")
+ *    BUILTIN(__builtin_ia32_minps, "V4fV4fV4f", "")
+ *    BUILTIN(__builtin_ia32_packssdw128, "V8sV4iV4i", "")
+ *    BUILTIN(__builtin_ia32_packsswb128, "V16cV8sV8s", "")
+ *    BUILTIN(__builtin_ia32_packuswb128, "V16cV8sV8s", "")
+ * and with SSE4.1 also:
+ *    BUILTIN(__builtin_ia32_packusdw128, "V8sV4iV4i", "")
+ *
+ * The conversions of a lane give INT_MIN for NaN and for the values out of
+ * the range of int, so a minps with the largest value of the type, which
+ * returns its second operand when either is a NaN, clamps the values above
+ * the range, and the saturating packs narrow the rest. The signed types
+ * clear the NaN lanes, the unsigned ones get 0 for them from the packs.
+ *
+ * The _sat_rte ones round with MXCSR, which pocl_set_default_rm () sets to
+ * round to nearest even for the kernels. */
+
+#ifdef __SSE2__
+
+typedef union
+{
+  float8 v;
+  float4 q[2];
+} f8_u;
+
+typedef union
+{
+  float16 v;
+  float4 q[4];
+} f16_u;
+
+typedef union
+{
+  int8 v;
+  int4 q[2];
+} i8_u;
+
+typedef union
+{
+  int16 v;
+  int4 q[4];
+} i16_u;
+
+typedef union
+{
+  short8 v;
+  short4 lo;
+  ushort8 u;
+  ushort4 ulo;
+} s8_u;
+
+typedef union
+{
+  short8 q[2];
+  short16 v;
+  ushort16 u;
+} s16_u;
+
+typedef union
+{
+  char16 v;
+  char4 lo4;
+  char8 lo8;
+  uchar16 u;
+  uchar4 ulo4;
+  uchar8 ulo8;
+} c16_u;
+
+/* The conversions of the lanes of the suffixes: _sat truncates. */
+#define CVT_sat __builtin_ia32_cvttps2dq
+#define CVT_sat_rte __builtin_ia32_cvtps2dq
+
+#define CLAMP_CVT(CVT, x, hi)                                                 \
+  CVT (__builtin_ia32_minps ((float4){ hi, hi, hi, hi }, x))
+
+/* The lanes as ints, for the narrower types already clamped above. */
+#define IMPLEMENT_LANES(SUFFIX, CVT)                                          \
+  static inline int4 int_lanes##SUFFIX (float4 x)                             \
+  {                                                                           \
+    int4 i = CVT (x);                                                         \
+    /* INT_MIN flips to INT_MAX for the values above the range */             \
+    i ^= x >= 0x1p+31f;                                                       \
+    return i & (x == x);                                                      \
+  }                                                                           \
+                                                                              \
+  static inline int4 short_lanes##SUFFIX (float4 x)                           \
+  {                                                                           \
+    return CLAMP_CVT (CVT, x, 32767.0f) & (x == x);                           \
+  }                                                                           \
+                                                                              \
+  static inline int4 char_lanes##SUFFIX (float4 x)                            \
+  {                                                                           \
+    return CLAMP_CVT (CVT, x, 127.0f) & (x == x);                             \
+  }                                                                           \
+                                                                              \
+  static inline int4 uchar_lanes##SUFFIX (float4 x)                           \
+  {                                                                           \
+    return CLAMP_CVT (CVT, x, 255.0f);                                        \
+  }
+
+#define IMPLEMENT_FLOAT2INT(SUFFIX)                                           \
+  int4 _cl_float2int4##SUFFIX (const float4 x)                                \
+  {                                                                           \
+    return int_lanes##SUFFIX (x);                                             \
+  }                                                                           \
+                                                                              \
+  int8 _cl_float2int8##SUFFIX (const float8 x)                                \
+  {                                                                           \
+    f8_u ui;                                                                  \
+    i8_u uo;                                                                  \
+    ui.v = x;                                                                 \
+    uo.q[0] = int_lanes##SUFFIX (ui.q[0]);                                    \
+    uo.q[1] = int_lanes##SUFFIX (ui.q[1]);                                    \
+    return uo.v;                                                              \
+  }                                                                           \
+                                                                              \
+  int16 _cl_float2int16##SUFFIX (const float16 x)                             \
+  {                                                                           \
+    f16_u ui;                                                                 \
+    i16_u uo;                                                                 \
+    ui.v = x;                                                                 \
+    for (int j = 0; j < 4; ++j)                                               \
+      uo.q[j] = int_lanes##SUFFIX (ui.q[j]);                                  \
+    return uo.v;                                                              \
+  }
+
+/* The 16-bit types, with the pack of the ints to the type, V and LO for
+ * the members of the unions of the type. */
+#define IMPLEMENT_FLOAT2SHORT(TYPE, SUFFIX, LANES, PACK, V, LO)               \
+  TYPE##4 _cl_float2##TYPE##4##SUFFIX (const float4 x)                        \
+  {                                                                           \
+    s8_u uo;                                                                  \
+    int4 i = LANES##SUFFIX (x);                                               \
+    uo.v = PACK (i, i);                                                       \
+    return uo.LO;                                                             \
+  }                                                                           \
+                                                                              \
+  TYPE##8 _cl_float2##TYPE##8##SUFFIX (const float8 x)                        \
+  {                                                                           \
+    f8_u ui;                                                                  \
+    s8_u uo;                                                                  \
+    ui.v = x;                                                                 \
+    uo.v = PACK (LANES##SUFFIX (ui.q[0]), LANES##SUFFIX (ui.q[1]));           \
+    return uo.V;                                                              \
+  }                                                                           \
+                                                                              \
+  TYPE##16 _cl_float2##TYPE##16##SUFFIX (const float16 x)                     \
+  {                                                                           \
+    f16_u ui;                                                                 \
+    s16_u uo;                                                                 \
+    ui.v = x;                                                                 \
+    uo.q[0] = PACK (LANES##SUFFIX (ui.q[0]), LANES##SUFFIX (ui.q[1]));        \
+    uo.q[1] = PACK (LANES##SUFFIX (ui.q[2]), LANES##SUFFIX (ui.q[3]));        \
+    return uo.V;                                                              \
+  }
+
+/* The 8-bit types: the ints pack to shorts, and those to the type. */
+#define IMPLEMENT_FLOAT2CHAR(TYPE, SUFFIX, LANES, PACK, V, LO4, LO8)          \
+  TYPE##4 _cl_float2##TYPE##4##SUFFIX (const float4 x)                        \
+  {                                                                           \
+    c16_u uo;                                                                 \
+    int4 i = LANES##SUFFIX (x);                                               \
+    short8 s = __builtin_ia32_packssdw128 (i, i);                             \
+    uo.v = PACK (s, s);                                                       \
+    return uo.LO4;                                                            \
+  }                                                                           \
+                                                                              \
+  TYPE##8 _cl_float2##TYPE##8##SUFFIX (const float8 x)                        \
+  {                                                                           \
+    f8_u ui;                                                                  \
+    c16_u uo;                                                                 \
+    ui.v = x;                                                                 \
+    short8 s = __builtin_ia32_packssdw128 (LANES##SUFFIX (ui.q[0]),           \
+                                           LANES##SUFFIX (ui.q[1]));          \
+    uo.v = PACK (s, s);                                                       \
+    return uo.LO8;                                                            \
+  }                                                                           \
+                                                                              \
+  TYPE##16 _cl_float2##TYPE##16##SUFFIX (const float16 x)                     \
+  {                                                                           \
+    f16_u ui;                                                                 \
+    c16_u uo;                                                                 \
+    ui.v = x;                                                                 \
+    short8 lo = __builtin_ia32_packssdw128 (LANES##SUFFIX (ui.q[0]),          \
+                                            LANES##SUFFIX (ui.q[1]));         \
+    short8 hi = __builtin_ia32_packssdw128 (LANES##SUFFIX (ui.q[2]),          \
+                                            LANES##SUFFIX (ui.q[3]));         \
+    uo.v = PACK (lo, hi);                                                     \
+    return uo.V;                                                              \
+  }
+
+#ifdef __SSE4_1__
+#define IMPLEMENT_FLOAT2USHORT(SUFFIX)                                        \
+  static inline int4 ushort_lanes##SUFFIX (float4 x)                          \
+  {                                                                           \
+    return CLAMP_CVT (CVT##SUFFIX, x, 65535.0f);                              \
+  }                                                                           \
+  IMPLEMENT_FLOAT2SHORT (ushort, SUFFIX, ushort_lanes,                        \
+                         __builtin_ia32_packusdw128, u, ulo)
+#else
+#define IMPLEMENT_FLOAT2USHORT(SUFFIX)
+#endif
+
+#define IMPLEMENT_SAT_CONVERSIONS(SUFFIX)                                     \
+  IMPLEMENT_LANES (SUFFIX, CVT##SUFFIX)                                       \
+  IMPLEMENT_FLOAT2INT (SUFFIX)                                                \
+  IMPLEMENT_FLOAT2SHORT (short, SUFFIX, short_lanes,                          \
+                         __builtin_ia32_packssdw128, v, lo)                   \
+  IMPLEMENT_FLOAT2USHORT (SUFFIX)                                             \
+  IMPLEMENT_FLOAT2CHAR (char, SUFFIX, char_lanes, __builtin_ia32_packsswb128, \
+                        v, lo4, lo8)                                          \
+  IMPLEMENT_FLOAT2CHAR (uchar, SUFFIX, uchar_lanes,                           \
+                        __builtin_ia32_packuswb128, u, ulo4, ulo8)
+
+
+IMPLEMENT_SAT_CONVERSIONS (_sat)
+IMPLEMENT_SAT_CONVERSIONS (_sat_rte)
+
+#endif
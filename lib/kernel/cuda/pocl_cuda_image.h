@@ -0,0 +1,164 @@
+/* OpenCL built-in library: the texture and surface access of CUDA images
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef POCL_CUDA_IMAGE_H
+#define POCL_CUDA_IMAGE_H
+
+#include "../pocl_image_rw_utils.h"
+
+/* The image argument is the device copy of the cuda_image_t of a CUDA
+ * array, see pocl_cuda_alloc_image. */
+#define CUDA_IMAGE(image) __builtin_astype (image, global cuda_image_t *)
+
+/* The geometries of the texture and surface instructions; a constant
+ * argument of the helpers, which folds the switches over them. */
+#define GEOM_1D 0
+#define GEOM_1D_ARRAY 1
+#define GEOM_2D 2
+#define GEOM_2D_ARRAY 3
+#define GEOM_3D 4
+
+/* The texture and surface instructions. pocl_ptx_gen replaces the calls of
+ * __pocl_nvvm_X with the NVVM intrinsic llvm.nvvm.X, with the underscores
+ * of X as dots, splitting the vector arguments and results to their
+ * elements. The layer of an array comes before the coordinates, and the x
+ * coordinate of a surface is in bytes. The surface accesses outside the
+ * image load zeroes and store nothing. */
+#define DECLARE_TEXTURE_READS(__GEOM__, ...)                                  \
+  float4 __pocl_nvvm_tex_unified_##__GEOM__##_v4f32_f32 (ulong, __VA_ARGS__); \
+  int4 __pocl_nvvm_tex_unified_##__GEOM__##_v4s32_f32 (ulong, __VA_ARGS__);   \
+  uint4 __pocl_nvvm_tex_unified_##__GEOM__##_v4u32_f32 (ulong, __VA_ARGS__);
+
+#define DECLARE_SURFACE_ACCESS(__GEOM__, ...)                                 \
+  ushort __pocl_nvvm_suld_##__GEOM__##_i8_zero (ulong, __VA_ARGS__);          \
+  ushort __pocl_nvvm_suld_##__GEOM__##_i16_zero (ulong, __VA_ARGS__);         \
+  uint __pocl_nvvm_suld_##__GEOM__##_i32_zero (ulong, __VA_ARGS__);           \
+  uint2 __pocl_nvvm_suld_##__GEOM__##_v2i32_zero (ulong, __VA_ARGS__);        \
+  uint4 __pocl_nvvm_suld_##__GEOM__##_v4i32_zero (ulong, __VA_ARGS__);        \
+  void __pocl_nvvm_sust_b_##__GEOM__##_i8_zero (ulong, __VA_ARGS__, ushort);  \
+  void __pocl_nvvm_sust_b_##__GEOM__##_i16_zero (ulong, __VA_ARGS__, ushort); \
+  void __pocl_nvvm_sust_b_##__GEOM__##_i32_zero (ulong, __VA_ARGS__, uint);   \
+  void __pocl_nvvm_sust_b_##__GEOM__##_v2i32_zero (ulong, __VA_ARGS__,        \
+                                                   uint2);                    \
+  void __pocl_nvvm_sust_b_##__GEOM__##_v4i32_zero (ulong, __VA_ARGS__, uint4);
+
+DECLARE_TEXTURE_READS (1d, float)
+DECLARE_TEXTURE_READS (1d_array, int, float)
+DECLARE_TEXTURE_READS (2d, float, float)
+DECLARE_TEXTURE_READS (2d_array, int, float, float)
+DECLARE_TEXTURE_READS (3d, float, float, float)
+
+DECLARE_SURFACE_ACCESS (1d, int)
+DECLARE_SURFACE_ACCESS (1d_array, int, int)
+DECLARE_SURFACE_ACCESS (2d, int, int)
+DECLARE_SURFACE_ACCESS (2d_array, int, int, int)
+DECLARE_SURFACE_ACCESS (3d, int, int, int)
+
+/* The texture read of a pixel, as one of the result types __T__ of the
+ * declarations above, at the coordinates c of the layer. */
+#define TEXTURE_READ(__GEOM__, __T__, dst, tex, layer, c)                     \
+  switch (__GEOM__)                                                           \
+    {                                                                         \
+    case GEOM_1D:                                                             \
+      dst = __pocl_nvvm_tex_unified_1d_##__T__##_f32 (tex, c.x);              \
+      break;                                                                  \
+    case GEOM_1D_ARRAY:                                                       \
+      dst = __pocl_nvvm_tex_unified_1d_array_##__T__##_f32 (tex, layer, c.x); \
+      break;                                                                  \
+    case GEOM_2D:                                                             \
+      dst = __pocl_nvvm_tex_unified_2d_##__T__##_f32 (tex, c.x, c.y);         \
+      break;                                                                  \
+    case GEOM_2D_ARRAY:                                                       \
+      dst = __pocl_nvvm_tex_unified_2d_array_##__T__##_f32 (tex, layer, c.x,  \
+                                                           c.y);              \
+      break;                                                                  \
+    default:                                                                  \
+      dst = __pocl_nvvm_tex_unified_3d_##__T__##_f32 (tex, c.x, c.y, c.z);    \
+      break;                                                                  \
+    }
+
+/* The surface loads and stores of a pixel, as one of the access widths
+ * __W__ of the declarations above; c holds the pixel coordinates, and x
+ * the byte offset of the pixel in its row. */
+#define SURFACE_STORE(__GEOM__, __W__, surf, x, c, value)                     \
+  switch (__GEOM__)                                                           \
+    {                                                                         \
+    case GEOM_1D:                                                             \
+      __pocl_nvvm_sust_b_1d_##__W__##_zero (surf, x, value);                  \
+      break;                                                                  \
+    case GEOM_1D_ARRAY:                                                       \
+      __pocl_nvvm_sust_b_1d_array_##__W__##_zero (surf, c.y, x, value);       \
+      break;                                                                  \
+    case GEOM_2D:                                                             \
+      __pocl_nvvm_sust_b_2d_##__W__##_zero (surf, x, c.y, value);             \
+      break;                                                                  \
+    case GEOM_2D_ARRAY:                                                       \
+      __pocl_nvvm_sust_b_2d_array_##__W__##_zero (surf, c.z, x, c.y, value);  \
+      break;                                                                  \
+    default:                                                                  \
+      __pocl_nvvm_sust_b_3d_##__W__##_zero (surf, x, c.y, c.z, value);        \
+      break;                                                                  \
+    }
+
+#define SURFACE_LOAD(__GEOM__, __W__, dst, surf, x, c)                        \
+  switch (__GEOM__)                                                           \
+    {                                                                         \
+    case GEOM_1D:                                                             \
+      dst = __pocl_nvvm_suld_1d_##__W__##_zero (surf, x);                     \
+      break;                                                                  \
+    case GEOM_1D_ARRAY:                                                       \
+      dst = __pocl_nvvm_suld_1d_array_##__W__##_zero (surf, c.y, x);          \
+      break;                                                                  \
+    case GEOM_2D:                                                             \
+      dst = __pocl_nvvm_suld_2d_##__W__##_zero (surf, x, c.y);                \
+      break;                                                                  \
+    case GEOM_2D_ARRAY:                                                       \
+      dst = __pocl_nvvm_suld_2d_array_##__W__##_zero (surf, c.z, x, c.y);     \
+      break;                                                                  \
+    default:                                                                  \
+      dst = __pocl_nvvm_suld_3d_##__W__##_zero (surf, x, c.y, c.z);           \
+      break;                                                                  \
+    }
+
+/* The pixel coordinates of the integer coordinates coord of an image of
+ * the geometry: the layer of an array is clamped to the array, as the
+ * reads and writes of the other drivers do. */
+_CL_ALWAYSINLINE static int4
+pocl_cuda_pixel_coord (global cuda_image_t *img, int geom, int4 coord)
+{
+  int last = img->_base._image_array_size - 1;
+  if (geom == GEOM_1D_ARRAY)
+    coord.y = clamp (coord.y, 0, last);
+  else if (geom == GEOM_2D_ARRAY)
+    coord.z = clamp (coord.z, 0, last);
+  return coord;
+}
+
+/* The size of a pixel of the image in bytes */
+_CL_ALWAYSINLINE static int
+pocl_cuda_pixel_size (global cuda_image_t *img)
+{
+  return img->_base._num_channels * img->_base._elem_size;
+}
+
+#endif
@@ -0,0 +1,259 @@
+/* OpenCL built-in library: read_image() for the CUDA devices
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* The reads with a sampler go through the texture object of the sampler
+   state, so the texture units do the addressing, the filtering and the
+   conversion of the channels. The reads without one load the pixel through
+   the surface object and convert it here. */
+
+#include "../templates.h"
+#include "pocl_cuda_image.h"
+
+#if __clang_major__ > 3
+#define READ_SAMPLER                                                          \
+  const dev_sampler_t s                                                       \
+      = (dev_sampler_t) (__builtin_astype (sampler, uintptr_t));
+#else
+#define READ_SAMPLER                                                          \
+  const dev_sampler_t s = (dev_sampler_t) (__builtin_astype (sampler, int));
+#endif
+
+/* Fills in the channels the image order lacks, as the bits of the values
+ * of data_class, and puts the channels of a BGRA image in order. */
+_CL_ALWAYSINLINE static uint4
+pocl_cuda_fill_channels (global cuda_image_t *img, uint4 c, int data_class)
+{
+  uint one = (data_class == POCL_IMAGE_CLASS_f) ? as_uint (1.0f) : 1;
+  switch (img->_base._order)
+    {
+    case CLK_R:
+      return (uint4) (c.x, 0, 0, one);
+    case CLK_RG:
+      return (uint4) (c.x, c.y, 0, one);
+    case CLK_BGRA:
+      return c.zyxw;
+    default:
+      return c;
+    }
+}
+
+/* Reads the image through the texture of the sampler state s at the
+ * texture coordinates coord, in the layer of an array that layer_coord
+ * has, and returns the pixel as the bits of the values of data_class. */
+_CL_ALWAYSINLINE static uint4
+pocl_cuda_read_texture (global cuda_image_t *img, int geom, dev_sampler_t s,
+                        float4 coord, int4 layer_coord, int data_class)
+{
+  ulong tex = img->_textures[POCL_CUDA_TEXTURE_INDEX (s)];
+  int4 lc = pocl_cuda_pixel_coord (img, geom, layer_coord);
+  int layer = (geom == GEOM_1D_ARRAY) ? lc.y : lc.z;
+
+  uint4 c;
+  if (data_class == POCL_IMAGE_CLASS_i)
+    {
+      int4 v;
+      TEXTURE_READ (geom, v4s32, v, tex, layer, coord);
+      c = as_uint4 (v);
+    }
+  else if (data_class == POCL_IMAGE_CLASS_ui)
+    {
+      TEXTURE_READ (geom, v4u32, c, tex, layer, coord);
+    }
+  else
+    {
+      float4 v;
+      TEXTURE_READ (geom, v4f32, v, tex, layer, coord);
+      c = as_uint4 (v);
+    }
+  return pocl_cuda_fill_channels (img, c, data_class);
+}
+
+/* Loads the bytes of the pixel at the pixel coordinates c, as up to four
+ * 32-bit words. */
+_CL_ALWAYSINLINE static uint4
+pocl_cuda_load_pixel (global cuda_image_t *img, int geom, int4 c)
+{
+  ulong surf = img->_surface;
+  int size = pocl_cuda_pixel_size (img);
+  int x = c.x * size;
+  uint4 raw = (uint4) (0);
+  uint v;
+  switch (size)
+    {
+    case 1:
+      SURFACE_LOAD (geom, i8, v, surf, x, c);
+      raw.x = v & UCHAR_MAX;
+      break;
+    case 2:
+      SURFACE_LOAD (geom, i16, v, surf, x, c);
+      raw.x = v;
+      break;
+    case 4:
+      SURFACE_LOAD (geom, i32, raw.x, surf, x, c);
+      break;
+    case 8:
+      SURFACE_LOAD (geom, v2i32, raw.xy, surf, x, c);
+      break;
+    default:
+      SURFACE_LOAD (geom, v4i32, raw, surf, x, c);
+      break;
+    }
+  return raw;
+}
+
+/* Converts the bytes of a pixel to its channels, as the bits of the values
+ * of data_class. */
+_CL_ALWAYSINLINE static uint4
+pocl_cuda_decode_pixel (global cuda_image_t *img, uint4 raw, int data_class)
+{
+  uint4 c;
+  switch (img->_base._data_type)
+    {
+    case CLK_UNORM_INT8:
+      c = as_uint4 (convert_float4 (as_uchar16 (raw).s0123)
+                    * (1.0f / UCHAR_MAX));
+      break;
+    case CLK_SNORM_INT8:
+      c = as_uint4 (fmax (convert_float4 (as_char16 (raw).s0123)
+                              * (1.0f / SCHAR_MAX),
+                          -1.0f));
+      break;
+    case CLK_UNORM_INT16:
+      c = as_uint4 (convert_float4 (as_ushort8 (raw).s0123)
+                    * (1.0f / USHRT_MAX));
+      break;
+    case CLK_SNORM_INT16:
+      c = as_uint4 (fmax (convert_float4 (as_short8 (raw).s0123)
+                              * (1.0f / SHRT_MAX),
+                          -1.0f));
+      break;
+    case CLK_HALF_FLOAT:
+      {
+        ushort4 h = as_ushort8 (raw).s0123;
+        c = as_uint4 (vload_half4 (0, (const half *)&h));
+        break;
+      }
+    case CLK_SIGNED_INT8:
+      c = as_uint4 (convert_int4 (as_char16 (raw).s0123));
+      break;
+    case CLK_SIGNED_INT16:
+      c = as_uint4 (convert_int4 (as_short8 (raw).s0123));
+      break;
+    case CLK_UNSIGNED_INT8:
+      c = convert_uint4 (as_uchar16 (raw).s0123);
+      break;
+    case CLK_UNSIGNED_INT16:
+      c = convert_uint4 (as_ushort8 (raw).s0123);
+      break;
+    default:
+      /* the 32-bit channels */
+      c = raw;
+      break;
+    }
+  return pocl_cuda_fill_channels (img, c, data_class);
+}
+
+/* The samplerless reads behave as the reads with a sampler of unnormalized
+   coordinates, CLK_ADDRESS_NONE and CLK_FILTER_NEAREST, which the surface
+   load is. */
+#define IMPLEMENT_READ_IMAGE_NOSAMPLER(__IMGTYPE__, __GEOM__, __RETVAL__,     \
+                                       __POSTFIX__, __COORD__)                \
+  __RETVAL__ _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY                  \
+  read_image##__POSTFIX__ (__IMGTYPE__ image, __COORD__ coord)                \
+  {                                                                           \
+    int4 coord4;                                                              \
+    INITCOORD##__COORD__ (coord4, coord);                                     \
+    global cuda_image_t *img = CUDA_IMAGE (image);                            \
+    int4 c = pocl_cuda_pixel_coord (img, __GEOM__, coord4);                   \
+    uint4 raw = pocl_cuda_load_pixel (img, __GEOM__, c);                      \
+    return as_##__RETVAL__ (                                                  \
+        pocl_cuda_decode_pixel (img, raw, POCL_IMAGE_CLASS_##__POSTFIX__));   \
+  }
+
+/* The integer coordinates are those of the pixels, whose centers the
+   texture coordinates are at. */
+#define IMPLEMENT_READ_IMAGE_INT_COORD(__IMGTYPE__, __GEOM__, __RETVAL__,     \
+                                       __POSTFIX__, __COORD__)                \
+  __RETVAL__ _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY                  \
+  read_image##__POSTFIX__ (__IMGTYPE__ image, sampler_t sampler,              \
+                           __COORD__ coord)                                   \
+  {                                                                           \
+    int4 coord4;                                                              \
+    INITCOORD##__COORD__ (coord4, coord);                                     \
+    READ_SAMPLER                                                              \
+    return as_##__RETVAL__ (pocl_cuda_read_texture (                          \
+        CUDA_IMAGE (image), __GEOM__, s, convert_float4 (coord4) + 0.5f,      \
+        coord4, POCL_IMAGE_CLASS_##__POSTFIX__));                             \
+  }
+
+/* The layer of an array is the nearest integer to its coordinate. */
+#define IMPLEMENT_READ_IMAGE_FLOAT_COORD(__IMGTYPE__, __GEOM__, __RETVAL__,   \
+                                         __POSTFIX__, __COORD__)              \
+  __RETVAL__ _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY                  \
+  read_image##__POSTFIX__ (__IMGTYPE__ image, sampler_t sampler,              \
+                           __COORD__ coord)                                   \
+  {                                                                           \
+    float4 coord4;                                                            \
+    INITCOORD##__COORD__ (coord4, coord);                                     \
+    READ_SAMPLER                                                              \
+    return as_##__RETVAL__ (pocl_cuda_read_texture (                          \
+        CUDA_IMAGE (image), __GEOM__, s, coord4, convert_int4_rte (coord4),   \
+        POCL_IMAGE_CLASS_##__POSTFIX__));                                     \
+  }
+
+#define IMPLEMENT_READ_IMAGE(__IMGTYPE__, __GEOM__, __INTCOORD__,             \
+                             __FLOATCOORD__)                                  \
+  IMPLEMENT_READ_IMAGE_NOSAMPLER (__IMGTYPE__, __GEOM__, float4, f,           \
+                                  __INTCOORD__)                               \
+  IMPLEMENT_READ_IMAGE_NOSAMPLER (__IMGTYPE__, __GEOM__, int4, i,             \
+                                  __INTCOORD__)                               \
+  IMPLEMENT_READ_IMAGE_NOSAMPLER (__IMGTYPE__, __GEOM__, uint4, ui,           \
+                                  __INTCOORD__)                               \
+  IMPLEMENT_READ_IMAGE_INT_COORD (__IMGTYPE__, __GEOM__, float4, f,           \
+                                  __INTCOORD__)                               \
+  IMPLEMENT_READ_IMAGE_INT_COORD (__IMGTYPE__, __GEOM__, int4, i,             \
+                                  __INTCOORD__)                               \
+  IMPLEMENT_READ_IMAGE_INT_COORD (__IMGTYPE__, __GEOM__, uint4, ui,           \
+                                  __INTCOORD__)                               \
+  IMPLEMENT_READ_IMAGE_FLOAT_COORD (__IMGTYPE__, __GEOM__, float4, f,         \
+                                    __FLOATCOORD__)                           \
+  IMPLEMENT_READ_IMAGE_FLOAT_COORD (__IMGTYPE__, __GEOM__, int4, i,           \
+                                    __FLOATCOORD__)                           \
+  IMPLEMENT_READ_IMAGE_FLOAT_COORD (__IMGTYPE__, __GEOM__, uint4, ui,         \
+                                    __FLOATCOORD__)
+
+IMPLEMENT_READ_IMAGE (IMG_RO_AQ image1d_t, GEOM_1D, int, float)
+IMPLEMENT_READ_IMAGE (IMG_RO_AQ image1d_array_t, GEOM_1D_ARRAY, int2, float2)
+IMPLEMENT_READ_IMAGE (IMG_RO_AQ image2d_t, GEOM_2D, int2, float2)
+IMPLEMENT_READ_IMAGE (IMG_RO_AQ image2d_array_t, GEOM_2D_ARRAY, int4, float4)
+IMPLEMENT_READ_IMAGE (IMG_RO_AQ image3d_t, GEOM_3D, int4, float4)
+
+#ifdef CLANG_HAS_RW_IMAGES
+
+IMPLEMENT_READ_IMAGE (IMG_RW_AQ image1d_t, GEOM_1D, int, float)
+IMPLEMENT_READ_IMAGE (IMG_RW_AQ image1d_array_t, GEOM_1D_ARRAY, int2, float2)
+IMPLEMENT_READ_IMAGE (IMG_RW_AQ image2d_t, GEOM_2D, int2, float2)
+IMPLEMENT_READ_IMAGE (IMG_RW_AQ image2d_array_t, GEOM_2D_ARRAY, int4, float4)
+IMPLEMENT_READ_IMAGE (IMG_RW_AQ image3d_t, GEOM_3D, int4, float4)
+
+#endif
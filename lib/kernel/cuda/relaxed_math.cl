@@ -0,0 +1,76 @@
+/* OpenCL built-in library: relaxed precision math functions for CUDA
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* The relaxed precision versions of the float math builtins, which the
+   kernel library linker binds the native_ builtins to and, with
+   -cl-fast-relaxed-math or -cl-unsafe-math-optimizations, also the
+   standard ones (see lib/llvmopencl/linker.cpp). They call the approximate
+   __nv_fast_* functions of libdevice, which is linked to the kernel by
+   pocl-ptx-gen, and compile to the special function unit instructions. */
+
+#include "../templates.h"
+
+float __nv_fast_expf (float);
+float __nv_fast_exp10f (float);
+float __nv_fast_logf (float);
+float __nv_fast_log2f (float);
+float __nv_fast_log10f (float);
+float __nv_fast_powf (float, float);
+float __nv_fast_sinf (float);
+float __nv_fast_cosf (float);
+float __nv_fast_tanf (float);
+float __nv_fast_fdividef (float, float);
+
+#define IMPLEMENT_RELAXED_V_V(NAME, FUNC)                                     \
+  float _CL_OVERLOADABLE NAME (float a) { return FUNC (a); }                  \
+  IMPLEMENT_BUILTIN_V_V (NAME, float2, lo, hi)                                \
+  IMPLEMENT_BUILTIN_V_V (NAME, float3, lo, s2)                                \
+  IMPLEMENT_BUILTIN_V_V (NAME, float4, lo, hi)                                \
+  IMPLEMENT_BUILTIN_V_V (NAME, float8, lo, hi)                                \
+  IMPLEMENT_BUILTIN_V_V (NAME, float16, lo, hi)
+
+#define IMPLEMENT_RELAXED_V_VV(NAME, FUNC)                                    \
+  float _CL_OVERLOADABLE NAME (float a, float b) { return FUNC (a, b); }      \
+  IMPLEMENT_BUILTIN_V_VV (NAME, float2, lo, hi)                               \
+  IMPLEMENT_BUILTIN_V_VV (NAME, float3, lo, s2)                               \
+  IMPLEMENT_BUILTIN_V_VV (NAME, float4, lo, hi)                               \
+  IMPLEMENT_BUILTIN_V_VV (NAME, float8, lo, hi)                               \
+  IMPLEMENT_BUILTIN_V_VV (NAME, float16, lo, hi)
+
+static float
+_pocl_relaxed_recipf (float a)
+{
+  return __nv_fast_fdividef (1.0f, a);
+}
+
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_exp, __nv_fast_expf)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_exp10, __nv_fast_exp10f)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_log, __nv_fast_logf)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_log2, __nv_fast_log2f)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_log10, __nv_fast_log10f)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_sin, __nv_fast_sinf)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_cos, __nv_fast_cosf)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_tan, __nv_fast_tanf)
+IMPLEMENT_RELAXED_V_V (_cl_relaxed_recip, _pocl_relaxed_recipf)
+IMPLEMENT_RELAXED_V_VV (_cl_relaxed_powr, __nv_fast_powf)
+IMPLEMENT_RELAXED_V_VV (_cl_relaxed_divide, __nv_fast_fdividef)
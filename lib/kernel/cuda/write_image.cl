@@ -0,0 +1,145 @@
+/* OpenCL built-in library: write_image() for the CUDA devices
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* The writes convert the color to the channels of the image here, and
+   store the bytes of the pixel through the surface object, which drops
+   the writes outside the image. */
+
+#include "../templates.h"
+#include "pocl_cuda_image.h"
+
+/* Converts the color, as the bits of the values of the write_image
+ * function, to the bytes of a pixel of the image, as up to four 32-bit
+ * words. The channels the image order lacks are dropped. */
+_CL_ALWAYSINLINE static uint4
+pocl_cuda_encode_pixel (global cuda_image_t *img, uint4 color)
+{
+  uint4 raw = (uint4) (0);
+  if (img->_base._order == CLK_BGRA)
+    color = color.zyxw;
+  float4 f = as_float4 (color);
+  switch (img->_base._data_type)
+    {
+    case CLK_UNORM_INT8:
+      raw.x = as_uint (convert_uchar4_sat_rte (f * (float)UCHAR_MAX));
+      break;
+    case CLK_SNORM_INT8:
+      raw.x = as_uint (convert_char4_sat_rte (f * (float)SCHAR_MAX));
+      break;
+    case CLK_UNORM_INT16:
+      raw.xy = as_uint2 (convert_ushort4_sat_rte (f * (float)USHRT_MAX));
+      break;
+    case CLK_SNORM_INT16:
+      raw.xy = as_uint2 (convert_short4_sat_rte (f * (float)SHRT_MAX));
+      break;
+    case CLK_HALF_FLOAT:
+      {
+        ushort4 h;
+        vstore_half4 (f, 0, (half *)&h);
+        raw.xy = as_uint2 (h);
+        break;
+      }
+    case CLK_SIGNED_INT8:
+      raw.x = as_uint (convert_char4_sat (as_int4 (color)));
+      break;
+    case CLK_SIGNED_INT16:
+      raw.xy = as_uint2 (convert_short4_sat (as_int4 (color)));
+      break;
+    case CLK_UNSIGNED_INT8:
+      raw.x = as_uint (convert_uchar4_sat (color));
+      break;
+    case CLK_UNSIGNED_INT16:
+      raw.xy = as_uint2 (convert_ushort4_sat (color));
+      break;
+    default:
+      /* the 32-bit channels */
+      raw = color;
+      break;
+    }
+  return raw;
+}
+
+/* Stores the bytes of the pixel at the pixel coordinates c. */
+_CL_ALWAYSINLINE static void
+pocl_cuda_store_pixel (global cuda_image_t *img, int geom, int4 c, uint4 raw)
+{
+  ulong surf = img->_surface;
+  int size = pocl_cuda_pixel_size (img);
+  int x = c.x * size;
+  switch (size)
+    {
+    case 1:
+      SURFACE_STORE (geom, i8, surf, x, c, (ushort)raw.x);
+      break;
+    case 2:
+      SURFACE_STORE (geom, i16, surf, x, c, (ushort)raw.x);
+      break;
+    case 4:
+      SURFACE_STORE (geom, i32, surf, x, c, raw.x);
+      break;
+    case 8:
+      SURFACE_STORE (geom, v2i32, surf, x, c, raw.xy);
+      break;
+    default:
+      SURFACE_STORE (geom, v4i32, surf, x, c, raw);
+      break;
+    }
+}
+
+#define IMPLEMENT_WRITE_IMAGE(__IMGTYPE__, __GEOM__, __POSTFIX__, __COORD__,  \
+                              __DTYPE__)                                      \
+  void _CL_OVERLOADABLE write_image##__POSTFIX__ (                            \
+      __IMGTYPE__ image, __COORD__ coord, __DTYPE__ color)                    \
+  {                                                                           \
+    int4 coord4;                                                              \
+    INITCOORD##__COORD__ (coord4, coord);                                     \
+    global cuda_image_t *img = CUDA_IMAGE (image);                            \
+    int4 c = pocl_cuda_pixel_coord (img, __GEOM__, coord4);                   \
+    pocl_cuda_store_pixel (img, __GEOM__, c,                                  \
+                           pocl_cuda_encode_pixel (img, as_uint4 (color)));   \
+  }
+
+#define IMPLEMENT_WRITE_IMAGES(__IMGTYPE__, __GEOM__, __COORD__)              \
+  IMPLEMENT_WRITE_IMAGE (__IMGTYPE__, __GEOM__, f, __COORD__, float4)         \
+  IMPLEMENT_WRITE_IMAGE (__IMGTYPE__, __GEOM__, i, __COORD__, int4)           \
+  IMPLEMENT_WRITE_IMAGE (__IMGTYPE__, __GEOM__, ui, __COORD__, uint4)
+
+IMPLEMENT_WRITE_IMAGES (IMG_WO_AQ image1d_t, GEOM_1D, int)
+IMPLEMENT_WRITE_IMAGES (IMG_WO_AQ image1d_array_t, GEOM_1D_ARRAY, int2)
+IMPLEMENT_WRITE_IMAGES (IMG_WO_AQ image2d_t, GEOM_2D, int2)
+IMPLEMENT_WRITE_IMAGES (IMG_WO_AQ image2d_array_t, GEOM_2D_ARRAY, int4)
+#ifdef cl_khr_3d_image_writes
+IMPLEMENT_WRITE_IMAGES (IMG_WO_AQ image3d_t, GEOM_3D, int4)
+#endif
+
+#ifdef CLANG_HAS_RW_IMAGES
+
+IMPLEMENT_WRITE_IMAGES (IMG_RW_AQ image1d_t, GEOM_1D, int)
+IMPLEMENT_WRITE_IMAGES (IMG_RW_AQ image1d_array_t, GEOM_1D_ARRAY, int2)
+IMPLEMENT_WRITE_IMAGES (IMG_RW_AQ image2d_t, GEOM_2D, int2)
+IMPLEMENT_WRITE_IMAGES (IMG_RW_AQ image2d_array_t, GEOM_2D_ARRAY, int4)
+#ifdef cl_khr_3d_image_writes
+IMPLEMENT_WRITE_IMAGES (IMG_RW_AQ image3d_t, GEOM_3D, int4)
+#endif
+
+#endif
@@ -0,0 +1,165 @@
+/* OpenCL built-in library: the ndrange, event and queue builtins of the
+   OpenCL 2.0 device-side enqueue
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* The queues and the events are passed as they are to the helpers in
+ * enqueue_kernel.c, which see them as plain pointers. */
+
+#if defined(__opencl_c_device_enqueue) && POCL_DEVICE_ADDRESS_BITS == 64
+
+int __pocl_enqueue_marker (queue_t queue, uint num_events,
+                           const clk_event_t *wait_list,
+                           clk_event_t *event_ret);
+clk_event_t __pocl_create_user_event (void);
+void __pocl_set_user_event_status (clk_event_t event, int status);
+void __pocl_retain_event (clk_event_t event);
+void __pocl_release_event (clk_event_t event);
+int __pocl_is_valid_event (clk_event_t event);
+queue_t __pocl_get_default_queue (void);
+
+static ndrange_t
+make_ndrange (uint work_dim, const size_t *offset, const size_t *global,
+              const size_t *local)
+{
+  ndrange_t range;
+  uint d;
+  range.workDimension = work_dim;
+  for (d = 0; d < 3; ++d)
+    {
+      range.globalWorkOffset[d] = (offset != 0 && d < work_dim) ? offset[d] : 0;
+      range.globalWorkSize[d] = d < work_dim ? global[d] : 1;
+      range.localWorkSize[d]
+          = d < work_dim ? (local != 0 ? local[d] : 0) : 1;
+    }
+  return range;
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_1D (size_t global_work_size)
+{
+  return make_ndrange (1, 0, &global_work_size, 0);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_1D (size_t global_work_size, size_t local_work_size)
+{
+  return make_ndrange (1, 0, &global_work_size, &local_work_size);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_1D (size_t global_work_offset, size_t global_work_size,
+            size_t local_work_size)
+{
+  return make_ndrange (1, &global_work_offset, &global_work_size,
+                       &local_work_size);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_2D (const size_t global_work_size[2])
+{
+  return make_ndrange (2, 0, global_work_size, 0);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_2D (const size_t global_work_size[2],
+            const size_t local_work_size[2])
+{
+  return make_ndrange (2, 0, global_work_size, local_work_size);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_2D (const size_t global_work_offset[2],
+            const size_t global_work_size[2],
+            const size_t local_work_size[2])
+{
+  return make_ndrange (2, global_work_offset, global_work_size,
+                       local_work_size);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_3D (const size_t global_work_size[3])
+{
+  return make_ndrange (3, 0, global_work_size, 0);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_3D (const size_t global_work_size[3],
+            const size_t local_work_size[3])
+{
+  return make_ndrange (3, 0, global_work_size, local_work_size);
+}
+
+ndrange_t _CL_OVERLOADABLE
+ndrange_3D (const size_t global_work_offset[3],
+            const size_t global_work_size[3],
+            const size_t local_work_size[3])
+{
+  return make_ndrange (3, global_work_offset, global_work_size,
+                       local_work_size);
+}
+
+int _CL_OVERLOADABLE
+enqueue_marker (queue_t queue, uint num_events_in_wait_list,
+                const clk_event_t *event_wait_list, clk_event_t *event_ret)
+{
+  return __pocl_enqueue_marker (queue, num_events_in_wait_list,
+                                event_wait_list, event_ret);
+}
+
+void _CL_OVERLOADABLE
+retain_event (clk_event_t event)
+{
+  __pocl_retain_event (event);
+}
+
+void _CL_OVERLOADABLE
+release_event (clk_event_t event)
+{
+  __pocl_release_event (event);
+}
+
+clk_event_t _CL_OVERLOADABLE
+create_user_event (void)
+{
+  return __pocl_create_user_event ();
+}
+
+void _CL_OVERLOADABLE
+set_user_event_status (clk_event_t event, int status)
+{
+  __pocl_set_user_event_status (event, status);
+}
+
+bool _CL_OVERLOADABLE
+is_valid_event (clk_event_t event)
+{
+  return __pocl_is_valid_event (event) != 0;
+}
+
+queue_t _CL_OVERLOADABLE
+get_default_queue (void)
+{
+  return __pocl_get_default_queue ();
+}
+
+#endif
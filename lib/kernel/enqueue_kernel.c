@@ -0,0 +1,168 @@
+/* OpenCL built-in library: the OpenCL 2.0 device-side enqueue functions of
+   the CPU devices
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* Clang lowers enqueue_kernel() and the kernel queries of the blocks to
+ * calls of the __enqueue_kernel_* and __get_kernel_*_impl functions, which
+ * get the queue and the events as pointers to opaque types, the ndrange_t
+ * by reference, the child kernel (the name of it, see pocl_llvm_build.cc)
+ * and the block literal. The linker casts the pointers to the ones defined
+ * here, see unifyDeviceEnqueueFingerPrints().
+ *
+ * They, and the helpers of the other device-side enqueue builtins in
+ * device_enqueue.cl, call the driver of the device through the device queue
+ * of the thread running the work-group, which the work-group function
+ * passes in its context struct. A device without device queues leaves it
+ * NULL, and the enqueues then fail. */
+
+#include "pocl_device_enqueue.h"
+
+#if POCL_DEVICE_ADDRESS_BITS == 64
+
+/* privatized to the device_enqueue of the context struct by the kernel
+   compiler, see Workgroup::privatizeContext() */
+extern struct pocl_device_enqueue *_pocl_device_enqueue;
+
+static int
+enqueue (void *queue, int flags, const pocl_ndrange *range, uint num_events,
+         void *const *wait_list, void **event_ret, void *kernel, void *block,
+         uint num_locals, const size_t *local_sizes)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  if (de == 0)
+    return POCL_CLK_INVALID_QUEUE;
+  return de->enqueue_kernel (de, queue, flags, range, num_events, wait_list,
+                             event_ret, (const char *)kernel, block,
+                             num_locals, (const ulong *)local_sizes);
+}
+
+int
+__enqueue_kernel_basic (void *queue, int flags, const pocl_ndrange *range,
+                        void *kernel, void *block)
+{
+  return enqueue (queue, flags, range, 0, 0, 0, kernel, block, 0, 0);
+}
+
+int
+__enqueue_kernel_basic_events (void *queue, int flags,
+                               const pocl_ndrange *range, uint num_events,
+                               void *const *wait_list, void **event_ret,
+                               void *kernel, void *block)
+{
+  return enqueue (queue, flags, range, num_events, wait_list, event_ret,
+                  kernel, block, 0, 0);
+}
+
+int
+__enqueue_kernel_varargs (void *queue, int flags, const pocl_ndrange *range,
+                          void *kernel, void *block, uint num_locals,
+                          const size_t *local_sizes)
+{
+  return enqueue (queue, flags, range, 0, 0, 0, kernel, block, num_locals,
+                  local_sizes);
+}
+
+int
+__enqueue_kernel_events_varargs (void *queue, int flags,
+                                 const pocl_ndrange *range, uint num_events,
+                                 void *const *wait_list, void **event_ret,
+                                 void *kernel, void *block, uint num_locals,
+                                 const size_t *local_sizes)
+{
+  return enqueue (queue, flags, range, num_events, wait_list, event_ret,
+                  kernel, block, num_locals, local_sizes);
+}
+
+uint
+__get_kernel_work_group_size_impl (void *kernel, void *block)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  return de ? (uint)de->max_work_group_size : 1;
+}
+
+uint
+__get_kernel_preferred_work_group_size_multiple_impl (void *kernel,
+                                                      void *block)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  return de ? (uint)de->preferred_work_group_size_multiple : 1;
+}
+
+/* The helpers of the builtins of device_enqueue.cl. */
+
+int
+__pocl_enqueue_marker (void *queue, uint num_events, void *const *wait_list,
+                       void **event_ret)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  if (de == 0)
+    return POCL_CLK_INVALID_QUEUE;
+  return de->enqueue_marker (de, queue, num_events, wait_list, event_ret);
+}
+
+void *
+__pocl_create_user_event (void)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  return de ? de->create_user_event (de) : (void *)-1;
+}
+
+void
+__pocl_set_user_event_status (void *event, int status)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  if (de)
+    de->set_user_event_status (de, event, status);
+}
+
+void
+__pocl_retain_event (void *event)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  if (de)
+    de->retain_event (de, event);
+}
+
+void
+__pocl_release_event (void *event)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  if (de)
+    de->release_event (de, event);
+}
+
+/* CLK_NULL_EVENT is all ones. */
+int
+__pocl_is_valid_event (void *event)
+{
+  return event != 0 && event != (void *)-1;
+}
+
+void *
+__pocl_get_default_queue (void)
+{
+  struct pocl_device_enqueue *de = _pocl_device_enqueue;
+  return de ? de->get_default_queue (de) : 0;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/* OpenCL built-in library: async_work_group_copy() for CPU devices
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "../templates.h"
+
+/* The async copies for the CPU devices. A work-group executes in a
+   single thread without a separate copy engine, thus the copy is done by
+   one work-item as a bulk memcpy() of the block, which the C library
+   implements with the widest vector moves of the CPU (and non-temporal
+   stores for the blocks larger than the caches). The copying work-item
+   then prefetches the block following the source, as the tiled kernels
+   typically proceed to copy it next, to overlap its loading with the
+   computation on the current one. wait_group_events() is a work-group
+   barrier which also separates the copy from the computation consuming
+   it to their own parallel regions, keeping the latter vectorizable. */
+
+/* The pointers are passed through an integer to memcpy(), as the CPU
+   address spaces are all the same flat memory. */
+#define IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE(GENTYPE)                            \
+  __attribute__ ((overloadable)) event_t async_work_group_copy (              \
+      __local GENTYPE *dst, const __global GENTYPE *src, size_t num_gentypes, \
+      event_t event)                                                          \
+  {                                                                           \
+    __SINGLE_WI                                                               \
+    {                                                                         \
+      __builtin_memcpy ((void *)(size_t)dst, (const void *)(size_t)src,       \
+                        num_gentypes * sizeof (GENTYPE));                     \
+      prefetch (src + num_gentypes, num_gentypes);                            \
+    }                                                                         \
+    return event;                                                             \
+  }                                                                           \
+                                                                              \
+  __attribute__ ((overloadable)) event_t async_work_group_copy (              \
+      __global GENTYPE *dst, const __local GENTYPE *src, size_t num_gentypes, \
+      event_t event)                                                          \
+  {                                                                           \
+    __SINGLE_WI                                                               \
+    {                                                                         \
+      __builtin_memcpy ((void *)(size_t)dst, (const void *)(size_t)src,       \
+                        num_gentypes * sizeof (GENTYPE));                     \
+    }                                                                         \
+    return event;                                                             \
+  }
+
+#define IMPLEMENT_ASYNC_COPY_FUNCS(GENTYPE)                                   \
+  IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE (GENTYPE)                                 \
+  IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE (GENTYPE##2)                              \
+  IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE (GENTYPE##3)                              \
+  IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE (GENTYPE##4)                              \
+  IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE (GENTYPE##8)                              \
+  IMPLEMENT_ASYNC_COPY_FUNCS_SINGLE (GENTYPE##16)
+
+IMPLEMENT_ASYNC_COPY_FUNCS (char);
+IMPLEMENT_ASYNC_COPY_FUNCS (uchar);
+IMPLEMENT_ASYNC_COPY_FUNCS (short);
+IMPLEMENT_ASYNC_COPY_FUNCS (ushort);
+IMPLEMENT_ASYNC_COPY_FUNCS (int);
+IMPLEMENT_ASYNC_COPY_FUNCS (uint);
+__IF_INT64 (IMPLEMENT_ASYNC_COPY_FUNCS (long));
+__IF_INT64 (IMPLEMENT_ASYNC_COPY_FUNCS (ulong));
+
+__IF_FP16 (IMPLEMENT_ASYNC_COPY_FUNCS (half));
+IMPLEMENT_ASYNC_COPY_FUNCS (float);
+__IF_FP64 (IMPLEMENT_ASYNC_COPY_FUNCS (double));
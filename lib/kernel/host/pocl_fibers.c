@@ -0,0 +1,273 @@
+/* OpenCL built-in library: the fibers of the work-items of the work-group
+   functions generated with the fiber method, see WorkitemFibers.cc
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* Each work-item runs the kernel body on a stack of its own, and a barrier
+ * switches back to the loop of __pocl_fibers_run, which resumes the
+ * work-items in rounds in the order of their linear local ids. When all
+ * the unfinished work-items have reached the barrier, the next round
+ * continues them past it. The switches save only the callee-saved
+ * registers of the C ABI, as the barriers are calls.
+ *
+ * The work-group function passes the body, and its stack size, as they
+ * depend on the kernel. The stacks of a work-group are one allocation,
+ * kept in a small pool for the next work-groups. */
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(_WIN32)
+
+void *malloc (size_t size);
+void free (void *ptr);
+
+/* The per work-item state. The work-group function reads the local ids
+ * from it, at the offsets of this layout. */
+typedef struct pocl_fiber
+{
+  void *shared;
+  size_t local_id[3];
+  /* the stack pointer saved at the last switch out of the fiber */
+  void *sp;
+  struct pocl_fiber_group *group;
+  int done;
+} pocl_fiber;
+
+typedef struct pocl_fiber_group
+{
+  /* the stack pointer saved by the switches to the fibers; the first
+   * member, so the first switch to a fiber passes the group to
+   * __pocl_fiber_start as well */
+  void *sched_sp;
+  pocl_fiber *current;
+  void (*body) (pocl_fiber *);
+  size_t count;
+} pocl_fiber_group;
+
+/* Saves the callee-saved registers on the current stack and its stack
+ * pointer to *from_sp, and restores the ones saved at to_sp. Returns when
+ * switched back to. The first switch to a fiber returns to
+ * __pocl_fiber_start, with from_sp left as its argument. */
+__attribute__ ((naked, noinline)) void
+__pocl_fiber_switch (void **from_sp, void *to_sp)
+{
+#if defined(__x86_64__)
+  __asm__ volatile ("pushq %rbp\n\t"
+                    "pushq %rbx\n\t"
+                    "pushq %r12\n\t"
+                    "pushq %r13\n\t"
+                    "pushq %r14\n\t"
+                    "pushq %r15\n\t"
+                    "movq %rsp, (%rdi)\n\t"
+                    "movq %rsi, %rsp\n\t"
+                    "popq %r15\n\t"
+                    "popq %r14\n\t"
+                    "popq %r13\n\t"
+                    "popq %r12\n\t"
+                    "popq %rbx\n\t"
+                    "popq %rbp\n\t"
+                    "retq\n\t");
+#else
+  __asm__ volatile ("sub sp, sp, #160\n\t"
+                    "stp x19, x20, [sp, #0]\n\t"
+                    "stp x21, x22, [sp, #16]\n\t"
+                    "stp x23, x24, [sp, #32]\n\t"
+                    "stp x25, x26, [sp, #48]\n\t"
+                    "stp x27, x28, [sp, #64]\n\t"
+                    "stp x29, x30, [sp, #80]\n\t"
+                    "stp d8, d9, [sp, #96]\n\t"
+                    "stp d10, d11, [sp, #112]\n\t"
+                    "stp d12, d13, [sp, #128]\n\t"
+                    "stp d14, d15, [sp, #144]\n\t"
+                    "mov x9, sp\n\t"
+                    "str x9, [x0]\n\t"
+                    "mov sp, x1\n\t"
+                    "ldp x19, x20, [sp, #0]\n\t"
+                    "ldp x21, x22, [sp, #16]\n\t"
+                    "ldp x23, x24, [sp, #32]\n\t"
+                    "ldp x25, x26, [sp, #48]\n\t"
+                    "ldp x27, x28, [sp, #64]\n\t"
+                    "ldp x29, x30, [sp, #80]\n\t"
+                    "ldp d8, d9, [sp, #96]\n\t"
+                    "ldp d10, d11, [sp, #112]\n\t"
+                    "ldp d12, d13, [sp, #128]\n\t"
+                    "ldp d14, d15, [sp, #144]\n\t"
+                    "add sp, sp, #160\n\t"
+                    "ret\n\t");
+#endif
+}
+
+/* The bottom function of a fiber stack. The kernel compiler links it in
+ * before __pocl_fibers_run, which only refers to its address. */
+__attribute__ ((noinline)) void
+__pocl_fiber_start (pocl_fiber_group *group)
+{
+  pocl_fiber *f = group->current;
+  group->body (f);
+  f->done = 1;
+  __pocl_fiber_switch (&f->sp, group->sched_sp);
+  __builtin_trap ();
+}
+
+/* The barrier of the work-group: resumed in the next round, after the
+ * rest of the work-items have reached it. */
+void
+__pocl_fiber_barrier (pocl_fiber *f)
+{
+  pocl_fiber_group *group = f->group;
+  if (group->count > 1)
+    __pocl_fiber_switch (&f->sp, group->sched_sp);
+}
+
+#define FIBER_POOL_SIZE 64
+
+/* The allocations of the earlier work-groups, prefixed with their size,
+ * available to the next ones of any thread. */
+static void *fiber_pool[FIBER_POOL_SIZE];
+
+static void *
+fiber_stacks_get (size_t size)
+{
+  for (unsigned i = 0; i < FIBER_POOL_SIZE; ++i)
+    {
+      if (__atomic_load_n (&fiber_pool[i], __ATOMIC_RELAXED) == NULL)
+        continue;
+      size_t *block = __atomic_exchange_n (&fiber_pool[i], NULL,
+                                           __ATOMIC_ACQUIRE);
+      if (block == NULL)
+        continue;
+      if (*block >= size)
+        return block;
+      free (block);
+      break;
+    }
+  size_t *block = malloc (size);
+  if (block == NULL)
+    __builtin_trap ();
+  *block = size;
+  return block;
+}
+
+static void
+fiber_stacks_put (void *block)
+{
+  for (unsigned i = 0; i < FIBER_POOL_SIZE; ++i)
+    {
+      void *expected = NULL;
+      if (__atomic_compare_exchange_n (&fiber_pool[i], &expected, block, 0,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+    }
+  free (block);
+}
+
+#define FIBER_ALIGN 64
+
+/* Runs body for each work-item of the local size, on a fiber stack of
+ * stack_size bytes, a multiple of the page size, with shared as the
+ * shared member of the fiber. */
+void
+__pocl_fibers_run (void (*body) (pocl_fiber *), void *shared, size_t size_x,
+                   size_t size_y, size_t size_z, size_t stack_size)
+{
+  size_t count = size_x * size_y * size_z;
+  pocl_fiber_group group;
+  group.body = body;
+  group.count = count;
+
+  if (count == 1)
+    {
+      pocl_fiber f = { shared, { 0, 0, 0 }, NULL, &group, 0 };
+      body (&f);
+      return;
+    }
+
+  size_t fibers_size = (count * sizeof (pocl_fiber) + FIBER_ALIGN - 1)
+                       & ~(size_t)(FIBER_ALIGN - 1);
+  size_t size = FIBER_ALIGN + fibers_size + count * stack_size;
+  char *block = fiber_stacks_get (size);
+  pocl_fiber *fibers = (pocl_fiber *)(block + FIBER_ALIGN);
+  char *stacks = (char *)fibers + fibers_size;
+
+  size_t i = 0;
+  for (size_t z = 0; z < size_z; ++z)
+    for (size_t y = 0; y < size_y; ++y)
+      for (size_t x = 0; x < size_x; ++x, ++i)
+        {
+          pocl_fiber *f = &fibers[i];
+          f->shared = shared;
+          f->local_id[0] = x;
+          f->local_id[1] = y;
+          f->local_id[2] = z;
+          f->group = &group;
+          f->done = 0;
+
+          /* the frame the first switch to the fiber restores: zeroed
+           * registers, and __pocl_fiber_start as the return address */
+          void **top = (void **)(stacks + (i + 1) * stack_size);
+#if defined(__x86_64__)
+          void **frame = top - 8;
+          for (int r = 0; r < 6; ++r)
+            frame[r] = NULL;
+          frame[6] = (void *)__pocl_fiber_start;
+          frame[7] = NULL;
+#else
+          void **frame = top - 20;
+          for (int r = 0; r < 20; ++r)
+            frame[r] = NULL;
+          frame[11] = (void *)__pocl_fiber_start;
+#endif
+          f->sp = frame;
+        }
+
+  size_t running = count;
+  while (running > 0)
+    for (i = 0; i < count; ++i)
+      {
+        pocl_fiber *f = &fibers[i];
+        if (f->done)
+          continue;
+        group.current = f;
+        __pocl_fiber_switch (&group.sched_sp, f->sp);
+        if (f->done)
+          --running;
+      }
+
+  fiber_stacks_put (block);
+}
+
+#else
+
+/* The kernel compiler uses the fibers only on the targets above. */
+
+void
+__pocl_fiber_barrier (void *f)
+{
+  __builtin_trap ();
+}
+
+void
+__pocl_fibers_run (void *body, void *shared, size_t size_x, size_t size_y,
+                   size_t size_z, size_t stack_size)
+{
+  __builtin_trap ();
+}
+
+#endif
@@ -0,0 +1,142 @@
+/* OpenCL built-in library: relaxed precision math functions for CPU devices
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* The relaxed precision versions of the float math builtins. The kernel
+   library linker binds the calls to the native_ builtins to these and,
+   with -cl-fast-relaxed-math or -cl-unsafe-math-optimizations, also the
+   calls to the standard exponential, logarithm, power and trigonometric
+   builtins (see lib/llvmopencl/linker.cpp). The linker also
+   allows the approximate function and reciprocal forms of their
+   floating point operations, which lets the backend use the hardware
+   reciprocal square root estimate refined with a Newton-Raphson step for
+   the vector rsqrt.
+
+   The functions meet the accuracy requirements of the OpenCL C relaxed
+   math mode. They are branch-free polynomial evaluations without the
+   special case handling of the full precision functions: the NaN,
+   infinite and denormal inputs and results are not handled, the
+   exponentials only saturate to 0 and infinity, and the trigonometric
+   functions reduce their argument accurately only for |x| < 10^5. */
+
+#include "../templates.h"
+
+/* 1.5 * 2^23: adding it to a float of a magnitude below 2^22 rounds it
+   to an integer, which is in the low mantissa bits of the sum. */
+#define MAGIC 12582912.0f
+#define MAGIC_BITS 0x4b400000
+
+#define vtype float
+#define itype int
+#define utype uint
+#define as_vtype as_float
+#define as_itype as_int
+#define as_utype as_uint
+#define convert_vtype convert_float
+#include "relaxed_math.h"
+#undef vtype
+#undef itype
+#undef utype
+#undef as_vtype
+#undef as_itype
+#undef as_utype
+#undef convert_vtype
+
+#define vtype float2
+#define itype int2
+#define utype uint2
+#define as_vtype as_float2
+#define as_itype as_int2
+#define as_utype as_uint2
+#define convert_vtype convert_float2
+#include "relaxed_math.h"
+#undef vtype
+#undef itype
+#undef utype
+#undef as_vtype
+#undef as_itype
+#undef as_utype
+#undef convert_vtype
+
+#define vtype float3
+#define itype int3
+#define utype uint3
+#define as_vtype as_float3
+#define as_itype as_int3
+#define as_utype as_uint3
+#define convert_vtype convert_float3
+#include "relaxed_math.h"
+#undef vtype
+#undef itype
+#undef utype
+#undef as_vtype
+#undef as_itype
+#undef as_utype
+#undef convert_vtype
+
+#define vtype float4
+#define itype int4
+#define utype uint4
+#define as_vtype as_float4
+#define as_itype as_int4
+#define as_utype as_uint4
+#define convert_vtype convert_float4
+#include "relaxed_math.h"
+#undef vtype
+#undef itype
+#undef utype
+#undef as_vtype
+#undef as_itype
+#undef as_utype
+#undef convert_vtype
+
+#define vtype float8
+#define itype int8
+#define utype uint8
+#define as_vtype as_float8
+#define as_itype as_int8
+#define as_utype as_uint8
+#define convert_vtype convert_float8
+#include "relaxed_math.h"
+#undef vtype
+#undef itype
+#undef utype
+#undef as_vtype
+#undef as_itype
+#undef as_utype
+#undef convert_vtype
+
+#define vtype float16
+#define itype int16
+#define utype uint16
+#define as_vtype as_float16
+#define as_itype as_int16
+#define as_utype as_uint16
+#define convert_vtype convert_float16
+#include "relaxed_math.h"
+#undef vtype
+#undef itype
+#undef utype
+#undef as_vtype
+#undef as_itype
+#undef as_utype
+#undef convert_vtype
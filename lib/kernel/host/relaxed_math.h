@@ -0,0 +1,193 @@
+/* OpenCL built-in library: relaxed precision math functions for CPU devices
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+/* The body of relaxed_math.cl for one float vector type, see there. The
+   polynomials are the ones of the Cephes single precision library. */
+
+/* Returns e^r * 2^n for |r| <= ln(2)/2 and n in [-127, 128]. */
+static _CL_OVERLOADABLE vtype
+_pocl_relaxed_exp_reduced (vtype r, itype n)
+{
+  vtype p = ((((1.9875691500E-4f * r + 1.3981999507E-3f) * r
+               + 8.3334519073E-3f) * r + 4.1665795894E-2f) * r
+             + 1.6666665459E-1f) * r + 5.0000001201E-1f;
+  p = p * r * r + r + 1.0f;
+  return p * as_vtype ((n + 127) << 23);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_exp2 (vtype x)
+{
+  x = fmin (fmax (x, -127.0f), 128.0f);
+  vtype b = x + MAGIC;
+  vtype n = b - MAGIC;
+  return _pocl_relaxed_exp_reduced ((x - n) * M_LN2_F,
+                                    as_itype (b) - MAGIC_BITS);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_exp (vtype x)
+{
+  x = fmin (fmax (x, -88.0f), 88.75f);
+  vtype b = x * M_LOG2E_F + MAGIC;
+  vtype n = b - MAGIC;
+  /* ln(2) split to a part exact in the product with n and the rest. */
+  vtype r = (x - n * 0.693359375f) - n * -2.12194440E-4f;
+  return _pocl_relaxed_exp_reduced (r, as_itype (b) - MAGIC_BITS);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_exp10 (vtype x)
+{
+  x = fmin (fmax (x, -38.2f), 38.6f);
+  vtype b = x * 3.32192809488736f + MAGIC;
+  vtype n = b - MAGIC;
+  vtype r = (x - n * 3.0102920532226562E-1f) - n * 7.9034151668E-7f;
+  return _pocl_relaxed_exp_reduced (r * M_LN10_F, as_itype (b) - MAGIC_BITS);
+}
+
+/* Returns ln(m) for x = m * 2^e with m in [sqrt(2)/2, sqrt(2)), and e. */
+static _CL_OVERLOADABLE vtype
+_pocl_relaxed_log_reduced (vtype x, vtype *e)
+{
+  itype ix = as_itype (x) - 0x3f3504f3;
+  *e = convert_vtype (ix >> 23);
+  vtype f = as_vtype ((ix & 0x007fffff) + 0x3f3504f3) - 1.0f;
+  vtype z = f * f;
+  vtype y = ((((((((7.0376836292E-2f * f - 1.1514610310E-1f) * f
+                   + 1.1676998740E-1f) * f - 1.2420140846E-1f) * f
+                 + 1.4249322787E-1f) * f - 1.6668057665E-1f) * f
+               + 2.0000714765E-1f) * f - 2.4999993993E-1f) * f
+             + 3.3333331174E-1f) * f * z;
+  return f + (y - 0.5f * z);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_log (vtype x)
+{
+  vtype e;
+  vtype l = _pocl_relaxed_log_reduced (x, &e);
+  return (e * -2.12194440E-4f + l) + e * 0.693359375f;
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_log2 (vtype x)
+{
+  vtype e;
+  vtype l = _pocl_relaxed_log_reduced (x, &e);
+  return l * M_LOG2E_F + e;
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_log10 (vtype x)
+{
+  vtype e;
+  vtype l = _pocl_relaxed_log_reduced (x, &e);
+  return l * M_LOG10E_F + e * 0.301029995664f;
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_powr (vtype x, vtype y)
+{
+  return _cl_relaxed_exp2 (y * _cl_relaxed_log2 (x));
+}
+
+/* Returns sin(r) and cos(r) for x = j * pi/2 + r, |r| <= pi/4, and j,
+   the quadrant of x in its low bits. */
+static _CL_OVERLOADABLE void
+_pocl_relaxed_sincos_reduced (vtype x, vtype *s, vtype *c, utype *q)
+{
+  vtype b = x * M_2_PI_F + MAGIC;
+  vtype j = b - MAGIC;
+  *q = as_utype (b);
+  /* pi/2 split to parts exact in the products with j. */
+  vtype r = ((x - j * 1.5703125f) - j * 4.837512969970703125E-4f)
+            - j * 7.54978995489188216E-8f;
+  vtype z = r * r;
+  *s = ((-1.9515295891E-4f * z + 8.3321608736E-3f) * z - 1.6666654611E-1f)
+           * z * r
+       + r;
+  *c = ((2.443315711809948E-5f * z - 1.388731625493765E-3f) * z
+        + 4.166664568298827E-2f)
+           * z * z
+       - 0.5f * z + 1.0f;
+}
+
+/* Returns sin(x) for the quadrant q of x and the reduced s and c. */
+static _CL_OVERLOADABLE vtype
+_pocl_relaxed_sin_quadrant (vtype s, vtype c, utype q)
+{
+  utype odd = 0u - (q & 1u);
+  utype r = (as_utype (s) & ~odd) | (as_utype (c) & odd);
+  return as_vtype (r ^ ((q & 2u) << 30));
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_sin (vtype x)
+{
+  vtype s, c;
+  utype q;
+  _pocl_relaxed_sincos_reduced (x, &s, &c, &q);
+  return _pocl_relaxed_sin_quadrant (s, c, q);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_cos (vtype x)
+{
+  vtype s, c;
+  utype q;
+  _pocl_relaxed_sincos_reduced (x, &s, &c, &q);
+  /* cos(x) = sin(x + pi/2) */
+  return _pocl_relaxed_sin_quadrant (s, c, q + 1u);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_tan (vtype x)
+{
+  vtype s, c;
+  utype q;
+  _pocl_relaxed_sincos_reduced (x, &s, &c, &q);
+  /* -cos(r) / sin(r) in the odd quadrants. */
+  utype odd = 0u - (q & 1u);
+  utype n = (as_utype (s) & ~odd) | ((as_utype (c) ^ 0x80000000u) & odd);
+  utype d = (as_utype (c) & ~odd) | (as_utype (s) & odd);
+  return as_vtype (n) / as_vtype (d);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_rsqrt (vtype x)
+{
+  return 1.0f / sqrt (x);
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_recip (vtype x)
+{
+  return 1.0f / x;
+}
+
+_CL_OVERLOADABLE vtype
+_cl_relaxed_divide (vtype x, vtype y)
+{
+  return x / y;
+}
@@ -0,0 +1,299 @@
+/* OpenCL built-in library: the OpenCL 2.0 pipe functions of the CPU devices
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* Clang lowers the pipe builtins to calls of these functions, which get
+ * the pipe and the reservation ids as pointers to opaque types, and the
+ * packet size and alignment as the last arguments. The linker casts the
+ * pointers to the ones defined here, see unifyPipeFingerPrints().
+ *
+ * A reservation id packs the first reserved packet in the low 32 bits and
+ * the number of reserved packets in the high ones, which thus are zero
+ * for the invalid id of a failed reservation. The work-group and the
+ * sub-group reservations are done by their first work-item and broadcast
+ * to the others, and committed by it once all the work-items have passed
+ * the barrier before the commit. */
+
+#include "pocl_pipe.h"
+
+#if POCL_DEVICE_ADDRESS_BITS == 64
+
+size_t _CL_OVERLOADABLE get_local_id (unsigned int dimindx);
+uint _CL_OVERLOADABLE get_sub_group_local_id (void);
+void _CL_OVERLOADABLE barrier (uint flags);
+void _CL_OVERLOADABLE sub_group_barrier (uint flags);
+ulong _CL_OVERLOADABLE work_group_broadcast (ulong x, size_t local_id);
+ulong _CL_OVERLOADABLE sub_group_broadcast (ulong x, uint sub_group_local_id);
+
+#define PIPE_DATA(p) ((uchar *)(p) + sizeof (pocl_pipe_header))
+#define RESERVE_ID(start, n) ((void *)(((ulong)(n) << 32) | (start)))
+#define RESERVE_START(id) ((uint)(ulong)(id))
+#define RESERVE_COUNT(id) ((uint)((ulong)(id) >> 32))
+
+typedef enum
+{
+  PIPE_READ,
+  PIPE_WRITE
+} pipe_side;
+
+/* Reserves num_packets consecutive packets for reading or writing with
+ * one atomic update of the pipe, or returns the invalid id if there are
+ * not enough of them committed by the other side. */
+static void *
+pipe_reserve (pocl_pipe_header *p, pipe_side side, uint num_packets)
+{
+  uint *reserved
+      = side == PIPE_READ ? &p->read_reserved : &p->write_reserved;
+  uint start = __atomic_load_n (reserved, __ATOMIC_RELAXED);
+  do
+    {
+      uint available;
+      if (side == PIPE_READ)
+        available = __atomic_load_n (&p->write_committed, __ATOMIC_ACQUIRE)
+                    - start;
+      else
+        available
+            = p->max_packets
+              - (start - __atomic_load_n (&p->read_committed, __ATOMIC_ACQUIRE));
+      if (num_packets == 0 || num_packets > available)
+        return 0;
+    }
+  while (!__atomic_compare_exchange_n (reserved, &start, start + num_packets,
+                                       1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return RESERVE_ID (start, num_packets);
+}
+
+/* Publishes the packets of a reservation to the other side. The
+ * reservations are committed in the order they were made, so that the
+ * committed packets are always the consecutive ones after the others. */
+static void
+pipe_commit (pocl_pipe_header *p, pipe_side side, void *reserve_id)
+{
+  uint *committed
+      = side == PIPE_READ ? &p->read_committed : &p->write_committed;
+  uint start = RESERVE_START (reserve_id);
+  while (__atomic_load_n (committed, __ATOMIC_RELAXED) != start)
+    ;
+  __atomic_store_n (committed, start + RESERVE_COUNT (reserve_id),
+                    __ATOMIC_RELEASE);
+}
+
+static uchar *
+pipe_packet (pocl_pipe_header *p, void *reserve_id, uint index)
+{
+  return PIPE_DATA (p)
+         + (size_t)((RESERVE_START (reserve_id) + index) % p->max_packets)
+               * p->packet_size;
+}
+
+static int
+is_first_work_item (void)
+{
+  return get_local_id (0) == 0 && get_local_id (1) == 0
+         && get_local_id (2) == 0;
+}
+
+int
+__read_pipe_2 (pocl_pipe_header *p, void *ptr, uint size, uint align)
+{
+  void *id = pipe_reserve (p, PIPE_READ, 1);
+  if (id == 0)
+    return -1;
+  __builtin_memcpy (ptr, pipe_packet (p, id, 0), size);
+  pipe_commit (p, PIPE_READ, id);
+  return 0;
+}
+
+int
+__write_pipe_2 (pocl_pipe_header *p, const void *ptr, uint size, uint align)
+{
+  void *id = pipe_reserve (p, PIPE_WRITE, 1);
+  if (id == 0)
+    return -1;
+  __builtin_memcpy (pipe_packet (p, id, 0), ptr, size);
+  pipe_commit (p, PIPE_WRITE, id);
+  return 0;
+}
+
+int
+__read_pipe_4 (pocl_pipe_header *p, void *reserve_id, uint index, void *ptr,
+               uint size, uint align)
+{
+  if (reserve_id == 0 || index >= RESERVE_COUNT (reserve_id))
+    return -1;
+  __builtin_memcpy (ptr, pipe_packet (p, reserve_id, index), size);
+  return 0;
+}
+
+int
+__write_pipe_4 (pocl_pipe_header *p, void *reserve_id, uint index,
+                const void *ptr, uint size, uint align)
+{
+  if (reserve_id == 0 || index >= RESERVE_COUNT (reserve_id))
+    return -1;
+  __builtin_memcpy (pipe_packet (p, reserve_id, index), ptr, size);
+  return 0;
+}
+
+void *
+__reserve_read_pipe (pocl_pipe_header *p, uint num_packets, uint size,
+                     uint align)
+{
+  return pipe_reserve (p, PIPE_READ, num_packets);
+}
+
+void *
+__reserve_write_pipe (pocl_pipe_header *p, uint num_packets, uint size,
+                      uint align)
+{
+  return pipe_reserve (p, PIPE_WRITE, num_packets);
+}
+
+void
+__commit_read_pipe (pocl_pipe_header *p, void *reserve_id, uint size,
+                    uint align)
+{
+  if (reserve_id != 0)
+    pipe_commit (p, PIPE_READ, reserve_id);
+}
+
+void
+__commit_write_pipe (pocl_pipe_header *p, void *reserve_id, uint size,
+                     uint align)
+{
+  if (reserve_id != 0)
+    pipe_commit (p, PIPE_WRITE, reserve_id);
+}
+
+void *
+__work_group_reserve_read_pipe (pocl_pipe_header *p, uint num_packets,
+                                uint size, uint align)
+{
+  ulong id = 0;
+  if (is_first_work_item ())
+    id = (ulong)pipe_reserve (p, PIPE_READ, num_packets);
+  return (void *)work_group_broadcast (id, 0);
+}
+
+void *
+__work_group_reserve_write_pipe (pocl_pipe_header *p, uint num_packets,
+                                 uint size, uint align)
+{
+  ulong id = 0;
+  if (is_first_work_item ())
+    id = (ulong)pipe_reserve (p, PIPE_WRITE, num_packets);
+  return (void *)work_group_broadcast (id, 0);
+}
+
+void
+__work_group_commit_read_pipe (pocl_pipe_header *p, void *reserve_id,
+                               uint size, uint align)
+{
+  barrier (CLK_GLOBAL_MEM_FENCE);
+  if (is_first_work_item () && reserve_id != 0)
+    pipe_commit (p, PIPE_READ, reserve_id);
+}
+
+void
+__work_group_commit_write_pipe (pocl_pipe_header *p, void *reserve_id,
+                                uint size, uint align)
+{
+  barrier (CLK_GLOBAL_MEM_FENCE);
+  if (is_first_work_item () && reserve_id != 0)
+    pipe_commit (p, PIPE_WRITE, reserve_id);
+}
+
+void *
+__sub_group_reserve_read_pipe (pocl_pipe_header *p, uint num_packets,
+                               uint size, uint align)
+{
+  ulong id = 0;
+  if (get_sub_group_local_id () == 0)
+    id = (ulong)pipe_reserve (p, PIPE_READ, num_packets);
+  return (void *)sub_group_broadcast (id, 0);
+}
+
+void *
+__sub_group_reserve_write_pipe (pocl_pipe_header *p, uint num_packets,
+                                uint size, uint align)
+{
+  ulong id = 0;
+  if (get_sub_group_local_id () == 0)
+    id = (ulong)pipe_reserve (p, PIPE_WRITE, num_packets);
+  return (void *)sub_group_broadcast (id, 0);
+}
+
+void
+__sub_group_commit_read_pipe (pocl_pipe_header *p, void *reserve_id,
+                              uint size, uint align)
+{
+  sub_group_barrier (CLK_GLOBAL_MEM_FENCE);
+  if (get_sub_group_local_id () == 0 && reserve_id != 0)
+    pipe_commit (p, PIPE_READ, reserve_id);
+}
+
+void
+__sub_group_commit_write_pipe (pocl_pipe_header *p, void *reserve_id,
+                               uint size, uint align)
+{
+  sub_group_barrier (CLK_GLOBAL_MEM_FENCE);
+  if (get_sub_group_local_id () == 0 && reserve_id != 0)
+    pipe_commit (p, PIPE_WRITE, reserve_id);
+}
+
+uint
+__get_pipe_num_packets_ro (pocl_pipe_header *p, uint size, uint align)
+{
+  return __atomic_load_n (&p->write_committed, __ATOMIC_RELAXED)
+         - __atomic_load_n (&p->read_reserved, __ATOMIC_RELAXED);
+}
+
+uint
+__get_pipe_num_packets_wo (pocl_pipe_header *p, uint size, uint align)
+{
+  return __atomic_load_n (&p->write_reserved, __ATOMIC_RELAXED)
+         - __atomic_load_n (&p->read_committed, __ATOMIC_RELAXED);
+}
+
+uint
+__get_pipe_max_packets_ro (pocl_pipe_header *p, uint size, uint align)
+{
+  return p->max_packets;
+}
+
+uint
+__get_pipe_max_packets_wo (pocl_pipe_header *p, uint size, uint align)
+{
+  return p->max_packets;
+}
+
+/* is_valid_reserve_id (reserve_id_t) is an ordinary builtin */
+_Bool pocl_is_valid_reserve_id (void *reserve_id) __asm__ (
+    "_Z19is_valid_reserve_id13ocl_reserveid");
+
+_Bool
+pocl_is_valid_reserve_id (void *reserve_id)
+{
+  return reserve_id != 0;
+}
+
+#endif
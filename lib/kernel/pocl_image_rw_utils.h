@@ -24,6 +24,45 @@
 #define POCL_IMAGE_RW_UTILS_H
 
 /* coordinate initialization */
+/* The channel data types the read_image{f,i,ui} and write_image{f,i,ui}
+ * functions are defined for. The undefined combinations need not be
+ * handled, so the pixel access functions only check the channel data
+ * types of the class at runtime. POCL_IMAGE_CLASS_ANY checks all of them. */
+#define POCL_IMAGE_CLASS_ANY 0
+#define POCL_IMAGE_CLASS_f 1
+#define POCL_IMAGE_CLASS_i 2
+#define POCL_IMAGE_CLASS_ui 3
+
+#define POCL_IMAGE_IS_SIGNED_INT(type)                                        \
+  ((type) == CLK_SIGNED_INT8 || (type) == CLK_SIGNED_INT16                    \
+   || (type) == CLK_SIGNED_INT32)
+
+#define POCL_IMAGE_IS_UNSIGNED_INT(type)                                      \
+  ((type) == CLK_UNSIGNED_INT8 || (type) == CLK_UNSIGNED_INT16                \
+   || (type) == CLK_UNSIGNED_INT32)
+
+/* Checks if an image with the channel data type can be accessed through
+ * the integer class cls (POCL_IMAGE_CLASS_i or POCL_IMAGE_CLASS_ui) by a
+ * function of data_class. Folds to a constant except for the _ANY class. */
+#define POCL_IMAGE_IS_CLASS(data_class, cls, type)                            \
+  ((data_class) == POCL_IMAGE_CLASS_ANY                                       \
+       ? ((cls) == POCL_IMAGE_CLASS_i ? POCL_IMAGE_IS_SIGNED_INT (type)       \
+                                      : POCL_IMAGE_IS_UNSIGNED_INT (type))    \
+       : (data_class) == (cls))
+
+/* The pixel offsets of the x and the y coordinates in an image stored in
+ * square tiles with sides of 1 << tile_shift pixels, the tiles of a row of
+ * tiles and the rows of a tile being consecutive in memory. row_pitch is
+ * the padded width of the image in pixels. The offset of a pixel is the
+ * sum of the two and of its slice; tile_shift 0 is the linear layout. */
+#define POCL_IMAGE_X_OFFSET(x, tile_shift)                                    \
+  ((((size_t)(x) >> (tile_shift)) << (2 * (tile_shift)))                     \
+   + ((size_t)(x) & (((size_t)1 << (tile_shift)) - 1)))
+
+#define POCL_IMAGE_Y_OFFSET(y, row_pitch, tile_shift)                         \
+  (((((size_t)(y) >> (tile_shift)) * (row_pitch)) << (tile_shift))           \
+   + (((size_t)(y) & (((size_t)1 << (tile_shift)) - 1)) << (tile_shift)))
+
 #define INITCOORDint(dest, source){             \
   dest.x = source;                              \
   dest.y = 0;                                   \
@@ -25,6 +25,7 @@
 */
 
 #include "printf_base.h"
+#include "pocl_context.h"
 
 #include <stdarg.h>
 
@@ -707,6 +708,242 @@ __pocl_printf (char *restrict __buffer, uint32_t *__buffer_index,
 
 /**************************************************************************/
 
+/* The binary printf of the CPU devices. Instead of formatting the output,
+ * stores a record of the format string address and the raw argument values
+ * to the buffer, which the host formats after the work-groups (see
+ * lib/CL/devices/printf_buffer.c). The format string is only scanned for
+ * the argument types, with the syntax of __pocl_printf_format_full(): the
+ * host reports the format string errors. The records which do not fit to
+ * the buffer are dropped. */
+
+/* TODO: 3-size vector va-arg crashes LLVM when compiled with -O > 0 */
+#define STORE_VALUES(WIDTH, PROMOTED_WIDTH)                                   \
+  {                                                                           \
+    WIDTH##16 val;                                                            \
+    switch (vector_length)                                                    \
+      {                                                                       \
+      default:                                                                \
+        __builtin_unreachable ();                                             \
+      case 1:                                                                 \
+        val.s0 = va_arg (ap, PROMOTED_WIDTH);                                 \
+        break;                                                                \
+      case 2:                                                                 \
+        val.s01 = va_arg (ap, WIDTH##2);                                      \
+        break;                                                                \
+      case 3:                                                                 \
+      case 4:                                                                 \
+        val.s0123 = va_arg (ap, WIDTH##4);                                    \
+        break;                                                                \
+      case 8:                                                                 \
+        val.lo = va_arg (ap, WIDTH##8);                                       \
+        break;                                                                \
+      case 16:                                                                \
+        val = va_arg (ap, WIDTH##16);                                         \
+        break;                                                                \
+      }                                                                       \
+    size = vector_length * sizeof (WIDTH);                                    \
+    if (pos + size > __buffer_capacity)                                       \
+      goto overflow;                                                          \
+    __builtin_memcpy (__buffer + pos, &val, size);                            \
+  }
+
+int
+__pocl_printf_binary (char *restrict __buffer, uint32_t *__buffer_index,
+                      uint32_t __buffer_capacity,
+                      const PRINTF_FMT_STR_AS char *restrict fmt, ...)
+{
+  const PRINTF_FMT_STR_AS char *format = fmt;
+  uint32_t start = *__buffer_index;
+  uint32_t pos = start + POCL_PRINTF_RECORD_HEADER_SIZE;
+  if (pos > __buffer_capacity)
+    return -1;
+
+  va_list ap;
+  va_start (ap, fmt);
+  char ch;
+  while ((ch = *format++))
+    {
+      if (ch != '%')
+        continue;
+      ch = *format++;
+      if (ch == '%')
+        continue;
+
+      while (ch == '-' || ch == '+' || ch == ' ' || ch == '#' || ch == '0')
+        ch = *format++;
+      while (ch >= '0' && ch <= '9')
+        ch = *format++;
+      if (ch == '.')
+        {
+          ch = *format++;
+          while (ch >= '0' && ch <= '9')
+            ch = *format++;
+        }
+
+      size_t vector_length = 1;
+      if (ch == 'v')
+        {
+          vector_length = 0;
+          ch = *format++;
+          while (ch >= '0' && ch <= '9')
+            {
+              vector_length = 10 * vector_length + (ch - '0');
+              ch = *format++;
+            }
+          if (!(vector_length == 2 || vector_length == 3
+                || vector_length == 4 || vector_length == 8
+                || vector_length == 16))
+            break;
+        }
+
+      size_t length = 0;
+      if (ch == 'h')
+        {
+          ch = *format++;
+          if (ch == 'h')
+            {
+              ch = *format++;
+              length = 1;
+            }
+          else if (ch == 'l')
+            {
+              ch = *format++;
+              length = 4;
+            }
+          else
+            length = 2;
+        }
+      else if (ch == 'l')
+        {
+          ch = *format++;
+          length = 8;
+        }
+      if ((vector_length > 1 && length == 0)
+          || (vector_length == 1 && length == 4))
+        break;
+
+      uint32_t size;
+      switch (ch)
+        {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+          switch (length)
+            {
+            case 1:
+              STORE_VALUES (uchar, uint);
+              break;
+            case 2:
+              STORE_VALUES (ushort, uint);
+              break;
+            case 0:
+            case 4:
+              STORE_VALUES (uint, uint);
+              break;
+#ifdef cl_khr_int64
+            case 8:
+              STORE_VALUES (ulong, ulong);
+              break;
+#endif
+            default:
+              goto done;
+            }
+          break;
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+          switch (length)
+            {
+            case 0:
+#ifdef cl_khr_fp64
+            case 4:
+              STORE_VALUES (float, double);
+              break;
+            case 8:
+              STORE_VALUES (double, double);
+              break;
+#else
+            case 4:
+              STORE_VALUES (float, float);
+              break;
+#endif
+            default:
+              goto done;
+            }
+          break;
+
+        case 'c':
+          {
+            uchar c = (uchar)va_arg (ap, int);
+            size = 1;
+            if (pos + size > __buffer_capacity)
+              goto overflow;
+            __buffer[pos] = c;
+            break;
+          }
+
+        case 's':
+          {
+            OCL_C_AS const char *val = va_arg (ap, OCL_C_AS const char *);
+            if (val == 0)
+              val = "(null)";
+            size = 0;
+            do
+              {
+                if (pos + size >= __buffer_capacity)
+                  goto overflow;
+                __buffer[pos + size] = val[size];
+              }
+            while (val[size++]);
+            break;
+          }
+
+        case 'p':
+          {
+            uintptr_t val = (uintptr_t)va_arg (ap, OCL_C_AS const void *);
+            size = sizeof (val);
+            if (pos + size > __buffer_capacity)
+              goto overflow;
+            __builtin_memcpy (__buffer + pos, &val, size);
+            break;
+          }
+
+        default:
+          goto done;
+        }
+
+      /* The arguments are in 8 byte aligned slots. */
+      pos = (pos + size + 7) & ~7u;
+    }
+
+done:;
+  va_end (ap);
+  uint32_t header[2] = { pos - start, 0 };
+  ulong format_address = (ulong) (uintptr_t)fmt;
+  __builtin_memcpy (__buffer + start, header, sizeof (header));
+  __builtin_memcpy (__buffer + start + sizeof (header), &format_address,
+                    sizeof (format_address));
+  *__buffer_index = pos;
+  return 0;
+
+overflow:
+  va_end (ap);
+  return -1;
+}
+
+#undef STORE_VALUES
+
+/**************************************************************************/
+
 extern char *_printf_buffer;
 extern uint32_t *_printf_buffer_position;
 extern uint32_t _printf_buffer_capacity;
@@ -714,7 +951,8 @@ extern uint32_t _printf_buffer_capacity;
 /* This is a placeholder printf function that will be replaced by calls
  * to __pocl_printf(), after an LLVM pass handles the hidden arguments.
  * both __pocl_printf and __pocl_printf_format_simple must be referenced
- * here, so that the kernel library linker pulls them in. */
+ * here, so that the kernel library linker pulls them in. The same goes
+ * for __pocl_printf_binary. */
 
 int
 printf (const PRINTF_FMT_STR_AS char *restrict fmt, ...)
@@ -732,6 +970,8 @@ printf (const PRINTF_FMT_STR_AS char *restrict fmt, ...)
 
   __pocl_printf (_printf_buffer, _printf_buffer_position,
                  _printf_buffer_capacity, NULL);
+  __pocl_printf_binary (_printf_buffer, _printf_buffer_position,
+                        _printf_buffer_capacity, NULL);
 
   *_printf_buffer_position = p.printf_buffer_index;
   return r;
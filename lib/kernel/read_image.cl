@@ -235,7 +235,7 @@ pocl_read_pixel_fast_i (size_t base_index, int order, int elem_size,
 
 /*************************************************************************/
 
-_CL_READONLY static int4
+_CL_ALWAYSINLINE _CL_READONLY static int4
 get_image_array_offset (global dev_image_t *img, int4 uvw_after_rint,
                         int4 array_coord)
 {
@@ -258,7 +258,7 @@ get_image_array_offset (global dev_image_t *img, int4 uvw_after_rint,
 }
 
 /* array_coord must be unnormalized & repeats removed */
-_CL_READONLY static int4
+_CL_ALWAYSINLINE _CL_READONLY static int4
 get_image_array_offset2 (global dev_image_t *img, int4 uvw_after_rint,
                          float4 array_coord)
 {
@@ -283,7 +283,7 @@ get_image_array_offset2 (global dev_image_t *img, int4 uvw_after_rint,
 }
 
 /* RET: (int4) (img.x{,y,z}, array_size, 0 {,0 ...} ) */
-_CL_READONLY static int4
+_CL_ALWAYSINLINE _CL_READONLY static int4
 pocl_get_image_array_size (global dev_image_t *img)
 {
   int4 imgsize = (int4) (img->_width, img->_height, img->_depth, 0);
@@ -301,9 +301,11 @@ pocl_get_image_array_size (global dev_image_t *img)
 /* full read with channel map conversion etc  */
 /* Reads a four element pixel from image pointed by integer coords.
  * Returns Border color (0) for out-of-range reads. This is OK since
- * reads behind border should either return border color, or are undefined */
-_CL_READONLY static uint4
-pocl_read_pixel (global dev_image_t *img, int4 coord)
+ * reads behind border should either return border color, or are undefined.
+ * data_class is the POCL_IMAGE_CLASS_* of the read_image function, which
+ * limits the channel data types to check at runtime. */
+_CL_ALWAYSINLINE _CL_READONLY static uint4
+pocl_read_pixel (global dev_image_t *img, int4 coord, int data_class)
 {
   uint4 color;
   int width = img->_width;
@@ -317,6 +319,7 @@ pocl_read_pixel (global dev_image_t *img, int4 coord)
   size_t elem_bytes = num_channels * elem_size;
   size_t row_pitch = img->_row_pitch / elem_bytes;
   size_t slice_pitch = img->_slice_pitch / elem_bytes;
+  int tile_shift = img->_tile_shift;
 
   if ((coord.x >= width || coord.x < 0)
       || ((height != 0) && (coord.y >= height || coord.y < 0))
@@ -337,15 +340,15 @@ pocl_read_pixel (global dev_image_t *img, int4 coord)
     }
 
   size_t base_index
-      = coord.x + (coord.y * row_pitch) + (coord.z * slice_pitch);
+      = POCL_IMAGE_X_OFFSET (coord.x, tile_shift)
+        + POCL_IMAGE_Y_OFFSET (coord.y, row_pitch, tile_shift)
+        + (coord.z * slice_pitch);
 
-  if ((channel_type == CLK_SIGNED_INT8) || (channel_type == CLK_SIGNED_INT16)
-      || (channel_type == CLK_SIGNED_INT32))
+  if (POCL_IMAGE_IS_CLASS (data_class, POCL_IMAGE_CLASS_i, channel_type))
     color = as_uint4 (
         pocl_read_pixel_fast_i (base_index, order, elem_size, data));
-  else if ((channel_type == CLK_UNSIGNED_INT8)
-           || (channel_type == CLK_UNSIGNED_INT16)
-           || (channel_type == CLK_UNSIGNED_INT32))
+  else if (POCL_IMAGE_IS_CLASS (data_class, POCL_IMAGE_CLASS_ui,
+                                channel_type))
     color = pocl_read_pixel_fast_ui (base_index, order, elem_size, data);
   else // TODO unsupported channel types
     color = as_uint4 (
@@ -355,7 +358,7 @@ pocl_read_pixel (global dev_image_t *img, int4 coord)
 }
 
 /* Transforms coords based on image addressing mode */
-_CL_READONLY static int4
+_CL_ALWAYSINLINE _CL_READONLY static int4
 pocl_address_mode (global dev_image_t *img, int4 input_coord,
                    const dev_sampler_t samp)
 {
@@ -382,8 +385,8 @@ pocl_address_mode (global dev_image_t *img, int4 input_coord,
 _CL_READONLY static float4
 read_pixel_linear_3d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                             int width, int height, int depth, int channel_type,
-                            size_t row_pitch, size_t slice_pitch, int order,
-                            void *data)
+                            size_t row_pitch, size_t slice_pitch,
+                            int tile_shift, int order, void *data)
 {
   size_t base_index = 0;
   int ijk0_y_OK = (ijk0.y >= 0 && ijk0.y < height);
@@ -400,55 +403,55 @@ read_pixel_linear_3d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
       if (ijk0_y_OK)
         {
-          base_index += (ijk0.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * one_m.y * one_m.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * (1 – b) * (1 – c) * Ti1j0k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * one_m.y * one_m.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk0.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
         }
 
       if (ijk1_y_OK)
         {
-          base_index += (ijk1.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
           // + (1 – a) * b * (1 – c) * Ti0j1k0
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * abc.y * one_m.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * b * (1 – c) * Ti1j1k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * abc.y * one_m.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk1.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
         }
 
       base_index -= (ijk0.z * slice_pitch);
@@ -460,56 +463,56 @@ read_pixel_linear_3d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
       if (ijk0_y_OK)
         {
-          base_index += (ijk0.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
           // + (1 – a) * (1 – b) * c * Ti0j0k1
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * one_m.y * abc.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * (1 – b) * (1 – c) * Ti1j0k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * one_m.y * abc.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk0.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
         }
 
       if (ijk1_y_OK)
         {
-          base_index += (ijk1.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
           // + (1 – a) * b * (1 – c) * Ti0j1k0
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * abc.y * abc.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * b * (1 – c) * Ti1j1k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * abc.y * abc.z
                       * pocl_read_pixel_fast_f (base_index, channel_type,
                                                 order, data));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk1.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
         }
 
       base_index -= (ijk1.z * slice_pitch);
@@ -525,8 +528,8 @@ read_pixel_linear_3d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 _CL_READONLY static uint4
 read_pixel_linear_3d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                            int width, int height, int depth, size_t row_pitch,
-                           size_t slice_pitch, int order, int elem_size,
-                           void *data)
+                           size_t slice_pitch, int tile_shift, int order,
+                           int elem_size, void *data)
 {
   size_t base_index = 0;
   int ijk0_y_OK = (ijk0.y >= 0 && ijk0.y < height);
@@ -543,55 +546,55 @@ read_pixel_linear_3d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
       if (ijk0_y_OK)
         {
-          base_index += (ijk0.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * one_m.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * (1 – b) * (1 – c) * Ti1j0k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * one_m.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk0.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
         }
 
       if (ijk1_y_OK)
         {
-          base_index += (ijk1.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
           // + (1 – a) * b * (1 – c) * Ti0j1k0
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * abc.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * b * (1 – c) * Ti1j1k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * abc.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk1.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
         }
 
       base_index -= (ijk0.z * slice_pitch);
@@ -603,56 +606,56 @@ read_pixel_linear_3d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
       if (ijk0_y_OK)
         {
-          base_index += (ijk0.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
           // + (1 – a) * (1 – b) * c * Ti0j0k1
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * one_m.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * (1 – b) * (1 – c) * Ti1j0k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * one_m.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk0.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
         }
 
       if (ijk1_y_OK)
         {
-          base_index += (ijk1.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
           // + (1 – a) * b * (1 – c) * Ti0j1k0
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * abc.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * b * (1 – c) * Ti1j1k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * abc.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_ui (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk1.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
         }
 
       base_index -= (ijk1.z * slice_pitch);
@@ -664,8 +667,8 @@ read_pixel_linear_3d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 _CL_READONLY static int4
 read_pixel_linear_3d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                           int width, int height, int depth, size_t row_pitch,
-                          size_t slice_pitch, int order, int elem_size,
-                          void *data)
+                          size_t slice_pitch, int tile_shift, int order,
+                          int elem_size, void *data)
 {
   size_t base_index = 0;
   int ijk0_y_OK = (ijk0.y >= 0 && ijk0.y < height);
@@ -682,55 +685,55 @@ read_pixel_linear_3d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
       if (ijk0_y_OK)
         {
-          base_index += (ijk0.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * one_m.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * (1 – b) * (1 – c) * Ti1j0k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * one_m.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk0.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
         }
 
       if (ijk1_y_OK)
         {
-          base_index += (ijk1.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
           // + (1 – a) * b * (1 – c) * Ti0j1k0
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * abc.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * b * (1 – c) * Ti1j1k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * abc.y * one_m.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk1.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
         }
 
       base_index -= (ijk0.z * slice_pitch);
@@ -742,56 +745,56 @@ read_pixel_linear_3d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
       if (ijk0_y_OK)
         {
-          base_index += (ijk0.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
           // + (1 – a) * (1 – b) * c * Ti0j0k1
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * one_m.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * (1 – b) * (1 – c) * Ti1j0k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * one_m.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk0.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
         }
 
       if (ijk1_y_OK)
         {
-          base_index += (ijk1.y * row_pitch);
+          base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
           // + (1 – a) * b * (1 – c) * Ti0j1k0
           if (ijk0_x_OK)
             {
-              base_index += ijk0.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
               sum += (one_m.x * abc.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk0.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
             }
 
           // + a * b * (1 – c) * Ti1j1k0
           if (ijk1_x_OK)
             {
-              base_index += ijk1.x;
+              base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
               sum += (abc.x * abc.y * abc.z
                       * convert_float4 (pocl_read_pixel_fast_i (
                             base_index, order, elem_size, data)));
-              base_index -= ijk1.x;
+              base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
             }
 
-          base_index -= (ijk1.y * row_pitch);
+          base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
         }
 
       base_index -= (ijk1.z * slice_pitch);
@@ -803,23 +806,23 @@ read_pixel_linear_3d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 _CL_READONLY static uint4
 read_pixel_linear_3d (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                       int width, int height, int depth, int channel_type,
-                      size_t row_pitch, size_t slice_pitch, int order,
-                      int elem_size, void *data)
+                      size_t row_pitch, size_t slice_pitch, int tile_shift,
+                      int order, int elem_size, void *data)
 {
   // TODO unsupported channel types
   if ((channel_type == CLK_SIGNED_INT8) || (channel_type == CLK_SIGNED_INT16)
       || (channel_type == CLK_SIGNED_INT32))
     return as_uint4 (read_pixel_linear_3d_int (
         abc, one_m, ijk0, ijk1, width, height, depth, row_pitch, slice_pitch,
-        order, elem_size, data));
+        tile_shift, order, elem_size, data));
   if ((channel_type == CLK_UNSIGNED_INT8) || (channel_type == CLK_UNSIGNED_INT16)
       || (channel_type == CLK_UNSIGNED_INT32))
     return read_pixel_linear_3d_uint (abc, one_m, ijk0, ijk1, width, height,
-                                      depth, row_pitch, slice_pitch, order,
-                                      elem_size, data);
+                                      depth, row_pitch, slice_pitch,
+                                      tile_shift, order, elem_size, data);
   return as_uint4 (read_pixel_linear_3d_float (
       abc, one_m, ijk0, ijk1, width, height, depth, channel_type, row_pitch,
-      slice_pitch, order, data));
+      slice_pitch, tile_shift, order, data));
 }
 
 /*************************************************************************/
@@ -828,7 +831,8 @@ _CL_READONLY static float4
 read_pixel_linear_2d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                             int array_coord, int width, int height,
                             int channel_type, size_t row_pitch,
-                            size_t slice_pitch, int order, void *data)
+                            size_t slice_pitch, int tile_shift, int order,
+                            void *data)
 {
   // 2D image
   size_t base_index = 0;
@@ -841,55 +845,55 @@ read_pixel_linear_2d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
   if (ijk0.y >= 0 && ijk0.y < height)
     {
-      base_index += (ijk0.y * row_pitch);
+      base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
       // T = (1 – a) * (1 – b) * Ti0j0
       if (ijk0_x_OK)
         {
-          base_index += ijk0.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
           sum += (one_m.x * one_m.y * pocl_read_pixel_fast_f (base_index,
                                                               channel_type,
                                                               order, data));
-          base_index -= ijk0.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
         }
 
       // + a * (1 – b) * Ti1j0
       if (ijk1_x_OK)
         {
-          base_index += ijk1.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
           sum += (abc.x * one_m.y * pocl_read_pixel_fast_f (base_index,
                                                             channel_type,
                                                             order, data));
-          base_index -= ijk1.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
         }
 
-      base_index -= (ijk0.y * row_pitch);
+      base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
     }
 
   if (ijk1.y >= 0 && ijk1.y < height)
     {
-      base_index += (ijk1.y * row_pitch);
+      base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
       // + (1 – a) * b * Ti0j1
       if (ijk0_x_OK)
         {
-          base_index += ijk0.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
           sum += (one_m.x * abc.y * pocl_read_pixel_fast_f (base_index,
                                                             channel_type,
                                                             order, data));
-          base_index -= ijk0.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
         }
 
       // + a * b * Ti1j1
       if (ijk1_x_OK)
         {
-          base_index += ijk1.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
           sum += (abc.x * abc.y * pocl_read_pixel_fast_f (
                                       base_index, channel_type, order, data));
-          base_index -= ijk1.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
         }
 
-      base_index -= (ijk1.y * row_pitch);
+      base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
     }
 
   return sum;
@@ -902,8 +906,9 @@ read_pixel_linear_2d_float (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 _CL_READONLY static uint4
 read_pixel_linear_2d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                            int array_coord, int width, int height,
-                           size_t row_pitch, size_t slice_pitch, int order,
-                           int elem_size, void *data)
+                           size_t row_pitch, size_t slice_pitch,
+                           int tile_shift, int order, int elem_size,
+                           void *data)
 {
   // 2D image
   size_t base_index = 0;
@@ -916,53 +921,53 @@ read_pixel_linear_2d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
   if (ijk0.y >= 0 && ijk0.y < height)
     {
-      base_index += (ijk0.y * row_pitch);
+      base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
       // T = (1 – a) * (1 – b) * Ti0j0
       if (ijk0_x_OK)
         {
-          base_index += ijk0.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
           sum += (one_m.x * one_m.y
                   * convert_float4 (pocl_read_pixel_fast_ui (
                         base_index, order, elem_size, data)));
-          base_index -= ijk0.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
         }
 
       // + a * (1 – b) * Ti1j0
       if (ijk1_x_OK)
         {
-          base_index += ijk1.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
           sum += (abc.x * one_m.y * convert_float4 (pocl_read_pixel_fast_ui (
                                         base_index, order, elem_size, data)));
-          base_index -= ijk1.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
         }
 
-      base_index -= (ijk0.y * row_pitch);
+      base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
     }
 
   if (ijk1.y >= 0 && ijk1.y < height)
     {
-      base_index += (ijk1.y * row_pitch);
+      base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
       // + (1 – a) * b * Ti0j1
       if (ijk0_x_OK)
         {
-          base_index += ijk0.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
           sum += (one_m.x * abc.y * convert_float4 (pocl_read_pixel_fast_ui (
                                         base_index, order, elem_size, data)));
-          base_index -= ijk0.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
         }
 
       // + a * b * Ti1j1
       if (ijk1_x_OK)
         {
-          base_index += ijk1.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
           sum += (abc.x * abc.y * convert_float4 (pocl_read_pixel_fast_ui (
                                       base_index, order, elem_size, data)));
-          base_index -= ijk1.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
         }
 
-      base_index -= (ijk1.y * row_pitch);
+      base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
     }
 
   return convert_uint4 (sum);
@@ -971,8 +976,8 @@ read_pixel_linear_2d_uint (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 _CL_READONLY static int4
 read_pixel_linear_2d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                           int array_coord, int width, int height,
-                          size_t row_pitch, size_t slice_pitch, int order,
-                          int elem_size, void *data)
+                          size_t row_pitch, size_t slice_pitch, int tile_shift,
+                          int order, int elem_size, void *data)
 {
   // 2D image
   size_t base_index = 0;
@@ -985,53 +990,53 @@ read_pixel_linear_2d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 
   if (ijk0.y >= 0 && ijk0.y < height)
     {
-      base_index += (ijk0.y * row_pitch);
+      base_index += POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
 
       // T = (1 – a) * (1 – b) * Ti0j0
       if (ijk0_x_OK)
         {
-          base_index += ijk0.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
           sum += (one_m.x * one_m.y
                   * convert_float4 (pocl_read_pixel_fast_i (base_index, order,
                                                             elem_size, data)));
-          base_index -= ijk0.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
         }
 
       // + a * (1 – b) * Ti1j0
       if (ijk1_x_OK)
         {
-          base_index += ijk1.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
           sum += (abc.x * one_m.y * convert_float4 (pocl_read_pixel_fast_i (
                                         base_index, order, elem_size, data)));
-          base_index -= ijk1.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
         }
 
-      base_index -= (ijk0.y * row_pitch);
+      base_index -= POCL_IMAGE_Y_OFFSET (ijk0.y, row_pitch, tile_shift);
     }
 
   if (ijk1.y >= 0 && ijk1.y < height)
     {
-      base_index += (ijk1.y * row_pitch);
+      base_index += POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
 
       // + (1 – a) * b * Ti0j1
       if (ijk0_x_OK)
         {
-          base_index += ijk0.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
           sum += (one_m.x * abc.y * convert_float4 (pocl_read_pixel_fast_i (
                                         base_index, order, elem_size, data)));
-          base_index -= ijk0.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk0.x, tile_shift);
         }
 
       // + a * b * Ti1j1
       if (ijk1_x_OK)
         {
-          base_index += ijk1.x;
+          base_index += POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
           sum += (abc.x * abc.y * convert_float4 (pocl_read_pixel_fast_i (
                                       base_index, order, elem_size, data)));
-          base_index -= ijk1.x;
+          base_index -= POCL_IMAGE_X_OFFSET (ijk1.x, tile_shift);
         }
 
-      base_index -= (ijk1.y * row_pitch);
+      base_index -= POCL_IMAGE_Y_OFFSET (ijk1.y, row_pitch, tile_shift);
     }
 
   return convert_int4 (sum);
@@ -1040,23 +1045,23 @@ read_pixel_linear_2d_int (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
 _CL_READONLY static uint4
 read_pixel_linear_2d (float4 abc, float4 one_m, int4 ijk0, int4 ijk1,
                       int array_coord, int width, int height, int channel_type,
-                      size_t row_pitch, size_t slice_pitch, int order,
-                      int elem_size, void *data)
+                      size_t row_pitch, size_t slice_pitch, int tile_shift,
+                      int order, int elem_size, void *data)
 {
   // TODO unsupported channel types
   if ((channel_type == CLK_SIGNED_INT8) || (channel_type == CLK_SIGNED_INT16)
       || (channel_type == CLK_SIGNED_INT32))
     return as_uint4 (read_pixel_linear_2d_int (
         abc, one_m, ijk0, ijk1, array_coord, width, height, row_pitch,
-        slice_pitch, order, elem_size, data));
+        slice_pitch, tile_shift, order, elem_size, data));
   if ((channel_type == CLK_UNSIGNED_INT8) || (channel_type == CLK_UNSIGNED_INT16)
       || (channel_type == CLK_UNSIGNED_INT32))
     return read_pixel_linear_2d_uint (abc, one_m, ijk0, ijk1, array_coord,
                                       width, height, row_pitch, slice_pitch,
-                                      order, elem_size, data);
+                                      tile_shift, order, elem_size, data);
   return as_uint4 (read_pixel_linear_2d_float (
       abc, one_m, ijk0, ijk1, array_coord, width, height, channel_type,
-      row_pitch, slice_pitch, order, data));
+      row_pitch, slice_pitch, tile_shift, order, data));
 }
 
 /*************************************************************************/
@@ -1193,6 +1198,27 @@ read_pixel_linear_1d (float4 abc, float4 one_m, int ijk0, int ijk1,
 #define INVALID_SAMPLER_FILTER (uint4) (0x2222)
 #define INVALID_SAMPLER_NORMAL (uint4) (0x3333)
 
+/* The nearest filtering of the clamping address modes, which is the common
+ * case of the image filtering kernels. It is inlined to the read_image*()
+ * calls so that with a constant sampler it reduces to the address clamping
+ * and the pixel load. */
+_CL_ALWAYSINLINE _CL_READONLY static uint4
+nonrepeat_nearest_filter (global dev_image_t *img, float4 orig_coord,
+                          const dev_sampler_t samp, int data_class)
+{
+  float4 coord = orig_coord;
+  if (samp & CLK_NORMALIZED_COORDS_TRUE)
+    {
+      float4 imgsize = convert_float4 (pocl_get_image_array_size (img));
+      coord *= imgsize;
+    }
+
+  int4 final_coord
+      = pocl_address_mode (img, convert_int4 (floor (coord)), samp);
+  int4 array_coord = get_image_array_offset2 (img, final_coord, coord);
+  return pocl_read_pixel (img, array_coord, data_class);
+}
+
 _CL_READONLY static uint4
 nonrepeat_filter (global dev_image_t *img, float4 orig_coord,
                   const dev_sampler_t samp)
@@ -1210,13 +1236,12 @@ nonrepeat_filter (global dev_image_t *img, float4 orig_coord,
   size_t elem_bytes = num_channels * elem_size;
   size_t row_pitch = img->_row_pitch / elem_bytes;
   size_t slice_pitch = img->_slice_pitch / elem_bytes;
+  int tile_shift = img->_tile_shift;
 
   if (samp & CLK_FILTER_NEAREST)
     {
-      int4 final_coord
-          = pocl_address_mode (img, convert_int4 (floor (coord)), samp);
-      int4 array_coord = get_image_array_offset2 (img, final_coord, coord);
-      return pocl_read_pixel (img, array_coord);
+      return nonrepeat_nearest_filter (img, orig_coord, samp,
+                                       POCL_IMAGE_CLASS_ANY);
     }
   else if (samp & CLK_FILTER_LINEAR)
     {
@@ -1232,7 +1257,7 @@ nonrepeat_filter (global dev_image_t *img, float4 orig_coord,
         {
           res = read_pixel_linear_3d (
               abc, one_m, ijk0, ijk1, img->_width, img->_height, img->_depth,
-              img->_data_type, row_pitch, slice_pitch, img->_order,
+              img->_data_type, row_pitch, slice_pitch, tile_shift, img->_order,
               img->_elem_size, img->_data);
         }
       else if (img->_height != 0)
@@ -1242,7 +1267,7 @@ nonrepeat_filter (global dev_image_t *img, float4 orig_coord,
                              (int)(img->_image_array_size - 1));
           res = read_pixel_linear_2d (
               abc, one_m, ijk0, ijk1, a_index, img->_width, img->_height,
-              img->_data_type, row_pitch, slice_pitch, img->_order,
+              img->_data_type, row_pitch, slice_pitch, tile_shift, img->_order,
               img->_elem_size, img->_data);
         }
       else
@@ -1271,6 +1296,7 @@ repeat_filter (global dev_image_t *img, float4 coord, const dev_sampler_t samp)
   size_t elem_bytes = num_channels * img->_elem_size;
   size_t row_pitch = img->_row_pitch / elem_bytes;
   size_t slice_pitch = img->_slice_pitch / elem_bytes;
+  int tile_shift = img->_tile_shift;
 
   if (samp & CLK_FILTER_NEAREST)
     {
@@ -1289,7 +1315,7 @@ repeat_filter (global dev_image_t *img, float4 coord, const dev_sampler_t samp)
       int4 array_coord
           = get_image_array_offset2 (img, final_coord, (coord * whd));
 
-      return pocl_read_pixel (img, array_coord);
+      return pocl_read_pixel (img, array_coord, POCL_IMAGE_CLASS_ANY);
     }
   else if (samp & CLK_FILTER_LINEAR)
     {
@@ -1321,7 +1347,7 @@ repeat_filter (global dev_image_t *img, float4 coord, const dev_sampler_t samp)
         {
           res = read_pixel_linear_3d (
               abc, one_m, ijk0, ijk1, img->_width, img->_height, img->_depth,
-              img->_data_type, row_pitch, slice_pitch, img->_order,
+              img->_data_type, row_pitch, slice_pitch, tile_shift, img->_order,
               img->_elem_size, img->_data);
         }
       else if (img->_height != 0)
@@ -1332,7 +1358,7 @@ repeat_filter (global dev_image_t *img, float4 coord, const dev_sampler_t samp)
                          0, (array_size - 1));
           res = read_pixel_linear_2d (
               abc, one_m, ijk0, ijk1, a_index, img->_width, img->_height,
-              img->_data_type, row_pitch, slice_pitch, img->_order,
+              img->_data_type, row_pitch, slice_pitch, tile_shift, img->_order,
               img->_elem_size, img->_data);
         }
       else
@@ -1363,6 +1389,7 @@ mirrored_repeat_filter (global dev_image_t *img, float4 coord,
   size_t elem_bytes = num_channels * img->_elem_size;
   size_t row_pitch = img->_row_pitch / elem_bytes;
   size_t slice_pitch = img->_slice_pitch / elem_bytes;
+  int tile_shift = img->_tile_shift;
 
   if (samp & CLK_FILTER_NEAREST)
     {
@@ -1384,7 +1411,7 @@ mirrored_repeat_filter (global dev_image_t *img, float4 coord,
       int4 final_coord = select (ijk, wdt, (ijk > wdt));
       int4 array_coord
           = get_image_array_offset2 (img, final_coord, (coord * whd));
-      return pocl_read_pixel (img, array_coord);
+      return pocl_read_pixel (img, array_coord, POCL_IMAGE_CLASS_ANY);
     }
   else if (samp & CLK_FILTER_LINEAR)
     {
@@ -1415,7 +1442,7 @@ mirrored_repeat_filter (global dev_image_t *img, float4 coord,
         {
           res = read_pixel_linear_3d (
               abc, one_m, ijk0, ijk1, img->_width, img->_height, img->_depth,
-              img->_data_type, row_pitch, slice_pitch, img->_order,
+              img->_data_type, row_pitch, slice_pitch, tile_shift, img->_order,
               img->_elem_size, img->_data);
         }
       else if (img->_height != 0)
@@ -1426,7 +1453,7 @@ mirrored_repeat_filter (global dev_image_t *img, float4 coord,
                          0, (array_size - 1));
           res = read_pixel_linear_2d (
               abc, one_m, ijk0, ijk1, a_index, img->_width, img->_height,
-              img->_data_type, row_pitch, slice_pitch, img->_order,
+              img->_data_type, row_pitch, slice_pitch, tile_shift, img->_order,
               img->_elem_size, img->_data);
         }
       else
@@ -1449,15 +1476,20 @@ mirrored_repeat_filter (global dev_image_t *img, float4 coord,
 }
 
 /*************************************************************************/
-/* read pixel with float coordinates */
-_CL_READONLY static uint4
+/* read pixel with float coordinates.
+ * The sampler dispatch is inlined to the callers, so that a constant
+ * sampler (e.g. one initialized in the kernel source) selects the filter
+ * at compile time and no per-pixel branches on it remain. */
+_CL_ALWAYSINLINE _CL_READONLY static uint4
 pocl_read_pixel_floatc (global dev_image_t *img, float4 coord,
-                        const dev_sampler_t samp)
+                        const dev_sampler_t samp, int data_class)
 {
   if ((samp & CLK_ADDRESS_MASK) == CLK_ADDRESS_REPEAT)
     return repeat_filter (img, coord, samp);
   else if ((samp & CLK_ADDRESS_MASK) == CLK_ADDRESS_MIRRORED_REPEAT)
     return mirrored_repeat_filter (img, coord, samp);
+  else if (samp & CLK_FILTER_NEAREST)
+    return nonrepeat_nearest_filter (img, coord, samp, data_class);
   else
     return nonrepeat_filter (img, coord, samp);
 }
@@ -1473,9 +1505,9 @@ pocl_read_pixel_floatc (global dev_image_t *img, float4 coord,
  * otherwise the values returned are undefined.
 */
 
-_CL_READONLY static uint4
+_CL_ALWAYSINLINE _CL_READONLY static uint4
 pocl_read_pixel_intc (global dev_image_t *img, int4 coord,
-                      const dev_sampler_t samp)
+                      const dev_sampler_t samp, int data_class)
 {
   if (samp & CLK_NORMALIZED_COORDS_TRUE)
     return INVALID_SAMPLER_NORMAL;
@@ -1485,7 +1517,7 @@ pocl_read_pixel_intc (global dev_image_t *img, int4 coord,
 
   int4 final_coord = pocl_address_mode (img, coord, samp);
   int4 array_coord = get_image_array_offset (img, final_coord, coord);
-  return pocl_read_pixel (img, array_coord);
+  return pocl_read_pixel (img, array_coord, data_class);
 }
 
 /******************* DONE *************************************************/
@@ -1498,15 +1530,16 @@ pocl_read_pixel_intc (global dev_image_t *img, int4 coord,
  * CLK_NORMALIZED_COORDS_FALSE and addressing mode to CLK_ADDRESS_NONE.
  */
 
-_CL_READONLY static uint4
-pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord)
+_CL_ALWAYSINLINE _CL_READONLY static uint4
+pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord,
+                                  int data_class)
 {
   const dev_sampler_t samp
       = CLK_FILTER_NEAREST | CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE;
 
   int4 final_coord = pocl_address_mode (img, coord, samp);
   int4 array_coord = get_image_array_offset (img, final_coord, coord);
-  return pocl_read_pixel (img, array_coord);
+  return pocl_read_pixel (img, array_coord, data_class);
 }
 
 /*************************************************************************/
@@ -1532,7 +1565,8 @@ pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord)
 
 #define IMPLEMENT_READ_INT4_IMAGE_INT_COORD(__IMGTYPE__, __RETVAL__,          \
                                             __POSTFIX__, __COORD__)           \
-  __RETVAL__ _CL_OVERLOADABLE _CL_READONLY read_image##__POSTFIX__ (                       \
+  __RETVAL__ _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY                  \
+  read_image##__POSTFIX__ (                                                   \
       __IMGTYPE__ image, sampler_t sampler, __COORD__ coord)                  \
   {                                                                           \
     int4 coord4;                                                              \
@@ -1540,39 +1574,43 @@ pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord)
     global dev_image_t *i_ptr                                                 \
         = __builtin_astype (image, global dev_image_t *);                     \
     READ_SAMPLER                                                              \
-    uint4 color = pocl_read_pixel_intc (i_ptr, coord4, s);                    \
+    uint4 color = pocl_read_pixel_intc (i_ptr, coord4, s,                     \
+                                         POCL_IMAGE_CLASS_##__POSTFIX__);     \
     return as_##__RETVAL__ (color);                                           \
   }
 
 #define IMPLEMENT_READ_FLOAT4_IMAGE_INT_COORD(__IMGTYPE__, __COORD__)         \
-  float4 _CL_OVERLOADABLE _CL_READONLY read_imagef (__IMGTYPE__ image, sampler_t sampler,  \
-                                       __COORD__ coord)                       \
+  float4 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY read_imagef (        \
+      __IMGTYPE__ image, sampler_t sampler, __COORD__ coord)                  \
   {                                                                           \
     int4 coord4;                                                              \
     INITCOORD##__COORD__ (coord4, coord);                                     \
     global dev_image_t *i_ptr                                                 \
         = __builtin_astype (image, global dev_image_t *);                     \
     READ_SAMPLER                                                              \
-    uint4 color = pocl_read_pixel_intc (i_ptr, coord4, s);                    \
+    uint4 color                                                               \
+        = pocl_read_pixel_intc (i_ptr, coord4, s, POCL_IMAGE_CLASS_f);        \
     return as_float4 (color);                                                 \
   }
 
 #define IMPLEMENT_READ_FLOAT4_IMAGE_FLOAT_COORD(__IMGTYPE__, __COORD__)       \
-  float4 _CL_OVERLOADABLE _CL_READONLY read_imagef (__IMGTYPE__ image, sampler_t sampler,  \
-                                       __COORD__ coord)                       \
+  float4 _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY read_imagef (        \
+      __IMGTYPE__ image, sampler_t sampler, __COORD__ coord)                  \
   {                                                                           \
     float4 coord4;                                                            \
     INITCOORD##__COORD__ (coord4, coord);                                     \
     global dev_image_t *i_ptr                                                 \
         = __builtin_astype (image, global dev_image_t *);                     \
     READ_SAMPLER                                                              \
-    uint4 color = pocl_read_pixel_floatc (i_ptr, coord4, s);                  \
+    uint4 color = pocl_read_pixel_floatc (i_ptr, coord4, s,                   \
+                                           POCL_IMAGE_CLASS_f);               \
     return as_float4 (color);                                                 \
   }
 
 #define IMPLEMENT_READ_INT4_IMAGE_FLOAT_COORD(__IMGTYPE__, __RETVAL__,        \
                                               __POSTFIX__, __COORD__)         \
-  __RETVAL__ _CL_OVERLOADABLE _CL_READONLY read_image##__POSTFIX__ (                       \
+  __RETVAL__ _CL_ALWAYSINLINE _CL_OVERLOADABLE _CL_READONLY                  \
+  read_image##__POSTFIX__ (                                                   \
       __IMGTYPE__ image, sampler_t sampler, __COORD__ coord)                  \
   {                                                                           \
     float4 coord4;                                                            \
@@ -1580,7 +1618,8 @@ pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord)
     global dev_image_t *i_ptr                                                 \
         = __builtin_astype (image, global dev_image_t *);                     \
     READ_SAMPLER                                                              \
-    uint4 color = pocl_read_pixel_floatc (i_ptr, coord4, s);                  \
+    uint4 color = pocl_read_pixel_floatc (i_ptr, coord4, s,                   \
+                                           POCL_IMAGE_CLASS_##__POSTFIX__);   \
     return as_##__RETVAL__ (color);                                           \
   }
 
@@ -1616,7 +1655,8 @@ pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord)
     INITCOORD##__COORD__ (coord4, coord);                                     \
     global dev_image_t *i_ptr                                                 \
         = __builtin_astype (image, global dev_image_t *);                     \
-    uint4 color = pocl_read_pixel_intc_samplerless (i_ptr, coord4);           \
+    uint4 color = pocl_read_pixel_intc_samplerless (                          \
+        i_ptr, coord4, POCL_IMAGE_CLASS_##__POSTFIX__);                       \
     return as_##__RETVAL__ (color);                                           \
   }
 
@@ -1628,7 +1668,8 @@ pocl_read_pixel_intc_samplerless (global dev_image_t *img, int4 coord)
     INITCOORD##__COORD__ (coord4, coord);                                     \
     global dev_image_t *i_ptr                                                 \
         = __builtin_astype (image, global dev_image_t *);                     \
-    uint4 color = pocl_read_pixel_intc_samplerless (i_ptr, coord4);           \
+    uint4 color = pocl_read_pixel_intc_samplerless (                          \
+        i_ptr, coord4, POCL_IMAGE_CLASS_f);                                   \
     return as_float4 (color);                                                 \
   }
 
@@ -46,57 +46,84 @@ _cl_half2float (ushort h)
   return as_float(result);
 }
 
-#ifdef __F16C__
+#if defined(__aarch64__) && defined(cl_khr_fp16) && !defined(__F16C__)
+
+/* ARMv8 has conversion instructions between half and float for all the
+ * vector widths, which the backend selects for the fpext from half. */
+#define POCL_NATIVE_HALF_CONVERSIONS
+
+static float
+_cl_half2float1 (const ushort data)
+{
+  return (float)as_half (data);
+}
+
+#define IMPLEMENT_HALF2FLOAT_NATIVE(WIDTH)                                    \
+  static float##WIDTH _cl_half2float##WIDTH (const ushort##WIDTH data)        \
+  {                                                                           \
+    return __builtin_convertvector (as_half##WIDTH (data), float##WIDTH);     \
+  }
+
+IMPLEMENT_HALF2FLOAT_NATIVE (2)
+IMPLEMENT_HALF2FLOAT_NATIVE (4)
+IMPLEMENT_HALF2FLOAT_NATIVE (8)
+IMPLEMENT_HALF2FLOAT_NATIVE (16)
+
+#endif
 
+#ifdef __F16C__
+float _cl_half2float1 (const ushort data);
+float2 _cl_half2float2 (const ushort2 data);
 float4 _cl_half2float4 (const ushort4 data);
 float8 _cl_half2float8 (const ushort8 data);
+float16 _cl_half2float16 (const ushort16 data);
+#endif
+
+#if defined(__F16C__) || defined(POCL_NATIVE_HALF_CONVERSIONS)
 
+/* vload_halfN only requires the alignment of half, so those load with
+ * vloadN, while the vloada_halfN may access the vectors directly. */
 #define IMPLEMENT_VLOAD_HALF(MOD)                                             \
                                                                               \
   float _CL_OVERLOADABLE vload_half (size_t offset, const MOD half *p)        \
   {                                                                           \
-    return _cl_half2float (((const MOD ushort *)p)[offset]);                  \
+    return _cl_half2float1 (((const MOD ushort *)p)[offset]);                 \
   }                                                                           \
                                                                               \
   float2 _CL_OVERLOADABLE vload_half2 (size_t offset, const MOD half *p)      \
   {                                                                           \
-    return (float2) (vload_half (offset * 2, p),                              \
-                     vload_half (offset * 2 + 1, p));                         \
+    return _cl_half2float2 (vload2 (offset, (const MOD ushort *)p));          \
   }                                                                           \
                                                                               \
   float3 _CL_OVERLOADABLE vload_half3 (size_t offset, const MOD half *p)      \
   {                                                                           \
-    return (float3) (vload_half (offset * 3, p),                              \
-                     vload_half (offset * 3 + 1, p),                          \
-                     vload_half (offset * 3 + 2, p));                         \
+    ushort3 h = vload3 (offset, (const MOD ushort *)p);                       \
+    return _cl_half2float4 ((ushort4) (h, 0)).xyz;                            \
   }                                                                           \
                                                                               \
   float4 _CL_OVERLOADABLE vload_half4 (size_t offset, const MOD half *p)      \
   {                                                                           \
-    return _cl_half2float4 (((const MOD ushort4 *)p)[offset]);                \
+    return _cl_half2float4 (vload4 (offset, (const MOD ushort *)p));          \
   }                                                                           \
                                                                               \
   float8 _CL_OVERLOADABLE vload_half8 (size_t offset, const MOD half *p)      \
   {                                                                           \
-    return _cl_half2float8 (((const MOD ushort8 *)p)[offset]);                \
+    return _cl_half2float8 (vload8 (offset, (const MOD ushort *)p));          \
   }                                                                           \
                                                                               \
   float16 _CL_OVERLOADABLE vload_half16 (size_t offset, const MOD half *p)    \
   {                                                                           \
-    float8 hi = _cl_half2float8 (((const MOD ushort8 *)p)[offset * 2]);       \
-    float8 lo = _cl_half2float8 (((const MOD ushort8 *)p)[offset * 2 + 1]);   \
-    return (float16) (hi, lo);                                                \
+    return _cl_half2float16 (vload16 (offset, (const MOD ushort *)p));        \
   }                                                                           \
                                                                               \
   float _CL_OVERLOADABLE vloada_half (size_t offset, const MOD half *p)       \
   {                                                                           \
-    return _cl_half2float (((const MOD ushort *)p)[offset]);                  \
+    return _cl_half2float1 (((const MOD ushort *)p)[offset]);                 \
   }                                                                           \
                                                                               \
   float2 _CL_OVERLOADABLE vloada_half2 (size_t offset, const MOD half *p)     \
   {                                                                           \
-    return (float2) (vloada_half (offset * 2, p),                             \
-                     vloada_half (offset * 2, p + 1));                        \
+    return _cl_half2float2 (((const MOD ushort2 *)p)[offset]);                \
   }                                                                           \
                                                                               \
   float3 _CL_OVERLOADABLE vloada_half3 (size_t offset, const MOD half *p)     \
@@ -117,12 +144,10 @@ float8 _cl_half2float8 (const ushort8 data);
                                                                               \
   float16 _CL_OVERLOADABLE vloada_half16 (size_t offset, const MOD half *p)   \
   {                                                                           \
-    float8 hi = _cl_half2float8 (((const MOD ushort8 *)p)[offset * 2]);       \
-    float8 lo = _cl_half2float8 (((const MOD ushort8 *)p)[offset * 2 + 1]);   \
-    return (float16) (hi, lo);                                                \
-  }                                                                           \
-                                                                              \
-// __F16C__
+    return _cl_half2float16 (((const MOD ushort16 *)p)[offset]);              \
+  }
+
+// __F16C__ || POCL_NATIVE_HALF_CONVERSIONS
 #else
 
 #define IMPLEMENT_VLOAD_HALF(MOD)                                             \
@@ -31,6 +31,9 @@
  *    _mm256_cvtps_ph(a, int);
  *    _mm_cvtph_ps(a);
  *    _mm256_cvtph_ps(a);
+ * and with AVX-512F also:
+ *    BUILTIN(__builtin_ia32_vcvtps2ph512_mask, "V16sV16fIiV16sUs", "")
+ *    BUILTIN(__builtin_ia32_vcvtph2ps512_mask, "V16fV16sV16fUsIi", "")
  */
 
 /* TODO
@@ -215,4 +218,107 @@ _cl_half2float8 (const ushort8 data)
   return uo.f;
 }
 
+/** FLOAT -> HALF scalar, vec2 and vec16 ******************************/
+
+/* The scalar and vec2 conversions use the low lanes of the vec4
+ * instruction, which is faster than the bit manipulation of the generic
+ * version. With AVX-512F the vec16 conversions are done with a single
+ * instruction. */
+
+#ifdef __AVX512F__
+
+typedef union
+{
+  short16 o;
+  ushort16 f;
+} f2h16_o;
+
+#define IMPLEMENT_FLOAT2HALF16(SUFFIX, MODE)                                  \
+  ushort16 _cl_float2half16##SUFFIX (const float16 data)                      \
+  {                                                                           \
+    f2h16_o uo;                                                               \
+    uo.o = __builtin_ia32_vcvtps2ph512_mask (data, MODE, (short16){ 0 },      \
+                                             (ushort)0xFFFF);                 \
+    return uo.f;                                                              \
+  }
+
+#else
+
+#define IMPLEMENT_FLOAT2HALF16(SUFFIX, MODE)                                  \
+  ushort16 _cl_float2half16##SUFFIX (const float16 data)                      \
+  {                                                                           \
+    ushort8 lo = _cl_float2half8##SUFFIX (data.lo);                           \
+    ushort8 hi = _cl_float2half8##SUFFIX (data.hi);                           \
+    return (ushort16){ lo.s0, lo.s1, lo.s2, lo.s3, lo.s4, lo.s5, lo.s6,       \
+                       lo.s7, hi.s0, hi.s1, hi.s2, hi.s3, hi.s4, hi.s5,       \
+                       hi.s6, hi.s7 };                                        \
+  }
+
+#endif
+
+#define IMPLEMENT_FLOAT2HALF_WIDTHS(SUFFIX, MODE)                             \
+  ushort _cl_float2half1##SUFFIX (const float data)                           \
+  {                                                                           \
+    return _cl_float2half4##SUFFIX ((float4){ data, 0.0f, 0.0f, 0.0f }).x;    \
+  }                                                                           \
+                                                                              \
+  ushort2 _cl_float2half2##SUFFIX (const float2 data)                         \
+  {                                                                           \
+    return _cl_float2half4##SUFFIX ((float4){ data.x, data.y, 0.0f, 0.0f })   \
+        .xy;                                                                  \
+  }                                                                           \
+                                                                              \
+  IMPLEMENT_FLOAT2HALF16 (SUFFIX, MODE)
+
+IMPLEMENT_FLOAT2HALF_WIDTHS (, 0)
+IMPLEMENT_FLOAT2HALF_WIDTHS (_rte, 0)
+IMPLEMENT_FLOAT2HALF_WIDTHS (_rtn, 1)
+IMPLEMENT_FLOAT2HALF_WIDTHS (_rtp, 2)
+IMPLEMENT_FLOAT2HALF_WIDTHS (_rtz, 3)
+
+/** HALF -> FLOAT scalar, vec2 and vec16 ******************************/
+
+float
+_cl_half2float1 (const ushort data)
+{
+  return _cl_half2float4 ((ushort4){ data, 0, 0, 0 }).x;
+}
+
+float2
+_cl_half2float2 (const ushort2 data)
+{
+  return _cl_half2float4 ((ushort4){ data.x, data.y, 0, 0 }).xy;
+}
+
+#ifdef __AVX512F__
+
+typedef union
+{
+  short16 i;
+  ushort16 u;
+} h2f16_i;
+
+float16
+_cl_half2float16 (const ushort16 data)
+{
+  h2f16_i ui;
+  ui.u = data;
+  /* 4 = _MM_FROUND_CUR_DIRECTION, the conversion is exact anyway. */
+  return __builtin_ia32_vcvtph2ps512_mask (ui.i, (float16){ 0.0f },
+                                           (ushort)0xFFFF, 4);
+}
+
+#else
+
+float16
+_cl_half2float16 (const ushort16 data)
+{
+  float8 lo = _cl_half2float8 (data.lo);
+  float8 hi = _cl_half2float8 (data.hi);
+  return (float16){ lo.s0, lo.s1, lo.s2, lo.s3, lo.s4, lo.s5, lo.s6, lo.s7,
+                    hi.s0, hi.s1, hi.s2, hi.s3, hi.s4, hi.s5, hi.s6, hi.s7 };
+}
+
+#endif
+
 #endif
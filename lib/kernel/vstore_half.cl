@@ -220,79 +220,145 @@ _cl_double2half_rtp (double d)
 
 #endif
 
+#if defined(__aarch64__) && defined(cl_khr_fp16) && !defined(__F16C__)
+
+/* ARMv8 has conversion instructions from float to half for all the vector
+ * widths, which the backend selects for the fptrunc to half. They round to
+ * the nearest even, so the other rounding modes use the generic code. */
+#define POCL_NATIVE_HALF_CONVERSIONS
+
+#define IMPLEMENT_FLOAT2HALF_NATIVE(SUFFIX)                                   \
+  static ushort _cl_float2half1##SUFFIX (const float data)                    \
+  {                                                                           \
+    return as_ushort ((half)data);                                            \
+  }                                                                           \
+  static ushort2 _cl_float2half2##SUFFIX (const float2 data)                  \
+  {                                                                           \
+    return as_ushort2 (__builtin_convertvector (data, half2));                \
+  }                                                                           \
+  static ushort4 _cl_float2half4##SUFFIX (const float4 data)                  \
+  {                                                                           \
+    return as_ushort4 (__builtin_convertvector (data, half4));                \
+  }                                                                           \
+  static ushort8 _cl_float2half8##SUFFIX (const float8 data)                  \
+  {                                                                           \
+    return as_ushort8 (__builtin_convertvector (data, half8));                \
+  }                                                                           \
+  static ushort16 _cl_float2half16##SUFFIX (const float16 data)               \
+  {                                                                           \
+    return as_ushort16 (__builtin_convertvector (data, half16));              \
+  }
+
+#define IMPLEMENT_FLOAT2HALF_GENERIC(SUFFIX)                                  \
+  static ushort _cl_float2half1##SUFFIX (const float data)                    \
+  {                                                                           \
+    return _cl_float2half##SUFFIX (data);                                     \
+  }                                                                           \
+  static ushort2 _cl_float2half2##SUFFIX (const float2 data)                  \
+  {                                                                           \
+    return (ushort2) (_cl_float2half##SUFFIX (data.x),                        \
+                      _cl_float2half##SUFFIX (data.y));                       \
+  }                                                                           \
+  static ushort4 _cl_float2half4##SUFFIX (const float4 data)                  \
+  {                                                                           \
+    return (ushort4) (_cl_float2half2##SUFFIX (data.lo),                      \
+                      _cl_float2half2##SUFFIX (data.hi));                     \
+  }                                                                           \
+  static ushort8 _cl_float2half8##SUFFIX (const float8 data)                  \
+  {                                                                           \
+    return (ushort8) (_cl_float2half4##SUFFIX (data.lo),                      \
+                      _cl_float2half4##SUFFIX (data.hi));                     \
+  }                                                                           \
+  static ushort16 _cl_float2half16##SUFFIX (const float16 data)               \
+  {                                                                           \
+    return (ushort16) (_cl_float2half8##SUFFIX (data.lo),                     \
+                       _cl_float2half8##SUFFIX (data.hi));                    \
+  }
+
+IMPLEMENT_FLOAT2HALF_NATIVE ()
+IMPLEMENT_FLOAT2HALF_NATIVE (_rte)
+IMPLEMENT_FLOAT2HALF_GENERIC (_rtn)
+IMPLEMENT_FLOAT2HALF_GENERIC (_rtp)
+IMPLEMENT_FLOAT2HALF_GENERIC (_rtz)
+
+#endif
+
 #ifdef __F16C__
 
-ushort4 _cl_float2half4 (const float4 data);
-ushort8 _cl_float2half8 (const float8 data);
-ushort4 _cl_float2half4_rte (const float4 data);
-ushort8 _cl_float2half8_rte (const float8 data);
-ushort4 _cl_float2half4_rtn (const float4 data);
-ushort8 _cl_float2half8_rtn (const float8 data);
-ushort4 _cl_float2half4_rtp (const float4 data);
-ushort8 _cl_float2half8_rtp (const float8 data);
-ushort4 _cl_float2half4_rtz (const float4 data);
-ushort8 _cl_float2half8_rtz (const float8 data);
+#define DECLARE_FLOAT2HALF_F16C(SUFFIX)                                       \
+  ushort _cl_float2half1##SUFFIX (const float data);                          \
+  ushort2 _cl_float2half2##SUFFIX (const float2 data);                        \
+  ushort4 _cl_float2half4##SUFFIX (const float4 data);                        \
+  ushort8 _cl_float2half8##SUFFIX (const float8 data);                        \
+  ushort16 _cl_float2half16##SUFFIX (const float16 data);
+
+DECLARE_FLOAT2HALF_F16C ()
+DECLARE_FLOAT2HALF_F16C (_rte)
+DECLARE_FLOAT2HALF_F16C (_rtn)
+DECLARE_FLOAT2HALF_F16C (_rtp)
+DECLARE_FLOAT2HALF_F16C (_rtz)
+#endif
 
+#if defined(__F16C__) || defined(POCL_NATIVE_HALF_CONVERSIONS)
+
+/* vstore_halfN only requires the alignment of half, so those store with
+ * vstoreN, while the vstorea_halfN may access the vectors directly. */
 #define IMPLEMENT_VSTORE_HALF(MOD, SUFFIX)                                    \
                                                                               \
   void _CL_OVERLOADABLE vstore_half##SUFFIX (float data, size_t offset,       \
                                              MOD half *p)                     \
   {                                                                           \
-    ((MOD ushort *)p)[offset] = _cl_float2half##SUFFIX (data);                \
+    ((MOD ushort *)p)[offset] = _cl_float2half1##SUFFIX (data);               \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstore_half2##SUFFIX (float2 data, size_t offset,     \
                                               MOD half *p)                    \
   {                                                                           \
-    vstore_half##SUFFIX (data.lo, offset * 2, p);                             \
-    vstore_half##SUFFIX (data.hi, offset * 2 + 1, p);                         \
+    vstore2 (_cl_float2half2##SUFFIX (data), offset, (MOD ushort *)p);        \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstore_half3##SUFFIX (float3 data, size_t offset,     \
                                               MOD half *p)                    \
   {                                                                           \
-    vstore_half##SUFFIX (data.x, offset * 3, p);                              \
-    vstore_half##SUFFIX (data.y, offset * 3 + 1, p);                          \
-    vstore_half##SUFFIX (data.z, offset * 3 + 2, p);                          \
+    ushort4 h = _cl_float2half4##SUFFIX ((float4) (data, 0.0f));              \
+    vstore3 (h.xyz, offset, (MOD ushort *)p);                                 \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstore_half4##SUFFIX (float4 data, size_t offset,     \
                                               MOD half *p)                    \
   {                                                                           \
-    ((MOD ushort4 *)p)[offset] = _cl_float2half4##SUFFIX (data);              \
+    vstore4 (_cl_float2half4##SUFFIX (data), offset, (MOD ushort *)p);        \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstore_half8##SUFFIX (float8 data, size_t offset,     \
                                               MOD half *p)                    \
   {                                                                           \
-    ((MOD ushort8 *)p)[offset] = _cl_float2half8##SUFFIX (data);              \
+    vstore8 (_cl_float2half8##SUFFIX (data), offset, (MOD ushort *)p);        \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstore_half16##SUFFIX (float16 data, size_t offset,   \
                                                MOD half *p)                   \
   {                                                                           \
-    ((MOD ushort8 *)p)[offset * 2] = _cl_float2half8##SUFFIX (data.lo);       \
-    ((MOD ushort8 *)p)[offset * 2 + 1] = _cl_float2half8##SUFFIX (data.hi);   \
+    vstore16 (_cl_float2half16##SUFFIX (data), offset, (MOD ushort *)p);      \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstorea_half##SUFFIX (float data, size_t offset,      \
                                               MOD half *p)                    \
   {                                                                           \
-    ((MOD ushort *)p)[offset] = _cl_float2half##SUFFIX (data);                \
+    ((MOD ushort *)p)[offset] = _cl_float2half1##SUFFIX (data);               \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstorea_half2##SUFFIX (float2 data, size_t offset,    \
                                                MOD half *p)                   \
   {                                                                           \
-    vstorea_half##SUFFIX (data.lo, offset * 2, p);                            \
-    vstorea_half##SUFFIX (data.hi, offset * 2 + 1, p);                        \
+    ((MOD ushort2 *)p)[offset] = _cl_float2half2##SUFFIX (data);              \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstorea_half3##SUFFIX (float3 data, size_t offset,    \
                                                MOD half *p)                   \
   {                                                                           \
-    vstorea_half2##SUFFIX (data.lo, offset * 2, p);                           \
-    vstorea_half2##SUFFIX ((float2) (data.z, 0.0f), offset * 2 + 1, p);       \
+    ushort4 h = _cl_float2half4##SUFFIX ((float4) (data, 0.0f));              \
+    vstore3 (h.xyz, 0, (MOD ushort *)p + offset * 4);                         \
   }                                                                           \
                                                                               \
   void _CL_OVERLOADABLE vstorea_half4##SUFFIX (float4 data, size_t offset,    \
@@ -310,11 +376,10 @@ ushort8 _cl_float2half8_rtz (const float8 data);
   void _CL_OVERLOADABLE vstorea_half16##SUFFIX (float16 data, size_t offset,  \
                                                 MOD half *p)                  \
   {                                                                           \
-    ((MOD ushort8 *)p)[offset * 2] = _cl_float2half8##SUFFIX (data.lo);       \
-    ((MOD ushort8 *)p)[offset * 2 + 1] = _cl_float2half8##SUFFIX (data.hi);   \
+    ((MOD ushort16 *)p)[offset] = _cl_float2half16##SUFFIX (data);            \
   }
 
-// __F16C__
+// __F16C__ || POCL_NATIVE_HALF_CONVERSIONS
 #else
 
 #define IMPLEMENT_VSTORE_HALF(MOD, SUFFIX)                                    \
@@ -63,6 +63,7 @@ write_float4_pixel (float4 color, void *data, size_t base_index, int type)
   if (type == CLK_HALF_FLOAT)
     {
       vstorea_half4(color, base_index, data);
+      return;
     }
   const float4 f127 = ((float4) (SCHAR_MAX));
   const float4 f32767 = ((float4) (SHRT_MAX));
@@ -240,11 +241,13 @@ pocl_write_pixel_fast_i (int4 color, size_t base_index, int order,
 
 /* full write with channel map conversion etc
  * Writes a four element pixel to an image pixel pointed by integer coords.
+ * data_class is the POCL_IMAGE_CLASS_* of the write_image function; it is
+ * inlined so that only the channel data types of the class are checked.
  */
-static void
+_CL_ALWAYSINLINE static void
 pocl_write_pixel (uint4 color, global dev_image_t *img, int4 coord,
                   size_t array_offset_pixels, size_t row_pitch,
-                  size_t slice_pitch)
+                  size_t slice_pitch, int data_class)
 {
   int width = img->_width;
   int height = img->_height;
@@ -252,6 +255,7 @@ pocl_write_pixel (uint4 color, global dev_image_t *img, int4 coord,
   int order = img->_order;
   int elem_size = img->_elem_size;
   int channel_type = img->_data_type;
+  int tile_shift = img->_tile_shift;
   void *data = img->_data;
 
   if ((coord.x >= width || coord.x < 0)
@@ -261,18 +265,18 @@ pocl_write_pixel (uint4 color, global dev_image_t *img, int4 coord,
       return;
     }
 
-  size_t base_index = array_offset_pixels + coord.x + (coord.y * row_pitch)
+  size_t base_index = array_offset_pixels
+                      + POCL_IMAGE_X_OFFSET (coord.x, tile_shift)
+                      + POCL_IMAGE_Y_OFFSET (coord.y, row_pitch, tile_shift)
                       + (coord.z * slice_pitch);
 
   color = map_channels (color, order);
 
-  if ((channel_type == CLK_SIGNED_INT8) || (channel_type == CLK_SIGNED_INT16)
-      || (channel_type == CLK_SIGNED_INT32))
+  if (POCL_IMAGE_IS_CLASS (data_class, POCL_IMAGE_CLASS_i, channel_type))
     pocl_write_pixel_fast_i (as_int4 (color), base_index, order, elem_size,
                              data);
-  else if ((channel_type == CLK_UNSIGNED_INT8)
-           || (channel_type == CLK_UNSIGNED_INT16)
-           || (channel_type == CLK_UNSIGNED_INT32))
+  else if (POCL_IMAGE_IS_CLASS (data_class, POCL_IMAGE_CLASS_ui,
+                                channel_type))
     pocl_write_pixel_fast_ui (as_uint4 (color), base_index, order, elem_size,
                               data);
   else // TODO unsupported channel types
@@ -312,7 +316,7 @@ CLK_UNSIGNED_INT8, CLK_UNSIGNED_INT16, or CLK_UNSIGNED_INT32.
     size_t row_pitch = i_ptr->_row_pitch / elem_bytes;                        \
     size_t slice_pitch = i_ptr->_slice_pitch / elem_bytes;                    \
     pocl_write_pixel (as_uint4 (color), i_ptr, coord4, 0, row_pitch,          \
-                      slice_pitch);                                           \
+                      slice_pitch, POCL_IMAGE_CLASS_##__POSTFIX__);           \
   }
 
 #define IMPLEMENT_WRITE_ARRAY_INT_COORD(__IMGTYPE__, __POSTFIX__, __COORD__,  \
@@ -343,7 +347,8 @@ CLK_UNSIGNED_INT8, CLK_UNSIGNED_INT16, or CLK_UNSIGNED_INT32.
       }                                                                       \
     array_offset_pixels *= slice_pitch;                                       \
     pocl_write_pixel (as_uint4 (color), i_ptr, coord4, array_offset_pixels,   \
-                      row_pitch, slice_pitch);                                \
+                      row_pitch, slice_pitch,                                 \
+                      POCL_IMAGE_CLASS_##__POSTFIX__);                        \
   }
 
 IMPLEMENT_WRITE_IMAGE_INT_COORD (IMG_WO_AQ image1d_t, ui, int, uint4)
@@ -37,6 +37,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include "BarrierTailReplication.h"
 #include "Barrier.h"
 #include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
 #include "VariableUniformityAnalysis.h"
 
 POP_COMPILER_DIAGS
@@ -65,6 +66,9 @@ BarrierTailReplication::getAnalysisUsage(AnalysisUsage &AU) const
   AU.addPreserved<LoopInfoWrapperPass>();
 
   AU.addPreserved<VariableUniformityAnalysis>();
+
+  AU.addRequired<pocl::WorkitemHandlerChooser>();
+  AU.addPreserved<pocl::WorkitemHandlerChooser>();
 }
 
 bool
@@ -72,7 +76,13 @@ BarrierTailReplication::runOnFunction(Function &F)
 {
   if (!Workgroup::isKernelToProcess(F))
     return false;
-  
+
+  /* The sub-CFGs of the CBS method can have several entries and exits,
+     replicating the tails would only grow the code. */
+  if (getAnalysis<pocl::WorkitemHandlerChooser>().chosenHandler() ==
+      pocl::WorkitemHandlerChooser::POCL_WIH_CBS)
+    return false;
+
 #ifdef DEBUG_BARRIER_REPL
   std::cerr << "### BTR on " << F.getName().str() << std::endl;
 #endif
@@ -36,6 +36,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
 
+#include "LLVMUtils.h"
 #include "Workgroup.h"
 
 POP_COMPILER_DIAGS
@@ -76,6 +77,7 @@ static const char *workgroup_variables[] = {"_local_id_x",
                                             "_global_offset_x",
                                             "_global_offset_y",
                                             "_global_offset_z",
+                                            POCL_DEVICE_ENQUEUE_GLOBAL,
                                             NULL};
 
 bool FlattenGlobals::runOnModule(Module &M) {
@@ -28,6 +28,8 @@
 #include "CompilerWarnings.h"
 IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
@@ -36,13 +38,28 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #include "ImplicitLoopBarriers.h"
 #include "Barrier.h"
+#include "LLVMUtils.h"
+#include "ParallelRegion.h"
 #include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
 #include "VariableUniformityAnalysis.h"
 
+#include "pocl_debug.h"
+#include "pocl_llvm_api.h"
 #include "pocl_runtime_config.h"
 
 //#define DEBUG_ILOOP_BARRIERS
 
+#define DEBUG_TYPE "implicit-loop-barriers"
+
+// The fewest work-items or kernel loop iterations worth vectorizing.
+#define MIN_VECTORIZED_TRIP_COUNT 4
+
+POCL_STATISTIC(ParallelOuterLoops,
+               "Number of kernel loops parallelized across the work-items");
+POCL_STATISTIC(InnerKernelLoops,
+               "Number of kernel loops left innermost for vectorization");
+
 using namespace llvm;
 using namespace pocl;
 
@@ -59,22 +76,170 @@ void ImplicitLoopBarriers::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addPreserved<DominatorTreeWrapperPass>();
   AU.addRequired<VariableUniformityAnalysis>();
   AU.addPreserved<VariableUniformityAnalysis>();
+  AU.addRequired<WorkitemHandlerChooser>();
+  AU.addPreserved<WorkitemHandlerChooser>();
+}
+
+// Returns the alloca holding the induction variable of the kernel loop L,
+// which the loop stores its own value incremented by a constant Step to,
+// or nullptr. The PHIs are in allocas at this point.
+static AllocaInst *findInductionAlloca(Loop &L, int64_t &Step) {
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      StoreInst *Store = dyn_cast<StoreInst>(&I);
+      if (Store == nullptr)
+        continue;
+      AllocaInst *Alloca = dyn_cast<AllocaInst>(Store->getPointerOperand());
+      BinaryOperator *Add = dyn_cast<BinaryOperator>(Store->getValueOperand());
+      if (Alloca == nullptr || Add == nullptr ||
+          Add->getOpcode() != Instruction::Add)
+        continue;
+      LoadInst *Load = dyn_cast<LoadInst>(Add->getOperand(0));
+      ConstantInt *C = dyn_cast<ConstantInt>(Add->getOperand(1));
+      if (Load != nullptr && C != nullptr &&
+          Load->getPointerOperand() == Alloca) {
+        Step = C->getSExtValue();
+        return Alloca;
+      }
+    }
+  }
+  return nullptr;
+}
+
+// Returns the trip count of the kernel loop L with the induction variable
+// in IV if it is a constant, otherwise 0.
+static uint64_t constantTripCount(Loop &L, AllocaInst *IV, int64_t Step) {
+  BasicBlock *Exiting = L.getExitingBlock();
+  BranchInst *Br =
+      Exiting ? dyn_cast<BranchInst>(Exiting->getTerminator()) : nullptr;
+  ICmpInst *Cmp =
+      Br && Br->isConditional() ? dyn_cast<ICmpInst>(Br->getCondition())
+                                : nullptr;
+  ConstantInt *End =
+      Cmp ? dyn_cast<ConstantInt>(Cmp->getOperand(1)) : nullptr;
+  if (End == nullptr || Step == 0)
+    return 0;
+  for (User *U : IV->users()) {
+    StoreInst *Init = dyn_cast<StoreInst>(U);
+    if (Init == nullptr || L.contains(Init))
+      continue;
+    ConstantInt *Start = dyn_cast<ConstantInt>(Init->getValueOperand());
+    if (Start == nullptr)
+      return 0;
+    int64_t Distance = End->getSExtValue() - Start->getSExtValue();
+    return Distance / Step > 0 ? Distance / Step : 0;
+  }
+  return 0;
+}
+
+/* Choose between parallelizing the work-items inside the kernel loop L of
+ * a kernel without barriers, which makes the work-item loop the innermost
+ * and thus the vectorized loop, and leaving the kernel loop innermost for
+ * the vectorizer. The former pays for storing the values live across the
+ * kernel loop iterations in the context arrays, so it is chosen only if
+ * more of the buffer accesses of the loop are consecutive (or, for loads,
+ * uniform) across the work-items than across the iterations, or if the
+ * kernel loop is too short to vectorize. */
+static bool preferParallelOuterLoop(Loop &L) {
+  Function *F = L.getHeader()->getParent();
+  Module *M = F->getParent();
+  const DataLayout &DL = M->getDataLayout();
+
+  GlobalVariable *LocalIdX = M->getGlobalVariable(POCL_LOCAL_ID_X_GLOBAL);
+  if (LocalIdX == nullptr)
+    return false;
+
+  unsigned long LocalSizeX = 0;
+  bool DynamicLocalSize = false;
+  getModuleIntMetadata(*M, "WGLocalSizeX", LocalSizeX);
+  getModuleBoolMetadata(*M, "WGDynamicLocalSize", DynamicLocalSize);
+  if (!DynamicLocalSize && LocalSizeX > 0 &&
+      LocalSizeX < MIN_VECTORIZED_TRIP_COUNT)
+    return false;
+
+  int64_t Step = 0;
+  AllocaInst *IV = findInductionAlloca(L, Step);
+  IdStrideAnalysis WIStrides(DL, LocalIdX);
+  IdStrideAnalysis IterationStrides(DL, IV);
+
+  unsigned AcrossWIs = 0, AcrossIterations = 0;
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      Value *Ptr;
+      Type *AccessType;
+      if (LoadInst *Load = dyn_cast<LoadInst>(&I)) {
+        Ptr = Load->getPointerOperand();
+        AccessType = Load->getType();
+      } else if (StoreInst *Store = dyn_cast<StoreInst>(&I)) {
+        Ptr = Store->getPointerOperand();
+        AccessType = Store->getValueOperand()->getType();
+      } else
+        continue;
+#ifndef LLVM_OLDER_THAN_12_0
+      if (isa<AllocaInst>(getUnderlyingObject(Ptr)))
+#else
+      if (isa<AllocaInst>(GetUnderlyingObject(Ptr, DL)))
+#endif
+        continue;
+      int64_t Size = DL.getTypeStoreSize(AccessType);
+      bool IsLoad = isa<LoadInst>(&I);
+      IdStride S = WIStrides.get(Ptr);
+      if (S.Known && (std::abs(S.Value) == Size || (IsLoad && S.Value == 0)))
+        ++AcrossWIs;
+      S = IV ? IterationStrides.get(Ptr) : UnknownStride;
+      if (S.Known && (std::abs(S.Value) == Size * std::abs(Step) ||
+                      (IsLoad && S.Value == 0)))
+        ++AcrossIterations;
+    }
+  }
+
+  uint64_t TripCount = IV ? constantTripCount(L, IV, Step) : 0;
+  bool ShortLoop = TripCount > 0 && TripCount < MIN_VECTORIZED_TRIP_COUNT;
+  bool Parallel =
+      AcrossWIs > AcrossIterations || (ShortLoop && AcrossWIs > 0);
+  POCL_MSG_PRINT_LLVM("Kernel loop %s of %s: %u accesses consecutive across "
+                      "the work-items, %u across the iterations, %s\n",
+                      L.getHeader()->getName().str().c_str(),
+                      F->getName().str().c_str(), AcrossWIs,
+                      AcrossIterations,
+                      Parallel ? "parallelizing the work-items inside it"
+                               : "vectorizing it");
+  return Parallel;
 }
 
 bool ImplicitLoopBarriers::runOnLoop(Loop *L, LPPassManager &LPM) {
-  if (!Workgroup::isKernelToProcess(*L->getHeader()->getParent()))
+  Function *F = L->getHeader()->getParent();
+  if (!Workgroup::isKernelToProcess(*F))
+    return false;
+
+  // __attribute__((annotate("pocl_no_parallel_outer_loop"))) and
+  // __attribute__((annotate("pocl_parallel_outer_loop"))) of the kernel
+  // override the choice.
+  if (F->getMetadata("pocl_no_parallel_outer_loop") != nullptr)
     return false;
 
   if (!pocl_get_bool_option("POCL_FORCE_PARALLEL_OUTER_LOOP", 0) &&
-      !Workgroup::hasWorkgroupBarriers(*L->getHeader()->getParent())) {
+      F->getMetadata("pocl_parallel_outer_loop") == nullptr &&
+      !Workgroup::hasWorkgroupBarriers(*F)) {
 #ifdef DEBUG_ILOOP_BARRIERS
-    std::cerr << "### ILB: The kernel has no barriers, let's not add implicit ones "
-              << "either to avoid WI context switch overheads"
+    std::cerr << "### ILB: The kernel has no barriers, let's add implicit ones "
+              << "only where they help the vectorization to avoid WI "
+              << "context switch overheads"
               << std::endl;
 #endif
-    return false;
+    if (getAnalysis<WorkitemHandlerChooser>().chosenHandler() !=
+            WorkitemHandlerChooser::POCL_WIH_LOOPS ||
+        L->getSubLoops().size() > 0)
+      return false;
+    if (!preferParallelOuterLoop(*L)) {
+      ++InnerKernelLoops;
+      return false;
+    }
   }
-  return ProcessLoop(L, LPM);
+  bool Changed = ProcessLoop(L, LPM);
+  if (Changed)
+    ++ParallelOuterLoops;
+  return Changed;
 }
 
 /**
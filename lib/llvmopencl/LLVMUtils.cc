@@ -27,10 +27,12 @@
 #include "CompilerWarnings.h"
 IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
+#include <llvm/IR/GetElementPtrTypeIterator.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/Analysis/LoopInfo.h>
 
 using namespace llvm;
 
@@ -138,6 +140,17 @@ bool isLocalMemFunctionArg(llvm::Function *F, unsigned ArgIndex) {
            SPIR_ADDRESS_SPACE_LOCAL;
 }
 
+bool isConstantMemFunctionArg(llvm::Function *F, unsigned ArgIndex) {
+
+  MDNode *MD = F->getMetadata("kernel_arg_addr_space");
+
+  if (MD == nullptr || MD->getNumOperands() <= ArgIndex)
+    return false;
+  else
+    return getConstantIntMDValue(MD->getOperand(ArgIndex)) ==
+           SPIR_ADDRESS_SPACE_CONSTANT;
+}
+
 void setFuncArgAddressSpaceMD(llvm::Function *F, unsigned ArgIndex,
                               unsigned AS) {
 
@@ -157,4 +170,262 @@ void setFuncArgAddressSpaceMD(llvm::Function *F, unsigned ArgIndex,
   AddressQuals.push_back(createConstantIntMD(C, AS));
   F->setMetadata(MDKind, MDNode::get(F->getContext(), AddressQuals));
 }
+
+bool isWorkItemLoop(const llvm::Loop &L) {
+  MDNode *LoopID = L.getLoopID();
+  if (LoopID == nullptr)
+    return false;
+  for (unsigned i = 1; i < LoopID->getNumOperands(); ++i) {
+    MDNode *Hint = dyn_cast<MDNode>(LoopID->getOperand(i));
+    if (Hint == nullptr || Hint->getNumOperands() == 0)
+      continue;
+    MDString *Name = dyn_cast<MDString>(Hint->getOperand(0));
+    if (Name && Name->getString() == "llvm.loop.parallel_accesses")
+      return true;
+  }
+  return false;
+}
+
+// The work-group collective and sub-group functions lowered by
+// WorkgroupCollectives.
+static const char *WorkgroupCollectives[] = {
+    "work_group_all", "work_group_any", "work_group_broadcast",
+    "work_group_reduce_add", "work_group_reduce_min", "work_group_reduce_max",
+    "work_group_scan_exclusive_add", "work_group_scan_exclusive_min",
+    "work_group_scan_exclusive_max", "work_group_scan_inclusive_add",
+    "work_group_scan_inclusive_min", "work_group_scan_inclusive_max",
+    "get_sub_group_size", "get_max_sub_group_size", "get_num_sub_groups",
+    "get_enqueued_num_sub_groups", "get_sub_group_id",
+    "get_sub_group_local_id", "sub_group_barrier", "sub_group_all",
+    "sub_group_any", "sub_group_broadcast", "sub_group_shuffle",
+    "sub_group_shuffle_xor", "sub_group_reduce_add", "sub_group_reduce_min",
+    "sub_group_reduce_max", "sub_group_scan_exclusive_add",
+    "sub_group_scan_exclusive_min", "sub_group_scan_exclusive_max",
+    "sub_group_scan_inclusive_add", "sub_group_scan_inclusive_min",
+    "sub_group_scan_inclusive_max", nullptr};
+
+llvm::StringRef getWorkgroupCollectiveName(llvm::StringRef FuncName,
+                                           llvm::StringRef *Params) {
+  StringRef Name = FuncName;
+  if (!Name.consume_front("_Z"))
+    return "";
+  unsigned NameLen;
+  if (Name.consumeInteger(10, NameLen) || NameLen >= Name.size())
+    return "";
+  StringRef BaseName = Name.take_front(NameLen);
+  const char **C = WorkgroupCollectives;
+  while (*C != nullptr && BaseName != *C)
+    ++C;
+  if (*C == nullptr)
+    return "";
+  if (Params != nullptr)
+    *Params = Name.drop_front(NameLen);
+  return BaseName;
+}
+
+// The element-wise math builtins that have a vector overload taking only
+// vectors of the scalar argument types. The divide and recip entries are
+// the _cl_relaxed_ versions of native_divide and native_recip.
+static const char *VectorizableBuiltins[] = {
+    "acos", "acosh", "acospi", "asin", "asinh", "asinpi", "atan", "atan2",
+    "atan2pi", "atanh", "atanpi", "cbrt", "ceil", "clamp", "copysign", "cos",
+    "cosh", "cospi", "degrees", "divide", "erf", "erfc", "exp", "exp10", "exp2",
+    "expm1", "fabs", "fdim", "floor", "fma", "fmax", "fmin", "fmod", "hypot",
+    "ilogb", "ldexp", "lgamma", "log", "log10", "log1p", "log2", "logb", "mad",
+    "maxmag", "minmag", "mix", "nextafter", "pow", "pown", "powr", "radians",
+    "recip", "remainder", "rint", "rootn", "round", "rsqrt", "sign", "sin",
+    "sinh", "sinpi", "smoothstep", "sqrt", "step", "tan", "tanh", "tanpi",
+    "tgamma", "trunc", "half_cos", "half_divide", "half_exp", "half_exp10",
+    "half_exp2", "half_log", "half_log10", "half_log2", "half_powr",
+    "half_recip", "half_rsqrt", "half_sin", "half_sqrt", "half_tan",
+    "native_cos", "native_divide", "native_exp", "native_exp10", "native_exp2",
+    "native_log", "native_log10", "native_log2", "native_powr", "native_recip",
+    "native_rsqrt", "native_sin", "native_sqrt", "native_tan", nullptr};
+
+bool isDoubleBuiltin(const llvm::Function &ScalarFunc) {
+  return ScalarFunc.arg_size() > 0 &&
+         ScalarFunc.getFunctionType()->getParamType(0)->isDoubleTy();
+}
+
+std::string getVectorBuiltinName(const llvm::Function &ScalarFunc,
+                                 unsigned Width) {
+  if (Width != 2 && Width != 4 && Width != 8 && Width != 16)
+    return "";
+
+  unsigned NumArgs = ScalarFunc.arg_size();
+  if (NumArgs == 0)
+    return "";
+  Type *ElemTy = ScalarFunc.getFunctionType()->getParamType(0);
+  char TypeCode;
+  if (ElemTy->isFloatTy())
+    TypeCode = 'f';
+  else if (ElemTy->isDoubleTy())
+    TypeCode = 'd';
+  else
+    return "";
+
+  // The result is of the element type, except for ilogb() which returns
+  // the exponents as ints.
+  Type *RetTy = ScalarFunc.getReturnType();
+  if (RetTy != ElemTy && !RetTy->isIntegerTy(32))
+    return "";
+
+  // Itanium mangling: _Z<name length><name><parameter types>.
+  StringRef Name = ScalarFunc.getName();
+  if (!Name.consume_front("_Z"))
+    return "";
+  unsigned NameLen;
+  if (Name.consumeInteger(10, NameLen) || NameLen > Name.size())
+    return "";
+  StringRef BaseName = Name.take_front(NameLen);
+  StringRef Params = Name.drop_front(NameLen);
+
+  // The parameters are of the element type, besides the int exponents of
+  // ldexp(), pown() and rootn().
+  const char Codes[] = {TypeCode, 'i', '\0'};
+  if (Params.size() != NumArgs ||
+      Params.find_first_not_of(Codes) != StringRef::npos)
+    return "";
+
+  // The builtins are renamed in the kernel library, see
+  // _builtin_renames.h, and the linker binds the relaxed math mode calls
+  // to the _cl_relaxed_ versions, see linker.cpp.
+  StringRef Builtin = BaseName;
+  Builtin.consume_front("_cl_");
+  Builtin.consume_front("relaxed_");
+  const char **B = VectorizableBuiltins;
+  while (*B != nullptr && Builtin != *B)
+    ++B;
+  if (*B == nullptr)
+    return "";
+
+  std::string VecName = "_Z" + std::to_string(NameLen) + BaseName.str();
+  // A repeated vector parameter type is a substitution of its first
+  // occurrence: S_ for the first vector type, S0_ for the second one.
+  std::string Seen;
+  for (char Code : Params) {
+    size_t Sub = Seen.find(Code);
+    if (Sub == 0)
+      VecName += "S_";
+    else if (Sub != std::string::npos)
+      VecName += "S" + std::to_string(Sub - 1) + "_";
+    else {
+      VecName += "Dv" + std::to_string(Width) + "_" + Code;
+      Seen += Code;
+    }
+  }
+  return VecName;
+}
+
+llvm::FunctionType *getVectorBuiltinType(const llvm::Function &ScalarFunc,
+                                         unsigned Width) {
+#ifndef LLVM_OLDER_THAN_11_0
+  auto widen = [Width](Type *T) -> Type * {
+    return FixedVectorType::get(T, Width);
+  };
+#else
+  auto widen = [Width](Type *T) -> Type * {
+    return VectorType::get(T, Width);
+  };
+#endif
+  SmallVector<Type *, 3> Params;
+  for (Type *T : ScalarFunc.getFunctionType()->params())
+    Params.push_back(widen(T));
+  return FunctionType::get(widen(ScalarFunc.getReturnType()), Params, false);
+}
+
+IdStride IdStrideAnalysis::get(llvm::Value *V, unsigned Depth) {
+  Instruction *I = dyn_cast<Instruction>(V);
+  if (I == nullptr)
+    return {true, 0};
+
+  auto Cached = Strides.find(V);
+  if (Cached != Strides.end())
+    return Cached->second;
+  if (Depth > 16)
+    return UnknownStride;
+  // Optimistically assume the loop carried values are invariant.
+  Strides[V] = {true, 0};
+
+  IdStride S = UnknownStride;
+  ConstantInt *C = I->getNumOperands() > 1
+                       ? dyn_cast<ConstantInt>(I->getOperand(1))
+                       : nullptr;
+  switch (I->getOpcode()) {
+  case Instruction::Load: {
+    Value *Ptr = cast<LoadInst>(I)->getPointerOperand();
+    if (Ptr == LocalIdVar)
+      S = {true, 1};
+    else {
+      IdStride Addr = get(Ptr, Depth + 1);
+      if (Addr.Known && Addr.Value == 0)
+        S = {true, 0};
+    }
+    break;
+  }
+  case Instruction::Add:
+    S = combine(get(I->getOperand(0), Depth + 1),
+                get(I->getOperand(1), Depth + 1), 1);
+    break;
+  case Instruction::Sub:
+    S = combine(get(I->getOperand(0), Depth + 1),
+                get(I->getOperand(1), Depth + 1), -1);
+    break;
+  case Instruction::Mul: {
+    IdStride A = get(I->getOperand(0), Depth + 1);
+    IdStride B = get(I->getOperand(1), Depth + 1);
+    ConstantInt *C0 = dyn_cast<ConstantInt>(I->getOperand(0));
+    if (C != nullptr && A.Known)
+      S = {true, A.Value * C->getSExtValue()};
+    else if (C0 != nullptr && B.Known)
+      S = {true, B.Value * C0->getSExtValue()};
+    else if (A.Known && A.Value == 0 && B.Known && B.Value == 0)
+      S = {true, 0};
+    break;
+  }
+  case Instruction::Shl: {
+    IdStride A = get(I->getOperand(0), Depth + 1);
+    if (C != nullptr && A.Known && C->getZExtValue() < 32)
+      S = {true, A.Value * ((int64_t)1 << C->getZExtValue())};
+    break;
+  }
+  case Instruction::ZExt:
+  case Instruction::SExt:
+  case Instruction::Trunc:
+  case Instruction::BitCast:
+  case Instruction::AddrSpaceCast:
+  case Instruction::PtrToInt:
+  case Instruction::IntToPtr:
+    S = get(I->getOperand(0), Depth + 1);
+    break;
+  case Instruction::GetElementPtr: {
+    GetElementPtrInst *GEP = cast<GetElementPtrInst>(I);
+    S = get(GEP->getPointerOperand(), Depth + 1);
+    for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP);
+         GTI != E && S.Known; ++GTI) {
+      // Struct fields are selected by constants.
+      if (GTI.isStruct())
+        continue;
+      int64_t Size = DL.getTypeAllocSize(GTI.getIndexedType());
+      S = combine(S, get(GTI.getOperand(), Depth + 1), Size);
+    }
+    break;
+  }
+  default:
+    // Anything else is invariant only if all its operands are.
+    S = {true, 0};
+    for (Value *Op : I->operands()) {
+      IdStride OpS = get(Op, Depth + 1);
+      if (!OpS.Known || OpS.Value != 0) {
+        S = UnknownStride;
+        break;
+      }
+    }
+    if (S.Known && I->mayReadFromMemory() && !isa<LoadInst>(I))
+      S = UnknownStride;
+  }
+
+  Strides[V] = S;
+  return S;
+}
 }
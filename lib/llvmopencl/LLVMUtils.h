@@ -30,15 +30,52 @@
 #include "pocl_spir.h"
 //#include "_libclang_versions_checks.h"
 
+#include <llvm/ADT/Statistic.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Transforms/Utils/Cloning.h> // for CloneFunctionIntoAbs
 
+// The statistics the kernel compile report (POCL_KERNEL_COMPILE_REPORT)
+// is built from. These are collected also when LLVM and pocl are built
+// without assertions.
+#ifdef LLVM_OLDER_THAN_10_0
+#define POCL_STATISTIC STATISTIC
+#else
+#define POCL_STATISTIC ALWAYS_ENABLED_STATISTIC
+#endif
+
+// The name prefix of the globals holding the work-group shared state of
+// the lowered work-group collective functions. Workgroup privatizes them
+// to the work-group function.
+#define POCL_WG_COLLECTIVE_GLOBAL_PREFIX "_pocl_wg_collective"
+
+// Marks the loads of the work-group collective results, which are the
+// same for all the work-items.
+#define POCL_WG_COLLECTIVE_RESULT_MD "pocl.wg_collective_result"
+
+// The name prefix of the zero length array globals the lowered sub-group
+// functions exchange the work-item values through. Workgroup privatizes
+// them to arrays with an element per work-item.
+#define POCL_SUB_GROUP_SCRATCH_GLOBAL_PREFIX "_pocl_sub_group_scratch"
+
+// The handle of the struct pocl_preempt_point * the preemption points of
+// WorkitemPreemption poll. Workgroup privatizes it to the load of the
+// preempt field of the context struct.
+#define POCL_PREEMPT_GLOBAL "_pocl_preempt"
+
+// The handle of the struct pocl_device_enqueue * of the device-side enqueue
+// functions of the kernel library (lib/kernel/enqueue_kernel.c), which
+// Workgroup privatizes to the load of the device_enqueue field of the
+// context struct.
+#define POCL_DEVICE_ENQUEUE_GLOBAL "_pocl_device_enqueue"
+
 namespace llvm {
     class Module;
     class Function;
     class GlobalVariable;
+    class Loop;
 }
 
 namespace pocl {
@@ -101,6 +138,9 @@ is_sampler_type(const llvm::Type& t)
 // Checks if the given argument of Func is a local buffer.
 bool isLocalMemFunctionArg(llvm::Function *Func, unsigned ArgIndex);
 
+// Checks if the given argument of Func is a constant buffer.
+bool isConstantMemFunctionArg(llvm::Function *Func, unsigned ArgIndex);
+
 // Sets the address space metadata of the given function argument.
 // Note: The address space ids must be SPIR ids. If it encounters
 // argument indices without address space ids in the list, sets
@@ -109,6 +149,63 @@ void setFuncArgAddressSpaceMD(llvm::Function *Func, unsigned ArgIndex,
                               unsigned AS);
 
 llvm::Metadata *createConstantIntMD(llvm::LLVMContext &C, int32_t Val);
+
+// Checks if L is a work-item loop created by WorkitemLoops, i.e., it is
+// marked with llvm.loop.parallel_accesses.
+bool isWorkItemLoop(const llvm::Loop &L);
+
+// Returns the name of the OpenCL work-group collective or sub-group
+// function, e.g. "work_group_reduce_add", the mangled function name
+// FuncName refers to, or an empty string if it is not one. Params is set to the mangled
+// parameter types.
+llvm::StringRef getWorkgroupCollectiveName(llvm::StringRef FuncName,
+                                           llvm::StringRef *Params = nullptr);
+
+// Returns the mangled name of the Width wide vector overload of the
+// element-wise float or double OpenCL math builtin ScalarFunc, or an empty
+// string if ScalarFunc is not such a builtin.
+std::string getVectorBuiltinName(const llvm::Function &ScalarFunc,
+                                 unsigned Width);
+
+// Checks if the element-wise math builtin ScalarFunc computes in double
+// precision, i.e., it should use the native double vector width.
+bool isDoubleBuiltin(const llvm::Function &ScalarFunc);
+
+// Returns the type of the Width wide vector overload of ScalarFunc, where
+// each of the scalar parameters and the result is widened to a vector.
+llvm::FunctionType *getVectorBuiltinType(const llvm::Function &ScalarFunc,
+                                         unsigned Width);
+
+// The stride of a value with respect to one local id, in the units of the
+// value (bytes for pointers). Not known if the value depends on the id
+// other than linearly with a constant factor.
+struct IdStride {
+  bool Known;
+  int64_t Value;
+};
+
+const IdStride UnknownStride = {false, 0};
+
+// Computes the strides of the values with respect to the local id stored
+// in LocalIdVar, one of the local id globals the work-item loops iterate.
+class IdStrideAnalysis {
+public:
+  IdStrideAnalysis(const llvm::DataLayout &DL, llvm::Value *LocalIdVar)
+      : DL(DL), LocalIdVar(LocalIdVar) {}
+
+  IdStride get(llvm::Value *V, unsigned Depth = 0);
+
+private:
+  IdStride combine(IdStride A, IdStride B, int64_t BFactor) {
+    if (!A.Known || !B.Known)
+      return UnknownStride;
+    return {true, A.Value + B.Value * BFactor};
+  }
+
+  const llvm::DataLayout &DL;
+  llvm::Value *LocalIdVar;
+  std::map<llvm::Value *, IdStride> Strides;
+};
 }
 
 template <typename VectorT>
@@ -0,0 +1,260 @@
+// LLVM function pass that removes the barriers which do not order any
+// conflicting memory accesses of the work-items.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+
+#include <map>
+#include <set>
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+#include "Barrier.h"
+#include "RemoveRedundantBarriers.h"
+#include "Workgroup.h"
+#include "pocl_debug.h"
+#include "pocl_llvm_api.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "remove-redundant-barriers"
+
+STATISTIC(NumBarriersRemoved, "Number of redundant barriers removed");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::RemoveRedundantBarriers>
+    X("remove-redundant-barriers",
+      "Remove barriers that do not order work-item memory accesses.");
+
+// The non-private memory a set of instructions might access. The
+// accessed objects are tracked when they are known not to alias each
+// other, otherwise the access is unknown.
+struct MemoryAccesses {
+  std::set<const Value *> Reads, Writes;
+  bool UnknownReads = false, UnknownWrites = false;
+
+  void add(const MemoryAccesses &Other) {
+    Reads.insert(Other.Reads.begin(), Other.Reads.end());
+    Writes.insert(Other.Writes.begin(), Other.Writes.end());
+    UnknownReads |= Other.UnknownReads;
+    UnknownWrites |= Other.UnknownWrites;
+  }
+};
+}
+
+char RemoveRedundantBarriers::ID = 0;
+
+RemoveRedundantBarriers::RemoveRedundantBarriers() : FunctionPass(ID) {}
+
+void RemoveRedundantBarriers::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesCFG();
+}
+
+// Records an access through Ptr. Accesses to allocas are private to the
+// work-item and reads of constant globals cannot conflict.
+static void addAccess(MemoryAccesses &Acc, const Function &F,
+                      const Value *Ptr, bool Read, bool Write) {
+#ifndef LLVM_OLDER_THAN_12_0
+  const Value *Obj = getUnderlyingObject(Ptr);
+#else
+  const Value *Obj = GetUnderlyingObject(Ptr, F.getParent()->getDataLayout());
+#endif
+  if (isa<AllocaInst>(Obj))
+    return;
+  const GlobalVariable *GV = dyn_cast<GlobalVariable>(Obj);
+  if (GV != nullptr && GV->isConstant() && !Write)
+    return;
+
+  const Argument *Arg = dyn_cast<Argument>(Obj);
+  bool Identified = GV != nullptr || (Arg != nullptr && Arg->hasNoAliasAttr());
+  if (Read) {
+    if (Identified)
+      Acc.Reads.insert(Obj);
+    else
+      Acc.UnknownReads = true;
+  }
+  if (Write) {
+    if (Identified)
+      Acc.Writes.insert(Obj);
+    else
+      Acc.UnknownWrites = true;
+  }
+}
+
+static void addAccesses(MemoryAccesses &Acc, const Function &F,
+                        const Instruction &I) {
+  if (isa<Barrier>(I) || isa<DbgInfoIntrinsic>(I) ||
+      !I.mayReadOrWriteMemory())
+    return;
+
+  if (const LoadInst *LI = dyn_cast<LoadInst>(&I)) {
+    addAccess(Acc, F, LI->getPointerOperand(), true, false);
+  } else if (const StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+    addAccess(Acc, F, SI->getPointerOperand(), false, true);
+  } else if (const AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I)) {
+    addAccess(Acc, F, RMW->getPointerOperand(), true, true);
+  } else if (const AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(&I)) {
+    addAccess(Acc, F, CX->getPointerOperand(), true, true);
+  } else if (const CallInst *CI = dyn_cast<CallInst>(&I)) {
+    bool Write = !CI->onlyReadsMemory();
+    if (CI->onlyAccessesArgMemory()) {
+      for (const Value *Arg : CI->args())
+        if (Arg->getType()->isPointerTy())
+          addAccess(Acc, F, Arg, true, Write);
+    } else {
+      Acc.UnknownReads = true;
+      Acc.UnknownWrites |= Write;
+    }
+  } else {
+    Acc.UnknownReads = true;
+    Acc.UnknownWrites = true;
+  }
+}
+
+// Checks if an access in A might touch the same memory as an access in B.
+static bool mayOverlap(const std::set<const Value *> &A, bool UnknownA,
+                       const std::set<const Value *> &B, bool UnknownB) {
+  if ((UnknownA && (UnknownB || !B.empty())) || (UnknownB && !A.empty()))
+    return true;
+  for (const Value *Obj : A)
+    if (B.count(Obj))
+      return true;
+  return false;
+}
+
+// A barrier orders the accesses of all the work-items before it against
+// the ones after it. It is needed only if one of them writes memory the
+// other accesses.
+static bool mayConflict(const MemoryAccesses &Before,
+                        const MemoryAccesses &After) {
+  return mayOverlap(Before.Writes, Before.UnknownWrites, After.Reads,
+                    After.UnknownReads) ||
+         mayOverlap(Before.Writes, Before.UnknownWrites, After.Writes,
+                    After.UnknownWrites) ||
+         mayOverlap(Before.Reads, Before.UnknownReads, After.Writes,
+                    After.UnknownWrites);
+}
+
+// Collects the blocks reachable from BB, or the blocks BB is reachable
+// from. BB itself is included only if it is in a cycle.
+static void collectReachable(BasicBlock *BB, bool Backwards,
+                             SmallPtrSetImpl<BasicBlock *> &Reachable) {
+  SmallVector<BasicBlock *, 16> Worklist;
+  if (Backwards)
+    Worklist.append(pred_begin(BB), pred_end(BB));
+  else
+    Worklist.append(succ_begin(BB), succ_end(BB));
+
+  while (!Worklist.empty()) {
+    BasicBlock *Next = Worklist.pop_back_val();
+    if (!Reachable.insert(Next).second)
+      continue;
+    if (Backwards)
+      Worklist.append(pred_begin(Next), pred_end(Next));
+    else
+      Worklist.append(succ_begin(Next), succ_end(Next));
+  }
+}
+
+bool RemoveRedundantBarriers::runOnFunction(Function &F) {
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  SmallVector<Instruction *, 8> Barriers;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      if (isa<Barrier>(I))
+        Barriers.push_back(&I);
+  if (Barriers.empty())
+    return false;
+
+  // With one work-item per work-group the barriers cannot order anything.
+  unsigned long LocalSizeX = 0, LocalSizeY = 0, LocalSizeZ = 0;
+  bool DynamicLocalSize = false;
+  const Module &M = *F.getParent();
+  getModuleIntMetadata(M, "WGLocalSizeX", LocalSizeX);
+  getModuleIntMetadata(M, "WGLocalSizeY", LocalSizeY);
+  getModuleIntMetadata(M, "WGLocalSizeZ", LocalSizeZ);
+  getModuleBoolMetadata(M, "WGDynamicLocalSize", DynamicLocalSize);
+  bool SingleWorkItem = !DynamicLocalSize && LocalSizeX == 1 &&
+                        LocalSizeY == 1 && LocalSizeZ == 1;
+
+  std::map<const BasicBlock *, MemoryAccesses> BlockAccesses;
+  if (!SingleWorkItem) {
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        addAccesses(BlockAccesses[&BB], F, I);
+  }
+
+  SmallVector<Instruction *, 8> Redundant;
+  for (Instruction *B : Barriers) {
+    if (SingleWorkItem) {
+      Redundant.push_back(B);
+      continue;
+    }
+
+    BasicBlock *BB = B->getParent();
+    MemoryAccesses Before, After;
+    bool IsBefore = true;
+    for (Instruction &I : *BB) {
+      if (&I == B)
+        IsBefore = false;
+      else
+        addAccesses(IsBefore ? Before : After, F, I);
+    }
+
+    SmallPtrSet<BasicBlock *, 16> Preds, Succs;
+    collectReachable(BB, true, Preds);
+    collectReachable(BB, false, Succs);
+    for (BasicBlock *Pred : Preds)
+      Before.add(BlockAccesses[Pred]);
+    for (BasicBlock *Succ : Succs)
+      After.add(BlockAccesses[Succ]);
+
+    if (!mayConflict(Before, After))
+      Redundant.push_back(B);
+  }
+
+  for (Instruction *B : Redundant)
+    B->eraseFromParent();
+  NumBarriersRemoved += Redundant.size();
+
+  if (!Redundant.empty())
+    POCL_MSG_PRINT_LLVM("Removed %u of the %u barriers of %s\n",
+                        (unsigned)Redundant.size(), (unsigned)Barriers.size(),
+                        F.getName().str().c_str());
+  return !Redundant.empty();
+}
+
+}
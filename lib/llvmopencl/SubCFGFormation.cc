@@ -0,0 +1,648 @@
+// LLVM function pass to create the work-group function by splitting the
+// kernel at the barriers into sub-CFGs wrapped in work-item loops.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <iostream>
+
+#include "pocl.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include "Barrier.h"
+#include "Kernel.h"
+#include "LLVMUtils.h"
+#include "ParallelRegion.h"
+#include "SubCFGFormation.h"
+#include "VariableUniformityAnalysis.h"
+#include "WorkitemHandlerChooser.h"
+#include "Workgroup.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "subcfgformation"
+
+#ifdef LLVM_OLDER_THAN_8_0
+#define PARALLEL_MD_NAME "llvm.mem.parallel_loop_access"
+#else
+#define PARALLEL_MD_NAME "llvm.access.group"
+#endif
+
+POCL_STATISTIC(SubCFGKernels, "Number of kernels split into sub-CFGs");
+POCL_STATISTIC(NumSubCFGs, "Number of sub-CFGs formed");
+POCL_STATISTIC(NumContextValues, "Number of values stored across barriers");
+POCL_STATISTIC(ContextArrayBytes,
+               "Bytes of work-item context arrays per work-group");
+
+using namespace llvm;
+using namespace pocl;
+
+namespace {
+  static
+  RegisterPass<SubCFGFormation> X("subcfgformation",
+                                  "Continuation-based work-group function "
+                                  "generation pass");
+}
+
+char SubCFGFormation::ID = 0;
+
+void
+SubCFGFormation::getAnalysisUsage(AnalysisUsage &AU) const
+{
+  AU.addRequired<VariableUniformityAnalysis>();
+  AU.addPreserved<pocl::VariableUniformityAnalysis>();
+
+  AU.addRequired<pocl::WorkitemHandlerChooser>();
+  AU.addPreserved<pocl::WorkitemHandlerChooser>();
+}
+
+bool
+SubCFGFormation::runOnFunction(Function &F)
+{
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  if (getAnalysis<pocl::WorkitemHandlerChooser>().chosenHandler() !=
+      pocl::WorkitemHandlerChooser::POCL_WIH_CBS)
+    return false;
+
+  ++SubCFGKernels;
+
+  bool Changed = ProcessFunction(F);
+
+  Barriers.clear();
+  BarrierIds.clear();
+  SubCFGEntries.clear();
+  Reachable.clear();
+  BarriersAfter.clear();
+  LiveValues.clear();
+  UniformSlots.clear();
+  PaddedContextArrays.clear();
+
+  return Changed;
+}
+
+/* Collects the blocks reachable from the successors of BB. The search
+   does not continue past the blocks in Stop. */
+static void
+collectReachable(BasicBlock *BB, std::set<BasicBlock *> &Blocks,
+                 const std::map<BasicBlock *, int> *Stop = nullptr)
+{
+  std::vector<BasicBlock *> Worklist(succ_begin(BB), succ_end(BB));
+  while (!Worklist.empty()) {
+    BasicBlock *Succ = Worklist.back();
+    Worklist.pop_back();
+    if (!Blocks.insert(Succ).second)
+      continue;
+    if (Stop != nullptr && Stop->count(Succ))
+      continue;
+    Worklist.insert(Worklist.end(), succ_begin(Succ), succ_end(Succ));
+  }
+}
+
+bool
+SubCFGFormation::ProcessFunction(Function &F)
+{
+  Kernel *K = cast<Kernel>(&F);
+  Initialize(K);
+
+  assert(!WGDynamicLocalSize &&
+         "The CBS method needs a specialized local size.");
+
+  if (WGLocalSizeX * WGLocalSizeY * WGLocalSizeZ == 1) {
+    K->addLocalSizeInitCode(WGLocalSizeX, WGLocalSizeY, WGLocalSizeZ);
+    ParallelRegion::insertLocalIdInit(&F.getEntryBlock(), 0, 0, 0);
+    return true;
+  }
+
+  /* After -barriers each barrier is alone in its block, the entry block
+     is a barrier block and so are the blocks returning from the kernel.
+     Each barrier block that is not an exit starts a sub-CFG. */
+  for (BasicBlock &BB : F) {
+    if (!Barrier::hasBarrier(&BB))
+      continue;
+    assert(Barrier::hasOnlyBarrier(&BB) && "Barriers are not canonicalized.");
+    if (BB.getTerminator()->getNumSuccessors() == 0) {
+      BarrierIds[&BB] = ExitId;
+      continue;
+    }
+    BarrierIds[&BB] = Barriers.size();
+    Barriers.push_back(&BB);
+  }
+  assert(!Barriers.empty() && Barriers.front() == &F.getEntryBlock());
+
+  for (auto &B : BarrierIds) {
+    Reachable[B.first].insert(B.first);
+    collectReachable(B.first, Reachable[B.first]);
+  }
+
+  /* The sub-CFG of a barrier consists of the barrier block and the blocks
+     reachable from it without crossing another barrier. */
+  std::vector<BasicBlockVector> SubCFGs;
+  for (BasicBlock *B : Barriers) {
+    std::set<BasicBlock *> Blocks;
+    collectReachable(B, Blocks, &BarrierIds);
+    BasicBlockVector SubCFG(1, B);
+    for (BasicBlock &BB : F)
+      if (Blocks.count(&BB) && !BarrierIds.count(&BB))
+        SubCFG.push_back(&BB);
+    SubCFGs.push_back(SubCFG);
+  }
+
+  /* Uniformity must be queried before the IR is modified. */
+  CollectLiveAcrossBarriers(F);
+
+  LLVMContext &C = F.getContext();
+  BasicBlockVector OldBlocks;
+  for (BasicBlock &BB : F)
+    OldBlocks.push_back(&BB);
+
+  BasicBlock *Entry =
+    BasicBlock::Create(C, "cbs.entry", &F, &F.getEntryBlock());
+  BranchInst *EntryBr = BranchInst::Create(OldBlocks.front(), Entry);
+
+  ArrayifyAllocas(F, Entry);
+  StoreLiveAcrossBarriers(Entry);
+
+  /* No SSA value is live across a barrier anymore, thus each sub-CFG can
+     be cloned independently into its work-item loops. */
+  BasicBlock *ExitBB = BasicBlock::Create(C, "cbs.exit", &F);
+  ReturnInst::Create(C, ExitBB);
+
+  for (unsigned Id = 0; Id < Barriers.size(); ++Id)
+    SubCFGEntries.push_back(
+      BasicBlock::Create(C, "cbs.subcfg." + Twine(Id), &F, ExitBB));
+
+  for (unsigned Id = 0; Id < Barriers.size(); ++Id)
+    FormSubCFG(F, Id, SubCFGs[Id], ExitBB);
+
+  NumSubCFGs += Barriers.size();
+
+  EntryBr->setSuccessor(0, SubCFGEntries.front());
+
+  for (BasicBlock *BB : OldBlocks)
+    BB->dropAllReferences();
+  for (BasicBlock *BB : OldBlocks) {
+    assert(BB->use_empty() && "Old block still referred to by a sub-CFG.");
+    BB->eraseFromParent();
+  }
+
+  K->addLocalSizeInitCode(WGLocalSizeX, WGLocalSizeY, WGLocalSizeZ);
+  ParallelRegion::insertLocalIdInit(Entry, 0, 0, 0);
+
+  return true;
+}
+
+/* Returns true in case a path from the end of the Def block to the
+   Use block goes through a barrier. */
+bool
+SubCFGFormation::CrossesBarrier(BasicBlock *Def, BasicBlock *Use)
+{
+  auto It = BarriersAfter.find(Def);
+  if (It == BarriersAfter.end()) {
+    std::set<BasicBlock *> Blocks;
+    collectReachable(Def, Blocks);
+    std::set<BasicBlock *> &After = BarriersAfter[Def];
+    for (BasicBlock *BB : Blocks)
+      if (BarrierIds.count(BB))
+        After.insert(BB);
+    It = BarriersAfter.find(Def);
+  }
+
+  for (BasicBlock *B : It->second)
+    if (Reachable[B].count(Use))
+      return true;
+  return false;
+}
+
+/* Returns the instruction before which the used value must be available:
+   the user, or the end of its incoming block in case of a PHI. */
+Instruction *
+SubCFGFormation::UsePoint(Use &U)
+{
+  Instruction *User = cast<Instruction>(U.getUser());
+  if (PHINode *Phi = dyn_cast<PHINode>(User))
+    return Phi->getIncomingBlock(U)->getTerminator();
+  return User;
+}
+
+/* Finds the values that are used after a barrier that can be executed
+   after their definition. Since the blocks of the sub-CFGs are cloned
+   separately, only these values need to be stored, the others are
+   always dominated by their definition in the sub-CFG of their use. */
+void
+SubCFGFormation::CollectLiveAcrossBarriers(Function &F)
+{
+  VariableUniformityAnalysis &VUA = getAnalysis<VariableUniformityAnalysis>();
+
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      if (isa<AllocaInst>(&I) || I.getType()->isVoidTy() ||
+          I.getType()->isTokenTy())
+        continue;
+
+      LiveValue Live;
+      Live.Def = &I;
+      for (Use &U : I.uses()) {
+        Instruction *User = dyn_cast<Instruction>(U.getUser());
+        if (User == nullptr)
+          continue;
+        if (CrossesBarrier(&BB, UsePoint(U)->getParent()))
+          Live.Uses.push_back(&U);
+      }
+      if (Live.Uses.empty())
+        continue;
+      Live.Uniform = !VUA.shouldBePrivatized(&F, &I);
+      LiveValues.push_back(Live);
+    }
+  }
+}
+
+AllocaInst *
+SubCFGFormation::CreateContextArray(BasicBlock *Entry, Type *T,
+                                    unsigned Align, const Twine &Name)
+{
+  const DataLayout &Layout = Entry->getModule()->getDataLayout();
+  IRBuilder<> Builder(Entry->getTerminator());
+
+  /* Pad the elements of over-aligned private arrays so that each
+     work-item's copy is aligned as the original. */
+  bool Padded = false;
+  uint64_t StoreSize = Layout.getTypeAllocSize(T);
+  if (Align > 1 && (StoreSize & (Align - 1))) {
+    uint64_t PaddedSize = (StoreSize & ~(uint64_t)(Align - 1)) + Align;
+    Type *Padding =
+      ArrayType::get(Type::getInt8Ty(T->getContext()), PaddedSize - StoreSize);
+    T = StructType::get(T->getContext(), {T, Padding}, true);
+    Padded = true;
+  }
+
+  Type *ArrayTy = ArrayType::get(
+    ArrayType::get(ArrayType::get(T, WGLocalSizeX), WGLocalSizeY),
+    WGLocalSizeZ);
+  AllocaInst *Alloca = Builder.CreateAlloca(ArrayTy, nullptr, Name);
+  ContextArrayBytes += Layout.getTypeAllocSize(ArrayTy);
+  Alloca->setAlignment(
+#ifndef LLVM_OLDER_THAN_10_0
+#ifndef LLVM_OLDER_THAN_11_0
+      llvm::Align(
+#else
+      llvm::MaybeAlign(
+#endif
+#endif
+          std::max(Align, (unsigned)ContextArrayAlign)
+#ifndef LLVM_OLDER_THAN_10_0
+          )
+#endif
+  );
+  if (Padded)
+    PaddedContextArrays.insert(Alloca);
+  return Alloca;
+}
+
+/* Returns the address of the current work-item's slot in the context
+   array. */
+Value *
+SubCFGFormation::GetContextSlot(IRBuilder<> &Builder, AllocaInst *ContextArray)
+{
+  if (UniformSlots.count(ContextArray))
+    return ContextArray;
+
+  std::vector<Value *> GEPArgs;
+  GEPArgs.push_back(ConstantInt::get(SizeT, 0));
+  GEPArgs.push_back(Builder.CreateLoad(SizeT, LocalIdZGlobal));
+  GEPArgs.push_back(Builder.CreateLoad(SizeT, LocalIdYGlobal));
+  GEPArgs.push_back(Builder.CreateLoad(SizeT, LocalIdXGlobal));
+  if (PaddedContextArrays.count(ContextArray))
+    GEPArgs.push_back(ConstantInt::get(Type::getInt32Ty(SizeT->getContext()),
+                                       0));
+  return Builder.CreateGEP(ContextArray->getAllocatedType(), ContextArray,
+                           GEPArgs);
+}
+
+/* Replaces the private variables with arrays holding a copy for each
+   work-item. Each use gets the address of the copy of the work-item
+   executing it. */
+void
+SubCFGFormation::ArrayifyAllocas(Function &F, BasicBlock *Entry)
+{
+  std::vector<AllocaInst *> Allocas;
+  for (BasicBlock &BB : F) {
+    if (&BB == Entry)
+      continue;
+    for (Instruction &I : BB)
+      if (AllocaInst *Alloca = dyn_cast<AllocaInst>(&I))
+        Allocas.push_back(Alloca);
+  }
+
+  for (AllocaInst *Alloca : Allocas) {
+    /* The lifetime markers would refer to the whole context array. */
+    std::vector<Instruction *> Markers;
+    for (User *U : Alloca->users()) {
+      Instruction *Cast = dyn_cast<Instruction>(U);
+      if (Cast != nullptr && Cast->isCast()) {
+        for (User *CU : Cast->users())
+          if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(CU))
+            if (II->isLifetimeStartOrEnd())
+              Markers.push_back(II);
+      } else if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(U)) {
+        if (II->isLifetimeStartOrEnd())
+          Markers.push_back(II);
+      }
+    }
+    for (Instruction *Marker : Markers)
+      Marker->eraseFromParent();
+
+    Type *ElementTy = Alloca->getAllocatedType();
+    if (Alloca->isArrayAllocation()) {
+      ConstantInt *Count = cast<ConstantInt>(Alloca->getArraySize());
+      ElementTy = ArrayType::get(ElementTy, Count->getZExtValue());
+    }
+
+    AllocaInst *ContextArray =
+      CreateContextArray(Entry, ElementTy, Alloca->getAlignment(),
+                         Alloca->getName() + ".pocl_context");
+
+    while (!Alloca->use_empty()) {
+      Use &U = *Alloca->use_begin();
+      IRBuilder<> Builder(UsePoint(U));
+      Value *Slot = GetContextSlot(Builder, ContextArray);
+      if (Alloca->isArrayAllocation())
+        Slot = Builder.CreateConstGEP2_32(ElementTy, Slot, 0, 0);
+      U.set(Builder.CreatePointerCast(Slot, Alloca->getType()));
+    }
+    Alloca->eraseFromParent();
+  }
+}
+
+/* Stores the values live across barriers after their definition and
+   loads them at their uses after the barriers. Uniform values share a
+   single slot and the local ids are simply reloaded. */
+void
+SubCFGFormation::StoreLiveAcrossBarriers(BasicBlock *Entry)
+{
+  for (LiveValue &Live : LiveValues) {
+    Instruction *Def = Live.Def;
+
+    LoadInst *Load = dyn_cast<LoadInst>(Def);
+    if (Load != nullptr &&
+        (Load->getPointerOperand() == LocalIdZGlobal ||
+         Load->getPointerOperand() == LocalIdYGlobal ||
+         Load->getPointerOperand() == LocalIdXGlobal)) {
+      for (Use *U : Live.Uses) {
+        IRBuilder<> Builder(UsePoint(*U));
+        U->set(Builder.CreateLoad(SizeT, Load->getPointerOperand()));
+      }
+      continue;
+    }
+
+    AllocaInst *ContextArray;
+    if (Live.Uniform) {
+      IRBuilder<> Builder(Entry->getTerminator());
+      ContextArray = Builder.CreateAlloca(Def->getType(), nullptr,
+                                          Def->getName() + ".pocl_uniform");
+      UniformSlots.insert(ContextArray);
+    } else {
+      ContextArray = CreateContextArray(Entry, Def->getType(), 0,
+                                        Def->getName() + ".pocl_context");
+    }
+
+    BasicBlock::iterator StorePoint = Def->getIterator();
+    if (isa<PHINode>(Def))
+      StorePoint = Def->getParent()->getFirstInsertionPt();
+    else
+      ++StorePoint;
+
+    IRBuilder<> Builder(&*StorePoint);
+    Builder.CreateStore(Def, GetContextSlot(Builder, ContextArray));
+
+    for (Use *U : Live.Uses) {
+      Builder.SetInsertPoint(UsePoint(*U));
+      U->set(Builder.CreateLoad(Def->getType(),
+                                GetContextSlot(Builder, ContextArray)));
+    }
+    ++NumContextValues;
+  }
+}
+
+/* Adds the parallel loop metadata to the work-item loop. The work-items
+   do not synchronize within a sub-CFG, thus their memory accesses are
+   independent. */
+void
+SubCFGFormation::MarkParallelLoop(Instruction *LoopBranch,
+                                  const BasicBlockVector &Blocks)
+{
+  LLVMContext &C = LoopBranch->getContext();
+
+  MDNode *Dummy = MDNode::getTemporary(C, ArrayRef<Metadata *>()).release();
+#ifdef LLVM_OLDER_THAN_8_0
+  MDNode *Root = MDNode::get(C, Dummy);
+#else
+  MDNode *AccessGroupMD = MDNode::getDistinct(C, {});
+  MDNode *ParallelAccessMD = MDNode::get(
+      C, {MDString::get(C, "llvm.loop.parallel_accesses"), AccessGroupMD});
+
+  MDNode *Root = MDNode::get(C, {Dummy, ParallelAccessMD});
+#endif
+  Root->replaceOperandWith(0, Root);
+  MDNode::deleteTemporary(Dummy);
+  LoopBranch->setMetadata("llvm.loop", Root);
+
+#ifdef LLVM_OLDER_THAN_8_0
+  MDNode *Identifier = Root;
+#else
+  MDNode *Identifier = AccessGroupMD;
+#endif
+
+  for (BasicBlock *BB : Blocks) {
+    for (Instruction &I : *BB) {
+      if (!I.mayReadOrWriteMemory())
+        continue;
+#if LLVM_VERSION_MAJOR < 13 &&                                                 \
+    !(LLVM_VERSION_MAJOR == 12 && LLVM_VERSION_MINOR >= 0 &&                   \
+      LLVM_VERSION_PATCH >= 1)
+      // Loads inside conditions cannot be marked before LLVM 12.0.1, see
+      // ParallelRegion::AddParallelLoopMetadata().
+      if (I.mayReadFromMemory())
+        continue;
+#endif
+      MDNode *NewMD = MDNode::get(C, Identifier);
+      MDNode *OldMD = I.getMetadata(PARALLEL_MD_NAME);
+      if (OldMD != nullptr)
+        NewMD = MDNode::concatenate(OldMD, NewMD);
+      I.setMetadata(PARALLEL_MD_NAME, NewMD);
+    }
+  }
+}
+
+/* Clones the blocks of the sub-CFG started by barrier Id into work-item
+   loops. The edges to barrier blocks are redirected to the loop latch
+   which records the barrier reached, and after the loops the next
+   sub-CFG is selected by it. All the work-items reach the same barrier,
+   so the id recorded by the last one is used.
+
+   cbs.subcfg.N:  store 0, _local_id_z ...
+   (body):        the cloned sub-CFG, the barrier block first
+   cbs.next.N.M:  br cbs.wi_latch.N (one per barrier M reached)
+   cbs.wi_latch.N: %next = phi [M, cbs.next.N.M] ...
+                  increment the ids, loop back to the body
+   (loop end):    switch %next to cbs.subcfg.M or cbs.exit
+*/
+void
+SubCFGFormation::FormSubCFG(Function &F, unsigned Id,
+                            const BasicBlockVector &Blocks, BasicBlock *ExitBB)
+{
+  LLVMContext &C = F.getContext();
+
+  ValueToValueMapTy VMap;
+  BasicBlockVector Clones;
+  for (BasicBlock *BB : Blocks) {
+    BasicBlock *Clone = CloneBasicBlock(BB, VMap, ".cbs" + Twine(Id), &F);
+    VMap[BB] = Clone;
+    Clones.push_back(Clone);
+    Clone->moveBefore(ExitBB);
+  }
+
+  BasicBlock *Body = Clones.front();
+  for (Instruction &I : *Body) {
+    if (isa<Barrier>(&I)) {
+      I.eraseFromParent();
+      break;
+    }
+  }
+
+  for (BasicBlock *Clone : Clones)
+    for (Instruction &I : *Clone)
+      RemapInstruction(&I, VMap,
+                       RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+
+  BasicBlock *Latch =
+    BasicBlock::Create(C, "cbs.wi_latch." + Twine(Id), &F, ExitBB);
+
+  std::map<int, BasicBlock *> Next;
+  for (BasicBlock *Clone : Clones) {
+    Instruction *T = Clone->getTerminator();
+    for (unsigned i = 0; i < T->getNumSuccessors(); ++i) {
+      BasicBlock *Succ = T->getSuccessor(i);
+      int Target;
+      if (Succ == Body)
+        Target = Id;
+      else if (BarrierIds.count(Succ))
+        Target = BarrierIds[Succ];
+      else
+        continue;
+
+      BasicBlock *&Stub = Next[Target];
+      if (Stub == nullptr) {
+        Stub = BasicBlock::Create(
+          C, "cbs.next." + Twine(Id) + "." + Twine(Target), &F, Latch);
+        BranchInst::Create(Latch, Stub);
+      }
+      T->setSuccessor(i, Stub);
+    }
+  }
+
+  /* The edges from the other sub-CFGs do not exist in the clones. */
+  for (BasicBlock *Clone : Clones) {
+    std::set<BasicBlock *> Preds(pred_begin(Clone), pred_end(Clone));
+    for (PHINode &Phi : Clone->phis())
+      for (unsigned i = Phi.getNumIncomingValues(); i-- > 0;)
+        if (!Preds.count(Phi.getIncomingBlock(i)))
+          Phi.removeIncomingValue(i, false);
+  }
+
+  IRBuilder<> Builder(Latch);
+  PHINode *NextId = nullptr;
+  if (Next.size() > 1) {
+    NextId = Builder.CreatePHI(Type::getInt32Ty(C), Next.size(),
+                               "cbs.next_barrier");
+    for (auto &N : Next)
+      NextId->addIncoming(ConstantInt::get(Type::getInt32Ty(C), N.first),
+                          N.second);
+  }
+
+  /* The work-item loops, from the outermost to the innermost dimension.
+     The loops are in the do-while form as each executes at least once. */
+  Value *LocalIds[3] = {LocalIdZGlobal, LocalIdYGlobal, LocalIdXGlobal};
+  unsigned long LocalSizes[3] = {WGLocalSizeZ, WGLocalSizeY, WGLocalSizeX};
+  std::vector<unsigned> Dims;
+  for (unsigned d = 0; d < 3; ++d)
+    if (LocalSizes[d] > 1)
+      Dims.push_back(d);
+
+  std::vector<BasicBlock *> Headers;
+  BasicBlock *Cur = SubCFGEntries[Id];
+  for (unsigned i = 0; i < Dims.size(); ++i) {
+    Builder.SetInsertPoint(Cur);
+    Builder.CreateStore(ConstantInt::get(SizeT, 0), LocalIds[Dims[i]]);
+    BasicBlock *Header = Body;
+    if (i + 1 < Dims.size())
+      Header = BasicBlock::Create(C, "cbs.wi_loop." + Twine(Id), &F, Body);
+    Builder.CreateBr(Header);
+    Headers.push_back(Header);
+    Cur = Header;
+  }
+
+  Cur = Latch;
+  for (unsigned i = Dims.size(); i-- > 0;) {
+    Builder.SetInsertPoint(Cur);
+    Value *LocalId = LocalIds[Dims[i]];
+    Value *Inc = Builder.CreateAdd(Builder.CreateLoad(SizeT, LocalId),
+                                   ConstantInt::get(SizeT, 1));
+    Builder.CreateStore(Inc, LocalId);
+    BasicBlock *End =
+      BasicBlock::Create(C, "cbs.wi_loop_end." + Twine(Id), &F, ExitBB);
+    Instruction *LoopBranch = Builder.CreateCondBr(
+      Builder.CreateICmpULT(Inc, ConstantInt::get(SizeT, LocalSizes[Dims[i]])),
+      Headers[i], End);
+    if (i + 1 == Dims.size())
+      MarkParallelLoop(LoopBranch, Clones);
+    Cur = End;
+  }
+
+  auto TargetBlock = [&](int Target) {
+    return Target == ExitId ? ExitBB : SubCFGEntries[Target];
+  };
+
+  Builder.SetInsertPoint(Cur);
+  if (Next.empty()) {
+    /* The sub-CFG never reaches a barrier. */
+    Builder.CreateBr(ExitBB);
+  } else if (NextId == nullptr) {
+    Builder.CreateBr(TargetBlock(Next.begin()->first));
+  } else {
+    SwitchInst *Switch = Builder.CreateSwitch(
+      NextId, TargetBlock(Next.begin()->first), Next.size() - 1);
+    for (auto N = std::next(Next.begin()); N != Next.end(); ++N)
+      Switch->addCase(ConstantInt::get(Type::getInt32Ty(C), N->first),
+                      TargetBlock(N->first));
+  }
+}
@@ -0,0 +1,107 @@
+// Header for SubCFGFormation function pass.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _POCL_SUBCFG_FORMATION_H
+#define _POCL_SUBCFG_FORMATION_H
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "pocl.h"
+
+#include "llvm/IR/IRBuilder.h"
+
+#include "WorkitemHandler.h"
+
+namespace pocl {
+
+  // Produces the work-group function with the continuation-based
+  // synchronization (CBS) method: the kernel is split at the barriers
+  // into sub-CFGs, each of which is wrapped in its own work-item loops
+  // and ends by selecting the sub-CFG of the barrier reached next. The
+  // values live across barriers are kept in explicit context arrays, so
+  // the code size stays linear in the size of the kernel regardless of
+  // how the barriers are nested in loops and conditionals.
+  class SubCFGFormation : public pocl::WorkitemHandler {
+  public:
+    static char ID;
+
+    // The id of the sub-CFG "started" by the barriers at the kernel exits.
+    enum { ExitId = -1 };
+
+    SubCFGFormation() : pocl::WorkitemHandler(ID) {}
+
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+    virtual bool runOnFunction(llvm::Function &F);
+
+  private:
+    typedef std::vector<llvm::BasicBlock *> BasicBlockVector;
+
+    // A value with uses that can execute after a barrier following its
+    // definition.
+    struct LiveValue {
+      llvm::Instruction *Def;
+      std::vector<llvm::Use *> Uses;
+      bool Uniform;
+    };
+
+    bool ProcessFunction(llvm::Function &F);
+
+    void CollectLiveAcrossBarriers(llvm::Function &F);
+    void ArrayifyAllocas(llvm::Function &F, llvm::BasicBlock *Entry);
+    void StoreLiveAcrossBarriers(llvm::BasicBlock *Entry);
+
+    llvm::AllocaInst *CreateContextArray(llvm::BasicBlock *Entry,
+                                         llvm::Type *T, unsigned Align,
+                                         const llvm::Twine &Name);
+    llvm::Value *GetContextSlot(llvm::IRBuilder<> &Builder,
+                                llvm::AllocaInst *ContextArray);
+    void MarkParallelLoop(llvm::Instruction *LoopBranch,
+                          const BasicBlockVector &Blocks);
+    llvm::Instruction *UsePoint(llvm::Use &U);
+
+    void FormSubCFG(llvm::Function &F, unsigned Id,
+                    const BasicBlockVector &Blocks, llvm::BasicBlock *ExitBB);
+
+    bool CrossesBarrier(llvm::BasicBlock *Def, llvm::BasicBlock *Use);
+
+    // The barrier blocks starting a sub-CFG, in the order of their ids.
+    BasicBlockVector Barriers;
+    // The id of the sub-CFG started by each barrier block, ExitId for the
+    // barriers at the kernel exits.
+    std::map<llvm::BasicBlock *, int> BarrierIds;
+    // The first block of the work-item loops of each sub-CFG.
+    std::vector<llvm::BasicBlock *> SubCFGEntries;
+    // The blocks reachable from each barrier block (including itself).
+    std::map<llvm::BasicBlock *, std::set<llvm::BasicBlock *>> Reachable;
+    // The barrier blocks reachable from the end of each block.
+    std::map<llvm::BasicBlock *, std::set<llvm::BasicBlock *>> BarriersAfter;
+    std::vector<LiveValue> LiveValues;
+    // The context arrays of uniform values, which have a single slot, and
+    // the ones whose elements are wrapped in a padding struct.
+    std::set<llvm::AllocaInst *> UniformSlots;
+    std::set<llvm::AllocaInst *> PaddedContextArrays;
+  };
+}
+
+#endif
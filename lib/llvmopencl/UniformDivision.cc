@@ -0,0 +1,264 @@
+// LLVM function pass that strength reduces the divisions by work-group
+// uniform values in the work-item loops.
+//
+// Copyright (c) 2023 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <map>
+#include <vector>
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/KnownBits.h"
+
+#include "LLVMUtils.h"
+#include "UniformDivision.h"
+#include "VariableUniformityAnalysis.h"
+#include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
+#include "pocl_debug.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "uniform-div"
+
+STATISTIC(NumReduced, "Number of divisions by uniform values reduced");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::UniformDivision>
+    X("uniform-div", "Strength reduce the divisions by work-group uniform "
+                     "values in the work-item loops.");
+
+// The multiply-shift form of the unsigned division by a divisor, per
+// Granlund and Montgomery: n / d = (t + ((n - t) >> Shift1)) >> Shift2 with
+// t = mulhi(n, Multiplier). Sign is the sign mask of the original divisor
+// of a signed division.
+struct DivisionMagic {
+  Value *Divisor;
+  Value *Multiplier;
+  Value *Shift1;
+  Value *Shift2;
+  Value *Sign;
+};
+}
+
+char UniformDivision::ID = 0;
+
+UniformDivision::UniformDivision() : FunctionPass(ID) {}
+
+void UniformDivision::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<VariableUniformityAnalysis>();
+  AU.addPreserved<VariableUniformityAnalysis>();
+  AU.addRequired<WorkitemHandlerChooser>();
+  AU.addPreserved<WorkitemHandlerChooser>();
+  AU.setPreservesCFG();
+}
+
+static bool inWorkItemLoop(LoopInfo &LI, BasicBlock *BB) {
+  for (Loop *L = LI.getLoopFor(BB); L != nullptr; L = L->getParentLoop())
+    if (isWorkItemLoop(*L))
+      return true;
+  return false;
+}
+
+// Computes the magic numbers of the unsigned division by D, which must be
+// below 2^32 also for 64 bit divisions, at the builder position.
+static void computeMagic(IRBuilder<> &B, Value *D, DivisionMagic &Magic) {
+  Type *T = D->getType();
+  unsigned Bits = T->getIntegerBitWidth();
+  Module *M = B.GetInsertBlock()->getModule();
+
+  // The division by zero is undefined, but the magic is computed also
+  // where the division does not run.
+  Value *Safe =
+      B.CreateSelect(B.CreateICmpEQ(D, ConstantInt::get(T, 0)),
+                     ConstantInt::get(T, 1), D);
+  Function *Ctlz = Intrinsic::getDeclaration(M, Intrinsic::ctlz, {T});
+  // L = ceil(log2(d))
+  Value *L = B.CreateSub(
+      ConstantInt::get(T, Bits),
+      B.CreateCall(Ctlz, {B.CreateSub(Safe, ConstantInt::get(T, 1)),
+                          B.getFalse()}));
+
+  // Multiplier = 2^Bits * (2^L - d) / d + 1, where 2^L - d < d < 2^32.
+  Type *I64 = B.getInt64Ty();
+  Value *D64 = B.CreateZExt(Safe, I64);
+  Value *R =
+      B.CreateSub(B.CreateShl(ConstantInt::get(I64, 1), B.CreateZExt(L, I64)),
+                  D64);
+  Value *Multiplier;
+  if (Bits == 32) {
+    Multiplier = B.CreateTrunc(
+        B.CreateUDiv(B.CreateShl(R, 32), D64), T);
+  } else {
+    Value *A = B.CreateShl(R, 32);
+    Value *High = B.CreateUDiv(A, D64);
+    Value *Low = B.CreateUDiv(B.CreateShl(B.CreateURem(A, D64), 32), D64);
+    Multiplier = B.CreateOr(B.CreateShl(High, 32), Low);
+  }
+  Magic.Multiplier = B.CreateAdd(Multiplier, ConstantInt::get(T, 1));
+  Magic.Shift1 = B.CreateZExt(B.CreateICmpNE(L, ConstantInt::get(T, 0)), T);
+  Magic.Shift2 = B.CreateSub(L, Magic.Shift1);
+  Magic.Divisor = D;
+}
+
+// Emits the unsigned division of N by the divisor of Magic.
+static Value *emitDivision(IRBuilder<> &B, Value *N,
+                           const DivisionMagic &Magic) {
+  Type *T = N->getType();
+  unsigned Bits = T->getIntegerBitWidth();
+  Type *Wide = B.getIntNTy(2 * Bits);
+  Value *Product = B.CreateMul(B.CreateZExt(N, Wide),
+                               B.CreateZExt(Magic.Multiplier, Wide));
+  Value *High = B.CreateTrunc(B.CreateLShr(Product, Bits), T);
+  return B.CreateLShr(
+      B.CreateAdd(High, B.CreateLShr(B.CreateSub(N, High), Magic.Shift1)),
+      Magic.Shift2);
+}
+
+/* The index math of the kernels, e.g. the gid / width and gid % width of
+ * 2D indexing with the width from an argument, divides by work-group
+ * uniform values, which the backends can only strength reduce when they
+ * are constants. Compute the magic multiplier and shifts of such divisors
+ * once where they are defined, outside of the work-item loops, and replace
+ * the divisions in the loops with multiply-shift sequences. The signed
+ * divisions divide the absolute values. The 64 bit divisions are reduced
+ * only when the divisor is known to fit 32 bits, so that the magic
+ * computation needs no 128 bit division. */
+bool UniformDivision::runOnFunction(Function &F) {
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  if (getAnalysis<WorkitemHandlerChooser>().chosenHandler() !=
+      WorkitemHandlerChooser::POCL_WIH_LOOPS)
+    return false;
+
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  VariableUniformityAnalysis &VUA = getAnalysis<VariableUniformityAnalysis>();
+  const DataLayout &DL = F.getParent()->getDataLayout();
+
+  std::vector<BinaryOperator *> Divisions;
+  for (BasicBlock &BB : F) {
+    if (!inWorkItemLoop(LI, &BB))
+      continue;
+    for (Instruction &I : BB) {
+      BinaryOperator *Div = dyn_cast<BinaryOperator>(&I);
+      if (Div == nullptr)
+        continue;
+      Instruction::BinaryOps Op = Div->getOpcode();
+      if (Op != Instruction::UDiv && Op != Instruction::URem &&
+          Op != Instruction::SDiv && Op != Instruction::SRem)
+        continue;
+      Value *D = Div->getOperand(1);
+      if (!Div->getType()->isIntegerTy() || isa<Constant>(D) ||
+          !VUA.isUniform(&F, D))
+        continue;
+      unsigned Bits = Div->getType()->getIntegerBitWidth();
+      if (Bits != 32 && !(Bits == 64 && DL.isLegalInteger(64)))
+        continue;
+      Instruction *DI = dyn_cast<Instruction>(D);
+      if (DI != nullptr && inWorkItemLoop(LI, DI->getParent()))
+        continue;
+      bool Signed = Op == Instruction::SDiv || Op == Instruction::SRem;
+      if (Bits == 64 &&
+          (Signed ? ComputeNumSignBits(D, DL) <= 32
+                  : computeKnownBits(D, DL).countMinLeadingZeros() < 32))
+        continue;
+      Divisions.push_back(Div);
+    }
+  }
+
+  std::map<std::pair<Value *, bool>, DivisionMagic> Magics;
+  for (BinaryOperator *Div : Divisions) {
+    Value *D = Div->getOperand(1);
+    Instruction::BinaryOps Op = Div->getOpcode();
+    bool Signed = Op == Instruction::SDiv || Op == Instruction::SRem;
+    unsigned Bits = Div->getType()->getIntegerBitWidth();
+
+    auto MI = Magics.find(std::make_pair(D, Signed));
+    if (MI == Magics.end()) {
+      Instruction *DI = dyn_cast<Instruction>(D);
+      BasicBlock::iterator IP;
+      if (DI == nullptr)
+        IP = F.getEntryBlock().getFirstInsertionPt();
+      else if (isa<PHINode>(DI))
+        IP = DI->getParent()->getFirstInsertionPt();
+      else
+        IP = std::next(DI->getIterator());
+      IRBuilder<> B(&*IP);
+      DivisionMagic Magic;
+      Value *AbsD = D;
+      Magic.Sign = nullptr;
+      if (Signed) {
+        Magic.Sign = B.CreateAShr(D, Bits - 1);
+        AbsD = B.CreateSub(B.CreateXor(D, Magic.Sign), Magic.Sign);
+      }
+      computeMagic(B, AbsD, Magic);
+      MI = Magics.insert(std::make_pair(std::make_pair(D, Signed), Magic))
+               .first;
+    }
+    const DivisionMagic &Magic = MI->second;
+
+    IRBuilder<> B(Div);
+    Value *N = Div->getOperand(0);
+    Value *NSign = nullptr;
+    if (Signed) {
+      NSign = B.CreateAShr(N, Bits - 1);
+      N = B.CreateSub(B.CreateXor(N, NSign), NSign);
+    }
+    Value *Result = emitDivision(B, N, Magic);
+    if (Op == Instruction::URem || Op == Instruction::SRem)
+      Result = B.CreateSub(N, B.CreateMul(Result, Magic.Divisor));
+    if (Op == Instruction::SDiv) {
+      Value *Sign = B.CreateXor(NSign, Magic.Sign);
+      Result = B.CreateSub(B.CreateXor(Result, Sign), Sign);
+    } else if (Op == Instruction::SRem) {
+      Result = B.CreateSub(B.CreateXor(Result, NSign), NSign);
+    }
+
+    VUA.setUniform(&F, Result, VUA.isUniform(&F, Div));
+    Result->takeName(Div);
+    Div->replaceAllUsesWith(Result);
+    Div->eraseFromParent();
+    ++NumReduced;
+  }
+
+  if (!Divisions.empty())
+    POCL_MSG_PRINT_LLVM("Strength reduced %zu divisions by uniform values "
+                        "in the work-item loops of %s\n",
+                        Divisions.size(), F.getName().str().c_str());
+  return !Divisions.empty();
+}
+}
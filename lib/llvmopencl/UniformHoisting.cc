@@ -0,0 +1,184 @@
+// LLVM function pass that hoists the work-group uniform computations out
+// of the work-item loops.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+
+#include "LLVMUtils.h"
+#include "UniformHoisting.h"
+#include "VariableUniformityAnalysis.h"
+#include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
+#include "pocl_debug.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "hoist-uniform"
+
+STATISTIC(NumHoisted, "Number of uniform instructions hoisted");
+STATISTIC(NumHoistedLoads, "Number of uniform loads hoisted");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::UniformHoisting>
+    X("hoist-uniform",
+      "Hoist work-group uniform computations out of work-item loops.");
+}
+
+char UniformHoisting::ID = 0;
+
+UniformHoisting::UniformHoisting() : FunctionPass(ID) {}
+
+void UniformHoisting::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<DominatorTreeWrapperPass>();
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<VariableUniformityAnalysis>();
+  AU.addPreserved<VariableUniformityAnalysis>();
+  AU.addRequired<WorkitemHandlerChooser>();
+  AU.addPreserved<WorkitemHandlerChooser>();
+  AU.setPreservesCFG();
+}
+
+// Returns true if the memory Ptr points to cannot change during the
+// kernel execution: __constant buffers and constant globals, or
+// arguments the kernel only reads and no other pointer aliases.
+static bool isInvariantMemory(Function &F, Value *Ptr) {
+#ifndef LLVM_OLDER_THAN_12_0
+  Value *Obj = getUnderlyingObject(Ptr);
+#else
+  Value *Obj = GetUnderlyingObject(Ptr, F.getParent()->getDataLayout());
+#endif
+  if (GlobalVariable *GV = dyn_cast<GlobalVariable>(Obj))
+    return GV->isConstant();
+  if (Argument *Arg = dyn_cast<Argument>(Obj))
+    return isConstantMemFunctionArg(&F, Arg->getArgNo()) ||
+           (Arg->hasNoAliasAttr() && Arg->onlyReadsMemory());
+  return false;
+}
+
+// Checks if I, a uniform instruction of the work-item loop L, computes
+// the same value in all of its iterations and can be executed once
+// before the loop instead.
+static bool canHoist(Function &F, Loop &L, Instruction &I, DominatorTree &DT,
+                     VariableUniformityAnalysis &VUA) {
+  if (isa<PHINode>(I) || I.isTerminator() || isa<AllocaInst>(I) ||
+      isa<DbgInfoIntrinsic>(I) || I.mayHaveSideEffects())
+    return false;
+
+  for (Value *Op : I.operands()) {
+    Instruction *OpI = dyn_cast<Instruction>(Op);
+    if (OpI != nullptr && L.contains(OpI))
+      return false;
+  }
+
+  if (!VUA.isUniform(&F, &I))
+    return false;
+
+  // The work-item loops with a preheader run at least one iteration, so
+  // the instructions executed in every iteration are safe to move there.
+  bool AlwaysExecuted = DT.dominates(I.getParent(), L.getLoopLatch());
+
+  if (LoadInst *Load = dyn_cast<LoadInst>(&I)) {
+    if (!Load->isSimple() || !isInvariantMemory(F, Load->getPointerOperand()))
+      return false;
+    return AlwaysExecuted || isSafeToSpeculativelyExecute(Load);
+  }
+
+  if (I.mayReadFromMemory())
+    return false;
+
+  return AlwaysExecuted || isSafeToSpeculativelyExecute(&I);
+}
+
+static unsigned hoistFromLoop(Function &F, Loop &L, DominatorTree &DT,
+                              VariableUniformityAnalysis &VUA) {
+  unsigned Hoisted = 0;
+  // Hoist out of the inner loops first, the outer work-item loops then
+  // move the same instructions out further towards the region entry.
+  for (Loop *SubLoop : L)
+    Hoisted += hoistFromLoop(F, *SubLoop, DT, VUA);
+
+  if (!isWorkItemLoop(L))
+    return Hoisted;
+
+  BasicBlock *Preheader = L.getLoopPreheader();
+  if (Preheader == nullptr || L.getLoopLatch() == nullptr)
+    return Hoisted;
+
+  // Visit the blocks in dominance order so the operands of an instruction
+  // are hoisted before it.
+  for (DomTreeNode *Node : depth_first(DT.getNode(L.getHeader()))) {
+    BasicBlock *BB = Node->getBlock();
+    if (!L.contains(BB))
+      continue;
+    for (auto II = BB->begin(), IE = BB->end(); II != IE;) {
+      Instruction &I = *II++;
+      if (!canHoist(F, L, I, DT, VUA))
+        continue;
+      I.moveBefore(Preheader->getTerminator());
+      if (isa<LoadInst>(I))
+        ++NumHoistedLoads;
+      ++NumHoisted;
+      ++Hoisted;
+    }
+  }
+  return Hoisted;
+}
+
+bool UniformHoisting::runOnFunction(Function &F) {
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  if (getAnalysis<WorkitemHandlerChooser>().chosenHandler() !=
+      WorkitemHandlerChooser::POCL_WIH_LOOPS)
+    return false;
+
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  VariableUniformityAnalysis &VUA = getAnalysis<VariableUniformityAnalysis>();
+
+  unsigned Hoisted = 0;
+  for (Loop *L : LI)
+    Hoisted += hoistFromLoop(F, *L, DT, VUA);
+
+  if (Hoisted > 0)
+    POCL_MSG_PRINT_LLVM("Hoisted %u uniform instructions out of the "
+                        "work-item loops of %s\n",
+                        Hoisted, F.getName().str().c_str());
+  return Hoisted > 0;
+}
+}
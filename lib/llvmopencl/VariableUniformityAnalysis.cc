@@ -39,6 +39,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #include "WorkitemHandler.h"
 #include "Kernel.h"
+#include "LLVMUtils.h"
 #include "VariableUniformityAnalysis.h"
 #include "Barrier.h"
 #include "Workgroup.h"
@@ -394,6 +395,13 @@ VariableUniformityAnalysis::isUniform(llvm::Function *f, llvm::Value* v) {
       setUniform(f, v, true);
       return true;
     } 
+
+    // The lowered work-group collectives read their results after a
+    // barrier, see WorkgroupCollectives.cc.
+    if (load->getMetadata(POCL_WG_COLLECTIVE_RESULT_MD) != nullptr) {
+      setUniform(f, v, true);
+      return true;
+    }
   }
 
   if (isa<llvm::PHINode>(v)) {
@@ -22,6 +22,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <algorithm>
 #include <cstdio>
 #include <map>
 #include <iostream>
@@ -34,6 +35,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include "pocl_llvm_api.h"
 
 #include <llvm/Analysis/ConstantFolding.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/BasicBlock.h>
 #ifdef LLVM_OLDER_THAN_11_0
 #include <llvm/IR/CallSite.h>
@@ -47,6 +49,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/MDBuilder.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/raw_ostream.h>
@@ -106,6 +109,8 @@ namespace llvm {
         Elements.push_back(TypeBuilder<types::i<32> *, xcompile>::get(Context));
         Elements.push_back(TypeBuilder<types::i<32>, xcompile>::get(Context));
         Elements.push_back(TypeBuilder<types::i<32>, xcompile>::get(Context));
+        Elements.push_back(TypeBuilder<types::i<8> *, xcompile>::get(Context));
+        Elements.push_back(TypeBuilder<types::i<8> *, xcompile>::get(Context));
         return StructType::get(Context, Elements);
         }
       else if (size_t_width == 32)
@@ -124,6 +129,10 @@ namespace llvm {
           Elements.push_back(TypeBuilder<types::i<32>, xcompile>::get(Context));
           Elements.push_back(
             TypeBuilder<types::i<32>, xcompile>::get(Context));
+          Elements.push_back(
+              TypeBuilder<types::i<8> *, xcompile>::get(Context));
+          Elements.push_back(
+              TypeBuilder<types::i<8> *, xcompile>::get(Context));
 
           return StructType::get(Context, Elements);
         }
@@ -155,12 +164,27 @@ enum PoclContextStructFields {
   PC_PRINTF_BUFFER,
   PC_PRINTF_BUFFER_POSITION,
   PC_PRINTF_BUFFER_CAPACITY,
-  PC_WORK_DIM
+  PC_WORK_DIM,
+  PC_PREEMPT,
+  PC_DEVICE_ENQUEUE
 };
 
 char Workgroup::ID = 0;
 static RegisterPass<Workgroup> X("workgroup", "Workgroup creation pass");
 
+static cl::opt<std::string> GenericLocalSizeXVersions(
+    "wg-generic-local-size-x-versions", cl::init(""), cl::Hidden,
+    cl::desc("Comma separated local_size_x values for which the work-group "
+             "functions with a dynamic local size get a version with "
+             "constant work-item loop bounds in the x dimension, or 'auto' "
+             "for 1, 2, 4 and 8 times the native vector width."));
+
+static cl::opt<bool> WGNoAliasVersion(
+    "wg-noalias-version", cl::init(true), cl::Hidden,
+    cl::desc("Create launchers of a copy of the work-group function with "
+             "noalias pointer arguments, for the launches whose buffers "
+             "the runtime finds not to overlap."));
+
 bool
 Workgroup::runOnModule(Module &M) {
 
@@ -190,12 +214,20 @@ Workgroup::runOnModule(Module &M) {
   getModuleIntMetadata(M, "device_context_as_id", DeviceContextASid);
 
   getModuleBoolMetadata(M, "device_side_printf", DeviceSidePrintf);
+  DeviceBinaryPrintf = false;
+  getModuleBoolMetadata(M, "device_binary_printf", DeviceBinaryPrintf);
   getModuleBoolMetadata(M, "device_alloca_locals", DeviceAllocaLocals);
 
   getModuleIntMetadata(M, "device_max_witem_dim", DeviceMaxWItemDim);
   getModuleIntMetadata(M, "device_max_witem_sizes_0", DeviceMaxWItemSizes[0]);
   getModuleIntMetadata(M, "device_max_witem_sizes_1", DeviceMaxWItemSizes[1]);
   getModuleIntMetadata(M, "device_max_witem_sizes_2", DeviceMaxWItemSizes[2]);
+  DeviceNativeVectorWidthFloat = 0;
+  getModuleIntMetadata(M, "device_native_vector_width_float",
+                       DeviceNativeVectorWidthFloat);
+  DeviceSubGroupSize = 1;
+  getModuleIntMetadata(M, "device_sub_group_size", DeviceSubGroupSize);
+  DeviceSubGroupSize = std::max(DeviceSubGroupSize, 1ul);
 
   HiddenArgs = 0;
   SizeTWidth = address_bits;
@@ -225,7 +257,9 @@ Workgroup::runOnModule(Module &M) {
       PointerType::get(Int8T, 0), // PRINTF_BUFFER
       PointerType::get(Int32T, 0), // PRINTF_BUFFER_POSITION
       Int32T, // PRINTF_BUFFER_CAPACITY
-      Int32T); // WORK_DIM
+      Int32T, // WORK_DIM
+      PointerType::get(Int8T, 0), // PREEMPT
+      PointerType::get(Int8T, 0)); // DEVICE_ENQUEUE
 
   LauncherFuncT = FunctionType::get(
       Type::getVoidTy(*C),
@@ -261,8 +295,15 @@ Workgroup::runOnModule(Module &M) {
     if (!isKernelToProcess(OrigKernel)) continue;
     Function *L = createWrapper(&OrigKernel, printfCache);
 
+    std::vector<std::pair<unsigned long, Function *>> LocalSizeXVersions;
+    if (WGDynamicLocalSize && !DeviceIsSPMD)
+      LocalSizeXVersions = createLocalSizeXVersions(L);
+
     privatizeContext(L);
 
+    if (!LocalSizeXVersions.empty())
+      addLocalSizeXDispatch(L, LocalSizeXVersions);
+
     if (DeviceUsingArgBufferLauncher) {
       Function *WGLauncher =
         createArgBufferWorkgroupLauncher(L, OrigKernel.getName().str());
@@ -277,6 +318,15 @@ Workgroup::runOnModule(Module &M) {
       kernels[&OrigKernel] = L;
     } else {
       createDefaultWorkgroupLauncher(L);
+      createWorkgroupRangeLauncher(L);
+      Function *NoAliasL =
+          LocalSizeXVersions.empty() ? createNoAliasVersion(L) : nullptr;
+      if (NoAliasL != nullptr) {
+        createDefaultWorkgroupLauncher(
+            NoAliasL, L->getName().str() + "_workgroup_noalias");
+        createWorkgroupRangeLauncher(
+            NoAliasL, L->getName().str() + "_workgroup_range_noalias");
+      }
       // This is used only by TCE anymore. TODO: Replace all with the
       // ArgBuffer one.
       createFastWorkgroupLauncher(L);
@@ -461,7 +511,8 @@ static bool callsPrintf(Function *F) {
         continue;
       if (callee->getName().equals("printf"))
         return true;
-      if (callee->getName().equals("__pocl_printf"))
+      if (callee->getName().equals("__pocl_printf") ||
+          callee->getName().equals("__pocl_printf_binary"))
         return true;
       if (callsPrintf(callee))
         return true;
@@ -795,7 +846,8 @@ Workgroup::createWrapper(Function *F, FunctionMapping &printfCache) {
 #endif
 
   if (DeviceSidePrintf) {
-    Function *poclPrintf = M->getFunction("__pocl_printf");
+    Function *poclPrintf = M->getFunction(
+        DeviceBinaryPrintf ? "__pocl_printf_binary" : "__pocl_printf");
     replacePrintfCalls(pb, pbp, pbc, true, poclPrintf, *M, L, printfCache);
   }
 
@@ -871,8 +923,12 @@ Workgroup::privatizeGlobals(llvm::Function *F, llvm::IRBuilder<> &Builder,
   }
 }
 
+// Converts the accesses to the work-item and work-group id and size globals
+// in F to its private variables and hidden arguments. If LocalSizeX is
+// non-zero, the local size in the x dimension is assumed to be that
+// constant instead of the one in the context struct.
 void
-Workgroup::privatizeContext(Function *F)
+Workgroup::privatizeContext(Function *F, unsigned long LocalSizeX)
 {
   char TempStr[STRING_LENGTH];
   IRBuilder<> Builder(F->getEntryBlock().getFirstNonPHI());
@@ -930,7 +986,10 @@ Workgroup::privatizeContext(Function *F)
   if (WGDynamicLocalSize) {
     if (LocalSizeAllocas[0] != nullptr)
       Builder.CreateStore(
-        createLoadFromContext(Builder, PC_LOCAL_SIZE, 0),
+        LocalSizeX > 0
+          ? ConstantInt::get(LocalSizeAllocas[0]->getAllocatedType(),
+                             LocalSizeX)
+          : createLoadFromContext(Builder, PC_LOCAL_SIZE, 0),
         LocalSizeAllocas[0]);
 
     if (LocalSizeAllocas[1] != nullptr)
@@ -962,8 +1021,86 @@ Workgroup::privatizeContext(Function *F)
         LocalSizeAllocas[2]);
   }
 
+  // Privatize the work-group shared state of the lowered work-group
+  // collectives to allocas reset at the start of each work-group.
+  for (GlobalVariable &GV : M->globals()) {
+    if (!GV.getName().startswith(POCL_WG_COLLECTIVE_GLOBAL_PREFIX))
+      continue;
+    AllocaInst *State =
+      Builder.CreateAlloca(GV.getValueType(), 0, GV.getName());
+    Builder.CreateStore(GV.getInitializer(), State);
+    for (Function::iterator i = F->begin(), e = F->end(); i != e; ++i) {
+      for (BasicBlock::iterator ii = i->begin(), ee = i->end();
+           ii != ee; ++ii)
+        ii->replaceUsesOfWith(&GV, State);
+    }
+  }
+
+  // Privatize the scratch arrays of the lowered sub-group functions to
+  // arrays with an element per work-item. The padding of a sub-group keeps
+  // the vector loads of a partial last sub-group inside the array.
+  Value *ScratchElements = nullptr;
+  for (GlobalVariable &GV : M->globals()) {
+    if (!GV.getName().startswith(POCL_SUB_GROUP_SCRATCH_GLOBAL_PREFIX))
+      continue;
+    if (ScratchElements == nullptr) {
+      ScratchElements = ConstantInt::get(SizeT, DeviceSubGroupSize - 1);
+      Value *WGSize = ConstantInt::get(SizeT, 1);
+      for (AllocaInst *LocalSize : LocalSizeAllocas)
+        if (LocalSize != nullptr)
+          WGSize = Builder.CreateMul(
+              WGSize,
+              Builder.CreateLoad(LocalSize->getAllocatedType(), LocalSize));
+      ScratchElements = Builder.CreateAdd(WGSize, ScratchElements);
+    }
+    Type *ElementTy = cast<ArrayType>(GV.getValueType())->getElementType();
+    AllocaInst *Scratch =
+        Builder.CreateAlloca(ElementTy, ScratchElements, GV.getName());
+    Scratch->setAlignment(
+#ifndef LLVM_OLDER_THAN_10_0
+#ifndef LLVM_OLDER_THAN_11_0
+        llvm::Align(
+#else
+        llvm::MaybeAlign(
+#endif
+#endif
+            MAX_EXTENDED_ALIGNMENT
+#ifndef LLVM_OLDER_THAN_10_0
+            )
+#endif
+    );
+    Value *Array = Builder.CreateBitCast(Scratch, GV.getType());
+    for (Function::iterator i = F->begin(), e = F->end(); i != e; ++i) {
+      for (BasicBlock::iterator ii = i->begin(), ee = i->end();
+           ii != ee; ++ii)
+        ii->replaceUsesOfWith(&GV, Array);
+    }
+  }
+
+  // In the small grid specializations the group ids fit in a few bits.
+  // Narrowing them tells that to the optimizers, which can then prove that
+  // the global id arithmetic does not overflow the 32-bit ints the kernels
+  // often index with, fold the sign extensions of those back to size_t
+  // and strength reduce the address computations using them.
+  std::vector<Value *> GroupIds = GroupIdArgs;
+  if (WGMaxGridDimWidth > 0) {
+    uint64_t LocalSizes[] = {WGLocalSizeX, WGLocalSizeY, WGLocalSizeZ};
+    for (int i = 0; i < 3; ++i) {
+      uint64_t MaxGroups = WGMaxGridDimWidth;
+      if (!WGDynamicLocalSize && LocalSizes[i] > 0)
+        MaxGroups = (MaxGroups + LocalSizes[i] - 1) / LocalSizes[i];
+      unsigned Bits = Log2_64_Ceil(MaxGroups);
+      if (Bits == 0)
+        GroupIds[i] = ConstantInt::get(SizeT, 0);
+      else if (Bits < (unsigned)SizeTWidth)
+        GroupIds[i] = Builder.CreateZExt(
+          Builder.CreateTrunc(GroupIdArgs[i], IntegerType::get(*C, Bits)),
+          SizeT);
+    }
+  }
+
   privatizeGlobals(
-    F, Builder, {"_group_id_x", "_group_id_y", "_group_id_z"}, GroupIdArgs);
+    F, Builder, {"_group_id_x", "_group_id_y", "_group_id_z"}, GroupIds);
 
   if (WGAssumeZeroGlobalOffset) {
     privatizeGlobals(
@@ -991,6 +1128,18 @@ Workgroup::privatizeContext(Function *F)
       Builder, {"_num_groups_x", "_num_groups_y", "_num_groups_z"},
       PC_NUM_GROUPS));
 
+  // The preemption point polled by the loops, see WorkitemPreemption.cc.
+  privatizeGlobals(
+    F, Builder, {POCL_PREEMPT_GLOBAL},
+    globalHandlesToContextStructLoads(Builder, {POCL_PREEMPT_GLOBAL},
+                                      PC_PREEMPT));
+
+  // The device queue callbacks of the device-side enqueue functions.
+  privatizeGlobals(
+    F, Builder, {POCL_DEVICE_ENQUEUE_GLOBAL},
+    globalHandlesToContextStructLoads(Builder, {POCL_DEVICE_ENQUEUE_GLOBAL},
+                                      PC_DEVICE_ENQUEUE));
+
   if (DeviceSidePrintf) {
     // Privatize _printf_buffer
     privatizeGlobals(
@@ -1010,33 +1159,118 @@ Workgroup::privatizeContext(Function *F)
   }
 }
 
-// Creates a work group launcher function (called KERNELNAME_workgroup)
-// that assumes kernel pointer arguments are stored as pointers to the
-// actual buffers and that scalar data is loaded from the default memory.
-void
-Workgroup::createDefaultWorkgroupLauncher(llvm::Function *F) {
+// Creates copies of the dynamic local size work-group function F for the
+// local_size_x values listed in -wg-generic-local-size-x-versions. With a
+// constant trip count, the x work-item loops of the copies vectorize without
+// the run-time checks and scalar remainder iterations of the generic loops,
+// which dominate the run time of the small work-groups. Returns the copies
+// with their local_size_x values.
+std::vector<std::pair<unsigned long, Function *>>
+Workgroup::createLocalSizeXVersions(Function *F) {
+
+  std::vector<std::pair<unsigned long, Function *>> Versions;
+  if (GenericLocalSizeXVersions.empty() ||
+      M->getGlobalVariable("_local_size_x") == nullptr ||
+      F->hasFnAttribute(Attribute::OptimizeNone))
+    return Versions;
+
+  std::vector<unsigned long> LocalSizes;
+  if (GenericLocalSizeXVersions == "auto") {
+    if (DeviceNativeVectorWidthFloat > 1)
+      for (unsigned long i = 1; i <= 8; i *= 2)
+        LocalSizes.push_back(DeviceNativeVectorWidthFloat * i);
+  } else {
+    std::stringstream SS(GenericLocalSizeXVersions);
+    std::string Item;
+    while (std::getline(SS, Item, ',')) {
+      unsigned long LocalSize = strtoul(Item.c_str(), nullptr, 10);
+      if (LocalSize > 1 &&
+          std::find(LocalSizes.begin(), LocalSizes.end(), LocalSize) ==
+              LocalSizes.end())
+        LocalSizes.push_back(LocalSize);
+    }
+  }
 
-  IRBuilder<> Builder(M->getContext());
+  for (unsigned long LocalSize : LocalSizes) {
+    if (DeviceMaxWItemSizes[0] > 0 && LocalSize > DeviceMaxWItemSizes[0])
+      continue;
 
-  std::string FuncName = "";
-  FuncName = F->getName().str();
+    ValueToValueMapTy VMap;
+    Function *V = CloneFunction(F, VMap);
+    V->setName(F->getName() + "_local_size_x_" + Twine(LocalSize));
+    V->setLinkage(Function::InternalLinkage);
+    V->removeFnAttr(Attribute::NoInline);
+    V->addFnAttr(Attribute::AlwaysInline);
 
-#ifdef LLVM_OLDER_THAN_9_0
-  Function *WorkGroup =
-    dyn_cast<Function>(M->getOrInsertFunction(
-                         FuncName + "_workgroup", LauncherFuncT));
-#else
-  FunctionCallee fc = M->getOrInsertFunction(FuncName + "_workgroup", LauncherFuncT);
-  Function *WorkGroup = dyn_cast<Function>(fc.getCallee());
-#endif
+    // Privatize the clone against its own hidden arguments.
+    Argument *OrigContextArg = ContextArg;
+    std::vector<Value *> OrigGroupIdArgs = GroupIdArgs;
+    ContextArg = cast<Argument>(VMap[ContextArg]);
+    for (Value *&GroupIdArg : GroupIdArgs)
+      GroupIdArg = VMap[GroupIdArg];
 
-  assert(WorkGroup != nullptr);
-  BasicBlock *Block = BasicBlock::Create(M->getContext(), "", WorkGroup);
-  Builder.SetInsertPoint(Block);
+    privatizeContext(V, LocalSize);
 
-  Function::arg_iterator ai = WorkGroup->arg_begin();
+    ContextArg = OrigContextArg;
+    GroupIdArgs = OrigGroupIdArgs;
+
+    Versions.push_back(std::make_pair(LocalSize, V));
+  }
+  return Versions;
+}
+
+// Makes the work-group function F branch to the version matching the
+// run-time local_size_x, if there is one, before its generic code.
+void Workgroup::addLocalSizeXDispatch(
+    Function *F,
+    const std::vector<std::pair<unsigned long, Function *>> &Versions) {
+
+  BasicBlock *Entry = &F->getEntryBlock();
+  BasicBlock::iterator SplitPoint = Entry->begin();
+  while (isa<AllocaInst>(&*SplitPoint))
+    ++SplitPoint;
+  BasicBlock *Generic =
+    Entry->splitBasicBlock(SplitPoint, "generic_local_size");
+  Entry->getTerminator()->eraseFromParent();
+
+  IRBuilder<> Builder(Entry);
+  // Calls to inlinable functions need a location in functions with
+  // debug info.
+  if (F->getSubprogram() != nullptr)
+    Builder.SetCurrentDebugLocation(
+      DILocation::get(*C, 0, 0, F->getSubprogram()));
+
+  Value *LocalSizeX = createLoadFromContext(Builder, PC_LOCAL_SIZE, 0);
+  SwitchInst *Switch =
+    Builder.CreateSwitch(LocalSizeX, Generic, Versions.size());
 
   SmallVector<Value *, 8> Arguments;
+  for (Argument &Arg : F->args())
+    Arguments.push_back(&Arg);
+
+  for (auto &Version : Versions) {
+    BasicBlock *BB = BasicBlock::Create(
+      *C, "local_size_x_" + Twine(Version.first), F, Generic);
+    Builder.SetInsertPoint(BB);
+    Builder.CreateCall(Version.second, Arguments);
+    Builder.CreateRetVoid();
+    Switch->addCase(
+      cast<ConstantInt>(ConstantInt::get(LocalSizeX->getType(),
+                                         Version.first)),
+      BB);
+  }
+}
+
+// Loads the kernel arguments of F from the argument pointer array, the
+// first argument of the launcher function, at the insert point of Builder.
+void
+Workgroup::loadLauncherArguments(llvm::Function *F, llvm::Function *Launcher,
+                                 IRBuilder<> &Builder,
+                                 SmallVectorImpl<Value *> &Arguments) {
+
+  BasicBlock *Block = Builder.GetInsertBlock();
+  Function::arg_iterator ai = Launcher->arg_begin();
+
   size_t i = 0;
   for (Function::const_arg_iterator ii = F->arg_begin(), ee = F->arg_end();
        ii != ee; ++ii) {
@@ -1116,7 +1350,36 @@ Workgroup::createDefaultWorkgroupLauncher(llvm::Function *F) {
     Arguments.push_back(Arg);
     ++i;
   }
+}
+
+// Creates a work group launcher function (called KERNELNAME_workgroup)
+// that assumes kernel pointer arguments are stored as pointers to the
+// actual buffers and that scalar data is loaded from the default memory.
+void
+Workgroup::createDefaultWorkgroupLauncher(llvm::Function *F,
+                                          std::string LauncherName) {
+
+  IRBuilder<> Builder(M->getContext());
+
+  if (LauncherName.empty())
+    LauncherName = F->getName().str() + "_workgroup";
+
+#ifdef LLVM_OLDER_THAN_9_0
+  Function *WorkGroup =
+    dyn_cast<Function>(M->getOrInsertFunction(LauncherName, LauncherFuncT));
+#else
+  FunctionCallee fc = M->getOrInsertFunction(LauncherName, LauncherFuncT);
+  Function *WorkGroup = dyn_cast<Function>(fc.getCallee());
+#endif
+
+  assert(WorkGroup != nullptr);
+  BasicBlock *Block = BasicBlock::Create(M->getContext(), "", WorkGroup);
+  Builder.SetInsertPoint(Block);
+
+  SmallVector<Value *, 8> Arguments;
+  loadLauncherArguments(F, WorkGroup, Builder, Arguments);
 
+  Function::arg_iterator ai = WorkGroup->arg_begin();
   ++ai;
   Arguments.push_back(&*ai);
   ++ai;
@@ -1130,6 +1393,141 @@ Workgroup::createDefaultWorkgroupLauncher(llvm::Function *F) {
   Builder.CreateRetVoid();
 }
 
+// Returns the object the pointer P is derived from.
+static Value *underlyingObject(Value *P, const DataLayout &DL) {
+#ifndef LLVM_OLDER_THAN_12_0
+  return getUnderlyingObject(P);
+#else
+  return GetUnderlyingObject(P, DL);
+#endif
+}
+
+// Creates a copy of the work-group function F with its pointer arguments
+// marked noalias, for the launchers that the runtime calls when the buffers
+// of a launch do not overlap. Returns nullptr if the copy is not worth it,
+// because fewer than two of the arguments may alias or none of them is
+// written through, or not safe, because the kernel forms pointers from
+// integers or loads them from buffers: the runtime checks only the pointers
+// passed as arguments.
+Function *Workgroup::createNoAliasVersion(Function *F) {
+
+  if (!WGNoAliasVersion || F->hasFnAttribute(Attribute::OptimizeNone))
+    return nullptr;
+
+  const DataLayout &DL = M->getDataLayout();
+  SmallPtrSet<Value *, 8> MayAlias;
+  Function::arg_iterator ai = F->arg_begin();
+  for (size_t i = 0; i + 4 < F->arg_size(); ++i, ++ai) {
+    if (ai->getType()->isPointerTy() && !ai->hasByValAttr() &&
+        !ai->hasNoAliasAttr())
+      MayAlias.insert(&*ai);
+  }
+  if (MayAlias.size() < 2)
+    return nullptr;
+
+  bool WrittenThrough = false;
+  for (BasicBlock &BB : *F) {
+    for (Instruction &I : BB) {
+      Value *Written = nullptr;
+      if (isa<IntToPtrInst>(&I))
+        return nullptr;
+      if (LoadInst *Load = dyn_cast<LoadInst>(&I)) {
+        // The context arrays and the context struct hold pointers too.
+        Value *Obj = underlyingObject(Load->getPointerOperand(), DL);
+        if (Load->getType()->isPtrOrPtrVectorTy() && !isa<AllocaInst>(Obj) &&
+            Obj != ContextArg)
+          return nullptr;
+      } else if (StoreInst *Store = dyn_cast<StoreInst>(&I))
+        Written = Store->getPointerOperand();
+      else if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I))
+        Written = RMW->getPointerOperand();
+      else if (AtomicCmpXchgInst *CmpXchg = dyn_cast<AtomicCmpXchgInst>(&I))
+        Written = CmpXchg->getPointerOperand();
+      else if (MemIntrinsic *MemI = dyn_cast<MemIntrinsic>(&I))
+        Written = MemI->getRawDest();
+      if (Written != nullptr) {
+        Value *Obj = underlyingObject(Written, DL);
+        if (!isa<AllocaInst>(Obj) && !isa<GlobalVariable>(Obj))
+          WrittenThrough = true;
+      }
+    }
+  }
+  if (!WrittenThrough)
+    return nullptr;
+
+  ValueToValueMapTy VMap;
+  Function *V = CloneFunction(F, VMap);
+  V->setName(F->getName() + "_noalias");
+  V->setLinkage(Function::InternalLinkage);
+  for (Value *Arg : MayAlias)
+    cast<Argument>(VMap[Arg])->addAttr(Attribute::NoAlias);
+  return V;
+}
+
+// Creates a launcher (called KERNELNAME_workgroup_range) that runs the
+// work-groups from group_x_start up to, but not including, group_x_end of
+// one row of the grid. It takes the arguments like the default launcher,
+// but loads them only once for the whole row, and the loop around the
+// kernel lets the optimizer hoist the per-WG invariant work out of it.
+void
+Workgroup::createWorkgroupRangeLauncher(llvm::Function *F,
+                                        std::string LauncherName) {
+
+  IRBuilder<> Builder(M->getContext());
+
+  if (LauncherName.empty())
+    LauncherName = F->getName().str() + "_workgroup_range";
+
+  SmallVector<Type *, 6> Params(LauncherFuncT->param_begin(),
+                                LauncherFuncT->param_end());
+  Params.insert(Params.begin() + 3, SizeT);
+  FunctionType *RangeFuncT =
+      FunctionType::get(Type::getVoidTy(*C), Params, false);
+
+#ifdef LLVM_OLDER_THAN_9_0
+  Function *RangeLauncher =
+    dyn_cast<Function>(M->getOrInsertFunction(LauncherName, RangeFuncT));
+#else
+  FunctionCallee fc = M->getOrInsertFunction(LauncherName, RangeFuncT);
+  Function *RangeLauncher = dyn_cast<Function>(fc.getCallee());
+#endif
+
+  assert(RangeLauncher != nullptr);
+  BasicBlock *Entry = BasicBlock::Create(*C, "", RangeLauncher);
+  BasicBlock *Loop = BasicBlock::Create(*C, "wg.range.loop", RangeLauncher);
+  BasicBlock *Exit = BasicBlock::Create(*C, "wg.range.exit", RangeLauncher);
+  Builder.SetInsertPoint(Entry);
+
+  SmallVector<Value *, 8> Arguments;
+  loadLauncherArguments(F, RangeLauncher, Builder, Arguments);
+
+  Function::arg_iterator ai = RangeLauncher->arg_begin();
+  Value *Context = &*(++ai);
+  Value *GroupXStart = &*(++ai);
+  Value *GroupXEnd = &*(++ai);
+  Value *GroupY = &*(++ai);
+  Value *GroupZ = &*(++ai);
+
+  Builder.CreateCondBr(Builder.CreateICmpULT(GroupXStart, GroupXEnd), Loop,
+                       Exit);
+
+  Builder.SetInsertPoint(Loop);
+  PHINode *GroupX = Builder.CreatePHI(SizeT, 2, "group_x");
+  GroupX->addIncoming(GroupXStart, Entry);
+  Arguments.push_back(Context);
+  Arguments.push_back(GroupX);
+  Arguments.push_back(GroupY);
+  Arguments.push_back(GroupZ);
+  Builder.CreateCall(F, ArrayRef<Value *>(Arguments));
+  Value *NextGroupX = Builder.CreateAdd(GroupX, ConstantInt::get(SizeT, 1));
+  GroupX->addIncoming(NextGroupX, Loop);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextGroupX, GroupXEnd), Loop,
+                       Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+}
+
 static inline uint64_t
 align64(uint64_t value, unsigned alignment)
 {
@@ -53,7 +53,14 @@ namespace pocl {
       createArgBufferWorkgroupLauncher(llvm::Function *Func,
                                        std::string KernName);
 
-    void createDefaultWorkgroupLauncher(llvm::Function *F);
+    void loadLauncherArguments(llvm::Function *F, llvm::Function *Launcher,
+                               llvm::IRBuilder<> &Builder,
+                               llvm::SmallVectorImpl<llvm::Value *> &Arguments);
+    void createDefaultWorkgroupLauncher(llvm::Function *F,
+                                        std::string LauncherName = "");
+    void createWorkgroupRangeLauncher(llvm::Function *F,
+                                      std::string LauncherName = "");
+    llvm::Function *createNoAliasVersion(llvm::Function *F);
     void createFastWorkgroupLauncher(llvm::Function *F);
 
     std::vector<llvm::Value*>
@@ -69,7 +76,13 @@ namespace pocl {
                           const std::vector<std::string> &&GlobalHandleNames,
                           std::vector<llvm::Value*> PrivateValues);
 
-    void privatizeContext(llvm::Function *F);
+    void privatizeContext(llvm::Function *F, unsigned long LocalSizeX = 0);
+
+    std::vector<std::pair<unsigned long, llvm::Function *>>
+      createLocalSizeXVersions(llvm::Function *F);
+    void addLocalSizeXDispatch(
+      llvm::Function *F,
+      const std::vector<std::pair<unsigned long, llvm::Function *>> &Versions);
 
     llvm::Value *createLoadFromContext(
       llvm::IRBuilder<> &Builder, int StructFieldIndex, int FieldIndex);
@@ -127,9 +140,12 @@ namespace pocl {
     unsigned long DeviceContextASid;
     unsigned long DeviceArgsASid;
     bool DeviceSidePrintf;
+    bool DeviceBinaryPrintf;
     bool DeviceAllocaLocals;
     unsigned long DeviceMaxWItemDim;
     unsigned long DeviceMaxWItemSizes[3];
+    unsigned long DeviceNativeVectorWidthFloat;
+    unsigned long DeviceSubGroupSize;
   };
 }
 
@@ -0,0 +1,375 @@
+// LLVM function pass that lowers the atomic operations the work-items of a
+// work-group cannot race on to plain memory accesses.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "LLVMUtils.h"
+#include "Workgroup.h"
+#include "WorkgroupAtomics.h"
+#include "pocl_debug.h"
+#include "pocl_llvm_api.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "workgroup-atomics"
+
+STATISTIC(NumDemoted, "Number of local atomics demoted to plain accesses");
+STATISTIC(NumPrivatized, "Number of global atomics privatized");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::WorkgroupAtomics>
+    X("workgroup-atomics",
+      "Lower the atomics the work-items of a work-group cannot race on.");
+}
+
+static cl::opt<bool> PrivatizeGlobalAtomics(
+    "privatize-global-atomics", cl::init(true), cl::Hidden,
+    cl::desc("Accumulate the global atomics to a fixed address in the "
+             "work-group function and update the memory once."));
+
+char WorkgroupAtomics::ID = 0;
+
+WorkgroupAtomics::WorkgroupAtomics() : FunctionPass(ID) {}
+
+void WorkgroupAtomics::getAnalysisUsage(AnalysisUsage &AU) const {}
+
+static const Value *getUnderlyingObj(const Value *Ptr, const Module &M) {
+#ifndef LLVM_OLDER_THAN_12_0
+  return getUnderlyingObject(Ptr);
+#else
+  return GetUnderlyingObject(Ptr, M.getDataLayout());
+#endif
+}
+
+// Checks if the memory at Ptr is only accessed by the work-items of one
+// work-group, one after another: the local buffers are allocated per
+// work-group and allocas are private to the work-group function.
+static bool isWorkgroupMemory(Function &F, const Value *Ptr) {
+  const Value *Obj = getUnderlyingObj(Ptr, *F.getParent());
+  if (isa<AllocaInst>(Obj))
+    return true;
+  const Argument *Arg = dyn_cast<Argument>(Obj);
+  return Arg != nullptr && Arg->getParent() == &F &&
+         isLocalMemFunctionArg(&F, Arg->getArgNo());
+}
+
+// Computes the value an atomicrmw stores from the Old memory value, or
+// returns nullptr for an unknown operation.
+static Value *applyRMW(IRBuilder<> &Builder, AtomicRMWInst::BinOp Op,
+                       Value *Old, Value *Val) {
+  switch (Op) {
+  case AtomicRMWInst::Xchg:
+    return Val;
+  case AtomicRMWInst::Add:
+    return Builder.CreateAdd(Old, Val);
+  case AtomicRMWInst::Sub:
+    return Builder.CreateSub(Old, Val);
+  case AtomicRMWInst::And:
+    return Builder.CreateAnd(Old, Val);
+  case AtomicRMWInst::Nand:
+    return Builder.CreateNot(Builder.CreateAnd(Old, Val));
+  case AtomicRMWInst::Or:
+    return Builder.CreateOr(Old, Val);
+  case AtomicRMWInst::Xor:
+    return Builder.CreateXor(Old, Val);
+  case AtomicRMWInst::Max:
+    return Builder.CreateSelect(Builder.CreateICmpSGT(Old, Val), Old, Val);
+  case AtomicRMWInst::Min:
+    return Builder.CreateSelect(Builder.CreateICmpSLT(Old, Val), Old, Val);
+  case AtomicRMWInst::UMax:
+    return Builder.CreateSelect(Builder.CreateICmpUGT(Old, Val), Old, Val);
+  case AtomicRMWInst::UMin:
+    return Builder.CreateSelect(Builder.CreateICmpULT(Old, Val), Old, Val);
+#ifndef LLVM_OLDER_THAN_9_0
+  case AtomicRMWInst::FAdd:
+    return Builder.CreateFAdd(Old, Val);
+  case AtomicRMWInst::FSub:
+    return Builder.CreateFSub(Old, Val);
+#endif
+  default:
+    return nullptr;
+  }
+}
+
+// Replaces an atomic access to work-group memory with plain accesses. The
+// work-items of a work-group run one after another in the same thread, so
+// nothing can access the memory between the load and the store.
+static bool demote(Instruction *I) {
+  IRBuilder<> Builder(I);
+  if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(I)) {
+    Value *Ptr = RMW->getPointerOperand();
+    Type *Ty = RMW->getValOperand()->getType();
+    LoadInst *Old = Builder.CreateLoad(Ty, Ptr);
+    Value *New = applyRMW(Builder, RMW->getOperation(), Old,
+                          RMW->getValOperand());
+    if (New == nullptr) {
+      Old->eraseFromParent();
+      return false;
+    }
+    Old->setVolatile(RMW->isVolatile());
+    Builder.CreateStore(New, Ptr, RMW->isVolatile());
+    RMW->replaceAllUsesWith(Old);
+  } else if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(I)) {
+    Value *Ptr = CX->getPointerOperand();
+    LoadInst *Old = Builder.CreateLoad(CX->getCompareOperand()->getType(), Ptr,
+                                       CX->isVolatile());
+    Value *Success = Builder.CreateICmpEQ(Old, CX->getCompareOperand());
+    Builder.CreateStore(Builder.CreateSelect(Success, CX->getNewValOperand(),
+                                             Old),
+                        Ptr, CX->isVolatile());
+    Value *Result = Builder.CreateInsertValue(UndefValue::get(CX->getType()),
+                                              Old, 0);
+    CX->replaceAllUsesWith(Builder.CreateInsertValue(Result, Success, 1));
+  } else if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+    LI->setAtomic(AtomicOrdering::NotAtomic);
+    return true;
+  } else if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+    SI->setAtomic(AtomicOrdering::NotAtomic);
+    return true;
+  }
+  I->eraseFromParent();
+  return true;
+}
+
+// The value that does not change the memory when an atomicrmw Op of it
+// is applied, or nullptr if the operation cannot be privatized.
+static Constant *getIdentity(AtomicRMWInst::BinOp Op, Type *Ty) {
+  if (!Ty->isIntegerTy())
+    return nullptr;
+  unsigned Bits = Ty->getIntegerBitWidth();
+  switch (Op) {
+  case AtomicRMWInst::Add:
+  case AtomicRMWInst::Sub:
+  case AtomicRMWInst::Or:
+  case AtomicRMWInst::Xor:
+  case AtomicRMWInst::UMax:
+    return Constant::getNullValue(Ty);
+  case AtomicRMWInst::And:
+  case AtomicRMWInst::UMin:
+    return Constant::getAllOnesValue(Ty);
+  case AtomicRMWInst::Max:
+    return ConstantInt::get(Ty->getContext(), APInt::getSignedMinValue(Bits));
+  case AtomicRMWInst::Min:
+    return ConstantInt::get(Ty->getContext(), APInt::getSignedMaxValue(Bits));
+  default:
+    return nullptr;
+  }
+}
+
+namespace {
+// The privatized atomics updating one global memory location with one
+// operation.
+struct PrivateAtomic {
+  Argument *Buffer;
+  int64_t Offset;
+  AtomicRMWInst::BinOp Op;
+  Type *Ty;
+  AtomicOrdering Ordering;
+  std::vector<AtomicRMWInst *> Updates;
+};
+}
+
+// Privatizes the global atomicrmws to a fixed offset of a buffer argument
+// whose result is unused, e.g. the counters the kernels update with
+// atomic_add or atomic_inc. The work-group function accumulates their
+// values to a register, which the loop vectorizer can turn to a vector
+// reduction, and applies the accumulated value to the memory with one
+// atomic at the end of the work-group. Other work-groups observe the
+// updates of the work-group later, but all at once, which is allowed as
+// long as nothing orders other memory accesses against the updates. Thus
+// the kernel must not have fences, compare-exchanges or atomic loads and
+// stores, and the buffer must not be accessed otherwise.
+static unsigned privatizeGlobalAtomics(Function &F) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  std::map<std::tuple<Argument *, int64_t, unsigned>, PrivateAtomic> Atomics;
+  std::set<const Value *> Disqualified;
+
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      if (isa<FenceInst>(I) || isa<AtomicCmpXchgInst>(I) ||
+          (isa<LoadInst>(I) && cast<LoadInst>(I).isAtomic()) ||
+          (isa<StoreInst>(I) && cast<StoreInst>(I).isAtomic()))
+        return 0;
+
+      AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I);
+      if (RMW != nullptr) {
+        Type *Ty = RMW->getValOperand()->getType();
+        Value *Ptr = RMW->getPointerOperand();
+        APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+        Argument *Buffer = dyn_cast<Argument>(
+            Ptr->stripAndAccumulateInBoundsConstantOffsets(DL, Offset));
+        if (Buffer == nullptr || !RMW->use_empty() || RMW->isVolatile() ||
+            getIdentity(RMW->getOperation(), Ty) == nullptr) {
+          Disqualified.insert(getUnderlyingObj(Ptr, *F.getParent()));
+          continue;
+        }
+        PrivateAtomic &A = Atomics[std::make_tuple(
+            Buffer, Offset.getSExtValue(), (unsigned)RMW->getOperation())];
+        if (!A.Updates.empty() && A.Ty != Ty)
+          Disqualified.insert(Buffer);
+        A.Buffer = Buffer;
+        A.Offset = Offset.getSExtValue();
+        A.Op = RMW->getOperation();
+        A.Ty = Ty;
+        A.Ordering = RMW->getOrdering();
+        A.Updates.push_back(RMW);
+        continue;
+      }
+
+      // Any other access to a privatized buffer disqualifies it.
+      const Value *Ptr = nullptr;
+      if (LoadInst *LI = dyn_cast<LoadInst>(&I))
+        Ptr = LI->getPointerOperand();
+      else if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+        Ptr = SI->getPointerOperand();
+        if (SI->getValueOperand()->getType()->isPointerTy())
+          Disqualified.insert(
+              getUnderlyingObj(SI->getValueOperand(), *F.getParent()));
+      } else if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+        for (Value *Arg : CI->args())
+          if (Arg->getType()->isPointerTy())
+            Disqualified.insert(getUnderlyingObj(Arg, *F.getParent()));
+      }
+      if (Ptr != nullptr)
+        Disqualified.insert(getUnderlyingObj(Ptr, *F.getParent()));
+    }
+  }
+
+  // Different operations on the same element do not commute, so only one
+  // of them can be privatized. The elements must not overlap either.
+  std::map<const Argument *, Type *> BufferTypes;
+  std::map<std::pair<const Argument *, int64_t>, unsigned> ElementOps;
+  for (auto &Entry : Atomics) {
+    PrivateAtomic &A = Entry.second;
+    if (BufferTypes.insert(std::make_pair(A.Buffer, A.Ty)).first->second !=
+            A.Ty ||
+        !ElementOps.insert(std::make_pair(std::make_pair(A.Buffer, A.Offset),
+                                          (unsigned)A.Op))
+             .second ||
+        A.Offset % DL.getTypeStoreSize(A.Ty) != 0)
+      Disqualified.insert(A.Buffer);
+  }
+
+  unsigned Privatized = 0;
+  IRBuilder<> EntryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+  for (auto &Entry : Atomics) {
+    PrivateAtomic &A = Entry.second;
+    if (Disqualified.count(A.Buffer))
+      continue;
+    // The subtractions are accumulated as additions.
+    AtomicRMWInst::BinOp AccOp =
+        A.Op == AtomicRMWInst::Sub ? AtomicRMWInst::Add : A.Op;
+    Constant *Identity = getIdentity(A.Op, A.Ty);
+    AllocaInst *Acc = EntryBuilder.CreateAlloca(A.Ty, nullptr,
+                                                "_pocl_private_atomic");
+    EntryBuilder.CreateStore(Identity, Acc);
+
+    for (AtomicRMWInst *RMW : A.Updates) {
+      IRBuilder<> Builder(RMW);
+      Builder.CreateStore(applyRMW(Builder, AccOp,
+                                   Builder.CreateLoad(A.Ty, Acc),
+                                   RMW->getValOperand()),
+                          Acc);
+      RMW->eraseFromParent();
+      ++Privatized;
+    }
+
+    for (BasicBlock &BB : F) {
+      ReturnInst *Ret = dyn_cast<ReturnInst>(BB.getTerminator());
+      if (Ret == nullptr)
+        continue;
+      IRBuilder<> Builder(Ret);
+      Type *BufferTy = A.Buffer->getType();
+      Value *Ptr = Builder.CreateBitCast(
+          Builder.CreateConstInBoundsGEP1_64(
+              Builder.getInt8Ty(),
+              Builder.CreateBitCast(
+                  A.Buffer, Builder.getInt8PtrTy(
+                                BufferTy->getPointerAddressSpace())),
+              A.Offset),
+          PointerType::get(A.Ty, BufferTy->getPointerAddressSpace()));
+      Builder.CreateAtomicRMW(A.Op, Ptr, Builder.CreateLoad(A.Ty, Acc),
+#ifndef LLVM_OLDER_THAN_13_0
+                              MaybeAlign(),
+#endif
+                              A.Ordering);
+    }
+  }
+  return Privatized;
+}
+
+bool WorkgroupAtomics::runOnFunction(Function &F) {
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  std::vector<Instruction *> WorkgroupAtomics;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      const Value *Ptr = nullptr;
+      if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I))
+        Ptr = RMW->getPointerOperand();
+      else if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(&I))
+        Ptr = CX->getPointerOperand();
+      else if (LoadInst *LI = dyn_cast<LoadInst>(&I))
+        Ptr = LI->isAtomic() ? LI->getPointerOperand() : nullptr;
+      else if (StoreInst *SI = dyn_cast<StoreInst>(&I))
+        Ptr = SI->isAtomic() ? SI->getPointerOperand() : nullptr;
+      if (Ptr != nullptr && isWorkgroupMemory(F, Ptr))
+        WorkgroupAtomics.push_back(&I);
+    }
+
+  unsigned Demoted = 0;
+  for (Instruction *I : WorkgroupAtomics)
+    Demoted += demote(I);
+  NumDemoted += Demoted;
+
+  unsigned Privatized = PrivatizeGlobalAtomics ? privatizeGlobalAtomics(F) : 0;
+  NumPrivatized += Privatized;
+
+  if (Demoted > 0 || Privatized > 0)
+    POCL_MSG_PRINT_LLVM("Demoted %u local and privatized %u global atomics "
+                        "of %s\n",
+                        Demoted, Privatized, F.getName().str().c_str());
+  return Demoted > 0 || Privatized > 0;
+}
+}
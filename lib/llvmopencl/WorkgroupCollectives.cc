@@ -0,0 +1,522 @@
+// LLVM function pass that lowers the OpenCL work-group collective and
+// sub-group functions to work-item loop code.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <algorithm>
+#include <vector>
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "Barrier.h"
+#include "LLVMUtils.h"
+#include "ParallelRegion.h"
+#include "Workgroup.h"
+#include "WorkgroupCollectives.h"
+#include "pocl_debug.h"
+#include "pocl_llvm_api.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "workgroup-collectives"
+
+STATISTIC(NumCollectives, "Number of work-group collectives lowered");
+STATISTIC(NumSubGroupFunctions, "Number of sub-group function calls lowered");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::WorkgroupCollectives>
+    X("workgroup-collectives",
+      "Lower the work-group collective and sub-group functions to "
+      "work-item loop code.");
+
+enum CollectiveOp { WG_OP_ADD, WG_OP_MIN, WG_OP_MAX, WG_OP_ALL, WG_OP_ANY };
+
+const char *LocalIdGlobals[] = {POCL_LOCAL_ID_X_GLOBAL, POCL_LOCAL_ID_Y_GLOBAL,
+                                POCL_LOCAL_ID_Z_GLOBAL};
+const char *LocalSizeGlobals[] = {"_local_size_x", "_local_size_y",
+                                  "_local_size_z"};
+}
+
+char WorkgroupCollectives::ID = 0;
+
+WorkgroupCollectives::WorkgroupCollectives() : FunctionPass(ID) {}
+
+void WorkgroupCollectives::getAnalysisUsage(AnalysisUsage &AU) const {}
+
+// The value that does not change the result when combined with Op.
+static Constant *getIdentity(CollectiveOp Op, Type *Ty, bool Unsigned) {
+  switch (Op) {
+  case WG_OP_ADD:
+  case WG_OP_ANY:
+    return Constant::getNullValue(Ty);
+  case WG_OP_ALL:
+    return ConstantInt::get(Ty, 1);
+  case WG_OP_MIN:
+    if (Ty->isFloatingPointTy())
+      return ConstantFP::getInfinity(Ty, false);
+    return ConstantInt::get(Ty->getContext(),
+                            Unsigned ? APInt::getMaxValue(
+                                           Ty->getIntegerBitWidth())
+                                     : APInt::getSignedMaxValue(
+                                           Ty->getIntegerBitWidth()));
+  case WG_OP_MAX:
+    if (Ty->isFloatingPointTy())
+      return ConstantFP::getInfinity(Ty, true);
+    return ConstantInt::get(Ty->getContext(),
+                            Unsigned ? APInt::getMinValue(
+                                           Ty->getIntegerBitWidth())
+                                     : APInt::getSignedMinValue(
+                                           Ty->getIntegerBitWidth()));
+  }
+  return nullptr;
+}
+
+// Combines the partial result Acc with the work-item value X. The forms
+// are the ones the loop vectorizer recognizes as reductions. The order
+// of the floating point operations of the collectives is unspecified,
+// thus the additions can be reassociated.
+static Value *combine(IRBuilder<> &Builder, CollectiveOp Op, Value *Acc,
+                      Value *X, bool Unsigned) {
+  bool FP = X->getType()->isFloatingPointTy();
+  switch (Op) {
+  case WG_OP_ADD:
+    if (FP) {
+      FastMathFlags FMF;
+      FMF.setAllowReassoc();
+      IRBuilder<>::FastMathFlagGuard Guard(Builder);
+      Builder.setFastMathFlags(FMF);
+      return Builder.CreateFAdd(Acc, X);
+    }
+    return Builder.CreateAdd(Acc, X);
+  case WG_OP_MIN:
+    if (FP)
+      return Builder.CreateMinNum(Acc, X);
+    return Builder.CreateSelect(Unsigned ? Builder.CreateICmpULT(X, Acc)
+                                         : Builder.CreateICmpSLT(X, Acc),
+                                X, Acc);
+  case WG_OP_MAX:
+    if (FP)
+      return Builder.CreateMaxNum(Acc, X);
+    return Builder.CreateSelect(Unsigned ? Builder.CreateICmpUGT(X, Acc)
+                                         : Builder.CreateICmpSGT(X, Acc),
+                                X, Acc);
+  case WG_OP_ALL:
+  case WG_OP_ANY: {
+    Value *Pred = Builder.CreateZExt(
+        Builder.CreateICmpNE(X, Constant::getNullValue(X->getType())),
+        Acc->getType());
+    return Op == WG_OP_ALL ? Builder.CreateAnd(Acc, Pred)
+                           : Builder.CreateOr(Acc, Pred);
+  }
+  }
+  return nullptr;
+}
+
+// Returns true in the work-item with the given local id. A missing id
+// dimension is zero.
+static Value *isWorkItem(IRBuilder<> &Builder, Type *SizeT,
+                         ArrayRef<Value *> LocalId) {
+  Module *M = Builder.GetInsertBlock()->getModule();
+  Value *Match = nullptr;
+  for (unsigned i = 0; i < 3; ++i) {
+    Value *Id = Builder.CreateLoad(
+        SizeT, M->getOrInsertGlobal(LocalIdGlobals[i], SizeT));
+    Value *Target = i < LocalId.size()
+                        ? Builder.CreateZExtOrTrunc(LocalId[i], SizeT)
+                        : ConstantInt::get(SizeT, 0);
+    Value *Cmp = Builder.CreateICmpEQ(Id, Target);
+    Match = Match == nullptr ? Cmp : Builder.CreateAnd(Match, Cmp);
+  }
+  return Match;
+}
+
+// Returns true in the work-item that runs last in the work-item loops.
+static Value *isLastWorkItem(IRBuilder<> &Builder, Type *SizeT) {
+  Module *M = Builder.GetInsertBlock()->getModule();
+  Value *Last[3];
+  for (unsigned i = 0; i < 3; ++i)
+    Last[i] = Builder.CreateSub(
+        Builder.CreateLoad(SizeT,
+                           M->getOrInsertGlobal(LocalSizeGlobals[i], SizeT)),
+        ConstantInt::get(SizeT, 1));
+  return isWorkItem(Builder, SizeT, Last);
+}
+
+static LoadInst *loadResult(IRBuilder<> &Builder, GlobalVariable *State) {
+  LoadInst *Result = Builder.CreateLoad(State->getValueType(), State);
+  Result->setMetadata(POCL_WG_COLLECTIVE_RESULT_MD,
+                      MDNode::get(Builder.getContext(), {}));
+  return Result;
+}
+
+// Lowers the collective call CI, which computes Name of its arguments.
+//
+// The work-items run the code between the barriers one after another in
+// the order of their linear local ids, whichever work-item handler is
+// used. The partial result of a reduction can thus be accumulated to a
+// work-group shared variable in the work-item loop:
+//
+//   acc = acc op x;          the loop vectorizer turns this to a vector
+//   barrier();               reduction once acc is privatized to a register
+//   result = acc;            the same for all the work-items
+//   acc = last ? identity : result;
+//
+// The shared variable is reset for the next dynamic instance of the
+// collective by the last work-item. A scan needs no barrier as the
+// partial result at a work-item is the result of the scan. A broadcast
+// stores the value of the given work-item before the barrier instead.
+static void lowerCollective(CallInst *CI, StringRef Name, StringRef Params,
+                            Type *SizeT) {
+  Module *M = CI->getModule();
+  IRBuilder<> Builder(CI);
+  Value *X = CI->getArgOperand(0);
+  Type *Ty = X->getType();
+
+  Name.consume_front("work_group_");
+  if (Name == "broadcast") {
+    GlobalVariable *State = new GlobalVariable(
+        *M, Ty, false, GlobalValue::InternalLinkage,
+        Constant::getNullValue(Ty), POCL_WG_COLLECTIVE_GLOBAL_PREFIX);
+    std::vector<Value *> LocalId;
+    for (unsigned i = 1; i < CI->arg_size(); ++i)
+      LocalId.push_back(CI->getArgOperand(i));
+    Value *Cur = Builder.CreateLoad(Ty, State);
+    Builder.CreateStore(
+        Builder.CreateSelect(isWorkItem(Builder, SizeT, LocalId), X, Cur),
+        State);
+    Barrier::Create(CI);
+    CI->replaceAllUsesWith(loadResult(Builder, State));
+    CI->eraseFromParent();
+    return;
+  }
+
+  bool Scan = Name.consume_front("scan_");
+  bool Inclusive = Scan && Name.consume_front("inclusive_");
+  if (Scan && !Inclusive)
+    Name.consume_front("exclusive_");
+  Name.consume_front("reduce_");
+
+  CollectiveOp Op = StringSwitch<CollectiveOp>(Name)
+                        .Case("add", WG_OP_ADD)
+                        .Case("min", WG_OP_MIN)
+                        .Case("max", WG_OP_MAX)
+                        .Case("all", WG_OP_ALL)
+                        .Default(WG_OP_ANY);
+  // The mangled unsigned int and unsigned long.
+  bool Unsigned = Params.startswith("j") || Params.startswith("m");
+
+  Constant *Identity = getIdentity(Op, CI->getType(), Unsigned);
+  GlobalVariable *State = new GlobalVariable(
+      *M, CI->getType(), false, GlobalValue::InternalLinkage, Identity,
+      POCL_WG_COLLECTIVE_GLOBAL_PREFIX);
+  Value *Acc = Builder.CreateLoad(CI->getType(), State);
+  Value *Combined = combine(Builder, Op, Acc, X, Unsigned);
+
+  Value *Result;
+  if (Scan) {
+    Result = Inclusive ? Combined : Acc;
+    Builder.CreateStore(
+        Builder.CreateSelect(isLastWorkItem(Builder, SizeT), Identity,
+                             Combined),
+        State);
+  } else {
+    Builder.CreateStore(Combined, State);
+    Barrier::Create(CI);
+    Result = loadResult(Builder, State);
+    Builder.CreateStore(
+        Builder.CreateSelect(isLastWorkItem(Builder, SizeT), Identity,
+                             Result),
+        State);
+  }
+  CI->replaceAllUsesWith(Result);
+  CI->eraseFromParent();
+}
+
+// Returns the linear local id of the work-item, the order the work-items
+// run the code between the barriers in, and the work-group size.
+static void getLinearLocalId(IRBuilder<> &Builder, Type *SizeT,
+                             Value *&LinearId, Value *&GroupSize) {
+  Module *M = Builder.GetInsertBlock()->getModule();
+  Value *Id[3], *Size[3];
+  for (unsigned i = 0; i < 3; ++i) {
+    Id[i] = Builder.CreateLoad(SizeT,
+                               M->getOrInsertGlobal(LocalIdGlobals[i], SizeT));
+    Size[i] = Builder.CreateLoad(
+        SizeT, M->getOrInsertGlobal(LocalSizeGlobals[i], SizeT));
+  }
+  LinearId = Builder.CreateAdd(
+      Id[0], Builder.CreateMul(
+                 Size[0], Builder.CreateAdd(
+                              Id[1], Builder.CreateMul(Size[1], Id[2]))));
+  GroupSize = Builder.CreateMul(Builder.CreateMul(Size[0], Size[1]), Size[2]);
+}
+
+static Value *createUMin(IRBuilder<> &Builder, Value *A, Value *B) {
+  return Builder.CreateSelect(Builder.CreateICmpULT(A, B), A, B);
+}
+
+// Reduces the lanes of the vector V with a horizontal operation.
+static Value *reduceVector(IRBuilder<> &Builder, CollectiveOp Op, Value *V,
+                           bool Unsigned) {
+  Type *EltTy = cast<VectorType>(V->getType())->getElementType();
+  bool FP = EltTy->isFloatingPointTy();
+  switch (Op) {
+  case WG_OP_ADD:
+    if (FP) {
+      FastMathFlags FMF;
+      FMF.setAllowReassoc();
+      IRBuilder<>::FastMathFlagGuard Guard(Builder);
+      Builder.setFastMathFlags(FMF);
+      return Builder.CreateFAddReduce(ConstantFP::getNegativeZero(EltTy), V);
+    }
+    return Builder.CreateAddReduce(V);
+  case WG_OP_MIN:
+    if (FP)
+#ifndef LLVM_OLDER_THAN_12_0
+      return Builder.CreateFPMinReduce(V);
+#else
+      return Builder.CreateFPMinReduce(V, false);
+#endif
+    return Builder.CreateIntMinReduce(V, !Unsigned);
+  case WG_OP_MAX:
+    if (FP)
+#ifndef LLVM_OLDER_THAN_12_0
+      return Builder.CreateFPMaxReduce(V);
+#else
+      return Builder.CreateFPMaxReduce(V, false);
+#endif
+    return Builder.CreateIntMaxReduce(V, !Unsigned);
+  case WG_OP_ALL:
+    return Builder.CreateAndReduce(V);
+  case WG_OP_ANY:
+    return Builder.CreateOrReduce(V);
+  }
+  return nullptr;
+}
+
+// Lowers the sub-group function call CI. The sub-groups are the chunks of
+// SubGroupSize work-items with consecutive linear local ids, which are the
+// lanes the loop vectorizer packs to a SIMD register when it vectorizes the
+// work-item loop by the native vector width. The last sub-group of the
+// work-group is partial if the work-group size is not a multiple of it.
+//
+// The reductions, broadcasts and shuffles store the work-item values to a
+// scratch array indexed by the linear local id. After a barrier, each
+// work-item loads the values of its sub-group as one vector and reduces it
+// with a horizontal vector operation, or loads the value of the source
+// lane of a broadcast or a shuffle. The scans accumulate in the work-item
+// loop like the work-group ones, restarting at the first sub-group lane.
+static void lowerSubGroupFunction(CallInst *CI, StringRef Name,
+                                  StringRef Params, Type *SizeT,
+                                  unsigned SubGroupSize) {
+  Module *M = CI->getModule();
+  IRBuilder<> Builder(CI);
+
+  if (Name == "sub_group_barrier") {
+    Barrier::Create(CI);
+    CI->eraseFromParent();
+    return;
+  }
+
+  Value *LinearId, *GroupSize;
+  getLinearLocalId(Builder, SizeT, LinearId, GroupSize);
+  Value *Width = ConstantInt::get(SizeT, SubGroupSize);
+  Value *SubGroupId = Builder.CreateUDiv(LinearId, Width);
+  Value *SubGroupLocalId = Builder.CreateURem(LinearId, Width);
+  Value *SubGroupStart = Builder.CreateMul(SubGroupId, Width);
+  Value *Size =
+      createUMin(Builder, Width, Builder.CreateSub(GroupSize, SubGroupStart));
+
+  if (Name.consume_front("get_")) {
+    Value *Result;
+    if (Name == "sub_group_id")
+      Result = SubGroupId;
+    else if (Name == "sub_group_local_id")
+      Result = SubGroupLocalId;
+    else if (Name == "sub_group_size")
+      Result = Size;
+    else if (Name == "max_sub_group_size")
+      Result = createUMin(Builder, Width, GroupSize);
+    else
+      Result = Builder.CreateUDiv(
+          Builder.CreateAdd(GroupSize, ConstantInt::get(SizeT,
+                                                        SubGroupSize - 1)),
+          Width);
+    CI->replaceAllUsesWith(Builder.CreateZExtOrTrunc(Result, CI->getType()));
+    CI->eraseFromParent();
+    return;
+  }
+
+  Value *X = CI->getArgOperand(0);
+  Type *Ty = X->getType();
+  Name.consume_front("sub_group_");
+  bool Scan = Name.consume_front("scan_");
+  bool Inclusive = Scan && Name.consume_front("inclusive_");
+  if (Scan && !Inclusive)
+    Name.consume_front("exclusive_");
+  Name.consume_front("reduce_");
+  // The mangled unsigned int and unsigned long.
+  bool Unsigned = Params.startswith("j") || Params.startswith("m");
+
+  CollectiveOp Op = StringSwitch<CollectiveOp>(Name)
+                        .Case("add", WG_OP_ADD)
+                        .Case("min", WG_OP_MIN)
+                        .Case("max", WG_OP_MAX)
+                        .Case("all", WG_OP_ALL)
+                        .Default(WG_OP_ANY);
+
+  if (Scan) {
+    Constant *Identity = getIdentity(Op, Ty, Unsigned);
+    GlobalVariable *State = new GlobalVariable(
+        *M, Ty, false, GlobalValue::InternalLinkage, Identity,
+        POCL_WG_COLLECTIVE_GLOBAL_PREFIX);
+    Value *Acc = Builder.CreateSelect(
+        Builder.CreateICmpEQ(SubGroupLocalId, ConstantInt::get(SizeT, 0)),
+        Identity, Builder.CreateLoad(Ty, State));
+    Value *Combined = combine(Builder, Op, Acc, X, Unsigned);
+    Builder.CreateStore(Combined, State);
+    CI->replaceAllUsesWith(Inclusive ? Combined : Acc);
+    CI->eraseFromParent();
+    return;
+  }
+
+  ArrayType *ScratchTy = ArrayType::get(Ty, 0);
+  GlobalVariable *Scratch = new GlobalVariable(
+      *M, ScratchTy, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(ScratchTy),
+      POCL_SUB_GROUP_SCRATCH_GLOBAL_PREFIX);
+  Value *Zero = ConstantInt::get(SizeT, 0);
+  Builder.CreateStore(
+      X, Builder.CreateInBoundsGEP(ScratchTy, Scratch, {Zero, LinearId}));
+  Barrier::Create(CI);
+
+  Value *Result;
+  if (Name == "broadcast" || Name.startswith("shuffle")) {
+    Value *Lane = Builder.CreateZExtOrTrunc(CI->getArgOperand(1), SizeT);
+    if (Name == "shuffle_xor")
+      Lane = Builder.CreateXor(SubGroupLocalId, Lane);
+    Result = Builder.CreateLoad(
+        Ty, Builder.CreateInBoundsGEP(
+                ScratchTy, Scratch,
+                {Zero, Builder.CreateAdd(SubGroupStart, Lane)}));
+  } else {
+#ifndef LLVM_OLDER_THAN_11_0
+    VectorType *VecTy = FixedVectorType::get(Ty, SubGroupSize);
+#else
+    VectorType *VecTy = VectorType::get(Ty, SubGroupSize);
+#endif
+    Value *Lanes = Builder.CreateBitCast(
+        Builder.CreateInBoundsGEP(ScratchTy, Scratch, {Zero, SubGroupStart}),
+        PointerType::get(VecTy, Scratch->getAddressSpace()));
+    LoadInst *V = Builder.CreateLoad(VecTy, Lanes);
+    V->setAlignment(
+#ifndef LLVM_OLDER_THAN_10_0
+#ifndef LLVM_OLDER_THAN_11_0
+        llvm::Align(
+#else
+        llvm::MaybeAlign(
+#endif
+#endif
+            M->getDataLayout().getABITypeAlignment(Ty)
+#ifndef LLVM_OLDER_THAN_10_0
+                )
+#endif
+    );
+
+    Value *Values = V;
+    if (Op == WG_OP_ALL || Op == WG_OP_ANY)
+      Values = Builder.CreateZExt(
+          Builder.CreateICmpNE(Values, Constant::getNullValue(VecTy)), VecTy);
+
+    // The lanes past the end of a partial sub-group do not contribute.
+    SmallVector<Constant *, 16> LaneIds;
+    for (unsigned i = 0; i < SubGroupSize; ++i)
+      LaneIds.push_back(ConstantInt::get(SizeT, i));
+    Value *Active = Builder.CreateICmpULT(
+        ConstantVector::get(LaneIds),
+        Builder.CreateVectorSplat(SubGroupSize, Size));
+    Values = Builder.CreateSelect(
+        Active, Values,
+        Builder.CreateVectorSplat(SubGroupSize,
+                                  getIdentity(Op, Ty, Unsigned)));
+    Result = reduceVector(Builder, Op, Values, Unsigned);
+  }
+  CI->replaceAllUsesWith(Result);
+  CI->eraseFromParent();
+}
+
+bool WorkgroupCollectives::runOnFunction(Function &F) {
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  std::vector<CallInst *> Collectives;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      CallInst *CI = dyn_cast<CallInst>(&I);
+      if (CI != nullptr && CI->getCalledFunction() != nullptr &&
+          !getWorkgroupCollectiveName(CI->getCalledFunction()->getName())
+               .empty())
+        Collectives.push_back(CI);
+    }
+  if (Collectives.empty())
+    return false;
+
+  unsigned long AddressBits;
+  getModuleIntMetadata(*F.getParent(), "device_address_bits", AddressBits);
+  Type *SizeT = IntegerType::get(F.getContext(), AddressBits);
+  unsigned long SubGroupSize = 1;
+  getModuleIntMetadata(*F.getParent(), "device_sub_group_size", SubGroupSize);
+  SubGroupSize = std::max(SubGroupSize, 1ul);
+
+  for (CallInst *CI : Collectives) {
+    StringRef Params;
+    StringRef Name =
+        getWorkgroupCollectiveName(CI->getCalledFunction()->getName(), &Params);
+    if (Name.startswith("work_group_")) {
+      lowerCollective(CI, Name, Params, SizeT);
+      ++NumCollectives;
+    } else {
+      lowerSubGroupFunction(CI, Name, Params, SizeT, SubGroupSize);
+      ++NumSubGroupFunctions;
+    }
+  }
+
+  POCL_MSG_PRINT_LLVM(
+      "Lowered %zu work-group and sub-group function calls of %s\n",
+      Collectives.size(), F.getName().str().c_str());
+  return true;
+}
+}
@@ -0,0 +1,295 @@
+// LLVM function pass to create the work-group function by running the
+// work-items of the kernel as fibers that switch at the barriers.
+//
+// Copyright (c) 2023 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <map>
+#include <vector>
+
+#include "pocl.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+#include "Barrier.h"
+#include "Kernel.h"
+#include "LLVMUtils.h"
+#include "WorkitemFibers.h"
+#include "WorkitemHandlerChooser.h"
+#include "Workgroup.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "workitemfibers"
+
+// The stack of a fiber: room for the calls to the builtins, and twice the
+// private variables of the kernel, for the spills around them.
+#define FIBER_STACK_BASE_SIZE (32 * 1024)
+#define FIBER_STACK_ALIGN 4096
+
+POCL_STATISTIC(FiberKernels, "Number of kernels run as work-item fibers");
+POCL_STATISTIC(FiberStackBytes, "Bytes of the work-item fiber stacks");
+
+using namespace llvm;
+using namespace pocl;
+
+namespace {
+  static
+  RegisterPass<WorkitemFibers> X("workitemfibers",
+                                 "Work-item fiber work-group function "
+                                 "generation pass");
+}
+
+char WorkitemFibers::ID = 0;
+
+// Returns the function of the fiber runtime, declared if not there yet.
+static Function *
+getRuntimeFunction(Module *M, StringRef Name, FunctionType *Ty)
+{
+  Function *F = M->getFunction(Name);
+  if (F == nullptr)
+    F = Function::Create(Ty, Function::ExternalLinkage, Name, M);
+  return F;
+}
+
+void
+WorkitemFibers::getAnalysisUsage(AnalysisUsage &AU) const
+{
+  AU.addRequired<pocl::WorkitemHandlerChooser>();
+  AU.addPreserved<pocl::WorkitemHandlerChooser>();
+}
+
+bool
+WorkitemFibers::runOnFunction(Function &F)
+{
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  if (getAnalysis<pocl::WorkitemHandlerChooser>().chosenHandler() !=
+      pocl::WorkitemHandlerChooser::POCL_WIH_FIBERS)
+    return false;
+
+  // The chooser picks the fibers again for the function left by an
+  // earlier run.
+  if (F.getParent()->getFunction(F.getName().str() + "_fiber") != nullptr)
+    return false;
+
+  ++FiberKernels;
+
+  return ProcessFunction(F);
+}
+
+bool
+WorkitemFibers::ProcessFunction(Function &F)
+{
+  Kernel *K = cast<Kernel>(&F);
+  Initialize(K);
+
+  Module *M = F.getParent();
+  LLVMContext &C = M->getContext();
+  Type *I8Ptr = Type::getInt8PtrTy(C);
+
+  // The fiber of a work-item, the beginning of struct pocl_fiber.
+  StructType *FiberTy =
+      StructType::get(C, {I8Ptr, ArrayType::get(SizeT, 3)});
+
+  // The values the work-items share, stored by the work-group function:
+  // the kernel arguments, the work-group pseudo variables, and the
+  // addresses of the work-group state of the lowered collective and
+  // sub-group functions. The Workgroup pass privatizes the loads and the
+  // addresses in the work-group function, which only the fiber bodies use.
+  std::vector<Type *> SharedTypes;
+  for (Argument &A : F.args())
+    SharedTypes.push_back(A.getType());
+
+  std::map<GlobalVariable *, unsigned> ValueSlots, AddressSlots;
+  for (const char *Name :
+       {"_group_id_x", "_group_id_y", "_group_id_z", "_global_offset_x",
+        "_global_offset_y", "_global_offset_z", "_work_dim", "_num_groups_x",
+        "_num_groups_y", "_num_groups_z"}) {
+    GlobalVariable *GV = M->getGlobalVariable(Name);
+    if (GV == nullptr)
+      continue;
+    ValueSlots[GV] = SharedTypes.size();
+    SharedTypes.push_back(GV->getValueType());
+  }
+  for (GlobalVariable &GV : M->globals()) {
+    if (!GV.getName().startswith(POCL_WG_COLLECTIVE_GLOBAL_PREFIX) &&
+        !GV.getName().startswith(POCL_SUB_GROUP_SCRATCH_GLOBAL_PREFIX))
+      continue;
+    AddressSlots[&GV] = SharedTypes.size();
+    SharedTypes.push_back(GV.getType());
+  }
+  StructType *SharedTy = StructType::get(C, SharedTypes);
+
+  // Move the kernel to the body the fibers run.
+  FunctionType *BodyTy =
+      FunctionType::get(Type::getVoidTy(C), {I8Ptr}, false);
+  Function *Body = Function::Create(BodyTy, Function::InternalLinkage,
+                                    F.getName() + "_fiber", M);
+  Body->addFnAttr(Attribute::NoInline);
+  for (const char *Attr : {"target-cpu", "target-features"})
+    if (F.hasFnAttribute(Attr))
+      Body->addFnAttr(F.getFnAttribute(Attr));
+  if (DISubprogram *SP = F.getSubprogram()) {
+    Body->setSubprogram(SP);
+    F.setSubprogram(MDNode::replaceWithDistinct(SP->clone()));
+  }
+  Body->getBasicBlockList().splice(Body->end(), F.getBasicBlockList());
+
+  std::vector<Instruction *> Instructions;
+  for (BasicBlock &BB : *Body)
+    for (Instruction &I : BB)
+      Instructions.push_back(&I);
+
+  Argument *FiberArg = &*Body->arg_begin();
+  FiberArg->setName("fiber");
+  BasicBlock &BodyEntry = Body->getEntryBlock();
+  IRBuilder<> Builder(&*BodyEntry.getFirstInsertionPt());
+
+  Value *Fiber = Builder.CreateBitCast(FiberArg, FiberTy->getPointerTo());
+  Value *Shared = Builder.CreateBitCast(
+      Builder.CreateLoad(I8Ptr, Builder.CreateStructGEP(FiberTy, Fiber, 0)),
+      SharedTy->getPointerTo(), "shared");
+  auto LoadShared = [&](unsigned Slot) -> Value * {
+    return Builder.CreateLoad(SharedTypes[Slot],
+                              Builder.CreateStructGEP(SharedTy, Shared, Slot));
+  };
+
+  unsigned Slot = 0;
+  for (Argument &A : F.args()) {
+    if (!A.use_empty())
+      A.replaceAllUsesWith(LoadShared(Slot));
+    ++Slot;
+  }
+
+  Value *LocalIdGlobals[3] = {LocalIdXGlobal, LocalIdYGlobal, LocalIdZGlobal};
+  unsigned long LocalSizes[3] = {WGLocalSizeX, WGLocalSizeY, WGLocalSizeZ};
+  std::map<GlobalVariable *, Value *> Addresses;
+  std::vector<Instruction *> Erased;
+  Function *FiberBarrier = getRuntimeFunction(
+      M, "__pocl_fiber_barrier", BodyTy);
+  for (Instruction *I : Instructions) {
+    if (isa<Barrier>(I)) {
+      // The fibers run out of the barriers at the exits of the kernel
+      // anyway.
+      Instruction *Next = I->getNextNode();
+      if (!isa<ReturnInst>(Next))
+        CallInst::Create(FiberBarrier, {FiberArg}, "", I);
+      Erased.push_back(I);
+      continue;
+    }
+
+    for (auto &Address : AddressSlots) {
+      GlobalVariable *GV = Address.first;
+      if (!is_contained(I->operand_values(), GV))
+        continue;
+      Value *&Addr = Addresses[GV];
+      if (Addr == nullptr)
+        Addr = LoadShared(Address.second);
+      I->replaceUsesOfWith(GV, Addr);
+    }
+
+    LoadInst *Load = dyn_cast<LoadInst>(I);
+    if (Load == nullptr)
+      continue;
+    GlobalVariable *GV =
+        dyn_cast<GlobalVariable>(Load->getPointerOperand()->stripPointerCasts());
+    if (GV == nullptr)
+      continue;
+
+    Value *V = nullptr;
+    for (int i = 0; i < 3; ++i) {
+      std::string LocalSize = std::string("_local_size_") + (char)('x' + i);
+      if (GV == LocalIdGlobals[i])
+        V = Builder.CreateLoad(
+            SizeT, Builder.CreateGEP(FiberTy, Fiber,
+                                     {Builder.getInt32(0), Builder.getInt32(1),
+                                      Builder.getInt32(i)}));
+      else if (GV->getName() == LocalSize)
+        V = ConstantInt::get(SizeT, LocalSizes[i]);
+    }
+    auto ValueSlot = ValueSlots.find(GV);
+    if (ValueSlot != ValueSlots.end())
+      V = LoadShared(ValueSlot->second);
+    if (V == nullptr)
+      continue;
+
+    Load->replaceAllUsesWith(Builder.CreateTruncOrBitCast(V, Load->getType()));
+    Erased.push_back(Load);
+  }
+  for (Instruction *I : Erased)
+    I->eraseFromParent();
+
+  // The stack of a fiber: the base size and twice the private variables,
+  // rounded up to whole pages.
+  const DataLayout &DL = M->getDataLayout();
+  uint64_t PrivateBytes = 0;
+  for (Instruction &I : BodyEntry) {
+    AllocaInst *Alloca = dyn_cast<AllocaInst>(&I);
+    if (Alloca == nullptr || !Alloca->isStaticAlloca())
+      continue;
+    PrivateBytes +=
+        DL.getTypeAllocSize(Alloca->getAllocatedType()) *
+        cast<ConstantInt>(Alloca->getArraySize())->getZExtValue();
+  }
+  uint64_t StackSize = FIBER_STACK_BASE_SIZE + 2 * PrivateBytes;
+  StackSize = (StackSize + FIBER_STACK_ALIGN - 1) &
+              ~(uint64_t)(FIBER_STACK_ALIGN - 1);
+  FiberStackBytes += StackSize * WGLocalSizeX * WGLocalSizeY * WGLocalSizeZ;
+
+  // The work-group function stores the shared values and runs the fibers.
+  BasicBlock *Entry = BasicBlock::Create(C, "fibers", &F);
+  Builder.SetInsertPoint(Entry);
+  AllocaInst *SharedAlloca = Builder.CreateAlloca(SharedTy, 0, "shared");
+  Slot = 0;
+  for (Argument &A : F.args())
+    Builder.CreateStore(&A, Builder.CreateStructGEP(SharedTy, SharedAlloca,
+                                                    Slot++));
+  for (auto &ValueSlot : ValueSlots)
+    Builder.CreateStore(
+        Builder.CreateLoad(ValueSlot.first->getValueType(), ValueSlot.first),
+        Builder.CreateStructGEP(SharedTy, SharedAlloca, ValueSlot.second));
+  for (auto &Address : AddressSlots)
+    Builder.CreateStore(Address.first, Builder.CreateStructGEP(
+                                           SharedTy, SharedAlloca,
+                                           Address.second));
+
+  Function *Run = getRuntimeFunction(
+      M, "__pocl_fibers_run",
+      FunctionType::get(Type::getVoidTy(C),
+                        {I8Ptr, I8Ptr, SizeT, SizeT, SizeT, SizeT}, false));
+  Builder.CreateCall(Run, {Builder.CreateBitCast(Body, I8Ptr),
+                           Builder.CreateBitCast(SharedAlloca, I8Ptr),
+                           ConstantInt::get(SizeT, WGLocalSizeX),
+                           ConstantInt::get(SizeT, WGLocalSizeY),
+                           ConstantInt::get(SizeT, WGLocalSizeZ),
+                           ConstantInt::get(SizeT, StackSize)});
+  Builder.CreateRetVoid();
+
+  return true;
+}
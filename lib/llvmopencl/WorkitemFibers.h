@@ -0,0 +1,53 @@
+// Header for WorkitemFibers function pass.
+//
+// Copyright (c) 2023 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _POCL_WORKITEM_FIBERS_H
+#define _POCL_WORKITEM_FIBERS_H
+
+#include "pocl.h"
+
+#include "WorkitemHandler.h"
+
+namespace pocl {
+
+  // Produces the work-group function with the fiber method: the kernel
+  // body moves to a function each work-item runs as a fiber on a stack of
+  // its own, and the barriers become switches to the other fibers of the
+  // work-group, see lib/kernel/host/pocl_fibers.c. The code stays the size
+  // of the kernel for any placement of the barriers, at the cost of a
+  // context switch per work-item and barrier, and of the work-item loops
+  // the other methods vectorize.
+  class WorkitemFibers : public pocl::WorkitemHandler {
+  public:
+    static char ID;
+
+    WorkitemFibers() : pocl::WorkitemHandler(ID) {}
+
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+    virtual bool runOnFunction(llvm::Function &F);
+
+  private:
+    bool ProcessFunction(llvm::Function &F);
+  };
+}
+
+#endif
@@ -77,6 +77,14 @@ WorkitemHandler::Initialize(Kernel *K) {
   getModuleBoolMetadata(*M, "WGAssumeZeroGlobalOffset",
                         WGAssumeZeroGlobalOffset);
 
+  DeviceL1CacheLineSize = 0;
+  getModuleIntMetadata(*M, "device_cache_line_size_l1",
+                       DeviceL1CacheLineSize);
+  ContextArrayAlign = MIN_CONTEXT_ARRAY_ALIGN;
+  if (DeviceL1CacheLineSize > ContextArrayAlign &&
+      (DeviceL1CacheLineSize & (DeviceL1CacheLineSize - 1)) == 0)
+    ContextArrayAlign = DeviceL1CacheLineSize;
+
   if (WGLocalSizeX == 0)
     WGLocalSizeX = 1;
   if (WGLocalSizeY == 0)
@@ -36,6 +36,9 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 POP_COMPILER_DIAGS
 
+// The minimum alignment of the work-item context arrays.
+#define MIN_CONTEXT_ARRAY_ALIGN 64
+
 namespace llvm {
   class DominatorTree;
 }
@@ -80,6 +83,11 @@ namespace pocl {
     unsigned long WGLocalSizeY;
     unsigned long WGLocalSizeZ;
     unsigned long WGMaxGridDimWidth;
+    // The L1 data cache line size of the device, 0 if unknown.
+    unsigned long DeviceL1CacheLineSize;
+    // The alignment of the work-item context arrays: at least 64 bytes for
+    // the widest vector accesses, and the L1 cache line where it is larger.
+    unsigned long ContextArrayAlign;
   };
 
   extern llvm::cl::opt<bool> AddWIMetadata;
@@ -22,12 +22,17 @@
 // THE SOFTWARE.
 
 #include <iostream>
+#include <set>
+#include <vector>
 
 #include "CompilerWarnings.h"
 IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
+#include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
 
 #define DEBUG_TYPE "workitem-loops"
 
@@ -35,8 +40,10 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include "WorkitemLoops.h"
 #include "WorkitemReplication.h"
 #include "Workgroup.h"
+#include "Barrier.h"
 #include "CanonicalizeBarriers.h"
 #include "Kernel.h"
+#include "pocl_llvm_api.h"
 
 using namespace llvm;
 using namespace pocl;
@@ -59,6 +66,128 @@ WorkitemHandlerChooser::getAnalysisUsage(AnalysisUsage &AU) const
 }
 
 
+/* Returns true if F calls printf, directly or through the functions it
+   calls. */
+static bool callsPrintf(const Function &F,
+                        std::set<const Function *> &Visited) {
+  if (!Visited.insert(&F).second)
+    return false;
+  for (const BasicBlock &BB : F) {
+    for (const Instruction &I : BB) {
+      const CallInst *Call = dyn_cast<CallInst>(&I);
+      if (Call == nullptr)
+        continue;
+      const Function *Callee = Call->getCalledFunction();
+      if (Callee == nullptr)
+        continue;
+      if (Callee->getName() == "printf" ||
+          Callee->getName() == "__pocl_printf" ||
+          Callee->getName() == "__pocl_printf_binary")
+        return true;
+      if (callsPrintf(*Callee, Visited))
+        return true;
+    }
+  }
+  return false;
+}
+
+/* Returns true if F calls the fiber runtime, thus was turned into fibers
+   already. */
+static bool runsFibers(const Function &F) {
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB)
+      if (const CallInst *Call = dyn_cast<CallInst>(&I))
+        if (Call->getCalledFunction() != nullptr &&
+            Call->getCalledFunction()->getName() == "__pocl_fibers_run")
+          return true;
+  return false;
+}
+
+/* Predicts whether forming the parallel regions of F multiplies its code:
+   the region former handles a barrier in an irreducible loop or deep in a
+   loop nest with implicit barriers in each of the loops around it, and
+   replicates the code after the barriers in conditional code, which does
+   not post-dominate the entry, up to the next barriers. The replication
+   is estimated as the instructions reachable from those barriers, which
+   overestimates it for the later barriers. */
+static bool regionsBlowUp(Function &F, unsigned long Threshold) {
+  std::vector<BasicBlock *> BarrierBlocks;
+  for (BasicBlock &BB : F)
+    if (Barrier::hasBarrier(&BB))
+      BarrierBlocks.push_back(&BB);
+  if (BarrierBlocks.empty())
+    return false;
+
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  PostDominatorTree PDT(F);
+
+  // An edge back to a block on the depth-first search path that does not
+  // dominate the source of the edge enters a loop with several entries.
+  std::set<BasicBlock *> Visited, OnPath;
+  std::vector<std::pair<BasicBlock *, succ_iterator>> Path;
+  BasicBlock *Entry = &F.getEntryBlock();
+  Visited.insert(Entry);
+  OnPath.insert(Entry);
+  Path.push_back(std::make_pair(Entry, succ_begin(Entry)));
+  while (!Path.empty()) {
+    BasicBlock *BB = Path.back().first;
+    if (Path.back().second == succ_end(BB)) {
+      OnPath.erase(BB);
+      Path.pop_back();
+      continue;
+    }
+    BasicBlock *Succ = *Path.back().second++;
+    if (OnPath.count(Succ) && !DT.dominates(Succ, BB))
+      return true;
+    if (Visited.insert(Succ).second) {
+      OnPath.insert(Succ);
+      Path.push_back(std::make_pair(Succ, succ_begin(Succ)));
+    }
+  }
+
+  unsigned long Replicated = 0;
+  for (BasicBlock *BB : BarrierBlocks) {
+    if (LI.getLoopDepth(BB) >= 3)
+      return true;
+    if (PDT.dominates(BB, Entry))
+      continue;
+    std::set<BasicBlock *> Reachable;
+    std::vector<BasicBlock *> Worklist(1, BB);
+    while (!Worklist.empty()) {
+      BasicBlock *Succ = Worklist.back();
+      Worklist.pop_back();
+      if (!Reachable.insert(Succ).second)
+        continue;
+      Replicated += Succ->size();
+      Worklist.insert(Worklist.end(), succ_begin(Succ), succ_end(Succ));
+    }
+  }
+  return Replicated > Threshold;
+}
+
+/* Returns true if the work-items of F can run as fibers, see
+   WorkitemFibers.cc: the fiber runtime switches the stacks on the 64-bit
+   x86 and Arm CPUs with the System V and AAPCS64 calling conventions. */
+bool
+WorkitemHandlerChooser::fibersSupported(Function &F)
+{
+  bool SPMD = false;
+  getModuleBoolMetadata(*F.getParent(), "device_is_spmd", SPMD);
+  if (SPMD || WGDynamicLocalSize)
+    return false;
+
+  Triple T(F.getParent()->getTargetTriple());
+  if ((T.getArch() != Triple::x86_64 && T.getArch() != Triple::aarch64) ||
+      T.isOSWindows())
+    return false;
+
+  // The Workgroup pass passes the printf buffer only to the functions the
+  // kernel calls directly, not to the fiber bodies.
+  std::set<const Function *> Visited;
+  return !callsPrintf(F, Visited);
+}
+
 bool
 WorkitemHandlerChooser::runOnFunction(Function &F)
 {
@@ -75,6 +204,11 @@ WorkitemHandlerChooser::runOnFunction(Function &F)
      FunctionPass that delegates to other passes. */    
   Initialize(K);
 
+  if (runsFibers(F)) {
+    chosenHandler_ = POCL_WIH_FIBERS;
+    return false;
+  }
+
   if (WGDynamicLocalSize) {
     chosenHandler_ = POCL_WIH_LOOPS;
     return false;
@@ -88,6 +222,17 @@ WorkitemHandlerChooser::runOnFunction(Function &F)
         chosenHandler_ = POCL_WIH_FULL_REPLICATION;
       else if (method == "loops" || method == "workitemloops" || method == "loopvec")
         chosenHandler_ = POCL_WIH_LOOPS;
+      else if (method == "cbs")
+        chosenHandler_ = POCL_WIH_CBS;
+      else if (method == "fibers") {
+        if (fibersSupported(F))
+          chosenHandler_ = POCL_WIH_FIBERS;
+        else {
+          std::cerr << "The fiber work group method is not supported for "
+                    << "the kernel or target. Using 'loops'." << std::endl;
+          chosenHandler_ = POCL_WIH_LOOPS;
+        }
+      }
       else if (method != "auto")
         {
           std::cerr << "Unknown work group generation method. Using 'auto'." << std::endl;
@@ -109,6 +254,16 @@ WorkitemHandlerChooser::runOnFunction(Function &F)
       } else {
         chosenHandler_ = POCL_WIH_LOOPS;
       }
+
+      // Fall back to the fibers for the kernels the region formation would
+      // blow up.
+      unsigned long FiberThreshold = 2000;
+      if (getenv("POCL_FIBER_THRESHOLD") != NULL)
+        FiberThreshold = atol(getenv("POCL_FIBER_THRESHOLD"));
+
+      if (chosenHandler_ == POCL_WIH_LOOPS && FiberThreshold > 0 &&
+          fibersSupported(F) && regionsBlowUp(F, FiberThreshold))
+        chosenHandler_ = POCL_WIH_FIBERS;
     }
 
   return false;
@@ -34,7 +34,9 @@ namespace pocl {
     
     enum WorkitemHandlerType {
       POCL_WIH_FULL_REPLICATION,
-      POCL_WIH_LOOPS
+      POCL_WIH_LOOPS,
+      POCL_WIH_CBS,
+      POCL_WIH_FIBERS
     };
 
   WorkitemHandlerChooser() : pocl::WorkitemHandler(ID), 
@@ -45,6 +47,8 @@ namespace pocl {
     
     WorkitemHandlerType chosenHandler() { return chosenHandler_; }
   private:
+    bool fibersSupported(llvm::Function &F);
+
     WorkitemHandlerType chosenHandler_;
   };
 }
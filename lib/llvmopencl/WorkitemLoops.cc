@@ -21,6 +21,7 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <climits>
 #include <iostream>
 #include <map>
 #include <sstream>
@@ -34,6 +35,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DebugInfoMetadata.h"
@@ -48,6 +50,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #define DEBUG_TYPE "workitem-loops"
 
+#include "LLVMUtils.h"
 #include "WorkitemLoops.h"
 #include "Workgroup.h"
 #include "Barrier.h"
@@ -62,11 +65,48 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #include "VariableUniformityAnalysis.h"
 
-#define CONTEXT_ARRAY_ALIGN 64
+
+// The maximum number of instructions cloned to rematerialize a value after
+// a barrier instead of storing it to a context array.
+#define CONTEXT_REMAT_MAX_INSTRUCTIONS 8
 
 using namespace llvm;
 using namespace pocl;
 
+POCL_STATISTIC(LoopKernels, "Number of kernels given work-item loops");
+POCL_STATISTIC(NumParallelRegions, "Number of parallel regions formed");
+POCL_STATISTIC(ContextArrayBytes,
+               "Bytes of work-item context arrays per work-group");
+POCL_STATISTIC(InnermostLoopY,
+               "Number of parallel regions given the y loop innermost");
+POCL_STATISTIC(InnermostLoopZ,
+               "Number of parallel regions given the z loop innermost");
+
+static cl::opt<bool> WIContextRemat(
+    "wi-context-remat", cl::init(true), cl::Hidden,
+    cl::desc("Rematerialize cheap values live across barriers instead of "
+             "storing them to work-item context arrays."));
+
+static cl::opt<bool> WIContextLayout(
+    "wi-context-layout", cl::init(true), cl::Hidden,
+    cl::desc("Choose the layout of each work-item context array by the "
+             "access pattern of its variable."));
+
+static cl::opt<bool> WILoopInterchange(
+    "wi-loop-interchange", cl::init(true), cl::Hidden,
+    cl::desc("Choose the innermost work-item loop of each parallel region "
+             "by the strides of its memory accesses."));
+
+/* Returns the number of elements of a vector value stored in a
+   struct-of-arrays context array, 0 for other types. */
+static unsigned soaElementCount(llvm::Type *T) {
+#ifndef LLVM_OLDER_THAN_11_0
+  if (FixedVectorType *VecTy = dyn_cast<FixedVectorType>(T))
+    return VecTy->getNumElements();
+#endif
+  return 0;
+}
+
 namespace {
   static
   RegisterPass<WorkitemLoops> X("workitemloops", 
@@ -101,6 +141,8 @@ WorkitemLoops::runOnFunction(Function &F)
       pocl::WorkitemHandlerChooser::POCL_WIH_LOOPS)
     return false;
 
+  ++LoopKernels;
+
   DTP = &getAnalysis<DominatorTreeWrapperPass>();
   DT = &DTP->getDomTree();
   LI = &getAnalysis<LoopInfoWrapperPass>();
@@ -131,6 +173,7 @@ WorkitemLoops::runOnFunction(Function &F)
   F.viewCFG();
 #endif
   contextArrays.clear();
+  soaContextArrays.clear();
   tempInstructionIds.clear();
 
   releaseParallelRegions();
@@ -388,6 +431,7 @@ WorkitemLoops::ProcessFunction(Function &F)
   releaseParallelRegions();
 
   original_parallel_regions = K->getParallelRegions(&LI->getLoopInfo());
+  NumParallelRegions += original_parallel_regions->size();
 
 #ifdef DUMP_CFGS
   F.dump();
@@ -577,19 +621,25 @@ WorkitemLoops::ProcessFunction(Function &F)
                            false, LocalIdZGlobal, WGLocalSizeZ, !unrolled, gv);
 
     } else {
-      if (WGLocalSizeX > 1) {
-        l = CreateLoopAround(*original, l.first, l.second, peelFirst,
-                             LocalIdXGlobal, WGLocalSizeX, !unrolled);
-      }
-
-      if (WGLocalSizeY > 1) {
-        l = CreateLoopAround(*original, l.first, l.second, false,
-                             LocalIdYGlobal, WGLocalSizeY);
+      /* The loops are created from the innermost out, by default x, y and
+         z. The peeled and unrolled iterations are of the x loop. */
+      unsigned LoopOrder[3] = {0, 1, 2};
+      if (WILoopInterchange && !peelFirst && !unrolled) {
+        unsigned Innermost = InnermostLoopDim(original);
+        for (unsigned d = Innermost; d > 0; --d)
+          LoopOrder[d] = LoopOrder[d - 1];
+        LoopOrder[0] = Innermost;
       }
-
-      if (WGLocalSizeZ > 1) {
-        l = CreateLoopAround(*original, l.first, l.second, false,
-                             LocalIdZGlobal, WGLocalSizeZ);
+      llvm::Value *LocalIdGlobals[3] = {LocalIdXGlobal, LocalIdYGlobal,
+                                        LocalIdZGlobal};
+      size_t LocalSizes[3] = {WGLocalSizeX, WGLocalSizeY, WGLocalSizeZ};
+
+      for (unsigned d : LoopOrder) {
+        if (LocalSizes[d] > 1) {
+          l = CreateLoopAround(*original, l.first, l.second,
+                               d == 0 && peelFirst, LocalIdGlobals[d],
+                               LocalSizes[d], d != 0 || !unrolled);
+        }
       }
     }
 
@@ -638,6 +688,59 @@ WorkitemLoops::ProcessFunction(Function &F)
   return true;
 }
 
+/*
+ * Returns the dimension whose work-item loop should be the innermost one
+ * around the region, so that it is the one vectorized. It is the one with
+ * the fewest memory accesses that are neither consecutive nor invariant
+ * across its work-items, preferring x, then y, on a tie.
+ */
+unsigned
+WorkitemLoops::InnermostLoopDim(ParallelRegion *Region)
+{
+  const DataLayout &DL = Region->entryBB()->getModule()->getDataLayout();
+  llvm::Value *LocalIdGlobals[3] = {LocalIdXGlobal, LocalIdYGlobal,
+                                    LocalIdZGlobal};
+  size_t LocalSizes[3] = {WGLocalSizeX, WGLocalSizeY, WGLocalSizeZ};
+
+  unsigned Best = 0;
+  unsigned BestCost = UINT_MAX;
+  for (unsigned d = 0; d < 3; ++d) {
+    if (LocalSizes[d] <= 1)
+      continue;
+    IdStrideAnalysis Strides(DL, LocalIdGlobals[d]);
+    unsigned Cost = 0;
+    for (llvm::BasicBlock *BB : *Region) {
+      for (llvm::Instruction &I : *BB) {
+        llvm::Value *Ptr;
+        llvm::Type *AccessType;
+        if (LoadInst *Load = dyn_cast<LoadInst>(&I)) {
+          Ptr = Load->getPointerOperand();
+          AccessType = Load->getType();
+        } else if (StoreInst *Store = dyn_cast<StoreInst>(&I)) {
+          Ptr = Store->getPointerOperand();
+          AccessType = Store->getValueOperand()->getType();
+        } else
+          continue;
+        IdStride S = Strides.get(Ptr);
+        int64_t Size = DL.getTypeStoreSize(AccessType);
+        if (!S.Known || (S.Value != 0 && S.Value != Size && S.Value != -Size))
+          ++Cost;
+      }
+    }
+    if (Cost < BestCost) {
+      Best = d;
+      BestCost = Cost;
+    }
+  }
+
+  // Record only the choices that differ from the default loop order.
+  if (Best == 1 && WGLocalSizeX > 1)
+    ++InnermostLoopY;
+  else if (Best == 2 && WGLocalSizeX * WGLocalSizeY > 1)
+    ++InnermostLoopZ;
+  return Best;
+}
+
 /*
  * Add context save/restore code to variables that are defined in 
  * the given region and are used outside the region.
@@ -796,6 +899,22 @@ WorkitemLoops::AddContextSave
       gepArgs.push_back(region->LocalIDXLoad());
     }
 
+  if (soaContextArrays.count(alloca))
+    {
+      /* Store each element to its own [z][y][x] array. */
+      llvm::Instruction *store = NULL;
+      gepArgs.insert(gepArgs.begin() + 1, NULL);
+      for (unsigned i = 0; i < soaElementCount(instruction->getType()); ++i)
+        {
+          gepArgs[1] = ConstantInt::get(SizeT, i);
+          store = builder.CreateStore(
+              builder.CreateExtractElement(instruction, i),
+              builder.CreateGEP(alloca->getType()->getPointerElementType(),
+                                alloca, gepArgs));
+        }
+      return store;
+    }
+
   return builder.CreateStore(instruction,
              builder.CreateGEP(alloca->getType()->getPointerElementType(),
                                alloca, gepArgs));
@@ -845,6 +964,22 @@ llvm::Instruction *WorkitemLoops::AddContextRestore(llvm::Value *val,
       gepArgs.push_back(region->LocalIDXLoad());
     }
 
+    if (soaContextArrays.count(alloca)) {
+      /* Gather the elements from their arrays. Later optimizations drop
+         the loads of the elements that are not used. */
+      llvm::Value *vec = UndefValue::get(InstType);
+      gepArgs.insert(gepArgs.begin() + 1, NULL);
+      for (unsigned i = 0; i < soaElementCount(InstType); ++i) {
+        gepArgs[1] = ConstantInt::get(SizeT, i);
+        llvm::Value *elem = builder.CreateLoad(
+            InstType->getScalarType(),
+            builder.CreateGEP(alloca->getType()->getPointerElementType(),
+                              alloca, gepArgs));
+        vec = builder.CreateInsertElement(vec, elem, i);
+      }
+      return cast<Instruction>(vec);
+    }
+
     if (PoclWrapperStructAdded)
       gepArgs.push_back(
           ConstantInt::get(Type::getInt32Ty(alloca->getContext()), 0));
@@ -1043,12 +1178,36 @@ WorkitemLoops::GetContextArray(llvm::Instruction *instruction,
     }
   else
     {
+      /* Vector values accessed only element-wise are stored as a struct of
+         arrays, one [z][y][x] array per element, so the element accesses
+         of consecutive work-items are consecutive in memory. */
+      bool SoA = ShouldUseSoALayout(instruction);
+      if (SoA)
+        AllocType = instruction->getType()->getScalarType();
+
+      /* Pad the rows of multi-dimensional work-groups to the context array
+         alignment, so that each row starts at a vector aligned address. */
+      uint64_t ContextSizeX = WGLocalSizeX;
+      uint64_t ElemSize = Layout.getTypeAllocSize(AllocType);
+      if (WIContextLayout && WGLocalSizeY * WGLocalSizeZ > 1 &&
+          ElemSize > 0 && ContextArrayAlign % ElemSize == 0) {
+        uint64_t Lanes = ContextArrayAlign / ElemSize;
+        if (WGLocalSizeX >= Lanes)
+          ContextSizeX = (WGLocalSizeX + Lanes - 1) / Lanes * Lanes;
+      }
+
       llvm::Type *contextArrayType = ArrayType::get(
-          ArrayType::get(ArrayType::get(AllocType, WGLocalSizeX), WGLocalSizeY),
+          ArrayType::get(ArrayType::get(AllocType, ContextSizeX), WGLocalSizeY),
           WGLocalSizeZ);
+      if (SoA)
+        contextArrayType = ArrayType::get(
+            contextArrayType, soaElementCount(instruction->getType()));
 
       /* Allocate the context data array for the variable. */
       Alloca = builder.CreateAlloca(contextArrayType, nullptr, varName);
+      if (SoA)
+        soaContextArrays.insert(Alloca);
+      ContextArrayBytes += Layout.getTypeAllocSize(contextArrayType);
     }
 
   /* Align the context arrays to stack to enable wide vectors
@@ -1063,18 +1222,23 @@ WorkitemLoops::GetContextArray(llvm::Instruction *instruction,
         llvm::MaybeAlign(
 #endif
 #endif
-            CONTEXT_ARRAY_ALIGN
+            ContextArrayAlign
 #ifndef LLVM_OLDER_THAN_10_0
             )
 #endif
     );
 
-    if (DebugVal && DebugCall && !WGDynamicLocalSize) {
+    if (DebugVal && DebugCall && !WGDynamicLocalSize &&
+        !soaContextArrays.count(Alloca)) {
 
       llvm::SmallVector<llvm::Metadata *, 4> Subscripts;
       Subscripts.push_back(DB->getOrCreateSubrange(0, WGLocalSizeZ));
       Subscripts.push_back(DB->getOrCreateSubrange(0, WGLocalSizeY));
-      Subscripts.push_back(DB->getOrCreateSubrange(0, WGLocalSizeX));
+      Subscripts.push_back(DB->getOrCreateSubrange(
+          0, cast<ArrayType>(Alloca->getAllocatedType()
+                                 ->getArrayElementType()
+                                 ->getArrayElementType())
+                 ->getNumElements()));
       llvm::DINodeArray SubscriptArray = DB->getOrCreateArray(Subscripts);
 
       size_t sizeBits;
@@ -1149,19 +1313,18 @@ WorkitemLoops::GetContextArray(llvm::Instruction *instruction,
  * TODO: ignore work group variables completely (the iteration variables)
  * The LLVM should optimize these away but it would improve
  * the readability of the output during debugging.
- * TODO: rematerialize some values such as extended values of global 
- * variables (especially global id which is computed from local id) or kernel 
- * argument values instead of allocating stack space for them
+ *
+ * Values that are cheap to compute from the local ids and uniform values,
+ * such as the global id, are rematerialized before each use instead of
+ * allocating stack space for them.
  */
 void
 WorkitemLoops::AddContextSaveRestore
 (llvm::Instruction *instruction) {
 
-  /* Allocate the context data array for the variable. */
-  bool PoclWrapperStructAdded = false;
-  llvm::Instruction *alloca =
-      GetContextArray(instruction, PoclWrapperStructAdded);
-  llvm::Instruction *theStore = AddContextSave(instruction, alloca);
+  unsigned rematBudget = CONTEXT_REMAT_MAX_INSTRUCTIONS;
+  bool rematerialize = WIContextRemat && !isa<AllocaInst>(instruction) &&
+                       CanRematerialize(instruction, rematBudget);
 
   InstructionVec uses;
   /* Restore the produced variable before each use to ensure the correct context
@@ -1185,10 +1348,18 @@ WorkitemLoops::AddContextSaveRestore
     {
       llvm::Instruction *user = cast<Instruction>(ui->getUser());
       if (user == NULL) continue;
-      if (user == theStore) continue;
       uses.push_back(user);
     }
 
+  /* Allocate the context data array for the variable. */
+  bool PoclWrapperStructAdded = false;
+  llvm::Instruction *alloca = NULL;
+  if (!rematerialize)
+    {
+      alloca = GetContextArray(instruction, PoclWrapperStructAdded);
+      AddContextSave(instruction, alloca);
+    }
+
   for (InstructionVec::iterator i = uses.begin(); i != uses.end(); ++i)
     {
       Instruction *user = *i;
@@ -1235,10 +1406,13 @@ WorkitemLoops::AddContextSaveRestore
           assert (incomingBB != NULL);
           contextRestoreLocation = incomingBB->getTerminator();
         }
-        llvm::Value *loadedValue = AddContextRestore(
-            user, alloca, instruction->getType(),
-            PoclWrapperStructAdded, contextRestoreLocation,
-            isa<AllocaInst>(instruction));
+        llvm::Value *loadedValue =
+            rematerialize
+                ? RematerializeValue(instruction, contextRestoreLocation)
+                : AddContextRestore(user, alloca, instruction->getType(),
+                                    PoclWrapperStructAdded,
+                                    contextRestoreLocation,
+                                    isa<AllocaInst>(instruction));
         user->replaceUsesOfWith(instruction, loadedValue);
 
 #ifdef DEBUG_WORK_ITEM_LOOPS
@@ -1248,6 +1422,106 @@ WorkitemLoops::AddContextSaveRestore
     }
 }
 
+/**
+ * Returns true if the vector value produced by the given instruction is
+ * only accessed element-wise and thus should get a struct-of-arrays
+ * context array.
+ */
+bool
+WorkitemLoops::ShouldUseSoALayout(llvm::Instruction *instr)
+{
+  if (!WIContextLayout || WGDynamicLocalSize || isa<AllocaInst>(instr) ||
+      soaElementCount(instr->getType()) == 0)
+    return false;
+
+  for (llvm::User *user : instr->users())
+    {
+      ExtractElementInst *extract = dyn_cast<ExtractElementInst>(user);
+      if (extract == NULL || !isa<ConstantInt>(extract->getIndexOperand()))
+        return false;
+    }
+  return true;
+}
+
+/**
+ * Checks if the value can be recomputed at any of its uses in other
+ * parallel regions from the local ids and uniform values with at most
+ * budget side effect free instructions.
+ */
+bool
+WorkitemLoops::CanRematerialize(llvm::Value *val, unsigned &budget)
+{
+  if (isa<Constant>(val) || isa<Argument>(val))
+    return true;
+
+  llvm::Instruction *instr = dyn_cast<Instruction>(val);
+  if (instr == NULL || isa<AllocaInst>(instr) || isa<PHINode>(instr))
+    return false;
+
+  llvm::LoadInst *load = dyn_cast<LoadInst>(instr);
+  if (load != NULL &&
+      (load->getPointerOperand() == LocalIdZGlobal ||
+       load->getPointerOperand() == LocalIdYGlobal ||
+       load->getPointerOperand() == LocalIdXGlobal))
+    return true;
+
+  /* Uniform values are used as such in all the regions. */
+  VariableUniformityAnalysis &VUA = getAnalysis<VariableUniformityAnalysis>();
+  if (!VUA.shouldBePrivatized(instr->getParent()->getParent(), instr))
+    return true;
+
+  if (budget == 0)
+    return false;
+  --budget;
+
+  if (!isa<BinaryOperator>(instr) && !isa<CastInst>(instr) &&
+      !isa<GetElementPtrInst>(instr) && !isa<CmpInst>(instr) &&
+      !isa<SelectInst>(instr))
+    return false;
+  if (!isSafeToSpeculativelyExecute(instr))
+    return false;
+
+  for (llvm::Value *op : instr->operands())
+    if (!CanRematerialize(op, budget))
+      return false;
+  return true;
+}
+
+/**
+ * Recomputes a value accepted by CanRematerialize() before the given
+ * instruction.
+ */
+llvm::Value *
+WorkitemLoops::RematerializeValue(llvm::Value *val, llvm::Instruction *before)
+{
+  llvm::Instruction *instr = dyn_cast<Instruction>(val);
+  if (instr == NULL)
+    return val;
+
+  ParallelRegion *region = RegionOfBlock(before->getParent());
+  assert (region != NULL);
+
+  llvm::LoadInst *load = dyn_cast<LoadInst>(instr);
+  if (load != NULL && load->getPointerOperand() == LocalIdZGlobal)
+    return region->LocalIDZLoad();
+  if (load != NULL && load->getPointerOperand() == LocalIdYGlobal)
+    return region->LocalIDYLoad();
+  if (load != NULL && load->getPointerOperand() == LocalIdXGlobal)
+    return region->LocalIDXLoad();
+
+  VariableUniformityAnalysis &VUA = getAnalysis<VariableUniformityAnalysis>();
+  if (!VUA.shouldBePrivatized(instr->getParent()->getParent(), instr))
+    return val;
+
+  llvm::Instruction *clone = instr->clone();
+  clone->insertBefore(before);
+  if (instr->hasName())
+    clone->setName(instr->getName() + ".remat");
+  for (unsigned i = 0; i < clone->getNumOperands(); ++i)
+    clone->setOperand(i, RematerializeValue(instr->getOperand(i), clone));
+  return clone;
+}
+
 bool
 WorkitemLoops::ShouldNotBeContextSaved(llvm::Instruction *instr)
 {
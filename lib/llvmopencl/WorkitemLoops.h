@@ -71,10 +71,13 @@ namespace pocl {
     ParallelRegion::ParallelRegionVector *original_parallel_regions;
 
     StrInstructionMap contextArrays;
+    // The context arrays of vector values stored one array per element.
+    InstructionIndex soaContextArrays;
 
     virtual bool ProcessFunction(llvm::Function &F);
 
     void FixMultiRegionVariables(ParallelRegion *region);
+    unsigned InnermostLoopDim(ParallelRegion *Region);
     void AddContextSaveRestore(llvm::Instruction *instruction);
     void releaseParallelRegions();
 
@@ -90,6 +93,10 @@ namespace pocl {
                                          bool isAlloca = false);
     llvm::Instruction *GetContextArray(llvm::Instruction *val,
                                        bool &PoclWrapperStructAdded);
+    bool ShouldUseSoALayout(llvm::Instruction *Instr);
+    bool CanRematerialize(llvm::Value *Val, unsigned &Budget);
+    llvm::Value *RematerializeValue(llvm::Value *Val,
+                                    llvm::Instruction *Before);
 
     std::pair<llvm::BasicBlock *, llvm::BasicBlock *>
     CreateLoopAround
@@ -0,0 +1,170 @@
+// LLVM function pass that polls the preemption point of the driver thread
+// at the back-edges of the loops of the work-group functions.
+//
+// Copyright (c) 2023 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <vector>
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include "LLVMUtils.h"
+#include "VariableUniformityAnalysis.h"
+#include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
+#include "WorkitemPreemption.h"
+#include "pocl_llvm_api.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "workitem-preemption"
+
+POCL_STATISTIC(NumPreemptionPoints, "Number of preemption points added");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::WorkitemPreemption>
+    X("workitem-preemption",
+      "Add preemption points to the loops of the work-group functions.");
+}
+
+char WorkitemPreemption::ID = 0;
+
+WorkitemPreemption::WorkitemPreemption() : FunctionPass(ID) {}
+
+void WorkitemPreemption::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<VariableUniformityAnalysis>();
+  AU.addPreserved<VariableUniformityAnalysis>();
+  AU.addRequired<WorkitemHandlerChooser>();
+  AU.addPreserved<WorkitemHandlerChooser>();
+}
+
+/* A work-group of a few work-items that each loop for long holds its driver
+ * thread for as long, and the work of the higher priority queues waits for
+ * it. For the devices with preemption_points, the latches of the loops poll
+ * the struct pocl_preempt_point of the thread (see pocl_context.h), and
+ * call its yield function when the driver has asked for it, which runs the
+ * urgent work on the same thread before returning to the loop.
+ *
+ * The innermost work-item loops are left alone, so that they still
+ * vectorize: their work-items are short, and the loops around them or the
+ * driver between the work-groups poll instead. The other loops, those of
+ * the kernel and the outer work-item loops, each get a load and a branch
+ * per iteration. The yield call only touches memory the kernel can't
+ * access without racing with the preempting work, so it does not stop the
+ * optimizations of the loop either. */
+bool WorkitemPreemption::runOnFunction(Function &F) {
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  Module *M = F.getParent();
+  bool PreemptionPoints = false;
+  getModuleBoolMetadata(*M, "device_preemption_points", PreemptionPoints);
+  if (!PreemptionPoints)
+    return false;
+
+  if (getAnalysis<WorkitemHandlerChooser>().chosenHandler() !=
+      WorkitemHandlerChooser::POCL_WIH_LOOPS)
+    return false;
+
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  std::vector<BasicBlock *> Latches;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (isWorkItemLoop(*L) && L->getSubLoops().empty())
+      continue;
+    if (BasicBlock *Latch = L->getLoopLatch())
+      Latches.push_back(Latch);
+  }
+  if (Latches.empty())
+    return false;
+
+  LLVMContext &C = F.getContext();
+  const DataLayout &DL = M->getDataLayout();
+  VariableUniformityAnalysis &VUA =
+      getAnalysis<VariableUniformityAnalysis>();
+  Type *I8Ptr = Type::getInt8PtrTy(C);
+  Type *I32 = Type::getInt32Ty(C);
+  FunctionType *YieldT = FunctionType::get(Type::getVoidTy(C), {I8Ptr}, false);
+  Type *YieldPtr = PointerType::get(YieldT, 0);
+
+  GlobalVariable *Handle = M->getGlobalVariable(POCL_PREEMPT_GLOBAL);
+  if (Handle == nullptr)
+    Handle = new GlobalVariable(*M, I8Ptr, false, GlobalValue::ExternalLinkage,
+                                nullptr, POCL_PREEMPT_GLOBAL);
+
+  MDNode *Unlikely = MDBuilder(C).createBranchWeights(1, 2000);
+
+  for (BasicBlock *Latch : Latches) {
+    // The latch terminator, with the loop metadata, moves to the new latch.
+    BasicBlock *Cont = Latch->splitBasicBlock(Latch->getTerminator(),
+                                              Latch->getName() + ".cont");
+    BasicBlock *Yield =
+        BasicBlock::Create(C, Latch->getName() + ".preempt", &F, Cont);
+    Latch->getTerminator()->eraseFromParent();
+
+    IRBuilder<> Builder(Latch);
+    LoadInst *Point = Builder.CreateLoad(I8Ptr, Handle);
+    LoadInst *Requested = Builder.CreateLoad(
+        I32, Builder.CreatePointerCast(Point, PointerType::get(I32, 0)));
+    Requested->setVolatile(true);
+    Value *Cond = Builder.CreateICmpNE(Requested, ConstantInt::get(I32, 0));
+    Builder.CreateCondBr(Cond, Yield, Cont, Unlikely);
+    VUA.setUniform(&F, Point);
+    VUA.setUniform(&F, Requested);
+    VUA.setUniform(&F, Cond);
+
+    // yield is the pointer after requested.
+    Builder.SetInsertPoint(Yield);
+    Value *YieldAddr = Builder.CreateGEP(
+        Builder.getInt8Ty(), Point,
+        ConstantInt::get(Type::getInt64Ty(C), DL.getPointerSize()));
+    Value *YieldFunc = Builder.CreateLoad(
+        YieldPtr,
+        Builder.CreatePointerCast(YieldAddr, PointerType::get(YieldPtr, 0)));
+    CallInst *Call = Builder.CreateCall(YieldT, YieldFunc, {Point});
+#ifdef LLVM_OLDER_THAN_14_0
+    Call->addAttribute(AttributeList::FunctionIndex,
+                       Attribute::InaccessibleMemOnly);
+    Call->addAttribute(AttributeList::FunctionIndex, Attribute::NoUnwind);
+#else
+    Call->addFnAttr(Attribute::InaccessibleMemOnly);
+    Call->addFnAttr(Attribute::NoUnwind);
+#endif
+    Builder.CreateBr(Cont);
+    ++NumPreemptionPoints;
+  }
+
+  return true;
+}
+}
@@ -0,0 +1,232 @@
+// LLVM function pass that prefetches the buffer elements the later
+// work-items of a work-item loop access with large strides.
+//
+// Copyright (c) 2023 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <set>
+#include <vector>
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "LLVMUtils.h"
+#include "ParallelRegion.h"
+#include "VariableUniformityAnalysis.h"
+#include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
+#include "WorkitemPrefetch.h"
+#include "pocl_llvm_api.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "workitem-prefetch"
+
+// The most work-items a prefetch is issued ahead of the access.
+#define MAX_PREFETCH_DISTANCE 16
+
+POCL_STATISTIC(NumPrefetches, "Number of software prefetches added");
+
+namespace pocl {
+
+using namespace llvm;
+
+static cl::opt<bool> WIPrefetch(
+    "wi-prefetch", cl::init(false), cl::Hidden,
+    cl::desc("Prefetch the buffer accesses of the work-item loops with "
+             "constant strides of at least a cache line."));
+
+static cl::opt<unsigned> WIPrefetchDistance(
+    "wi-prefetch-distance", cl::init(0), cl::Hidden,
+    cl::desc("The work-items to prefetch ahead, 0 to derive it from the L1 "
+             "data cache size of the device."));
+
+namespace {
+static RegisterPass<pocl::WorkitemPrefetch>
+    X("workitem-prefetch",
+      "Add software prefetches to the work-item loops.");
+}
+
+char WorkitemPrefetch::ID = 0;
+
+WorkitemPrefetch::WorkitemPrefetch() : FunctionPass(ID) {}
+
+void WorkitemPrefetch::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<WorkitemHandlerChooser>();
+  AU.addPreserved<WorkitemHandlerChooser>();
+  AU.addPreserved<VariableUniformityAnalysis>();
+  AU.setPreservesCFG();
+}
+
+// Returns the local id global the work-item loop L iterates, read by the
+// condition of its latch, or nullptr.
+static GlobalVariable *loopLocalIdVar(Loop &L, GlobalVariable *LocalIds[3]) {
+  BasicBlock *Latch = L.getLoopLatch();
+  BranchInst *Br =
+      Latch ? dyn_cast<BranchInst>(Latch->getTerminator()) : nullptr;
+  if (Br == nullptr || !Br->isConditional())
+    return nullptr;
+  ICmpInst *Cmp = dyn_cast<ICmpInst>(Br->getCondition());
+  LoadInst *Id = Cmp ? dyn_cast<LoadInst>(Cmp->getOperand(0)) : nullptr;
+  if (Id == nullptr)
+    return nullptr;
+  for (unsigned D = 0; D < 3; ++D)
+    if (LocalIds[D] != nullptr && Id->getPointerOperand() == LocalIds[D])
+      return LocalIds[D];
+  return nullptr;
+}
+
+/* The hardware prefetchers follow the streams of consecutive work-items
+ * well, but not the accesses that skip one or more cache lines per
+ * work-item, e.g. to the columns of a row-major matrix. Prefetch the
+ * buffer elements those accesses of the work-items Distance ahead touch,
+ * with the distance derived from the L1 data cache size of the device so
+ * that the prefetched lines of all the streams of the loop fit in a
+ * quarter of it. The loop vectorizer does not vectorize loops with
+ * prefetches, but such accesses would anyway become gathers. */
+bool WorkitemPrefetch::runOnFunction(Function &F) {
+  if (!WIPrefetch || !Workgroup::isKernelToProcess(F))
+    return false;
+
+  if (getAnalysis<WorkitemHandlerChooser>().chosenHandler() !=
+      WorkitemHandlerChooser::POCL_WIH_LOOPS)
+    return false;
+
+  Module *M = F.getParent();
+  const DataLayout &DL = M->getDataLayout();
+  unsigned long LineSize = 64, L1Size = 32 * 1024;
+  getModuleIntMetadata(*M, "device_cache_line_size_l1", LineSize);
+  getModuleIntMetadata(*M, "device_cache_size_l1", L1Size);
+  if (LineSize == 0)
+    return false;
+
+  unsigned long LocalSizes[3] = {0, 0, 0};
+  bool DynamicLocalSize = false;
+  getModuleIntMetadata(*M, "WGLocalSizeX", LocalSizes[0]);
+  getModuleIntMetadata(*M, "WGLocalSizeY", LocalSizes[1]);
+  getModuleIntMetadata(*M, "WGLocalSizeZ", LocalSizes[2]);
+  getModuleBoolMetadata(*M, "WGDynamicLocalSize", DynamicLocalSize);
+
+  GlobalVariable *LocalIds[3] = {
+      M->getGlobalVariable(POCL_LOCAL_ID_X_GLOBAL),
+      M->getGlobalVariable(POCL_LOCAL_ID_Y_GLOBAL),
+      M->getGlobalVariable(POCL_LOCAL_ID_Z_GLOBAL)};
+
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  bool Changed = false;
+
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (!isWorkItemLoop(*L))
+      continue;
+    GlobalVariable *IdVar = loopLocalIdVar(*L, LocalIds);
+    if (IdVar == nullptr)
+      continue;
+    unsigned Dim = IdVar == LocalIds[0] ? 0 : (IdVar == LocalIds[1] ? 1 : 2);
+
+    // The buffer accesses of the work-items of this loop, not of the
+    // loops in its body, with at least a cache line between them.
+    IdStrideAnalysis Strides(DL, IdVar);
+    std::vector<std::pair<Instruction *, int64_t>> Accesses;
+    std::set<Value *> Ptrs;
+    for (BasicBlock *BB : L->blocks()) {
+      if (LI.getLoopFor(BB) != L)
+        continue;
+      for (Instruction &I : *BB) {
+        Value *Ptr = nullptr;
+        if (LoadInst *Load = dyn_cast<LoadInst>(&I)) {
+          if (Load->isSimple())
+            Ptr = Load->getPointerOperand();
+        } else if (StoreInst *Store = dyn_cast<StoreInst>(&I)) {
+          if (Store->isSimple())
+            Ptr = Store->getPointerOperand();
+        }
+        if (Ptr == nullptr || !Ptrs.insert(Ptr).second)
+          continue;
+#ifdef LLVM_OLDER_THAN_12_0
+        Value *Obj = GetUnderlyingObject(Ptr, DL);
+#else
+        Value *Obj = getUnderlyingObject(Ptr);
+#endif
+        if (!isa<Argument>(Obj))
+          continue;
+        IdStride S = Strides.get(Ptr);
+        if (!S.Known || (uint64_t)std::abs(S.Value) < LineSize)
+          continue;
+        Accesses.push_back(std::make_pair(&I, S.Value));
+      }
+    }
+    if (Accesses.empty())
+      continue;
+
+    uint64_t Distance = WIPrefetchDistance;
+    if (Distance == 0)
+      Distance = L1Size / LineSize / (4 * Accesses.size());
+    if (Distance > MAX_PREFETCH_DISTANCE)
+      Distance = MAX_PREFETCH_DISTANCE;
+    // Stay within the work-group, where the ids are known.
+    if (!DynamicLocalSize && LocalSizes[Dim] > 0 &&
+        Distance >= LocalSizes[Dim])
+      Distance = LocalSizes[Dim] / 2;
+    if (Distance == 0)
+      continue;
+
+    for (auto &Access : Accesses) {
+      Instruction *I = Access.first;
+      bool IsStore = isa<StoreInst>(I);
+      Value *Ptr = IsStore ? cast<StoreInst>(I)->getPointerOperand()
+                           : cast<LoadInst>(I)->getPointerOperand();
+      unsigned AS = Ptr->getType()->getPointerAddressSpace();
+      IRBuilder<> Builder(I);
+      Type *I8Ptr = Type::getInt8PtrTy(F.getContext(), AS);
+      Value *Ahead = Builder.CreateGEP(
+          Builder.getInt8Ty(), Builder.CreatePointerCast(Ptr, I8Ptr),
+          ConstantInt::get(Type::getInt64Ty(F.getContext()),
+                           (int64_t)Distance * Access.second));
+#ifdef LLVM_OLDER_THAN_10_0
+      if (AS != 0)
+        continue;
+      Function *Prefetch = Intrinsic::getDeclaration(M, Intrinsic::prefetch);
+#else
+      Function *Prefetch =
+          Intrinsic::getDeclaration(M, Intrinsic::prefetch, {I8Ptr});
+#endif
+      // The locality of 3 keeps the line in all the cache levels.
+      Builder.CreateCall(Prefetch, {Ahead, Builder.getInt32(IsStore ? 1 : 0),
+                                    Builder.getInt32(3), Builder.getInt32(1)});
+      ++NumPrefetches;
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+}
@@ -44,6 +44,7 @@ IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #define DEBUG_TYPE "workitem"
 
+#include "LLVMUtils.h"
 #include "WorkitemReplication.h"
 #include "Workgroup.h"
 #include "Barrier.h"
@@ -65,8 +66,11 @@ POP_COMPILER_DIAGS
 using namespace llvm;
 using namespace pocl;
 
-STATISTIC(ContextValues, "Number of SSA values which have to be context-saved");
-STATISTIC(ContextSize, "Context size per workitem in bytes");
+POCL_STATISTIC(ReplicatedKernels, "Number of kernels replicated");
+POCL_STATISTIC(NumParallelRegions, "Number of parallel regions formed");
+POCL_STATISTIC(ContextValues,
+               "Number of SSA values which have to be context-saved");
+POCL_STATISTIC(ContextSize, "Context size per workitem in bytes");
 
 namespace {
   static
@@ -95,6 +99,8 @@ WorkitemReplication::runOnFunction(Function &F)
       pocl::WorkitemHandlerChooser::POCL_WIH_FULL_REPLICATION)
     return false;
 
+  ++ReplicatedKernels;
+
   DTP = &getAnalysis<DominatorTreeWrapperPass>();
   DT = &DTP->getDomTree();
 
@@ -132,6 +138,7 @@ WorkitemReplication::ProcessFunction(Function &F)
 
   ParallelRegion::ParallelRegionVector* original_parallel_regions =
     K->getParallelRegions(&LI->getLoopInfo());
+  NumParallelRegions += original_parallel_regions->size();
 
   std::vector<ParallelRegion::ParallelRegionVector> parallel_regions(
       workitem_count);
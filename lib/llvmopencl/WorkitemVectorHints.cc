@@ -0,0 +1,170 @@
+// LLVM function pass that prepares the work-item loops for vectorizing
+// one work-item per SIMD lane with the loop vectorizer.
+//
+// Copyright (c) 2022 pocl developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "config.h"
+
+#include "CompilerWarnings.h"
+IGNORE_COMPILER_WARNING("-Wunused-parameter")
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#ifndef LLVM_OLDER_THAN_11_0
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#endif
+
+#include "LLVMUtils.h"
+#include "VariableUniformityAnalysis.h"
+#include "Workgroup.h"
+#include "WorkitemHandlerChooser.h"
+#include "WorkitemVectorHints.h"
+#include "pocl_llvm_api.h"
+
+POP_COMPILER_DIAGS
+
+#define DEBUG_TYPE "workitem-vector-hints"
+
+STATISTIC(NumVectorizedCalls,
+          "Number of builtin calls given a vector variant");
+
+namespace pocl {
+
+using namespace llvm;
+
+namespace {
+static RegisterPass<pocl::WorkitemVectorHints>
+    X("workitem-vector-hints",
+      "Prepare work-item loops for vectorization across work-items.");
+}
+
+char WorkitemVectorHints::ID = 0;
+
+WorkitemVectorHints::WorkitemVectorHints() : FunctionPass(ID) {}
+
+void WorkitemVectorHints::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<VariableUniformityAnalysis>();
+  AU.addPreserved<VariableUniformityAnalysis>();
+  AU.addRequired<WorkitemHandlerChooser>();
+  AU.addPreserved<WorkitemHandlerChooser>();
+  AU.setPreservesCFG();
+}
+
+#ifndef LLVM_OLDER_THAN_11_0
+
+static void addLoopHint(Loop &L, StringRef Name, Metadata *Value) {
+  LLVMContext &C = L.getHeader()->getContext();
+  MDNode *LoopID = L.getLoopID();
+  SmallVector<Metadata *, 4> MDs;
+  // Reserve the first operand for the self reference.
+  MDs.push_back(nullptr);
+  if (LoopID != nullptr)
+    for (unsigned i = 1; i < LoopID->getNumOperands(); ++i)
+      MDs.push_back(LoopID->getOperand(i));
+  MDs.push_back(MDNode::get(C, {MDString::get(C, Name), Value}));
+  MDNode *NewLoopID = MDNode::getDistinct(C, MDs);
+  NewLoopID->replaceOperandWith(0, NewLoopID);
+  L.setLoopID(NewLoopID);
+}
+
+#endif
+
+/* Calls to math builtins are a common reason for the loop vectorizer to
+ * give up on a work-item loop. Declare the matching vector overloads of the
+ * kernel library (linked in by the kernel compiler, see
+ * pocl_llvm_generate_workgroup_function_nowrite()) as vector variants of
+ * the calls through the vector-function-abi-variant attribute, and ask the
+ * vectorizer for the device's native width in the loops containing them.
+ * Calls with uniform results stay scalar: the vectorizer computes them once
+ * per vector iteration. The vectorizer if-converts the divergent branches of
+ * the loop body to masked code. */
+bool WorkitemVectorHints::runOnFunction(Function &F) {
+#ifdef LLVM_OLDER_THAN_11_0
+  return false;
+#else
+  if (!Workgroup::isKernelToProcess(F))
+    return false;
+
+  if (getAnalysis<WorkitemHandlerChooser>().chosenHandler() !=
+      WorkitemHandlerChooser::POCL_WIH_LOOPS)
+    return false;
+
+  Module *M = F.getParent();
+  unsigned long WidthFloat = 0, WidthDouble = 0;
+  getModuleIntMetadata(*M, "device_native_vector_width_float", WidthFloat);
+  getModuleIntMetadata(*M, "device_native_vector_width_double", WidthDouble);
+
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  VariableUniformityAnalysis &VUA = getAnalysis<VariableUniformityAnalysis>();
+
+  std::map<Loop *, unsigned> LoopWidths;
+  for (BasicBlock &BB : F) {
+    Loop *L = LI.getLoopFor(&BB);
+    // Only the innermost loops are vectorized.
+    if (L == nullptr || !isWorkItemLoop(*L))
+      continue;
+    for (Instruction &I : BB) {
+      CallInst *Call = dyn_cast<CallInst>(&I);
+      if (Call == nullptr || Call->getCalledFunction() == nullptr ||
+          Call->hasFnAttr("vector-function-abi-variant"))
+        continue;
+      Function *Callee = Call->getCalledFunction();
+      unsigned Width = isDoubleBuiltin(*Callee) ? WidthDouble : WidthFloat;
+      std::string VecName = getVectorBuiltinName(*Callee, Width);
+      if (VecName.empty())
+        continue;
+      Function *VecFunc = M->getFunction(VecName);
+      if (VecFunc == nullptr || VecFunc->isDeclaration())
+        continue;
+      if (VUA.isUniform(&F, Call))
+        continue;
+      // The vectorizer uses a single width per loop.
+      auto LW = LoopWidths.find(L);
+      if (LW != LoopWidths.end() && LW->second != Width)
+        continue;
+
+      std::string Variant = "_ZGV_LLVM_N" + std::to_string(Width) +
+                            std::string(Callee->arg_size(), 'v') + "_" +
+                            Callee->getName().str() + "(" + VecName + ")";
+      VFABI::setVectorVariantNames(Call, {Variant});
+      LoopWidths[L] = Width;
+      ++NumVectorizedCalls;
+    }
+  }
+
+  LLVMContext &C = F.getContext();
+  for (auto &LW : LoopWidths) {
+    addLoopHint(*LW.first, "llvm.loop.vectorize.width",
+                ConstantAsMetadata::get(
+                    ConstantInt::get(Type::getInt32Ty(C), LW.second)));
+    addLoopHint(*LW.first, "llvm.loop.vectorize.enable",
+                ConstantAsMetadata::get(ConstantInt::getTrue(C)));
+  }
+
+  return !LoopWidths.empty();
+#endif
+}
+}
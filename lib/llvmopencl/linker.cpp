@@ -30,6 +30,7 @@
 #include <list>
 #include <iostream>
 #include <set>
+#include <vector>
 
 #include "config.h"
 #include "pocl.h"
@@ -39,8 +40,10 @@
 IGNORE_COMPILER_WARNING("-Wunused-parameter")
 
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
@@ -160,12 +163,26 @@ CloneFuncFixOpenCLImageT(llvm::Module *Mod, llvm::Function *F, unsigned AS)
     return DstFunc;
 }
 
+// The kernel library is loaded lazily, its function bodies are read
+// from the bitcode when first needed.
+static void
+materialize_func(llvm::Function *F)
+{
+  if (!F->isMaterializable())
+    return;
+  if (llvm::Error E = F->materialize()) {
+    DB_PRINT("could not materialize %s\n", F->getName().data());
+    llvm::consumeError(std::move(E));
+  }
+}
+
 // Find all functions in the calltree of F, append their
 // name to list.
 static inline void
 find_called_functions(llvm::Function *F,
                       std::list<llvm::StringRef> &list)
 {
+  materialize_func(F);
   if (F->isDeclaration()) {
     DB_PRINT("it's a declaration.\n");
     return;
@@ -216,6 +233,7 @@ CopyFunc(const llvm::StringRef Name,
     llvm::Function *SrcFunc = From->getFunction(Name);
     // TODO: is this the linker error "not found", and not an assert?
     assert(SrcFunc && "Did not find function to copy in kernel library");
+    materialize_func(SrcFunc);
     llvm::Function *DstFunc = To->getFunction(Name);
 
     if (DstFunc == NULL) {
@@ -254,39 +272,81 @@ CopyFunc(const llvm::StringRef Name,
     }
 }
 
+// Returns the functions to copy for F, callees first, from the call graph
+// cache, walking the bodies only of the functions not in it yet.
+static const std::vector<llvm::StringRef> &
+callgraph_order(llvm::Function *F, LinkerCallGraph &CallGraph)
+{
+  LinkerCallGraph::iterator Found = CallGraph.find(F);
+  if (Found != CallGraph.end())
+    return Found->second;
+
+  // Reserve the entry first: a recursive call finds it empty, so cycles end.
+  std::vector<llvm::StringRef> &Order = CallGraph[F];
+  std::list<llvm::StringRef> Callees;
+  std::set<llvm::StringRef> Added;
+
+  // Only the direct callees of F; theirs come from their own entries.
+  materialize_func(F);
+  if (!F->isDeclaration()) {
+    for (llvm::BasicBlock &BB : *F) {
+      for (llvm::Instruction &I : BB) {
+        CallInst *CI = dyn_cast<CallInst>(&I);
+        if (CI == NULL)
+          continue;
+        llvm::Function *Callee = CI->getCalledFunction();
+        // this happens with e.g. inline asm calls
+        if (Callee == NULL)
+          continue;
+        if (Callee->getCallingConv() == llvm::CallingConv::SPIR_FUNC ||
+            CI->getCallingConv() == llvm::CallingConv::SPIR_FUNC) {
+          // Loosen the CC to the default one, like find_called_functions().
+          Callee->setCallingConv(llvm::CallingConv::C);
+          CI->setCallingConv(llvm::CallingConv::C);
+        }
+        if (Callee != F && !find_from_list(Callee->getName(), Callees))
+          Callees.push_back(Callee->getName());
+      }
+    }
+  }
+
+  std::vector<llvm::StringRef> Result;
+  for (llvm::StringRef Name : Callees) {
+    llvm::Function *Callee = F->getParent()->getFunction(Name);
+    for (llvm::StringRef N : callgraph_order(Callee, CallGraph))
+      if (Added.insert(N).second)
+        Result.push_back(N);
+  }
+  if (Added.insert(F->getName()).second)
+    Result.push_back(F->getName());
+
+  // the references into the map stay valid across the insertions
+  Order.swap(Result);
+  return Order;
+}
+
 /* Copy function F and all the functions in its call graph
  * that are defined in 'from', into 'to', adding the mappings to
- * 'vvm'.
+ * 'vvm'. The call graphs of the functions of 'from' are memoized in
+ * 'callgraph'.
  */
 static int
 copy_func_callgraph(const llvm::StringRef func_name,
                     const llvm::Module *  from,
                     llvm::Module *        to,
                     ValueToValueMapTy &   vvm,
-                    unsigned AS) {
-    std::list<llvm::StringRef> callees;
+                    unsigned AS,
+                    LinkerCallGraph &     callgraph) {
     llvm::Function *RootFunc = from->getFunction(func_name);
     if (RootFunc == NULL)
       return -1;
     DB_PRINT("copying function %s with callgraph\n", RootFunc->getName().data());
 
-    find_called_functions(RootFunc, callees);
-
-    // First copy the callees of func, then the function itself.
-    // Recurse into callees to handle the case where kernel library
-    // functions call other kernel library functions.
-    std::list<llvm::StringRef>::iterator ci,ce;
-    for (ci = callees.begin(), ce = callees.end(); ci != ce; ci++) {
-      llvm::Function *SrcFunc = from->getFunction(*ci);
-      if (!SrcFunc->isDeclaration()) {
-        copy_func_callgraph(*ci, from, to, vvm, AS);
-      } else {
-        DB_PRINT("%s is declaration, not recursing into it!\n",
-		 SrcFunc->getName().str().c_str());
-      }
-      CopyFunc(*ci, from, to, vvm, AS);
-    }
-    CopyFunc(func_name, from, to, vvm, AS);
+    // The callees of func come before it, and the callees of kernel
+    // library functions before them, so each function is copied after
+    // everything it calls is mapped.
+    for (llvm::StringRef Name : callgraph_order(RootFunc, callgraph))
+      CopyFunc(Name, from, to, vvm, AS);
     return 0;
 }
 
@@ -408,13 +468,219 @@ void unifyPrintfFingerPrint(llvm::Module *Program, const llvm::Module *Lib) {
 }
 #endif
 
+// The functions Clang lowers the OpenCL 2.0 pipe builtins to, and the
+// is_valid_reserve_id() builtin.
+static const char *PipeBuiltins[] = {
+    "__read_pipe_2", "__write_pipe_2", "__read_pipe_4", "__write_pipe_4",
+    "__reserve_read_pipe", "__reserve_write_pipe", "__commit_read_pipe",
+    "__commit_write_pipe", "__work_group_reserve_read_pipe",
+    "__work_group_reserve_write_pipe", "__work_group_commit_read_pipe",
+    "__work_group_commit_write_pipe", "__sub_group_reserve_read_pipe",
+    "__sub_group_reserve_write_pipe", "__sub_group_commit_read_pipe",
+    "__sub_group_commit_write_pipe", "__get_pipe_num_packets_ro",
+    "__get_pipe_num_packets_wo", "__get_pipe_max_packets_ro",
+    "__get_pipe_max_packets_wo", "_Z19is_valid_reserve_id13ocl_reserveid",
+    nullptr};
+
+// Redirects the calls of Called to a declaration with the fingerprint of
+// LibFunc, casting the pointer arguments and the result. The calls get the
+// attributes of LibFunc, so that a byval or sret argument is passed the way
+// the library function takes it.
+static void redirectToLibFingerPrint(llvm::Module *Program,
+                                     llvm::Function *Called,
+                                     const llvm::Function *LibFunc) {
+  std::string Name = Called->getName().str();
+  llvm::FunctionType *FT = LibFunc->getFunctionType();
+  Called->setName("_old" + Name);
+  llvm::Function *NewFunc =
+      Function::Create(FT, LibFunc->getLinkage(), Name, Program);
+
+  std::vector<llvm::CallInst *> Calls;
+  for (llvm::User *U : Called->users())
+    if (llvm::CallInst *Call = dyn_cast<llvm::CallInst>(U))
+      Calls.push_back(Call);
+  for (llvm::CallInst *Call : Calls) {
+    IRBuilder<> Builder(Call);
+    std::vector<llvm::Value *> Args;
+    for (unsigned i = 0; i < FT->getNumParams(); ++i) {
+      llvm::Value *Arg = Call->getArgOperand(i);
+      if (Arg->getType() != FT->getParamType(i))
+        Arg = Builder.CreatePointerBitCastOrAddrSpaceCast(
+            Arg, FT->getParamType(i));
+      Args.push_back(Arg);
+    }
+    llvm::CallInst *NewCall = Builder.CreateCall(NewFunc, Args);
+    NewCall->setAttributes(LibFunc->getAttributes());
+    llvm::Value *Result = NewCall;
+    if (Result->getType() != Call->getType() &&
+        !Call->getType()->isVoidTy())
+      Result = Builder.CreatePointerBitCastOrAddrSpaceCast(Result,
+                                                           Call->getType());
+    if (!Call->getType()->isVoidTy())
+      Call->replaceAllUsesWith(Result);
+    Call->eraseFromParent();
+  }
+  if (Called->use_empty())
+    Called->eraseFromParent();
+}
+
+// The pipe builtins get the pipes and the reservation ids as pointers to
+// the opaque opencl.pipe_ro_t, opencl.pipe_wo_t and opencl.reserve_id_t
+// types, which the C implementations in the kernel library (pipes.c) see
+// as plain pointers. Like with the printf above, the calls are redirected
+// to declarations with the library's fingerprint, casting the pointers.
+static void unifyPipeFingerPrints(llvm::Module *Program,
+                                  const llvm::Module *Lib) {
+  for (const char **Name = PipeBuiltins; *Name != nullptr; ++Name) {
+    llvm::Function *Called = Program->getFunction(*Name);
+    const llvm::Function *LibFunc = Lib->getFunction(*Name);
+    if (Called == nullptr || LibFunc == nullptr ||
+        Called->getFunctionType() == LibFunc->getFunctionType() ||
+        Called->arg_size() != LibFunc->arg_size())
+      continue;
+    redirectToLibFingerPrint(Program, Called, LibFunc);
+  }
+}
+
+// The functions Clang lowers enqueue_kernel() and the kernel queries of the
+// blocks to, and the mangled names of the other device-side enqueue
+// builtins.
+static const char *DeviceEnqueueBuiltins[] = {
+    "__enqueue_kernel_", "__get_kernel_", "_Z10ndrange_1D", "_Z10ndrange_2D",
+    "_Z10ndrange_3D", "_Z14enqueue_marker", "_Z12retain_event",
+    "_Z13release_event", "_Z17create_user_event", "_Z21set_user_event_status",
+    "_Z14is_valid_event", "_Z17get_default_queue", nullptr};
+
+// Like the pipe builtins, the device-side enqueue builtins get pointers to
+// the opaque opencl.queue_t and opencl.clk_event_t types, and the ndrange_t
+// struct, which is a different type in each module of the LLVM context.
+// The kernel library functions (enqueue_kernel.c, device_enqueue.cl) take
+// their own ndrange_t, and plain pointers for the rest.
+static void unifyDeviceEnqueueFingerPrints(llvm::Module *Program,
+                                           const llvm::Module *Lib) {
+  std::vector<llvm::Function *> Declarations;
+  for (llvm::Function &F : *Program) {
+    if (!F.isDeclaration())
+      continue;
+    for (const char **Prefix = DeviceEnqueueBuiltins; *Prefix != nullptr;
+         ++Prefix)
+      if (F.getName().startswith(*Prefix)) {
+        Declarations.push_back(&F);
+        break;
+      }
+  }
+
+  for (llvm::Function *Called : Declarations) {
+    const llvm::Function *LibFunc = Lib->getFunction(Called->getName());
+    if (LibFunc == nullptr ||
+        Called->getFunctionType() == LibFunc->getFunctionType() ||
+        Called->arg_size() != LibFunc->arg_size())
+      continue;
+    redirectToLibFingerPrint(Program, Called, LibFunc);
+  }
+}
+
+// The builtins of which the kernel library can have _cl_relaxed_ versions:
+// the native_ ones, and the standard ones the relaxed math mode allows to
+// be less accurate.
+static const char *RelaxedNativeBuiltins[] = {
+    "exp",  "exp2", "exp10", "log",   "log2",  "log10", "sin",
+    "cos",  "tan",  "powr",  "rsqrt", "recip", "divide", nullptr};
+static const char *RelaxedStandardBuiltins[] = {
+    "exp", "exp2", "exp10", "log", "log2", "log10",
+    "sin", "cos",  "tan",   "powr", nullptr};
+
+// Returns the name of the relaxed precision version of the given mangled
+// builtin, or an empty string if it has none.
+static std::string getRelaxedBuiltinName(llvm::StringRef Name,
+                                         bool RelaxedMath) {
+  // Itanium mangling: _Z<name length><name><parameter types>.
+  if (!Name.consume_front("_Z"))
+    return "";
+  unsigned NameLen;
+  if (Name.consumeInteger(10, NameLen) || NameLen > Name.size())
+    return "";
+  StringRef BaseName = Name.take_front(NameLen);
+  StringRef Params = Name.drop_front(NameLen);
+
+  // The builtins are renamed in the kernel library, see _builtin_renames.h.
+  if (!BaseName.consume_front("_cl_"))
+    return "";
+  const char **Builtins = RelaxedStandardBuiltins;
+  if (BaseName.consume_front("native_"))
+    Builtins = RelaxedNativeBuiltins;
+  else if (!RelaxedMath)
+    return "";
+  while (*Builtins != nullptr && BaseName != *Builtins)
+    ++Builtins;
+  if (*Builtins == nullptr)
+    return "";
+
+  std::string Relaxed = "_cl_relaxed_" + BaseName.str();
+  return "_Z" + std::to_string(Relaxed.size()) + Relaxed + Params.str();
+}
+
+// Redirects the calls to the math builtins that have relaxed precision
+// versions in the kernel library to them.
+static void bindRelaxedBuiltins(llvm::Module *Program, const llvm::Module *Lib,
+                                bool RelaxedMath) {
+  std::vector<llvm::Function *> Declarations;
+  for (llvm::Function &F : *Program)
+    if (F.isDeclaration())
+      Declarations.push_back(&F);
+
+  for (llvm::Function *F : Declarations) {
+    std::string RelaxedName = getRelaxedBuiltinName(F->getName(), RelaxedMath);
+    if (RelaxedName.empty())
+      continue;
+    const llvm::Function *LibF = Lib->getFunction(RelaxedName);
+    if (LibF == nullptr || LibF->getFunctionType() != F->getFunctionType())
+      continue;
+    DB_PRINT("binding %s to %s\n", F->getName().data(), RelaxedName.c_str());
+    llvm::Function *Relaxed = Program->getFunction(RelaxedName);
+    if (Relaxed == nullptr) {
+      Relaxed = Function::Create(F->getFunctionType(), F->getLinkage(),
+                                 RelaxedName, Program);
+      Relaxed->copyAttributesFrom(F);
+    }
+    F->replaceAllUsesWith(Relaxed);
+    F->eraseFromParent();
+  }
+}
+
+// Allows the approximate forms of the floating point operations in the
+// relaxed precision builtins copied from the kernel library. This lets the
+// backend, for example, use the reciprocal square root estimate refined
+// with a Newton-Raphson step for rsqrt. NaNs and infinities are kept,
+// as the builtins saturate to them.
+static void relaxBuiltinMath(llvm::Module *Program) {
+  llvm::FastMathFlags FMF;
+  FMF.setAllowReciprocal();
+  FMF.setApproxFunc();
+  FMF.setAllowContract(true);
+  FMF.setNoSignedZeros();
+  for (llvm::Function &F : *Program) {
+    if (F.isDeclaration() || !(F.getName().contains("_cl_relaxed_") ||
+                               F.getName().contains("_pocl_relaxed_")))
+      continue;
+    for (llvm::BasicBlock &BB : F)
+      for (llvm::Instruction &I : BB)
+        if (isa<FPMathOperator>(&I))
+          I.setFastMathFlags(FMF);
+  }
+}
+
 int link(llvm::Module *Program, const llvm::Module *Lib, std::string &log,
-         unsigned global_AS, const char **DevAuxFuncs) {
+         unsigned global_AS, const char **DevAuxFuncs, bool RelaxedMath,
+         LinkerCallGraph *LibCallGraph) {
 
   assert(Program);
   assert(Lib);
   ValueToValueMapTy vvm;
   std::list<llvm::StringRef> declared;
+  LinkerCallGraph LocalCallGraph;
+  if (LibCallGraph == nullptr)
+    LibCallGraph = &LocalCallGraph;
 
 #ifndef LLVM_OLDER_THAN_10_0
   // LLVM 9 misses some of the APIs needed by this function. We don't support
@@ -422,6 +688,12 @@ int link(llvm::Module *Program, const llvm::Module *Lib, std::string &log,
   unifyPrintfFingerPrint(Program, Lib);
 #endif
 
+  unifyPipeFingerPrints(Program, Lib);
+
+  unifyDeviceEnqueueFingerPrints(Program, Lib);
+
+  bindRelaxedBuiltins(Program, Lib, RelaxedMath);
+
   // Include auxiliary functions required by the device at hand.
   if (DevAuxFuncs) {
     const char **Func = DevAuxFuncs;
@@ -497,7 +769,8 @@ int link(llvm::Module *Program, const llvm::Module *Lib, std::string &log,
   for (di = declared.begin(), de = declared.end();
        di != de; di++) {
       llvm::StringRef r = *di;
-      if (copy_func_callgraph(r, Lib, Program, vvm, global_AS)) {
+      if (copy_func_callgraph(r, Lib, Program, vvm, global_AS,
+                              *LibCallGraph)) {
         Function *f = Program->getFunction(r);
         if ((f == NULL) ||
             (f->isDeclaration() &&
@@ -505,6 +778,9 @@ int link(llvm::Module *Program, const llvm::Module *Lib, std::string &log,
              // the OpenCL 1.2 printf.
              !f->getName().equals("printf") &&
              !f->getName().equals(pocl_sampler_handler) &&
+             // The work-group collectives are lowered by the kernel
+             // compiler, see WorkgroupCollectives.cc.
+             pocl::getWorkgroupCollectiveName(f->getName()).empty() &&
              !f->getName().startswith(llvm_intrins))
            ) {
           log.append("Cannot find symbol ");
@@ -520,6 +796,64 @@ int link(llvm::Module *Program, const llvm::Module *Lib, std::string &log,
 
   shared_copy(Program, Lib, log, vvm);
 
+  relaxBuiltinMath(Program);
+
+  return 0;
+}
+
+int linkFunctions(llvm::Module *Program, const llvm::Module *Lib,
+                  const char **Funcs, unsigned global_AS,
+                  LinkerCallGraph *LibCallGraph) {
+  ValueToValueMapTy vvm;
+  LinkerCallGraph LocalCallGraph;
+  if (LibCallGraph == nullptr)
+    LibCallGraph = &LocalCallGraph;
+
+  // Map the globals of lib to the ones of the same name the earlier
+  // linking copied, and declare the rest.
+  std::vector<const GlobalVariable *> NewGlobals;
+  for (const GlobalVariable &LibGV : Lib->globals()) {
+    GlobalVariable *GV = Program->getNamedGlobal(LibGV.getName());
+    if (GV == nullptr) {
+      GV = new GlobalVariable(
+          *Program, LibGV.getValueType(), LibGV.isConstant(),
+          LibGV.getLinkage(), (Constant *)0, LibGV.getName(),
+          (GlobalVariable *)0, LibGV.getThreadLocalMode(),
+          LibGV.getType()->getAddressSpace());
+      GV->copyAttributesFrom(&LibGV);
+      NewGlobals.push_back(&LibGV);
+    }
+    vvm[&LibGV] = GV;
+  }
+
+  for (const char **Func = Funcs; *Func != nullptr; ++Func) {
+    llvm::Function *F = Program->getFunction(*Func);
+    if (F != nullptr && !F->isDeclaration())
+      continue;
+    if (copy_func_callgraph(*Func, Lib, Program, vvm, global_AS,
+                            *LibCallGraph))
+      return 1;
+  }
+
+  // Initialize the new globals the copied functions use, and the ones
+  // their initializers refer to, and drop the others.
+  std::set<const GlobalVariable *> Used;
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (const GlobalVariable *LibGV : NewGlobals) {
+      GlobalVariable *GV = cast<GlobalVariable>(vvm[LibGV]);
+      if (GV->use_empty() || !Used.insert(LibGV).second)
+        continue;
+      if (LibGV->hasInitializer())
+        GV->setInitializer(MapValue(LibGV->getInitializer(), vvm));
+      Changed = true;
+    }
+  }
+  for (const GlobalVariable *LibGV : NewGlobals)
+    if (Used.count(LibGV) == 0)
+      cast<GlobalVariable>(vvm[LibGV])->eraseFromParent();
+
   return 0;
 }
 
@@ -527,6 +861,7 @@ int copyKernelFromBitcode(const char* name, llvm::Module *parallel_bc,
                           const llvm::Module *program, unsigned global_AS,
                           const char **DevAuxFuncs) {
   ValueToValueMapTy vvm;
+  LinkerCallGraph CallGraph;
 
   // Copy all the globals from lib to program.
   // It probably is faster to just copy them all, than to inspect
@@ -544,12 +879,14 @@ int copyKernelFromBitcode(const char* name, llvm::Module *parallel_bc,
   }
 
   const StringRef kernel_name(name);
-  copy_func_callgraph(kernel_name, program, parallel_bc, vvm, global_AS);
+  copy_func_callgraph(kernel_name, program, parallel_bc, vvm, global_AS,
+                      CallGraph);
 
   if (DevAuxFuncs) {
     const char **Func = DevAuxFuncs;
     while (*Func != nullptr) {
-      copy_func_callgraph(*Func++, program, parallel_bc, vvm, global_AS);
+      copy_func_callgraph(*Func++, program, parallel_bc, vvm, global_AS,
+                          CallGraph);
     }
   }
 
@@ -4,10 +4,22 @@
 #include "llvm/IR/Module.h"
 #include "llvm/ADT/StringRef.h"
 
+#include <map>
+#include <vector>
+
 #ifdef __GNUC__
 #pragma GCC visibility push(hidden)
 #endif
 
+/**
+ * The functions to copy from a module for linking each of its functions,
+ * i.e. its call graph in the copying order (callees first). Filled in on
+ * demand by the linker; keeping it with a kernel library module turns
+ * linking the builtins a later program uses into lookups.
+ */
+typedef std::map<const llvm::Function *, std::vector<llvm::StringRef>>
+    LinkerCallGraph;
+
 /**
  * Link in module lib to krn.
  * This function searches for each undefined symbol 
@@ -16,9 +28,26 @@
  * running DCE.
  *
  * log is used to report errors if we run into undefined symbols
+ *
+ * The native_ math builtins are bound to their relaxed precision versions
+ * in lib if it has them, and with RelaxedMath also the standard builtins
+ * the relaxed math mode of OpenCL C allows to be less accurate.
  */
 int link(llvm::Module *krn, const llvm::Module *lib, std::string &log,
-         unsigned global_AS, const char **DevAuxFuncs);
+         unsigned global_AS, const char **DevAuxFuncs,
+         bool RelaxedMath = false, LinkerCallGraph *LibCallGraph = nullptr);
+
+/**
+ * Copy the functions of lib listed in funcs, a nullptr terminated array,
+ * with their call graphs to krn, unless krn defines them already. For the
+ * builtins the kernel compiler passes add calls to after the kernel was
+ * linked. The globals krn has already are shared, not copied again.
+ *
+ * Returns non-zero if lib lacks one of the functions.
+ */
+int linkFunctions(llvm::Module *krn, const llvm::Module *lib,
+                  const char **funcs, unsigned global_AS,
+                  LinkerCallGraph *LibCallGraph = nullptr);
 
 int copyKernelFromBitcode(const char *name, llvm::Module *parallel_bc,
                           const llvm::Module *program, unsigned global_AS,
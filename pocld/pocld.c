@@ -0,0 +1,1658 @@
+/* pocld.c - a daemon serving the OpenCL devices of a node to the remote
+   driver of pocl on other nodes
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+/* Each client connection is a session with an OpenCL context of all the
+ * devices of the platform served. The connection thread enqueues the
+ * commands of the session without blocking, with the events of the earlier
+ * commands the client lists as their wait lists, and the event callbacks
+ * reply to the client as they complete. The migrations from the buffers of
+ * another pocld are pulled from it by a helper thread per migration. */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <CL/opencl.h>
+
+#include "remote_protocol.h"
+#include "utlist.h"
+
+#define POCLD_BUCKETS 256
+/* the largest POD argument size tried to find out the size of an argument */
+#define MAX_TESTED_ARG_SIZE 128
+
+#define POCLD_LOG(...)                                                        \
+  do                                                                          \
+    {                                                                         \
+      fprintf (stderr, "pocld: " __VA_ARGS__);                                \
+    }                                                                         \
+  while (0)
+
+typedef enum
+{
+  POCLD_BUFFER,
+  POCLD_PROGRAM,
+  POCLD_KERNEL,
+  POCLD_QUEUE,
+  POCLD_EVENT,
+} pocld_kind;
+
+/* An OpenCL object of a session, by the id the client gave it */
+typedef struct pocld_object_s
+{
+  uint64_t id;
+  pocld_kind kind;
+  void *obj;
+  /* the device of a buffer or a queue */
+  cl_uint device;
+  struct pocld_object_s *next;
+} pocld_object_t;
+
+typedef struct pocld_session_s
+{
+  uint64_t id;
+  int fd;
+  /* held while a reply is written, by the connection thread and the event
+   * callbacks */
+  pthread_mutex_t send_lock;
+
+  /* protects objects, inflight and queues_dirty */
+  pthread_mutex_t lock;
+  pocld_object_t *objects[POCLD_BUCKETS];
+  /* the commands and the peer reads that still use the session */
+  unsigned inflight;
+  pthread_cond_t idle_cond;
+  /* commands were enqueued since the queues were last flushed */
+  int queues_dirty;
+
+  cl_context context;
+  cl_uint num_devices;
+  cl_device_id *devices;
+  /* a queue per device for the migrations between the servers */
+  cl_command_queue *io_queues;
+
+  struct pocld_session_s *next;
+} pocld_session_t;
+
+/* What the completion of a command frees and replies with */
+typedef struct
+{
+  pocld_session_t *session;
+  uint64_t id;
+  /* the payload of the message, or the staging memory of a read */
+  char *data;
+  /* the bytes of data the command completes with, 0 for no data */
+  size_t reply_size;
+  /* the sub-buffers of the kernel arguments */
+  cl_mem *tmp_mems;
+  unsigned num_tmp_mems;
+  /* the event, if it could not be added to the objects */
+  cl_event release_event;
+} pocld_completion_t;
+
+static cl_platform_id platform;
+static pocld_session_t *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t last_session_id = 0;
+
+/*****************************************************************************/
+
+static pocld_object_t *
+pocld_find (pocld_session_t *s, uint64_t id, pocld_kind kind)
+{
+  pocld_object_t *o;
+  pthread_mutex_lock (&s->lock);
+  LL_FOREACH (s->objects[id % POCLD_BUCKETS], o)
+    {
+      if (o->id == id && o->kind == kind)
+        break;
+    }
+  pthread_mutex_unlock (&s->lock);
+  return o;
+}
+
+static void *
+pocld_find_obj (pocld_session_t *s, uint64_t id, pocld_kind kind)
+{
+  pocld_object_t *o = pocld_find (s, id, kind);
+  return o ? o->obj : NULL;
+}
+
+static int
+pocld_add (pocld_session_t *s, uint64_t id, pocld_kind kind, void *obj,
+           cl_uint device)
+{
+  pocld_object_t *o = (pocld_object_t *)calloc (1, sizeof (pocld_object_t));
+  if (o == NULL)
+    return -1;
+  o->id = id;
+  o->kind = kind;
+  o->obj = obj;
+  o->device = device;
+  pthread_mutex_lock (&s->lock);
+  LL_PREPEND (s->objects[id % POCLD_BUCKETS], o);
+  pthread_mutex_unlock (&s->lock);
+  return 0;
+}
+
+static void
+pocld_release_obj (pocld_kind kind, void *obj)
+{
+  switch (kind)
+    {
+    case POCLD_BUFFER:
+      clReleaseMemObject ((cl_mem)obj);
+      break;
+    case POCLD_PROGRAM:
+      clReleaseProgram ((cl_program)obj);
+      break;
+    case POCLD_KERNEL:
+      clReleaseKernel ((cl_kernel)obj);
+      break;
+    case POCLD_QUEUE:
+      clFinish ((cl_command_queue)obj);
+      clReleaseCommandQueue ((cl_command_queue)obj);
+      break;
+    case POCLD_EVENT:
+      clReleaseEvent ((cl_event)obj);
+      break;
+    }
+}
+
+/* Forgets the object and releases it. The unknown ids are ignored: the
+ * objects that failed to be created are freed too. */
+static void
+pocld_remove (pocld_session_t *s, uint64_t id, pocld_kind kind)
+{
+  pocld_object_t *o;
+  pthread_mutex_lock (&s->lock);
+  LL_FOREACH (s->objects[id % POCLD_BUCKETS], o)
+    {
+      if (o->id == id && o->kind == kind)
+        {
+          LL_DELETE (s->objects[id % POCLD_BUCKETS], o);
+          break;
+        }
+    }
+  pthread_mutex_unlock (&s->lock);
+  if (o == NULL)
+    return;
+  pocld_release_obj (o->kind, o->obj);
+  free (o);
+}
+
+/*****************************************************************************/
+
+static int
+pocld_send_reply (int fd, pthread_mutex_t *lock, uint32_t type, uint64_t id,
+                  int32_t status, const void *data, size_t size)
+{
+  remote_reply_header r;
+  int err;
+  memset (&r, 0, sizeof (r));
+  r.type = type;
+  r.id = id;
+  r.status = status;
+  r.payload_size = size;
+
+  if (lock)
+    pthread_mutex_lock (lock);
+  err = remote_send_all (fd, &r, sizeof (r));
+  if (err == 0 && size > 0)
+    err = remote_send_all (fd, data, size);
+  if (lock)
+    pthread_mutex_unlock (lock);
+  return err;
+}
+
+static void
+pocld_reply (pocld_session_t *s, uint64_t id, int32_t status,
+             const void *data, size_t size)
+{
+  pocld_send_reply (s->fd, &s->send_lock, REMOTE_MSG_REPLY, id, status, data,
+                    size);
+}
+
+static void
+pocld_free_completion (pocld_completion_t *c)
+{
+  unsigned i;
+  for (i = 0; i < c->num_tmp_mems; ++i)
+    clReleaseMemObject (c->tmp_mems[i]);
+  if (c->release_event)
+    clReleaseEvent (c->release_event);
+  free (c->tmp_mems);
+  free (c->data);
+  free (c);
+}
+
+static void CL_CALLBACK
+pocld_command_complete (cl_event event, cl_int status, void *user_data)
+{
+  pocld_completion_t *c = (pocld_completion_t *)user_data;
+  pocld_session_t *s = c->session;
+
+  /* a failed connection is noticed by the connection thread */
+  pocld_send_reply (s->fd, &s->send_lock, REMOTE_MSG_COMPLETE, c->id,
+                    status < 0 ? status : CL_SUCCESS, c->data,
+                    status < 0 ? 0 : c->reply_size);
+  pocld_free_completion (c);
+
+  pthread_mutex_lock (&s->lock);
+  --s->inflight;
+  pthread_cond_broadcast (&s->idle_cond);
+  pthread_mutex_unlock (&s->lock);
+}
+
+/* Registers the event of a command by its id, and replies when it
+ * completes. The completion is freed then. */
+static void
+pocld_track (pocld_session_t *s, cl_event event, pocld_completion_t *c)
+{
+  pthread_mutex_lock (&s->lock);
+  ++s->inflight;
+  s->queues_dirty = 1;
+  pthread_mutex_unlock (&s->lock);
+
+  /* the objects keep the event until the client releases it */
+  if (pocld_add (s, c->id, POCLD_EVENT, event, 0) != 0)
+    c->release_event = event;
+  clSetEventCallback (event, CL_COMPLETE, pocld_command_complete, c);
+}
+
+/* Fails a command that could not be enqueued, with an event of the error,
+ * so that the commands waiting for it fail too. */
+static void
+pocld_fail_command (pocld_session_t *s, pocld_completion_t *c, cl_int err)
+{
+  cl_event event = clCreateUserEvent (s->context, NULL);
+  if (event == NULL)
+    {
+      pocld_send_reply (s->fd, &s->send_lock, REMOTE_MSG_COMPLETE, c->id, err,
+                        NULL, 0);
+      pocld_free_completion (c);
+      return;
+    }
+  pocld_track (s, event, c);
+  clSetUserEventStatus (event, err < 0 ? err : CL_OUT_OF_RESOURCES);
+}
+
+static pocld_completion_t *
+pocld_new_completion (pocld_session_t *s, uint64_t id)
+{
+  pocld_completion_t *c
+      = (pocld_completion_t *)calloc (1, sizeof (pocld_completion_t));
+  if (c == NULL)
+    return NULL;
+  c->session = s;
+  c->id = id;
+  return c;
+}
+
+/* Reads the wait list of a command. The events the client already released
+ * have completed, and are left out. */
+static cl_event *
+pocld_get_wait_list (pocld_session_t *s, remote_stream *p, cl_uint *num)
+{
+  uint32_t n = remote_get_u32 (p), i;
+  cl_event *events = NULL;
+  *num = 0;
+  if (p->error || n == 0)
+    return NULL;
+  events = (cl_event *)calloc (n, sizeof (cl_event));
+  if (events == NULL)
+    {
+      p->error = 1;
+      return NULL;
+    }
+  for (i = 0; i < n; ++i)
+    {
+      cl_event e
+          = (cl_event)pocld_find_obj (s, remote_get_u64 (p), POCLD_EVENT);
+      if (e)
+        events[(*num)++] = e;
+    }
+  return events;
+}
+
+/*****************************************************************************/
+
+static int
+pocld_open_session (int fd, pocld_session_t **session)
+{
+  pocld_session_t *s = (pocld_session_t *)calloc (1, sizeof (pocld_session_t));
+  cl_int err;
+  if (s == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+
+  s->fd = fd;
+  pthread_mutex_init (&s->send_lock, NULL);
+  pthread_mutex_init (&s->lock, NULL);
+  pthread_cond_init (&s->idle_cond, NULL);
+
+  err = clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, 0, NULL,
+                        &s->num_devices);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  s->devices = (cl_device_id *)calloc (s->num_devices, sizeof (cl_device_id));
+  s->io_queues = (cl_command_queue *)calloc (s->num_devices,
+                                             sizeof (cl_command_queue));
+  if (s->devices == NULL || s->io_queues == NULL)
+    {
+      err = CL_OUT_OF_HOST_MEMORY;
+      goto ERROR;
+    }
+  err = clGetDeviceIDs (platform, CL_DEVICE_TYPE_ALL, s->num_devices,
+                        s->devices, NULL);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  s->context
+      = clCreateContext (NULL, s->num_devices, s->devices, NULL, NULL, &err);
+  if (err != CL_SUCCESS)
+    goto ERROR;
+  cl_uint i;
+  for (i = 0; i < s->num_devices; ++i)
+    {
+      s->io_queues[i]
+          = clCreateCommandQueue (s->context, s->devices[i], 0, &err);
+      if (err != CL_SUCCESS)
+        goto ERROR;
+    }
+
+  pthread_mutex_lock (&sessions_lock);
+  s->id = ++last_session_id;
+  LL_APPEND (sessions, s);
+  pthread_mutex_unlock (&sessions_lock);
+
+  *session = s;
+  return CL_SUCCESS;
+
+ERROR:
+  if (s->io_queues)
+    for (i = 0; i < s->num_devices; ++i)
+      if (s->io_queues[i])
+        clReleaseCommandQueue (s->io_queues[i]);
+  if (s->context)
+    clReleaseContext (s->context);
+  free (s->io_queues);
+  free (s->devices);
+  free (s);
+  return err;
+}
+
+static void pocld_flush_queues (pocld_session_t *s, int force);
+
+static void
+pocld_close_session (pocld_session_t *s)
+{
+  cl_uint i;
+  unsigned b;
+
+  pthread_mutex_lock (&sessions_lock);
+  LL_DELETE (sessions, s);
+  pthread_mutex_unlock (&sessions_lock);
+
+  pocld_flush_queues (s, 1);
+  pthread_mutex_lock (&s->lock);
+  while (s->inflight > 0)
+    pthread_cond_wait (&s->idle_cond, &s->lock);
+  pthread_mutex_unlock (&s->lock);
+
+  for (b = 0; b < POCLD_BUCKETS; ++b)
+    {
+      pocld_object_t *o, *tmp;
+      LL_FOREACH_SAFE (s->objects[b], o, tmp)
+        {
+          LL_DELETE (s->objects[b], o);
+          pocld_release_obj (o->kind, o->obj);
+          free (o);
+        }
+    }
+  for (i = 0; i < s->num_devices; ++i)
+    clReleaseCommandQueue (s->io_queues[i]);
+  clReleaseContext (s->context);
+
+  pthread_mutex_destroy (&s->send_lock);
+  pthread_mutex_destroy (&s->lock);
+  pthread_cond_destroy (&s->idle_cond);
+  free (s->io_queues);
+  free (s->devices);
+  free (s);
+}
+
+/* Flushes the queues of the session, once the client has sent all it had,
+ * so that the commands pipelined in the messages are batched. The queues
+ * are flushed unlocked, since a flush may run the event callbacks. */
+static void
+pocld_flush_queues (pocld_session_t *s, int force)
+{
+  cl_command_queue queues[64];
+  unsigned b, n = 0, i;
+  pocld_object_t *o;
+
+  pthread_mutex_lock (&s->lock);
+  if (!s->queues_dirty && !force)
+    {
+      pthread_mutex_unlock (&s->lock);
+      return;
+    }
+  s->queues_dirty = 0;
+  for (b = 0; b < POCLD_BUCKETS; ++b)
+    LL_FOREACH (s->objects[b], o)
+      {
+        if (o->kind != POCLD_QUEUE)
+          continue;
+        if (n == sizeof (queues) / sizeof (queues[0]))
+          {
+            /* flush the rest the next time */
+            s->queues_dirty = 1;
+            break;
+          }
+        clRetainCommandQueue ((cl_command_queue)o->obj);
+        queues[n++] = (cl_command_queue)o->obj;
+      }
+  pthread_mutex_unlock (&s->lock);
+
+  for (i = 0; i < n; ++i)
+    {
+      clFlush (queues[i]);
+      clReleaseCommandQueue (queues[i]);
+    }
+}
+
+/*****************************************************************************/
+
+#define INFO(field, param, type)                                              \
+  do                                                                          \
+    {                                                                         \
+      type v = 0;                                                             \
+      clGetDeviceInfo (dev, param, sizeof (v), &v, NULL);                     \
+      info->field = v;                                                        \
+    }                                                                         \
+  while (0)
+
+#define INFO_STR(field, param)                                                \
+  clGetDeviceInfo (dev, param, sizeof (info->field) - 1, info->field, NULL)
+
+static void
+pocld_device_info (cl_device_id dev, remote_device_info_t *info)
+{
+  size_t sizes[3] = { 0, 0, 0 };
+  memset (info, 0, sizeof (*info));
+
+  INFO (type, CL_DEVICE_TYPE, cl_device_type);
+  INFO (global_mem_size, CL_DEVICE_GLOBAL_MEM_SIZE, cl_ulong);
+  INFO (max_mem_alloc_size, CL_DEVICE_MAX_MEM_ALLOC_SIZE, cl_ulong);
+  INFO (global_mem_cache_size, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, cl_ulong);
+  INFO (local_mem_size, CL_DEVICE_LOCAL_MEM_SIZE, cl_ulong);
+  INFO (max_constant_buffer_size, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+        cl_ulong);
+  INFO (max_parameter_size, CL_DEVICE_MAX_PARAMETER_SIZE, size_t);
+  INFO (max_work_group_size, CL_DEVICE_MAX_WORK_GROUP_SIZE, size_t);
+  clGetDeviceInfo (dev, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof (sizes), sizes,
+                   NULL);
+  info->max_work_item_sizes[0] = sizes[0];
+  info->max_work_item_sizes[1] = sizes[1];
+  info->max_work_item_sizes[2] = sizes[2];
+  INFO (printf_buffer_size, CL_DEVICE_PRINTF_BUFFER_SIZE, size_t);
+  INFO (profiling_timer_resolution, CL_DEVICE_PROFILING_TIMER_RESOLUTION,
+        size_t);
+  INFO (single_fp_config, CL_DEVICE_SINGLE_FP_CONFIG, cl_device_fp_config);
+  INFO (double_fp_config, CL_DEVICE_DOUBLE_FP_CONFIG, cl_device_fp_config);
+
+  INFO (vendor_id, CL_DEVICE_VENDOR_ID, cl_uint);
+  INFO (max_compute_units, CL_DEVICE_MAX_COMPUTE_UNITS, cl_uint);
+  INFO (max_clock_frequency, CL_DEVICE_MAX_CLOCK_FREQUENCY, cl_uint);
+  INFO (address_bits, CL_DEVICE_ADDRESS_BITS, cl_uint);
+  INFO (mem_base_addr_align, CL_DEVICE_MEM_BASE_ADDR_ALIGN, cl_uint);
+  INFO (global_mem_cacheline_size, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE,
+        cl_uint);
+  INFO (global_mem_cache_type, CL_DEVICE_GLOBAL_MEM_CACHE_TYPE,
+        cl_device_mem_cache_type);
+  INFO (local_mem_type, CL_DEVICE_LOCAL_MEM_TYPE, cl_device_local_mem_type);
+  INFO (max_work_item_dimensions, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS,
+        cl_uint);
+  INFO (max_constant_args, CL_DEVICE_MAX_CONSTANT_ARGS, cl_uint);
+
+  INFO (native_vector_width[0], CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR, cl_uint);
+  INFO (native_vector_width[1], CL_DEVICE_NATIVE_VECTOR_WIDTH_SHORT, cl_uint);
+  INFO (native_vector_width[2], CL_DEVICE_NATIVE_VECTOR_WIDTH_INT, cl_uint);
+  INFO (native_vector_width[3], CL_DEVICE_NATIVE_VECTOR_WIDTH_LONG, cl_uint);
+  INFO (native_vector_width[4], CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, cl_uint);
+  INFO (native_vector_width[5], CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE,
+        cl_uint);
+  INFO (preferred_vector_width[0], CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR,
+        cl_uint);
+  INFO (preferred_vector_width[1], CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT,
+        cl_uint);
+  INFO (preferred_vector_width[2], CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT,
+        cl_uint);
+  INFO (preferred_vector_width[3], CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG,
+        cl_uint);
+  INFO (preferred_vector_width[4], CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,
+        cl_uint);
+  INFO (preferred_vector_width[5], CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE,
+        cl_uint);
+
+  INFO (endian_little, CL_DEVICE_ENDIAN_LITTLE, cl_bool);
+  INFO (error_correction_support, CL_DEVICE_ERROR_CORRECTION_SUPPORT,
+        cl_bool);
+  INFO (compiler_available, CL_DEVICE_COMPILER_AVAILABLE, cl_bool);
+  INFO (available, CL_DEVICE_AVAILABLE, cl_bool);
+
+  INFO_STR (name, CL_DEVICE_NAME);
+  INFO_STR (vendor, CL_DEVICE_VENDOR);
+  INFO_STR (version, CL_DEVICE_VERSION);
+  INFO_STR (driver_version, CL_DRIVER_VERSION);
+  INFO_STR (opencl_c_version, CL_DEVICE_OPENCL_C_VERSION);
+  INFO_STR (profile, CL_DEVICE_PROFILE);
+  INFO_STR (extensions, CL_DEVICE_EXTENSIONS);
+}
+
+#undef INFO
+#undef INFO_STR
+
+/* Writes a string the OpenCL info query returns */
+static void
+pocld_put_kernel_info_str (remote_stream *out, cl_kernel kernel,
+                           cl_kernel_info param)
+{
+  size_t size = 0;
+  char *str = NULL;
+  if (clGetKernelInfo (kernel, param, 0, NULL, &size) == CL_SUCCESS
+      && size > 0)
+    {
+      str = (char *)calloc (1, size + 1);
+      if (str)
+        clGetKernelInfo (kernel, param, size, str, NULL);
+    }
+  remote_put_str (out, str ? str : "");
+  free (str);
+}
+
+static void
+pocld_put_arg_info_str (remote_stream *out, cl_kernel kernel, cl_uint i,
+                        cl_kernel_arg_info param, char *str, size_t size)
+{
+  str[0] = 0;
+  clGetKernelArgInfo (kernel, i, param, size - 1, str, NULL);
+  str[size - 1] = 0;
+  remote_put_str (out, str);
+}
+
+/* Writes the metadata of a kernel. The sizes of the POD arguments can't be
+ * queried, so they are found out by trying clSetKernelArg with different
+ * sizes, like the proxy driver does. */
+static void
+pocld_put_kernel_metadata (remote_stream *out, cl_kernel kernel,
+                           cl_device_id dev)
+{
+  char type_name[1024];
+  char arg_name[1024];
+  char empty_buffer[MAX_TESTED_ARG_SIZE];
+  size_t reqd_wg_size[3] = { 0, 0, 0 };
+  cl_ulong local_mem_size = 0;
+  cl_uint num_args = 0, i;
+  size_t j;
+
+  memset (empty_buffer, 0, sizeof (empty_buffer));
+  pocld_put_kernel_info_str (out, kernel, CL_KERNEL_FUNCTION_NAME);
+  pocld_put_kernel_info_str (out, kernel, CL_KERNEL_ATTRIBUTES);
+  clGetKernelWorkGroupInfo (kernel, dev, CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                            sizeof (reqd_wg_size), reqd_wg_size, NULL);
+  for (i = 0; i < 3; ++i)
+    remote_put_u64 (out, reqd_wg_size[i]);
+  clGetKernelWorkGroupInfo (kernel, dev, CL_KERNEL_LOCAL_MEM_SIZE,
+                            sizeof (local_mem_size), &local_mem_size, NULL);
+  remote_put_u64 (out, local_mem_size);
+
+  clGetKernelInfo (kernel, CL_KERNEL_NUM_ARGS, sizeof (num_args), &num_args,
+                   NULL);
+  remote_put_u32 (out, num_args);
+
+  for (i = 0; i < num_args; ++i)
+    {
+      cl_kernel_arg_address_qualifier address_q = 0;
+      cl_kernel_arg_access_qualifier access_q = CL_KERNEL_ARG_ACCESS_NONE;
+      cl_kernel_arg_type_qualifier type_q = 0;
+      uint32_t kind = REMOTE_ARG_POD;
+      uint64_t type_size = 0;
+
+      clGetKernelArgInfo (kernel, i, CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+                          sizeof (address_q), &address_q, NULL);
+      clGetKernelArgInfo (kernel, i, CL_KERNEL_ARG_ACCESS_QUALIFIER,
+                          sizeof (access_q), &access_q, NULL);
+      clGetKernelArgInfo (kernel, i, CL_KERNEL_ARG_TYPE_QUALIFIER,
+                          sizeof (type_q), &type_q, NULL);
+      type_name[0] = 0;
+      clGetKernelArgInfo (kernel, i, CL_KERNEL_ARG_TYPE_NAME,
+                          sizeof (type_name) - 1, type_name, NULL);
+      type_name[sizeof (type_name) - 1] = 0;
+      size_t len = strlen (type_name);
+
+      if (access_q != CL_KERNEL_ARG_ACCESS_NONE)
+        {
+          kind = REMOTE_ARG_IMAGE;
+          type_size = sizeof (cl_mem);
+        }
+      else if (strncmp (type_name, "sampler_t", 9) == 0)
+        {
+          kind = REMOTE_ARG_SAMPLER;
+          type_size = sizeof (cl_sampler);
+        }
+      else if (len > 0 && type_name[len - 1] == '*')
+        {
+          kind = (address_q == CL_KERNEL_ARG_ADDRESS_LOCAL) ? REMOTE_ARG_LOCAL
+                                                            : REMOTE_ARG_BUFFER;
+          type_size = sizeof (cl_mem);
+        }
+      else
+        {
+          size_t successes = 0;
+          for (j = 1; j <= MAX_TESTED_ARG_SIZE; ++j)
+            {
+              if (clSetKernelArg (kernel, i, j, empty_buffer) == CL_SUCCESS)
+                {
+                  type_size = j;
+                  ++successes;
+                }
+            }
+          /* some implementations accept any argument size */
+          if (successes > 1)
+            {
+              POCLD_LOG ("can't find out the size of argument %u\n", i);
+              type_size = 0;
+            }
+        }
+
+      remote_put_u32 (out, kind);
+      remote_put_u32 (out, address_q);
+      remote_put_u32 (out, access_q);
+      remote_put_u64 (out, type_q);
+      remote_put_u64 (out, type_size);
+      remote_put_str (out, type_name);
+      pocld_put_arg_info_str (out, kernel, i, CL_KERNEL_ARG_NAME, arg_name,
+                              sizeof (arg_name));
+    }
+}
+
+static void
+pocld_build_program (pocld_session_t *s, remote_msg_header *h,
+                     remote_stream *p)
+{
+  remote_stream out = { 0 };
+  char *options = remote_get_str (p);
+  char *source = remote_get_str (p);
+  cl_device_id dev;
+  cl_program program = NULL;
+  cl_int err = CL_INVALID_VALUE;
+  char *log = NULL;
+
+  if (p->error || h->device >= s->num_devices || source == NULL)
+    goto REPLY;
+  dev = s->devices[h->device];
+
+  /* the client needs the argument info for the kernel metadata */
+  size_t options_len = options ? strlen (options) : 0;
+  char *build_options = (char *)malloc (options_len + 32);
+  if (build_options == NULL)
+    {
+      err = CL_OUT_OF_HOST_MEMORY;
+      goto REPLY;
+    }
+  snprintf (build_options, options_len + 32, "%s -cl-kernel-arg-info",
+            options ? options : "");
+
+  const char *src = source;
+  program = clCreateProgramWithSource (s->context, 1, &src, NULL, &err);
+  if (err == CL_SUCCESS)
+    err = clBuildProgram (program, 1, &dev, build_options, NULL, NULL);
+  free (build_options);
+
+  size_t log_size = 0;
+  if (program
+      && clGetProgramBuildInfo (program, dev, CL_PROGRAM_BUILD_LOG, 0, NULL,
+                                &log_size)
+             == CL_SUCCESS
+      && log_size > 0)
+    {
+      log = (char *)calloc (1, log_size + 1);
+      if (log)
+        clGetProgramBuildInfo (program, dev, CL_PROGRAM_BUILD_LOG, log_size,
+                               log, NULL);
+    }
+
+REPLY:
+  remote_put_str (&out, log ? log : "");
+  if (err == CL_SUCCESS)
+    {
+      cl_uint num_kernels = 0, i;
+      cl_kernel *kernels = NULL;
+      clCreateKernelsInProgram (program, 0, NULL, &num_kernels);
+      if (num_kernels > 0)
+        kernels = (cl_kernel *)calloc (num_kernels, sizeof (cl_kernel));
+      if (kernels == NULL
+          || clCreateKernelsInProgram (program, num_kernels, kernels, NULL)
+                 != CL_SUCCESS)
+        num_kernels = 0;
+      remote_put_u32 (&out, num_kernels);
+      for (i = 0; i < num_kernels; ++i)
+        {
+          pocld_put_kernel_metadata (&out, kernels[i], dev);
+          clReleaseKernel (kernels[i]);
+        }
+      free (kernels);
+      if (out.error || pocld_add (s, h->obj, POCLD_PROGRAM, program, 0) != 0)
+        err = CL_OUT_OF_HOST_MEMORY;
+    }
+  if (err != CL_SUCCESS && program)
+    clReleaseProgram (program);
+
+  pocld_reply (s, h->id, err, out.data, out.error ? 0 : out.size);
+  remote_stream_free (&out);
+  free (log);
+  free (options);
+  free (source);
+}
+
+/*****************************************************************************/
+
+/* The source buffer of a migration from another session, with the session
+ * held */
+static cl_int
+pocld_peer_read (uint64_t session, uint64_t buffer, uint64_t offset,
+                 uint64_t size, void *dst)
+{
+  pocld_session_t *s;
+  pocld_object_t *o = NULL;
+  cl_mem mem = NULL;
+  cl_command_queue queue = NULL;
+
+  pthread_mutex_lock (&sessions_lock);
+  LL_FOREACH (sessions, s)
+    {
+      if (s->id == session)
+        break;
+    }
+  if (s)
+    {
+      /* the connection thread of the session may free the buffer */
+      pthread_mutex_lock (&s->lock);
+      LL_FOREACH (s->objects[buffer % POCLD_BUCKETS], o)
+        {
+          if (o->id == buffer && o->kind == POCLD_BUFFER)
+            break;
+        }
+      if (o)
+        {
+          mem = (cl_mem)o->obj;
+          queue = s->io_queues[o->device];
+          clRetainMemObject (mem);
+          ++s->inflight;
+        }
+      pthread_mutex_unlock (&s->lock);
+    }
+  pthread_mutex_unlock (&sessions_lock);
+
+  if (mem == NULL)
+    return CL_INVALID_MEM_OBJECT;
+
+  cl_int err = clEnqueueReadBuffer (queue, mem, CL_TRUE, offset, size, dst, 0,
+                                    NULL, NULL);
+  clReleaseMemObject (mem);
+
+  pthread_mutex_lock (&s->lock);
+  --s->inflight;
+  pthread_cond_broadcast (&s->idle_cond);
+  pthread_mutex_unlock (&s->lock);
+  return err;
+}
+
+static void
+pocld_serve_peer_read (int fd, remote_msg_header *h, remote_stream *p)
+{
+  uint64_t session = remote_get_u64 (p);
+  uint64_t offset = remote_get_u64 (p);
+  uint64_t size = remote_get_u64 (p);
+  cl_int err = CL_INVALID_VALUE;
+  char *data = NULL;
+
+  if (!p->error)
+    {
+      data = (char *)malloc (size ? size : 1);
+      err = data ? pocld_peer_read (session, h->obj, offset, size, data)
+                 : CL_OUT_OF_HOST_MEMORY;
+    }
+  pocld_send_reply (fd, NULL, REMOTE_MSG_REPLY, h->id, err, data,
+                    err == CL_SUCCESS ? size : 0);
+  free (data);
+}
+
+/* Reads the source of a migration from another pocld */
+static cl_int
+pocld_fetch_from_peer (const char *address, uint64_t session, uint64_t buffer,
+                       uint64_t offset, uint64_t size, void *dst)
+{
+  remote_msg_header h;
+  remote_reply_header r;
+  remote_stream params = { 0 };
+  cl_int err = CL_DEVICE_NOT_AVAILABLE;
+
+  int fd = remote_connect (address);
+  if (fd < 0)
+    {
+      POCLD_LOG ("can't connect to %s\n", address);
+      return CL_DEVICE_NOT_AVAILABLE;
+    }
+
+  memset (&h, 0, sizeof (h));
+  h.type = REMOTE_MSG_PEER_READ;
+  h.id = 1;
+  h.obj = buffer;
+  remote_put_u64 (&params, session);
+  remote_put_u64 (&params, offset);
+  remote_put_u64 (&params, size);
+  h.payload_size = params.size;
+
+  if (!params.error && remote_send_all (fd, &h, sizeof (h)) == 0
+      && remote_send_all (fd, params.data, params.size) == 0
+      && remote_recv_all (fd, &r, sizeof (r)) == 0)
+    {
+      err = r.status;
+      if (err == CL_SUCCESS && r.payload_size != size)
+        err = CL_OUT_OF_RESOURCES;
+      if (err == CL_SUCCESS)
+        {
+          if (remote_recv_all (fd, dst, size) != 0)
+            err = CL_DEVICE_NOT_AVAILABLE;
+        }
+    }
+  remote_stream_free (&params);
+  close (fd);
+  return err;
+}
+
+typedef struct
+{
+  pocld_session_t *session;
+  cl_event user_event;
+  cl_event *wait_list;
+  cl_uint num_events;
+  cl_mem dst;
+  cl_command_queue io_queue;
+  char *address;
+  uint64_t src_session;
+  uint64_t src_buffer;
+  uint64_t offset;
+  uint64_t size;
+} pocld_migration_t;
+
+/* Pulls the source of a migration from the other pocld to the destination,
+ * once the commands the migration waits for have completed. */
+static void *
+pocld_migration_pthread (void *ptr)
+{
+  pocld_migration_t *m = (pocld_migration_t *)ptr;
+  cl_int err = CL_SUCCESS;
+  cl_uint i;
+  char *data = NULL;
+
+  if (m->num_events > 0)
+    err = clWaitForEvents (m->num_events, m->wait_list);
+  if (err == CL_SUCCESS)
+    {
+      data = (char *)malloc (m->size);
+      if (data == NULL)
+        err = CL_OUT_OF_HOST_MEMORY;
+    }
+  if (err == CL_SUCCESS)
+    err = (m->address[0] == 0)
+              ? pocld_peer_read (m->src_session, m->src_buffer, m->offset,
+                                 m->size, data)
+              : pocld_fetch_from_peer (m->address, m->src_session,
+                                       m->src_buffer, m->offset, m->size,
+                                       data);
+  if (err == CL_SUCCESS)
+    err = clEnqueueWriteBuffer (m->io_queue, m->dst, CL_TRUE, m->offset,
+                                m->size, data, 0, NULL, NULL);
+  free (data);
+
+  if (err != CL_SUCCESS)
+    POCLD_LOG ("migration from %s failed with %i\n", m->address, err);
+  clSetUserEventStatus (m->user_event,
+                        err == CL_SUCCESS ? CL_COMPLETE
+                                          : (err < 0 ? err
+                                                     : CL_OUT_OF_RESOURCES));
+
+  for (i = 0; i < m->num_events; ++i)
+    clReleaseEvent (m->wait_list[i]);
+  clReleaseEvent (m->user_event);
+  clReleaseMemObject (m->dst);
+  free (m->wait_list);
+  free (m->address);
+  free (m);
+  return NULL;
+}
+
+static void
+pocld_migrate_d2d (pocld_session_t *s, remote_msg_header *h,
+                   remote_stream *p, cl_command_queue queue, cl_event *events,
+                   cl_uint num_events, pocld_completion_t *c)
+{
+  uint64_t src_buffer = remote_get_u64 (p);
+  uint64_t offset = remote_get_u64 (p);
+  uint64_t size = remote_get_u64 (p);
+  char *address = remote_get_str (p);
+  uint64_t src_session = remote_get_u64 (p);
+  pocld_object_t *dst = pocld_find (s, h->obj, POCLD_BUFFER);
+  cl_event event = NULL;
+  cl_int err;
+  cl_uint i;
+
+  if (p->error || address == NULL || dst == NULL)
+    {
+      free (address);
+      free (events);
+      pocld_fail_command (s, c, CL_INVALID_MEM_OBJECT);
+      return;
+    }
+
+  /* both buffers in this context */
+  if (address[0] == 0 && src_session == s->id)
+    {
+      cl_mem src = (cl_mem)pocld_find_obj (s, src_buffer, POCLD_BUFFER);
+      free (address);
+      if (src == NULL)
+        {
+          free (events);
+          pocld_fail_command (s, c, CL_INVALID_MEM_OBJECT);
+          return;
+        }
+      err = clEnqueueCopyBuffer (queue, src, (cl_mem)dst->obj, offset, offset,
+                                 size, num_events, events, &event);
+      free (events);
+      if (err != CL_SUCCESS)
+        pocld_fail_command (s, c, err);
+      else
+        pocld_track (s, event, c);
+      return;
+    }
+
+  pocld_migration_t *m
+      = (pocld_migration_t *)calloc (1, sizeof (pocld_migration_t));
+  event = clCreateUserEvent (s->context, &err);
+  if (m == NULL || err != CL_SUCCESS)
+    {
+      free (m);
+      free (address);
+      free (events);
+      pocld_fail_command (s, c, err != CL_SUCCESS ? err
+                                                  : CL_OUT_OF_HOST_MEMORY);
+      return;
+    }
+
+  m->session = s;
+  m->user_event = event;
+  m->wait_list = events;
+  m->num_events = num_events;
+  m->dst = (cl_mem)dst->obj;
+  m->io_queue = s->io_queues[dst->device];
+  m->address = address;
+  m->src_session = src_session;
+  m->src_buffer = src_buffer;
+  m->offset = offset;
+  m->size = size;
+  for (i = 0; i < num_events; ++i)
+    clRetainEvent (events[i]);
+  clRetainEvent (event);
+  clRetainMemObject (m->dst);
+
+  pocld_track (s, event, c);
+
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, pocld_migration_pthread, m) != 0)
+    {
+      clSetUserEventStatus (event, CL_OUT_OF_RESOURCES);
+      for (i = 0; i < num_events; ++i)
+        clReleaseEvent (events[i]);
+      clReleaseEvent (event);
+      clReleaseMemObject (m->dst);
+      free (events);
+      free (address);
+      free (m);
+      return;
+    }
+  pthread_detach (thread);
+}
+
+/*****************************************************************************/
+
+/* Sets the arguments of the kernel and enqueues it */
+static cl_int
+pocld_run (pocld_session_t *s, remote_msg_header *h, remote_stream *p,
+           cl_command_queue queue, cl_event *events, cl_uint num_events,
+           pocld_completion_t *c, cl_event *event)
+{
+  cl_kernel kernel = (cl_kernel)pocld_find_obj (s, h->obj, POCLD_KERNEL);
+  size_t offset[3], global[3], local[3];
+  cl_uint work_dim = remote_get_u32 (p), i;
+  int has_local = 0;
+
+  for (i = 0; i < 3; ++i)
+    offset[i] = remote_get_u64 (p);
+  for (i = 0; i < 3; ++i)
+    global[i] = remote_get_u64 (p);
+  for (i = 0; i < 3; ++i)
+    {
+      local[i] = remote_get_u64 (p);
+      has_local |= (local[i] != 0);
+    }
+
+  if (kernel == NULL)
+    return CL_INVALID_KERNEL;
+  if (work_dim < 1 || work_dim > 3)
+    return CL_INVALID_WORK_DIMENSION;
+
+  cl_uint num_args = remote_get_u32 (p);
+  if (p->error)
+    return CL_INVALID_VALUE;
+  c->tmp_mems = (cl_mem *)calloc (num_args ? num_args : 1, sizeof (cl_mem));
+  if (c->tmp_mems == NULL)
+    return CL_OUT_OF_HOST_MEMORY;
+
+  for (i = 0; i < num_args; ++i)
+    {
+      uint32_t kind = remote_get_u32 (p);
+      uint64_t size = remote_get_u64 (p);
+      cl_int err;
+      if (p->error)
+        return CL_INVALID_VALUE;
+
+      switch (kind)
+        {
+        case REMOTE_ARG_LOCAL:
+          err = clSetKernelArg (kernel, i, size, NULL);
+          break;
+        case REMOTE_ARG_POD:
+          {
+            const void *value = remote_get (p, size);
+            if (value == NULL)
+              return CL_INVALID_VALUE;
+            err = clSetKernelArg (kernel, i, size, value);
+            break;
+          }
+        case REMOTE_ARG_BUFFER:
+          {
+            uint64_t id = remote_get_u64 (p);
+            uint64_t origin = remote_get_u64 (p);
+            cl_mem mem = NULL;
+            if (id != 0)
+              {
+                mem = (cl_mem)pocld_find_obj (s, id, POCLD_BUFFER);
+                if (mem == NULL)
+                  return CL_INVALID_MEM_OBJECT;
+              }
+            if (mem && size > 0)
+              {
+                cl_buffer_region region = { origin, size };
+                mem = clCreateSubBuffer (mem, 0, CL_BUFFER_CREATE_TYPE_REGION,
+                                         &region, &err);
+                if (err != CL_SUCCESS)
+                  return err;
+                c->tmp_mems[c->num_tmp_mems++] = mem;
+              }
+            err = clSetKernelArg (kernel, i, sizeof (cl_mem), &mem);
+            break;
+          }
+        default:
+          return CL_INVALID_ARG_VALUE;
+        }
+      if (err != CL_SUCCESS)
+        return err;
+    }
+
+  return clEnqueueNDRangeKernel (queue, kernel, work_dim, offset, global,
+                                 has_local ? local : NULL, num_events, events,
+                                 event);
+}
+
+/* Enqueues a command without waiting for it */
+static void
+pocld_command (pocld_session_t *s, remote_msg_header *h, remote_stream *p)
+{
+  pocld_completion_t *c = pocld_new_completion (s, h->id);
+  pocld_object_t *q = pocld_find (s, h->queue, POCLD_QUEUE);
+  cl_command_queue queue = q ? (cl_command_queue)q->obj : NULL;
+  pocld_object_t *buf = NULL;
+  cl_event *events = NULL, event = NULL;
+  cl_uint num_events = 0, i;
+  cl_int err = CL_SUCCESS;
+  size_t region[3], buffer_origin[3], host_origin[3] = { 0, 0, 0 };
+
+  if (c == NULL)
+    {
+      pocld_send_reply (s->fd, &s->send_lock, REMOTE_MSG_COMPLETE, h->id,
+                        CL_OUT_OF_HOST_MEMORY, NULL, 0);
+      return;
+    }
+  events = pocld_get_wait_list (s, p, &num_events);
+  if (queue == NULL)
+    {
+      free (events);
+      pocld_fail_command (s, c, CL_INVALID_COMMAND_QUEUE);
+      return;
+    }
+
+  switch (h->type)
+    {
+    case REMOTE_MSG_READ:
+    case REMOTE_MSG_WRITE:
+      {
+        uint64_t offset = remote_get_u64 (p);
+        uint64_t size = remote_get_u64 (p);
+        buf = pocld_find (s, h->obj, POCLD_BUFFER);
+        if (buf == NULL || p->error)
+          {
+            err = CL_INVALID_MEM_OBJECT;
+            break;
+          }
+        if (h->type == REMOTE_MSG_READ)
+          {
+            c->data = (char *)malloc (size ? size : 1);
+            c->reply_size = size;
+            if (c->data == NULL)
+              {
+                err = CL_OUT_OF_HOST_MEMORY;
+                break;
+              }
+            err = clEnqueueReadBuffer (queue, (cl_mem)buf->obj, CL_FALSE,
+                                       offset, size, c->data, num_events,
+                                       events, &event);
+          }
+        else
+          {
+            const void *data = remote_get (p, size);
+            if (data == NULL)
+              {
+                err = CL_INVALID_VALUE;
+                break;
+              }
+            /* the payload stays until the write completes */
+            c->data = p->data;
+            p->data = NULL;
+            err = clEnqueueWriteBuffer (queue, (cl_mem)buf->obj, CL_FALSE,
+                                        offset, size, data, num_events, events,
+                                        &event);
+          }
+        break;
+      }
+
+    case REMOTE_MSG_COPY:
+      {
+        cl_mem src = (cl_mem)pocld_find_obj (s, remote_get_u64 (p),
+                                             POCLD_BUFFER);
+        uint64_t src_offset = remote_get_u64 (p);
+        uint64_t dst_offset = remote_get_u64 (p);
+        uint64_t size = remote_get_u64 (p);
+        buf = pocld_find (s, h->obj, POCLD_BUFFER);
+        if (buf == NULL || src == NULL || p->error)
+          {
+            err = CL_INVALID_MEM_OBJECT;
+            break;
+          }
+        err = clEnqueueCopyBuffer (queue, src, (cl_mem)buf->obj, src_offset,
+                                   dst_offset, size, num_events, events,
+                                   &event);
+        break;
+      }
+
+    case REMOTE_MSG_READ_RECT:
+    case REMOTE_MSG_WRITE_RECT:
+      {
+        for (i = 0; i < 3; ++i)
+          buffer_origin[i] = remote_get_u64 (p);
+        for (i = 0; i < 3; ++i)
+          region[i] = remote_get_u64 (p);
+        size_t row_pitch = remote_get_u64 (p);
+        size_t slice_pitch = remote_get_u64 (p);
+        size_t size = region[0] * region[1] * region[2];
+        buf = pocld_find (s, h->obj, POCLD_BUFFER);
+        if (buf == NULL || p->error)
+          {
+            err = CL_INVALID_MEM_OBJECT;
+            break;
+          }
+        /* the host side of the region is packed */
+        if (h->type == REMOTE_MSG_READ_RECT)
+          {
+            c->data = (char *)malloc (size ? size : 1);
+            c->reply_size = size;
+            if (c->data == NULL)
+              {
+                err = CL_OUT_OF_HOST_MEMORY;
+                break;
+              }
+            err = clEnqueueReadBufferRect (
+                queue, (cl_mem)buf->obj, CL_FALSE, buffer_origin, host_origin,
+                region, row_pitch, slice_pitch, region[0],
+                region[0] * region[1], c->data, num_events, events, &event);
+          }
+        else
+          {
+            const void *data = remote_get (p, size);
+            if (data == NULL)
+              {
+                err = CL_INVALID_VALUE;
+                break;
+              }
+            c->data = p->data;
+            p->data = NULL;
+            err = clEnqueueWriteBufferRect (
+                queue, (cl_mem)buf->obj, CL_FALSE, buffer_origin, host_origin,
+                region, row_pitch, slice_pitch, region[0],
+                region[0] * region[1], data, num_events, events, &event);
+          }
+        break;
+      }
+
+    case REMOTE_MSG_COPY_RECT:
+      {
+        size_t src_origin[3], dst_origin[3], pitches[4];
+        cl_mem src = (cl_mem)pocld_find_obj (s, remote_get_u64 (p),
+                                             POCLD_BUFFER);
+        for (i = 0; i < 3; ++i)
+          src_origin[i] = remote_get_u64 (p);
+        for (i = 0; i < 3; ++i)
+          dst_origin[i] = remote_get_u64 (p);
+        for (i = 0; i < 3; ++i)
+          region[i] = remote_get_u64 (p);
+        for (i = 0; i < 4; ++i)
+          pitches[i] = remote_get_u64 (p);
+        buf = pocld_find (s, h->obj, POCLD_BUFFER);
+        if (buf == NULL || src == NULL || p->error)
+          {
+            err = CL_INVALID_MEM_OBJECT;
+            break;
+          }
+        err = clEnqueueCopyBufferRect (queue, src, (cl_mem)buf->obj,
+                                       src_origin, dst_origin, region,
+                                       pitches[0], pitches[1], pitches[2],
+                                       pitches[3], num_events, events, &event);
+        break;
+      }
+
+    case REMOTE_MSG_FILL:
+      {
+        uint64_t offset = remote_get_u64 (p);
+        uint64_t size = remote_get_u64 (p);
+        uint32_t pattern_size = remote_get_u32 (p);
+        const void *pattern = remote_get (p, pattern_size);
+        buf = pocld_find (s, h->obj, POCLD_BUFFER);
+        if (buf == NULL || pattern == NULL)
+          {
+            err = CL_INVALID_MEM_OBJECT;
+            break;
+          }
+        err = clEnqueueFillBuffer (queue, (cl_mem)buf->obj, pattern,
+                                   pattern_size, offset, size, num_events,
+                                   events, &event);
+        break;
+      }
+
+    case REMOTE_MSG_RUN:
+      err = pocld_run (s, h, p, queue, events, num_events, c, &event);
+      break;
+
+    case REMOTE_MSG_MARKER:
+      err = clEnqueueMarkerWithWaitList (queue, num_events, events, &event);
+      break;
+
+    case REMOTE_MSG_MIGRATE_D2D:
+      /* takes the wait list */
+      pocld_migrate_d2d (s, h, p, queue, events, num_events, c);
+      return;
+
+    default:
+      err = CL_INVALID_OPERATION;
+    }
+
+  free (events);
+  if (err != CL_SUCCESS)
+    pocld_fail_command (s, c, err);
+  else
+    pocld_track (s, event, c);
+}
+
+/*****************************************************************************/
+
+/* Handles a message of a session */
+static void
+pocld_message (pocld_session_t *s, remote_msg_header *h, remote_stream *p)
+{
+  cl_int err;
+
+  switch (h->type)
+    {
+    case REMOTE_MSG_DEVICE_INFO:
+      {
+        remote_device_info_t info;
+        if (h->device >= s->num_devices)
+          {
+            pocld_reply (s, h->id, CL_INVALID_DEVICE, NULL, 0);
+            break;
+          }
+        pocld_device_info (s->devices[h->device], &info);
+        pocld_reply (s, h->id, CL_SUCCESS, &info, sizeof (info));
+        break;
+      }
+
+    case REMOTE_MSG_CREATE_BUFFER:
+      {
+        uint64_t size = remote_get_u64 (p);
+        uint64_t flags = remote_get_u64 (p);
+        cl_mem mem = NULL;
+        err = CL_INVALID_VALUE;
+        if (!p->error && h->device < s->num_devices)
+          mem = clCreateBuffer (s->context, (cl_mem_flags)flags, size, NULL,
+                                &err);
+        if (err == CL_SUCCESS
+            && pocld_add (s, h->obj, POCLD_BUFFER, mem, h->device) != 0)
+          {
+            clReleaseMemObject (mem);
+            err = CL_OUT_OF_HOST_MEMORY;
+          }
+        pocld_reply (s, h->id, err, NULL, 0);
+        break;
+      }
+    case REMOTE_MSG_FREE_BUFFER:
+      pocld_remove (s, h->obj, POCLD_BUFFER);
+      break;
+
+    case REMOTE_MSG_BUILD_PROGRAM:
+      pocld_build_program (s, h, p);
+      break;
+    case REMOTE_MSG_FREE_PROGRAM:
+      pocld_remove (s, h->obj, POCLD_PROGRAM);
+      break;
+
+    case REMOTE_MSG_CREATE_KERNEL:
+      {
+        cl_program program = (cl_program)pocld_find_obj (
+            s, remote_get_u64 (p), POCLD_PROGRAM);
+        char *name = remote_get_str (p);
+        /* the commands of a kernel that failed to be created fail */
+        if (program && name)
+          {
+            cl_kernel kernel = clCreateKernel (program, name, &err);
+            if (err == CL_SUCCESS
+                && pocld_add (s, h->obj, POCLD_KERNEL, kernel, 0) != 0)
+              clReleaseKernel (kernel);
+          }
+        free (name);
+        break;
+      }
+    case REMOTE_MSG_FREE_KERNEL:
+      pocld_remove (s, h->obj, POCLD_KERNEL);
+      break;
+
+    case REMOTE_MSG_CREATE_QUEUE:
+      {
+        cl_command_queue_properties props = remote_get_u64 (p);
+        if (p->error || h->device >= s->num_devices)
+          break;
+        cl_command_queue queue = clCreateCommandQueue (
+            s->context, s->devices[h->device], props, &err);
+        /* the wait lists order the commands of an in-order queue anyway */
+        if (err != CL_SUCCESS)
+          queue = clCreateCommandQueue (
+              s->context, s->devices[h->device],
+              props & ~CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+        if (err == CL_SUCCESS
+            && pocld_add (s, h->obj, POCLD_QUEUE, queue, h->device) != 0)
+          clReleaseCommandQueue (queue);
+        break;
+      }
+    case REMOTE_MSG_FREE_QUEUE:
+      pocld_remove (s, h->obj, POCLD_QUEUE);
+      break;
+
+    case REMOTE_MSG_RELEASE_EVENT:
+      pocld_remove (s, h->obj, POCLD_EVENT);
+      break;
+
+    case REMOTE_MSG_READ:
+    case REMOTE_MSG_WRITE:
+    case REMOTE_MSG_COPY:
+    case REMOTE_MSG_READ_RECT:
+    case REMOTE_MSG_WRITE_RECT:
+    case REMOTE_MSG_COPY_RECT:
+    case REMOTE_MSG_FILL:
+    case REMOTE_MSG_RUN:
+    case REMOTE_MSG_MARKER:
+    case REMOTE_MSG_MIGRATE_D2D:
+      pocld_command (s, h, p);
+      break;
+
+    default:
+      POCLD_LOG ("unknown message %u\n", h->type);
+    }
+}
+
+static void *
+pocld_connection_pthread (void *ptr)
+{
+  int fd = (int)(intptr_t)ptr;
+  pocld_session_t *s = NULL;
+  remote_msg_header h;
+
+  while (remote_recv_all (fd, &h, sizeof (h)) == 0)
+    {
+      remote_stream p = { 0 };
+      if (h.payload_size > 0)
+        {
+          p.data = (char *)malloc (h.payload_size);
+          if (p.data == NULL)
+            {
+              POCLD_LOG ("can't receive a message of %" PRIu64 " bytes\n",
+                         h.payload_size);
+              break;
+            }
+          p.size = p.capacity = h.payload_size;
+          if (remote_recv_all (fd, p.data, p.size) != 0)
+            {
+              remote_stream_free (&p);
+              break;
+            }
+        }
+
+      if (h.type == REMOTE_MSG_PEER_READ)
+        pocld_serve_peer_read (fd, &h, &p);
+      else if (h.type == REMOTE_MSG_HELLO && s == NULL)
+        {
+          uint32_t version = remote_get_u32 (&p);
+          cl_int err = (version == POCL_REMOTE_PROTOCOL_VERSION)
+                           ? pocld_open_session (fd, &s)
+                           : CL_INVALID_VALUE;
+          remote_stream out = { 0 };
+          if (s)
+            {
+              remote_put_u64 (&out, s->id);
+              remote_put_u32 (&out, s->num_devices);
+            }
+          pocld_send_reply (fd, s ? &s->send_lock : NULL, REMOTE_MSG_REPLY,
+                            h.id, err, out.data, out.size);
+          remote_stream_free (&out);
+          if (s == NULL)
+            {
+              POCLD_LOG ("refused a session: %i\n", err);
+              remote_stream_free (&p);
+              break;
+            }
+        }
+      else if (s)
+        pocld_message (s, &h, &p);
+      else
+        {
+          POCLD_LOG ("message %u outside of a session\n", h.type);
+          remote_stream_free (&p);
+          break;
+        }
+      remote_stream_free (&p);
+
+      /* flush once the pipelined messages have been handled */
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (s && poll (&pfd, 1, 0) == 0)
+        pocld_flush_queues (s, 0);
+    }
+
+  if (s)
+    pocld_close_session (s);
+  close (fd);
+  return NULL;
+}
+
+static int
+pocld_listen (const char *address, unsigned port)
+{
+  struct addrinfo hints, *res, *ai;
+  char port_str[16];
+  int fd = -1, one = 1;
+
+  snprintf (port_str, sizeof (port_str), "%u", port);
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo (address, port_str, &hints, &res) != 0)
+    return -1;
+
+  for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+        continue;
+      setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+      if (bind (fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen (fd, 16) == 0)
+        break;
+      close (fd);
+      fd = -1;
+    }
+  freeaddrinfo (res);
+  return fd;
+}
+
+static void
+usage (const char *prog)
+{
+  printf ("Usage: %s [-a address] [-p port] [platform index]\n"
+          "Serves the OpenCL devices of the platform to the remote driver"
+          " of pocl.\n"
+          "  -a  the address to listen at, all by default\n"
+          "  -p  the port to listen at, %u by default\n",
+          prog, POCL_REMOTE_DEFAULT_PORT);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *address = NULL;
+  unsigned port = POCL_REMOTE_DEFAULT_PORT;
+  unsigned platform_index = 0;
+  cl_platform_id *platforms;
+  cl_uint num_platforms = 0;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "a:p:h")) != -1)
+    {
+      switch (opt)
+        {
+        case 'a':
+          address = optarg;
+          break;
+        case 'p':
+          port = (unsigned)atoi (optarg);
+          break;
+        default:
+          usage (argv[0]);
+          return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+  if (optind < argc)
+    platform_index = (unsigned)atoi (argv[optind]);
+
+  if (clGetPlatformIDs (0, NULL, &num_platforms) != CL_SUCCESS
+      || platform_index >= num_platforms)
+    {
+      POCLD_LOG ("no OpenCL platform %u\n", platform_index);
+      return EXIT_FAILURE;
+    }
+  platforms = (cl_platform_id *)calloc (num_platforms, sizeof (cl_platform_id));
+  if (platforms == NULL
+      || clGetPlatformIDs (num_platforms, platforms, NULL) != CL_SUCCESS)
+    return EXIT_FAILURE;
+  platform = platforms[platform_index];
+  free (platforms);
+
+  int listen_fd = pocld_listen (address, port);
+  if (listen_fd < 0)
+    {
+      POCLD_LOG ("can't listen at port %u\n", port);
+      return EXIT_FAILURE;
+    }
+  /* a client closing its connection must not end the daemon */
+  signal (SIGPIPE, SIG_IGN);
+  POCLD_LOG ("listening at port %u\n", port);
+
+  while (1)
+    {
+      int fd = accept (listen_fd, NULL, NULL);
+      int one = 1;
+      pthread_t thread;
+      if (fd < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          POCLD_LOG ("accept failed: %s\n", strerror (errno));
+          break;
+        }
+      setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+      if (pthread_create (&thread, NULL, pocld_connection_pthread,
+                          (void *)(intptr_t)fd)
+          != 0)
+        {
+          close (fd);
+          continue;
+        }
+      pthread_detach (thread);
+    }
+
+  close (listen_fd);
+  return EXIT_FAILURE;
+}
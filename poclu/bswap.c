@@ -22,6 +22,16 @@
 */
 
 #include "pocl_opencl.h"
+#include "poclu_parallel.h"
+
+#if (defined(__x86_64__) || defined(__i386__))                               \
+    && (defined(__GNUC__) || defined(__clang__))
+#define POCLU_BSWAP_SSSE3
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define POCLU_BSWAP_NEON
+#include <arm_neon.h>
+#endif
 
 #define GENERIC_BYTESWAP(__DTYPE, __WORD)                         \
   do {                                                            \
@@ -77,51 +87,99 @@ poclu_bswap_cl_float(cl_device_id device, cl_float original)
   return original;
 }
 
+typedef struct
+{
+  unsigned char *bytes;
+  size_t word_size;
+} bswap_args_t;
+
+#ifdef POCLU_BSWAP_SSSE3
+/* Swaps the 2 or 4 byte words of the whole 16 byte blocks at p, and returns
+ * the number of bytes swapped. */
+__attribute__ ((target ("ssse3"))) static size_t
+bswap_ssse3 (unsigned char *p, size_t num_bytes, size_t word_size)
+{
+  const __m128i shuffle
+      = (word_size == 2) ? _mm_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11,
+                                          10, 13, 12, 15, 14)
+                         : _mm_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9,
+                                          8, 15, 14, 13, 12);
+  size_t i;
+  for (i = 0; i + 16 <= num_bytes; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)(p + i));
+      _mm_storeu_si128 ((__m128i *)(p + i), _mm_shuffle_epi8 (v, shuffle));
+    }
+  return i;
+}
+#endif
+
+static void
+bswap_words (void *data, size_t begin, size_t end)
+{
+  bswap_args_t *args = (bswap_args_t *)data;
+  size_t word_size = args->word_size;
+  unsigned char *p = args->bytes + begin * word_size;
+  size_t num_bytes = (end - begin) * word_size;
+  size_t i = 0, j;
+
+#if defined(POCLU_BSWAP_SSSE3)
+  if (__builtin_cpu_supports ("ssse3"))
+    i = bswap_ssse3 (p, num_bytes, word_size);
+#elif defined(POCLU_BSWAP_NEON)
+  for (; i + 16 <= num_bytes; i += 16)
+    {
+      uint8x16_t v = vld1q_u8 (p + i);
+      vst1q_u8 (p + i, (word_size == 2) ? vrev16q_u8 (v) : vrev32q_u8 (v));
+    }
+#endif
+
+  for (; i < num_bytes; i += word_size)
+    for (j = 0; j < word_size / 2; ++j)
+      {
+        unsigned char b = p[i + j];
+        p[i + j] = p[i + word_size - 1 - j];
+        p[i + word_size - 1 - j] = b;
+      }
+}
+
+/* Swaps the bytes of the num_words words of the array, with vector
+ * shuffles, and in several threads if the array is large. */
+static void
+bswap_array (void *array, size_t word_size, size_t num_words)
+{
+  bswap_args_t args = { (unsigned char *)array, word_size };
+  poclu_parallel_ranges (bswap_words, &args, num_words);
+}
+
 void
 poclu_bswap_cl_int_array(cl_device_id device, cl_int* array,
                          size_t num_elements)
 {
-  size_t i;
   if (!needs_swap (device)) return;
-  for (i = 0; i < num_elements; ++i)
-    {
-      GENERIC_BYTESWAP (cl_int, array[i]);
-    }
+  bswap_array (array, sizeof (cl_int), num_elements);
 }
 
 void
 poclu_bswap_cl_half_array(cl_device_id device, cl_half* array,
                            size_t num_elements)
 {
-  size_t i;
   if (!needs_swap (device)) return;
-  for (i = 0; i < num_elements; ++i)
-    {
-      GENERIC_BYTESWAP (cl_half, array[i]);
-    }
+  bswap_array (array, sizeof (cl_half), num_elements);
 }
 
 void
 poclu_bswap_cl_float_array(cl_device_id device, cl_float* array,
                            size_t num_elements)
 {
-  size_t i;
   if (!needs_swap (device)) return;
-  for (i = 0; i < num_elements; ++i)
-    {
-      GENERIC_BYTESWAP (cl_float, array[i]);
-    }
+  bswap_array (array, sizeof (cl_float), num_elements);
 }
 
 void
 poclu_bswap_cl_float2_array(cl_device_id device, cl_float2* array,
                             size_t num_elements)
 {
-  size_t i;
   if (!needs_swap (device)) return;
-  for (i = 0; i < num_elements; ++i)
-    {
-      GENERIC_BYTESWAP (cl_float, array[i].s[0]);
-      GENERIC_BYTESWAP (cl_float, array[i].s[1]);
-    }
+  bswap_array (array, sizeof (cl_float), num_elements * 2);
 }
@@ -29,7 +29,9 @@
 #include <math.h>
 #include <stdint.h>
 
+#include "pocl_half.h"
 #include "pocl_opencl.h"
+#include "poclu_parallel.h"
 
 typedef union
 {
@@ -49,39 +51,14 @@ poclu_float_to_cl_half_fast(float value)
   return half;
 }
 
-// The idea behind these float to half functions is from:
-// https://gamedev.stackexchange.com/a/17410
 cl_half
 poclu_float_to_cl_half(float value)
 {
-  FloatConvUnion u;
-  u.f = value;
-  cl_half half = (u.i >> 16) & 0x8000; // sign
-  cl_half fraction = (u.i >> 12) & 0x007ff; // fraction with extra bit for rounding
-  cl_half exponent = (u.i >> 23)  & 0xff; // exponent
-
-  if(exponent < 0x0067) // Return signed zero if zero or value is too small for denormal half
-    return half;
-
-  if(exponent > 0x008e){// value was NaN or Inf
-    half |= 0x7c00u; // Make into inf
-    half |= exponent == 255 && (u.i & 0x007fffffu); // If value was NaN make this into NaN
-    return half;
-  }
-
-  if(exponent < 0x0071){// Denormal
-    fraction |= 0x0800u;
-
-    // rounding
-    half |= (fraction >> (0x0072 - exponent)) + ((fraction >> (0x0071 - exponent)) & 1);
-    return half;
-  }
-
-  half |= ((exponent - 0x0070) << 10) | (fraction >> 1);
-  half += fraction & 1;// rounding
-  return half;
+  return pocl_float_to_half (value);
 }
 
+// The idea behind these float to half functions is from:
+// https://gamedev.stackexchange.com/a/17410
 cl_half
 poclu_float_to_cl_half_ceil(float value)
 {
@@ -155,38 +132,46 @@ poclu_float_to_cl_half_floor(float value)
   return half;
 }
 
-#ifndef INFINITY
-#define INFINITY 1.0/0.0
-#endif
-
-#ifndef NAN
-#define NAN 0.0/0.0
-#endif
-
 float
 poclu_cl_half_to_float(cl_half value)
 {
-  if (value == 0xFC00) {
-    return -INFINITY;
-  }
-  if (value == 0x7C00) {
-    return INFINITY;
-  }
+  return pocl_half_to_float (value);
+}
 
-  int sgn = ((value & 0x8000) >> 15);
-  int exp = (value & 0x7C00) >> 10;
-  int mant = value & 0x03FF;
+typedef struct
+{
+  cl_half *halves;
+  float *floats;
+} conversion_args_t;
 
-  if (exp == 0x1F && mant != 0) {
-    return NAN;
-  }
+static void
+floats_to_halves (void *data, size_t begin, size_t end)
+{
+  conversion_args_t *args = (conversion_args_t *)data;
+  pocl_float_to_half_array (args->halves + begin, args->floats + begin,
+                            end - begin);
+}
 
-  float v = (exp == 0) ? mant : mant | 0x0400; // 1.x if not denormal
-  v /= 0x400;
-  float mul = exp2((float)exp - 15);
-  v *= mul;
-  if (sgn) {
-    v *= -1;
-  }
-  return v;
+static void
+halves_to_floats (void *data, size_t begin, size_t end)
+{
+  conversion_args_t *args = (conversion_args_t *)data;
+  pocl_half_to_float_array (args->floats + begin, args->halves + begin,
+                            end - begin);
+}
+
+void
+poclu_float_to_cl_half_array (cl_half *dst, const float *src,
+                              size_t num_elements)
+{
+  conversion_args_t args = { dst, (float *)src };
+  poclu_parallel_ranges (floats_to_halves, &args, num_elements);
+}
+
+void
+poclu_cl_half_to_float_array (float *dst, const cl_half *src,
+                              size_t num_elements)
+{
+  conversion_args_t args = { (cl_half *)src, dst };
+  poclu_parallel_ranges (halves_to_floats, &args, num_elements);
 }
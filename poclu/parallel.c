@@ -0,0 +1,102 @@
+/* parallel - running the array helpers of poclu in threads
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#include "poclu_parallel.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* The fewest elements worth a thread of their own; the conversions and
+ * swaps run at the memory bandwidth of one core below this. */
+#define POCLU_PARALLEL_MIN_ELEMENTS (1 << 20)
+#define POCLU_PARALLEL_MAX_THREADS 8
+
+typedef struct
+{
+  poclu_range_fn fn;
+  void *args;
+  size_t begin;
+  size_t end;
+} poclu_range_t;
+
+#ifndef _WIN32
+static void *
+run_range (void *data)
+{
+  poclu_range_t *range = (poclu_range_t *)data;
+  range->fn (range->args, range->begin, range->end);
+  return NULL;
+}
+#endif
+
+void
+poclu_parallel_ranges (poclu_range_fn fn, void *args, size_t num_elements)
+{
+#ifndef _WIN32
+  size_t num_threads = num_elements / POCLU_PARALLEL_MIN_ELEMENTS;
+  long num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (num_cpus > 0 && num_threads > (size_t)num_cpus)
+    num_threads = num_cpus;
+  if (num_threads > POCLU_PARALLEL_MAX_THREADS)
+    num_threads = POCLU_PARALLEL_MAX_THREADS;
+
+  if (num_threads > 1)
+    {
+      poclu_range_t ranges[POCLU_PARALLEL_MAX_THREADS];
+      pthread_t threads[POCLU_PARALLEL_MAX_THREADS];
+      int started[POCLU_PARALLEL_MAX_THREADS];
+      /* a multiple of 64 elements per thread keeps the vector loops whole */
+      size_t per_thread = (num_elements / num_threads + 63) & ~(size_t)63;
+      size_t i;
+
+      for (i = 0; i < num_threads; ++i)
+        {
+          ranges[i].fn = fn;
+          ranges[i].args = args;
+          ranges[i].begin = i * per_thread;
+          ranges[i].end = (i == num_threads - 1) ? num_elements
+                                                 : (i + 1) * per_thread;
+          if (ranges[i].begin > num_elements)
+            ranges[i].begin = num_elements;
+          if (ranges[i].end > num_elements)
+            ranges[i].end = num_elements;
+          /* the first range is run by this thread */
+          started[i] = i > 0
+                       && pthread_create (&threads[i], NULL, run_range,
+                                          &ranges[i])
+                              == 0;
+        }
+
+      for (i = 0; i < num_threads; ++i)
+        if (!started[i])
+          run_range (&ranges[i]);
+      for (i = 1; i < num_threads; ++i)
+        if (started[i])
+          pthread_join (threads[i], NULL);
+      return;
+    }
+#endif
+  fn (args, 0, num_elements);
+}
@@ -96,6 +96,7 @@ POCLU_API cl_int POCLU_CALL poclu_get_multiple_devices (
     cl_device_id **devices, cl_command_queue **queues);
 /**
  * cl_half related helpers.
+ * poclu_float_to_cl_half rounds to the nearest half, ties to even.
  */
 POCLU_API cl_half POCLU_CALL
 poclu_float_to_cl_half(float value);
@@ -103,6 +104,17 @@ poclu_float_to_cl_half(float value);
 POCLU_API float POCLU_CALL
 poclu_cl_half_to_float(cl_half value);
 
+/* Conversions of arrays, with the conversion instructions of the CPU, and
+ * in several threads if the array is large. The floats are rounded to the
+ * nearest half, ties to even. */
+POCLU_API void POCLU_CALL
+poclu_float_to_cl_half_array (cl_half *dst, const float *src,
+                              size_t num_elements);
+
+POCLU_API void POCLU_CALL
+poclu_cl_half_to_float_array (float *dst, const cl_half *src,
+                              size_t num_elements);
+
 /* Read content of file to a malloc'd buffer, which is returned.
  * Return NULL on errors */
 POCLU_API char *POCLU_CALL poclu_read_file (const char *filemane);
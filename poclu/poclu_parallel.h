@@ -0,0 +1,37 @@
+/* poclu_parallel - running the array helpers of poclu in threads
+
+   Copyright (c) 2023 pocl developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+*/
+
+#ifndef POCLU_PARALLEL_H
+#define POCLU_PARALLEL_H
+
+#include <stddef.h>
+
+/* Processes the elements [begin, end) of the array of args. */
+typedef void (*poclu_range_fn) (void *args, size_t begin, size_t end);
+
+/* Calls fn on the ranges of the num_elements elements, in threads of their
+ * own if the array is large. Returns when all the ranges are done. */
+void poclu_parallel_ranges (poclu_range_fn fn, void *args,
+                            size_t num_elements);
+
+#endif
@@ -0,0 +1,462 @@
+/* Benchmarks of the runtime overhead of pocl: the time to the first kernel,
+   the enqueue throughput and wait latency of empty kernels, the buffer and
+   map operations, buffer migrations, kernel launches that look up different
+   kernels and the compile time of kernels of growing size. The results are
+   printed as JSON, to compare them between pocl versions.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "poclu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Usage: pocl_bench [--quick] [-o FILE]
+
+   --quick runs a few iterations of each benchmark, to check that they work.
+   The JSON goes to FILE, or to stdout. */
+
+#define MAX_RESULTS 64
+#define NUM_SWITCH_KERNELS 64
+
+typedef struct
+{
+  char name[64];
+  double value;
+  const char *unit;
+} bench_result;
+
+static bench_result results[MAX_RESULTS];
+static unsigned num_results = 0;
+static int quick = 0;
+
+static uint64_t
+now_ns ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+add_result (const char *name, double value, const char *unit)
+{
+  if (num_results == MAX_RESULTS)
+    return;
+  snprintf (results[num_results].name, sizeof (results[0].name), "%s",
+            name);
+  results[num_results].value = value;
+  results[num_results].unit = unit;
+  ++num_results;
+}
+
+static unsigned
+iterations (unsigned full)
+{
+  return quick ? (full / 100 > 0 ? full / 100 : 1) : full;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static const char empty_source[] = "kernel void empty(global int *p) {}\n";
+
+/* Builds the source for the device, salted so that the kernel cache of an
+   earlier run doesn't hide the compile time. */
+static cl_program
+build_salted (cl_context context, cl_device_id device, const char *source,
+              cl_int *err)
+{
+  char salt[64];
+  const char *sources[2] = { salt, source };
+  snprintf (salt, sizeof (salt), "/* %llu %d */\n",
+            (unsigned long long)now_ns (), (int)getpid ());
+  cl_program program
+      = clCreateProgramWithSource (context, 2, sources, NULL, err);
+  if (*err != CL_SUCCESS)
+    return NULL;
+  *err = clBuildProgram (program, 1, &device, NULL, NULL, NULL);
+  return program;
+}
+
+static int
+bench_enqueue (cl_context context, cl_device_id device, cl_kernel kernel,
+               cl_command_queue_properties props, const char *name)
+{
+  cl_int err;
+  size_t gws = 1;
+  unsigned i, n = iterations (100000);
+  cl_command_queue queue
+      = clCreateCommandQueue (context, device, props, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueue");
+
+  /* warm up */
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &gws, NULL,
+                                          0, NULL, NULL));
+  CHECK_CL_ERROR (clFinish (queue));
+
+  uint64_t start = now_ns ();
+  for (i = 0; i < n; ++i)
+    CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &gws,
+                                            NULL, 0, NULL, NULL));
+  uint64_t enqueued = now_ns ();
+  CHECK_CL_ERROR (clFinish (queue));
+  uint64_t end = now_ns ();
+
+  char result[64];
+  snprintf (result, sizeof (result), "%s_enqueue_rate", name);
+  add_result (result, n * 1e9 / (double)(enqueued - start), "1/s");
+  snprintf (result, sizeof (result), "%s_completion_rate", name);
+  add_result (result, n * 1e9 / (double)(end - start), "1/s");
+
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  return EXIT_SUCCESS;
+}
+
+static int
+bench_wait_latency (cl_command_queue queue, cl_kernel kernel)
+{
+  size_t gws = 1;
+  unsigned i, n = iterations (10000);
+  uint64_t *lat = (uint64_t *)malloc (n * sizeof (uint64_t));
+  TEST_ASSERT (lat != NULL);
+
+  for (i = 0; i < n; ++i)
+    {
+      cl_event ev;
+      uint64_t start = now_ns ();
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &gws,
+                                              NULL, 0, NULL, &ev));
+      CHECK_CL_ERROR (clFlush (queue));
+      CHECK_CL_ERROR (clWaitForEvents (1, &ev));
+      lat[i] = now_ns () - start;
+      CHECK_CL_ERROR (clReleaseEvent (ev));
+    }
+  qsort (lat, n, sizeof (uint64_t), compare_u64);
+  add_result ("wait_latency_p50", lat[n / 2] / 1e3, "us");
+  add_result ("wait_latency_p99", lat[(n * 99) / 100] / 1e3, "us");
+  free (lat);
+  return EXIT_SUCCESS;
+}
+
+static int
+bench_buffers (cl_context context, cl_command_queue queue)
+{
+  cl_int err;
+  unsigned i, n = iterations (100000);
+  const size_t size = 1 << 20;
+
+  uint64_t start = now_ns ();
+  for (i = 0; i < n; ++i)
+    {
+      cl_mem buf
+          = clCreateBuffer (context, CL_MEM_READ_WRITE, 4096, NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+      CHECK_CL_ERROR (clReleaseMemObject (buf));
+    }
+  add_result ("buffer_create_release_rate",
+              n * 1e9 / (double)(now_ns () - start), "1/s");
+
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, size, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  n = iterations (10000);
+  start = now_ns ();
+  for (i = 0; i < n; ++i)
+    {
+      void *p = clEnqueueMapBuffer (queue, buf, CL_TRUE, CL_MAP_WRITE, 0,
+                                    size, 0, NULL, NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clEnqueueMapBuffer");
+      ((char *)p)[i % size] = 1;
+      CHECK_CL_ERROR (clEnqueueUnmapMemObject (queue, buf, p, 0, NULL, NULL));
+    }
+  CHECK_CL_ERROR (clFinish (queue));
+  uint64_t elapsed = now_ns () - start;
+  add_result ("map_unmap_rate", n * 1e9 / (double)elapsed, "1/s");
+  add_result ("map_unmap_bandwidth",
+              (double)n * size / (double)elapsed, "GB/s");
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  return EXIT_SUCCESS;
+}
+
+static int
+bench_migration (cl_context context, cl_command_queue *queues,
+                 cl_uint num_devices)
+{
+  cl_int err;
+  unsigned i, n = iterations (200);
+  const size_t size = quick ? 1 << 20 : 64 << 20;
+
+  if (num_devices < 2)
+    return EXIT_SUCCESS;
+
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, size, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  cl_int pattern = 1;
+  CHECK_CL_ERROR (clEnqueueFillBuffer (queues[0], buf, &pattern,
+                                       sizeof (pattern), 0, size, 0, NULL,
+                                       NULL));
+  CHECK_CL_ERROR (clFinish (queues[0]));
+
+  uint64_t start = now_ns ();
+  for (i = 0; i < n; ++i)
+    {
+      /* writing the first and the last element makes all of the other
+         device's copy stale */
+      cl_command_queue q = queues[(i + 1) % 2];
+      CHECK_CL_ERROR (clEnqueueMigrateMemObjects (q, 1, &buf, 0, 0, NULL,
+                                                  NULL));
+      CHECK_CL_ERROR (clEnqueueFillBuffer (q, buf, &pattern,
+                                           sizeof (pattern), 0,
+                                           sizeof (pattern), 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueFillBuffer (
+          q, buf, &pattern, sizeof (pattern), size - sizeof (pattern),
+          sizeof (pattern), 0, NULL, NULL));
+      CHECK_CL_ERROR (clFinish (q));
+    }
+  add_result ("migration_bandwidth",
+              (double)n * size / (double)(now_ns () - start), "GB/s");
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  return EXIT_SUCCESS;
+}
+
+/* The launches of one kernel against the launches cycling through many
+   kernels, each compiled before: the difference is the cost of finding the
+   right kernel binary for the launch. */
+static int
+bench_kernel_switch (cl_context context, cl_device_id device,
+                     cl_command_queue queue, cl_mem arg)
+{
+  cl_int err;
+  size_t gws = 1;
+  unsigned i, k, n = iterations (20000);
+  char *source = (char *)malloc (NUM_SWITCH_KERNELS * 64);
+  cl_kernel kernels[NUM_SWITCH_KERNELS];
+  TEST_ASSERT (source != NULL);
+
+  source[0] = 0;
+  for (k = 0; k < NUM_SWITCH_KERNELS; ++k)
+    sprintf (source + strlen (source),
+             "kernel void k%u(global int *p) { p[0] = %u; }\n", k, k);
+  cl_program program = build_salted (context, device, source, &err);
+  CHECK_OPENCL_ERROR_IN ("clBuildProgram");
+  for (k = 0; k < NUM_SWITCH_KERNELS; ++k)
+    {
+      char name[16];
+      snprintf (name, sizeof (name), "k%u", k);
+      kernels[k] = clCreateKernel (program, name, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+      CHECK_CL_ERROR (clSetKernelArg (kernels[k], 0, sizeof (cl_mem), &arg));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernels[k], 1, NULL,
+                                              &gws, NULL, 0, NULL, NULL));
+    }
+  CHECK_CL_ERROR (clFinish (queue));
+
+  uint64_t start = now_ns ();
+  for (i = 0; i < n; ++i)
+    CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernels[0], 1, NULL, &gws,
+                                            NULL, 0, NULL, NULL));
+  CHECK_CL_ERROR (clFinish (queue));
+  uint64_t same = now_ns () - start;
+
+  start = now_ns ();
+  for (i = 0; i < n; ++i)
+    CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue,
+                                            kernels[i % NUM_SWITCH_KERNELS],
+                                            1, NULL, &gws, NULL, 0, NULL,
+                                            NULL));
+  CHECK_CL_ERROR (clFinish (queue));
+  uint64_t cycling = now_ns () - start;
+
+  add_result ("launch_same_kernel", same / 1e3 / n, "us");
+  add_result ("launch_cycling_kernels", cycling / 1e3 / n, "us");
+
+  for (k = 0; k < NUM_SWITCH_KERNELS; ++k)
+    CHECK_CL_ERROR (clReleaseKernel (kernels[k]));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  free (source);
+  return EXIT_SUCCESS;
+}
+
+/* clBuildProgram and the first launch (which generates the work-group
+   function) of a kernel of N dependent statements. */
+static int
+bench_compile (cl_context context, cl_device_id device,
+               cl_command_queue queue, cl_mem arg)
+{
+  static const unsigned sizes[] = { 16, 128, 1024 };
+  cl_int err;
+  size_t gws = 1;
+  unsigned s, i;
+
+  for (s = 0; s < (quick ? 1 : 3); ++s)
+    {
+      unsigned n = sizes[s];
+      char *source = (char *)malloc (n * 48 + 128);
+      TEST_ASSERT (source != NULL);
+      strcpy (source, "kernel void grow(global int *p) {\n  int x = p[0];\n");
+      for (i = 0; i < n; ++i)
+        sprintf (source + strlen (source), "  x = x * %u + p[%u];\n",
+                 i + 3, i % 7);
+      strcat (source, "  p[0] = x;\n}\n");
+
+      uint64_t start = now_ns ();
+      cl_program program = build_salted (context, device, source, &err);
+      CHECK_OPENCL_ERROR_IN ("clBuildProgram");
+      uint64_t built = now_ns ();
+      cl_kernel kernel = clCreateKernel (program, "grow", &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+      CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &arg));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &gws,
+                                              NULL, 0, NULL, NULL));
+      CHECK_CL_ERROR (clFinish (queue));
+      uint64_t launched = now_ns ();
+
+      char name[64];
+      snprintf (name, sizeof (name), "build_%u_statements", n);
+      add_result (name, (built - start) / 1e6, "ms");
+      snprintf (name, sizeof (name), "first_launch_%u_statements", n);
+      add_result (name, (launched - built) / 1e6, "ms");
+
+      CHECK_CL_ERROR (clReleaseKernel (kernel));
+      CHECK_CL_ERROR (clReleaseProgram (program));
+      free (source);
+    }
+  return EXIT_SUCCESS;
+}
+
+static void
+print_json_string (FILE *out, const char *str)
+{
+  fputc ('"', out);
+  for (; *str; ++str)
+    {
+      if (*str == '"' || *str == '\\')
+        fputc ('\\', out);
+      if ((unsigned char)*str >= 0x20)
+        fputc (*str, out);
+    }
+  fputc ('"', out);
+}
+
+int
+main (int argc, char **argv)
+{
+  uint64_t start = now_ns ();
+  const char *output = NULL;
+  cl_int err;
+  cl_platform_id platform;
+  cl_context context;
+  cl_device_id *devices;
+  cl_command_queue *queues;
+  cl_uint num_devices;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem arg;
+  size_t gws = 1;
+  char platform_version[256], device_name[256];
+  int i;
+
+  for (i = 1; i < argc; ++i)
+    {
+      if (strcmp (argv[i], "--quick") == 0)
+        quick = 1;
+      else if (strcmp (argv[i], "-o") == 0 && i + 1 < argc)
+        output = argv[++i];
+      else
+        {
+          fprintf (stderr, "Usage: %s [--quick] [-o FILE]\n", argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  /* the time to the first kernel includes the runtime initialization,
+     which is why this must be the first OpenCL call */
+  err = poclu_get_multiple_devices (&platform, &context, &num_devices,
+                                    &devices, &queues);
+  CHECK_OPENCL_ERROR_IN ("poclu_get_multiple_devices");
+  uint64_t initialized = now_ns ();
+  program = build_salted (context, devices[0], empty_source, &err);
+  CHECK_OPENCL_ERROR_IN ("clBuildProgram");
+  kernel = clCreateKernel (program, "empty", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  arg = clCreateBuffer (context, CL_MEM_READ_WRITE, 4096, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &arg));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queues[0], kernel, 1, NULL, &gws,
+                                          NULL, 0, NULL, NULL));
+  CHECK_CL_ERROR (clFinish (queues[0]));
+  add_result ("time_to_context", (initialized - start) / 1e6, "ms");
+  add_result ("time_to_first_kernel", (now_ns () - start) / 1e6, "ms");
+
+  CHECK_CL_ERROR (clGetPlatformInfo (platform, CL_PLATFORM_VERSION,
+                                     sizeof (platform_version),
+                                     platform_version, NULL));
+  CHECK_CL_ERROR (clGetDeviceInfo (devices[0], CL_DEVICE_NAME,
+                                   sizeof (device_name), device_name, NULL));
+
+  if (bench_enqueue (context, devices[0], kernel, 0, "in_order")
+      || bench_enqueue (context, devices[0], kernel,
+                        CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                        "out_of_order")
+      || bench_wait_latency (queues[0], kernel)
+      || bench_buffers (context, queues[0])
+      || bench_migration (context, queues, num_devices)
+      || bench_kernel_switch (context, devices[0], queues[0], arg)
+      || bench_compile (context, devices[0], queues[0], arg))
+    return EXIT_FAILURE;
+
+  FILE *out = output ? fopen (output, "w") : stdout;
+  TEST_ASSERT (out != NULL);
+  fprintf (out, "{\n  \"platform\": ");
+  print_json_string (out, platform_version);
+  fprintf (out, ",\n  \"device\": ");
+  print_json_string (out, device_name);
+  fprintf (out, ",\n  \"num_devices\": %u,\n  \"quick\": %s,\n", num_devices,
+           quick ? "true" : "false");
+  fprintf (out, "  \"results\": {\n");
+  for (i = 0; i < (int)num_results; ++i)
+    fprintf (out, "    \"%s\": { \"value\": %.6g, \"unit\": \"%s\" }%s\n",
+             results[i].name, results[i].value, results[i].unit,
+             i + 1 < (int)num_results ? "," : "");
+  fprintf (out, "  }\n}\n");
+  if (output)
+    fclose (out);
+
+  CHECK_CL_ERROR (clReleaseMemObject (arg));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  for (i = 0; i < (int)num_devices; ++i)
+    CHECK_CL_ERROR (clReleaseCommandQueue (queues[i]));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+  free (devices);
+  free (queues);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,478 @@
+/* Benchmarks of the quality of the generated kernel code: a corpus of
+   stencil, reduction, GEMM, histogram, image filter and branchy kernels is
+   run with each work-group method, and the attained GFLOP/s and GB/s are
+   compared to a roofline of the device. The results are printed as JSON.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+*/
+
+#include "poclu.h"
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Usage: pocl_kernel_bench [--quick] [--methods M1,M2,...] [-o FILE]
+
+   Runs itself once per work-group method (default "loopvec,loops,cbs")
+   with POCL_WORK_GROUP_METHOD set, as the method can't change within a
+   process, and collects the results of the runs. --quick uses small
+   problem sizes and one repetition, to check that the benchmarks work. */
+
+extern char **environ;
+
+#define REPS 10
+
+static int quick = 0;
+
+static const char *corpus_source =
+    "kernel void stream_copy(global const float4 *in, global float4 *out) {\n"
+    "  out[get_global_id(0)] = in[get_global_id(0)];\n"
+    "}\n"
+    "kernel void stencil5(global const float *in, global float *out) {\n"
+    "  int x = get_global_id(0), y = get_global_id(1);\n"
+    "  int w = get_global_size(0), h = get_global_size(1);\n"
+    "  int xl = max(x - 1, 0), xr = min(x + 1, w - 1);\n"
+    "  int yu = max(y - 1, 0), yd = min(y + 1, h - 1);\n"
+    "  out[y * w + x] = 0.2f * (in[y * w + x] + in[y * w + xl]\n"
+    "                   + in[y * w + xr] + in[yu * w + x] + in[yd * w + x]);\n"
+    "}\n"
+    "kernel void reduce_sum(global const float *in, global float *out,\n"
+    "                       local float *tmp, int n) {\n"
+    "  int lid = get_local_id(0), lsize = get_local_size(0);\n"
+    "  float sum = 0.0f;\n"
+    "  for (int i = get_global_id(0); i < n; i += get_global_size(0))\n"
+    "    sum += in[i];\n"
+    "  tmp[lid] = sum;\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  for (int s = lsize / 2; s > 0; s /= 2) {\n"
+    "    if (lid < s)\n"
+    "      tmp[lid] += tmp[lid + s];\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  }\n"
+    "  if (lid == 0)\n"
+    "    out[get_group_id(0)] = tmp[0];\n"
+    "}\n"
+    "#define TILE 16\n"
+    "kernel void gemm(global const float *a, global const float *b,\n"
+    "                 global float *c, int n) {\n"
+    "  local float ta[TILE][TILE], tb[TILE][TILE];\n"
+    "  int lx = get_local_id(0), ly = get_local_id(1);\n"
+    "  int col = get_global_id(0), row = get_global_id(1);\n"
+    "  float acc = 0.0f;\n"
+    "  for (int t = 0; t < n; t += TILE) {\n"
+    "    ta[ly][lx] = a[row * n + t + lx];\n"
+    "    tb[ly][lx] = b[(t + ly) * n + col];\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    for (int k = 0; k < TILE; ++k)\n"
+    "      acc = fma(ta[ly][k], tb[k][lx], acc);\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  }\n"
+    "  c[row * n + col] = acc;\n"
+    "}\n"
+    "kernel void histogram(global const uchar *in, global uint *bins,\n"
+    "                      int per_item) {\n"
+    "  local uint lbins[256];\n"
+    "  int lid = get_local_id(0), lsize = get_local_size(0);\n"
+    "  for (int i = lid; i < 256; i += lsize)\n"
+    "    lbins[i] = 0;\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  int base = get_group_id(0) * lsize * per_item;\n"
+    "  for (int i = 0; i < per_item; ++i)\n"
+    "    atomic_inc(&lbins[in[base + i * lsize + lid]]);\n"
+    "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "  for (int i = lid; i < 256; i += lsize)\n"
+    "    atomic_add(&bins[i], lbins[i]);\n"
+    "}\n"
+    "kernel void gauss3x3(global const float *in, global float *out) {\n"
+    "  int x = get_global_id(0), y = get_global_id(1);\n"
+    "  int w = get_global_size(0), h = get_global_size(1);\n"
+    "  float sum = 0.0f;\n"
+    "  for (int dy = -1; dy <= 1; ++dy)\n"
+    "    for (int dx = -1; dx <= 1; ++dx) {\n"
+    "      int xx = clamp(x + dx, 0, w - 1), yy = clamp(y + dy, 0, h - 1);\n"
+    "      float k = (dx == 0 ? 2.0f : 1.0f) * (dy == 0 ? 2.0f : 1.0f);\n"
+    "      sum = fma(k, in[yy * w + xx], sum);\n"
+    "    }\n"
+    "  out[y * w + x] = sum * (1.0f / 16.0f);\n"
+    "}\n"
+    "kernel void branchy(global const int *in, global int *out) {\n"
+    "  int v = in[get_global_id(0)], r = 0;\n"
+    "  if (v & 1)\n"
+    "    r = v * 3 + 1;\n"
+    "  else if (v & 2)\n"
+    "    r = v >> 1;\n"
+    "  else\n"
+    "    r = v ^ 0x5bd1e995;\n"
+    "  for (int i = 0; i < (v & 7); ++i)\n"
+    "    r = (r << 1) ^ (r >> 3);\n"
+    "  out[get_global_id(0)] = r;\n"
+    "}\n";
+
+typedef struct
+{
+  cl_context context;
+  cl_device_id device;
+  cl_command_queue queue;
+  cl_program program;
+  size_t max_wg;
+  FILE *out;
+  int first;
+} bench_ctx;
+
+static int
+compare_ulong (const void *a, const void *b)
+{
+  cl_ulong x = *(const cl_ulong *)a, y = *(const cl_ulong *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* A buffer of random bytes, or with floats, of random small integers so
+   that the float kernels neither overflow nor hit denormals. */
+static cl_mem
+random_buffer (bench_ctx *b, size_t size, int floats, cl_int *err)
+{
+  size_t i;
+  unsigned char *data = (unsigned char *)malloc (size);
+  if (data == NULL)
+    {
+      *err = CL_OUT_OF_HOST_MEMORY;
+      return NULL;
+    }
+  if (floats)
+    for (i = 0; i < size / sizeof (cl_float); ++i)
+      ((cl_float *)data)[i] = (cl_float)(rand () & 0x3f);
+  else
+    for (i = 0; i < size; ++i)
+      data[i] = (unsigned char)rand ();
+  cl_mem buf = clCreateBuffer (b->context,
+                               CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size,
+                               data, err);
+  free (data);
+  return buf;
+}
+
+/* Runs the kernel once to compile it, then REPS times, and returns the
+   median of the command times in *ns. */
+static int
+time_kernel (bench_ctx *b, cl_kernel kernel, cl_uint dims,
+             const size_t *global, const size_t *local, cl_ulong *ns)
+{
+  cl_ulong times[REPS];
+  unsigned i, reps = quick ? 1 : REPS;
+
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (b->queue, kernel, dims, NULL,
+                                          global, local, 0, NULL, NULL));
+  CHECK_CL_ERROR (clFinish (b->queue));
+  for (i = 0; i < reps; ++i)
+    {
+      cl_event ev;
+      cl_ulong start, end;
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (b->queue, kernel, dims, NULL,
+                                              global, local, 0, NULL, &ev));
+      CHECK_CL_ERROR (clWaitForEvents (1, &ev));
+      CHECK_CL_ERROR (clGetEventProfilingInfo (
+          ev, CL_PROFILING_COMMAND_START, sizeof (start), &start, NULL));
+      CHECK_CL_ERROR (clGetEventProfilingInfo (
+          ev, CL_PROFILING_COMMAND_END, sizeof (end), &end, NULL));
+      CHECK_CL_ERROR (clReleaseEvent (ev));
+      times[i] = end - start;
+    }
+  qsort (times, reps, sizeof (cl_ulong), compare_ulong);
+  *ns = times[reps / 2];
+  return EXIT_SUCCESS;
+}
+
+static void
+report (bench_ctx *b, const char *name, cl_ulong ns, double flops,
+        double bytes)
+{
+  fprintf (b->out,
+           "%s\n      \"%s\": { \"time_us\": %.3f, \"gflops\": %.6g, "
+           "\"gbytes_per_s\": %.6g }",
+           b->first ? "" : ",", name, ns / 1e3, flops / (double)ns,
+           bytes / (double)ns);
+  b->first = 0;
+}
+
+/* Creates the kernel and sets the buffers as its first arguments. */
+static cl_kernel
+make_kernel (bench_ctx *b, const char *name, cl_uint num_bufs, cl_mem *bufs,
+             cl_int *err)
+{
+  cl_uint i;
+  cl_kernel kernel = clCreateKernel (b->program, name, err);
+  if (*err != CL_SUCCESS)
+    return NULL;
+  for (i = 0; i < num_bufs && *err == CL_SUCCESS; ++i)
+    *err = clSetKernelArg (kernel, i, sizeof (cl_mem), &bufs[i]);
+  return kernel;
+}
+
+static int
+bench_corpus (bench_ctx *b, double *stream_gbs)
+{
+  cl_int err;
+  cl_ulong ns;
+  cl_kernel k;
+  cl_mem bufs[3];
+  size_t wg = b->max_wg < 256 ? b->max_wg : 256;
+  size_t n1 = quick ? 1 << 18 : 1 << 24;
+  size_t side = quick ? 256 : 2048;
+  cl_int n_gemm = quick ? 128 : 512;
+  size_t global2[2] = { side, side }, local2[2] = { 16, 16 };
+
+  /* streaming copy, the memory side of the roofline */
+  bufs[0] = random_buffer (b, n1 * 16, 1, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  bufs[1] = random_buffer (b, n1 * 16, 1, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  k = make_kernel (b, "stream_copy", 2, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("stream_copy");
+  TEST_ASSERT (time_kernel (b, k, 1, &n1, NULL, &ns) == EXIT_SUCCESS);
+  *stream_gbs = 2.0 * n1 * 16 / (double)ns;
+  report (b, "stream_copy", ns, 0, 2.0 * n1 * 16);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[0]));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[1]));
+
+  bufs[0] = random_buffer (b, side * side * 4, 1, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  bufs[1] = random_buffer (b, side * side * 4, 1, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  k = make_kernel (b, "stencil5", 2, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("stencil5");
+  TEST_ASSERT (time_kernel (b, k, 2, global2, local2, &ns) == EXIT_SUCCESS);
+  report (b, "stencil5", ns, 5.0 * side * side, 8.0 * side * side);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+
+  k = make_kernel (b, "gauss3x3", 2, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("gauss3x3");
+  TEST_ASSERT (time_kernel (b, k, 2, global2, local2, &ns) == EXIT_SUCCESS);
+  report (b, "gauss3x3", ns, 19.0 * side * side, 8.0 * side * side);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[0]));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[1]));
+
+  size_t groups = 64, reduce_global = groups * wg;
+  cl_int n = (cl_int)n1;
+  bufs[0] = random_buffer (b, n1 * 4, 1, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  bufs[1] = random_buffer (b, groups * 4, 1, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  k = make_kernel (b, "reduce_sum", 2, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("reduce_sum");
+  CHECK_CL_ERROR (clSetKernelArg (k, 2, wg * sizeof (cl_float), NULL));
+  CHECK_CL_ERROR (clSetKernelArg (k, 3, sizeof (cl_int), &n));
+  TEST_ASSERT (time_kernel (b, k, 1, &reduce_global, &wg, &ns)
+               == EXIT_SUCCESS);
+  report (b, "reduce_sum", ns, (double)n1, 4.0 * n1);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[0]));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[1]));
+
+  size_t gemm_global[2] = { n_gemm, n_gemm };
+  for (unsigned i = 0; i < 3; ++i)
+    {
+      bufs[i] = random_buffer (b, (size_t)n_gemm * n_gemm * 4, 1, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+    }
+  k = make_kernel (b, "gemm", 3, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("gemm");
+  CHECK_CL_ERROR (clSetKernelArg (k, 3, sizeof (cl_int), &n_gemm));
+  TEST_ASSERT (time_kernel (b, k, 2, gemm_global, local2, &ns)
+               == EXIT_SUCCESS);
+  report (b, "gemm", ns, 2.0 * n_gemm * n_gemm * n_gemm,
+          3.0 * n_gemm * n_gemm * 4);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+  for (unsigned i = 0; i < 3; ++i)
+    CHECK_CL_ERROR (clReleaseMemObject (bufs[i]));
+
+  cl_int per_item = 64;
+  size_t hist_global = n1 / per_item;
+  bufs[0] = random_buffer (b, n1, 0, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  bufs[1] = random_buffer (b, 256 * 4, 0, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  k = make_kernel (b, "histogram", 2, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("histogram");
+  CHECK_CL_ERROR (clSetKernelArg (k, 2, sizeof (cl_int), &per_item));
+  TEST_ASSERT (time_kernel (b, k, 1, &hist_global, &wg, &ns) == EXIT_SUCCESS);
+  report (b, "histogram", ns, 0, (double)n1);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[0]));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[1]));
+
+  bufs[0] = random_buffer (b, n1 * 4, 0, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  bufs[1] = random_buffer (b, n1 * 4, 0, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  k = make_kernel (b, "branchy", 2, bufs, &err);
+  CHECK_OPENCL_ERROR_IN ("branchy");
+  TEST_ASSERT (time_kernel (b, k, 1, &n1, &wg, &ns) == EXIT_SUCCESS);
+  report (b, "branchy", ns, 0, 8.0 * n1);
+  CHECK_CL_ERROR (clReleaseKernel (k));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[0]));
+  CHECK_CL_ERROR (clReleaseMemObject (bufs[1]));
+
+  return EXIT_SUCCESS;
+}
+
+/* One method: builds and runs the corpus, writes a JSON object. */
+static int
+run_method (const char *output)
+{
+  cl_int err;
+  cl_platform_id platform;
+  bench_ctx b;
+  cl_uint compute_units, clock_mhz, vec_width;
+  double stream_gbs = 0;
+
+  memset (&b, 0, sizeof (b));
+  CHECK_CL_ERROR (
+      poclu_get_any_device2 (&b.context, &b.device, &b.queue, &platform));
+  CHECK_CL_ERROR (clReleaseCommandQueue (b.queue));
+  b.queue = clCreateCommandQueue (b.context, b.device,
+                                  CL_QUEUE_PROFILING_ENABLE, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueue");
+  CHECK_CL_ERROR (clGetDeviceInfo (b.device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                                   sizeof (size_t), &b.max_wg, NULL));
+  CHECK_CL_ERROR (clGetDeviceInfo (b.device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                                   sizeof (cl_uint), &compute_units, NULL));
+  CHECK_CL_ERROR (clGetDeviceInfo (b.device, CL_DEVICE_MAX_CLOCK_FREQUENCY,
+                                   sizeof (cl_uint), &clock_mhz, NULL));
+  CHECK_CL_ERROR (clGetDeviceInfo (b.device,
+                                   CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,
+                                   sizeof (cl_uint), &vec_width, NULL));
+  b.program = clCreateProgramWithSource (b.context, 1, &corpus_source, NULL,
+                                         &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  err = clBuildProgram (b.program, 1, &b.device, NULL, NULL, NULL);
+  if (err != CL_SUCCESS)
+    poclu_show_program_build_log (b.program);
+  CHECK_OPENCL_ERROR_IN ("clBuildProgram");
+
+  b.out = fopen (output, "w");
+  TEST_ASSERT (b.out != NULL);
+  b.first = 1;
+  fprintf (b.out, "{\n    \"kernels\": {");
+  if (bench_corpus (&b, &stream_gbs))
+    return EXIT_FAILURE;
+  /* an FMA per lane and cycle on every compute unit */
+  double peak_gflops = 2.0 * compute_units * vec_width * clock_mhz / 1e3;
+  fprintf (b.out,
+           "\n    },\n    \"roofline\": { \"peak_gflops\": %.6g, "
+           "\"stream_gbytes_per_s\": %.6g, \"compute_units\": %u, "
+           "\"clock_mhz\": %u, \"float_vector_width\": %u }\n  }",
+           peak_gflops, stream_gbs, compute_units, clock_mhz, vec_width);
+  fclose (b.out);
+
+  CHECK_CL_ERROR (clReleaseProgram (b.program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (b.queue));
+  CHECK_CL_ERROR (clReleaseContext (b.context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+  return EXIT_SUCCESS;
+}
+
+static int
+copy_file (const char *path, FILE *out)
+{
+  char buf[4096];
+  size_t n;
+  FILE *in = fopen (path, "r");
+  if (in == NULL)
+    return EXIT_FAILURE;
+  while ((n = fread (buf, 1, sizeof (buf), in)) > 0)
+    fwrite (buf, 1, n, out);
+  fclose (in);
+  return EXIT_SUCCESS;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *output = NULL, *child_output = NULL;
+  char methods[256] = "loopvec,loops,cbs";
+  char *method, *save_ptr;
+  int i, first = 1, failed = 0;
+
+  for (i = 1; i < argc; ++i)
+    {
+      if (strcmp (argv[i], "--quick") == 0)
+        quick = 1;
+      else if (strcmp (argv[i], "--methods") == 0 && i + 1 < argc)
+        snprintf (methods, sizeof (methods), "%s", argv[++i]);
+      else if (strcmp (argv[i], "-o") == 0 && i + 1 < argc)
+        output = argv[++i];
+      else if (strcmp (argv[i], "--child") == 0 && i + 1 < argc)
+        child_output = argv[++i];
+      else
+        {
+          fprintf (stderr,
+                   "Usage: %s [--quick] [--methods M1,M2,...] [-o FILE]\n",
+                   argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  if (child_output)
+    return run_method (child_output);
+
+  FILE *out = output ? fopen (output, "w") : stdout;
+  TEST_ASSERT (out != NULL);
+  fprintf (out, "{\n  \"quick\": %s,\n  \"methods\": {",
+           quick ? "true" : "false");
+  for (method = strtok_r (methods, ",", &save_ptr); method != NULL;
+       method = strtok_r (NULL, ",", &save_ptr))
+    {
+      char tmp[64];
+      int status;
+      pid_t pid;
+      char *child_argv[] = { argv[0], "--child", tmp,
+                             quick ? "--quick" : NULL, NULL };
+
+      snprintf (tmp, sizeof (tmp), "pocl_kernel_bench.%d.%s.json",
+                (int)getpid (), method);
+      setenv ("POCL_WORK_GROUP_METHOD", method, 1);
+      if (posix_spawnp (&pid, argv[0], NULL, NULL, child_argv, environ) != 0
+          || waitpid (pid, &status, 0) != pid || !WIFEXITED (status)
+          || WEXITSTATUS (status) != 0)
+        {
+          fprintf (stderr, "FAIL: the %s run failed\n", method);
+          failed = 1;
+          unlink (tmp);
+          continue;
+        }
+      fprintf (out, "%s\n  \"%s\": ", first ? "" : ",", method);
+      first = 0;
+      if (copy_file (tmp, out))
+        failed = 1;
+      unlink (tmp);
+    }
+  fprintf (out, "\n  }\n}\n");
+  if (output)
+    fclose (out);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
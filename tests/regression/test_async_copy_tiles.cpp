@@ -0,0 +1,113 @@
+// Copyright (c) 2023 PoCL developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/* Tests the async work-group copies in a tiled kernel: the tiles are copied
+ * to local memory with both the contiguous and the strided copies, consumed
+ * by all the work-items after wait_group_events() and copied back. */
+
+#include "pocl_opencl.h"
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#include <CL/cl2.hpp>
+#include <iostream>
+#include <vector>
+
+#define LOCAL_SIZE 16
+#define TILE 64
+#define TILES 8
+
+const char *SOURCE = R"RAW(
+#define TILE 64
+#define TILES 8
+
+__kernel void tiles(__global const float4 *in, __global const float *col,
+                    __global float4 *out) {
+  __local float4 tile[TILE];
+  __local float tcol[TILE];
+  __local float4 res[TILE];
+  size_t g = get_group_id(0);
+  float4 acc = 0.0f;
+  for (int t = 0; t < TILES; ++t) {
+    size_t base = (g * TILES + t) * TILE;
+    event_t e = async_work_group_copy(tile, in + base, TILE, 0);
+    e = async_work_group_strided_copy(tcol, col + base * 2, TILE, 2, e);
+    wait_group_events(1, &e);
+    for (size_t i = get_local_id(0); i < TILE; i += get_local_size(0))
+      res[i] = tile[TILE - 1 - i] * tcol[i];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    e = async_work_group_copy(out + base, res, TILE, 0);
+    wait_group_events(1, &e);
+  }
+}
+)RAW";
+
+int main() {
+  const size_t Groups = 3;
+  const size_t N = Groups * TILES * TILE;
+  std::vector<cl_float4> In(N), Out(N);
+  std::vector<float> Col(N * 2);
+  for (size_t i = 0; i < N; ++i) {
+    for (int j = 0; j < 4; ++j)
+      In[i].s[j] = (float)(i * 4 + j);
+    Col[i * 2] = (float)(i % 7);
+    Col[i * 2 + 1] = -1.0f;
+  }
+
+  try {
+    cl::Program program(SOURCE, true);
+    cl::Buffer InBuf(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(cl_float4) * N, In.data());
+    cl::Buffer ColBuf(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                      sizeof(float) * N * 2, Col.data());
+    cl::Buffer OutBuf(CL_MEM_WRITE_ONLY, sizeof(cl_float4) * N);
+    cl::Kernel kernel(program, "tiles");
+    kernel.setArg(0, InBuf);
+    kernel.setArg(1, ColBuf);
+    kernel.setArg(2, OutBuf);
+    cl::CommandQueue queue = cl::CommandQueue::getDefault();
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                               cl::NDRange(Groups * LOCAL_SIZE),
+                               cl::NDRange(LOCAL_SIZE));
+    queue.enqueueReadBuffer(OutBuf, CL_TRUE, 0, sizeof(cl_float4) * N,
+                            Out.data());
+  } catch (cl::Error &err) {
+    std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < N; ++i) {
+    size_t Base = i / TILE * TILE;
+    size_t Src = Base + TILE - 1 - (i - Base);
+    for (int j = 0; j < 4; ++j) {
+      float Expected = In[Src].s[j] * Col[i * 2];
+      if (Out[i].s[j] != Expected) {
+        std::cerr << "FAIL at " << i << "." << j << ": " << Out[i].s[j]
+                  << " != " << Expected << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
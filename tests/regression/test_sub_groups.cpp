@@ -0,0 +1,172 @@
+// Copyright (c) 2023 PoCL developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/* Tests the cl_khr_subgroups and cl_khr_subgroup_shuffle functions with a
+ * 2D work-group whose size is not a multiple of the sub-group size, so the
+ * last sub-group is partial. The sub-group size the kernel sees must agree
+ * with CL_KERNEL_MAX_SUB_GROUP_SIZE_FOR_NDRANGE. */
+
+#include "pocl_opencl.h"
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#include <CL/cl2.hpp>
+#include <climits>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define LOCAL_X 10
+#define LOCAL_Y 3
+#define GROUPS 2
+
+const char *SOURCE = R"RAW(
+__kernel void sub_groups(__global const int *in, __global int *info,
+                         __global int *sum, __global uint *umax,
+                         __global int *scan, __global int *bcast,
+                         __global int *shuffled, __global int *any) {
+  size_t lid = get_local_linear_id();
+  size_t gid = get_group_id(0) * get_local_size(0) * get_local_size(1) + lid;
+  int v = in[gid];
+  info[gid] = get_sub_group_id() * 65536 + get_sub_group_local_id() * 256 +
+              get_sub_group_size();
+  sum[gid] = sub_group_reduce_add(v);
+  umax[gid] = sub_group_reduce_max((uint)v);
+  scan[gid] = sub_group_scan_inclusive_add(v) * 1000 +
+              min(sub_group_scan_exclusive_min(v), 100);
+  bcast[gid] = sub_group_broadcast(v, 1) + get_num_sub_groups() * 1000;
+  shuffled[gid] = sub_group_shuffle_xor(v, 1) * 1000 +
+                  sub_group_shuffle(v, get_sub_group_size() - 1);
+  sub_group_barrier(CLK_LOCAL_MEM_FENCE);
+  any[gid] = sub_group_any(v > 8) + 2 * sub_group_all(v > -4);
+}
+)RAW";
+
+int main() {
+  const size_t WGSize = LOCAL_X * LOCAL_Y;
+  const size_t N = GROUPS * WGSize;
+  std::vector<cl_int> In(N), Info(N), Sum(N), Scan(N), Bcast(N), Shuffled(N),
+      Any(N);
+  std::vector<cl_uint> UMax(N);
+  for (size_t i = 0; i < N; ++i)
+    In[i] = (int)((i * 5) % 13) - 4;
+  size_t SGSize = 0;
+
+  try {
+    cl::Device device = cl::Device::getDefault();
+    std::string Extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+    if (Extensions.find("cl_khr_subgroups") == std::string::npos ||
+        Extensions.find("cl_khr_subgroup_shuffle") == std::string::npos) {
+      std::cout << "OK" << std::endl;
+      return EXIT_SUCCESS;
+    }
+
+    cl::Program program(SOURCE);
+    program.build();
+    cl::Buffer InBuf(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(cl_int) * N, In.data());
+    std::vector<cl::Buffer> OutBufs;
+    for (int i = 0; i < 7; ++i)
+      OutBufs.push_back(cl::Buffer(CL_MEM_WRITE_ONLY, sizeof(cl_int) * N));
+    cl::Kernel kernel(program, "sub_groups");
+    kernel.setArg(0, InBuf);
+    for (int i = 0; i < 7; ++i)
+      kernel.setArg(i + 1, OutBufs[i]);
+
+    size_t Local[] = {LOCAL_X, LOCAL_Y};
+    cl_int Err = clGetKernelSubGroupInfo(
+        kernel(), device(), CL_KERNEL_MAX_SUB_GROUP_SIZE_FOR_NDRANGE,
+        sizeof(Local), Local, sizeof(SGSize), &SGSize, NULL);
+    if (Err != CL_SUCCESS || SGSize == 0 || SGSize > WGSize) {
+      std::cerr << "FAIL: CL_KERNEL_MAX_SUB_GROUP_SIZE_FOR_NDRANGE " << SGSize
+                << " (" << Err << ")" << std::endl;
+      return EXIT_FAILURE;
+    }
+    // The broadcast and the shuffles read the second lane.
+    if (SGSize < 2) {
+      std::cout << "OK" << std::endl;
+      return EXIT_SUCCESS;
+    }
+    size_t Count = 0;
+    Err = clGetKernelSubGroupInfo(
+        kernel(), device(), CL_KERNEL_SUB_GROUP_COUNT_FOR_NDRANGE,
+        sizeof(Local), Local, sizeof(Count), &Count, NULL);
+    if (Err != CL_SUCCESS || Count != (WGSize + SGSize - 1) / SGSize) {
+      std::cerr << "FAIL: CL_KERNEL_SUB_GROUP_COUNT_FOR_NDRANGE " << Count
+                << " (" << Err << ")" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    cl::CommandQueue queue = cl::CommandQueue::getDefault();
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                               cl::NDRange(GROUPS * LOCAL_X, LOCAL_Y),
+                               cl::NDRange(LOCAL_X, LOCAL_Y));
+    void *Outs[] = {Info.data(),  Sum.data(),      UMax.data(), Scan.data(),
+                    Bcast.data(), Shuffled.data(), Any.data()};
+    for (int i = 0; i < 7; ++i)
+      queue.enqueueReadBuffer(OutBufs[i], CL_TRUE, 0, sizeof(cl_int) * N,
+                              Outs[i]);
+  } catch (cl::Error &err) {
+    std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const size_t NumSG = (WGSize + SGSize - 1) / SGSize;
+  for (size_t g = 0; g < GROUPS; ++g) {
+    for (size_t i = 0; i < WGSize; ++i) {
+      size_t SG = i / SGSize, Lane = i % SGSize;
+      size_t Start = SG * SGSize;
+      size_t Size = WGSize - Start < SGSize ? WGSize - Start : SGSize;
+      const cl_int *V = &In[g * WGSize + Start];
+      int Total = 0, Prefix = 0, PrefixMin = INT_MAX, AnySet = 0, AllSet = 1;
+      cl_uint MaxU = 0;
+      for (size_t j = 0; j < Size; ++j) {
+        Total += V[j];
+        MaxU = (cl_uint)V[j] > MaxU ? (cl_uint)V[j] : MaxU;
+        AnySet |= V[j] > 8;
+        AllSet &= V[j] > -4;
+        if (j < Lane)
+          PrefixMin = V[j] < PrefixMin ? V[j] : PrefixMin;
+        if (j <= Lane)
+          Prefix += V[j];
+      }
+      PrefixMin = PrefixMin < 100 ? PrefixMin : 100;
+      size_t Id = g * WGSize + i;
+      bool Ok = Info[Id] == (int)(SG * 65536 + Lane * 256 + Size) &&
+                Sum[Id] == Total && UMax[Id] == MaxU &&
+                Scan[Id] == Prefix * 1000 + PrefixMin &&
+                Bcast[Id] == V[1] + (int)NumSG * 1000 &&
+                Shuffled[Id] == V[Lane ^ 1] * 1000 + V[Size - 1] &&
+                Any[Id] == AnySet + 2 * AllSet;
+      if (!Ok) {
+        std::cerr << "FAIL at group " << g << " work-item " << i << ": "
+                  << Info[Id] << " " << Sum[Id] << " " << UMax[Id] << " "
+                  << Scan[Id] << " " << Bcast[Id] << " " << Shuffled[Id]
+                  << " " << Any[Id] << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+// Copyright (c) 2023 PoCL developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/* Tests vload_halfN and vstore_halfN of all the widths at addresses that are
+ * only aligned to a half, and the rounding modes of vstore_half. */
+
+#include "pocl_opencl.h"
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#include <CL/cl2.hpp>
+#include <iostream>
+#include <vector>
+
+const char *SOURCE = R"RAW(
+__kernel void vload_store_half(__global const half *in, __global half *out,
+                               __global float *loaded,
+                               __global half *rounded) {
+  /* Each width copies one vector starting at an odd offset. */
+  vstore_half(vload_half(1, in), 1, out);
+  vstore_half2(vload_half2(0, in + 17), 0, out + 17);
+  vstore_half3(vload_half3(0, in + 33), 0, out + 33);
+  vstore_half4(vload_half4(0, in + 49), 0, out + 49);
+  vstore_half8(vload_half8(0, in + 65), 0, out + 65);
+  vstore_half16(vload_half16(0, in + 81), 0, out + 81);
+  vstore16(vload_half16(0, in + 81), 0, loaded);
+
+  /* 1 + 2^-12 and its negation lie between two halves. */
+  float2 v = (float2)(1.0f + 0x1.0p-12f, -1.0f - 0x1.0p-12f);
+  vstore_half2_rte(v, 0, rounded + 1);
+  vstore_half2_rtz(v, 0, rounded + 3);
+  vstore_half2_rtp(v, 0, rounded + 5);
+  vstore_half2_rtn(v, 0, rounded + 7);
+  vstore_half8_rtp((float8)(v, v, v, v), 1, rounded + 1);
+  vstore_half_rtn(v.y, 17, rounded);
+  vstore_half16_rtz((float16)(v.x), 0, rounded + 19);
+}
+)RAW";
+
+int main() {
+  const size_t N = 128;
+  std::vector<cl_half> In(N), Out(N, 0), Rounded(48, 0);
+  std::vector<cl_float> Loaded(16);
+  // Exactly representable halves: In[i] = i / 8.
+  for (size_t i = 1; i < N; ++i) {
+    // i = 2^E * (1 + M / 1024), so i / 8 has the biased exponent E - 3 + 15.
+    unsigned E = 0;
+    while ((i >> E) > 1)
+      ++E;
+    unsigned M = (unsigned)(((i << 10) >> E) & 0x3FF);
+    In[i] = (cl_half)(((E - 3 + 15) << 10) | M);
+  }
+
+  try {
+    cl::Device device = cl::Device::getDefault();
+    if (device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp16") ==
+        std::string::npos) {
+      std::cout << "OK" << std::endl;
+      return EXIT_SUCCESS;
+    }
+
+    cl::Program program(SOURCE);
+    program.build();
+    cl::Buffer InBuf(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(cl_half) * N, In.data());
+    cl::Buffer OutBuf(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                      sizeof(cl_half) * N, Out.data());
+    cl::Buffer LoadedBuf(CL_MEM_WRITE_ONLY, sizeof(cl_float) * 16);
+    cl::Buffer RoundedBuf(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                          sizeof(cl_half) * Rounded.size(), Rounded.data());
+    cl::Kernel kernel(program, "vload_store_half");
+    kernel.setArg(0, InBuf);
+    kernel.setArg(1, OutBuf);
+    kernel.setArg(2, LoadedBuf);
+    kernel.setArg(3, RoundedBuf);
+
+    cl::CommandQueue queue = cl::CommandQueue::getDefault();
+    queue.enqueueTask(kernel);
+    queue.enqueueReadBuffer(OutBuf, CL_TRUE, 0, sizeof(cl_half) * N,
+                            Out.data());
+    queue.enqueueReadBuffer(LoadedBuf, CL_TRUE, 0, sizeof(cl_float) * 16,
+                            Loaded.data());
+    queue.enqueueReadBuffer(RoundedBuf, CL_TRUE, 0,
+                            sizeof(cl_half) * Rounded.size(), Rounded.data());
+  } catch (cl::Error &err) {
+    std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // The copies cover [1, 2), [17, 19), [33, 36), [49, 53), [65, 73) and
+  // [81, 97); everything else must stay zero.
+  const size_t Starts[] = {1, 17, 33, 49, 65, 81};
+  const size_t Widths[] = {1, 2, 3, 4, 8, 16};
+  std::vector<bool> Copied(N, false);
+  for (size_t w = 0; w < 6; ++w)
+    for (size_t i = 0; i < Widths[w]; ++i)
+      Copied[Starts[w] + i] = true;
+  for (size_t i = 0; i < N; ++i) {
+    cl_half Expected = Copied[i] ? In[i] : 0;
+    if (Out[i] != Expected) {
+      std::cerr << "FAIL: half " << i << " " << std::hex << Out[i]
+                << " != " << Expected << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  for (size_t i = 0; i < 16; ++i) {
+    if (Loaded[i] != (float)(81 + i) / 8.0f) {
+      std::cerr << "FAIL: loaded " << i << " " << Loaded[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  const cl_half One = 0x3C00, OneUp = 0x3C01, MinusOne = 0xBC00,
+                MinusOneDown = 0xBC01;
+  std::vector<cl_half> ExpectedRounded(Rounded.size(), 0);
+  // rte, rtz, rtp and rtn of (1 + 2^-12, -1 - 2^-12), the rtp ones are
+  // then overwritten by the vstore_half8_rtp at [9, 17).
+  const cl_half Pairs[][2] = {{One, MinusOne},
+                              {One, MinusOne},
+                              {OneUp, MinusOne},
+                              {One, MinusOneDown}};
+  for (size_t m = 0; m < 4; ++m) {
+    ExpectedRounded[1 + 2 * m] = Pairs[m][0];
+    ExpectedRounded[2 + 2 * m] = Pairs[m][1];
+  }
+  for (size_t i = 9; i < 17; i += 2) {
+    ExpectedRounded[i] = OneUp;
+    ExpectedRounded[i + 1] = MinusOne;
+  }
+  ExpectedRounded[17] = MinusOneDown;
+  for (size_t i = 19; i < 35; ++i)
+    ExpectedRounded[i] = One;
+  for (size_t i = 0; i < Rounded.size(); ++i) {
+    if (Rounded[i] != ExpectedRounded[i]) {
+      std::cerr << "FAIL: rounded " << i << " " << std::hex << Rounded[i]
+                << " != " << ExpectedRounded[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2023 PoCL developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/* Tests the OpenCL 2.0 work-group collective functions, which the kernel
+ * compiler lowers to accumulation in the work-item loops: the reductions
+ * and scans run in a loop to check the accumulators are reset for the
+ * next call, and the broadcast picks a work-item of a 2D work-group. */
+
+#include "pocl_opencl.h"
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#include <CL/cl2.hpp>
+#include <climits>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define LOCAL_X 8
+#define LOCAL_Y 4
+#define GROUPS 3
+#define ROUNDS 3
+
+const char *SOURCE = R"RAW(
+#define ROUNDS 3
+
+__kernel void collectives(__global const int *in, __global int *sum,
+                          __global int *inclusive, __global int *exclusive,
+                          __global uint *umin, __global int *bcast,
+                          __global float *fmaxv, __global int *allany) {
+  size_t lid = get_local_linear_id();
+  size_t gid = get_group_id(0) * get_local_size(0) * get_local_size(1) + lid;
+  int v = in[gid];
+  int s = 0;
+  for (int r = 0; r < ROUNDS; ++r)
+    s += work_group_reduce_add(v + r);
+  sum[gid] = s;
+  inclusive[gid] = work_group_scan_inclusive_add(v);
+  exclusive[gid] = work_group_scan_exclusive_max(v);
+  umin[gid] = work_group_reduce_min((uint)v);
+  bcast[gid] = work_group_broadcast(v, 5, 2);
+  fmaxv[gid] = work_group_reduce_max((float)v);
+  allany[gid] = work_group_all(v > -10) + 2 * work_group_any(v > 10);
+}
+)RAW";
+
+int main() {
+  const size_t WGSize = LOCAL_X * LOCAL_Y;
+  const size_t N = GROUPS * WGSize;
+  std::vector<cl_int> In(N), Sum(N), Inclusive(N), Exclusive(N), Bcast(N),
+      AllAny(N);
+  std::vector<cl_uint> UMin(N);
+  std::vector<cl_float> FMax(N);
+  for (size_t i = 0; i < N; ++i)
+    In[i] = (int)((i * 7) % 23) - 5;
+
+  try {
+    cl::Device device = cl::Device::getDefault();
+    std::string Version = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+    if (Version.compare(0, 10, "OpenCL C 2") != 0) {
+      std::cout << "OK" << std::endl;
+      return EXIT_SUCCESS;
+    }
+
+    cl::Program program(SOURCE);
+    program.build("-cl-std=CL2.0");
+    cl::Buffer InBuf(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(cl_int) * N, In.data());
+    std::vector<cl::Buffer> OutBufs;
+    for (int i = 0; i < 7; ++i)
+      OutBufs.push_back(cl::Buffer(CL_MEM_WRITE_ONLY, sizeof(cl_int) * N));
+    cl::Kernel kernel(program, "collectives");
+    kernel.setArg(0, InBuf);
+    for (int i = 0; i < 7; ++i)
+      kernel.setArg(i + 1, OutBufs[i]);
+    cl::CommandQueue queue = cl::CommandQueue::getDefault();
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                               cl::NDRange(GROUPS * LOCAL_X, LOCAL_Y),
+                               cl::NDRange(LOCAL_X, LOCAL_Y));
+    void *Outs[] = {Sum.data(),  Inclusive.data(), Exclusive.data(),
+                    UMin.data(), Bcast.data(),     FMax.data(),
+                    AllAny.data()};
+    for (int i = 0; i < 7; ++i)
+      queue.enqueueReadBuffer(OutBufs[i], CL_TRUE, 0, sizeof(cl_int) * N,
+                              Outs[i]);
+  } catch (cl::Error &err) {
+    std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  for (size_t g = 0; g < GROUPS; ++g) {
+    const cl_int *V = &In[g * WGSize];
+    int Total = 0, Max = V[0], AnySet = 0, AllSet = 1;
+    cl_uint MinU = (cl_uint)V[0];
+    for (size_t i = 0; i < WGSize; ++i) {
+      Total += V[i];
+      Max = V[i] > Max ? V[i] : Max;
+      MinU = (cl_uint)V[i] < MinU ? (cl_uint)V[i] : MinU;
+      AllSet &= V[i] > -10;
+      AnySet |= V[i] > 10;
+    }
+    int RoundsSum = ROUNDS * Total + (int)WGSize * ROUNDS * (ROUNDS - 1) / 2;
+    int Prefix = 0, PrefixMax = INT_MIN;
+    for (size_t i = 0; i < WGSize; ++i) {
+      size_t Id = g * WGSize + i;
+      Prefix += V[i];
+      bool Ok = Sum[Id] == RoundsSum && Inclusive[Id] == Prefix &&
+                Exclusive[Id] == PrefixMax && UMin[Id] == MinU &&
+                Bcast[Id] == V[2 * LOCAL_X + 5] && FMax[Id] == (float)Max &&
+                AllAny[Id] == AllSet + 2 * AnySet;
+      if (!Ok) {
+        std::cerr << "FAIL at group " << g << " work-item " << i << ": "
+                  << Sum[Id] << " " << Inclusive[Id] << " " << Exclusive[Id]
+                  << " " << UMin[Id] << " " << Bcast[Id] << " " << FMax[Id]
+                  << " " << AllAny[Id] << std::endl;
+        return EXIT_FAILURE;
+      }
+      PrefixMax = V[i] > PrefixMax ? V[i] : PrefixMax;
+    }
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
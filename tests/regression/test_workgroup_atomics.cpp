@@ -0,0 +1,131 @@
+// Copyright (c) 2023 PoCL developers
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+/* Tests a histogram kernel whose local atomics the kernel compiler turns to
+ * plain accesses, and whose global counters it accumulates per work-group.
+ * The old values the local atomics return must stay exact, and the updates
+ * of all the work-groups must reach the global memory. */
+
+#include "pocl_opencl.h"
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#include <CL/cl2.hpp>
+#include <iostream>
+#include <vector>
+
+#define BINS 16
+#define LOCAL_SIZE 64
+#define GROUPS 8
+
+const char *SOURCE = R"RAW(
+#define BINS 16
+__kernel void histogram(__global const uint *in, __global uint *hist,
+                        __global uint *ranks, __global uint *stats) {
+  __local uint bins[BINS];
+  size_t lid = get_local_id(0);
+  if (lid < BINS)
+    bins[lid] = 0;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  uint v = in[get_global_id(0)];
+  ranks[get_global_id(0)] = atomic_inc(&bins[v % BINS]);
+  atomic_add(&stats[0], v);
+  atomic_inc(&stats[1]);
+  atomic_max(&stats[2], v);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (lid < BINS)
+    atomic_add(&hist[lid], bins[lid]);
+}
+)RAW";
+
+int main() {
+  const size_t N = LOCAL_SIZE * GROUPS;
+  std::vector<cl_uint> In(N), Hist(BINS, 0), Ranks(N), Stats(3, 0);
+  for (size_t i = 0; i < N; ++i)
+    In[i] = (cl_uint)((i * 7919) % 1013);
+
+  try {
+    cl::Program program(SOURCE);
+    program.build();
+    cl::Buffer InBuf(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                     sizeof(cl_uint) * N, In.data());
+    cl::Buffer HistBuf(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                       sizeof(cl_uint) * BINS, Hist.data());
+    cl::Buffer RanksBuf(CL_MEM_WRITE_ONLY, sizeof(cl_uint) * N);
+    cl::Buffer StatsBuf(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof(cl_uint) * 3, Stats.data());
+    cl::Kernel kernel(program, "histogram");
+    kernel.setArg(0, InBuf);
+    kernel.setArg(1, HistBuf);
+    kernel.setArg(2, RanksBuf);
+    kernel.setArg(3, StatsBuf);
+
+    cl::CommandQueue queue = cl::CommandQueue::getDefault();
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(N),
+                               cl::NDRange(LOCAL_SIZE));
+    queue.enqueueReadBuffer(HistBuf, CL_TRUE, 0, sizeof(cl_uint) * BINS,
+                            Hist.data());
+    queue.enqueueReadBuffer(RanksBuf, CL_TRUE, 0, sizeof(cl_uint) * N,
+                            Ranks.data());
+    queue.enqueueReadBuffer(StatsBuf, CL_TRUE, 0, sizeof(cl_uint) * 3,
+                            Stats.data());
+  } catch (cl::Error &err) {
+    std::cerr << "ERROR: " << err.what() << "(" << err.err() << ")"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<cl_uint> Expected(BINS, 0);
+  cl_uint Sum = 0, Max = 0;
+  for (size_t g = 0; g < GROUPS; ++g) {
+    // The ranks within one work-group's bin must be a permutation of
+    // 0..count-1.
+    std::vector<std::vector<bool>> Seen(BINS,
+                                        std::vector<bool>(LOCAL_SIZE, false));
+    for (size_t i = g * LOCAL_SIZE; i < (g + 1) * LOCAL_SIZE; ++i) {
+      cl_uint Bin = In[i] % BINS;
+      if (Ranks[i] >= LOCAL_SIZE || Seen[Bin][Ranks[i]]) {
+        std::cerr << "FAIL: rank " << Ranks[i] << " at " << i << std::endl;
+        return EXIT_FAILURE;
+      }
+      Seen[Bin][Ranks[i]] = true;
+      ++Expected[Bin];
+      Sum += In[i];
+      Max = In[i] > Max ? In[i] : Max;
+    }
+  }
+
+  for (size_t b = 0; b < BINS; ++b) {
+    if (Hist[b] != Expected[b]) {
+      std::cerr << "FAIL: bin " << b << " " << Hist[b] << " != "
+                << Expected[b] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (Stats[0] != Sum || Stats[1] != N || Stats[2] != Max) {
+    std::cerr << "FAIL: stats " << Stats[0] << " " << Stats[1] << " "
+              << Stats[2] << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cout << "OK" << std::endl;
+  return EXIT_SUCCESS;
+}
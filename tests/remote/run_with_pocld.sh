@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs a test with the remote device, against a pocld serving the pthread
+# device on 127.0.0.1 at the given port.
+#
+# Usage: run_with_pocld.sh <pocld> <port> <test> [arguments]
+
+POCLD="$1"
+PORT="$2"
+shift 2
+
+LOG="pocld_${PORT}.log"
+POCL_DEVICES=pthread "$POCLD" -a 127.0.0.1 -p "$PORT" >"$LOG" 2>&1 &
+POCLD_PID=$!
+trap 'kill $POCLD_PID 2>/dev/null' EXIT INT TERM
+
+# wait for it to listen, for up to 10 seconds
+i=0
+while ! grep -q "listening at port" "$LOG"; do
+  if ! kill -0 $POCLD_PID 2>/dev/null || [ $i -ge 100 ]; then
+    echo "FAIL: pocld did not start at port $PORT:"
+    cat "$LOG"
+    exit 1
+  fi
+  i=$((i + 1))
+  sleep 0.1
+done
+
+POCL_DEVICES=remote POCL_REMOTE0_PARAMETERS="127.0.0.1:$PORT" "$@"
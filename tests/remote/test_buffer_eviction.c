@@ -0,0 +1,148 @@
+/* Tests the eviction of the least recently used buffers from a device
+   that runs out of memory: more buffers than fit in the memory of the
+   device are written, copied and read, and each must keep its content
+   over the evictions and the migrations back to the device.
+
+   Copyright (c) 2026 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_BUFFERS 10
+/* the buffers fill the device memory this many times */
+#define BUFFERS_PER_MEMORY 4
+/* the largest device memory the test runs with */
+#define MAX_MEMORY (64 * 1024 * 1024)
+#define PATCH_OFFSET 1000
+#define PATCH_SIZE 100
+
+static unsigned char
+pattern (size_t buffer, size_t i)
+{
+  return (unsigned char)(buffer * 131 + i * 7 + (i >> 8));
+}
+
+static int
+check (const unsigned char *data, size_t size, size_t buffer,
+       const char *what)
+{
+  size_t i;
+  for (i = 0; i < size; ++i)
+    if (data[i] != pattern (buffer, i))
+      {
+        printf ("FAIL: %s: byte %zu of buffer %zu is %u, not %u\n", what, i,
+                buffer, data[i], pattern (buffer, i));
+        return EXIT_FAILURE;
+      }
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_mem buffers[NUM_BUFFERS], scratch;
+  cl_ulong mem_size;
+  unsigned char *data;
+  size_t size, b, i;
+
+  CHECK_CL_ERROR (poclu_get_any_device2 (&context, &device, &queue,
+                                         &platform));
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_GLOBAL_MEM_SIZE,
+                                   sizeof (mem_size), &mem_size, NULL));
+  if (mem_size > MAX_MEMORY)
+    {
+      printf ("The device has %lu bytes of memory, more than the test "
+              "exhausts; limit it with POCL_REMOTE_MEMORY_LIMIT\n",
+              (unsigned long)mem_size);
+      return 77;
+    }
+  size = (size_t)mem_size / BUFFERS_PER_MEMORY;
+  TEST_ASSERT (size > PATCH_OFFSET + PATCH_SIZE);
+  TEST_ASSERT ((cl_ulong)size * NUM_BUFFERS > mem_size);
+
+  data = (unsigned char *)malloc (size);
+  TEST_ASSERT (data != NULL);
+
+  /* the later writes evict the buffers written first; without the
+     eviction, they would fail to allocate the memory */
+  for (b = 0; b < NUM_BUFFERS; ++b)
+    {
+      buffers[b]
+          = clCreateBuffer (context, CL_MEM_READ_WRITE, size, NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+      for (i = 0; i < size; ++i)
+        data[i] = pattern (b, i);
+      CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buffers[b], CL_TRUE, 0,
+                                            size, data, 0, NULL, NULL));
+    }
+
+  /* the reads migrate the evicted buffers back to the device */
+  for (b = 0; b < NUM_BUFFERS; ++b)
+    {
+      memset (data, 0, size);
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buffers[b], CL_TRUE, 0,
+                                           size, data, 0, NULL, NULL));
+      TEST_ASSERT (check (data, size, b, "read") == EXIT_SUCCESS);
+    }
+
+  /* the copies use each buffer with another one on the device */
+  scratch = clCreateBuffer (context, CL_MEM_READ_WRITE, size, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  for (b = 0; b < NUM_BUFFERS; ++b)
+    {
+      memset (data, 0, size);
+      CHECK_CL_ERROR (clEnqueueCopyBuffer (queue, buffers[b], scratch, 0, 0,
+                                           size, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, scratch, CL_TRUE, 0, size,
+                                           data, 0, NULL, NULL));
+      TEST_ASSERT (check (data, size, b, "copy") == EXIT_SUCCESS);
+    }
+
+  /* a partial write to the evicted first buffer keeps the rest of it */
+  for (i = 0; i < PATCH_SIZE; ++i)
+    data[i] = pattern (0, PATCH_OFFSET + i);
+  CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buffers[0], CL_TRUE,
+                                        PATCH_OFFSET, PATCH_SIZE, data, 0,
+                                        NULL, NULL));
+  memset (data, 0, size);
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buffers[0], CL_TRUE, 0, size,
+                                       data, 0, NULL, NULL));
+  TEST_ASSERT (check (data, size, 0, "partial write") == EXIT_SUCCESS);
+
+  for (b = 0; b < NUM_BUFFERS; ++b)
+    CHECK_CL_ERROR (clReleaseMemObject (buffers[b]));
+  CHECK_CL_ERROR (clReleaseMemObject (scratch));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+  free (data);
+
+  printf ("OK\n");
+  return EXIT_SUCCESS;
+}
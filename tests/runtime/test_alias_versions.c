@@ -0,0 +1,141 @@
+/* Tests that a kernel without restrict computes the same results when its
+   buffer arguments overlap as when they do not, as the CPU devices run a
+   version of it assuming no aliasing for the latter.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 256
+
+/* c gets 2 where a and b are the same memory, 1 elsewhere */
+char kernelSourceCode[] = "kernel void store_both(global int *a,\n"
+                          "                       global int *b,\n"
+                          "                       global int *c) {\n"
+                          "  size_t i = get_global_id(0);\n"
+                          "  a[i] = 1;\n"
+                          "  b[i] = 2;\n"
+                          "  c[i] = a[i];\n"
+                          "}\n";
+
+/* Runs the kernel on a, b and c, and checks that c holds expected. */
+static int
+run_and_check (cl_command_queue queue, cl_kernel kernel, cl_mem a, cl_mem b,
+               cl_mem c, cl_int expected, const char *what)
+{
+  cl_int result[N];
+  size_t global_work_size = N;
+  int i;
+
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &a));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &b));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &c));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, c, CL_TRUE, 0, sizeof (result),
+                                       result, 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    if (result[i] != expected)
+      {
+        printf ("FAIL with %s at %i: %i != %i\n", what, i, result[i],
+                expected);
+        return EXIT_FAILURE;
+      }
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem parent, a, b, a_again, c;
+  cl_uint align_bits;
+  cl_buffer_region region;
+  const char *kernel_buffer = kernelSourceCode;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                   sizeof (align_bits), &align_bits, NULL));
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "store_both", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  /* a and b are sub-buffers of the same buffer, at aligned origins */
+  region.size = N * sizeof (cl_int);
+  region.origin = (region.size * 8 + align_bits - 1) / align_bits
+                  * (align_bits / 8);
+  parent = clCreateBuffer (context, CL_MEM_READ_WRITE,
+                           region.origin + region.size, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  c = clCreateBuffer (context, CL_MEM_READ_WRITE, region.size, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  b = clCreateSubBuffer (parent, CL_MEM_READ_WRITE,
+                         CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateSubBuffer");
+  region.origin = 0;
+  a = clCreateSubBuffer (parent, CL_MEM_READ_WRITE,
+                         CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateSubBuffer");
+  a_again = clCreateSubBuffer (parent, CL_MEM_READ_WRITE,
+                               CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateSubBuffer");
+
+  TEST_ASSERT (run_and_check (queue, kernel, a, b, c, 1, "disjoint buffers")
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, a, a, c, 2, "the same buffer")
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, a, a_again, c, 2,
+                              "the same region of two sub-buffers")
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, a, b, c, 1,
+                              "disjoint buffers again")
+               == EXIT_SUCCESS);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (a_again));
+  CHECK_CL_ERROR (clReleaseMemObject (a));
+  CHECK_CL_ERROR (clReleaseMemObject (b));
+  CHECK_CL_ERROR (clReleaseMemObject (c));
+  CHECK_CL_ERROR (clReleaseMemObject (parent));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/* Tests that a kernel with its scalar arguments folded into the work-group
+   function, by the -cl-pocl-specialize-args= build option, computes the
+   right results when the values change between the launches.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 256
+
+/* out[i] = the sum of in[i .. i + radius] times scale */
+char kernelSourceCode[]
+    = "kernel void window_sum(global const int *in, global int *out,\n"
+      "                         int radius, float scale) {\n"
+      "  size_t i = get_global_id(0);\n"
+      "  int sum = 0;\n"
+      "  for (int j = 0; j <= radius; ++j)\n"
+      "    sum += in[i + j];\n"
+      "  out[i] = (int)(sum * scale);\n"
+      "}\n";
+
+/* Runs the kernel with radius and scale, and checks the result. */
+static int
+run_and_check (cl_command_queue queue, cl_kernel kernel, cl_mem out,
+               const cl_int *input, cl_int radius, cl_float scale)
+{
+  cl_int result[N];
+  size_t global_work_size = N;
+  int i, j;
+
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_int), &radius));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 3, sizeof (cl_float), &scale));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, out, CL_TRUE, 0,
+                                       sizeof (result), result, 0, NULL,
+                                       NULL));
+  for (i = 0; i < N; ++i)
+    {
+      cl_int sum = 0;
+      for (j = 0; j <= radius; ++j)
+        sum += input[i + j];
+      if (result[i] != (cl_int)(sum * scale))
+        {
+          printf ("FAIL with radius %i and scale %f at %i: %i != %i\n",
+                  radius, scale, i, result[i], (cl_int)(sum * scale));
+          return EXIT_FAILURE;
+        }
+    }
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem in, out;
+  cl_int input[N + 8];
+  const char *kernel_buffer = kernelSourceCode;
+  int i;
+
+  for (i = 0; i < N + 8; ++i)
+    input[i] = i % 7;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (
+      program, 0, NULL, "-cl-pocl-specialize-args=window_sum:radius,scale",
+      NULL, NULL));
+  kernel = clCreateKernel (program, "window_sum", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  in = clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                       sizeof (input), input, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  out = clCreateBuffer (context, CL_MEM_WRITE_ONLY, N * sizeof (cl_int), NULL,
+                        &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &in));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &out));
+
+  /* each new value gets a WG function of its own, the repeated ones
+     reuse theirs */
+  TEST_ASSERT (run_and_check (queue, kernel, out, input, 3, 1.0f)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, out, input, 3, 1.0f)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, out, input, 5, 1.0f)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, out, input, 5, 2.5f)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (run_and_check (queue, kernel, out, input, 3, 1.0f)
+               == EXIT_SUCCESS);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (in));
+  CHECK_CL_ERROR (clReleaseMemObject (out));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
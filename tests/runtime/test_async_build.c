@@ -0,0 +1,139 @@
+/* Tests the builds of clBuildProgram with a callback, which run in the
+   background: the callbacks come for every program and can create its
+   kernels, and clCreateKernel waits for a build that has not finished.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 256
+#define NUM_PROGRAMS 4
+
+typedef struct
+{
+  cl_event done;
+  cl_kernel kernel;
+  cl_build_status status;
+} build_result;
+
+static void CL_CALLBACK
+build_finished (cl_program program, void *user_data)
+{
+  build_result *res = (build_result *)user_data;
+  cl_device_id device;
+  cl_int err;
+
+  err = clGetProgramInfo (program, CL_PROGRAM_DEVICES, sizeof (device),
+                          &device, NULL);
+  if (err == CL_SUCCESS)
+    err = clGetProgramBuildInfo (program, device, CL_PROGRAM_BUILD_STATUS,
+                                 sizeof (res->status), &res->status, NULL);
+  if (err == CL_SUCCESS && res->status == CL_BUILD_SUCCESS)
+    res->kernel = clCreateKernel (program, "add", &err);
+  clSetUserEventStatus (res->done, err == CL_SUCCESS ? CL_COMPLETE : err);
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program programs[NUM_PROGRAMS];
+  build_result results[NUM_PROGRAMS];
+  char source[256];
+  const char *src = source;
+  cl_int data[N];
+  size_t global_work_size = N;
+  int i, j;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  for (i = 0; i < NUM_PROGRAMS; ++i)
+    {
+      snprintf (source, sizeof (source),
+                "kernel void add(global int *data) {\n"
+                "  size_t i = get_global_id(0);\n"
+                "  data[i] = (int)i + %d;\n"
+                "}\n",
+                i * 1000);
+      programs[i]
+          = clCreateProgramWithSource (context, 1, &src, NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+      results[i].done = clCreateUserEvent (context, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateUserEvent");
+      results[i].kernel = NULL;
+      CHECK_CL_ERROR (clBuildProgram (programs[i], 0, NULL, NULL,
+                                      build_finished, &results[i]));
+    }
+
+  /* waits for the build of the last program */
+  cl_kernel kernel = clCreateKernel (programs[NUM_PROGRAMS - 1], "add", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (data),
+                               NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (data),
+                                       data, 0, NULL, NULL));
+  for (j = 0; j < N; ++j)
+    TEST_ASSERT (data[j] == j + (NUM_PROGRAMS - 1) * 1000);
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+
+  for (i = 0; i < NUM_PROGRAMS; ++i)
+    {
+      CHECK_CL_ERROR (clWaitForEvents (1, &results[i].done));
+      TEST_ASSERT (results[i].status == CL_BUILD_SUCCESS);
+      TEST_ASSERT (results[i].kernel != NULL);
+
+      CHECK_CL_ERROR (
+          clSetKernelArg (results[i].kernel, 0, sizeof (cl_mem), &buf));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, results[i].kernel, 1,
+                                              NULL, &global_work_size, NULL,
+                                              0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0,
+                                           sizeof (data), data, 0, NULL,
+                                           NULL));
+      for (j = 0; j < N; ++j)
+        TEST_ASSERT (data[j] == j + i * 1000);
+
+      CHECK_CL_ERROR (clReleaseKernel (results[i].kernel));
+      CHECK_CL_ERROR (clReleaseEvent (results[i].done));
+      CHECK_CL_ERROR (clReleaseProgram (programs[i]));
+    }
+
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  printf ("OK\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/* Tests the NDRange launches with no local size under
+   POCL_AUTOTUNE_LOCAL_SIZE: the candidate local sizes the tuning runs, and
+   the tuned one used after them, must all give correct results.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4096
+#define LAUNCHES 24
+
+char kernelSourceCode[]
+    = "kernel \n"
+      "void ids(global uint* out, global uint* lsize) {\n"
+      "    size_t i = get_global_id(0);\n"
+      "    out[i] = get_group_id(0) * get_local_size(0) + get_local_id(0);\n"
+      "    lsize[i] = get_local_size(0);\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem out_buf, lsize_buf;
+  cl_uint out[N], lsize[N];
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global_work_size = N;
+  int launch, i;
+
+  /* read at the platform initialization */
+  setenv ("POCL_AUTOTUNE_LOCAL_SIZE", "1", 1);
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "ids", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  out_buf = clCreateBuffer (context, CL_MEM_WRITE_ONLY, sizeof (out), NULL,
+                            &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  lsize_buf = clCreateBuffer (context, CL_MEM_WRITE_ONLY, sizeof (lsize),
+                              NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &out_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &lsize_buf));
+
+  for (launch = 0; launch < LAUNCHES; ++launch)
+    {
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                              &global_work_size, NULL, 0,
+                                              NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, out_buf, CL_FALSE, 0,
+                                           sizeof (out), out, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, lsize_buf, CL_TRUE, 0,
+                                           sizeof (lsize), lsize, 0, NULL,
+                                           NULL));
+      if (lsize[0] == 0 || N % lsize[0] != 0)
+        {
+          printf ("FAIL: local size %u at launch %i\n", lsize[0], launch);
+          return EXIT_FAILURE;
+        }
+      for (i = 0; i < N; ++i)
+        if (out[i] != (cl_uint)i || lsize[i] != lsize[0])
+          {
+            printf ("FAIL at launch %i, %i: %u (local size %u)\n", launch, i,
+                    out[i], lsize[i]);
+            return EXIT_FAILURE;
+          }
+    }
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (out_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (lsize_buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+/* Tests that the launches computing with the generic work-group function
+   while POCL_BACKGROUND_SPECIALIZATION builds the specialized ones give the
+   same results as those running the specialized functions once they are
+   built, for several launch configurations and a kernel with a
+   reqd_work_group_size that is never deferred.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 1024
+#define LAUNCHES 6
+#define NUM_LOCAL_SIZES 3
+
+char kernelSourceCode[]
+    = "kernel void scale(global const int *x, global int *y, int a) {\n"
+      "  size_t i = get_global_id(0);\n"
+      "  y[i] = x[i] * a + (int)get_local_id(0);\n"
+      "}\n"
+      "__attribute__((reqd_work_group_size(16, 1, 1)))\n"
+      "kernel void fixed(global const int *x, global int *y, int a) {\n"
+      "  size_t i = get_global_id(0);\n"
+      "  y[i] = x[i] * a + (int)get_local_id(0);\n"
+      "}\n";
+
+/* Runs the kernel with the local size and checks the results. */
+static int
+run_and_check (cl_command_queue queue, cl_kernel kernel, cl_mem y_buf,
+               const cl_int *x, cl_int a, size_t local_size, int launch)
+{
+  cl_int err;
+  cl_int y[N];
+  size_t global_work_size = N;
+  int i;
+
+  err = clEnqueueNDRangeKernel (queue, kernel, 1, NULL, &global_work_size,
+                                &local_size, 0, NULL, NULL);
+  CHECK_OPENCL_ERROR_IN ("clEnqueueNDRangeKernel");
+  err = clEnqueueReadBuffer (queue, y_buf, CL_TRUE, 0, sizeof (y), y, 0,
+                             NULL, NULL);
+  CHECK_OPENCL_ERROR_IN ("clEnqueueReadBuffer");
+  for (i = 0; i < N; ++i)
+    if (y[i] != x[i] * a + (cl_int)(i % local_size))
+      {
+        printf ("FAIL at launch %i, local size %zu, %i: %i != %i\n", launch,
+                local_size, i, y[i], x[i] * a + (cl_int)(i % local_size));
+        return EXIT_FAILURE;
+      }
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel, fixed;
+  cl_mem x_buf, y_buf;
+  cl_int x[N];
+  const char *kernel_buffer = kernelSourceCode;
+  const size_t local_sizes[NUM_LOCAL_SIZES] = { 8, 32, 64 };
+  cl_int a = 3;
+  int launch, i;
+
+  for (i = 0; i < N; ++i)
+    x[i] = i % 7;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "scale", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  fixed = clCreateKernel (program, "fixed", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  x_buf = clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          sizeof (x), x, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  y_buf = clCreateBuffer (context, CL_MEM_WRITE_ONLY, N * sizeof (cl_int),
+                          NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &x_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &y_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_int), &a));
+  CHECK_CL_ERROR (clSetKernelArg (fixed, 0, sizeof (cl_mem), &x_buf));
+  CHECK_CL_ERROR (clSetKernelArg (fixed, 1, sizeof (cl_mem), &y_buf));
+  CHECK_CL_ERROR (clSetKernelArg (fixed, 2, sizeof (cl_int), &a));
+
+  /* the first launch of each local size queues its specialized build and
+     runs the generic WG function, the later ones run either, depending on
+     when the build finishes */
+  for (launch = 0; launch < LAUNCHES; ++launch)
+    {
+      for (i = 0; i < NUM_LOCAL_SIZES; ++i)
+        TEST_ASSERT (run_and_check (queue, kernel, y_buf, x, a,
+                                    local_sizes[i], launch)
+                     == EXIT_SUCCESS);
+      TEST_ASSERT (run_and_check (queue, fixed, y_buf, x, a, 16, launch)
+                   == EXIT_SUCCESS);
+    }
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (x_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (y_buf));
+  CHECK_CL_ERROR (clReleaseKernel (fixed));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
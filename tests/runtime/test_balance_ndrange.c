@@ -0,0 +1,126 @@
+/* Tests clEnqueueNDRangeKernelBalancePoCL over the devices of a context.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+#define N 4096
+#define ROUNDS 8
+
+char kernelSourceCode[] = "kernel \n"
+                          "void inc(global int* data) {\n"
+                          "    data[get_global_id(0)] += 1;\n"
+                          "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform = NULL;
+  cl_context context = NULL;
+  cl_device_id *devices = NULL;
+  cl_command_queue *queues = NULL;
+  cl_uint num_devices = 0;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buf;
+  cl_event events[ROUNDS];
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global = N;
+  int data[N];
+  int i, r;
+
+  err = poclu_get_multiple_devices (&platform, &context, &num_devices,
+                                    &devices, &queues);
+  CHECK_OPENCL_ERROR_IN ("poclu_get_multiple_devices");
+
+  clEnqueueNDRangeKernelBalancePoCL_fn balance
+      = (clEnqueueNDRangeKernelBalancePoCL_fn)
+          clGetExtensionFunctionAddressForPlatform (
+              platform, "clEnqueueNDRangeKernelBalancePoCL");
+  TEST_ASSERT (balance != NULL);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "inc", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  for (i = 0; i < N; ++i)
+    data[i] = i;
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof (data), data, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+
+  /* The rounds may go to different devices; each must see the previous
+   * one's writes, whichever device it ran on. */
+  for (r = 0; r < ROUNDS; ++r)
+    {
+      CHECK_CL_ERROR (balance (num_devices, queues, kernel, 1, NULL, &global,
+                               NULL, r ? 1 : 0, r ? &events[r - 1] : NULL,
+                               &events[r]));
+      if (r % 2)
+        CHECK_CL_ERROR (clWaitForEvents (1, &events[r]));
+    }
+  CHECK_CL_ERROR (clWaitForEvents (1, &events[ROUNDS - 1]));
+  for (r = 0; r < ROUNDS; ++r)
+    CHECK_CL_ERROR (clReleaseEvent (events[r]));
+
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queues[0], buf, CL_TRUE, 0,
+                                       sizeof (data), data, 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    if (data[i] != i + ROUNDS)
+      {
+        printf ("FAIL at %i: %i != %i\n", i, data[i], i + ROUNDS);
+        return EXIT_FAILURE;
+      }
+
+  /* invalid arguments */
+  TEST_ASSERT (balance (0, queues, kernel, 1, NULL, &global, NULL, 0, NULL,
+                        NULL)
+               == CL_INVALID_VALUE);
+  TEST_ASSERT (balance (1, queues, kernel, 0, NULL, &global, NULL, 0, NULL,
+                        NULL)
+               == CL_INVALID_WORK_DIMENSION);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  for (i = 0; i < (int)num_devices; ++i)
+    CHECK_CL_ERROR (clReleaseCommandQueue (queues[i]));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+  free (devices);
+  free (queues);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/* Tests clEnqueueNDRangeKernelBatchPoCL with many small launches of two
+   kernels, each writing its own part of a buffer.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+#define LAUNCHES 200
+#define PART 24
+
+char kernelSourceCode[]
+    = "kernel void set(global int *data, int value) {\n"
+      "  data[get_global_id(0)] = value;\n"
+      "}\n"
+      "kernel void add(global int *data, int value) {\n"
+      "  data[get_global_id(0)] += value;\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel set, add;
+  cl_mem buf;
+  cl_event event;
+  const char *kernel_buffer = kernelSourceCode;
+  cl_ndrange_launch_pocl launches[LAUNCHES];
+  cl_int values[LAUNCHES];
+  size_t arg_sizes[2] = { sizeof (cl_mem), sizeof (cl_int) };
+  const void *arg_values[LAUNCHES][2];
+  cl_int data[LAUNCHES * PART];
+  int i, j;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  clEnqueueNDRangeKernelBatchPoCL_fn batch
+      = (clEnqueueNDRangeKernelBatchPoCL_fn)
+          clGetExtensionFunctionAddressForPlatform (
+              platform, "clEnqueueNDRangeKernelBatchPoCL");
+  TEST_ASSERT (batch != NULL);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  set = clCreateKernel (program, "set", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  add = clCreateKernel (program, "add", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  for (i = 0; i < LAUNCHES * PART; ++i)
+    data[i] = -1;
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof (data), data, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+
+  /* the even parts are set to the launch index, the odd ones get it
+     added; the last launch leaves its local size to the device, and the
+     launches of add use the arguments set before the batch */
+  CHECK_CL_ERROR (clSetKernelArg (add, 0, sizeof (cl_mem), &buf));
+  for (i = 0; i < LAUNCHES; ++i)
+    {
+      cl_ndrange_launch_pocl *l = &launches[i];
+      values[i] = i;
+      arg_values[i][0] = &buf;
+      arg_values[i][1] = &values[i];
+      l->kernel = (i % 2) ? add : set;
+      l->work_dim = 1;
+      l->global_work_offset[0] = i * PART;
+      l->global_work_size[0] = PART;
+      l->local_work_size[0] = (i == LAUNCHES - 1) ? 0 : PART / 2;
+      l->local_work_size[1] = 0;
+      l->local_work_size[2] = 0;
+      l->num_args = (i % 2) ? 0 : 2;
+      l->arg_sizes = (i % 2) ? NULL : arg_sizes;
+      l->arg_values = (i % 2) ? NULL : arg_values[i];
+    }
+  values[1] = 5;
+  CHECK_CL_ERROR (clSetKernelArg (add, 1, sizeof (cl_int), &values[1]));
+
+  CHECK_CL_ERROR (batch (queue, LAUNCHES, launches, 0, NULL, &event));
+  CHECK_CL_ERROR (clWaitForEvents (1, &event));
+  CHECK_CL_ERROR (clReleaseEvent (event));
+
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (data),
+                                       data, 0, NULL, NULL));
+  for (i = 0; i < LAUNCHES; ++i)
+    for (j = 0; j < PART; ++j)
+      {
+        cl_int expected = (i % 2) ? -1 + 5 : i;
+        if (data[i * PART + j] != expected)
+          {
+            printf ("FAIL at launch %i item %i: %i != %i\n", i, j,
+                    data[i * PART + j], expected);
+            return EXIT_FAILURE;
+          }
+      }
+
+  TEST_ASSERT (batch (queue, 0, launches, 0, NULL, NULL) == CL_INVALID_VALUE);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (set));
+  CHECK_CL_ERROR (clReleaseKernel (add));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/* Tests the kernels of programs created from pocl binaries, whose metadata
+   is only read from the binary when they are created: the kernel names
+   are known before, and the argument info, the attributes and the
+   binaries of the program are the same as those of the program built
+   from the source.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 128
+#define NUM_KERNELS 8
+
+char kernelSourceCode[]
+    = "kernel void k0(global int *out, int a) { out[get_global_id(0)] = a; }\n"
+      "kernel void k1(global int *out, int a) { out[get_global_id(0)] = a+1; }\n"
+      "kernel void k2(global int *out, int a) { out[get_global_id(0)] = a+2; }\n"
+      "kernel void k3(global int *out, int a) { out[get_global_id(0)] = a+3; }\n"
+      "kernel void k4(global int *out, int a) { out[get_global_id(0)] = a+4; }\n"
+      "kernel void k5(global int *out, int a) { out[get_global_id(0)] = a+5; }\n"
+      "kernel void k6(global int *out, int a) { out[get_global_id(0)] = a+6; }\n"
+      "__attribute__((reqd_work_group_size(8, 1, 1)))\n"
+      "kernel void k7(global float *out, local float *tmp, float scale) {\n"
+      "  size_t l = get_local_id(0);\n"
+      "  tmp[l] = (float)get_global_id(0) * scale;\n"
+      "  barrier(CLK_LOCAL_MEM_FENCE);\n"
+      "  out[get_global_id(0)] = tmp[7 - l];\n"
+      "}\n";
+
+/* Returns the pocl binary of the program for its only device. */
+static unsigned char *
+get_binary (cl_program program, size_t *size)
+{
+  cl_int err;
+  unsigned char *binary;
+
+  err = clGetProgramInfo (program, CL_PROGRAM_BINARY_SIZES, sizeof (size_t),
+                          size, NULL);
+  if (err != CL_SUCCESS || *size == 0)
+    return NULL;
+  binary = malloc (*size);
+  if (binary == NULL)
+    return NULL;
+  err = clGetProgramInfo (program, CL_PROGRAM_BINARIES,
+                          sizeof (unsigned char *), &binary, NULL);
+  if (err != CL_SUCCESS)
+    {
+      free (binary);
+      return NULL;
+    }
+  return binary;
+}
+
+static cl_program
+program_from_binary (cl_context context, cl_device_id device,
+                     const unsigned char *binary, size_t size)
+{
+  cl_int err, status;
+  cl_program program = clCreateProgramWithBinary (context, 1, &device, &size,
+                                                  &binary, &status, &err);
+  if (err != CL_SUCCESS || status != CL_SUCCESS)
+    return NULL;
+  if (clBuildProgram (program, 0, NULL, NULL, NULL, NULL) != CL_SUCCESS)
+    {
+      clReleaseProgram (program);
+      return NULL;
+    }
+  return program;
+}
+
+/* Runs kernel k<index> of the program and checks its output. */
+static int
+run_int_kernel (cl_context context, cl_command_queue queue,
+                cl_program program, unsigned index)
+{
+  cl_int err;
+  char name[8];
+  cl_int out[N];
+  cl_int a = 1000;
+  size_t global_work_size = N;
+  unsigned i;
+
+  snprintf (name, sizeof (name), "k%u", index);
+  cl_kernel kernel = clCreateKernel (program, name, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (out), NULL,
+                               &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_int), &a));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (out),
+                                       out, 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    TEST_ASSERT (out[i] == a + (cl_int)index);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  const char *src = kernelSourceCode;
+  char names[256];
+  size_t num_kernels = 0;
+  size_t binary_size, binary2_size, size;
+  cl_kernel_arg_address_qualifier address;
+  char arg_name[64];
+  size_t wg_size[3];
+  float out[N];
+  size_t global_work_size = N, local_work_size = 8;
+  float scale = 0.5f;
+  unsigned i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  cl_program source_program
+      = clCreateProgramWithSource (context, 1, &src, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (source_program, 0, NULL,
+                                  "-cl-kernel-arg-info", NULL, NULL));
+  unsigned char *binary = get_binary (source_program, &binary_size);
+  TEST_ASSERT (binary != NULL);
+
+  cl_program program
+      = program_from_binary (context, device, binary, binary_size);
+  TEST_ASSERT (program != NULL);
+
+  /* the names of all the kernels, none of which has been created */
+  CHECK_CL_ERROR (clGetProgramInfo (program, CL_PROGRAM_NUM_KERNELS,
+                                    sizeof (num_kernels), &num_kernels,
+                                    NULL));
+  TEST_ASSERT (num_kernels == NUM_KERNELS);
+  CHECK_CL_ERROR (clGetProgramInfo (program, CL_PROGRAM_KERNEL_NAMES,
+                                    sizeof (names), names, NULL));
+  TEST_ASSERT (strstr (names, "k0") != NULL);
+  TEST_ASSERT (strstr (names, "k7") != NULL);
+
+  /* the local and the reqd_work_group_size of the last kernel */
+  cl_kernel kernel = clCreateKernel (program, "k7", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  CHECK_CL_ERROR (clGetKernelWorkGroupInfo (
+      kernel, device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, sizeof (wg_size),
+      wg_size, NULL));
+  TEST_ASSERT (wg_size[0] == 8 && wg_size[1] == 1 && wg_size[2] == 1);
+  CHECK_CL_ERROR (clGetKernelArgInfo (kernel, 1,
+                                      CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+                                      sizeof (address), &address, NULL));
+  TEST_ASSERT (address == CL_KERNEL_ARG_ADDRESS_LOCAL);
+  err = clGetKernelArgInfo (kernel, 2, CL_KERNEL_ARG_NAME, sizeof (arg_name),
+                            arg_name, NULL);
+  if (err != CL_KERNEL_ARG_INFO_NOT_AVAILABLE)
+    {
+      CHECK_OPENCL_ERROR_IN ("clGetKernelArgInfo");
+      TEST_ASSERT (strcmp (arg_name, "scale") == 0);
+    }
+
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (out), NULL,
+                               &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, 8 * sizeof (cl_float), NULL));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_float), &scale));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, &local_work_size,
+                                          0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (out),
+                                       out, 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    TEST_ASSERT (out[i] == (float)((i & ~7u) + 7 - (i & 7)) * scale);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+
+  TEST_ASSERT (run_int_kernel (context, queue, program, 3) == EXIT_SUCCESS);
+
+  /* the binaries of the program with kernels that were never created */
+  CHECK_CL_ERROR (clGetProgramInfo (program, CL_PROGRAM_BINARY_SIZES,
+                                    sizeof (size), &size, NULL));
+  unsigned char *binary2 = get_binary (program, &binary2_size);
+  TEST_ASSERT (binary2 != NULL && binary2_size == size);
+  cl_program program2
+      = program_from_binary (context, device, binary2, binary2_size);
+  TEST_ASSERT (program2 != NULL);
+  for (i = 0; i < NUM_KERNELS - 1; i += 2)
+    TEST_ASSERT (run_int_kernel (context, queue, program2, i)
+                 == EXIT_SUCCESS);
+
+  CHECK_CL_ERROR (clReleaseProgram (program2));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseProgram (source_program));
+  free (binary2);
+  free (binary);
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  printf ("OK\n");
+  return EXIT_SUCCESS;
+}
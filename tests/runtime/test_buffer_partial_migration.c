@@ -0,0 +1,207 @@
+/*
+  Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+  deal in the Software without restriction, including without limitation the
+  rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+  sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+  IN THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "poclu.h"
+
+#ifdef _MSC_VER
+#include "vccompat.hpp"
+#endif
+
+/*
+  Partial migration test. Moves one buffer back and forth between two
+  devices, with writes that only touch parts of it (clEnqueueWriteBuffer,
+  clEnqueueFillBuffer, a kernel writing a subbuffer) in between writes of
+  the whole buffer, and checks that every device sees all the updates.
+*/
+
+#define N 4096
+#define SUB_OFFSET 1024
+#define SUB_SIZE 512
+
+char kernelSourceCode[] = "kernel \n"
+                          "void add(global int* data, int value) {\n"
+                          "    data[get_global_id(0)] += value;\n"
+                          "}\n";
+
+int
+main (int argc, char **argv)
+{
+  cl_int *expected = NULL, *output = NULL, *part = NULL;
+  int err;
+  cl_mem buf = NULL, sub = NULL;
+  size_t global_work_size = N, sub_work_size = SUB_SIZE;
+  cl_int value;
+  int i;
+
+  cl_platform_id platform = NULL;
+  cl_context context = NULL;
+  cl_device_id *devices = NULL;
+  cl_command_queue *queues = NULL;
+  cl_uint num_devices = 0;
+  cl_program program = NULL;
+  cl_kernel kernel = NULL, sub_kernel = NULL;
+  const char *kernel_buffer = kernelSourceCode;
+
+  err = poclu_get_multiple_devices (&platform, &context, &num_devices,
+                                    &devices, &queues);
+  CHECK_OPENCL_ERROR_IN ("poclu_get_multiple_devices");
+
+  printf ("NUM DEVICES: %u \n", num_devices);
+  if (num_devices < 2)
+    {
+      printf ("NOT ENOUGH DEVICES! (need 2)\n");
+      err = 77;
+      goto EARLY_EXIT;
+    }
+
+  expected = (cl_int *)malloc (N * sizeof (cl_int));
+  output = (cl_int *)malloc (N * sizeof (cl_int));
+  part = (cl_int *)malloc (N * sizeof (cl_int));
+  for (i = 0; i < N; ++i)
+    {
+      expected[i] = i;
+      part[i] = -i;
+    }
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "add", &err);
+  CHECK_CL_ERROR2 (err);
+  sub_kernel = clCreateKernel (program, "add", &err);
+  CHECK_CL_ERROR2 (err);
+
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        N * sizeof (cl_int), expected, &err);
+  CHECK_CL_ERROR2 (err);
+  cl_buffer_region region
+      = { SUB_OFFSET * sizeof (cl_int), SUB_SIZE * sizeof (cl_int) };
+  sub = clCreateSubBuffer (buf, CL_MEM_READ_WRITE,
+                           CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+  CHECK_CL_ERROR2 (err);
+
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  value = 1;
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_int), &value));
+  CHECK_CL_ERROR (clSetKernelArg (sub_kernel, 0, sizeof (cl_mem), &sub));
+  value = 100;
+  CHECK_CL_ERROR (clSetKernelArg (sub_kernel, 1, sizeof (cl_int), &value));
+
+  /* the whole buffer on device 0 */
+  err = clEnqueueNDRangeKernel (queues[0], kernel, 1, NULL,
+                                &global_work_size, NULL, 0, NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  CHECK_CL_ERROR (clFinish (queues[0]));
+  for (i = 0; i < N; ++i)
+    expected[i] += 1;
+
+  /* a few elements from the host, then a fill, on device 1 */
+  err = clEnqueueWriteBuffer (queues[1], buf, CL_TRUE, 10 * sizeof (cl_int),
+                              20 * sizeof (cl_int), part + 10, 0, NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  for (i = 10; i < 30; ++i)
+    expected[i] = part[i];
+  value = 7;
+  err = clEnqueueFillBuffer (queues[1], buf, &value, sizeof (cl_int),
+                             3000 * sizeof (cl_int), 16 * sizeof (cl_int), 0,
+                             NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  CHECK_CL_ERROR (clFinish (queues[1]));
+  for (i = 3000; i < 3016; ++i)
+    expected[i] = 7;
+
+  /* a subbuffer on device 0 */
+  err = clEnqueueNDRangeKernel (queues[0], sub_kernel, 1, NULL,
+                                &sub_work_size, NULL, 0, NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  CHECK_CL_ERROR (clFinish (queues[0]));
+  for (i = SUB_OFFSET; i < SUB_OFFSET + SUB_SIZE; ++i)
+    expected[i] += 100;
+
+  /* device 1 must see all of the above */
+  err = clEnqueueReadBuffer (queues[1], buf, CL_TRUE, 0, N * sizeof (cl_int),
+                             output, 0, NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  for (i = 0; i < N; ++i)
+    if (output[i] != expected[i])
+      {
+        printf ("FAIL at %i on device 1: %i != %i\n", i, output[i],
+                expected[i]);
+        err = 1;
+        goto ERROR;
+      }
+
+  /* the whole buffer again on device 1, then a write on device 0 */
+  err = clEnqueueNDRangeKernel (queues[1], kernel, 1, NULL,
+                                &global_work_size, NULL, 0, NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  CHECK_CL_ERROR (clFinish (queues[1]));
+  for (i = 0; i < N; ++i)
+    expected[i] += 1;
+  err = clEnqueueWriteBuffer (queues[0], buf, CL_TRUE, 2000 * sizeof (cl_int),
+                              5 * sizeof (cl_int), part + 2000, 0, NULL,
+                              NULL);
+  CHECK_CL_ERROR2 (err);
+  for (i = 2000; i < 2005; ++i)
+    expected[i] = part[i];
+
+  err = clEnqueueReadBuffer (queues[1], buf, CL_TRUE, 0, N * sizeof (cl_int),
+                             output, 0, NULL, NULL);
+  CHECK_CL_ERROR2 (err);
+  for (i = 0; i < N; ++i)
+    if (output[i] != expected[i])
+      {
+        printf ("FAIL at %i on device 1: %i != %i\n", i, output[i],
+                expected[i]);
+        err = 1;
+        goto ERROR;
+      }
+
+  printf ("OK\n");
+
+ERROR:
+  CHECK_CL_ERROR (clReleaseMemObject (sub));
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (sub_kernel));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+
+EARLY_EXIT:
+  for (i = 0; i < (int)num_devices; ++i)
+    {
+      CHECK_CL_ERROR (clReleaseCommandQueue (queues[i]));
+    }
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+  free (expected);
+  free (output);
+  free (part);
+  free (devices);
+  free (queues);
+
+  return err;
+}
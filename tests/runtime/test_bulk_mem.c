@@ -0,0 +1,126 @@
+/* Tests buffer writes, fills, copies, rect copies and reads large enough
+   for the pthread driver to split them between its threads.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* not a multiple of the chunk size, to get a partial last chunk */
+#define SIZE (12 * 1024 * 1024 + 40)
+#define FILL_OFFSET 4096
+#define FILL_SIZE (9 * 1024 * 1024 + 16)
+/* rect copy of ROWS rows of ROW_SIZE bytes, in two slices */
+#define ROW_SIZE 1000
+#define ROW_PITCH 1024
+#define ROWS 8192
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_mem a, b;
+  unsigned char *src, *dst;
+  const unsigned char pattern[16] = { 1, 2, 3, 4, 5, 6, 7, 8,
+                                      9, 10, 11, 12, 13, 14, 15, 16 };
+  size_t i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  src = (unsigned char *)malloc (SIZE);
+  dst = (unsigned char *)malloc (SIZE);
+  TEST_ASSERT (src != NULL && dst != NULL);
+  for (i = 0; i < SIZE; ++i)
+    src[i] = (unsigned char)(i * 2654435761U >> 24);
+
+  a = clCreateBuffer (context, CL_MEM_READ_WRITE, SIZE, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  b = clCreateBuffer (context, CL_MEM_READ_WRITE, SIZE, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+
+  CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, a, CL_FALSE, 0, SIZE, src, 0,
+                                        NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueFillBuffer (queue, a, pattern, sizeof (pattern),
+                                       FILL_OFFSET, FILL_SIZE, 0, NULL,
+                                       NULL));
+  CHECK_CL_ERROR (clEnqueueCopyBuffer (queue, a, b, 0, 0, SIZE, 0, NULL,
+                                       NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, b, CL_TRUE, 0, SIZE, dst, 0,
+                                       NULL, NULL));
+
+  for (i = 0; i < FILL_SIZE; ++i)
+    src[FILL_OFFSET + i] = pattern[i % sizeof (pattern)];
+  for (i = 0; i < SIZE; ++i)
+    if (dst[i] != src[i])
+      {
+        printf ("FAIL at %zu: %u != %u\n", i, dst[i], src[i]);
+        return EXIT_FAILURE;
+      }
+
+  /* copy the rows back from b to a, with a shifted destination */
+  {
+    size_t src_origin[3] = { 8, 1, 0 };
+    size_t dst_origin[3] = { 16, 2, 0 };
+    size_t region[3] = { ROW_SIZE, ROWS / 2, 2 };
+    CHECK_CL_ERROR (clEnqueueCopyBufferRect (
+        queue, b, a, src_origin, dst_origin, region, ROW_PITCH,
+        ROW_PITCH * (ROWS / 2 + 2), ROW_PITCH, ROW_PITCH * (ROWS / 2 + 2), 0,
+        NULL, NULL));
+    CHECK_CL_ERROR (clEnqueueReadBuffer (queue, a, CL_TRUE, 0, SIZE, dst, 0,
+                                         NULL, NULL));
+    size_t slice_pitch = ROW_PITCH * (ROWS / 2 + 2);
+    size_t y, z;
+    for (z = 0; z < region[2]; ++z)
+      for (y = 0; y < region[1]; ++y)
+        for (i = 0; i < ROW_SIZE; ++i)
+          {
+            size_t s = src_origin[0] + i + (src_origin[1] + y) * ROW_PITCH
+                       + (src_origin[2] + z) * slice_pitch;
+            size_t d = dst_origin[0] + i + (dst_origin[1] + y) * ROW_PITCH
+                       + (dst_origin[2] + z) * slice_pitch;
+            if (dst[d] != src[s])
+              {
+                printf ("FAIL rect at %zu: %u != %u\n", d, dst[d], src[s]);
+                return EXIT_FAILURE;
+              }
+          }
+  }
+
+  printf ("OK\n");
+
+  free (src);
+  free (dst);
+  CHECK_CL_ERROR (clReleaseMemObject (a));
+  CHECK_CL_ERROR (clReleaseMemObject (b));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
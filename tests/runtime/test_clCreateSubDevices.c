@@ -362,6 +362,46 @@ int main(int argc, char **argv)
   else
     TEST_ASSERT((found_cus[0] + found_cus[1]) == 2);
 
+  /* CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, if supported. On hosts with
+   * a single domain of each type, NEXT_PARTITIONABLE fails to partition. */
+  cl_device_affinity_domain domains = 0;
+  err = clGetDeviceInfo (rootdev, CL_DEVICE_PARTITION_AFFINITY_DOMAIN,
+                         sizeof (domains), &domains, NULL);
+  CHECK_OPENCL_ERROR_IN ("CL_DEVICE_PARTITION_AFFINITY_DOMAIN");
+
+  if (domains & CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE)
+    {
+      const cl_device_partition_property affinity_splitter[]
+          = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+              CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE, 0 };
+
+      err = clCreateSubDevices (rootdev, affinity_splitter, 0, NULL,
+                                &numdevs);
+      if (err == CL_SUCCESS)
+        {
+          TEST_ASSERT (numdevs > 1);
+          cl_device_id *affdev = malloc (numdevs * sizeof (cl_device_id));
+          TEST_ASSERT (affdev);
+          err = clCreateSubDevices (rootdev, affinity_splitter, numdevs,
+                                    affdev, NULL);
+          CHECK_OPENCL_ERROR_IN ("partition by affinity domain");
+
+          cl_uint total_cus = 0;
+          for (i = 0; i < numdevs; ++i)
+            {
+              err = clGetDeviceInfo (affdev[i], CL_DEVICE_MAX_COMPUTE_UNITS,
+                                     sizeof (sub_cus), &sub_cus, NULL);
+              CHECK_OPENCL_ERROR_IN ("affinity sub CU");
+              total_cus += sub_cus;
+              clReleaseDevice (affdev[i]);
+            }
+          TEST_ASSERT (total_cus == max_cus);
+          free (affdev);
+        }
+      else
+        TEST_ASSERT (err == CL_DEVICE_PARTITION_FAILED);
+    }
+
   /* So far, so good. Let's now try and use these devices,
    * by building a program for all of them and launching kernels on them.
    *
@@ -118,6 +118,45 @@ main (void)
 
   TEST_ASSERT ((count == 1024) && "copying partially content size failed");
 
+  // a sub-buffer has the content size of its parent
+  cl_uint align_bits;
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                   sizeof (align_bits), &align_bits, NULL));
+  size_t align = align_bits / 8;
+  if (align + 256 <= 1024)
+    {
+      cl_buffer_region region = { align, 256 };
+      cl_mem buf_sub
+          = clCreateSubBuffer (buf_content_src, CL_MEM_READ_WRITE,
+                               CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateSubBuffer");
+      TEST_ASSERT (setContentSizeBuffer (buf_sub, buf_size)
+                   == CL_INVALID_MEM_OBJECT);
+
+      memset (host_buf_dst, DST_CHAR, 1024);
+      CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buf_content_dst, CL_TRUE,
+                                            0, 1024, host_buf_dst, 0, NULL,
+                                            NULL));
+      content_size = align + 64;
+      CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buf_size, CL_TRUE, 0, 8,
+                                            &content_size, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueCopyBuffer (queue, buf_sub, buf_content_dst, 0,
+                                           0, 256, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf_content_dst, CL_TRUE, 0,
+                                           1024, host_buf_dst, 0, NULL,
+                                           NULL));
+      count = 0;
+      for (size_t i = 0; i < 64; ++i)
+        if (host_buf_dst[i] == SRC_CHAR)
+          ++count;
+      for (size_t i = 64; i < 1024; ++i)
+        if (host_buf_dst[i] == DST_CHAR)
+          ++count;
+
+      TEST_ASSERT ((count == 1024) && "copying a sub-buffer failed");
+      CHECK_CL_ERROR (clReleaseMemObject (buf_sub));
+    }
+
   CHECK_CL_ERROR (clReleaseMemObject (buf_content_dst));
   CHECK_CL_ERROR (clReleaseMemObject (buf_content_src));
   CHECK_CL_ERROR (clReleaseMemObject (buf_size));
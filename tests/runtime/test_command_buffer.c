@@ -0,0 +1,189 @@
+/* Tests recording and replaying command buffers (cl_khr_command_buffer).
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+#define N 1024
+#define NUM_KERNELS 8
+#define NUM_REPLAYS 5
+
+char kernelSourceCode[] = "kernel \n"
+                          "void add(global int* data, int value) {\n"
+                          "    data[get_global_id(0)] += value;\n"
+                          "}\n";
+
+#define GET_FN(name)                                                          \
+  name##_fn name                                                              \
+      = (name##_fn)clGetExtensionFunctionAddressForPlatform (platform,        \
+                                                             #name);          \
+  TEST_ASSERT (name != NULL)
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buf, copy;
+  cl_command_buffer_khr cmdbuf;
+  cl_sync_point_khr fill_sp, sp;
+  cl_command_buffer_state_khr state;
+  cl_uint num_queues;
+  cl_event ev;
+  cl_int zero = 0, value;
+  int *output;
+  size_t global_work_size = N;
+  const char *kernel_buffer = kernelSourceCode;
+  int i, j;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  GET_FN (clCreateCommandBufferKHR);
+  GET_FN (clFinalizeCommandBufferKHR);
+  GET_FN (clReleaseCommandBufferKHR);
+  GET_FN (clEnqueueCommandBufferKHR);
+  GET_FN (clCommandBarrierWithWaitListKHR);
+  GET_FN (clCommandCopyBufferKHR);
+  GET_FN (clCommandFillBufferKHR);
+  GET_FN (clCommandNDRangeKernelKHR);
+  GET_FN (clGetCommandBufferInfoKHR);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "add", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE, N * sizeof (cl_int), NULL,
+                        &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  copy = clCreateBuffer (context, CL_MEM_READ_WRITE, N * sizeof (cl_int),
+                         NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  output = (int *)malloc (N * sizeof (cl_int));
+  TEST_ASSERT (output != NULL);
+
+  cmdbuf = clCreateCommandBufferKHR (1, &queue, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandBufferKHR");
+
+  /* zero the buffer, then add 1..NUM_KERNELS to it; the arguments are
+     taken when the kernels are recorded */
+  CHECK_CL_ERROR (clCommandFillBufferKHR (cmdbuf, NULL, buf, &zero,
+                                          sizeof (cl_int), 0,
+                                          N * sizeof (cl_int), 0, NULL,
+                                          &fill_sp, NULL));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  sp = fill_sp;
+  for (i = 1; i <= NUM_KERNELS; ++i)
+    {
+      value = i;
+      CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_int), &value));
+      CHECK_CL_ERROR (clCommandNDRangeKernelKHR (
+          cmdbuf, NULL, NULL, kernel, 1, NULL, &global_work_size, NULL, 1,
+          &sp, &sp, NULL));
+    }
+  CHECK_CL_ERROR (
+      clCommandBarrierWithWaitListKHR (cmdbuf, NULL, 0, NULL, NULL, NULL));
+  CHECK_CL_ERROR (clCommandCopyBufferKHR (cmdbuf, NULL, buf, copy, 0, 0,
+                                          N * sizeof (cl_int), 0, NULL, NULL,
+                                          NULL));
+
+  /* changing the kernel arguments after recording has no effect */
+  value = 1000;
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_int), &value));
+
+  /* invalid uses */
+  err = clEnqueueCommandBufferKHR (0, NULL, cmdbuf, 0, NULL, NULL);
+  TEST_ASSERT (err == CL_INVALID_OPERATION);
+  err = clCommandBarrierWithWaitListKHR (cmdbuf, queue, 0, NULL, NULL, NULL);
+  TEST_ASSERT (err == CL_INVALID_COMMAND_QUEUE);
+  sp = 1000;
+  err = clCommandBarrierWithWaitListKHR (cmdbuf, NULL, 1, &sp, NULL, NULL);
+  TEST_ASSERT (err == CL_INVALID_SYNC_POINT_WAIT_LIST_KHR);
+
+  CHECK_CL_ERROR (clGetCommandBufferInfoKHR (cmdbuf,
+                                             CL_COMMAND_BUFFER_STATE_KHR,
+                                             sizeof (state), &state, NULL));
+  TEST_ASSERT (state == CL_COMMAND_BUFFER_STATE_RECORDING_KHR);
+  CHECK_CL_ERROR (clFinalizeCommandBufferKHR (cmdbuf));
+  err = clFinalizeCommandBufferKHR (cmdbuf);
+  TEST_ASSERT (err == CL_INVALID_OPERATION);
+  err = clCommandBarrierWithWaitListKHR (cmdbuf, NULL, 0, NULL, NULL, NULL);
+  TEST_ASSERT (err == CL_INVALID_OPERATION);
+  CHECK_CL_ERROR (clGetCommandBufferInfoKHR (cmdbuf,
+                                             CL_COMMAND_BUFFER_NUM_QUEUES_KHR,
+                                             sizeof (num_queues), &num_queues,
+                                             NULL));
+  TEST_ASSERT (num_queues == 1);
+
+  for (j = 0; j < NUM_REPLAYS; ++j)
+    {
+      CHECK_CL_ERROR (clEnqueueCommandBufferKHR (0, NULL, cmdbuf, 0, NULL,
+                                                 &ev));
+      CHECK_CL_ERROR (clWaitForEvents (1, &ev));
+      CHECK_CL_ERROR (clReleaseEvent (ev));
+      CHECK_CL_ERROR (clGetCommandBufferInfoKHR (
+          cmdbuf, CL_COMMAND_BUFFER_STATE_KHR, sizeof (state), &state, NULL));
+      TEST_ASSERT (state == CL_COMMAND_BUFFER_STATE_EXECUTABLE_KHR);
+
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, copy, CL_TRUE, 0,
+                                           N * sizeof (cl_int), output, 0,
+                                           NULL, NULL));
+      for (i = 0; i < N; ++i)
+        if (output[i] != NUM_KERNELS * (NUM_KERNELS + 1) / 2)
+          {
+            printf ("FAIL at %i in replay %i: %i\n", i, j, output[i]);
+            return EXIT_FAILURE;
+          }
+      /* the next replay must start from the fill again */
+      memset (output, 0xff, N * sizeof (cl_int));
+      CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buf, CL_TRUE, 0,
+                                            N * sizeof (cl_int), output, 0,
+                                            NULL, NULL));
+    }
+
+  printf ("OK\n");
+
+  free (output);
+  CHECK_CL_ERROR (clReleaseCommandBufferKHR (cmdbuf));
+  CHECK_CL_ERROR (clReleaseMemObject (copy));
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+/* Tests running kernels of two contexts with different scheduling weights
+   at the same time, which the pthread device shares its threads between
+   with POCL_PTHREAD_FAIR_SHARE, and that an invalid weight is rejected.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+#define NUM_CONTEXTS 2
+
+char kernelSourceCode[] = "kernel void iterate(global uint *out, uint n) {\n"
+                          "  size_t gid = get_global_id(0);\n"
+                          "  uint x = (uint)gid;\n"
+                          "  for (uint i = 0; i < n; ++i)\n"
+                          "    x = x * 1664525u + 1013904223u;\n"
+                          "  out[gid] = x;\n"
+                          "}\n";
+
+static cl_uint
+iterate (cl_uint x, cl_uint n)
+{
+  cl_uint i;
+  for (i = 0; i < n; ++i)
+    x = x * 1664525u + 1013904223u;
+  return x;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context default_context;
+  cl_command_queue default_queue;
+  cl_context contexts[NUM_CONTEXTS];
+  cl_command_queue queues[NUM_CONTEXTS];
+  cl_program programs[NUM_CONTEXTS];
+  cl_kernel kernels[NUM_CONTEXTS];
+  cl_mem bufs[NUM_CONTEXTS];
+  cl_event events[NUM_CONTEXTS];
+  /* a big NDRange of the heavy context and a small one of the light */
+  size_t sizes[NUM_CONTEXTS] = { 256 * 1024, 1024 };
+  cl_uint iterations[NUM_CONTEXTS] = { 1024, 64 };
+  cl_context_properties weights[NUM_CONTEXTS] = { 4, 1 };
+  const char *kernel_buffer = kernelSourceCode;
+  unsigned c;
+  size_t i;
+
+  poclu_get_any_device2 (&default_context, &device, &default_queue,
+                         &platform);
+
+  cl_context_properties bad_props[]
+      = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+          CL_CONTEXT_SCHEDULING_WEIGHT_POCL, 0, 0 };
+  TEST_ASSERT (clCreateContext (bad_props, 1, &device, NULL, NULL, &err)
+               == NULL);
+  TEST_ASSERT (err == CL_INVALID_PROPERTY);
+
+  for (c = 0; c < NUM_CONTEXTS; ++c)
+    {
+      cl_context_properties props[]
+          = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+              CL_CONTEXT_SCHEDULING_WEIGHT_POCL, weights[c], 0 };
+      contexts[c] = clCreateContext (props, 1, &device, NULL, NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateContext");
+      queues[c] = clCreateCommandQueue (contexts[c], device, 0, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateCommandQueue");
+      programs[c] = clCreateProgramWithSource (
+          contexts[c], 1, (const char **)&kernel_buffer, NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+      CHECK_CL_ERROR (
+          clBuildProgram (programs[c], 0, NULL, NULL, NULL, NULL));
+      kernels[c] = clCreateKernel (programs[c], "iterate", &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+      bufs[c] = clCreateBuffer (contexts[c], CL_MEM_WRITE_ONLY,
+                                sizes[c] * sizeof (cl_uint), NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+      CHECK_CL_ERROR (
+          clSetKernelArg (kernels[c], 0, sizeof (cl_mem), &bufs[c]));
+      CHECK_CL_ERROR (
+          clSetKernelArg (kernels[c], 1, sizeof (cl_uint), &iterations[c]));
+    }
+
+  for (c = 0; c < NUM_CONTEXTS; ++c)
+    {
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queues[c], kernels[c], 1, NULL,
+                                              &sizes[c], NULL, 0, NULL,
+                                              &events[c]));
+      CHECK_CL_ERROR (clFlush (queues[c]));
+    }
+
+  /* the light context first */
+  for (c = NUM_CONTEXTS; c-- > 0;)
+    {
+      cl_uint *result = (cl_uint *)malloc (sizes[c] * sizeof (cl_uint));
+      TEST_ASSERT (result != NULL);
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queues[c], bufs[c], CL_TRUE, 0,
+                                           sizes[c] * sizeof (cl_uint),
+                                           result, 1, &events[c], NULL));
+      for (i = 0; i < sizes[c]; ++i)
+        if (result[i] != iterate ((cl_uint)i, iterations[c]))
+          {
+            printf ("FAIL in context %u at %zu: %u != %u\n", c, i, result[i],
+                    iterate ((cl_uint)i, iterations[c]));
+            return EXIT_FAILURE;
+          }
+      free (result);
+    }
+
+  printf ("OK\n");
+
+  for (c = 0; c < NUM_CONTEXTS; ++c)
+    {
+      CHECK_CL_ERROR (clReleaseEvent (events[c]));
+      CHECK_CL_ERROR (clReleaseMemObject (bufs[c]));
+      CHECK_CL_ERROR (clReleaseKernel (kernels[c]));
+      CHECK_CL_ERROR (clReleaseProgram (programs[c]));
+      CHECK_CL_ERROR (clReleaseCommandQueue (queues[c]));
+      CHECK_CL_ERROR (clReleaseContext (contexts[c]));
+    }
+  CHECK_CL_ERROR (clReleaseCommandQueue (default_queue));
+  CHECK_CL_ERROR (clReleaseContext (default_context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
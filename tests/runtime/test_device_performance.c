@@ -0,0 +1,71 @@
+/* Tests the CL_DEVICE_PERFORMANCE_POCL device info: the first query measures
+   the device, and the later ones return the same values.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+int
+main (void)
+{
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_device_performance_pocl first, second;
+  size_t size = 0;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_PERFORMANCE_POCL, 0,
+                                   NULL, &size));
+  TEST_ASSERT (size == sizeof (cl_device_performance_pocl));
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_PERFORMANCE_POCL,
+                                   sizeof (first), &first, NULL));
+  TEST_ASSERT (first.global_mem_bandwidth > 0);
+  TEST_ASSERT (first.flops > 0);
+  TEST_ASSERT (first.launch_latency_ns > 0);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_PERFORMANCE_POCL,
+                                   sizeof (second), &second, NULL));
+  TEST_ASSERT (second.global_mem_bandwidth == first.global_mem_bandwidth);
+  TEST_ASSERT (second.flops == first.flops);
+  TEST_ASSERT (second.launch_latency_ns == first.launch_latency_ns);
+
+  printf ("%llu B/s, %llu flop/s, %llu ns per launch\n",
+          (unsigned long long)first.global_mem_bandwidth,
+          (unsigned long long)first.flops,
+          (unsigned long long)first.launch_latency_ns);
+
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  printf ("OK\n");
+  return EXIT_SUCCESS;
+}
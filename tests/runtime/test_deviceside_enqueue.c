@@ -27,14 +27,177 @@
 #include <stdlib.h>
 
 /* Tests for verifying the return values of API functions related to
-   Device-side Enqueue.  Since currently PoCL doesn't have support for
-   Device-side Enqueue on any of the device drivers. The return values should
-   match the values defined in the OpenCL specification.  See,
+   Device-side Enqueue.  The devices without device queues should return the
+   values defined in the OpenCL specification.  See,
    https://www.khronos.org/registry/OpenCL/specs/3.0-unified/html/OpenCL_API.html#_device_side_enqueue
+   On the devices with them, the default device queues are checked and, if
+   the device has a compiler, a kernel enqueuing child kernels with each of
+   the enqueue flags is run.
 */
 
 #define MAX_PLATFORMS 32
 #define MAX_DEVICES 32
+#define N 64
+
+/* The first child writes out, the second one waits for its event and
+   increments out, and the last one runs after the parent. */
+static const char *source
+    = "kernel void parent (global int *out, global int *flags,\n"
+      "                     global int *status)\n"
+      "{\n"
+      "  if (get_global_id (0) != 0)\n"
+      "    return;\n"
+      "  queue_t q = get_default_queue ();\n"
+      "  clk_event_t ev;\n"
+      "  status[0] = enqueue_kernel (\n"
+      "      q, CLK_ENQUEUE_FLAGS_WAIT_WORK_GROUP, ndrange_1D (64), 0, NULL,\n"
+      "      &ev, ^{ out[get_global_id (0)] = 2 * (int)get_global_id (0); });\n"
+      "  status[1] = enqueue_kernel (\n"
+      "      q, CLK_ENQUEUE_FLAGS_NO_WAIT, ndrange_1D (64, 4), 1, &ev, NULL,\n"
+      "      ^(local void *tmp) {\n"
+      "        local int *t = (local int *)tmp;\n"
+      "        t[get_local_id (0)] = out[get_global_id (0)] + 1;\n"
+      "        out[get_global_id (0)] = t[get_local_id (0)];\n"
+      "      }, 4 * sizeof (int));\n"
+      "  release_event (ev);\n"
+      "  status[2] = enqueue_kernel (q, CLK_ENQUEUE_FLAGS_WAIT_KERNEL,\n"
+      "                              ndrange_1D (1), ^{ flags[0] = 1; });\n"
+      "}\n";
+
+/* Runs the parent kernel on a device with a default device queue. */
+static int
+run_parent (cl_context context, cl_device_id device)
+{
+  cl_int err;
+  cl_int out[N], status[3] = { -1, -1, -1 }, flags = 0;
+  size_t global_work_size = 4;
+  unsigned i;
+
+  cl_command_queue queue = clCreateCommandQueue (context, device, 0, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueue");
+  cl_program program
+      = clCreateProgramWithSource (context, 1, &source, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (
+      clBuildProgram (program, 1, &device, "-cl-std=CL2.0", NULL, NULL));
+  cl_kernel kernel = clCreateKernel (program, "parent", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  cl_mem out_buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (out),
+                                   NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  cl_mem flags_buf
+      = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof (flags), &flags, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  cl_mem status_buf
+      = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof (status), status, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &out_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &flags_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_mem), &status_buf));
+
+  /* the parent completes after all of its children */
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, out_buf, CL_FALSE, 0,
+                                       sizeof (out), out, 0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, flags_buf, CL_FALSE, 0,
+                                       sizeof (flags), &flags, 0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, status_buf, CL_TRUE, 0,
+                                       sizeof (status), status, 0, NULL,
+                                       NULL));
+
+  for (i = 0; i < 3; ++i)
+    TEST_ASSERT (status[i] == CL_SUCCESS);
+  for (i = 0; i < N; ++i)
+    TEST_ASSERT (out[i] == 2 * (cl_int)i + 1);
+  TEST_ASSERT (flags == 1);
+
+  CHECK_CL_ERROR (clReleaseMemObject (status_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (flags_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (out_buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  return EXIT_SUCCESS;
+}
+
+/* Checks the default device queues of a device that has device queues. */
+static int
+test_device_queues (cl_device_id device)
+{
+  cl_int err;
+  cl_uint pref_size, queue_size;
+  cl_bool compiler;
+  cl_command_queue queue_default;
+  cl_queue_properties props[]
+      = { CL_QUEUE_PROPERTIES,
+          CL_QUEUE_ON_DEVICE | CL_QUEUE_ON_DEVICE_DEFAULT
+              | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+          0 };
+  cl_queue_properties replacement_props[]
+      = { CL_QUEUE_PROPERTIES,
+          CL_QUEUE_ON_DEVICE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, 0 };
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device,
+                                   CL_DEVICE_QUEUE_ON_DEVICE_PREFERRED_SIZE,
+                                   sizeof (cl_uint), &pref_size, NULL));
+  TEST_ASSERT (pref_size > 0);
+
+  cl_context context = clCreateContext (NULL, 1, &device, NULL, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateContext");
+  cl_command_queue device_queue
+      = clCreateCommandQueueWithProperties (context, device, props, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueueWithProperties");
+
+  CHECK_CL_ERROR (clGetCommandQueueInfo (device_queue, CL_QUEUE_SIZE,
+                                         sizeof (cl_uint), &queue_size, NULL));
+  TEST_ASSERT (queue_size == pref_size);
+  CHECK_CL_ERROR (clGetCommandQueueInfo (device_queue, CL_QUEUE_DEVICE_DEFAULT,
+                                         sizeof (cl_command_queue),
+                                         &queue_default, NULL));
+  TEST_ASSERT (queue_default == device_queue);
+
+  /* the existing default device queue is returned */
+  cl_command_queue same_queue
+      = clCreateCommandQueueWithProperties (context, device, props, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueueWithProperties");
+  TEST_ASSERT (same_queue == device_queue);
+  CHECK_CL_ERROR (clReleaseCommandQueue (same_queue));
+
+  /* the host commands cannot go to a device queue */
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (cl_int),
+                               NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  cl_int pattern = 0;
+  err = clEnqueueFillBuffer (device_queue, buf, &pattern, sizeof (pattern), 0,
+                             sizeof (pattern), 0, NULL, NULL);
+  TEST_ASSERT (err == CL_INVALID_COMMAND_QUEUE);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+
+  cl_command_queue replacement = clCreateCommandQueueWithProperties (
+      context, device, replacement_props, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueueWithProperties");
+  CHECK_CL_ERROR (clSetDefaultDeviceCommandQueue (context, device,
+                                                  replacement));
+  CHECK_CL_ERROR (clGetCommandQueueInfo (device_queue, CL_QUEUE_DEVICE_DEFAULT,
+                                         sizeof (cl_command_queue),
+                                         &queue_default, NULL));
+  TEST_ASSERT (queue_default == replacement);
+  CHECK_CL_ERROR (clReleaseCommandQueue (device_queue));
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_COMPILER_AVAILABLE,
+                                   sizeof (cl_bool), &compiler, NULL));
+  if (compiler)
+    TEST_ASSERT (run_parent (context, device) == EXIT_SUCCESS);
+
+  CHECK_CL_ERROR (clReleaseCommandQueue (replacement));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  return EXIT_SUCCESS;
+}
 
 int
 main (void)
@@ -62,10 +225,11 @@ main (void)
 
       for (j = 0; j < ndevices; j++)
         {
-          cl_uint device_queue_support;
-          err = clGetDeviceInfo (devices[j], CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES,
-                                 sizeof (cl_uint), &device_queue_support,
-                                 NULL);
+          cl_device_device_enqueue_capabilities device_queue_support;
+          err = clGetDeviceInfo (
+              devices[j], CL_DEVICE_DEVICE_ENQUEUE_CAPABILITIES,
+              sizeof (cl_device_device_enqueue_capabilities),
+              &device_queue_support, NULL);
           CHECK_OPENCL_ERROR_IN ("clGetDeviceInfo");
 
           if (device_queue_support == 0)
@@ -135,6 +299,8 @@ main (void)
               CHECK_CL_ERROR (clReleaseCommandQueue (queue));
               CHECK_CL_ERROR (clReleaseContext (context));
             }
+          else
+            TEST_ASSERT (test_device_queues (devices[j]) == EXIT_SUCCESS);
         }
     }
 #endif
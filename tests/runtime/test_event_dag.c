@@ -0,0 +1,108 @@
+/* Tests a wide event graph on an out-of-order queue: thousands of markers
+   waiting on one user event, and a barrier waiting on all of them, with
+   events repeated in its wait list.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_NODES 4096
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_command_queue_properties props;
+  cl_event user_event, barrier, *markers, *wait_list;
+  cl_int status;
+  int i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_QUEUE_PROPERTIES,
+                                   sizeof (props), &props, NULL));
+  if ((props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0)
+    {
+      printf ("SKIP: no out-of-order queues\n");
+      return 77;
+    }
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  queue = clCreateCommandQueue (context, device,
+                                CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateCommandQueue");
+
+  markers = (cl_event *)malloc (NUM_NODES * sizeof (cl_event));
+  wait_list = (cl_event *)malloc (2 * NUM_NODES * sizeof (cl_event));
+  TEST_ASSERT (markers != NULL && wait_list != NULL);
+
+  user_event = clCreateUserEvent (context, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateUserEvent");
+
+  for (i = 0; i < NUM_NODES; ++i)
+    CHECK_CL_ERROR (
+        clEnqueueMarkerWithWaitList (queue, 1, &user_event, &markers[i]));
+
+  /* every marker twice */
+  for (i = 0; i < NUM_NODES; ++i)
+    {
+      wait_list[2 * i] = markers[i];
+      wait_list[2 * i + 1] = markers[NUM_NODES - 1 - i];
+    }
+  CHECK_CL_ERROR (clEnqueueBarrierWithWaitList (queue, 2 * NUM_NODES,
+                                                wait_list, &barrier));
+  CHECK_CL_ERROR (clFlush (queue));
+
+  CHECK_CL_ERROR (clGetEventInfo (barrier, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                  sizeof (status), &status, NULL));
+  TEST_ASSERT (status != CL_COMPLETE);
+
+  CHECK_CL_ERROR (clSetUserEventStatus (user_event, CL_COMPLETE));
+  CHECK_CL_ERROR (clWaitForEvents (1, &barrier));
+
+  for (i = 0; i < NUM_NODES; ++i)
+    {
+      CHECK_CL_ERROR (clGetEventInfo (markers[i],
+                                      CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                      sizeof (status), &status, NULL));
+      TEST_ASSERT (status == CL_COMPLETE);
+      CHECK_CL_ERROR (clReleaseEvent (markers[i]));
+    }
+  CHECK_CL_ERROR (clReleaseEvent (barrier));
+  CHECK_CL_ERROR (clReleaseEvent (user_event));
+  CHECK_CL_ERROR (clFinish (queue));
+
+  printf ("OK\n");
+
+  free (markers);
+  free (wait_list);
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
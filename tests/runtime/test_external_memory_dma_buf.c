@@ -0,0 +1,162 @@
+/* Tests cl_khr_external_memory_dma_buf: a kernel increments a buffer that
+   is imported from a memfd, and the results must appear in the memfd
+   without any reads from the buffer.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define N 4096
+
+char kernelSourceCode[] = "kernel void inc(global int *data) {\n"
+                          "  data[get_global_id(0)] += 1;\n"
+                          "}\n";
+
+#define GET_FN(name)                                                          \
+  name##_fn name                                                              \
+      = (name##_fn)clGetExtensionFunctionAddressForPlatform (platform,        \
+                                                             #name);          \
+  TEST_ASSERT (name != NULL)
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buf;
+  cl_external_memory_handle_type_khr handle_type = 0;
+  size_t global_work_size = N, size;
+  char extensions[2048];
+  const char *kernel_buffer = kernelSourceCode;
+  cl_int *host;
+  int fd;
+  unsigned i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_EXTENSIONS,
+                                   sizeof (extensions), extensions, NULL));
+  if (strstr (extensions, "cl_khr_external_memory_dma_buf") == NULL)
+    {
+      printf ("The device cannot import dma-bufs -> skipping test\n");
+      return 77;
+    }
+
+  CHECK_CL_ERROR (clGetDeviceInfo (
+      device, CL_DEVICE_EXTERNAL_MEMORY_IMPORT_HANDLE_TYPES_KHR,
+      sizeof (handle_type), &handle_type, &size));
+  TEST_ASSERT (size == sizeof (handle_type));
+  TEST_ASSERT (handle_type == CL_EXTERNAL_MEMORY_HANDLE_DMA_BUF_KHR);
+
+  GET_FN (clEnqueueAcquireExternalMemObjectsKHR);
+  GET_FN (clEnqueueReleaseExternalMemObjectsKHR);
+
+  /* a memfd stands in for the dma-buf of a GPU or a camera, which are
+     mapped the same way */
+  fd = memfd_create ("pocl_test", 0);
+  if (fd < 0)
+    {
+      printf ("memfd_create is not available -> skipping test\n");
+      return 77;
+    }
+  TEST_ASSERT (ftruncate (fd, N * sizeof (cl_int)) == 0);
+  host = (cl_int *)mmap (NULL, N * sizeof (cl_int), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+  TEST_ASSERT (host != MAP_FAILED);
+  for (i = 0; i < N; ++i)
+    host[i] = (cl_int)i;
+
+  cl_mem_properties props[] = { CL_EXTERNAL_MEMORY_HANDLE_DMA_BUF_KHR,
+                                (cl_mem_properties)fd, 0 };
+  buf = clCreateBufferWithProperties (context, props, CL_MEM_READ_WRITE,
+                                      N * sizeof (cl_int), NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBufferWithProperties");
+
+  /* the buffer cannot be bigger than the memory it imports */
+  TEST_ASSERT (clCreateBufferWithProperties (context, props, 0,
+                                             2 * N * sizeof (cl_int), NULL,
+                                             &err)
+               == NULL);
+  TEST_ASSERT (err == CL_INVALID_BUFFER_SIZE);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "inc", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+
+  /* releasing a buffer that is not acquired is an error */
+  TEST_ASSERT (clEnqueueReleaseExternalMemObjectsKHR (queue, 1, &buf, 0, NULL,
+                                                      NULL)
+               == CL_INVALID_MEM_OBJECT);
+
+  /* two rounds, so that the writes through the mapping between them must
+     be seen by the second launch */
+  for (int round = 0; round < 2; ++round)
+    {
+      CHECK_CL_ERROR (clEnqueueAcquireExternalMemObjectsKHR (queue, 1, &buf,
+                                                             0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                              &global_work_size, NULL, 0,
+                                              NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReleaseExternalMemObjectsKHR (queue, 1, &buf,
+                                                             0, NULL, NULL));
+      CHECK_CL_ERROR (clFinish (queue));
+
+      for (i = 0; i < N; ++i)
+        {
+          if (host[i] != (cl_int)(i * (round + 1) + 1))
+            {
+              printf ("FAIL: element %u is %i after round %i\n", i, host[i],
+                      round);
+              return EXIT_FAILURE;
+            }
+          host[i] = (cl_int)(i * (round + 2));
+        }
+    }
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  munmap (host, N * sizeof (cl_int));
+  close (fd);
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/* Tests that each launch of a kernel uses the arguments set when it was
+   enqueued, when they are changed, set again to the same values or left
+   alone between the launches.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 64
+#define LAUNCHES 6
+
+char kernelSourceCode[]
+    = "kernel void add(global int *data, int value, int out) {\n"
+      "  data[out * get_global_size(0) + get_global_id(0)] += value;\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buf;
+  cl_event user_event;
+  const char *kernel_buffer = kernelSourceCode;
+  /* the value added by each launch, and the row of data it adds it to */
+  const cl_int values[LAUNCHES] = { 1, 1, 2, 2, 3, 2 };
+  const cl_int rows[LAUNCHES] = { 0, 0, 0, 1, 1, 1 };
+  cl_int expected[2] = { 0, 0 };
+  cl_int data[2 * N];
+  size_t global_work_size = N;
+  int i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "add", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  for (i = 0; i < 2 * N; ++i)
+    data[i] = 0;
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof (data), data, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+
+  /* hold the launches back until all have been enqueued, so that the
+     arguments are changed while the earlier ones are pending */
+  user_event = clCreateUserEvent (context, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateUserEvent");
+  CHECK_CL_ERROR (clEnqueueMarkerWithWaitList (queue, 1, &user_event, NULL));
+
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  for (i = 0; i < LAUNCHES; ++i)
+    {
+      /* launch 1 sets nothing, launch 2 only the unchanged row */
+      if (i != 1)
+        CHECK_CL_ERROR (
+            clSetKernelArg (kernel, 2, sizeof (cl_int), &rows[i]));
+      if (i != 1 && i != 2)
+        CHECK_CL_ERROR (
+            clSetKernelArg (kernel, 1, sizeof (cl_int), &values[i]));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                              &global_work_size, NULL, 0,
+                                              NULL, NULL));
+      expected[rows[i]] += (i == 2 ? values[1] : values[i]);
+    }
+  CHECK_CL_ERROR (clSetUserEventStatus (user_event, CL_COMPLETE));
+
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (data),
+                                       data, 0, NULL, NULL));
+  for (i = 0; i < 2 * N; ++i)
+    if (data[i] != expected[i / N])
+      {
+        printf ("FAIL at %i: %i != %i\n", i, data[i], expected[i / N]);
+        return EXIT_FAILURE;
+      }
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseEvent (user_event));
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/* Tests the work-group functions loaded with the in-process JIT of
+   POCL_KERNEL_JIT: the kernels give the right results at their first
+   launch, and at the later ones after their JIT instances were evicted from
+   a loaded binary cache smaller than the number of kernels, which, with the
+   kernel cache enabled, loads the cached object files again.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 256
+#define NUM_KERNELS 4
+#define ROUNDS 3
+
+char kernelSourceCode[]
+    = "kernel void k0(global int *out, int a) { out[get_global_id(0)] = a; }\n"
+      "kernel void k1(global int *out, int a) {\n"
+      "  out[get_global_id(0)] = a * (int)get_global_id(0);\n"
+      "}\n"
+      "kernel void k2(global int *out, int a) {\n"
+      "  out[get_global_id(0)] = a + (int)get_local_id(0);\n"
+      "}\n"
+      "kernel void k3(global int *out, int a) {\n"
+      "  out[get_global_id(0)] = a - (int)get_group_id(0);\n"
+      "}\n";
+
+static cl_int
+expected (unsigned kernel, cl_int a, size_t i, size_t local_size)
+{
+  switch (kernel)
+    {
+    case 0:
+      return a;
+    case 1:
+      return a * (cl_int)i;
+    case 2:
+      return a + (cl_int)(i % local_size);
+    default:
+      return a - (cl_int)(i / local_size);
+    }
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernels[NUM_KERNELS];
+  cl_mem buf;
+  cl_int out[N];
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global_work_size = N, local_work_size = 16;
+  char name[8];
+  unsigned k, round, i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+
+  buf = clCreateBuffer (context, CL_MEM_WRITE_ONLY, sizeof (out), NULL,
+                        &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  for (k = 0; k < NUM_KERNELS; ++k)
+    {
+      snprintf (name, sizeof (name), "k%u", k);
+      kernels[k] = clCreateKernel (program, name, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+      CHECK_CL_ERROR (clSetKernelArg (kernels[k], 0, sizeof (cl_mem), &buf));
+    }
+
+  /* each round loads every kernel again, as the two loaded last only
+     remain in the cache */
+  for (round = 0; round < ROUNDS; ++round)
+    for (k = 0; k < NUM_KERNELS; ++k)
+      {
+        cl_int a = (cl_int)(100 * round + k);
+        CHECK_CL_ERROR (
+            clSetKernelArg (kernels[k], 1, sizeof (cl_int), &a));
+        CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernels[k], 1, NULL,
+                                                &global_work_size,
+                                                &local_work_size, 0, NULL,
+                                                NULL));
+        CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0,
+                                             sizeof (out), out, 0, NULL,
+                                             NULL));
+        for (i = 0; i < N; ++i)
+          if (out[i] != expected (k, a, i, local_work_size))
+            {
+              printf ("FAIL at round %u, k%u, %u: %i != %i\n", round, k, i,
+                      out[i], expected (k, a, i, local_work_size));
+              return EXIT_FAILURE;
+            }
+      }
+
+  printf ("OK\n");
+
+  for (k = 0; k < NUM_KERNELS; ++k)
+    CHECK_CL_ERROR (clReleaseKernel (kernels[k]));
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
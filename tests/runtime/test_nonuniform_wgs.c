@@ -0,0 +1,151 @@
+/* Tests the NDRange launches with no local size and global sizes that
+   aren't multiples of the preferred WG size multiple, which the CPU
+   driver may run with smaller work-groups at the edges of the grid.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* primes */
+#define W 1021
+#define H 251
+
+char kernelSourceCode[]
+    = "kernel \n"
+      "void ids(global uint* out, uint ox, uint oy, uint w) {\n"
+      "    size_t x = get_global_id(0), y = get_global_id(1);\n"
+      "    out[(y - oy) * w + x - ox] += y * w + x + 1;\n"
+      "}\n"
+      "kernel \n"
+      "void sizes(global uint* out) {\n"
+      "    size_t i = get_global_id(0) - get_global_offset(0);\n"
+      "    out[i] = get_global_size(0);\n"
+      "}\n";
+
+/* Runs ids over a w x h grid at the offset, and checks that each work-item
+   ran exactly once. */
+static int
+run_ids (cl_command_queue queue, cl_kernel kernel, cl_mem buf, cl_uint *out,
+         cl_uint w, cl_uint h, cl_uint ox, cl_uint oy)
+{
+  size_t global[2] = { w, h };
+  size_t offset[2] = { ox, oy };
+  cl_uint x, y;
+
+  for (x = 0; x < w * h; ++x)
+    out[x] = 0;
+  CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buf, CL_TRUE, 0,
+                                        w * h * sizeof (cl_uint), out, 0, NULL,
+                                        NULL));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_uint), &ox));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_uint), &oy));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 3, sizeof (cl_uint), &w));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, h > 1 ? 2 : 1,
+                                          offset, global, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0,
+                                       w * h * sizeof (cl_uint), out, 0, NULL,
+                                       NULL));
+  for (y = 0; y < h; ++y)
+    for (x = 0; x < w; ++x)
+      {
+        cl_uint expected = (y + oy) * w + x + ox + 1;
+        if (out[y * w + x] != expected)
+          {
+            printf ("FAIL at %u,%u of %ux%u: %u != %u\n", x, y, w, h,
+                    out[y * w + x], expected);
+            return EXIT_FAILURE;
+          }
+      }
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel ids, sizes;
+  cl_mem buf;
+  cl_uint *out;
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global_work_size = W;
+  int i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  ids = clCreateKernel (program, "ids", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  sizes = clCreateKernel (program, "sizes", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  out = (cl_uint *)malloc (W * H * sizeof (cl_uint));
+  TEST_ASSERT (out != NULL);
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE, W * H * sizeof (cl_uint),
+                        NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+
+  TEST_ASSERT (run_ids (queue, ids, buf, out, W, 1, 0, 0) == EXIT_SUCCESS);
+  TEST_ASSERT (run_ids (queue, ids, buf, out, W, 1, 3, 0) == EXIT_SUCCESS);
+  TEST_ASSERT (run_ids (queue, ids, buf, out, W, H, 0, 0) == EXIT_SUCCESS);
+  TEST_ASSERT (run_ids (queue, ids, buf, out, W, H, 5, 7) == EXIT_SUCCESS);
+  TEST_ASSERT (run_ids (queue, ids, buf, out, 24, H, 0, 0) == EXIT_SUCCESS);
+
+  /* A kernel that queries the global size keeps uniform work-groups. */
+  CHECK_CL_ERROR (clSetKernelArg (sizes, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, sizes, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0,
+                                       W * sizeof (cl_uint), out, 0, NULL,
+                                       NULL));
+  for (i = 0; i < W; ++i)
+    if (out[i] != W)
+      {
+        printf ("FAIL: get_global_size() at %i: %u\n", i, out[i]);
+        return EXIT_FAILURE;
+      }
+
+  printf ("OK\n");
+
+  free (out);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (ids));
+  CHECK_CL_ERROR (clReleaseKernel (sizes));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+/* Tests the OpenCL 2.0 pipes: a kernel writes its global ids to a pipe
+   with work-group reservations, and another kernel reads them back with
+   the plain read_pipe, so that every id must be read exactly once.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 4096
+#define WG_SIZE 64
+
+char kernelSourceCode[]
+    = "kernel void produce(write_only pipe int p, global int *failures) {\n"
+      "  int gid = (int)get_global_id(0);\n"
+      "  reserve_id_t rid = work_group_reserve_write_pipe(p, WG_SIZE);\n"
+      "  if (is_valid_reserve_id(rid)) {\n"
+      "    if (write_pipe(p, rid, get_local_id(0), &gid) != 0)\n"
+      "      atomic_inc(failures);\n"
+      "    work_group_commit_write_pipe(p, rid);\n"
+      "  } else {\n"
+      "    atomic_inc(failures);\n"
+      "  }\n"
+      "}\n"
+      "kernel void consume(read_only pipe int p, global int *seen,\n"
+      "                    global int *failures) {\n"
+      "  int id;\n"
+      "  if (read_pipe(p, &id) == 0 && id >= 0 && id < N)\n"
+      "    atomic_inc(&seen[id]);\n"
+      "  else\n"
+      "    atomic_inc(failures);\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel produce, consume;
+  cl_mem pipe, seen_buf, failures_buf;
+  cl_bool pipe_support = CL_FALSE;
+  cl_uint packet_size, max_packets;
+  size_t global_work_size = N, local_work_size = WG_SIZE;
+  cl_int *seen;
+  cl_int failures = 0;
+  const char *kernel_buffer = kernelSourceCode;
+  unsigned i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  err = clGetDeviceInfo (device, CL_DEVICE_PIPE_SUPPORT, sizeof (cl_bool),
+                         &pipe_support, NULL);
+  if (err != CL_SUCCESS || !pipe_support)
+    {
+      printf ("The device does not support pipes -> skipping test\n");
+      return 77;
+    }
+
+  pipe = clCreatePipe (context, 0, sizeof (cl_int), N, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreatePipe");
+  CHECK_CL_ERROR (clGetPipeInfo (pipe, CL_PIPE_PACKET_SIZE, sizeof (cl_uint),
+                                 &packet_size, NULL));
+  CHECK_CL_ERROR (clGetPipeInfo (pipe, CL_PIPE_MAX_PACKETS, sizeof (cl_uint),
+                                 &max_packets, NULL));
+  TEST_ASSERT (packet_size == sizeof (cl_int));
+  TEST_ASSERT (max_packets == N);
+
+  TEST_ASSERT (clCreatePipe (context, 0, 0, N, NULL, &err) == NULL);
+  TEST_ASSERT (err == CL_INVALID_PIPE_SIZE);
+
+  seen = (cl_int *)calloc (N, sizeof (cl_int));
+  TEST_ASSERT (seen != NULL);
+  seen_buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                             N * sizeof (cl_int), seen, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  failures_buf
+      = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        sizeof (cl_int), &failures, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL,
+                                  "-cl-std=CL2.0 -DN=4096 -DWG_SIZE=64", NULL,
+                                  NULL));
+  produce = clCreateKernel (program, "produce", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  consume = clCreateKernel (program, "consume", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  /* only pipes can be given to the pipe arguments */
+  TEST_ASSERT (clSetKernelArg (produce, 0, sizeof (cl_mem), &seen_buf)
+               == CL_INVALID_ARG_VALUE);
+
+  CHECK_CL_ERROR (clSetKernelArg (produce, 0, sizeof (cl_mem), &pipe));
+  CHECK_CL_ERROR (clSetKernelArg (produce, 1, sizeof (cl_mem), &failures_buf));
+  CHECK_CL_ERROR (clSetKernelArg (consume, 0, sizeof (cl_mem), &pipe));
+  CHECK_CL_ERROR (clSetKernelArg (consume, 1, sizeof (cl_mem), &seen_buf));
+  CHECK_CL_ERROR (clSetKernelArg (consume, 2, sizeof (cl_mem), &failures_buf));
+
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, produce, 1, NULL,
+                                          &global_work_size, &local_work_size,
+                                          0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, consume, 1, NULL,
+                                          &global_work_size, &local_work_size,
+                                          0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, failures_buf, CL_TRUE, 0,
+                                       sizeof (cl_int), &failures, 0, NULL,
+                                       NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, seen_buf, CL_TRUE, 0,
+                                       N * sizeof (cl_int), seen, 0, NULL,
+                                       NULL));
+
+  TEST_ASSERT (failures == 0);
+  for (i = 0; i < N; ++i)
+    if (seen[i] != 1)
+      {
+        printf ("FAIL: id %u was read %i times\n", i, seen[i]);
+        return EXIT_FAILURE;
+      }
+  free (seen);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (pipe));
+  CHECK_CL_ERROR (clReleaseMemObject (seen_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (failures_buf));
+  CHECK_CL_ERROR (clReleaseKernel (produce));
+  CHECK_CL_ERROR (clReleaseKernel (consume));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/* Tests the array helpers of poclu against their scalar versions: the
+   float <-> cl_half conversions and the byte swaps, for the lengths that
+   end in each vector loop tail, and for an array large enough to be split
+   between threads.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SHORT 17
+/* more than the 2 << 20 elements worth two threads */
+#define LARGE ((3 << 20) + 13)
+
+/* The poclu_bswap_* functions swap only for a device with the other byte
+   order than the host's, so this test, which uses no other OpenCL call,
+   reports that for every device. */
+CL_API_ENTRY cl_int CL_API_CALL
+clGetDeviceInfo (cl_device_id device, cl_device_info param_name,
+                 size_t param_value_size, void *param_value,
+                 size_t *param_value_size_ret)
+{
+  const uint16_t one = 1;
+  cl_bool little = *(const unsigned char *)&one == 1;
+  if (param_name != CL_DEVICE_ENDIAN_LITTLE
+      || param_value_size < sizeof (cl_bool))
+    return CL_INVALID_VALUE;
+  *(cl_bool *)param_value = !little;
+  if (param_value_size_ret)
+    *param_value_size_ret = sizeof (cl_bool);
+  return CL_SUCCESS;
+}
+
+static float
+bits_to_float (uint32_t u)
+{
+  float f;
+  memcpy (&f, &u, sizeof (f));
+  return f;
+}
+
+static uint32_t
+float_to_bits (float f)
+{
+  uint32_t u;
+  memcpy (&u, &f, sizeof (u));
+  return u;
+}
+
+/* The floats of the tests: zeros, infinities, NaNs, the half subnormal
+   and overflow boundaries and the values halfway between two halves, and
+   then pseudo-random bit patterns of all the exponents. */
+static void
+fill_floats (float *f, size_t n)
+{
+  static const uint32_t special[] = {
+    0x00000000u, 0x80000000u, 0x7f800000u, 0xff800000u, 0x7fc00000u,
+    0xffc00001u, 0x7f800001u, 0x7fa00000u, /* 2^-24, the least subnormal */
+    0x33800000u, 0x33000000u, 0x33000001u, 0x33c00000u,
+    /* 2^-14, the least normal, and the largest subnormal below it */
+    0x38800000u, 0x387fc000u, 0x387fe000u, 0x387ff000u,
+    /* 65504, the largest half, and the values rounding to it or to inf */
+    0x477fe000u, 0x477fefffu, 0x477ff000u, 0x47800000u,
+    /* 1 + 2^-11 and 1 + 3 * 2^-11: halfway, ties to even down and up */
+    0x3f801000u, 0x3f803000u, 0x3f801001u, 0xbf803000u,
+    /* a float denormal */
+    0x00000001u, 0x807fffffu
+  };
+  size_t num_special = sizeof (special) / sizeof (special[0]);
+  uint32_t x = 0x12345678u;
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    {
+      if (i < num_special)
+        f[i] = bits_to_float (special[i]);
+      else
+        {
+          x = x * 1664525u + 1013904223u;
+          f[i] = bits_to_float (x);
+        }
+    }
+}
+
+static int
+test_conversions (const float *floats, size_t n, cl_half *halves,
+                  float *back)
+{
+  size_t i;
+
+  poclu_float_to_cl_half_array (halves, floats, n);
+  for (i = 0; i < n; ++i)
+    if (halves[i] != poclu_float_to_cl_half (floats[i]))
+      {
+        printf ("FAIL: %zu of %zu floats: 0x%08x to half 0x%04x, not "
+                "0x%04x\n",
+                i, n, float_to_bits (floats[i]), halves[i],
+                poclu_float_to_cl_half (floats[i]));
+        return EXIT_FAILURE;
+      }
+
+  /* every half pattern, as many as fit */
+  for (i = 0; i < n; ++i)
+    halves[i] = (cl_half)(i * 40503u + 7);
+  poclu_cl_half_to_float_array (back, halves, n);
+  for (i = 0; i < n; ++i)
+    if (float_to_bits (back[i])
+        != float_to_bits (poclu_cl_half_to_float (halves[i])))
+      {
+        printf ("FAIL: %zu of %zu halves: 0x%04x to float 0x%08x, not "
+                "0x%08x\n",
+                i, n, halves[i], float_to_bits (back[i]),
+                float_to_bits (poclu_cl_half_to_float (halves[i])));
+        return EXIT_FAILURE;
+      }
+  return EXIT_SUCCESS;
+}
+
+static int
+test_swaps (const float *floats, size_t n, float *swapped)
+{
+  cl_device_id device = NULL;
+  size_t i;
+
+  memcpy (swapped, floats, n * sizeof (float));
+  poclu_bswap_cl_float_array (device, swapped, n);
+  for (i = 0; i < n; ++i)
+    if (float_to_bits (swapped[i])
+        != float_to_bits (poclu_bswap_cl_float (device, floats[i])))
+      {
+        printf ("FAIL: %zu of %zu floats swapped\n", i, n);
+        return EXIT_FAILURE;
+      }
+
+  memcpy (swapped, floats, n * sizeof (float));
+  poclu_bswap_cl_int_array (device, (cl_int *)swapped, n);
+  for (i = 0; i < n; ++i)
+    {
+      cl_int v;
+      memcpy (&v, &floats[i], sizeof (v));
+      if (((cl_int *)swapped)[i] != poclu_bswap_cl_int (device, v))
+        {
+          printf ("FAIL: %zu of %zu ints swapped\n", i, n);
+          return EXIT_FAILURE;
+        }
+    }
+
+  /* the halves of the same bytes, twice as many */
+  memcpy (swapped, floats, n * sizeof (float));
+  poclu_bswap_cl_half_array (device, (cl_half *)swapped, 2 * n);
+  for (i = 0; i < 2 * n; ++i)
+    if (((cl_half *)swapped)[i]
+        != poclu_bswap_cl_half (device, ((const cl_half *)floats)[i]))
+      {
+        printf ("FAIL: %zu of %zu halves swapped\n", i, 2 * n);
+        return EXIT_FAILURE;
+      }
+
+  /* the float2s of the first n / 2 * 2 floats */
+  memcpy (swapped, floats, n * sizeof (float));
+  poclu_bswap_cl_float2_array (device, (cl_float2 *)swapped, n / 2);
+  for (i = 0; i < n / 2 * 2; ++i)
+    if (float_to_bits (swapped[i])
+        != float_to_bits (poclu_bswap_cl_float (device, floats[i])))
+      {
+        printf ("FAIL: %zu of %zu float2 components swapped\n", i, n);
+        return EXIT_FAILURE;
+      }
+  for (; i < n; ++i)
+    TEST_ASSERT (float_to_bits (swapped[i]) == float_to_bits (floats[i]));
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  float *floats = (float *)malloc (LARGE * sizeof (float));
+  float *back = (float *)malloc (LARGE * sizeof (float));
+  cl_half *halves = (cl_half *)malloc (LARGE * sizeof (cl_half));
+  size_t n;
+
+  TEST_ASSERT (floats != NULL && back != NULL && halves != NULL);
+  /* the device of the other byte order */
+  TEST_ASSERT (poclu_bswap_cl_int (NULL, 0x01020304) == 0x04030201);
+
+  /* the specials are the first elements, so each length starts with them */
+  for (n = 0; n <= MAX_SHORT; ++n)
+    {
+      fill_floats (floats, n);
+      TEST_ASSERT (test_conversions (floats, n, halves, back)
+                   == EXIT_SUCCESS);
+      TEST_ASSERT (test_swaps (floats, n, back) == EXIT_SUCCESS);
+    }
+
+  fill_floats (floats, LARGE);
+  TEST_ASSERT (test_conversions (floats, LARGE, halves, back)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (test_swaps (floats, LARGE, back) == EXIT_SUCCESS);
+
+  free (halves);
+  free (back);
+  free (floats);
+
+  printf ("OK\n");
+  return EXIT_SUCCESS;
+}
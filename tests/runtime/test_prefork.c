@@ -0,0 +1,141 @@
+/* Tests POCL_PREFORK: the children forked after a kernel has run in the
+   parent run it too, and so does the parent after the fork.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define N 1024
+#define NUM_CHILDREN 4
+
+char kernelSourceCode[] = "kernel void scale(global int *data, int f) {\n"
+                          "  size_t i = get_global_id(0);\n"
+                          "  data[i] = (int)i * f;\n"
+                          "}\n";
+
+static int
+run_scale (cl_context context, cl_command_queue queue, cl_kernel kernel,
+           cl_int f)
+{
+  cl_int err;
+  cl_int data[N];
+  size_t global_work_size = N;
+  unsigned i;
+
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (data),
+                               NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_int), &f));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (data),
+                                       data, 0, NULL, NULL));
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  for (i = 0; i < N; ++i)
+    if (data[i] != (cl_int)i * f)
+      {
+        printf ("FAIL: element %u is %i instead of %i\n", i, data[i],
+                (cl_int)i * f);
+        return EXIT_FAILURE;
+      }
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_device_type type;
+  cl_context context;
+  cl_command_queue queue;
+  const char *kernel_buffer = kernelSourceCode;
+  pid_t children[NUM_CHILDREN];
+  int i, failed = 0;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (
+      clGetDeviceInfo (device, CL_DEVICE_TYPE, sizeof (type), &type, NULL));
+  if (!(type & CL_DEVICE_TYPE_CPU))
+    {
+      printf ("POCL_PREFORK is only supported by the CPU devices -> "
+              "skipping test\n");
+      return 77;
+    }
+
+  cl_program program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  cl_kernel kernel = clCreateKernel (program, "scale", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  /* builds and loads the WG function before the fork */
+  if (run_scale (context, queue, kernel, 1) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < NUM_CHILDREN; ++i)
+    {
+      children[i] = fork ();
+      TEST_ASSERT (children[i] >= 0);
+      if (children[i] == 0)
+        {
+          int res = run_scale (context, queue, kernel, i + 2);
+          /* the child shares the objects of the parent, skip the cleanup */
+          _exit (res);
+        }
+    }
+
+  if (run_scale (context, queue, kernel, -1) != EXIT_SUCCESS)
+    failed = 1;
+
+  for (i = 0; i < NUM_CHILDREN; ++i)
+    {
+      int status;
+      TEST_ASSERT (waitpid (children[i], &status, 0) == children[i]);
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+        {
+          printf ("FAIL: child %i did not run the kernel\n", i);
+          failed = 1;
+        }
+    }
+
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  if (failed)
+    return EXIT_FAILURE;
+  printf ("OK\n");
+  return EXIT_SUCCESS;
+}
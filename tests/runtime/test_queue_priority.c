@@ -0,0 +1,154 @@
+/* Tests the command queues with cl_khr_priority_hints and
+   cl_khr_throttle_hints: kernels enqueued to a high priority, a low
+   priority and a low throttle queue at the same time all compute their
+   results, and invalid hints are rejected.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N (64 * 1024)
+#define NUM_QUEUES 3
+
+char kernelSourceCode[] = "kernel void iterate(global uint *out, uint n) {\n"
+                          "  size_t gid = get_global_id(0);\n"
+                          "  uint x = (uint)gid;\n"
+                          "  for (uint i = 0; i < n; ++i)\n"
+                          "    x = x * 1664525u + 1013904223u;\n"
+                          "  out[gid] = x;\n"
+                          "}\n";
+
+static cl_uint
+iterate (cl_uint x, cl_uint n)
+{
+  cl_uint i;
+  for (i = 0; i < n; ++i)
+    x = x * 1664525u + 1013904223u;
+  return x;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_command_queue queues[NUM_QUEUES];
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem bufs[NUM_QUEUES];
+  cl_uint iterations[NUM_QUEUES] = { 4096, 16, 256 };
+  unsigned read_order[NUM_QUEUES] = { 1, 2, 0 };
+  cl_uint *result;
+  size_t global_work_size = N;
+  char extensions[4096];
+  const char *kernel_buffer = kernelSourceCode;
+  unsigned i, q;
+
+  cl_queue_properties props[NUM_QUEUES][3]
+      = { { CL_QUEUE_PRIORITY_KHR, CL_QUEUE_PRIORITY_LOW_KHR, 0 },
+          { CL_QUEUE_PRIORITY_KHR, CL_QUEUE_PRIORITY_HIGH_KHR, 0 },
+          { CL_QUEUE_THROTTLE_KHR, CL_QUEUE_THROTTLE_LOW_KHR, 0 } };
+  cl_queue_properties bad_props[3] = { CL_QUEUE_PRIORITY_KHR, 123, 0 };
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_EXTENSIONS,
+                                   sizeof (extensions), extensions, NULL));
+  if (strstr (extensions, "cl_khr_priority_hints") == NULL
+      || strstr (extensions, "cl_khr_throttle_hints") == NULL)
+    {
+      printf ("The device does not support the queue hints -> skipping "
+              "test\n");
+      return 77;
+    }
+
+  TEST_ASSERT (clCreateCommandQueueWithProperties (context, device, bad_props,
+                                                   &err)
+               == NULL);
+  TEST_ASSERT (err == CL_INVALID_VALUE);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "iterate", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  /* the kernel arguments are copied at enqueue, so the same kernel can be
+     enqueued to all the queues before any of them runs */
+  for (q = 0; q < NUM_QUEUES; ++q)
+    {
+      queues[q] = clCreateCommandQueueWithProperties (context, device,
+                                                      props[q], &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateCommandQueueWithProperties");
+      bufs[q] = clCreateBuffer (context, CL_MEM_WRITE_ONLY,
+                                N * sizeof (cl_uint), NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+      CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &bufs[q]));
+      CHECK_CL_ERROR (
+          clSetKernelArg (kernel, 1, sizeof (cl_uint), &iterations[q]));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queues[q], kernel, 1, NULL,
+                                              &global_work_size, NULL, 0,
+                                              NULL, NULL));
+      CHECK_CL_ERROR (clFlush (queues[q]));
+    }
+
+  result = (cl_uint *)malloc (N * sizeof (cl_uint));
+  TEST_ASSERT (result != NULL);
+  /* the high priority queue first */
+  for (q = 0; q < NUM_QUEUES; ++q)
+    {
+      unsigned k = read_order[q];
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queues[k], bufs[k], CL_TRUE, 0,
+                                           N * sizeof (cl_uint), result, 0,
+                                           NULL, NULL));
+      for (i = 0; i < N; ++i)
+        if (result[i] != iterate (i, iterations[k]))
+          {
+            printf ("FAIL on queue %u at %u: %u != %u\n", k, i, result[i],
+                    iterate (i, iterations[k]));
+            return EXIT_FAILURE;
+          }
+    }
+  free (result);
+
+  printf ("OK\n");
+
+  for (q = 0; q < NUM_QUEUES; ++q)
+    {
+      CHECK_CL_ERROR (clReleaseMemObject (bufs[q]));
+      CHECK_CL_ERROR (clReleaseCommandQueue (queues[q]));
+    }
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/* Tests clEnqueueNDRangeKernelSplitPoCL over the devices of a context.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+#define WIDTH 64
+#define HEIGHT 96
+#define ROUNDS 3
+
+char kernelSourceCode[]
+    = "kernel \n"
+      "void scale(global int* data, global const int* add) {\n"
+      "    size_t i = get_global_id(1) * get_global_size(0)\n"
+      "               + get_global_id(0);\n"
+      "    data[i] = data[i] * 2 + add[get_global_id(1)];\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform = NULL;
+  cl_context context = NULL;
+  cl_device_id *devices = NULL;
+  cl_command_queue *queues = NULL;
+  cl_command_queue split_queues[2];
+  cl_uint num_devices = 0, num_queues;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem data_buf, add_buf;
+  cl_event event;
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global[2] = { WIDTH, HEIGHT }, local[2] = { 8, 4 };
+  int data[WIDTH * HEIGHT], expected[WIDTH * HEIGHT], add[HEIGHT];
+  int i, r;
+
+  err = poclu_get_multiple_devices (&platform, &context, &num_devices,
+                                    &devices, &queues);
+  CHECK_OPENCL_ERROR_IN ("poclu_get_multiple_devices");
+
+  clEnqueueNDRangeKernelSplitPoCL_fn split
+      = (clEnqueueNDRangeKernelSplitPoCL_fn)
+          clGetExtensionFunctionAddressForPlatform (
+              platform, "clEnqueueNDRangeKernelSplitPoCL");
+  TEST_ASSERT (split != NULL);
+
+  /* With a single device, split between two queues of it. */
+  num_queues = num_devices;
+  if (num_devices == 1)
+    {
+      split_queues[0] = queues[0];
+      split_queues[1]
+          = clCreateCommandQueue (context, devices[0], 0, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateCommandQueue");
+      num_queues = 2;
+    }
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "scale", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  for (i = 0; i < WIDTH * HEIGHT; ++i)
+    expected[i] = data[i] = i;
+  for (i = 0; i < HEIGHT; ++i)
+    add[i] = i * 3;
+
+  data_buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                             sizeof (data), data, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  add_buf = clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                            sizeof (add), add, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &data_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &add_buf));
+
+  /* Several rounds, so that the later ones are split by the measured
+   * throughputs, and each one reads what the previous one gathered. */
+  for (r = 0; r < ROUNDS; ++r)
+    {
+      CHECK_CL_ERROR (split (num_queues,
+                             num_devices == 1 ? split_queues : queues, kernel,
+                             2, NULL, global, local, 0, NULL, &event));
+      CHECK_CL_ERROR (clWaitForEvents (1, &event));
+      CHECK_CL_ERROR (clReleaseEvent (event));
+      for (i = 0; i < WIDTH * HEIGHT; ++i)
+        expected[i] = expected[i] * 2 + add[i / WIDTH];
+    }
+
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queues[0], data_buf, CL_TRUE, 0,
+                                       sizeof (data), data, 0, NULL, NULL));
+  for (i = 0; i < WIDTH * HEIGHT; ++i)
+    if (data[i] != expected[i])
+      {
+        printf ("FAIL at %i: %i != %i\n", i, data[i], expected[i]);
+        return EXIT_FAILURE;
+      }
+
+  /* invalid arguments */
+  TEST_ASSERT (split (0, queues, kernel, 2, NULL, global, local, 0, NULL,
+                      NULL)
+               == CL_INVALID_VALUE);
+  local[1] = 5;
+  TEST_ASSERT (split (1, queues, kernel, 2, NULL, global, local, 0, NULL,
+                      NULL)
+               == CL_INVALID_WORK_GROUP_SIZE);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (data_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (add_buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  if (num_devices == 1)
+    CHECK_CL_ERROR (clReleaseCommandQueue (split_queues[1]));
+  for (i = 0; i < (int)num_devices; ++i)
+    CHECK_CL_ERROR (clReleaseCommandQueue (queues[i]));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+  free (devices);
+  free (queues);
+
+  return EXIT_SUCCESS;
+}
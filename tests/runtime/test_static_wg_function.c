@@ -0,0 +1,158 @@
+/* Tests clRegisterStaticWGFunctionsPoCL: a WG function of the test program
+   replaces the compiled one of a kernel, for the program built from the
+   source and for one created from its pocl binary.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 64
+
+char kernelSourceCode[] = "kernel void fill(global int *data) {\n"
+                          "  data[get_global_id(0)] = 1;\n"
+                          "}\n";
+
+/* The WG function ABI of the CPU devices: the arguments are an array of
+   pointers to the argument values. With the local size of 1, the group
+   id is the global id. */
+static void
+static_fill (unsigned char *args, unsigned char *pc, uint64_t group_x,
+             uint64_t group_y, uint64_t group_z)
+{
+  cl_int *data = *(cl_int **)((void **)args)[0];
+  data[group_x] = 42;
+}
+
+static int
+run_fill (cl_context context, cl_command_queue queue, cl_program program)
+{
+  cl_int err;
+  cl_int data[N];
+  size_t global_work_size = N, local_work_size = 1;
+  unsigned i;
+
+  cl_kernel kernel = clCreateKernel (program, "fill", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  cl_mem buf = clCreateBuffer (context, CL_MEM_READ_WRITE, sizeof (data),
+                               NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, &local_work_size,
+                                          0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0, sizeof (data),
+                                       data, 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    if (data[i] != 42)
+      {
+        printf ("FAIL: element %u is %i, the static WG function was not "
+                "used\n",
+                i, data[i]);
+        return EXIT_FAILURE;
+      }
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_device_type type;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program, binary_program;
+  char build_hash[64];
+  const char *kernel_buffer = kernelSourceCode;
+  size_t binary_size;
+  unsigned char *binary;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (
+      clGetDeviceInfo (device, CL_DEVICE_TYPE, sizeof (type), &type, NULL));
+  if (!(type & CL_DEVICE_TYPE_CPU))
+    {
+      printf ("Only the CPU devices run static WG functions -> skipping "
+              "test\n");
+      return 77;
+    }
+
+  clRegisterStaticWGFunctionsPoCL_fn clRegisterStaticWGFunctionsPoCL
+      = (clRegisterStaticWGFunctionsPoCL_fn)
+          clGetExtensionFunctionAddressForPlatform (
+              platform, "clRegisterStaticWGFunctionsPoCL");
+  TEST_ASSERT (clRegisterStaticWGFunctionsPoCL != NULL);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  CHECK_CL_ERROR (clGetProgramBuildInfo (program, device,
+                                         CL_PROGRAM_BUILD_HASH_POCL,
+                                         sizeof (build_hash), build_hash,
+                                         NULL));
+
+  /* the binary is taken before the registration, so that it has the
+     compiled WG functions */
+  CHECK_CL_ERROR (clGetProgramInfo (program, CL_PROGRAM_BINARY_SIZES,
+                                    sizeof (size_t), &binary_size, NULL));
+  binary = (unsigned char *)malloc (binary_size);
+  TEST_ASSERT (binary != NULL);
+  CHECK_CL_ERROR (clGetProgramInfo (program, CL_PROGRAM_BINARIES,
+                                    sizeof (unsigned char *), &binary, NULL));
+
+  static cl_static_wg_function_pocl functions[1];
+  functions[0].build_hash = build_hash;
+  functions[0].kernel_name = "fill";
+  functions[0].wg = (void *)static_fill;
+  CHECK_CL_ERROR (clRegisterStaticWGFunctionsPoCL (platform, 1, functions));
+
+  if (run_fill (context, queue, program) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  binary_program = clCreateProgramWithBinary (
+      context, 1, &device, &binary_size, (const unsigned char **)&binary,
+      NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithBinary");
+  CHECK_CL_ERROR (clBuildProgram (binary_program, 0, NULL, NULL, NULL, NULL));
+  if (run_fill (context, queue, binary_program) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  printf ("OK\n");
+
+  free (binary);
+  CHECK_CL_ERROR (clReleaseProgram (binary_program));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/* Tests clEnqueueSVMMigrateMem on coarse-grained SVM allocations.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 4096
+
+char kernelSourceCode[] = "kernel \n"
+                          "void inc(global int* data) {\n"
+                          "    data[get_global_id(0)] += 1;\n"
+                          "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_device_svm_capabilities caps;
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global_work_size = N;
+  int i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_SVM_CAPABILITIES,
+                                   sizeof (caps), &caps, NULL));
+  if ((caps & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) == 0)
+    {
+      printf ("SKIP: no coarse-grained SVM\n");
+      return 77;
+    }
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "inc", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  int *data = (int *)clSVMAlloc (context, CL_MEM_READ_WRITE,
+                                 N * sizeof (int), 0);
+  TEST_ASSERT (data != NULL);
+
+  CHECK_CL_ERROR (clEnqueueSVMMap (queue, CL_TRUE, CL_MAP_WRITE, data,
+                                   N * sizeof (int), 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    data[i] = i;
+  CHECK_CL_ERROR (clEnqueueSVMUnmap (queue, data, 0, NULL, NULL));
+
+  /* the whole allocation to the device, and back to the host in two
+     parts, one of them given by a pointer inside the allocation */
+  const void *ptrs[2] = { data, data + N / 2 };
+  size_t sizes[2] = { N / 2 * sizeof (int), 0 };
+  CHECK_CL_ERROR (
+      clEnqueueSVMMigrateMem (queue, 1, ptrs, NULL, 0, 0, NULL, NULL));
+  CHECK_CL_ERROR (clSetKernelArgSVMPointer (kernel, 0, data));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clEnqueueSVMMigrateMem (queue, 2, ptrs, sizes,
+                                          CL_MIGRATE_MEM_OBJECT_HOST, 0, NULL,
+                                          NULL));
+
+  CHECK_CL_ERROR (clEnqueueSVMMap (queue, CL_TRUE, CL_MAP_READ, data,
+                                   N * sizeof (int), 0, NULL, NULL));
+  for (i = 0; i < N; ++i)
+    if (data[i] != i + 1)
+      {
+        printf ("FAIL at %i: %i != %i\n", i, data[i], i + 1);
+        return EXIT_FAILURE;
+      }
+  CHECK_CL_ERROR (clEnqueueSVMUnmap (queue, data, 0, NULL, NULL));
+
+  /* invalid arguments */
+  TEST_ASSERT (clEnqueueSVMMigrateMem (queue, 0, ptrs, NULL, 0, 0, NULL, NULL)
+               == CL_INVALID_VALUE);
+  TEST_ASSERT (clEnqueueSVMMigrateMem (queue, 1, NULL, NULL, 0, 0, NULL, NULL)
+               == CL_INVALID_VALUE);
+  TEST_ASSERT (clEnqueueSVMMigrateMem (queue, 1, ptrs, NULL, CL_MAP_READ, 0,
+                                       NULL, NULL)
+               == CL_INVALID_VALUE);
+
+  CHECK_CL_ERROR (clFinish (queue));
+  clSVMFree (context, data);
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+/* Tests fine-grained system SVM: kernels working on malloc()ed memory
+   passed with clSetKernelArgSVMPointer, and SVM atomics on it.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 1024
+
+typedef struct
+{
+  int *data;
+  int count;
+} node_t;
+
+/* The kernel follows a pointer stored in the host memory it is given. */
+char kernelSourceCode[]
+    = "typedef struct { global int *data; int count; } node_t;\n"
+      "kernel \n"
+      "void inc(global node_t *node, global int *sum) {\n"
+      "    int v = node->data[get_global_id(0)] + 1;\n"
+      "    node->data[get_global_id(0)] = v;\n"
+      "    atomic_add(sum, v);\n"
+      "    if (get_global_id(0) == 0)\n"
+      "        node->count += 1;\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_device_svm_capabilities caps;
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global_work_size = N;
+  cl_bool fine_grain_system = CL_TRUE;
+  int i, expected_sum = 0;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_SVM_CAPABILITIES,
+                                   sizeof (caps), &caps, NULL));
+  if ((caps & CL_DEVICE_SVM_FINE_GRAIN_SYSTEM) == 0
+      || (caps & CL_DEVICE_SVM_ATOMICS) == 0)
+    {
+      printf ("SKIP: no fine-grained system SVM with atomics\n");
+      return 77;
+    }
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "inc", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  node_t *node = (node_t *)malloc (sizeof (node_t));
+  int *storage = (int *)malloc ((N + 1) * sizeof (int));
+  int *sum = (int *)malloc (sizeof (int));
+  TEST_ASSERT (node != NULL && storage != NULL && sum != NULL);
+  /* not the start of the allocation */
+  node->data = storage + 1;
+  node->count = 0;
+  *sum = 0;
+  for (i = 0; i < N; ++i)
+    node->data[i] = i;
+
+  CHECK_CL_ERROR (clSetKernelArgSVMPointer (kernel, 0, node));
+  CHECK_CL_ERROR (clSetKernelArgSVMPointer (kernel, 1, sum));
+  CHECK_CL_ERROR (clSetKernelExecInfo (kernel,
+                                       CL_KERNEL_EXEC_INFO_SVM_FINE_GRAIN_SYSTEM,
+                                       sizeof (cl_bool), &fine_grain_system));
+
+  /* mapping the system allocations is a no-op */
+  CHECK_CL_ERROR (clEnqueueSVMMap (queue, CL_TRUE, CL_MAP_WRITE, node->data,
+                                   N * sizeof (int), 0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueSVMUnmap (queue, node->data, 0, NULL, NULL));
+
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  CHECK_CL_ERROR (clFinish (queue));
+
+  for (i = 0; i < N; ++i)
+    {
+      if (node->data[i] != i + 1)
+        {
+          printf ("FAIL at %i: %i != %i\n", i, node->data[i], i + 1);
+          return EXIT_FAILURE;
+        }
+      expected_sum += i + 1;
+    }
+  TEST_ASSERT (node->count == 1);
+  TEST_ASSERT (*sum == expected_sum);
+
+  /* SVM memcpy works on system allocations too */
+  CHECK_CL_ERROR (clEnqueueSVMMemcpy (queue, CL_TRUE, storage, sum,
+                                      sizeof (int), 0, NULL, NULL));
+  TEST_ASSERT (storage[0] == expected_sum);
+
+  printf ("OK\n");
+
+  free (sum);
+  free (storage);
+  free (node);
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+/* Tests that the launches of a kernel compute the same results with the
+   first tier work-group functions of POCL_TIERED_COMPILATION as with the
+   fully optimized ones built for the later launches.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 1024
+#define LAUNCHES 8
+
+char kernelSourceCode[]
+    = "kernel void poly(global const float *x, global float *y, int n) {\n"
+      "  size_t i = get_global_id(0);\n"
+      "  float acc = 0.0f;\n"
+      "  for (int j = 0; j < n; ++j)\n"
+      "    acc = acc * x[i] + (float)j;\n"
+      "  y[i] = acc;\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem x_buf, y_buf;
+  cl_float x[N], y[N];
+  const char *kernel_buffer = kernelSourceCode;
+  size_t global_work_size = N;
+  cl_int n = 4;
+  int launch, i, j;
+
+  /* read at the first launch */
+  setenv ("POCL_TIERED_COMPILATION", "2", 1);
+
+  for (i = 0; i < N; ++i)
+    x[i] = (cl_float)(i % 5) * 0.5f;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "poly", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  x_buf = clCreateBuffer (context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          sizeof (x), x, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  y_buf = clCreateBuffer (context, CL_MEM_WRITE_ONLY, sizeof (y), NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &x_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 1, sizeof (cl_mem), &y_buf));
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 2, sizeof (cl_int), &n));
+
+  /* the first two launches run the first tier WG function, the later
+     ones either it or the optimized one, depending on when the
+     background build finishes */
+  for (launch = 0; launch < LAUNCHES; ++launch)
+    {
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                              &global_work_size, NULL, 0,
+                                              NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, y_buf, CL_TRUE, 0,
+                                           sizeof (y), y, 0, NULL, NULL));
+      for (i = 0; i < N; ++i)
+        {
+          cl_float acc = 0.0f;
+          for (j = 0; j < n; ++j)
+            acc = acc * x[i] + (cl_float)j;
+          if (y[i] != acc)
+            {
+              printf ("FAIL at launch %i, %i: %f != %f\n", launch, i, y[i],
+                      acc);
+              return EXIT_FAILURE;
+            }
+        }
+    }
+
+  printf ("OK\n");
+
+  CHECK_CL_ERROR (clReleaseMemObject (x_buf));
+  CHECK_CL_ERROR (clReleaseMemObject (y_buf));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
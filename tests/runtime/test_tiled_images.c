@@ -0,0 +1,193 @@
+/* Tests 2D images stored in tiles on the CPU devices: host writes, fills,
+   maps and reads, and kernel reads with the nearest and linear filters.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* not a multiple of the tile size */
+#define W 37
+#define H 29
+
+char kernelSourceCode[]
+    = "constant sampler_t nearest = CLK_NORMALIZED_COORDS_FALSE\n"
+      "  | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;\n"
+      "constant sampler_t linear = CLK_NORMALIZED_COORDS_FALSE\n"
+      "  | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;\n"
+      "kernel void inc(read_only image2d_t in, write_only image2d_t out) {\n"
+      "  int2 c = (int2)(get_global_id(0), get_global_id(1));\n"
+      "  write_imagef(out, c, read_imagef(in, nearest, c) + 1.0f);\n"
+      "}\n"
+      "kernel void lerp(read_only image2d_t in, global float *out) {\n"
+      "  int x = get_global_id(0), y = get_global_id(1);\n"
+      "  float2 c = (float2)(x + 1.0f, y + 0.5f);\n"
+      "  out[y * get_global_size(0) + x] = read_imagef(in, linear, c).x;\n"
+      "}\n";
+
+static float
+pixel (size_t x, size_t y)
+{
+  return (float)(x + 100 * y);
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel inc, lerp;
+  cl_mem a, b, buf;
+  cl_bool image_support;
+  const cl_image_format format = { CL_R, CL_FLOAT };
+  cl_image_desc desc;
+  float *src, *dst, *mapped;
+  const float fill = -1.0f;
+  const char *kernel_buffer = kernelSourceCode;
+  size_t origin[3] = { 0, 0, 0 };
+  size_t region[3] = { W, H, 1 };
+  size_t fill_origin[3] = { 3, 5, 0 };
+  size_t fill_region[3] = { 11, 9, 1 };
+  size_t global[2] = { W, H };
+  size_t lerp_global[2] = { W - 1, H };
+  size_t row_pitch, x, y;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_IMAGE_SUPPORT,
+                                   sizeof (image_support), &image_support,
+                                   NULL));
+  if (!image_support)
+    {
+      printf ("SKIP: no image support\n");
+      return 77;
+    }
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  inc = clCreateKernel (program, "inc", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+  lerp = clCreateKernel (program, "lerp", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  src = (float *)malloc (W * H * sizeof (float));
+  dst = (float *)malloc (W * H * sizeof (float));
+  TEST_ASSERT (src != NULL && dst != NULL);
+  for (y = 0; y < H; ++y)
+    for (x = 0; x < W; ++x)
+      src[y * W + x] = pixel (x, y);
+
+  memset (&desc, 0, sizeof (desc));
+  desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+  desc.image_width = W;
+  desc.image_height = H;
+  a = clCreateImage (context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateImage");
+  b = clCreateImage (context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateImage");
+  buf = clCreateBuffer (context, CL_MEM_WRITE_ONLY,
+                        (W - 1) * H * sizeof (float), NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+
+  CHECK_CL_ERROR (clEnqueueWriteImage (queue, a, CL_FALSE, origin, region, 0,
+                                       0, src, 0, NULL, NULL));
+
+  /* the linear filter reads pixels of neighbouring tiles */
+  CHECK_CL_ERROR (clSetKernelArg (lerp, 0, sizeof (cl_mem), &a));
+  CHECK_CL_ERROR (clSetKernelArg (lerp, 1, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, lerp, 2, NULL, lerp_global,
+                                          NULL, 0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadBuffer (queue, buf, CL_TRUE, 0,
+                                       (W - 1) * H * sizeof (float), dst, 0,
+                                       NULL, NULL));
+  for (y = 0; y < H; ++y)
+    for (x = 0; x < W - 1; ++x)
+      if (dst[y * (W - 1) + x] != pixel (x, y) + 0.5f)
+        {
+          printf ("FAIL: linear read at %zu,%zu: %f != %f\n", x, y,
+                  dst[y * (W - 1) + x], pixel (x, y) + 0.5f);
+          return EXIT_FAILURE;
+        }
+
+  CHECK_CL_ERROR (clEnqueueFillImage (queue, a, &fill, fill_origin,
+                                      fill_region, 0, NULL, NULL));
+  CHECK_CL_ERROR (clSetKernelArg (inc, 0, sizeof (cl_mem), &a));
+  CHECK_CL_ERROR (clSetKernelArg (inc, 1, sizeof (cl_mem), &b));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, inc, 2, NULL, global, NULL,
+                                          0, NULL, NULL));
+  CHECK_CL_ERROR (clEnqueueReadImage (queue, b, CL_TRUE, origin, region, 0, 0,
+                                      dst, 0, NULL, NULL));
+
+  for (y = 0; y < H; ++y)
+    for (x = 0; x < W; ++x)
+      {
+        if (x >= fill_origin[0] && x < fill_origin[0] + fill_region[0]
+            && y >= fill_origin[1] && y < fill_origin[1] + fill_region[1])
+          src[y * W + x] = fill;
+        src[y * W + x] += 1.0f;
+      }
+  if (memcmp (src, dst, W * H * sizeof (float)) != 0)
+    {
+      printf ("FAIL: image content differs after fill and kernel\n");
+      return EXIT_FAILURE;
+    }
+
+  /* maps show the pixels in rows, whatever the storage */
+  mapped = (float *)clEnqueueMapImage (queue, b, CL_TRUE, CL_MAP_READ, origin,
+                                       region, &row_pitch, NULL, 0, NULL,
+                                       NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clEnqueueMapImage");
+  for (y = 0; y < H; ++y)
+    if (memcmp ((char *)mapped + y * row_pitch, src + y * W,
+                W * sizeof (float))
+        != 0)
+      {
+        printf ("FAIL: mapped row %zu differs\n", y);
+        return EXIT_FAILURE;
+      }
+  CHECK_CL_ERROR (clEnqueueUnmapMemObject (queue, b, mapped, 0, NULL, NULL));
+  CHECK_CL_ERROR (clFinish (queue));
+
+  printf ("OK\n");
+
+  free (src);
+  free (dst);
+  CHECK_CL_ERROR (clReleaseMemObject (a));
+  CHECK_CL_ERROR (clReleaseMemObject (b));
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+  CHECK_CL_ERROR (clReleaseKernel (inc));
+  CHECK_CL_ERROR (clReleaseKernel (lerp));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
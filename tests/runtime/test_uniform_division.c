@@ -0,0 +1,141 @@
+/* Tests the integer divisions and remainders by kernel arguments, which
+   the kernel compiler strength reduces in the work-item loops, with
+   divisors of various magnitudes and signs.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 512
+
+char kernelSourceCode[]
+    = "kernel void divide(global uint *uq, global uint *ur,\n"
+      "                   global int *sq, global int *sr,\n"
+      "                   global ulong *lq, global ulong *lr,\n"
+      "                   uint width, int swidth, int offset) {\n"
+      "  size_t gid = get_global_id(0);\n"
+      "  uint u = (uint)gid * 2654435761u;\n"
+      "  int s = (int)((uint)gid * (uint)offset);\n"
+      "  uq[gid] = u / width;\n"
+      "  ur[gid] = u % width;\n"
+      "  sq[gid] = s / swidth;\n"
+      "  sr[gid] = s % swidth;\n"
+      "  lq[gid] = (gid << 40) / width;\n"
+      "  lr[gid] = (gid << 40) % width;\n"
+      "}\n";
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem bufs[6];
+  cl_uint uq[N], ur[N];
+  cl_int sq[N], sr[N];
+  cl_ulong lq[N], lr[N];
+  const cl_uint widths[] = { 1, 2, 3, 7, 64, 1000, 65537, 0x80000001u,
+                             0xffffffffu };
+  const cl_int swidths[] = { 1, -1, 3, -7, 64, -1000, 65537, -0x7fffffff,
+                             0x7fffffff };
+  const cl_int offset = -1234567;
+  size_t global_work_size = N, local_work_size = 64;
+  const char *kernel_buffer = kernelSourceCode;
+  unsigned i, j;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "divide", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  for (j = 0; j < 6; ++j)
+    {
+      bufs[j] = clCreateBuffer (context, CL_MEM_WRITE_ONLY,
+                                N * (j < 4 ? sizeof (cl_int)
+                                           : sizeof (cl_ulong)),
+                                NULL, &err);
+      CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+      CHECK_CL_ERROR (clSetKernelArg (kernel, j, sizeof (cl_mem), &bufs[j]));
+    }
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 8, sizeof (cl_int), &offset));
+
+  for (i = 0; i < sizeof (widths) / sizeof (widths[0]); ++i)
+    {
+      CHECK_CL_ERROR (
+          clSetKernelArg (kernel, 6, sizeof (cl_uint), &widths[i]));
+      CHECK_CL_ERROR (
+          clSetKernelArg (kernel, 7, sizeof (cl_int), &swidths[i]));
+      CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                              &global_work_size,
+                                              &local_work_size, 0, NULL,
+                                              NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, bufs[0], CL_FALSE, 0,
+                                           sizeof (uq), uq, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, bufs[1], CL_FALSE, 0,
+                                           sizeof (ur), ur, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, bufs[2], CL_FALSE, 0,
+                                           sizeof (sq), sq, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, bufs[3], CL_FALSE, 0,
+                                           sizeof (sr), sr, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, bufs[4], CL_FALSE, 0,
+                                           sizeof (lq), lq, 0, NULL, NULL));
+      CHECK_CL_ERROR (clEnqueueReadBuffer (queue, bufs[5], CL_TRUE, 0,
+                                           sizeof (lr), lr, 0, NULL, NULL));
+
+      for (j = 0; j < N; ++j)
+        {
+          cl_uint u = (cl_uint)j * 2654435761u;
+          cl_int s = (cl_int)((cl_uint)j * (cl_uint)offset);
+          cl_ulong l = (cl_ulong)j << 40;
+          if (uq[j] != u / widths[i] || ur[j] != u % widths[i]
+              || sq[j] != s / swidths[i] || sr[j] != s % swidths[i]
+              || lq[j] != l / widths[i] || lr[j] != l % widths[i])
+            {
+              printf ("FAIL with the divisors %u and %d at %u\n", widths[i],
+                      swidths[i], j);
+              return EXIT_FAILURE;
+            }
+        }
+    }
+
+  printf ("OK\n");
+
+  for (j = 0; j < 6; ++j)
+    CHECK_CL_ERROR (clReleaseMemObject (bufs[j]));
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/* Tests that the CPU devices map buffers without copies, and the
+   CL_MEM_ZERO_COPY_POCL query.
+
+   Copyright (c) 2023 PoCL developers
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to
+   deal in the Software without restriction, including without limitation the
+   rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+   sell copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+   IN THE SOFTWARE.
+ */
+
+#include "poclu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* must be sourced from PoCL */
+#include "include/CL/cl_ext_pocl.h"
+
+#define N 1024
+
+char kernelSourceCode[] = "kernel \n"
+                          "void inc(global int* data) {\n"
+                          "    data[get_global_id(0)] += 1;\n"
+                          "}\n";
+
+/* Runs the kernel on the buffer, maps it and checks that it holds i + 1,
+   returns the mapped pointer in *mapped and the zero-copy query result in
+   *zero_copy. */
+static int
+run_and_map (cl_command_queue queue, cl_kernel kernel, cl_mem buf,
+             int **mapped, cl_bool *zero_copy)
+{
+  cl_int err;
+  size_t global_work_size = N;
+  int i;
+
+  CHECK_CL_ERROR (clSetKernelArg (kernel, 0, sizeof (cl_mem), &buf));
+  CHECK_CL_ERROR (clEnqueueNDRangeKernel (queue, kernel, 1, NULL,
+                                          &global_work_size, NULL, 0, NULL,
+                                          NULL));
+  *mapped = (int *)clEnqueueMapBuffer (queue, buf, CL_TRUE, CL_MAP_READ, 0,
+                                       N * sizeof (cl_int), 0, NULL, NULL,
+                                       &err);
+  CHECK_OPENCL_ERROR_IN ("clEnqueueMapBuffer");
+  for (i = 0; i < N; ++i)
+    if ((*mapped)[i] != i + 1)
+      {
+        printf ("FAIL at %i: %i != %i\n", i, (*mapped)[i], i + 1);
+        return EXIT_FAILURE;
+      }
+  CHECK_CL_ERROR (clGetMemObjectInfo (buf, CL_MEM_ZERO_COPY_POCL,
+                                      sizeof (cl_bool), zero_copy, NULL));
+  CHECK_CL_ERROR (
+      clEnqueueUnmapMemObject (queue, buf, *mapped, 0, NULL, NULL));
+  CHECK_CL_ERROR (clFinish (queue));
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  cl_int err;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program program;
+  cl_kernel kernel;
+  cl_mem buf;
+  cl_device_type type;
+  cl_uint align_bits;
+  cl_bool zero_copy;
+  char *storage;
+  int *host_ptr, *mapped;
+  size_t align;
+  const char *kernel_buffer = kernelSourceCode;
+  int i;
+
+  poclu_get_any_device2 (&context, &device, &queue, &platform);
+
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_TYPE, sizeof (type),
+                                   &type, NULL));
+  if ((type & CL_DEVICE_TYPE_CPU) == 0)
+    {
+      printf ("SKIP: not a CPU device\n");
+      return 77;
+    }
+  CHECK_CL_ERROR (clGetDeviceInfo (device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                                   sizeof (align_bits), &align_bits, NULL));
+  align = align_bits / 8;
+
+  program = clCreateProgramWithSource (
+      context, 1, (const char **)&kernel_buffer, NULL, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateProgramWithSource");
+  CHECK_CL_ERROR (clBuildProgram (program, 0, NULL, NULL, NULL, NULL));
+  kernel = clCreateKernel (program, "inc", &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateKernel");
+
+  storage = (char *)malloc (N * sizeof (cl_int) + 2 * align);
+  TEST_ASSERT (storage != NULL);
+
+  /* An aligned USE_HOST_PTR buffer maps to the host pointer itself. */
+  host_ptr
+      = (int *)(((uintptr_t)storage + align - 1) & ~(uintptr_t)(align - 1));
+  for (i = 0; i < N; ++i)
+    host_ptr[i] = i;
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                        N * sizeof (cl_int), host_ptr, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  TEST_ASSERT (run_and_map (queue, kernel, buf, &mapped, &zero_copy)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (mapped == host_ptr);
+  TEST_ASSERT (zero_copy == CL_TRUE);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+
+  /* A misaligned one still works, through a copy. */
+  host_ptr = (int *)((char *)host_ptr + sizeof (cl_int));
+  for (i = 0; i < N; ++i)
+    host_ptr[i] = i;
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                        N * sizeof (cl_int), host_ptr, &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  TEST_ASSERT (run_and_map (queue, kernel, buf, &mapped, &zero_copy)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (mapped == host_ptr);
+  TEST_ASSERT (zero_copy == CL_FALSE);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+
+  /* Buffers allocated by the runtime are always zero-copy. */
+  buf = clCreateBuffer (context, CL_MEM_READ_WRITE, N * sizeof (cl_int), NULL,
+                        &err);
+  CHECK_OPENCL_ERROR_IN ("clCreateBuffer");
+  for (i = 0; i < N; ++i)
+    host_ptr[i] = i;
+  CHECK_CL_ERROR (clEnqueueWriteBuffer (queue, buf, CL_TRUE, 0,
+                                        N * sizeof (cl_int), host_ptr, 0, NULL,
+                                        NULL));
+  TEST_ASSERT (run_and_map (queue, kernel, buf, &mapped, &zero_copy)
+               == EXIT_SUCCESS);
+  TEST_ASSERT (zero_copy == CL_TRUE);
+  CHECK_CL_ERROR (clReleaseMemObject (buf));
+
+  printf ("OK\n");
+
+  free (storage);
+  CHECK_CL_ERROR (clReleaseKernel (kernel));
+  CHECK_CL_ERROR (clReleaseProgram (program));
+  CHECK_CL_ERROR (clReleaseCommandQueue (queue));
+  CHECK_CL_ERROR (clReleaseContext (context));
+  CHECK_CL_ERROR (clUnloadPlatformCompiler (platform));
+
+  return EXIT_SUCCESS;
+}